@@ -18,17 +18,6 @@
 #include "qemu-queue.h"
 #include "qemu_socket.h"
 
-typedef struct AioHandler AioHandler;
-
-/* The list of registered AIO handlers */
-static QLIST_HEAD(, AioHandler) aio_handlers;
-
-/* This is a simple lock used to protect the aio_handlers list.  Specifically,
- * it's used to ensure that no callbacks are removed while we're walking and
- * dispatching callbacks.
- */
-static int walking_handlers;
-
 struct AioHandler
 {
     int fd;
@@ -40,11 +29,11 @@ struct AioHandler
     QLIST_ENTRY(AioHandler) node;
 };
 
-static AioHandler *find_aio_handler(int fd)
+static AioHandler *find_aio_handler(AioContext *ctx, int fd)
 {
     AioHandler *node;
 
-    QLIST_FOREACH(node, &aio_handlers, node) {
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
         if (node->fd == fd)
             if (!node->deleted)
                 return node;
@@ -53,21 +42,22 @@ static AioHandler *find_aio_handler(int fd)
     return NULL;
 }
 
-int qemu_aio_set_fd_handler(int fd,
-                            IOHandler *io_read,
-                            IOHandler *io_write,
-                            AioFlushHandler *io_flush,
-                            void *opaque)
+void aio_set_fd_handler(AioContext *ctx,
+                        int fd,
+                        IOHandler *io_read,
+                        IOHandler *io_write,
+                        AioFlushHandler *io_flush,
+                        void *opaque)
 {
     AioHandler *node;
 
-    node = find_aio_handler(fd);
+    node = find_aio_handler(ctx, fd);
 
     /* Are we deleting the fd handler? */
     if (!io_read && !io_write) {
         if (node) {
             /* If the lock is held, just mark the node as deleted */
-            if (walking_handlers)
+            if (ctx->walking_handlers)
                 node->deleted = 1;
             else {
                 /* Otherwise, delete it for real.  We can't just mark it as
@@ -83,7 +73,7 @@ int qemu_aio_set_fd_handler(int fd,
             /* Alloc and insert if it's not already there */
             node = g_malloc0(sizeof(AioHandler));
             node->fd = fd;
-            QLIST_INSERT_HEAD(&aio_handlers, node, node);
+            QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
         }
         /* Update handler with latest information */
         node->io_read = io_read;
@@ -92,8 +82,20 @@ int qemu_aio_set_fd_handler(int fd,
         node->opaque = opaque;
     }
 
-    qemu_set_fd_handler2(fd, NULL, io_read, io_write, opaque);
+    /* The main loop polls the handlers of its context as well */
+    if (ctx->is_main) {
+        qemu_set_fd_handler2(fd, NULL, io_read, io_write, opaque);
+    }
+}
 
+int qemu_aio_set_fd_handler(int fd,
+                            IOHandler *io_read,
+                            IOHandler *io_write,
+                            AioFlushHandler *io_flush,
+                            void *opaque)
+{
+    aio_set_fd_handler(qemu_get_aio_context(), fd, io_read, io_write,
+                       io_flush, opaque);
     return 0;
 }
 
@@ -103,9 +105,16 @@ void qemu_aio_flush(void)
 }
 
 bool qemu_aio_wait(void)
+{
+    return aio_poll(qemu_get_aio_context(), true);
+}
+
+bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
     fd_set rdfds, wrfds;
+    struct timeval tv, *tvp;
+    uint32_t timeout;
     int max_fd = -1;
     int ret;
     bool busy;
@@ -115,18 +124,18 @@ bool qemu_aio_wait(void)
      * Do not call select in this case, because it is possible that the caller
      * does not need a complete flush (as is the case for qemu_aio_wait loops).
      */
-    if (qemu_bh_poll()) {
+    if (aio_bh_poll(ctx) | aio_run_timers(ctx)) {
         return true;
     }
 
-    walking_handlers = 1;
+    ctx->walking_handlers = 1;
 
     FD_ZERO(&rdfds);
     FD_ZERO(&wrfds);
 
     /* fill fd sets */
     busy = false;
-    QLIST_FOREACH(node, &aio_handlers, node) {
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
         /* If there aren't pending AIO operations, don't invoke callbacks.
          * Otherwise, if there are no AIO requests, qemu_aio_wait() would
          * wait indefinitely.
@@ -147,23 +156,37 @@ bool qemu_aio_wait(void)
         }
     }
 
-    walking_handlers = 0;
+    ctx->walking_handlers = 0;
+
+    /* An armed timer is something to wait for as well */
+    if (ctx->active_timers) {
+        busy = true;
+    }
 
     /* No AIO operations?  Get us out of here */
     if (!busy) {
         return false;
     }
 
-    /* wait until next event */
-    ret = select(max_fd, &rdfds, &wrfds, NULL, NULL);
+    /* wait until next event, or until the next timer expires */
+    timeout = blocking ? UINT32_MAX : 0;
+    aio_update_timeout(ctx, &timeout);
+    if (timeout == UINT32_MAX) {
+        tvp = NULL;
+    } else {
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        tvp = &tv;
+    }
+    ret = select(max_fd, &rdfds, &wrfds, NULL, tvp);
 
     /* if we have any readable fds, dispatch event */
     if (ret > 0) {
-        walking_handlers = 1;
+        ctx->walking_handlers = 1;
 
         /* we have to walk very carefully in case
-         * qemu_aio_set_fd_handler is called while we're walking */
-        node = QLIST_FIRST(&aio_handlers);
+         * aio_set_fd_handler is called while we're walking */
+        node = QLIST_FIRST(&ctx->aio_handlers);
         while (node) {
             AioHandler *tmp;
 
@@ -187,8 +210,10 @@ bool qemu_aio_wait(void)
             }
         }
 
-        walking_handlers = 0;
+        ctx->walking_handlers = 0;
     }
 
+    aio_run_timers(ctx);
+
     return true;
 }
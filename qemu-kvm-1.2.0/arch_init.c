@@ -28,6 +28,12 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #endif
+#ifdef __linux__
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#endif
+#include <zlib.h>
 #include "config.h"
 #include "monitor.h"
 #include "sysemu.h"
@@ -41,10 +47,21 @@
 #include "net.h"
 #include "gdbstub.h"
 #include "hw/smbios.h"
+#include "hw/xen.h"
 #include "exec-memory.h"
 #include "hw/pcspk.h"
 #include "qemu/page_cache.h"
+#include "qemu/xbzrle.h"
 #include "qmp-commands.h"
+#include "qemu-thread.h"
+#include "bitmap.h"
+#include "cpus.h"
+#include "exec-all.h"
+#include "iov.h"
+#include "qemu_socket.h"
+#include "block.h"
+#include "qemu-coroutine.h"
+#include "qemu-config.h"
 
 #ifdef DEBUG_ARCH_INIT
 #define DPRINTF(fmt, ...) \
@@ -102,33 +119,35 @@ const uint32_t arch_type = QEMU_ARCH;
 /***********************************************************/
 /* ram save/restore */
 
-#define RAM_SAVE_FLAG_FULL     0x01 /* Obsolete, not used anymore */
+/* FULL was obsolete before version 4, flat RAM images reuse the bit */
+#define RAM_SAVE_FLAG_FLAT     0x01
 #define RAM_SAVE_FLAG_COMPRESS 0x02
 #define RAM_SAVE_FLAG_MEM_SIZE 0x04
 #define RAM_SAVE_FLAG_PAGE     0x08
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
+#define RAM_SAVE_FLAG_COMPRESS_PAGE 0x80
+#define RAM_SAVE_FLAG_POSTCOPY 0x100
+#define RAM_SAVE_FLAG_MULTIFD  0x200
 
-#ifdef __ALTIVEC__
-#include <altivec.h>
-#define VECTYPE        vector unsigned char
-#define SPLAT(p)       vec_splat(vec_ld(0, p), 0)
-#define ALL_EQ(v1, v2) vec_all_eq(v1, v2)
-/* altivec.h may redefine the bool macro as vector type.
- * Reset it to POSIX semantics. */
-#undef bool
-#define bool _Bool
-#elif defined __SSE2__
-#include <emmintrin.h>
-#define VECTYPE        __m128i
-#define SPLAT(p)       _mm_set1_epi8(*(p))
-#define ALL_EQ(v1, v2) (_mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2)) == 0xFFFF)
-#else
-#define VECTYPE        unsigned long
-#define SPLAT(p)       (*(p) * (~0UL / 255))
-#define ALL_EQ(v1, v2) ((v1) == (v2))
-#endif
+/*
+ * Flat RAM images, where the file position of any page is known without
+ * parsing the stream.  A RAM_SAVE_FLAG_FLAT record has a layout byte, the
+ * block id and length, and then:
+ *
+ * RAM_FLAT_PACKED (savevm): a bitmap of the pages that are not zero, and
+ * those pages back to back from a RAM_FLAT_ALIGN boundary of the file on,
+ * so that loadvm can leave the pages where they are until the guest needs
+ * them.
+ *
+ * RAM_FLAT_FIXED (migration to a file): the offset of the block's region
+ * in the file, which has each page at its offset in the block.
+ */
+#define RAM_FLAT_PACKED 0
+#define RAM_FLAT_FIXED  1
+
+#define RAM_FLAT_ALIGN (64 * 1024)
 
 
 static struct defconfig_file {
@@ -161,19 +180,13 @@ int qemu_read_default_config_files(bool userconfig)
     return 0;
 }
 
-static int is_dup_page(uint8_t *page)
+/*
+ * Pages filled with another byte than zero are rare enough that they are
+ * not worth a separate scan; the destination still accepts any fill byte.
+ */
+static bool is_zero_page(uint8_t *page)
 {
-    VECTYPE *p = (VECTYPE *)page;
-    VECTYPE val = SPLAT(page);
-    int i;
-
-    for (i = 0; i < TARGET_PAGE_SIZE / sizeof(VECTYPE); i++) {
-        if (!ALL_EQ(val, p[i])) {
-            return 0;
-        }
-    }
-
-    return 1;
+    return buffer_is_zero(page, TARGET_PAGE_SIZE);
 }
 
 /* struct contains XBZRLE cache and a static page
@@ -187,6 +200,8 @@ static struct {
     uint8_t *decoded_buf;
     /* Cache for XBZRLE */
     PageCache *cache;
+    /* size the migration thread resizes the cache to, 0 if none */
+    int64_t resize_to;
 } XBZRLE = {
     .encoded_buf = NULL,
     .current_buf = NULL,
@@ -198,12 +213,26 @@ static struct {
 int64_t xbzrle_cache_resize(int64_t new_size)
 {
     if (XBZRLE.cache != NULL) {
-        return cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE) *
-            TARGET_PAGE_SIZE;
+        /* the cache is used without the iothread lock, leave the resize
+           to the migration thread */
+        XBZRLE.resize_to = new_size;
     }
     return pow2floor(new_size);
 }
 
+static void xbzrle_cache_apply_resize(void)
+{
+    int64_t new_size = XBZRLE.resize_to;
+
+    if (!new_size) {
+        return;
+    }
+    XBZRLE.resize_to = 0;
+    if (cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE) < 0) {
+        DPRINTF("Error resizing cache\n");
+    }
+}
+
 /* accounting for migration statistics */
 typedef struct AccountingInfo {
     uint64_t dup_pages;
@@ -212,7 +241,10 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_bytes;
     uint64_t xbzrle_pages;
     uint64_t xbzrle_cache_miss;
+    uint64_t xbzrle_cache_hit;
+    uint64_t xbzrle_cache_evictions;
     uint64_t xbzrle_overflows;
+    uint64_t skipped_zero_pages;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -242,6 +274,11 @@ uint64_t norm_mig_pages_transferred(void)
     return acct_info.norm_pages;
 }
 
+uint64_t skipped_mig_pages_transferred(void)
+{
+    return acct_info.skipped_zero_pages;
+}
+
 uint64_t xbzrle_mig_bytes_transferred(void)
 {
     return acct_info.xbzrle_bytes;
@@ -257,6 +294,16 @@ uint64_t xbzrle_mig_pages_cache_miss(void)
     return acct_info.xbzrle_cache_miss;
 }
 
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hit;
+}
+
+uint64_t xbzrle_mig_pages_cache_evictions(void)
+{
+    return acct_info.xbzrle_cache_evictions;
+}
+
 uint64_t xbzrle_mig_pages_overflow(void)
 {
     return acct_info.xbzrle_overflows;
@@ -274,23 +321,70 @@ static void save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
 
 }
 
+/*
+ * Pages last sent as zero pages, indexed by ram_addr >> TARGET_PAGE_BITS.
+ * When one of them is dirtied but is still zero, the destination already
+ * has the right content and nothing needs to be sent.
+ */
+static unsigned long *zero_pages;
+static long zero_pages_nbits;
+
+static void ram_zero_page_sent(ram_addr_t current_addr, uint8_t *p)
+{
+    long page = current_addr >> TARGET_PAGE_BITS;
+
+    if (zero_pages && page < zero_pages_nbits && *p == 0) {
+        set_bit(page, zero_pages);
+    }
+    /* the cached copy must match what the destination now has */
+    if (migrate_use_xbzrle() && cache_is_cached(XBZRLE.cache, current_addr)) {
+        memset(get_cached_data(XBZRLE.cache, current_addr), *p,
+               TARGET_PAGE_SIZE);
+    }
+}
+
+/* Returns true if the page is a zero page the destination already has */
+static bool ram_zero_page_known(ram_addr_t current_addr, uint8_t *p)
+{
+    long page = current_addr >> TARGET_PAGE_BITS;
+
+    if (!zero_pages || page >= zero_pages_nbits ||
+        !test_bit(page, zero_pages)) {
+        return false;
+    }
+    if (buffer_is_zero(p, TARGET_PAGE_SIZE)) {
+        return true;
+    }
+    clear_bit(page, zero_pages);
+    return false;
+}
+
 #define ENCODING_FLAG_XBZRLE 0x1
 
-static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
-                            ram_addr_t current_addr, RAMBlock *block,
-                            ram_addr_t offset, int cont, bool last_stage)
+/*
+ * xbzrle_encode_page: XBZRLE-encode a page against its cached copy
+ *
+ * Returns: n: the encoded length, the data is in XBZRLE.encoded_buf
+ *          0: if the page hasn't changed
+ *         -1: if the page has to be sent in full (cache miss or overflow)
+ */
+static int xbzrle_encode_page(uint8_t *current_data, ram_addr_t current_addr,
+                              bool last_stage)
 {
-    int encoded_len = 0, bytes_sent = -1;
+    int encoded_len = 0;
     uint8_t *prev_cached_page;
 
     if (!cache_is_cached(XBZRLE.cache, current_addr)) {
         if (!last_stage) {
             cache_insert(XBZRLE.cache, current_addr,
                          g_memdup(current_data, TARGET_PAGE_SIZE));
+            acct_info.xbzrle_cache_evictions =
+                cache_get_evictions(XBZRLE.cache);
         }
         acct_info.xbzrle_cache_miss++;
         return -1;
     }
+    acct_info.xbzrle_cache_hit++;
 
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
@@ -317,381 +411,3417 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
         memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
     }
 
+    acct_info.xbzrle_pages++;
+    acct_info.xbzrle_bytes += encoded_len + 1 + 2;
+
+    return encoded_len;
+}
+
+static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
+                            ram_addr_t current_addr, RAMBlock *block,
+                            ram_addr_t offset, int cont, bool last_stage)
+{
+    int encoded_len;
+
+    encoded_len = xbzrle_encode_page(current_data, current_addr, last_stage);
+    if (encoded_len <= 0) {
+        return encoded_len;
+    }
+
     /* Send XBZRLE based compressed page */
     save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_XBZRLE);
     qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
     qemu_put_be16(f, encoded_len);
     qemu_put_buffer(f, XBZRLE.encoded_buf, encoded_len);
-    bytes_sent = encoded_len + 1 + 2;
-    acct_info.xbzrle_pages++;
-    acct_info.xbzrle_bytes += bytes_sent;
 
-    return bytes_sent;
+    return encoded_len + 1 + 2;
 }
 
-static RAMBlock *last_block;
-static ram_addr_t last_offset;
-
 /*
- * ram_save_block: Writes a page of memory to the stream f
+ * Multithreaded page compression
  *
- * Returns:  0: if the page hasn't changed
- *          -1: if there are no more dirty pages
- *           n: the amount of bytes written in other case
+ * ram_save_block() queues pages in a ring of slots.  Worker threads pick
+ * pending slots and deflate a private copy of the page, while the
+ * migration thread writes finished slots to the stream strictly in ring
+ * order.  The stream therefore looks as if the pages had been sent inline,
+ * and RAM_SAVE_FLAG_CONTINUE keeps its meaning.  Duplicate and XBZRLE pages
+ * need no work from the pool and enter the ring already finished.
  */
 
-static int ram_save_block(QEMUFile *f, bool last_stage)
-{
-    RAMBlock *block = last_block;
-    ram_addr_t offset = last_offset;
-    int bytes_sent = -1;
-    MemoryRegion *mr;
-    ram_addr_t current_addr;
-
-    if (!block)
-        block = QLIST_FIRST(&ram_list.blocks);
+#define COMPRESS_SLOTS_PER_THREAD 4
+#define COMPRESS_LEVEL 1
 
-    do {
-        mr = block->mr;
-        if (memory_region_get_dirty(mr, offset, TARGET_PAGE_SIZE,
-                                    DIRTY_MEMORY_MIGRATION)) {
-            uint8_t *p;
-            int cont = (block == last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
-
-            memory_region_reset_dirty(mr, offset, TARGET_PAGE_SIZE,
-                                      DIRTY_MEMORY_MIGRATION);
+typedef enum {
+    COMPRESS_SLOT_PENDING,
+    COMPRESS_SLOT_BUSY,
+    COMPRESS_SLOT_DONE,
+} CompressSlotState;
 
-            p = memory_region_get_ram_ptr(mr) + offset;
+typedef struct CompressSlot {
+    RAMBlock *block;
+    ram_addr_t offset;
+    int cont;
+    /* RAM_SAVE_FLAG_* the slot is sent with */
+    int flag;
+    CompressSlotState state;
+    /* copy of the guest page */
+    uint8_t *page;
+    /* deflated or XBZRLE-encoded data */
+    uint8_t *out;
+    unsigned long out_len;
+} CompressSlot;
+
+typedef struct CompressThread {
+    QemuThread thread;
+    uint64_t pages;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    int64_t busy_ns;
+} CompressThread;
 
-            if (is_dup_page(p)) {
-                acct_info.dup_pages++;
-                save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_COMPRESS);
-                qemu_put_byte(f, *p);
-                bytes_sent = 1;
-            } else if (migrate_use_xbzrle()) {
-                current_addr = block->offset + offset;
-                bytes_sent = save_xbzrle_page(f, p, current_addr, block,
-                                              offset, cont, last_stage);
-                if (!last_stage) {
-                    p = get_cached_data(XBZRLE.cache, current_addr);
-                }
-            }
+static struct {
+    QemuMutex lock;
+    /* signalled when a slot becomes pending or the pool is shut down */
+    QemuCond work_cond;
+    /* signalled when a worker finishes a slot */
+    QemuCond done_cond;
+    CompressSlot *slots;
+    int nb_slots;
+    /* oldest slot in use, the next one written to the stream */
+    int head;
+    /* number of slots in use */
+    int count;
+    /* slots after head that workers have already looked at */
+    int picked;
+    bool quit;
+    /* kept after the pool is shut down so query-migrate can report it */
+    CompressThread *threads;
+    int nb_threads;
+    bool active;
+} compress_pool;
+
+static void *compress_thread_fn(void *opaque)
+{
+    CompressThread *t = opaque;
+    CompressSlot *slot;
+    unsigned long out_len;
+    int64_t start;
+    int ret;
 
-            /* either we didn't send yet (we may have had XBZRLE overflow) */
-            if (bytes_sent == -1) {
-                save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
-                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-                bytes_sent = TARGET_PAGE_SIZE;
-                acct_info.norm_pages++;
-            }
+    qemu_mutex_lock(&compress_pool.lock);
+    while (!compress_pool.quit) {
+        slot = NULL;
+        while (compress_pool.picked < compress_pool.count) {
+            int idx = (compress_pool.head + compress_pool.picked++) %
+                      compress_pool.nb_slots;
+            CompressSlot *next = &compress_pool.slots[idx];
 
-            /* if page is unmodified, continue to the next */
-            if (bytes_sent != 0) {
+            if (next->state == COMPRESS_SLOT_PENDING) {
+                slot = next;
                 break;
             }
         }
-
-        offset += TARGET_PAGE_SIZE;
-        if (offset >= block->length) {
-            offset = 0;
-            block = QLIST_NEXT(block, next);
-            if (!block)
-                block = QLIST_FIRST(&ram_list.blocks);
+        if (!slot) {
+            qemu_cond_wait(&compress_pool.work_cond, &compress_pool.lock);
+            continue;
         }
-    } while (block != last_block || offset != last_offset);
-
-    last_block = block;
-    last_offset = offset;
+        slot->state = COMPRESS_SLOT_BUSY;
+        qemu_mutex_unlock(&compress_pool.lock);
+
+        start = get_clock();
+        out_len = compressBound(TARGET_PAGE_SIZE);
+        ret = compress2(slot->out, &out_len, slot->page, TARGET_PAGE_SIZE,
+                        COMPRESS_LEVEL);
+
+        qemu_mutex_lock(&compress_pool.lock);
+        if (ret == Z_OK && out_len < TARGET_PAGE_SIZE) {
+            slot->flag = RAM_SAVE_FLAG_COMPRESS_PAGE;
+            slot->out_len = out_len;
+        } else {
+            slot->flag = RAM_SAVE_FLAG_PAGE;
+            out_len = TARGET_PAGE_SIZE;
+        }
+        t->pages++;
+        t->bytes_in += TARGET_PAGE_SIZE;
+        t->bytes_out += out_len;
+        t->busy_ns += get_clock() - start;
+        slot->state = COMPRESS_SLOT_DONE;
+        qemu_cond_broadcast(&compress_pool.done_cond);
+    }
+    qemu_mutex_unlock(&compress_pool.lock);
 
-    return bytes_sent;
+    return NULL;
 }
 
-static uint64_t bytes_transferred;
-
-static ram_addr_t ram_save_remaining(void)
+static void compress_threads_fini(void)
 {
-    return ram_list.dirty_pages;
-}
+    int i;
 
-uint64_t ram_bytes_remaining(void)
-{
-    return ram_save_remaining() * TARGET_PAGE_SIZE;
-}
+    if (!compress_pool.active) {
+        return;
+    }
 
-uint64_t ram_bytes_transferred(void)
-{
-    return bytes_transferred;
-}
+    qemu_mutex_lock(&compress_pool.lock);
+    compress_pool.quit = true;
+    qemu_cond_broadcast(&compress_pool.work_cond);
+    qemu_mutex_unlock(&compress_pool.lock);
 
-uint64_t ram_bytes_total(void)
-{
-    RAMBlock *block;
-    uint64_t total = 0;
+    for (i = 0; i < compress_pool.nb_threads; i++) {
+        qemu_thread_join(&compress_pool.threads[i].thread);
+    }
 
-    QLIST_FOREACH(block, &ram_list.blocks, next)
-        total += block->length;
+    for (i = 0; i < compress_pool.nb_slots; i++) {
+        g_free(compress_pool.slots[i].page);
+        g_free(compress_pool.slots[i].out);
+    }
+    g_free(compress_pool.slots);
+    compress_pool.slots = NULL;
 
-    return total;
+    qemu_cond_destroy(&compress_pool.done_cond);
+    qemu_cond_destroy(&compress_pool.work_cond);
+    qemu_mutex_destroy(&compress_pool.lock);
+    compress_pool.active = false;
 }
 
-static int block_compar(const void *a, const void *b)
+static void compress_threads_init(int nb_threads)
 {
-    RAMBlock * const *ablock = a;
-    RAMBlock * const *bblock = b;
+    int i;
 
-    return strcmp((*ablock)->idstr, (*bblock)->idstr);
-}
+    compress_threads_fini();
+    g_free(compress_pool.threads);
 
-static void sort_ram_list(void)
-{
-    RAMBlock *block, *nblock, **blocks;
-    int n;
-    n = 0;
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        ++n;
-    }
-    blocks = g_malloc(n * sizeof *blocks);
-    n = 0;
-    QLIST_FOREACH_SAFE(block, &ram_list.blocks, next, nblock) {
-        blocks[n++] = block;
-        QLIST_REMOVE(block, next);
+    compress_pool.nb_threads = nb_threads;
+    compress_pool.nb_slots = nb_threads * COMPRESS_SLOTS_PER_THREAD;
+    compress_pool.slots = g_new0(CompressSlot, compress_pool.nb_slots);
+    for (i = 0; i < compress_pool.nb_slots; i++) {
+        compress_pool.slots[i].page = g_malloc(TARGET_PAGE_SIZE);
+        compress_pool.slots[i].out = g_malloc(compressBound(TARGET_PAGE_SIZE));
     }
-    qsort(blocks, n, sizeof *blocks, block_compar);
-    while (--n >= 0) {
-        QLIST_INSERT_HEAD(&ram_list.blocks, blocks[n], next);
+    compress_pool.head = 0;
+    compress_pool.count = 0;
+    compress_pool.picked = 0;
+    compress_pool.quit = false;
+
+    qemu_mutex_init(&compress_pool.lock);
+    qemu_cond_init(&compress_pool.work_cond);
+    qemu_cond_init(&compress_pool.done_cond);
+
+    compress_pool.threads = g_new0(CompressThread, nb_threads);
+    for (i = 0; i < nb_threads; i++) {
+        qemu_thread_create(&compress_pool.threads[i].thread, compress_thread_fn,
+                           &compress_pool.threads[i], QEMU_THREAD_JOINABLE);
     }
-    g_free(blocks);
+    compress_pool.active = true;
 }
 
-static void migration_end(void)
+/* Wait for the oldest slot to finish and write it to the stream */
+static int compress_write_head(QEMUFile *f)
 {
-    memory_global_dirty_log_stop();
+    CompressSlot *slot = &compress_pool.slots[compress_pool.head];
+    int bytes_sent;
 
-    if (migrate_use_xbzrle()) {
-        cache_fini(XBZRLE.cache);
-        g_free(XBZRLE.cache);
-        g_free(XBZRLE.encoded_buf);
-        g_free(XBZRLE.current_buf);
-        g_free(XBZRLE.decoded_buf);
-        XBZRLE.cache = NULL;
+    qemu_mutex_lock(&compress_pool.lock);
+    while (slot->state != COMPRESS_SLOT_DONE) {
+        qemu_cond_wait(&compress_pool.done_cond, &compress_pool.lock);
     }
+    qemu_mutex_unlock(&compress_pool.lock);
+
+    save_block_hdr(f, slot->block, slot->offset, slot->cont, slot->flag);
+    switch (slot->flag) {
+    case RAM_SAVE_FLAG_COMPRESS:
+        qemu_put_byte(f, slot->page[0]);
+        bytes_sent = 1;
+        break;
+    case RAM_SAVE_FLAG_COMPRESS_PAGE:
+        qemu_put_be32(f, slot->out_len);
+        qemu_put_buffer(f, slot->out, slot->out_len);
+        bytes_sent = slot->out_len + 4;
+        break;
+    case RAM_SAVE_FLAG_XBZRLE:
+        qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
+        qemu_put_be16(f, slot->out_len);
+        qemu_put_buffer(f, slot->out, slot->out_len);
+        bytes_sent = slot->out_len + 1 + 2;
+        break;
+    default:
+        qemu_put_buffer(f, slot->page, TARGET_PAGE_SIZE);
+        bytes_sent = TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+        break;
+    }
+
+    qemu_mutex_lock(&compress_pool.lock);
+    compress_pool.head = (compress_pool.head + 1) % compress_pool.nb_slots;
+    compress_pool.count--;
+    if (compress_pool.picked) {
+        compress_pool.picked--;
+    }
+    qemu_mutex_unlock(&compress_pool.lock);
+
+    return bytes_sent;
 }
 
-static void ram_migration_cancel(void *opaque)
+/* Write all queued pages to the stream, returns the bytes sent */
+static int compress_flush(QEMUFile *f)
 {
-    migration_end();
-}
+    int bytes_sent = 0;
 
-#define MAX_WAIT 50 /* ms, half buffered_file limit */
+    while (compress_pool.count) {
+        bytes_sent += compress_write_head(f);
+    }
+    return bytes_sent;
+}
 
-static int ram_save_setup(QEMUFile *f, void *opaque)
+/*
+ * compress_queue_page: queue a dirty page for compression
+ *
+ * Returns: -1: if the page hasn't changed and nothing was queued
+ *           n: the amount of bytes written to make room in the ring
+ */
+static int compress_queue_page(QEMUFile *f, RAMBlock *block,
+                               ram_addr_t offset, int cont, uint8_t *p,
+                               bool last_stage)
 {
-    ram_addr_t addr;
-    RAMBlock *block;
+    CompressSlot *slot;
+    int bytes_sent = 0;
+    int encoded_len = -1;
+    bool dup;
 
-    bytes_transferred = 0;
-    last_block = NULL;
-    last_offset = 0;
-    sort_ram_list();
+    dup = is_zero_page(p);
+    if (!dup && migrate_use_xbzrle()) {
+        ram_addr_t current_addr = block->offset + offset;
 
-    if (migrate_use_xbzrle()) {
-        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
-                                  TARGET_PAGE_SIZE,
-                                  TARGET_PAGE_SIZE);
-        if (!XBZRLE.cache) {
-            DPRINTF("Error creating cache\n");
+        encoded_len = xbzrle_encode_page(p, current_addr, last_stage);
+        if (encoded_len == 0) {
             return -1;
         }
-        XBZRLE.encoded_buf = g_malloc0(TARGET_PAGE_SIZE);
-        XBZRLE.current_buf = g_malloc(TARGET_PAGE_SIZE);
-        acct_clear();
-    }
-
-    /* Make sure all dirty bits are set */
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
-            if (!memory_region_get_dirty(block->mr, addr, TARGET_PAGE_SIZE,
-                                         DIRTY_MEMORY_MIGRATION)) {
-                memory_region_set_dirty(block->mr, addr, TARGET_PAGE_SIZE);
-            }
+        if (encoded_len < 0 && !last_stage) {
+            p = get_cached_data(XBZRLE.cache, current_addr);
         }
     }
 
-    memory_global_dirty_log_start();
-
-    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+    if (compress_pool.count == compress_pool.nb_slots) {
+        bytes_sent = compress_write_head(f);
+    }
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        qemu_put_byte(f, strlen(block->idstr));
-        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
-        qemu_put_be64(f, block->length);
+    slot = &compress_pool.slots[(compress_pool.head + compress_pool.count) %
+                           compress_pool.nb_slots];
+    slot->block = block;
+    slot->offset = offset;
+    slot->cont = cont;
+    if (dup) {
+        acct_info.dup_pages++;
+        ram_zero_page_sent(block->offset + offset, p);
+        slot->flag = RAM_SAVE_FLAG_COMPRESS;
+        slot->page[0] = *p;
+        slot->state = COMPRESS_SLOT_DONE;
+    } else if (encoded_len > 0) {
+        slot->flag = RAM_SAVE_FLAG_XBZRLE;
+        memcpy(slot->out, XBZRLE.encoded_buf, encoded_len);
+        slot->out_len = encoded_len;
+        slot->state = COMPRESS_SLOT_DONE;
+    } else {
+        memcpy(slot->page, p, TARGET_PAGE_SIZE);
+        slot->state = COMPRESS_SLOT_PENDING;
     }
 
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    qemu_mutex_lock(&compress_pool.lock);
+    compress_pool.count++;
+    if (slot->state == COMPRESS_SLOT_PENDING) {
+        qemu_cond_signal(&compress_pool.work_cond);
+    }
+    qemu_mutex_unlock(&compress_pool.lock);
 
-    return 0;
+    return bytes_sent;
 }
 
-static int ram_save_iterate(QEMUFile *f, void *opaque)
+CompressThreadStatsList *compress_mig_thread_stats(void)
 {
-    uint64_t bytes_transferred_last;
-    double bwidth = 0;
-    int ret;
+    CompressThreadStatsList *head = NULL;
+    CompressThreadStatsList *entry = NULL;
     int i;
-    uint64_t expected_time;
-
-    bytes_transferred_last = bytes_transferred;
-    bwidth = qemu_get_clock_ns(rt_clock);
-
-    i = 0;
-    while ((ret = qemu_file_rate_limit(f)) == 0) {
-        int bytes_sent;
 
-        bytes_sent = ram_save_block(f, false);
-        /* no more blocks to sent */
-        if (bytes_sent < 0) {
-            break;
-        }
-        bytes_transferred += bytes_sent;
-        acct_info.iterations++;
-        /* we want to check in the 1st loop, just in case it was the 1st time
-           and we had to sync the dirty bitmap.
-           qemu_get_clock_ns() is a bit expensive, so we only check each some
-           iterations
-        */
-        if ((i & 63) == 0) {
-            uint64_t t1 = (qemu_get_clock_ns(rt_clock) - bwidth) / 1000000;
-            if (t1 > MAX_WAIT) {
-                DPRINTF("big wait: " PRIu64 " milliseconds, %d iterations\n",
-                        t1, i);
-                break;
-            }
+    if (compress_pool.active) {
+        qemu_mutex_lock(&compress_pool.lock);
+    }
+    for (i = 0; i < compress_pool.nb_threads && compress_pool.threads; i++) {
+        CompressThread *t = &compress_pool.threads[i];
+
+        if (head == NULL) {
+            head = g_malloc0(sizeof(*entry));
+            entry = head;
+        } else {
+            entry->next = g_malloc0(sizeof(*entry));
+            entry = entry->next;
         }
-        i++;
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->id = i;
+        entry->value->pages = t->pages;
+        entry->value->bytes_in = t->bytes_in;
+        entry->value->bytes_out = t->bytes_out;
+        entry->value->busy_time = t->busy_ns / 1000000;
+    }
+    if (compress_pool.active) {
+        qemu_mutex_unlock(&compress_pool.lock);
     }
 
-    if (ret < 0) {
+    return head;
+}
+
+/*
+ * Multifd
+ *
+ * Pages sent in full from guest memory can go over extra TCP connections
+ * instead of the migration stream.  ram_save_block() gathers them in
+ * packets of up to MULTIFD_PAGES_PER_PACKET pages of one block and hands
+ * each packet to an idle channel, whose thread sends it straight from
+ * guest memory.  On the destination, a thread per channel receives the
+ * pages straight into guest memory.
+ *
+ * A page is sent at most once per RAM section, but a later section can
+ * send it again, over another channel or in the migration stream.  So
+ * each section that used the channels ends with a sync packet on every
+ * channel and a RAM_SAVE_FLAG_MULTIFD sync in the migration stream: the
+ * destination does not read past the latter before all channels got to
+ * the former.
+ */
+
+#define MULTIFD_MAGIC 0x51454d46 /* "QEMF" */
+#define MULTIFD_PAGES_PER_PACKET 64
+
+/* RAM_SAVE_FLAG_MULTIFD commands */
+#define MULTIFD_CMD_START 1 /* followed by the number of channels */
+#define MULTIFD_CMD_SYNC  2
+#define MULTIFD_CMD_END   3
+
+enum {
+    MULTIFD_PACKET_PAGES,
+    MULTIFD_PACKET_SYNC,
+    MULTIFD_PACKET_END,
+};
+
+/* all fields are big endian, the page data follows */
+typedef struct QEMU_PACKED MultiFDPacket {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t nb_pages;
+    char idstr[256];
+    uint64_t offsets[MULTIFD_PAGES_PER_PACKET];
+} MultiFDPacket;
+
+typedef enum {
+    MULTIFD_CHANNEL_IDLE,
+    /* ram_save_block() is adding pages to the packet */
+    MULTIFD_CHANNEL_FILLING,
+    /* the thread owns the packet until it is sent */
+    MULTIFD_CHANNEL_SENDING,
+} MultiFDChannelState;
+
+typedef struct MultiFDSendChannel {
+    QemuThread thread;
+    int fd;
+    MultiFDChannelState state;
+    int type;
+    RAMBlock *block;
+    int nb_pages;
+    MultiFDPacket packet;
+    /* the packet, then its pages */
+    struct iovec iov[MULTIFD_PAGES_PER_PACKET + 1];
+} MultiFDSendChannel;
+
+static struct {
+    QemuMutex lock;
+    /* signalled when a packet is ready to send or the channels quit */
+    QemuCond work_cond;
+    /* signalled when a channel becomes idle */
+    QemuCond idle_cond;
+    MultiFDSendChannel *channels;
+    int nb_channels;
+    /* the channel whose packet is filling, if any */
+    MultiFDSendChannel *current;
+    /* where the search for an idle channel starts */
+    int next;
+    /* pages were queued since the last sync */
+    bool dirty;
+    bool error;
+    bool quit;
+    bool active;
+} multifd_send;
+
+/* Sends or receives all of @bytes, a single iov_send_recv() may stop short */
+static int multifd_io_all(int fd, struct iovec *iov, unsigned iov_cnt,
+                          size_t bytes, bool do_send)
+{
+    size_t done = 0;
+
+    while (done < bytes) {
+        ssize_t ret = iov_send_recv(fd, iov, iov_cnt, done, bytes - done,
+                                    do_send);
+
+        if (ret <= 0) {
+            return -1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendChannel *c = opaque;
+    bool failed;
+    int type;
+
+    failed = tcp_finish_outgoing_channel(c->fd) < 0;
+
+    qemu_mutex_lock(&multifd_send.lock);
+    while (true) {
+        size_t bytes;
+
+        if (failed) {
+            multifd_send.error = true;
+        }
+        while (c->state != MULTIFD_CHANNEL_SENDING && !multifd_send.quit) {
+            qemu_cond_wait(&multifd_send.work_cond, &multifd_send.lock);
+        }
+        if (c->state != MULTIFD_CHANNEL_SENDING) {
+            break;
+        }
+        type = c->type;
+        failed = multifd_send.error;
+        qemu_mutex_unlock(&multifd_send.lock);
+
+        /* after an error the packets are dropped, the migration fails */
+        bytes = sizeof(c->packet) + c->nb_pages * TARGET_PAGE_SIZE;
+        if (!failed) {
+            failed = multifd_io_all(c->fd, c->iov, c->nb_pages + 1, bytes,
+                                    true) < 0;
+        }
+
+        qemu_mutex_lock(&multifd_send.lock);
+        c->state = MULTIFD_CHANNEL_IDLE;
+        qemu_cond_broadcast(&multifd_send.idle_cond);
+        if (type == MULTIFD_PACKET_END) {
+            break;
+        }
+    }
+    if (failed) {
+        multifd_send.error = true;
+    }
+    qemu_mutex_unlock(&multifd_send.lock);
+
+    return NULL;
+}
+
+/* Called with multifd_send.lock held, returns NULL on errors */
+static MultiFDSendChannel *multifd_get_idle_channel(void)
+{
+    int i;
+
+    while (!multifd_send.error) {
+        for (i = 0; i < multifd_send.nb_channels; i++) {
+            int idx = (multifd_send.next + i) % multifd_send.nb_channels;
+            MultiFDSendChannel *c = &multifd_send.channels[idx];
+
+            if (c->state == MULTIFD_CHANNEL_IDLE) {
+                multifd_send.next = (idx + 1) % multifd_send.nb_channels;
+                return c;
+            }
+        }
+        qemu_cond_wait(&multifd_send.idle_cond, &multifd_send.lock);
+    }
+    return NULL;
+}
+
+/* Hands the packet of @c to its thread, called with multifd_send.lock held */
+static void multifd_post(MultiFDSendChannel *c, int type)
+{
+    c->packet.magic = cpu_to_be32(MULTIFD_MAGIC);
+    c->packet.type = cpu_to_be32(type);
+    c->packet.nb_pages = cpu_to_be32(c->nb_pages);
+    c->type = type;
+    c->state = MULTIFD_CHANNEL_SENDING;
+    qemu_cond_broadcast(&multifd_send.work_cond);
+}
+
+/* Sends a packet of @type without pages on every channel and waits for
+   all of them to be sent.  Called with multifd_send.lock held. */
+static int multifd_post_all(int type)
+{
+    int i;
+
+    if (multifd_send.current) {
+        multifd_post(multifd_send.current, MULTIFD_PACKET_PAGES);
+        multifd_send.current = NULL;
+    }
+    for (i = 0; i < multifd_send.nb_channels; i++) {
+        MultiFDSendChannel *c = &multifd_send.channels[i];
+
+        while (c->state != MULTIFD_CHANNEL_IDLE && !multifd_send.error) {
+            qemu_cond_wait(&multifd_send.idle_cond, &multifd_send.lock);
+        }
+        if (multifd_send.error) {
+            return -EIO;
+        }
+        c->nb_pages = 0;
+        multifd_post(c, type);
+    }
+    for (i = 0; i < multifd_send.nb_channels; i++) {
+        while (multifd_send.channels[i].state != MULTIFD_CHANNEL_IDLE &&
+               !multifd_send.error) {
+            qemu_cond_wait(&multifd_send.idle_cond, &multifd_send.lock);
+        }
+    }
+    return multifd_send.error ? -EIO : 0;
+}
+
+static int multifd_send_start(QEMUFile *f, int nb_channels)
+{
+    Error *err = NULL;
+    int i;
+
+    multifd_send.channels = g_new0(MultiFDSendChannel, nb_channels);
+    for (i = 0; i < nb_channels; i++) {
+        MultiFDSendChannel *c = &multifd_send.channels[i];
+
+        c->fd = tcp_connect_outgoing_channel(&err);
+        if (error_is_set(&err)) {
+            DPRINTF("multifd channel %d: %s\n", i, error_get_pretty(err));
+            error_free(err);
+            while (i--) {
+                close(multifd_send.channels[i].fd);
+            }
+            g_free(multifd_send.channels);
+            multifd_send.channels = NULL;
+            return -1;
+        }
+        c->iov[0].iov_base = &c->packet;
+        c->iov[0].iov_len = sizeof(c->packet);
+    }
+    multifd_send.nb_channels = nb_channels;
+    multifd_send.current = NULL;
+    multifd_send.next = 0;
+    multifd_send.dirty = false;
+    multifd_send.error = false;
+    multifd_send.quit = false;
+
+    qemu_mutex_init(&multifd_send.lock);
+    qemu_cond_init(&multifd_send.work_cond);
+    qemu_cond_init(&multifd_send.idle_cond);
+
+    for (i = 0; i < nb_channels; i++) {
+        qemu_thread_create(&multifd_send.channels[i].thread,
+                           multifd_send_thread, &multifd_send.channels[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    multifd_send.active = true;
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD);
+    qemu_put_byte(f, MULTIFD_CMD_START);
+    qemu_put_be32(f, nb_channels);
+    /* the channels block until the destination got this */
+    qemu_fflush(f);
+
+    return 0;
+}
+
+/*
+ * Ends the RAM section's use of the channels, see above.  When it returns
+ * the channels are done with guest memory, so the ramlist lock can go.
+ */
+static void multifd_send_sync(QEMUFile *f)
+{
+    int ret;
+
+    if (!multifd_send.dirty) {
+        return;
+    }
+
+    qemu_mutex_lock(&multifd_send.lock);
+    ret = multifd_post_all(MULTIFD_PACKET_SYNC);
+    multifd_send.dirty = false;
+    qemu_mutex_unlock(&multifd_send.lock);
+
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return;
+    }
+    qemu_update_position(f, multifd_send.nb_channels * sizeof(MultiFDPacket));
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD);
+    qemu_put_byte(f, MULTIFD_CMD_SYNC);
+}
+
+/*
+ * Stops the channels.  Once the migration is complete, the channels end
+ * after the packets in flight, otherwise they are cut short.
+ */
+static void multifd_send_fini(QEMUFile *f, bool complete)
+{
+    int i;
+
+    if (!multifd_send.active) {
+        return;
+    }
+
+    if (complete) {
+        multifd_send_sync(f);
+    }
+    qemu_mutex_lock(&multifd_send.lock);
+    if (complete && multifd_post_all(MULTIFD_PACKET_END) == 0) {
+        qemu_update_position(f, multifd_send.nb_channels *
+                                sizeof(MultiFDPacket));
+        qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD);
+        qemu_put_byte(f, MULTIFD_CMD_END);
+    } else {
+        if (complete) {
+            qemu_file_set_error(f, -EIO);
+        }
+        for (i = 0; i < multifd_send.nb_channels; i++) {
+            shutdown(multifd_send.channels[i].fd, SHUT_RDWR);
+        }
+    }
+    multifd_send.quit = true;
+    qemu_cond_broadcast(&multifd_send.work_cond);
+    qemu_mutex_unlock(&multifd_send.lock);
+
+    for (i = 0; i < multifd_send.nb_channels; i++) {
+        qemu_thread_join(&multifd_send.channels[i].thread);
+        close(multifd_send.channels[i].fd);
+    }
+    g_free(multifd_send.channels);
+    multifd_send.channels = NULL;
+
+    qemu_cond_destroy(&multifd_send.idle_cond);
+    qemu_cond_destroy(&multifd_send.work_cond);
+    qemu_mutex_destroy(&multifd_send.lock);
+    multifd_send.active = false;
+}
+
+/*
+ * multifd_send_page: queue a page for the channels
+ *
+ * The page is read when its packet is sent, so it must be guest memory.
+ * Errors are reported through f.
+ *
+ * Returns: the amount of bytes the page adds to the migration
+ */
+static int multifd_send_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
+{
+    MultiFDSendChannel *c;
+    int bytes_sent = TARGET_PAGE_SIZE;
+
+    qemu_mutex_lock(&multifd_send.lock);
+    c = multifd_send.current;
+    if (c && (c->block != block || c->nb_pages == MULTIFD_PAGES_PER_PACKET)) {
+        multifd_post(c, MULTIFD_PACKET_PAGES);
+        c = NULL;
+    }
+    if (!c) {
+        c = multifd_get_idle_channel();
+        if (!c) {
+            qemu_mutex_unlock(&multifd_send.lock);
+            qemu_file_set_error(f, -EIO);
+            return bytes_sent;
+        }
+        c->state = MULTIFD_CHANNEL_FILLING;
+        c->block = block;
+        c->nb_pages = 0;
+        pstrcpy(c->packet.idstr, sizeof(c->packet.idstr), block->idstr);
+        multifd_send.current = c;
+        bytes_sent += sizeof(MultiFDPacket);
+    }
+    multifd_send.dirty = true;
+    qemu_mutex_unlock(&multifd_send.lock);
+
+    c->packet.offsets[c->nb_pages] = cpu_to_be64(offset);
+    c->iov[c->nb_pages + 1].iov_base = block->host + offset;
+    c->iov[c->nb_pages + 1].iov_len = TARGET_PAGE_SIZE;
+    c->nb_pages++;
+
+    qemu_update_position(f, bytes_sent);
+    return bytes_sent;
+}
+
+typedef struct MultiFDRecvChannel {
+    QemuThread thread;
+    int fd;
+    /* sync packets received */
+    uint64_t syncs;
+} MultiFDRecvChannel;
+
+static struct {
+    QemuMutex lock;
+    /* signalled when a channel gets a sync packet or fails */
+    QemuCond sync_cond;
+    MultiFDRecvChannel *channels;
+    int nb_channels;
+    /* syncs read from the migration stream */
+    uint64_t syncs;
+    bool error;
+    bool active;
+} multifd_recv;
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvChannel *c = opaque;
+    MultiFDPacket packet;
+    struct iovec iov[MULTIFD_PAGES_PER_PACKET];
+    RAMBlock *block = NULL;
+
+    while (true) {
+        struct iovec hdr = { .iov_base = &packet, .iov_len = sizeof(packet) };
+        uint32_t nb_pages;
+        int i;
+
+        if (multifd_io_all(c->fd, &hdr, 1, sizeof(packet), false) < 0 ||
+            be32_to_cpu(packet.magic) != MULTIFD_MAGIC) {
+            fprintf(stderr, "multifd: bad or truncated packet\n");
+            goto error;
+        }
+
+        switch (be32_to_cpu(packet.type)) {
+        case MULTIFD_PACKET_PAGES:
+            break;
+        case MULTIFD_PACKET_SYNC:
+            qemu_mutex_lock(&multifd_recv.lock);
+            c->syncs++;
+            qemu_cond_broadcast(&multifd_recv.sync_cond);
+            qemu_mutex_unlock(&multifd_recv.lock);
+            continue;
+        case MULTIFD_PACKET_END:
+            return NULL;
+        default:
+            fprintf(stderr, "multifd: unknown packet type\n");
+            goto error;
+        }
+
+        /* the block list does not change while the migration is loaded */
+        packet.idstr[sizeof(packet.idstr) - 1] = 0;
+        if (!block || strcmp(block->idstr, packet.idstr)) {
+            QLIST_FOREACH(block, &ram_list.blocks, next) {
+                if (!strcmp(block->idstr, packet.idstr)) {
+                    break;
+                }
+            }
+            if (!block) {
+                fprintf(stderr, "multifd: can't find block %s!\n",
+                        packet.idstr);
+                goto error;
+            }
+        }
+
+        nb_pages = be32_to_cpu(packet.nb_pages);
+        if (nb_pages > MULTIFD_PAGES_PER_PACKET) {
+            fprintf(stderr, "multifd: bad page count %u\n", nb_pages);
+            goto error;
+        }
+        for (i = 0; i < nb_pages; i++) {
+            uint64_t offset = be64_to_cpu(packet.offsets[i]);
+
+            if (offset >= block->length || (offset & ~TARGET_PAGE_MASK)) {
+                fprintf(stderr, "multifd: bad offset in block %s\n",
+                        block->idstr);
+                goto error;
+            }
+            iov[i].iov_base = block->host + offset;
+            iov[i].iov_len = TARGET_PAGE_SIZE;
+        }
+        if (multifd_io_all(c->fd, iov, nb_pages, nb_pages * TARGET_PAGE_SIZE,
+                           false) < 0) {
+            fprintf(stderr, "multifd: truncated packet\n");
+            goto error;
+        }
+    }
+
+error:
+    qemu_mutex_lock(&multifd_recv.lock);
+    multifd_recv.error = true;
+    qemu_cond_broadcast(&multifd_recv.sync_cond);
+    qemu_mutex_unlock(&multifd_recv.lock);
+    return NULL;
+}
+
+static int multifd_recv_start(int nb_channels)
+{
+    int i;
+
+    if (multifd_recv.active || nb_channels < 1 || nb_channels > 255) {
+        fprintf(stderr, "multifd: bad channel count %d\n", nb_channels);
+        return -EINVAL;
+    }
+
+    /* the channels connected before the migration stream got here */
+    multifd_recv.channels = g_new0(MultiFDRecvChannel, nb_channels);
+    for (i = 0; i < nb_channels; i++) {
+        multifd_recv.channels[i].fd = tcp_accept_incoming_channel();
+        if (multifd_recv.channels[i].fd == -1) {
+            fprintf(stderr, "multifd: could not accept channel\n");
+            while (i--) {
+                close(multifd_recv.channels[i].fd);
+            }
+            g_free(multifd_recv.channels);
+            multifd_recv.channels = NULL;
+            return -EIO;
+        }
+    }
+    multifd_recv.nb_channels = nb_channels;
+    multifd_recv.syncs = 0;
+    multifd_recv.error = false;
+
+    qemu_mutex_init(&multifd_recv.lock);
+    qemu_cond_init(&multifd_recv.sync_cond);
+    for (i = 0; i < nb_channels; i++) {
+        qemu_thread_create(&multifd_recv.channels[i].thread,
+                           multifd_recv_thread, &multifd_recv.channels[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    multifd_recv.active = true;
+
+    return 0;
+}
+
+/* Waits for every channel to receive the pages sent before the sync */
+static int multifd_recv_sync(void)
+{
+    int i, ret;
+
+    if (!multifd_recv.active) {
+        return -EINVAL;
+    }
+
+    qemu_mutex_lock(&multifd_recv.lock);
+    multifd_recv.syncs++;
+    for (i = 0; i < multifd_recv.nb_channels; i++) {
+        while (multifd_recv.channels[i].syncs < multifd_recv.syncs &&
+               !multifd_recv.error) {
+            qemu_cond_wait(&multifd_recv.sync_cond, &multifd_recv.lock);
+        }
+    }
+    ret = multifd_recv.error ? -EIO : 0;
+    qemu_mutex_unlock(&multifd_recv.lock);
+
+    return ret;
+}
+
+/* The source ended every channel after its last sync */
+static int multifd_recv_fini(void)
+{
+    int i;
+
+    if (!multifd_recv.active) {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < multifd_recv.nb_channels; i++) {
+        qemu_thread_join(&multifd_recv.channels[i].thread);
+        close(multifd_recv.channels[i].fd);
+    }
+    g_free(multifd_recv.channels);
+    multifd_recv.channels = NULL;
+
+    qemu_cond_destroy(&multifd_recv.sync_cond);
+    qemu_mutex_destroy(&multifd_recv.lock);
+    multifd_recv.active = false;
+
+    return multifd_recv.error ? -EIO : 0;
+}
+
+static int load_multifd(QEMUFile *f)
+{
+    switch (qemu_get_byte(f)) {
+    case MULTIFD_CMD_START:
+        return multifd_recv_start(qemu_get_be32(f));
+    case MULTIFD_CMD_SYNC:
+        return multifd_recv_sync();
+    case MULTIFD_CMD_END:
+        return multifd_recv_fini();
+    default:
+        fprintf(stderr, "multifd: unknown command\n");
+        return -EINVAL;
+    }
+}
+
+/* channels the RAM of the next migration is sent over, 0 without multifd */
+static int ram_multifd_channels;
+/* the next migration writes RAM pages over RDMA */
+static bool ram_rdma;
+/* savevm writes RAM as a flat image in the complete stage */
+static bool ram_save_flat;
+/* the next migration writes RAM pages to this file, -1 if none */
+static int ram_save_file_fd = -1;
+
+static RAMBlock *last_block;
+static ram_addr_t last_offset;
+/* block of the last page header in the migration stream */
+static RAMBlock *last_sent_block;
+/* set until the first pass over RAM wraps around */
+static bool ram_bulk_stage;
+/* the remaining dirty pages are sent after the destination has started */
+static bool ram_postcopy_active;
+/* dirty pages taken off the dirty bitmap so far */
+static uint64_t ram_pages_scanned;
+/* ram_list.version last_block was found in */
+static uint32_t last_version;
+
+/*
+ * Pages still to send are in the migration_bitmap of their block, one bit
+ * per page.  Only the migration thread uses them, and it only takes the
+ * iothread lock to move the global dirty log into them with
+ * migration_bitmap_sync().  Blocks added during the migration have none,
+ * the destination would not know them anyway.
+ */
+static uint64_t migration_dirty_pages;
+
+/*
+ * Dirty frequency
+ *
+ * Each block has a heat byte per chunk of RAM_HEAT_CHUNK_PAGES pages.  A
+ * sync that finds the chunk dirty raises its heat by one, one that finds
+ * it clean halves it, so the heat counts the syncs in a row the guest
+ * wrote to the chunk, with some memory.  With the defer-hot-pages
+ * capability the hottest chunks are not sent until the guest has stopped,
+ * they would only be dirtied again meanwhile.  How much can be deferred is
+ * bounded by half of what fits in the downtime, and the live iterations
+ * keep converging on the rest.
+ */
+#define RAM_HEAT_CHUNK_BITS     6
+#define RAM_HEAT_CHUNK_PAGES    (1 << RAM_HEAT_CHUNK_BITS)
+#define RAM_HEAT_MAX            15
+#define RAM_HEAT_MASK           0x0f
+#define RAM_HEAT_DIRTIED        0x40
+#define RAM_HEAT_DEFER          0x80
+/* chunks colder than that are not worth deferring */
+#define RAM_HEAT_DEFER_MIN      3
+#define RAM_HEAT_HISTORY        8
+
+typedef struct RamHeatRecord {
+    uint64_t iteration;
+    /* pages in chunks of each heat */
+    uint64_t pages[RAM_HEAT_MAX + 1];
+    uint64_t deferred_pages;
+    int threshold;
+} RamHeatRecord;
+
+static struct {
+    bool active;
+    /* pages the hottest chunks may add up to, set by ram_save_pending() */
+    uint64_t budget;
+    /* dirty pages held back in deferred chunks */
+    uint64_t deferred_pages;
+    uint64_t iterations;
+    /* the last RAM_HEAT_HISTORY syncs, protected by the iothread lock */
+    RamHeatRecord history[RAM_HEAT_HISTORY];
+} ram_heat;
+
+static inline bool ram_heat_deferred(RAMBlock *block, ram_addr_t offset)
+{
+    return block->migration_heat &&
+           (block->migration_heat[offset >> (TARGET_PAGE_BITS +
+                                             RAM_HEAT_CHUNK_BITS)] &
+            RAM_HEAT_DEFER);
+}
+
+static inline bool migration_bitmap_test_dirty(RAMBlock *block,
+                                               ram_addr_t offset)
+{
+    return block->migration_bitmap &&
+           test_bit(offset >> TARGET_PAGE_BITS, block->migration_bitmap);
+}
+
+static inline bool migration_bitmap_test_and_reset_dirty(RAMBlock *block,
+                                                         ram_addr_t offset)
+{
+    if (!block->migration_bitmap ||
+        !test_and_clear_bit(offset >> TARGET_PAGE_BITS,
+                            block->migration_bitmap)) {
+        return false;
+    }
+    migration_dirty_pages--;
+    return true;
+}
+
+/* Returns the offset of the first dirty page from @start, or the length */
+static inline ram_addr_t migration_bitmap_find_dirty(RAMBlock *block,
+                                                     ram_addr_t start)
+{
+    unsigned long size = block->length >> TARGET_PAGE_BITS;
+
+    if (!block->migration_bitmap) {
+        return block->length;
+    }
+    return (ram_addr_t)find_next_bit(block->migration_bitmap, size,
+                                     start >> TARGET_PAGE_BITS)
+           << TARGET_PAGE_BITS;
+}
+
+/*
+ * Moves what the dirty log has for @block into its migration bitmap.  The
+ * log has a byte per page, most of it is skipped a long at a time.
+ * Returns whether any page was dirty.
+ */
+static bool migration_bitmap_sync_block(RAMBlock *block)
+{
+    const uint8_t flag = 1 << DIRTY_MEMORY_MIGRATION;
+    const unsigned long mask = (unsigned long)0x0101010101010101ULL * flag;
+    uint8_t *log = ram_list.phys_dirty + (block->offset >> TARGET_PAGE_BITS);
+    unsigned long pages = block->length >> TARGET_PAGE_BITS;
+    unsigned long i = 0;
+    bool dirty = false;
+
+    while (i < pages) {
+        if (!((uintptr_t)(log + i) % sizeof(long)) &&
+            i + sizeof(long) <= pages &&
+            !(*(unsigned long *)(log + i) & mask)) {
+            i += sizeof(long);
+            continue;
+        }
+        if (log[i] & flag) {
+            dirty = true;
+            if (block->migration_heat) {
+                block->migration_heat[i >> RAM_HEAT_CHUNK_BITS] |=
+                    RAM_HEAT_DIRTIED;
+            }
+            if (!test_and_set_bit(i, block->migration_bitmap)) {
+                migration_dirty_pages++;
+            }
+        }
+        i++;
+    }
+    return dirty;
+}
+
+/*
+ * Ages the heat of every chunk after a sync, then marks the hottest ones
+ * for deferral: all chunks from the lowest heat at which they still fit in
+ * the budget together.
+ */
+static void ram_heat_update(void)
+{
+    RamHeatRecord *rec;
+    RAMBlock *block;
+    uint64_t total = 0;
+    int level;
+
+    rec = &ram_heat.history[ram_heat.iterations % RAM_HEAT_HISTORY];
+    memset(rec, 0, sizeof(*rec));
+    rec->iteration = ++ram_heat.iterations;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        unsigned long pages = block->length >> TARGET_PAGE_BITS;
+        unsigned long i;
+
+        if (!block->migration_heat) {
+            continue;
+        }
+        for (i = 0; i << RAM_HEAT_CHUNK_BITS < pages; i++) {
+            uint8_t heat = block->migration_heat[i];
+
+            if (heat & RAM_HEAT_DIRTIED) {
+                heat = MIN((heat & RAM_HEAT_MASK) + 1, RAM_HEAT_MAX);
+            } else {
+                heat = (heat & RAM_HEAT_MASK) >> 1;
+            }
+            block->migration_heat[i] = heat;
+            rec->pages[heat] += MIN(RAM_HEAT_CHUNK_PAGES,
+                                    pages - (i << RAM_HEAT_CHUNK_BITS));
+        }
+    }
+
+    rec->threshold = RAM_HEAT_MAX + 1;
+    for (level = RAM_HEAT_MAX; level >= RAM_HEAT_DEFER_MIN; level--) {
+        total += rec->pages[level];
+        if (total > ram_heat.budget) {
+            break;
+        }
+        if (total) {
+            rec->threshold = level;
+        }
+    }
+
+    ram_heat.deferred_pages = 0;
+    if (rec->threshold <= RAM_HEAT_MAX) {
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            unsigned long pages = block->length >> TARGET_PAGE_BITS;
+            unsigned long i, j;
+
+            if (!block->migration_heat) {
+                continue;
+            }
+            for (i = 0; i << RAM_HEAT_CHUNK_BITS < pages; i++) {
+                if (block->migration_heat[i] < rec->threshold) {
+                    continue;
+                }
+                block->migration_heat[i] |= RAM_HEAT_DEFER;
+                for (j = i << RAM_HEAT_CHUNK_BITS;
+                     j < MIN((i + 1) << RAM_HEAT_CHUNK_BITS, pages); j++) {
+                    if (test_bit(j, block->migration_bitmap)) {
+                        ram_heat.deferred_pages++;
+                    }
+                }
+            }
+        }
+    }
+    rec->deferred_pages = ram_heat.deferred_pages;
+}
+
+/* Called with the iothread lock held */
+static void migration_bitmap_sync(void)
+{
+    RAMBlock *block;
+
+    memory_global_sync_dirty_bitmap(get_system_memory());
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        /* the dirty log only changes under the iothread lock, so the
+           whole block can be reset at once */
+        if (block->migration_bitmap && migration_bitmap_sync_block(block)) {
+            memory_region_reset_dirty(block->mr, 0, block->length,
+                                      DIRTY_MEMORY_MIGRATION);
+        }
+    }
+
+    if (ram_heat.active) {
+        ram_heat_update();
+    }
+}
+
+DirtyHeatStatsList *ram_dirty_heat_stats(void)
+{
+    DirtyHeatStatsList *head = NULL;
+    DirtyHeatStatsList *entry = NULL;
+    uint64_t i;
+    int level;
+
+    i = ram_heat.iterations > RAM_HEAT_HISTORY ?
+        ram_heat.iterations - RAM_HEAT_HISTORY : 0;
+    for (; i < ram_heat.iterations; i++) {
+        RamHeatRecord *rec = &ram_heat.history[i % RAM_HEAT_HISTORY];
+        DirtyHeatLevelList *levels = NULL;
+
+        if (head == NULL) {
+            head = g_malloc0(sizeof(*entry));
+            entry = head;
+        } else {
+            entry->next = g_malloc0(sizeof(*entry));
+            entry = entry->next;
+        }
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->iteration = rec->iteration;
+        entry->value->deferred_pages = rec->deferred_pages;
+        entry->value->threshold = rec->threshold;
+        /* built backwards, so that it starts with the coldest */
+        for (level = RAM_HEAT_MAX; level >= 0; level--) {
+            DirtyHeatLevelList *l;
+
+            if (!rec->pages[level]) {
+                continue;
+            }
+            l = g_malloc0(sizeof(*l));
+            l->value = g_malloc0(sizeof(*l->value));
+            l->value->heat = level;
+            l->value->pages = rec->pages[level];
+            l->next = levels;
+            levels = l;
+        }
+        entry->value->histogram = levels;
+    }
+
+    return head;
+}
+
+/*
+ * The guest reported [addr, addr + length) as free: its content does not
+ * matter, so a migration does not need to send it until it is written
+ * again.  Called from the balloon's worker thread.
+ */
+void ram_free_page_hint(ram_addr_t addr, ram_addr_t length)
+{
+    RAMBlock *block;
+    ram_addr_t offset, end;
+
+    qemu_mutex_lock_ramlist();
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (addr >= block->offset && addr < block->offset + block->length) {
+            break;
+        }
+    }
+    if (block && block->migration_bitmap) {
+        end = MIN(addr + length, block->offset + block->length);
+        for (offset = addr - block->offset; offset < end - block->offset;
+             offset += TARGET_PAGE_SIZE) {
+            migration_bitmap_test_and_reset_dirty(block, offset);
+        }
+    }
+    qemu_mutex_unlock_ramlist();
+}
+
+/*
+ * blocks were added or removed since the last pass, last_block may be gone
+ * and the pages of a removed block are not to send anymore
+ */
+static void ram_save_check_version(void)
+{
+    RAMBlock *block;
+
+    if (ram_list.version != last_version) {
+        last_block = NULL;
+        last_offset = 0;
+        last_sent_block = NULL;
+        last_version = ram_list.version;
+
+        migration_dirty_pages = 0;
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            unsigned long pages = block->length >> TARGET_PAGE_BITS;
+            unsigned long i;
+
+            if (!block->migration_bitmap) {
+                continue;
+            }
+            for (i = 0; i < BITS_TO_LONGS(pages); i++) {
+                migration_dirty_pages +=
+                    hweight_long(block->migration_bitmap[i]);
+            }
+        }
+    }
+}
+
+/*
+ * Writes the page straight into the destination's memory when migrating
+ * over RDMA; the migration stream then carries nothing about it.  Returns
+ * whether it did.
+ */
+static bool ram_save_rdma_page(QEMUFile *f, RAMBlock *block,
+                               ram_addr_t offset)
+{
+#ifdef CONFIG_RDMA
+    int ret;
+
+    if (!ram_rdma || ram_postcopy_active) {
+        return false;
+    }
+    ret = rdma_save_page(block->idstr, offset, TARGET_PAGE_SIZE);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+    if (ret <= 0) {
+        return false;
+    }
+    /* counts for the rate limit and the bandwidth */
+    qemu_update_position(f, TARGET_PAGE_SIZE);
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*
+ * Migration to a file.  Each block has a region at a fixed offset of the
+ * file, after the part reserved for the migration stream, and its pages
+ * are written there with pwrite() by RAM_FILE_THREADS threads.  A page
+ * that is sent again overwrites its old copy, so the file does not grow,
+ * and the first pass leaves zero pages as holes.  The destination can map
+ * the regions or read them in parallel, see ram_load_file_region().
+ */
+#define RAM_FILE_ALIGN      (2 * 1024 * 1024)
+#define RAM_FILE_THREADS    4
+#define RAM_FILE_QUEUE      64
+/* pages written by one pwrite() at most */
+#define RAM_FILE_BATCH      (1024 * 1024)
+
+typedef struct RamFileWrite {
+    uint8_t *host;
+    int64_t pos;
+    size_t len;
+} RamFileWrite;
+
+static struct {
+    int fd;
+    /* file offset of each block's region, indexed like ram_list */
+    RAMBlock **blocks;
+    int64_t *offsets;
+    int nb_blocks;
+    /* block of the last lookup */
+    int last;
+    QemuMutex lock;
+    /* signalled when a write is queued or the threads are shut down */
+    QemuCond work_cond;
+    /* signalled when a write is taken off the queue or completes */
+    QemuCond done_cond;
+    RamFileWrite queue[RAM_FILE_QUEUE];
+    int head;
+    int count;
+    /* writes the threads are doing */
+    int busy;
+    /* consecutive pages that are not queued yet */
+    RamFileWrite batch;
+    int error;
+    bool quit;
+    QemuThread threads[RAM_FILE_THREADS];
+    bool active;
+} ram_file;
+
+static int ram_file_pwrite(RamFileWrite *w)
+{
+    size_t done = 0;
+
+    while (done < w->len) {
+        ssize_t ret = pwrite(ram_file.fd, w->host + done, w->len - done,
+                             w->pos + done);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+static void *ram_file_thread_fn(void *opaque)
+{
+    RamFileWrite w;
+    int ret;
+
+    qemu_mutex_lock(&ram_file.lock);
+    for (;;) {
+        if (!ram_file.count) {
+            if (ram_file.quit) {
+                break;
+            }
+            qemu_cond_wait(&ram_file.work_cond, &ram_file.lock);
+            continue;
+        }
+        w = ram_file.queue[ram_file.head];
+        ram_file.head = (ram_file.head + 1) % RAM_FILE_QUEUE;
+        ram_file.count--;
+        ram_file.busy++;
+        qemu_mutex_unlock(&ram_file.lock);
+
+        ret = ram_file_pwrite(&w);
+
+        qemu_mutex_lock(&ram_file.lock);
+        if (ret < 0 && !ram_file.error) {
+            ram_file.error = ret;
+        }
+        ram_file.busy--;
+        qemu_cond_broadcast(&ram_file.done_cond);
+    }
+    qemu_mutex_unlock(&ram_file.lock);
+
+    return NULL;
+}
+
+/* Queue the current batch, waiting for room if needed */
+static void ram_file_push_batch(void)
+{
+    if (!ram_file.batch.len) {
+        return;
+    }
+
+    qemu_mutex_lock(&ram_file.lock);
+    while (ram_file.count == RAM_FILE_QUEUE) {
+        qemu_cond_wait(&ram_file.done_cond, &ram_file.lock);
+    }
+    ram_file.queue[(ram_file.head + ram_file.count) % RAM_FILE_QUEUE] =
+        ram_file.batch;
+    ram_file.count++;
+    qemu_cond_signal(&ram_file.work_cond);
+    qemu_mutex_unlock(&ram_file.lock);
+
+    ram_file.batch.len = 0;
+}
+
+/* Wait until everything queued is in the file, returns the first error */
+static int ram_file_drain(void)
+{
+    int ret;
+
+    ram_file_push_batch();
+
+    qemu_mutex_lock(&ram_file.lock);
+    while (ram_file.count || ram_file.busy) {
+        qemu_cond_wait(&ram_file.done_cond, &ram_file.lock);
+    }
+    ret = ram_file.error;
+    qemu_mutex_unlock(&ram_file.lock);
+
+    return ret;
+}
+
+static void ram_file_fini(void)
+{
+    int i;
+
+    if (!ram_file.active) {
+        return;
+    }
+
+    ram_file_drain();
+    qemu_mutex_lock(&ram_file.lock);
+    ram_file.quit = true;
+    qemu_cond_broadcast(&ram_file.work_cond);
+    qemu_mutex_unlock(&ram_file.lock);
+
+    for (i = 0; i < RAM_FILE_THREADS; i++) {
+        qemu_thread_join(&ram_file.threads[i]);
+    }
+
+    g_free(ram_file.blocks);
+    g_free(ram_file.offsets);
+    ram_file.blocks = NULL;
+    ram_file.offsets = NULL;
+    qemu_cond_destroy(&ram_file.done_cond);
+    qemu_cond_destroy(&ram_file.work_cond);
+    qemu_mutex_destroy(&ram_file.lock);
+    ram_file.active = false;
+}
+
+/* Lay the blocks out after the stream and start the writer threads */
+static int ram_file_init(int fd)
+{
+    RAMBlock *block;
+    int64_t pos = MIGRATION_FILE_STREAM_SIZE;
+    int i = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        i++;
+    }
+    ram_file.nb_blocks = i;
+    ram_file.blocks = g_new(RAMBlock *, i);
+    ram_file.offsets = g_new(int64_t, i);
+
+    i = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        ram_file.blocks[i] = block;
+        ram_file.offsets[i] = pos;
+        pos = QEMU_ALIGN_UP(pos + block->length, RAM_FILE_ALIGN);
+        i++;
+    }
+    /* the regions read as zero until written */
+    if (ftruncate(fd, pos) < 0) {
+        g_free(ram_file.blocks);
+        g_free(ram_file.offsets);
+        return -errno;
+    }
+
+    ram_file.fd = fd;
+    ram_file.last = 0;
+    ram_file.head = 0;
+    ram_file.count = 0;
+    ram_file.busy = 0;
+    ram_file.batch.len = 0;
+    ram_file.error = 0;
+    ram_file.quit = false;
+    qemu_mutex_init(&ram_file.lock);
+    qemu_cond_init(&ram_file.work_cond);
+    qemu_cond_init(&ram_file.done_cond);
+    for (i = 0; i < RAM_FILE_THREADS; i++) {
+        qemu_thread_create(&ram_file.threads[i], ram_file_thread_fn, NULL,
+                           QEMU_THREAD_JOINABLE);
+    }
+    ram_file.active = true;
+    return 0;
+}
+
+static int64_t ram_file_region(RAMBlock *block)
+{
+    int i;
+
+    if (ram_file.blocks[ram_file.last] == block) {
+        return ram_file.offsets[ram_file.last];
+    }
+    for (i = 0; i < ram_file.nb_blocks; i++) {
+        if (ram_file.blocks[i] == block) {
+            ram_file.last = i;
+            return ram_file.offsets[i];
+        }
+    }
+    return -1;
+}
+
+/*
+ * Writes the page to its place in the file; the migration stream carries
+ * nothing about it.  Returns the bytes written, or 0 for a zero page the
+ * file already has.
+ */
+static int ram_save_file_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                              uint8_t *p)
+{
+    RamFileWrite *batch = &ram_file.batch;
+    int64_t pos = ram_file_region(block);
+
+    if (pos < 0) {
+        /* hotplugged after the file was laid out */
+        qemu_file_set_error(f, -EINVAL);
+        return 0;
+    }
+    pos += offset;
+
+    if (buffer_is_zero(p, TARGET_PAGE_SIZE)) {
+        ram_zero_page_sent(block->offset + offset, p);
+        acct_info.dup_pages++;
+        if (ram_bulk_stage) {
+            return 0;
+        }
+    } else {
+        acct_info.norm_pages++;
+    }
+
+    if (batch->len && (batch->host + batch->len != p ||
+                       batch->pos + batch->len != pos ||
+                       batch->len >= RAM_FILE_BATCH)) {
+        ram_file_push_batch();
+    }
+    if (!batch->len) {
+        batch->host = p;
+        batch->pos = pos;
+    }
+    batch->len += TARGET_PAGE_SIZE;
+
+    /* counts for the rate limit and the bandwidth */
+    qemu_update_position(f, TARGET_PAGE_SIZE);
+    return TARGET_PAGE_SIZE;
+}
+
+/*
+ * ram_save_block: Writes a page of memory to the stream f
+ *
+ * Returns:  0: if the page hasn't changed
+ *          -1: if there are no more dirty pages
+ *           n: the amount of bytes written in other case
+ */
+
+static int ram_save_block(QEMUFile *f, bool last_stage)
+{
+    RAMBlock *block = last_block;
+    ram_addr_t offset = last_offset;
+    bool complete_round = false;
+    int bytes_sent = -1;
+    bool queued;
+    bool multifd;
+    bool rdma;
+    bool file;
+    ram_addr_t current_addr;
+
+    if (!block) {
+        block = last_block = QLIST_FIRST(&ram_list.blocks);
+        offset = last_offset = 0;
+    }
+
+    for (;;) {
+        offset = migration_bitmap_find_dirty(block, offset);
+        if (complete_round && block == last_block && offset >= last_offset) {
+            break;
+        }
+        if (offset >= block->length) {
+            offset = 0;
+            block = QLIST_NEXT(block, next);
+            if (!block) {
+                block = QLIST_FIRST(&ram_list.blocks);
+                complete_round = true;
+                ram_bulk_stage = false;
+            }
+            continue;
+        }
+        /* held back until the guest stops, skip the rest of the chunk */
+        if (!last_stage && !ram_postcopy_active &&
+            ram_heat_deferred(block, offset)) {
+            offset |= (RAM_HEAT_CHUNK_PAGES << TARGET_PAGE_BITS) - 1;
+            offset++;
+            continue;
+        }
+
+        if (migration_bitmap_test_and_reset_dirty(block, offset)) {
+            uint8_t *p;
+            int cont = (block == last_sent_block && !ram_postcopy_active) ?
+                RAM_SAVE_FLAG_CONTINUE : 0;
+
+            ram_pages_scanned++;
+            bytes_sent = -1;
+            queued = multifd = rdma = file = false;
+
+            /* not memory_region_get_ram_ptr(), it updates the MRU
+               block, which is protected by the iothread lock */
+            p = block->host + offset;
+            current_addr = block->offset + offset;
+
+            if (!ram_postcopy_active && ram_zero_page_known(current_addr, p)) {
+                acct_info.skipped_zero_pages++;
+                bytes_sent = 0;
+            } else if (ram_file.active) {
+                bytes_sent = ram_save_file_page(f, block, offset, p);
+                file = true;
+            } else if (compress_pool.active) {
+                bytes_sent = compress_queue_page(f, block, offset, cont, p,
+                                                 last_stage);
+                queued = bytes_sent >= 0;
+                if (!queued) {
+                    bytes_sent = 0;
+                }
+            } else if (is_zero_page(p)) {
+                acct_info.dup_pages++;
+                save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_COMPRESS);
+                qemu_put_byte(f, *p);
+                ram_zero_page_sent(current_addr, p);
+                bytes_sent = 1;
+            } else if (migrate_use_xbzrle() && !ram_postcopy_active) {
+                bytes_sent = save_xbzrle_page(f, p, current_addr, block,
+                                              offset, cont, last_stage);
+                if (!last_stage) {
+                    p = get_cached_data(XBZRLE.cache, current_addr);
+                }
+            }
+
+            /* either we didn't send yet (we may have had XBZRLE overflow) */
+            if (bytes_sent == -1) {
+                /* not the XBZRLE cache copy, the channels read the page
+                   when they send it */
+                multifd = multifd_send.active && !ram_postcopy_active &&
+                          p == block->host + offset;
+                if (multifd) {
+                    bytes_sent = multifd_send_page(f, block, offset);
+                } else if (p == block->host + offset &&
+                           ram_save_rdma_page(f, block, offset)) {
+                    rdma = true;
+                    bytes_sent = TARGET_PAGE_SIZE;
+                } else {
+                    save_block_hdr(f, block, offset, cont,
+                                   RAM_SAVE_FLAG_PAGE);
+                    qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+                    bytes_sent = TARGET_PAGE_SIZE;
+                }
+                acct_info.norm_pages++;
+            }
+
+            if ((bytes_sent > 0 && !multifd && !rdma && !file) || queued) {
+                last_sent_block = block;
+            }
+
+            /* if page is unmodified, continue to the next */
+            if (bytes_sent != 0 || queued) {
+                break;
+            }
+        }
+
+        offset += TARGET_PAGE_SIZE;
+    }
+
+    last_block = block;
+    last_offset = offset;
+
+    return bytes_sent;
+}
+
+static uint64_t bytes_transferred;
+
+static ram_addr_t ram_save_remaining(void)
+{
+    return migration_dirty_pages;
+}
+
+uint64_t ram_bytes_remaining(void)
+{
+    return ram_save_remaining() * TARGET_PAGE_SIZE;
+}
+
+uint64_t ram_bytes_transferred(void)
+{
+    return bytes_transferred;
+}
+
+uint64_t ram_bytes_total(void)
+{
+    RAMBlock *block;
+    uint64_t total = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next)
+        total += block->length;
+
+    return total;
+}
+
+static int block_compar(const void *a, const void *b)
+{
+    RAMBlock * const *ablock = a;
+    RAMBlock * const *bblock = b;
+
+    return strcmp((*ablock)->idstr, (*bblock)->idstr);
+}
+
+static void sort_ram_list(void)
+{
+    RAMBlock *block, *nblock, **blocks;
+    int n;
+    n = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        ++n;
+    }
+    blocks = g_malloc(n * sizeof *blocks);
+    n = 0;
+    QLIST_FOREACH_SAFE(block, &ram_list.blocks, next, nblock) {
+        blocks[n++] = block;
+        QLIST_REMOVE(block, next);
+    }
+    qsort(blocks, n, sizeof *blocks, block_compar);
+    while (--n >= 0) {
+        QLIST_INSERT_HEAD(&ram_list.blocks, blocks[n], next);
+    }
+    ram_list.version++;
+    g_free(blocks);
+}
+
+static void migration_end(void)
+{
+    RAMBlock *block;
+
+    memory_global_dirty_log_stop();
+    cpu_throttle_stop();
+
+    compress_threads_fini();
+    multifd_send_fini(NULL, false);
+    ram_file_fini();
+
+    g_free(zero_pages);
+    zero_pages = NULL;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        g_free(block->migration_bitmap);
+        block->migration_bitmap = NULL;
+        g_free(block->migration_heat);
+        block->migration_heat = NULL;
+    }
+    ram_heat.active = false;
+    ram_heat.deferred_pages = 0;
+
+    if (migrate_use_xbzrle()) {
+        cache_fini(XBZRLE.cache);
+        g_free(XBZRLE.cache);
+        g_free(XBZRLE.encoded_buf);
+        g_free(XBZRLE.current_buf);
+        g_free(XBZRLE.decoded_buf);
+        XBZRLE.cache = NULL;
+    }
+}
+
+static void ram_migration_cancel(void *opaque)
+{
+    migration_end();
+}
+
+static void ram_migration_set_params(const MigrationParams *params,
+                                     void *opaque)
+{
+    ram_multifd_channels = params->multifd_channels;
+    ram_rdma = params->rdma;
+    ram_save_flat = params->flat;
+    ram_save_file_fd = params->file ? params->file_fd : -1;
+}
+
+/*
+ * Auto-converge: once a second, compare the amount of memory the guest
+ * dirtied with the amount that was sent.  If the guest dirtied more than
+ * half of it for CONVERGE_HIGH_PERIODS periods in a row, throttle its
+ * vCPUs, and keep throttling harder while that goes on.
+ */
+#define CONVERGE_PERIOD_MS      1000
+#define CONVERGE_HIGH_PERIODS   2
+#define CONVERGE_THROTTLE_INITIAL   20
+#define CONVERGE_THROTTLE_INCREMENT 10
+
+static struct {
+    int64_t start_time;
+    uint64_t bytes_transferred;
+    uint64_t pages_scanned;
+    uint64_t pages_remaining;
+    int high_periods;
+} converge;
+
+static void converge_reset(void)
+{
+    converge.start_time = qemu_get_clock_ms(rt_clock);
+    converge.bytes_transferred = bytes_transferred;
+    converge.pages_scanned = ram_pages_scanned;
+    converge.pages_remaining = ram_save_remaining();
+    converge.high_periods = 0;
+}
+
+static void check_converge(void)
+{
+    int64_t now = qemu_get_clock_ms(rt_clock);
+    uint64_t dirtied, sent;
+
+    if (!migrate_auto_converge() || ram_bulk_stage ||
+        now < converge.start_time + CONVERGE_PERIOD_MS) {
+        return;
+    }
+
+    migration_bitmap_sync();
+
+    /* every page scanned this period left the set of remaining pages */
+    dirtied = (ram_save_remaining() + ram_pages_scanned -
+               converge.pages_scanned - converge.pages_remaining) *
+              TARGET_PAGE_SIZE;
+    sent = bytes_transferred - converge.bytes_transferred;
+    DPRINTF("converge: dirtied %" PRIu64 " sent %" PRIu64 "\n", dirtied, sent);
+
+    if (dirtied > sent / 2) {
+        converge.high_periods++;
+    } else {
+        converge.high_periods = 0;
+    }
+    if (converge.high_periods >= CONVERGE_HIGH_PERIODS) {
+        if (cpu_throttle_active()) {
+            cpu_throttle_set(cpu_throttle_get_percentage() +
+                             CONVERGE_THROTTLE_INCREMENT);
+        } else {
+            cpu_throttle_set(CONVERGE_THROTTLE_INITIAL);
+        }
+        converge.high_periods = 0;
+    }
+
+    converge.start_time = now;
+    converge.bytes_transferred = bytes_transferred;
+    converge.pages_scanned = ram_pages_scanned;
+    converge.pages_remaining = ram_save_remaining();
+}
+
+#define MAX_WAIT 50 /* ms, half buffered_file limit */
+
+static int ram_save_setup(QEMUFile *f, void *opaque)
+{
+    RAMBlock *block;
+    int i;
+
+    bytes_transferred = 0;
+    last_block = NULL;
+    last_offset = 0;
+    last_sent_block = NULL;
+    ram_bulk_stage = true;
+    ram_postcopy_active = false;
+    qemu_mutex_lock_ramlist();
+    sort_ram_list();
+    last_version = ram_list.version;
+    qemu_mutex_unlock_ramlist();
+
+    zero_pages_nbits = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        zero_pages_nbits = MAX(zero_pages_nbits,
+                               (block->offset + block->length) >>
+                               TARGET_PAGE_BITS);
+    }
+    g_free(zero_pages);
+    zero_pages = bitmap_new(zero_pages_nbits);
+
+    /* Make sure all dirty bits are set */
+    migration_dirty_pages = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        int pages = block->length >> TARGET_PAGE_BITS;
+
+        g_free(block->migration_bitmap);
+        block->migration_bitmap = bitmap_new(pages);
+        bitmap_set(block->migration_bitmap, 0, pages);
+        migration_dirty_pages += pages;
+    }
+
+    if (migrate_use_xbzrle()) {
+        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
+                                  TARGET_PAGE_SIZE,
+                                  TARGET_PAGE_SIZE);
+        if (!XBZRLE.cache) {
+            DPRINTF("Error creating cache\n");
+            return -1;
+        }
+        XBZRLE.encoded_buf = g_malloc0(TARGET_PAGE_SIZE);
+        XBZRLE.current_buf = g_malloc(TARGET_PAGE_SIZE);
+        acct_clear();
+    }
+
+    if (migrate_use_compress() && ram_save_file_fd < 0) {
+        compress_threads_init(migrate_compress_threads());
+    }
+
+    memory_global_dirty_log_start();
+    /* everything is in the bitmap already, this only clears the log */
+    ram_heat.active = false;
+    migration_bitmap_sync();
+    converge_reset();
+
+    ram_heat.budget = 0;
+    ram_heat.deferred_pages = 0;
+    ram_heat.iterations = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        g_free(block->migration_heat);
+        block->migration_heat =
+            g_malloc0(DIV_ROUND_UP(block->length >> TARGET_PAGE_BITS,
+                                   RAM_HEAT_CHUNK_PAGES));
+    }
+    ram_heat.active = true;
+
+    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, block->length);
+    }
+
+    if (ram_save_file_fd >= 0) {
+        int ret = ram_file_init(ram_save_file_fd);
+
+        if (ret < 0) {
+            DPRINTF("Error laying out the migration file\n");
+            return ret;
+        }
+        for (i = 0; i < ram_file.nb_blocks; i++) {
+            block = ram_file.blocks[i];
+            qemu_put_be64(f, RAM_SAVE_FLAG_FLAT);
+            qemu_put_byte(f, RAM_FLAT_FIXED);
+            qemu_put_byte(f, strlen(block->idstr));
+            qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+            qemu_put_be64(f, block->length);
+            qemu_put_be64(f, ram_file.offsets[i]);
+        }
+    }
+
+    /* compressed pages are sent in the migration stream */
+    if (ram_multifd_channels && !compress_pool.active &&
+        multifd_send_start(f, ram_multifd_channels) < 0) {
+        DPRINTF("Error connecting the multifd channels\n");
+        return -1;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return 0;
+}
+
+/*
+ * Called from the migration thread without the iothread lock: it only
+ * sends what migration_bitmap_sync() put in the migration bitmap.  The
+ * ramlist lock keeps the blocks in place meanwhile.
+ */
+static int ram_save_iterate(QEMUFile *f, void *opaque)
+{
+    uint64_t bytes_transferred_last;
+    double bwidth = 0;
+    int ret;
+    int i;
+    uint64_t expected_time;
+
+    /* the guest is stopped, the whole of RAM goes out in one go */
+    if (ram_save_flat) {
+        return 1;
+    }
+
+    qemu_mutex_lock_ramlist();
+
+    ram_save_check_version();
+    if (migrate_use_xbzrle()) {
+        xbzrle_cache_apply_resize();
+    }
+
+    bytes_transferred_last = bytes_transferred;
+    bwidth = qemu_get_clock_ns(rt_clock);
+
+    i = 0;
+    while ((ret = qemu_file_rate_limit(f)) == 0) {
+        int bytes_sent;
+
+        bytes_sent = ram_save_block(f, false);
+        /* no more blocks to sent */
+        if (bytes_sent < 0) {
+            break;
+        }
+        bytes_transferred += bytes_sent;
+        acct_info.iterations++;
+        /* we want to check in the 1st loop, just in case it was the 1st time
+           and we had to sync the dirty bitmap.
+           qemu_get_clock_ns() is a bit expensive, so we only check each some
+           iterations
+        */
+        if ((i & 63) == 0) {
+            uint64_t t1 = (qemu_get_clock_ns(rt_clock) - bwidth) / 1000000;
+            if (t1 > MAX_WAIT) {
+                DPRINTF("big wait: " PRIu64 " milliseconds, %d iterations\n",
+                        t1, i);
+                break;
+            }
+        }
+        i++;
+    }
+
+    if (ret >= 0 && compress_pool.active) {
+        bytes_transferred += compress_flush(f);
+    }
+    if (multifd_send.active) {
+        multifd_send_sync(f);
+    }
+    /* the threads read the pages, which the ramlist lock keeps in place */
+    if (ram_file.active) {
+        int err = ram_file_drain();
+        if (err < 0) {
+            qemu_file_set_error(f, err);
+        }
+    }
+
+    qemu_mutex_unlock_ramlist();
+
+    if (ret < 0) {
         return ret;
     }
 
-    bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
-    bwidth = (bytes_transferred - bytes_transferred_last) / bwidth;
+    bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
+    bwidth = (bytes_transferred - bytes_transferred_last) / bwidth;
+
+    /* if we haven't transferred anything this round, force expected_time to a
+     * a very high value, but without crashing */
+    if (bwidth == 0) {
+        bwidth = 0.000001;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    /* A live migration decides when to stop with ram_save_pending(), this
+     * is for the savevm command, which stops the guest and never syncs. */
+    expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
+
+    DPRINTF("ram_save_live: expected(" PRIu64 ") <= max(" PRIu64 ")?\n",
+            expected_time, migrate_max_downtime());
+
+    return expected_time <= migrate_max_downtime();
+}
+
+/* Called from the migration thread with the iothread lock held */
+static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
+{
+    uint64_t remaining_size;
+    uint64_t deferred;
+
+    ram_heat.budget = migrate_defer_hot_pages() ?
+                      max_size / 2 / TARGET_PAGE_SIZE : 0;
+    check_converge();
+
+    remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    /* the balloon may have freed deferred pages since */
+    deferred = MIN(ram_heat.deferred_pages, ram_save_remaining());
+    /* a sync moves deferred pages back when nothing else is left */
+    if (remaining_size <= max_size || deferred == ram_save_remaining()) {
+        migration_bitmap_sync();
+        remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    }
+    return remaining_size;
+}
+
+/*
+ * Postcopy, source side
+ *
+ * Instead of the remaining dirty pages, the RAM section end carries a
+ * bitmap of them.  After the device state the destination starts, and
+ * ram_postcopy_iterate() streams the pages listed in the bitmap while
+ * ram_postcopy_request_page() serves the ones the destination faults on.
+ * Each page is sent once: sending it clears its migration dirty bit, and
+ * the stopped source does not dirty memory anymore.
+ */
+
+bool ram_postcopy_ready(void)
+{
+    return !ram_bulk_stage;
+}
+
+void ram_postcopy_begin(void)
+{
+    ram_postcopy_active = true;
+}
+
+static void ram_save_postcopy_bitmap(QEMUFile *f)
+{
+    RAMBlock *block;
+    ram_addr_t addr;
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY);
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        uint64_t word = 0;
+        int bit = 0;
+
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, block->length);
+
+        for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
+            if (migration_bitmap_test_dirty(block, addr)) {
+                word |= 1ULL << bit;
+            }
+            if (++bit == 64) {
+                qemu_put_be64(f, word);
+                word = 0;
+                bit = 0;
+            }
+        }
+        if (bit) {
+            qemu_put_be64(f, word);
+        }
+    }
+
+    /* an empty idstr ends the list */
+    qemu_put_byte(f, 0);
+}
+
+int ram_postcopy_iterate(QEMUFile *f)
+{
+    int ret;
+
+    ram_save_check_version();
+
+    while ((ret = qemu_file_rate_limit(f)) == 0) {
+        int bytes_sent;
+
+        bytes_sent = ram_save_block(f, true);
+        /* everything has been sent */
+        if (bytes_sent < 0) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+            qemu_fflush(f);
+            return 1;
+        }
+        bytes_transferred += bytes_sent;
+    }
+
+    return ret < 0 ? ret : 0;
+}
+
+int ram_postcopy_request_page(QEMUFile *f, const char *idstr,
+                              uint64_t offset)
+{
+    RAMBlock *block;
+    uint8_t *p;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (!strcmp(block->idstr, idstr)) {
+            break;
+        }
+    }
+    if (!block || offset >= block->length) {
+        return -EINVAL;
+    }
+
+    offset &= TARGET_PAGE_MASK;
+    if (!migration_bitmap_test_and_reset_dirty(block, offset)) {
+        /* already sent, it is on its way */
+        return 0;
+    }
+
+    p = memory_region_get_ram_ptr(block->mr) + offset;
+    if (is_zero_page(p)) {
+        acct_info.dup_pages++;
+        save_block_hdr(f, block, offset, 0, RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, *p);
+        bytes_transferred += 1;
+    } else {
+        save_block_hdr(f, block, offset, 0, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+        acct_info.norm_pages++;
+        bytes_transferred += TARGET_PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+static void ram_save_flat_blocks(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        int64_t pages = block->length >> TARGET_PAGE_BITS;
+        int64_t words = DIV_ROUND_UP(pages, 64);
+        uint64_t *nonzero = g_new0(uint64_t, words);
+        uint32_t pad;
+        int64_t i;
+
+        for (i = 0; i < pages; i++) {
+            if (!buffer_is_zero(block->host + (i << TARGET_PAGE_BITS),
+                                TARGET_PAGE_SIZE)) {
+                nonzero[i / 64] |= 1ULL << (i % 64);
+            }
+        }
+
+        qemu_put_be64(f, RAM_SAVE_FLAG_FLAT);
+        qemu_put_byte(f, RAM_FLAT_PACKED);
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, block->length);
+        for (i = 0; i < words; i++) {
+            qemu_put_be64(f, nonzero[i]);
+        }
+        pad = -(qemu_ftell(f) + 4) & (RAM_FLAT_ALIGN - 1);
+        qemu_put_be32(f, pad);
+        while (pad--) {
+            qemu_put_byte(f, 0);
+        }
+
+        for (i = 0; i < pages; i++) {
+            if (nonzero[i / 64] & (1ULL << (i % 64))) {
+                qemu_put_buffer(f, block->host + (i << TARGET_PAGE_BITS),
+                                TARGET_PAGE_SIZE);
+                bytes_transferred += TARGET_PAGE_SIZE;
+            }
+        }
+        g_free(nonzero);
+    }
+}
+
+static int ram_save_complete(QEMUFile *f, void *opaque)
+{
+    /* the guest is stopped from here on */
+    cpu_throttle_stop();
+    migration_bitmap_sync();
+    ram_save_check_version();
+
+    if (ram_save_flat) {
+        if (compress_pool.active) {
+            compress_threads_fini();
+        }
+        multifd_send_fini(f, true);
+        memory_global_dirty_log_stop();
+        ram_save_flat_blocks(f);
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return 0;
+    }
+
+    if (ram_postcopy_active) {
+        if (compress_pool.active) {
+            bytes_transferred += compress_flush(f);
+            compress_threads_fini();
+        }
+        multifd_send_fini(f, true);
+        memory_global_dirty_log_stop();
+        ram_save_postcopy_bitmap(f);
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return 0;
+    }
+
+    /* try transferring iterative blocks of memory */
+
+    /* flush all remaining blocks regardless of rate limiting */
+    while (true) {
+        int bytes_sent;
+
+        bytes_sent = ram_save_block(f, true);
+        /* no more blocks to sent */
+        if (bytes_sent < 0) {
+            break;
+        }
+        bytes_transferred += bytes_sent;
+    }
+    if (compress_pool.active) {
+        bytes_transferred += compress_flush(f);
+        compress_threads_fini();
+    }
+    multifd_send_fini(f, true);
+    if (ram_file.active) {
+        int ret = ram_file_drain();
+
+        ram_file_fini();
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    memory_global_dirty_log_stop();
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return 0;
+}
+
+static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
+{
+    int ret, rc = 0;
+    unsigned int xh_len;
+    int xh_flags;
+
+    if (!XBZRLE.decoded_buf) {
+        XBZRLE.decoded_buf = g_malloc(TARGET_PAGE_SIZE);
+    }
+
+    /* extract RLE header */
+    xh_flags = qemu_get_byte(f);
+    xh_len = qemu_get_be16(f);
+
+    if (xh_flags != ENCODING_FLAG_XBZRLE) {
+        fprintf(stderr, "Failed to load XBZRLE page - wrong compression!\n");
+        return -1;
+    }
+
+    if (xh_len > TARGET_PAGE_SIZE) {
+        fprintf(stderr, "Failed to load XBZRLE page - len overflow!\n");
+        return -1;
+    }
+    /* load data and decode */
+    qemu_get_buffer(f, XBZRLE.decoded_buf, xh_len);
+
+    /* decode RLE */
+    ret = xbzrle_decode_buffer(XBZRLE.decoded_buf, xh_len, host,
+                               TARGET_PAGE_SIZE);
+    if (ret == -1) {
+        fprintf(stderr, "Failed to load XBZRLE page - decode error!\n");
+        rc = -1;
+    } else  if (ret > TARGET_PAGE_SIZE) {
+        fprintf(stderr, "Failed to load XBZRLE page - size %d exceeds %d!\n",
+                ret, TARGET_PAGE_SIZE);
+        abort();
+    }
+
+    return rc;
+}
+
+static int load_compressed_page(QEMUFile *f, void *host)
+{
+    static uint8_t *compressed_buf;
+    unsigned long max_len = compressBound(TARGET_PAGE_SIZE);
+    unsigned long len, dest_len = TARGET_PAGE_SIZE;
+
+    if (!compressed_buf) {
+        compressed_buf = g_malloc(max_len);
+    }
+
+    len = qemu_get_be32(f);
+    if (len > max_len) {
+        fprintf(stderr, "Failed to load compressed page - len overflow!\n");
+        return -1;
+    }
+    qemu_get_buffer(f, compressed_buf, len);
+
+    if (uncompress(host, &dest_len, compressed_buf, len) != Z_OK ||
+        dest_len != TARGET_PAGE_SIZE) {
+        fprintf(stderr, "Failed to load compressed page - decode error!\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline void *host_from_stream_offset(QEMUFile *f,
+                                            ram_addr_t offset,
+                                            int flags)
+{
+    static RAMBlock *block = NULL;
+    char id[256];
+    uint8_t len;
+
+    if (flags & RAM_SAVE_FLAG_CONTINUE) {
+        if (!block) {
+            fprintf(stderr, "Ack, bad migration stream!\n");
+            return NULL;
+        }
+
+        return memory_region_get_ram_ptr(block->mr) + offset;
+    }
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(id, block->idstr, sizeof(id)))
+            return memory_region_get_ram_ptr(block->mr) + offset;
+    }
+
+    fprintf(stderr, "Can't find block %s!\n", id);
+    return NULL;
+}
+
+/*
+ * Postcopy, destination side
+ *
+ * Pages listed in the bitmap are protected with PROT_NONE before the guest
+ * starts.  A thread keeps reading pages from the migration stream; each one
+ * is written through /proc/self/mem, so that it is complete before it
+ * becomes accessible, and then unprotected.  A thread that faults on a page
+ * still missing asks the source for it over the same socket and waits for
+ * the page to arrive.
+ *
+ * Host system calls would get EFAULT instead of faulting, so the pages are
+ * also requested and waited for before QEMU hands guest memory out: TCG
+ * maps them through tlb_set_page() and devices through
+ * cpu_physical_memory_map() and qemu_get_ram_ptr(), which all call
+ * ram_lazy_touch().  KVM, vhost and dataplane access guest memory behind
+ * QEMU's back, so postcopy is refused with them.
+ *
+ * If the stream fails, the missing pages are made accessible as they are
+ * and the guest is stopped with an internal error.
+ */
+
+int64_t ram_postcopy_pages;
+
+#ifdef __linux__
+typedef struct PostcopyBlock {
+    RAMBlock *block;
+    uint8_t *host;
+    /* pages not received yet, only cleared by the receiving thread */
+    unsigned long *pending;
+} PostcopyBlock;
+
+static struct {
+    /* kept until the next incoming migration, fault handlers may run late */
+    PostcopyBlock *blocks;
+    int nb_blocks;
+    bool loaded;
+    QEMUFile *file;
+    int fd;
+    int mem_fd;
+    QemuThread thread;
+    /* serializes requests written from fault handlers */
+    int request_lock;
+    struct sigaction old_segv;
+    /* protects the pending bitmaps against waiters, and failed */
+    QemuMutex lock;
+    QemuCond page_cond;
+    bool page_cond_init;
+    bool failed;
+} postcopy_in;
+
+static PostcopyBlock *postcopy_find_block(uint8_t *addr)
+{
+    int i;
+
+    for (i = 0; i < postcopy_in.nb_blocks; i++) {
+        PostcopyBlock *pb = &postcopy_in.blocks[i];
+
+        if (addr >= pb->host && addr < pb->host + pb->block->length) {
+            return pb;
+        }
+    }
+    return NULL;
+}
+
+static int postcopy_check_netdev(QemuOpts *opts, void *opaque)
+{
+    return qemu_opt_get_bool(opts, "vhost", false) ||
+           qemu_opt_get_bool(opts, "vhostforce", false);
+}
+
+static int postcopy_check_device(QemuOpts *opts, void *opaque)
+{
+    return qemu_opt_get_bool(opts, "x-data-plane", false);
+}
+
+static int load_postcopy_bitmap(QEMUFile *f)
+{
+    char id[256];
+    uint8_t len;
+    int i;
+
+    if (kvm_enabled()) {
+        fprintf(stderr, "postcopy migration is not supported with KVM\n");
+        return -1;
+    }
+    if (qemu_opts_foreach(qemu_find_opts("netdev"), postcopy_check_netdev,
+                          NULL, 1) ||
+        qemu_opts_foreach(qemu_find_opts("net"), postcopy_check_netdev,
+                          NULL, 1)) {
+        fprintf(stderr, "postcopy migration is not supported with vhost\n");
+        return -1;
+    }
+    if (qemu_opts_foreach(qemu_find_opts("device"), postcopy_check_device,
+                          NULL, 1)) {
+        fprintf(stderr,
+                "postcopy migration is not supported with x-data-plane\n");
+        return -1;
+    }
+
+    for (i = 0; i < postcopy_in.nb_blocks; i++) {
+        g_free(postcopy_in.blocks[i].pending);
+    }
+    g_free(postcopy_in.blocks);
+    postcopy_in.blocks = NULL;
+    postcopy_in.nb_blocks = 0;
+
+    while ((len = qemu_get_byte(f)) != 0) {
+        RAMBlock *block;
+        PostcopyBlock *pb;
+        ram_addr_t length, page, nb_pages;
+
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+        length = qemu_get_be64(f);
+
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block || block->length != length) {
+            fprintf(stderr, "Unknown ramblock \"%s\" in postcopy bitmap\n",
+                    id);
+            return -1;
+        }
+
+        postcopy_in.blocks = g_renew(PostcopyBlock, postcopy_in.blocks,
+                                     postcopy_in.nb_blocks + 1);
+        pb = &postcopy_in.blocks[postcopy_in.nb_blocks++];
+        pb->block = block;
+        pb->host = memory_region_get_ram_ptr(block->mr);
+        nb_pages = length >> TARGET_PAGE_BITS;
+        pb->pending = bitmap_new(nb_pages);
+
+        for (page = 0; page < nb_pages; page += 64) {
+            uint64_t word = qemu_get_be64(f);
+
+            for (i = 0; i < 64 && page + i < nb_pages; i++) {
+                if (word & (1ULL << i)) {
+                    set_bit(page + i, pb->pending);
+                }
+            }
+        }
+    }
+
+    postcopy_in.loaded = true;
+    return qemu_file_get_error(f);
+}
+
+static void postcopy_send_request(PostcopyBlock *pb, ram_addr_t offset)
+{
+    uint8_t req[1 + 256 + 8];
+    int len = strlen(pb->block->idstr);
+    int size = 1 + len + 8;
+    int pos = 0;
+    int i;
+
+    req[0] = len;
+    memcpy(req + 1, pb->block->idstr, len);
+    for (i = 0; i < 8; i++) {
+        req[1 + len + i] = offset >> (56 - 8 * i);
+    }
+
+    while (__sync_lock_test_and_set(&postcopy_in.request_lock, 1)) {
+        /* another thread is sending its request */
+    }
+    while (pos < size) {
+        ssize_t ret = write(postcopy_in.fd, req + pos, size - pos);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            break;
+        }
+        pos += ret;
+    }
+    __sync_lock_release(&postcopy_in.request_lock);
+}
+
+/* Called with postcopy_in.lock held */
+static void postcopy_wait_page(PostcopyBlock *pb, unsigned long page)
+{
+    while (test_bit(page, pb->pending) && !postcopy_in.failed) {
+        qemu_cond_wait(&postcopy_in.page_cond, &postcopy_in.lock);
+    }
+}
+
+/*
+ * The fault is synchronous and comes from an access to guest memory, never
+ * from code holding postcopy_in.lock, so the handler can wait on the lock
+ * and condition variable.
+ */
+static void postcopy_sigsegv_handler(int sig, siginfo_t *info, void *ctx)
+{
+    uint8_t *addr = info->si_addr;
+    int saved_errno = errno;
+    PostcopyBlock *pb;
+    unsigned long page;
+
+    pb = postcopy_find_block(addr);
+    if (!pb) {
+        /* a genuine fault, let it hit the previous handler */
+        sigaction(SIGSEGV, &postcopy_in.old_segv, NULL);
+        return;
+    }
+
+    page = (addr - pb->host) >> TARGET_PAGE_BITS;
+    if (test_bit(page, pb->pending)) {
+        postcopy_send_request(pb, (ram_addr_t)page << TARGET_PAGE_BITS);
+        qemu_mutex_lock(&postcopy_in.lock);
+        postcopy_wait_page(pb, page);
+        qemu_mutex_unlock(&postcopy_in.lock);
+    }
+    errno = saved_errno;
+}
+
+void ram_postcopy_fault_in(ram_addr_t addr, ram_addr_t size)
+{
+    int i;
+
+    for (i = 0; i < postcopy_in.nb_blocks; i++) {
+        PostcopyBlock *pb = &postcopy_in.blocks[i];
+        RAMBlock *block = pb->block;
+        unsigned long page, first, last;
+
+        if (addr >= block->offset + block->length ||
+            addr + size <= block->offset) {
+            continue;
+        }
+        first = (MAX(addr, block->offset) - block->offset) >> TARGET_PAGE_BITS;
+        last = (MIN(addr + size, block->offset + block->length) - 1 -
+                block->offset) >> TARGET_PAGE_BITS;
+
+        /* ask for all of them before waiting for the first one */
+        for (page = first; page <= last; page++) {
+            if (test_bit(page, pb->pending)) {
+                postcopy_send_request(pb, (ram_addr_t)page << TARGET_PAGE_BITS);
+            }
+        }
+        qemu_mutex_lock(&postcopy_in.lock);
+        for (page = first; page <= last; page++) {
+            postcopy_wait_page(pb, page);
+        }
+        qemu_mutex_unlock(&postcopy_in.lock);
+    }
+}
+
+static int postcopy_place_page(uint8_t *host, uint8_t *buf)
+{
+    PostcopyBlock *pb = postcopy_find_block(host);
+    unsigned long page;
+
+    if (!pb) {
+        return -1;
+    }
+
+    page = (host - pb->host) >> TARGET_PAGE_BITS;
+    if (!test_bit(page, pb->pending)) {
+        return 0;
+    }
+
+    if (postcopy_in.mem_fd >= 0 &&
+        pwrite(postcopy_in.mem_fd, buf, TARGET_PAGE_SIZE,
+               (off_t)(uintptr_t)host) == TARGET_PAGE_SIZE) {
+        if (mprotect(host, TARGET_PAGE_SIZE, PROT_READ | PROT_WRITE)) {
+            return -1;
+        }
+    } else {
+        /* the page is briefly visible before it is filled */
+        if (mprotect(host, TARGET_PAGE_SIZE, PROT_READ | PROT_WRITE)) {
+            return -1;
+        }
+        memcpy(host, buf, TARGET_PAGE_SIZE);
+    }
+    qemu_mutex_lock(&postcopy_in.lock);
+    clear_bit(page, pb->pending);
+    ram_postcopy_pages--;
+    qemu_cond_broadcast(&postcopy_in.page_cond);
+    qemu_mutex_unlock(&postcopy_in.lock);
+
+    return 0;
+}
+
+/* Give up on the missing pages: make them accessible as they are, so that
+ * nothing waits for them anymore, and stop the guest */
+static void postcopy_incoming_fail(void)
+{
+    int i;
+
+    fprintf(stderr, "postcopy migration failed, %" PRId64
+            " pages of guest memory are lost\n", ram_postcopy_pages);
+
+    qemu_mutex_lock(&postcopy_in.lock);
+    for (i = 0; i < postcopy_in.nb_blocks; i++) {
+        PostcopyBlock *pb = &postcopy_in.blocks[i];
+
+        mprotect(pb->host, pb->block->length, PROT_READ | PROT_WRITE);
+    }
+    postcopy_in.failed = true;
+    ram_postcopy_pages = 0;
+    qemu_cond_broadcast(&postcopy_in.page_cond);
+    qemu_mutex_unlock(&postcopy_in.lock);
+
+    qemu_system_vmstop_request(RUN_STATE_INTERNAL_ERROR);
+}
+
+static void postcopy_incoming_fini(void)
+{
+    sigaction(SIGSEGV, &postcopy_in.old_segv, NULL);
+    if (postcopy_in.mem_fd >= 0) {
+        close(postcopy_in.mem_fd);
+    }
+    qemu_fclose(postcopy_in.file);
+    close(postcopy_in.fd);
+    postcopy_in.file = NULL;
+}
+
+static void *postcopy_incoming_thread(void *opaque)
+{
+    QEMUFile *f = postcopy_in.file;
+    uint8_t *buf = g_malloc(TARGET_PAGE_SIZE);
+    ram_addr_t addr;
+    int flags;
+
+    while (true) {
+        void *host;
+
+        addr = qemu_get_be64(f);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        if (flags & RAM_SAVE_FLAG_EOS) {
+            break;
+        }
+
+        host = host_from_stream_offset(f, addr, flags);
+        if (!host) {
+            goto fail;
+        }
+
+        if (flags & RAM_SAVE_FLAG_COMPRESS) {
+            memset(buf, qemu_get_byte(f), TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_PAGE) {
+            qemu_get_buffer(f, buf, TARGET_PAGE_SIZE);
+        } else {
+            goto fail;
+        }
+
+        if (qemu_file_get_error(f) || postcopy_place_page(host, buf) < 0) {
+            goto fail;
+        }
+    }
+
+    if (qemu_file_get_error(f)) {
+        goto fail;
+    }
+    DPRINTF("postcopy migration done\n");
+    ram_postcopy_pages = 0;
+    postcopy_incoming_fini();
+    g_free(buf);
+    return NULL;
+
+fail:
+    postcopy_incoming_fail();
+    postcopy_incoming_fini();
+    g_free(buf);
+    return NULL;
+}
+
+bool ram_postcopy_incoming_pending(void)
+{
+    return postcopy_in.loaded;
+}
+
+int ram_postcopy_incoming_start(QEMUFile *f)
+{
+    struct sigaction act;
+    int i;
+
+    postcopy_in.loaded = false;
+    postcopy_in.fd = qemu_socket_fd(f);
+    if (postcopy_in.fd < 0) {
+        fprintf(stderr, "postcopy migration needs a socket connection\n");
+        return -1;
+    }
+    postcopy_in.file = f;
+    postcopy_in.mem_fd = open("/proc/self/mem", O_RDWR);
+    postcopy_in.failed = false;
+    if (!postcopy_in.page_cond_init) {
+        qemu_mutex_init(&postcopy_in.lock);
+        qemu_cond_init(&postcopy_in.page_cond);
+        postcopy_in.page_cond_init = true;
+    }
 
-    /* if we haven't transferred anything this round, force expected_time to a
-     * a very high value, but without crashing */
-    if (bwidth == 0) {
-        bwidth = 0.000001;
+    for (i = 0; i < postcopy_in.nb_blocks; i++) {
+        PostcopyBlock *pb = &postcopy_in.blocks[i];
+        unsigned long nb_pages = pb->block->length >> TARGET_PAGE_BITS;
+        unsigned long page, end;
+
+        page = find_next_bit(pb->pending, nb_pages, 0);
+        while (page < nb_pages) {
+            end = find_next_zero_bit(pb->pending, nb_pages, page);
+            if (mprotect(pb->host + (page << TARGET_PAGE_BITS),
+                         (end - page) << TARGET_PAGE_BITS, PROT_NONE)) {
+                return -1;
+            }
+            ram_postcopy_pages += end - page;
+            page = find_next_bit(pb->pending, nb_pages, end);
+        }
     }
 
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    memset(&act, 0, sizeof(act));
+    act.sa_sigaction = postcopy_sigsegv_handler;
+    act.sa_flags = SA_SIGINFO;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGSEGV, &act, &postcopy_in.old_segv);
 
-    expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
+    qemu_thread_create(&postcopy_in.thread, postcopy_incoming_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+    return 0;
+}
+#else
+static int load_postcopy_bitmap(QEMUFile *f)
+{
+    fprintf(stderr, "postcopy migration is not supported on this host\n");
+    return -1;
+}
 
-    DPRINTF("ram_save_live: expected(" PRIu64 ") <= max(" PRIu64 ")?\n",
-            expected_time, migrate_max_downtime());
+bool ram_postcopy_incoming_pending(void)
+{
+    return false;
+}
+
+int ram_postcopy_incoming_start(QEMUFile *f)
+{
+    return -1;
+}
+
+void ram_postcopy_fault_in(ram_addr_t addr, ram_addr_t size)
+{
+}
+#endif
+
+/*
+ * Lazy loading of flat RAM images (loadvm -l).
+ *
+ * Zero pages are cleared right away, the others stay pending: a pending
+ * page is read from the VM state when TCG maps it or a device gets at it
+ * through qemu_get_ram_ptr() and friends, and meanwhile a coroutine reads
+ * all of them in the order they were saved.  Pages are read into a bounce
+ * buffer and only copied if they are still pending, since the guest may
+ * have written to them while the read was in flight.
+ *
+ * Only blocks larger than RAM_LAZY_MIN_BLOCK are loaded lazily.  Smaller
+ * ones are device memory like video RAM, which the display code reads
+ * through pointers it keeps.
+ */
+#define RAM_LAZY_MIN_BLOCK      (256 * 1024 * 1024)
+#define RAM_LAZY_FAULT_PAGES    (RAM_FLAT_ALIGN / TARGET_PAGE_SIZE)
+#define RAM_LAZY_PREFETCH_PAGES ((1024 * 1024) / TARGET_PAGE_SIZE)
+
+typedef struct RamLazyBlock {
+    RAMBlock *block;
+    int64_t pages;
+    /* pages that are in the image, and those of them not loaded yet */
+    uint64_t *nonzero;
+    uint64_t *pending;
+    /* number of pages in the image before each word of the bitmaps */
+    int64_t *rank;
+    /* position of the first page in the VM state */
+    int64_t data_pos;
+    QTAILQ_ENTRY(RamLazyBlock) next;
+} RamLazyBlock;
+
+typedef struct RamLazyLoad {
+    BlockDriverState *bs;
+    QTAILQ_HEAD(, RamLazyBlock) blocks;
+    Coroutine *co;
+    QEMUBH *bh;
+    bool cancelled;
+} RamLazyLoad;
+
+static RamLazyLoad *ram_lazy;
+int64_t ram_lazy_pages;
+
+static bool flat_test_bit(const uint64_t *map, int64_t page)
+{
+    return map[page / 64] & (1ULL << (page % 64));
+}
 
-    if (expected_time <= migrate_max_downtime()) {
-        memory_global_sync_dirty_bitmap(get_system_memory());
-        expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
+/* First page from @page on whose bit is @set, or @end */
+static int64_t flat_find_next(const uint64_t *map, int64_t page, int64_t end,
+                              bool set)
+{
+    uint64_t flip = set ? 0 : ~0ULL;
+    uint64_t word;
 
-        return expected_time <= migrate_max_downtime();
+    if (page >= end) {
+        return end;
     }
-    return 0;
+    word = (map[page / 64] ^ flip) & (~0ULL << (page % 64));
+    while (!word) {
+        page = (page | 63) + 1;
+        if (page >= end) {
+            return end;
+        }
+        word = map[page / 64] ^ flip;
+    }
+    return MIN((page & ~63LL) + ctz64(word), end);
 }
 
-static int ram_save_complete(QEMUFile *f, void *opaque)
+/* Zero a range of a block, and give its memory back when possible */
+static void ram_clear_pages(RAMBlock *block, ram_addr_t offset,
+                            ram_addr_t length)
 {
-    memory_global_sync_dirty_bitmap(get_system_memory());
+    uint8_t *host = block->host + offset;
+    uintptr_t mask = getpagesize() - 1;
+    uintptr_t start = ((uintptr_t)host + mask) & ~mask;
+    uintptr_t end = ((uintptr_t)host + length) & ~mask;
+
+#if defined(__linux__) && !defined(TARGET_S390X)
+    /* file mappings would read back the file */
+    if (block->fd > 0) {
+        start = end;
+    }
+#endif
+    if (start < end && (!kvm_enabled() || kvm_has_sync_mmu()) &&
+        qemu_madvise((void *)start, end - start, QEMU_MADV_DONTNEED) == 0) {
+        memset(host, 0, start - (uintptr_t)host);
+        memset((void *)end, 0, (uintptr_t)host + length - end);
+        return;
+    }
+    memset(host, 0, length);
+}
 
-    /* try transferring iterative blocks of memory */
+static int64_t ram_lazy_page_pos(RamLazyBlock *lb, int64_t page)
+{
+    uint64_t below = lb->nonzero[page / 64] & ((1ULL << (page % 64)) - 1);
 
-    /* flush all remaining blocks regardless of rate limiting */
-    while (true) {
-        int bytes_sent;
+    return lb->data_pos +
+           ((lb->rank[page / 64] + ctpop64(below)) << TARGET_PAGE_BITS);
+}
 
-        bytes_sent = ram_save_block(f, true);
-        /* no more blocks to sent */
-        if (bytes_sent < 0) {
+/*
+ * Read @npages pages from @page on, which must all be in the image, and
+ * copy those that are still pending to the guest.  Yields when called
+ * from a coroutine.
+ */
+static void ram_lazy_read(RamLazyLoad *s, RamLazyBlock *lb, int64_t page,
+                          int npages)
+{
+    int size = npages << TARGET_PAGE_BITS;
+    uint8_t *buf = g_malloc(size);
+    int64_t i;
+    int ret;
+
+    ret = bdrv_load_vmstate(s->bs, buf, ram_lazy_page_pos(lb, page), size);
+    if (ret < 0) {
+        /* the guest cannot go on without its memory */
+        fprintf(stderr, "Failed to load RAM from the snapshot: %s\n",
+                strerror(-ret));
+        exit(1);
+    }
+
+    if (!s->cancelled) {
+        for (i = page; i < page + npages; i++) {
+            if (flat_test_bit(lb->pending, i)) {
+                memcpy(lb->block->host + (i << TARGET_PAGE_BITS),
+                       buf + ((i - page) << TARGET_PAGE_BITS),
+                       TARGET_PAGE_SIZE);
+                lb->pending[i / 64] &= ~(1ULL << (i % 64));
+                ram_lazy_pages--;
+            }
+        }
+    }
+    g_free(buf);
+}
+
+/* Load the pending pages of [@page, @end), @max_pages at a time */
+static void ram_lazy_load_range(RamLazyLoad *s, RamLazyBlock *lb,
+                                int64_t page, int64_t end, int max_pages)
+{
+    while (!s->cancelled) {
+        int64_t last;
+
+        page = flat_find_next(lb->pending, page, end, true);
+        if (page == end) {
             break;
         }
-        bytes_transferred += bytes_sent;
+        /* pages in the image are contiguous in the file */
+        last = flat_find_next(lb->nonzero, page, end, false);
+        last = MIN(last, page + max_pages);
+        ram_lazy_read(s, lb, page, last - page);
+        page = last;
     }
-    memory_global_dirty_log_stop();
+}
 
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+void ram_lazy_load(ram_addr_t addr, ram_addr_t size)
+{
+    RamLazyLoad *s = ram_lazy;
+    RamLazyBlock *lb;
+
+    QTAILQ_FOREACH(lb, &s->blocks, next) {
+        RAMBlock *block = lb->block;
+        int64_t page, end;
+
+        if (addr >= block->offset + block->length ||
+            addr + size <= block->offset) {
+            continue;
+        }
+        /* whole aligned windows, which are mostly one cluster of the image */
+        page = (MAX(addr, block->offset) - block->offset) >> TARGET_PAGE_BITS;
+        end = (MIN(addr + size, block->offset + block->length) - 1 -
+               block->offset) >> TARGET_PAGE_BITS;
+        page &= ~(int64_t)(RAM_LAZY_FAULT_PAGES - 1);
+        end = MIN((end | (RAM_LAZY_FAULT_PAGES - 1)) + 1, lb->pages);
+        ram_lazy_load_range(s, lb, page, end, RAM_LAZY_FAULT_PAGES);
+    }
+}
+
+static void ram_lazy_free_blocks(RamLazyLoad *s)
+{
+    RamLazyBlock *lb;
+
+    while ((lb = QTAILQ_FIRST(&s->blocks))) {
+        QTAILQ_REMOVE(&s->blocks, lb, next);
+        g_free(lb->nonzero);
+        g_free(lb->pending);
+        g_free(lb->rank);
+        g_free(lb);
+    }
+}
+
+static void ram_lazy_bh(void *opaque)
+{
+    RamLazyLoad *s = opaque;
+
+    qemu_coroutine_enter(s->co, NULL);
+}
+
+static void coroutine_fn ram_lazy_prefetch(void *opaque)
+{
+    RamLazyLoad *s = opaque;
+    RamLazyBlock *lb = QTAILQ_FIRST(&s->blocks);
+    int64_t page = 0, last;
+
+    while (!s->cancelled && lb) {
+        page = flat_find_next(lb->pending, page, lb->pages, true);
+        if (page == lb->pages) {
+            lb = QTAILQ_NEXT(lb, next);
+            page = 0;
+            continue;
+        }
+        last = flat_find_next(lb->nonzero, page, lb->pages, false);
+        last = MIN(last, page + RAM_LAZY_PREFETCH_PAGES);
+        ram_lazy_read(s, lb, page, last - page);
+        page = last;
+
+        /* let the guest and the main loop run in between */
+        qemu_bh_schedule(s->bh);
+        qemu_coroutine_yield();
+    }
+
+    if (!s->cancelled) {
+        DPRINTF("lazy RAM load completed\n");
+        ram_lazy_free_blocks(s);
+        ram_lazy_pages = 0;
+        ram_lazy = NULL;
+        bdrv_set_in_use(s->bs, 0);
+    }
+    qemu_bh_delete(s->bh);
+    g_free(s);
+}
+
+int ram_lazy_load_begin(BlockDriverState *bs)
+{
+    if (kvm_enabled() || xen_enabled() || mttcg_enabled) {
+        fprintf(stderr, "Lazy RAM loading needs single-threaded TCG\n");
+        return -ENOTSUP;
+    }
+    if (bdrv_in_use(bs)) {
+        fprintf(stderr, "Device '%s' is in use\n", bdrv_get_device_name(bs));
+        return -EBUSY;
+    }
 
+    ram_lazy_load_cancel();
+    ram_lazy = g_new0(RamLazyLoad, 1);
+    ram_lazy->bs = bs;
+    QTAILQ_INIT(&ram_lazy->blocks);
     return 0;
 }
 
-static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
+void ram_lazy_load_start(void)
 {
-    int ret, rc = 0;
-    unsigned int xh_len;
-    int xh_flags;
+    RamLazyLoad *s = ram_lazy;
 
-    if (!XBZRLE.decoded_buf) {
-        XBZRLE.decoded_buf = g_malloc(TARGET_PAGE_SIZE);
+    if (!s || s->co) {
+        return;
+    }
+    if (!ram_lazy_pages) {
+        ram_lazy_load_cancel();
+        return;
     }
 
-    /* extract RLE header */
-    xh_flags = qemu_get_byte(f);
-    xh_len = qemu_get_be16(f);
+    bdrv_set_in_use(s->bs, 1);
+    s->bh = qemu_bh_new(ram_lazy_bh, s);
+    s->co = qemu_coroutine_create(ram_lazy_prefetch);
+    qemu_coroutine_enter(s->co, s);
+}
 
-    if (xh_flags != ENCODING_FLAG_XBZRLE) {
-        fprintf(stderr, "Failed to load XBZRLE page - wrong compression!\n");
-        return -1;
+/* Forget about the pending pages, because new contents are coming */
+void ram_lazy_load_cancel(void)
+{
+    RamLazyLoad *s = ram_lazy;
+
+    if (!s) {
+        return;
+    }
+    ram_lazy = NULL;
+    ram_lazy_pages = 0;
+    ram_lazy_free_blocks(s);
+    if (s->co) {
+        /* the coroutine frees the rest when it next runs */
+        s->cancelled = true;
+        bdrv_set_in_use(s->bs, 0);
+    } else {
+        g_free(s);
     }
+}
 
-    if (xh_len > TARGET_PAGE_SIZE) {
-        fprintf(stderr, "Failed to load XBZRLE page - len overflow!\n");
-        return -1;
+/* Load all pending pages now, e.g. before RAM is saved */
+void ram_lazy_load_all(void)
+{
+    RamLazyLoad *s = ram_lazy;
+    RamLazyBlock *lb;
+
+    if (!s || !s->co) {
+        return;
     }
-    /* load data and decode */
-    qemu_get_buffer(f, XBZRLE.decoded_buf, xh_len);
+    QTAILQ_FOREACH(lb, &s->blocks, next) {
+        ram_lazy_load_range(s, lb, 0, lb->pages, RAM_LAZY_PREFETCH_PAGES);
+    }
+}
 
-    /* decode RLE */
-    ret = xbzrle_decode_buffer(XBZRLE.decoded_buf, xh_len, host,
-                               TARGET_PAGE_SIZE);
-    if (ret == -1) {
-        fprintf(stderr, "Failed to load XBZRLE page - decode error!\n");
-        rc = -1;
-    } else  if (ret > TARGET_PAGE_SIZE) {
-        fprintf(stderr, "Failed to load XBZRLE page - size %d exceeds %d!\n",
-                ret, TARGET_PAGE_SIZE);
-        abort();
+/*
+ * Migration from a file: the RAM regions are read through their own file
+ * descriptor, by RAM_FILE_THREADS threads or by mapping them.
+ */
+#define RAM_FILE_READ_CHUNK (8 * 1024 * 1024)
+
+static int ram_load_file_fd = -1;
+static bool ram_load_file_map;
+
+typedef struct RamFileRead {
+    RAMBlock *block;
+    int64_t pos;
+    QemuMutex lock;
+    /* offset in the block of the next chunk to read */
+    ram_addr_t next;
+    int error;
+} RamFileRead;
+
+void ram_load_set_file(int fd, bool map)
+{
+    if (ram_load_file_fd >= 0) {
+        close(ram_load_file_fd);
     }
+    ram_load_file_fd = fd;
+    ram_load_file_map = map;
+}
 
-    return rc;
+/* Map the region privately over the block, returns whether it could */
+static bool ram_file_map(RAMBlock *block, int64_t pos)
+{
+#ifndef _WIN32
+    uintptr_t mask = getpagesize() - 1;
+
+#if defined(__linux__) && !defined(TARGET_S390X)
+    /* keep the huge pages of -mem-path */
+    if (block->fd > 0) {
+        return false;
+    }
+#endif
+    if (((uintptr_t)block->host | block->length | pos) & mask ||
+        xen_enabled() || (kvm_enabled() && !kvm_has_sync_mmu())) {
+        return false;
+    }
+    return mmap(block->host, block->length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED, ram_load_file_fd, pos) != MAP_FAILED;
+#else
+    return false;
+#endif
 }
 
-static inline void *host_from_stream_offset(QEMUFile *f,
-                                            ram_addr_t offset,
-                                            int flags)
+static int ram_file_read_chunk(RamFileRead *r, ram_addr_t offset,
+                               ram_addr_t end)
 {
-    static RAMBlock *block = NULL;
-    char id[256];
-    uint8_t len;
+    RAMBlock *block = r->block;
 
-    if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block) {
-            fprintf(stderr, "Ack, bad migration stream!\n");
-            return NULL;
+    while (offset < end) {
+        ram_addr_t hole = end;
+        ssize_t ret;
+
+#ifdef SEEK_DATA
+        /* holes are zero pages, which the destination may not have */
+        off_t data = lseek(ram_load_file_fd, r->pos + offset, SEEK_DATA);
+
+        if (data < 0 && errno == ENXIO) {
+            data = r->pos + end;
+        }
+        if (data >= 0) {
+            data = MIN(data - r->pos, (off_t)end);
+            if (data > offset) {
+                ram_clear_pages(block, offset, data - offset);
+                offset = data;
+                continue;
+            }
+            data = lseek(ram_load_file_fd, r->pos + offset, SEEK_HOLE);
+            if (data >= 0) {
+                hole = MIN(data - r->pos, (off_t)end);
+            }
+        }
+#endif
+        while (offset < hole) {
+            ret = pread(ram_load_file_fd, block->host + offset, hole - offset,
+                        r->pos + offset);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret <= 0) {
+                return ret < 0 ? -errno : -EIO;
+            }
+            offset += ret;
         }
+    }
+    return 0;
+}
 
-        return memory_region_get_ram_ptr(block->mr) + offset;
+static void *ram_file_read_fn(void *opaque)
+{
+    RamFileRead *r = opaque;
+    ram_addr_t offset, end;
+    int ret;
+
+    for (;;) {
+        qemu_mutex_lock(&r->lock);
+        offset = r->next;
+        if (offset >= r->block->length || r->error) {
+            qemu_mutex_unlock(&r->lock);
+            break;
+        }
+        end = MIN(offset + RAM_FILE_READ_CHUNK, r->block->length);
+        r->next = end;
+        qemu_mutex_unlock(&r->lock);
+
+        ret = ram_file_read_chunk(r, offset, end);
+        if (ret < 0) {
+            qemu_mutex_lock(&r->lock);
+            if (!r->error) {
+                r->error = ret;
+            }
+            qemu_mutex_unlock(&r->lock);
+        }
+    }
+    return NULL;
+}
+
+static int ram_load_file_region(RAMBlock *block, int64_t pos)
+{
+    QemuThread threads[RAM_FILE_THREADS];
+    RamFileRead r;
+    int i;
+
+    if (ram_load_file_fd < 0) {
+        fprintf(stderr, "RAM of \"%s\" is in a migration file, but the "
+                "migration does not come from one\n", block->idstr);
+        return -EINVAL;
+    }
+    if (ram_load_file_map && ram_file_map(block, pos)) {
+        return 0;
     }
 
+    r.block = block;
+    r.pos = pos;
+    r.next = 0;
+    r.error = 0;
+    qemu_mutex_init(&r.lock);
+    for (i = 0; i < RAM_FILE_THREADS; i++) {
+        qemu_thread_create(&threads[i], ram_file_read_fn, &r,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < RAM_FILE_THREADS; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    qemu_mutex_destroy(&r.lock);
+
+    if (r.error) {
+        fprintf(stderr, "Failed to read RAM of \"%s\" from the migration "
+                "file: %s\n", block->idstr, strerror(-r.error));
+    }
+    return r.error;
+}
+
+static int load_flat_block(QEMUFile *f)
+{
+    RAMBlock *block;
+    char id[256];
+    uint8_t len, layout;
+    uint64_t *nonzero;
+    int64_t pages, words, nr_nonzero = 0, data_pos, page, next, i;
+    uint32_t pad;
+    bool lazy;
+
+    layout = qemu_get_byte(f);
     len = qemu_get_byte(f);
     qemu_get_buffer(f, (uint8_t *)id, len);
     id[len] = 0;
-
     QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (!strncmp(id, block->idstr, sizeof(id)))
-            return memory_region_get_ram_ptr(block->mr) + offset;
+        if (!strncmp(id, block->idstr, sizeof(id))) {
+            break;
+        }
+    }
+    if (!block) {
+        fprintf(stderr, "Unknown ramblock \"%s\", cannot "
+                "accept migration\n", id);
+        return -EINVAL;
+    }
+    if (qemu_get_be64(f) != block->length) {
+        return -EINVAL;
     }
 
-    fprintf(stderr, "Can't find block %s!\n", id);
-    return NULL;
+    if (layout == RAM_FLAT_FIXED) {
+        return ram_load_file_region(block, qemu_get_be64(f));
+    } else if (layout != RAM_FLAT_PACKED) {
+        return -EINVAL;
+    }
+
+    pages = block->length >> TARGET_PAGE_BITS;
+    words = DIV_ROUND_UP(pages, 64);
+    nonzero = g_new(uint64_t, words);
+    for (i = 0; i < words; i++) {
+        nonzero[i] = qemu_get_be64(f);
+        nr_nonzero += ctpop64(nonzero[i]);
+    }
+    pad = qemu_get_be32(f);
+    if (pad >= RAM_FLAT_ALIGN) {
+        g_free(nonzero);
+        return -EINVAL;
+    }
+    while (pad--) {
+        qemu_get_byte(f);
+    }
+    data_pos = qemu_ftell(f);
+
+    lazy = ram_lazy && !ram_lazy->co && block->length > RAM_LAZY_MIN_BLOCK;
+    for (page = 0; page < pages; page = next) {
+        i = flat_find_next(nonzero, page, pages, true);
+        if (i > page) {
+            ram_clear_pages(block, page << TARGET_PAGE_BITS,
+                            (i - page) << TARGET_PAGE_BITS);
+        }
+        next = flat_find_next(nonzero, i, pages, false);
+        if (lazy) {
+            continue;
+        }
+        for (; i < next; i++) {
+            qemu_get_buffer(f, block->host + (i << TARGET_PAGE_BITS),
+                            TARGET_PAGE_SIZE);
+        }
+    }
+
+    if (lazy) {
+        RamLazyBlock *lb = g_new0(RamLazyBlock, 1);
+
+        lb->block = block;
+        lb->pages = pages;
+        lb->nonzero = nonzero;
+        lb->pending = g_memdup(nonzero, words * sizeof(uint64_t));
+        lb->rank = g_new(int64_t, words);
+        lb->data_pos = data_pos;
+        for (i = 0, page = 0; i < words; i++) {
+            lb->rank[i] = page;
+            page += ctpop64(nonzero[i]);
+        }
+        QTAILQ_INSERT_TAIL(&ram_lazy->blocks, lb, next);
+        ram_lazy_pages += nr_nonzero;
+
+        qemu_fseek(f, data_pos + (nr_nonzero << TARGET_PAGE_BITS), SEEK_SET);
+    } else {
+        g_free(nonzero);
+    }
+    return 0;
 }
 
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
@@ -761,13 +3891,17 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
 
             ch = qemu_get_byte(f);
-            memset(host, ch, TARGET_PAGE_SIZE);
+            /* Pages that were never touched read as zero without being
+               allocated, writing to them would populate them. */
+            if (ch != 0 || !buffer_is_zero(host, TARGET_PAGE_SIZE)) {
+                memset(host, ch, TARGET_PAGE_SIZE);
 #ifndef _WIN32
-            if (ch == 0 &&
-                (!kvm_enabled() || kvm_has_sync_mmu())) {
-                qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
-            }
+                if (ch == 0 &&
+                    (!kvm_enabled() || kvm_has_sync_mmu())) {
+                    qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+                }
 #endif
+            }
         } else if (flags & RAM_SAVE_FLAG_PAGE) {
             void *host;
 
@@ -790,6 +3924,31 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 ret = -EINVAL;
                 goto done;
             }
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            void *host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                return -EINVAL;
+            }
+
+            if (load_compressed_page(f, host) < 0) {
+                ret = -EINVAL;
+                goto done;
+            }
+        } else if (flags & RAM_SAVE_FLAG_POSTCOPY) {
+            if (load_postcopy_bitmap(f) < 0) {
+                ret = -EINVAL;
+                goto done;
+            }
+        } else if (flags & RAM_SAVE_FLAG_MULTIFD) {
+            ret = load_multifd(f);
+            if (ret < 0) {
+                goto done;
+            }
+        } else if (flags & RAM_SAVE_FLAG_FLAT) {
+            ret = load_flat_block(f);
+            if (ret < 0) {
+                goto done;
+            }
         }
         error = qemu_file_get_error(f);
         if (error) {
@@ -808,6 +3967,8 @@ SaveVMHandlers savevm_ram_handlers = {
     .save_live_setup = ram_save_setup,
     .save_live_iterate = ram_save_iterate,
     .save_live_complete = ram_save_complete,
+    .save_live_pending = ram_save_pending,
+    .set_params = ram_migration_set_params,
     .load_state = ram_load,
     .cancel = ram_migration_cancel,
 };
@@ -24,47 +24,187 @@
 
 #include "qemu-common.h"
 #include "qemu-aio.h"
+#include "qemu-timer.h"
 #include "main-loop.h"
+#include "qemu-barrier.h"
 
-/* Anchor of the list of Bottom Halves belonging to the context */
-static struct QEMUBH *first_bh;
+#ifdef CONFIG_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+/***********************************************************/
+/* contexts */
+
+static AioContext *qemu_aio_context;
+
+static AioContext *aio_context_alloc(bool is_main)
+{
+    AioContext *ctx = g_malloc0(sizeof(*ctx));
+
+    QLIST_INIT(&ctx->aio_handlers);
+    ctx->notify_rfd = ctx->notify_wfd = -1;
+    ctx->is_main = is_main;
+    return ctx;
+}
+
+static void aio_notify_cb(void *opaque)
+{
+    AioContext *ctx = opaque;
+    char bytes[16];
+    ssize_t len;
+
+    /* eventfd reads return 8 bytes, a pipe may have more to drain */
+    do {
+        len = read(ctx->notify_rfd, bytes, sizeof(bytes));
+    } while ((len == -1 && errno == EINTR) || len == sizeof(bytes));
+}
+
+static int aio_context_init_notifier(AioContext *ctx)
+{
+#ifndef _WIN32
+#ifdef CONFIG_EVENTFD
+    ctx->notify_rfd = ctx->notify_wfd = eventfd(0, 0);
+    if (ctx->notify_rfd == -1)
+#endif
+    {
+        int fds[2];
+
+        if (qemu_pipe(fds) == -1) {
+            return -errno;
+        }
+        ctx->notify_rfd = fds[0];
+        ctx->notify_wfd = fds[1];
+    }
+    fcntl(ctx->notify_rfd, F_SETFL, O_NONBLOCK);
+    fcntl(ctx->notify_wfd, F_SETFL, O_NONBLOCK);
+
+    /* For the main context this also makes the main loop wake up */
+    aio_set_fd_handler(ctx, ctx->notify_rfd, aio_notify_cb, NULL, NULL, ctx);
+#endif
+    return 0;
+}
+
+AioContext *qemu_get_aio_context(void)
+{
+    if (!qemu_aio_context) {
+        qemu_aio_context = aio_context_alloc(true);
+        /* without a notifier, fall back to qemu_notify_event() */
+        aio_context_init_notifier(qemu_aio_context);
+    }
+    return qemu_aio_context;
+}
+
+AioContext *aio_context_new(void)
+{
+    AioContext *ctx = aio_context_alloc(false);
+
+    if (aio_context_init_notifier(ctx) < 0) {
+        fprintf(stderr, "failed to create aio context notifier\n");
+        g_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+void aio_context_free(AioContext *ctx)
+{
+    QEMUBH *bh, *next;
+
+    assert(!ctx->is_main);
+    assert(!ctx->active_timers);
+
+    if (ctx->notify_rfd != -1) {
+        aio_set_fd_handler(ctx, ctx->notify_rfd, NULL, NULL, NULL, NULL);
+        close(ctx->notify_rfd);
+        if (ctx->notify_wfd != ctx->notify_rfd) {
+            close(ctx->notify_wfd);
+        }
+    }
+    assert(QLIST_EMPTY(&ctx->aio_handlers));
+
+    for (bh = ctx->first_bh; bh; bh = next) {
+        next = bh->next;
+        g_free(bh);
+    }
+    g_free(ctx);
+}
+
+void aio_notify(AioContext *ctx)
+{
+    uint64_t value = 1;
+    ssize_t ret;
+
+    if (ctx->notify_wfd == -1) {
+        if (ctx->is_main) {
+            qemu_notify_event();
+        }
+        return;
+    }
+
+    do {
+        ret = write(ctx->notify_wfd, &value, sizeof(value));
+    } while (ret == -1 && errno == EINTR);
+
+    /* a full pipe already has a wakeup pending */
+    assert(ret == sizeof(value) || (ret == -1 && errno == EAGAIN));
+}
 
 /***********************************************************/
 /* bottom halves (can be seen as timers which expire ASAP) */
 
+/*
+ * Bottom halves can be created and scheduled from any thread without a
+ * lock.  New BHs are pushed at the head of the list with a compare-and-swap;
+ * only the thread running the context unlinks deleted ones, which is safe
+ * against concurrent pushes as long as it uses a compare-and-swap for the
+ * head too.  A context is notified once per round of aio_bh_poll(), however
+ * many BHs are scheduled in between.
+ */
 struct QEMUBH {
+    AioContext *ctx;
     QEMUBHFunc *cb;
     void *opaque;
     QEMUBH *next;
-    bool scheduled;
+    int scheduled;                  /* updated atomically */
     bool idle;
     bool deleted;
 };
 
-QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque)
+QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
 {
     QEMUBH *bh;
     bh = g_malloc0(sizeof(QEMUBH));
+    bh->ctx = ctx;
     bh->cb = cb;
     bh->opaque = opaque;
-    bh->next = first_bh;
-    first_bh = bh;
+    do {
+        bh->next = ctx->first_bh;
+    } while (!__sync_bool_compare_and_swap(&ctx->first_bh, bh->next, bh));
     return bh;
 }
 
-int qemu_bh_poll(void)
+QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque)
+{
+    return aio_bh_new(qemu_get_aio_context(), cb, opaque);
+}
+
+int aio_bh_poll(AioContext *ctx)
 {
     QEMUBH *bh, **bhp, *next;
     int ret;
-    static int nesting = 0;
 
-    nesting++;
+    ctx->bh_nesting++;
+
+    /* BHs scheduled from now on must notify again; pairs with the
+     * compare-and-swap in qemu_bh_schedule. */
+    ctx->notify_pending = 0;
+    smp_mb();
 
     ret = 0;
-    for (bh = first_bh; bh; bh = next) {
+    for (bh = ctx->first_bh; bh; bh = next) {
         next = bh->next;
-        if (!bh->deleted && bh->scheduled) {
-            bh->scheduled = 0;
+        if (!bh->deleted && bh->scheduled &&
+            __sync_bool_compare_and_swap(&bh->scheduled, 1, 0)) {
             if (!bh->idle)
                 ret = 1;
             bh->idle = 0;
@@ -72,18 +212,25 @@ int qemu_bh_poll(void)
         }
     }
 
-    nesting--;
+    ctx->bh_nesting--;
 
     /* remove deleted bhs */
-    if (!nesting) {
-        bhp = &first_bh;
+    if (!ctx->bh_nesting) {
+        bhp = &ctx->first_bh;
         while (*bhp) {
             bh = *bhp;
-            if (bh->deleted) {
+            if (!bh->deleted) {
+                bhp = &bh->next;
+            } else if (bhp != &ctx->first_bh) {
+                /* other threads only ever change the head */
                 *bhp = bh->next;
                 g_free(bh);
+            } else if (__sync_bool_compare_and_swap(&ctx->first_bh,
+                                                    bh, bh->next)) {
+                g_free(bh);
             } else {
-                bhp = &bh->next;
+                /* a BH was pushed meanwhile, bh is no longer the head */
+                bhp = &ctx->first_bh;
             }
         }
     }
@@ -91,22 +238,37 @@ int qemu_bh_poll(void)
     return ret;
 }
 
+int qemu_bh_poll(void)
+{
+    AioContext *ctx = qemu_get_aio_context();
+
+    aio_run_timers(ctx);
+    return aio_bh_poll(ctx);
+}
+
 void qemu_bh_schedule_idle(QEMUBH *bh)
 {
     if (bh->scheduled)
         return;
-    bh->scheduled = 1;
     bh->idle = 1;
+    __sync_bool_compare_and_swap(&bh->scheduled, 0, 1);
 }
 
 void qemu_bh_schedule(QEMUBH *bh)
 {
+    AioContext *ctx = bh->ctx;
+
     if (bh->scheduled)
         return;
-    bh->scheduled = 1;
     bh->idle = 0;
-    /* stop the currently executing CPU to execute the BH ASAP */
-    qemu_notify_event();
+    if (!__sync_bool_compare_and_swap(&bh->scheduled, 0, 1)) {
+        return;
+    }
+    /* wake up the thread running the context to execute the BH ASAP,
+     * unless an earlier BH already did and it hasn't polled yet */
+    if (__sync_bool_compare_and_swap(&ctx->notify_pending, 0, 1)) {
+        aio_notify(ctx);
+    }
 }
 
 void qemu_bh_cancel(QEMUBH *bh)
@@ -120,11 +282,11 @@ void qemu_bh_delete(QEMUBH *bh)
     bh->deleted = 1;
 }
 
-void qemu_bh_update_timeout(uint32_t *timeout)
+void aio_update_timeout(AioContext *ctx, uint32_t *timeout)
 {
     QEMUBH *bh;
 
-    for (bh = first_bh; bh; bh = bh->next) {
+    for (bh = ctx->first_bh; bh; bh = bh->next) {
         if (!bh->deleted && bh->scheduled) {
             if (bh->idle) {
                 /* idle bottom halves will be polled at least
@@ -134,9 +296,113 @@ void qemu_bh_update_timeout(uint32_t *timeout)
                 /* non-idle bottom halves will be executed
                  * immediately */
                 *timeout = 0;
-                break;
+                return;
             }
         }
     }
+
+    if (ctx->active_timers) {
+        int64_t delta = ctx->active_timers->expire_time - get_clock();
+
+        if (delta <= 0) {
+            *timeout = 0;
+        } else {
+            /* round up, waking up early would only spin */
+            *timeout = MIN(*timeout, (delta + SCALE_MS - 1) / SCALE_MS);
+        }
+    }
+}
+
+void qemu_bh_update_timeout(uint32_t *timeout)
+{
+    aio_update_timeout(qemu_get_aio_context(), timeout);
+}
+
+/***********************************************************/
+/* timers */
+
+struct AioTimer {
+    AioContext *ctx;
+    AioTimerFunc *cb;
+    void *opaque;
+    int64_t expire_time;
+    AioTimer *next;
+};
+
+AioTimer *aio_timer_new(AioContext *ctx, AioTimerFunc *cb, void *opaque)
+{
+    AioTimer *ts = g_malloc0(sizeof(*ts));
+
+    ts->ctx = ctx;
+    ts->cb = cb;
+    ts->opaque = opaque;
+    return ts;
 }
 
+void aio_timer_free(AioTimer *ts)
+{
+    aio_timer_del(ts);
+    g_free(ts);
+}
+
+void aio_timer_del(AioTimer *ts)
+{
+    AioTimer **pt, *t;
+
+    pt = &ts->ctx->active_timers;
+    while ((t = *pt) != NULL) {
+        if (t == ts) {
+            *pt = t->next;
+            break;
+        }
+        pt = &t->next;
+    }
+}
+
+void aio_timer_mod(AioTimer *ts, int64_t expire_time)
+{
+    AioTimer **pt, *t;
+
+    aio_timer_del(ts);
+
+    /* keep the list sorted, the head is the next one to expire */
+    pt = &ts->ctx->active_timers;
+    while ((t = *pt) != NULL && t->expire_time <= expire_time) {
+        pt = &t->next;
+    }
+    ts->expire_time = expire_time;
+    ts->next = *pt;
+    *pt = ts;
+}
+
+bool aio_timer_pending(AioTimer *ts)
+{
+    AioTimer *t;
+
+    for (t = ts->ctx->active_timers; t; t = t->next) {
+        if (t == ts) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int aio_run_timers(AioContext *ctx)
+{
+    AioTimer *ts;
+    int64_t now;
+    int ret = 0;
+
+    if (!ctx->active_timers) {
+        return 0;
+    }
+
+    now = get_clock();
+    while ((ts = ctx->active_timers) != NULL && ts->expire_time <= now) {
+        /* remove the timer before the callback, which may re-arm it */
+        ctx->active_timers = ts->next;
+        ts->cb(ts->opaque);
+        ret++;
+    }
+    return ret;
+}
@@ -1015,7 +1015,7 @@ static int audio_pcm_hw_get_live_out (HWVoiceOut *hw, int *nb_live)
 int audio_pcm_sw_write (SWVoiceOut *sw, void *buf, int size)
 {
     int hwsamples, samples, isamp, osamp, wpos, live, dead, left, swlim, blck;
-    int ret = 0, pos = 0, total = 0;
+    int ret = 0, pos = 0, total = 0, silent = 0;
 
     if (!sw) {
         return size;
@@ -1048,6 +1048,10 @@ int audio_pcm_sw_write (SWVoiceOut *sw, void *buf, int size)
         if (!(sw->hw->ctl_caps & VOICE_VOLUME_CAP)) {
             mixeng_volume (sw->buf, swlim, &sw->vol);
         }
+
+        /* Mixing silence into the hw buffer changes nothing */
+        silent = st_rate_silent (sw->rate) &&
+            mixeng_is_silent (sw->buf, swlim);
     }
 
     while (swlim) {
@@ -1059,13 +1063,24 @@ int audio_pcm_sw_write (SWVoiceOut *sw, void *buf, int size)
         }
         isamp = swlim;
         osamp = blck;
-        st_rate_flow_mix (
-            sw->rate,
-            sw->buf + pos,
-            sw->hw->mix_buf + wpos,
-            &isamp,
-            &osamp
-            );
+        if (silent) {
+            st_rate_flow_skip (
+                sw->rate,
+                sw->buf + pos,
+                sw->hw->mix_buf + wpos,
+                &isamp,
+                &osamp
+                );
+        }
+        else {
+            st_rate_flow_mix (
+                sw->rate,
+                sw->buf + pos,
+                sw->hw->mix_buf + wpos,
+                &isamp,
+                &osamp
+                );
+        }
         ret += isamp;
         swlim -= isamp;
         pos += isamp;
@@ -1123,7 +1138,8 @@ static int audio_is_timer_needed (void)
 static void audio_reset_timer (AudioState *s)
 {
     if (audio_is_timer_needed ()) {
-        qemu_mod_timer (s->ts, qemu_get_clock_ns (vm_clock) + 1);
+        qemu_mod_timer (s->ts,
+                        qemu_get_clock_ns (vm_clock) + conf.period.ticks);
     }
     else {
         qemu_del_timer (s->ts);
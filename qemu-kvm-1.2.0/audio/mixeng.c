@@ -336,6 +336,19 @@ void *st_rate_start (int inrate, int outrate)
 #define OP(a, b) a = b
 #include "rate_template.h"
 
+/* Only advances the positions, for mixing in silence */
+#define NAME st_rate_flow_skip
+#define OP(a, b) (void) (b)
+#include "rate_template.h"
+
+/* Whether the resampler's interpolation history is silence */
+int st_rate_silent (void *opaque)
+{
+    struct rate *rate = opaque;
+
+    return !rate->ilast.l && !rate->ilast.r;
+}
+
 void st_rate_stop (void *opaque)
 {
     g_free (opaque);
@@ -346,6 +359,18 @@ void mixeng_clear (struct st_sample *buf, int len)
     memset (buf, 0, len * sizeof (struct st_sample));
 }
 
+int mixeng_is_silent (const struct st_sample *buf, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        if (buf[i].l || buf[i].r) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 void mixeng_volume (struct st_sample *buf, int len, struct mixeng_volume *vol)
 {
 #ifdef CONFIG_MIXEMU
@@ -354,6 +379,17 @@ void mixeng_volume (struct st_sample *buf, int len, struct mixeng_volume *vol)
         return;
     }
 
+    /* Full volume is the common case and leaves the samples alone */
+#ifdef FLOAT_MIXENG
+    if (vol->l == 1.0 && vol->r == 1.0) {
+        return;
+    }
+#else
+    if (vol->l == 1LL << 32 && vol->r == 1LL << 32) {
+        return;
+    }
+#endif
+
     while (len--) {
 #ifdef FLOAT_MIXENG
         buf->l = buf->l * vol->l;
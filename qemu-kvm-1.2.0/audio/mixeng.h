@@ -44,8 +44,12 @@ void st_rate_flow (void *opaque, struct st_sample *ibuf, struct st_sample *obuf,
                    int *isamp, int *osamp);
 void st_rate_flow_mix (void *opaque, struct st_sample *ibuf, struct st_sample *obuf,
                        int *isamp, int *osamp);
+void st_rate_flow_skip (void *opaque, struct st_sample *ibuf, struct st_sample *obuf,
+                        int *isamp, int *osamp);
+int st_rate_silent (void *opaque);
 void st_rate_stop (void *opaque);
 void mixeng_clear (struct st_sample *buf, int len);
+int mixeng_is_silent (const struct st_sample *buf, int len);
 void mixeng_volume (struct st_sample *buf, int len, struct mixeng_volume *vol);
 
 #endif  /* mixeng.h */
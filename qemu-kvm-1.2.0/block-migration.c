@@ -21,6 +21,8 @@
 #include "block-migration.h"
 #include "migration.h"
 #include "blockdev.h"
+#include "main-loop.h"
+#include "qemu/hbitmap.h"
 #include <assert.h>
 
 #define BLOCK_SIZE (BDRV_SECTORS_PER_DIRTY_CHUNK << BDRV_SECTOR_BITS)
@@ -28,6 +30,7 @@
 #define BLK_MIG_FLAG_DEVICE_BLOCK       0x01
 #define BLK_MIG_FLAG_EOS                0x02
 #define BLK_MIG_FLAG_PROGRESS           0x04
+#define BLK_MIG_FLAG_ZERO_BLOCK         0x08
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
@@ -52,6 +55,7 @@ typedef struct BlkMigDevState {
     int64_t dirty;
     QSIMPLEQ_ENTRY(BlkMigDevState) entry;
     unsigned long *aio_bitmap;
+    BdrvDirtyBitmap *dirty_bitmap;
 } BlkMigDevState;
 
 typedef struct BlkMigBlock {
@@ -87,17 +91,23 @@ static BlkMigState block_mig_state;
 static void blk_send(QEMUFile *f, BlkMigBlock * blk)
 {
     int len;
+    uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
+
+    if (migrate_zero_blocks() && buffer_is_zero(blk->buf, BLOCK_SIZE)) {
+        flags |= BLK_MIG_FLAG_ZERO_BLOCK;
+    }
 
     /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
-                     | BLK_MIG_FLAG_DEVICE_BLOCK);
+    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS) | flags);
 
     /* device name */
     len = strlen(blk->bmds->bs->device_name);
     qemu_put_byte(f, len);
     qemu_put_buffer(f, (uint8_t *)blk->bmds->bs->device_name, len);
 
-    qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+    if (!(flags & BLK_MIG_FLAG_ZERO_BLOCK)) {
+        qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+    }
 }
 
 int blk_mig_active(void)
@@ -253,7 +263,7 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
                                 nr_sectors, blk_mig_read_cb, blk);
     block_mig_state.submitted++;
 
-    bdrv_reset_dirty(bs, cur_sector, nr_sectors);
+    bdrv_reset_dirty_bitmap(bs, bmds->dirty_bitmap, cur_sector, nr_sectors);
     bmds->cur_sector = cur_sector + nr_sectors;
 
     return (bmds->cur_sector >= total_sectors);
@@ -264,7 +274,13 @@ static void set_dirty_tracking(int enable)
     BlkMigDevState *bmds;
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
-        bdrv_set_dirty_tracking(bmds->bs, enable);
+        if (enable) {
+            bmds->dirty_bitmap = bdrv_create_dirty_bitmap(bmds->bs,
+                                                          BLOCK_SIZE);
+        } else if (bmds->dirty_bitmap) {
+            bdrv_release_dirty_bitmap(bmds->bs, bmds->dirty_bitmap);
+            bmds->dirty_bitmap = NULL;
+        }
     }
 }
 
@@ -366,60 +382,65 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
                                  int is_async)
 {
     BlkMigBlock *blk;
+    HBitmapIter hbi;
     int64_t total_sectors = bmds->total_sectors;
     int64_t sector;
     int nr_sectors;
     int ret = -EIO;
 
-    for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
-        if (bmds_aio_inflight(bmds, sector)) {
-            bdrv_drain_all();
-        }
-        if (bdrv_get_dirty(bmds->bs, sector)) {
+    /* Jump straight to the next dirty chunk instead of probing every one */
+    bdrv_dirty_iter_init(bmds->bs, bmds->dirty_bitmap, &hbi, bmds->cur_dirty);
+    sector = hbitmap_iter_next(&hbi);
+    if (sector < 0) {
+        sector = total_sectors;
+    }
+    bmds->cur_dirty = sector;
 
-            if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-                nr_sectors = total_sectors - sector;
-            } else {
-                nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
-            }
-            blk = g_malloc(sizeof(BlkMigBlock));
-            blk->buf = g_malloc(BLOCK_SIZE);
-            blk->bmds = bmds;
-            blk->sector = sector;
-            blk->nr_sectors = nr_sectors;
-
-            if (is_async) {
-                blk->iov.iov_base = blk->buf;
-                blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-                qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
-                if (block_mig_state.submitted == 0) {
-                    block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
-                }
+    if (sector >= total_sectors) {
+        return 1;
+    }
 
-                blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
-                                            nr_sectors, blk_mig_read_cb, blk);
-                block_mig_state.submitted++;
-                bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
-            } else {
-                ret = bdrv_read(bmds->bs, sector, blk->buf, nr_sectors);
-                if (ret < 0) {
-                    goto error;
-                }
-                blk_send(f, blk);
+    if (bmds_aio_inflight(bmds, sector)) {
+        bdrv_drain_all();
+    }
 
-                g_free(blk->buf);
-                g_free(blk);
-            }
+    if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
+        nr_sectors = total_sectors - sector;
+    } else {
+        nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+    }
+    blk = g_malloc(sizeof(BlkMigBlock));
+    blk->buf = g_malloc(BLOCK_SIZE);
+    blk->bmds = bmds;
+    blk->sector = sector;
+    blk->nr_sectors = nr_sectors;
 
-            bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
-            break;
+    if (is_async) {
+        blk->iov.iov_base = blk->buf;
+        blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+
+        if (block_mig_state.submitted == 0) {
+            block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
+        }
+
+        blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
+                                    nr_sectors, blk_mig_read_cb, blk);
+        block_mig_state.submitted++;
+        bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
+    } else {
+        ret = bdrv_read(bmds->bs, sector, blk->buf, nr_sectors);
+        if (ret < 0) {
+            goto error;
         }
-        sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
-        bmds->cur_dirty = sector;
+        blk_send(f, blk);
+
+        g_free(blk->buf);
+        g_free(blk);
     }
 
-    return (bmds->cur_dirty >= bmds->total_sectors);
+    bdrv_reset_dirty_bitmap(bmds->bs, bmds->dirty_bitmap, sector, nr_sectors);
+    return 0;
 
 error:
     DPRINTF("Error reading sector %" PRId64 "\n", sector);
@@ -482,10 +503,10 @@ static int64_t get_remaining_dirty(void)
     int64_t dirty = 0;
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
-        dirty += bdrv_get_dirty_count(bmds->bs);
+        dirty += bdrv_get_dirty_count(bmds->bs, bmds->dirty_bitmap);
     }
 
-    return dirty * BLOCK_SIZE;
+    return dirty << BDRV_SECTOR_BITS;
 }
 
 static int is_stage2_completed(void)
@@ -568,7 +589,9 @@ static int block_save_setup(QEMUFile *f, void *opaque)
     return 0;
 }
 
-static int block_save_iterate(QEMUFile *f, void *opaque)
+/* called from the migration thread, the block layer needs the
+ * iothread lock */
+static int block_save_iterate_locked(QEMUFile *f)
 {
     int ret;
 
@@ -616,6 +639,17 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
     return is_stage2_completed();
 }
 
+static int block_save_iterate(QEMUFile *f, void *opaque)
+{
+    int ret;
+
+    qemu_mutex_lock_iothread();
+    ret = block_save_iterate_locked(f);
+    qemu_mutex_unlock_iothread();
+
+    return ret;
+}
+
 static int block_save_complete(QEMUFile *f, void *opaque)
 {
     int ret;
@@ -704,9 +738,12 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
                 nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
             }
 
-            buf = g_malloc(BLOCK_SIZE);
-
-            qemu_get_buffer(f, buf, BLOCK_SIZE);
+            if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
+                buf = g_malloc0(BLOCK_SIZE);
+            } else {
+                buf = g_malloc(BLOCK_SIZE);
+                qemu_get_buffer(f, buf, BLOCK_SIZE);
+            }
             ret = bdrv_write(bs, addr, buf, nr_sectors);
 
             g_free(buf);
@@ -743,6 +780,24 @@ static void block_set_params(const MigrationParams *params, void *opaque)
     block_mig_state.blk_enable |= params->shared;
 }
 
+static uint64_t block_save_pending(QEMUFile *f, void *opaque,
+                                   uint64_t max_size)
+{
+    BlkMigDevState *bmds;
+    uint64_t pending = get_remaining_dirty();
+
+    /* the bulk phase is not accounted in the dirty count */
+    QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
+        if (!bmds->bulk_completed) {
+            pending += (bmds->total_sectors - bmds->cur_sector) <<
+                       BDRV_SECTOR_BITS;
+        }
+    }
+
+    DPRINTF("Enter save live pending  %" PRIu64 "\n", pending);
+    return pending;
+}
+
 static bool block_is_active(void *opaque)
 {
     return block_mig_state.blk_enable == 1;
@@ -753,6 +808,7 @@ SaveVMHandlers savevm_block_handlers = {
     .save_live_setup = block_save_setup,
     .save_live_iterate = block_save_iterate,
     .save_live_complete = block_save_complete,
+    .save_live_pending = block_save_pending,
     .load_state = block_load,
     .cancel = block_migration_cancel,
     .is_active = block_is_active,
@@ -31,6 +31,8 @@
 #include "qemu-coroutine.h"
 #include "qmp-commands.h"
 #include "qemu-timer.h"
+#include "host-utils.h"
+#include "qemu/hbitmap.h"
 
 #ifdef CONFIG_BSD
 #include <sys/types.h>
@@ -53,9 +55,13 @@
 typedef enum {
     BDRV_REQ_COPY_ON_READ = 0x1,
     BDRV_REQ_ZERO_WRITE   = 0x2,
+    BDRV_REQ_FUA          = 0x4,
+    BDRV_REQ_NO_ALLOC_MAP = 0x8,
 } BdrvRequestFlags;
 
 static void bdrv_dev_change_media_cb(BlockDriverState *bs, bool load);
+static void bdrv_alloc_changed(BlockDriverState *bs, int64_t sector_num,
+                               int64_t nb_sectors);
 static BlockDriverAIOCB *bdrv_aio_readv_em(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque);
@@ -68,6 +74,10 @@ static int coroutine_fn bdrv_co_readv_em(BlockDriverState *bs,
 static int coroutine_fn bdrv_co_writev_em(BlockDriverState *bs,
                                          int64_t sector_num, int nb_sectors,
                                          QEMUIOVector *iov);
+static int coroutine_fn bdrv_co_writev_fua_em(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              int nb_sectors,
+                                              QEMUIOVector *iov);
 static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors, QEMUIOVector *qiov,
     BdrvRequestFlags flags);
@@ -80,17 +90,51 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
                                                int nb_sectors,
                                                BlockDriverCompletionFunc *cb,
                                                void *opaque,
-                                               bool is_write);
+                                               bool is_write,
+                                               BdrvRequestFlags flags);
 static void coroutine_fn bdrv_co_do_rw(void *opaque);
+static int coroutine_fn bdrv_co_do_flush(BlockDriverState *bs,
+                                         unsigned int current_gen);
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors);
+static void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
+                           int nr_sectors);
 
-static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
-        bool is_write, double elapsed_time, uint64_t *wait);
-static bool bdrv_exceed_iops_limits(BlockDriverState *bs, bool is_write,
-        double elapsed_time, uint64_t *wait);
-static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
-        bool is_write, int64_t *wait);
+struct BdrvDirtyBitmap {
+    HBitmap *bitmap;
+    QLIST_ENTRY(BdrvDirtyBitmap) list;
+};
+
+/*
+ * A leaky bucket for one throttling limit.  Every request adds its size to
+ * the level, which drains at the rate of the limit.  Requests may be
+ * dispatched as long as the level is below the burst size.
+ */
+typedef struct LeakyBucket {
+    double avg;             /* drain rate, in bytes or requests per second */
+    double max;             /* burst size, in bytes or requests */
+    double level;
+} LeakyBucket;
+
+enum {
+    THROTTLE_BPS,
+    THROTTLE_OPS,
+};
+
+/*
+ * Drives in the same throttle group share one set of buckets, so that
+ * their combined I/O stays within the limits.  A drive that is not in a
+ * named group has a private one.
+ */
+struct ThrottleGroup {
+    char *name;             /* NULL for a private group */
+    int refcnt;
+    BlockIOLimit limits;
+    LeakyBucket buckets[2][3];
+    int64_t previous_leak;
+    QLIST_HEAD(, BlockDriverState) members;
+    QLIST_ENTRY(ThrottleGroup) list;
+};
 
 static QTAILQ_HEAD(, BlockDriverState) bdrv_states =
     QTAILQ_HEAD_INITIALIZER(bdrv_states);
@@ -98,6 +142,9 @@ static QTAILQ_HEAD(, BlockDriverState) bdrv_states =
 static QLIST_HEAD(, BlockDriver) bdrv_drivers =
     QLIST_HEAD_INITIALIZER(bdrv_drivers);
 
+static QLIST_HEAD(, ThrottleGroup) throttle_groups =
+    QLIST_HEAD_INITIALIZER(throttle_groups);
+
 /* The device to use for VM snapshots */
 static BlockDriverState *bs_snapshots;
 
@@ -125,6 +172,132 @@ int is_windows_drive(const char *filename)
 #endif
 
 /* throttling disk I/O limits */
+static void throttle_group_config(ThrottleGroup *tg, BlockIOLimit *limits)
+{
+    int i;
+
+    tg->limits = *limits;
+    for (i = 0; i < 3; i++) {
+        LeakyBucket *bps = &tg->buckets[THROTTLE_BPS][i];
+        LeakyBucket *ops = &tg->buckets[THROTTLE_OPS][i];
+
+        /* Without an explicit burst size, allow 100ms worth of I/O */
+        bps->avg = limits->bps[i];
+        bps->max = limits->bps_max[i] ? limits->bps_max[i] : bps->avg / 10;
+        ops->avg = limits->iops[i];
+        ops->max = limits->iops_max[i] ? limits->iops_max[i] : ops->avg / 10;
+        bps->level = MIN(bps->level, bps->max);
+        ops->level = MIN(ops->level, ops->max);
+    }
+}
+
+static void throttle_group_leak(ThrottleGroup *tg, int64_t now)
+{
+    double delta;
+    int i, j;
+
+    delta = (now - tg->previous_leak) / NANOSECONDS_PER_SECOND;
+    tg->previous_leak = now;
+    if (delta <= 0) {
+        return;
+    }
+
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < 3; j++) {
+            LeakyBucket *bkt = &tg->buckets[i][j];
+            bkt->level = MAX(bkt->level - bkt->avg * delta, 0);
+        }
+    }
+}
+
+/* Return how many ns a request must wait for, or 0 if it may go now */
+static int64_t throttle_group_wait(ThrottleGroup *tg, bool is_write)
+{
+    int types[] = { is_write, BLOCK_IO_LIMIT_TOTAL };
+    int64_t wait = 0;
+    int i, j;
+
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < ARRAY_SIZE(types); j++) {
+            LeakyBucket *bkt = &tg->buckets[i][types[j]];
+            double extra = bkt->level - bkt->max;
+
+            if (bkt->avg && extra > 0) {
+                /* Round up so that the timer does not fire too early */
+                wait = MAX(wait, extra / bkt->avg * NANOSECONDS_PER_SECOND + 1);
+            }
+        }
+    }
+    return wait;
+}
+
+static void throttle_group_account(ThrottleGroup *tg, bool is_write,
+                                   int64_t bytes)
+{
+    int types[] = { is_write, BLOCK_IO_LIMIT_TOTAL };
+    int j;
+
+    for (j = 0; j < ARRAY_SIZE(types); j++) {
+        LeakyBucket *bps = &tg->buckets[THROTTLE_BPS][types[j]];
+        LeakyBucket *ops = &tg->buckets[THROTTLE_OPS][types[j]];
+
+        if (bps->avg) {
+            bps->level += bytes;
+        }
+        if (ops->avg) {
+            ops->level += 1;
+        }
+    }
+}
+
+static void throttle_group_join(BlockDriverState *bs, const char *name)
+{
+    ThrottleGroup *tg = NULL;
+
+    if (name) {
+        QLIST_FOREACH(tg, &throttle_groups, list) {
+            if (!strcmp(tg->name, name)) {
+                break;
+            }
+        }
+    }
+
+    if (!tg) {
+        /* A new group starts out with the limits of its first drive */
+        tg = g_malloc0(sizeof(*tg));
+        tg->previous_leak = qemu_get_clock_ns(vm_clock);
+        throttle_group_config(tg, &bs->io_limits);
+        QLIST_INIT(&tg->members);
+        if (name) {
+            tg->name = g_strdup(name);
+            QLIST_INSERT_HEAD(&throttle_groups, tg, list);
+        }
+    }
+
+    tg->refcnt++;
+    QLIST_INSERT_HEAD(&tg->members, bs, throttle_list);
+    bs->throttle_group = tg;
+}
+
+static void throttle_group_leave(BlockDriverState *bs)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+
+    if (!tg) {
+        return;
+    }
+
+    QLIST_REMOVE(bs, throttle_list);
+    bs->throttle_group = NULL;
+    if (--tg->refcnt == 0) {
+        if (tg->name) {
+            QLIST_REMOVE(tg, list);
+            g_free(tg->name);
+        }
+        g_free(tg);
+    }
+}
+
 void bdrv_io_limits_disable(BlockDriverState *bs)
 {
     bs->io_limits_enabled = false;
@@ -136,11 +309,6 @@ void bdrv_io_limits_disable(BlockDriverState *bs)
         qemu_free_timer(bs->block_timer);
         bs->block_timer = NULL;
     }
-
-    bs->slice_start = 0;
-    bs->slice_end   = 0;
-    bs->slice_time  = 0;
-    memset(&bs->io_base, 0, sizeof(bs->io_base));
 }
 
 static void bdrv_block_timer(void *opaque)
@@ -154,10 +322,9 @@ void bdrv_io_limits_enable(BlockDriverState *bs)
 {
     qemu_co_queue_init(&bs->throttled_reqs);
     bs->block_timer = qemu_new_timer_ns(vm_clock, bdrv_block_timer, bs);
-    bs->slice_time  = 5 * BLOCK_IO_SLICE_TIME;
-    bs->slice_start = qemu_get_clock_ns(vm_clock);
-    bs->slice_end   = bs->slice_start + bs->slice_time;
-    memset(&bs->io_base, 0, sizeof(bs->io_base));
+    if (!bs->throttle_group) {
+        throttle_group_join(bs, NULL);
+    }
     bs->io_limits_enabled = true;
 }
 
@@ -175,7 +342,8 @@ bool bdrv_io_limits_enabled(BlockDriverState *bs)
 static void bdrv_io_limits_intercept(BlockDriverState *bs,
                                      bool is_write, int nb_sectors)
 {
-    int64_t wait_time = -1;
+    ThrottleGroup *tg;
+    int64_t now, wait_time;
 
     if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
         qemu_co_queue_wait(&bs->throttled_reqs);
@@ -186,14 +354,24 @@ static void bdrv_io_limits_intercept(BlockDriverState *bs,
      * allowed to be serviced. So if the current request still exceeds the
      * limits, it will be inserted to the head. All requests followed it will
      * be still in throttled_reqs queue.
+     *
+     * Other drives of the group may use up the budget while we sleep, so
+     * the wait time is computed again every time the timer fires.
      */
-
-    while (bdrv_exceed_io_limits(bs, nb_sectors, is_write, &wait_time)) {
-        qemu_mod_timer(bs->block_timer,
-                       wait_time + qemu_get_clock_ns(vm_clock));
+    for (;;) {
+        tg = bs->throttle_group;
+        now = qemu_get_clock_ns(vm_clock);
+        throttle_group_leak(tg, now);
+        wait_time = throttle_group_wait(tg, is_write);
+        if (wait_time == 0) {
+            break;
+        }
+        qemu_mod_timer(bs->block_timer, now + wait_time);
         qemu_co_queue_wait_insert_head(&bs->throttled_reqs);
     }
 
+    throttle_group_account(tg, is_write,
+                           (int64_t)nb_sectors * BDRV_SECTOR_SIZE);
     qemu_co_queue_next(&bs->throttled_reqs);
 }
 
@@ -312,6 +490,7 @@ BlockDriverState *bdrv_new(const char *device_name)
         QTAILQ_INSERT_TAIL(&bdrv_states, bs, list);
     }
     bdrv_iostatus_disable(bs);
+    qemu_co_queue_init(&bs->flush_queue);
     return bs;
 }
 
@@ -620,9 +799,46 @@ void bdrv_disable_copy_on_read(BlockDriverState *bs)
     bs->copy_on_read--;
 }
 
+/*
+ * Sizes in bytes of the L2 table, refcount block and decompressed cluster
+ * caches of formats that have them, 0 keeps the format's default.  Takes
+ * effect on the next open.
+ */
+void bdrv_set_cache_sizes(BlockDriverState *bs, uint64_t l2_cache_size,
+                          uint64_t refcount_cache_size,
+                          uint64_t compressed_cache_size)
+{
+    bs->l2_cache_size = l2_cache_size;
+    bs->refcount_cache_size = refcount_cache_size;
+    bs->compressed_cache_size = compressed_cache_size;
+}
+
+/*
+ * Lets formats with a dirty flag skip refcount writes and repair the
+ * refcounts when an image that was not closed cleanly is opened.  Takes
+ * effect on the next open.
+ */
+void bdrv_set_lazy_refcounts(BlockDriverState *bs, bool enable)
+{
+    bs->lazy_refcounts = enable;
+}
+
+/*
+ * Number of requests the host AIO context of the image file can hold, for
+ * protocols that have one, 0 keeps the default.  Takes effect on the next
+ * open.
+ */
+void bdrv_set_aio_queue_depth(BlockDriverState *bs, int depth)
+{
+    bs->aio_queue_depth = depth;
+}
+
 /*
  * Common part for opening disk images and files
  */
+static int bdrv_file_open_common(BlockDriverState **pbs, const char *filename,
+                                 int flags, int aio_queue_depth);
+
 static int bdrv_open_common(BlockDriverState *bs, const char *filename,
     int flags, BlockDriver *drv)
 {
@@ -652,6 +868,7 @@ static int bdrv_open_common(BlockDriverState *bs, const char *filename,
 
     bs->drv = drv;
     bs->opaque = g_malloc0(drv->instance_size);
+    bdrv_alloc_changed(bs, 0, -1);
 
     bs->enable_write_cache = !!(flags & BDRV_O_CACHE_WB);
     open_flags = flags | BDRV_O_CACHE_WB;
@@ -675,7 +892,8 @@ static int bdrv_open_common(BlockDriverState *bs, const char *filename,
     if (drv->bdrv_file_open) {
         ret = drv->bdrv_file_open(bs, filename, open_flags);
     } else {
-        ret = bdrv_file_open(&bs->file, filename, open_flags);
+        ret = bdrv_file_open_common(&bs->file, filename, open_flags,
+                                    bs->aio_queue_depth);
         if (ret >= 0) {
             ret = drv->bdrv_open(bs, open_flags);
         }
@@ -711,10 +929,8 @@ free_and_fail:
     return ret;
 }
 
-/*
- * Opens a file using a protocol (file, host_device, nbd, ...)
- */
-int bdrv_file_open(BlockDriverState **pbs, const char *filename, int flags)
+static int bdrv_file_open_common(BlockDriverState **pbs, const char *filename,
+                                 int flags, int aio_queue_depth)
 {
     BlockDriverState *bs;
     BlockDriver *drv;
@@ -726,6 +942,7 @@ int bdrv_file_open(BlockDriverState **pbs, const char *filename, int flags)
     }
 
     bs = bdrv_new("");
+    bs->aio_queue_depth = aio_queue_depth;
     ret = bdrv_open_common(bs, filename, flags, drv);
     if (ret < 0) {
         bdrv_delete(bs);
@@ -736,6 +953,14 @@ int bdrv_file_open(BlockDriverState **pbs, const char *filename, int flags)
     return 0;
 }
 
+/*
+ * Opens a file using a protocol (file, host_device, nbd, ...)
+ */
+int bdrv_file_open(BlockDriverState **pbs, const char *filename, int flags)
+{
+    return bdrv_file_open_common(pbs, filename, flags, 0);
+}
+
 /*
  * Opens a disk image (raw, qcow2, vmdk, ...)
  */
@@ -886,6 +1111,7 @@ void bdrv_close(BlockDriverState *bs)
             bdrv_delete(bs->backing_hd);
             bs->backing_hd = NULL;
         }
+        bdrv_alloc_changed(bs, 0, -1);
         bs->drv->bdrv_close(bs);
         g_free(bs->opaque);
 #ifdef _WIN32
@@ -997,12 +1223,10 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
 
     bs_dest->enable_write_cache = bs_src->enable_write_cache;
 
-    /* i/o timing parameters */
-    bs_dest->slice_time         = bs_src->slice_time;
-    bs_dest->slice_start        = bs_src->slice_start;
-    bs_dest->slice_end          = bs_src->slice_end;
+    /* i/o throttling */
     bs_dest->io_limits          = bs_src->io_limits;
-    bs_dest->io_base            = bs_src->io_base;
+    bs_dest->throttle_group     = bs_src->throttle_group;
+    bs_dest->throttle_list      = bs_src->throttle_list;
     bs_dest->throttled_reqs     = bs_src->throttled_reqs;
     bs_dest->block_timer        = bs_src->block_timer;
     bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
@@ -1016,8 +1240,7 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     bs_dest->iostatus           = bs_src->iostatus;
 
     /* dirty bitmap */
-    bs_dest->dirty_count        = bs_src->dirty_count;
-    bs_dest->dirty_bitmap       = bs_src->dirty_bitmap;
+    bs_dest->dirty_bitmaps      = bs_src->dirty_bitmaps;
 
     /* job */
     bs_dest->in_use             = bs_src->in_use;
@@ -1047,12 +1270,13 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
 
     /* bs_new must be anonymous and shouldn't have anything fancy enabled */
     assert(bs_new->device_name[0] == '\0');
-    assert(bs_new->dirty_bitmap == NULL);
+    assert(QLIST_EMPTY(&bs_new->dirty_bitmaps));
     assert(bs_new->job == NULL);
     assert(bs_new->dev == NULL);
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
     assert(bs_new->block_timer == NULL);
+    assert(bs_new->throttle_group == NULL);
 
     tmp = *bs_new;
     *bs_new = *bs_old;
@@ -1073,6 +1297,16 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(bs_new->io_limits_enabled == false);
     assert(bs_new->block_timer == NULL);
 
+    /* The flush queues are not in use, but their heads point to
+     * themselves and must not move with the rest of the contents */
+    assert(!bs_new->active_flush_req && !bs_old->active_flush_req);
+    qemu_co_queue_init(&bs_new->flush_queue);
+    qemu_co_queue_init(&bs_old->flush_queue);
+
+    /* the maps name the BlockDriverStates that just changed contents */
+    bdrv_alloc_changed(bs_new, 0, -1);
+    bdrv_alloc_changed(bs_old, 0, -1);
+
     bdrv_rebind(bs_new);
     bdrv_rebind(bs_old);
 }
@@ -1102,6 +1336,56 @@ void bdrv_append(BlockDriverState *bs_new, BlockDriverState *bs_top)
             bs_new->drv ? bs_new->drv->format_name : "");
 }
 
+/*
+ * Reopen the image file behind bs with different flags, typically to make
+ * a read-only backing file writable for the duration of a block job.
+ *
+ * The image is opened a second time and the new contents are swapped into
+ * bs, so every pointer to bs stays valid.  The backing chain of bs is not
+ * touched.
+ */
+int bdrv_reopen(BlockDriverState *bs, int flags)
+{
+    BlockDriverState *bs_new, *backing_hd;
+    int ret;
+
+    flags |= BDRV_O_NO_BACKING;
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    }
+    if ((bs->open_flags | BDRV_O_NO_BACKING) == flags) {
+        return 0;
+    }
+
+    bdrv_drain_all();
+    ret = bdrv_flush(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bs_new = bdrv_new("");
+    bdrv_set_cache_sizes(bs_new, bs->l2_cache_size, bs->refcount_cache_size,
+                         bs->compressed_cache_size);
+    bdrv_set_lazy_refcounts(bs_new, bs->lazy_refcounts);
+    bdrv_set_aio_queue_depth(bs_new, bs->aio_queue_depth);
+    ret = bdrv_open(bs_new, bs->filename, flags, bs->drv);
+    if (ret < 0) {
+        bdrv_delete(bs_new);
+        return ret;
+    }
+
+    backing_hd = bs->backing_hd;
+    bs->backing_hd = NULL;
+    bdrv_swap(bs_new, bs);
+    bs->backing_hd = backing_hd;
+
+    /* open_flags stay with the device, update them by hand */
+    bs->open_flags = flags & ~BDRV_O_NO_BACKING;
+
+    bdrv_delete(bs_new);
+    return 0;
+}
+
 void bdrv_delete(BlockDriverState *bs)
 {
     assert(!bs->dev);
@@ -1112,6 +1396,7 @@ void bdrv_delete(BlockDriverState *bs)
     bdrv_make_anon(bs);
 
     bdrv_close(bs);
+    throttle_group_leave(bs);
 
     assert(bs != bs_snapshots);
     g_free(bs);
@@ -1349,6 +1634,7 @@ int bdrv_commit(BlockDriverState *bs)
 
     if (drv->bdrv_make_empty) {
         ret = drv->bdrv_make_empty(bs);
+        bdrv_alloc_changed(bs, 0, -1);
         bdrv_flush(bs);
     }
 
@@ -1412,6 +1698,7 @@ struct BdrvTrackedRequest {
  */
 static void tracked_request_end(BdrvTrackedRequest *req)
 {
+    req->bs->in_flight--;
     QLIST_REMOVE(req, list);
     qemu_co_queue_restart_all(&req->wait_queue);
 }
@@ -1435,6 +1722,10 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
     qemu_co_queue_init(&req->wait_queue);
 
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+
+    if (++bs->in_flight > bs->max_in_flight) {
+        bs->max_in_flight = bs->in_flight;
+    }
 }
 
 /**
@@ -1658,36 +1949,6 @@ int bdrv_read_unthrottled(BlockDriverState *bs, int64_t sector_num,
     return ret;
 }
 
-#define BITS_PER_LONG  (sizeof(unsigned long) * 8)
-
-static void set_dirty_bitmap(BlockDriverState *bs, int64_t sector_num,
-                             int nb_sectors, int dirty)
-{
-    int64_t start, end;
-    unsigned long val, idx, bit;
-
-    start = sector_num / BDRV_SECTORS_PER_DIRTY_CHUNK;
-    end = (sector_num + nb_sectors - 1) / BDRV_SECTORS_PER_DIRTY_CHUNK;
-
-    for (; start <= end; start++) {
-        idx = start / BITS_PER_LONG;
-        bit = start % BITS_PER_LONG;
-        val = bs->dirty_bitmap[idx];
-        if (dirty) {
-            if (!(val & (1UL << bit))) {
-                bs->dirty_count++;
-                val |= 1UL << bit;
-            }
-        } else {
-            if (val & (1UL << bit)) {
-                bs->dirty_count--;
-                val &= ~(1UL << bit);
-            }
-        }
-        bs->dirty_bitmap[idx] = val;
-    }
-}
-
 /* Return < 0 if error. Important errors are:
   -EIO         generic I/O error (may happen for all errors)
   -ENOMEDIUM   No media inserted.
@@ -1866,6 +2127,7 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
         ret = drv->bdrv_co_writev(bs, cluster_sector_num, cluster_nb_sectors,
                                   &bounce_qiov);
     }
+    bdrv_alloc_changed(bs, cluster_sector_num, cluster_nb_sectors);
 
     if (ret < 0) {
         /* It might be okay to ignore write errors for guest requests.  If this
@@ -1884,6 +2146,318 @@ err:
     return ret;
 }
 
+/*
+ * Allocation map
+ *
+ * Reading a range that is unallocated in an image with a long backing chain
+ * makes every layer look up its own metadata before the read reaches the
+ * layer that has the data.  Images with at least two backing files keep a
+ * map of extents instead, each telling which layer a range of sectors is
+ * read from, so that a read goes straight to that layer.
+ *
+ * A write or discard on an image drops the extents it overlaps from the
+ * image's own map and gives the image a new alloc_gen.  The map remembers
+ * the layers below and their alloc_gen, and is thrown away when any of them
+ * differ, e.g. after a write to a backing file or a change of the chain.
+ */
+
+/* is_allocated queries ask for this many sectors to get long extents */
+#define BDRV_ALLOC_MAP_QUERY        (1 << 21)
+#define BDRV_ALLOC_MAP_MAX_EXTENTS  4096
+
+typedef struct BdrvAllocExtent {
+    int64_t start;
+    int64_t len;
+    BlockDriverState *owner;    /* layer read from, NULL if none */
+    bool zero;                  /* reads as zeroes */
+} BdrvAllocExtent;
+
+typedef struct BdrvAllocMap BdrvAllocMap;
+
+struct BdrvAllocMap {
+    GTree *extents;
+    unsigned int nr_extents;
+
+    /* the backing chain the extents are valid for */
+    int depth;
+    BlockDriverState **layers;
+    uint64_t *gens;
+};
+
+/* source of alloc_gen values, never reused for another image */
+static uint64_t bdrv_alloc_gen_counter;
+
+static gint bdrv_alloc_extent_cmp(gconstpointer a, gconstpointer b,
+                                  gpointer opaque)
+{
+    const BdrvAllocExtent *ea = a, *eb = b;
+
+    return ea->start < eb->start ? -1 : ea->start > eb->start;
+}
+
+/* Search function for the extent overlapping the range DATA */
+static gint bdrv_alloc_extent_search(gconstpointer key, gconstpointer data)
+{
+    const BdrvAllocExtent *e = key, *range = data;
+
+    if (e->start + e->len <= range->start) {
+        return 1;
+    } else if (e->start >= range->start + range->len) {
+        return -1;
+    }
+    return 0;
+}
+
+static BdrvAllocExtent *bdrv_alloc_map_find(BdrvAllocMap *map,
+                                            int64_t sector_num, int64_t len)
+{
+    BdrvAllocExtent range = { .start = sector_num, .len = len };
+
+    return g_tree_search(map->extents, bdrv_alloc_extent_search, &range);
+}
+
+static void bdrv_alloc_map_drop(BdrvAllocMap *map, int64_t sector_num,
+                                int64_t len)
+{
+    BdrvAllocExtent *e;
+
+    while ((e = bdrv_alloc_map_find(map, sector_num, len)) != NULL) {
+        g_tree_remove(map->extents, e);
+        map->nr_extents--;
+    }
+}
+
+static void bdrv_alloc_map_free(BlockDriverState *bs)
+{
+    BdrvAllocMap *map = bs->alloc_map;
+
+    if (map) {
+        g_tree_destroy(map->extents);
+        g_free(map->layers);
+        g_free(map->gens);
+        g_free(map);
+        bs->alloc_map = NULL;
+    }
+}
+
+/*
+ * Called whenever what BS reads from where may have changed in
+ * [sector_num, sector_num + nb_sectors), or anywhere if nb_sectors is -1.
+ */
+static void bdrv_alloc_changed(BlockDriverState *bs, int64_t sector_num,
+                               int64_t nb_sectors)
+{
+    bs->alloc_gen = ++bdrv_alloc_gen_counter;
+    if (nb_sectors < 0) {
+        bdrv_alloc_map_free(bs);
+    } else if (bs->alloc_map) {
+        bdrv_alloc_map_drop(bs->alloc_map, sector_num, nb_sectors);
+    }
+}
+
+static bool bdrv_alloc_map_enabled(BlockDriverState *bs)
+{
+    return bs->drv->bdrv_co_is_allocated && bs->backing_hd &&
+           bs->backing_hd->backing_hd;
+}
+
+/* The map of BS, emptied first if the chain below BS has changed */
+static BdrvAllocMap *bdrv_alloc_map_get(BlockDriverState *bs)
+{
+    BdrvAllocMap *map = bs->alloc_map;
+    BlockDriverState *layer;
+    int i;
+
+    if (map) {
+        layer = bs->backing_hd;
+        for (i = 0; i < map->depth && layer; i++) {
+            if (map->layers[i] != layer || map->gens[i] != layer->alloc_gen) {
+                break;
+            }
+            layer = layer->backing_hd;
+        }
+        if (i == map->depth && !layer) {
+            return map;
+        }
+        bdrv_alloc_map_free(bs);
+    }
+
+    map = g_malloc0(sizeof(*map));
+    map->extents = g_tree_new_full(bdrv_alloc_extent_cmp, NULL, g_free, NULL);
+    for (layer = bs->backing_hd; layer; layer = layer->backing_hd) {
+        map->depth++;
+    }
+    map->layers = g_new(BlockDriverState *, map->depth);
+    map->gens = g_new(uint64_t, map->depth);
+    for (i = 0, layer = bs->backing_hd; layer; i++, layer = layer->backing_hd) {
+        map->layers[i] = layer;
+        map->gens[i] = layer->alloc_gen;
+    }
+    bs->alloc_map = map;
+    return map;
+}
+
+/* Sum of alloc_gen over BS and its backing chain; grows on every change */
+static uint64_t bdrv_chain_alloc_gen(BlockDriverState *bs)
+{
+    uint64_t gen = 0;
+
+    for (; bs; bs = bs->backing_hd) {
+        gen += bs->alloc_gen;
+    }
+    return gen;
+}
+
+/* Walk down the chain to find which layer SECTOR_NUM is read from */
+static int coroutine_fn bdrv_alloc_map_fill(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            BdrvAllocExtent *e)
+{
+    BlockDriverState *layer;
+    int n = MIN(BDRV_ALLOC_MAP_QUERY, bs->total_sectors - sector_num);
+    int pnum, ret;
+
+    e->start = sector_num;
+    e->owner = NULL;
+    e->zero = true;
+
+    for (layer = bs; layer; layer = layer->backing_hd) {
+        if (sector_num >= layer->total_sectors) {
+            /* the layer above reads zeroes past the end of a short backing
+             * file */
+            e->owner = layer;
+            break;
+        }
+
+        ret = bdrv_co_is_allocated(layer, sector_num, n, &pnum);
+        if (ret < 0) {
+            return ret;
+        } else if (pnum == 0) {
+            return -EIO;
+        }
+        n = MIN(n, pnum);
+        if (ret) {
+            e->owner = layer;
+            e->zero = false;
+            break;
+        }
+    }
+
+    e->len = n;
+    return 0;
+}
+
+/*
+ * Find the layer of the chain of BS that SECTOR_NUM is read from.  *PNUM is
+ * set to the number of sectors, at most NB_SECTORS, that are read from the
+ * same place.  *ZERO is set if they read as zeroes, either because nothing
+ * in the chain has them (*OWNER is NULL) or because they are past the end of
+ * *OWNER.
+ */
+static int coroutine_fn bdrv_alloc_map_lookup(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, BlockDriverState **owner, bool *zero,
+    int *pnum)
+{
+    BdrvAllocMap *map = bdrv_alloc_map_get(bs);
+    BdrvAllocExtent *e, *next;
+    int64_t end = sector_num + nb_sectors;
+    int64_t pos;
+    uint64_t gen;
+    int ret;
+
+    e = bdrv_alloc_map_find(map, sector_num, 1);
+    if (!e) {
+        e = g_malloc(sizeof(*e));
+        gen = bdrv_chain_alloc_gen(bs);
+        ret = bdrv_alloc_map_fill(bs, sector_num, e);
+        if (ret < 0) {
+            g_free(e);
+            return ret;
+        }
+
+        *owner = e->owner;
+        *zero = e->zero;
+        *pnum = MIN(e->len, nb_sectors);
+
+        /* the lookups may have yielded, and the result is only worth
+         * keeping if nothing changed meanwhile */
+        if (gen != bdrv_chain_alloc_gen(bs)) {
+            g_free(e);
+            return 0;
+        }
+        map = bdrv_alloc_map_get(bs);
+        bdrv_alloc_map_drop(map, e->start, e->len);
+        if (map->nr_extents == BDRV_ALLOC_MAP_MAX_EXTENTS) {
+            bdrv_alloc_map_drop(map, 0, INT64_MAX);
+        }
+        g_tree_insert(map->extents, e, e);
+        map->nr_extents++;
+        return 0;
+    }
+
+    *owner = e->owner;
+    *zero = e->zero;
+
+    /* merge the following extents that are read from the same place */
+    pos = e->start + e->len;
+    while (pos < end) {
+        next = bdrv_alloc_map_find(map, pos, 1);
+        if (!next || next->owner != e->owner || next->zero != e->zero) {
+            break;
+        }
+        pos = next->start + next->len;
+    }
+
+    *pnum = MIN(pos, end) - sector_num;
+    return 0;
+}
+
+/* Read from the layers that hold the data, as told by the allocation map */
+static int coroutine_fn bdrv_co_chain_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    BlockDriverState *owner;
+    QEMUIOVector sub_qiov;
+    size_t offset = 0;
+    bool zero;
+    int n, ret = 0;
+
+    qemu_iovec_init(&sub_qiov, qiov->niov);
+    while (nb_sectors > 0) {
+        ret = bdrv_alloc_map_lookup(bs, sector_num, nb_sectors,
+                                    &owner, &zero, &n);
+        if (ret < 0) {
+            break;
+        }
+
+        if (n == nb_sectors && owner == bs && !zero) {
+            /* the common case, everything is in BS itself */
+            ret = bs->drv->bdrv_co_readv(bs, sector_num, n, qiov);
+            break;
+        }
+
+        qemu_iovec_reset(&sub_qiov);
+        qemu_iovec_concat(&sub_qiov, qiov, offset, n * BDRV_SECTOR_SIZE);
+        if (zero) {
+            qemu_iovec_memset(&sub_qiov, 0, 0, n * BDRV_SECTOR_SIZE);
+        } else if (owner == bs) {
+            ret = bs->drv->bdrv_co_readv(bs, sector_num, n, &sub_qiov);
+        } else {
+            ret = bdrv_co_do_readv(owner, sector_num, n, &sub_qiov,
+                                   BDRV_REQ_NO_ALLOC_MAP);
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        offset += n * BDRV_SECTOR_SIZE;
+    }
+    qemu_iovec_destroy(&sub_qiov);
+    return ret;
+}
+
 /*
  * Handle a read request in coroutine context
  */
@@ -1934,7 +2508,12 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
         }
     }
 
-    ret = drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    if (!(flags & (BDRV_REQ_COPY_ON_READ | BDRV_REQ_NO_ALLOC_MAP)) &&
+        bdrv_alloc_map_enabled(bs)) {
+        ret = bdrv_co_chain_readv(bs, sector_num, nb_sectors, qiov);
+    } else {
+        ret = drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    }
 
 out:
     tracked_request_end(&req);
@@ -2026,19 +2605,31 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
 
     tracked_request_begin(&req, bs, sector_num, nb_sectors, true);
 
-    if (flags & BDRV_REQ_ZERO_WRITE) {
+    /* With the write cache disabled every write behaves as if FUA was set */
+    if (!bs->enable_write_cache) {
+        flags |= BDRV_REQ_FUA;
+    }
+
+    if (flags & BDRV_REQ_ZERO_WRITE) {
         ret = bdrv_co_do_write_zeroes(bs, sector_num, nb_sectors);
+    } else if ((flags & BDRV_REQ_FUA) && drv->bdrv_aio_writev_fua &&
+               !(bs->open_flags & BDRV_O_NO_FLUSH)) {
+        /* The driver makes the data stable without a separate flush */
+        ret = bdrv_co_writev_fua_em(bs, sector_num, nb_sectors, qiov);
+        flags &= ~BDRV_REQ_FUA;
     } else {
         ret = drv->bdrv_co_writev(bs, sector_num, nb_sectors, qiov);
     }
 
-    if (ret == 0 && !bs->enable_write_cache) {
+    if (ret == 0) {
+        bs->write_gen++;
+    }
+    bdrv_alloc_changed(bs, sector_num, nb_sectors);
+    if (ret == 0 && (flags & BDRV_REQ_FUA)) {
         ret = bdrv_co_flush(bs);
     }
 
-    if (bs->dirty_bitmap) {
-        set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
-    }
+    bdrv_set_dirty(bs, sector_num, nb_sectors);
 
     if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
         bs->wr_highest_sector = sector_num + nb_sectors - 1;
@@ -2082,6 +2673,7 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
     if (bdrv_in_use(bs))
         return -EBUSY;
     ret = drv->bdrv_truncate(bs, offset);
+    bdrv_alloc_changed(bs, 0, -1);
     if (ret == 0) {
         ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
         bdrv_dev_resize_cb(bs);
@@ -2137,12 +2729,66 @@ void bdrv_get_geometry(BlockDriverState *bs, uint64_t *nb_sectors_ptr)
     *nb_sectors_ptr = length;
 }
 
-/* throttling disk io limits */
+/* Start or stop throttling bs according to bs->io_limits */
+static void bdrv_io_limits_update(BlockDriverState *bs)
+{
+    bool enabled = bdrv_io_limits_enabled(bs);
+
+    if (!bs->drv) {
+        /* bdrv_open() enables throttling */
+        bs->io_limits_enabled = enabled;
+    } else if (enabled && !bs->io_limits_enabled) {
+        bdrv_io_limits_enable(bs);
+    } else if (!enabled && bs->io_limits_enabled) {
+        bdrv_io_limits_disable(bs);
+    } else if (bs->block_timer) {
+        /* Let throttled requests check the new limits */
+        qemu_mod_timer(bs->block_timer, qemu_get_clock_ns(vm_clock));
+    }
+}
+
+/* throttling disk io limits, shared by all drives of the throttle group */
 void bdrv_set_io_limits(BlockDriverState *bs,
                         BlockIOLimit *io_limits)
 {
-    bs->io_limits = *io_limits;
-    bs->io_limits_enabled = bdrv_io_limits_enabled(bs);
+    BlockDriverState *member;
+
+    if (!bs->throttle_group) {
+        bs->io_limits = *io_limits;
+        throttle_group_join(bs, NULL);
+    }
+
+    throttle_group_leak(bs->throttle_group, qemu_get_clock_ns(vm_clock));
+    throttle_group_config(bs->throttle_group, io_limits);
+    QLIST_FOREACH(member, &bs->throttle_group->members, throttle_list) {
+        member->io_limits = *io_limits;
+        bdrv_io_limits_update(member);
+    }
+}
+
+/*
+ * Move bs to the throttle group called name, creating it if needed, or
+ * to a private group if name is NULL.  bs takes the limits of an existing
+ * group; a new group takes the limits of bs.
+ */
+void bdrv_set_io_limits_group(BlockDriverState *bs, const char *name)
+{
+    const char *old = bdrv_get_io_limits_group(bs);
+
+    if (bs->throttle_group && (old == name ||
+                               (old && name && !strcmp(old, name)))) {
+        return;
+    }
+
+    throttle_group_leave(bs);
+    throttle_group_join(bs, name);
+    bs->io_limits = bs->throttle_group->limits;
+    bdrv_io_limits_update(bs);
+}
+
+const char *bdrv_get_io_limits_group(BlockDriverState *bs)
+{
+    return bs->throttle_group ? bs->throttle_group->name : NULL;
 }
 
 void bdrv_set_on_error(BlockDriverState *bs, BlockErrorAction on_read_error,
@@ -2295,6 +2941,7 @@ int bdrv_has_zero_init(BlockDriverState *bs)
 
 typedef struct BdrvCoIsAllocatedData {
     BlockDriverState *bs;
+    BlockDriverState *base;
     int64_t sector_num;
     int nb_sectors;
     int *pnum;
@@ -2396,6 +3043,24 @@ int coroutine_fn bdrv_co_is_allocated_above(BlockDriverState *top,
     BlockDriverState *intermediate;
     int ret, n = nb_sectors;
 
+    if (bdrv_alloc_map_enabled(top) && sector_num < top->total_sectors) {
+        BlockDriverState *owner;
+        bool zero;
+
+        ret = bdrv_alloc_map_lookup(top, sector_num, nb_sectors,
+                                    &owner, &zero, pnum);
+        if (ret < 0) {
+            return ret;
+        }
+        for (intermediate = top; intermediate && intermediate != base;
+             intermediate = intermediate->backing_hd) {
+            if (intermediate == owner) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
     intermediate = top;
     while (intermediate && intermediate != base) {
         int pnum_inter;
@@ -2413,8 +3078,12 @@ int coroutine_fn bdrv_co_is_allocated_above(BlockDriverState *top,
          * might have
          *
          * [sector_num+x, nr_sectors] allocated.
+         *
+         * Nothing is allocated past the end of a shorter backing file, so
+         * pnum_inter stopping there doesn't limit n.
          */
-        if (n > pnum_inter) {
+        if (n > pnum_inter &&
+            sector_num + pnum_inter < intermediate->total_sectors) {
             n = pnum_inter;
         }
 
@@ -2425,6 +3094,69 @@ int coroutine_fn bdrv_co_is_allocated_above(BlockDriverState *top,
     return 0;
 }
 
+/*
+ * Lets the driver queue the requests that follow until bdrv_io_unplug()
+ * and submit them together.  Formats pass this on to their image file.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
+/* Coroutine wrapper for bdrv_is_allocated_above() */
+static void coroutine_fn bdrv_is_allocated_above_co_entry(void *opaque)
+{
+    BdrvCoIsAllocatedData *data = opaque;
+
+    data->ret = bdrv_co_is_allocated_above(data->bs, data->base,
+                                           data->sector_num, data->nb_sectors,
+                                           data->pnum);
+    data->done = true;
+}
+
+/*
+ * Synchronous wrapper around bdrv_co_is_allocated_above().
+ *
+ * See bdrv_co_is_allocated_above() for details.
+ */
+int bdrv_is_allocated_above(BlockDriverState *top, BlockDriverState *base,
+                            int64_t sector_num, int nb_sectors, int *pnum)
+{
+    Coroutine *co;
+    BdrvCoIsAllocatedData data = {
+        .bs = top,
+        .base = base,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .pnum = pnum,
+        .done = false,
+    };
+
+    co = qemu_coroutine_create(bdrv_is_allocated_above_co_entry);
+    qemu_coroutine_enter(co, &data);
+    while (!data.done) {
+        qemu_aio_wait();
+    }
+    return data.ret;
+}
+
 BlockInfoList *qmp_query_block(Error **errp)
 {
     BlockInfoList *head = NULL, *cur_item = NULL;
@@ -2457,6 +3189,7 @@ BlockInfoList *qmp_query_block(Error **errp)
             info->value->inserted->drv = g_strdup(bs->drv->format_name);
             info->value->inserted->encrypted = bs->encrypted;
             info->value->inserted->encryption_key_missing = bdrv_key_required(bs);
+            info->value->inserted->write_cache = bdrv_enable_write_cache(bs);
             if (bs->backing_file[0]) {
                 info->value->inserted->has_backing_file = true;
                 info->value->inserted->backing_file = g_strdup(bs->backing_file);
@@ -2478,6 +3211,37 @@ BlockInfoList *qmp_query_block(Error **errp)
                                bs->io_limits.iops[BLOCK_IO_LIMIT_READ];
                 info->value->inserted->iops_wr =
                                bs->io_limits.iops[BLOCK_IO_LIMIT_WRITE];
+
+                info->value->inserted->bps_max =
+                               bs->io_limits.bps_max[BLOCK_IO_LIMIT_TOTAL];
+                info->value->inserted->has_bps_max =
+                               info->value->inserted->bps_max != 0;
+                info->value->inserted->bps_rd_max =
+                               bs->io_limits.bps_max[BLOCK_IO_LIMIT_READ];
+                info->value->inserted->has_bps_rd_max =
+                               info->value->inserted->bps_rd_max != 0;
+                info->value->inserted->bps_wr_max =
+                               bs->io_limits.bps_max[BLOCK_IO_LIMIT_WRITE];
+                info->value->inserted->has_bps_wr_max =
+                               info->value->inserted->bps_wr_max != 0;
+                info->value->inserted->iops_max =
+                               bs->io_limits.iops_max[BLOCK_IO_LIMIT_TOTAL];
+                info->value->inserted->has_iops_max =
+                               info->value->inserted->iops_max != 0;
+                info->value->inserted->iops_rd_max =
+                               bs->io_limits.iops_max[BLOCK_IO_LIMIT_READ];
+                info->value->inserted->has_iops_rd_max =
+                               info->value->inserted->iops_rd_max != 0;
+                info->value->inserted->iops_wr_max =
+                               bs->io_limits.iops_max[BLOCK_IO_LIMIT_WRITE];
+                info->value->inserted->has_iops_wr_max =
+                               info->value->inserted->iops_wr_max != 0;
+            }
+
+            if (bdrv_get_io_limits_group(bs)) {
+                info->value->inserted->has_group = true;
+                info->value->inserted->group =
+                    g_strdup(bdrv_get_io_limits_group(bs));
             }
         }
 
@@ -2493,6 +3257,28 @@ BlockInfoList *qmp_query_block(Error **errp)
     return head;
 }
 
+static BlockLatencyBucketList *qmp_query_latency_hist(const uint64_t *hist)
+{
+    BlockLatencyBucketList *head = NULL, **tail = &head;
+    int i;
+
+    /* Only report buckets that have seen requests */
+    for (i = 0; i < BDRV_LATENCY_BUCKETS; i++) {
+        BlockLatencyBucketList *entry;
+
+        if (!hist[i]) {
+            continue;
+        }
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->limit_us = 2ULL << i;
+        entry->value->count = hist[i];
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
 /* Consider exposing this as a full fledged QMP command */
 static BlockStats *qmp_query_blockstat(const BlockDriverState *bs, Error **errp)
 {
@@ -2515,6 +3301,24 @@ static BlockStats *qmp_query_blockstat(const BlockDriverState *bs, Error **errp)
     s->stats->wr_total_time_ns = bs->total_time_ns[BDRV_ACCT_WRITE];
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
+    s->stats->rd_merged = bs->nr_merged[BDRV_ACCT_READ];
+    s->stats->wr_merged = bs->nr_merged[BDRV_ACCT_WRITE];
+    s->stats->in_flight = bs->in_flight;
+    s->stats->max_in_flight = bs->max_in_flight;
+
+    s->stats->rd_latency = qmp_query_latency_hist(
+        bs->latency_hist[BDRV_ACCT_READ]);
+    s->stats->has_rd_latency = s->stats->rd_latency != NULL;
+    s->stats->wr_latency = qmp_query_latency_hist(
+        bs->latency_hist[BDRV_ACCT_WRITE]);
+    s->stats->has_wr_latency = s->stats->wr_latency != NULL;
+    s->stats->flush_latency = qmp_query_latency_hist(
+        bs->latency_hist[BDRV_ACCT_FLUSH]);
+    s->stats->has_flush_latency = s->stats->flush_latency != NULL;
+
+    if (bs->drv && bs->drv->bdrv_get_cache_stats) {
+        bs->drv->bdrv_get_cache_stats(bs, s->stats);
+    }
 
     if (bs->file) {
         s->has_parent = true;
@@ -2572,9 +3376,8 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return -EIO;
 
-    if (bs->dirty_bitmap) {
-        set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
-    }
+    bdrv_set_dirty(bs, sector_num, nb_sectors);
+    bdrv_alloc_changed(bs, sector_num, nb_sectors);
 
     return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
 }
@@ -2692,6 +3495,7 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
 
     if (!drv)
         return -ENOMEDIUM;
+    bdrv_alloc_changed(bs, 0, -1);
     if (drv->bdrv_snapshot_goto)
         return drv->bdrv_snapshot_goto(bs, snapshot_id);
 
@@ -2769,6 +3573,19 @@ BlockDriverState *bdrv_find_backing_image(BlockDriverState *bs,
     return NULL;
 }
 
+/*
+ * Return the image in the chain of active whose backing file is bs, or NULL
+ * if bs is active itself or not part of its chain.
+ */
+BlockDriverState *bdrv_find_overlay(BlockDriverState *active,
+                                    BlockDriverState *bs)
+{
+    while (active && active->backing_hd != bs) {
+        active = active->backing_hd;
+    }
+    return active;
+}
+
 int bdrv_get_backing_file_depth(BlockDriverState *bs)
 {
     if (!bs->drv) {
@@ -2865,7 +3682,7 @@ BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
     trace_bdrv_aio_readv(bs, sector_num, nb_sectors, opaque);
 
     return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
-                                 cb, opaque, false);
+                                 cb, opaque, false, 0);
 }
 
 BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
@@ -2875,7 +3692,22 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
     trace_bdrv_aio_writev(bs, sector_num, nb_sectors, opaque);
 
     return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
-                                 cb, opaque, true);
+                                 cb, opaque, true, 0);
+}
+
+/*
+ * Like bdrv_aio_writev(), but the data is on stable storage when the
+ * request completes, even if the write cache is enabled.
+ */
+BlockDriverAIOCB *bdrv_aio_writev_fua(BlockDriverState *bs, int64_t sector_num,
+                                      QEMUIOVector *qiov, int nb_sectors,
+                                      BlockDriverCompletionFunc *cb,
+                                      void *opaque)
+{
+    trace_bdrv_aio_writev(bs, sector_num, nb_sectors, opaque);
+
+    return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
+                                 cb, opaque, true, BDRV_REQ_FUA);
 }
 
 
@@ -2940,9 +3772,12 @@ static int multiwrite_req_compare(const void *a, const void *b)
 /*
  * Takes a bunch of requests and tries to merge them. Returns the number of
  * requests that remain after merging.
+ *
+ * Writes are merged when they are sequential or overlap, reads only when
+ * they are exactly sequential because each of them needs all of its data.
  */
 static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
-    int num_reqs, MultiwriteCB *mcb)
+    int num_reqs, MultiwriteCB *mcb, bool is_write)
 {
     int i, outidx;
 
@@ -2957,7 +3792,8 @@ static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
         int64_t oldreq_last = reqs[outidx].sector + reqs[outidx].nb_sectors;
 
         // Handle exactly sequential writes and overlapping writes.
-        if (reqs[i].sector <= oldreq_last) {
+        if (reqs[i].sector == oldreq_last ||
+            (is_write && reqs[i].sector < oldreq_last)) {
             merge = 1;
         }
 
@@ -2994,29 +3830,19 @@ static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
         }
     }
 
+    bs->nr_merged[is_write ? BDRV_ACCT_WRITE : BDRV_ACCT_READ] +=
+        num_reqs - (outidx + 1);
+
     return outidx + 1;
 }
 
-/*
- * Submit multiple AIO write requests at once.
- *
- * On success, the function returns 0 and all requests in the reqs array have
- * been submitted. In error case this function returns -1, and any of the
- * requests may or may not be submitted yet. In particular, this means that the
- * callback will be called for some of the requests, for others it won't. The
- * caller must check the error field of the BlockRequest to wait for the right
- * callbacks (if error != 0, no callback will be called).
- *
- * The implementation may modify the contents of the reqs array, e.g. to merge
- * requests. However, the fields opaque and error are left unmodified as they
- * are used to signal failure for a single request to the caller.
- */
-int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
+static int bdrv_aio_multi_rw(BlockDriverState *bs, BlockRequest *reqs,
+                             int num_reqs, bool is_write)
 {
     MultiwriteCB *mcb;
     int i;
 
-    /* don't submit writes if we don't have a medium */
+    /* don't submit requests if we don't have a medium */
     if (bs->drv == NULL) {
         for (i = 0; i < num_reqs; i++) {
             reqs[i].error = -ENOMEDIUM;
@@ -3039,188 +3865,60 @@ int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
     }
 
     // Check for mergable requests
-    num_reqs = multiwrite_merge(bs, reqs, num_reqs, mcb);
+    num_reqs = multiwrite_merge(bs, reqs, num_reqs, mcb, is_write);
 
-    trace_bdrv_aio_multiwrite(mcb, mcb->num_callbacks, num_reqs);
+    if (is_write) {
+        trace_bdrv_aio_multiwrite(mcb, mcb->num_callbacks, num_reqs);
+    } else {
+        trace_bdrv_aio_multiread(mcb, mcb->num_callbacks, num_reqs);
+    }
 
     /* Run the aio requests. */
     mcb->num_requests = num_reqs;
     for (i = 0; i < num_reqs; i++) {
-        bdrv_aio_writev(bs, reqs[i].sector, reqs[i].qiov,
-            reqs[i].nb_sectors, multiwrite_cb, mcb);
+        if (is_write) {
+            bdrv_aio_writev(bs, reqs[i].sector, reqs[i].qiov,
+                reqs[i].nb_sectors, multiwrite_cb, mcb);
+        } else {
+            bdrv_aio_readv(bs, reqs[i].sector, reqs[i].qiov,
+                reqs[i].nb_sectors, multiwrite_cb, mcb);
+        }
     }
 
     return 0;
 }
 
-void bdrv_aio_cancel(BlockDriverAIOCB *acb)
-{
-    acb->pool->cancel(acb);
-}
-
-/* block I/O throttling */
-static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
-                 bool is_write, double elapsed_time, uint64_t *wait)
+/*
+ * Submit multiple AIO write requests at once.
+ *
+ * On success, the function returns 0 and all requests in the reqs array have
+ * been submitted. In error case this function returns -1, and any of the
+ * requests may or may not be submitted yet. In particular, this means that the
+ * callback will be called for some of the requests, for others it won't. The
+ * caller must check the error field of the BlockRequest to wait for the right
+ * callbacks (if error != 0, no callback will be called).
+ *
+ * The implementation may modify the contents of the reqs array, e.g. to merge
+ * requests. However, the fields opaque and error are left unmodified as they
+ * are used to signal failure for a single request to the caller.
+ */
+int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
 {
-    uint64_t bps_limit = 0;
-    double   bytes_limit, bytes_base, bytes_res;
-    double   slice_time, wait_time;
-
-    if (bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL]) {
-        bps_limit = bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL];
-    } else if (bs->io_limits.bps[is_write]) {
-        bps_limit = bs->io_limits.bps[is_write];
-    } else {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    slice_time = bs->slice_end - bs->slice_start;
-    slice_time /= (NANOSECONDS_PER_SECOND);
-    bytes_limit = bps_limit * slice_time;
-    bytes_base  = bs->nr_bytes[is_write] - bs->io_base.bytes[is_write];
-    if (bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL]) {
-        bytes_base += bs->nr_bytes[!is_write] - bs->io_base.bytes[!is_write];
-    }
-
-    /* bytes_base: the bytes of data which have been read/written; and
-     *             it is obtained from the history statistic info.
-     * bytes_res: the remaining bytes of data which need to be read/written.
-     * (bytes_base + bytes_res) / bps_limit: used to calcuate
-     *             the total time for completing reading/writting all data.
-     */
-    bytes_res   = (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
-
-    if (bytes_base + bytes_res <= bytes_limit) {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    /* Calc approx time to dispatch */
-    wait_time = (bytes_base + bytes_res) / bps_limit - elapsed_time;
-
-    /* When the I/O rate at runtime exceeds the limits,
-     * bs->slice_end need to be extended in order that the current statistic
-     * info can be kept until the timer fire, so it is increased and tuned
-     * based on the result of experiment.
-     */
-    bs->slice_time = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    bs->slice_end += bs->slice_time - 3 * BLOCK_IO_SLICE_TIME;
-    if (wait) {
-        *wait = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    }
-
-    return true;
+    return bdrv_aio_multi_rw(bs, reqs, num_reqs, true);
 }
 
-static bool bdrv_exceed_iops_limits(BlockDriverState *bs, bool is_write,
-                             double elapsed_time, uint64_t *wait)
+/*
+ * Submit multiple AIO read requests at once, merging those that are
+ * sequential.  Same semantics as bdrv_aio_multiwrite().
+ */
+int bdrv_aio_multiread(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
 {
-    uint64_t iops_limit = 0;
-    double   ios_limit, ios_base;
-    double   slice_time, wait_time;
-
-    if (bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL]) {
-        iops_limit = bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL];
-    } else if (bs->io_limits.iops[is_write]) {
-        iops_limit = bs->io_limits.iops[is_write];
-    } else {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    slice_time = bs->slice_end - bs->slice_start;
-    slice_time /= (NANOSECONDS_PER_SECOND);
-    ios_limit  = iops_limit * slice_time;
-    ios_base   = bs->nr_ops[is_write] - bs->io_base.ios[is_write];
-    if (bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL]) {
-        ios_base += bs->nr_ops[!is_write] - bs->io_base.ios[!is_write];
-    }
-
-    if (ios_base + 1 <= ios_limit) {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    /* Calc approx time to dispatch */
-    wait_time = (ios_base + 1) / iops_limit;
-    if (wait_time > elapsed_time) {
-        wait_time = wait_time - elapsed_time;
-    } else {
-        wait_time = 0;
-    }
-
-    bs->slice_time = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    bs->slice_end += bs->slice_time - 3 * BLOCK_IO_SLICE_TIME;
-    if (wait) {
-        *wait = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    }
-
-    return true;
+    return bdrv_aio_multi_rw(bs, reqs, num_reqs, false);
 }
 
-static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
-                           bool is_write, int64_t *wait)
+void bdrv_aio_cancel(BlockDriverAIOCB *acb)
 {
-    int64_t  now, max_wait;
-    uint64_t bps_wait = 0, iops_wait = 0;
-    double   elapsed_time;
-    int      bps_ret, iops_ret;
-
-    now = qemu_get_clock_ns(vm_clock);
-    if ((bs->slice_start < now)
-        && (bs->slice_end > now)) {
-        bs->slice_end = now + bs->slice_time;
-    } else {
-        bs->slice_time  =  5 * BLOCK_IO_SLICE_TIME;
-        bs->slice_start = now;
-        bs->slice_end   = now + bs->slice_time;
-
-        bs->io_base.bytes[is_write]  = bs->nr_bytes[is_write];
-        bs->io_base.bytes[!is_write] = bs->nr_bytes[!is_write];
-
-        bs->io_base.ios[is_write]    = bs->nr_ops[is_write];
-        bs->io_base.ios[!is_write]   = bs->nr_ops[!is_write];
-    }
-
-    elapsed_time  = now - bs->slice_start;
-    elapsed_time  /= (NANOSECONDS_PER_SECOND);
-
-    bps_ret  = bdrv_exceed_bps_limits(bs, nb_sectors,
-                                      is_write, elapsed_time, &bps_wait);
-    iops_ret = bdrv_exceed_iops_limits(bs, is_write,
-                                      elapsed_time, &iops_wait);
-    if (bps_ret || iops_ret) {
-        max_wait = bps_wait > iops_wait ? bps_wait : iops_wait;
-        if (wait) {
-            *wait = max_wait;
-        }
-
-        now = qemu_get_clock_ns(vm_clock);
-        if (bs->slice_end < now + max_wait) {
-            bs->slice_end = now + max_wait;
-        }
-
-        return true;
-    }
-
-    if (wait) {
-        *wait = 0;
-    }
-
-    return false;
+    acb->pool->cancel(acb);
 }
 
 /**************************************************************/
@@ -3311,7 +4009,10 @@ typedef struct BlockDriverAIOCBCoroutine {
     BlockDriverAIOCB common;
     BlockRequest req;
     bool is_write;
+    BdrvRequestFlags flags;
     QEMUBH* bh;
+    BlockDiscardRange *ranges;
+    int nb_ranges;
 } BlockDriverAIOCBCoroutine;
 
 static void bdrv_aio_co_cancel_em(BlockDriverAIOCB *blockacb)
@@ -3341,10 +4042,10 @@ static void coroutine_fn bdrv_co_do_rw(void *opaque)
 
     if (!acb->is_write) {
         acb->req.error = bdrv_co_do_readv(bs, acb->req.sector,
-            acb->req.nb_sectors, acb->req.qiov, 0);
+            acb->req.nb_sectors, acb->req.qiov, acb->flags);
     } else {
         acb->req.error = bdrv_co_do_writev(bs, acb->req.sector,
-            acb->req.nb_sectors, acb->req.qiov, 0);
+            acb->req.nb_sectors, acb->req.qiov, acb->flags);
     }
 
     acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
@@ -3357,7 +4058,8 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
                                                int nb_sectors,
                                                BlockDriverCompletionFunc *cb,
                                                void *opaque,
-                                               bool is_write)
+                                               bool is_write,
+                                               BdrvRequestFlags flags)
 {
     Coroutine *co;
     BlockDriverAIOCBCoroutine *acb;
@@ -3367,6 +4069,7 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
     acb->req.nb_sectors = nb_sectors;
     acb->req.qiov = qiov;
     acb->is_write = is_write;
+    acb->flags = flags;
 
     co = qemu_coroutine_create(bdrv_co_do_rw);
     qemu_coroutine_enter(co, acb);
@@ -3427,6 +4130,97 @@ BlockDriverAIOCB *bdrv_aio_discard(BlockDriverState *bs,
     return &acb->common;
 }
 
+static int discard_range_compare(const void *a, const void *b)
+{
+    const BlockDiscardRange *ra = a, *rb = b;
+
+    if (ra->sector_num < rb->sector_num) {
+        return -1;
+    }
+    return ra->sector_num > rb->sector_num;
+}
+
+/*
+ * Sort @ranges and merge the ones that overlap or touch, dropping empty
+ * ones.  Returns the number of ranges left at the start of the array.
+ */
+int bdrv_merge_discard_ranges(BlockDiscardRange *ranges, int nb_ranges)
+{
+    int i, n = 0;
+
+    qsort(ranges, nb_ranges, sizeof(*ranges), discard_range_compare);
+    for (i = 0; i < nb_ranges; i++) {
+        int64_t end = ranges[i].sector_num + ranges[i].nb_sectors;
+
+        if (ranges[i].nb_sectors <= 0) {
+            continue;
+        }
+        if (n > 0 && ranges[i].sector_num <=
+                     ranges[n - 1].sector_num + ranges[n - 1].nb_sectors) {
+            end = MAX(end, ranges[n - 1].sector_num +
+                           ranges[n - 1].nb_sectors);
+            ranges[n - 1].nb_sectors = end - ranges[n - 1].sector_num;
+        } else {
+            ranges[n++] = ranges[i];
+        }
+    }
+    return n;
+}
+
+/* Large discards are split so that drivers never see sector counts that
+ * overflow when converted to bytes */
+#define BDRV_DISCARD_MAX_SECTORS (1 << 21)
+
+static void coroutine_fn bdrv_aio_discard_ranges_co_entry(void *opaque)
+{
+    BlockDriverAIOCBCoroutine *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+    int i, ret = 0;
+
+    for (i = 0; i < acb->nb_ranges && ret == 0; i++) {
+        int64_t sector_num = acb->ranges[i].sector_num;
+        int64_t nb_sectors = acb->ranges[i].nb_sectors;
+
+        while (nb_sectors > 0 && ret == 0) {
+            int n = MIN(nb_sectors, BDRV_DISCARD_MAX_SECTORS);
+
+            ret = bdrv_co_discard(bs, sector_num, n);
+            sector_num += n;
+            nb_sectors -= n;
+        }
+    }
+
+    g_free(acb->ranges);
+    acb->req.error = ret;
+    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    qemu_bh_schedule(acb->bh);
+}
+
+/*
+ * Discard several ranges, e.g. all those of an ATA TRIM or SCSI UNMAP
+ * command.  Adjacent ranges are merged first, so that the image sees few
+ * large discards instead of many small ones.
+ */
+BlockDriverAIOCB *bdrv_aio_discard_ranges(BlockDriverState *bs,
+                                          const BlockDiscardRange *ranges,
+                                          int nb_ranges,
+                                          BlockDriverCompletionFunc *cb,
+                                          void *opaque)
+{
+    Coroutine *co;
+    BlockDriverAIOCBCoroutine *acb;
+
+    acb = qemu_aio_get(&bdrv_em_co_aio_pool, bs, cb, opaque);
+    acb->ranges = g_memdup(ranges, nb_ranges * sizeof(*ranges));
+    acb->nb_ranges = bdrv_merge_discard_ranges(acb->ranges, nb_ranges);
+    trace_bdrv_aio_discard_ranges(bs, nb_ranges, acb->nb_ranges, opaque);
+
+    co = qemu_coroutine_create(bdrv_aio_discard_ranges_co_entry);
+    qemu_coroutine_enter(co, acb);
+
+    return &acb->common;
+}
+
 void bdrv_init(void)
 {
     module_call_init(MODULE_INIT_BLOCK);
@@ -3520,6 +4314,26 @@ static int coroutine_fn bdrv_co_writev_em(BlockDriverState *bs,
     return bdrv_co_io_em(bs, sector_num, nb_sectors, iov, true);
 }
 
+static int coroutine_fn bdrv_co_writev_fua_em(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              int nb_sectors,
+                                              QEMUIOVector *iov)
+{
+    CoroutineIOCompletion co = {
+        .coroutine = qemu_coroutine_self(),
+    };
+    BlockDriverAIOCB *acb;
+
+    acb = bs->drv->bdrv_aio_writev_fua(bs, sector_num, iov, nb_sectors,
+                                       bdrv_co_io_em_complete, &co);
+    if (!acb) {
+        return -EIO;
+    }
+    qemu_coroutine_yield();
+
+    return co.ret;
+}
+
 static void coroutine_fn bdrv_flush_co_entry(void *opaque)
 {
     RwCo *rwco = opaque;
@@ -3529,12 +4343,33 @@ static void coroutine_fn bdrv_flush_co_entry(void *opaque)
 
 int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
 {
+    unsigned int current_gen;
     int ret;
 
     if (!bs || !bdrv_is_inserted(bs) || bdrv_is_read_only(bs)) {
         return 0;
     }
 
+    /* Only one flush per device is sent at a time.  Anybody who comes
+     * in while it runs waits for it and then sends one more flush that
+     * covers everybody who was waiting.  */
+    current_gen = bs->write_gen;
+    while (bs->active_flush_req) {
+        qemu_co_queue_wait(&bs->flush_queue);
+    }
+    bs->active_flush_req = true;
+    ret = bdrv_co_do_flush(bs, current_gen);
+    bs->active_flush_req = false;
+    qemu_co_queue_restart_all(&bs->flush_queue);
+
+    return ret;
+}
+
+static int coroutine_fn bdrv_co_do_flush(BlockDriverState *bs,
+                                         unsigned int current_gen)
+{
+    int ret;
+
     /* Write back cached data to the OS even with cache=unsafe */
     if (bs->drv->bdrv_co_flush_to_os) {
         ret = bs->drv->bdrv_co_flush_to_os(bs);
@@ -3548,6 +4383,11 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
         goto flush_parent;
     }
 
+    /* Nothing was written since the last flush that succeeded */
+    if (bs->flushed_gen == current_gen) {
+        goto flush_parent;
+    }
+
     if (bs->drv->bdrv_co_flush_to_disk) {
         ret = bs->drv->bdrv_co_flush_to_disk(bs);
     } else if (bs->drv->bdrv_aio_flush) {
@@ -3580,6 +4420,7 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
     if (ret < 0) {
         return ret;
     }
+    bs->flushed_gen = current_gen;
 
     /* Now flush the underlying protocol.  It will also have BDRV_O_NO_FLUSH
      * in the case of cache=unsafe, so there are no useless flushes.
@@ -3651,7 +4492,12 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
         return -EIO;
     } else if (bs->read_only) {
         return -EROFS;
-    } else if (bs->drv->bdrv_co_discard) {
+    }
+
+    /* discarded clusters may be read from the backing file again */
+    bdrv_alloc_changed(bs, sector_num, nb_sectors);
+
+    if (bs->drv->bdrv_co_discard) {
         return bs->drv->bdrv_co_discard(bs, sector_num, nb_sectors);
     } else if (bs->drv->bdrv_aio_discard) {
         BlockDriverAIOCB *acb;
@@ -3790,49 +4636,81 @@ void *qemu_blockalign(BlockDriverState *bs, size_t size)
     return qemu_memalign((bs && bs->buffer_alignment) ? bs->buffer_alignment : 512, size);
 }
 
-void bdrv_set_dirty_tracking(BlockDriverState *bs, int enable)
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
+                                          int granularity)
 {
+    BdrvDirtyBitmap *bitmap;
     int64_t bitmap_size;
 
-    bs->dirty_count = 0;
-    if (enable) {
-        if (!bs->dirty_bitmap) {
-            bitmap_size = (bdrv_getlength(bs) >> BDRV_SECTOR_BITS) +
-                    BDRV_SECTORS_PER_DIRTY_CHUNK * BITS_PER_LONG - 1;
-            bitmap_size /= BDRV_SECTORS_PER_DIRTY_CHUNK * BITS_PER_LONG;
+    /* granularity is in bytes, a power of two and at least one sector */
+    assert((granularity & (granularity - 1)) == 0);
+    granularity >>= BDRV_SECTOR_BITS;
+    assert(granularity);
 
-            bs->dirty_bitmap = g_new0(unsigned long, bitmap_size);
-        }
-    } else {
-        if (bs->dirty_bitmap) {
-            g_free(bs->dirty_bitmap);
-            bs->dirty_bitmap = NULL;
+    bitmap_size = bdrv_getlength(bs) >> BDRV_SECTOR_BITS;
+    bitmap = g_malloc0(sizeof(BdrvDirtyBitmap));
+    bitmap->bitmap = hbitmap_alloc(bitmap_size, ffs(granularity) - 1);
+    QLIST_INSERT_HEAD(&bs->dirty_bitmaps, bitmap, list);
+    return bitmap;
+}
+
+void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
+{
+    BdrvDirtyBitmap *bm, *next;
+
+    QLIST_FOREACH_SAFE(bm, &bs->dirty_bitmaps, list, next) {
+        if (bm == bitmap) {
+            QLIST_REMOVE(bitmap, list);
+            hbitmap_free(bitmap->bitmap);
+            g_free(bitmap);
+            return;
         }
     }
 }
 
-int bdrv_get_dirty(BlockDriverState *bs, int64_t sector)
+int bdrv_get_dirty(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                   int64_t sector)
 {
-    int64_t chunk = sector / (int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK;
+    return hbitmap_get(bitmap->bitmap, sector);
+}
 
-    if (bs->dirty_bitmap &&
-        (sector << BDRV_SECTOR_BITS) < bdrv_getlength(bs)) {
-        return !!(bs->dirty_bitmap[chunk / (sizeof(unsigned long) * 8)] &
-            (1UL << (chunk % (sizeof(unsigned long) * 8))));
-    } else {
-        return 0;
+void bdrv_dirty_iter_init(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                          HBitmapIter *hbi, int64_t sector)
+{
+    hbitmap_iter_init(hbi, bitmap->bitmap, sector);
+}
+
+void bdrv_set_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                           int64_t cur_sector, int64_t nr_sectors)
+{
+    hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
+}
+
+void bdrv_reset_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                             int64_t cur_sector, int64_t nr_sectors)
+{
+    hbitmap_reset(bitmap->bitmap, cur_sector, nr_sectors);
+}
+
+/* Guest writes dirty every bitmap on the device */
+static void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
+                           int nr_sectors)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
     }
 }
 
-void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector,
-                      int nr_sectors)
+int64_t bdrv_get_dirty_count(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
 {
-    set_dirty_bitmap(bs, cur_sector, nr_sectors, 0);
+    return hbitmap_count(bitmap->bitmap);
 }
 
-int64_t bdrv_get_dirty_count(BlockDriverState *bs)
+int bdrv_get_dirty_granularity(BdrvDirtyBitmap *bitmap)
 {
-    return bs->dirty_count;
+    return BDRV_SECTOR_SIZE << hbitmap_granularity(bitmap->bitmap);
 }
 
 void bdrv_set_in_use(BlockDriverState *bs, int in_use)
@@ -3898,14 +4776,41 @@ bdrv_acct_start(BlockDriverState *bs, BlockAcctCookie *cookie, int64_t bytes,
     cookie->type = type;
 }
 
+static int bdrv_latency_bucket(int64_t latency_ns)
+{
+    uint64_t latency_us = latency_ns / 1000;
+    int bucket;
+
+    if (latency_us == 0) {
+        return 0;
+    }
+    bucket = 63 - clz64(latency_us);
+    return MIN(bucket, BDRV_LATENCY_BUCKETS - 1);
+}
+
 void
 bdrv_acct_done(BlockDriverState *bs, BlockAcctCookie *cookie)
 {
+    int64_t latency_ns;
+
     assert(cookie->type < BDRV_MAX_IOTYPE);
 
+    latency_ns = get_clock() - cookie->start_time_ns;
     bs->nr_bytes[cookie->type] += cookie->bytes;
     bs->nr_ops[cookie->type]++;
-    bs->total_time_ns[cookie->type] += get_clock() - cookie->start_time_ns;
+    bs->total_time_ns[cookie->type] += latency_ns;
+    bs->latency_hist[cookie->type][bdrv_latency_bucket(latency_ns)]++;
+}
+
+/*
+ * Clear the latency histograms and restart peak queue depth tracking.  The
+ * byte and operation totals are left alone because I/O throttling computes
+ * its slices from them.
+ */
+void bdrv_reset_latency_stats(BlockDriverState *bs)
+{
+    memset(bs->latency_hist, 0, sizeof(bs->latency_hist));
+    bs->max_in_flight = bs->in_flight;
 }
 
 int bdrv_img_create(const char *filename, const char *fmt,
@@ -4074,6 +4979,7 @@ void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
     job->cb            = cb;
     job->opaque        = opaque;
     job->busy          = true;
+    job->rate_sample_ns = qemu_get_clock_ns(rt_clock);
     bs->job = job;
 
     /* Only set speed when necessary to avoid NotSupported error */
@@ -4133,6 +5039,72 @@ bool block_job_is_cancelled(BlockJob *job)
     return job->cancelled;
 }
 
+/* The rate is the average over the last sample of at least this long */
+#define BLOCK_JOB_RATE_INTERVAL 1000000000LL /* ns */
+
+void block_job_update_rate(BlockJob *job)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    int64_t elapsed = now - job->rate_sample_ns;
+
+    if (elapsed >= BLOCK_JOB_RATE_INTERVAL) {
+        job->rate = MAX(0, job->offset - job->rate_sample_offset) *
+                    1000000000LL / elapsed;
+        job->rate_sample_ns = now;
+        job->rate_sample_offset = job->offset;
+    }
+}
+
+int64_t block_job_get_rate(BlockJob *job)
+{
+    int64_t elapsed = qemu_get_clock_ns(rt_clock) - job->rate_sample_ns;
+
+    /* A job that stopped making progress has not updated the sample */
+    if (elapsed >= 2 * BLOCK_JOB_RATE_INTERVAL) {
+        return MAX(0, job->offset - job->rate_sample_offset) *
+               1000000000LL / elapsed;
+    }
+    return job->rate;
+}
+
+void block_job_request_complete(BlockJob *job, Error **errp)
+{
+    if (!job->job_type->complete) {
+        error_set(errp, QERR_NOT_SUPPORTED);
+        return;
+    }
+    if (!job->ready || job->cancelled) {
+        error_set(errp, QERR_BLOCK_JOB_NOT_READY,
+                  bdrv_get_device_name(job->bs));
+        return;
+    }
+    job->job_type->complete(job, errp);
+}
+
+QObject *qobject_from_block_job(BlockJob *job)
+{
+    return qobject_from_jsonf("{ 'type': %s,"
+                              "'device': %s,"
+                              "'len': %" PRId64 ","
+                              "'offset': %" PRId64 ","
+                              "'speed': %" PRId64 " }",
+                              job->job_type->job_type,
+                              bdrv_get_device_name(job->bs),
+                              job->len,
+                              job->offset,
+                              job->speed);
+}
+
+void block_job_ready(BlockJob *job)
+{
+    QObject *obj;
+
+    job->ready = true;
+    obj = qobject_from_block_job(job);
+    monitor_protocol_event(QEVENT_BLOCK_JOB_READY, obj);
+    qobject_decref(obj);
+}
+
 struct BlockCancelData {
     BlockJob *job;
     BlockDriverCompletionFunc *cb;
@@ -0,0 +1,990 @@
+/*
+ * Block protocol that caches a slow backend in a local file
+ *
+ * Copyright (C) 2012
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ * The cache file usually lives on a local SSD and holds whole clusters of
+ * a network backend (sheepdog, rbd, iscsi...).  It is laid out as
+ *
+ *   cluster 0:   BlkcacheHeader
+ *   cluster 1-:  index, one little endian uint64_t per slot, holding the
+ *                backend cluster number plus one, or 0 for a free slot
+ *   then:        the slots, one cluster each
+ *
+ * The index is only written when the image is closed, and the header says
+ * whether it is up to date.  A cache that was not closed cleanly is simply
+ * started cold, so that crashes can never return stale data.
+ *
+ * In writeback mode, writes of whole clusters and writes to cached clusters
+ * only go to the cache file; they are copied to the backend when the guest
+ * flushes, or in the background when too much of the cache is dirty.  The
+ * backend therefore always holds everything the guest has flushed.
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "qemu-coroutine.h"
+#include "trace.h"
+
+#define BLKCACHE_MAGIC          "QEMUBLKC"
+#define BLKCACHE_VERSION        1
+#define BLKCACHE_CLUSTER_BITS   16
+#define BLKCACHE_NAME_MAX       1024
+
+/* Default and minimum size of the cache file data area */
+#define BLKCACHE_DEFAULT_SIZE   (1024LL * 1024 * 1024)
+#define BLKCACHE_MIN_SLOTS      16
+
+/* Largest backend read that is done to fill the cache */
+#define BLKCACHE_MAX_FILL       (1024 * 1024)
+
+/* Reads stop filling the cache while this many fills are outstanding */
+#define BLKCACHE_MAX_FILLS      16
+
+typedef struct BlkcacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t cluster_bits;
+    uint64_t nb_slots;
+    uint64_t backend_size;
+    uint32_t clean;             /* the index matches the slots */
+    uint32_t name_len;
+    char backend[BLKCACHE_NAME_MAX];
+} QEMU_PACKED BlkcacheHeader;
+
+typedef struct BlkcacheSlot {
+    int64_t cluster;            /* backend cluster held, -1 if free */
+    bool valid;                 /* the data has been written to the slot */
+    bool dirty;                 /* newer than the backend */
+    bool stale;                 /* overwritten while busy, drop on release */
+    bool writing_back;
+    bool referenced;            /* used since the clock hand last passed */
+    int users;                  /* requests using the slot's data */
+    unsigned int dirty_gen;     /* bumped by every write to a dirty slot */
+} BlkcacheSlot;
+
+typedef struct BDRVBlkcacheState {
+    BlockDriverState *cache;    /* the local file, bs->file is the backend */
+    char *backend_name;
+    bool writeback;
+    int cluster_bits;
+    int64_t backend_size;       /* in bytes, a multiple of the sector size */
+    int64_t data_offset;        /* in bytes */
+
+    BlkcacheSlot *slots;
+    int64_t nb_slots;
+    GHashTable *map;            /* cluster number -> slot */
+    int64_t clock_hand;
+
+    int64_t nb_valid;
+    int64_t nb_dirty;
+    int nb_writing_back;
+    int fills_in_flight;
+    bool bg_writeback;
+    CoQueue writeback_queue;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;
+} BDRVBlkcacheState;
+
+typedef struct BlkcacheFill {
+    BlockDriverState *bs;
+    int64_t cluster;            /* first cluster in buf */
+    uint8_t *buf;
+    uint64_t len;               /* bytes in buf */
+    int nb_clusters;
+    BlkcacheSlot **slots;       /* NULL for clusters that are not filled */
+} BlkcacheFill;
+
+static inline uint64_t blkcache_cluster_size(BDRVBlkcacheState *s)
+{
+    return 1ULL << s->cluster_bits;
+}
+
+/* Bytes of the backend that are held by @cluster, less at the end */
+static inline uint64_t blkcache_cluster_len(BDRVBlkcacheState *s,
+                                            int64_t cluster)
+{
+    return MIN(blkcache_cluster_size(s),
+               s->backend_size - (cluster << s->cluster_bits));
+}
+
+static inline int64_t blkcache_slot_sector(BDRVBlkcacheState *s,
+                                           BlkcacheSlot *slot)
+{
+    return (s->data_offset + ((slot - s->slots) << s->cluster_bits)) >>
+           BDRV_SECTOR_BITS;
+}
+
+static BlkcacheSlot *blkcache_lookup(BDRVBlkcacheState *s, int64_t cluster)
+{
+    return g_hash_table_lookup(s->map, &cluster);
+}
+
+static inline bool blkcache_usable(BlkcacheSlot *slot)
+{
+    return slot && slot->valid && !slot->stale;
+}
+
+static void blkcache_drop(BDRVBlkcacheState *s, BlkcacheSlot *slot)
+{
+    assert(slot->users == 0 && !slot->dirty);
+
+    if (slot->cluster < 0) {
+        return;
+    }
+    g_hash_table_remove(s->map, &slot->cluster);
+    if (slot->valid) {
+        s->nb_valid--;
+    }
+    slot->cluster = -1;
+    slot->valid = false;
+    slot->stale = false;
+    slot->referenced = false;
+}
+
+static void blkcache_get(BlkcacheSlot *slot)
+{
+    slot->users++;
+    slot->referenced = true;
+}
+
+static void blkcache_put(BDRVBlkcacheState *s, BlkcacheSlot *slot)
+{
+    assert(slot->users > 0);
+    if (--slot->users == 0 && slot->stale) {
+        blkcache_drop(s, slot);
+    }
+}
+
+/* The slot's data may no longer match the backend */
+static void blkcache_invalidate(BDRVBlkcacheState *s, BlkcacheSlot *slot)
+{
+    assert(!slot->dirty);
+    if (slot->users > 0) {
+        slot->stale = true;
+    } else {
+        blkcache_drop(s, slot);
+    }
+}
+
+static void blkcache_mark_valid(BDRVBlkcacheState *s, BlkcacheSlot *slot)
+{
+    if (!slot->valid) {
+        slot->valid = true;
+        s->nb_valid++;
+    }
+}
+
+static void blkcache_mark_dirty(BDRVBlkcacheState *s, BlkcacheSlot *slot)
+{
+    slot->dirty_gen++;
+    if (!slot->dirty) {
+        slot->dirty = true;
+        s->nb_dirty++;
+    }
+}
+
+/*
+ * Pick a slot for @cluster with the clock algorithm and return it with a
+ * reference held, or NULL if every slot is busy or dirty.  The slot is not
+ * valid until its data has been written.
+ */
+static BlkcacheSlot *blkcache_alloc(BDRVBlkcacheState *s, int64_t cluster)
+{
+    int64_t i;
+
+    for (i = 0; i < 2 * s->nb_slots; i++) {
+        BlkcacheSlot *slot = &s->slots[s->clock_hand];
+
+        s->clock_hand = (s->clock_hand + 1) % s->nb_slots;
+        if (slot->users > 0 || slot->dirty) {
+            continue;
+        }
+        if (slot->referenced) {
+            slot->referenced = false;
+            continue;
+        }
+
+        if (slot->cluster >= 0) {
+            s->evictions++;
+            blkcache_drop(s, slot);
+        }
+        slot->cluster = cluster;
+        g_hash_table_insert(s->map, &slot->cluster, slot);
+        blkcache_get(slot);
+        return slot;
+    }
+    return NULL;
+}
+
+static void coroutine_fn blkcache_fill_entry(void *opaque)
+{
+    BlkcacheFill *fill = opaque;
+    BlockDriverState *bs = fill->bs;
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t cluster_size = blkcache_cluster_size(s);
+    int i, ret;
+
+    for (i = 0; i < fill->nb_clusters; i++) {
+        BlkcacheSlot *slot = fill->slots[i];
+        uint64_t len = MIN(cluster_size, fill->len - i * cluster_size);
+        struct iovec iov = {
+            .iov_base = fill->buf + i * cluster_size,
+            .iov_len  = len,
+        };
+        QEMUIOVector qiov;
+
+        if (!slot) {
+            continue;
+        }
+
+        /* A write to the cluster since the backend read makes buf stale */
+        if (!slot->stale) {
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = bdrv_co_writev(s->cache, blkcache_slot_sector(s, slot),
+                                 len >> BDRV_SECTOR_BITS, &qiov);
+            if (ret < 0 || slot->stale) {
+                slot->stale = true;
+            } else {
+                blkcache_mark_valid(s, slot);
+            }
+        }
+        blkcache_put(s, slot);
+    }
+
+    trace_blkcache_fill(bs, fill->cluster, fill->nb_clusters);
+    s->fills_in_flight--;
+    qemu_vfree(fill->buf);
+    g_free(fill->slots);
+    g_free(fill);
+}
+
+/* Read a range that lies within one cached cluster */
+static int coroutine_fn blkcache_read_slot(BlockDriverState *bs,
+                                           BlkcacheSlot *slot,
+                                           uint64_t offset, uint64_t bytes,
+                                           QEMUIOVector *qiov,
+                                           size_t qiov_offset)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t in_cluster = offset & (blkcache_cluster_size(s) - 1);
+    QEMUIOVector sub;
+    int ret;
+
+    blkcache_get(slot);
+    qemu_iovec_init(&sub, qiov->niov);
+    qemu_iovec_concat(&sub, qiov, qiov_offset, bytes);
+
+    ret = bdrv_co_readv(s->cache, blkcache_slot_sector(s, slot) +
+                        (in_cluster >> BDRV_SECTOR_BITS),
+                        bytes >> BDRV_SECTOR_BITS, &sub);
+    if (ret < 0) {
+        /* The cache only makes things faster, never fail because of it */
+        if (!slot->dirty) {
+            slot->stale = true;
+            ret = bdrv_co_readv(bs->file, offset >> BDRV_SECTOR_BITS,
+                                bytes >> BDRV_SECTOR_BITS, &sub);
+        }
+    }
+
+    qemu_iovec_destroy(&sub);
+    blkcache_put(s, slot);
+    return ret;
+}
+
+/*
+ * Read a range none of whose clusters is in the cache, and start filling
+ * the cache with them.  The slots are allocated before the backend is
+ * read, so that writes that complete in the meantime can mark them stale.
+ */
+static int coroutine_fn blkcache_read_miss(BlockDriverState *bs,
+                                           uint64_t offset, uint64_t bytes,
+                                           QEMUIOVector *qiov,
+                                           size_t qiov_offset)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t cluster_size = blkcache_cluster_size(s);
+    uint64_t start = offset & ~(cluster_size - 1);
+    uint64_t end = MIN(ROUND_UP(offset + bytes, cluster_size),
+                       s->backend_size);
+    BlkcacheFill *fill;
+    struct iovec iov;
+    QEMUIOVector buf_qiov, sub;
+    bool any = false;
+    int i, ret;
+
+    if (s->fills_in_flight >= BLKCACHE_MAX_FILLS) {
+        qemu_iovec_init(&sub, qiov->niov);
+        qemu_iovec_concat(&sub, qiov, qiov_offset, bytes);
+        ret = bdrv_co_readv(bs->file, offset >> BDRV_SECTOR_BITS,
+                            bytes >> BDRV_SECTOR_BITS, &sub);
+        qemu_iovec_destroy(&sub);
+        return ret;
+    }
+
+    fill = g_new0(BlkcacheFill, 1);
+    fill->bs = bs;
+    fill->cluster = start >> s->cluster_bits;
+    fill->len = end - start;
+    fill->nb_clusters = DIV_ROUND_UP(fill->len, cluster_size);
+    fill->slots = g_new0(BlkcacheSlot *, fill->nb_clusters);
+    fill->buf = qemu_blockalign(bs, fill->len);
+
+    for (i = 0; i < fill->nb_clusters; i++) {
+        int64_t cluster = fill->cluster + i;
+
+        if (!blkcache_lookup(s, cluster)) {
+            fill->slots[i] = blkcache_alloc(s, cluster);
+            any |= fill->slots[i] != NULL;
+        }
+    }
+
+    iov.iov_base = fill->buf;
+    iov.iov_len = fill->len;
+    qemu_iovec_init_external(&buf_qiov, &iov, 1);
+    ret = bdrv_co_readv(bs->file, start >> BDRV_SECTOR_BITS,
+                        fill->len >> BDRV_SECTOR_BITS, &buf_qiov);
+    if (ret >= 0) {
+        qemu_iovec_from_buf(qiov, qiov_offset, fill->buf + (offset - start),
+                            bytes);
+    }
+
+    if (ret < 0 || !any) {
+        for (i = 0; i < fill->nb_clusters; i++) {
+            if (fill->slots[i]) {
+                fill->slots[i]->stale = true;
+                blkcache_put(s, fill->slots[i]);
+            }
+        }
+        qemu_vfree(fill->buf);
+        g_free(fill->slots);
+        g_free(fill);
+        return ret;
+    }
+
+    s->fills_in_flight++;
+    qemu_coroutine_enter(qemu_coroutine_create(blkcache_fill_entry), fill);
+    return 0;
+}
+
+static int coroutine_fn blkcache_co_readv(BlockDriverState *bs,
+                                          int64_t sector_num, int nb_sectors,
+                                          QEMUIOVector *qiov)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t cluster_size = blkcache_cluster_size(s);
+    uint64_t offset = sector_num * BDRV_SECTOR_SIZE;
+    uint64_t end = offset + (uint64_t)nb_sectors * BDRV_SECTOR_SIZE;
+    size_t done = 0;
+    int ret;
+
+    while (offset < end) {
+        int64_t cluster = offset >> s->cluster_bits;
+        BlkcacheSlot *slot = blkcache_lookup(s, cluster);
+        uint64_t run_end = MIN(end, (cluster + 1) << s->cluster_bits);
+
+        if (blkcache_usable(slot)) {
+            s->hits++;
+            ret = blkcache_read_slot(bs, slot, offset, run_end - offset,
+                                     qiov, done);
+        } else {
+            /* Batch the following misses into a single backend read */
+            s->misses++;
+            while (run_end < end &&
+                   run_end - (offset & ~(cluster_size - 1)) <
+                   BLKCACHE_MAX_FILL &&
+                   !blkcache_usable(blkcache_lookup(s, run_end >>
+                                                    s->cluster_bits))) {
+                s->misses++;
+                run_end = MIN(end, run_end + cluster_size);
+            }
+            ret = blkcache_read_miss(bs, offset, run_end - offset,
+                                     qiov, done);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        done += run_end - offset;
+        offset = run_end;
+    }
+    return 0;
+}
+
+/*
+ * Called after a range was written to the backend: bring the slots of the
+ * range up to date, or drop them if that is not possible.
+ */
+static void coroutine_fn blkcache_update(BlockDriverState *bs,
+                                         uint64_t offset, uint64_t bytes,
+                                         QEMUIOVector *qiov,
+                                         size_t qiov_offset, bool ok)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t end = offset + bytes;
+
+    while (offset < end) {
+        int64_t cluster = offset >> s->cluster_bits;
+        uint64_t chunk_end = MIN(end, (cluster + 1) << s->cluster_bits);
+        BlkcacheSlot *slot = blkcache_lookup(s, cluster);
+        QEMUIOVector sub;
+        int ret;
+
+        if (!slot || slot->stale) {
+            /* nothing to do */
+        } else if (!ok || !slot->valid || slot->users > 0) {
+            blkcache_invalidate(s, slot);
+        } else {
+            blkcache_get(slot);
+            qemu_iovec_init(&sub, qiov->niov);
+            qemu_iovec_concat(&sub, qiov, qiov_offset, chunk_end - offset);
+            ret = bdrv_co_writev(s->cache, blkcache_slot_sector(s, slot) +
+                                 ((offset & (blkcache_cluster_size(s) - 1)) >>
+                                  BDRV_SECTOR_BITS),
+                                 (chunk_end - offset) >> BDRV_SECTOR_BITS,
+                                 &sub);
+            qemu_iovec_destroy(&sub);
+            if (ret < 0) {
+                slot->stale = true;
+            }
+            blkcache_put(s, slot);
+        }
+
+        qiov_offset += chunk_end - offset;
+        offset = chunk_end;
+    }
+}
+
+static int coroutine_fn blkcache_write_through(BlockDriverState *bs,
+                                               uint64_t offset,
+                                               uint64_t bytes,
+                                               QEMUIOVector *qiov,
+                                               size_t qiov_offset)
+{
+    QEMUIOVector sub;
+    int ret;
+
+    qemu_iovec_init(&sub, qiov->niov);
+    qemu_iovec_concat(&sub, qiov, qiov_offset, bytes);
+    ret = bdrv_co_writev(bs->file, offset >> BDRV_SECTOR_BITS,
+                         bytes >> BDRV_SECTOR_BITS, &sub);
+    qemu_iovec_destroy(&sub);
+
+    blkcache_update(bs, offset, bytes, qiov, qiov_offset, ret >= 0);
+    return ret;
+}
+
+static int coroutine_fn blkcache_writeback_all(BlockDriverState *bs);
+
+static void coroutine_fn blkcache_bg_writeback_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVBlkcacheState *s = bs->opaque;
+
+    blkcache_writeback_all(bs);
+    s->bg_writeback = false;
+}
+
+/*
+ * Write a range that lies within one cluster to the cache only.  Returns
+ * 1 if this was not possible and the range must go to the backend.
+ */
+static int coroutine_fn blkcache_write_cached(BlockDriverState *bs,
+                                              uint64_t offset, uint64_t bytes,
+                                              QEMUIOVector *qiov,
+                                              size_t qiov_offset)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int64_t cluster = offset >> s->cluster_bits;
+    uint64_t in_cluster = offset & (blkcache_cluster_size(s) - 1);
+    BlkcacheSlot *slot = blkcache_lookup(s, cluster);
+    bool new_slot = false;
+    QEMUIOVector sub;
+    int ret;
+
+    if (blkcache_usable(slot)) {
+        blkcache_get(slot);
+    } else if (!slot && in_cluster == 0 &&
+               bytes == blkcache_cluster_len(s, cluster)) {
+        slot = blkcache_alloc(s, cluster);
+        if (!slot) {
+            return 1;
+        }
+        new_slot = true;
+    } else {
+        return 1;
+    }
+
+    qemu_iovec_init(&sub, qiov->niov);
+    qemu_iovec_concat(&sub, qiov, qiov_offset, bytes);
+    ret = bdrv_co_writev(s->cache, blkcache_slot_sector(s, slot) +
+                         (in_cluster >> BDRV_SECTOR_BITS),
+                         bytes >> BDRV_SECTOR_BITS, &sub);
+    qemu_iovec_destroy(&sub);
+
+    if (ret < 0) {
+        if (slot->dirty) {
+            /* The cache holds the only copy, there is no way around it */
+            blkcache_put(s, slot);
+            return ret;
+        }
+        slot->stale = true;
+        blkcache_put(s, slot);
+        return 1;
+    }
+
+    if (new_slot) {
+        blkcache_mark_valid(s, slot);
+    }
+    /* Only now, so that a concurrent writeback sees the change */
+    blkcache_mark_dirty(s, slot);
+    blkcache_put(s, slot);
+
+    if (s->nb_dirty > s->nb_slots / 2 && !s->bg_writeback) {
+        s->bg_writeback = true;
+        qemu_coroutine_enter(qemu_coroutine_create(blkcache_bg_writeback_entry),
+                             bs);
+    }
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_writev(BlockDriverState *bs,
+                                           int64_t sector_num, int nb_sectors,
+                                           QEMUIOVector *qiov)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t offset = sector_num * BDRV_SECTOR_SIZE;
+    uint64_t end = offset + (uint64_t)nb_sectors * BDRV_SECTOR_SIZE;
+    size_t done = 0;
+    int ret;
+
+    if (!s->writeback) {
+        return blkcache_write_through(bs, offset, end - offset, qiov, 0);
+    }
+
+    while (offset < end) {
+        int64_t cluster = offset >> s->cluster_bits;
+        uint64_t chunk_end = MIN(end, (cluster + 1) << s->cluster_bits);
+
+        ret = blkcache_write_cached(bs, offset, chunk_end - offset,
+                                    qiov, done);
+        if (ret == 1) {
+            ret = blkcache_write_through(bs, offset, chunk_end - offset,
+                                         qiov, done);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        done += chunk_end - offset;
+        offset = chunk_end;
+    }
+    return 0;
+}
+
+/*
+ * After a discard the backend may return anything for the range, so clean
+ * slots are dropped to keep the cache consistent with it.  Dirty slots hold
+ * data that is newer than the discard and are written back as usual.
+ */
+static int coroutine_fn blkcache_co_discard(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            int nb_sectors)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int64_t cluster = (sector_num * BDRV_SECTOR_SIZE) >> s->cluster_bits;
+    int64_t last = ((sector_num + nb_sectors) * BDRV_SECTOR_SIZE - 1) >>
+                   s->cluster_bits;
+    int ret;
+
+    ret = bdrv_co_discard(bs->file, sector_num, nb_sectors);
+
+    for (; nb_sectors > 0 && cluster <= last; cluster++) {
+        BlkcacheSlot *slot = blkcache_lookup(s, cluster);
+
+        if (slot && !slot->dirty) {
+            blkcache_invalidate(s, slot);
+        }
+    }
+    return ret;
+}
+
+static int coroutine_fn blkcache_writeback_slot(BlockDriverState *bs,
+                                                BlkcacheSlot *slot)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    unsigned int gen = slot->dirty_gen;
+    uint64_t len = blkcache_cluster_len(s, slot->cluster);
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int ret;
+
+    blkcache_get(slot);
+    slot->writing_back = true;
+    s->nb_writing_back++;
+
+    iov.iov_base = qemu_blockalign(s->cache, len);
+    iov.iov_len = len;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = bdrv_co_readv(s->cache, blkcache_slot_sector(s, slot),
+                        len >> BDRV_SECTOR_BITS, &qiov);
+    if (ret >= 0) {
+        ret = bdrv_co_writev(bs->file,
+                             (slot->cluster << s->cluster_bits) >>
+                             BDRV_SECTOR_BITS,
+                             len >> BDRV_SECTOR_BITS, &qiov);
+    }
+    trace_blkcache_writeback(bs, slot->cluster, ret);
+
+    /* Writes that came in meanwhile are written back by the next pass */
+    if (ret >= 0 && slot->dirty_gen == gen) {
+        slot->dirty = false;
+        s->nb_dirty--;
+        s->writebacks++;
+    }
+
+    qemu_vfree(iov.iov_base);
+    slot->writing_back = false;
+    s->nb_writing_back--;
+    blkcache_put(s, slot);
+    qemu_co_queue_restart_all(&s->writeback_queue);
+    return ret;
+}
+
+static int coroutine_fn blkcache_writeback_all(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int64_t i;
+    int ret;
+
+    for (i = 0; i < s->nb_slots && s->nb_dirty > 0; i++) {
+        BlkcacheSlot *slot = &s->slots[i];
+
+        if (slot->dirty && !slot->writing_back) {
+            ret = blkcache_writeback_slot(bs, slot);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Everything the guest wrote so far must be on the backend after a flush */
+static int coroutine_fn blkcache_co_flush_to_os(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int ret;
+
+    while (s->nb_dirty > 0) {
+        ret = blkcache_writeback_all(bs);
+        if (ret < 0) {
+            return ret;
+        }
+        if (s->nb_dirty > 0 && s->nb_writing_back > 0) {
+            qemu_co_queue_wait(&s->writeback_queue);
+        }
+    }
+    return 0;
+}
+
+static void blkcache_header_init(BDRVBlkcacheState *s, BlkcacheHeader *h,
+                                 bool clean)
+{
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, BLKCACHE_MAGIC, sizeof(h->magic));
+    h->version = cpu_to_le32(BLKCACHE_VERSION);
+    h->cluster_bits = cpu_to_le32(s->cluster_bits);
+    h->nb_slots = cpu_to_le64(s->nb_slots);
+    h->backend_size = cpu_to_le64(s->backend_size);
+    h->clean = cpu_to_le32(clean);
+    h->name_len = cpu_to_le32(strlen(s->backend_name));
+    memcpy(h->backend, s->backend_name, strlen(s->backend_name));
+}
+
+/* Reuse the slots listed in the index if the cache was closed cleanly */
+static void blkcache_load_index(BDRVBlkcacheState *s)
+{
+    BlkcacheHeader h, expected;
+    uint64_t *index;
+    int64_t i;
+
+    if (bdrv_pread(s->cache, 0, &h, sizeof(h)) != sizeof(h)) {
+        return;
+    }
+    blkcache_header_init(s, &expected, true);
+    if (memcmp(&h, &expected, sizeof(h))) {
+        return;
+    }
+
+    index = g_malloc(s->nb_slots * sizeof(uint64_t));
+    if (bdrv_pread(s->cache, blkcache_cluster_size(s), index,
+                   s->nb_slots * sizeof(uint64_t)) < 0) {
+        g_free(index);
+        return;
+    }
+    for (i = 0; i < s->nb_slots; i++) {
+        uint64_t entry = le64_to_cpu(index[i]);
+        BlkcacheSlot *slot = &s->slots[i];
+
+        if (entry == 0 || entry - 1 >=
+            DIV_ROUND_UP(s->backend_size, blkcache_cluster_size(s)) ||
+            blkcache_lookup(s, entry - 1)) {
+            continue;
+        }
+        slot->cluster = entry - 1;
+        g_hash_table_insert(s->map, &slot->cluster, slot);
+        blkcache_mark_valid(s, slot);
+    }
+    g_free(index);
+}
+
+static int blkcache_save_index(BDRVBlkcacheState *s)
+{
+    BlkcacheHeader h;
+    uint64_t *index;
+    int64_t i;
+    int ret;
+
+    index = g_malloc(s->nb_slots * sizeof(uint64_t));
+    for (i = 0; i < s->nb_slots; i++) {
+        BlkcacheSlot *slot = &s->slots[i];
+        bool keep = slot->valid && !slot->stale && !slot->dirty;
+
+        index[i] = cpu_to_le64(keep ? slot->cluster + 1 : 0);
+    }
+    ret = bdrv_pwrite(s->cache, blkcache_cluster_size(s), index,
+                      s->nb_slots * sizeof(uint64_t));
+    g_free(index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_flush(s->cache);
+    if (ret < 0) {
+        return ret;
+    }
+
+    blkcache_header_init(s, &h, true);
+    return bdrv_pwrite_sync(s->cache, 0, &h, sizeof(h));
+}
+
+static int blkcache_open_cache_file(BDRVBlkcacheState *s, const char *path,
+                                    int64_t size)
+{
+    int64_t index_size;
+    int fd, ret;
+
+    fd = qemu_open(path, O_RDWR | O_CREAT | O_BINARY, 0600);
+    if (fd < 0) {
+        return -errno;
+    }
+    qemu_close(fd);
+
+    ret = bdrv_file_open(&s->cache, path, BDRV_O_RDWR | BDRV_O_CACHE_WB);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->nb_slots = MAX(size >> s->cluster_bits, BLKCACHE_MIN_SLOTS);
+    index_size = ROUND_UP(s->nb_slots * sizeof(uint64_t),
+                          blkcache_cluster_size(s));
+    s->data_offset = blkcache_cluster_size(s) + index_size;
+
+    ret = bdrv_truncate(s->cache, s->data_offset +
+                        (s->nb_slots << s->cluster_bits));
+    if (ret < 0) {
+        bdrv_delete(s->cache);
+        s->cache = NULL;
+    }
+    return ret;
+}
+
+/*
+ * Valid filenames look like
+ *
+ *   blkcache:[writeback:][size=<bytes>:]path/to/cache_file:backend
+ *
+ * where backend is any protocol filename, e.g. rbd:pool/image.
+ */
+static int blkcache_open(BlockDriverState *bs, const char *filename,
+                         int flags)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheHeader h;
+    int64_t size = BLKCACHE_DEFAULT_SIZE;
+    char *cache_path = NULL;
+    const char *c;
+    int64_t i;
+    int ret;
+
+    if (strncmp(filename, "blkcache:", strlen("blkcache:"))) {
+        return -EINVAL;
+    }
+    filename += strlen("blkcache:");
+
+    /* Options come first, then the cache file */
+    for (;;) {
+        c = strchr(filename, ':');
+        if (c == NULL) {
+            return -EINVAL;
+        }
+        if (!strncmp(filename, "writeback:", strlen("writeback:"))) {
+            s->writeback = true;
+        } else if (!strncmp(filename, "writethrough:",
+                            strlen("writethrough:"))) {
+            s->writeback = false;
+        } else if (!strncmp(filename, "size=", strlen("size="))) {
+            char *end;
+
+            size = strtosz(filename + strlen("size="), &end);
+            if (size < 0 || end != c) {
+                error_report("blkcache: invalid cache size");
+                return -EINVAL;
+            }
+        } else {
+            break;
+        }
+        filename = c + 1;
+    }
+    cache_path = g_strndup(filename, c - filename);
+    filename = c + 1;
+
+    ret = bdrv_file_open(&bs->file, filename, flags);
+    if (ret < 0) {
+        goto fail;
+    }
+    s->backend_name = g_strdup(filename);
+    if (strlen(s->backend_name) >= BLKCACHE_NAME_MAX) {
+        ret = -ENAMETOOLONG;
+        goto fail;
+    }
+    s->backend_size = bdrv_getlength(bs->file);
+    if (s->backend_size < 0) {
+        ret = s->backend_size;
+        goto fail;
+    }
+
+    s->cluster_bits = BLKCACHE_CLUSTER_BITS;
+    ret = blkcache_open_cache_file(s, cache_path, size);
+    if (ret < 0) {
+        error_report("blkcache: could not open cache file %s", cache_path);
+        goto fail;
+    }
+
+    s->slots = g_new0(BlkcacheSlot, s->nb_slots);
+    for (i = 0; i < s->nb_slots; i++) {
+        s->slots[i].cluster = -1;
+    }
+    s->map = g_hash_table_new(g_int64_hash, g_int64_equal);
+    qemu_co_queue_init(&s->writeback_queue);
+
+    blkcache_load_index(s);
+
+    /* From now on the index is out of date until the image is closed */
+    blkcache_header_init(s, &h, false);
+    ret = bdrv_pwrite_sync(s->cache, 0, &h, sizeof(h));
+    if (ret < 0) {
+        goto fail;
+    }
+
+    trace_blkcache_open(bs, cache_path, s->nb_slots, s->nb_valid,
+                        s->writeback);
+    g_free(cache_path);
+    return 0;
+
+fail:
+    if (s->map) {
+        g_hash_table_destroy(s->map);
+        s->map = NULL;
+    }
+    g_free(s->slots);
+    s->slots = NULL;
+    if (s->cache) {
+        bdrv_delete(s->cache);
+        s->cache = NULL;
+    }
+    if (bs->file) {
+        bdrv_delete(bs->file);
+        bs->file = NULL;
+    }
+    g_free(s->backend_name);
+    g_free(cache_path);
+    return ret;
+}
+
+static void blkcache_close(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    while (s->fills_in_flight > 0 || s->bg_writeback) {
+        qemu_aio_wait();
+    }
+
+    /* bdrv_close() flushed, so this only happens after backend errors */
+    if (s->nb_dirty > 0) {
+        error_report("blkcache: %" PRId64 " clusters could not be written "
+                     "back to %s", s->nb_dirty, s->backend_name);
+    }
+    if (blkcache_save_index(s) < 0) {
+        error_report("blkcache: could not save the index, the cache will "
+                     "start cold");
+    }
+
+    bdrv_delete(s->cache);
+    s->cache = NULL;
+    g_hash_table_destroy(s->map);
+    g_free(s->slots);
+    g_free(s->backend_name);
+}
+
+static int64_t blkcache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file);
+}
+
+static void blkcache_get_cache_stats(const BlockDriverState *bs,
+                                     BlockDeviceStats *stats)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    stats->has_local_cache = true;
+    stats->local_cache = g_malloc0(sizeof(*stats->local_cache));
+    stats->local_cache->size = s->nb_slots << s->cluster_bits;
+    stats->local_cache->used = s->nb_valid << s->cluster_bits;
+    stats->local_cache->dirty = s->nb_dirty << s->cluster_bits;
+    stats->local_cache->hits = s->hits;
+    stats->local_cache->misses = s->misses;
+    stats->local_cache->evictions = s->evictions;
+    stats->local_cache->writebacks = s->writebacks;
+}
+
+static BlockDriver bdrv_blkcache = {
+    .format_name            = "blkcache",
+    .protocol_name          = "blkcache",
+    .instance_size          = sizeof(BDRVBlkcacheState),
+
+    .bdrv_getlength         = blkcache_getlength,
+    .bdrv_file_open         = blkcache_open,
+    .bdrv_close             = blkcache_close,
+    .bdrv_get_cache_stats   = blkcache_get_cache_stats,
+
+    .bdrv_co_readv          = blkcache_co_readv,
+    .bdrv_co_writev         = blkcache_co_writev,
+    .bdrv_co_flush_to_os    = blkcache_co_flush_to_os,
+    .bdrv_co_discard        = blkcache_co_discard,
+};
+
+static void bdrv_blkcache_init(void)
+{
+    bdrv_register(&bdrv_blkcache);
+}
+
+block_init(bdrv_blkcache_init);
@@ -0,0 +1,351 @@
+/*
+ * Live block commit
+ *
+ * Copyright (C) 2012
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "block_int.h"
+#include "qemu/ratelimit.h"
+
+enum {
+    /*
+     * Size of the requests that copy data from top to base.  The size
+     * grows from COMMIT_BUFFER_SIZE up to COMMIT_MAX_BUFFER_SIZE while
+     * requests complete quickly, and shrinks back when they get slow.
+     */
+    COMMIT_BUFFER_SIZE = 512 * 1024, /* in bytes */
+    COMMIT_MAX_BUFFER_SIZE = 4 * 1024 * 1024, /* in bytes */
+
+    /* Number of chunks that are copied concurrently */
+    COMMIT_MAX_IN_FLIGHT = 8,
+
+    /* Allocation status is looked up in batches of this many bytes */
+    COMMIT_SCAN_SIZE = 256 * 1024 * 1024,
+};
+
+/* Copies faster than this grow the request size, slower ones shrink it */
+#define COMMIT_FAST_NS  10000000LL
+#define COMMIT_SLOW_NS  50000000LL
+
+#define SLICE_TIME 100000000ULL /* ns */
+
+typedef struct CommitBlockJob {
+    BlockJob common;
+    RateLimit limit;
+    BlockDriverState *top;
+    BlockDriverState *base;
+    BlockDriverState *overlay;
+    int orig_base_flags;
+    int orig_overlay_flags;
+    int chunk_sectors;
+    int in_flight;
+    bool waiting;
+    int ret;
+} CommitBlockJob;
+
+typedef struct CommitCopy {
+    CommitBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+} CommitCopy;
+
+static int coroutine_fn commit_populate(BlockDriverState *top,
+                                        BlockDriverState *base,
+                                        int64_t sector_num, int nb_sectors,
+                                        void *buf)
+{
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len  = nb_sectors * BDRV_SECTOR_SIZE,
+    };
+    QEMUIOVector qiov;
+    int ret;
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = bdrv_co_readv(top, sector_num, nb_sectors, &qiov);
+    if (ret < 0) {
+        return ret;
+    }
+    return bdrv_co_writev(base, sector_num, nb_sectors, &qiov);
+}
+
+static void coroutine_fn commit_copy_entry(void *opaque)
+{
+    CommitCopy *copy = opaque;
+    CommitBlockJob *s = copy->s;
+    int64_t start_ns, elapsed;
+    void *buf;
+    int ret;
+
+    start_ns = qemu_get_clock_ns(rt_clock);
+    buf = qemu_blockalign(s->top, copy->nb_sectors * BDRV_SECTOR_SIZE);
+    ret = commit_populate(s->top, s->base, copy->sector_num,
+                          copy->nb_sectors, buf);
+    qemu_vfree(buf);
+    elapsed = qemu_get_clock_ns(rt_clock) - start_ns;
+    trace_commit_copy_done(s, copy->sector_num, copy->nb_sectors, ret,
+                           elapsed);
+
+    if (ret < 0) {
+        if (s->ret == 0) {
+            s->ret = ret;
+        }
+    } else {
+        if (elapsed < COMMIT_FAST_NS &&
+            copy->nb_sectors == s->chunk_sectors &&
+            s->chunk_sectors < COMMIT_MAX_BUFFER_SIZE / BDRV_SECTOR_SIZE) {
+            s->chunk_sectors *= 2;
+        } else if (elapsed > COMMIT_SLOW_NS &&
+                   s->chunk_sectors > COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE) {
+            s->chunk_sectors /= 2;
+        }
+
+        /* Publish progress */
+        s->common.offset += copy->nb_sectors * BDRV_SECTOR_SIZE;
+        block_job_update_rate(&s->common);
+    }
+
+    s->in_flight--;
+    g_free(copy);
+
+    if (s->waiting) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void commit_start_copy(CommitBlockJob *s, int64_t sector_num,
+                              int nb_sectors)
+{
+    CommitCopy *copy = g_new(CommitCopy, 1);
+    Coroutine *co;
+
+    copy->s = s;
+    copy->sector_num = sector_num;
+    copy->nb_sectors = nb_sectors;
+    s->in_flight++;
+
+    co = qemu_coroutine_create(commit_copy_entry);
+    qemu_coroutine_enter(co, copy);
+}
+
+static void coroutine_fn commit_wait_for_copy(CommitBlockJob *s)
+{
+    s->waiting = true;
+    qemu_coroutine_yield();
+    s->waiting = false;
+}
+
+/*
+ * Make base the backing file of the overlay of top, and close the images
+ * from top down to (but excluding) base.
+ */
+static int commit_drop_intermediate(CommitBlockJob *s)
+{
+    BlockDriverState *intermediate, *unused;
+    BlockDriverState *base = s->base;
+    int ret;
+
+    ret = bdrv_change_backing_file(s->overlay, base->filename,
+                                   base->drv ? base->drv->format_name : NULL);
+    if (ret < 0) {
+        return ret;
+    }
+
+    intermediate = s->top;
+    s->overlay->backing_hd = base;
+    while (intermediate != base) {
+        unused = intermediate;
+        intermediate = intermediate->backing_hd;
+        unused->backing_hd = NULL;
+        bdrv_delete(unused);
+    }
+    return 0;
+}
+
+static void coroutine_fn commit_run(void *opaque)
+{
+    CommitBlockJob *s = opaque;
+    BlockDriverState *top = s->top;
+    BlockDriverState *base = s->base;
+    int64_t sector_num = 0, end, base_len;
+    uint64_t delay_ns = 0;
+    int ret = 0;
+    int n = 0;
+
+    s->common.len = bdrv_getlength(top);
+    if (s->common.len < 0) {
+        ret = s->common.len;
+        goto out;
+    }
+
+    /* The base may have been created smaller than the images above it */
+    base_len = bdrv_getlength(base);
+    if (base_len < 0) {
+        ret = base_len;
+        goto out;
+    }
+    if (base_len < s->common.len) {
+        ret = bdrv_truncate(base, s->common.len);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    end = s->common.len >> BDRV_SECTOR_BITS;
+    s->chunk_sectors = COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE;
+
+    /* n is what is left of the current run of sectors that need copying.
+     * The guest only writes to the active image, which is above top, so
+     * a single pass over the clusters allocated in top is enough.
+     */
+    while (sector_num < end) {
+        /* Note that even when no rate limit is applied we need to go back
+         * to the main loop here, so that no new request is submitted from
+         * a completion callback and qemu_aio_flush() returns.
+         */
+        block_job_sleep_ns(&s->common, rt_clock, delay_ns);
+        delay_ns = 0;
+        if (block_job_is_cancelled(&s->common)) {
+            break;
+        }
+
+        /* Fill the pipeline */
+        while (s->ret == 0 && sector_num < end &&
+               s->in_flight < COMMIT_MAX_IN_FLIGHT) {
+            int nb_sectors;
+
+            if (n == 0) {
+                ret = bdrv_co_is_allocated_above(top, base, sector_num,
+                                                 MIN(end - sector_num,
+                                                     COMMIT_SCAN_SIZE /
+                                                     BDRV_SECTOR_SIZE), &n);
+                trace_commit_one_iteration(s, sector_num, n, ret);
+                if (ret < 0) {
+                    s->ret = ret;
+                    break;
+                }
+                /* Finish early if end of top has been reached */
+                if (ret == 0 && n == 0) {
+                    n = end - sector_num;
+                }
+                if (ret == 0) {
+                    s->common.offset += (int64_t)n * BDRV_SECTOR_SIZE;
+                    block_job_update_rate(&s->common);
+                    sector_num += n;
+                    n = 0;
+                    break;
+                }
+            }
+
+            nb_sectors = MIN(n, s->chunk_sectors);
+            if (s->common.speed) {
+                delay_ns = ratelimit_calculate_delay(&s->limit, nb_sectors);
+                if (delay_ns > 0) {
+                    break;
+                }
+            }
+            commit_start_copy(s, sector_num, nb_sectors);
+            sector_num += nb_sectors;
+            n -= nb_sectors;
+        }
+        if (s->ret < 0) {
+            break;
+        }
+
+        if (delay_ns == 0 && s->in_flight >= COMMIT_MAX_IN_FLIGHT) {
+            commit_wait_for_copy(s);
+        }
+    }
+
+    while (s->in_flight > 0) {
+        commit_wait_for_copy(s);
+    }
+    ret = s->ret;
+
+    if (!block_job_is_cancelled(&s->common) && sector_num == end && ret == 0) {
+        ret = bdrv_flush(base);
+        if (ret == 0) {
+            ret = commit_drop_intermediate(s);
+        }
+    }
+
+out:
+    /* Put base and the overlay back to the way they were opened.  The job
+     * is over either way, so failures here are not reported.
+     */
+    bdrv_reopen(base, s->orig_base_flags);
+    bdrv_reopen(s->overlay, s->orig_overlay_flags);
+
+    block_job_complete(&s->common, ret);
+}
+
+static void commit_set_speed(BlockJob *job, int64_t speed, Error **errp)
+{
+    CommitBlockJob *s = container_of(job, CommitBlockJob, common);
+
+    if (speed < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER, "speed");
+        return;
+    }
+    ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
+}
+
+static BlockJobType commit_job_type = {
+    .instance_size = sizeof(CommitBlockJob),
+    .job_type      = "commit",
+    .set_speed     = commit_set_speed,
+};
+
+void commit_start(BlockDriverState *bs, BlockDriverState *top,
+                  BlockDriverState *base, int64_t speed,
+                  BlockDriverCompletionFunc *cb,
+                  void *opaque, Error **errp)
+{
+    CommitBlockJob *s;
+    BlockDriverState *overlay;
+    int orig_base_flags, orig_overlay_flags;
+
+    overlay = bdrv_find_overlay(bs, top);
+    assert(overlay);
+
+    if (bdrv_in_use(bs)) {
+        error_set(errp, QERR_DEVICE_IN_USE, bdrv_get_device_name(bs));
+        return;
+    }
+
+    /* Data is written to base, and the overlay gets a new backing file */
+    orig_base_flags = base->open_flags;
+    orig_overlay_flags = overlay->open_flags;
+    if (bdrv_reopen(base, orig_base_flags | BDRV_O_RDWR) < 0) {
+        error_set(errp, QERR_OPEN_FILE_FAILED, base->filename);
+        return;
+    }
+    if (bdrv_reopen(overlay, orig_overlay_flags | BDRV_O_RDWR) < 0) {
+        bdrv_reopen(base, orig_base_flags);
+        error_set(errp, QERR_OPEN_FILE_FAILED, overlay->filename);
+        return;
+    }
+
+    s = block_job_create(&commit_job_type, bs, speed, cb, opaque, errp);
+    if (!s) {
+        bdrv_reopen(overlay, orig_overlay_flags);
+        bdrv_reopen(base, orig_base_flags);
+        return;
+    }
+
+    s->top = top;
+    s->base = base;
+    s->overlay = overlay;
+    s->orig_base_flags = orig_base_flags;
+    s->orig_overlay_flags = orig_overlay_flags;
+
+    s->common.co = qemu_coroutine_create(commit_run);
+    trace_commit_start(bs, base, top, s, s->common.co, opaque);
+    qemu_coroutine_enter(s->common.co, s);
+}
@@ -34,11 +34,32 @@
 #define DPRINTF(fmt, ...) do { } while (0)
 #endif
 
+/*
+ * Options are appended to the URL, each one followed by a colon:
+ *
+ *   http://server/image.iso:readahead=1048576:connections=16:cache=/var/x:
+ *
+ * "readahead" is the number of bytes fetched beyond each read.
+ * "connections" is the number of transfers that may run at the same time.
+ * "cache" names a local file that keeps the data fetched so far, so that
+ * it is served locally the next time the same image is opened.  It is
+ * thrown away when the size or modification time of the image changes.
+ */
+
 #define CURL_NUM_STATES 8
+#define CURL_MAX_STATES 64
 #define CURL_NUM_ACB    8
 #define SECTOR_SIZE     512
 #define READ_AHEAD_SIZE (256 * 1024)
 
+/* Reads larger than this are split into range requests sent in parallel */
+#define CURL_PARALLEL_CHUNK (512 * 1024)
+
+#define CURL_CACHE_MAGIC        "QEMUCURL"
+#define CURL_CACHE_VERSION      1
+#define CURL_CACHE_BLOCK        (64 * 1024)
+#define CURL_CACHE_HEADER_SIZE  4096
+
 #define FIND_RET_NONE   0
 #define FIND_RET_OK     1
 #define FIND_RET_WAIT   2
@@ -53,14 +74,22 @@ typedef struct CURLAIOCB {
     int64_t sector_num;
     int nb_sectors;
 
-    size_t start;
-    size_t end;
+    int pending;        /* parts that have not been read yet */
+    int ret;
 } CURLAIOCB;
 
+/* Part of a request that waits for the data of a transfer */
+typedef struct CURLAIOPart {
+    CURLAIOCB *acb;
+    size_t start;       /* in the buffer of the transfer */
+    size_t end;
+    size_t qiov_offset;
+} CURLAIOPart;
+
 typedef struct CURLState
 {
     struct BDRVCURLState *s;
-    CURLAIOCB *acb[CURL_NUM_ACB];
+    CURLAIOPart parts[CURL_NUM_ACB];
     CURL *curl;
     char *orig_buf;
     size_t buf_start;
@@ -71,12 +100,31 @@ typedef struct CURLState
     char in_use;
 } CURLState;
 
+/* All fields are little endian */
+typedef struct CURLCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t len;
+    int64_t filetime;
+} QEMU_PACKED CURLCacheHeader;
+
 typedef struct BDRVCURLState {
     CURLM *multi;
     size_t len;
-    CURLState states[CURL_NUM_STATES];
+    CURLState *states;
+    int num_states;
     char *url;
     size_t readahead_size;
+
+    /* Local cache: a header, one bit per block telling whether the block
+     * has been stored, then the blocks at the offset they have in the
+     * image.  The bitmap is written back when the image is closed.  */
+    int cache_fd;
+    uint8_t *cache_map;
+    size_t cache_map_size;
+    off_t cache_data_offset;
+    bool cache_dirty;
 } BDRVCURLState;
 
 static void curl_clean_state(CURLState *s);
@@ -119,6 +167,18 @@ static size_t curl_size_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
     return realsize;
 }
 
+/* Completes the request once its last part has been read */
+static void curl_part_done(CURLAIOCB *acb, int ret)
+{
+    if (ret < 0) {
+        acb->ret = ret;
+    }
+    if (--acb->pending == 0) {
+        acb->common.cb(acb->common.opaque, acb->ret);
+        qemu_aio_release(acb);
+    }
+}
+
 static size_t curl_read_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
 {
     CURLState *s = ((CURLState*)opaque);
@@ -130,21 +190,24 @@ static size_t curl_read_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
     if (!s || !s->orig_buf)
         goto read_end;
 
-    memcpy(s->orig_buf + s->buf_off, ptr, realsize);
-    s->buf_off += realsize;
+    /* Never write past the buffer, even if the server sends too much */
+    memcpy(s->orig_buf + s->buf_off, ptr,
+           MIN(realsize, s->buf_len - s->buf_off));
+    s->buf_off += MIN(realsize, s->buf_len - s->buf_off);
 
     for(i=0; i<CURL_NUM_ACB; i++) {
-        CURLAIOCB *acb = s->acb[i];
+        CURLAIOPart *part = &s->parts[i];
+        CURLAIOCB *acb = part->acb;
 
         if (!acb)
             continue;
 
-        if ((s->buf_off >= acb->end)) {
-            qemu_iovec_from_buf(acb->qiov, 0, s->orig_buf + acb->start,
-                                acb->end - acb->start);
-            acb->common.cb(acb->common.opaque, 0);
-            qemu_aio_release(acb);
-            s->acb[i] = NULL;
+        if ((s->buf_off >= part->end)) {
+            qemu_iovec_from_buf(acb->qiov, part->qiov_offset,
+                                s->orig_buf + part->start,
+                                part->end - part->start);
+            part->acb = NULL;
+            curl_part_done(acb, 0);
         }
     }
 
@@ -153,12 +216,12 @@ read_end:
 }
 
 static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
-                         CURLAIOCB *acb)
+                         CURLAIOCB *acb, size_t qiov_offset)
 {
     int i;
     size_t end = start + len;
 
-    for (i=0; i<CURL_NUM_STATES; i++) {
+    for (i=0; i<s->num_states; i++) {
         CURLState *state = &s->states[i];
         size_t buf_end = (state->buf_start + state->buf_off);
         size_t buf_fend = (state->buf_start + state->buf_len);
@@ -176,26 +239,27 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
         {
             char *buf = state->orig_buf + (start - state->buf_start);
 
-            qemu_iovec_from_buf(acb->qiov, 0, buf, len);
-            acb->common.cb(acb->common.opaque, 0);
-
+            qemu_iovec_from_buf(acb->qiov, qiov_offset, buf, len);
             return FIND_RET_OK;
         }
 
         // Wait for unfinished chunks
-        if ((start >= state->buf_start) &&
+        if (state->in_use &&
+            (start >= state->buf_start) &&
             (start <= buf_fend) &&
             (end >= state->buf_start) &&
             (end <= buf_fend))
         {
             int j;
 
-            acb->start = start - state->buf_start;
-            acb->end = acb->start + len;
-
             for (j=0; j<CURL_NUM_ACB; j++) {
-                if (!state->acb[j]) {
-                    state->acb[j] = acb;
+                CURLAIOPart *part = &state->parts[j];
+
+                if (!part->acb) {
+                    part->acb = acb;
+                    part->start = start - state->buf_start;
+                    part->end = part->start + len;
+                    part->qiov_offset = qiov_offset;
                     return FIND_RET_WAIT;
                 }
             }
@@ -205,6 +269,155 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
     return FIND_RET_NONE;
 }
 
+static bool curl_cache_test(BDRVCURLState *s, int64_t block)
+{
+    return s->cache_map[block / 8] & (1 << (block % 8));
+}
+
+/*
+ * Opens the local cache in @path.  It is reset unless it was written for
+ * an image of the same size and modification time.
+ */
+static int curl_cache_open(BDRVCURLState *s, const char *path, long filetime)
+{
+    CURLCacheHeader h;
+    int64_t blocks;
+    int fd;
+
+    blocks = DIV_ROUND_UP(s->len, CURL_CACHE_BLOCK);
+    s->cache_map_size = DIV_ROUND_UP(blocks, 8);
+    s->cache_map = g_malloc0(s->cache_map_size);
+    s->cache_data_offset = CURL_CACHE_HEADER_SIZE +
+        DIV_ROUND_UP(s->cache_map_size, CURL_CACHE_BLOCK) * CURL_CACHE_BLOCK;
+
+    fd = qemu_open(path, O_RDWR | O_CREAT | O_BINARY, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "CURL: Could not open cache %s: %s\n", path,
+                strerror(errno));
+        goto fail;
+    }
+
+    if (pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+        !memcmp(h.magic, CURL_CACHE_MAGIC, sizeof(h.magic)) &&
+        le32_to_cpu(h.version) == CURL_CACHE_VERSION &&
+        le32_to_cpu(h.block_size) == CURL_CACHE_BLOCK &&
+        le64_to_cpu(h.len) == s->len &&
+        le64_to_cpu(h.filetime) == filetime) {
+        if (pread(fd, s->cache_map, s->cache_map_size,
+                  CURL_CACHE_HEADER_SIZE) != s->cache_map_size) {
+            memset(s->cache_map, 0, s->cache_map_size);
+        }
+    } else {
+        DPRINTF("CURL: Starting a new cache in %s\n", path);
+        memcpy(h.magic, CURL_CACHE_MAGIC, sizeof(h.magic));
+        h.version = cpu_to_le32(CURL_CACHE_VERSION);
+        h.block_size = cpu_to_le32(CURL_CACHE_BLOCK);
+        h.len = cpu_to_le64(s->len);
+        h.filetime = cpu_to_le64(filetime);
+        if (ftruncate(fd, 0) < 0 ||
+            pwrite(fd, &h, sizeof(h), 0) != sizeof(h)) {
+            fprintf(stderr, "CURL: Could not initialize cache %s: %s\n",
+                    path, strerror(errno));
+            close(fd);
+            goto fail;
+        }
+        s->cache_dirty = true;
+    }
+
+    s->cache_fd = fd;
+    return 0;
+
+fail:
+    g_free(s->cache_map);
+    s->cache_map = NULL;
+    return -EINVAL;
+}
+
+static void curl_cache_close(BDRVCURLState *s)
+{
+    if (s->cache_fd < 0) {
+        return;
+    }
+
+    /* The data must be on disk before the bits that say it is valid */
+    if (s->cache_dirty && qemu_fdatasync(s->cache_fd) == 0) {
+        if (pwrite(s->cache_fd, s->cache_map, s->cache_map_size,
+                   CURL_CACHE_HEADER_SIZE) != s->cache_map_size) {
+            fprintf(stderr, "CURL: Could not write the cache bitmap\n");
+        }
+    }
+    close(s->cache_fd);
+    s->cache_fd = -1;
+    g_free(s->cache_map);
+    s->cache_map = NULL;
+}
+
+/*
+ * Reads [start, start + len) from the local cache if all of it is there.
+ * The cache is a local file, so it is read synchronously.
+ */
+static bool curl_cache_read(BDRVCURLState *s, CURLAIOCB *acb, size_t start,
+                            size_t len, size_t qiov_offset)
+{
+    int64_t block;
+    char *buf;
+    bool ret = false;
+
+    if (s->cache_fd < 0) {
+        return false;
+    }
+
+    for (block = start / CURL_CACHE_BLOCK;
+         block <= (start + len - 1) / CURL_CACHE_BLOCK; block++) {
+        if (!curl_cache_test(s, block)) {
+            return false;
+        }
+    }
+
+    buf = g_malloc(len);
+    if (pread(s->cache_fd, buf, len, s->cache_data_offset + start) == len) {
+        qemu_iovec_from_buf(acb->qiov, qiov_offset, buf, len);
+        ret = true;
+    }
+    g_free(buf);
+    return ret;
+}
+
+/* Stores the whole cache blocks that a finished transfer has fetched */
+static void curl_cache_store(BDRVCURLState *s, CURLState *state)
+{
+    size_t buf_end = state->buf_start + state->buf_off;
+    int64_t first, last, block;
+    size_t start, end;
+
+    if (s->cache_fd < 0) {
+        return;
+    }
+
+    first = DIV_ROUND_UP(state->buf_start, CURL_CACHE_BLOCK);
+    if (buf_end >= s->len) {
+        /* the last block of the image may be partial */
+        last = DIV_ROUND_UP(s->len, CURL_CACHE_BLOCK);
+    } else {
+        last = buf_end / CURL_CACHE_BLOCK;
+    }
+    if (first >= last) {
+        return;
+    }
+
+    start = first * CURL_CACHE_BLOCK;
+    end = MIN(last * CURL_CACHE_BLOCK, s->len);
+    if (pwrite(s->cache_fd, state->orig_buf + (start - state->buf_start),
+               end - start, s->cache_data_offset + start) != end - start) {
+        return;
+    }
+
+    for (block = first; block < last; block++) {
+        s->cache_map[block / 8] |= 1 << (block % 8);
+    }
+    s->cache_dirty = true;
+}
+
 static void curl_multi_do(void *arg)
 {
     BDRVCURLState *s = (BDRVCURLState *)arg;
@@ -234,22 +447,25 @@ static void curl_multi_do(void *arg)
             case CURLMSG_DONE:
             {
                 CURLState *state = NULL;
+                int i;
+
                 curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&state);
 
-                /* ACBs for successful messages get completed in curl_read_cb */
-                if (msg->data.result != CURLE_OK) {
-                    int i;
-                    for (i = 0; i < CURL_NUM_ACB; i++) {
-                        CURLAIOCB *acb = state->acb[i];
+                if (msg->data.result == CURLE_OK) {
+                    curl_cache_store(s, state);
+                }
 
-                        if (acb == NULL) {
-                            continue;
-                        }
+                /* Parts of successful transfers were completed in
+                 * curl_read_cb, unless the server sent less than asked */
+                for (i = 0; i < CURL_NUM_ACB; i++) {
+                    CURLAIOCB *acb = state->parts[i].acb;
 
-                        acb->common.cb(acb->common.opaque, -EIO);
-                        qemu_aio_release(acb);
-                        state->acb[i] = NULL;
+                    if (acb == NULL) {
+                        continue;
                     }
+
+                    state->parts[i].acb = NULL;
+                    curl_part_done(acb, -EIO);
                 }
 
                 curl_clean_state(state);
@@ -268,9 +484,9 @@ static CURLState *curl_init_state(BDRVCURLState *s)
     int i, j;
 
     do {
-        for (i=0; i<CURL_NUM_STATES; i++) {
+        for (i=0; i<s->num_states; i++) {
             for (j=0; j<CURL_NUM_ACB; j++)
-                if (s->states[i].acb[j])
+                if (s->states[i].parts[j].acb)
                     continue;
             if (s->states[i].in_use)
                 continue;
@@ -320,47 +536,77 @@ static void curl_clean_state(CURLState *s)
     s->in_use = 0;
 }
 
+/*
+ * Strips the trailing "name=value:" options off @file, see the comment at
+ * the top.  Returns the cache path in @cache_path, or NULL.
+ */
+static int curl_parse_options(BDRVCURLState *s, char *file, char **cache_path)
+{
+    char *opt, *value;
+    char *end;
+    size_t len = strlen(file);
+
+    *cache_path = NULL;
+    if (len == 0 || file[len - 1] != ':') {
+        return 0;
+    }
+    file[len - 1] = '\0';
+
+    while ((opt = strrchr(file, ':')) != NULL) {
+        value = strchr(opt, '=');
+        if (!value) {
+            break;
+        }
+        value++;
+
+        if (strstart(opt, ":readahead=", NULL)) {
+            s->readahead_size = strtoul(value, &end, 10);
+            if (*end) {
+                return -EINVAL;
+            }
+        } else if (strstart(opt, ":connections=", NULL)) {
+            s->num_states = strtol(value, &end, 10);
+            if (*end || s->num_states < 1 ||
+                s->num_states > CURL_MAX_STATES) {
+                fprintf(stderr, "CURL: connections must be between 1 and %d\n",
+                        CURL_MAX_STATES);
+                return -EINVAL;
+            }
+        } else if (strstart(opt, ":cache=", NULL)) {
+            g_free(*cache_path);
+            *cache_path = g_strdup(value);
+        } else {
+            break;
+        }
+        *opt = '\0';
+    }
+
+    /* the colon was part of the URL if no option was found */
+    if (strlen(file) == len - 1) {
+        file[len - 1] = ':';
+    }
+    return 0;
+}
+
 static int curl_open(BlockDriverState *bs, const char *filename, int flags)
 {
     BDRVCURLState *s = bs->opaque;
     CURLState *state = NULL;
     double d;
+    long filetime = -1;
 
-    #define RA_OPTSTR ":readahead="
     char *file;
-    char *ra;
-    const char *ra_val;
-    int parse_state = 0;
+    char *cache_path;
 
     static int inited = 0;
 
     file = g_strdup(filename);
     s->readahead_size = READ_AHEAD_SIZE;
+    s->num_states = CURL_NUM_STATES;
+    s->cache_fd = -1;
 
-    /* Parse a trailing ":readahead=#:" param, if present. */
-    ra = file + strlen(file) - 1;
-    while (ra >= file) {
-        if (parse_state == 0) {
-            if (*ra == ':')
-                parse_state++;
-            else
-                break;
-        } else if (parse_state == 1) {
-            if (*ra > '9' || *ra < '0') {
-                char *opt_start = ra - strlen(RA_OPTSTR) + 1;
-                if (opt_start > file &&
-                    strncmp(opt_start, RA_OPTSTR, strlen(RA_OPTSTR)) == 0) {
-                    ra_val = ra + 1;
-                    ra -= strlen(RA_OPTSTR) - 1;
-                    *ra = '\0';
-                    s->readahead_size = atoi(ra_val);
-                    break;
-                } else {
-                    break;
-                }
-            }
-        }
-        ra--;
+    if (curl_parse_options(s, file, &cache_path) < 0) {
+        goto out_noclean;
     }
 
     if ((s->readahead_size & 0x1ff) != 0) {
@@ -376,6 +622,7 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
 
     DPRINTF("CURL: Opening %s\n", file);
     s->url = file;
+    s->states = g_new0(CURLState, s->num_states);
     state = curl_init_state(s);
     if (!state)
         goto out_noclean;
@@ -383,10 +630,12 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
     // Get file size
 
     curl_easy_setopt(state->curl, CURLOPT_NOBODY, 1);
+    curl_easy_setopt(state->curl, CURLOPT_FILETIME, 1);
     curl_easy_setopt(state->curl, CURLOPT_WRITEFUNCTION, (void *)curl_size_cb);
     if (curl_easy_perform(state->curl))
         goto out;
     curl_easy_getinfo(state->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &d);
+    curl_easy_getinfo(state->curl, CURLINFO_FILETIME, &filetime);
     curl_easy_setopt(state->curl, CURLOPT_WRITEFUNCTION, (void *)curl_read_cb);
     curl_easy_setopt(state->curl, CURLOPT_NOBODY, 0);
     if (d)
@@ -399,12 +648,22 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
     curl_easy_cleanup(state->curl);
     state->curl = NULL;
 
+    if (cache_path) {
+        if (curl_cache_open(s, cache_path, filetime) < 0) {
+            goto out_noclean;
+        }
+        g_free(cache_path);
+        cache_path = NULL;
+    }
+
     // Now we know the file exists and its size, so let's
-    // initialize the multi interface!
+    // initialize the multi interface!  Connections are kept open and
+    // reused by the transfers that follow.
 
     s->multi = curl_multi_init();
     curl_multi_setopt( s->multi, CURLMOPT_SOCKETDATA, s); 
     curl_multi_setopt( s->multi, CURLMOPT_SOCKETFUNCTION, curl_sock_cb ); 
+    curl_multi_setopt(s->multi, CURLMOPT_MAXCONNECTS, (long)s->num_states);
     curl_multi_do(s);
 
     return 0;
@@ -414,6 +673,9 @@ out:
     curl_easy_cleanup(state->curl);
     state->curl = NULL;
 out_noclean:
+    g_free(cache_path);
+    g_free(s->states);
+    s->states = NULL;
     g_free(file);
     return -EINVAL;
 }
@@ -423,9 +685,9 @@ static int curl_aio_flush(void *opaque)
     BDRVCURLState *s = opaque;
     int i, j;
 
-    for (i=0; i < CURL_NUM_STATES; i++) {
+    for (i=0; i < s->num_states; i++) {
         for(j=0; j < CURL_NUM_ACB; j++) {
-            if (s->states[i].acb[j]) {
+            if (s->states[i].parts[j].acb) {
                 return 1;
             }
         }
@@ -443,25 +705,23 @@ static AIOPool curl_aio_pool = {
     .cancel             = curl_aio_cancel,
 };
 
-
-static void curl_readv_bh_cb(void *p)
+/* Reads [start, start + len) of the image to @qiov_offset in the request */
+static void curl_read_part(BDRVCURLState *s, CURLAIOCB *acb, size_t start,
+                           size_t len, size_t qiov_offset, bool readahead)
 {
     CURLState *state;
-
-    CURLAIOCB *acb = p;
-    BDRVCURLState *s = acb->common.bs->opaque;
-
-    qemu_bh_delete(acb->bh);
-    acb->bh = NULL;
-
-    size_t start = acb->sector_num * SECTOR_SIZE;
     size_t end;
 
+    if (curl_cache_read(s, acb, start, len, qiov_offset)) {
+        curl_part_done(acb, 0);
+        return;
+    }
+
     // In case we have the requested data already (e.g. read-ahead),
     // we can just call the callback and be done.
-    switch (curl_find_buf(s, start, acb->nb_sectors * SECTOR_SIZE, acb)) {
+    switch (curl_find_buf(s, start, len, acb, qiov_offset)) {
         case FIND_RET_OK:
-            qemu_aio_release(acb);
+            curl_part_done(acb, 0);
             // fall through
         case FIND_RET_WAIT:
             return;
@@ -472,31 +732,54 @@ static void curl_readv_bh_cb(void *p)
     // No cache found, so let's start a new request
     state = curl_init_state(s);
     if (!state) {
-        acb->common.cb(acb->common.opaque, -EIO);
-        qemu_aio_release(acb);
+        curl_part_done(acb, -EIO);
         return;
     }
 
-    acb->start = 0;
-    acb->end = (acb->nb_sectors * SECTOR_SIZE);
-
     state->buf_off = 0;
     if (state->orig_buf)
         g_free(state->orig_buf);
     state->buf_start = start;
-    state->buf_len = acb->end + s->readahead_size;
+    state->buf_len = len + (readahead ? s->readahead_size : 0);
     end = MIN(start + state->buf_len, s->len) - 1;
     state->orig_buf = g_malloc(state->buf_len);
-    state->acb[0] = acb;
+    state->parts[0].acb = acb;
+    state->parts[0].start = 0;
+    state->parts[0].end = len;
+    state->parts[0].qiov_offset = qiov_offset;
 
     snprintf(state->range, 127, "%zd-%zd", start, end);
-    DPRINTF("CURL (AIO): Reading %d at %zd (%s)\n",
-            (acb->nb_sectors * SECTOR_SIZE), start, state->range);
+    DPRINTF("CURL (AIO): Reading %zd at %zd (%s)\n",
+            len, start, state->range);
     curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
 
     curl_multi_add_handle(s->multi, state->curl);
     curl_multi_do(s);
+}
+
+static void curl_readv_bh_cb(void *p)
+{
+    CURLAIOCB *acb = p;
+    BDRVCURLState *s = acb->common.bs->opaque;
+    size_t start = acb->sector_num * SECTOR_SIZE;
+    size_t len = acb->nb_sectors * SECTOR_SIZE;
+    size_t offset, part_len;
 
+    qemu_bh_delete(acb->bh);
+    acb->bh = NULL;
+
+    /* Large reads are fetched as several ranges on parallel connections,
+     * only the last one reads ahead.  The extra reference keeps the
+     * request from completing before all of its parts are issued.  */
+    acb->pending = 1;
+    acb->ret = 0;
+    for (offset = 0; offset < len; offset += part_len) {
+        part_len = MIN(len - offset, CURL_PARALLEL_CHUNK);
+        acb->pending++;
+        curl_read_part(s, acb, start + offset, part_len, offset,
+                       offset + part_len == len);
+    }
+    curl_part_done(acb, 0);
 }
 
 static BlockDriverAIOCB *curl_aio_readv(BlockDriverState *bs,
@@ -528,7 +811,7 @@ static void curl_close(BlockDriverState *bs)
     int i;
 
     DPRINTF("CURL: Close\n");
-    for (i=0; i<CURL_NUM_STATES; i++) {
+    for (i=0; i<s->num_states; i++) {
         if (s->states[i].in_use)
             curl_clean_state(&s->states[i]);
         if (s->states[i].curl) {
@@ -542,6 +825,8 @@ static void curl_close(BlockDriverState *bs)
     }
     if (s->multi)
         curl_multi_cleanup(s->multi);
+    g_free(s->states);
+    curl_cache_close(s);
     if (s->url)
         free(s->url);
 }
@@ -40,13 +40,36 @@
 #include <hw/scsi-defs.h>
 #endif
 
+/* tunables of the -iscsi option, see parse_queue_params() */
+#define ISCSI_DEFAULT_QUEUE_DEPTH 64
+#define ISCSI_MAX_SESSIONS        8
+
+/* largest WRITE16 built by merging queued writes */
+#define ISCSI_MAX_COALESCE_BYTES  (1024 * 1024)
+
+struct IscsiLun;
+
+typedef struct IscsiSession {
+    struct IscsiLun *iscsilun;
+    struct iscsi_context *iscsi;
+    int events;
+    int inflight;
+} IscsiSession;
+
 typedef struct IscsiLun {
+    /* the first session, used for everything but reads and writes */
     struct iscsi_context *iscsi;
     int lun;
     enum scsi_inquiry_peripheral_device_type type;
     int block_size;
     uint64_t num_blocks;
-    int events;
+
+    IscsiSession sessions[ISCSI_MAX_SESSIONS];
+    int nr_sessions;
+
+    /* reads and writes in flight per session, beyond that they queue */
+    int queue_depth;
+    QTAILQ_HEAD(, IscsiAIOCB) queue;
 } IscsiLun;
 
 typedef struct IscsiAIOCB {
@@ -54,6 +77,7 @@ typedef struct IscsiAIOCB {
     QEMUIOVector *qiov;
     QEMUBH *bh;
     IscsiLun *iscsilun;
+    IscsiSession *session;
     struct scsi_task *task;
     uint8_t *buf;
     int status;
@@ -63,6 +87,18 @@ typedef struct IscsiAIOCB {
 #ifdef __linux__
     sg_io_hdr_t *ioh;
 #endif
+
+    int64_t sector_num;
+    int nb_sectors;
+    int is_write;
+
+    /* waiting for a free slot on iscsilun->queue */
+    int queued;
+    QTAILQ_ENTRY(IscsiAIOCB) entry;
+
+    /* writes sent as part of one WRITE16, chained from the first one */
+    int merged;
+    struct IscsiAIOCB *merged_next;
 } IscsiAIOCB;
 
 struct IscsiTask {
@@ -72,10 +108,13 @@ struct IscsiTask {
     int complete;
 };
 
+static void iscsi_submit_queued(IscsiLun *iscsilun);
+
 static void
 iscsi_bh_cb(void *p)
 {
     IscsiAIOCB *acb = p;
+    IscsiLun *iscsilun = acb->iscsilun;
 
     qemu_bh_delete(acb->bh);
 
@@ -88,6 +127,15 @@ iscsi_bh_cb(void *p)
         acb->task = NULL;
     }
 
+    /* a read or write gives back its slot */
+    if (acb->session != NULL) {
+        acb->session->inflight--;
+        acb->session = NULL;
+        qemu_aio_release(acb);
+        iscsi_submit_queued(iscsilun);
+        return;
+    }
+
     qemu_aio_release(acb);
 }
 
@@ -124,9 +172,23 @@ iscsi_aio_cancel(BlockDriverAIOCB *blockacb)
 
     acb->canceled = 1;
 
-    /* send a task mgmt call to the target to cancel the task on the target */
-    iscsi_task_mgmt_abort_task_async(iscsilun->iscsi, acb->task,
-                                     iscsi_abort_task_cb, acb);
+    if (acb->queued) {
+        QTAILQ_REMOVE(&iscsilun->queue, acb, entry);
+        acb->queued = 0;
+        acb->status = -ECANCELED;
+        iscsi_schedule_bh(acb);
+        return;
+    }
+
+    /* a merged write shares its task with others, let it complete */
+    if (!acb->merged) {
+        /* send a task mgmt call to the target to cancel the task on the
+         * target */
+        iscsi_task_mgmt_abort_task_async(acb->session ? acb->session->iscsi
+                                                      : iscsilun->iscsi,
+                                         acb->task,
+                                         iscsi_abort_task_cb, acb);
+    }
 
     while (acb->status == -EINPROGRESS) {
         qemu_aio_wait();
@@ -144,56 +206,66 @@ static void iscsi_process_write(void *arg);
 
 static int iscsi_process_flush(void *arg)
 {
-    IscsiLun *iscsilun = arg;
+    IscsiSession *session = arg;
 
-    return iscsi_queue_length(iscsilun->iscsi) > 0;
+    return iscsi_queue_length(session->iscsi) > 0;
 }
 
 static void
-iscsi_set_events(IscsiLun *iscsilun)
+iscsi_session_set_events(IscsiSession *session)
 {
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    struct iscsi_context *iscsi = session->iscsi;
     int ev;
 
     /* We always register a read handler.  */
     ev = POLLIN;
     ev |= iscsi_which_events(iscsi);
-    if (ev != iscsilun->events) {
+    if (ev != session->events) {
         qemu_aio_set_fd_handler(iscsi_get_fd(iscsi),
                       iscsi_process_read,
                       (ev & POLLOUT) ? iscsi_process_write : NULL,
                       iscsi_process_flush,
-                      iscsilun);
+                      session);
 
     }
 
     /* If we just added an event, the callback might be delayed
      * unless we call qemu_notify_event().
      */
-    if (ev & ~iscsilun->events) {
+    if (ev & ~session->events) {
         qemu_notify_event();
     }
-    iscsilun->events = ev;
+    session->events = ev;
+}
+
+static void
+iscsi_set_events(IscsiLun *iscsilun)
+{
+    int i;
+
+    for (i = 0; i < iscsilun->nr_sessions; i++) {
+        iscsi_session_set_events(&iscsilun->sessions[i]);
+    }
 }
 
 static void
 iscsi_process_read(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = arg;
+    struct iscsi_context *iscsi = session->iscsi;
 
     iscsi_service(iscsi, POLLIN);
-    iscsi_set_events(iscsilun);
+    iscsi_session_set_events(session);
 }
 
 static void
 iscsi_process_write(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = arg;
+    struct iscsi_context *iscsi = session->iscsi;
 
     iscsi_service(iscsi, POLLOUT);
-    iscsi_set_events(iscsilun);
+    iscsi_session_set_events(session);
 }
 
 
@@ -202,23 +274,32 @@ iscsi_aio_write16_cb(struct iscsi_context *iscsi, int status,
                      void *command_data, void *opaque)
 {
     IscsiAIOCB *acb = opaque;
+    IscsiAIOCB *next;
 
     trace_iscsi_aio_write16_cb(iscsi, status, acb, acb->canceled);
 
     g_free(acb->buf);
+    acb->buf = NULL;
 
-    if (acb->canceled != 0) {
-        return;
-    }
-
-    acb->status = 0;
     if (status < 0) {
         error_report("Failed to write16 data to iSCSI lun. %s",
                      iscsi_get_error(iscsi));
-        acb->status = -EIO;
     }
 
-    iscsi_schedule_bh(acb);
+    for (; acb != NULL; acb = next) {
+        next = acb->merged_next;
+
+        if (acb->canceled != 0) {
+            if (acb->merged) {
+                acb->status = -ECANCELED;
+                iscsi_schedule_bh(acb);
+            }
+            continue;
+        }
+
+        acb->status = status < 0 ? -EIO : 0;
+        iscsi_schedule_bh(acb);
+    }
 }
 
 static int64_t sector_qemu2lun(int64_t sector, IscsiLun *iscsilun)
@@ -226,42 +307,40 @@ static int64_t sector_qemu2lun(int64_t sector, IscsiLun *iscsilun)
     return sector * BDRV_SECTOR_SIZE / iscsilun->block_size;
 }
 
-static BlockDriverAIOCB *
-iscsi_aio_writev(BlockDriverState *bs, int64_t sector_num,
-                 QEMUIOVector *qiov, int nb_sectors,
-                 BlockDriverCompletionFunc *cb,
-                 void *opaque)
+static int
+iscsi_submit_write(IscsiAIOCB *acb)
 {
-    IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
-    IscsiAIOCB *acb;
-    size_t size;
+    BlockDriverState *bs = acb->common.bs;
+    IscsiLun *iscsilun = acb->iscsilun;
+    struct iscsi_context *iscsi = acb->session->iscsi;
+    IscsiAIOCB *m;
+    size_t size, offset;
     uint32_t num_sectors;
     uint64_t lba;
     struct iscsi_data data;
 
-    acb = qemu_aio_get(&iscsi_aio_pool, bs, cb, opaque);
-    trace_iscsi_aio_writev(iscsi, sector_num, nb_sectors, opaque, acb);
-
-    acb->iscsilun = iscsilun;
-    acb->qiov     = qiov;
-
-    acb->canceled   = 0;
-    acb->bh         = NULL;
-    acb->status     = -EINPROGRESS;
+    size = 0;
+    for (m = acb; m != NULL; m = m->merged_next) {
+        size += m->nb_sectors * BDRV_SECTOR_SIZE;
+    }
 
     /* XXX we should pass the iovec to write16 to avoid the extra copy */
     /* this will allow us to get rid of 'buf' completely */
-    size = nb_sectors * BDRV_SECTOR_SIZE;
     acb->buf = g_malloc(size);
-    qemu_iovec_to_buf(acb->qiov, 0, acb->buf, size);
+    offset = 0;
+    for (m = acb; m != NULL; m = m->merged_next) {
+        qemu_iovec_to_buf(m->qiov, 0, acb->buf + offset,
+                          m->nb_sectors * BDRV_SECTOR_SIZE);
+        offset += m->nb_sectors * BDRV_SECTOR_SIZE;
+    }
 
     acb->task = malloc(sizeof(struct scsi_task));
     if (acb->task == NULL) {
         error_report("iSCSI: Failed to allocate task for scsi WRITE16 "
                      "command. %s", iscsi_get_error(iscsi));
-        qemu_aio_release(acb);
-        return NULL;
+        g_free(acb->buf);
+        acb->buf = NULL;
+        return -ENOMEM;
     }
     memset(acb->task, 0, sizeof(struct scsi_task));
 
@@ -272,7 +351,7 @@ iscsi_aio_writev(BlockDriverState *bs, int64_t sector_num,
         /* set FUA on writes when cache mode is write through */
         acb->task->cdb[1] |= 0x04;
     }
-    lba = sector_qemu2lun(sector_num, iscsilun);
+    lba = sector_qemu2lun(acb->sector_num, iscsilun);
     *(uint32_t *)&acb->task->cdb[2]  = htonl(lba >> 32);
     *(uint32_t *)&acb->task->cdb[6]  = htonl(lba & 0xffffffff);
     num_sectors = size / iscsilun->block_size;
@@ -287,14 +366,13 @@ iscsi_aio_writev(BlockDriverState *bs, int64_t sector_num,
                                  &data,
                                  acb) != 0) {
         scsi_free_scsi_task(acb->task);
+        acb->task = NULL;
         g_free(acb->buf);
-        qemu_aio_release(acb);
-        return NULL;
+        acb->buf = NULL;
+        return -EIO;
     }
 
-    iscsi_set_events(iscsilun);
-
-    return &acb->common;
+    return 0;
 }
 
 static void
@@ -319,31 +397,18 @@ iscsi_aio_read16_cb(struct iscsi_context *iscsi, int status,
     iscsi_schedule_bh(acb);
 }
 
-static BlockDriverAIOCB *
-iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
-                QEMUIOVector *qiov, int nb_sectors,
-                BlockDriverCompletionFunc *cb,
-                void *opaque)
+static int
+iscsi_submit_read(IscsiAIOCB *acb)
 {
-    IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
-    IscsiAIOCB *acb;
+    IscsiLun *iscsilun = acb->iscsilun;
+    struct iscsi_context *iscsi = acb->session->iscsi;
     size_t qemu_read_size;
     int i;
     uint64_t lba;
     uint32_t num_sectors;
 
-    qemu_read_size = BDRV_SECTOR_SIZE * (size_t)nb_sectors;
+    qemu_read_size = BDRV_SECTOR_SIZE * (size_t)acb->nb_sectors;
 
-    acb = qemu_aio_get(&iscsi_aio_pool, bs, cb, opaque);
-    trace_iscsi_aio_readv(iscsi, sector_num, nb_sectors, opaque, acb);
-
-    acb->iscsilun = iscsilun;
-    acb->qiov     = qiov;
-
-    acb->canceled    = 0;
-    acb->bh          = NULL;
-    acb->status      = -EINPROGRESS;
     acb->read_size   = qemu_read_size;
     acb->buf         = NULL;
 
@@ -353,7 +418,7 @@ iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
      */
     acb->read_offset = 0;
     if (iscsilun->block_size > BDRV_SECTOR_SIZE) {
-        uint64_t bdrv_offset = BDRV_SECTOR_SIZE * sector_num;
+        uint64_t bdrv_offset = BDRV_SECTOR_SIZE * acb->sector_num;
 
         acb->read_offset  = bdrv_offset % iscsilun->block_size;
     }
@@ -366,13 +431,12 @@ iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
     if (acb->task == NULL) {
         error_report("iSCSI: Failed to allocate task for scsi READ16 "
                      "command. %s", iscsi_get_error(iscsi));
-        qemu_aio_release(acb);
-        return NULL;
+        return -ENOMEM;
     }
     memset(acb->task, 0, sizeof(struct scsi_task));
 
     acb->task->xfer_dir = SCSI_XFER_READ;
-    lba = sector_qemu2lun(sector_num, iscsilun);
+    lba = sector_qemu2lun(acb->sector_num, iscsilun);
     acb->task->expxferlen = qemu_read_size;
 
     switch (iscsilun->type) {
@@ -396,8 +460,8 @@ iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
                                  NULL,
                                  acb) != 0) {
         scsi_free_scsi_task(acb->task);
-        qemu_aio_release(acb);
-        return NULL;
+        acb->task = NULL;
+        return -EIO;
     }
 
     for (i = 0; i < acb->qiov->niov; i++) {
@@ -406,11 +470,161 @@ iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
                 acb->qiov->iov[i].iov_base);
     }
 
-    iscsi_set_events(iscsilun);
+    return 0;
+}
+
+/* The least busy session, or NULL if all of them are at queue_depth */
+static IscsiSession *
+iscsi_get_session(IscsiLun *iscsilun)
+{
+    IscsiSession *session = &iscsilun->sessions[0];
+    int i;
+
+    for (i = 1; i < iscsilun->nr_sessions; i++) {
+        if (iscsilun->sessions[i].inflight < session->inflight) {
+            session = &iscsilun->sessions[i];
+        }
+    }
+    return session->inflight < iscsilun->queue_depth ? session : NULL;
+}
+
+static int
+iscsi_submit(IscsiAIOCB *acb, IscsiSession *session)
+{
+    int ret;
+
+    acb->session = session;
+    ret = acb->is_write ? iscsi_submit_write(acb) : iscsi_submit_read(acb);
+    if (ret < 0) {
+        acb->session = NULL;
+        return ret;
+    }
+
+    session->inflight++;
+    iscsi_session_set_events(session);
+    return 0;
+}
+
+/*
+ * Chain the writes at the head of the queue that continue where ACB
+ * ends, so that they are sent with a single WRITE16.  Writes only queue
+ * up when the target is busy, so this adds no latency.
+ */
+static void
+iscsi_coalesce_writes(IscsiLun *iscsilun, IscsiAIOCB *acb)
+{
+    IscsiAIOCB *last = acb;
+    IscsiAIOCB *next;
+    size_t size = acb->nb_sectors * BDRV_SECTOR_SIZE;
+
+    while ((next = QTAILQ_FIRST(&iscsilun->queue)) != NULL &&
+           next->is_write &&
+           next->sector_num == last->sector_num + last->nb_sectors &&
+           size + next->nb_sectors * BDRV_SECTOR_SIZE <=
+               ISCSI_MAX_COALESCE_BYTES) {
+        QTAILQ_REMOVE(&iscsilun->queue, next, entry);
+        next->queued = 0;
+        last->merged_next = next;
+        last = next;
+        acb->merged = next->merged = 1;
+        size += next->nb_sectors * BDRV_SECTOR_SIZE;
+    }
+}
+
+static void
+iscsi_submit_queued(IscsiLun *iscsilun)
+{
+    IscsiSession *session;
+    IscsiAIOCB *acb, *next;
+
+    while ((acb = QTAILQ_FIRST(&iscsilun->queue)) != NULL &&
+           (session = iscsi_get_session(iscsilun)) != NULL) {
+        QTAILQ_REMOVE(&iscsilun->queue, acb, entry);
+        acb->queued = 0;
+        if (acb->is_write) {
+            iscsi_coalesce_writes(iscsilun, acb);
+        }
+
+        if (iscsi_submit(acb, session) < 0) {
+            for (; acb != NULL; acb = next) {
+                next = acb->merged_next;
+                acb->status = -EIO;
+                iscsi_schedule_bh(acb);
+            }
+        }
+    }
+}
+
+static BlockDriverAIOCB *
+iscsi_aio_rw(BlockDriverState *bs, int64_t sector_num,
+             QEMUIOVector *qiov, int nb_sectors, int is_write,
+             BlockDriverCompletionFunc *cb, void *opaque)
+{
+    IscsiLun *iscsilun = bs->opaque;
+    IscsiSession *session = NULL;
+    IscsiAIOCB *acb;
+
+    acb = qemu_aio_get(&iscsi_aio_pool, bs, cb, opaque);
+    if (is_write) {
+        trace_iscsi_aio_writev(iscsilun->iscsi, sector_num, nb_sectors,
+                               opaque, acb);
+    } else {
+        trace_iscsi_aio_readv(iscsilun->iscsi, sector_num, nb_sectors,
+                              opaque, acb);
+    }
+
+    acb->iscsilun = iscsilun;
+    acb->qiov     = qiov;
+
+    acb->canceled   = 0;
+    acb->bh         = NULL;
+    acb->status     = -EINPROGRESS;
+    acb->session    = NULL;
+    acb->task       = NULL;
+    acb->buf        = NULL;
+
+    acb->sector_num  = sector_num;
+    acb->nb_sectors  = nb_sectors;
+    acb->is_write    = is_write;
+    acb->queued      = 0;
+    acb->merged      = 0;
+    acb->merged_next = NULL;
+
+    /* keep the order of queued requests */
+    if (QTAILQ_EMPTY(&iscsilun->queue)) {
+        session = iscsi_get_session(iscsilun);
+    }
+    if (session == NULL) {
+        QTAILQ_INSERT_TAIL(&iscsilun->queue, acb, entry);
+        acb->queued = 1;
+        return &acb->common;
+    }
+
+    if (iscsi_submit(acb, session) < 0) {
+        qemu_aio_release(acb);
+        return NULL;
+    }
 
     return &acb->common;
 }
 
+static BlockDriverAIOCB *
+iscsi_aio_writev(BlockDriverState *bs, int64_t sector_num,
+                 QEMUIOVector *qiov, int nb_sectors,
+                 BlockDriverCompletionFunc *cb,
+                 void *opaque)
+{
+    return iscsi_aio_rw(bs, sector_num, qiov, nb_sectors, 1, cb, opaque);
+}
+
+static BlockDriverAIOCB *
+iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
+                QEMUIOVector *qiov, int nb_sectors,
+                BlockDriverCompletionFunc *cb,
+                void *opaque)
+{
+    return iscsi_aio_rw(bs, sector_num, qiov, nb_sectors, 0, cb, opaque);
+}
 
 static void
 iscsi_synccache10_cb(struct iscsi_context *iscsi, int status,
@@ -446,6 +660,9 @@ iscsi_aio_flush(BlockDriverState *bs,
     acb->canceled   = 0;
     acb->bh         = NULL;
     acb->status     = -EINPROGRESS;
+    acb->session    = NULL;
+    acb->queued     = 0;
+    acb->merged     = 0;
 
     acb->task = iscsi_synchronizecache10_task(iscsi, iscsilun->lun,
                                          0, 0, 0, 0,
@@ -499,6 +716,9 @@ iscsi_aio_discard(BlockDriverState *bs,
     acb->canceled   = 0;
     acb->bh         = NULL;
     acb->status     = -EINPROGRESS;
+    acb->session    = NULL;
+    acb->queued     = 0;
+    acb->merged     = 0;
 
     list[0].lba = sector_qemu2lun(sector_num, iscsilun);
     list[0].num = nb_sectors * BDRV_SECTOR_SIZE / iscsilun->block_size;
@@ -574,6 +794,9 @@ static BlockDriverAIOCB *iscsi_aio_ioctl(BlockDriverState *bs,
     acb->canceled    = 0;
     acb->bh          = NULL;
     acb->status      = -EINPROGRESS;
+    acb->session     = NULL;
+    acb->queued      = 0;
+    acb->merged      = 0;
     acb->buf         = NULL;
     acb->ioh         = buf;
 
@@ -891,6 +1114,43 @@ static void parse_header_digest(struct iscsi_context *iscsi, const char *target)
     }
 }
 
+static void parse_queue_params(const char *target, int *queue_depth,
+                               int *nr_sessions)
+{
+    QemuOptsList *list;
+    QemuOpts *opts;
+
+    *queue_depth = ISCSI_DEFAULT_QUEUE_DEPTH;
+    *nr_sessions = 1;
+
+    list = qemu_find_opts("iscsi");
+    if (!list) {
+        return;
+    }
+
+    opts = qemu_opts_find(list, target);
+    if (opts == NULL) {
+        opts = QTAILQ_FIRST(&list->head);
+        if (!opts) {
+            return;
+        }
+    }
+
+    *queue_depth = qemu_opt_get_number(opts, "queue-depth",
+                                       ISCSI_DEFAULT_QUEUE_DEPTH);
+    if (*queue_depth < 1) {
+        error_report("Invalid queue-depth setting : %d", *queue_depth);
+        *queue_depth = ISCSI_DEFAULT_QUEUE_DEPTH;
+    }
+
+    *nr_sessions = qemu_opt_get_number(opts, "sessions", 1);
+    if (*nr_sessions < 1 || *nr_sessions > ISCSI_MAX_SESSIONS) {
+        error_report("Invalid sessions setting : %d, must be 1 to %d",
+                     *nr_sessions, ISCSI_MAX_SESSIONS);
+        *nr_sessions = 1;
+    }
+}
+
 static char *parse_initiator_name(const char *target)
 {
     QemuOptsList *list;
@@ -918,9 +1178,95 @@ static char *parse_initiator_name(const char *target)
     }
 }
 
+/*
+ * Add a session to ISCSI_URL to iscsilun->sessions.  It still has to
+ * be connected.
+ */
+static int iscsi_create_session(IscsiLun *iscsilun, struct iscsi_url *iscsi_url,
+                                const char *initiator_name)
+{
+    IscsiSession *session = &iscsilun->sessions[iscsilun->nr_sessions];
+    struct iscsi_context *iscsi;
+
+    iscsi = iscsi_create_context(initiator_name);
+    if (iscsi == NULL) {
+        error_report("iSCSI: Failed to create iSCSI context.");
+        return -ENOMEM;
+    }
+
+    if (iscsi_set_targetname(iscsi, iscsi_url->target)) {
+        error_report("iSCSI: Failed to set target name.");
+        goto fail;
+    }
+
+    if (iscsi_url->user != NULL) {
+        if (iscsi_set_initiator_username_pwd(iscsi, iscsi_url->user,
+                                             iscsi_url->passwd) != 0) {
+            error_report("Failed to set initiator username and password");
+            goto fail;
+        }
+    }
+
+    /* check if we got CHAP username/password via the options */
+    if (parse_chap(iscsi, iscsi_url->target) != 0) {
+        error_report("iSCSI: Failed to set CHAP user/password");
+        goto fail;
+    }
+
+    if (iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL) != 0) {
+        error_report("iSCSI: Failed to set session type to normal.");
+        goto fail;
+    }
+
+    iscsi_set_header_digest(iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
+
+    /* check if we got HEADER_DIGEST via the options */
+    parse_header_digest(iscsi, iscsi_url->target);
+
+    session->iscsilun = iscsilun;
+    session->iscsi    = iscsi;
+    session->events   = 0;
+    session->inflight = 0;
+    iscsilun->nr_sessions++;
+    return 0;
+
+fail:
+    iscsi_destroy_context(iscsi);
+    return -EINVAL;
+}
+
+static void iscsi_destroy_sessions(IscsiLun *iscsilun)
+{
+    int i;
+
+    for (i = 0; i < iscsilun->nr_sessions; i++) {
+        IscsiSession *session = &iscsilun->sessions[i];
+
+        if (session->events) {
+            qemu_aio_set_fd_handler(iscsi_get_fd(session->iscsi),
+                                    NULL, NULL, NULL, NULL);
+        }
+        iscsi_destroy_context(session->iscsi);
+    }
+    iscsilun->nr_sessions = 0;
+}
+
+static void
+iscsi_session_connect_cb(struct iscsi_context *iscsi, int status,
+                         void *command_data, void *opaque)
+{
+    struct IscsiTask *itask = opaque;
+
+    itask->status   = status != 0;
+    itask->complete = 1;
+}
+
 /*
  * We support iscsi url's on the form
  * iscsi://[<username>%<password>@]<host>[:<port>]/<targetname>/<lun>
+ *
+ * With -iscsi sessions=N, reads and writes are spread among N sessions
+ * to the target, each with up to queue-depth commands in flight.
  */
 static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
 {
@@ -929,6 +1275,7 @@ static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
     struct iscsi_url *iscsi_url = NULL;
     struct IscsiTask task;
     char *initiator_name = NULL;
+    int i, nr_sessions;
     int ret;
 
     if ((BDRV_SECTOR_SIZE % 512) != 0) {
@@ -947,49 +1294,17 @@ static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
     }
 
     memset(iscsilun, 0, sizeof(IscsiLun));
+    QTAILQ_INIT(&iscsilun->queue);
+    parse_queue_params(iscsi_url->target, &iscsilun->queue_depth,
+                       &nr_sessions);
 
     initiator_name = parse_initiator_name(iscsi_url->target);
 
-    iscsi = iscsi_create_context(initiator_name);
-    if (iscsi == NULL) {
-        error_report("iSCSI: Failed to create iSCSI context.");
-        ret = -ENOMEM;
-        goto out;
-    }
-
-    if (iscsi_set_targetname(iscsi, iscsi_url->target)) {
-        error_report("iSCSI: Failed to set target name.");
-        ret = -EINVAL;
-        goto out;
-    }
-
-    if (iscsi_url->user != NULL) {
-        ret = iscsi_set_initiator_username_pwd(iscsi, iscsi_url->user,
-                                              iscsi_url->passwd);
-        if (ret != 0) {
-            error_report("Failed to set initiator username and password");
-            ret = -EINVAL;
-            goto out;
-        }
-    }
-
-    /* check if we got CHAP username/password via the options */
-    if (parse_chap(iscsi, iscsi_url->target) != 0) {
-        error_report("iSCSI: Failed to set CHAP user/password");
-        ret = -EINVAL;
+    ret = iscsi_create_session(iscsilun, iscsi_url, initiator_name);
+    if (ret < 0) {
         goto out;
     }
-
-    if (iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL) != 0) {
-        error_report("iSCSI: Failed to set session type to normal.");
-        ret = -EINVAL;
-        goto out;
-    }
-
-    iscsi_set_header_digest(iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
-
-    /* check if we got HEADER_DIGEST via the options */
-    parse_header_digest(iscsi, iscsi_url->target);
+    iscsi = iscsilun->sessions[0].iscsi;
 
     task.iscsilun = iscsilun;
     task.status = 0;
@@ -1018,6 +1333,37 @@ static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
         goto out;
     }
 
+    /* the other sessions only carry reads and writes */
+    for (i = 1; i < nr_sessions; i++) {
+        struct iscsi_context *extra;
+
+        ret = iscsi_create_session(iscsilun, iscsi_url, initiator_name);
+        if (ret < 0) {
+            goto out;
+        }
+        extra = iscsilun->sessions[i].iscsi;
+
+        task.status = 0;
+        task.complete = 0;
+        if (iscsi_full_connect_async(extra, iscsi_url->portal, iscsi_url->lun,
+                                     iscsi_session_connect_cb, &task) != 0) {
+            error_report("iSCSI: Failed to start async connect.");
+            ret = -EINVAL;
+            goto out;
+        }
+
+        while (!task.complete) {
+            iscsi_set_events(iscsilun);
+            qemu_aio_wait();
+        }
+        if (task.status != 0) {
+            error_report("iSCSI: Failed to open session %d to LUN : %s",
+                         i, iscsi_get_error(extra));
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
     /* Medium changer or tape. We dont have any emulation for this so this must
      * be sg ioctl compatible. We force it to be sg, otherwise qemu will try
      * to read from the device to guess the image format.
@@ -1038,9 +1384,7 @@ out:
     }
 
     if (ret) {
-        if (iscsi != NULL) {
-            iscsi_destroy_context(iscsi);
-        }
+        iscsi_destroy_sessions(iscsilun);
         memset(iscsilun, 0, sizeof(IscsiLun));
     }
     return ret;
@@ -1049,10 +1393,8 @@ out:
 static void iscsi_close(BlockDriverState *bs)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
 
-    qemu_aio_set_fd_handler(iscsi_get_fd(iscsi), NULL, NULL, NULL, NULL);
-    iscsi_destroy_context(iscsi);
+    iscsi_destroy_sessions(iscsilun);
     memset(iscsilun, 0, sizeof(IscsiLun));
 }
 
@@ -0,0 +1,463 @@
+/*
+ * Image mirroring
+ *
+ * Copyright (C) 2012
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "block_int.h"
+#include "qemu/ratelimit.h"
+#include "qemu/hbitmap.h"
+
+enum {
+    /* A single copy covers between one granule and this many bytes */
+    MIRROR_MAX_COPY = 4 * 1024 * 1024,
+
+    MIRROR_MAX_IN_FLIGHT = 16,
+    MIRROR_BUFFER_BUDGET = 16 * 1024 * 1024, /* in bytes */
+};
+
+/* Copies faster than this grow the chunk size, slower ones shrink it */
+#define MIRROR_FAST_NS  10000000LL
+#define MIRROR_SLOW_NS  50000000LL
+
+#define SLICE_TIME 100000000ULL /* ns */
+
+typedef struct MirrorBlockJob {
+    BlockJob common;
+    RateLimit limit;
+    BlockDriverState *target;
+    MirrorSyncMode mode;
+    bool commit;            /* target is the base of the source's chain */
+    int orig_base_flags;
+    BdrvDirtyBitmap *dirty_bitmap;
+    int granularity;        /* in sectors */
+    int max_chunk_sectors;
+    bool synced;
+    bool should_complete;
+    bool waiting;
+    int ret;
+    int64_t end;
+    int64_t sector_num;
+    int chunk_sectors;
+    int in_flight;
+    int64_t buf_bytes;
+    HBitmap *in_flight_bitmap;
+} MirrorBlockJob;
+
+typedef struct MirrorOp {
+    MirrorBlockJob *s;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t sector_num;
+    int nb_sectors;
+    int64_t start_ns;
+} MirrorOp;
+
+static void mirror_iteration_done(MirrorOp *op, int ret)
+{
+    MirrorBlockJob *s = op->s;
+    int64_t elapsed;
+
+    elapsed = qemu_get_clock_ns(rt_clock) - op->start_ns;
+    trace_mirror_iteration_done(s, op->sector_num, op->nb_sectors, ret,
+                                elapsed);
+
+    if (ret < 0) {
+        /* Try again later, or leave it dirty if the job fails */
+        bdrv_set_dirty_bitmap(s->common.bs, s->dirty_bitmap,
+                              op->sector_num, op->nb_sectors);
+        if (s->ret == 0) {
+            s->ret = ret;
+        }
+    } else if (elapsed < MIRROR_FAST_NS &&
+               op->nb_sectors == s->chunk_sectors &&
+               s->chunk_sectors < s->max_chunk_sectors) {
+        s->chunk_sectors *= 2;
+    } else if (elapsed > MIRROR_SLOW_NS &&
+               s->chunk_sectors > s->granularity) {
+        s->chunk_sectors /= 2;
+    }
+
+    hbitmap_reset(s->in_flight_bitmap, op->sector_num, op->nb_sectors);
+
+    s->in_flight--;
+    s->buf_bytes -= op->iov.iov_len;
+    qemu_vfree(op->iov.iov_base);
+    g_slice_free(MirrorOp, op);
+
+    if (s->waiting) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void mirror_write_complete(void *opaque, int ret)
+{
+    MirrorOp *op = opaque;
+
+    if (ret < 0) {
+        trace_mirror_error(op->s, op->sector_num, false, ret);
+    }
+    mirror_iteration_done(op, ret);
+}
+
+static void mirror_read_complete(void *opaque, int ret)
+{
+    MirrorOp *op = opaque;
+    MirrorBlockJob *s = op->s;
+
+    if (ret < 0) {
+        trace_mirror_error(s, op->sector_num, true, ret);
+        mirror_iteration_done(op, ret);
+        return;
+    }
+    bdrv_aio_writev(s->target, op->sector_num, &op->qiov, op->nb_sectors,
+                    mirror_write_complete, op);
+}
+
+/*
+ * Start copying the next dirty area that is not already being copied.
+ * Returns the number of sectors submitted, or 0 if every dirty chunk
+ * already has a copy in flight.
+ */
+static int mirror_iteration(MirrorBlockJob *s)
+{
+    BlockDriverState *source = s->common.bs;
+    HBitmapIter hbi;
+    int64_t sector_num;
+    bool wrapped = false;
+    MirrorOp *op;
+    int nb_sectors;
+
+    bdrv_dirty_iter_init(source, s->dirty_bitmap, &hbi, s->sector_num);
+    for (;;) {
+        sector_num = hbitmap_iter_next(&hbi);
+        if (sector_num < 0) {
+            if (wrapped) {
+                return 0;
+            }
+            wrapped = true;
+            bdrv_dirty_iter_init(source, s->dirty_bitmap, &hbi, 0);
+            continue;
+        }
+        if (!hbitmap_get(s->in_flight_bitmap, sector_num)) {
+            break;
+        }
+    }
+
+    /* Extend the copy over adjacent dirty granules, up to the chunk size */
+    nb_sectors = s->granularity;
+    while (nb_sectors < s->chunk_sectors &&
+           sector_num + nb_sectors < s->end &&
+           bdrv_get_dirty(source, s->dirty_bitmap, sector_num + nb_sectors) &&
+           !hbitmap_get(s->in_flight_bitmap, sector_num + nb_sectors)) {
+        nb_sectors += s->granularity;
+    }
+    nb_sectors = MIN(nb_sectors, s->end - sector_num);
+    hbitmap_set(s->in_flight_bitmap, sector_num, nb_sectors);
+    s->sector_num = sector_num + nb_sectors;
+
+    op = g_slice_new(MirrorOp);
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+    op->start_ns = qemu_get_clock_ns(rt_clock);
+    op->iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+    op->iov.iov_base = qemu_blockalign(source, op->iov.iov_len);
+    qemu_iovec_init_external(&op->qiov, &op->iov, 1);
+
+    s->in_flight++;
+    s->buf_bytes += op->iov.iov_len;
+
+    /* Guest writes that land after this point mark the area dirty again */
+    bdrv_reset_dirty_bitmap(source, s->dirty_bitmap, sector_num, nb_sectors);
+
+    trace_mirror_one_iteration(s, sector_num, nb_sectors);
+    bdrv_aio_readv(source, sector_num, &op->qiov, nb_sectors,
+                   mirror_read_complete, op);
+    return nb_sectors;
+}
+
+static void coroutine_fn mirror_wait_for_io(MirrorBlockJob *s)
+{
+    s->waiting = true;
+    qemu_coroutine_yield();
+    s->waiting = false;
+}
+
+static void coroutine_fn mirror_run(void *opaque)
+{
+    MirrorBlockJob *s = opaque;
+    BlockDriverState *bs = s->common.bs;
+    int64_t sector_num, cnt;
+    int ret = 0;
+    int n;
+
+    s->common.len = bdrv_getlength(bs);
+    if (s->common.len < 0) {
+        ret = s->common.len;
+        goto out_release;
+    }
+
+    s->end = s->common.len >> BDRV_SECTOR_BITS;
+    s->in_flight_bitmap = hbitmap_alloc(s->end, ffs(s->granularity) - 1);
+
+    if (s->commit) {
+        /* The base may have been created smaller than the images above */
+        int64_t base_len = bdrv_getlength(s->target);
+        if (base_len >= 0 && base_len < s->common.len) {
+            base_len = bdrv_truncate(s->target, s->common.len);
+        }
+        if (base_len < 0) {
+            ret = base_len;
+            goto out;
+        }
+    }
+
+    /* Everything that the target must copy starts out dirty */
+    for (sector_num = 0; sector_num < s->end; sector_num += n) {
+        n = MIN(s->end - sector_num, INT_MAX);
+        if (s->commit) {
+            ret = bdrv_co_is_allocated_above(bs, s->target, sector_num, n,
+                                             &n);
+            if (ret < 0) {
+                goto out;
+            }
+            if (n == 0) {
+                break;
+            }
+            if (ret == 0) {
+                continue;
+            }
+        } else if (s->mode == MIRROR_SYNC_MODE_TOP) {
+            ret = bdrv_co_is_allocated(bs, sector_num, n, &n);
+            if (ret < 0) {
+                goto out;
+            }
+            if (ret == 0) {
+                continue;
+            }
+        }
+        bdrv_set_dirty_bitmap(bs, s->dirty_bitmap, sector_num, n);
+    }
+    ret = 0;
+
+    for (;;) {
+        uint64_t delay_ns = 0;
+        bool should_complete;
+
+        /* Cancelling before the first pass is over simply aborts the copy */
+        if (s->ret < 0 ||
+            (block_job_is_cancelled(&s->common) && !s->synced)) {
+            break;
+        }
+
+        cnt = bdrv_get_dirty_count(bs, s->dirty_bitmap);
+        s->common.offset = MAX(0, s->end - cnt) * BDRV_SECTOR_SIZE;
+        block_job_update_rate(&s->common);
+
+        if (cnt > 0 && s->in_flight < MIRROR_MAX_IN_FLIGHT &&
+            s->buf_bytes < MIRROR_BUFFER_BUDGET) {
+            n = mirror_iteration(s);
+            if (n > 0) {
+                if (s->common.speed) {
+                    delay_ns = ratelimit_calculate_delay(&s->limit, n);
+                }
+                if (delay_ns == 0) {
+                    continue;
+                }
+            }
+        }
+
+        if (cnt == 0 && s->in_flight == 0) {
+            if (!s->synced) {
+                /* The target now matches the source; from here on only
+                 * guest writes need to be copied.
+                 */
+                s->synced = true;
+                trace_mirror_ready(s);
+                block_job_ready(&s->common);
+            }
+
+            should_complete = s->should_complete ||
+                              block_job_is_cancelled(&s->common);
+            if (should_complete) {
+                /* Nothing may dirty the source between the final check
+                 * and the end of the job, so flush guest requests first.
+                 */
+                bdrv_drain_all();
+                if (bdrv_get_dirty_count(bs, s->dirty_bitmap) == 0) {
+                    break;
+                }
+                continue;
+            }
+        }
+
+        if (delay_ns > 0 || (cnt == 0 && s->in_flight == 0)) {
+            /* Note that even when no rate limit is applied we need to yield
+             * here so that the guest can run and dirty the source again.
+             */
+            block_job_sleep_ns(&s->common, rt_clock,
+                               delay_ns ? delay_ns : SLICE_TIME);
+        } else {
+            mirror_wait_for_io(s);
+            /* We were woken up by a completion callback.  Go back to the
+             * main loop before submitting more I/O; otherwise a
+             * bdrv_drain_all() would keep running copies until the whole
+             * bitmap is clean.
+             */
+            block_job_sleep_ns(&s->common, rt_clock, 0);
+        }
+    }
+
+out:
+    while (s->in_flight > 0) {
+        mirror_wait_for_io(s);
+    }
+    if (ret == 0) {
+        ret = s->ret;
+    }
+    hbitmap_free(s->in_flight_bitmap);
+
+out_release:
+    bdrv_release_dirty_bitmap(bs, s->dirty_bitmap);
+
+    if (ret == 0 && s->synced) {
+        ret = bdrv_flush(s->target);
+    }
+    if (ret == 0 && s->should_complete &&
+        !block_job_is_cancelled(&s->common)) {
+        /* Switch the device over to the target; the old image is what
+         * gets closed below.  When committing, the target is still in the
+         * backing chain of the old image, so cut the chain above it first.
+         */
+        s->common.offset = s->common.len;
+        if (s->commit) {
+            bdrv_find_overlay(bs, s->target)->backing_hd = NULL;
+        }
+        bdrv_swap(s->target, bs);
+        bdrv_delete(s->target);
+    } else if (s->commit) {
+        /* The base stays in the chain, put it back the way it was */
+        bdrv_reopen(s->target, s->orig_base_flags);
+    } else {
+        bdrv_delete(s->target);
+    }
+    block_job_complete(&s->common, ret);
+}
+
+static void mirror_set_speed(BlockJob *job, int64_t speed, Error **errp)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    if (speed < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER, "speed");
+        return;
+    }
+    ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
+}
+
+static void mirror_complete(BlockJob *job, Error **errp)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    s->should_complete = true;
+    if (!job->busy) {
+        qemu_coroutine_enter(job->co, NULL);
+    }
+}
+
+static BlockJobType mirror_job_type = {
+    .instance_size = sizeof(MirrorBlockJob),
+    .job_type      = "mirror",
+    .set_speed     = mirror_set_speed,
+    .complete      = mirror_complete,
+};
+
+static BlockJobType commit_active_job_type = {
+    .instance_size = sizeof(MirrorBlockJob),
+    .job_type      = "commit",
+    .set_speed     = mirror_set_speed,
+    .complete      = mirror_complete,
+};
+
+static MirrorBlockJob *mirror_create(BlockJobType *job_type,
+                                     BlockDriverState *bs,
+                                     BlockDriverState *target,
+                                     int64_t speed, int granularity,
+                                     BlockDriverCompletionFunc *cb,
+                                     void *opaque, Error **errp)
+{
+    MirrorBlockJob *s;
+
+    s = block_job_create(job_type, bs, speed, cb, opaque, errp);
+    if (!s) {
+        return NULL;
+    }
+
+    s->target = target;
+    s->granularity = granularity >> BDRV_SECTOR_BITS;
+    s->max_chunk_sectors = MAX(s->granularity,
+                               MIRROR_MAX_COPY >> BDRV_SECTOR_BITS);
+    s->chunk_sectors = s->granularity;
+
+    /* Track guest writes from now on, before the first copy is issued */
+    s->dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity);
+    return s;
+}
+
+void mirror_start(BlockDriverState *bs, BlockDriverState *target,
+                  MirrorSyncMode mode, int64_t speed, int granularity,
+                  BlockDriverCompletionFunc *cb,
+                  void *opaque, Error **errp)
+{
+    MirrorBlockJob *s;
+
+    s = mirror_create(&mirror_job_type, bs, target, speed, granularity,
+                      cb, opaque, errp);
+    if (!s) {
+        return;
+    }
+    s->mode = mode;
+
+    s->common.co = qemu_coroutine_create(mirror_run);
+    trace_mirror_start(bs, target, s, s->common.co, opaque);
+    qemu_coroutine_enter(s->common.co, s);
+}
+
+void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
+                         int64_t speed, int granularity,
+                         BlockDriverCompletionFunc *cb,
+                         void *opaque, Error **errp)
+{
+    MirrorBlockJob *s;
+    int orig_base_flags;
+
+    if (bdrv_in_use(bs)) {
+        error_set(errp, QERR_DEVICE_IN_USE, bdrv_get_device_name(bs));
+        return;
+    }
+
+    orig_base_flags = base->open_flags;
+    if (bdrv_reopen(base, orig_base_flags | BDRV_O_RDWR) < 0) {
+        error_set(errp, QERR_OPEN_FILE_FAILED, base->filename);
+        return;
+    }
+
+    s = mirror_create(&commit_active_job_type, bs, base, speed, granularity,
+                      cb, opaque, errp);
+    if (!s) {
+        bdrv_reopen(base, orig_base_flags);
+        return;
+    }
+    s->commit = true;
+    s->orig_base_flags = orig_base_flags;
+
+    s->common.co = qemu_coroutine_create(mirror_run);
+    trace_mirror_start(bs, base, s, s->common.co, opaque);
+    qemu_coroutine_enter(s->common.co, s);
+}
@@ -36,6 +36,7 @@
 #include <unistd.h>
 
 #define EN_OPTSTR ":exportname="
+#define CONN_OPTSTR ":connections="
 
 /* #define DEBUG_NBD */
 
@@ -46,16 +47,14 @@
 #define logout(fmt, ...) ((void)0)
 #endif
 
-#define MAX_NBD_REQUESTS	16
-#define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
-#define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
+#define MAX_NBD_REQUESTS	64
+#define MAX_NBD_CONNECTIONS	8
+#define HANDLE_TO_INDEX(conn, handle) ((handle) ^ ((uint64_t)(intptr_t)conn))
+#define INDEX_TO_HANDLE(conn, index)  ((index)  ^ ((uint64_t)(intptr_t)conn))
 
-typedef struct BDRVNBDState {
+/* One socket to the server, with its own requests in flight */
+typedef struct NBDConnection {
     int sock;
-    uint32_t nbdflags;
-    off_t size;
-    size_t blocksize;
-    char *export_name; /* An NBD server may export several devices */
 
     CoMutex send_mutex;
     CoMutex free_sema;
@@ -64,6 +63,18 @@ typedef struct BDRVNBDState {
 
     Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
     struct nbd_reply reply;
+} NBDConnection;
+
+typedef struct BDRVNBDState {
+    uint32_t nbdflags;
+    off_t size;
+    size_t blocksize;
+    char *export_name; /* An NBD server may export several devices */
+
+    /* Requests are spread over several connections, which the server must
+     * be willing to accept (qemu-nbd --shared).  */
+    int num_conns;
+    NBDConnection conns[MAX_NBD_CONNECTIONS];
 
     /* If it begins with  '/', this is a UNIX domain socket. Otherwise,
      * it's a string of the form <hostname|ip4|\[ip6\]>:port
@@ -75,6 +86,7 @@ static int nbd_config(BDRVNBDState *s, const char *filename, int flags)
 {
     char *file;
     char *export_name;
+    char *conn_opt;
     const char *host_spec;
     const char *unixpath;
     int err = -EINVAL;
@@ -91,6 +103,21 @@ static int nbd_config(BDRVNBDState *s, const char *filename, int flags)
         s->export_name = g_strdup(export_name);
     }
 
+    /* nbd:...:connections=N[:exportname=...] */
+    s->num_conns = 1;
+    conn_opt = strstr(file, CONN_OPTSTR);
+    if (conn_opt) {
+        char *end;
+
+        conn_opt[0] = 0; /* truncate 'file' */
+        conn_opt += strlen(CONN_OPTSTR);
+        s->num_conns = strtol(conn_opt, &end, 10);
+        if (*conn_opt == 0 || *end != 0 ||
+            s->num_conns < 1 || s->num_conns > MAX_NBD_CONNECTIONS) {
+            goto out;
+        }
+    }
+
     /* extract the host_spec - fail if it's not nbd:... */
     if (!strstart(file, "nbd:", &host_spec)) {
         goto out;
@@ -117,53 +144,68 @@ out:
     return err;
 }
 
-static void nbd_coroutine_start(BDRVNBDState *s, struct nbd_request *request)
+/* Pick the connection with the fewest requests in flight */
+static NBDConnection *nbd_pick_connection(BDRVNBDState *s)
+{
+    NBDConnection *conn = &s->conns[0];
+    int i;
+
+    for (i = 1; i < s->num_conns; i++) {
+        if (s->conns[i].in_flight < conn->in_flight) {
+            conn = &s->conns[i];
+        }
+    }
+    return conn;
+}
+
+static void nbd_coroutine_start(NBDConnection *conn,
+                                struct nbd_request *request)
 {
     int i;
 
     /* Poor man semaphore.  The free_sema is locked when no other request
      * can be accepted, and unlocked after receiving one reply.  */
-    if (s->in_flight >= MAX_NBD_REQUESTS - 1) {
-        qemu_co_mutex_lock(&s->free_sema);
-        assert(s->in_flight < MAX_NBD_REQUESTS);
+    if (conn->in_flight >= MAX_NBD_REQUESTS - 1) {
+        qemu_co_mutex_lock(&conn->free_sema);
+        assert(conn->in_flight < MAX_NBD_REQUESTS);
     }
-    s->in_flight++;
+    conn->in_flight++;
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i] == NULL) {
-            s->recv_coroutine[i] = qemu_coroutine_self();
+        if (conn->recv_coroutine[i] == NULL) {
+            conn->recv_coroutine[i] = qemu_coroutine_self();
             break;
         }
     }
 
     assert(i < MAX_NBD_REQUESTS);
-    request->handle = INDEX_TO_HANDLE(s, i);
+    request->handle = INDEX_TO_HANDLE(conn, i);
 }
 
 static int nbd_have_request(void *opaque)
 {
-    BDRVNBDState *s = opaque;
+    NBDConnection *conn = opaque;
 
-    return s->in_flight > 0;
+    return conn->in_flight > 0;
 }
 
 static void nbd_reply_ready(void *opaque)
 {
-    BDRVNBDState *s = opaque;
+    NBDConnection *conn = opaque;
     uint64_t i;
     int ret;
 
-    if (s->reply.handle == 0) {
+    if (conn->reply.handle == 0) {
         /* No reply already in flight.  Fetch a header.  It is possible
          * that another thread has done the same thing in parallel, so
          * the socket is not readable anymore.
          */
-        ret = nbd_receive_reply(s->sock, &s->reply);
+        ret = nbd_receive_reply(conn->sock, &conn->reply);
         if (ret == -EAGAIN) {
             return;
         }
         if (ret < 0) {
-            s->reply.handle = 0;
+            conn->reply.handle = 0;
             goto fail;
         }
     }
@@ -171,55 +213,57 @@ static void nbd_reply_ready(void *opaque)
     /* There's no need for a mutex on the receive side, because the
      * handler acts as a synchronization point and ensures that only
      * one coroutine is called until the reply finishes.  */
-    i = HANDLE_TO_INDEX(s, s->reply.handle);
+    i = HANDLE_TO_INDEX(conn, conn->reply.handle);
     if (i >= MAX_NBD_REQUESTS) {
         goto fail;
     }
 
-    if (s->recv_coroutine[i]) {
-        qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+    if (conn->recv_coroutine[i]) {
+        qemu_coroutine_enter(conn->recv_coroutine[i], NULL);
         return;
     }
 
 fail:
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i]) {
-            qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+        if (conn->recv_coroutine[i]) {
+            qemu_coroutine_enter(conn->recv_coroutine[i], NULL);
         }
     }
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BDRVNBDState *s = opaque;
-    qemu_coroutine_enter(s->send_coroutine, NULL);
+    NBDConnection *conn = opaque;
+    qemu_coroutine_enter(conn->send_coroutine, NULL);
 }
 
-static int nbd_co_send_request(BDRVNBDState *s, struct nbd_request *request,
+static int nbd_co_send_request(NBDConnection *conn,
+                               struct nbd_request *request,
                                QEMUIOVector *qiov, int offset)
 {
     int rc, ret;
 
-    qemu_co_mutex_lock(&s->send_mutex);
-    s->send_coroutine = qemu_coroutine_self();
-    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, nbd_restart_write,
-                            nbd_have_request, s);
-    rc = nbd_send_request(s->sock, request);
+    qemu_co_mutex_lock(&conn->send_mutex);
+    conn->send_coroutine = qemu_coroutine_self();
+    qemu_aio_set_fd_handler(conn->sock, nbd_reply_ready, nbd_restart_write,
+                            nbd_have_request, conn);
+    rc = nbd_send_request(conn->sock, request);
     if (rc >= 0 && qiov) {
-        ret = qemu_co_sendv(s->sock, qiov->iov, qiov->niov,
+        ret = qemu_co_sendv(conn->sock, qiov->iov, qiov->niov,
                             offset, request->len);
         if (ret != request->len) {
-            return -EIO;
+            rc = -EIO;
         }
     }
-    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, NULL,
-                            nbd_have_request, s);
-    s->send_coroutine = NULL;
-    qemu_co_mutex_unlock(&s->send_mutex);
+    qemu_aio_set_fd_handler(conn->sock, nbd_reply_ready, NULL,
+                            nbd_have_request, conn);
+    conn->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&conn->send_mutex);
     return rc;
 }
 
-static void nbd_co_receive_reply(BDRVNBDState *s, struct nbd_request *request,
+static void nbd_co_receive_reply(NBDConnection *conn,
+                                 struct nbd_request *request,
                                  struct nbd_reply *reply,
                                  QEMUIOVector *qiov, int offset)
 {
@@ -228,37 +272,67 @@ static void nbd_co_receive_reply(BDRVNBDState *s, struct nbd_request *request,
     /* Wait until we're woken up by the read handler.  TODO: perhaps
      * peek at the next reply and avoid yielding if it's ours?  */
     qemu_coroutine_yield();
-    *reply = s->reply;
+    *reply = conn->reply;
     if (reply->handle != request->handle) {
         reply->error = EIO;
     } else {
+        /* Read payloads straight into the caller's buffers */
         if (qiov && reply->error == 0) {
-            ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
-                                offset, request->len);
-            if (ret != request->len) {
+            size_t len = request->len;
+
+            if ((request->type & NBD_CMD_MASK_COMMAND) ==
+                NBD_CMD_BLOCK_STATUS) {
+                len = sizeof(struct nbd_block_status);
+            }
+            ret = qemu_co_recvv(conn->sock, qiov->iov, qiov->niov,
+                                offset, len);
+            if (ret != len) {
                 reply->error = EIO;
             }
         }
 
         /* Tell the read handler to read another header.  */
-        s->reply.handle = 0;
+        conn->reply.handle = 0;
     }
 }
 
-static void nbd_coroutine_end(BDRVNBDState *s, struct nbd_request *request)
+static void nbd_coroutine_end(NBDConnection *conn,
+                              struct nbd_request *request)
 {
-    int i = HANDLE_TO_INDEX(s, request->handle);
-    s->recv_coroutine[i] = NULL;
-    if (s->in_flight-- == MAX_NBD_REQUESTS) {
-        qemu_co_mutex_unlock(&s->free_sema);
+    int i = HANDLE_TO_INDEX(conn, request->handle);
+    conn->recv_coroutine[i] = NULL;
+    if (conn->in_flight-- == MAX_NBD_REQUESTS) {
+        qemu_co_mutex_unlock(&conn->free_sema);
+    }
+}
+
+/* Send one request on the least busy connection and wait for the reply */
+static int nbd_co_request(BDRVNBDState *s, struct nbd_request *request,
+                          QEMUIOVector *write_qiov, QEMUIOVector *read_qiov,
+                          int offset)
+{
+    NBDConnection *conn = nbd_pick_connection(s);
+    struct nbd_reply reply;
+    ssize_t ret;
+
+    nbd_coroutine_start(conn, request);
+    ret = nbd_co_send_request(conn, request, write_qiov, offset);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(conn, request, &reply, read_qiov, offset);
     }
+    nbd_coroutine_end(conn, request);
+    return -reply.error;
 }
 
-static int nbd_establish_connection(BlockDriverState *bs)
+static int nbd_establish_connection(BlockDriverState *bs,
+                                    NBDConnection *conn)
 {
     BDRVNBDState *s = bs->opaque;
     int sock;
     int ret;
+    uint32_t nbdflags;
     off_t size;
     size_t blocksize;
 
@@ -275,7 +349,7 @@ static int nbd_establish_connection(BlockDriverState *bs)
     }
 
     /* NBD handshake */
-    ret = nbd_receive_negotiate(sock, s->export_name, &s->nbdflags, &size,
+    ret = nbd_receive_negotiate(sock, s->export_name, &nbdflags, &size,
                                 &blocksize);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
@@ -283,41 +357,48 @@ static int nbd_establish_connection(BlockDriverState *bs)
         return ret;
     }
 
+    if (conn == &s->conns[0]) {
+        s->nbdflags = nbdflags;
+        s->size = size;
+        s->blocksize = blocksize;
+    } else if (nbdflags != s->nbdflags || size != s->size) {
+        logout("NBD server exports a different device on this connection\n");
+        closesocket(sock);
+        return -EINVAL;
+    }
+
+    qemu_co_mutex_init(&conn->send_mutex);
+    qemu_co_mutex_init(&conn->free_sema);
+
     /* Now that we're connected, set the socket to be non-blocking and
      * kick the reply mechanism.  */
     socket_set_nonblock(sock);
     qemu_aio_set_fd_handler(sock, nbd_reply_ready, NULL,
-                            nbd_have_request, s);
-
-    s->sock = sock;
-    s->size = size;
-    s->blocksize = blocksize;
+                            nbd_have_request, conn);
+    conn->sock = sock;
 
     logout("Established connection with NBD server\n");
     return 0;
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_teardown_connection(NBDConnection *conn)
 {
-    BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
 
     request.type = NBD_CMD_DISC;
     request.from = 0;
     request.len = 0;
-    nbd_send_request(s->sock, &request);
+    nbd_send_request(conn->sock, &request);
 
-    qemu_aio_set_fd_handler(s->sock, NULL, NULL, NULL, NULL);
-    closesocket(s->sock);
+    qemu_aio_set_fd_handler(conn->sock, NULL, NULL, NULL, NULL);
+    closesocket(conn->sock);
 }
 
 static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
 {
     BDRVNBDState *s = bs->opaque;
     int result;
-
-    qemu_co_mutex_init(&s->send_mutex);
-    qemu_co_mutex_init(&s->free_sema);
+    int i;
 
     /* Pop the config into our state object. Exit if invalid. */
     result = nbd_config(s, filename, flags);
@@ -325,12 +406,22 @@ static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
         return result;
     }
 
-    /* establish TCP connection, return error if it fails
+    /* establish TCP connections, return error if one fails
      * TODO: Configurable retry-until-timeout behaviour.
      */
-    result = nbd_establish_connection(bs);
+    for (i = 0; i < s->num_conns; i++) {
+        result = nbd_establish_connection(bs, &s->conns[i]);
+        if (result < 0) {
+            while (i-- > 0) {
+                nbd_teardown_connection(&s->conns[i]);
+            }
+            g_free(s->export_name);
+            g_free(s->host_spec);
+            return result;
+        }
+    }
 
-    return result;
+    return 0;
 }
 
 static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
@@ -339,23 +430,12 @@ static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
 
     request.type = NBD_CMD_READ;
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, qiov, offset);
-    }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
-
+    return nbd_co_request(s, &request, NULL, qiov, offset);
 }
 
 static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
@@ -364,8 +444,6 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
 
     request.type = NBD_CMD_WRITE;
     if (!bdrv_enable_write_cache(bs) && (s->nbdflags & NBD_FLAG_SEND_FUA)) {
@@ -375,15 +453,7 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, qiov, offset);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
-    }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+    return nbd_co_request(s, &request, qiov, NULL, offset);
 }
 
 /* qemu-nbd has a limit of slightly less than 1M per request.  Try to
@@ -428,8 +498,6 @@ static int nbd_co_flush(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
 
     if (!(s->nbdflags & NBD_FLAG_SEND_FLUSH)) {
         return 0;
@@ -443,15 +511,9 @@ static int nbd_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
-    }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+    /* The server flushes the whole export, so this also covers writes
+     * that completed on the other connections.  */
+    return nbd_co_request(s, &request, NULL, NULL, 0);
 }
 
 static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
@@ -459,34 +521,112 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
 
     if (!(s->nbdflags & NBD_FLAG_SEND_TRIM)) {
         return 0;
     }
     request.type = NBD_CMD_TRIM;
-    request.from = sector_num * 512;;
+    request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
+    return nbd_co_request(s, &request, NULL, NULL, 0);
+}
+
+/* Requests without a payload are only limited by the 32-bit length */
+#define NBD_MAX_ZERO_SECTORS (1 << 21)
+
+static int nbd_co_write_zeroes_1(BlockDriverState *bs, int64_t sector_num,
+                                 int nb_sectors)
+{
+    BDRVNBDState *s = bs->opaque;
+    struct nbd_request request;
+
+    request.type = NBD_CMD_WRITE_ZEROES;
+    if (!bdrv_enable_write_cache(bs) && (s->nbdflags & NBD_FLAG_SEND_FUA)) {
+        request.type |= NBD_CMD_FLAG_FUA;
+    }
+    request.from = sector_num * 512;
+    request.len = nb_sectors * 512;
+
+    return nbd_co_request(s, &request, NULL, NULL, 0);
+}
+
+static int coroutine_fn nbd_co_write_zeroes(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            int nb_sectors)
+{
+    BDRVNBDState *s = bs->opaque;
+    int ret;
+
+    if (!(s->nbdflags & NBD_FLAG_SEND_WRITE_ZEROES)) {
+        return -ENOTSUP;
+    }
+
+    while (nb_sectors > NBD_MAX_ZERO_SECTORS) {
+        ret = nbd_co_write_zeroes_1(bs, sector_num, NBD_MAX_ZERO_SECTORS);
+        if (ret < 0) {
+            return ret;
+        }
+        sector_num += NBD_MAX_ZERO_SECTORS;
+        nb_sectors -= NBD_MAX_ZERO_SECTORS;
+    }
+    return nbd_co_write_zeroes_1(bs, sector_num, nb_sectors);
+}
+
+/*
+ * Ask the server whether the first sectors of the range hold data.  Holes
+ * read as zeroes, so copying an image only needs to transfer the rest.
+ */
+static int coroutine_fn nbd_co_is_allocated(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            int nb_sectors, int *pnum)
+{
+    BDRVNBDState *s = bs->opaque;
+    struct nbd_request request;
+    struct nbd_block_status status;
+    struct iovec iov = {
+        .iov_base = &status,
+        .iov_len  = sizeof(status),
+    };
+    QEMUIOVector qiov;
+    uint32_t length;
+    int ret;
+
+    if (!(s->nbdflags & NBD_FLAG_SEND_BLOCK_STATUS) || nb_sectors == 0) {
+        *pnum = nb_sectors;
+        return 1;
+    }
+
+    nb_sectors = MIN(nb_sectors, NBD_MAX_ZERO_SECTORS);
+    request.type = NBD_CMD_BLOCK_STATUS;
+    request.from = sector_num * 512;
+    request.len = nb_sectors * 512;
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    ret = nbd_co_request(s, &request, NULL, &qiov, 0);
     if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
+        return ret;
     }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+
+    length = be32_to_cpu(status.length);
+    if (length == 0 || length > request.len || length % 512) {
+        return -EIO;
+    }
+    *pnum = length / 512;
+    return !!(be32_to_cpu(status.flags) & NBD_STATE_ALLOCATED);
 }
 
 static void nbd_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
+    int i;
+
     g_free(s->export_name);
     g_free(s->host_spec);
 
-    nbd_teardown_connection(bs);
+    for (i = 0; i < s->num_conns; i++) {
+        nbd_teardown_connection(&s->conns[i]);
+    }
 }
 
 static int64_t nbd_getlength(BlockDriverState *bs)
@@ -505,6 +645,8 @@ static BlockDriver bdrv_nbd = {
     .bdrv_close          = nbd_close,
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
+    .bdrv_co_write_zeroes = nbd_co_write_zeroes,
+    .bdrv_co_is_allocated = nbd_co_is_allocated,
     .bdrv_getlength      = nbd_getlength,
     .protocol_name       = "nbd",
 };
@@ -815,15 +815,21 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
             goto fail;
         }
     } else {
+        /* Only coroutine callers can run concurrently with other requests */
+        if (qemu_in_coroutine()) {
+            qemu_co_mutex_lock(&s->lock);
+        }
         cluster_offset = get_cluster_offset(bs, sector_num << 9, 2,
                                             out_len, 0, 0);
         if (cluster_offset == 0) {
             ret = -EIO;
-            goto fail;
+        } else {
+            cluster_offset &= s->cluster_offset_mask;
+            ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+        }
+        if (qemu_in_coroutine()) {
+            qemu_co_mutex_unlock(&s->lock);
         }
-
-        cluster_offset &= s->cluster_offset_mask;
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
         if (ret < 0) {
             goto fail;
         }
@@ -27,12 +27,24 @@
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Cached tables are found by offset through a hash table, and victims are
+ * taken from an LRU list that holds the tables nobody has a reference to.
+ * Both are O(1), so the cache can be made as large as the working set of
+ * the image.
+ *
+ * Coroutines drop s->lock while they read an L2 table or write back an
+ * evicted one, see qcow2_cache_can_unlock().  A table being read is marked
+ * as loading and holds a reference, so that it is neither evicted nor used
+ * before it is complete; whoever looks it up meanwhile waits on c->waiters.
+ */
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
+    bool    loading;
     int     ref;
+    QLIST_ENTRY(Qcow2CachedTable) hash_next;
+    QTAILQ_ENTRY(Qcow2CachedTable) lru_next;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -40,8 +52,43 @@ struct Qcow2Cache {
     struct Qcow2Cache*      depends;
     int                     size;
     bool                    depends_on_flush;
+    uint64_t                hits;
+    uint64_t                misses;
+
+    /* all tables, entries[i] caches the one at table_array + i * table_size */
+    uint8_t*                table_array;
+    int                     table_size;
+    int                     hash_bits;
+    QLIST_HEAD(, Qcow2CachedTable) *hash;
+    QTAILQ_HEAD(, Qcow2CachedTable) lru;
+
+    /* requests waiting for a table to be loaded or released */
+    CoQueue                 waiters;
 };
 
+static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int i)
+{
+    return c->table_array + (size_t)i * c->table_size;
+}
+
+/* Returns the entry caching @table, or -1 if it isn't one of ours */
+static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t off = (uint8_t *)table - c->table_array;
+
+    if (off < 0 || off % c->table_size || off / c->table_size >= c->size) {
+        return -1;
+    }
+    return off / c->table_size;
+}
+
+static inline unsigned qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    /* offsets are cluster aligned, multiplicative hashing mixes the rest */
+    return (uint32_t)((offset / c->table_size) * 0x9e3779b97f4a7c15ULL >> 32)
+           >> (32 - c->hash_bits);
+}
+
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 {
     BDRVQcowState *s = bs->opaque;
@@ -51,10 +98,21 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
     c = g_malloc0(sizeof(*c));
     c->size = num_tables;
     c->entries = g_malloc0(sizeof(*c->entries) * num_tables);
+    c->table_size = s->cluster_size;
+    c->table_array = qemu_blockalign(bs, (size_t)num_tables * c->table_size);
+
+    /* at least one bucket per table */
+    c->hash_bits = 1;
+    while ((1 << c->hash_bits) < num_tables) {
+        c->hash_bits++;
+    }
+    c->hash = g_malloc0(sizeof(*c->hash) << c->hash_bits);
 
+    QTAILQ_INIT(&c->lru);
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru_next);
     }
+    qemu_co_queue_init(&c->waiters);
 
     return c;
 }
@@ -65,15 +123,24 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
+        assert(!c->entries[i].loading);
     }
 
+    qemu_vfree(c->table_array);
+    g_free(c->hash);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
+void qcow2_cache_get_stats(Qcow2Cache *c, BlockCacheStats *stats)
+{
+    stats->size = c->size;
+    stats->hits = c->hits;
+    stats->misses = c->misses;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -120,8 +187,8 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
-        s->cluster_size);
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset,
+        qcow2_cache_get_table_addr(c, i), s->cluster_size);
     if (ret < 0) {
         return ret;
     }
@@ -131,7 +198,11 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
     return 0;
 }
 
-int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
+/*
+ * Writes back all dirty tables without flushing bs->file, for callers that
+ * flush it themselves anyway
+ */
+int qcow2_cache_write(BlockDriverState *bs, Qcow2Cache *c)
 {
     BDRVQcowState *s = bs->opaque;
     int result = 0;
@@ -147,6 +218,14 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
         }
     }
 
+    return result;
+}
+
+int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int result = qcow2_cache_write(bs, c);
+    int ret;
+
     if (result == 0) {
         ret = bdrv_flush(bs->file);
         if (ret < 0) {
@@ -185,90 +264,201 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
     c->depends_on_flush = true;
 }
 
-static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
+/*
+ * Coroutines hold s->lock whenever they use the caches.  Everything but the
+ * contents of L2 tables (the L1 table, refcounts, the list of in-flight
+ * allocations) is only changed under it, so it can be dropped around the I/O
+ * for an L2 table and requests that need other tables get ahead meanwhile.
+ * Refcount block I/O stays serialized, as the allocation code relies on
+ * refcounts not changing under it.
+ */
+static bool qcow2_cache_can_unlock(BlockDriverState *bs, Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
+    BDRVQcowState *s = bs->opaque;
 
+    return c == s->l2_table_cache && qemu_in_coroutine();
+}
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
-            continue;
-        }
+/* Waits until a table has been loaded or released */
+static void qcow2_cache_wait(BlockDriverState *bs, Qcow2Cache *c)
+{
+    BDRVQcowState *s = bs->opaque;
 
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
+    if (qemu_in_coroutine()) {
+        qemu_co_mutex_unlock(&s->lock);
+        qemu_co_queue_wait(&c->waiters);
+        qemu_co_mutex_lock(&s->lock);
+    } else {
+        qemu_aio_wait();
+    }
+}
+
+/*
+ * Writes back a dirty table that is about to be evicted without s->lock.
+ * The table is marked clean before the write and holds a reference during
+ * it, so a request that changes it meanwhile makes it dirty again instead
+ * of having its update dropped.
+ */
+static int qcow2_cache_entry_writeback(BlockDriverState *bs, Qcow2Cache *c,
+                                       int i)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CachedTable *entry = &c->entries[i];
+    int ret = 0;
+
+    if (c->depends) {
+        ret = qcow2_cache_flush_dependency(bs, c);
+    } else if (c->depends_on_flush) {
+        ret = bdrv_flush(bs->file);
+        if (ret >= 0) {
+            c->depends_on_flush = false;
         }
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    /* the dependency may have been flushed by someone else meanwhile */
+    if (!entry->dirty || entry->ref) {
+        return 0;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
+    trace_qcow2_cache_entry_flush(qemu_coroutine_self(),
+                                  c == s->l2_table_cache, i);
+
+    QTAILQ_REMOVE(&c->lru, entry, lru_next);
+    entry->ref++;
+    entry->dirty = false;
+
+    qemu_co_mutex_unlock(&s->lock);
+    ret = bdrv_pwrite(bs->file, entry->offset,
+                      qcow2_cache_get_table_addr(c, i), s->cluster_size);
+    qemu_co_mutex_lock(&s->lock);
 
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
+    if (ret < 0) {
+        entry->dirty = true;
+    }
+    if (--entry->ref == 0) {
+        QTAILQ_INSERT_HEAD(&c->lru, entry, lru_next);
     }
+    qemu_co_queue_restart_all(&c->waiters);
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
+    return ret < 0 ? ret : 0;
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    Qcow2CachedTable *entry;
+
+    QLIST_FOREACH(entry, &c->hash[qcow2_cache_hash(c, offset)], hash_next) {
+        if (entry->offset == offset) {
+            return entry - c->entries;
+        }
     }
-    return min_index;
+    return -1;
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcowState *s = bs->opaque;
+    bool unlock = qcow2_cache_can_unlock(bs, c);
+    Qcow2CachedTable *entry;
     int i;
     int ret;
 
     trace_qcow2_cache_get(qemu_coroutine_self(), c == s->l2_table_cache,
                           offset, read_from_disk);
 
+retry:
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        if (c->entries[i].loading) {
+            qcow2_cache_wait(bs, c);
+            goto retry;
         }
+        c->hits++;
+        goto found;
     }
 
     /* If not, write a table back and replace it */
-    i = qcow2_cache_find_entry_to_replace(c);
+    entry = QTAILQ_FIRST(&c->lru);
+    if (!entry) {
+        /* Every table is in use by a request that waits for I/O */
+        if (!unlock) {
+            abort();
+        }
+        qcow2_cache_wait(bs, c);
+        goto retry;
+    }
+    i = entry - c->entries;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
-    if (i < 0) {
-        return i;
+
+    if (unlock && entry->dirty) {
+        ret = qcow2_cache_entry_writeback(bs, c, i);
+        if (ret < 0) {
+            return ret;
+        }
+        /* The table may have been looked up again, or another request may
+         * have loaded ours meanwhile */
+        goto retry;
     }
 
     ret = qcow2_cache_entry_flush(bs, c, i);
     if (ret < 0) {
         return ret;
     }
+    c->misses++;
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (entry->offset) {
+        QLIST_REMOVE(entry, hash_next);
+    }
+    entry->offset = offset;
+    QLIST_INSERT_HEAD(&c->hash[qcow2_cache_hash(c, offset)], entry,
+                      hash_next);
+
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        QTAILQ_REMOVE(&c->lru, entry, lru_next);
+        entry->ref++;
+        entry->loading = true;
+
+        if (unlock) {
+            qemu_co_mutex_unlock(&s->lock);
+        }
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_get_table_addr(c, i),
+                         s->cluster_size);
+        if (unlock) {
+            qemu_co_mutex_lock(&s->lock);
+        }
+
+        entry->loading = false;
+        qemu_co_queue_restart_all(&c->waiters);
         if (ret < 0) {
+            QLIST_REMOVE(entry, hash_next);
+            entry->offset = 0;
+            if (--entry->ref == 0) {
+                QTAILQ_INSERT_HEAD(&c->lru, entry, lru_next);
+            }
             return ret;
         }
+        goto done;
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
-    c->entries[i].offset = offset;
-
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
-    c->entries[i].ref++;
-    *table = c->entries[i].table;
+    if (c->entries[i].ref++ == 0) {
+        QTAILQ_REMOVE(&c->lru, &c->entries[i], lru_next);
+    }
+done:
+    *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
@@ -290,34 +480,31 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, *table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
+    if (i < 0) {
+        return -ENOENT;
     }
-    return -ENOENT;
 
-found:
     c->entries[i].ref--;
     *table = NULL;
 
     assert(c->entries[i].ref >= 0);
+
+    /* the least recently released table is the next victim */
+    if (c->entries[i].ref == 0) {
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru_next);
+        qemu_co_queue_restart_all(&c->waiters);
+    }
     return 0;
 }
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
+    if (i < 0) {
+        abort();
     }
-    abort();
-
-found:
     c->entries[i].dirty = true;
 }
@@ -28,6 +28,9 @@
 #include "block_int.h"
 #include "block/qcow2.h"
 #include "trace.h"
+#ifdef CONFIG_POSIX
+#include "thread-pool.h"
+#endif
 
 int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size)
 {
@@ -159,11 +162,20 @@ static int write_l1_entry(BlockDriverState *bs, int l1_index)
  * table) copy the contents of the old L2 table into the newly allocated one.
  * Otherwise the new table is initialized with zeros.
  *
+ * Coroutines only hold s->lock for the refcount update: the new table and
+ * the L1 entry are written without it, and requests for the same L1 entry
+ * wait in get_cluster_table() until that is done.  The L1 entry is only set
+ * once the table is on disk, so that readers meanwhile still see the old
+ * one.
  */
 
 static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 {
     BDRVQcowState *s = bs->opaque;
+    bool unlock = qemu_in_coroutine();
+    Qcow2L2Alloc alloc = {
+        .l1_index = l1_index,
+    };
     uint64_t old_l2_offset;
     uint64_t *l2_table;
     int64_t l2_offset;
@@ -180,17 +192,22 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         return l2_offset;
     }
 
-    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    /* the refcount must be on disk before the L1 entry, the flush below
+     * takes care of that */
+    ret = qcow2_cache_write(bs, s->refcount_block_cache);
     if (ret < 0) {
-        goto fail;
+        return ret;
     }
 
+    qemu_co_queue_init(&alloc.waiters);
+    QLIST_INSERT_HEAD(&s->l2_allocs, &alloc, next);
+
     /* allocate a new entry in the l2 cache */
 
     trace_qcow2_l2_allocate_get_empty(bs, l1_index);
     ret = qcow2_cache_get_empty(bs, s->l2_table_cache, l2_offset, (void**) table);
     if (ret < 0) {
-        return ret;
+        goto out;
     }
 
     l2_table = *table;
@@ -218,32 +235,57 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         }
     }
 
-    /* write the l2 table to the file */
+    /* write the l2 table to the file, the other dirty tables in the cache
+     * don't need to be on disk before the L1 entry and can wait.  Nobody
+     * else can get at the table before the L1 entry is set, so it is written
+     * directly and stays clean in the cache. */
     BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
 
     trace_qcow2_l2_allocate_write_l2(bs, l1_index);
-    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (unlock) {
+        qemu_co_mutex_unlock(&s->lock);
+    }
+    ret = bdrv_pwrite(bs->file, l2_offset, l2_table, s->cluster_size);
+    if (ret >= 0) {
+        ret = bdrv_flush(bs->file);
+    }
     if (ret < 0) {
-        goto fail;
+        goto fail_unlocked;
     }
 
     /* update the L1 entry */
     trace_qcow2_l2_allocate_write_l1(bs, l1_index);
+    if (unlock) {
+        qemu_co_mutex_lock(&s->l1_lock);
+    }
     s->l1_table[l1_index] = l2_offset | QCOW_OFLAG_COPIED;
     ret = write_l1_entry(bs, l1_index);
+    if (ret < 0) {
+        s->l1_table[l1_index] = old_l2_offset;
+    }
+    if (unlock) {
+        qemu_co_mutex_unlock(&s->l1_lock);
+    }
+
+fail_unlocked:
+    if (unlock) {
+        qemu_co_mutex_lock(&s->lock);
+    }
     if (ret < 0) {
         goto fail;
     }
 
     *table = l2_table;
     trace_qcow2_l2_allocate_done(bs, l1_index, 0);
-    return 0;
+    ret = 0;
+    goto out;
 
 fail:
     trace_qcow2_l2_allocate_done(bs, l1_index, ret);
     qcow2_cache_put(bs, s->l2_table_cache, (void**) table);
-    s->l1_table[l1_index] = old_l2_offset;
+out:
+    QLIST_REMOVE(&alloc, next);
+    qemu_co_queue_restart_all(&alloc.waiters);
     return ret;
 }
 
@@ -507,11 +549,29 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
     unsigned int l1_index, l2_index;
     uint64_t l2_offset;
     uint64_t *l2_table = NULL;
+    Qcow2L2Alloc *alloc;
     int ret;
 
     /* seek the the l2 offset in the l1 table */
 
     l1_index = offset >> (s->l2_bits + s->cluster_bits);
+
+again:
+    /* Wait for an allocation of the same L2 table that runs without s->lock,
+     * and for all of them if the L1 table is going to be replaced */
+    QLIST_FOREACH(alloc, &s->l2_allocs, next) {
+        if (alloc->l1_index == l1_index || l1_index >= s->l1_size) {
+            if (qemu_in_coroutine()) {
+                qemu_co_mutex_unlock(&s->lock);
+                qemu_co_queue_wait(&alloc->waiters);
+                qemu_co_mutex_lock(&s->lock);
+            } else {
+                qemu_aio_wait();
+            }
+            goto again;
+        }
+    }
+
     if (l1_index >= s->l1_size) {
         ret = qcow2_grow_l1_table(bs, l1_index + 1, false);
         if (ret < 0) {
@@ -774,6 +834,9 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
      * Check if there already is an AIO write request in flight which allocates
      * the same cluster. In this case we need to wait until the previous
      * request has completed and updated the L2 table accordingly.
+     *
+     * Only real overlaps wait, allocations of adjacent clusters (as in a
+     * sequential or striped write pattern) proceed in parallel.
      */
     QLIST_FOREACH(old_alloc, &s->cluster_allocs, next_in_flight) {
 
@@ -782,7 +845,7 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = old_alloc->offset >> s->cluster_bits;
         uint64_t old_end = old_start + old_alloc->nb_clusters;
 
-        if (end < old_start || start > old_end) {
+        if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
             if (start < old_start) {
@@ -811,7 +874,7 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
     if (*host_offset == 0) {
         int64_t cluster_offset =
-            qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
+            qcow2_alloc_data_clusters(bs, guest_offset, nb_clusters);
         if (cluster_offset < 0) {
             return cluster_offset;
         }
@@ -1021,28 +1084,196 @@ static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
     return 0;
 }
 
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+typedef struct Qcow2Decompress {
+    uint8_t *out_buf;
+    int out_buf_size;
+    const uint8_t *buf;
+    int buf_size;
+} Qcow2Decompress;
+
+static int qcow2_decompress_func(void *opaque)
+{
+    Qcow2Decompress *d = opaque;
+
+    if (decompress_buffer(d->out_buf, d->out_buf_size,
+                          d->buf, d->buf_size) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * Inflates in a worker thread, so that requests for other compressed
+ * clusters are decompressed in parallel instead of one after the other in
+ * the I/O thread.
+ */
+static int coroutine_fn qcow2_co_decompress(BlockDriverState *bs,
+    uint8_t *out_buf, int out_buf_size, const uint8_t *buf, int buf_size)
+{
+    Qcow2Decompress d = {
+        .out_buf        = out_buf,
+        .out_buf_size   = out_buf_size,
+        .buf            = buf,
+        .buf_size       = buf_size,
+    };
+
+#ifdef CONFIG_POSIX
+    ThreadPool *pool = thread_pool_get_default();
+
+    if (pool) {
+        return thread_pool_submit_co(pool, qcow2_decompress_func, &d);
+    }
+#endif
+    return qcow2_decompress_func(&d);
+}
+
+void qcow2_compressed_cache_init(BlockDriverState *bs, int size)
 {
     BDRVQcowState *s = bs->opaque;
+
+    s->compressed_cache = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->compressed_lru);
+    s->compressed_cache_size = size;
+    s->compressed_cache_entries = 0;
+}
+
+static void compressed_cache_remove(BDRVQcowState *s,
+                                    Qcow2CompressedCluster *c)
+{
+    g_hash_table_remove(s->compressed_cache, &c->offset);
+    if (!c->busy) {
+        QTAILQ_REMOVE(&s->compressed_lru, c, next_lru);
+    }
+    s->compressed_cache_entries--;
+}
+
+static void compressed_cache_free(Qcow2CompressedCluster *c)
+{
+    qemu_vfree(c->data);
+    g_free(c);
+}
+
+/*
+ * Drops all decompressed clusters, for writes may free compressed clusters
+ * and reuse their space.  Clusters that are being read are dropped by their
+ * reader when it is done.
+ */
+void qcow2_compressed_cache_invalidate(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressedCluster *c, *next;
+
+    QTAILQ_FOREACH_SAFE(c, &s->compressed_lru, next_lru, next) {
+        compressed_cache_remove(s, c);
+        compressed_cache_free(c);
+    }
+    s->compressed_cache_generation++;
+}
+
+void qcow2_compressed_cache_destroy(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (!s->compressed_cache) {
+        return;
+    }
+    qcow2_compressed_cache_invalidate(bs);
+    assert(s->compressed_cache_entries == 0);
+    g_hash_table_destroy(s->compressed_cache);
+    s->compressed_cache = NULL;
+}
+
+/*
+ * Copies nb_sectors from index_in_cluster of the compressed cluster at
+ * cluster_offset to qiov.
+ *
+ * Called with s->lock held, it is dropped while reading and inflating the
+ * cluster.  Other requests for the same cluster wait for it, others run in
+ * parallel.
+ */
+int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset,
+                             QEMUIOVector *qiov, int index_in_cluster,
+                             int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressedCluster *c;
     int ret, csize, nb_csectors, sector_offset;
-    uint64_t coffset;
+    uint64_t coffset, generation;
+    uint8_t *buf;
 
     coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file, coffset >> 9, s->cluster_data, nb_csectors);
-        if (ret < 0) {
-            return ret;
-        }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
+
+again:
+    c = g_hash_table_lookup(s->compressed_cache, &coffset);
+    if (c && c->busy) {
+        qemu_co_mutex_unlock(&s->lock);
+        qemu_co_queue_wait(&c->waiting);
+        qemu_co_mutex_lock(&s->lock);
+        goto again;
+    } else if (c) {
+        QTAILQ_REMOVE(&s->compressed_lru, c, next_lru);
+        QTAILQ_INSERT_TAIL(&s->compressed_lru, c, next_lru);
+        goto copy;
+    }
+
+    /* Reuse the least recently used cluster, or add one if all are busy */
+    c = QTAILQ_FIRST(&s->compressed_lru);
+    if (c && s->compressed_cache_entries >= s->compressed_cache_size) {
+        compressed_cache_remove(s, c);
+    } else {
+        c = g_malloc0(sizeof(*c));
+        c->data = qemu_blockalign(bs, s->cluster_size);
+        qemu_co_queue_init(&c->waiting);
+    }
+    c->offset = coffset;
+    c->busy = true;
+    g_hash_table_insert(s->compressed_cache, &c->offset, c);
+    s->compressed_cache_entries++;
+    generation = s->compressed_cache_generation;
+
+    nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+    sector_offset = coffset & 511;
+    csize = nb_csectors * 512 - sector_offset;
+    buf = qemu_blockalign(bs, nb_csectors * 512);
+
+    qemu_co_mutex_unlock(&s->lock);
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_read(bs->file, coffset >> 9, buf, nb_csectors);
+    if (ret >= 0) {
+        ret = qcow2_co_decompress(bs, c->data, s->cluster_size,
+                                  buf + sector_offset, csize);
+    }
+    qemu_co_mutex_lock(&s->lock);
+    qemu_vfree(buf);
+
+    /* the waiters look the cluster up again */
+    qemu_co_queue_restart_all(&c->waiting);
+
+    if (ret < 0 || generation != s->compressed_cache_generation) {
+        /* after an invalidation this request still gets what it read, but
+         * nobody else does */
+        compressed_cache_remove(s, c);
+        if (ret >= 0) {
+            qemu_iovec_from_buf(qiov, 0, c->data + index_in_cluster * 512,
+                                nb_sectors * 512);
         }
-        s->cluster_cache_offset = coffset;
+        compressed_cache_free(c);
+        return ret;
+    }
+
+    c->busy = false;
+    QTAILQ_INSERT_TAIL(&s->compressed_lru, c, next_lru);
+    while (s->compressed_cache_entries > s->compressed_cache_size &&
+           QTAILQ_FIRST(&s->compressed_lru) != c) {
+        Qcow2CompressedCluster *old = QTAILQ_FIRST(&s->compressed_lru);
+
+        compressed_cache_remove(s, old);
+        compressed_cache_free(old);
     }
+
+copy:
+    qemu_iovec_from_buf(qiov, 0, c->data + index_in_cluster * 512,
+                        nb_sectors * 512);
     return 0;
 }
 
@@ -1100,7 +1331,7 @@ int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     unsigned int nb_clusters;
     int ret;
 
-    end_offset = offset + (nb_sectors << BDRV_SECTOR_BITS);
+    end_offset = offset + ((uint64_t)nb_sectors << BDRV_SECTOR_BITS);
 
     /* Round start up and end down */
     offset = align_offset(offset, s->cluster_size);
@@ -1112,18 +1343,26 @@ int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
 
     nb_clusters = size_to_clusters(s, end_offset - offset);
 
+    /* Clusters that are freed are discarded in the image file as well */
+    s->cache_discards = true;
+
     /* Each L2 table is handled by its own loop iteration */
     while (nb_clusters > 0) {
         ret = discard_single_l2(bs, offset, nb_clusters);
         if (ret < 0) {
-            return ret;
+            goto fail;
         }
 
         nb_clusters -= ret;
         offset += (ret * s->cluster_size);
     }
 
-    return 0;
+    ret = 0;
+fail:
+    s->cache_discards = false;
+    qcow2_process_discards(bs, ret);
+
+    return ret;
 }
 
 /*
@@ -51,6 +51,7 @@ int qcow2_refcount_init(BlockDriverState *bs)
         for(i = 0; i < s->refcount_table_size; i++)
             be64_to_cpus(&s->refcount_table[i]);
     }
+    QTAILQ_INIT(&s->discards);
     return 0;
  fail:
     return -ENOMEM;
@@ -59,6 +60,7 @@ int qcow2_refcount_init(BlockDriverState *bs)
 void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    qcow2_process_discards(bs, -EINVAL);
     g_free(s->refcount_table);
 }
 
@@ -411,6 +413,95 @@ fail_block:
     return ret;
 }
 
+/*
+ * Discard the clusters freed since s->cache_discards was set in the image
+ * file.  Adjacent clusters were merged into one region, so that a large
+ * guest discard becomes a few large requests.  If @ret is negative, the
+ * regions are only forgotten.
+ */
+void qcow2_process_discards(BlockDriverState *bs, int ret)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2DiscardRegion *d, *next;
+
+    QTAILQ_FOREACH_SAFE(d, &s->discards, next, next) {
+        QTAILQ_REMOVE(&s->discards, d, next);
+
+        /* Discard is a hint, errors don't matter */
+        if (ret >= 0) {
+            bdrv_discard(bs->file, d->offset >> BDRV_SECTOR_BITS,
+                         d->bytes >> BDRV_SECTOR_BITS);
+        }
+        g_free(d);
+    }
+}
+
+/* Queue a range whose refcount dropped to zero for discarding */
+static void update_refcount_discard(BlockDriverState *bs,
+                                    uint64_t offset, uint64_t length)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2DiscardRegion *d, *p, *next;
+
+    QTAILQ_FOREACH(d, &s->discards, next) {
+        if (offset + length == d->offset || d->offset + d->bytes == offset) {
+            d->offset = MIN(offset, d->offset);
+            d->bytes += length;
+            goto found;
+        }
+    }
+
+    d = g_new(Qcow2DiscardRegion, 1);
+    d->offset = offset;
+    d->bytes = length;
+    QTAILQ_INSERT_TAIL(&s->discards, d, next);
+
+found:
+    /* d may now close the gap to another region */
+    QTAILQ_FOREACH_SAFE(p, &s->discards, next, next) {
+        if (p != d && (p->offset == d->offset + d->bytes ||
+                       p->offset + p->bytes == d->offset)) {
+            d->offset = MIN(d->offset, p->offset);
+            d->bytes += p->bytes;
+            QTAILQ_REMOVE(&s->discards, p, next);
+            g_free(p);
+        }
+    }
+}
+
+/* A queued range was allocated again before it was discarded */
+static void update_refcount_undiscard(BlockDriverState *bs,
+                                      uint64_t offset, uint64_t length)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2DiscardRegion *d, *next;
+    uint64_t end = offset + length;
+
+    QTAILQ_FOREACH_SAFE(d, &s->discards, next, next) {
+        uint64_t d_end = d->offset + d->bytes;
+
+        if (end <= d->offset || offset >= d_end) {
+            continue;
+        }
+        if (offset > d->offset && end < d_end) {
+            Qcow2DiscardRegion *tail = g_new(Qcow2DiscardRegion, 1);
+
+            tail->offset = end;
+            tail->bytes = d_end - end;
+            QTAILQ_INSERT_AFTER(&s->discards, d, tail, next);
+            d->bytes = offset - d->offset;
+        } else if (offset > d->offset) {
+            d->bytes = offset - d->offset;
+        } else if (end < d_end) {
+            d->offset = end;
+            d->bytes = d_end - end;
+        } else {
+            QTAILQ_REMOVE(&s->discards, d, next);
+            g_free(d);
+        }
+    }
+}
+
 /* XXX: cache several refcount block clusters ? */
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
     int64_t offset, int64_t length, int addend)
@@ -478,6 +569,12 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         if (refcount == 0 && cluster_index < s->free_cluster_index) {
             s->free_cluster_index = cluster_index;
         }
+        if (refcount == 0 && addend < 0 && s->cache_discards) {
+            update_refcount_discard(bs, cluster_offset, s->cluster_size);
+        } else if (refcount == addend && addend > 0 &&
+                   !QTAILQ_EMPTY(&s->discards)) {
+            update_refcount_undiscard(bs, cluster_offset, s->cluster_size);
+        }
         refcount_block[block_index] = cpu_to_be16(refcount);
     }
 
@@ -582,6 +679,70 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, int64_t size)
     return offset;
 }
 
+/*
+ * Allocates up to *nb_clusters contiguous clusters for guest data at
+ * guest_offset and updates *nb_clusters to the number actually allocated.
+ *
+ * When the guest writes sequentially, the clusters come from a pool that is
+ * allocated ahead of need, so that a sequential fill doesn't pay a refcount
+ * update for every request.  The pool starts at MIN_CLUSTER_POOL_SIZE and
+ * doubles with each refill up to MAX_CLUSTER_POOL_SIZE while the writes stay
+ * sequential.  Its clusters have their refcount set already; whatever is
+ * left is freed by qcow2_free_cluster_pool() when the image is closed, and
+ * leaks after a crash.
+ */
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t guest_offset,
+                                  unsigned int *nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t bytes = (uint64_t)*nb_clusters << s->cluster_bits;
+    int64_t offset;
+
+    if (guest_offset != s->pool_next_guest_offset) {
+        s->pool_refill = 0;
+        s->pool_next_guest_offset = guest_offset + bytes;
+        return qcow2_alloc_clusters(bs, bytes);
+    }
+
+    if (s->pool_clusters == 0) {
+        unsigned int n;
+
+        s->pool_refill = MAX(s->pool_refill * 2,
+                             MIN_CLUSTER_POOL_SIZE >> s->cluster_bits);
+        s->pool_refill = MIN(s->pool_refill,
+                             MAX_CLUSTER_POOL_SIZE >> s->cluster_bits);
+        n = MAX(*nb_clusters, s->pool_refill);
+
+        offset = qcow2_alloc_clusters(bs, (int64_t)n << s->cluster_bits);
+        if (offset < 0) {
+            return offset;
+        }
+        s->pool_offset = offset;
+        s->pool_clusters = n;
+    }
+
+    *nb_clusters = MIN(*nb_clusters, s->pool_clusters);
+    bytes = (uint64_t)*nb_clusters << s->cluster_bits;
+
+    offset = s->pool_offset;
+    s->pool_offset += bytes;
+    s->pool_clusters -= *nb_clusters;
+    s->pool_next_guest_offset = guest_offset + bytes;
+
+    return offset;
+}
+
+void qcow2_free_cluster_pool(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->pool_clusters) {
+        qcow2_free_clusters(bs, s->pool_offset,
+                            (int64_t)s->pool_clusters << s->cluster_bits);
+        s->pool_clusters = 0;
+    }
+}
+
 int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     int nb_clusters)
 {
@@ -718,17 +879,150 @@ void qcow2_free_any_clusters(BlockDriverState *bs,
 
 
 
+/*
+ * Adds addend to the refcounts of the L2 table *l1_entry points to and of
+ * all clusters it references, and updates QCOW_OFLAG_COPIED in the L2 table
+ * and in *l1_entry.  With addend == 0 only the flags are updated.
+ *
+ * Physically contiguous clusters are updated with a single update_refcount()
+ * call, and nothing is flushed here: the callers flush once they are done.
+ */
+int qcow2_update_l2_refcount(BlockDriverState *bs, uint64_t *l1_entry,
+                             int addend)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *l2_table = NULL;
+    uint64_t l2_offset, offset, old_offset, run_start = 0;
+    int64_t run_len = 0;
+    int j, nb_csectors, refcount, ret;
+    bool l2_freed = false;
+
+    l2_offset = *l1_entry & L1E_OFFSET_MASK;
+    if (!l2_offset) {
+        return 0;
+    }
+
+    if (addend < 0) {
+        refcount = get_refcount(bs, l2_offset >> s->cluster_bits);
+        if (refcount < 0) {
+            return refcount;
+        }
+        /* Don't leave a dirty copy of a freed table in the cache, it would
+         * be written over whatever the cluster is reused for */
+        l2_freed = (refcount + addend <= 0);
+    }
+
+    ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
+        (void**) &l2_table);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* First the refcounts... */
+    for (j = 0; addend != 0 && j < s->l2_size; j++) {
+        offset = be64_to_cpu(l2_table[j]);
+        if (offset & QCOW_OFLAG_COMPRESSED) {
+            nb_csectors = ((offset >> s->csize_shift) & s->csize_mask) + 1;
+            ret = update_refcount(bs, (offset & s->cluster_offset_mask) & ~511,
+                                  nb_csectors * 512, addend);
+            if (ret < 0) {
+                goto fail;
+            }
+            continue;
+        }
+
+        offset &= L2E_OFFSET_MASK;
+        if (!offset) {
+            continue;
+        }
+        if (run_len && offset == run_start + run_len) {
+            run_len += s->cluster_size;
+            continue;
+        }
+        ret = update_refcount(bs, run_start, run_len, addend);
+        if (ret < 0) {
+            goto fail;
+        }
+        run_start = offset;
+        run_len = s->cluster_size;
+    }
+    ret = update_refcount(bs, run_start, run_len, addend);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* ...then the flags */
+    for (j = 0; !l2_freed && j < s->l2_size; j++) {
+        offset = be64_to_cpu(l2_table[j]);
+        if (!(offset & QCOW_OFLAG_COMPRESSED) && !(offset & L2E_OFFSET_MASK)) {
+            continue;
+        }
+        old_offset = offset;
+        offset &= ~QCOW_OFLAG_COPIED;
+
+        if (offset & QCOW_OFLAG_COMPRESSED) {
+            /* compressed clusters are never modified */
+            refcount = 2;
+        } else if (addend > 0) {
+            /* now referenced by at least two tables */
+            refcount = 2;
+        } else {
+            refcount = get_refcount(bs, (offset & L2E_OFFSET_MASK) >>
+                                        s->cluster_bits);
+            if (refcount < 0) {
+                ret = refcount;
+                goto fail;
+            }
+        }
+
+        if (refcount == 1) {
+            offset |= QCOW_OFLAG_COPIED;
+        }
+        if (offset != old_offset) {
+            if (addend > 0) {
+                qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                    s->refcount_block_cache);
+            }
+            l2_table[j] = cpu_to_be64(offset);
+            qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
+        }
+    }
+
+    ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = update_refcount(bs, l2_offset, 1, addend);
+    if (ret < 0) {
+        goto fail;
+    }
+    refcount = get_refcount(bs, l2_offset >> s->cluster_bits);
+    if (refcount < 0) {
+        ret = refcount;
+        goto fail;
+    } else if (refcount == 1) {
+        l2_offset |= QCOW_OFLAG_COPIED;
+    }
+    *l1_entry = l2_offset;
+
+    ret = 0;
+fail:
+    if (l2_table) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    }
+    return ret;
+}
+
 /* update the refcounts of snapshots and the copied flag */
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l1_table, *l2_table, l2_offset, offset, l1_size2, l1_allocated;
-    int64_t old_offset, old_l2_offset;
-    int i, j, l1_modified = 0, nb_csectors, refcount;
+    uint64_t *l1_table, l1_entry, l1_size2, l1_allocated;
+    int i, l1_modified = 0;
     int ret;
 
-    l2_table = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
 
@@ -758,98 +1052,19 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     }
 
     for(i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
-            old_l2_offset = l2_offset;
-            l2_offset &= L1E_OFFSET_MASK;
-
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
-
-            for(j = 0; j < s->l2_size; j++) {
-                offset = be64_to_cpu(l2_table[j]);
-                if (offset != 0) {
-                    old_offset = offset;
-                    offset &= ~QCOW_OFLAG_COPIED;
-                    if (offset & QCOW_OFLAG_COMPRESSED) {
-                        nb_csectors = ((offset >> s->csize_shift) &
-                                       s->csize_mask) + 1;
-                        if (addend != 0) {
-                            int ret;
-                            ret = update_refcount(bs,
-                                (offset & s->cluster_offset_mask) & ~511,
-                                nb_csectors * 512, addend);
-                            if (ret < 0) {
-                                goto fail;
-                            }
-
-                            /* TODO Flushing once for the whole function should
-                             * be enough */
-                            bdrv_flush(bs->file);
-                        }
-                        /* compressed clusters are never modified */
-                        refcount = 2;
-                    } else {
-                        uint64_t cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
-                        if (addend != 0) {
-                            refcount = update_cluster_refcount(bs, cluster_index, addend);
-                        } else {
-                            refcount = get_refcount(bs, cluster_index);
-                        }
-
-                        if (refcount < 0) {
-                            ret = -EIO;
-                            goto fail;
-                        }
-                    }
-
-                    if (refcount == 1) {
-                        offset |= QCOW_OFLAG_COPIED;
-                    }
-                    if (offset != old_offset) {
-                        if (addend > 0) {
-                            qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                                s->refcount_block_cache);
-                        }
-                        l2_table[j] = cpu_to_be64(offset);
-                        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-                    }
-                }
-            }
-
-            ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
-
-
-            if (addend != 0) {
-                refcount = update_cluster_refcount(bs, l2_offset >> s->cluster_bits, addend);
-            } else {
-                refcount = get_refcount(bs, l2_offset >> s->cluster_bits);
-            }
-            if (refcount < 0) {
-                ret = -EIO;
-                goto fail;
-            } else if (refcount == 1) {
-                l2_offset |= QCOW_OFLAG_COPIED;
-            }
-            if (l2_offset != old_l2_offset) {
-                l1_table[i] = l2_offset;
-                l1_modified = 1;
-            }
+        l1_entry = l1_table[i];
+        ret = qcow2_update_l2_refcount(bs, &l1_entry, addend);
+        if (ret < 0) {
+            goto fail;
+        }
+        if (l1_entry != l1_table[i]) {
+            l1_table[i] = l1_entry;
+            l1_modified = 1;
         }
     }
 
     ret = 0;
 fail:
-    if (l2_table) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
-    }
-
     /* Update L1 only if it isn't deleted anyway (addend = -1) */
     if (addend >= 0 && l1_modified) {
         for(i = 0; i < l1_size; i++)
@@ -880,15 +1095,187 @@ fail:
  *
  * Modifies the number of errors in res.
  */
+/*
+ * qemu-img check counts the references to each cluster in memory.  Most
+ * clusters are referenced once or not at all, so one byte per cluster is
+ * enough; the few clusters referenced 255 times or more are counted in a
+ * hash table instead.
+ */
+#define CHECK_REFCOUNT_OVERFLOW 0xff
+
+typedef struct CheckRefcounts {
+    uint8_t *counts;
+    GHashTable *overflow;
+    int64_t nb_clusters;
+} CheckRefcounts;
+
+static int check_refcount_get(CheckRefcounts *rc, int64_t k)
+{
+    gpointer value;
+
+    if (rc->counts[k] < CHECK_REFCOUNT_OVERFLOW) {
+        return rc->counts[k];
+    }
+    value = g_hash_table_lookup(rc->overflow, &k);
+    return GPOINTER_TO_INT(value);
+}
+
+/* Returns the new reference count of cluster k, 0 on overflow */
+static int check_refcount_inc(CheckRefcounts *rc, int64_t k)
+{
+    int64_t *key;
+    int refcount;
+
+    if (rc->counts[k] < CHECK_REFCOUNT_OVERFLOW - 1) {
+        return ++rc->counts[k];
+    }
+
+    refcount = (check_refcount_get(rc, k) + 1) & 0xffff;
+    rc->counts[k] = CHECK_REFCOUNT_OVERFLOW;
+    key = g_new(int64_t, 1);
+    *key = k;
+    g_hash_table_replace(rc->overflow, key, GINT_TO_POINTER(refcount));
+    return refcount;
+}
+
+/*
+ * qemu-img check reads every L2 table and refcount block once.  Many of
+ * these reads are kept in flight to hide the latency of the image file,
+ * but the tables are still processed one at a time and in order, so that
+ * the output doesn't depend on the order in which the reads complete.
+ */
+#define CHECK_READAHEAD 32
+
+typedef struct CheckTable {
+    void *buf;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    bool pending;
+    bool done;
+    int ret;
+} CheckTable;
+
+typedef struct CheckReader {
+    BlockDriverState *bs;
+    uint64_t *offsets;
+    int nb_tables;
+    int next_issue;
+    int current;
+    bool async;
+    CheckTable slots[CHECK_READAHEAD];
+} CheckReader;
+
+static void check_read_cb(void *opaque, int ret)
+{
+    CheckTable *t = opaque;
+
+    t->ret = ret;
+    t->done = true;
+}
+
+/* offsets[i] is the offset of table i in the image file, 0 for none */
+static void check_reader_init(CheckReader *r, BlockDriverState *bs,
+                              uint64_t *offsets, int nb_tables)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    memset(r, 0, sizeof(*r));
+    r->bs = bs;
+    r->offsets = offsets;
+    r->nb_tables = nb_tables;
+    r->current = -1;
+    /* the DEBUG_ALLOC checks run in coroutines, which must not poll */
+    r->async = !qemu_in_coroutine();
+    for (i = 0; i < CHECK_READAHEAD; i++) {
+        r->slots[i].buf = qemu_blockalign(bs, s->cluster_size);
+    }
+}
+
+static void check_reader_wait(CheckTable *t)
+{
+    while (t->pending && !t->done) {
+        qemu_aio_wait();
+    }
+    t->pending = false;
+}
+
+static void check_reader_destroy(CheckReader *r)
+{
+    int i;
+
+    for (i = 0; i < CHECK_READAHEAD; i++) {
+        check_reader_wait(&r->slots[i]);
+        qemu_vfree(r->slots[i].buf);
+    }
+}
+
+/*
+ * Returns table i, or NULL if there is none.  Tables must be requested in
+ * increasing order (the same table may be requested again), and the buffer
+ * of a table is only valid until the next one is requested.
+ */
+static void *check_reader_get(CheckReader *r, int i, int *ret)
+{
+    BDRVQcowState *s = r->bs->opaque;
+    CheckTable *t;
+
+    *ret = 0;
+    if (i == r->current) {
+        return r->slots[i % CHECK_READAHEAD].buf;
+    }
+    r->current = -1;
+    if (r->next_issue <= i) {
+        r->next_issue = i;
+    }
+    while (r->async && r->next_issue < r->nb_tables &&
+           r->next_issue < i + CHECK_READAHEAD) {
+        uint64_t offset = r->offsets[r->next_issue];
+
+        t = &r->slots[r->next_issue % CHECK_READAHEAD];
+        check_reader_wait(t);
+        r->next_issue++;
+        if (!offset || (offset & (BDRV_SECTOR_SIZE - 1))) {
+            continue;
+        }
+
+        t->iov.iov_base = t->buf;
+        t->iov.iov_len = s->cluster_size;
+        qemu_iovec_init_external(&t->qiov, &t->iov, 1);
+        t->pending = true;
+        t->done = false;
+        if (!bdrv_aio_readv(r->bs->file, offset >> BDRV_SECTOR_BITS, &t->qiov,
+                            s->cluster_sectors, check_read_cb, t)) {
+            t->pending = false;
+        }
+    }
+
+    if (!r->offsets[i]) {
+        return NULL;
+    }
+
+    t = &r->slots[i % CHECK_READAHEAD];
+    if (t->pending) {
+        check_reader_wait(t);
+        *ret = t->ret;
+    } else if (bdrv_pread(r->bs->file, r->offsets[i], t->buf,
+                          s->cluster_size) != s->cluster_size) {
+        *ret = -EIO;
+    }
+    if (*ret == 0) {
+        r->current = i;
+    }
+    return t->buf;
+}
+
 static void inc_refcounts(BlockDriverState *bs,
                           BdrvCheckResult *res,
-                          uint16_t *refcount_table,
-                          int refcount_table_size,
+                          CheckRefcounts *rc,
                           int64_t offset, int64_t size)
 {
     BDRVQcowState *s = bs->opaque;
     int64_t start, last, cluster_offset;
-    int k;
+    int64_t k;
 
     if (size <= 0)
         return;
@@ -902,13 +1289,13 @@ static void inc_refcounts(BlockDriverState *bs,
             fprintf(stderr, "ERROR: invalid cluster offset=0x%" PRIx64 "\n",
                 cluster_offset);
             res->corruptions++;
-        } else if (k >= refcount_table_size) {
+        } else if (k >= rc->nb_clusters) {
             fprintf(stderr, "Warning: cluster offset=0x%" PRIx64 " is after "
                 "the end of the image file, can't properly check refcounts.\n",
                 cluster_offset);
             res->check_errors++;
         } else {
-            if (++refcount_table[k] == 0) {
+            if (check_refcount_inc(rc, k) == 0) {
                 fprintf(stderr, "ERROR: overflow cluster offset=0x%" PRIx64
                     "\n", cluster_offset);
                 res->corruptions++;
@@ -926,19 +1313,11 @@ static void inc_refcounts(BlockDriverState *bs,
  * error occurred.
  */
 static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
-    uint16_t *refcount_table, int refcount_table_size, int64_t l2_offset,
-    int check_copied)
+    CheckRefcounts *rc, uint64_t *l2_table, int check_copied)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
-    int i, l2_size, nb_csectors, refcount;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
-
-    if (bdrv_pread(bs->file, l2_offset, l2_table, l2_size) != l2_size)
-        goto fail;
+    uint64_t l2_entry;
+    int i, nb_csectors, refcount;
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
@@ -959,8 +1338,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             nb_csectors = ((l2_entry >> s->csize_shift) &
                            s->csize_mask) + 1;
             l2_entry &= s->cluster_offset_mask;
-            inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                l2_entry & ~511, nb_csectors * 512);
+            inc_refcounts(bs, res, rc, l2_entry & ~511, nb_csectors * 512);
             break;
 
         case QCOW2_CLUSTER_ZERO:
@@ -979,7 +1357,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                 if (refcount < 0) {
                     fprintf(stderr, "Can't get refcount for offset %"
                         PRIx64 ": %s\n", l2_entry, strerror(-refcount));
-                    goto fail;
+                    return -EIO;
                 }
                 if ((refcount == 1) != ((l2_entry & QCOW_OFLAG_COPIED) != 0)) {
                     fprintf(stderr, "ERROR OFLAG_COPIED: offset=%"
@@ -989,8 +1367,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             }
 
             /* Mark cluster as used */
-            inc_refcounts(bs, res, refcount_table,refcount_table_size,
-                offset, s->cluster_size);
+            inc_refcounts(bs, res, rc, offset, s->cluster_size);
 
             /* Correct offsets are cluster aligned */
             if (offset & (s->cluster_size - 1)) {
@@ -1009,13 +1386,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
-    g_free(l2_table);
     return 0;
-
-fail:
-    fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-    g_free(l2_table);
-    return -EIO;
 }
 
 /*
@@ -1028,20 +1399,19 @@ fail:
  */
 static int check_refcounts_l1(BlockDriverState *bs,
                               BdrvCheckResult *res,
-                              uint16_t *refcount_table,
-                              int refcount_table_size,
+                              CheckRefcounts *rc,
                               int64_t l1_table_offset, int l1_size,
                               int check_copied)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l1_table, l2_offset, l1_size2;
+    uint64_t *l1_table, *l2_offsets = NULL, *l2_table, l2_offset, l1_size2;
+    CheckReader reader = { .bs = NULL };
     int i, refcount, ret;
 
     l1_size2 = l1_size * sizeof(uint64_t);
 
     /* Mark L1 table as used */
-    inc_refcounts(bs, res, refcount_table, refcount_table_size,
-        l1_table_offset, l1_size2);
+    inc_refcounts(bs, res, rc, l1_table_offset, l1_size2);
 
     /* Read L1 table entries from disk */
     if (l1_size2 == 0) {
@@ -1055,6 +1425,12 @@ static int check_refcounts_l1(BlockDriverState *bs,
             be64_to_cpus(&l1_table[i]);
     }
 
+    l2_offsets = g_malloc0(l1_size2);
+    for (i = 0; i < l1_size; i++) {
+        l2_offsets[i] = l1_table[i] & L1E_OFFSET_MASK;
+    }
+    check_reader_init(&reader, bs, l2_offsets, l1_size);
+
     /* Do the actual checks */
     for(i = 0; i < l1_size; i++) {
         l2_offset = l1_table[i];
@@ -1077,8 +1453,7 @@ static int check_refcounts_l1(BlockDriverState *bs,
 
             /* Mark L2 table as used */
             l2_offset &= L1E_OFFSET_MASK;
-            inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                l2_offset, s->cluster_size);
+            inc_refcounts(bs, res, rc, l2_offset, s->cluster_size);
 
             /* L2 tables are cluster aligned */
             if (l2_offset & (s->cluster_size - 1)) {
@@ -1088,23 +1463,60 @@ static int check_refcounts_l1(BlockDriverState *bs,
             }
 
             /* Process and check L2 entries */
-            ret = check_refcounts_l2(bs, res, refcount_table,
-                refcount_table_size, l2_offset, check_copied);
+            l2_table = check_reader_get(&reader, i, &ret);
             if (ret < 0) {
+                fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
                 goto fail;
             }
+            if (l2_table) {
+                ret = check_refcounts_l2(bs, res, rc, l2_table, check_copied);
+                if (ret < 0) {
+                    goto fail;
+                }
+            }
         }
     }
+    check_reader_destroy(&reader);
+    g_free(l2_offsets);
     g_free(l1_table);
     return 0;
 
 fail:
     fprintf(stderr, "ERROR: I/O error in check_refcounts_l1\n");
     res->check_errors++;
+    if (reader.bs) {
+        check_reader_destroy(&reader);
+    }
+    g_free(l2_offsets);
     g_free(l1_table);
     return -EIO;
 }
 
+/*
+ * Reads the refcount of cluster i from the refcount blocks that reader
+ * returns, in order, for each entry of the refcount table.
+ */
+static int check_get_disk_refcount(BlockDriverState *bs, CheckReader *reader,
+                                   int64_t i)
+{
+    BDRVQcowState *s = bs->opaque;
+    int shift = s->cluster_bits - REFCOUNT_SHIFT;
+    int64_t table_index = i >> shift;
+    uint16_t *refcount_block;
+    int ret;
+
+    if (table_index >= reader->nb_tables) {
+        return 0;
+    }
+    refcount_block = check_reader_get(reader, table_index, &ret);
+    if (ret < 0) {
+        return ret;
+    } else if (!refcount_block) {
+        return 0;
+    }
+    return be16_to_cpu(refcount_block[i & ((1 << shift) - 1)]);
+}
+
 /*
  * Checks an image for refcount consistency.
  *
@@ -1116,22 +1528,28 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
 {
     BDRVQcowState *s = bs->opaque;
     int64_t size, i;
-    int nb_clusters, refcount1, refcount2;
+    int64_t nb_clusters;
+    int refcount1, refcount2;
     QCowSnapshot *sn;
-    uint16_t *refcount_table;
+    CheckRefcounts rc;
+    CheckReader reader;
+    uint64_t *block_offsets;
+    int nb_blocks;
+    bool use_cache;
     int ret;
 
     size = bdrv_getlength(bs->file);
     nb_clusters = size_to_clusters(s, size);
-    refcount_table = g_malloc0(nb_clusters * sizeof(uint16_t));
+    rc.nb_clusters = nb_clusters;
+    rc.counts = g_malloc0(nb_clusters);
+    rc.overflow = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                        g_free, NULL);
 
     /* header */
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
-        0, s->cluster_size);
+    inc_refcounts(bs, res, &rc, 0, s->cluster_size);
 
     /* current L1 table */
-    ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
-                       s->l1_table_offset, s->l1_size, 1);
+    ret = check_refcounts_l1(bs, res, &rc, s->l1_table_offset, s->l1_size, 1);
     if (ret < 0) {
         goto fail;
     }
@@ -1139,18 +1557,16 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     /* snapshots */
     for(i = 0; i < s->nb_snapshots; i++) {
         sn = s->snapshots + i;
-        ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
+        ret = check_refcounts_l1(bs, res, &rc,
             sn->l1_table_offset, sn->l1_size, 0);
         if (ret < 0) {
             goto fail;
         }
     }
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
-        s->snapshots_offset, s->snapshots_size);
+    inc_refcounts(bs, res, &rc, s->snapshots_offset, s->snapshots_size);
 
     /* refcount data */
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
-        s->refcount_table_offset,
+    inc_refcounts(bs, res, &rc, s->refcount_table_offset,
         s->refcount_table_size * sizeof(uint64_t));
 
     for(i = 0; i < s->refcount_table_size; i++) {
@@ -1174,20 +1590,38 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         if (offset != 0) {
-            inc_refcounts(bs, res, refcount_table, nb_clusters,
-                offset, s->cluster_size);
-            if (refcount_table[cluster] != 1) {
+            inc_refcounts(bs, res, &rc, offset, s->cluster_size);
+            if (check_refcount_get(&rc, cluster) != 1) {
                 fprintf(stderr, "ERROR refcount block %" PRId64
                     " refcount=%d\n",
-                    i, refcount_table[cluster]);
+                    i, check_refcount_get(&rc, cluster));
                 res->corruptions++;
             }
         }
     }
 
-    /* compare ref counts */
+    /*
+     * compare ref counts
+     *
+     * The refcount blocks are read directly from the image file, with
+     * readahead, until the first repair; after that the cache is
+     * authoritative and get_refcount() is used.
+     */
+    nb_blocks = MIN(s->refcount_table_size,
+                    (nb_clusters >> (s->cluster_bits - REFCOUNT_SHIFT)) + 1);
+    block_offsets = g_malloc0((nb_blocks + 1) * sizeof(uint64_t));
+    for (i = 0; i < nb_blocks; i++) {
+        block_offsets[i] = s->refcount_table[i];
+    }
+    check_reader_init(&reader, bs, block_offsets, nb_blocks);
+    use_cache = qcow2_cache_flush(bs, s->refcount_block_cache) < 0;
+
     for(i = 0; i < nb_clusters; i++) {
-        refcount1 = get_refcount(bs, i);
+        if (use_cache) {
+            refcount1 = get_refcount(bs, i);
+        } else {
+            refcount1 = check_get_disk_refcount(bs, &reader, i);
+        }
         if (refcount1 < 0) {
             fprintf(stderr, "Can't get refcount for cluster %" PRId64 ": %s\n",
                 i, strerror(-refcount1));
@@ -1195,7 +1629,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
             continue;
         }
 
-        refcount2 = refcount_table[i];
+        refcount2 = check_refcount_get(&rc, i);
         if (refcount1 != refcount2) {
 
             /* Check if we're allowed to fix the mismatch */
@@ -1213,6 +1647,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                    i, refcount1, refcount2);
 
             if (num_fixed) {
+                use_cache = true;
                 ret = update_refcount(bs, i << s->cluster_bits, 1,
                                       refcount2 - refcount1);
                 if (ret >= 0) {
@@ -1230,11 +1665,13 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
+    check_reader_destroy(&reader);
+    g_free(block_offsets);
     ret = 0;
 
 fail:
-    g_free(refcount_table);
+    g_hash_table_destroy(rc.overflow);
+    g_free(rc.counts);
 
     return ret;
 }
-
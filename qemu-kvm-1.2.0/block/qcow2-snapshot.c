@@ -51,6 +51,28 @@ typedef struct QEMU_PACKED QCowSnapshotExtraData {
     uint64_t disk_size;
 } QCowSnapshotExtraData;
 
+/*
+ * Deleting a snapshot only removes it from the snapshot table before
+ * returning.  The refcounts of the clusters it references are decreased
+ * afterwards by a coroutine that holds s->lock for one L2 table at a time,
+ * so that guest requests run in between.  Until it is done, some clusters
+ * of the active L1 table lack QCOW_OFLAG_COPIED although nothing else
+ * references them any more; writes to them just copy them first.  If QEMU
+ * stops before, the clusters leak, which "qemu-img check -r leaks" repairs.
+ *
+ * Everything else that changes metadata without s->lock, i.e. all the
+ * other snapshot operations, truncate, check and close, first waits for
+ * the release to finish with qcow2_snapshot_release_wait().
+ */
+typedef struct Qcow2SnapshotRelease {
+    BlockDriverState *bs;
+    uint64_t l1_table_offset;
+    int l1_size;
+    uint64_t *l1_table;
+    Coroutine *co;
+    QEMUBH *bh;
+} Qcow2SnapshotRelease;
+
 void qcow2_free_snapshots(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
@@ -322,6 +344,7 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
     uint64_t *l1_table = NULL;
     int64_t l1_table_offset;
 
+    qcow2_snapshot_release_wait(bs);
     memset(sn, 0, sizeof(*sn));
 
     /* Generate an ID if it wasn't passed */
@@ -428,6 +451,8 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
     int ret;
     uint64_t *sn_l1_table = NULL;
 
+    qcow2_snapshot_release_wait(bs);
+
     /* Search the snapshot */
     snapshot_index = find_snapshot_by_id_or_name(bs, snapshot_id);
     if (snapshot_index < 0) {
@@ -476,6 +501,11 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
         goto fail;
     }
 
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
+
     ret = bdrv_pwrite_sync(bs->file, s->l1_table_offset, sn_l1_table,
                            cur_l1_bytes);
     if (ret < 0) {
@@ -532,11 +562,115 @@ fail:
     return ret;
 }
 
+static void qcow2_snapshot_release_bh(void *opaque)
+{
+    Qcow2SnapshotRelease *r = opaque;
+
+    qemu_coroutine_enter(r->co, NULL);
+}
+
+/* Give the requests that queued up on s->lock a chance to run */
+static void coroutine_fn qcow2_snapshot_release_yield(Qcow2SnapshotRelease *r)
+{
+    qemu_bh_schedule(r->bh);
+    qemu_coroutine_yield();
+}
+
+static void coroutine_fn qcow2_snapshot_release_entry(void *opaque)
+{
+    Qcow2SnapshotRelease *r = opaque;
+    BlockDriverState *bs = r->bs;
+    BDRVQcowState *s = bs->opaque;
+    uint64_t l1_entry;
+    int i, modified = 0, ret = 0;
+
+    /* Decrease the refcounts of clusters referenced by the snapshot */
+    for (i = 0; i < r->l1_size; i++) {
+        if (!(r->l1_table[i] & L1E_OFFSET_MASK)) {
+            continue;
+        }
+        l1_entry = r->l1_table[i];
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_update_l2_refcount(bs, &l1_entry, -1);
+        qemu_co_mutex_unlock(&s->lock);
+        if (ret < 0) {
+            goto out;
+        }
+        qcow2_snapshot_release_yield(r);
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    qcow2_free_clusters(bs, r->l1_table_offset, r->l1_size * sizeof(uint64_t));
+    qemu_co_mutex_unlock(&s->lock);
+
+    /* must update the copied flag on the current cluster offsets */
+    for (i = 0; i < s->l1_size; i++) {
+        qemu_co_mutex_lock(&s->lock);
+        l1_entry = s->l1_table[i];
+        ret = qcow2_update_l2_refcount(bs, &l1_entry, 0);
+        if (ret == 0 && l1_entry != s->l1_table[i]) {
+            s->l1_table[i] = l1_entry;
+            modified++;
+        }
+        qemu_co_mutex_unlock(&s->lock);
+        if (ret < 0) {
+            goto out;
+        }
+        if (s->l1_table[i] & L1E_OFFSET_MASK) {
+            qcow2_snapshot_release_yield(r);
+        }
+    }
+
+    if (modified) {
+        uint64_t *l1_table;
+
+        qemu_co_mutex_lock(&s->lock);
+        l1_table = g_malloc(s->l1_size * sizeof(uint64_t));
+        for (i = 0; i < s->l1_size; i++) {
+            l1_table[i] = cpu_to_be64(s->l1_table[i]);
+        }
+        ret = bdrv_pwrite_sync(bs->file, s->l1_table_offset, l1_table,
+                               s->l1_size * sizeof(uint64_t));
+        g_free(l1_table);
+        qemu_co_mutex_unlock(&s->lock);
+    }
+
+#ifdef DEBUG_ALLOC
+    {
+        BdrvCheckResult result = {0};
+        qcow2_check_refcounts(bs, &result, 0);
+    }
+#endif
+
+out:
+    if (ret < 0) {
+        error_report("qcow2: Releasing the clusters of a deleted snapshot "
+                     "failed: %s", strerror(-ret));
+    }
+    qemu_bh_delete(r->bh);
+    g_free(r->l1_table);
+    g_free(r);
+    s->snapshot_release = NULL;
+}
+
+void qcow2_snapshot_release_wait(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    while (s->snapshot_release) {
+        qemu_aio_wait();
+    }
+}
+
 int qcow2_snapshot_delete(BlockDriverState *bs, const char *snapshot_id)
 {
     BDRVQcowState *s = bs->opaque;
     QCowSnapshot sn;
-    int snapshot_index, ret;
+    Qcow2SnapshotRelease *r;
+    uint64_t *sn_l1_table;
+    int i, snapshot_index, ret;
+
+    qcow2_snapshot_release_wait(bs);
 
     /* Search the snapshot */
     snapshot_index = find_snapshot_by_id_or_name(bs, snapshot_id);
@@ -545,6 +679,17 @@ int qcow2_snapshot_delete(BlockDriverState *bs, const char *snapshot_id)
     }
     sn = s->snapshots[snapshot_index];
 
+    sn_l1_table = g_malloc0(align_offset(sn.l1_size * sizeof(uint64_t), 512));
+    ret = bdrv_pread(bs->file, sn.l1_table_offset, sn_l1_table,
+                     sn.l1_size * sizeof(uint64_t));
+    if (ret < 0) {
+        g_free(sn_l1_table);
+        return ret;
+    }
+    for (i = 0; i < sn.l1_size; i++) {
+        be64_to_cpus(&sn_l1_table[i]);
+    }
+
     /* Remove it from the snapshot list */
     memmove(s->snapshots + snapshot_index,
             s->snapshots + snapshot_index + 1,
@@ -552,6 +697,7 @@ int qcow2_snapshot_delete(BlockDriverState *bs, const char *snapshot_id)
     s->nb_snapshots--;
     ret = qcow2_write_snapshots(bs);
     if (ret < 0) {
+        g_free(sn_l1_table);
         return ret;
     }
 
@@ -562,29 +708,16 @@ int qcow2_snapshot_delete(BlockDriverState *bs, const char *snapshot_id)
     g_free(sn.id_str);
     g_free(sn.name);
 
-    /*
-     * Now decrease the refcounts of clusters referenced by the snapshot and
-     * free the L1 table.
-     */
-    ret = qcow2_update_snapshot_refcount(bs, sn.l1_table_offset,
-                                         sn.l1_size, -1);
-    if (ret < 0) {
-        return ret;
-    }
-    qcow2_free_clusters(bs, sn.l1_table_offset, sn.l1_size * sizeof(uint64_t));
+    r = g_malloc0(sizeof(*r));
+    r->bs = bs;
+    r->l1_table_offset = sn.l1_table_offset;
+    r->l1_size = sn.l1_size;
+    r->l1_table = sn_l1_table;
+    r->bh = qemu_bh_new(qcow2_snapshot_release_bh, r);
+    r->co = qemu_coroutine_create(qcow2_snapshot_release_entry);
+    s->snapshot_release = r;
+    qemu_coroutine_enter(r->co, r);
 
-    /* must update the copied flag on the current cluster offsets */
-    ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size, 0);
-    if (ret < 0) {
-        return ret;
-    }
-
-#ifdef DEBUG_ALLOC
-    {
-        BdrvCheckResult result = {0};
-        qcow2_check_refcounts(bs, &result, 0);
-    }
-#endif
     return 0;
 }
 
@@ -627,6 +760,7 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs, const char *snapshot_name)
     int ret;
 
     assert(bs->read_only);
+    qcow2_snapshot_release_wait(bs);
 
     /* Search the snapshot */
     snapshot_index = find_snapshot_by_id_or_name(bs, snapshot_name);
@@ -30,6 +30,9 @@
 #include "qemu-error.h"
 #include "qerror.h"
 #include "trace.h"
+#ifdef CONFIG_POSIX
+#include "thread-pool.h"
+#endif
 
 /*
   Differences with QCOW:
@@ -273,7 +276,10 @@ static int qcow2_mark_clean(BlockDriverState *bs)
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
                        BdrvCheckMode fix)
 {
-    int ret = qcow2_check_refcounts(bs, result, fix);
+    int ret;
+
+    qcow2_snapshot_release_wait(bs);
+    ret = qcow2_check_refcounts(bs, result, fix);
     if (ret < 0) {
         return ret;
     }
@@ -284,6 +290,23 @@ static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
     return ret;
 }
 
+/*
+ * Number of tables for a cache of @bytes, as set with the -drive
+ * l2-cache-size and refcount-cache-size options, @def if it wasn't set
+ */
+static int qcow2_cache_tables(BDRVQcowState *s, uint64_t bytes, int def,
+                              int min)
+{
+    uint64_t tables;
+
+    if (!bytes) {
+        return def;
+    }
+
+    tables = bytes / s->cluster_size;
+    return MIN(MAX(tables, min), MAX_CACHE_SIZE);
+}
+
 static int qcow2_open(BlockDriverState *bs, int flags)
 {
     BDRVQcowState *s = bs->opaque;
@@ -429,14 +452,18 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     }
 
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
-
-    s->cluster_cache = g_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = qemu_blockalign(bs, QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size
-                                  + 512);
-    s->cluster_cache_offset = -1;
+    s->l2_table_cache =
+        qcow2_cache_create(bs, qcow2_cache_tables(s, bs->l2_cache_size,
+                                                  L2_CACHE_SIZE,
+                                                  MIN_L2_CACHE_SIZE));
+    s->refcount_block_cache =
+        qcow2_cache_create(bs, qcow2_cache_tables(s, bs->refcount_cache_size,
+                                                  REFCOUNT_CACHE_SIZE,
+                                                  MIN_REFCOUNT_CACHE_SIZE));
+
+    qcow2_compressed_cache_init(bs,
+        qcow2_cache_tables(s, bs->compressed_cache_size,
+                           COMPRESSED_CACHE_SIZE, 1));
     s->flags = flags;
 
     ret = qcow2_refcount_init(bs);
@@ -445,6 +472,7 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     }
 
     QLIST_INIT(&s->cluster_allocs);
+    QLIST_INIT(&s->l2_allocs);
 
     /* read qcow2 extensions */
     if (qcow2_read_extensions(bs, header.header_length, ext_end, NULL)) {
@@ -480,8 +508,20 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         }
     }
 
+    s->use_lazy_refcounts =
+        !!(s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS);
+    if (bs->lazy_refcounts && !s->use_lazy_refcounts) {
+        if (s->qcow_version < 3) {
+            error_report("Lazy refcounts require a qcow2 version 3 image");
+            ret = -ENOTSUP;
+            goto fail;
+        }
+        s->use_lazy_refcounts = true;
+    }
+
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    qemu_co_mutex_init(&s->l1_lock);
 
     /* Repair image if dirty */
     if (!(flags & BDRV_O_CHECK) && !bs->read_only &&
@@ -511,8 +551,7 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     if (s->l2_table_cache) {
         qcow2_cache_destroy(bs, s->l2_table_cache);
     }
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    qcow2_compressed_cache_destroy(bs);
     return ret;
 }
 
@@ -575,7 +614,8 @@ static int coroutine_fn qcow2_co_is_allocated(BlockDriverState *bs,
         *pnum = 0;
     }
 
-    return (cluster_offset != 0);
+    /* zero clusters are not read from the backing file */
+    return (cluster_offset != 0) || (ret == QCOW2_CLUSTER_ZERO);
 }
 
 /* handle reading after the end of the backing file */
@@ -664,15 +704,11 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             break;
 
         case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
-            ret = qcow2_decompress_cluster(bs, cluster_offset);
+            ret = qcow2_decompress_cluster(bs, cluster_offset, &hd_qiov,
+                                           index_in_cluster, cur_nr_sectors);
             if (ret < 0) {
                 goto fail;
             }
-
-            qemu_iovec_from_buf(&hd_qiov, 0,
-                s->cluster_cache + index_in_cluster * 512,
-                512 * cur_nr_sectors);
             break;
 
         case QCOW2_CLUSTER_NORMAL:
@@ -776,7 +812,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    s->cluster_cache_offset = -1; /* disable compressed cache */
+    qcow2_compressed_cache_invalidate(bs);
 
     qemu_co_mutex_lock(&s->lock);
 
@@ -796,8 +832,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
             goto fail;
         }
 
-        if (l2meta.nb_clusters > 0 &&
-            (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS)) {
+        if (l2meta.nb_clusters > 0 && s->use_lazy_refcounts) {
             qcow2_mark_dirty(bs);
         }
 
@@ -867,8 +902,11 @@ fail:
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    qcow2_snapshot_release_wait(bs);
     g_free(s->l1_table);
 
+    qcow2_free_cluster_pool(bs);
     qcow2_cache_flush(bs, s->l2_table_cache);
     qcow2_cache_flush(bs, s->refcount_block_cache);
 
@@ -880,8 +918,7 @@ static void qcow2_close(BlockDriverState *bs)
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
 
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    qcow2_compressed_cache_destroy(bs);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -1433,6 +1470,8 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
         return -EINVAL;
     }
 
+    qcow2_snapshot_release_wait(bs);
+
     /* cannot proceed if image has snapshots */
     if (s->nb_snapshots) {
         error_report("Can't resize an image which has snapshots");
@@ -1463,17 +1502,78 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+typedef struct Qcow2Compress {
+    uint8_t *out_buf;
+    const uint8_t *buf;
+    int size;
+    int out_len;
+} Qcow2Compress;
+
+/* Sets out_len to size if the data doesn't get smaller */
+static int qcow2_compress_func(void *opaque)
+{
+    Qcow2Compress *c = opaque;
+    z_stream strm;
+    int ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = c->size;
+    strm.next_in = (uint8_t *)c->buf;
+    strm.avail_out = c->size;
+    strm.next_out = c->out_buf;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret != Z_STREAM_END && ret != Z_OK) {
+        deflateEnd(&strm);
+        return -EINVAL;
+    }
+    c->out_len = strm.next_out - c->out_buf;
+
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END) {
+        c->out_len = c->size;
+    }
+    return 0;
+}
+
+/*
+ * When called from a coroutine, deflate in a worker thread so that
+ * several clusters can be compressed at the same time.
+ */
+static int qcow2_compress(BlockDriverState *bs, Qcow2Compress *c)
+{
+#ifdef CONFIG_POSIX
+    ThreadPool *pool = thread_pool_get_default();
+
+    if (pool && qemu_in_coroutine()) {
+        return thread_pool_submit_co(pool, qcow2_compress_func, c);
+    }
+#endif
+    return qcow2_compress_func(c);
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
 static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
+    Qcow2Compress c;
+    int ret;
     uint8_t *out_buf;
     uint64_t cluster_offset;
 
+    qcow2_snapshot_release_wait(bs);
+
     if (nb_sectors == 0) {
         /* align end of file to a sector boundary to ease reading with
            sector based I/Os */
@@ -1488,47 +1588,39 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
+    c = (Qcow2Compress) {
+        .out_buf    = out_buf,
+        .buf        = buf,
+        .size       = s->cluster_size,
+    };
+    ret = qcow2_compress(bs, &c);
+    if (ret < 0) {
         goto fail;
     }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (c.out_len >= s->cluster_size) {
         /* could not compress: write normal cluster */
         ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
         if (ret < 0) {
             goto fail;
         }
     } else {
+        /* Only coroutine callers can run concurrently with other requests */
+        if (qemu_in_coroutine()) {
+            qemu_co_mutex_lock(&s->lock);
+        }
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
+            sector_num << 9, c.out_len);
         if (!cluster_offset) {
             ret = -EIO;
-            goto fail;
+        } else {
+            cluster_offset &= s->cluster_offset_mask;
+            BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+            ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, c.out_len);
+        }
+        if (qemu_in_coroutine()) {
+            qemu_co_mutex_unlock(&s->lock);
         }
-        cluster_offset &= s->cluster_offset_mask;
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
         if (ret < 0) {
             goto fail;
         }
@@ -1540,20 +1632,26 @@ fail:
     return ret;
 }
 
+/*
+ * bdrv_co_flush() flushes bs->file right after this, so the caches are only
+ * written here.  Ordering between them is still taken care of by the cache
+ * dependencies, and with lazy refcounts the refcount blocks aren't written
+ * at all until they are evicted or the image is closed.
+ */
 static coroutine_fn int qcow2_co_flush_to_os(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
     int ret;
 
     qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    ret = qcow2_cache_write(bs, s->l2_table_cache);
     if (ret < 0) {
         qemu_co_mutex_unlock(&s->lock);
         return ret;
     }
 
     if (qcow2_need_accurate_refcounts(s)) {
-        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        ret = qcow2_cache_write(bs, s->refcount_block_cache);
         if (ret < 0) {
             qemu_co_mutex_unlock(&s->lock);
             return ret;
@@ -1577,6 +1675,20 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static void qcow2_get_cache_stats(const BlockDriverState *bs,
+                                  BlockDeviceStats *stats)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    stats->has_l2_cache = true;
+    stats->l2_cache = g_malloc0(sizeof(*stats->l2_cache));
+    qcow2_cache_get_stats(s->l2_table_cache, stats->l2_cache);
+
+    stats->has_refcount_cache = true;
+    stats->refcount_cache = g_malloc0(sizeof(*stats->refcount_cache));
+    qcow2_cache_get_stats(s->refcount_block_cache, stats->refcount_cache);
+}
+
 #if 0
 static void dump_refcounts(BlockDriverState *bs)
 {
@@ -1699,6 +1811,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_list     = qcow2_snapshot_list,
     .bdrv_snapshot_load_tmp     = qcow2_snapshot_load_tmp,
     .bdrv_get_info      = qcow2_get_info,
+    .bdrv_get_cache_stats = qcow2_get_cache_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -56,8 +56,19 @@
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
 
+/* Bounds for the -drive l2-cache-size and refcount-cache-size options */
+#define MIN_L2_CACHE_SIZE 2
+#define MIN_REFCOUNT_CACHE_SIZE REFCOUNT_CACHE_SIZE
+#define MAX_CACHE_SIZE 65536 /* tables */
+
+#define COMPRESSED_CACHE_SIZE 16 /* clusters */
+
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* Bounds for the clusters preallocated for sequential writes, in bytes */
+#define MIN_CLUSTER_POOL_SIZE (1 << 20)
+#define MAX_CLUSTER_POOL_SIZE (16 << 20)
+
 typedef struct QCowHeader {
     uint32_t magic;
     uint32_t version;
@@ -132,6 +143,13 @@ typedef struct Qcow2Feature {
     char    name[46];
 } QEMU_PACKED Qcow2Feature;
 
+/* An L2 table being allocated without s->lock, see l2_allocate() */
+typedef struct Qcow2L2Alloc {
+    int l1_index;
+    CoQueue waiters;
+    QLIST_ENTRY(Qcow2L2Alloc) next;
+} Qcow2L2Alloc;
+
 typedef struct BDRVQcowState {
     int cluster_bits;
     int cluster_size;
@@ -149,10 +167,14 @@ typedef struct BDRVQcowState {
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
 
-    uint8_t *cluster_cache;
-    uint8_t *cluster_data;
-    uint64_t cluster_cache_offset;
+    /* decompressed clusters by offset, the unused ones in LRU order */
+    GHashTable *compressed_cache;
+    QTAILQ_HEAD(, Qcow2CompressedCluster) compressed_lru;
+    int compressed_cache_size;
+    int compressed_cache_entries;
+    uint64_t compressed_cache_generation;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
+    QLIST_HEAD(, Qcow2L2Alloc) l2_allocs;
 
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
@@ -160,7 +182,19 @@ typedef struct BDRVQcowState {
     int64_t free_cluster_index;
     int64_t free_byte_offset;
 
+    /* data clusters allocated ahead of sequential writes, see
+     * qcow2_alloc_data_clusters() */
+    uint64_t pool_offset;
+    unsigned int pool_clusters;
+    unsigned int pool_refill;
+    uint64_t pool_next_guest_offset;
+
+    /* Protects the metadata.  Coroutines drop it for L2 table I/O (see
+     * qcow2-cache.c and l2_allocate()), so that allocating writes that need
+     * different L2 tables only serialize on the refcount updates. */
     CoMutex lock;
+    /* serializes the L1 table writes of l2_allocate() */
+    CoMutex l1_lock;
 
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
     uint32_t crypt_method_header;
@@ -170,6 +204,8 @@ typedef struct BDRVQcowState {
     int snapshots_size;
     int nb_snapshots;
     QCowSnapshot *snapshots;
+    /* clusters of a deleted snapshot being released in the background */
+    struct Qcow2SnapshotRelease *snapshot_release;
 
     int flags;
     int qcow_version;
@@ -178,6 +214,14 @@ typedef struct BDRVQcowState {
     uint64_t compatible_features;
     uint64_t autoclear_features;
 
+    /* lazy refcounts enabled in the header or with -drive lazy-refcounts */
+    bool use_lazy_refcounts;
+
+    /* clusters freed by a guest discard, discarded in the image file by
+     * qcow2_process_discards() */
+    bool cache_discards;
+    QTAILQ_HEAD(, Qcow2DiscardRegion) discards;
+
     size_t unknown_header_fields_size;
     void* unknown_header_fields;
     QLIST_HEAD(, Qcow2UnknownHeaderExtension) unknown_header_ext;
@@ -196,6 +240,21 @@ typedef struct QCowCreateState {
 
 struct QCowAIOCB;
 
+typedef struct Qcow2CompressedCluster {
+    uint64_t offset; /* of the compressed data in the image file */
+    uint8_t *data;
+    /* being read and decompressed, requests for it wait in waiting */
+    bool busy;
+    CoQueue waiting;
+    QTAILQ_ENTRY(Qcow2CompressedCluster) next_lru;
+} Qcow2CompressedCluster;
+
+typedef struct Qcow2DiscardRegion {
+    uint64_t offset;
+    uint64_t bytes;
+    QTAILQ_ENTRY(Qcow2DiscardRegion) next;
+} Qcow2DiscardRegion;
+
 /* XXX This could be private for qcow2-cluster.c */
 typedef struct QCowL2Meta
 {
@@ -271,6 +330,9 @@ int qcow2_refcount_init(BlockDriverState *bs);
 void qcow2_refcount_close(BlockDriverState *bs);
 
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, int64_t size);
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t guest_offset,
+                                  unsigned int *nb_clusters);
+void qcow2_free_cluster_pool(BlockDriverState *bs);
 int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     int nb_clusters);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
@@ -279,6 +341,10 @@ void qcow2_free_clusters(BlockDriverState *bs,
 void qcow2_free_any_clusters(BlockDriverState *bs,
     uint64_t cluster_offset, int nb_clusters);
 
+void qcow2_process_discards(BlockDriverState *bs, int ret);
+
+int qcow2_update_l2_refcount(BlockDriverState *bs, uint64_t *l1_entry,
+                             int addend);
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend);
 
@@ -288,7 +354,12 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
 /* qcow2-cluster.c functions */
 int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
+int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset,
+                             QEMUIOVector *qiov, int index_in_cluster,
+                             int nb_sectors);
+void qcow2_compressed_cache_init(BlockDriverState *bs, int size);
+void qcow2_compressed_cache_invalidate(BlockDriverState *bs);
+void qcow2_compressed_cache_destroy(BlockDriverState *bs);
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
                      int nb_sectors, int enc,
@@ -313,6 +384,7 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id);
 int qcow2_snapshot_delete(BlockDriverState *bs, const char *snapshot_id);
 int qcow2_snapshot_list(BlockDriverState *bs, QEMUSnapshotInfo **psn_tab);
 int qcow2_snapshot_load_tmp(BlockDriverState *bs, const char *snapshot_name);
+void qcow2_snapshot_release_wait(BlockDriverState *bs);
 
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
@@ -320,8 +392,10 @@ int qcow2_read_snapshots(BlockDriverState *bs);
 /* qcow2-cache.c functions */
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
+void qcow2_cache_get_stats(Qcow2Cache *c, BlockCacheStats *stats);
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
+int qcow2_cache_write(BlockDriverState *bs, Qcow2Cache *c);
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
 int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
     Qcow2Cache *dependency);
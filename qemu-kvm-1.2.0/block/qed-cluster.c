@@ -111,6 +111,38 @@ out:
     g_free(find_cluster_cb);
 }
 
+/**
+ * Read ahead the L2 tables following a sequential stream
+ *
+ * @s:          QED state
+ * @l1_index:   L1 index of the table being looked up
+ *
+ * A stream that moves on from one L2 table to the next is likely to need the
+ * tables after it as well.  Reading them in the background hides the metadata
+ * read that would otherwise stall the stream at every table boundary.
+ */
+static void qed_prefetch_l2_tables(BDRVQEDState *s, unsigned int l1_index)
+{
+    unsigned int i;
+
+    if (l1_index == s->l2_stream_index) {
+        return;
+    }
+    if (l1_index == s->l2_stream_index + 1) {
+        for (i = l1_index + 1;
+             i <= l1_index + QED_L2_PREFETCH_TABLES && i < s->table_nelems;
+             i++) {
+            uint64_t l2_offset = s->l1_table->offsets[i];
+
+            if (!qed_offset_is_unalloc_cluster(l2_offset) &&
+                qed_check_table_offset(s, l2_offset)) {
+                qed_prefetch_l2_table(s, l2_offset);
+            }
+        }
+    }
+    s->l2_stream_index = l1_index;
+}
+
 /**
  * Find the offset of a data cluster
  *
@@ -135,6 +167,7 @@ void qed_find_cluster(BDRVQEDState *s, QEDRequest *request, uint64_t pos,
                       size_t len, QEDFindClusterFunc *cb, void *opaque)
 {
     QEDFindClusterCB *find_cluster_cb;
+    unsigned int l1_index = qed_l1_index(s, pos);
     uint64_t l2_offset;
 
     /* Limit length to L2 boundary.  Requests are broken up at the L2 boundary
@@ -142,7 +175,9 @@ void qed_find_cluster(BDRVQEDState *s, QEDRequest *request, uint64_t pos,
      */
     len = MIN(len, (((pos >> s->l1_shift) + 1) << s->l1_shift) - pos);
 
-    l2_offset = s->l1_table->offsets[qed_l1_index(s, pos)];
+    qed_prefetch_l2_tables(s, l1_index);
+
+    l2_offset = s->l1_table->offsets[l1_index];
     if (qed_offset_is_unalloc_cluster(l2_offset)) {
         cb(opaque, QED_CLUSTER_L1, 0, len);
         return;
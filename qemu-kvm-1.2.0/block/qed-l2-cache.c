@@ -42,27 +42,36 @@
  * cluster offset lookup, L2 table allocation, and L2 table update when a new
  * data cluster has been allocated.
  *
+ * Entries are found through a hash table keyed by L2 table offset and kept
+ * in least recently used order, so the cache can be sized to cover large
+ * images without lookups becoming expensive.  The size comes from the drive's
+ * l2-cache-size option.
+ *
  * An interesting case occurs when two requests need to access an L2 table that
  * is not in the cache.  Since the operation to read the table from the image
- * file takes some time to complete, both requests may see a cache miss and
- * start reading the L2 table from the image file.  The first to finish will
- * commit its L2 table into the cache.  When the second tries to commit its
- * table will be deleted in favor of the existing cache entry.
+ * file takes some time to complete, both requests may see a cache miss.  The
+ * table I/O code keeps track of tables being read and the second request
+ * waits for the first read instead of issuing its own.  Allocated L2 tables
+ * are still committed directly, and if the offset is already present the new
+ * table is deleted in favor of the existing cache entry.
  */
 
 #include "trace.h"
 #include "qed.h"
 
-/* Each L2 holds 2GB so this let's us fully cache a 100GB disk */
-#define MAX_L2_CACHE_SIZE 50
-
 /**
  * Initialize the L2 cache
+ *
+ * @max_entries:    Number of unused tables kept around
  */
-void qed_init_l2_cache(L2TableCache *l2_cache)
+void qed_init_l2_cache(L2TableCache *l2_cache, unsigned int max_entries)
 {
     QTAILQ_INIT(&l2_cache->entries);
+    l2_cache->lookup = g_hash_table_new(g_int64_hash, g_int64_equal);
     l2_cache->n_entries = 0;
+    l2_cache->max_entries = max_entries;
+    l2_cache->hits = 0;
+    l2_cache->misses = 0;
 }
 
 /**
@@ -76,6 +85,10 @@ void qed_free_l2_cache(L2TableCache *l2_cache)
         qemu_vfree(entry->table);
         g_free(entry);
     }
+    if (l2_cache->lookup) {
+        g_hash_table_destroy(l2_cache->lookup);
+        l2_cache->lookup = NULL;
+    }
 }
 
 /**
@@ -119,21 +132,23 @@ void qed_unref_l2_cache_entry(CachedL2Table *entry)
  * Find an entry in the L2 cache.  This may return NULL and it's up to the
  * caller to satisfy the cache miss.
  *
- * For a cached entry, this function increases the reference count and returns
- * the entry.
+ * For a cached entry, this function increases the reference count, marks the
+ * entry as most recently used and returns the entry.
  */
 CachedL2Table *qed_find_l2_cache_entry(L2TableCache *l2_cache, uint64_t offset)
 {
     CachedL2Table *entry;
 
-    QTAILQ_FOREACH(entry, &l2_cache->entries, node) {
-        if (entry->offset == offset) {
-            trace_qed_find_l2_cache_entry(l2_cache, entry, offset, entry->ref);
-            entry->ref++;
-            return entry;
-        }
+    entry = g_hash_table_lookup(l2_cache->lookup, &offset);
+    if (!entry) {
+        return NULL;
     }
-    return NULL;
+
+    trace_qed_find_l2_cache_entry(l2_cache, entry, offset, entry->ref);
+    entry->ref++;
+    QTAILQ_REMOVE(&l2_cache->entries, entry, node);
+    QTAILQ_INSERT_TAIL(&l2_cache->entries, entry, node);
+    return entry;
 }
 
 /**
@@ -161,10 +176,11 @@ void qed_commit_l2_cache_entry(L2TableCache *l2_cache, CachedL2Table *l2_table)
         return;
     }
 
-    /* Evict an unused cache entry so we have space.  If all entries are in use
-     * we can grow the cache temporarily and we try to shrink back down later.
+    /* Evict the least recently used unused entries so we have space.  If all
+     * entries are in use we can grow the cache temporarily and we try to
+     * shrink back down later.
      */
-    if (l2_cache->n_entries >= MAX_L2_CACHE_SIZE) {
+    if (l2_cache->n_entries >= l2_cache->max_entries) {
         CachedL2Table *next;
         QTAILQ_FOREACH_SAFE(entry, &l2_cache->entries, node, next) {
             if (entry->ref > 1) {
@@ -172,11 +188,12 @@ void qed_commit_l2_cache_entry(L2TableCache *l2_cache, CachedL2Table *l2_table)
             }
 
             QTAILQ_REMOVE(&l2_cache->entries, entry, node);
+            g_hash_table_remove(l2_cache->lookup, &entry->offset);
             l2_cache->n_entries--;
             qed_unref_l2_cache_entry(entry);
 
             /* Stop evicting when we've shrunk back to max size */
-            if (l2_cache->n_entries < MAX_L2_CACHE_SIZE) {
+            if (l2_cache->n_entries < l2_cache->max_entries) {
                 break;
             }
         }
@@ -184,4 +201,5 @@ void qed_commit_l2_cache_entry(L2TableCache *l2_cache, CachedL2Table *l2_table)
 
     l2_cache->n_entries++;
     QTAILQ_INSERT_TAIL(&l2_cache->entries, l2_table, node);
+    g_hash_table_insert(l2_cache->lookup, &l2_table->offset, l2_table);
 }
@@ -201,65 +201,147 @@ int qed_write_l1_table_sync(BDRVQEDState *s, unsigned int index,
     return ret;
 }
 
-typedef struct {
-    GenericCB gencb;
+struct QEDL2Load {
     BDRVQEDState *s;
-    uint64_t l2_offset;
+    uint64_t offset;
+    CachedL2Table *l2_table;        /* committed to the cache once read */
+    QSIMPLEQ_HEAD(, QEDReadL2TableCB) waiters;
+    QLIST_ENTRY(QEDL2Load) next;
+};
+
+typedef struct QEDReadL2TableCB {
+    GenericCB gencb;
     QEDRequest *request;
+    QSIMPLEQ_ENTRY(QEDReadL2TableCB) next;
 } QEDReadL2TableCB;
 
 static void qed_read_l2_table_cb(void *opaque, int ret)
 {
-    QEDReadL2TableCB *read_l2_table_cb = opaque;
-    QEDRequest *request = read_l2_table_cb->request;
-    BDRVQEDState *s = read_l2_table_cb->s;
-    CachedL2Table *l2_table = request->l2_table;
-    uint64_t l2_offset = read_l2_table_cb->l2_offset;
+    QEDL2Load *load = opaque;
+    BDRVQEDState *s = load->s;
+    CachedL2Table *l2_table = load->l2_table;
+    QEDReadL2TableCB *read_l2_table_cb, *next_cb;
+
+    QLIST_REMOVE(load, next);
 
     if (ret) {
         /* can't trust loaded L2 table anymore */
         qed_unref_l2_cache_entry(l2_table);
-        request->l2_table = NULL;
     } else {
-        l2_table->offset = l2_offset;
-
+        l2_table->offset = load->offset;
         qed_commit_l2_cache_entry(&s->l2_cache, l2_table);
+    }
 
-        /* This is guaranteed to succeed because we just committed the entry
-         * to the cache.
-         */
-        request->l2_table = qed_find_l2_cache_entry(&s->l2_cache, l2_offset);
-        assert(request->l2_table != NULL);
+    /* Take a reference for every waiter before completing any of them, the
+     * completions may commit other tables and evict this one again.  Finding
+     * the entry is guaranteed to succeed because we just committed it to the
+     * cache.
+     */
+    QSIMPLEQ_FOREACH(read_l2_table_cb, &load->waiters, next) {
+        QEDRequest *request = read_l2_table_cb->request;
+
+        if (ret) {
+            request->l2_table = NULL;
+        } else {
+            request->l2_table = qed_find_l2_cache_entry(&s->l2_cache,
+                                                        load->offset);
+            assert(request->l2_table != NULL);
+        }
     }
 
-    gencb_complete(&read_l2_table_cb->gencb, ret);
+    QSIMPLEQ_FOREACH_SAFE(read_l2_table_cb, &load->waiters, next, next_cb) {
+        gencb_complete(&read_l2_table_cb->gencb, ret);
+    }
+    g_free(load);
+}
+
+static QEDL2Load *qed_find_l2_load(BDRVQEDState *s, uint64_t offset)
+{
+    QEDL2Load *load;
+
+    QLIST_FOREACH(load, &s->l2_loads, next) {
+        if (load->offset == offset) {
+            return load;
+        }
+    }
+    return NULL;
+}
+
+static QEDL2Load *qed_new_l2_load(BDRVQEDState *s, uint64_t offset)
+{
+    QEDL2Load *load = g_malloc0(sizeof(*load));
+
+    load->s = s;
+    load->offset = offset;
+    load->l2_table = qed_alloc_l2_cache_entry(&s->l2_cache);
+    load->l2_table->table = qed_alloc_table(s);
+    QSIMPLEQ_INIT(&load->waiters);
+    QLIST_INSERT_HEAD(&s->l2_loads, load, next);
+    return load;
+}
+
+static void qed_start_l2_load(QEDL2Load *load)
+{
+    BDRVQEDState *s = load->s;
+
+    BLKDBG_EVENT(s->bs->file, BLKDBG_L2_LOAD);
+    qed_read_table(s, load->offset, load->l2_table->table,
+                   qed_read_l2_table_cb, load);
 }
 
 void qed_read_l2_table(BDRVQEDState *s, QEDRequest *request, uint64_t offset,
                        BlockDriverCompletionFunc *cb, void *opaque)
 {
     QEDReadL2TableCB *read_l2_table_cb;
+    QEDL2Load *load;
 
     qed_unref_l2_cache_entry(request->l2_table);
 
     /* Check for cached L2 entry */
     request->l2_table = qed_find_l2_cache_entry(&s->l2_cache, offset);
     if (request->l2_table) {
+        s->l2_cache.hits++;
         cb(opaque, 0);
         return;
     }
-
-    request->l2_table = qed_alloc_l2_cache_entry(&s->l2_cache);
-    request->l2_table->table = qed_alloc_table(s);
+    s->l2_cache.misses++;
 
     read_l2_table_cb = gencb_alloc(sizeof(*read_l2_table_cb), cb, opaque);
-    read_l2_table_cb->s = s;
-    read_l2_table_cb->l2_offset = offset;
     read_l2_table_cb->request = request;
 
-    BLKDBG_EVENT(s->bs->file, BLKDBG_L2_LOAD);
-    qed_read_table(s, offset, request->l2_table->table,
-                   qed_read_l2_table_cb, read_l2_table_cb);
+    /* Wait for the table if it is already being read */
+    load = qed_find_l2_load(s, offset);
+    if (load) {
+        QSIMPLEQ_INSERT_TAIL(&load->waiters, read_l2_table_cb, next);
+        return;
+    }
+
+    load = qed_new_l2_load(s, offset);
+    QSIMPLEQ_INSERT_TAIL(&load->waiters, read_l2_table_cb, next);
+    qed_start_l2_load(load);
+}
+
+/**
+ * Read an L2 table into the cache in the background
+ *
+ * Nothing happens if the table is cached or already being read.  Lookups
+ * that need the table before the read completes wait for it.
+ */
+void qed_prefetch_l2_table(BDRVQEDState *s, uint64_t offset)
+{
+    CachedL2Table *entry;
+
+    entry = qed_find_l2_cache_entry(&s->l2_cache, offset);
+    if (entry) {
+        qed_unref_l2_cache_entry(entry);
+        return;
+    }
+    if (qed_find_l2_load(s, offset)) {
+        return;
+    }
+
+    trace_qed_prefetch_l2_table(s, offset);
+    qed_start_l2_load(qed_new_l2_load(s, offset));
 }
 
 int qed_read_l2_table_sync(BDRVQEDState *s, QEDRequest *request, uint64_t offset)
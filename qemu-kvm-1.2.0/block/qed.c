@@ -284,6 +284,35 @@ static CachedL2Table *qed_new_l2_table(BDRVQEDState *s)
 }
 
 static void qed_aio_next_io(void *opaque, int ret);
+static void qed_start_need_check_timer(BDRVQEDState *s);
+
+/**
+ * Retry the allocating writes that are waiting
+ *
+ * Each request looks up its cluster again, since the allocation it waited
+ * for may have filled it in.  Requests that still conflict queue up again.
+ */
+static void qed_restart_allocating_write_reqs(BDRVQEDState *s)
+{
+    QSIMPLEQ_HEAD(, QEDAIOCB) reqs = QSIMPLEQ_HEAD_INITIALIZER(reqs);
+    QEDAIOCB *acb;
+
+    if (s->allocating_write_reqs_plugged) {
+        return;
+    }
+
+    QSIMPLEQ_CONCAT(&reqs, &s->allocating_write_reqs);
+    while ((acb = QSIMPLEQ_FIRST(&reqs)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&reqs, next);
+        qed_aio_next_io(acb, 0);
+    }
+
+    if (QLIST_EMPTY(&s->allocating_writes) &&
+        QSIMPLEQ_EMPTY(&s->allocating_write_reqs) &&
+        (s->header.features & QED_F_NEED_CHECK)) {
+        qed_start_need_check_timer(s);
+    }
+}
 
 static void qed_plug_allocating_write_reqs(BDRVQEDState *s)
 {
@@ -294,16 +323,10 @@ static void qed_plug_allocating_write_reqs(BDRVQEDState *s)
 
 static void qed_unplug_allocating_write_reqs(BDRVQEDState *s)
 {
-    QEDAIOCB *acb;
-
     assert(s->allocating_write_reqs_plugged);
 
     s->allocating_write_reqs_plugged = false;
-
-    acb = QSIMPLEQ_FIRST(&s->allocating_write_reqs);
-    if (acb) {
-        qed_aio_next_io(acb, 0);
-    }
+    qed_restart_allocating_write_reqs(s);
 }
 
 static void qed_finish_clear_need_check(void *opaque, int ret)
@@ -340,6 +363,7 @@ static void qed_need_check_timer_cb(void *opaque)
 
     /* The timer should only fire when allocating writes have drained */
     assert(!QSIMPLEQ_FIRST(&s->allocating_write_reqs));
+    assert(QLIST_EMPTY(&s->allocating_writes));
 
     trace_qed_need_check_timer_cb(s);
 
@@ -373,6 +397,23 @@ static void bdrv_qed_rebind(BlockDriverState *bs)
     s->bs = bs;
 }
 
+/**
+ * Number of L2 tables to cache, from the drive's l2-cache-size in bytes
+ */
+static unsigned int qed_l2_cache_tables(BDRVQEDState *s)
+{
+    uint64_t tables;
+
+    if (!s->bs->l2_cache_size) {
+        return QED_DEFAULT_L2_CACHE_SIZE;
+    }
+
+    /* There is no use in caching more tables than the L1 table holds */
+    tables = s->bs->l2_cache_size /
+             ((uint64_t)s->header.cluster_size * s->header.table_size);
+    return MIN(MAX(tables, QED_MIN_L2_CACHE_SIZE), s->table_nelems);
+}
+
 static int bdrv_qed_open(BlockDriverState *bs, int flags)
 {
     BDRVQEDState *s = bs->opaque;
@@ -381,7 +422,9 @@ static int bdrv_qed_open(BlockDriverState *bs, int flags)
     int ret;
 
     s->bs = bs;
+    QLIST_INIT(&s->allocating_writes);
     QSIMPLEQ_INIT(&s->allocating_write_reqs);
+    QLIST_INIT(&s->l2_loads);
 
     ret = bdrv_pread(bs->file, 0, &le_header, sizeof(le_header));
     if (ret < 0) {
@@ -469,7 +512,7 @@ static int bdrv_qed_open(BlockDriverState *bs, int flags)
     }
 
     s->l1_table = qed_alloc_table(s);
-    qed_init_l2_cache(&s->l2_cache);
+    qed_init_l2_cache(&s->l2_cache, qed_l2_cache_tables(s));
 
     ret = qed_read_l1_table_sync(s);
     if (ret) {
@@ -695,6 +738,22 @@ static BDRVQEDState *acb_to_s(QEDAIOCB *acb)
     return acb->common.bs->opaque;
 }
 
+/**
+ * Finish the allocation of a request and let waiting requests retry
+ */
+static void qed_release_allocation(QEDAIOCB *acb)
+{
+    BDRVQEDState *s = acb_to_s(acb);
+
+    if (!acb->allocating) {
+        return;
+    }
+
+    QLIST_REMOVE(acb, alloc_next);
+    acb->allocating = false;
+    qed_restart_allocating_write_reqs(s);
+}
+
 /**
  * Read from the backing file or zero-fill if no backing file
  *
@@ -877,21 +936,10 @@ static void qed_aio_complete(QEDAIOCB *acb, int ret)
     acb->bh = qemu_bh_new(qed_aio_complete_bh, acb);
     qemu_bh_schedule(acb->bh);
 
-    /* Start next allocating write request waiting behind this one.  Note that
-     * requests enqueue themselves when they first hit an unallocated cluster
-     * but they wait until the entire request is finished before waking up the
-     * next request in the queue.  This ensures that we don't cycle through
-     * requests multiple times but rather finish one at a time completely.
+    /* Start allocating write requests waiting behind this one if it failed
+     * in the middle of an allocation
      */
-    if (acb == QSIMPLEQ_FIRST(&s->allocating_write_reqs)) {
-        QSIMPLEQ_REMOVE_HEAD(&s->allocating_write_reqs, next);
-        acb = QSIMPLEQ_FIRST(&s->allocating_write_reqs);
-        if (acb) {
-            qed_aio_next_io(acb, 0);
-        } else if (s->header.features & QED_F_NEED_CHECK) {
-            qed_start_need_check_timer(s);
-        }
-    }
+    qed_release_allocation(acb);
 }
 
 /**
@@ -1095,6 +1143,69 @@ static void qed_aio_write_zero_cluster(void *opaque, int ret)
     qed_aio_write_l2_update(acb, 0, 1);
 }
 
+/**
+ * Check whether two allocations would step on each other
+ *
+ * Two allocations in one L2 table would both write back the sectors of the
+ * table they update, and the older copy could land last on disk.  The same
+ * goes for the L1 table, which every new L2 table is linked into.
+ */
+static bool qed_allocations_overlap(BDRVQEDState *s, QEDAIOCB *acb,
+                                    QEDAIOCB *other)
+{
+    if (qed_l1_index(s, acb->cur_pos) == qed_l1_index(s, other->cur_pos)) {
+        return true;
+    }
+    return acb->find_cluster_ret == QED_CLUSTER_L1 &&
+           other->find_cluster_ret == QED_CLUSTER_L1;
+}
+
+/**
+ * Check whether an allocation has to wait
+ *
+ * Allocations in different L2 tables run in parallel.  A request also waits
+ * behind queued requests for the same table so that it cannot starve them.
+ */
+static bool qed_allocation_must_wait(BDRVQEDState *s, QEDAIOCB *acb)
+{
+    QEDAIOCB *other;
+
+    if (s->allocating_write_reqs_plugged || s->need_check_pending) {
+        return true;
+    }
+
+    QLIST_FOREACH(other, &s->allocating_writes, alloc_next) {
+        if (qed_allocations_overlap(s, acb, other)) {
+            return true;
+        }
+    }
+    QSIMPLEQ_FOREACH(other, &s->allocating_write_reqs, next) {
+        if (qed_allocations_overlap(s, acb, other)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Continue an allocating write once the QED_F_NEED_CHECK header is written
+ */
+static void qed_aio_write_need_check_cb(void *opaque, int ret)
+{
+    QEDAIOCB *acb = opaque;
+    BDRVQEDState *s = acb_to_s(acb);
+
+    s->need_check_pending = false;
+
+    if (acb->flags & QED_AIOCB_ZERO) {
+        qed_aio_write_zero_cluster(acb, ret);
+    } else {
+        qed_aio_write_prefill(acb, ret);
+    }
+
+    qed_restart_allocating_write_reqs(s);
+}
+
 /**
  * Write new data cluster
  *
@@ -1109,18 +1220,19 @@ static void qed_aio_write_alloc(QEDAIOCB *acb, size_t len)
     BlockDriverCompletionFunc *cb;
 
     /* Cancel timer when the first allocating request comes in */
-    if (QSIMPLEQ_EMPTY(&s->allocating_write_reqs)) {
+    if (QLIST_EMPTY(&s->allocating_writes) &&
+        QSIMPLEQ_EMPTY(&s->allocating_write_reqs)) {
         qed_cancel_need_check_timer(s);
     }
 
-    /* Freeze this request if another allocating write is in progress */
-    if (acb != QSIMPLEQ_FIRST(&s->allocating_write_reqs)) {
+    /* Freeze this request if a conflicting allocating write is in progress */
+    if (qed_allocation_must_wait(s, acb)) {
+        trace_qed_aio_write_alloc_wait(s, acb, acb->cur_pos);
         QSIMPLEQ_INSERT_TAIL(&s->allocating_write_reqs, acb, next);
-    }
-    if (acb != QSIMPLEQ_FIRST(&s->allocating_write_reqs) ||
-        s->allocating_write_reqs_plugged) {
         return; /* wait for existing request to finish */
     }
+    QLIST_INSERT_HEAD(&s->allocating_writes, acb, alloc_next);
+    acb->allocating = true;
 
     acb->cur_nclusters = qed_bytes_to_clusters(s,
             qed_offset_into_cluster(s, acb->cur_pos) + len);
@@ -1140,8 +1252,10 @@ static void qed_aio_write_alloc(QEDAIOCB *acb, size_t len)
     }
 
     if (qed_should_set_need_check(s)) {
+        /* Other allocations wait until the header is out */
         s->header.features |= QED_F_NEED_CHECK;
-        qed_write_header(s, cb, acb);
+        s->need_check_pending = true;
+        qed_write_header(s, qed_aio_write_need_check_cb, acb);
     } else {
         cb(acb, 0);
     }
@@ -1281,6 +1395,9 @@ static void qed_aio_next_io(void *opaque, int ret)
         return;
     }
 
+    /* The allocation of the previous cluster, if any, is complete */
+    qed_release_allocation(acb);
+
     acb->qiov_offset += acb->cur_qiov.size;
     acb->cur_pos += acb->cur_qiov.size;
     qemu_iovec_reset(&acb->cur_qiov);
@@ -1315,6 +1432,7 @@ static BlockDriverAIOCB *qed_aio_setup(BlockDriverState *bs,
     acb->cur_pos = (uint64_t)sector_num * BDRV_SECTOR_SIZE;
     acb->end_pos = acb->cur_pos + nb_sectors * BDRV_SECTOR_SIZE;
     acb->request.l2_table = NULL;
+    acb->allocating = false;
     qemu_iovec_init(&acb->cur_qiov, qiov->niov);
 
     /* Start request */
@@ -1529,6 +1647,18 @@ static int bdrv_qed_check(BlockDriverState *bs, BdrvCheckResult *result,
     return qed_check(s, result, !!fix);
 }
 
+static void bdrv_qed_get_cache_stats(const BlockDriverState *bs,
+                                     BlockDeviceStats *stats)
+{
+    BDRVQEDState *s = bs->opaque;
+
+    stats->has_l2_cache = true;
+    stats->l2_cache = g_malloc0(sizeof(*stats->l2_cache));
+    stats->l2_cache->size = s->l2_cache.max_entries;
+    stats->l2_cache->hits = s->l2_cache.hits;
+    stats->l2_cache->misses = s->l2_cache.misses;
+}
+
 static QEMUOptionParameter qed_create_options[] = {
     {
         .name = BLOCK_OPT_SIZE,
@@ -1576,6 +1706,7 @@ static BlockDriver bdrv_qed = {
     .bdrv_change_backing_file = bdrv_qed_change_backing_file,
     .bdrv_invalidate_cache    = bdrv_qed_invalidate_cache,
     .bdrv_check               = bdrv_qed_check,
+    .bdrv_get_cache_stats     = bdrv_qed_get_cache_stats,
 };
 
 static void bdrv_qed_init(void)
@@ -81,6 +81,16 @@ enum {
 
     /* Delay to flush and clean image after last allocating write completes */
     QED_NEED_CHECK_TIMEOUT = 5,    /* in seconds */
+
+    /* Number of L2 tables cached unless the drive's l2-cache-size is set.
+     * Each L2 holds 2GB with the default geometry, so this lets us fully
+     * cache a 100GB disk.
+     */
+    QED_DEFAULT_L2_CACHE_SIZE = 50,
+    QED_MIN_L2_CACHE_SIZE = 4,
+
+    /* L2 tables read ahead of a sequential stream */
+    QED_L2_PREFETCH_TABLES = 2,
 };
 
 typedef struct {
@@ -115,10 +125,17 @@ typedef struct CachedL2Table {
 } CachedL2Table;
 
 typedef struct {
-    QTAILQ_HEAD(, CachedL2Table) entries;
+    QTAILQ_HEAD(, CachedL2Table) entries;   /* least recently used first */
+    GHashTable *lookup;                     /* offset -> CachedL2Table */
     unsigned int n_entries;
+    unsigned int max_entries;
+    uint64_t hits;
+    uint64_t misses;
 } L2TableCache;
 
+/* An L2 table read from the image file that lookups can wait for */
+typedef struct QEDL2Load QEDL2Load;
+
 typedef struct QEDRequest {
     CachedL2Table *l2_table;
 } QEDRequest;
@@ -133,6 +150,8 @@ typedef struct QEDAIOCB {
     QEMUBH *bh;
     int bh_ret;                     /* final return status for completion bh */
     QSIMPLEQ_ENTRY(QEDAIOCB) next;  /* next request */
+    QLIST_ENTRY(QEDAIOCB) alloc_next; /* allocating writes in progress */
+    bool allocating;                /* on the allocating_writes list? */
     int flags;                      /* QED_AIOCB_* bits ORed together */
     bool *finished;                 /* signal for cancel completion */
     uint64_t end_pos;               /* request end on block device, in bytes */
@@ -158,14 +177,20 @@ typedef struct {
     QEDHeader header;               /* always cpu-endian */
     QEDTable *l1_table;
     L2TableCache l2_cache;          /* l2 table cache */
+    QLIST_HEAD(, QEDL2Load) l2_loads; /* L2 tables being read */
+    unsigned int l2_stream_index;   /* L1 index of the last table lookup */
     uint32_t table_nelems;
     uint32_t l1_shift;
     uint32_t l2_shift;
     uint32_t l2_mask;
 
-    /* Allocating write request queue */
+    /* Allocating writes in progress and the queue of those waiting for
+     * them.  Allocations into different L2 tables run in parallel.
+     */
+    QLIST_HEAD(, QEDAIOCB) allocating_writes;
     QSIMPLEQ_HEAD(, QEDAIOCB) allocating_write_reqs;
     bool allocating_write_reqs_plugged;
+    bool need_check_pending;        /* header with QED_F_NEED_CHECK in flight */
 
     /* Periodic flush and clear need check flag */
     QEMUTimer *need_check_timer;
@@ -218,7 +243,7 @@ int qed_write_header_sync(BDRVQEDState *s);
 /**
  * L2 cache functions
  */
-void qed_init_l2_cache(L2TableCache *l2_cache);
+void qed_init_l2_cache(L2TableCache *l2_cache, unsigned int max_entries);
 void qed_free_l2_cache(L2TableCache *l2_cache);
 CachedL2Table *qed_alloc_l2_cache_entry(L2TableCache *l2_cache);
 void qed_unref_l2_cache_entry(CachedL2Table *entry);
@@ -237,6 +262,7 @@ int qed_read_l2_table_sync(BDRVQEDState *s, QEDRequest *request,
                            uint64_t offset);
 void qed_read_l2_table(BDRVQEDState *s, QEDRequest *request, uint64_t offset,
                        BlockDriverCompletionFunc *cb, void *opaque);
+void qed_prefetch_l2_table(BDRVQEDState *s, uint64_t offset);
 void qed_write_l2_table(BDRVQEDState *s, QEDRequest *request,
                         unsigned int index, unsigned int n, bool flush,
                         BlockDriverCompletionFunc *cb, void *opaque);
@@ -25,6 +25,7 @@
 
 /* AIO flags */
 #define QEMU_AIO_MISALIGNED   0x1000
+#define QEMU_AIO_FUA          0x2000 /* data must be stable on completion */
 
 
 /* posix-aio-compat.c - thread pool based implementation */
@@ -37,9 +38,11 @@ BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
         BlockDriverCompletionFunc *cb, void *opaque);
 
 /* linux-aio.c - Linux native implementation */
-void *laio_init(void);
+void *laio_init(int max_events);
 BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type);
+void laio_io_plug(void *aio_ctx);
+void laio_io_unplug(void *aio_ctx);
 
 #endif /* QEMU_RAW_POSIX_AIO_H */
@@ -40,6 +40,18 @@
  * (e.g., /etc/ceph/ceph.conf).  To avoid reading _any_ configuration
  * file, specify conf=/dev/null.
  *
+ * The librbd cache follows the cache= mode of the drive.  It can be tuned
+ * per drive with the Ceph options, e.g. rbd_cache_size=64M or
+ * rbd_cache_max_dirty=0, which take precedence over the cache= mode.
+ *
+ * Two options are handled by qemu rather than passed to Ceph:
+ *
+ * "readahead" is the size of the window read ahead once the guest reads
+ * sequentially, 0 disables it (default 1M).
+ *
+ * "write_coalesce" is the largest write built by merging adjacent writes
+ * that the device submits together, 0 disables merging (default 1M).
+ *
  * Configuration values containing :, @, or = can be escaped with a
  * leading "\".
  */
@@ -60,6 +72,13 @@
 #define RBD_MAX_SNAP_NAME_SIZE 128
 #define RBD_MAX_SNAPS 100
 
+#define RBD_DEFAULT_READAHEAD (1024 * 1024)
+#define RBD_MAX_READAHEAD (64 * 1024 * 1024)
+#define RBD_DEFAULT_WRITE_COALESCE (1024 * 1024)
+
+/* Sequential reads in a row before readahead kicks in */
+#define RBD_READAHEAD_TRIGGER 4
+
 typedef enum {
     RBD_AIO_READ,
     RBD_AIO_WRITE,
@@ -74,9 +93,13 @@ typedef struct RBDAIOCB {
     char *bounce;
     RBDAIOCmd cmd;
     int64_t sector_num;
+    int64_t off;
+    int64_t size;
     int error;
     struct BDRVRBDState *s;
     int cancelled;
+    QSIMPLEQ_ENTRY(RBDAIOCB) next;
+    struct RBDAIOCB *merged_next;   /* other writes done by the same rados op */
 } RBDAIOCB;
 
 typedef struct RADOSCB {
@@ -86,6 +109,9 @@ typedef struct RADOSCB {
     int done;
     int64_t size;
     char *buf;
+    bool free_buf;      /* buf was allocated for a merged write */
+    bool readahead;     /* reads into s->ra_buf, acb is NULL */
+    int ra_gen;
     int ret;
 } RADOSCB;
 
@@ -102,6 +128,30 @@ typedef struct BDRVRBDState {
     char *snap;
     int event_reader_pos;
     RADOSCB *event_rcb;
+
+    /* Readahead of sequential streams into ra_buf.  [ra_off, ra_off +
+     * ra_len) holds valid data; ra_gen is bumped by writes that overlap
+     * the window so that a readahead in flight is thrown away.  */
+    int64_t readahead_size;
+    int64_t seq_next;
+    int seq_count;
+    char *ra_buf;
+    int64_t ra_off;
+    int64_t ra_len;
+    bool ra_in_flight;
+    int ra_gen;
+
+    /* Writes queued between bdrv_io_plug() and bdrv_io_unplug() */
+    int64_t coalesce_size;
+    int plugged;
+    QSIMPLEQ_HEAD(, RBDAIOCB) pending_writes;
+
+    /* Counters for query-blockstats */
+    uint64_t ra_ops;
+    uint64_t ra_bytes;
+    uint64_t ra_hits;
+    uint64_t coalesced_writes;
+    uint64_t write_batches;
 } BDRVRBDState;
 
 static void rbd_aio_bh_cb(void *opaque);
@@ -233,8 +283,27 @@ static char *qemu_rbd_parse_clientname(const char *conf, char *clientname)
     return NULL;
 }
 
-static int qemu_rbd_set_conf(rados_t cluster, const char *conf)
+/* Parses a qemu option of the filename, see the comment at the top */
+static int qemu_rbd_parse_size(const char *name, const char *value,
+                               int64_t max, int64_t *size)
+{
+    char *end;
+    int64_t bytes;
+
+    bytes = strtosz_suffix(value, &end, STRTOSZ_DEFSUFFIX_B);
+    if (bytes < 0 || *end || bytes > max) {
+        error_report("invalid value %s for %s", value, name);
+        return -EINVAL;
+    }
+    *size = bytes;
+    return 0;
+}
+
+/* @s is NULL when creating an image, the qemu options are ignored then */
+static int qemu_rbd_set_conf(rados_t cluster, const char *conf,
+                             BDRVRBDState *s)
 {
+    int64_t size;
     char *p, *buf;
     char name[RBD_MAX_CONF_NAME_SIZE];
     char value[RBD_MAX_CONF_VAL_SIZE];
@@ -272,6 +341,22 @@ static int qemu_rbd_set_conf(rados_t cluster, const char *conf)
             }
         } else if (strcmp(name, "id") == 0) {
             /* ignore, this is parsed by qemu_rbd_parse_clientname() */
+        } else if (strcmp(name, "readahead") == 0) {
+            ret = qemu_rbd_parse_size(name, value, RBD_MAX_READAHEAD, &size);
+            if (ret < 0) {
+                break;
+            }
+            if (s) {
+                s->readahead_size = size;
+            }
+        } else if (strcmp(name, "write_coalesce") == 0) {
+            ret = qemu_rbd_parse_size(name, value, OBJ_MAX_SIZE, &size);
+            if (ret < 0) {
+                break;
+            }
+            if (s) {
+                s->coalesce_size = size;
+            }
         } else {
             ret = rados_conf_set(cluster, name, value);
             if (ret < 0) {
@@ -341,7 +426,7 @@ static int qemu_rbd_create(const char *filename, QEMUOptionParameter *options)
     }
 
     if (conf[0] != '\0' &&
-        qemu_rbd_set_conf(cluster, conf) < 0) {
+        qemu_rbd_set_conf(cluster, conf, NULL) < 0) {
         error_report("error setting config options");
         rados_shutdown(cluster);
         return -EIO;
@@ -371,36 +456,32 @@ static int qemu_rbd_create(const char *filename, QEMUOptionParameter *options)
  * and runs in qemu context. It schedules a bh, but just in case the aio
  * was not cancelled before.
  */
-static void qemu_rbd_complete_aio(RADOSCB *rcb)
+static void qemu_rbd_complete_acb(RBDAIOCB *acb, int64_t r, char *buf,
+                                  int64_t size)
 {
-    RBDAIOCB *acb = rcb->acb;
-    int64_t r;
-
     if (acb->cancelled) {
         qemu_vfree(acb->bounce);
         qemu_aio_release(acb);
-        goto done;
+        return;
     }
 
-    r = rcb->ret;
-
     if (acb->cmd == RBD_AIO_WRITE ||
         acb->cmd == RBD_AIO_DISCARD) {
         if (r < 0) {
             acb->ret = r;
             acb->error = 1;
         } else if (!acb->error) {
-            acb->ret = rcb->size;
+            acb->ret = size;
         }
     } else {
         if (r < 0) {
-            memset(rcb->buf, 0, rcb->size);
+            memset(buf, 0, size);
             acb->ret = r;
             acb->error = 1;
-        } else if (r < rcb->size) {
-            memset(rcb->buf + r, 0, rcb->size - r);
+        } else if (r < size) {
+            memset(buf + r, 0, size - r);
             if (!acb->error) {
-                acb->ret = rcb->size;
+                acb->ret = size;
             }
         } else if (!acb->error) {
             acb->ret = r;
@@ -409,6 +490,53 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
     /* Note that acb->bh can be NULL in case where the aio was cancelled */
     acb->bh = qemu_bh_new(rbd_aio_bh_cb, acb);
     qemu_bh_schedule(acb->bh);
+}
+
+/* Drops the readahead data if [off, off + size) overlaps its window */
+static void qemu_rbd_invalidate_readahead(BDRVRBDState *s, int64_t off,
+                                          int64_t size)
+{
+    if (off < s->ra_off + s->readahead_size && s->ra_off < off + size) {
+        s->ra_len = 0;
+        s->ra_gen++;
+    }
+}
+
+static void qemu_rbd_complete_readahead(RADOSCB *rcb)
+{
+    BDRVRBDState *s = rcb->s;
+
+    s->ra_in_flight = false;
+    if (rcb->ret > 0 && rcb->ra_gen == s->ra_gen) {
+        s->ra_len = MIN(rcb->ret, rcb->size);
+        s->ra_bytes += s->ra_len;
+    } else {
+        s->ra_len = 0;
+    }
+}
+
+static void qemu_rbd_complete_aio(RADOSCB *rcb)
+{
+    BDRVRBDState *s = rcb->s;
+    RBDAIOCB *acb, *next;
+
+    if (rcb->readahead) {
+        qemu_rbd_complete_readahead(rcb);
+        goto done;
+    }
+
+    for (acb = rcb->acb; acb; acb = next) {
+        next = acb->merged_next;
+
+        /* A readahead may have raced with the write, read it again */
+        if (acb->cmd != RBD_AIO_READ) {
+            qemu_rbd_invalidate_readahead(s, acb->off, acb->size);
+        }
+        qemu_rbd_complete_acb(acb, rcb->ret, rcb->buf, acb->size);
+    }
+    if (rcb->free_buf) {
+        qemu_vfree(rcb->buf);
+    }
 done:
     g_free(rcb);
 }
@@ -500,8 +628,12 @@ static int qemu_rbd_open(BlockDriverState *bs, const char *filename, int flags)
         rados_conf_read_file(s->cluster, NULL);
     }
 
+    s->readahead_size = RBD_DEFAULT_READAHEAD;
+    s->coalesce_size = RBD_DEFAULT_WRITE_COALESCE;
+    QSIMPLEQ_INIT(&s->pending_writes);
+
     if (conf[0] != '\0') {
-        r = qemu_rbd_set_conf(s->cluster, conf);
+        r = qemu_rbd_set_conf(s->cluster, conf, s);
         if (r < 0) {
             error_report("error setting config options");
             goto failed_shutdown;
@@ -564,6 +696,7 @@ static void qemu_rbd_close(BlockDriverState *bs)
     rados_ioctx_destroy(s->io_ctx);
     g_free(s->snap);
     rados_shutdown(s->cluster);
+    qemu_vfree(s->ra_buf);
 }
 
 /*
@@ -638,7 +771,8 @@ static void rbd_aio_bh_cb(void *opaque)
 {
     RBDAIOCB *acb = opaque;
 
-    if (acb->cmd == RBD_AIO_READ) {
+    /* reads served from the readahead buffer have no bounce buffer */
+    if (acb->cmd == RBD_AIO_READ && acb->bounce) {
         qemu_iovec_from_buf(acb->qiov, 0, acb->bounce, acb->qiov->size);
     }
     qemu_vfree(acb->bounce);
@@ -661,6 +795,188 @@ static int rbd_aio_discard_wrapper(rbd_image_t image,
 #endif
 }
 
+/*
+ * Serves a read from the readahead buffer if it holds all of it.  Returns
+ * whether it did.
+ */
+static bool qemu_rbd_read_cached(BDRVRBDState *s, RBDAIOCB *acb)
+{
+    if (acb->off < s->ra_off ||
+        acb->off + acb->size > s->ra_off + s->ra_len) {
+        return false;
+    }
+
+    qemu_iovec_from_buf(acb->qiov, 0, s->ra_buf + (acb->off - s->ra_off),
+                        acb->size);
+    acb->ret = acb->size;
+    acb->bh = qemu_bh_new(rbd_aio_bh_cb, acb);
+    qemu_bh_schedule(acb->bh);
+    s->ra_hits++;
+
+    /* the stream goes on, the next miss starts another readahead */
+    s->seq_next = acb->off + acb->size;
+    s->seq_count++;
+    return true;
+}
+
+/*
+ * Tracks the stream of reads and, once it has been sequential for a few
+ * requests, reads the window that follows @off + @size into ra_buf.  Only
+ * one readahead is in flight at a time; failures are not reported, the
+ * guest's own reads will see them.
+ */
+static void qemu_rbd_readahead(BlockDriverState *bs, int64_t off,
+                               int64_t size)
+{
+    BDRVRBDState *s = bs->opaque;
+    RADOSCB *rcb;
+    rbd_completion_t c;
+    int64_t start, len;
+    int r;
+
+    if (off == s->seq_next) {
+        s->seq_count++;
+    } else {
+        s->seq_count = 0;
+    }
+    s->seq_next = off + size;
+
+    if (s->seq_count < RBD_READAHEAD_TRIGGER || s->ra_in_flight ||
+        size >= s->readahead_size) {
+        return;
+    }
+
+    start = off + size;
+    len = MIN(s->readahead_size,
+              bs->total_sectors * BDRV_SECTOR_SIZE - start);
+    if (len <= 0) {
+        return;
+    }
+
+    if (!s->ra_buf) {
+        s->ra_buf = qemu_blockalign(bs, s->readahead_size);
+    }
+
+    rcb = g_malloc0(sizeof(RADOSCB));
+    rcb->s = s;
+    rcb->buf = s->ra_buf;
+    rcb->size = len;
+    rcb->readahead = true;
+    rcb->ra_gen = s->ra_gen;
+    r = rbd_aio_create_completion(rcb, (rbd_callback_t) rbd_finish_aiocb, &c);
+    if (r < 0) {
+        g_free(rcb);
+        return;
+    }
+    r = rbd_aio_read(s->image, start, len, s->ra_buf, c);
+    if (r < 0) {
+        rbd_aio_release(c);
+        g_free(rcb);
+        return;
+    }
+
+    s->ra_off = start;
+    s->ra_len = 0;
+    s->ra_in_flight = true;
+    s->ra_ops++;
+    s->qemu_aio_count++;
+}
+
+/*
+ * Submits the writes chained from @first through merged_next, which cover
+ * @size contiguous bytes, as a single rados write.
+ */
+static void qemu_rbd_submit_writes(BDRVRBDState *s, RBDAIOCB *first,
+                                   int64_t size, int n)
+{
+    RBDAIOCB *acb;
+    RADOSCB *rcb;
+    rbd_completion_t c;
+    char *buf;
+    int64_t pos = 0;
+    int r;
+
+    buf = qemu_blockalign(first->common.bs, size);
+    for (acb = first; acb; acb = acb->merged_next) {
+        qemu_iovec_to_buf(acb->qiov, 0, buf + pos, acb->size);
+        pos += acb->size;
+    }
+
+    if (n > 1) {
+        s->coalesced_writes += n;
+        s->write_batches++;
+    }
+    /* each write was counted when it was queued */
+    s->qemu_aio_count -= n - 1;
+
+    rcb = g_malloc0(sizeof(RADOSCB));
+    rcb->acb = first;
+    rcb->s = s;
+    rcb->buf = buf;
+    rcb->free_buf = true;
+    rcb->size = size;
+    r = rbd_aio_create_completion(rcb, (rbd_callback_t) rbd_finish_aiocb, &c);
+    if (r >= 0) {
+        r = rbd_aio_write(s->image, first->off, size, buf, c);
+        if (r < 0) {
+            rbd_aio_release(c);
+        }
+    }
+
+    if (r < 0) {
+        /* the requests have been accepted already, fail them from a BH */
+        rcb->ret = r;
+        qemu_rbd_complete_aio(rcb);
+        s->qemu_aio_count--;
+    }
+}
+
+/* Merges runs of adjacent queued writes up to coalesce_size and submits them */
+static void qemu_rbd_submit_pending(BDRVRBDState *s)
+{
+    RBDAIOCB *first, *last, *acb;
+    int64_t size;
+    int n;
+
+    while (!QSIMPLEQ_EMPTY(&s->pending_writes)) {
+        first = last = QSIMPLEQ_FIRST(&s->pending_writes);
+        QSIMPLEQ_REMOVE_HEAD(&s->pending_writes, next);
+        first->merged_next = NULL;
+        size = first->size;
+        n = 1;
+
+        while ((acb = QSIMPLEQ_FIRST(&s->pending_writes)) != NULL &&
+               acb->off == last->off + last->size &&
+               size + acb->size <= s->coalesce_size) {
+            QSIMPLEQ_REMOVE_HEAD(&s->pending_writes, next);
+            acb->merged_next = NULL;
+            last->merged_next = acb;
+            last = acb;
+            size += acb->size;
+            n++;
+        }
+
+        qemu_rbd_submit_writes(s, first, size, n);
+    }
+}
+
+static void qemu_rbd_io_plug(BlockDriverState *bs)
+{
+    BDRVRBDState *s = bs->opaque;
+
+    s->plugged++;
+}
+
+static void qemu_rbd_io_unplug(BlockDriverState *bs)
+{
+    BDRVRBDState *s = bs->opaque;
+
+    assert(s->plugged > 0);
+    if (--s->plugged == 0) {
+        qemu_rbd_submit_pending(s);
+    }
+}
+
 static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
                                        int64_t sector_num,
                                        QEMUIOVector *qiov,
@@ -678,32 +994,51 @@ static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
 
     BDRVRBDState *s = bs->opaque;
 
+    off = sector_num * BDRV_SECTOR_SIZE;
+    size = nb_sectors * BDRV_SECTOR_SIZE;
+
     acb = qemu_aio_get(&rbd_aio_pool, bs, cb, opaque);
     acb->cmd = cmd;
     acb->qiov = qiov;
-    if (cmd == RBD_AIO_DISCARD) {
-        acb->bounce = NULL;
-    } else {
-        acb->bounce = qemu_blockalign(bs, qiov->size);
-    }
+    acb->bounce = NULL;
+    acb->off = off;
+    acb->size = size;
+    acb->merged_next = NULL;
     acb->ret = 0;
     acb->error = 0;
     acb->s = s;
     acb->cancelled = 0;
     acb->bh = NULL;
 
+    if (cmd == RBD_AIO_READ && s->readahead_size) {
+        if (qemu_rbd_read_cached(s, acb)) {
+            return &acb->common;
+        }
+        qemu_rbd_readahead(bs, off, size);
+    } else if (cmd != RBD_AIO_READ) {
+        qemu_rbd_invalidate_readahead(s, off, size);
+    }
+
+    if (cmd == RBD_AIO_WRITE && s->plugged && size < s->coalesce_size) {
+        /* submitted by qemu_rbd_io_unplug(), possibly merged */
+        QSIMPLEQ_INSERT_TAIL(&s->pending_writes, acb, next);
+        s->qemu_aio_count++;
+        return &acb->common;
+    }
+
+    if (cmd != RBD_AIO_DISCARD) {
+        acb->bounce = qemu_blockalign(bs, qiov->size);
+    }
+
     if (cmd == RBD_AIO_WRITE) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
     }
 
     buf = acb->bounce;
 
-    off = sector_num * BDRV_SECTOR_SIZE;
-    size = nb_sectors * BDRV_SECTOR_SIZE;
-
     s->qemu_aio_count++; /* All the RADOSCB */
 
-    rcb = g_malloc(sizeof(RADOSCB));
+    rcb = g_malloc0(sizeof(RADOSCB));
     rcb->done = 0;
     rcb->acb = acb;
     rcb->buf = buf;
@@ -737,6 +1072,7 @@ static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
 failed:
     g_free(rcb);
     s->qemu_aio_count--;
+    qemu_vfree(acb->bounce);
     qemu_aio_release(acb);
     return NULL;
 }
@@ -864,6 +1200,10 @@ static int qemu_rbd_snap_rollback(BlockDriverState *bs,
     BDRVRBDState *s = bs->opaque;
     int r;
 
+    /* the whole image changes under the readahead buffer */
+    s->ra_len = 0;
+    s->ra_gen++;
+
     r = rbd_snap_rollback(s->image, snapshot_name);
     return r;
 }
@@ -922,6 +1262,20 @@ static BlockDriverAIOCB* qemu_rbd_aio_discard(BlockDriverState *bs,
 }
 #endif
 
+static void qemu_rbd_get_cache_stats(const BlockDriverState *bs,
+                                     BlockDeviceStats *stats)
+{
+    BDRVRBDState *s = bs->opaque;
+
+    stats->has_rbd = true;
+    stats->rbd = g_malloc0(sizeof(*stats->rbd));
+    stats->rbd->readahead_ops = s->ra_ops;
+    stats->rbd->readahead_bytes = s->ra_bytes;
+    stats->rbd->readahead_hits = s->ra_hits;
+    stats->rbd->coalesced_writes = s->coalesced_writes;
+    stats->rbd->write_batches = s->write_batches;
+}
+
 static QEMUOptionParameter qemu_rbd_create_options[] = {
     {
      .name = BLOCK_OPT_SIZE,
@@ -946,11 +1300,14 @@ static BlockDriver bdrv_rbd = {
     .create_options     = qemu_rbd_create_options,
     .bdrv_getlength     = qemu_rbd_getlength,
     .bdrv_truncate      = qemu_rbd_truncate,
+    .bdrv_get_cache_stats = qemu_rbd_get_cache_stats,
     .protocol_name      = "rbd",
 
     .bdrv_aio_readv         = qemu_rbd_aio_readv,
     .bdrv_aio_writev        = qemu_rbd_aio_writev,
     .bdrv_co_flush_to_disk  = qemu_rbd_co_flush,
+    .bdrv_io_plug           = qemu_rbd_io_plug,
+    .bdrv_io_unplug         = qemu_rbd_io_unplug,
 
 #ifdef LIBRBD_SUPPORTS_DISCARD
     .bdrv_aio_discard       = qemu_rbd_aio_discard,
@@ -23,6 +23,13 @@
 #define SD_DEFAULT_ADDR "localhost"
 #define SD_DEFAULT_PORT "7000"
 
+/* number of connections used for object I/O */
+#define SD_NR_CONNECTIONS 4
+
+/* read cache, see sd_cache_read() */
+#define SD_CACHE_CHUNK_SIZE (64 * 1024)
+#define SD_CACHE_SIZE       (16 * 1024 * 1024)
+
 #define SD_OP_CREATE_AND_WRITE_OBJ  0x01
 #define SD_OP_READ_OBJ       0x02
 #define SD_OP_WRITE_OBJ      0x03
@@ -247,9 +254,11 @@ static inline int is_snapshot(struct SheepdogInode *inode)
 #endif
 
 typedef struct SheepdogAIOCB SheepdogAIOCB;
+typedef struct SheepdogConn SheepdogConn;
 
 typedef struct AIOReq {
     SheepdogAIOCB *aiocb;
+    SheepdogConn *conn;
     unsigned int iov_offset;
 
     uint64_t oid;
@@ -259,6 +268,9 @@ typedef struct AIOReq {
     uint8_t flags;
     uint32_t id;
 
+    /* cache_write_gen when a read was sent */
+    uint64_t cache_gen;
+
     QLIST_ENTRY(AIOReq) aio_siblings;
 } AIOReq;
 
@@ -285,6 +297,27 @@ struct SheepdogAIOCB {
     int nr_pending;
 };
 
+/*
+ * A connection used for object I/O.  Requests to the same object
+ * always go through the same connection, requests to different
+ * objects are spread among all of them.
+ */
+struct SheepdogConn {
+    struct BDRVSheepdogState *s;
+    int fd;
+
+    CoMutex lock;
+    Coroutine *co_send;
+    Coroutine *co_recv;
+};
+
+typedef struct SheepdogCacheEntry {
+    uint64_t oid;
+    uint32_t offset;
+    uint8_t *data;
+    QTAILQ_ENTRY(SheepdogCacheEntry) lru;
+} SheepdogCacheEntry;
+
 typedef struct BDRVSheepdogState {
     SheepdogInode inode;
 
@@ -297,12 +330,17 @@ typedef struct BDRVSheepdogState {
 
     char *addr;
     char *port;
-    int fd;
+    char **gateways;
     int flush_fd;
 
-    CoMutex lock;
-    Coroutine *co_send;
-    Coroutine *co_recv;
+    SheepdogConn conns[SD_NR_CONNECTIONS];
+    int nr_conns;
+
+    /* recently read data, NULL with cache=none */
+    GHashTable *cache;
+    QTAILQ_HEAD(sd_cache_lru_head, SheepdogCacheEntry) cache_lru;
+    unsigned int cache_nr;
+    uint64_t cache_write_gen;
 
     uint32_t aioreq_seq_num;
     QLIST_HEAD(inflight_aio_head, AIOReq) inflight_aio_head;
@@ -657,17 +695,167 @@ static void coroutine_fn send_pending_req(BDRVSheepdogState *s, uint64_t oid)
     }
 }
 
+static SheepdogConn *sd_get_conn(BDRVSheepdogState *s, uint64_t oid)
+{
+    uint64_t hval = fnv_64a_buf(&oid, sizeof(oid), FNV1A_64_INIT);
+
+    return &s->conns[hval % s->nr_conns];
+}
+
+/*
+ * Read cache
+ *
+ * Data objects are cached in SD_CACHE_CHUNK_SIZE chunks, filled by
+ * reads that cover whole chunks and dropped by writes to them.  The
+ * VDI is locked by this QEMU while it is open, so nobody else writes
+ * to its objects and objects of snapshots never change.
+ *
+ * A read that was sent before a write and completes after it may
+ * carry either the old or the new data, so it only fills the cache if
+ * no write was sent or completed meanwhile.
+ */
+static guint sd_cache_hash(gconstpointer key)
+{
+    const SheepdogCacheEntry *e = key;
+    uint64_t hval;
+
+    hval = fnv_64a_buf((void *)&e->oid, sizeof(e->oid), FNV1A_64_INIT);
+    hval = fnv_64a_buf((void *)&e->offset, sizeof(e->offset), hval);
+    return hval;
+}
+
+static gboolean sd_cache_equal(gconstpointer a, gconstpointer b)
+{
+    const SheepdogCacheEntry *ea = a, *eb = b;
+
+    return ea->oid == eb->oid && ea->offset == eb->offset;
+}
+
+static SheepdogCacheEntry *sd_cache_lookup(BDRVSheepdogState *s,
+                                           uint64_t oid, uint64_t offset)
+{
+    SheepdogCacheEntry key = { .oid = oid, .offset = offset };
+
+    return g_hash_table_lookup(s->cache, &key);
+}
+
+static void sd_cache_drop(BDRVSheepdogState *s, SheepdogCacheEntry *e)
+{
+    g_hash_table_remove(s->cache, e);
+    QTAILQ_REMOVE(&s->cache_lru, e, lru);
+    s->cache_nr--;
+    g_free(e->data);
+    g_free(e);
+}
+
+static void sd_cache_clear(BDRVSheepdogState *s)
+{
+    while (!QTAILQ_EMPTY(&s->cache_lru)) {
+        sd_cache_drop(s, QTAILQ_FIRST(&s->cache_lru));
+    }
+}
+
+/*
+ * Copy LEN bytes at OFFSET of OID to QIOV at IOV_OFFSET if all of them
+ * are cached.  Returns true on a hit.
+ */
+static bool sd_cache_read(BDRVSheepdogState *s, uint64_t oid,
+                          uint64_t offset, unsigned int len,
+                          QEMUIOVector *qiov, size_t iov_offset)
+{
+    uint64_t start = QEMU_ALIGN_DOWN(offset, SD_CACHE_CHUNK_SIZE);
+    uint64_t end = offset + len;
+    uint64_t off;
+    SheepdogCacheEntry *e;
+
+    if (!s->cache) {
+        return false;
+    }
+
+    for (off = start; off < end; off += SD_CACHE_CHUNK_SIZE) {
+        if (!sd_cache_lookup(s, oid, off)) {
+            return false;
+        }
+    }
+
+    for (off = start; off < end; off += SD_CACHE_CHUNK_SIZE) {
+        uint64_t from = MAX(off, offset);
+        uint64_t to = MIN(off + SD_CACHE_CHUNK_SIZE, end);
+
+        e = sd_cache_lookup(s, oid, off);
+        qemu_iovec_from_buf(qiov, iov_offset + from - offset,
+                            e->data + from - off, to - from);
+        QTAILQ_REMOVE(&s->cache_lru, e, lru);
+        QTAILQ_INSERT_HEAD(&s->cache_lru, e, lru);
+    }
+    return true;
+}
+
+/* Fill the cache with the chunks that a completed read covers */
+static void sd_cache_insert(BDRVSheepdogState *s, AIOReq *aio_req,
+                            QEMUIOVector *qiov)
+{
+    uint64_t end = aio_req->offset + aio_req->data_len;
+    uint64_t off;
+    SheepdogCacheEntry *e;
+
+    if (!s->cache || aio_req->cache_gen != s->cache_write_gen) {
+        return;
+    }
+
+    for (off = QEMU_ALIGN_UP(aio_req->offset, SD_CACHE_CHUNK_SIZE);
+         off + SD_CACHE_CHUNK_SIZE <= end; off += SD_CACHE_CHUNK_SIZE) {
+        if (sd_cache_lookup(s, aio_req->oid, off)) {
+            continue;
+        }
+        if (s->cache_nr == SD_CACHE_SIZE / SD_CACHE_CHUNK_SIZE) {
+            sd_cache_drop(s, QTAILQ_LAST(&s->cache_lru, sd_cache_lru_head));
+        }
+
+        e = g_malloc(sizeof(*e));
+        e->oid = aio_req->oid;
+        e->offset = off;
+        e->data = g_malloc(SD_CACHE_CHUNK_SIZE);
+        qemu_iovec_to_buf(qiov, aio_req->iov_offset + off - aio_req->offset,
+                          e->data, SD_CACHE_CHUNK_SIZE);
+        g_hash_table_insert(s->cache, e, e);
+        QTAILQ_INSERT_HEAD(&s->cache_lru, e, lru);
+        s->cache_nr++;
+    }
+}
+
+static void sd_cache_invalidate(BDRVSheepdogState *s, uint64_t oid,
+                                uint64_t offset, unsigned int len)
+{
+    uint64_t off;
+    SheepdogCacheEntry *e;
+
+    if (!s->cache || !is_data_obj(oid)) {
+        return;
+    }
+
+    s->cache_write_gen++;
+    for (off = QEMU_ALIGN_DOWN(offset, SD_CACHE_CHUNK_SIZE);
+         off < offset + len; off += SD_CACHE_CHUNK_SIZE) {
+        e = sd_cache_lookup(s, oid, off);
+        if (e) {
+            sd_cache_drop(s, e);
+        }
+    }
+}
+
 /*
  * Receive responses of the I/O requests.
  *
  * This function is registered as a fd handler, and called from the
- * main loop when s->fd is ready for reading responses.
+ * main loop when the connection is ready for reading responses.
  */
 static void coroutine_fn aio_read_response(void *opaque)
 {
     SheepdogObjRsp rsp;
-    BDRVSheepdogState *s = opaque;
-    int fd = s->fd;
+    SheepdogConn *conn = opaque;
+    BDRVSheepdogState *s = conn->s;
+    int fd = conn->fd;
     int ret;
     AIOReq *aio_req = NULL;
     SheepdogAIOCB *acb;
@@ -686,7 +874,7 @@ static void coroutine_fn aio_read_response(void *opaque)
 
     /* find the right aio_req from the inflight aio list */
     QLIST_FOREACH(aio_req, &s->inflight_aio_head, aio_siblings) {
-        if (aio_req->id == rsp.id) {
+        if (aio_req->id == rsp.id && aio_req->conn == conn) {
             break;
         }
     }
@@ -701,7 +889,9 @@ static void coroutine_fn aio_read_response(void *opaque)
     case AIOCB_WRITE_UDATA:
         /* this coroutine context is no longer suitable for co_recv
          * because we may send data to update vdi objects */
-        s->co_recv = NULL;
+        conn->co_recv = NULL;
+        sd_cache_invalidate(s, aio_req->oid, aio_req->offset,
+                            aio_req->data_len);
         if (!is_data_obj(aio_req->oid)) {
             break;
         }
@@ -739,6 +929,8 @@ static void coroutine_fn aio_read_response(void *opaque)
     if (rsp.result != SD_RES_SUCCESS) {
         acb->ret = -EIO;
         error_report("%s", sd_strerror(rsp.result));
+    } else if (acb->aiocb_type == AIOCB_READ_UDATA) {
+        sd_cache_insert(s, aio_req, acb->qiov);
     }
 
     free_aio_req(s, aio_req);
@@ -750,30 +942,31 @@ static void coroutine_fn aio_read_response(void *opaque)
         acb->aio_done_func(acb);
     }
 out:
-    s->co_recv = NULL;
+    conn->co_recv = NULL;
 }
 
 static void co_read_response(void *opaque)
 {
-    BDRVSheepdogState *s = opaque;
+    SheepdogConn *conn = opaque;
 
-    if (!s->co_recv) {
-        s->co_recv = qemu_coroutine_create(aio_read_response);
+    if (!conn->co_recv) {
+        conn->co_recv = qemu_coroutine_create(aio_read_response);
     }
 
-    qemu_coroutine_enter(s->co_recv, opaque);
+    qemu_coroutine_enter(conn->co_recv, opaque);
 }
 
 static void co_write_request(void *opaque)
 {
-    BDRVSheepdogState *s = opaque;
+    SheepdogConn *conn = opaque;
 
-    qemu_coroutine_enter(s->co_send, NULL);
+    qemu_coroutine_enter(conn->co_send, NULL);
 }
 
 static int aio_flush_request(void *opaque)
 {
-    BDRVSheepdogState *s = opaque;
+    SheepdogConn *conn = opaque;
+    BDRVSheepdogState *s = conn->s;
 
     return !QLIST_EMPTY(&s->inflight_aio_head) ||
         !QLIST_EMPTY(&s->pending_aio_head);
@@ -794,11 +987,12 @@ static int set_nodelay(int fd)
  * We cannot use this discriptor for other operations because
  * the block driver may be on waiting response from the server.
  */
-static int get_sheep_fd(BDRVSheepdogState *s)
+static int get_sheep_fd(BDRVSheepdogState *s, SheepdogConn *conn,
+                        const char *addr)
 {
     int ret, fd;
 
-    fd = connect_to_sdog(s->addr, s->port);
+    fd = connect_to_sdog(addr, s->port);
     if (fd < 0) {
         error_report("%s", strerror(errno));
         return fd;
@@ -813,10 +1007,35 @@ static int get_sheep_fd(BDRVSheepdogState *s)
         return -errno;
     }
 
-    qemu_aio_set_fd_handler(fd, co_read_response, NULL, aio_flush_request, s);
+    qemu_aio_set_fd_handler(fd, co_read_response, NULL, aio_flush_request,
+                            conn);
     return fd;
 }
 
+/* The gateway that connection I talks to */
+static const char *sd_gateway(BDRVSheepdogState *s, int i)
+{
+    if (!s->gateways) {
+        return s->addr;
+    }
+    return s->gateways[i % g_strv_length(s->gateways)];
+}
+
+static void sd_close_conns(BDRVSheepdogState *s)
+{
+    int i;
+
+    for (i = 0; i < s->nr_conns; i++) {
+        SheepdogConn *conn = &s->conns[i];
+
+        if (conn->fd >= 0) {
+            qemu_aio_set_fd_handler(conn->fd, NULL, NULL, NULL, NULL);
+            closesocket(conn->fd);
+            conn->fd = -1;
+        }
+    }
+}
+
 /*
  * Parse a filename
  *
@@ -832,7 +1051,9 @@ static int get_sheep_fd(BDRVSheepdogState *s)
  * `tag'.
  *
  * You can run VMs outside the Sheepdog cluster by specifying
- * `hostname' and `port' (experimental).
+ * `hostname' and `port' (experimental).  `hostname' may be a comma
+ * separated list of gateways that listen on the same port; object I/O
+ * is then spread among all of them, other requests go to the first.
  */
 static int parse_vdiname(BDRVSheepdogState *s, const char *filename,
                          char *vdi, uint32_t *snapid, char *tag)
@@ -861,6 +1082,11 @@ static int parse_vdiname(BDRVSheepdogState *s, const char *filename,
         s->port = p;
         p = strchr(p, ':');
         *p++ = '\0';
+
+        if (strchr(s->addr, ',')) {
+            s->gateways = g_strsplit(s->addr, ",", 0);
+            *strchr(s->addr, ',') = '\0';
+        }
     } else {
         s->addr = NULL;
         s->port = 0;
@@ -945,6 +1171,7 @@ static int coroutine_fn add_aio_request(BDRVSheepdogState *s, AIOReq *aio_req,
 {
     int nr_copies = s->inode.nr_copies;
     SheepdogObjReq hdr;
+    SheepdogConn *conn;
     unsigned int wlen;
     int ret;
     uint64_t oid = aio_req->oid;
@@ -986,33 +1213,41 @@ static int coroutine_fn add_aio_request(BDRVSheepdogState *s, AIOReq *aio_req,
 
     hdr.id = aio_req->id;
 
-    qemu_co_mutex_lock(&s->lock);
-    s->co_send = qemu_coroutine_self();
-    qemu_aio_set_fd_handler(s->fd, co_read_response, co_write_request,
-                            aio_flush_request, s);
-    socket_set_cork(s->fd, 1);
+    conn = sd_get_conn(s, oid);
+    aio_req->conn = conn;
+    if (aiocb_type == AIOCB_READ_UDATA) {
+        aio_req->cache_gen = s->cache_write_gen;
+    } else {
+        sd_cache_invalidate(s, oid, offset, datalen);
+    }
+
+    qemu_co_mutex_lock(&conn->lock);
+    conn->co_send = qemu_coroutine_self();
+    qemu_aio_set_fd_handler(conn->fd, co_read_response, co_write_request,
+                            aio_flush_request, conn);
+    socket_set_cork(conn->fd, 1);
 
     /* send a header */
-    ret = qemu_co_send(s->fd, &hdr, sizeof(hdr));
+    ret = qemu_co_send(conn->fd, &hdr, sizeof(hdr));
     if (ret < 0) {
-        qemu_co_mutex_unlock(&s->lock);
+        qemu_co_mutex_unlock(&conn->lock);
         error_report("failed to send a req, %s", strerror(errno));
         return -errno;
     }
 
     if (wlen) {
-        ret = qemu_co_sendv(s->fd, iov, niov, aio_req->iov_offset, wlen);
+        ret = qemu_co_sendv(conn->fd, iov, niov, aio_req->iov_offset, wlen);
         if (ret < 0) {
-            qemu_co_mutex_unlock(&s->lock);
+            qemu_co_mutex_unlock(&conn->lock);
             error_report("failed to send a data, %s", strerror(errno));
             return -errno;
         }
     }
 
-    socket_set_cork(s->fd, 0);
-    qemu_aio_set_fd_handler(s->fd, co_read_response, NULL,
-                            aio_flush_request, s);
-    qemu_co_mutex_unlock(&s->lock);
+    socket_set_cork(conn->fd, 0);
+    qemu_aio_set_fd_handler(conn->fd, co_read_response, NULL,
+                            aio_flush_request, conn);
+    qemu_co_mutex_unlock(&conn->lock);
 
     return 0;
 }
@@ -1084,7 +1319,7 @@ static int write_object(int fd, char *buf, uint64_t oid, int copies,
 
 static int sd_open(BlockDriverState *bs, const char *filename, int flags)
 {
-    int ret, fd;
+    int i, ret, fd;
     uint32_t vid = 0;
     BDRVSheepdogState *s = bs->opaque;
     char vdi[SD_MAX_VDI_LEN], tag[SD_MAX_VDI_TAG_LEN];
@@ -1095,7 +1330,13 @@ static int sd_open(BlockDriverState *bs, const char *filename, int flags)
 
     QLIST_INIT(&s->inflight_aio_head);
     QLIST_INIT(&s->pending_aio_head);
-    s->fd = -1;
+    QTAILQ_INIT(&s->cache_lru);
+    s->nr_conns = SD_NR_CONNECTIONS;
+    for (i = 0; i < s->nr_conns; i++) {
+        s->conns[i].s = s;
+        s->conns[i].fd = -1;
+        qemu_co_mutex_init(&s->conns[i].lock);
+    }
 
     memset(vdi, 0, sizeof(vdi));
     memset(tag, 0, sizeof(tag));
@@ -1103,10 +1344,14 @@ static int sd_open(BlockDriverState *bs, const char *filename, int flags)
         ret = -EINVAL;
         goto out;
     }
-    s->fd = get_sheep_fd(s);
-    if (s->fd < 0) {
-        ret = s->fd;
-        goto out;
+    for (i = 0; i < s->nr_conns; i++) {
+        SheepdogConn *conn = &s->conns[i];
+
+        conn->fd = get_sheep_fd(s, conn, sd_gateway(s, i));
+        if (conn->fd < 0) {
+            ret = conn->fd;
+            goto out;
+        }
     }
 
     ret = find_vdi_name(s, vdi, snapid, tag, &vid, 0);
@@ -1152,14 +1397,15 @@ static int sd_open(BlockDriverState *bs, const char *filename, int flags)
 
     bs->total_sectors = s->inode.vdi_size / SECTOR_SIZE;
     strncpy(s->name, vdi, sizeof(s->name));
-    qemu_co_mutex_init(&s->lock);
+    if (!(flags & BDRV_O_NOCACHE)) {
+        s->cache = g_hash_table_new(sd_cache_hash, sd_cache_equal);
+    }
     g_free(buf);
     return 0;
 out:
-    qemu_aio_set_fd_handler(s->fd, NULL, NULL, NULL, NULL);
-    if (s->fd >= 0) {
-        closesocket(s->fd);
-    }
+    sd_close_conns(s);
+    g_strfreev(s->gateways);
+    s->gateways = NULL;
     g_free(buf);
     return ret;
 }
@@ -1345,6 +1591,7 @@ static int sd_create(const char *filename, QEMUOptionParameter *options)
 
     ret = sd_prealloc(filename);
 out:
+    g_strfreev(s->gateways);
     g_free(s);
     return ret;
 }
@@ -1380,11 +1627,15 @@ static void sd_close(BlockDriverState *bs)
         error_report("%s, %s", sd_strerror(rsp->result), s->name);
     }
 
-    qemu_aio_set_fd_handler(s->fd, NULL, NULL, NULL, NULL);
-    closesocket(s->fd);
+    sd_close_conns(s);
     if (s->cache_enabled) {
         closesocket(s->flush_fd);
     }
+    if (s->cache) {
+        sd_cache_clear(s);
+        g_hash_table_destroy(s->cache);
+    }
+    g_strfreev(s->gateways);
     g_free(s->addr);
 }
 
@@ -1578,6 +1829,9 @@ static int coroutine_fn sd_co_rw_vector(void *p)
                 qemu_iovec_memset(acb->qiov, done, 0, len);
                 goto done;
             }
+            if (sd_cache_read(s, oid, offset, len, acb->qiov, done)) {
+                goto done;
+            }
             break;
         case AIOCB_WRITE_UDATA:
             if (!inode->data_vdi_id[idx]) {
@@ -1854,6 +2108,9 @@ static int sd_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
     }
 
     s->is_snapshot = 1;
+    if (s->cache) {
+        sd_cache_clear(s);
+    }
 
     g_free(buf);
     g_free(old_s);
@@ -19,11 +19,24 @@ enum {
     /*
      * Size of data buffer for populating the image file.  This should be large
      * enough to process multiple clusters in a single call, so that populating
-     * contiguous regions of the image is efficient.
+     * contiguous regions of the image is efficient.  The request size grows
+     * from STREAM_BUFFER_SIZE up to STREAM_MAX_BUFFER_SIZE while requests
+     * complete quickly, and shrinks back when they get slow.
      */
     STREAM_BUFFER_SIZE = 512 * 1024, /* in bytes */
+    STREAM_MAX_BUFFER_SIZE = 4 * 1024 * 1024, /* in bytes */
+
+    /* Number of chunks that are copied concurrently */
+    STREAM_MAX_IN_FLIGHT = 8,
+
+    /* Allocation status is looked up in batches of this many bytes */
+    STREAM_SCAN_SIZE = 256 * 1024 * 1024,
 };
 
+/* Copies faster than this grow the request size, slower ones shrink it */
+#define STREAM_FAST_NS  10000000LL
+#define STREAM_SLOW_NS  50000000LL
+
 #define SLICE_TIME 100000000ULL /* ns */
 
 typedef struct StreamBlockJob {
@@ -31,8 +44,18 @@ typedef struct StreamBlockJob {
     RateLimit limit;
     BlockDriverState *base;
     char backing_file_id[1024];
+    int chunk_sectors;
+    int in_flight;
+    bool waiting;
+    int ret;
 } StreamBlockJob;
 
+typedef struct StreamCopy {
+    StreamBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+} StreamCopy;
+
 static int coroutine_fn stream_populate(BlockDriverState *bs,
                                         int64_t sector_num, int nb_sectors,
                                         void *buf)
@@ -49,6 +72,72 @@ static int coroutine_fn stream_populate(BlockDriverState *bs,
     return bdrv_co_copy_on_readv(bs, sector_num, nb_sectors, &qiov);
 }
 
+static void coroutine_fn stream_copy_entry(void *opaque)
+{
+    StreamCopy *copy = opaque;
+    StreamBlockJob *s = copy->s;
+    BlockDriverState *bs = s->common.bs;
+    int64_t start_ns, elapsed;
+    void *buf;
+    int ret;
+
+    start_ns = qemu_get_clock_ns(rt_clock);
+    buf = qemu_blockalign(bs, copy->nb_sectors * BDRV_SECTOR_SIZE);
+    ret = stream_populate(bs, copy->sector_num, copy->nb_sectors, buf);
+    qemu_vfree(buf);
+    elapsed = qemu_get_clock_ns(rt_clock) - start_ns;
+    trace_stream_copy_done(s, copy->sector_num, copy->nb_sectors, ret,
+                           elapsed);
+
+    if (ret < 0) {
+        if (s->ret == 0) {
+            s->ret = ret;
+        }
+    } else {
+        if (elapsed < STREAM_FAST_NS &&
+            copy->nb_sectors == s->chunk_sectors &&
+            s->chunk_sectors < STREAM_MAX_BUFFER_SIZE / BDRV_SECTOR_SIZE) {
+            s->chunk_sectors *= 2;
+        } else if (elapsed > STREAM_SLOW_NS &&
+                   s->chunk_sectors > STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE) {
+            s->chunk_sectors /= 2;
+        }
+
+        /* Publish progress */
+        s->common.offset += copy->nb_sectors * BDRV_SECTOR_SIZE;
+        block_job_update_rate(&s->common);
+    }
+
+    s->in_flight--;
+    g_free(copy);
+
+    if (s->waiting) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void stream_start_copy(StreamBlockJob *s, int64_t sector_num,
+                              int nb_sectors)
+{
+    StreamCopy *copy = g_new(StreamCopy, 1);
+    Coroutine *co;
+
+    copy->s = s;
+    copy->sector_num = sector_num;
+    copy->nb_sectors = nb_sectors;
+    s->in_flight++;
+
+    co = qemu_coroutine_create(stream_copy_entry);
+    qemu_coroutine_enter(co, copy);
+}
+
+static void coroutine_fn stream_wait_for_copy(StreamBlockJob *s)
+{
+    s->waiting = true;
+    qemu_coroutine_yield();
+    s->waiting = false;
+}
+
 static void close_unused_images(BlockDriverState *top, BlockDriverState *base,
                                 const char *base_id)
 {
@@ -76,10 +165,10 @@ static void coroutine_fn stream_run(void *opaque)
     StreamBlockJob *s = opaque;
     BlockDriverState *bs = s->common.bs;
     BlockDriverState *base = s->base;
-    int64_t sector_num, end;
+    int64_t sector_num = 0, end;
+    uint64_t delay_ns = 0;
     int ret = 0;
     int n = 0;
-    void *buf;
 
     s->common.len = bdrv_getlength(bs);
     if (s->common.len < 0) {
@@ -88,7 +177,7 @@ static void coroutine_fn stream_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
+    s->chunk_sectors = STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE;
 
     /* Turn on copy-on-read for the whole block device so that guest read
      * requests help us make progress.  Only do this when copying the entire
@@ -99,56 +188,86 @@ static void coroutine_fn stream_run(void *opaque)
         bdrv_enable_copy_on_read(bs);
     }
 
-    for (sector_num = 0; sector_num < end; sector_num += n) {
-        uint64_t delay_ns = 0;
-        bool copy;
-
-wait:
-        /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that qemu_aio_flush() returns.
+    /* n is what is left of the current run of sectors that need copying */
+    while (sector_num < end) {
+        /* Note that even when no rate limit is applied we need to go back
+         * to the main loop here, so that no new request is submitted from
+         * a completion callback and qemu_aio_flush() returns.
          */
         block_job_sleep_ns(&s->common, rt_clock, delay_ns);
+        delay_ns = 0;
         if (block_job_is_cancelled(&s->common)) {
             break;
         }
 
-        ret = bdrv_co_is_allocated(bs, sector_num,
-                                   STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, &n);
-        if (ret == 1) {
-            /* Allocated in the top, no need to copy.  */
-            copy = false;
-        } else {
-            /* Copy if allocated in the intermediate images.  Limit to the
-             * known-unallocated area [sector_num, sector_num+n).  */
-            ret = bdrv_co_is_allocated_above(bs->backing_hd, base,
-                                             sector_num, n, &n);
-
-            /* Finish early if end of backing file has been reached */
-            if (ret == 0 && n == 0) {
-                n = end - sector_num;
+        /* Fill the pipeline */
+        while (s->ret == 0 && sector_num < end &&
+               s->in_flight < STREAM_MAX_IN_FLIGHT) {
+            int nb_sectors;
+
+            if (n == 0) {
+                bool copy;
+
+                ret = bdrv_co_is_allocated(bs, sector_num,
+                                           MIN(end - sector_num,
+                                               STREAM_SCAN_SIZE /
+                                               BDRV_SECTOR_SIZE), &n);
+                if (ret == 1) {
+                    /* Allocated in the top, no need to copy.  */
+                    copy = false;
+                } else {
+                    /* Copy if allocated in the intermediate images.  Limit
+                     * to the known-unallocated area [sector_num,
+                     * sector_num+n).  */
+                    ret = bdrv_co_is_allocated_above(bs->backing_hd, base,
+                                                     sector_num, n, &n);
+
+                    /* Finish early if end of backing file has been reached */
+                    if (ret == 0 && n == 0) {
+                        n = end - sector_num;
+                    }
+
+                    copy = (ret == 1);
+                }
+                trace_stream_one_iteration(s, sector_num, n, ret);
+                if (ret < 0) {
+                    s->ret = ret;
+                    break;
+                }
+                if (!copy) {
+                    s->common.offset += (int64_t)n * BDRV_SECTOR_SIZE;
+                    block_job_update_rate(&s->common);
+                    sector_num += n;
+                    n = 0;
+                    break;
+                }
             }
 
-            copy = (ret == 1);
-        }
-        trace_stream_one_iteration(s, sector_num, n, ret);
-        if (ret >= 0 && copy) {
+            nb_sectors = MIN(n, s->chunk_sectors);
             if (s->common.speed) {
-                delay_ns = ratelimit_calculate_delay(&s->limit, n);
+                delay_ns = ratelimit_calculate_delay(&s->limit, nb_sectors);
                 if (delay_ns > 0) {
-                    goto wait;
+                    break;
                 }
             }
-            ret = stream_populate(bs, sector_num, n, buf);
+            stream_start_copy(s, sector_num, nb_sectors);
+            sector_num += nb_sectors;
+            n -= nb_sectors;
         }
-        if (ret < 0) {
+        if (s->ret < 0) {
             break;
         }
-        ret = 0;
 
-        /* Publish progress */
-        s->common.offset += n * BDRV_SECTOR_SIZE;
+        if (delay_ns == 0 && s->in_flight >= STREAM_MAX_IN_FLIGHT) {
+            stream_wait_for_copy(s);
+        }
     }
 
+    while (s->in_flight > 0) {
+        stream_wait_for_copy(s);
+    }
+    ret = s->ret;
+
     if (!base) {
         bdrv_disable_copy_on_read(bs);
     }
@@ -165,7 +284,6 @@ wait:
         close_unused_images(bs, base, base_id);
     }
 
-    qemu_vfree(buf);
     block_job_complete(&s->common, ret);
 }
 
@@ -40,7 +40,6 @@
 #define BLOCK_IO_LIMIT_WRITE    1
 #define BLOCK_IO_LIMIT_TOTAL    2
 
-#define BLOCK_IO_SLICE_TIME     100000000
 #define NANOSECONDS_PER_SECOND  1000000000.0
 
 #define BLOCK_OPT_SIZE              "size"
@@ -60,12 +59,11 @@ typedef struct BdrvTrackedRequest BdrvTrackedRequest;
 typedef struct BlockIOLimit {
     int64_t bps[3];
     int64_t iops[3];
+    int64_t bps_max[3];         /* burst size in bytes, 0 for the default */
+    int64_t iops_max[3];        /* burst size in requests, 0 for the default */
 } BlockIOLimit;
 
-typedef struct BlockIOBaseValue {
-    uint64_t bytes[2];
-    uint64_t ios[2];
-} BlockIOBaseValue;
+typedef struct ThrottleGroup ThrottleGroup;
 
 typedef struct BlockJob BlockJob;
 
@@ -83,6 +81,12 @@ typedef struct BlockJobType {
 
     /** Optional callback for job types that support setting a speed limit */
     void (*set_speed)(BlockJob *job, int64_t speed, Error **errp);
+
+    /**
+     * Optional callback for job types that keep running until the user
+     * tells them to finish, such as mirroring.
+     */
+    void (*complete)(BlockJob *job, Error **errp);
 } BlockJobType;
 
 /**
@@ -118,6 +122,12 @@ struct BlockJob {
      */
     bool busy;
 
+    /**
+     * Set by #block_job_ready once the job can be completed with
+     * #block_job_request_complete.
+     */
+    bool ready;
+
     /** Offset that is published by the query-block-jobs QMP API */
     int64_t offset;
 
@@ -127,6 +137,13 @@ struct BlockJob {
     /** Speed that was set with @block_job_set_speed.  */
     int64_t speed;
 
+    /** Measured progress in bytes per second, see #block_job_update_rate */
+    int64_t rate;
+
+    /** Time and offset at the start of the current rate sample */
+    int64_t rate_sample_ns;
+    int64_t rate_sample_offset;
+
     /** The completion function that will be called when the job completes.  */
     BlockDriverCompletionFunc *cb;
 
@@ -159,6 +176,13 @@ struct BlockDriver {
         BlockDriverCompletionFunc *cb, void *opaque);
     BlockDriverAIOCB *(*bdrv_aio_flush)(BlockDriverState *bs,
         BlockDriverCompletionFunc *cb, void *opaque);
+    /*
+     * Write data that is on stable storage when the request completes.
+     * May be NULL, in which case the write is followed by a flush.
+     */
+    BlockDriverAIOCB *(*bdrv_aio_writev_fua)(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque);
     BlockDriverAIOCB *(*bdrv_aio_discard)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque);
@@ -180,6 +204,14 @@ struct BlockDriver {
     int coroutine_fn (*bdrv_co_is_allocated)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum);
 
+    /*
+     * Requests submitted between plug and unplug may be queued and passed
+     * to the host together.  Calls nest, the queue is submitted by the
+     * outermost unplug.
+     */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+
     /*
      * Invalidate any cached meta-data.
      */
@@ -215,6 +247,9 @@ struct BlockDriver {
     int (*bdrv_snapshot_load_tmp)(BlockDriverState *bs,
                                   const char *snapshot_name);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
+    /* fills in the driver's cache counters of query-blockstats */
+    void (*bdrv_get_cache_stats)(const BlockDriverState *bs,
+                                 BlockDeviceStats *stats);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, const uint8_t *buf,
                              int64_t pos, int size);
@@ -296,12 +331,10 @@ struct BlockDriverState {
     /* number of in-flight copy-on-read requests */
     unsigned int copy_on_read_in_flight;
 
-    /* the time for latest disk I/O */
-    int64_t slice_time;
-    int64_t slice_start;
-    int64_t slice_end;
+    /* I/O throttling */
     BlockIOLimit io_limits;
-    BlockIOBaseValue  io_base;
+    ThrottleGroup *throttle_group;
+    QLIST_ENTRY(BlockDriverState) throttle_list;
     CoQueue      throttled_reqs;
     QEMUTimer    *block_timer;
     bool         io_limits_enabled;
@@ -310,7 +343,12 @@ struct BlockDriverState {
     uint64_t nr_bytes[BDRV_MAX_IOTYPE];
     uint64_t nr_ops[BDRV_MAX_IOTYPE];
     uint64_t total_time_ns[BDRV_MAX_IOTYPE];
+    uint64_t nr_merged[BDRV_MAX_IOTYPE];  /* requests merged into others */
     uint64_t wr_highest_sector;
+    /* bucket i counts requests that took [2^i, 2^(i+1)) microseconds */
+    uint64_t latency_hist[BDRV_MAX_IOTYPE][BDRV_LATENCY_BUCKETS];
+    unsigned int in_flight;         /* tracked read/write requests */
+    unsigned int max_in_flight;
 
     /* Whether the disk can expand beyond total_sectors */
     int growable;
@@ -321,14 +359,34 @@ struct BlockDriverState {
     /* do we need to tell the quest if we have a volatile write cache? */
     int enable_write_cache;
 
+    /* flushes are sent one at a time and skipped if nothing was written */
+    unsigned int write_gen;         /* bumped by every completed write */
+    unsigned int flushed_gen;       /* write_gen of the last good flush */
+
+    /* where reads of each range go in the backing chain, see block.c */
+    struct BdrvAllocMap *alloc_map;
+    uint64_t alloc_gen;
+    bool active_flush_req;
+    CoQueue flush_queue;
+
+    /* size in bytes of the format's caches, 0 for the default */
+    uint64_t l2_cache_size;
+    uint64_t refcount_cache_size;
+    uint64_t compressed_cache_size;
+
+    /* defer refcount updates and repair them after a crash, if supported */
+    bool lazy_refcounts;
+
+    /* requests the host AIO context can hold, 0 for the default */
+    int aio_queue_depth;
+
     /* NOTE: the following infos are only hints for real hardware
        drivers. They are not used by the block driver */
     BlockErrorAction on_read_error, on_write_error;
     bool iostatus_enabled;
     BlockDeviceIoStatus iostatus;
     char device_name[32];
-    unsigned long *dirty_bitmap;
-    int64_t dirty_count;
+    QLIST_HEAD(, BdrvDirtyBitmap) dirty_bitmaps;
     int in_use; /* users other than guest access, eg. block migration */
     QTAILQ_ENTRY(BlockDriverState) list;
 
@@ -342,6 +400,8 @@ int get_tmp_filename(char *filename, int size);
 
 void bdrv_set_io_limits(BlockDriverState *bs,
                         BlockIOLimit *io_limits);
+void bdrv_set_io_limits_group(BlockDriverState *bs, const char *name);
+const char *bdrv_get_io_limits_group(BlockDriverState *bs);
 
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
@@ -409,6 +469,49 @@ void block_job_set_speed(BlockJob *job, int64_t speed, Error **errp);
  */
 void block_job_cancel(BlockJob *job);
 
+/**
+ * block_job_update_rate:
+ * @job: The job whose offset was just advanced.
+ *
+ * Recompute the throughput published by query-block-jobs.  Jobs call
+ * this whenever they publish progress.
+ */
+void block_job_update_rate(BlockJob *job);
+
+/**
+ * block_job_get_rate:
+ * @job: The job being queried.
+ *
+ * Returns the recent progress of @job, in bytes per second.
+ */
+int64_t block_job_get_rate(BlockJob *job);
+
+/**
+ * block_job_request_complete:
+ * @job: The job to be completed.
+ * @errp: Error object.
+ *
+ * Asynchronously ask a job that has reached the ready state to finish.
+ * Fails if the job type does not support it or the job is not ready yet.
+ */
+void block_job_request_complete(BlockJob *job, Error **errp);
+
+/**
+ * block_job_ready:
+ * @job: The job which is now ready to be completed.
+ *
+ * Mark @job as ready and emit the BLOCK_JOB_READY event.
+ */
+void block_job_ready(BlockJob *job);
+
+/**
+ * qobject_from_block_job:
+ * @job: The job being described.
+ *
+ * Build the data dictionary shared by the block job events.
+ */
+QObject *qobject_from_block_job(BlockJob *job);
+
 /**
  * block_job_is_cancelled:
  * @job: The job being queried.
@@ -456,4 +559,69 @@ void stream_start(BlockDriverState *bs, BlockDriverState *base,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp);
 
+/**
+ * mirror_start:
+ * @bs: Block device to operate on.
+ * @target: Block device to write to.
+ * @mode: Whether to copy the whole backing chain or only the top image.
+ * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @granularity: The granularity of the dirty bitmap, in bytes; a power
+ * of two and at least one sector.
+ * @cb: Completion function for the job.
+ * @opaque: Opaque pointer value passed to @cb.
+ * @errp: Error object.
+ *
+ * Start a mirroring operation on @bs.  Clusters that are allocated
+ * in @bs (or its backing chain, for a full copy) are written to @target,
+ * and so are guest writes for as long as the job runs.  Once the two
+ * are in sync the BLOCK_JOB_READY event is emitted.  Completing the job
+ * then replaces @bs with @target; cancelling it leaves @bs in place and
+ * @target as a consistent copy.  @target is closed when the job ends.
+ */
+void mirror_start(BlockDriverState *bs, BlockDriverState *target,
+                  MirrorSyncMode mode, int64_t speed, int granularity,
+                  BlockDriverCompletionFunc *cb,
+                  void *opaque, Error **errp);
+
+/**
+ * commit_start:
+ * @bs: Active block device.
+ * @top: Image in the backing chain of @bs to commit, below @bs.
+ * @base: Image in the backing chain of @top to commit into.
+ * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @cb: Completion function for the job.
+ * @opaque: Opaque pointer value passed to @cb.
+ * @errp: Error object.
+ *
+ * Start a commit operation on @bs.  Clusters that are allocated in any
+ * image from @top down to @base (exclusive) are written to @base, which
+ * is made writable for the duration of the job.  At the end of a
+ * successful job, the image above @top gets @base as its backing file
+ * and the images in between are closed.
+ */
+void commit_start(BlockDriverState *bs, BlockDriverState *top,
+                  BlockDriverState *base, int64_t speed,
+                  BlockDriverCompletionFunc *cb,
+                  void *opaque, Error **errp);
+
+/**
+ * commit_active_start:
+ * @bs: Active block device, committed into @base.
+ * @base: Image in the backing chain of @bs to commit into.
+ * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @granularity: The granularity of the dirty bitmap, in bytes.
+ * @cb: Completion function for the job.
+ * @opaque: Opaque pointer value passed to @cb.
+ * @errp: Error object.
+ *
+ * Like mirror_start with @base as the target, except that only clusters
+ * allocated above @base are copied.  Completing the job once it is ready
+ * makes @base the active image of the device and closes the images that
+ * were above it; cancelling it leaves the chain as it was.
+ */
+void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
+                         int64_t speed, int granularity,
+                         BlockDriverCompletionFunc *cb,
+                         void *opaque, Error **errp);
+
 #endif /* BLOCK_INT_H */
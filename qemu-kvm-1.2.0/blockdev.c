@@ -276,6 +276,22 @@ static bool do_check_io_limits(BlockIOLimit *io_limits)
     return true;
 }
 
+/* A burst size only makes sense together with the matching limit */
+static bool do_check_io_burst(BlockIOLimit *io_limits)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if ((io_limits->bps_max[i] && !io_limits->bps[i]) ||
+            (io_limits->iops_max[i] && !io_limits->iops[i]) ||
+            io_limits->bps_max[i] < 0 || io_limits->iops_max[i] < 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
 {
     const char *buf;
@@ -295,8 +311,12 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     const char *devaddr;
     DriveInfo *dinfo;
     BlockIOLimit io_limits;
+    const char *throttle_group;
     int snapshot = 0;
     bool copy_on_read;
+    uint64_t l2_cache_size, refcount_cache_size, compressed_cache_size;
+    bool lazy_refcounts;
+    int aio_queue_depth;
     int ret;
 
     translation = BIOS_ATA_TRANSLATION_AUTO;
@@ -314,6 +334,11 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     snapshot = qemu_opt_get_bool(opts, "snapshot", 0);
     ro = qemu_opt_get_bool(opts, "readonly", 0);
     copy_on_read = qemu_opt_get_bool(opts, "copy-on-read", false);
+    l2_cache_size = qemu_opt_get_size(opts, "l2-cache-size", 0);
+    refcount_cache_size = qemu_opt_get_size(opts, "refcount-cache-size", 0);
+    compressed_cache_size = qemu_opt_get_size(opts, "compressed-cache-size", 0);
+    lazy_refcounts = qemu_opt_get_bool(opts, "lazy-refcounts", false);
+    aio_queue_depth = qemu_opt_get_number(opts, "aio-queue-depth", 0);
 
     file = qemu_opt_get(opts, "file");
     serial = qemu_opt_get(opts, "serial");
@@ -400,6 +425,12 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     }
 #endif
 
+    if (qemu_opt_get(opts, "aio-queue-depth") &&
+        (aio_queue_depth < 1 || aio_queue_depth > 65536)) {
+        error_report("aio-queue-depth must be between 1 and 65536");
+        return NULL;
+    }
+
     if ((buf = qemu_opt_get(opts, "format")) != NULL) {
         if (is_help_option(buf)) {
             error_printf("Supported formats:");
@@ -427,6 +458,19 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
                            qemu_opt_get_number(opts, "iops_rd", 0);
     io_limits.iops[BLOCK_IO_LIMIT_WRITE] =
                            qemu_opt_get_number(opts, "iops_wr", 0);
+    io_limits.bps_max[BLOCK_IO_LIMIT_TOTAL]  =
+                           qemu_opt_get_number(opts, "bps_max", 0);
+    io_limits.bps_max[BLOCK_IO_LIMIT_READ]   =
+                           qemu_opt_get_number(opts, "bps_rd_max", 0);
+    io_limits.bps_max[BLOCK_IO_LIMIT_WRITE]  =
+                           qemu_opt_get_number(opts, "bps_wr_max", 0);
+    io_limits.iops_max[BLOCK_IO_LIMIT_TOTAL] =
+                           qemu_opt_get_number(opts, "iops_max", 0);
+    io_limits.iops_max[BLOCK_IO_LIMIT_READ]  =
+                           qemu_opt_get_number(opts, "iops_rd_max", 0);
+    io_limits.iops_max[BLOCK_IO_LIMIT_WRITE] =
+                           qemu_opt_get_number(opts, "iops_wr_max", 0);
+    throttle_group = qemu_opt_get(opts, "throttle_group");
 
     if (!do_check_io_limits(&io_limits)) {
         error_report("bps(iops) and bps_rd/bps_wr(iops_rd/iops_wr) "
@@ -434,6 +478,12 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
         return NULL;
     }
 
+    if (!do_check_io_burst(&io_limits)) {
+        error_report("bps_max(iops_max) requires the matching bps(iops) "
+                     "limit");
+        return NULL;
+    }
+
     if (qemu_opt_get(opts, "boot") != NULL) {
         fprintf(stderr, "qemu-kvm: boot=on|off is deprecated and will be "
                 "ignored. Future versions will reject this parameter. Please "
@@ -550,8 +600,24 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
 
     bdrv_set_on_error(dinfo->bdrv, on_read_error, on_write_error);
 
-    /* disk I/O throttling */
-    bdrv_set_io_limits(dinfo->bdrv, &io_limits);
+    /* disk I/O throttling; without limits of its own, a drive that joins
+     * a group just uses the limits of the group */
+    if (throttle_group) {
+        bdrv_set_io_limits_group(dinfo->bdrv, throttle_group);
+    }
+    if (!throttle_group || io_limits.bps[BLOCK_IO_LIMIT_TOTAL] ||
+        io_limits.bps[BLOCK_IO_LIMIT_READ] ||
+        io_limits.bps[BLOCK_IO_LIMIT_WRITE] ||
+        io_limits.iops[BLOCK_IO_LIMIT_TOTAL] ||
+        io_limits.iops[BLOCK_IO_LIMIT_READ] ||
+        io_limits.iops[BLOCK_IO_LIMIT_WRITE]) {
+        bdrv_set_io_limits(dinfo->bdrv, &io_limits);
+    }
+
+    bdrv_set_cache_sizes(dinfo->bdrv, l2_cache_size, refcount_cache_size,
+                         compressed_cache_size);
+    bdrv_set_lazy_refcounts(dinfo->bdrv, lazy_refcounts);
+    bdrv_set_aio_queue_depth(dinfo->bdrv, aio_queue_depth);
 
     switch(type) {
     case IF_IDE:
@@ -797,6 +863,13 @@ void qmp_transaction(BlockdevActionList *dev_list, Error **errp)
 
         /* We will manually add the backing_hd field to the bs later */
         states->new_bs = bdrv_new("");
+        bdrv_set_cache_sizes(states->new_bs, states->old_bs->l2_cache_size,
+                             states->old_bs->refcount_cache_size,
+                             states->old_bs->compressed_cache_size);
+        bdrv_set_lazy_refcounts(states->new_bs,
+                                states->old_bs->lazy_refcounts);
+        bdrv_set_aio_queue_depth(states->new_bs,
+                                 states->old_bs->aio_queue_depth);
         ret = bdrv_open(states->new_bs, new_image_file,
                         flags | BDRV_O_NO_BACKING, drv);
         if (ret != 0) {
@@ -948,9 +1021,47 @@ void qmp_change_blockdev(const char *device, const char *filename,
 }
 
 /* throttling disk I/O limits */
+static void block_latency_reset(BlockDriverState *bs)
+{
+    for (; bs; bs = bs->file) {
+        bdrv_reset_latency_stats(bs);
+    }
+}
+
+static void block_latency_reset_one(void *opaque, BlockDriverState *bs)
+{
+    block_latency_reset(bs);
+}
+
+void qmp_block_latency_reset(bool has_device, const char *device,
+                             Error **errp)
+{
+    BlockDriverState *bs;
+
+    if (!has_device) {
+        bdrv_iterate(block_latency_reset_one, NULL);
+        return;
+    }
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+    block_latency_reset(bs);
+}
+
 void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
                                int64_t bps_wr, int64_t iops, int64_t iops_rd,
-                               int64_t iops_wr, Error **errp)
+                               int64_t iops_wr,
+                               bool has_bps_max, int64_t bps_max,
+                               bool has_bps_rd_max, int64_t bps_rd_max,
+                               bool has_bps_wr_max, int64_t bps_wr_max,
+                               bool has_iops_max, int64_t iops_max,
+                               bool has_iops_rd_max, int64_t iops_rd_max,
+                               bool has_iops_wr_max, int64_t iops_wr_max,
+                               bool has_group, const char *group,
+                               Error **errp)
 {
     BlockIOLimit io_limits;
     BlockDriverState *bs;
@@ -967,24 +1078,25 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
     io_limits.iops[BLOCK_IO_LIMIT_TOTAL]= iops;
     io_limits.iops[BLOCK_IO_LIMIT_READ] = iops_rd;
     io_limits.iops[BLOCK_IO_LIMIT_WRITE]= iops_wr;
-
-    if (!do_check_io_limits(&io_limits)) {
+    io_limits.bps_max[BLOCK_IO_LIMIT_TOTAL]  = has_bps_max ? bps_max : 0;
+    io_limits.bps_max[BLOCK_IO_LIMIT_READ]   = has_bps_rd_max ? bps_rd_max : 0;
+    io_limits.bps_max[BLOCK_IO_LIMIT_WRITE]  = has_bps_wr_max ? bps_wr_max : 0;
+    io_limits.iops_max[BLOCK_IO_LIMIT_TOTAL] = has_iops_max ? iops_max : 0;
+    io_limits.iops_max[BLOCK_IO_LIMIT_READ]  =
+                                        has_iops_rd_max ? iops_rd_max : 0;
+    io_limits.iops_max[BLOCK_IO_LIMIT_WRITE] =
+                                        has_iops_wr_max ? iops_wr_max : 0;
+
+    if (!do_check_io_limits(&io_limits) || !do_check_io_burst(&io_limits)) {
         error_set(errp, QERR_INVALID_PARAMETER_COMBINATION);
         return;
     }
 
-    bs->io_limits = io_limits;
-    bs->slice_time = BLOCK_IO_SLICE_TIME;
-
-    if (!bs->io_limits_enabled && bdrv_io_limits_enabled(bs)) {
-        bdrv_io_limits_enable(bs);
-    } else if (bs->io_limits_enabled && !bdrv_io_limits_enabled(bs)) {
-        bdrv_io_limits_disable(bs);
-    } else {
-        if (bs->block_timer) {
-            qemu_mod_timer(bs->block_timer, qemu_get_clock_ns(vm_clock));
-        }
+    /* An empty group name moves the drive back to a group of its own */
+    if (has_group) {
+        bdrv_set_io_limits_group(bs, group[0] ? group : NULL);
     }
+    bdrv_set_io_limits(bs, &io_limits);
 }
 
 int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
@@ -1057,26 +1169,12 @@ void qmp_block_resize(const char *device, int64_t size, Error **errp)
     }
 }
 
-static QObject *qobject_from_block_job(BlockJob *job)
-{
-    return qobject_from_jsonf("{ 'type': %s,"
-                              "'device': %s,"
-                              "'len': %" PRId64 ","
-                              "'offset': %" PRId64 ","
-                              "'speed': %" PRId64 " }",
-                              job->job_type->job_type,
-                              bdrv_get_device_name(job->bs),
-                              job->len,
-                              job->offset,
-                              job->speed);
-}
-
-static void block_stream_cb(void *opaque, int ret)
+static void block_job_cb(void *opaque, int ret)
 {
     BlockDriverState *bs = opaque;
     QObject *obj;
 
-    trace_block_stream_cb(bs, bs->job, ret);
+    trace_block_job_cb(bs, bs->job, ret);
 
     assert(bs->job);
     obj = qobject_from_block_job(bs->job);
@@ -1118,7 +1216,7 @@ void qmp_block_stream(const char *device, bool has_base,
     }
 
     stream_start(bs, base_bs, base, has_speed ? speed : 0,
-                 block_stream_cb, bs, &local_err);
+                 block_job_cb, bs, &local_err);
     if (error_is_set(&local_err)) {
         error_propagate(errp, local_err);
         return;
@@ -1132,6 +1230,188 @@ void qmp_block_stream(const char *device, bool has_base,
     trace_qmp_block_stream(bs, bs->job);
 }
 
+#define MIRROR_DEFAULT_GRANULARITY  (64 * 1024)
+#define MIRROR_MAX_GRANULARITY      (64 * 1024 * 1024)
+
+void qmp_drive_mirror(const char *device, const char *target,
+                      bool has_format, const char *format,
+                      enum MirrorSyncMode sync,
+                      bool has_mode, enum NewImageMode mode,
+                      bool has_speed, int64_t speed,
+                      bool has_granularity, int64_t granularity,
+                      Error **errp)
+{
+    BlockDriverState *bs;
+    BlockDriverState *source, *target_bs;
+    BlockDriver *drv = NULL;
+    Error *local_err = NULL;
+    int flags;
+    uint64_t size;
+    int ret;
+
+    if (!has_speed) {
+        speed = 0;
+    }
+    if (!has_mode) {
+        mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
+    }
+    if (!has_granularity) {
+        granularity = MIRROR_DEFAULT_GRANULARITY;
+    }
+    if (granularity < BDRV_SECTOR_SIZE ||
+        granularity > MIRROR_MAX_GRANULARITY ||
+        (granularity & (granularity - 1))) {
+        error_set(errp, QERR_INVALID_PARAMETER, "granularity");
+        return;
+    }
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return;
+    }
+
+    if (!has_format) {
+        format = mode == NEW_IMAGE_MODE_EXISTING ? NULL : bs->drv->format_name;
+    }
+    if (format) {
+        drv = bdrv_find_format(format);
+        if (!drv) {
+            error_set(errp, QERR_INVALID_BLOCK_FORMAT, format);
+            return;
+        }
+    }
+
+    if (bdrv_in_use(bs)) {
+        error_set(errp, QERR_DEVICE_IN_USE, device);
+        return;
+    }
+
+    flags = bs->open_flags | BDRV_O_RDWR;
+    source = bs->backing_hd;
+    if (!source && sync == MIRROR_SYNC_MODE_TOP) {
+        sync = MIRROR_SYNC_MODE_FULL;
+    }
+
+    size = bdrv_getlength(bs);
+    if (mode != NEW_IMAGE_MODE_EXISTING) {
+        assert(format && drv);
+        if (sync == MIRROR_SYNC_MODE_FULL) {
+            /* create new image w/o backing file */
+            ret = bdrv_img_create(target, format, NULL, NULL, NULL,
+                                  size, flags);
+        } else {
+            /* create new image with backing file */
+            ret = bdrv_img_create(target, format,
+                                  source->filename,
+                                  source->drv->format_name,
+                                  NULL, size, flags);
+        }
+        if (ret) {
+            error_set(errp, QERR_OPEN_FILE_FAILED, target);
+            return;
+        }
+    }
+
+    target_bs = bdrv_new("");
+    bdrv_set_cache_sizes(target_bs, bs->l2_cache_size,
+                         bs->refcount_cache_size,
+                         bs->compressed_cache_size);
+    bdrv_set_lazy_refcounts(target_bs, bs->lazy_refcounts);
+    bdrv_set_aio_queue_depth(target_bs, bs->aio_queue_depth);
+    ret = bdrv_open(target_bs, target, flags, drv);
+    if (ret < 0) {
+        bdrv_delete(target_bs);
+        error_set(errp, QERR_OPEN_FILE_FAILED, target);
+        return;
+    }
+
+    mirror_start(bs, target_bs, sync, speed, granularity,
+                 block_job_cb, bs, &local_err);
+    if (error_is_set(&local_err)) {
+        bdrv_delete(target_bs);
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    /* Grab a reference so hotplug does not delete the BlockDriverState from
+     * underneath us.
+     */
+    drive_get_ref(drive_get_by_blockdev(bs));
+
+    trace_qmp_drive_mirror(bs, target_bs, bs->job);
+}
+
+void qmp_block_commit(const char *device,
+                      bool has_base, const char *base,
+                      bool has_top, const char *top,
+                      bool has_speed, int64_t speed,
+                      Error **errp)
+{
+    BlockDriverState *bs;
+    BlockDriverState *base_bs, *top_bs;
+    Error *local_err = NULL;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    /* Default to committing the active image */
+    top_bs = bs;
+    if (has_top && strcmp(top, bs->filename) != 0) {
+        top_bs = bdrv_find_backing_image(bs, top);
+        if (top_bs == NULL) {
+            error_set(errp, QERR_TOP_NOT_FOUND, top);
+            return;
+        }
+    }
+
+    /* Default to the bottom of the chain */
+    if (has_base) {
+        base_bs = bdrv_find_backing_image(top_bs, base);
+        if (base_bs == NULL) {
+            error_set(errp, QERR_BASE_NOT_FOUND, base);
+            return;
+        }
+    } else {
+        base_bs = top_bs->backing_hd;
+        while (base_bs && base_bs->backing_hd) {
+            base_bs = base_bs->backing_hd;
+        }
+        if (base_bs == NULL) {
+            error_set(errp, QERR_BASE_NOT_FOUND, "(none)");
+            return;
+        }
+    }
+
+    if (top_bs == bs) {
+        commit_active_start(bs, base_bs, has_speed ? speed : 0,
+                            MIRROR_DEFAULT_GRANULARITY,
+                            block_job_cb, bs, &local_err);
+    } else {
+        commit_start(bs, top_bs, base_bs, has_speed ? speed : 0,
+                     block_job_cb, bs, &local_err);
+    }
+    if (error_is_set(&local_err)) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    /* Grab a reference so hotplug does not delete the BlockDriverState from
+     * underneath us.
+     */
+    drive_get_ref(drive_get_by_blockdev(bs));
+
+    trace_qmp_block_commit(bs, bs->job);
+}
+
 static BlockJob *find_block_job(const char *device)
 {
     BlockDriverState *bs;
@@ -1168,6 +1448,19 @@ void qmp_block_job_cancel(const char *device, Error **errp)
     block_job_cancel(job);
 }
 
+void qmp_block_job_complete(const char *device, Error **errp)
+{
+    BlockJob *job = find_block_job(device);
+
+    if (!job) {
+        error_set(errp, QERR_DEVICE_NOT_ACTIVE, device);
+        return;
+    }
+
+    trace_qmp_block_job_complete(job);
+    block_job_request_complete(job, errp);
+}
+
 static void do_qmp_query_block_jobs_one(void *opaque, BlockDriverState *bs)
 {
     BlockJobInfoList **prev = opaque;
@@ -1182,6 +1475,8 @@ static void do_qmp_query_block_jobs_one(void *opaque, BlockDriverState *bs)
             .len    = job->len,
             .offset = job->offset,
             .speed  = job->speed,
+            .ready  = job->ready,
+            .rate   = block_job_get_rate(job),
         };
 
         elem = g_new0(BlockJobInfoList, 1);
@@ -17,6 +17,9 @@
 #include "hw/hw.h"
 #include "qemu-timer.h"
 #include "qemu-char.h"
+#include "qemu-thread.h"
+#include "qemu-rcu.h"
+#include "main-loop.h"
 #include "buffered_file.h"
 
 //#define DEBUG_BUFFERED_FILE
@@ -25,17 +28,18 @@ typedef struct QEMUFileBuffered
 {
     BufferedPutFunc *put_buffer;
     BufferedPutReadyFunc *put_ready;
-    BufferedWaitForUnfreezeFunc *wait_for_unfreeze;
+    BufferedWaitFunc *wait;
     BufferedCloseFunc *close;
     void *opaque;
     QEMUFile *file;
-    int freeze_output;
-    size_t bytes_xfer;
+    /* file position at the start of the current period */
+    int64_t xfer_start;
     size_t xfer_limit;
     uint8_t *buffer;
     size_t buffer_size;
     size_t buffer_capacity;
-    QEMUTimer *timer;
+    QemuThread thread;
+    bool closed;
 } QEMUFileBuffered;
 
 #ifdef DEBUG_BUFFERED_FILE
@@ -46,6 +50,15 @@ typedef struct QEMUFileBuffered
     do { } while (0)
 #endif
 
+/* length of a rate limiting period, xfer_limit is per period */
+#define BUFFER_DELAY 100 /* ms */
+
+/* what the client sent this period, qemu_update_position() included */
+static size_t buffered_bytes_xfer(QEMUFileBuffered *s)
+{
+    return qemu_ftell(s->file) - s->xfer_start;
+}
+
 static void buffered_append(QEMUFileBuffered *s,
                             const uint8_t *buf, size_t size)
 {
@@ -70,6 +83,7 @@ static void buffered_append(QEMUFileBuffered *s,
     s->buffer_size += size;
 }
 
+/* Writes are blocking, this only runs in the buffered file thread */
 static void buffered_flush(QEMUFileBuffered *s)
 {
     size_t offset = 0;
@@ -88,15 +102,9 @@ static void buffered_flush(QEMUFileBuffered *s)
 
         ret = s->put_buffer(s->opaque, s->buffer + offset,
                             s->buffer_size - offset);
-        if (ret == -EAGAIN) {
-            DPRINTF("backend not ready, freezing\n");
-            s->freeze_output = 1;
-            break;
-        }
-
         if (ret <= 0) {
             DPRINTF("error flushing data, %zd\n", ret);
-            qemu_file_set_error(s->file, ret);
+            qemu_file_set_error(s->file, ret ? ret : -EIO);
             break;
         } else {
             DPRINTF("flushed %zd byte(s)\n", ret);
@@ -112,8 +120,7 @@ static void buffered_flush(QEMUFileBuffered *s)
 static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, int size)
 {
     QEMUFileBuffered *s = opaque;
-    int offset = 0, error;
-    ssize_t ret;
+    int error;
 
     DPRINTF("putting %d bytes at %" PRId64 "\n", size, pos);
 
@@ -123,53 +130,19 @@ static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, in
         return error;
     }
 
-    DPRINTF("unfreezing output\n");
-    s->freeze_output = 0;
-
-    buffered_flush(s);
-
-    while (!s->freeze_output && offset < size) {
-        if (s->bytes_xfer > s->xfer_limit) {
-            DPRINTF("transfer limit exceeded when putting\n");
-            break;
-        }
-
-        ret = s->put_buffer(s->opaque, buf + offset, size - offset);
-        if (ret == -EAGAIN) {
-            DPRINTF("backend not ready, freezing\n");
-            s->freeze_output = 1;
-            break;
-        }
-
-        if (ret <= 0) {
-            DPRINTF("error putting\n");
-            qemu_file_set_error(s->file, ret);
-            offset = -EINVAL;
-            break;
-        }
-
-        DPRINTF("put %zd byte(s)\n", ret);
-        offset += ret;
-        s->bytes_xfer += ret;
+    if (size <= 0) {
+        return size;
     }
 
-    if (offset >= 0) {
-        DPRINTF("buffering %d bytes\n", size - offset);
-        buffered_append(s, buf + offset, size - offset);
-        offset = size;
-    }
-
-    if (pos == 0 && size == 0) {
-        DPRINTF("file is ready\n");
-        if (s->bytes_xfer <= s->xfer_limit) {
-            DPRINTF("notifying client\n");
-            s->put_ready(s->opaque);
-        }
-    }
+    /* the thread sends it once the client returns */
+    DPRINTF("buffering %d bytes\n", size);
+    buffered_append(s, buf, size);
 
-    return offset;
+    return size;
 }
 
+/* Only called from the put_ready and wait callbacks, that is from the
+ * buffered file thread; the thread exits once they return. */
 static int buffered_close(void *opaque)
 {
     QEMUFileBuffered *s = opaque;
@@ -179,16 +152,10 @@ static int buffered_close(void *opaque)
 
     while (!qemu_file_get_error(s->file) && s->buffer_size) {
         buffered_flush(s);
-        if (s->freeze_output)
-            s->wait_for_unfreeze(s->opaque);
     }
 
     ret = s->close(s->opaque);
-
-    qemu_del_timer(s->timer);
-    qemu_free_timer(s->timer);
-    g_free(s->buffer);
-    g_free(s);
+    s->closed = true;
 
     return ret;
 }
@@ -208,10 +175,8 @@ static int buffered_rate_limit(void *opaque)
     if (ret) {
         return ret;
     }
-    if (s->freeze_output)
-        return 1;
 
-    if (s->bytes_xfer > s->xfer_limit)
+    if (buffered_bytes_xfer(s) > s->xfer_limit)
         return 1;
 
     return 0;
@@ -227,7 +192,7 @@ static int64_t buffered_set_rate_limit(void *opaque, int64_t new_rate)
         new_rate = SIZE_MAX;
     }
 
-    s->xfer_limit = new_rate / 10;
+    s->xfer_limit = new_rate / (1000 / BUFFER_DELAY);
     
 out:
     return s->xfer_limit;
@@ -240,33 +205,52 @@ static int64_t buffered_get_rate_limit(void *opaque)
     return s->xfer_limit;
 }
 
-static void buffered_rate_tick(void *opaque)
+/*
+ * The client runs in this thread, without the iothread lock: put_ready
+ * is called as long as the transfer limit of the current period is not
+ * reached, and wait when it is.  Whatever put_ready buffered is written
+ * out here, outside of any lock.
+ */
+static void *buffered_file_thread(void *opaque)
 {
     QEMUFileBuffered *s = opaque;
+    int64_t initial_time = qemu_get_clock_ms(rt_clock);
 
-    if (qemu_file_get_error(s->file)) {
-        buffered_close(s);
-        return;
-    }
+    qemu_lock_stats_set_site("migration");
+    rcu_register_thread();
+    while (!s->closed) {
+        int64_t current_time = qemu_get_clock_ms(rt_clock);
 
-    qemu_mod_timer(s->timer, qemu_get_clock_ms(rt_clock) + 100);
+        if (current_time >= initial_time + BUFFER_DELAY) {
+            s->xfer_start = qemu_ftell(s->file);
+            initial_time = current_time;
+        }
 
-    if (s->freeze_output)
-        return;
+        buffered_flush(s);
 
-    s->bytes_xfer = 0;
+        /* on errors, let the client notice them and close the file */
+        if (buffered_bytes_xfer(s) <= s->xfer_limit ||
+            qemu_file_get_error(s->file)) {
+            DPRINTF("notifying client\n");
+            s->put_ready(s->opaque);
+        } else {
+            DPRINTF("transfer limit reached, waiting\n");
+            s->wait(s->opaque, initial_time + BUFFER_DELAY - current_time);
+        }
+    }
 
-    buffered_flush(s);
+    g_free(s->buffer);
+    g_free(s);
 
-    /* Add some checks around this */
-    s->put_ready(s->opaque);
+    rcu_unregister_thread();
+    return NULL;
 }
 
 QEMUFile *qemu_fopen_ops_buffered(void *opaque,
                                   size_t bytes_per_sec,
                                   BufferedPutFunc *put_buffer,
                                   BufferedPutReadyFunc *put_ready,
-                                  BufferedWaitForUnfreezeFunc *wait_for_unfreeze,
+                                  BufferedWaitFunc *wait,
                                   BufferedCloseFunc *close)
 {
     QEMUFileBuffered *s;
@@ -274,10 +258,10 @@ QEMUFile *qemu_fopen_ops_buffered(void *opaque,
     s = g_malloc0(sizeof(*s));
 
     s->opaque = opaque;
-    s->xfer_limit = bytes_per_sec / 10;
+    s->xfer_limit = bytes_per_sec / (1000 / BUFFER_DELAY);
     s->put_buffer = put_buffer;
     s->put_ready = put_ready;
-    s->wait_for_unfreeze = wait_for_unfreeze;
+    s->wait = wait;
     s->close = close;
 
     s->file = qemu_fopen_ops(s, buffered_put_buffer, NULL,
@@ -285,9 +269,8 @@ QEMUFile *qemu_fopen_ops_buffered(void *opaque,
                              buffered_set_rate_limit,
 			     buffered_get_rate_limit);
 
-    s->timer = qemu_new_timer_ms(rt_clock, buffered_rate_tick, s);
-
-    qemu_mod_timer(s->timer, qemu_get_clock_ms(rt_clock) + 100);
+    qemu_thread_create(&s->thread, buffered_file_thread, s,
+                       QEMU_THREAD_DETACHED);
 
     return s->file;
 }
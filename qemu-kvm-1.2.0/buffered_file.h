@@ -18,13 +18,17 @@
 
 typedef ssize_t (BufferedPutFunc)(void *opaque, const void *data, size_t size);
 typedef void (BufferedPutReadyFunc)(void *opaque);
-typedef void (BufferedWaitForUnfreezeFunc)(void *opaque);
+/* the transfer limit is reached, wait for at most @timeout_ms */
+typedef void (BufferedWaitFunc)(void *opaque, int64_t timeout_ms);
 typedef int (BufferedCloseFunc)(void *opaque);
 
+/* put_buffer, put_ready and wait are called from a thread of the buffered
+ * file, without the iothread lock.  put_buffer must block until it wrote
+ * something.  The file must be closed from put_ready or wait. */
 QEMUFile *qemu_fopen_ops_buffered(void *opaque, size_t xfer_limit,
                                   BufferedPutFunc *put_buffer,
                                   BufferedPutReadyFunc *put_ready,
-                                  BufferedWaitForUnfreezeFunc *wait_for_unfreeze,
+                                  BufferedWaitFunc *wait,
                                   BufferedCloseFunc *close);
 
 #endif
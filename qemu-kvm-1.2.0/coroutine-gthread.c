@@ -26,6 +26,7 @@ typedef struct {
     Coroutine base;
     GThread *thread;
     bool runnable;
+    bool exiting;
     bool free_on_thread_exit;
     CoroutineAction action;
 } CoroutineGThread;
@@ -146,9 +147,16 @@ static gpointer coroutine_thread(gpointer opaque)
     CoroutineGThread *co = opaque;
 
     set_coroutine_key(co, false);
-    coroutine_wait_runnable(co);
-    co->base.entry(co->base.entry_arg);
-    qemu_coroutine_switch(&co->base, co->base.caller, COROUTINE_TERMINATE);
+
+    /* Terminated coroutines are kept in a pool and entered again */
+    for (;;) {
+        coroutine_wait_runnable(co);
+        if (co->exiting) {
+            break;
+        }
+        co->base.entry(co->base.entry_arg);
+        qemu_coroutine_switch(&co->base, co->base.caller, COROUTINE_TERMINATE);
+    }
     return NULL;
 }
 
@@ -169,6 +177,12 @@ void qemu_coroutine_delete(Coroutine *co_)
 {
     CoroutineGThread *co = DO_UPCAST(CoroutineGThread, base, co_);
 
+    g_static_mutex_lock(&coroutine_lock);
+    co->exiting = true;
+    co->runnable = true;
+    g_cond_broadcast(coroutine_cond);
+    g_static_mutex_unlock(&coroutine_lock);
+
     g_thread_join(co->thread);
     g_free(co);
 }
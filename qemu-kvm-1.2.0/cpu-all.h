@@ -21,6 +21,8 @@
 
 #include "qemu-common.h"
 #include "qemu-tls.h"
+#include "qemu-thread.h"
+#include "qemu-rcu.h"
 #include "cpu-common.h"
 
 /* some important defines:
@@ -361,6 +363,8 @@ int walk_memory_regions(void *, walk_memory_regions_fn);
 int page_get_flags(target_ulong address);
 void page_set_flags(target_ulong start, target_ulong end, int flags);
 int page_check_range(target_ulong start, target_ulong len, int flags);
+target_ulong page_find_free_range(target_ulong end, target_ulong size,
+                                  target_ulong align);
 #endif
 
 CPUArchState *cpu_copy(CPUArchState *env);
@@ -476,6 +480,7 @@ void cpu_watchpoint_remove_all(CPUArchState *env, int mask);
 void cpu_single_step(CPUArchState *env, int enabled);
 int cpu_is_stopped(CPUArchState *env);
 void run_on_cpu(CPUArchState *env, void (*func)(void *data), void *data);
+void async_run_on_cpu(CPUArchState *env, void (*func)(void *data), void *data);
 
 #if !defined(CONFIG_USER_ONLY)
 
@@ -493,25 +498,53 @@ extern ram_addr_t ram_size;
 #define RAM_PREALLOC_MASK   (1 << 0)
 
 typedef struct RAMBlock {
+    RCUHead rcu;
     struct MemoryRegion *mr;
     uint8_t *host;
     ram_addr_t offset;
     ram_addr_t length;
     uint32_t flags;
     char idstr[256];
+    /* pages still to send, owned by the migration thread */
+    unsigned long *migration_bitmap;
+    /* dirty frequency of each chunk of pages, see arch_init.c */
+    uint8_t *migration_heat;
+    /* Reads can take either the iothread or the ramlist lock.
+     * Writes must take both locks.
+     */
     QLIST_ENTRY(RAMBlock) next;
 #if defined(__linux__) && !defined(TARGET_S390X)
     int fd;
 #endif
 } RAMBlock;
 
+/* The blocks sorted by offset, for lookups by ram_addr_t.  Replaced as a
+ * whole when blocks are added or removed, never modified in place, and
+ * freed after an RCU grace period.
+ */
+typedef struct RAMBlockIndex {
+    RCUHead rcu;
+    unsigned int nr;
+    RAMBlock *blocks[];
+} RAMBlockIndex;
+
 typedef struct RAMList {
+    QemuMutex mutex;
+    /* Protected by the iothread lock.  */
     uint8_t *phys_dirty;
-    QLIST_HEAD(, RAMBlock) blocks;
     uint64_t dirty_pages;
+    /* Written with both locks held, read under RCU.  */
+    RAMBlockIndex *block_index;
+    /* Protected by the ramlist lock.  */
+    QLIST_HEAD(, RAMBlock) blocks;
+    /* bumped every time blocks are added, removed or reordered */
+    uint32_t version;
 } RAMList;
 extern RAMList ram_list;
 
+void qemu_mutex_lock_ramlist(void);
+void qemu_mutex_unlock_ramlist(void);
+
 extern const char *mem_path;
 extern int mem_prealloc;
 
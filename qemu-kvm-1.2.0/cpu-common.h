@@ -44,11 +44,35 @@ void *qemu_ram_ptr_length(ram_addr_t addr, ram_addr_t *size);
  * RAMBlocks must not change. */
 void *qemu_safe_ram_ptr(ram_addr_t addr);
 void qemu_put_ram_ptr(void *addr);
+
+/* Pages that loadvm -l has not read yet; they are read on first access */
+extern int64_t ram_lazy_pages;
+void ram_lazy_load(ram_addr_t addr, ram_addr_t size);
+/* Pages an incoming postcopy migration has not received yet; they are
+ * requested and waited for on first access */
+extern int64_t ram_postcopy_pages;
+void ram_postcopy_fault_in(ram_addr_t addr, ram_addr_t size);
+
+static inline void ram_lazy_touch(ram_addr_t addr, ram_addr_t size)
+{
+    if (unlikely(ram_lazy_pages)) {
+        ram_lazy_load(addr, size);
+    }
+    if (unlikely(ram_postcopy_pages)) {
+        ram_postcopy_fault_in(addr, size);
+    }
+}
 /* This should not be used by devices.  */
 int qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr);
 ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr);
+int qemu_ram_get_fd(void *ptr, ram_addr_t *offset);
 void qemu_ram_set_idstr(ram_addr_t addr, const char *name, DeviceState *dev);
 
+typedef void (RAMBlockIterFunc)(const char *idstr, void *host_addr,
+                                ram_addr_t length, void *opaque);
+
+void qemu_ram_foreach_block(RAMBlockIterFunc func, void *opaque);
+
 void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                             int len, int is_write);
 static inline void cpu_physical_memory_read(target_phys_addr_t addr,
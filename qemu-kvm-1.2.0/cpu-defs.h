@@ -77,8 +77,19 @@ typedef uint64_t target_ulong __attribute__((aligned(TARGET_LONG_ALIGNMENT)));
 #define TB_JMP_PAGE_MASK (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
 
 #if !defined(CONFIG_USER_ONLY)
+/* The TCG backends mask the TLB index with an immediate; only the x86 one
+   has room for more than 8 bits.  */
+#if defined(__i386__) || defined(__x86_64__)
+#define CPU_TLB_BITS 10
+#else
 #define CPU_TLB_BITS 8
+#endif
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+/* fully associative victim TLB, looked up before walking the page tables */
+#define CPU_VTLB_SIZE 8
+/* entries filled since the last flush that are remembered, so that a
+   flush of a mostly empty TLB does not need to clear all of it */
+#define CPU_TLB_FILL_LOG_SIZE 64
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -113,7 +124,20 @@ extern int CPUTLBEntry_wrong_size[sizeof(CPUTLBEntry) == (1 << CPU_TLB_ENTRY_BIT
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
     target_phys_addr_t iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
     target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;
+    target_ulong tlb_flush_mask;                                        \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    target_phys_addr_t iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];            \
+    unsigned int vtlb_index;                                            \
+    /* mmu_idx << CPU_TLB_BITS | index; only valid if tlb_fill_log_on  \
+       and tlb_fill_log_len <= CPU_TLB_FILL_LOG_SIZE */                 \
+    uint16_t tlb_fill_log[CPU_TLB_FILL_LOG_SIZE];                       \
+    unsigned int tlb_fill_log_len;                                      \
+    bool tlb_fill_log_on;                                               \
+    /* statistics for "info jit" */                                     \
+    uint64_t tlb_fill_count;                                            \
+    uint64_t tlb_victim_hits;                                           \
+    uint64_t tlb_full_flushes;                                          \
+    uint64_t tlb_partial_flushes;
 
 #else
 
@@ -138,6 +162,9 @@ struct kvm_run;
 struct KVMState;
 struct qemu_work_item;
 
+/* Bucket n counts waits below 4^n us, the last one all longer waits */
+#define CPU_LOCK_WAIT_BUCKETS 8
+
 typedef struct CPUBreakpoint {
     target_ulong pc;
     int flags; /* BP_* */
@@ -201,6 +228,9 @@ typedef struct CPUWatchpoint {
     int nr_cores;  /* number of cores within this CPU package */        \
     int nr_threads;/* number of threads within this CPU */              \
     int running; /* Nonzero if cpu is currently running(usermode).  */  \
+    int has_waiter; /* counted by a pending exclusive op (usermode). */ \
+    int tlb_flush_pending; /* TLB flushes requested by other threads */ \
+    int tlb_flush_done; /* value of tlb_flush_pending at the last one */\
     int thread_id;                                                      \
     /* user data */                                                     \
     void *opaque;                                                       \
@@ -214,6 +244,18 @@ typedef struct CPUWatchpoint {
     struct KVMState *kvm_state;                                         \
     struct kvm_run *kvm_run;                                            \
     int kvm_fd;                                                         \
-    int kvm_vcpu_dirty;
+    int kvm_vcpu_dirty;                                                 \
+    unsigned int kvm_regs_valid; /* fetched register groups */          \
+                                                                        \
+    /* exits handled without/with the global mutex, and how long the   \
+       vCPU waited for it */                                            \
+    uint64_t lockless_exits;                                            \
+    uint64_t locked_exits;                                              \
+    uint64_t lock_wait_hist[CPU_LOCK_WAIT_BUCKETS];                     \
+                                                                        \
+    /* adaptive halt polling, see qemu_kvm_wait_io_event() */           \
+    int64_t halt_poll_ns;                                               \
+    uint64_t halt_poll_successes;                                       \
+    uint64_t halt_poll_misses;
 
 #endif
@@ -85,8 +85,8 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
                                       target_ulong cs_base,
                                       uint64_t flags)
 {
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
+    TranslationBlock *tb;
+    TBPhysHash *hash;
     tb_page_addr_t phys_pc, phys_page1;
     target_ulong virt_page2;
 
@@ -95,12 +95,11 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
     /* find translated block using physical mappings */
     phys_pc = get_page_addr_code(env, pc);
     phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb)
-            goto not_found;
+    /* the lookup does not modify the chain, so it can run concurrently
+       with other lookups */
+    hash = tb_phys_hash;
+    tb = hash->buckets[tb_phys_hash_func(hash, phys_pc, pc, flags, cs_base)];
+    for (; tb != NULL; tb = tb->phys_hash_next) {
         if (tb->pc == pc &&
             tb->page_addr[0] == phys_page1 &&
             tb->cs_base == cs_base &&
@@ -118,19 +117,18 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
                 goto found;
             }
         }
-        ptb1 = &tb->phys_hash_next;
     }
- not_found:
+#if defined(CONFIG_USER_ONLY)
+    /* code translated by a previous run of the same program */
+    tb = tb_cache_lookup(pc, cs_base, flags);
+    if (tb) {
+        goto found;
+    }
+#endif
    /* if no translated code available, then translate it now */
     tb = tb_gen_code(env, pc, cs_base, flags, 0);
 
  found:
-    /* Move the last found TB to the head of the list */
-    if (likely(*ptb1)) {
-        *ptb1 = tb->phys_hash_next;
-        tb->phys_hash_next = tb_phys_hash[h];
-        tb_phys_hash[h] = tb;
-    }
     /* we add the TB in the virtual pc hash table */
     env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
     return tb;
@@ -154,6 +152,42 @@ static inline TranslationBlock *tb_find_fast(CPUArchState *env)
     return tb;
 }
 
+/* Called from generated code at the end of a TB whose successor is only
+   known at run time (indirect jumps, returns).  Returns the code of the
+   next TB if it is in the virtual pc cache, so that the TB can jump to it
+   without going back through cpu_exec(), or tcg_ctx.code_gen_epilogue
+   otherwise.  Translation, interrupts and exit requests are left to the
+   main loop.  */
+void *tb_lookup_tc_ptr(CPUArchState *env)
+{
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+#if !defined(CONFIG_USER_ONLY)
+    /* TBs are not chained with MTTCG, do not chain them this way either */
+    if (mttcg_enabled) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+#endif
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags || tb->invalid)) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+    tb_region_touch(tb);
+
+    /* Same ordering as in cpu_exec(): cpu_unlink_tb() must see the TB
+       we are about to enter, or we must see the request.  */
+    env->current_tb = tb;
+    barrier();
+    if (unlikely(env->interrupt_request || env->exit_request)) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+    return tb->tc_ptr;
+}
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 void cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler)
@@ -264,8 +298,20 @@ int cpu_exec(CPUArchState *env)
 
             next_tb = 0; /* force lookup of first TB */
             for(;;) {
+#if !defined(CONFIG_USER_ONLY)
+                if (unlikely(env->tlb_flush_pending != env->tlb_flush_done)) {
+                    qemu_tcg_tlb_flush_service(env);
+                    next_tb = 0;
+                }
+#endif
                 interrupt_request = env->interrupt_request;
                 if (unlikely(interrupt_request)) {
+#if !defined(CONFIG_USER_ONLY)
+                    /* interrupt controllers are devices */
+                    if (mttcg_enabled) {
+                        qemu_tcg_io_lock();
+                    }
+#endif
                     if (unlikely(env->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -540,6 +586,11 @@ int cpu_exec(CPUArchState *env)
                            the program flow was changed */
                         next_tb = 0;
                     }
+#if !defined(CONFIG_USER_ONLY)
+                    if (mttcg_enabled) {
+                        qemu_tcg_io_unlock();
+                    }
+#endif
                 }
                 if (unlikely(env->exit_request)) {
                     env->exit_request = 0;
@@ -566,7 +617,9 @@ int cpu_exec(CPUArchState *env)
                 }
 #endif /* DEBUG_DISAS || CONFIG_DEBUG_EXEC */
                 spin_lock(&tb_lock);
+                tcg_tb_lock();
                 tb = tb_find_fast(env);
+                tb_region_touch(tb);
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
                 if (tb_invalidated_flag) {
@@ -583,10 +636,17 @@ int cpu_exec(CPUArchState *env)
 #endif
                 /* see if we can patch the calling TB. When the TB
                    spans two pages, we cannot safely do a direct
-                   jump. */
-                if (next_tb != 0 && tb->page_addr[1] == -1) {
+                   jump.  With MTTCG other vCPUs may be executing the
+                   calling TB while its jump is patched, so TBs are not
+                   chained at all.  */
+                if (next_tb != 0 && tb->page_addr[1] == -1
+#if !defined(CONFIG_USER_ONLY)
+                    && !mttcg_enabled
+#endif
+                    ) {
                     tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
                 }
+                tcg_tb_unlock();
                 spin_unlock(&tb_lock);
 
                 /* cpu_interrupt might be called while translating the
@@ -635,6 +695,12 @@ int cpu_exec(CPUArchState *env)
             /* Reload env after longjmp - the compiler may have smashed all
              * local variables as longjmp is marked 'noreturn'. */
             env = cpu_single_env;
+#if !defined(CONFIG_USER_ONLY)
+            if (mttcg_enabled) {
+                tcg_tb_lock_reset();
+                qemu_tcg_cpu_unwind();
+            }
+#endif
         }
     } /* for(;;) */
 
@@ -33,6 +33,9 @@
 #include "qmp-commands.h"
 
 #include "qemu-thread.h"
+#include "qemu-rcu.h"
+#include "qemu-config.h"
+#include "qemu-barrier.h"
 #include "cpus.h"
 #include "qtest.h"
 #include "main-loop.h"
@@ -190,15 +193,24 @@ void cpu_disable_ticks(void)
    the IO wait loop.  */
 #define ICOUNT_WOBBLE (get_ticks_per_sec() / 10)
 
-static void icount_adjust(void)
+/* Every expiry of the vm_clock trigger also ends the instruction budget
+   of the running CPU, so back off while the shift is stable.  */
+#define ICOUNT_VM_PERIOD_MIN (get_ticks_per_sec() / 10)
+#define ICOUNT_VM_PERIOD_MAX get_ticks_per_sec()
+static int64_t icount_vm_period;
+
+/* Returns true if the shift changed.  */
+static bool icount_adjust(void)
 {
     int64_t cur_time;
     int64_t cur_icount;
     int64_t delta;
     static int64_t last_delta;
+    int old_shift = icount_time_shift;
+
     /* If the VM is not running, then do nothing.  */
     if (!runstate_is_running()) {
-        return;
+        return false;
     }
     cur_time = cpu_get_clock();
     cur_icount = qemu_get_clock_ns(vm_clock);
@@ -218,20 +230,30 @@ static void icount_adjust(void)
     }
     last_delta = delta;
     qemu_icount_bias = cur_icount - (qemu_icount << icount_time_shift);
+    if (icount_time_shift == old_shift) {
+        return false;
+    }
+    icount_vm_period = ICOUNT_VM_PERIOD_MIN;
+    return true;
 }
 
 static void icount_adjust_rt(void *opaque)
 {
     qemu_mod_timer(icount_rt_timer,
                    qemu_get_clock_ms(rt_clock) + 1000);
-    icount_adjust();
+    if (icount_adjust()) {
+        qemu_mod_timer(icount_vm_timer,
+                       qemu_get_clock_ns(vm_clock) + icount_vm_period);
+    }
 }
 
 static void icount_adjust_vm(void *opaque)
 {
+    if (!icount_adjust()) {
+        icount_vm_period = MIN(icount_vm_period * 2, ICOUNT_VM_PERIOD_MAX);
+    }
     qemu_mod_timer(icount_vm_timer,
-                   qemu_get_clock_ns(vm_clock) + get_ticks_per_sec() / 10);
-    icount_adjust();
+                   qemu_get_clock_ns(vm_clock) + icount_vm_period);
 }
 
 static int64_t qemu_icount_round(int64_t count)
@@ -378,9 +400,10 @@ void configure_icount(const char *option)
     icount_rt_timer = qemu_new_timer_ms(rt_clock, icount_adjust_rt, NULL);
     qemu_mod_timer(icount_rt_timer,
                    qemu_get_clock_ms(rt_clock) + 1000);
+    icount_vm_period = ICOUNT_VM_PERIOD_MIN;
     icount_vm_timer = qemu_new_timer_ns(vm_clock, icount_adjust_vm, NULL);
     qemu_mod_timer(icount_vm_timer,
-                   qemu_get_clock_ns(vm_clock) + get_ticks_per_sec() / 10);
+                   qemu_get_clock_ns(vm_clock) + icount_vm_period);
 }
 
 /***********************************************************/
@@ -442,6 +465,8 @@ static void do_vm_stop(RunState state)
     if (runstate_is_running()) {
         cpu_disable_ticks();
         pause_all_vcpus();
+        /* coalesced writes would be lost with the vcpu state otherwise */
+        qemu_flush_coalesced_mmio_buffer();
         runstate_set(state);
         vm_state_notify(0, state);
         bdrv_drain_all();
@@ -617,6 +642,141 @@ QemuMutex qemu_global_mutex;
 static QemuCond qemu_io_proceeded_cond;
 static bool iothread_requesting_mutex;
 
+/*
+ * Global mutex statistics.  Each thread names the site it takes the mutex
+ * from with qemu_lock_stats_set_site(); threads that don't are counted as
+ * "other".  Everything but the list of sites is only touched with the
+ * global mutex held, and nothing but a flag test is done while disabled.
+ */
+#define LOCK_STATS_BUCKETS 8
+
+typedef struct LockSite {
+    char *name;
+    uint64_t acquisitions;
+    uint64_t locks;             /* explicit lock calls, see wait_hist */
+    uint64_t wait_ns;
+    uint64_t hold_ns;
+    uint64_t max_wait_ns;
+    uint64_t max_hold_ns;
+    uint64_t wait_hist[LOCK_STATS_BUCKETS];
+    uint64_t hold_hist[LOCK_STATS_BUCKETS];
+    QTAILQ_ENTRY(LockSite) next;
+} LockSite;
+
+static bool lock_stats_enabled;
+static QemuMutex lock_stats_sites_lock;
+static QTAILQ_HEAD(, LockSite) lock_stats_sites =
+    QTAILQ_HEAD_INITIALIZER(lock_stats_sites);
+static LockSite *lock_stats_other;
+static DEFINE_TLS(LockSite *, lock_stats_site);
+
+/* The site holding the global mutex, NULL if it is not being measured */
+static LockSite *lock_stats_holder;
+static int64_t lock_stats_hold_start;
+
+void qemu_lock_stats_set_site(const char *name)
+{
+    LockSite *site;
+
+    qemu_mutex_lock(&lock_stats_sites_lock);
+    QTAILQ_FOREACH(site, &lock_stats_sites, next) {
+        if (!strcmp(site->name, name)) {
+            break;
+        }
+    }
+    if (!site) {
+        site = g_malloc0(sizeof(*site));
+        site->name = g_strdup(name);
+        QTAILQ_INSERT_TAIL(&lock_stats_sites, site, next);
+    }
+    qemu_mutex_unlock(&lock_stats_sites_lock);
+
+    tls_var(lock_stats_site) = site;
+}
+
+/* Same bucket bounds as the per-vCPU wait histograms */
+static void lock_stats_account(uint64_t *hist, uint64_t *total, uint64_t *max,
+                               int64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int i = 0;
+
+    while (i < LOCK_STATS_BUCKETS - 1 && us >= (1ULL << (2 * i))) {
+        i++;
+    }
+    hist[i]++;
+    *total += ns;
+    if (ns > *max) {
+        *max = ns;
+    }
+}
+
+static inline int64_t lock_stats_wait_start(void)
+{
+    return lock_stats_enabled ? get_clock() : 0;
+}
+
+/* Called with the global mutex just taken */
+static void lock_stats_acquired(int64_t wait_start, bool waited)
+{
+    LockSite *site;
+    int64_t now;
+
+    if (!wait_start) {
+        lock_stats_holder = NULL;
+        return;
+    }
+
+    site = tls_var(lock_stats_site);
+    if (!site) {
+        site = lock_stats_other;
+    }
+    now = get_clock();
+    site->acquisitions++;
+    if (waited) {
+        site->locks++;
+        lock_stats_account(site->wait_hist, &site->wait_ns,
+                           &site->max_wait_ns, now - wait_start);
+    }
+    lock_stats_holder = site;
+    lock_stats_hold_start = now;
+}
+
+/* Called with the global mutex about to be released */
+static void lock_stats_release(void)
+{
+    LockSite *site = lock_stats_holder;
+
+    if (site) {
+        lock_stats_account(site->hold_hist, &site->hold_ns,
+                           &site->max_hold_ns,
+                           get_clock() - lock_stats_hold_start);
+        lock_stats_holder = NULL;
+    }
+}
+
+static void qemu_global_mutex_lock(void)
+{
+    int64_t start = lock_stats_wait_start();
+
+    qemu_mutex_lock(&qemu_global_mutex);
+    lock_stats_acquired(start, true);
+}
+
+static void qemu_global_mutex_unlock(void)
+{
+    lock_stats_release();
+    qemu_mutex_unlock(&qemu_global_mutex);
+}
+
+/* Time asleep on a condition is not contention, so only the holds count */
+static void qemu_global_cond_wait(QemuCond *cond)
+{
+    lock_stats_release();
+    qemu_cond_wait(cond, &qemu_global_mutex);
+    lock_stats_acquired(lock_stats_wait_start(), false);
+}
+
 static QemuThread io_thread;
 
 static QemuThread *tcg_cpu_thread;
@@ -635,7 +795,18 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_pause_cond);
     qemu_cond_init(&qemu_work_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
-    qemu_mutex_init(&qemu_global_mutex);
+    /* Handed back and forth between vCPUs and the main loop all the time */
+    qemu_mutex_init_adaptive(&qemu_global_mutex);
+    qemu_mutex_init(&lock_stats_sites_lock);
+    qemu_lock_stats_set_site("other");
+    lock_stats_other = tls_var(lock_stats_site);
+    qemu_lock_stats_set_site("main-loop");
+    qemu_mutex_init(&tcg_exclusive_lock);
+    qemu_cond_init(&tcg_exclusive_cond);
+    qemu_cond_init(&tcg_exclusive_resume);
+    qemu_mutex_init(&tcg_atomic_mutex);
+    qemu_mutex_init(&tcg_tlb_flush_lock);
+    qemu_cond_init(&tcg_tlb_flush_cond);
 
     qemu_thread_get_self(&io_thread);
 }
@@ -659,16 +830,42 @@ void run_on_cpu(CPUArchState *env, void (*func)(void *data), void *data)
     env->queued_work_last = &wi;
     wi.next = NULL;
     wi.done = false;
+    wi.free = false;
 
     qemu_cpu_kick(env);
     while (!wi.done) {
         CPUArchState *self_env = cpu_single_env;
 
-        qemu_cond_wait(&qemu_work_cond, &qemu_global_mutex);
+        qemu_global_cond_wait(&qemu_work_cond);
         cpu_single_env = self_env;
     }
 }
 
+void async_run_on_cpu(CPUArchState *env, void (*func)(void *data), void *data)
+{
+    struct qemu_work_item *wi;
+
+    if (qemu_cpu_is_self(env)) {
+        func(data);
+        return;
+    }
+
+    wi = g_malloc0(sizeof(struct qemu_work_item));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    if (!env->queued_work_first) {
+        env->queued_work_first = wi;
+    } else {
+        env->queued_work_last->next = wi;
+    }
+    env->queued_work_last = wi;
+    wi->next = NULL;
+    wi->done = false;
+
+    qemu_cpu_kick(env);
+}
+
 static void flush_queued_work(CPUArchState *env)
 {
     struct qemu_work_item *wi;
@@ -681,11 +878,104 @@ static void flush_queued_work(CPUArchState *env)
         env->queued_work_first = wi->next;
         wi->func(wi->data);
         wi->done = true;
+        if (wi->free) {
+            g_free(wi);
+        }
     }
     env->queued_work_last = NULL;
     qemu_cond_broadcast(&qemu_work_cond);
 }
 
+/*
+ * vCPU throttling: every timeslice of guest execution, each vCPU is made
+ * to sleep for long enough that it only runs (100 - percentage)% of the
+ * time.  Used by migration to slow down guests that dirty memory faster
+ * than it can be sent.
+ */
+#define CPU_THROTTLE_PCT_MIN 1
+#define CPU_THROTTLE_PCT_MAX 99
+#define CPU_THROTTLE_TIMESLICE_NS 10000000
+
+static QEMUTimer *throttle_timer;
+static unsigned int throttle_percentage;
+
+static void cpu_throttle_thread(void *opaque)
+{
+    CPUArchState *env = opaque;
+    CPUState *cpu = ENV_GET_CPU(env);
+    double pct;
+    double throttle_ratio;
+    long sleeptime_ns;
+
+    if (!cpu_throttle_get_percentage()) {
+        cpu->throttle_thread_scheduled = false;
+        return;
+    }
+
+    pct = (double)cpu_throttle_get_percentage() / 100;
+    throttle_ratio = pct / (1 - pct);
+    sleeptime_ns = (long)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS);
+
+    qemu_mutex_unlock_iothread();
+    g_usleep(sleeptime_ns / 1000); /* convert ns to us for usleep call */
+    qemu_mutex_lock_iothread();
+    cpu->throttle_thread_scheduled = false;
+}
+
+static void cpu_throttle_timer_tick(void *opaque)
+{
+    CPUArchState *env;
+    double pct;
+
+    /* Stop the timer if needed */
+    if (!cpu_throttle_get_percentage()) {
+        return;
+    }
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        CPUState *cpu = ENV_GET_CPU(env);
+
+        if (!cpu->throttle_thread_scheduled) {
+            cpu->throttle_thread_scheduled = true;
+            async_run_on_cpu(env, cpu_throttle_thread, env);
+        }
+    }
+
+    pct = (double)cpu_throttle_get_percentage() / 100;
+    qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                   CPU_THROTTLE_TIMESLICE_NS / (1 - pct));
+}
+
+void cpu_throttle_set(int new_throttle_pct)
+{
+    if (!throttle_timer) {
+        throttle_timer = qemu_new_timer_ns(rt_clock, cpu_throttle_timer_tick,
+                                           NULL);
+    }
+
+    /* Ensure throttle percentage is within valid range */
+    new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+    new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+
+    throttle_percentage = new_throttle_pct;
+    qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                   CPU_THROTTLE_TIMESLICE_NS);
+}
+
+void cpu_throttle_stop(void)
+{
+    throttle_percentage = 0;
+}
+
+bool cpu_throttle_active(void)
+{
+    return (cpu_throttle_get_percentage() != 0);
+}
+
+int cpu_throttle_get_percentage(void)
+{
+    return throttle_percentage;
+}
+
 static void qemu_wait_io_event_common(CPUArchState *env)
 {
     CPUState *cpu = ENV_GET_CPU(env);
@@ -707,11 +997,11 @@ static void qemu_tcg_wait_io_event(void)
        /* Start accounting real time to the virtual clock if the CPUs
           are idle.  */
         qemu_clock_warp(vm_clock);
-        qemu_cond_wait(tcg_halt_cond, &qemu_global_mutex);
+        qemu_global_cond_wait(tcg_halt_cond);
     }
 
     while (iothread_requesting_mutex) {
-        qemu_cond_wait(&qemu_io_proceeded_cond, &qemu_global_mutex);
+        qemu_global_cond_wait(&qemu_io_proceeded_cond);
     }
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
@@ -719,24 +1009,94 @@ static void qemu_tcg_wait_io_event(void)
     }
 }
 
+/*
+ * Halted vCPUs spin for up to halt_poll_ns before they sleep on halt_cond,
+ * which saves the wakeup latency when an interrupt follows shortly.  The
+ * window grows while halts end within halt_poll_max_ns and shrinks when
+ * they don't, so idle vCPUs stop burning host CPU.
+ */
+#define HALT_POLL_START_NS 10000
+
+static int64_t halt_poll_max_ns;
+
+static bool qemu_kvm_halt_poll(CPUArchState *env)
+{
+    int64_t start = get_clock();
+
+    qemu_global_mutex_unlock();
+    do {
+        barrier();
+        if (!cpu_thread_is_idle(env)) {
+            break;
+        }
+    } while (get_clock() - start < env->halt_poll_ns);
+    qemu_global_mutex_lock();
+
+    return !cpu_thread_is_idle(env);
+}
+
+static void qemu_kvm_halt_poll_update(CPUArchState *env, int64_t halt_ns)
+{
+    if (halt_ns <= env->halt_poll_ns) {
+        return;
+    }
+    if (halt_ns <= halt_poll_max_ns) {
+        env->halt_poll_ns = MIN(MAX(env->halt_poll_ns * 2, HALT_POLL_START_NS),
+                                halt_poll_max_ns);
+    } else {
+        env->halt_poll_ns /= 2;
+        if (env->halt_poll_ns < HALT_POLL_START_NS) {
+            env->halt_poll_ns = 0;
+        }
+    }
+}
+
 static void qemu_kvm_wait_io_event(CPUArchState *env)
 {
+    int64_t halt_start = 0;
+
+    if (halt_poll_max_ns && env->halted && !env->stopped &&
+        runstate_is_running() && cpu_thread_is_idle(env)) {
+        halt_start = get_clock();
+        if (env->halt_poll_ns && qemu_kvm_halt_poll(env)) {
+            env->halt_poll_successes++;
+            halt_start = 0;
+        }
+    }
+
     while (cpu_thread_is_idle(env)) {
-        qemu_cond_wait(env->halt_cond, &qemu_global_mutex);
+        qemu_global_cond_wait(env->halt_cond);
+    }
+
+    if (halt_start) {
+        if (env->halt_poll_ns) {
+            env->halt_poll_misses++;
+        }
+        qemu_kvm_halt_poll_update(env, get_clock() - halt_start);
     }
 
     qemu_kvm_eat_signals(env);
     qemu_wait_io_event_common(env);
 }
 
+static void qemu_cpu_set_lock_site(CPUArchState *env)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "vcpu%d", env->cpu_index);
+    qemu_lock_stats_set_site(name);
+}
+
 static void *qemu_kvm_cpu_thread_fn(void *arg)
 {
     CPUArchState *env = arg;
     CPUState *cpu = ENV_GET_CPU(env);
     int r;
 
-    qemu_mutex_lock(&qemu_global_mutex);
+    qemu_cpu_set_lock_site(env);
+    qemu_global_mutex_lock();
     qemu_thread_get_self(cpu->thread);
+    rcu_register_thread();
     env->thread_id = qemu_get_thread_id();
     cpu_single_env = env;
 
@@ -776,8 +1136,10 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
     sigset_t waitset;
     int r;
 
+    qemu_cpu_set_lock_site(env);
     qemu_mutex_lock_iothread();
     qemu_thread_get_self(cpu->thread);
+    rcu_register_thread();
     env->thread_id = qemu_get_thread_id();
 
     sigemptyset(&waitset);
@@ -817,9 +1179,11 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
 
     qemu_tcg_init_cpu_signals();
     qemu_thread_get_self(cpu->thread);
+    rcu_register_thread();
+    qemu_lock_stats_set_site("tcg");
 
     /* signal CPU creation */
-    qemu_mutex_lock(&qemu_global_mutex);
+    qemu_global_mutex_lock();
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         env->thread_id = qemu_get_thread_id();
         env->created = 1;
@@ -828,7 +1192,7 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
 
     /* wait for initial kick-off after machine start */
     while (first_cpu->stopped) {
-        qemu_cond_wait(tcg_halt_cond, &qemu_global_mutex);
+        qemu_global_cond_wait(tcg_halt_cond);
 
         /* process any pending work */
         for (env = first_cpu; env != NULL; env = env->next_cpu) {
@@ -847,6 +1211,278 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+/*
+ * Multi-threaded TCG.  Each vCPU thread drops the global mutex while it is
+ * in cpu_exec() and takes it back for device access and interrupt
+ * delivery.  Work that must not overlap with any translated code, such as
+ * flushing the translation cache, runs in an exclusive section that waits
+ * until no other vCPU is inside cpu_exec(), like linux-user does.
+ */
+bool mttcg_enabled;
+
+static QemuMutex tcg_exclusive_lock;
+static QemuCond tcg_exclusive_cond;
+static QemuCond tcg_exclusive_resume;
+static int tcg_pending_cpus;
+
+/* serializes guest exclusive stores and swaps */
+static QemuMutex tcg_atomic_mutex;
+
+/* signalled when a vCPU has done the TLB flushes requested from it, or
+   has left cpu_exec() */
+static QemuMutex tcg_tlb_flush_lock;
+static QemuCond tcg_tlb_flush_cond;
+
+static DEFINE_TLS(int, tcg_io_lock_depth);
+static DEFINE_TLS(bool, tcg_atomic_locked);
+
+/* Wait for pending exclusive sections.  tcg_exclusive_lock must be held. */
+static void qemu_tcg_exclusive_idle(void)
+{
+    while (tcg_pending_cpus) {
+        qemu_cond_wait(&tcg_exclusive_resume, &tcg_exclusive_lock);
+    }
+}
+
+/* Must be called outside cpu_exec(). */
+static void qemu_tcg_start_exclusive(void)
+{
+    CPUArchState *other;
+
+    qemu_mutex_lock(&tcg_exclusive_lock);
+    qemu_tcg_exclusive_idle();
+
+    tcg_pending_cpus = 1;
+    for (other = first_cpu; other != NULL; other = other->next_cpu) {
+        if (other->running) {
+            tcg_pending_cpus++;
+            cpu_exit(other);
+        }
+    }
+    while (tcg_pending_cpus > 1) {
+        qemu_cond_wait(&tcg_exclusive_cond, &tcg_exclusive_lock);
+    }
+}
+
+static void qemu_tcg_end_exclusive(void)
+{
+    tcg_pending_cpus = 0;
+    qemu_cond_broadcast(&tcg_exclusive_resume);
+    qemu_mutex_unlock(&tcg_exclusive_lock);
+}
+
+static void qemu_tcg_exec_start(CPUArchState *env)
+{
+    qemu_mutex_lock(&tcg_exclusive_lock);
+    qemu_tcg_exclusive_idle();
+    env->running = 1;
+    qemu_mutex_unlock(&tcg_exclusive_lock);
+}
+
+static void qemu_tcg_exec_end(CPUArchState *env)
+{
+    qemu_mutex_lock(&tcg_exclusive_lock);
+    env->running = 0;
+    if (tcg_pending_cpus > 1) {
+        tcg_pending_cpus--;
+        if (tcg_pending_cpus == 1) {
+            qemu_cond_signal(&tcg_exclusive_cond);
+        }
+    }
+    qemu_mutex_unlock(&tcg_exclusive_lock);
+
+    /* TLB flushes requested from now on are done before env runs again */
+    qemu_mutex_lock(&tcg_tlb_flush_lock);
+    qemu_cond_broadcast(&tcg_tlb_flush_cond);
+    qemu_mutex_unlock(&tcg_tlb_flush_lock);
+}
+
+/* Do the TLB flushes other vCPUs requested from env.  Called by the thread
+   of env, from within cpu_exec().  */
+void qemu_tcg_tlb_flush_service(CPUArchState *env)
+{
+    int req = env->tlb_flush_pending;
+
+    smp_rmb();
+    tlb_flush(env, 1);
+
+    qemu_mutex_lock(&tcg_tlb_flush_lock);
+    env->tlb_flush_done = req;
+    qemu_cond_broadcast(&tcg_tlb_flush_cond);
+    qemu_mutex_unlock(&tcg_tlb_flush_lock);
+}
+
+/* Flush the TLBs of all other vCPUs, and wait until none of them can use
+   an entry from before the call: each has either done the flush or is
+   outside cpu_exec(), where it does the flush before running guest code
+   again.  Requests from vCPUs that are waiting for env meanwhile are
+   served here, otherwise two broadcasts could wait for each other.  */
+void qemu_tcg_tlb_flush_others(CPUArchState *env)
+{
+    CPUArchState *other;
+
+    for (other = first_cpu; other != NULL; other = other->next_cpu) {
+        if (other != env) {
+            tlb_flush_request(other);
+        }
+    }
+
+    qemu_mutex_lock(&tcg_tlb_flush_lock);
+    other = first_cpu;
+    while (other) {
+        if (env->tlb_flush_pending != env->tlb_flush_done) {
+            qemu_mutex_unlock(&tcg_tlb_flush_lock);
+            qemu_tcg_tlb_flush_service(env);
+            qemu_mutex_lock(&tcg_tlb_flush_lock);
+            continue;
+        }
+        if (other == env || !other->running ||
+            other->tlb_flush_done == other->tlb_flush_pending) {
+            other = other->next_cpu;
+            continue;
+        }
+        qemu_cond_wait(&tcg_tlb_flush_cond, &tcg_tlb_flush_lock);
+    }
+    qemu_mutex_unlock(&tcg_tlb_flush_lock);
+}
+
+/* Take the global mutex from within cpu_exec().  Nests. */
+void qemu_tcg_io_lock(void)
+{
+    if (tls_var(tcg_io_lock_depth)++ == 0) {
+        qemu_global_mutex_lock();
+    }
+}
+
+void qemu_tcg_io_unlock(void)
+{
+    if (--tls_var(tcg_io_lock_depth) == 0) {
+        qemu_global_mutex_unlock();
+    }
+}
+
+void qemu_tcg_atomic_lock(void)
+{
+    qemu_mutex_lock(&tcg_atomic_mutex);
+    tls_var(tcg_atomic_locked) = true;
+}
+
+void qemu_tcg_atomic_unlock(void)
+{
+    tls_var(tcg_atomic_locked) = false;
+    qemu_mutex_unlock(&tcg_atomic_mutex);
+}
+
+/* Drop what the vCPU thread held when an exception longjmp'ed out of
+   translated code or a helper.  */
+void qemu_tcg_cpu_unwind(void)
+{
+    if (tls_var(tcg_atomic_locked)) {
+        qemu_tcg_atomic_unlock();
+    }
+    if (tls_var(tcg_io_lock_depth)) {
+        tls_var(tcg_io_lock_depth) = 0;
+        qemu_global_mutex_unlock();
+    }
+}
+
+static int qemu_tcg_mt_cpu_exec(CPUArchState *env)
+{
+    int ret;
+
+    qemu_global_mutex_unlock();
+    if (tb_flush_pending) {
+        qemu_tcg_start_exclusive();
+        if (tb_flush_pending) {
+            /* the I/O thread may still be invalidating TBs */
+            tcg_tb_lock();
+            tb_flush_exclusive(env);
+            tb_flush_pending = 0;
+            tcg_tb_unlock();
+        }
+        qemu_tcg_end_exclusive();
+    }
+    qemu_tcg_exec_start(env);
+    ret = cpu_exec(env);
+    qemu_tcg_exec_end(env);
+    qemu_global_mutex_lock();
+
+    /* cpu_exec() clears it, but this thread only ever runs env */
+    cpu_single_env = env;
+    return ret;
+}
+
+static void qemu_tcg_mt_wait_io_event(CPUArchState *env)
+{
+    while (cpu_thread_is_idle(env)) {
+        qemu_global_cond_wait(env->halt_cond);
+    }
+    qemu_wait_io_event_common(env);
+}
+
+static void *qemu_tcg_mt_cpu_thread_fn(void *arg)
+{
+    CPUArchState *env = arg;
+    CPUState *cpu = ENV_GET_CPU(env);
+    int r;
+
+    qemu_cpu_set_lock_site(env);
+    qemu_global_mutex_lock();
+    qemu_thread_get_self(cpu->thread);
+    rcu_register_thread();
+    env->thread_id = qemu_get_thread_id();
+    cpu_single_env = env;
+
+    /* signal CPU creation */
+    env->created = 1;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(env)) {
+            r = qemu_tcg_mt_cpu_exec(env);
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(env);
+            }
+        }
+        qemu_tcg_mt_wait_io_event(env);
+    }
+
+    return NULL;
+}
+
+static void qemu_tcg_mt_start_vcpu(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+
+    cpu->thread = g_malloc0(sizeof(QemuThread));
+    env->halt_cond = g_malloc0(sizeof(QemuCond));
+    qemu_cond_init(env->halt_cond);
+    qemu_thread_create(cpu->thread, qemu_tcg_mt_cpu_thread_fn, env,
+                       QEMU_THREAD_JOINABLE);
+    while (env->created == 0) {
+        qemu_global_cond_wait(&qemu_cpu_cond);
+    }
+}
+
+static void qemu_tcg_configure(void)
+{
+    QemuOptsList *list = qemu_find_opts("machine");
+
+    if (QTAILQ_EMPTY(&list->head) ||
+        !qemu_opt_get_bool(QTAILQ_FIRST(&list->head), "mttcg", false)) {
+        return;
+    }
+#if !defined(TARGET_SUPPORTS_MTTCG) || !defined(__linux__)
+    fprintf(stderr, "qemu: mttcg is not supported for this target or host\n");
+    exit(1);
+#endif
+    if (use_icount) {
+        fprintf(stderr, "qemu: mttcg cannot be combined with -icount\n");
+        exit(1);
+    }
+    mttcg_enabled = true;
+}
+
 static void qemu_cpu_kick_thread(CPUArchState *env)
 {
     CPUState *cpu = ENV_GET_CPU(env);
@@ -873,7 +1509,9 @@ void qemu_cpu_kick(void *_env)
     CPUState *cpu = ENV_GET_CPU(env);
 
     qemu_cond_broadcast(env->halt_cond);
-    if (!tcg_enabled() && !cpu->thread_kicked) {
+    if (mttcg_enabled) {
+        cpu_exit(env);
+    } else if (!tcg_enabled() && !cpu->thread_kicked) {
         qemu_cpu_kick_thread(env);
         cpu->thread_kicked = true;
     }
@@ -902,9 +1540,17 @@ int qemu_cpu_is_self(void *_env)
     return qemu_thread_is_self(cpu->thread);
 }
 
+/* the iothread and the migration thread both stop vCPUs synchronously */
+static bool qemu_in_vcpu_thread(void)
+{
+    return cpu_single_env && qemu_cpu_is_self(cpu_single_env);
+}
+
 void qemu_mutex_lock_iothread(void)
 {
-    if (!tcg_enabled()) {
+    int64_t start = lock_stats_wait_start();
+
+    if (!tcg_enabled() || mttcg_enabled) {
         qemu_mutex_lock(&qemu_global_mutex);
     } else {
         iothread_requesting_mutex = true;
@@ -915,11 +1561,12 @@ void qemu_mutex_lock_iothread(void)
         iothread_requesting_mutex = false;
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    lock_stats_acquired(start, true);
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
-    qemu_mutex_unlock(&qemu_global_mutex);
+    qemu_global_mutex_unlock();
 }
 
 static int all_vcpus_paused(void)
@@ -947,9 +1594,9 @@ void pause_all_vcpus(void)
         penv = penv->next_cpu;
     }
 
-    if (!qemu_thread_is_self(&io_thread)) {
+    if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !mttcg_enabled) {
             while (penv) {
                 penv->stop = 0;
                 penv->stopped = 1;
@@ -960,7 +1607,7 @@ void pause_all_vcpus(void)
     }
 
     while (!all_vcpus_paused()) {
-        qemu_cond_wait(&qemu_pause_cond, &qemu_global_mutex);
+        qemu_global_cond_wait(&qemu_pause_cond);
         penv = first_cpu;
         while (penv) {
             qemu_cpu_kick(penv);
@@ -987,6 +1634,14 @@ static void qemu_tcg_init_vcpu(void *_env)
     CPUArchState *env = _env;
     CPUState *cpu = ENV_GET_CPU(env);
 
+    if (env == first_cpu) {
+        qemu_tcg_configure();
+    }
+    if (mttcg_enabled) {
+        qemu_tcg_mt_start_vcpu(env);
+        return;
+    }
+
     /* share a single thread for all cpus with TCG */
     if (!tcg_cpu_thread) {
         cpu->thread = g_malloc0(sizeof(QemuThread));
@@ -999,7 +1654,7 @@ static void qemu_tcg_init_vcpu(void *_env)
         cpu->hThread = qemu_thread_get_handle(cpu->thread);
 #endif
         while (env->created == 0) {
-            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+            qemu_global_cond_wait(&qemu_cpu_cond);
         }
         tcg_cpu_thread = cpu->thread;
     } else {
@@ -1011,6 +1666,12 @@ static void qemu_tcg_init_vcpu(void *_env)
 static void qemu_kvm_start_vcpu(CPUArchState *env)
 {
     CPUState *cpu = ENV_GET_CPU(env);
+    QemuOptsList *list = qemu_find_opts("machine");
+
+    if (!QTAILQ_EMPTY(&list->head)) {
+        halt_poll_max_ns = qemu_opt_get_number(QTAILQ_FIRST(&list->head),
+                                               "kvm_halt_poll_ns", 0);
+    }
 
     cpu->thread = g_malloc0(sizeof(QemuThread));
     env->halt_cond = g_malloc0(sizeof(QemuCond));
@@ -1018,7 +1679,7 @@ static void qemu_kvm_start_vcpu(CPUArchState *env)
     qemu_thread_create(cpu->thread, qemu_kvm_cpu_thread_fn, env,
                        QEMU_THREAD_JOINABLE);
     while (env->created == 0) {
-        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        qemu_global_cond_wait(&qemu_cpu_cond);
     }
 }
 
@@ -1032,7 +1693,7 @@ static void qemu_dummy_start_vcpu(CPUArchState *env)
     qemu_thread_create(cpu->thread, qemu_dummy_cpu_thread_fn, env,
                        QEMU_THREAD_JOINABLE);
     while (env->created == 0) {
-        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        qemu_global_cond_wait(&qemu_cpu_cond);
     }
 }
 
@@ -1064,7 +1725,7 @@ void cpu_stop_current(void)
 
 void vm_stop(RunState state)
 {
-    if (!qemu_thread_is_self(&io_thread)) {
+    if (qemu_in_vcpu_thread()) {
         qemu_system_vmstop_request(state);
         /*
          * FIXME: should not return to device code in case
@@ -1154,6 +1815,207 @@ static void tcg_exec_all(void)
     exit_request = 0;
 }
 
+/*
+ * Host CPU affinity.  KVM vCPU threads and the main I/O thread are pinned
+ * directly.  Dataplane threads come and go with the guest driver, so their
+ * mask is kept and applied to each one as it starts.
+ */
+typedef struct DataPlaneThread {
+    QemuThread *thread;
+    QLIST_ENTRY(DataPlaneThread) next;
+} DataPlaneThread;
+
+static QLIST_HEAD(, DataPlaneThread) dataplane_threads =
+    QLIST_HEAD_INITIALIZER(dataplane_threads);
+static unsigned long *dataplane_affinity;
+
+void qemu_register_dataplane_thread(QemuThread *thread)
+{
+    DataPlaneThread *dp = g_malloc0(sizeof(*dp));
+
+    dp->thread = thread;
+    QLIST_INSERT_HEAD(&dataplane_threads, dp, next);
+    if (dataplane_affinity) {
+        qemu_thread_set_affinity(thread, dataplane_affinity, MAX_HOST_CPUS);
+    }
+}
+
+void qemu_unregister_dataplane_thread(QemuThread *thread)
+{
+    DataPlaneThread *dp;
+
+    QLIST_FOREACH(dp, &dataplane_threads, next) {
+        if (dp->thread == thread) {
+            QLIST_REMOVE(dp, next);
+            g_free(dp);
+            return;
+        }
+    }
+}
+
+static void set_thread_affinity(bool has_vcpu, int64_t vcpu,
+                                const char *iothread,
+                                const unsigned long *cpus, Error **errp)
+{
+    CPUArchState *env;
+    DataPlaneThread *dp;
+    int ret = 0;
+
+    if (has_vcpu == (iothread != NULL)) {
+        error_set(errp, QERR_INVALID_PARAMETER_COMBINATION);
+        return;
+    }
+    if (bitmap_empty(cpus, MAX_HOST_CPUS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "cpus",
+                  "a list of host CPUs");
+        return;
+    }
+
+    if (has_vcpu) {
+        for (env = first_cpu; env != NULL; env = env->next_cpu) {
+            if (env->cpu_index == vcpu) {
+                break;
+            }
+        }
+        if (env == NULL) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "vcpu",
+                      "a CPU number");
+            return;
+        }
+        /* TCG runs all vCPUs on one thread */
+        if (!kvm_enabled()) {
+            error_set(errp, QERR_UNSUPPORTED);
+            return;
+        }
+        ret = qemu_thread_set_affinity(ENV_GET_CPU(env)->thread, cpus,
+                                       MAX_HOST_CPUS);
+    } else if (!strcmp(iothread, "main")) {
+        ret = qemu_thread_set_affinity(&io_thread, cpus, MAX_HOST_CPUS);
+    } else if (!strcmp(iothread, "dataplane")) {
+        if (!dataplane_affinity) {
+            dataplane_affinity = bitmap_new(MAX_HOST_CPUS);
+        }
+        bitmap_copy(dataplane_affinity, cpus, MAX_HOST_CPUS);
+        QLIST_FOREACH(dp, &dataplane_threads, next) {
+            ret = qemu_thread_set_affinity(dp->thread, cpus, MAX_HOST_CPUS);
+            if (ret < 0) {
+                break;
+            }
+        }
+    } else {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "iothread",
+                  "'main' or 'dataplane'");
+        return;
+    }
+
+    if (ret < 0) {
+        error_set(errp, ERROR_CLASS_GENERIC_ERROR,
+                  "Could not set thread affinity: %s", strerror(-ret));
+    }
+}
+
+void qmp_set_thread_affinity(bool has_vcpu, int64_t vcpu,
+                             bool has_iothread, const char *iothread,
+                             const char *cpus, Error **errp)
+{
+    unsigned long *mask = bitmap_new(MAX_HOST_CPUS);
+
+    if (qemu_parse_bitmap_list(cpus, mask, MAX_HOST_CPUS) < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "cpus",
+                  "a list of host CPUs");
+    } else {
+        set_thread_affinity(has_vcpu, vcpu, has_iothread ? iothread : NULL,
+                            mask, errp);
+    }
+    g_free(mask);
+}
+
+static int thread_affinity_add_cpus(const char *name, const char *value,
+                                    void *opaque)
+{
+    if (strcmp(name, "cpus") != 0) {
+        return 0;
+    }
+    if (qemu_parse_bitmap_list(value, opaque, MAX_HOST_CPUS) < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "cpus",
+                      "a list of host CPUs");
+        return -1;
+    }
+    return 0;
+}
+
+int qemu_thread_affinity_init(QemuOpts *opts, void *opaque)
+{
+    unsigned long *mask = bitmap_new(MAX_HOST_CPUS);
+    const char *vcpu = qemu_opt_get(opts, "vcpu");
+    Error *err = NULL;
+    int ret = -1;
+
+    if (qemu_opt_foreach(opts, thread_affinity_add_cpus, mask, 1) == 0) {
+        set_thread_affinity(vcpu != NULL, qemu_opt_get_number(opts, "vcpu", 0),
+                            qemu_opt_get(opts, "iothread"), mask, &err);
+        if (error_is_set(&err)) {
+            qerror_report_err(err);
+            error_free(err);
+        } else {
+            ret = 0;
+        }
+    }
+    g_free(mask);
+    return ret;
+}
+
+#ifdef __linux__
+void numa_get_host_node_cpus(const unsigned long *nodes, unsigned long *cpus)
+{
+    char *path, *cpulist;
+    int node;
+
+    for (node = find_first_bit(nodes, MAX_HOST_NODES); node < MAX_HOST_NODES;
+         node = find_next_bit(nodes, MAX_HOST_NODES, node + 1)) {
+        path = g_strdup_printf("/sys/devices/system/node/node%d/cpulist",
+                               node);
+        if (g_file_get_contents(path, &cpulist, NULL, NULL)) {
+            g_strstrip(cpulist);
+            if (*cpulist) {
+                qemu_parse_bitmap_list(cpulist, cpus, MAX_HOST_CPUS);
+            }
+            g_free(cpulist);
+        }
+        g_free(path);
+    }
+}
+#else
+void numa_get_host_node_cpus(const unsigned long *nodes, unsigned long *cpus)
+{
+}
+#endif
+
+/* Pin the vCPUs of guest nodes that -numa binds to host nodes to the CPUs
+ * of those host nodes, unless told otherwise by -thread-affinity.  */
+static void numa_set_vcpu_affinity(CPUArchState *env)
+{
+    unsigned long *nodes = node_host_nodes[env->numa_node];
+    unsigned long *mask;
+    int ret;
+
+    if (!kvm_enabled() || bitmap_empty(nodes, MAX_HOST_NODES)) {
+        return;
+    }
+
+    mask = bitmap_new(MAX_HOST_CPUS);
+    numa_get_host_node_cpus(nodes, mask);
+    if (!bitmap_empty(mask, MAX_HOST_CPUS)) {
+        ret = qemu_thread_set_affinity(ENV_GET_CPU(env)->thread, mask,
+                                       MAX_HOST_CPUS);
+        if (ret < 0) {
+            fprintf(stderr, "qemu: could not pin CPU %d to its host nodes: "
+                    "%s\n", env->cpu_index, strerror(-ret));
+        }
+    }
+    g_free(mask);
+}
+
 void set_numa_modes(void)
 {
     CPUArchState *env;
@@ -1165,6 +2027,9 @@ void set_numa_modes(void)
                 env->numa_node = i;
             }
         }
+        if (nb_numa_nodes > 0) {
+            numa_set_vcpu_affinity(env);
+        }
     }
 }
 
@@ -1207,7 +2072,11 @@ CpuInfoList *qmp_query_cpus(Error **errp)
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
         CpuInfoList *info;
 
+#if defined(TARGET_I386)
+        cpu_synchronize_groups(env, KVM_REGS_SREGS | KVM_REGS_MP_STATE);
+#else
         cpu_synchronize_state(env);
+#endif
 
         info = g_malloc0(sizeof(*info));
         info->value = g_malloc0(sizeof(*info->value));
@@ -1215,6 +2084,14 @@ CpuInfoList *qmp_query_cpus(Error **errp)
         info->value->current = (env == first_cpu);
         info->value->halted = env->halted;
         info->value->thread_id = env->thread_id;
+        if (halt_poll_max_ns) {
+            info->value->has_halt_poll_ns = true;
+            info->value->halt_poll_ns = env->halt_poll_ns;
+            info->value->has_halt_poll_successes = true;
+            info->value->halt_poll_successes = env->halt_poll_successes;
+            info->value->has_halt_poll_misses = true;
+            info->value->halt_poll_misses = env->halt_poll_misses;
+        }
 #if defined(TARGET_I386)
         info->value->has_pc = true;
         info->value->pc = env->eip + env->segs[R_CS].base;
@@ -1243,6 +2120,119 @@ CpuInfoList *qmp_query_cpus(Error **errp)
     return head;
 }
 
+CpuLockStatsList *qmp_query_cpu_lock_stats(Error **errp)
+{
+    CpuLockStatsList *head = NULL, **prev = &head;
+    CPUArchState *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        CpuLockStatsList *info;
+        CpuLockWaitBucketList **bucket_prev;
+        int i;
+
+        info = g_malloc0(sizeof(*info));
+        info->value = g_malloc0(sizeof(*info->value));
+        info->value->CPU = env->cpu_index;
+        info->value->lockless_exits = env->lockless_exits;
+        info->value->locked_exits = env->locked_exits;
+
+        bucket_prev = &info->value->wait_histogram;
+        for (i = 0; i < CPU_LOCK_WAIT_BUCKETS; i++) {
+            CpuLockWaitBucketList *bucket = g_malloc0(sizeof(*bucket));
+
+            bucket->value = g_malloc0(sizeof(*bucket->value));
+            if (i < CPU_LOCK_WAIT_BUCKETS - 1) {
+                bucket->value->has_below_us = true;
+                bucket->value->below_us = 1LL << (2 * i);
+            }
+            bucket->value->count = env->lock_wait_hist[i];
+            *bucket_prev = bucket;
+            bucket_prev = &bucket->next;
+        }
+
+        *prev = info;
+        prev = &info->next;
+    }
+
+    return head;
+}
+
+static LockStatsBucketList *lock_stats_hist(const uint64_t *hist)
+{
+    LockStatsBucketList *head = NULL, **prev = &head;
+    int i;
+
+    for (i = 0; i < LOCK_STATS_BUCKETS; i++) {
+        LockStatsBucketList *bucket = g_malloc0(sizeof(*bucket));
+
+        bucket->value = g_malloc0(sizeof(*bucket->value));
+        if (i < LOCK_STATS_BUCKETS - 1) {
+            bucket->value->has_below_us = true;
+            bucket->value->below_us = 1LL << (2 * i);
+        }
+        bucket->value->count = hist[i];
+        *prev = bucket;
+        prev = &bucket->next;
+    }
+    return head;
+}
+
+LockStatsInfo *qmp_query_lock_stats(Error **errp)
+{
+    LockStatsInfo *info = g_malloc0(sizeof(*info));
+    LockSiteStatsList **prev = &info->sites;
+    LockSite *site;
+
+    info->enabled = lock_stats_enabled;
+
+    qemu_mutex_lock(&lock_stats_sites_lock);
+    QTAILQ_FOREACH(site, &lock_stats_sites, next) {
+        LockSiteStatsList *entry;
+
+        if (!site->acquisitions) {
+            continue;
+        }
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->site = g_strdup(site->name);
+        entry->value->acquisitions = site->acquisitions;
+        entry->value->locks = site->locks;
+        entry->value->wait_ns = site->wait_ns;
+        entry->value->max_wait_ns = site->max_wait_ns;
+        entry->value->hold_ns = site->hold_ns;
+        entry->value->max_hold_ns = site->max_hold_ns;
+        entry->value->wait_histogram = lock_stats_hist(site->wait_hist);
+        entry->value->hold_histogram = lock_stats_hist(site->hold_hist);
+        *prev = entry;
+        prev = &entry->next;
+    }
+    qemu_mutex_unlock(&lock_stats_sites_lock);
+
+    return info;
+}
+
+/* Called with the global mutex held, like every monitor command */
+void qmp_lock_stats(bool enable, Error **errp)
+{
+    LockSite *site;
+
+    if (enable && !lock_stats_enabled) {
+        qemu_mutex_lock(&lock_stats_sites_lock);
+        QTAILQ_FOREACH(site, &lock_stats_sites, next) {
+            site->acquisitions = 0;
+            site->locks = 0;
+            site->wait_ns = 0;
+            site->hold_ns = 0;
+            site->max_wait_ns = 0;
+            site->max_hold_ns = 0;
+            memset(site->wait_hist, 0, sizeof(site->wait_hist));
+            memset(site->hold_hist, 0, sizeof(site->hold_hist));
+        }
+        qemu_mutex_unlock(&lock_stats_sites_lock);
+    }
+    lock_stats_enabled = enable;
+}
+
 void qmp_memsave(int64_t addr, int64_t size, const char *filename,
                  bool has_cpu, int64_t cpu_index, Error **errp)
 {
@@ -1,6 +1,9 @@
 #ifndef QEMU_CPUS_H
 #define QEMU_CPUS_H
 
+#include "qemu-option.h"
+#include "qemu-thread.h"
+
 /* cpus.c */
 void qemu_init_cpu_loop(void);
 void resume_all_vcpus(void);
@@ -13,6 +16,15 @@ void cpu_synchronize_all_post_init(void);
 
 void qtest_clock_warp(int64_t dest);
 
+void cpu_throttle_set(int new_throttle_pct);
+void cpu_throttle_stop(void);
+bool cpu_throttle_active(void);
+int cpu_throttle_get_percentage(void);
+
+int qemu_thread_affinity_init(QemuOpts *opts, void *opaque);
+void qemu_register_dataplane_thread(QemuThread *thread);
+void qemu_unregister_dataplane_thread(QemuThread *thread);
+
 /* vl.c */
 extern int smp_cores;
 extern int smp_threads;
@@ -55,6 +55,7 @@ static const CPUTLBEntry s_cputlb_empty_entry = {
 void tlb_flush(CPUArchState *env, int flush_global)
 {
     int i;
+    int mmu_idx;
 
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
@@ -63,11 +64,30 @@ void tlb_flush(CPUArchState *env, int flush_global)
        links while we are modifying them */
     env->current_tb = NULL;
 
-    for (i = 0; i < CPU_TLB_SIZE; i++) {
-        int mmu_idx;
+    if (env->tlb_fill_log_on &&
+        env->tlb_fill_log_len <= CPU_TLB_FILL_LOG_SIZE) {
+        /* only the entries filled since the last flush can be valid */
+        for (i = 0; i < env->tlb_fill_log_len; i++) {
+            mmu_idx = env->tlb_fill_log[i] >> CPU_TLB_BITS;
+            env->tlb_table[mmu_idx][env->tlb_fill_log[i] &
+                                    (CPU_TLB_SIZE - 1)] =
+                s_cputlb_empty_entry;
+        }
+        env->tlb_partial_flushes++;
+    } else {
+        for (i = 0; i < CPU_TLB_SIZE; i++) {
+            for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+                env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
+            }
+        }
+        env->tlb_full_flushes++;
+    }
+    env->tlb_fill_log_len = 0;
+    env->tlb_fill_log_on = true;
 
-        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-            env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+            env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
         }
     }
 
@@ -78,6 +98,21 @@ void tlb_flush(CPUArchState *env, int flush_global)
     tlb_flush_count++;
 }
 
+/* Flush the TLB of a CPU that may be running in another thread.  With
+ * multi-threaded TCG the owning vCPU does the flush itself the next time
+ * it goes through the cpu_exec() loop; qemu_tcg_tlb_flush_others() also
+ * waits for that.
+ */
+void tlb_flush_request(CPUArchState *env)
+{
+    if (mttcg_enabled && !qemu_cpu_is_self(env)) {
+        __sync_fetch_and_add(&env->tlb_flush_pending, 1);
+        cpu_exit(env);
+        return;
+    }
+    tlb_flush(env, 1);
+}
+
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
     if (addr == (tlb_entry->addr_read &
@@ -115,12 +150,60 @@ void tlb_flush_page(CPUArchState *env, target_ulong addr)
     addr &= TARGET_PAGE_MASK;
     i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+        }
     }
 
     tb_flush_jmp_cache(env, addr);
 }
 
+static inline void tlb_log_fill(CPUArchState *env, int mmu_idx, int index)
+{
+    if (env->tlb_fill_log_len < CPU_TLB_FILL_LOG_SIZE) {
+        env->tlb_fill_log[env->tlb_fill_log_len] =
+            (mmu_idx << CPU_TLB_BITS) | index;
+    }
+    if (env->tlb_fill_log_len <= CPU_TLB_FILL_LOG_SIZE) {
+        env->tlb_fill_log_len++;
+    }
+}
+
+/* Look for the page of 'addr' in the victim TLB and, on a hit, swap it
+   into the main TLB at 'index'.  'access' is 0 for loads, 1 for stores
+   and 2 for code fetches, as for tlb_fill().  */
+bool tlb_victim_lookup(CPUArchState *env, int mmu_idx, int index,
+                       target_ulong addr, int access)
+{
+    int k;
+
+    addr &= TARGET_PAGE_MASK;
+    for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        CPUTLBEntry *vte = &env->tlb_v_table[mmu_idx][k];
+        target_ulong cmp;
+
+        cmp = access == 0 ? vte->addr_read :
+              access == 1 ? vte->addr_write : vte->addr_code;
+        if (addr == (cmp & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+            CPUTLBEntry *te = &env->tlb_table[mmu_idx][index];
+            CPUTLBEntry tmp = *te;
+            target_phys_addr_t tmpio = env->iotlb[mmu_idx][index];
+
+            *te = *vte;
+            *vte = tmp;
+            env->iotlb[mmu_idx][index] = env->iotlb_v[mmu_idx][k];
+            env->iotlb_v[mmu_idx][k] = tmpio;
+            tlb_log_fill(env, mmu_idx, index);
+            env->tlb_victim_hits++;
+            return true;
+        }
+    }
+    return false;
+}
+
 /* update the TLBs so that writes to code in the virtual page 'addr'
    can be detected */
 void tlb_protect_code(ram_addr_t ram_addr)
@@ -178,6 +261,10 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         int mmu_idx;
 
+        if (mttcg_enabled && !qemu_cpu_is_self(env)) {
+            tlb_flush_request(env);
+            continue;
+        }
         for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
             unsigned int i;
 
@@ -185,6 +272,10 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
             }
+            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
+            }
         }
     }
 }
@@ -206,7 +297,12 @@ void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
     vaddr &= TARGET_PAGE_MASK;
     i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
+        }
     }
 }
 
@@ -247,11 +343,13 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
     uintptr_t addend;
     CPUTLBEntry *te;
     target_phys_addr_t iotlb;
+    int k;
 
     assert(size >= TARGET_PAGE_SIZE);
     if (size != TARGET_PAGE_SIZE) {
         tlb_add_large_page(env, vaddr, size);
     }
+    phys_map_lock();
     section = phys_page_find(paddr >> TARGET_PAGE_BITS);
 #if defined(DEBUG_TLB)
     printf("tlb_set_page: vaddr=" TARGET_FMT_lx " paddr=0x" TARGET_FMT_plx
@@ -269,6 +367,9 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
         memory_region_is_romd(section->mr)) {
         addend = (uintptr_t)memory_region_get_ram_ptr(section->mr)
         + memory_region_section_addr(section, paddr);
+        ram_lazy_touch(memory_region_get_ram_addr(section->mr)
+                       + memory_region_section_addr(section, paddr),
+                       TARGET_PAGE_SIZE);
     } else {
         addend = 0;
     }
@@ -278,8 +379,27 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                                             &address);
 
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te = &env->tlb_table[mmu_idx][index];
+
+    /* the victim TLB must not keep a stale copy of the new page */
+    for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], vaddr);
+    }
+    /* move the entry we are replacing to the victim TLB, unless it is
+       empty or for the same page */
+    if ((te->addr_read & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) != vaddr &&
+        (te->addr_write & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) != vaddr &&
+        (te->addr_code & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) != vaddr &&
+        (te->addr_read != -1 || te->addr_write != -1 ||
+         te->addr_code != -1)) {
+        k = env->vtlb_index++ % CPU_VTLB_SIZE;
+        env->tlb_v_table[mmu_idx][k] = *te;
+        env->iotlb_v[mmu_idx][k] = env->iotlb[mmu_idx][index];
+    }
+    tlb_log_fill(env, mmu_idx, index);
+    env->tlb_fill_count++;
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -308,6 +428,7 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
     } else {
         te->addr_write = -1;
     }
+    phys_map_unlock();
 }
 
 /* NOTE: this function can trigger an exception */
@@ -332,7 +453,9 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
 #endif
     }
     pd = env1->iotlb[mmu_idx][page_index] & ~TARGET_PAGE_MASK;
+    phys_map_lock();
     mr = iotlb_to_region(pd);
+    phys_map_unlock();
     if (memory_region_is_unassigned(mr)) {
 #if defined(TARGET_ALPHA) || defined(TARGET_MIPS) || defined(TARGET_SPARC)
         cpu_unassigned_access(env1, addr, 0, 1, 0, 4);
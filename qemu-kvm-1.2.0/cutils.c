@@ -27,6 +27,23 @@
 
 #include "qemu_socket.h"
 #include "iov.h"
+#include "bitops.h"
+
+#if defined __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined CONFIG_AVX2_OPT && defined __SSE2__
+#include <cpuid.h>
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+#pragma GCC pop_options
+#endif
+
+#if defined __ARM_NEON__ || defined __aarch64__
+#include <arm_neon.h>
+#endif
 
 void strpadcpy(char *buf, int buf_size, const char *str, char pad)
 {
@@ -246,40 +263,204 @@ size_t qemu_iovec_memset(QEMUIOVector *qiov, size_t offset,
 }
 
 /*
- * Checks if a buffer is all zeroes
- *
- * Attention! The len must be a multiple of 4 * sizeof(long) due to
- * restriction of optimizations in this function.
+ * Zero detection kernels.  They accept any alignment and length, because
+ * guest buffers can start and end anywhere; the vector variants leave
+ * whatever is left after their main loop to the word one.  All of them
+ * OR several vectors together before testing, so that a zero buffer costs
+ * one branch per 64 or 128 bytes.
  */
-bool buffer_is_zero(const void *buf, size_t len)
+
+static bool buffer_zero_long(const uint8_t *p, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len && ((uintptr_t)(p + i) % sizeof(long))) {
+        if (p[i++]) {
+            return false;
+        }
+    }
+    for (; i + 4 * sizeof(long) <= len; i += 4 * sizeof(long)) {
+        const long *l = (const long *)(p + i);
+
+        if (l[0] | l[1] | l[2] | l[3]) {
+            return false;
+        }
+    }
+    while (i < len) {
+        if (p[i++]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#if defined __SSE2__
+static bool buffer_zero_sse2(const uint8_t *p, size_t len)
 {
-    /*
-     * Use long as the biggest available internal data type that fits into the
-     * CPU register and unroll the loop to smooth out the effect of memory
-     * latency.
-     */
+    __m128i zero = _mm_setzero_si128();
+    size_t i;
 
+    for (i = 0; i + 64 <= len; i += 64) {
+        __m128i t0 = _mm_loadu_si128((__m128i *)(p + i));
+        __m128i t1 = _mm_loadu_si128((__m128i *)(p + i + 16));
+        __m128i t2 = _mm_loadu_si128((__m128i *)(p + i + 32));
+        __m128i t3 = _mm_loadu_si128((__m128i *)(p + i + 48));
+        __m128i t = _mm_or_si128(_mm_or_si128(t0, t1), _mm_or_si128(t2, t3));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) != 0xffff) {
+            return false;
+        }
+    }
+    return buffer_zero_long(p + i, len - i);
+}
+#endif
+
+#if defined CONFIG_AVX2_OPT && defined __SSE2__
+#pragma GCC push_options
+#pragma GCC target("avx2")
+static bool buffer_zero_avx2(const uint8_t *p, size_t len)
+{
     size_t i;
-    long d0, d1, d2, d3;
-    const long * const data = buf;
 
-    assert(len % (4 * sizeof(long)) == 0);
-    len /= sizeof(long);
+    for (i = 0; i + 128 <= len; i += 128) {
+        __m256i t0 = _mm256_loadu_si256((__m256i *)(p + i));
+        __m256i t1 = _mm256_loadu_si256((__m256i *)(p + i + 32));
+        __m256i t2 = _mm256_loadu_si256((__m256i *)(p + i + 64));
+        __m256i t3 = _mm256_loadu_si256((__m256i *)(p + i + 96));
+        __m256i t = _mm256_or_si256(_mm256_or_si256(t0, t1),
+                                    _mm256_or_si256(t2, t3));
+
+        if (!_mm256_testz_si256(t, t)) {
+            return false;
+        }
+    }
+    return buffer_zero_long(p + i, len - i);
+}
+#pragma GCC pop_options
+#endif
+
+#if defined __ARM_NEON__ || defined __aarch64__
+static bool buffer_zero_neon(const uint8_t *p, size_t len)
+{
+    size_t i;
 
-    for (i = 0; i < len; i += 4) {
-        d0 = data[i + 0];
-        d1 = data[i + 1];
-        d2 = data[i + 2];
-        d3 = data[i + 3];
+    for (i = 0; i + 64 <= len; i += 64) {
+        uint64x2_t t0 = vreinterpretq_u64_u8(vld1q_u8(p + i));
+        uint64x2_t t1 = vreinterpretq_u64_u8(vld1q_u8(p + i + 16));
+        uint64x2_t t2 = vreinterpretq_u64_u8(vld1q_u8(p + i + 32));
+        uint64x2_t t3 = vreinterpretq_u64_u8(vld1q_u8(p + i + 48));
+        uint64x2_t t = vorrq_u64(vorrq_u64(t0, t1), vorrq_u64(t2, t3));
 
-        if (d0 || d1 || d2 || d3) {
+        if (vgetq_lane_u64(t, 0) | vgetq_lane_u64(t, 1)) {
             return false;
         }
     }
+    return buffer_zero_long(p + i, len - i);
+}
+#endif
+
+typedef struct BufferZeroAccel {
+    const char *name;
+    bool (*is_zero)(const uint8_t *p, size_t len);
+    bool (*available)(void);
+} BufferZeroAccel;
 
+static bool buffer_zero_always_available(void)
+{
     return true;
 }
 
+/* from the fastest to the slowest */
+static const BufferZeroAccel buffer_zero_accels[] = {
+#if defined CONFIG_AVX2_OPT && defined __SSE2__
+    { "avx2", buffer_zero_avx2, host_has_avx2 },
+#endif
+#if defined __SSE2__
+    { "sse2", buffer_zero_sse2, buffer_zero_always_available },
+#endif
+#if defined __ARM_NEON__ || defined __aarch64__
+    { "neon", buffer_zero_neon, buffer_zero_always_available },
+#endif
+    { "long", buffer_zero_long, buffer_zero_always_available },
+};
+
+static const BufferZeroAccel *buffer_zero_accel =
+    &buffer_zero_accels[ARRAY_SIZE(buffer_zero_accels) - 1];
+
+static void __attribute__((constructor)) buffer_zero_init_accel(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(buffer_zero_accels); i++) {
+        if (buffer_zero_accels[i].available()) {
+            buffer_zero_accel = &buffer_zero_accels[i];
+            break;
+        }
+    }
+}
+
+const char *buffer_zero_accel_name(void)
+{
+    return buffer_zero_accel->name;
+}
+
+bool buffer_zero_test_next_accel(void)
+{
+    while (buffer_zero_accel <
+           &buffer_zero_accels[ARRAY_SIZE(buffer_zero_accels) - 1]) {
+        buffer_zero_accel++;
+        if (buffer_zero_accel->available()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Checks if a buffer is all zeroes
+ *
+ * Any alignment and length are fine.  Most buffers that are not zero
+ * have data right at the start, so look at the first word before paying
+ * for the vector setup.
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    unsigned long head;
+
+    if (len >= sizeof(head)) {
+        memcpy(&head, buf, sizeof(head));
+        if (head) {
+            return false;
+        }
+    }
+    return buffer_zero_accel->is_zero(buf, len);
+}
+
+#if defined CONFIG_AVX2_OPT && defined __SSE2__
+/* Whether code built with target("avx2") can run on this host */
+bool host_has_avx2(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+
+    /* the OS must save the YMM state on context switches */
+    __cpuid(1, eax, ebx, ecx, edx);
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)) {
+        return false;
+    }
+    asm("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    if ((eax & 6) != 6) {
+        return false;
+    }
+
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & bit_AVX2) != 0;
+}
+#endif
+
 #ifndef _WIN32
 /* Sets a specific flag */
 int fcntl_setfl(int fd, int flag)
@@ -388,6 +569,40 @@ int qemu_parse_fdset(const char *param)
     return qemu_parse_fd(param);
 }
 
+/*
+ * Parse a list of numbers and ranges such as "0-3,8,10-11" and set the
+ * corresponding bits in @bitmap, which has @nbits bits.  Bits that are
+ * already set are left alone.  Return -1 on a malformed list or if a
+ * number does not fit in the bitmap.
+ */
+int qemu_parse_bitmap_list(const char *str, unsigned long *bitmap, long nbits)
+{
+    unsigned long value, endvalue;
+    char *endptr;
+
+    do {
+        if (!qemu_isdigit(*str)) {
+            return -1;
+        }
+        value = endvalue = strtoul(str, &endptr, 10);
+        if (*endptr == '-') {
+            if (!qemu_isdigit(endptr[1])) {
+                return -1;
+            }
+            endvalue = strtoul(endptr + 1, &endptr, 10);
+        }
+        if (endvalue < value || endvalue >= nbits) {
+            return -1;
+        }
+        for (; value <= endvalue; value++) {
+            set_bit(value, bitmap);
+        }
+        str = endptr + 1;
+    } while (*endptr == ',');
+
+    return *endptr ? -1 : 0;
+}
+
 /* round down to the nearest power of 2*/
 int64_t pow2floor(int64_t value)
 {
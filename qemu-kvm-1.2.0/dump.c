@@ -11,6 +11,7 @@
  *
  */
 
+#include <zlib.h>
 #include "qemu-common.h"
 #include "elf.h"
 #include "cpu.h"
@@ -24,6 +25,11 @@
 #include "error.h"
 #include "qmp-commands.h"
 #include "gdbstub.h"
+#include "exec-memory.h"
+#include "main-loop.h"
+#include "migration.h"
+#include "qemu-thread.h"
+#include "qjson.h"
 
 static uint16_t cpu_convert_to_target16(uint16_t val, int endian)
 {
@@ -58,6 +64,128 @@ static uint64_t cpu_convert_to_target64(uint64_t val, int endian)
     return val;
 }
 
+/*
+ * kdump-compressed format, as written by makedumpfile and read by crash.
+ * It is emitted in makedumpfile's flattened form, a header followed by
+ * (offset, size, data) records, so that it can go to a pipe and parts of
+ * it can be written again.  "makedumpfile -R" turns it into a plain file.
+ *
+ * The layout of the dump, in blocks of TARGET_PAGE_SIZE:
+ *   --------------------------
+ *   |  disk dump header       |
+ *   --------------------------
+ *   |  sub header, elf notes  |
+ *   --------------------------
+ *   |  1st and 2nd bitmap     |
+ *   --------------------------
+ *   |  page descriptors       |
+ *   --------------------------
+ *   |  zero page, page data   |
+ *   --------------------------
+ *
+ * Each page of RAM has a descriptor, zero pages all point to the one
+ * zero page and take no room.  The pages are compressed by a pool of
+ * threads and written in order.
+ */
+#define KDUMP_SIGNATURE             "KDUMP   "
+#define KDUMP_SIG_LEN               (sizeof(KDUMP_SIGNATURE) - 1)
+#define KDUMP_HEADER_VERSION        6
+#define KDUMP_DH_COMPRESSED_ZLIB    0x1
+
+#define MAKEDUMPFILE_SIGNATURE      "makedumpfile"
+#define MAKEDUMPFILE_TYPE_FLAT      1
+#define MAKEDUMPFILE_VERSION_FLAT   1
+#define MAKEDUMPFILE_HEADER_SIZE    4096
+#define MAKEDUMPFILE_END            -1
+
+#define KDUMP_MAX_THREADS           8
+#define KDUMP_SLOTS_PER_THREAD      16
+#define KDUMP_BUF_SIZE              (1024 * 1024)
+#define KDUMP_DESC_BATCH            1024
+
+typedef struct QEMU_PACKED MakedumpfileHeader {
+    char signature[16];
+    int64_t type;
+    int64_t version;
+} MakedumpfileHeader;
+
+typedef struct QEMU_PACKED MakedumpfileDataHeader {
+    int64_t offset;
+    int64_t buf_size;
+} MakedumpfileDataHeader;
+
+typedef struct QEMU_PACKED NewUtsname {
+    char sysname[65];
+    char nodename[65];
+    char release[65];
+    char version[65];
+    char machine[65];
+    char domainname[65];
+} NewUtsname;
+
+typedef struct QEMU_PACKED DiskDumpHeader64 {
+    char signature[KDUMP_SIG_LEN];
+    uint32_t header_version;
+    NewUtsname utsname;
+    char timestamp[22];             /* struct timeval and its padding */
+    uint32_t status;
+    uint32_t block_size;
+    uint32_t sub_hdr_size;          /* in blocks */
+    uint32_t bitmap_blocks;
+    uint32_t max_mapnr;
+    uint32_t total_ram_blocks;
+    uint32_t device_blocks;
+    uint32_t written_blocks;
+    uint32_t current_cpu;
+    uint32_t nr_cpus;
+} DiskDumpHeader64;
+
+typedef struct QEMU_PACKED KdumpSubHeader64 {
+    uint64_t phys_base;
+    uint32_t dump_level;
+    uint32_t split;
+    uint64_t start_pfn;
+    uint64_t end_pfn;
+    uint64_t offset_vmcoreinfo;
+    uint64_t size_vmcoreinfo;
+    uint64_t offset_note;
+    uint64_t size_note;
+    uint64_t offset_eraseinfo;
+    uint64_t size_eraseinfo;
+    uint64_t start_pfn_64;
+    uint64_t end_pfn_64;
+    uint64_t max_mapnr_64;
+} KdumpSubHeader64;
+
+typedef struct PageDescriptor {
+    uint64_t offset;                /* of the data in the dump */
+    uint32_t size;
+    uint32_t flags;                 /* KDUMP_DH_COMPRESSED_* */
+    uint64_t page_flags;
+} PageDescriptor;
+
+typedef struct KdumpBlock {
+    RAMBlock *block;
+    /* descriptor of the first page of the block */
+    uint64_t index;
+} KdumpBlock;
+
+typedef enum {
+    KDUMP_SLOT_PENDING,
+    KDUMP_SLOT_BUSY,
+    KDUMP_SLOT_DONE,
+} KdumpSlotState;
+
+typedef struct KdumpSlot {
+    KdumpSlotState state;
+    uint64_t index;
+    uint8_t *host;
+    bool zero;
+    uint8_t *out;
+    /* length of the compressed page, 0 if it is stored as is */
+    unsigned long out_len;
+} KdumpSlot;
+
 typedef struct DumpState {
     ArchDumpInfo dump_info;
     MemoryMappingList list;
@@ -75,13 +203,61 @@ typedef struct DumpState {
     int64_t begin;
     int64_t length;
     Error **errp;
+
+    DumpGuestMemoryFormat format;
+    bool live;
+
+    /* kdump-compressed format */
+    uint32_t block_size;
+    uint64_t max_mapnr;
+    uint32_t sub_hdr_blocks;
+    uint32_t bitmap_blocks;
+    KdumpBlock *blocks;
+    int nr_blocks;
+    int64_t note_pos;
+    int64_t desc_offset;
+    int64_t zero_page_offset;
+    /* where the next page data goes */
+    int64_t data_offset;
+
+    /* records not yet written, the last one is still open */
+    uint8_t *buf;
+    size_t buf_len;
+    size_t rec_hdr;
+    int64_t rec_size;
+    int64_t rec_end;
+
+    /* consecutive page descriptors not yet written */
+    PageDescriptor *descs;
+    uint64_t desc_first;
+    int nr_descs;
+
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    KdumpSlot *slots;
+    int nb_slots;
+    /* oldest slot in use, the next one to be written */
+    int head;
+    int count;
+    /* slots after head that workers have already looked at */
+    int picked;
+    bool quit;
+    QemuThread *threads;
+    int nb_threads;
 } DumpState;
 
+static void kdump_threads_fini(DumpState *s);
+
 static int dump_cleanup(DumpState *s)
 {
     int ret = 0;
 
     memory_mapping_list_free(&s->list);
+    kdump_threads_fini(s);
+    g_free(s->blocks);
+    g_free(s->buf);
+    g_free(s->descs);
     if (s->fd != -1) {
         close(s->fd);
     }
@@ -672,6 +848,547 @@ static int create_vmcore(DumpState *s)
     return 0;
 }
 
+static void *kdump_thread_fn(void *opaque)
+{
+    DumpState *s = opaque;
+    KdumpSlot *slot;
+    unsigned long out_len;
+
+    qemu_mutex_lock(&s->lock);
+    while (!s->quit) {
+        slot = NULL;
+        while (s->picked < s->count) {
+            KdumpSlot *next = &s->slots[(s->head + s->picked++) % s->nb_slots];
+
+            if (next->state == KDUMP_SLOT_PENDING) {
+                slot = next;
+                break;
+            }
+        }
+        if (!slot) {
+            qemu_cond_wait(&s->work_cond, &s->lock);
+            continue;
+        }
+        slot->state = KDUMP_SLOT_BUSY;
+        qemu_mutex_unlock(&s->lock);
+
+        slot->zero = buffer_is_zero(slot->host, s->block_size);
+        slot->out_len = 0;
+        if (!slot->zero) {
+            out_len = compressBound(s->block_size);
+            if (compress2(slot->out, &out_len, slot->host, s->block_size,
+                          Z_BEST_SPEED) == Z_OK && out_len < s->block_size) {
+                slot->out_len = out_len;
+            }
+        }
+
+        qemu_mutex_lock(&s->lock);
+        slot->state = KDUMP_SLOT_DONE;
+        qemu_cond_broadcast(&s->done_cond);
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+static void kdump_threads_fini(DumpState *s)
+{
+    int i;
+
+    if (!s->threads) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->lock);
+    s->quit = true;
+    qemu_cond_broadcast(&s->work_cond);
+    qemu_mutex_unlock(&s->lock);
+
+    for (i = 0; i < s->nb_threads; i++) {
+        qemu_thread_join(&s->threads[i]);
+    }
+    g_free(s->threads);
+    s->threads = NULL;
+
+    for (i = 0; i < s->nb_slots; i++) {
+        g_free(s->slots[i].out);
+    }
+    g_free(s->slots);
+    s->slots = NULL;
+
+    qemu_cond_destroy(&s->done_cond);
+    qemu_cond_destroy(&s->work_cond);
+    qemu_mutex_destroy(&s->lock);
+}
+
+static void kdump_threads_init(DumpState *s)
+{
+    int i;
+
+    s->nb_threads = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+    s->nb_threads = MAX(1, MIN(sysconf(_SC_NPROCESSORS_ONLN),
+                               KDUMP_MAX_THREADS));
+#endif
+    s->nb_slots = s->nb_threads * KDUMP_SLOTS_PER_THREAD;
+    s->slots = g_new0(KdumpSlot, s->nb_slots);
+    for (i = 0; i < s->nb_slots; i++) {
+        s->slots[i].out = g_malloc(compressBound(s->block_size));
+    }
+    s->head = 0;
+    s->count = 0;
+    s->picked = 0;
+    s->quit = false;
+
+    qemu_mutex_init(&s->lock);
+    qemu_cond_init(&s->work_cond);
+    qemu_cond_init(&s->done_cond);
+
+    s->threads = g_new0(QemuThread, s->nb_threads);
+    for (i = 0; i < s->nb_threads; i++) {
+        qemu_thread_create(&s->threads[i], kdump_thread_fn, s,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void kdump_close_record(DumpState *s)
+{
+    if (s->rec_end != -1) {
+        stq_be_p(s->buf + s->rec_hdr + sizeof(int64_t), s->rec_size);
+        s->rec_end = -1;
+    }
+}
+
+static int kdump_flush(DumpState *s)
+{
+    kdump_close_record(s);
+    if (s->buf_len && fd_write_vmcore(s->buf, s->buf_len, s) < 0) {
+        return -1;
+    }
+    s->buf_len = 0;
+    return 0;
+}
+
+/* Write @size bytes at @offset of the dump, as one or more records */
+static int kdump_write(DumpState *s, int64_t offset, const void *buf,
+                       size_t size)
+{
+    size_t len;
+
+    while (size) {
+        if (s->buf_len + sizeof(MakedumpfileDataHeader) >= KDUMP_BUF_SIZE &&
+            kdump_flush(s) < 0) {
+            return -1;
+        }
+        /* data that follows the last record is appended to it */
+        if (offset != s->rec_end) {
+            kdump_close_record(s);
+            s->rec_hdr = s->buf_len;
+            stq_be_p(s->buf + s->buf_len, offset);
+            s->buf_len += sizeof(MakedumpfileDataHeader);
+            s->rec_size = 0;
+        }
+        len = MIN(size, KDUMP_BUF_SIZE - s->buf_len);
+        memcpy(s->buf + s->buf_len, buf, len);
+        s->buf_len += len;
+        s->rec_size += len;
+        s->rec_end = offset + len;
+
+        buf += len;
+        offset += len;
+        size -= len;
+    }
+    return 0;
+}
+
+static int kdump_write_note(void *buf, size_t size, void *opaque)
+{
+    DumpState *s = opaque;
+    int ret;
+
+    ret = kdump_write(s, s->note_pos, buf, size);
+    s->note_pos += size;
+    return ret;
+}
+
+static int kdump_flush_descs(DumpState *s)
+{
+    int ret = 0;
+
+    if (s->nr_descs) {
+        ret = kdump_write(s, s->desc_offset +
+                          s->desc_first * sizeof(PageDescriptor),
+                          s->descs, s->nr_descs * sizeof(PageDescriptor));
+        s->nr_descs = 0;
+    }
+    return ret;
+}
+
+static int kdump_add_desc(DumpState *s, uint64_t index, int64_t offset,
+                          uint32_t size, uint32_t flags)
+{
+    int endian = s->dump_info.d_endian;
+    PageDescriptor *pd;
+
+    if (s->nr_descs && (index != s->desc_first + s->nr_descs ||
+                        s->nr_descs == KDUMP_DESC_BATCH)) {
+        if (kdump_flush_descs(s) < 0) {
+            return -1;
+        }
+    }
+    if (!s->nr_descs) {
+        s->desc_first = index;
+    }
+
+    pd = &s->descs[s->nr_descs++];
+    pd->offset = cpu_convert_to_target64(offset, endian);
+    pd->size = cpu_convert_to_target32(size, endian);
+    pd->flags = cpu_convert_to_target32(flags, endian);
+    pd->page_flags = 0;
+    return 0;
+}
+
+/* Wait for the oldest slot and write its page and descriptor */
+static int kdump_write_head(DumpState *s)
+{
+    KdumpSlot *slot = &s->slots[s->head];
+    int ret;
+
+    qemu_mutex_lock(&s->lock);
+    while (slot->state != KDUMP_SLOT_DONE) {
+        qemu_cond_wait(&s->done_cond, &s->lock);
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    if (slot->zero) {
+        ret = kdump_add_desc(s, slot->index, s->zero_page_offset,
+                             s->block_size, 0);
+    } else if (slot->out_len) {
+        ret = kdump_add_desc(s, slot->index, s->data_offset, slot->out_len,
+                             KDUMP_DH_COMPRESSED_ZLIB);
+        if (ret == 0) {
+            ret = kdump_write(s, s->data_offset, slot->out, slot->out_len);
+        }
+        s->data_offset += slot->out_len;
+    } else {
+        ret = kdump_add_desc(s, slot->index, s->data_offset, s->block_size, 0);
+        if (ret == 0) {
+            ret = kdump_write(s, s->data_offset, slot->host, s->block_size);
+        }
+        s->data_offset += s->block_size;
+    }
+
+    qemu_mutex_lock(&s->lock);
+    s->head = (s->head + 1) % s->nb_slots;
+    s->count--;
+    if (s->picked) {
+        s->picked--;
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static int kdump_queue_page(DumpState *s, uint64_t index, uint8_t *host)
+{
+    KdumpSlot *slot;
+
+    if (s->count == s->nb_slots && kdump_write_head(s) < 0) {
+        return -1;
+    }
+
+    slot = &s->slots[(s->head + s->count) % s->nb_slots];
+    slot->index = index;
+    slot->host = host;
+
+    qemu_mutex_lock(&s->lock);
+    slot->state = KDUMP_SLOT_PENDING;
+    s->count++;
+    qemu_cond_signal(&s->work_cond);
+    qemu_mutex_unlock(&s->lock);
+
+    return 0;
+}
+
+/*
+ * Write every page, or with @dirty only the pages written by the guest
+ * since the first pass of a live dump.  Their new descriptor replaces
+ * the one of the first pass.
+ */
+static int kdump_write_pages(DumpState *s, bool dirty)
+{
+    ram_addr_t offset;
+    int i;
+
+    for (i = 0; i < s->nr_blocks; i++) {
+        RAMBlock *block = s->blocks[i].block;
+
+        for (offset = 0; offset < block->length; offset += s->block_size) {
+            if (dirty && !memory_region_get_dirty(block->mr, offset,
+                                                  s->block_size,
+                                                  DIRTY_MEMORY_DUMP)) {
+                continue;
+            }
+            if (kdump_queue_page(s, s->blocks[i].index +
+                                 (offset >> TARGET_PAGE_BITS),
+                                 block->host + offset) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    while (s->count) {
+        if (kdump_write_head(s) < 0) {
+            return -1;
+        }
+    }
+    return kdump_flush_descs(s);
+}
+
+/* write the headers, the notes, the bitmaps and the zero page */
+static int kdump_write_headers(DumpState *s)
+{
+    int endian = s->dump_info.d_endian;
+    uint64_t len_bitmap = (uint64_t)s->bitmap_blocks / 2 * s->block_size;
+    DiskDumpHeader64 dh;
+    KdumpSubHeader64 kh;
+    CPUArchState *env;
+    uint8_t *bitmap;
+    uint64_t pfn, end;
+    int64_t offset;
+    int nr_cpus = 0;
+    int i, ret;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        nr_cpus++;
+    }
+
+    memset(&dh, 0, sizeof(dh));
+    memcpy(dh.signature, KDUMP_SIGNATURE, KDUMP_SIG_LEN);
+    dh.header_version = cpu_convert_to_target32(KDUMP_HEADER_VERSION, endian);
+    if (s->dump_info.d_machine == EM_X86_64) {
+        pstrcpy(dh.utsname.machine, sizeof(dh.utsname.machine), "x86_64");
+    }
+    dh.status = cpu_convert_to_target32(KDUMP_DH_COMPRESSED_ZLIB, endian);
+    dh.block_size = cpu_convert_to_target32(s->block_size, endian);
+    dh.sub_hdr_size = cpu_convert_to_target32(s->sub_hdr_blocks, endian);
+    dh.bitmap_blocks = cpu_convert_to_target32(s->bitmap_blocks, endian);
+    dh.max_mapnr = cpu_convert_to_target32(MIN(s->max_mapnr, UINT32_MAX),
+                                           endian);
+    dh.nr_cpus = cpu_convert_to_target32(nr_cpus, endian);
+    if (kdump_write(s, 0, &dh, sizeof(dh)) < 0) {
+        return -1;
+    }
+
+    memset(&kh, 0, sizeof(kh));
+    kh.offset_note = cpu_convert_to_target64(s->block_size + sizeof(kh),
+                                             endian);
+    kh.size_note = cpu_convert_to_target64(s->note_size, endian);
+    kh.end_pfn_64 = cpu_convert_to_target64(s->max_mapnr, endian);
+    kh.max_mapnr_64 = cpu_convert_to_target64(s->max_mapnr, endian);
+    if (kdump_write(s, s->block_size, &kh, sizeof(kh)) < 0) {
+        return -1;
+    }
+
+    s->note_pos = s->block_size + sizeof(kh);
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (cpu_write_elf64_note(kdump_write_note, env, cpu_index(env),
+                                 s) < 0) {
+            return -1;
+        }
+    }
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (cpu_write_elf64_qemunote(kdump_write_note, env, s) < 0) {
+            return -1;
+        }
+    }
+
+    /* every page of RAM is both valid and dumped */
+    bitmap = g_malloc0(len_bitmap);
+    for (i = 0; i < s->nr_blocks; i++) {
+        pfn = s->blocks[i].block->offset >> TARGET_PAGE_BITS;
+        end = pfn + (s->blocks[i].block->length >> TARGET_PAGE_BITS);
+        for (; pfn < end; pfn++) {
+            bitmap[pfn / CHAR_BIT] |= 1 << (pfn % CHAR_BIT);
+        }
+    }
+    offset = (int64_t)s->block_size * (1 + s->sub_hdr_blocks);
+    ret = kdump_write(s, offset, bitmap, len_bitmap);
+    if (ret == 0) {
+        ret = kdump_write(s, offset + len_bitmap, bitmap, len_bitmap);
+    }
+    g_free(bitmap);
+    if (ret < 0) {
+        return -1;
+    }
+
+    bitmap = g_malloc0(s->block_size);
+    ret = kdump_write(s, s->zero_page_offset, bitmap, s->block_size);
+    g_free(bitmap);
+    return ret;
+}
+
+static int kdump_block_cmp(const void *a, const void *b)
+{
+    const KdumpBlock *x = a, *y = b;
+
+    return x->block->offset < y->block->offset ? -1 :
+           x->block->offset > y->block->offset;
+}
+
+/* lay out the dump and write the flattened format's header */
+static int kdump_begin(DumpState *s)
+{
+    MakedumpfileHeader *mh;
+    RAMBlock *block;
+    uint64_t nr_pages = 0, len_bitmap;
+    int i, ret;
+
+    s->nr_blocks = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        s->nr_blocks++;
+    }
+    s->blocks = g_new0(KdumpBlock, s->nr_blocks);
+    i = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        s->blocks[i++].block = block;
+    }
+    /* descriptors are in pfn order */
+    qsort(s->blocks, s->nr_blocks, sizeof(KdumpBlock), kdump_block_cmp);
+
+    s->max_mapnr = 0;
+    for (i = 0; i < s->nr_blocks; i++) {
+        block = s->blocks[i].block;
+        s->blocks[i].index = nr_pages;
+        nr_pages += block->length >> TARGET_PAGE_BITS;
+        s->max_mapnr = MAX(s->max_mapnr,
+                           (block->offset + block->length) >> TARGET_PAGE_BITS);
+    }
+
+    s->block_size = TARGET_PAGE_SIZE;
+    s->sub_hdr_blocks = DIV_ROUND_UP(sizeof(KdumpSubHeader64) + s->note_size,
+                                     s->block_size);
+    len_bitmap = QEMU_ALIGN_UP(DIV_ROUND_UP(s->max_mapnr, CHAR_BIT),
+                               s->block_size);
+    s->bitmap_blocks = len_bitmap / s->block_size * 2;
+    s->desc_offset = (int64_t)s->block_size *
+                     (1 + s->sub_hdr_blocks + s->bitmap_blocks);
+    s->zero_page_offset = QEMU_ALIGN_UP(s->desc_offset +
+                                        nr_pages * sizeof(PageDescriptor),
+                                        s->block_size);
+    s->data_offset = s->zero_page_offset + s->block_size;
+
+    s->buf = g_malloc(KDUMP_BUF_SIZE);
+    s->buf_len = 0;
+    s->rec_end = -1;
+    s->descs = g_new(PageDescriptor, KDUMP_DESC_BATCH);
+    s->nr_descs = 0;
+    kdump_threads_init(s);
+
+    mh = g_malloc0(MAKEDUMPFILE_HEADER_SIZE);
+    pstrcpy(mh->signature, sizeof(mh->signature), MAKEDUMPFILE_SIGNATURE);
+    mh->type = cpu_to_be64(MAKEDUMPFILE_TYPE_FLAT);
+    mh->version = cpu_to_be64(MAKEDUMPFILE_VERSION_FLAT);
+    ret = fd_write_vmcore(mh, MAKEDUMPFILE_HEADER_SIZE, s);
+    g_free(mh);
+    return ret;
+}
+
+static int kdump_end(DumpState *s)
+{
+    MakedumpfileDataHeader mdh;
+
+    if (kdump_flush(s) < 0) {
+        return -1;
+    }
+    mdh.offset = cpu_to_be64(MAKEDUMPFILE_END);
+    mdh.buf_size = cpu_to_be64(MAKEDUMPFILE_END);
+    return fd_write_vmcore(&mdh, sizeof(mdh), s);
+}
+
+static int create_kdump_vmcore(DumpState *s)
+{
+    if (kdump_begin(s) < 0 || kdump_write_headers(s) < 0 ||
+        kdump_write_pages(s, false) < 0 || kdump_end(s) < 0) {
+        dump_error(s, "dump: failed to write kdump-compressed vmcore.\n");
+        return -1;
+    }
+
+    dump_completed(s);
+    return 0;
+}
+
+/*
+ * A live dump writes all pages while the guest runs, then stops it and
+ * writes the CPU state and the pages it wrote meanwhile.
+ */
+static Error *dump_live_blocker;
+
+static void *dump_live_thread(void *opaque)
+{
+    DumpState *s = opaque;
+    CPUArchState *env;
+    int ret;
+
+    qemu_mutex_lock_ramlist();
+    ret = kdump_begin(s);
+    if (ret == 0) {
+        ret = kdump_write_pages(s, false);
+    }
+    qemu_mutex_unlock_ramlist();
+
+    qemu_mutex_lock_iothread();
+    if (runstate_is_running()) {
+        vm_stop_force_state(RUN_STATE_SAVE_VM);
+        s->resume = true;
+    }
+    if (ret == 0) {
+        memory_global_sync_dirty_bitmap(get_system_memory());
+        for (env = first_cpu; env != NULL; env = env->next_cpu) {
+            cpu_synchronize_state(env);
+        }
+        if (kdump_write_headers(s) < 0 || kdump_write_pages(s, true) < 0 ||
+            kdump_end(s) < 0) {
+            ret = -1;
+        }
+    }
+    memory_global_dirty_log_stop();
+    migrate_del_blocker(dump_live_blocker);
+    error_free(dump_live_blocker);
+    dump_live_blocker = NULL;
+
+    monitor_protocol_event(QEVENT_DUMP_COMPLETED,
+                           qobject_from_jsonf("{ 'status': %s }",
+                                              ret < 0 ? "failed" :
+                                                        "completed"));
+    if (ret < 0) {
+        fprintf(stderr, "dump: failed to write live kdump-compressed "
+                "vmcore\n");
+    }
+    dump_cleanup(s);
+    g_free(s);
+    qemu_mutex_unlock_iothread();
+
+    return NULL;
+}
+
+static void dump_live_start(DumpState *s)
+{
+    QemuThread thread;
+    RAMBlock *block;
+
+    error_set(&dump_live_blocker, QERR_DEVICE_FEATURE_BLOCKS_MIGRATION,
+              "live", "dump-guest-memory");
+    migrate_add_blocker(dump_live_blocker);
+
+    memory_global_dirty_log_start();
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        memory_region_reset_dirty(block->mr, 0, block->length,
+                                  DIRTY_MEMORY_DUMP);
+    }
+    qemu_thread_create(&thread, dump_live_thread, s, QEMU_THREAD_DETACHED);
+}
+
 static ram_addr_t get_start_block(DumpState *s)
 {
     RAMBlock *block;
@@ -701,13 +1418,16 @@ static ram_addr_t get_start_block(DumpState *s)
 }
 
 static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
-                     int64_t begin, int64_t length, Error **errp)
+                     int64_t begin, int64_t length,
+                     DumpGuestMemoryFormat format, bool live, Error **errp)
 {
     CPUArchState *env;
     int nr_cpus;
     int ret;
 
-    if (runstate_is_running()) {
+    s->format = format;
+    s->live = live;
+    if (!live && runstate_is_running()) {
         vm_stop(RUN_STATE_SAVE_VM);
         s->resume = true;
     } else {
@@ -745,6 +1465,13 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
         goto cleanup;
     }
 
+    /* only the 64-bit kdump headers are written */
+    if (format == DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZLIB &&
+        s->dump_info.d_class != ELFCLASS64) {
+        error_set(errp, QERR_UNSUPPORTED);
+        goto cleanup;
+    }
+
     s->note_size = cpu_get_note_size(s->dump_info.d_class,
                                      s->dump_info.d_machine, nr_cpus);
     if (ret < 0) {
@@ -818,7 +1545,8 @@ cleanup:
 
 void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
                            int64_t begin, bool has_length, int64_t length,
-                           Error **errp)
+                           bool has_format, DumpGuestMemoryFormat format,
+                           bool has_live, bool live, Error **errp)
 {
     const char *p;
     int fd = -1;
@@ -833,6 +1561,30 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
         error_set(errp, QERR_MISSING_PARAMETER, "begin");
         return;
     }
+    if (!has_format) {
+        format = DUMP_GUEST_MEMORY_FORMAT_ELF;
+    }
+    if (!has_live) {
+        live = false;
+    }
+    /* kdump-compressed dumps have all of RAM and no memory mapping */
+    if (format != DUMP_GUEST_MEMORY_FORMAT_ELF && (paging || has_begin)) {
+        error_set(errp, QERR_INVALID_PARAMETER_COMBINATION);
+        return;
+    }
+    if (live && format == DUMP_GUEST_MEMORY_FORMAT_ELF) {
+        error_set(errp, QERR_INVALID_PARAMETER_COMBINATION);
+        return;
+    }
+    if (dump_live_blocker) {
+        error_set(errp, QERR_DUMP_IN_PROGRESS);
+        return;
+    }
+    /* the dirty log is shared with migration */
+    if (live && migration_in_progress()) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
 
 #if !defined(WIN32)
     if (strstart(file, "fd:", &p)) {
@@ -857,15 +1609,27 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
         return;
     }
 
-    s = g_malloc(sizeof(DumpState));
+    s = g_malloc0(sizeof(DumpState));
 
-    ret = dump_init(s, fd, paging, has_begin, begin, length, errp);
+    ret = dump_init(s, fd, paging, has_begin, begin, length, format, live,
+                    errp);
     if (ret < 0) {
         g_free(s);
         return;
     }
 
-    if (create_vmcore(s) < 0 && !error_is_set(s->errp)) {
+    if (live) {
+        /* the thread frees s and emits DUMP_COMPLETED */
+        dump_live_start(s);
+        return;
+    }
+
+    if (format == DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZLIB) {
+        ret = create_kdump_vmcore(s);
+    } else {
+        ret = create_vmcore(s);
+    }
+    if (ret < 0 && !error_is_set(s->errp)) {
         error_set(errp, QERR_IO_ERROR);
     }
 
@@ -74,6 +74,11 @@ extern target_ulong gen_opc_pc[OPC_BUF_SIZE];
 extern uint8_t gen_opc_instr_start[OPC_BUF_SIZE];
 extern uint16_t gen_opc_icount[OPC_BUF_SIZE];
 
+/* cpu_restore_state() calls, and those that had to generate the host
+   code again because the TB has no tc_search data */
+extern uint64_t tb_restore_count;
+extern uint64_t tb_restore_regen_count;
+
 #include "qemu-log.h"
 
 void gen_intermediate_code(CPUArchState *env, struct TranslationBlock *tb);
@@ -105,6 +110,9 @@ void tlb_flush(CPUArchState *env, int flush_global);
 void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                   target_phys_addr_t paddr, int prot,
                   int mmu_idx, target_ulong size);
+void tlb_flush_request(CPUArchState *env);
+bool tlb_victim_lookup(CPUArchState *env, int mmu_idx, int index,
+                       target_ulong addr, int access);
 void tb_invalidate_phys_addr(target_phys_addr_t addr);
 #else
 static inline void tlb_flush_page(CPUArchState *env, target_ulong addr)
@@ -114,12 +122,16 @@ static inline void tlb_flush_page(CPUArchState *env, target_ulong addr)
 static inline void tlb_flush(CPUArchState *env, int flush_global)
 {
 }
+
+static inline void tlb_flush_request(CPUArchState *env)
+{
+}
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
+/* initial size of the physical TB hash; it grows with the number of TBs */
 #define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
 
 #define MIN_CODE_GEN_BUFFER_SIZE     (1024 * 1024)
 
@@ -149,6 +161,8 @@ struct TranslationBlock {
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
+    /* which op each part of the code comes from, see tcg_search_pc() */
+    uint8_t *tc_search;
     /* next matching tb for physical address. */
     struct TranslationBlock *phys_hash_next;
     /* first and second physical page containing code. The lower bit
@@ -171,8 +185,23 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    uint8_t region;     /* code buffer region holding tc_ptr */
+    bool invalid;       /* removed by tb_phys_invalidate() */
+    bool nocache;       /* must not be saved in the translation cache */
 };
 
+/* The code buffer is split into regions that are filled one after the
+   other; when all are full, the least recently used one is evicted.  */
+#define TB_MAX_REGIONS 8
+
+extern unsigned int tb_region_clock;
+extern unsigned int tb_region_last_use[TB_MAX_REGIONS];
+
+static inline void tb_region_touch(TranslationBlock *tb)
+{
+    tb_region_last_use[tb->region] = tb_region_clock;
+}
+
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
 {
     target_ulong tmp;
@@ -188,9 +217,33 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 	    | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
+/* Hash table of all TBs, keyed on everything tb_find_slow() compares.
+   A resize builds a new table and then publishes it with a single pointer
+   store, so a lookup only needs to load tb_phys_hash once.  */
+typedef struct TBPhysHash {
+    unsigned int bits;
+    struct TranslationBlock *buckets[];
+} TBPhysHash;
+
+extern TBPhysHash *tb_phys_hash;
+
+static inline uint64_t tb_hash_mix(tb_page_addr_t phys_pc, target_ulong pc,
+                                   uint64_t flags, target_ulong cs_base)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    uint64_t h;
+
+    h = (uint64_t)phys_pc * 0x9e3779b97f4a7c15ULL;
+    h ^= ((uint64_t)pc ^ ((uint64_t)cs_base << 32)) * 0xc2b2ae3d27d4eb4fULL;
+    h ^= flags * 0x165667b19e3779f9ULL;
+    return h ^ (h >> 29);
+}
+
+static inline unsigned int tb_phys_hash_func(TBPhysHash *hash,
+                                             tb_page_addr_t phys_pc,
+                                             target_ulong pc, uint64_t flags,
+                                             target_ulong cs_base)
+{
+    return tb_hash_mix(phys_pc, pc, flags, cs_base) >> (64 - hash->bits);
 }
 
 void tb_free(TranslationBlock *tb);
@@ -198,8 +251,18 @@ void tb_flush(CPUArchState *env);
 void tb_link_page(TranslationBlock *tb,
                   tb_page_addr_t phys_pc, tb_page_addr_t phys_page2);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
+extern int tb_gen_uncacheable;
+void *tb_lookup_tc_ptr(CPUArchState *env);
 
-extern TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+#if defined(CONFIG_USER_ONLY)
+/* persistent translation cache (linux-user) */
+void tb_cache_init(const char *dir, const char *filename,
+                   const char *cpu_model, int singlestep);
+void tb_cache_load(void);
+void tb_cache_save(void);
+TranslationBlock *tb_cache_lookup(target_ulong pc, target_ulong cs_base,
+                                  uint64_t flags);
+#endif
 
 #if defined(USE_DIRECT_JUMP)
 
@@ -288,6 +351,41 @@ extern spinlock_t tb_lock;
 
 extern int tb_invalidated_flag;
 
+void tb_flush_exclusive(CPUArchState *env);
+
+#if !defined(CONFIG_USER_ONLY)
+/* Multi-threaded TCG (-machine mttcg=on): each vCPU runs cpu_exec() in its
+   own thread and only takes the global mutex for device access.
+   Translation is serialized by tcg_tb_lock().  Flushing the translation
+   cache needs every vCPU out of cpu_exec(), so tb_flush() only sets
+   tb_flush_pending and the vCPU threads call tb_flush_exclusive().  */
+extern bool mttcg_enabled;
+extern volatile int tb_flush_pending;
+
+void tcg_tb_lock(void);
+void tcg_tb_unlock(void);
+void tcg_tb_lock_reset(void);
+void phys_map_lock(void);
+void phys_map_unlock(void);
+
+/* cpus.c */
+void qemu_tcg_io_lock(void);
+void qemu_tcg_io_unlock(void);
+void qemu_tcg_atomic_lock(void);
+void qemu_tcg_atomic_unlock(void);
+void qemu_tcg_cpu_unwind(void);
+void qemu_tcg_tlb_flush_service(CPUArchState *env);
+void qemu_tcg_tlb_flush_others(CPUArchState *env);
+#else
+static inline void tcg_tb_lock(void)
+{
+}
+
+static inline void tcg_tb_unlock(void)
+{
+}
+#endif
+
 /* The return address may point to the start of the next instruction.
    Subtracting one gets us the call instruction itself.  */
 #if defined(CONFIG_TCG_INTERPRETER)
@@ -308,6 +406,28 @@ extern uintptr_t tci_tb_ptr;
 # define GETPC() ((uintptr_t)__builtin_return_address(0) - 1)
 #endif
 
+#if defined(CONFIG_QEMU_LDST_OPTIMIZATION) && defined(CONFIG_SOFTMMU)
+/* The softmmu load/store helpers are called from TLB miss paths placed at
+   the end of the TB, which jump back to the fast path when done.  Right
+   after the call the backend puts a short jump over the offset from the
+   return address to the fast path, which is what exception handling must
+   see as the position in the TB.  */
+bool is_tcg_gen_code(uintptr_t pc);
+
+static inline uintptr_t tcg_getpc_ldst(uintptr_t ra)
+{
+    const uint8_t *p = (const uint8_t *)ra;
+
+    if (is_tcg_gen_code(ra) && p[0] == 0xeb && p[1] == 4) {
+        return ra + *(const int32_t *)(p + 2) - 1;
+    }
+    return ra - 1;
+}
+# define GETPC_LDST() tcg_getpc_ldst((uintptr_t)__builtin_return_address(0))
+#else
+# define GETPC_LDST() GETPC()
+#endif
+
 #if !defined(CONFIG_USER_ONLY)
 
 struct MemoryRegion *iotlb_to_region(target_phys_addr_t index);
@@ -315,6 +435,8 @@ uint64_t io_mem_read(struct MemoryRegion *mr, target_phys_addr_t addr,
                      unsigned size);
 void io_mem_write(struct MemoryRegion *mr, target_phys_addr_t addr,
                   uint64_t value, unsigned size);
+bool notdirty_write_fast(CPUArchState *env, ram_addr_t ram_addr,
+                         target_ulong vaddr);
 
 void tlb_fill(CPUArchState *env1, target_ulong addr, int is_write, int mmu_idx,
               uintptr_t retaddr);
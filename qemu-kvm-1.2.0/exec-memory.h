@@ -39,6 +39,9 @@ void set_system_memory_map(MemoryRegion *mr);
 /* Set the I/O memory region.  This region is the I/O memory map. */
 void set_system_io_map(MemoryRegion *mr);
 
+/* Print usage statistics of the DMA bounce buffer pool. */
+void dma_bounce_info(fprintf_function mon_printf, void *f);
+
 #endif
 
 #endif
@@ -38,12 +38,15 @@ void cpu_register_physical_memory_log(struct MemoryRegionSection *section,
 
 void qemu_register_coalesced_mmio(target_phys_addr_t addr, ram_addr_t size);
 void qemu_unregister_coalesced_mmio(target_phys_addr_t addr, ram_addr_t size);
+void qemu_register_coalesced_pio(target_phys_addr_t addr, ram_addr_t size);
+void qemu_unregister_coalesced_pio(target_phys_addr_t addr, ram_addr_t size);
 
 int cpu_physical_memory_set_dirty_tracking(int enable);
 
 #define VGA_DIRTY_FLAG       0x01
 #define CODE_DIRTY_FLAG      0x02
 #define MIGRATION_DIRTY_FLAG 0x08
+#define DUMP_DIRTY_FLAG      0x10
 
 static inline int cpu_physical_memory_get_dirty_flags(ram_addr_t addr)
 {
@@ -56,19 +59,34 @@ static inline int cpu_physical_memory_is_dirty(ram_addr_t addr)
     return cpu_physical_memory_get_dirty_flags(addr) == 0xff;
 }
 
+/* whether any page in the range has one of dirty_flags set */
 static inline int cpu_physical_memory_get_dirty(ram_addr_t start,
                                                 ram_addr_t length,
                                                 int dirty_flags)
 {
-    int ret = 0;
-    ram_addr_t addr, end;
-
-    end = TARGET_PAGE_ALIGN(start + length);
-    start &= TARGET_PAGE_MASK;
-    for (addr = start; addr < end; addr += TARGET_PAGE_SIZE) {
-        ret |= cpu_physical_memory_get_dirty_flags(addr) & dirty_flags;
+    /* dirty_flags in every byte, to test sizeof(long) pages at once */
+    unsigned long mask = (unsigned long)dirty_flags * (~0UL / 0xff);
+    const uint8_t *flags = ram_list.phys_dirty;
+    ram_addr_t page, end;
+
+    end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+    page = start >> TARGET_PAGE_BITS;
+    for (; page < end && (page % sizeof(long)); page++) {
+        if (flags[page] & dirty_flags) {
+            return 1;
+        }
+    }
+    for (; page + sizeof(long) <= end; page += sizeof(long)) {
+        if (*(unsigned long *)(flags + page) & mask) {
+            return 1;
+        }
     }
-    return ret;
+    for (; page < end; page++) {
+        if (flags[page] & dirty_flags) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
 static inline int cpu_physical_memory_set_dirty_flags(ram_addr_t addr,
@@ -113,6 +131,56 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
     }
 }
 
+/*
+ * Mark dirty the pages whose bits are set in the little endian @bitmap,
+ * @pages_per_bit pages per bit starting at @start.  The bitmap is walked a
+ * word at a time, so clean stretches cost one test per HOST_LONG_BITS bits.
+ *
+ * Several threads may mark disjoint ranges at the same time, the dirty
+ * page count is updated atomically once at the end.
+ */
+static inline void cpu_physical_memory_set_dirty_lebitmap(
+    const unsigned long *bitmap, ram_addr_t start, unsigned long nbits,
+    unsigned pages_per_bit)
+{
+    uint8_t *dirty = ram_list.phys_dirty + (start >> TARGET_PAGE_BITS);
+    unsigned long len = (nbits + HOST_LONG_BITS - 1) / HOST_LONG_BITS;
+    unsigned long i, j, k, page;
+    uint64_t newly_dirty = 0;
+
+    for (i = 0; i < len; i++) {
+        unsigned long c;
+
+        if (bitmap[i] == 0) {
+            continue;
+        }
+
+        c = leul_to_cpu(bitmap[i]);
+        if (c == ~0UL && pages_per_bit == 1) {
+            page = i * HOST_LONG_BITS;
+            for (k = 0; k < HOST_LONG_BITS; k++) {
+                newly_dirty += !(dirty[page + k] & MIGRATION_DIRTY_FLAG);
+            }
+            memset(dirty + page, 0xff, HOST_LONG_BITS);
+            continue;
+        }
+
+        do {
+            j = ffsl(c) - 1;
+            c &= ~(1ul << j);
+            page = (i * HOST_LONG_BITS + j) * pages_per_bit;
+            for (k = 0; k < pages_per_bit; k++) {
+                newly_dirty += !(dirty[page + k] & MIGRATION_DIRTY_FLAG);
+                dirty[page + k] = 0xff;
+            }
+        } while (c != 0);
+    }
+
+    if (newly_dirty) {
+        __sync_fetch_and_add(&ram_list.dirty_pages, newly_dirty);
+    }
+}
+
 static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
                                                         ram_addr_t length,
                                                         int dirty_flags)
@@ -55,9 +55,13 @@
 #else /* !CONFIG_USER_ONLY */
 #include "xen-mapcache.h"
 #include "trace.h"
+#include "sysemu.h"
+#include "bitmap.h"
 #endif
 
 #include "cputlb.h"
+#include "qemu-barrier.h"
+#include "qemu-tls.h"
 
 #define WANT_EXEC_OBSOLETE
 #include "exec-obsolete.h"
@@ -81,11 +85,20 @@
 
 static TranslationBlock *tbs;
 static int code_gen_max_blocks;
-TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+TBPhysHash *tb_phys_hash;
+/* the hash stops growing once it has a bucket for every possible TB */
+static unsigned int tb_phys_hash_max_bits;
 static int nb_tbs;
 /* any access to the tbs or the page table must use this lock */
 spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
 
+#if !defined(CONFIG_USER_ONLY)
+/* the same for MTTCG vCPU threads, which spin_lock() does not cover */
+static QemuMutex tb_mutex;
+static DEFINE_TLS(int, tb_lock_depth);
+volatile int tb_flush_pending;
+#endif
+
 #if defined(__arm__) || defined(__sparc_v9__)
 /* The prologue must be reachable with a direct jump. ARM and Sparc64
  have limited branch ranges (possibly also PPC) so place it in a
@@ -108,6 +121,33 @@ static unsigned long code_gen_buffer_size;
 static unsigned long code_gen_buffer_max_size;
 static uint8_t *code_gen_ptr;
 
+typedef struct TBRegion {
+    uint8_t *code_start;
+    uint8_t *code_end;          /* end of the code generated so far */
+    int first_tb;               /* index of the region's TBs in tbs[] */
+    int nb_tbs;
+} TBRegion;
+
+static TBRegion tb_regions[TB_MAX_REGIONS];
+static int tb_nb_regions;
+static int tb_cur_region;
+static unsigned long tb_region_size;
+static int tb_region_max_blocks;
+static int tb_region_evict_count;
+/* bumped whenever a region is (re)started; tb_region_touch() stamps the
+   region of every TB looked up with the current value */
+unsigned int tb_region_clock;
+unsigned int tb_region_last_use[TB_MAX_REGIONS];
+/* set by the translator when the code it generates embeds host pointers
+   that are only meaningful in this process */
+int tb_gen_uncacheable;
+
+#if defined(CONFIG_USER_ONLY)
+/* TBs translated since startup, i.e. not taken from the cache */
+static int tb_cache_generated;
+static void tb_cache_flush(void);
+#endif
+
 #if !defined(CONFIG_USER_ONLY)
 int phys_ram_fd;
 static int in_migration;
@@ -138,6 +178,8 @@ typedef struct PageDesc {
        of lookups we do to a given page to use a bitmap */
     unsigned int code_write_count;
     uint8_t *code_bitmap;
+    /* writes to the page that did not hit any translated code */
+    unsigned int code_write_skip;
 #if defined(CONFIG_USER_ONLY)
     unsigned long flags;
 #endif
@@ -194,6 +236,11 @@ static uint16_t phys_section_notdirty;
 static uint16_t phys_section_rom;
 static uint16_t phys_section_watch;
 
+/* MTTCG vCPUs fill their TLBs without the global mutex; this keeps them
+   from looking at phys_map and phys_sections while they are rebuilt.  */
+static QemuMutex phys_map_mutex;
+static DEFINE_TLS(int, phys_map_lock_depth);
+
 struct PhysPageEntry {
     uint16_t is_leaf : 1;
      /* index into phys_sections (is_leaf) or phys_map_nodes (!is_leaf) */
@@ -219,6 +266,38 @@ static MemoryRegion io_mem_watch;
 /* statistics */
 static int tb_flush_count;
 static int tb_phys_invalidate_count;
+/* translation cost, for "info jit" */
+static uint64_t tb_gen_count;
+static uint64_t tb_gen_time;
+static uint64_t tb_gen_guest_insns;
+static uint64_t tb_gen_host_bytes;
+static uint64_t tb_gen_search_bytes;
+static unsigned int smc_write_skip_count;
+static unsigned int smc_write_skip_max;
+static tb_page_addr_t smc_write_skip_max_page;
+static uint64_t tb_io_recompile_count;
+static uint64_t tb_io_hint_count;
+
+/* Blocks that cpu_io_recompile() had to cut short at an I/O instruction.
+   When one of them is translated again, e.g. after a flush, it is ended
+   at that instruction right away instead of after another fault.  Only
+   used with -icount.  */
+#define TB_IO_HINT_BITS 10
+
+typedef struct TBIOHint {
+    tb_page_addr_t phys_pc;
+    target_ulong cs_base;
+    uint64_t flags;
+    uint16_t cflags;            /* 0 if unused */
+} TBIOHint;
+
+static TBIOHint tb_io_hints[1 << TB_IO_HINT_BITS];
+
+static inline TBIOHint *tb_io_hint(tb_page_addr_t phys_pc)
+{
+    return &tb_io_hints[(phys_pc ^ (phys_pc >> TB_IO_HINT_BITS)) &
+                        ((1 << TB_IO_HINT_BITS) - 1)];
+}
 
 #ifdef _WIN32
 static void map_exec(void *addr, long size)
@@ -508,7 +587,40 @@ bool memory_region_is_unassigned(MemoryRegion *mr)
 #ifdef USE_STATIC_CODE_GEN_BUFFER
 static uint8_t static_code_gen_buffer[DEFAULT_CODE_GEN_BUFFER_SIZE]
                __attribute__((aligned (CODE_GEN_ALIGN)));
+/* static as well, so that TB addresses embedded in the generated code are
+   the same from one run to the next (see tb_cache_load()) */
+static TranslationBlock static_tbs[DEFAULT_CODE_GEN_BUFFER_SIZE /
+                                   CODE_GEN_AVG_BLOCK_SIZE];
+#endif
+
+static void tb_regions_init(void)
+{
+    int i;
+
+#if defined(CONFIG_USER_ONLY)
+    /* other guest threads may be running code from any region */
+    tb_nb_regions = 1;
+#else
+    /* each region must be able to hold many maximum size TBs */
+    tb_nb_regions = TB_MAX_REGIONS;
+    while (tb_nb_regions > 1 &&
+           code_gen_buffer_size / tb_nb_regions <
+           4 * TCG_MAX_OP_SIZE * OPC_BUF_SIZE) {
+        tb_nb_regions--;
+    }
 #endif
+    tb_region_size = (code_gen_buffer_size / tb_nb_regions) &
+        ~(unsigned long)(CODE_GEN_ALIGN - 1);
+    tb_region_max_blocks = code_gen_max_blocks / tb_nb_regions;
+    for (i = 0; i < tb_nb_regions; i++) {
+        tb_regions[i].code_start = code_gen_buffer + i * tb_region_size;
+        tb_regions[i].code_end = tb_regions[i].code_start;
+        tb_regions[i].first_tb = i * tb_region_max_blocks;
+        tb_regions[i].nb_tbs = 0;
+    }
+    tb_cur_region = 0;
+    tb_region_last_use[0] = ++tb_region_clock;
+}
 
 static void code_gen_alloc(unsigned long tb_size)
 {
@@ -607,7 +719,21 @@ static void code_gen_alloc(unsigned long tb_size)
     code_gen_buffer_max_size = code_gen_buffer_size -
         (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
     code_gen_max_blocks = code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
+#ifdef USE_STATIC_CODE_GEN_BUFFER
+    tbs = static_tbs;
+#else
     tbs = g_malloc(code_gen_max_blocks * sizeof(TranslationBlock));
+#endif
+
+    tb_phys_hash = g_malloc0(sizeof(TBPhysHash) +
+                             (sizeof(TranslationBlock *) <<
+                              CODE_GEN_PHYS_HASH_BITS));
+    tb_phys_hash->bits = CODE_GEN_PHYS_HASH_BITS;
+    tb_phys_hash_max_bits = CODE_GEN_PHYS_HASH_BITS;
+    while ((1 << tb_phys_hash_max_bits) < code_gen_max_blocks) {
+        tb_phys_hash_max_bits++;
+    }
+    tb_regions_init();
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -635,6 +761,9 @@ bool tcg_enabled(void)
 void cpu_exec_init_all(void)
 {
 #if !defined(CONFIG_USER_ONLY)
+    qemu_mutex_init(&ram_list.mutex);
+    qemu_mutex_init(&tb_mutex);
+    qemu_mutex_init(&phys_map_mutex);
     memory_map_init();
     io_mem_init();
 #endif
@@ -718,24 +847,34 @@ void cpu_exec_init(CPUArchState *env)
    too many translation blocks or too much generated code. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBRegion *r = &tb_regions[tb_cur_region];
     TranslationBlock *tb;
 
-    if (nb_tbs >= code_gen_max_blocks ||
-        (code_gen_ptr - code_gen_buffer) >= code_gen_buffer_max_size)
+    if (r->nb_tbs >= tb_region_max_blocks ||
+        code_gen_ptr >= r->code_start + tb_region_size -
+                        TCG_MAX_OP_SIZE * OPC_BUF_SIZE)
         return NULL;
-    tb = &tbs[nb_tbs++];
+    tb = &tbs[r->first_tb + r->nb_tbs++];
+    nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
+    tb->region = tb_cur_region;
+    tb->invalid = false;
+    tb->nocache = false;
     return tb;
 }
 
 void tb_free(TranslationBlock *tb)
 {
+    TBRegion *r = &tb_regions[tb_cur_region];
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (nb_tbs > 0 && tb == &tbs[nb_tbs - 1]) {
+    if (r->nb_tbs > 0 && tb == &tbs[r->first_tb + r->nb_tbs - 1]) {
         code_gen_ptr = tb->tc_ptr;
+        r->code_end = code_gen_ptr;
+        r->nb_tbs--;
         nb_tbs--;
     }
 }
@@ -780,9 +919,9 @@ static void page_flush_tb(void)
     }
 }
 
-/* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUArchState *env1)
+/* flush all the translation blocks; no vCPU may be executing translated
+   code at the same time */
+void tb_flush_exclusive(CPUArchState *env1)
 {
     CPUArchState *env;
 #if defined(DEBUG_FLUSH)
@@ -795,13 +934,18 @@ void tb_flush(CPUArchState *env1)
         cpu_abort(env1, "Internal error: code buffer overflow\n");
 
     nb_tbs = 0;
+    tb_regions_init();
 
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
         memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
     }
 
-    memset (tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof (void *));
+    memset(tb_phys_hash->buckets, 0,
+           sizeof(TranslationBlock *) << tb_phys_hash->bits);
     page_flush_tb();
+#if defined(CONFIG_USER_ONLY)
+    tb_cache_flush();
+#endif
 
     code_gen_ptr = code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
@@ -809,6 +953,50 @@ void tb_flush(CPUArchState *env1)
     tb_flush_count++;
 }
 
+/* XXX: tb_flush is currently not thread safe in user mode */
+void tb_flush(CPUArchState *env1)
+{
+#if !defined(CONFIG_USER_ONLY)
+    if (mttcg_enabled) {
+        CPUArchState *env;
+
+        /* other vCPUs may be executing translated code; the flush is done
+           before any of them enters cpu_exec() again */
+        tb_flush_pending = 1;
+        for (env = first_cpu; env != NULL; env = env->next_cpu) {
+            cpu_exit(env);
+        }
+        return;
+    }
+#endif
+    tb_flush_exclusive(env1);
+}
+
+#if !defined(CONFIG_USER_ONLY)
+void tcg_tb_lock(void)
+{
+    if (mttcg_enabled && tls_var(tb_lock_depth)++ == 0) {
+        qemu_mutex_lock(&tb_mutex);
+    }
+}
+
+void tcg_tb_unlock(void)
+{
+    if (mttcg_enabled && --tls_var(tb_lock_depth) == 0) {
+        qemu_mutex_unlock(&tb_mutex);
+    }
+}
+
+/* for cpu_exec() after a longjmp */
+void tcg_tb_lock_reset(void)
+{
+    if (tls_var(tb_lock_depth)) {
+        tls_var(tb_lock_depth) = 0;
+        qemu_mutex_unlock(&tb_mutex);
+    }
+}
+#endif
+
 #ifdef DEBUG_TB_CHECK
 
 static void tb_invalidate_check(target_ulong address)
@@ -816,8 +1004,9 @@ static void tb_invalidate_check(target_ulong address)
     TranslationBlock *tb;
     int i;
     address &= TARGET_PAGE_MASK;
-    for(i = 0;i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for(tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
+    for (i = 0; i < (1 << tb_phys_hash->bits); i++) {
+        for (tb = tb_phys_hash->buckets[i]; tb != NULL;
+             tb = tb->phys_hash_next) {
             if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
                   address >= tb->pc + tb->size)) {
                 printf("ERROR invalidate: address=" TARGET_FMT_lx
@@ -834,8 +1023,9 @@ static void tb_page_check(void)
     TranslationBlock *tb;
     int i, flags1, flags2;
 
-    for(i = 0;i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for(tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
+    for (i = 0; i < (1 << tb_phys_hash->bits); i++) {
+        for (tb = tb_phys_hash->buckets[i]; tb != NULL;
+             tb = tb->phys_hash_next) {
             flags1 = page_get_flags(tb->pc);
             flags2 = page_get_flags(tb->pc + tb->size - 1);
             if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
@@ -915,30 +1105,55 @@ static inline void tb_reset_jump(TranslationBlock *tb, int n)
     tb_set_jmp_target(tb, n, (uintptr_t)(tb->tc_ptr + tb->tb_next_offset[n]));
 }
 
+/* Remove all direct jumps from and to a TB.  */
+static void tb_jmp_unlink(TranslationBlock *tb)
+{
+    TranslationBlock *tb1, *tb2;
+    unsigned int n1;
+
+    /* suppress this TB from the two jump lists */
+    tb_jmp_remove(tb, 0);
+    tb_jmp_remove(tb, 1);
+
+    /* suppress any remaining jumps to this TB */
+    tb1 = tb->jmp_first;
+    for(;;) {
+        n1 = (uintptr_t)tb1 & 3;
+        if (n1 == 2)
+            break;
+        tb1 = (TranslationBlock *)((uintptr_t)tb1 & ~3);
+        tb2 = tb1->jmp_next[n1];
+        tb_reset_jump(tb1, n1);
+        tb1->jmp_next[n1] = NULL;
+        tb1 = tb2;
+    }
+    tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2); /* fail safe */
+}
+
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 {
     CPUArchState *env;
     PageDesc *p;
-    unsigned int h, n1;
+    unsigned int h;
     tb_page_addr_t phys_pc;
-    TranslationBlock *tb1, *tb2;
 
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_remove(&tb_phys_hash[h], tb,
+    h = tb_phys_hash_func(tb_phys_hash, phys_pc, tb->pc, tb->flags,
+                          tb->cs_base);
+    tb_remove(&tb_phys_hash->buckets[h], tb,
               offsetof(TranslationBlock, phys_hash_next));
 
-    /* remove the TB from the page list */
+    /* remove the TB from the page list.  The code bitmap may keep the
+       bits of the TB set: that only costs a useless lookup the next
+       time those bytes are written, which then clears them.  */
     if (tb->page_addr[0] != page_addr) {
         p = page_find(tb->page_addr[0] >> TARGET_PAGE_BITS);
         tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
     }
     if (tb->page_addr[1] != -1 && tb->page_addr[1] != page_addr) {
         p = page_find(tb->page_addr[1] >> TARGET_PAGE_BITS);
         tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
     }
 
     tb_invalidated_flag = 1;
@@ -950,25 +1165,56 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
             env->tb_jmp_cache[h] = NULL;
     }
 
-    /* suppress this TB from the two jump lists */
-    tb_jmp_remove(tb, 0);
-    tb_jmp_remove(tb, 1);
+    tb_jmp_unlink(tb);
+    tb->invalid = true;
 
-    /* suppress any remaining jumps to this TB */
-    tb1 = tb->jmp_first;
-    for(;;) {
-        n1 = (uintptr_t)tb1 & 3;
-        if (n1 == 2)
+    tb_phys_invalidate_count++;
+}
+
+/* Make room for new TBs by throwing away the least recently used region
+   of the code buffer.  Like tb_flush(), this must not be called while
+   any CPU may be executing translated code from the buffer.  */
+static void tb_evict_region(CPUArchState *env)
+{
+    TBRegion *r;
+    TranslationBlock *tb;
+    int i, victim;
+
+    if (tb_nb_regions == 1) {
+        tb_flush(env);
+        return;
+    }
+    victim = -1;
+    for (i = 0; i < tb_nb_regions; i++) {
+        if (i == tb_cur_region) {
+            continue;
+        }
+        if (tb_regions[i].nb_tbs == 0) {
+            victim = i;
             break;
-        tb1 = (TranslationBlock *)((uintptr_t)tb1 & ~3);
-        tb2 = tb1->jmp_next[n1];
-        tb_reset_jump(tb1, n1);
-        tb1->jmp_next[n1] = NULL;
-        tb1 = tb2;
+        }
+        if (victim < 0 ||
+            (int)(tb_region_last_use[i] - tb_region_last_use[victim]) < 0) {
+            victim = i;
+        }
     }
-    tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2); /* fail safe */
-
-    tb_phys_invalidate_count++;
+    r = &tb_regions[victim];
+    for (i = 0; i < r->nb_tbs; i++) {
+        tb = &tbs[r->first_tb + i];
+        if (tb->invalid) {
+            /* it can still have been chained after being invalidated */
+            tb_jmp_unlink(tb);
+        } else {
+            tb_phys_invalidate(tb, -1);
+        }
+    }
+    nb_tbs -= r->nb_tbs;
+    r->nb_tbs = 0;
+    r->code_end = r->code_start;
+    tb_cur_region = victim;
+    code_gen_ptr = r->code_start;
+    tb_region_last_use[victim] = ++tb_region_clock;
+    tb_region_evict_count++;
 }
 
 static inline void set_bits(uint8_t *tab, int start, int len)
@@ -998,9 +1244,56 @@ static inline void set_bits(uint8_t *tab, int start, int len)
     }
 }
 
+static inline void reset_bits(uint8_t *tab, int start, int len)
+{
+    int end, mask, end1;
+
+    end = start + len;
+    tab += start >> 3;
+    mask = 0xff << (start & 7);
+    if ((start & ~7) == (end & ~7)) {
+        if (start < end) {
+            mask &= ~(0xff << (end & 7));
+            *tab &= ~mask;
+        }
+    } else {
+        *tab++ &= ~mask;
+        start = (start + 8) & ~7;
+        end1 = end & ~7;
+        while (start < end1) {
+            *tab++ = 0;
+            start += 8;
+        }
+        if (start < end) {
+            mask = ~(0xff << (end & 7));
+            *tab &= ~mask;
+        }
+    }
+}
+
+/* mark the bytes of the page covered by part n of tb in its code bitmap */
+static void page_bitmap_add_tb(PageDesc *p, TranslationBlock *tb, int n)
+{
+    int tb_start, tb_end;
+
+    /* NOTE: this is subtle as a TB may span two physical pages */
+    if (n == 0) {
+        /* NOTE: tb_end may be after the end of the page, but
+           it is not a problem */
+        tb_start = tb->pc & ~TARGET_PAGE_MASK;
+        tb_end = tb_start + tb->size;
+        if (tb_end > TARGET_PAGE_SIZE)
+            tb_end = TARGET_PAGE_SIZE;
+    } else {
+        tb_start = 0;
+        tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
+    }
+    set_bits(p->code_bitmap, tb_start, tb_end - tb_start);
+}
+
 static void build_page_bitmap(PageDesc *p)
 {
-    int n, tb_start, tb_end;
+    int n;
     TranslationBlock *tb;
 
     p->code_bitmap = g_malloc0(TARGET_PAGE_SIZE / 8);
@@ -1009,23 +1302,21 @@ static void build_page_bitmap(PageDesc *p)
     while (tb != NULL) {
         n = (uintptr_t)tb & 3;
         tb = (TranslationBlock *)((uintptr_t)tb & ~3);
-        /* NOTE: this is subtle as a TB may span two physical pages */
-        if (n == 0) {
-            /* NOTE: tb_end may be after the end of the page, but
-               it is not a problem */
-            tb_start = tb->pc & ~TARGET_PAGE_MASK;
-            tb_end = tb_start + tb->size;
-            if (tb_end > TARGET_PAGE_SIZE)
-                tb_end = TARGET_PAGE_SIZE;
-        } else {
-            tb_start = 0;
-            tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
-        }
-        set_bits(p->code_bitmap, tb_start, tb_end - tb_start);
+        page_bitmap_add_tb(p, tb, n);
         tb = tb->page_next[n];
     }
 }
 
+/* account a write to a code page that did not hit any TB */
+static void page_count_write_skip(PageDesc *p, tb_page_addr_t addr)
+{
+    smc_write_skip_count++;
+    if (++p->code_write_skip > smc_write_skip_max) {
+        smc_write_skip_max = p->code_write_skip;
+        smc_write_skip_max_page = addr & TARGET_PAGE_MASK;
+    }
+}
+
 TranslationBlock *tb_gen_code(CPUArchState *env,
                               target_ulong pc, target_ulong cs_base,
                               int flags, int cflags)
@@ -1034,13 +1325,31 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     uint8_t *tc_ptr;
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
-    int code_gen_size;
+    int code_gen_size, search_size;
+    int64_t ti;
 
     phys_pc = get_page_addr_code(env, pc);
+    if (use_icount && cflags == 0) {
+        TBIOHint *hint = tb_io_hint(phys_pc);
+
+        if (hint->cflags && hint->phys_pc == phys_pc &&
+            hint->cs_base == cs_base && hint->flags == flags) {
+            cflags = hint->cflags;
+            tb_io_hint_count++;
+        }
+    }
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+#if !defined(CONFIG_USER_ONLY)
+        if (mttcg_enabled) {
+            /* wait for the flush outside cpu_exec() */
+            tb_flush(env);
+            env->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(env);
+        }
+#endif
+        /* make room by evicting older code */
+        tb_evict_region(env);
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
@@ -1051,9 +1360,33 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+    tb_gen_uncacheable = 0;
+    ti = get_clock();
     cpu_gen_code(env, tb, &code_gen_size);
+    tb->nocache = tb_gen_uncacheable;
+#if defined(CONFIG_USER_ONLY)
+    tb_cache_generated++;
+#endif
+
+    /* keep what cpu_restore_state() needs right after the code */
+    tb->tc_search = tc_ptr + code_gen_size;
+    search_size = tcg_encode_search_pc(&tcg_ctx, tb->tc_search,
+                                       tb_regions[tb->region].code_start +
+                                       tb_region_size - tb->tc_search);
+    if (search_size < 0) {
+        tb->tc_search = NULL;
+        search_size = 0;
+    }
+    tb_gen_count++;
+    tb_gen_time += get_clock() - ti;
+    tb_gen_guest_insns += tb->icount;
+    tb_gen_host_bytes += code_gen_size;
+    tb_gen_search_bytes += search_size;
+
     code_gen_ptr = (void *)(((uintptr_t)code_gen_ptr + code_gen_size +
-                             CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+                             search_size + CODE_GEN_ALIGN - 1) &
+                            ~(CODE_GEN_ALIGN - 1));
+    tb_regions[tb->region].code_end = code_gen_ptr;
 
     /* check next page if needed */
     virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
@@ -1096,7 +1429,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
     CPUArchState *env = cpu_single_env;
     tb_page_addr_t tb_start, tb_end;
     PageDesc *p;
-    int n;
+    int n, hit = 0;
 #ifdef TARGET_HAS_PRECISE_SMC
     int current_tb_not_found = is_cpu_write_access;
     TranslationBlock *current_tb = NULL;
@@ -1106,9 +1439,12 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
     int current_flags = 0;
 #endif /* TARGET_HAS_PRECISE_SMC */
 
+    tcg_tb_lock();
     p = page_find(start >> TARGET_PAGE_BITS);
-    if (!p)
+    if (!p) {
+        tcg_tb_unlock();
         return;
+    }
     if (!p->code_bitmap &&
         ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD &&
         is_cpu_write_access) {
@@ -1134,6 +1470,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
             tb_end = tb_start + ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
         }
         if (!(tb_end <= start || tb_start >= end)) {
+            hit = 1;
 #ifdef TARGET_HAS_PRECISE_SMC
             if (current_tb_not_found) {
                 current_tb_not_found = 0;
@@ -1173,6 +1510,14 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
         }
         tb = tb_next;
     }
+    if (!hit && is_cpu_write_access) {
+        /* the bitmap was stale for these bytes, or there is none yet */
+        if (p->code_bitmap) {
+            reset_bits(p->code_bitmap, start & ~TARGET_PAGE_MASK,
+                       end - start);
+        }
+        page_count_write_skip(p, start);
+    }
 #if !defined(CONFIG_USER_ONLY)
     /* if no code remaining, no need to continue to use slow writes */
     if (!p->first_tb) {
@@ -1192,6 +1537,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
         cpu_resume_from_signal(env, NULL);
     }
 #endif
+    tcg_tb_unlock();
 }
 
 /* len must be <= 8 and start must be a multiple of len */
@@ -1216,6 +1562,7 @@ static inline void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
         b = p->code_bitmap[offset >> 3] >> (offset & 7);
         if (b & ((1 << len) - 1))
             goto do_invalidate;
+        page_count_write_skip(p, start);
     } else {
     do_invalidate:
         tb_invalidate_phys_page_range(start, start + len, 1);
@@ -1299,7 +1646,9 @@ static inline void tb_alloc_page(TranslationBlock *tb,
     page_already_protected = p->first_tb != NULL;
 #endif
     p->first_tb = (TranslationBlock *)((uintptr_t)tb | n);
-    invalidate_page_bitmap(p);
+    if (p->code_bitmap) {
+        page_bitmap_add_tb(p, tb, n);
+    }
 
 #if defined(TARGET_HAS_SMC) || 1
 
@@ -1341,6 +1690,34 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 #endif /* TARGET_HAS_SMC */
 }
 
+/* Double the size of the physical hash table.  The new table is filled
+   before it is published; the old one is freed right away, which is fine
+   as long as lookups are done under tb_lock (or tcg_tb_lock).  */
+static void tb_phys_hash_grow(void)
+{
+    TBPhysHash *old = tb_phys_hash, *new;
+    TranslationBlock *tb, *next;
+    tb_page_addr_t phys_pc;
+    unsigned int i, h;
+
+    new = g_malloc0(sizeof(TBPhysHash) +
+                    (sizeof(TranslationBlock *) << (old->bits + 1)));
+    new->bits = old->bits + 1;
+    for (i = 0; i < (1u << old->bits); i++) {
+        for (tb = old->buckets[i]; tb != NULL; tb = next) {
+            next = tb->phys_hash_next;
+            phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
+            h = tb_phys_hash_func(new, phys_pc, tb->pc, tb->flags,
+                                  tb->cs_base);
+            tb->phys_hash_next = new->buckets[h];
+            new->buckets[h] = tb;
+        }
+    }
+    smp_wmb();
+    tb_phys_hash = new;
+    g_free(old);
+}
+
 /* add a new TB and link it to the physical page tables. phys_page2 is
    (-1) to indicate that only one page contains the TB. */
 void tb_link_page(TranslationBlock *tb,
@@ -1352,10 +1729,17 @@ void tb_link_page(TranslationBlock *tb,
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
+    /* keep the average chain length below two */
+    if (nb_tbs > (2 << tb_phys_hash->bits) &&
+        tb_phys_hash->bits < tb_phys_hash_max_bits) {
+        tb_phys_hash_grow();
+    }
     /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tb_phys_hash[h];
+    h = tb_phys_hash_func(tb_phys_hash, phys_pc, tb->pc, tb->flags,
+                          tb->cs_base);
+    ptb = &tb_phys_hash->buckets[h];
     tb->phys_hash_next = *ptb;
+    smp_wmb();
     *ptb = tb;
 
     /* add in the page list */
@@ -1381,6 +1765,15 @@ void tb_link_page(TranslationBlock *tb,
     mmap_unlock();
 }
 
+#if defined(CONFIG_QEMU_LDST_OPTIMIZATION) && defined(CONFIG_SOFTMMU)
+/* true if 'pc' points into the translated code */
+bool is_tcg_gen_code(uintptr_t pc)
+{
+    return pc >= (uintptr_t)code_gen_buffer &&
+           pc < (uintptr_t)code_gen_buffer + code_gen_buffer_size;
+}
+#endif
+
 /* find the TB 'tb' such that tb[0].tc_ptr <= tc_ptr <
    tb[1].tc_ptr. Return NULL if not found */
 TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
@@ -1388,16 +1781,22 @@ TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
     int m_min, m_max, m;
     uintptr_t v;
     TranslationBlock *tb;
+    TBRegion *r;
 
-    if (nb_tbs <= 0)
+    if (tc_ptr < (uintptr_t)code_gen_buffer) {
+        return NULL;
+    }
+    m = (tc_ptr - (uintptr_t)code_gen_buffer) / tb_region_size;
+    if (m >= tb_nb_regions) {
         return NULL;
-    if (tc_ptr < (uintptr_t)code_gen_buffer ||
-        tc_ptr >= (uintptr_t)code_gen_ptr) {
+    }
+    r = &tb_regions[m];
+    if (r->nb_tbs <= 0 || tc_ptr >= (uintptr_t)r->code_end) {
         return NULL;
     }
     /* binary search (cf Knuth) */
-    m_min = 0;
-    m_max = nb_tbs - 1;
+    m_min = r->first_tb;
+    m_max = r->first_tb + r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
         tb = &tbs[m];
@@ -2026,6 +2425,178 @@ void page_dump(FILE *f)
     walk_memory_regions(f, dump_region);
 }
 
+/* The guest address ranges whose pages have non-zero flags, as a treap
+   of disjoint, non-adjacent intervals ordered by address.  It lets mmap
+   find free guest address space without probing the page tables one
+   page at a time.  Updated by page_set_flags(), so the mmap_lock
+   protects it as well.  */
+typedef struct PageRange PageRange;
+struct PageRange {
+    target_ulong start;
+    target_ulong last;          /* inclusive */
+    unsigned int prio;
+    PageRange *left, *right;
+};
+
+static PageRange *page_ranges;
+
+static PageRange *page_range_new(target_ulong start, target_ulong last)
+{
+    static unsigned int seed = 0x9e3779b9;
+    PageRange *r = g_malloc0(sizeof(*r));
+
+    /* xorshift32 */
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    r->start = start;
+    r->last = last;
+    r->prio = seed;
+    return r;
+}
+
+static void page_range_free(PageRange *t)
+{
+    if (t) {
+        page_range_free(t->left);
+        page_range_free(t->right);
+        g_free(t);
+    }
+}
+
+/* Split T into the ranges starting below KEY and the others.  */
+static void page_range_split(PageRange *t, target_ulong key,
+                             PageRange **l, PageRange **r)
+{
+    if (!t) {
+        *l = *r = NULL;
+    } else if (t->start < key) {
+        page_range_split(t->right, key, &t->right, r);
+        *l = t;
+    } else {
+        page_range_split(t->left, key, l, &t->left);
+        *r = t;
+    }
+}
+
+/* All ranges of L must be below those of R.  */
+static PageRange *page_range_merge(PageRange *l, PageRange *r)
+{
+    if (!l) {
+        return r;
+    }
+    if (!r) {
+        return l;
+    }
+    if (l->prio > r->prio) {
+        l->right = page_range_merge(l->right, r);
+        return l;
+    }
+    r->left = page_range_merge(l, r->left);
+    return r;
+}
+
+static PageRange *page_range_max(PageRange *t)
+{
+    while (t && t->right) {
+        t = t->right;
+    }
+    return t;
+}
+
+/* The range with the highest start below KEY, or NULL.  */
+static PageRange *page_range_below(target_ulong key)
+{
+    PageRange *t = page_ranges, *found = NULL;
+
+    while (t) {
+        if (t->start < key) {
+            found = t;
+            t = t->right;
+        } else {
+            t = t->left;
+        }
+    }
+    return found;
+}
+
+static void page_ranges_add(target_ulong start, target_ulong last)
+{
+    PageRange *a, *b, *c, *m;
+
+    page_range_split(page_ranges, start, &a, &b);
+    /* a range ending right before START is merged */
+    m = page_range_max(a);
+    if (m && m->last >= start - 1) {
+        start = m->start;
+        if (m->last > last) {
+            last = m->last;
+        }
+        page_range_split(a, m->start, &a, &m);
+        page_range_free(m);
+    }
+    /* and so are those starting inside or right after [start, last] */
+    if (last >= (target_ulong)-2) {
+        c = NULL;
+    } else {
+        page_range_split(b, last + 2, &b, &c);
+    }
+    m = page_range_max(b);
+    if (m && m->last > last) {
+        last = m->last;
+    }
+    page_range_free(b);
+    page_ranges = page_range_merge(page_range_merge(a, page_range_new(start,
+                                                                      last)),
+                                   c);
+}
+
+static void page_ranges_remove(target_ulong start, target_ulong last)
+{
+    PageRange *a, *b, *c, *m, *tail = NULL;
+
+    page_range_split(page_ranges, start, &a, &b);
+    /* the range overlapping START is truncated, or split in two */
+    m = page_range_max(a);
+    if (m && m->last >= start) {
+        if (m->last > last) {
+            tail = page_range_new(last + 1, m->last);
+        }
+        m->last = start - 1;
+    }
+    if (last == (target_ulong)-1) {
+        c = NULL;
+    } else {
+        page_range_split(b, last + 1, &b, &c);
+    }
+    /* ranges starting inside [start, last] go, except for their tail */
+    m = page_range_max(b);
+    if (m && m->last > last) {
+        tail = page_range_new(last + 1, m->last);
+    }
+    page_range_free(b);
+    page_ranges = page_range_merge(page_range_merge(a, tail), c);
+}
+
+/* Return the highest ALIGN aligned address ADDR such that the SIZE bytes
+   at ADDR are below END and contain no page with non-zero flags, or -1.
+   SIZE must be a multiple of ALIGN.  The mmap_lock should be held.  */
+target_ulong page_find_free_range(target_ulong end, target_ulong size,
+                                  target_ulong align)
+{
+    target_ulong hi = end & ~(align - 1);
+    PageRange *r;
+
+    while (hi >= size) {
+        r = page_range_below(hi);
+        if (!r || r->last < hi - size) {
+            return hi - size;
+        }
+        hi = r->start & ~(align - 1);
+    }
+    return -1;
+}
+
 int page_get_flags(target_ulong address)
 {
     PageDesc *p;
@@ -2072,6 +2643,12 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
         }
         p->flags = flags;
     }
+
+    if (flags) {
+        page_ranges_add(start, end - 1);
+    } else {
+        page_ranges_remove(start, end - 1);
+    }
 }
 
 int page_check_range(target_ulong start, target_ulong len, int flags)
@@ -2171,13 +2748,402 @@ int page_unprotect(target_ulong address, uintptr_t pc, void *puc)
     mmap_unlock();
     return 0;
 }
-#endif /* defined(CONFIG_USER_ONLY) */
 
-#if !defined(CONFIG_USER_ONLY)
+/* Persistent translation cache.  On exit the generated code and the TB
+   descriptors are written to a file named after a hash of the guest
+   executable; the next run of the same binary maps that file back over
+   the (static) code buffer and TB array and adopts cached TBs on a lookup
+   miss, after checking that the guest code they were made from is still
+   the same.  Generated code contains absolute addresses of QEMU functions,
+   of tbs[] and of the code buffer, so the file is only used by the very
+   same QEMU executable loaded at the same address.  */
 
-#define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
-typedef struct subpage_t {
-    MemoryRegion iomem;
+#define TB_CACHE_HASH_INIT 0xcbf29ce484222325ULL
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint64_t key;               /* guest executable, CPU model, options */
+    uint64_t qemu_dev;          /* the QEMU executable */
+    uint64_t qemu_ino;
+    uint64_t qemu_size;
+    uint64_t qemu_mtime;
+    uint64_t text_addr;
+    uint64_t code_addr;
+    uint64_t tbs_addr;
+    uint64_t tb_size;
+    uint64_t max_blocks;
+    uint64_t guest_base;
+    uint64_t reserved_va;
+    /* everything above must match for the file to be used */
+    uint64_t code_size;
+    uint64_t nb_tbs;
+} TBCacheHeader;
+
+typedef struct TBCacheEntry {
+    uint64_t sum;               /* of the guest code, 0 if not adoptable */
+    uint64_t hash;              /* tb_hash_mix() of the TB */
+} TBCacheEntry;
+
+static char *tb_cache_path;
+static TBCacheHeader tb_cache_id;
+/* checksum of the guest code for each dormant TB of tbs[], i.e. one that
+   was loaded from the file and not adopted yet; 0 for all others */
+static uint64_t *tb_cache_sums;
+/* open addressing index of the dormant TBs, holds tbs[] index + 1 */
+static int32_t *tb_cache_index;
+static unsigned int tb_cache_index_mask;
+
+static uint64_t tb_cache_hash(uint64_t h, const uint8_t *p, size_t len)
+{
+    uint64_t w;
+
+    while (len >= 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 32;
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        h = (h ^ *p++) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* never 0, which marks TBs that cannot be adopted */
+static uint64_t tb_cache_sum(target_ulong pc, int size)
+{
+    return tb_cache_hash(TB_CACHE_HASH_INIT ^ size, g2h(pc), size) | 1;
+}
+
+static int tb_cache_pread(int fd, void *buf, size_t len, off_t off)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = pread(fd, buf, len, off);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf = (uint8_t *)buf + ret;
+        off += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int tb_cache_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = pwrite(fd, buf, len, off);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf = (const uint8_t *)buf + ret;
+        off += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/* The code and the TB descriptors are stored at the same offset within a
+   host page as in memory, so that they can be mapped in place.  */
+static void tb_cache_layout(const TBCacheHeader *h, off_t *off_code,
+                            off_t *off_tbs, off_t *off_entries)
+{
+    uint64_t page_mask = qemu_real_host_page_size - 1;
+
+    *off_code = qemu_real_host_page_size + (h->code_addr & page_mask);
+    *off_tbs = ((*off_code + h->code_size + page_mask) & ~page_mask) +
+        (h->tbs_addr & page_mask);
+    *off_entries = *off_tbs + h->nb_tbs * h->tb_size;
+}
+
+/* Map 'len' bytes of the file at 'off' to 'dst'.  The partial pages at
+   either end are shared with other data and are read instead.  */
+static int tb_cache_map(int fd, void *dst, size_t len, off_t off, int prot)
+{
+    uintptr_t page_mask = qemu_real_host_page_size - 1;
+    uintptr_t addr = (uintptr_t)dst;
+    uintptr_t start = (addr + page_mask) & ~page_mask;
+    uintptr_t end = (addr + len) & ~page_mask;
+
+    if (end <= start) {
+        return tb_cache_pread(fd, dst, len, off);
+    }
+    if (tb_cache_pread(fd, dst, start - addr, off) < 0 ||
+        tb_cache_pread(fd, (void *)end, addr + len - end,
+                       off + (end - addr)) < 0) {
+        return -1;
+    }
+    if (mmap((void *)start, end - start, prot, MAP_PRIVATE | MAP_FIXED,
+             fd, off + (start - addr)) == MAP_FAILED) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Enable the cache in 'dir' for the guest executable 'filename'.  */
+void tb_cache_init(const char *dir, const char *filename,
+                   const char *cpu_model, int singlestep)
+{
+    struct stat st;
+    uint64_t key;
+    void *p;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        return;
+    }
+    key = tb_cache_hash(TB_CACHE_HASH_INIT, p, st.st_size);
+    munmap(p, st.st_size);
+    key = tb_cache_hash(key, (const uint8_t *)cpu_model, strlen(cpu_model));
+    key = tb_cache_hash(key, (const uint8_t *)&singlestep,
+                        sizeof(singlestep));
+
+    if (stat("/proc/self/exe", &st) < 0) {
+        return;
+    }
+    memcpy(tb_cache_id.magic, "QEMUTBC1", 8);
+    tb_cache_id.key = key;
+    tb_cache_id.qemu_dev = st.st_dev;
+    tb_cache_id.qemu_ino = st.st_ino;
+    tb_cache_id.qemu_size = st.st_size;
+    tb_cache_id.qemu_mtime = st.st_mtime;
+    tb_cache_id.text_addr = (uintptr_t)tb_gen_code;
+    tb_cache_path = g_strdup_printf("%s/%016" PRIx64 ".tbc", dir, key);
+}
+
+/* Must be called once guest_base is fixed and before any translation.  */
+void tb_cache_load(void)
+{
+    TBCacheHeader hdr;
+    TBCacheEntry *entries;
+    off_t off_code, off_tbs, off_entries;
+    unsigned int slot, size;
+    int fd, i, n, count;
+
+    if (!tb_cache_path) {
+        return;
+    }
+    tb_cache_id.code_addr = (uintptr_t)code_gen_buffer;
+    tb_cache_id.tbs_addr = (uintptr_t)tbs;
+    tb_cache_id.tb_size = sizeof(TranslationBlock);
+    tb_cache_id.max_blocks = code_gen_max_blocks;
+    tb_cache_id.guest_base = GUEST_BASE;
+    tb_cache_id.reserved_va = RESERVED_VA;
+    tb_cache_sums = g_malloc0(code_gen_max_blocks * sizeof(uint64_t));
+
+    fd = open(tb_cache_path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    if (tb_cache_pread(fd, &hdr, sizeof(hdr), 0) < 0 ||
+        memcmp(&hdr, &tb_cache_id, offsetof(TBCacheHeader, code_size)) ||
+        hdr.code_size > code_gen_buffer_max_size ||
+        hdr.nb_tbs > tb_region_max_blocks || nb_tbs != 0) {
+        close(fd);
+        return;
+    }
+    n = hdr.nb_tbs;
+    tb_cache_layout(&hdr, &off_code, &off_tbs, &off_entries);
+    entries = g_malloc(n * sizeof(TBCacheEntry));
+    if (tb_cache_pread(fd, entries, n * sizeof(TBCacheEntry),
+                       off_entries) < 0 ||
+        tb_cache_map(fd, code_gen_buffer, hdr.code_size, off_code,
+                     PROT_READ | PROT_WRITE | PROT_EXEC) < 0 ||
+        tb_cache_map(fd, tbs, n * sizeof(TranslationBlock), off_tbs,
+                     PROT_READ | PROT_WRITE) < 0) {
+        g_free(entries);
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    count = 0;
+    for (i = 0; i < n; i++) {
+        if (entries[i].sum) {
+            count++;
+        }
+    }
+    size = 16;
+    while (size < 2 * count) {
+        size <<= 1;
+    }
+    tb_cache_index = g_malloc0(size * sizeof(int32_t));
+    tb_cache_index_mask = size - 1;
+    for (i = 0; i < n; i++) {
+        if (!entries[i].sum) {
+            continue;
+        }
+        tb_cache_sums[i] = entries[i].sum;
+        slot = entries[i].hash & tb_cache_index_mask;
+        while (tb_cache_index[slot]) {
+            slot = (slot + 1) & tb_cache_index_mask;
+        }
+        tb_cache_index[slot] = i + 1;
+    }
+    g_free(entries);
+
+    /* the dormant TBs stay allocated, new code goes after theirs */
+    code_gen_ptr = code_gen_buffer + hdr.code_size;
+    flush_icache_range((uintptr_t)code_gen_buffer, (uintptr_t)code_gen_ptr);
+    tb_regions[0].code_end = code_gen_ptr;
+    tb_regions[0].nb_tbs = n;
+    nb_tbs = n;
+}
+
+/* Adopt a dormant TB for pc/cs_base/flags if the guest code it was
+   translated from has not changed.  Called with tb_lock held.  */
+TranslationBlock *tb_cache_lookup(target_ulong pc, target_ulong cs_base,
+                                  uint64_t flags)
+{
+    TranslationBlock *tb;
+    target_ulong virt_page2;
+    unsigned int slot;
+    int i;
+
+    if (!tb_cache_index) {
+        return NULL;
+    }
+    slot = tb_hash_mix(pc, pc, flags, cs_base) & tb_cache_index_mask;
+    for (; tb_cache_index[slot]; slot = (slot + 1) & tb_cache_index_mask) {
+        i = tb_cache_index[slot] - 1;
+        tb = &tbs[i];
+        if (!tb_cache_sums[i] || tb->pc != pc || tb->cs_base != cs_base ||
+            tb->flags != flags) {
+            continue;
+        }
+        if (page_check_range(pc, tb->size, PAGE_READ) != 0 ||
+            tb_cache_sum(pc, tb->size) != tb_cache_sums[i]) {
+            continue;
+        }
+        tb_cache_sums[i] = 0;
+        tb->invalid = false;
+        virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
+        tb_link_page(tb, pc, (pc & TARGET_PAGE_MASK) != virt_page2 ?
+                     virt_page2 : -1);
+        return tb;
+    }
+    return NULL;
+}
+
+static void tb_cache_flush(void)
+{
+    g_free(tb_cache_index);
+    tb_cache_index = NULL;
+    if (tb_cache_sums) {
+        memset(tb_cache_sums, 0, code_gen_max_blocks * sizeof(uint64_t));
+    }
+}
+
+/* Write the translated code back to the cache file, if anything new was
+   translated.  Called on guest exit.  */
+void tb_cache_save(void)
+{
+    TBCacheHeader hdr;
+    TBCacheEntry *entries;
+    TranslationBlock *tb, *copy;
+    off_t off_code, off_tbs, off_entries;
+    char *tmp;
+    int fd, i, ret;
+
+    if (!tb_cache_sums || !tb_cache_generated) {
+        return;
+    }
+    spin_lock(&tb_lock);
+    mmap_lock();
+
+    hdr = tb_cache_id;
+    hdr.code_size = code_gen_ptr - code_gen_buffer;
+    hdr.nb_tbs = nb_tbs;
+    copy = g_malloc(nb_tbs * sizeof(TranslationBlock));
+    entries = g_malloc0(nb_tbs * sizeof(TBCacheEntry));
+    for (i = 0; i < nb_tbs; i++) {
+        tb = &tbs[i];
+        if (!tb->invalid) {
+            /* the TBs it is chained to may not be adopted next time */
+            if (tb->tb_next_offset[0] != 0xffff) {
+                tb_reset_jump(tb, 0);
+            }
+            if (tb->tb_next_offset[1] != 0xffff) {
+                tb_reset_jump(tb, 1);
+            }
+            /* the guest may have unmapped the code since */
+            if (tb->cflags == 0 && !tb->nocache && tb->size > 0 &&
+                page_check_range(tb->pc, tb->size, PAGE_READ) == 0) {
+                tb_cache_sums[i] = tb_cache_sum(tb->pc, tb->size);
+            }
+        }
+        if (tb_cache_sums[i]) {
+            entries[i].sum = tb_cache_sums[i];
+            entries[i].hash = tb_hash_mix(tb->pc, tb->pc, tb->flags,
+                                          tb->cs_base);
+        }
+        /* saved TBs are dormant: not linked anywhere */
+        copy[i] = *tb;
+        copy[i].phys_hash_next = NULL;
+        copy[i].page_next[0] = NULL;
+        copy[i].page_next[1] = NULL;
+        copy[i].jmp_next[0] = NULL;
+        copy[i].jmp_next[1] = NULL;
+        copy[i].jmp_first = NULL;
+        copy[i].invalid = true;
+    }
+
+    tb_cache_layout(&hdr, &off_code, &off_tbs, &off_entries);
+    tmp = g_strdup_printf("%s.%d", tb_cache_path, (int)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        ret = tb_cache_pwrite(fd, &hdr, sizeof(hdr), 0);
+        if (ret == 0) {
+            ret = tb_cache_pwrite(fd, code_gen_buffer, hdr.code_size,
+                                  off_code);
+        }
+        if (ret == 0) {
+            ret = tb_cache_pwrite(fd, copy, nb_tbs * sizeof(TranslationBlock),
+                                  off_tbs);
+        }
+        if (ret == 0) {
+            ret = tb_cache_pwrite(fd, entries, nb_tbs * sizeof(TBCacheEntry),
+                                  off_entries);
+        }
+        if (close(fd) < 0 || ret < 0 || rename(tmp, tb_cache_path) < 0) {
+            unlink(tmp);
+        }
+    }
+    g_free(tmp);
+    g_free(entries);
+    g_free(copy);
+
+    mmap_unlock();
+    spin_unlock(&tb_lock);
+}
+#endif /* defined(CONFIG_USER_ONLY) */
+
+#if !defined(CONFIG_USER_ONLY)
+
+#define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
+typedef struct subpage_t {
+    MemoryRegion iomem;
     target_phys_addr_t base;
     uint16_t sub_section[TARGET_PAGE_SIZE];
 } subpage_t;
@@ -2329,12 +3295,111 @@ void qemu_unregister_coalesced_mmio(target_phys_addr_t addr, ram_addr_t size)
         kvm_uncoalesce_mmio_region(addr, size);
 }
 
+void qemu_register_coalesced_pio(target_phys_addr_t addr, ram_addr_t size)
+{
+    if (kvm_enabled())
+        kvm_coalesce_pio_region(addr, size);
+}
+
+void qemu_unregister_coalesced_pio(target_phys_addr_t addr, ram_addr_t size)
+{
+    if (kvm_enabled())
+        kvm_uncoalesce_pio_region(addr, size);
+}
+
 void qemu_flush_coalesced_mmio_buffer(void)
 {
     if (kvm_enabled())
         kvm_flush_coalesced_mmio_buffer();
 }
 
+#ifdef __linux__
+
+#include <sys/syscall.h>
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED   1
+#define MPOL_BIND        2
+#define MPOL_INTERLEAVE  3
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE     (1 << 1)
+#endif
+
+/*
+ * The board allocates the RAM that -numa splits between the guest nodes
+ * first, so it is the block at offset 0 and node i owns the node_mem[i]
+ * bytes following node i-1.  Bind each node's share to its -numa
+ * hostnodes; MPOL_MF_MOVE also migrates pages that were already touched.
+ */
+static bool qemu_ram_numa_needed(RAMBlock *block)
+{
+    int i;
+
+    if (block->offset != 0) {
+        return false;
+    }
+    for (i = 0; i < nb_numa_nodes; i++) {
+        if (!bitmap_empty(node_host_nodes[i], MAX_HOST_NODES)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Node borders are 8MB aligned, pages straddling one stay with the lower
+ * node.  */
+static void qemu_ram_numa_range(int node, ram_addr_t length,
+                                unsigned long pagesize,
+                                ram_addr_t *start, ram_addr_t *end)
+{
+    ram_addr_t offset = 0;
+    int i;
+
+    for (i = 0; i < node; i++) {
+        offset += node_mem[i];
+    }
+    length = QEMU_ALIGN_UP(length, pagesize);
+    *start = MIN(QEMU_ALIGN_UP(offset, pagesize), length);
+    *end = MIN(QEMU_ALIGN_UP(offset + node_mem[node], pagesize), length);
+}
+
+static void qemu_ram_numa_bind(RAMBlock *block, void *host, ram_addr_t length,
+                               unsigned long pagesize)
+{
+    static const int modes[] = {
+        [NUMA_POLICY_BIND] = MPOL_BIND,
+        [NUMA_POLICY_PREFERRED] = MPOL_PREFERRED,
+        [NUMA_POLICY_INTERLEAVE] = MPOL_INTERLEAVE,
+    };
+    ram_addr_t start, end;
+    int i;
+
+    if (!qemu_ram_numa_needed(block)) {
+        return;
+    }
+
+    for (i = 0; i < nb_numa_nodes; i++) {
+        qemu_ram_numa_range(i, length, pagesize, &start, &end);
+        if (bitmap_empty(node_host_nodes[i], MAX_HOST_NODES) ||
+            end <= start) {
+            continue;
+        }
+        if (syscall(__NR_mbind, (uint8_t *)host + start, end - start,
+                    modes[node_policy[i]], node_host_nodes[i],
+                    MAX_HOST_NODES + 1, MPOL_MF_MOVE) < 0) {
+            fprintf(stderr, "qemu: binding the memory of numa node %d "
+                    "failed: %s\n", i, strerror(errno));
+        }
+    }
+}
+#else
+static void qemu_ram_numa_bind(RAMBlock *block, void *host, ram_addr_t length,
+                               unsigned long pagesize)
+{
+}
+#endif
+
 #if defined(__linux__) && !defined(TARGET_S390X)
 
 #include <sys/vfs.h>
@@ -2361,6 +3426,132 @@ static long gethugepagesize(const char *path)
     return fs.f_bsize;
 }
 
+/*
+ * -mem-prealloc faults in every page up front.  A single thread takes
+ * minutes for a large guest, so the work is split between
+ * mem_prealloc_threads threads.  When the RAM is bound to host nodes, each
+ * node's share is touched by threads running on that node's CPUs, which
+ * keeps the page clearing in the kernel node-local.
+ */
+#define RAM_PREALLOC_MAX_THREADS 16
+
+typedef struct RAMPreallocChunk {
+    QemuThread thread;
+    uint8_t *start;
+    ram_addr_t length;
+    unsigned long pagesize;
+    unsigned long *cpus;
+} RAMPreallocChunk;
+
+static void *qemu_ram_prealloc_thread(void *opaque)
+{
+    RAMPreallocChunk *chunk = opaque;
+    volatile uint8_t *p = chunk->start;
+    ram_addr_t i;
+
+    if (chunk->cpus) {
+        QemuThread self;
+
+        qemu_thread_get_self(&self);
+        qemu_thread_set_affinity(&self, chunk->cpus, MAX_HOST_CPUS);
+    }
+    for (i = 0; i < chunk->length; i += chunk->pagesize) {
+        p[i] = p[i];
+    }
+    return NULL;
+}
+
+static int qemu_ram_prealloc_split(RAMPreallocChunk *chunks, int nb_chunks,
+                                   uint8_t *start, ram_addr_t length,
+                                   unsigned long pagesize, int threads,
+                                   unsigned long *cpus)
+{
+    ram_addr_t chunk_len = QEMU_ALIGN_UP(DIV_ROUND_UP(length, threads),
+                                         pagesize);
+    ram_addr_t offset;
+
+    for (offset = 0; offset < length; offset += chunk_len) {
+        RAMPreallocChunk *chunk = &chunks[nb_chunks++];
+
+        chunk->start = start + offset;
+        chunk->length = MIN(chunk_len, length - offset);
+        chunk->pagesize = pagesize;
+        chunk->cpus = cpus;
+    }
+    return nb_chunks;
+}
+
+static void qemu_ram_prealloc(RAMBlock *block, void *host, ram_addr_t length,
+                              unsigned long pagesize)
+{
+    QemuOpts *machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    RAMPreallocChunk *chunks;
+    unsigned long *node_cpus[MAX_NODES] = { NULL };
+    int64_t start_time = get_clock();
+    int threads, nb_chunks = 0;
+    ram_addr_t start, end = 0;
+    int i;
+
+    threads = MIN(sysconf(_SC_NPROCESSORS_ONLN), RAM_PREALLOC_MAX_THREADS);
+    if (machine_opts) {
+        threads = qemu_opt_get_number(machine_opts, "mem_prealloc_threads",
+                                      threads);
+    }
+    threads = MAX(threads, 1);
+
+    /* Every node's share, and what is left after the last node, gets at
+     * least one thread of its own */
+    chunks = g_new0(RAMPreallocChunk, threads + MAX_NODES + 1);
+    if (qemu_ram_numa_needed(block)) {
+        for (i = 0; i < nb_numa_nodes; i++) {
+            qemu_ram_numa_range(i, length, pagesize, &start, &end);
+            if (end <= start) {
+                continue;
+            }
+            if (!bitmap_empty(node_host_nodes[i], MAX_HOST_NODES)) {
+                node_cpus[i] = bitmap_new(MAX_HOST_CPUS);
+                numa_get_host_node_cpus(node_host_nodes[i], node_cpus[i]);
+                if (bitmap_empty(node_cpus[i], MAX_HOST_CPUS)) {
+                    g_free(node_cpus[i]);
+                    node_cpus[i] = NULL;
+                }
+            }
+            nb_chunks = qemu_ram_prealloc_split(chunks, nb_chunks,
+                                                (uint8_t *)host + start,
+                                                end - start, pagesize,
+                                                MAX(threads * (end - start) /
+                                                    length, 1),
+                                                node_cpus[i]);
+        }
+        /* -numa does not check that the nodes add up to the RAM size */
+        if (end < length) {
+            nb_chunks = qemu_ram_prealloc_split(chunks, nb_chunks,
+                                                (uint8_t *)host + end,
+                                                length - end, pagesize, 1,
+                                                NULL);
+        }
+    } else {
+        nb_chunks = qemu_ram_prealloc_split(chunks, 0, host, length, pagesize,
+                                            threads, NULL);
+    }
+
+    for (i = 0; i < nb_chunks; i++) {
+        qemu_thread_create(&chunks[i].thread, qemu_ram_prealloc_thread,
+                           &chunks[i], QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < nb_chunks; i++) {
+        qemu_thread_join(&chunks[i].thread);
+    }
+
+    for (i = 0; i < MAX_NODES; i++) {
+        g_free(node_cpus[i]);
+    }
+    g_free(chunks);
+
+    fprintf(stderr, "qemu: preallocated %" PRIu64 " MB in %" PRId64
+            " ms with %d threads\n", (uint64_t)length >> 20,
+            (get_clock() - start_time) / SCALE_MS, nb_chunks);
+}
 static void *file_ram_alloc(RAMBlock *block,
                             ram_addr_t memory,
                             const char *path)
@@ -2368,9 +3559,7 @@ static void *file_ram_alloc(RAMBlock *block,
     char *filename;
     void *area;
     int fd;
-#ifdef MAP_POPULATE
     int flags;
-#endif
     unsigned long hpagesize;
 
     hpagesize = gethugepagesize(path);
@@ -2411,26 +3600,139 @@ static void *file_ram_alloc(RAMBlock *block,
     if (ftruncate(fd, memory))
         perror("ftruncate");
 
-#ifdef MAP_POPULATE
-    /* NB: MAP_POPULATE won't exhaustively alloc all phys pages in the case
-     * MAP_PRIVATE is requested.  For mem_prealloc we mmap as MAP_SHARED
-     * to sidestep this quirk.
+    /* For mem_prealloc we mmap as MAP_SHARED, which makes hugetlbfs
+     * reserve all pages at mmap time; a shortage fails here rather than
+     * with SIGBUS in the prealloc threads.  Pages are only touched once
+     * the NUMA policy is in place.
      */
-    flags = mem_prealloc ? MAP_POPULATE | MAP_SHARED : MAP_PRIVATE;
+    flags = mem_prealloc ? MAP_SHARED : MAP_PRIVATE;
     area = mmap(0, memory, PROT_READ | PROT_WRITE, flags, fd, 0);
-#else
-    area = mmap(0, memory, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-#endif
     if (area == MAP_FAILED) {
         perror("file_ram_alloc: can't mmap RAM pages");
         close(fd);
         return (NULL);
     }
+    qemu_ram_numa_bind(block, area, memory, hpagesize);
+    if (mem_prealloc) {
+        qemu_ram_prealloc(block, area, memory, hpagesize);
+    }
     block->fd = fd;
     return area;
 }
 #endif
 
+void qemu_mutex_lock_ramlist(void)
+{
+    qemu_mutex_lock(&ram_list.mutex);
+}
+
+void qemu_mutex_unlock_ramlist(void)
+{
+    qemu_mutex_unlock(&ram_list.mutex);
+}
+
+static int ram_block_index_compar(const void *a, const void *b)
+{
+    RAMBlock * const *ablock = a;
+    RAMBlock * const *bblock = b;
+
+    if ((*ablock)->offset < (*bblock)->offset) {
+        return -1;
+    }
+    return (*ablock)->offset > (*bblock)->offset;
+}
+
+static void ram_block_index_reclaim(RCUHead *rcu)
+{
+    g_free(container_of(rcu, RAMBlockIndex, rcu));
+}
+
+/* Called with both the iothread and the ramlist lock held, after the list
+ * has changed.  Removed blocks must be freed with call_rcu1() afterwards.
+ */
+static void ram_list_update_index(void)
+{
+    RAMBlockIndex *idx, *old = ram_list.block_index;
+    RAMBlock *block;
+    unsigned int n = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        n++;
+    }
+    idx = g_malloc(sizeof(*idx) + n * sizeof(idx->blocks[0]));
+    idx->nr = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        idx->blocks[idx->nr++] = block;
+    }
+    qsort(idx->blocks, idx->nr, sizeof(idx->blocks[0]),
+          ram_block_index_compar);
+
+    atomic_rcu_set(&ram_list.block_index, idx);
+    ram_list.version++;
+    if (old) {
+        call_rcu1(&old->rcu, ram_block_index_reclaim);
+    }
+}
+
+static void ram_block_reclaim(RCUHead *rcu)
+{
+    g_free(container_of(rcu, RAMBlock, rcu));
+}
+
+/* Last block found by this thread, valid as long as ram_list.version
+ * has not changed since.
+ */
+static DEFINE_TLS(RAMBlock *, ram_mru_block);
+static DEFINE_TLS(uint32_t, ram_mru_version);
+
+/* The RAMBlock itself stays allocated until a grace period after it is
+ * removed, but its memory is released right away; callers must know that
+ * addr is still mapped, as before.
+ */
+static RAMBlock *ram_block_find(ram_addr_t addr)
+{
+    RAMBlockIndex *idx;
+    RAMBlock *block;
+    unsigned int lo, hi, mid;
+
+    rcu_read_lock();
+    block = tls_var(ram_mru_block);
+    if (block && tls_var(ram_mru_version) == ram_list.version &&
+        addr - block->offset < block->length) {
+        goto out;
+    }
+
+    tls_var(ram_mru_version) = ram_list.version;
+    smp_rmb(); /* the index is published before the version */
+    idx = atomic_rcu_read(&ram_list.block_index);
+    block = NULL;
+    if (!idx) {
+        goto out;
+    }
+
+    /* Find the last block that starts at or below addr.  */
+    lo = 0;
+    hi = idx->nr;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (idx->blocks[mid]->offset <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        goto out;
+    }
+    if (addr - idx->blocks[lo - 1]->offset < idx->blocks[lo - 1]->length) {
+        block = idx->blocks[lo - 1];
+        tls_var(ram_mru_block) = block;
+    }
+out:
+    rcu_read_unlock();
+    return block;
+}
+
 static ram_addr_t find_ram_offset(ram_addr_t size)
 {
     RAMBlock *block, *next_block;
@@ -2493,6 +3795,27 @@ static void qemu_ram_setup_dump(void *addr, ram_addr_t size)
     }
 }
 
+/*
+ * With mem_thp, anonymous RAM is madvised for transparent hugepages instead
+ * of KSM, which would split the huge pages again when merging.
+ */
+static void qemu_ram_setup_anon(RAMBlock *block, ram_addr_t size)
+{
+    QemuOpts *machine_opts;
+
+    machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    if (machine_opts && qemu_opt_get_bool(machine_opts, "mem_thp", false)) {
+        if (qemu_madvise(block->host, size, QEMU_MADV_HUGEPAGE)) {
+            perror("qemu_madvise");
+            fprintf(stderr, "madvise doesn't support MADV_HUGEPAGE, "
+                            "but mem_thp=on specified\n");
+        }
+    } else {
+        qemu_madvise(block->host, size, QEMU_MADV_MERGEABLE);
+    }
+    qemu_ram_numa_bind(block, block->host, size, qemu_real_host_page_size);
+}
+
 void qemu_ram_set_idstr(ram_addr_t addr, const char *name, DeviceState *dev)
 {
     RAMBlock *new_block, *block;
@@ -2525,6 +3848,15 @@ void qemu_ram_set_idstr(ram_addr_t addr, const char *name, DeviceState *dev)
     }
 }
 
+void qemu_ram_foreach_block(RAMBlockIterFunc func, void *opaque)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        func(block->idstr, block->host, block->length, opaque);
+    }
+}
+
 ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
                                    MemoryRegion *mr)
 {
@@ -2544,7 +3876,7 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
             new_block->host = file_ram_alloc(new_block, size, mem_path);
             if (!new_block->host) {
                 new_block->host = qemu_vmalloc(size);
-                qemu_madvise(new_block->host, size, QEMU_MADV_MERGEABLE);
+                qemu_ram_setup_anon(new_block, size);
             }
 #else
             fprintf(stderr, "-mem-path option unsupported\n");
@@ -2559,12 +3891,17 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
             } else {
                 new_block->host = qemu_vmalloc(size);
             }
-            qemu_madvise(new_block->host, size, QEMU_MADV_MERGEABLE);
+            if (!xen_enabled()) {
+                qemu_ram_setup_anon(new_block, size);
+            }
         }
     }
     new_block->length = size;
 
+    qemu_mutex_lock_ramlist();
     QLIST_INSERT_HEAD(&ram_list.blocks, new_block, next);
+    ram_list_update_index();
+    qemu_mutex_unlock_ramlist();
 
     ram_list.phys_dirty = g_realloc(ram_list.phys_dirty,
                                        last_ram_offset() >> TARGET_PAGE_BITS);
@@ -2589,22 +3926,28 @@ void qemu_ram_free_from_ptr(ram_addr_t addr)
 {
     RAMBlock *block;
 
+    qemu_mutex_lock_ramlist();
     QLIST_FOREACH(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
             QLIST_REMOVE(block, next);
-            g_free(block);
-            return;
+            ram_list_update_index();
+            g_free(block->migration_bitmap);
+            call_rcu1(&block->rcu, ram_block_reclaim);
+            break;
         }
     }
+    qemu_mutex_unlock_ramlist();
 }
 
 void qemu_ram_free(ram_addr_t addr)
 {
     RAMBlock *block;
 
+    qemu_mutex_lock_ramlist();
     QLIST_FOREACH(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
             QLIST_REMOVE(block, next);
+            ram_list_update_index();
             if (block->flags & RAM_PREALLOC_MASK) {
                 ;
             } else if (mem_path) {
@@ -2629,10 +3972,12 @@ void qemu_ram_free(ram_addr_t addr)
                 }
 #endif
             }
-            g_free(block);
-            return;
+            g_free(block->migration_bitmap);
+            call_rcu1(&block->rcu, ram_block_reclaim);
+            break;
         }
     }
+    qemu_mutex_unlock_ramlist();
 
 }
 
@@ -2710,64 +4055,38 @@ void *qemu_get_ram_ptr(ram_addr_t addr)
 {
     RAMBlock *block;
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (addr - block->offset < block->length) {
-            /* Move this entry to to start of the list.  */
-            if (block != QLIST_FIRST(&ram_list.blocks)) {
-                QLIST_REMOVE(block, next);
-                QLIST_INSERT_HEAD(&ram_list.blocks, block, next);
-            }
-            if (xen_enabled()) {
-                /* We need to check if the requested address is in the RAM
-                 * because we don't want to map the entire memory in QEMU.
-                 * In that case just map until the end of the page.
-                 */
-                if (block->offset == 0) {
-                    return xen_map_cache(addr, 0, 0);
-                } else if (block->host == NULL) {
-                    block->host =
-                        xen_map_cache(block->offset, block->length, 1);
-                }
-            }
-            return block->host + (addr - block->offset);
-        }
+    /* The lookup does not write to ram_list, so that the list stays
+     * stable for the migration thread and for concurrent callers.
+     */
+    block = ram_block_find(addr);
+    if (!block) {
+        fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
+        abort();
     }
 
-    fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
-    abort();
-
-    return NULL;
+    ram_lazy_touch(addr, 1);
+    if (xen_enabled()) {
+        /* We need to check if the requested address is in the RAM
+         * because we don't want to map the entire memory in QEMU.
+         * In that case just map until the end of the page.
+         */
+        if (block->offset == 0) {
+            return xen_map_cache(addr, 0, 0);
+        } else if (block->host == NULL) {
+            block->host =
+                xen_map_cache(block->offset, block->length, 1);
+        }
+    }
+    return block->host + (addr - block->offset);
 }
 
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
- * Same as qemu_get_ram_ptr but avoid reordering ramblocks.
+ * Kept for callers that used to need a lookup that does not reorder
+ * ramblocks; qemu_get_ram_ptr no longer does either.
  */
 void *qemu_safe_ram_ptr(ram_addr_t addr)
 {
-    RAMBlock *block;
-
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (addr - block->offset < block->length) {
-            if (xen_enabled()) {
-                /* We need to check if the requested address is in the RAM
-                 * because we don't want to map the entire memory in QEMU.
-                 * In that case just map until the end of the page.
-                 */
-                if (block->offset == 0) {
-                    return xen_map_cache(addr, 0, 0);
-                } else if (block->host == NULL) {
-                    block->host =
-                        xen_map_cache(block->offset, block->length, 1);
-                }
-            }
-            return block->host + (addr - block->offset);
-        }
-    }
-
-    fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
-    abort();
-
-    return NULL;
+    return qemu_get_ram_ptr(addr);
 }
 
 /* Return a host pointer to guest's ram. Similar to qemu_get_ram_ptr
@@ -2780,18 +4099,17 @@ void *qemu_ram_ptr_length(ram_addr_t addr, ram_addr_t *size)
     if (xen_enabled()) {
         return xen_map_cache(addr, *size, 1);
     } else {
-        RAMBlock *block;
+        RAMBlock *block = ram_block_find(addr);
 
-        QLIST_FOREACH(block, &ram_list.blocks, next) {
-            if (addr - block->offset < block->length) {
-                if (addr - block->offset + *size > block->length)
-                    *size = block->length - addr + block->offset;
-                return block->host + (addr - block->offset);
-            }
+        if (!block) {
+            fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
+            abort();
         }
-
-        fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
-        abort();
+        if (addr - block->offset + *size > block->length) {
+            *size = block->length - addr + block->offset;
+        }
+        ram_lazy_touch(addr, *size);
+        return block->host + (addr - block->offset);
     }
 }
 
@@ -2824,6 +4142,31 @@ int qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr)
     return -1;
 }
 
+/* Return the fd of the -mem-path file that backs the RAM at host address
+   ptr, and the offset of ptr in it, so that another process can map the
+   same memory.  Returns -1 if the RAM is not file backed.  */
+int qemu_ram_get_fd(void *ptr, ram_addr_t *offset)
+{
+#if defined(__linux__) && !defined(TARGET_S390X)
+    RAMBlock *block;
+    uint8_t *host = ptr;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (block->host == NULL) {
+            continue;
+        }
+        if (host - block->host < block->length) {
+            if (block->fd <= 0) {
+                return -1;
+            }
+            *offset = host - block->host;
+            return block->fd;
+        }
+    }
+#endif
+    return -1;
+}
+
 /* Some of the softmmu routines need to translate from a host pointer
    (typically a TLB entry) back to a ram offset.  */
 ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr)
@@ -2897,7 +4240,9 @@ static void notdirty_mem_write(void *opaque, target_phys_addr_t ram_addr,
     dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
     if (!(dirty_flags & CODE_DIRTY_FLAG)) {
 #if !defined(CONFIG_USER_ONLY)
+        tcg_tb_lock();
         tb_invalidate_phys_page_fast(ram_addr, size);
+        tcg_tb_unlock();
         dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
 #endif
     }
@@ -2922,6 +4267,31 @@ static void notdirty_mem_write(void *opaque, target_phys_addr_t ram_addr,
         tlb_set_dirty(cpu_single_env, cpu_single_env->mem_io_vaddr);
 }
 
+/* Fast path for a store that hit a clean page: if the page holds no
+   translated code there is nothing to check, so mark it dirty with a
+   single atomic OR and let the TLB entry go back to direct RAM access.
+   Returns false if the store must go through notdirty_mem_write.  */
+bool notdirty_write_fast(CPUArchState *env, ram_addr_t ram_addr,
+                         target_ulong vaddr)
+{
+    uint8_t *flags = &ram_list.phys_dirty[ram_addr >> TARGET_PAGE_BITS];
+    uint8_t old;
+
+    if (!(*flags & CODE_DIRTY_FLAG)) {
+        return false;
+    }
+    /* Never set CODE_DIRTY_FLAG here, tb_alloc_page may be clearing it.  */
+    old = __sync_fetch_and_or(flags, 0xff & ~CODE_DIRTY_FLAG);
+    if (!(old & MIGRATION_DIRTY_FLAG)) {
+        __sync_fetch_and_add(&ram_list.dirty_pages, 1);
+    }
+    if (!(old & CODE_DIRTY_FLAG)) {
+        return false;
+    }
+    tlb_set_dirty(env, vaddr);
+    return true;
+}
+
 static const MemoryRegionOps notdirty_mem_ops = {
     .read = error_mem_read,
     .write = notdirty_mem_write,
@@ -3163,8 +4533,23 @@ static void io_mem_init(void)
                           "watch", UINT64_MAX);
 }
 
+void phys_map_lock(void)
+{
+    if (mttcg_enabled && tls_var(phys_map_lock_depth)++ == 0) {
+        qemu_mutex_lock(&phys_map_mutex);
+    }
+}
+
+void phys_map_unlock(void)
+{
+    if (mttcg_enabled && --tls_var(phys_map_lock_depth) == 0) {
+        qemu_mutex_unlock(&phys_map_mutex);
+    }
+}
+
 static void core_begin(MemoryListener *listener)
 {
+    phys_map_lock();
     destroy_all_mappings();
     phys_sections_clear();
     phys_map.ptr = PHYS_MAP_NODE_NIL;
@@ -3181,8 +4566,9 @@ static void core_commit(MemoryListener *listener)
     /* since each CPU stores ram addresses in its TLB cache, we must
        reset the modified entries */
     /* XXX: slow ! */
+    phys_map_unlock();
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
-        tlb_flush(env, 1);
+        tlb_flush_request(env);
     }
 }
 
@@ -3406,6 +4792,42 @@ int cpu_memory_rw_debug(CPUArchState *env, target_ulong addr,
 }
 
 #else
+/* Number of bytes of a len byte access at addr that fall in section,
+   which must be RAM.  Sections registered as multipage ranges are
+   contiguous RAM, so one lookup is enough for the whole part of a
+   transfer that lies in them.  l is the length up to the end of the
+   current page.  */
+static inline int phys_section_span(MemoryRegionSection *section,
+                                    target_phys_addr_t addr, int len, int l)
+{
+    uint64_t left;
+
+    if (xen_enabled()) {
+        /* the map cache only guarantees the page to be mapped */
+        return l;
+    }
+    left = section->offset_within_address_space + section->size - addr;
+    return left < len ? left : len;
+}
+
+static void invalidate_and_set_dirty(ram_addr_t addr, ram_addr_t length)
+{
+    ram_addr_t end = addr + length;
+    ram_addr_t next;
+
+    while (addr < end) {
+        next = MIN((addr & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE, end);
+        if (!cpu_physical_memory_is_dirty(addr)) {
+            /* invalidate code */
+            tb_invalidate_phys_page_range(addr, next, 0);
+            /* set dirty bit */
+            cpu_physical_memory_set_dirty_flags(
+                addr, (0xff & ~CODE_DIRTY_FLAG));
+        }
+        addr = next;
+    }
+}
+
 void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                             int len, int is_write)
 {
@@ -3449,16 +4871,13 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                 addr1 = memory_region_get_ram_addr(section->mr)
                     + memory_region_section_addr(section, addr);
                 /* RAM case */
+                l = phys_section_span(section, addr, len, l);
                 ptr = qemu_get_ram_ptr(addr1);
                 memcpy(ptr, buf, l);
-                if (!cpu_physical_memory_is_dirty(addr1)) {
-                    /* invalidate code */
-                    tb_invalidate_phys_page_range(addr1, addr1 + l, 0);
-                    /* set dirty bit */
-                    cpu_physical_memory_set_dirty_flags(
-                        addr1, (0xff & ~CODE_DIRTY_FLAG));
-                }
+                invalidate_and_set_dirty(addr1, l);
                 qemu_put_ram_ptr(ptr);
+            } else {
+                l = phys_section_span(section, addr, len, l);
             }
         } else {
             if (!(memory_region_is_ram(section->mr) ||
@@ -3484,6 +4903,7 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                 }
             } else {
                 /* RAM case */
+                l = phys_section_span(section, addr, len, l);
                 ptr = qemu_get_ram_ptr(section->mr->ram_addr
                                        + memory_region_section_addr(section,
                                                                     addr));
@@ -3531,13 +4951,80 @@ void cpu_physical_memory_write_rom(target_phys_addr_t addr,
     }
 }
 
-typedef struct {
+typedef struct BounceBuffer {
     void *buffer;
     target_phys_addr_t addr;
     target_phys_addr_t len;
+    QLIST_ENTRY(BounceBuffer) link;
 } BounceBuffer;
 
-static BounceBuffer bounce;
+/* Bounce buffers for mapping memory that is not RAM.  At most
+   bounce_pool_size bytes are handed out at a time; beyond that, mapping
+   fails and the caller waits for a map client callback.  */
+#define BOUNCE_POOL_DEFAULT_SIZE (64 * 1024)
+
+static QLIST_HEAD(, BounceBuffer) bounce_list =
+    QLIST_HEAD_INITIALIZER(bounce_list);
+static target_phys_addr_t bounce_pool_size;
+static target_phys_addr_t bounce_in_use;
+static target_phys_addr_t bounce_peak;
+static uint64_t bounce_map_count;
+static uint64_t bounce_wait_count;
+
+static BounceBuffer *bounce_buffer_get(target_phys_addr_t addr,
+                                       target_phys_addr_t len)
+{
+    BounceBuffer *bb;
+
+    if (!bounce_pool_size) {
+        QemuOpts *machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+
+        bounce_pool_size = BOUNCE_POOL_DEFAULT_SIZE;
+        if (machine_opts) {
+            bounce_pool_size = qemu_opt_get_size(machine_opts,
+                                                 "dma_bounce_size",
+                                                 BOUNCE_POOL_DEFAULT_SIZE);
+        }
+        /* always allow at least one mapping */
+        bounce_pool_size = MAX(bounce_pool_size, TARGET_PAGE_SIZE);
+    }
+
+    if (bounce_in_use + len > bounce_pool_size) {
+        bounce_wait_count++;
+        return NULL;
+    }
+    bounce_in_use += len;
+    bounce_peak = MAX(bounce_peak, bounce_in_use);
+    bounce_map_count++;
+
+    bb = g_new(BounceBuffer, 1);
+    bb->buffer = qemu_memalign(TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
+    bb->addr = addr;
+    bb->len = len;
+    QLIST_INSERT_HEAD(&bounce_list, bb, link);
+    return bb;
+}
+
+static BounceBuffer *bounce_buffer_find(void *buffer)
+{
+    BounceBuffer *bb;
+
+    QLIST_FOREACH(bb, &bounce_list, link) {
+        if (bb->buffer == buffer) {
+            return bb;
+        }
+    }
+    return NULL;
+}
+
+void dma_bounce_info(fprintf_function mon_printf, void *f)
+{
+    mon_printf(f, "DMA bounce buffers: %" PRIu64 "/%" PRIu64
+               " bytes in use, peak %" PRIu64 ", %" PRIu64 " maps, %" PRIu64
+               " waits\n", (uint64_t)bounce_in_use,
+               (uint64_t)bounce_pool_size, (uint64_t)bounce_peak,
+               bounce_map_count, bounce_wait_count);
+}
 
 typedef struct MapClient {
     void *opaque;
@@ -3605,18 +5092,21 @@ void *cpu_physical_memory_map(target_phys_addr_t addr,
         section = phys_page_find(page >> TARGET_PAGE_BITS);
 
         if (!(memory_region_is_ram(section->mr) && !section->readonly)) {
-            if (todo || bounce.buffer) {
+            BounceBuffer *bb;
+
+            if (todo) {
+                break;
+            }
+            bb = bounce_buffer_get(addr, l);
+            if (!bb) {
                 break;
             }
-            bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
-            bounce.addr = addr;
-            bounce.len = l;
             if (!is_write) {
-                cpu_physical_memory_read(addr, bounce.buffer, l);
+                cpu_physical_memory_read(addr, bb->buffer, l);
             }
 
             *plen = l;
-            return bounce.buffer;
+            return bb->buffer;
         }
         if (!todo) {
             raddr = memory_region_get_ram_addr(section->mr)
@@ -3640,7 +5130,9 @@ void *cpu_physical_memory_map(target_phys_addr_t addr,
 void cpu_physical_memory_unmap(void *buffer, target_phys_addr_t len,
                                int is_write, target_phys_addr_t access_len)
 {
-    if (buffer != bounce.buffer) {
+    BounceBuffer *bb = bounce_buffer_find(buffer);
+
+    if (!bb) {
         if (is_write) {
             ram_addr_t addr1 = qemu_ram_addr_from_host_nofail(buffer);
             while (access_len) {
@@ -3665,10 +5157,12 @@ void cpu_physical_memory_unmap(void *buffer, target_phys_addr_t len,
         return;
     }
     if (is_write) {
-        cpu_physical_memory_write(bounce.addr, bounce.buffer, access_len);
+        cpu_physical_memory_write(bb->addr, bb->buffer, access_len);
     }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
+    QLIST_REMOVE(bb, link);
+    bounce_in_use -= bb->len;
+    qemu_vfree(bb->buffer);
+    g_free(bb);
     cpu_notify_map_clients();
 }
 
@@ -4112,9 +5606,11 @@ int cpu_memory_rw_debug(CPUArchState *env, target_ulong addr,
 void cpu_io_recompile(CPUArchState *env, uintptr_t retaddr)
 {
     TranslationBlock *tb;
-    uint32_t n, cflags;
-    target_ulong pc, cs_base;
+    TBIOHint *hint;
+    uint32_t n, cflags, rewind = 0;
+    target_ulong pc, cs_base, cur_pc, cur_cs_base;
     uint64_t flags;
+    int cur_flags;
 
     tb = tb_find_pc(retaddr);
     if (!tb) {
@@ -4137,6 +5633,7 @@ void cpu_io_recompile(CPUArchState *env, uintptr_t retaddr)
         env->active_tc.PC -= 4;
         env->icount_decr.u16.low++;
         env->hflags &= ~MIPS_HFLAG_BMASK;
+        rewind = 1;
     }
 #elif defined(TARGET_SH4)
     if ((env->flags & ((DELAY_SLOT | DELAY_SLOT_CONDITIONAL))) != 0
@@ -4144,6 +5641,7 @@ void cpu_io_recompile(CPUArchState *env, uintptr_t retaddr)
         env->pc -= 2;
         env->icount_decr.u16.low++;
         env->flags &= ~(DELAY_SLOT | DELAY_SLOT_CONDITIONAL);
+        rewind = 1;
     }
 #endif
     /* This should never happen.  */
@@ -4154,15 +5652,27 @@ void cpu_io_recompile(CPUArchState *env, uintptr_t retaddr)
     pc = tb->pc;
     cs_base = tb->cs_base;
     flags = tb->flags;
+    if (tb->cflags == 0 || (tb->cflags & CF_LAST_IO)) {
+        hint = tb_io_hint(tb->page_addr[0] + (pc & ~TARGET_PAGE_MASK));
+        hint->phys_pc = tb->page_addr[0] + (pc & ~TARGET_PAGE_MASK);
+        hint->cs_base = cs_base;
+        hint->flags = flags;
+        hint->cflags = cflags;
+    }
+    tb_io_recompile_count++;
     tb_phys_invalidate(tb, -1);
     /* FIXME: In theory this could raise an exception.  In practice
        we have already translated the block once so it's probably ok.  */
     tb_gen_code(env, pc, cs_base, flags, cflags);
-    /* TODO: If env->pc != tb->pc (i.e. the faulting instruction was not
-       the first in the TB) then we end up generating a whole new TB and
-       repeating the fault, which is horribly inefficient.
-       Better would be to execute just this insn uncached, or generate a
-       second new TB.  */
+    /* The instructions before the I/O one have already been executed, so
+       execution resumes in the middle of the block.  Give it a block of
+       its own there, or a full one would be translated only to fault on
+       its first instruction.  */
+    cpu_get_tb_cpu_state(env, &cur_pc, &cur_cs_base, &cur_flags);
+    if (cur_pc != pc) {
+        tb_gen_code(env, cur_pc, cur_cs_base, cur_flags,
+                    (1 + rewind) | CF_LAST_IO);
+    }
     cpu_resume_from_signal(env, NULL);
 }
 
@@ -4172,39 +5682,52 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
     int i, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    int used_buckets, max_chain, chain, r;
+    ptrdiff_t code_size;
     TranslationBlock *tb;
+    CPUArchState *env;
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for(i = 0; i < nb_tbs; i++) {
-        tb = &tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size)
-            max_target_code_size = tb->size;
-        if (tb->page_addr[1] != -1)
-            cross_page++;
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    code_size = 0;
+    for (r = 0; r < tb_nb_regions; r++) {
+        code_size += tb_regions[r].code_end - tb_regions[r].code_start;
+    }
+    for (r = 0; r < tb_nb_regions; r++) {
+        for (i = 0; i < tb_regions[r].nb_tbs; i++) {
+            tb = &tbs[tb_regions[r].first_tb + i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
     cpu_fprintf(f, "gen code size       %td/%ld\n",
-                code_gen_ptr - code_gen_buffer, code_gen_buffer_max_size);
+                code_size, code_gen_buffer_max_size);
+    cpu_fprintf(f, "code regions        %d (current %d, %d evicted)\n",
+                tb_nb_regions, tb_cur_region, tb_region_evict_count);
     cpu_fprintf(f, "TB count            %d/%d\n", 
                 nb_tbs, code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
                 nb_tbs ? target_code_size / nb_tbs : 0,
                 max_target_code_size);
     cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-                nb_tbs ? (code_gen_ptr - code_gen_buffer) / nb_tbs : 0,
-                target_code_size ? (double) (code_gen_ptr - code_gen_buffer) / target_code_size : 0);
+                nb_tbs ? code_size / nb_tbs : 0,
+                target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n",
             cross_page,
             nb_tbs ? (cross_page * 100) / nb_tbs : 0);
@@ -4213,10 +5736,59 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 nb_tbs ? (direct_jmp_count * 100) / nb_tbs : 0,
                 direct_jmp2_count,
                 nb_tbs ? (direct_jmp2_count * 100) / nb_tbs : 0);
+    used_buckets = 0;
+    max_chain = 0;
+    for (i = 0; i < (1 << tb_phys_hash->bits); i++) {
+        chain = 0;
+        for (tb = tb_phys_hash->buckets[i]; tb != NULL;
+             tb = tb->phys_hash_next) {
+            chain++;
+        }
+        if (chain) {
+            used_buckets++;
+        }
+        if (chain > max_chain) {
+            max_chain = chain;
+        }
+    }
+    cpu_fprintf(f, "TB hash buckets     %d/%d (%d%% used)\n",
+                used_buckets, 1 << tb_phys_hash->bits,
+                (used_buckets * 100) >> tb_phys_hash->bits);
+    cpu_fprintf(f, "TB hash chain len   %0.2f avg, %d max\n",
+                used_buckets ? (double)nb_tbs / used_buckets : 0,
+                max_chain);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
+    cpu_fprintf(f, "TB translations     %" PRIu64 " (%" PRIu64 " ns avg)\n",
+                tb_gen_count, tb_gen_count ? tb_gen_time / tb_gen_count : 0);
+    cpu_fprintf(f, "TB host bytes/insn  %0.1f (+%0.1f restore data)\n",
+                tb_gen_guest_insns ?
+                (double)tb_gen_host_bytes / tb_gen_guest_insns : 0,
+                tb_gen_guest_insns ?
+                (double)tb_gen_search_bytes / tb_gen_guest_insns : 0);
+    cpu_fprintf(f, "TB state restores   %" PRIu64 " (%" PRIu64
+                " regenerated code)\n",
+                tb_restore_count, tb_restore_regen_count);
+    if (use_icount) {
+        cpu_fprintf(f, "TB I/O recompiles   %" PRIu64 " (%" PRIu64
+                    " avoided by hints)\n",
+                    tb_io_recompile_count, tb_io_hint_count);
+    }
+    cpu_fprintf(f, "SMC skipped writes  %u (max %u on page 0x%" PRIx64 ")\n",
+                smc_write_skip_count, smc_write_skip_max,
+                (uint64_t)smc_write_skip_max_page);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        cpu_fprintf(f, "CPU #%d TLB fills %" PRIu64 " victim hits %" PRIu64
+                    " (%" PRIu64 "%%) flushes %" PRIu64 " full %" PRIu64
+                    " partial\n", env->cpu_index, env->tlb_fill_count,
+                    env->tlb_victim_hits,
+                    env->tlb_fill_count + env->tlb_victim_hits ?
+                    env->tlb_victim_hits * 100 /
+                    (env->tlb_fill_count + env->tlb_victim_hits) : 0,
+                    env->tlb_full_flushes, env->tlb_partial_flushes);
+    }
     tcg_dump_info(f, cpu_fprintf);
 }
 
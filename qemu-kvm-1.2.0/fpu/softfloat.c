@@ -40,6 +40,8 @@ these four paragraphs for those parts of this code that are retained.
  */
 #include "config.h"
 
+#include <float.h>
+
 #include "softfloat.h"
 
 /*----------------------------------------------------------------------------
@@ -74,6 +76,148 @@ void set_floatx80_rounding_precision(int val STATUS_PARAM)
     STATUS(floatx80_rounding_precision) = val;
 }
 
+/*----------------------------------------------------------------------------
+| Host FPU fast path for single and double precision add, sub, mul and div.
+| It is only taken when the host computes the result bit-exactly with the
+| same exception flags softfloat would produce: rounding is to nearest even,
+| the inexact flag is already set (so we need not find out whether the host
+| result was exact), both inputs are zero or normal, and the result is
+| normal or an exact zero (so overflow, underflow and flushing of outputs
+| cannot be involved).  Everything else goes through the software code.
+| Hosts that evaluate float expressions in extended precision (x87) would
+| round twice, so the fast path is disabled there.
+*----------------------------------------------------------------------------*/
+
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#define SOFTFLOAT_HOST_FPU 1
+#else
+#define SOFTFLOAT_HOST_FPU 0
+#endif
+
+enum {
+    host_fpu_add,
+    host_fpu_sub,
+    host_fpu_mul,
+    host_fpu_div
+};
+
+INLINE flag host_fpu_usable(float_status *status)
+{
+    return SOFTFLOAT_HOST_FPU
+        && STATUS(float_rounding_mode) == float_round_nearest_even
+        && (STATUS(float_exception_flags) & float_flag_inexact);
+}
+
+/*----------------------------------------------------------------------------
+| Returns 1 if a zero result of `op' on `a' and `b' is exact for any inputs of
+| that kind, e.g. because an operand of a multiplication is zero.
+*----------------------------------------------------------------------------*/
+
+INLINE flag host_fpu_trivial_zero(int op, flag aZero, flag bZero)
+{
+    switch (op) {
+    case host_fpu_add:
+    case host_fpu_sub:
+        return aZero && bZero;
+    case host_fpu_mul:
+        return aZero || bZero;
+    default:
+        return aZero;
+    }
+}
+
+static flag float32_host_op(int op, float32 a, float32 b, float32 *res
+                            STATUS_PARAM)
+{
+    union {
+        uint32_t i;
+        float f;
+    } ua, ub, ur;
+    flag aZero, bZero;
+    int_fast16_t rExp;
+
+    if (!host_fpu_usable(status)) {
+        return 0;
+    }
+    aZero = float32_is_zero(a);
+    bZero = float32_is_zero(b);
+    if ((!aZero && !float32_is_normal(a)) || (!bZero && !float32_is_normal(b))
+        || (op == host_fpu_div && bZero)) {
+        return 0;
+    }
+    ua.i = float32_val(a);
+    ub.i = float32_val(b);
+    switch (op) {
+    case host_fpu_add:
+        ur.f = ua.f + ub.f;
+        break;
+    case host_fpu_sub:
+        ur.f = ua.f - ub.f;
+        break;
+    case host_fpu_mul:
+        ur.f = ua.f * ub.f;
+        break;
+    default:
+        ur.f = ua.f / ub.f;
+        break;
+    }
+    rExp = (ur.i >> 23) & 0xFF;
+    if (rExp == 0xFF) {
+        return 0;
+    }
+    if (rExp == 0 && !host_fpu_trivial_zero(op, aZero, bZero)) {
+        return 0;
+    }
+    *res = make_float32(ur.i);
+    return 1;
+}
+
+static flag float64_host_op(int op, float64 a, float64 b, float64 *res
+                            STATUS_PARAM)
+{
+    union {
+        uint64_t i;
+        double f;
+    } ua, ub, ur;
+    flag aZero, bZero;
+    int_fast16_t rExp;
+
+    if (!host_fpu_usable(status)) {
+        return 0;
+    }
+    aZero = float64_is_zero(a);
+    bZero = float64_is_zero(b);
+    if ((!aZero && !float64_is_normal(a)) || (!bZero && !float64_is_normal(b))
+        || (op == host_fpu_div && bZero)) {
+        return 0;
+    }
+    ua.i = float64_val(a);
+    ub.i = float64_val(b);
+    switch (op) {
+    case host_fpu_add:
+        ur.f = ua.f + ub.f;
+        break;
+    case host_fpu_sub:
+        ur.f = ua.f - ub.f;
+        break;
+    case host_fpu_mul:
+        ur.f = ua.f * ub.f;
+        break;
+    default:
+        ur.f = ua.f / ub.f;
+        break;
+    }
+    rExp = (ur.i >> 52) & 0x7FF;
+    if (rExp == 0x7FF) {
+        return 0;
+    }
+    if (rExp == 0 && !host_fpu_trivial_zero(op, aZero, bZero)) {
+        return 0;
+    }
+    *res = make_float64(ur.i);
+    return 1;
+}
+
 /*----------------------------------------------------------------------------
 | Returns the fraction bits of the half-precision floating-point value `a'.
 *----------------------------------------------------------------------------*/
@@ -1851,7 +1995,13 @@ static float32 subFloat32Sigs( float32 a, float32 b, flag zSign STATUS_PARAM)
 
 float32 float32_add( float32 a, float32 b STATUS_PARAM )
 {
+    float32 hres;
     flag aSign, bSign;
+
+    if (float32_host_op(host_fpu_add, a, b, &hres STATUS_VAR)) {
+        return hres;
+    }
+
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -1874,7 +2024,13 @@ float32 float32_add( float32 a, float32 b STATUS_PARAM )
 
 float32 float32_sub( float32 a, float32 b STATUS_PARAM )
 {
+    float32 hres;
     flag aSign, bSign;
+
+    if (float32_host_op(host_fpu_sub, a, b, &hres STATUS_VAR)) {
+        return hres;
+    }
+
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -1897,12 +2053,17 @@ float32 float32_sub( float32 a, float32 b STATUS_PARAM )
 
 float32 float32_mul( float32 a, float32 b STATUS_PARAM )
 {
+    float32 hres;
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
     uint32_t aSig, bSig;
     uint64_t zSig64;
     uint32_t zSig;
 
+    if (float32_host_op(host_fpu_mul, a, b, &hres STATUS_VAR)) {
+        return hres;
+    }
+
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -1960,9 +2121,15 @@ float32 float32_mul( float32 a, float32 b STATUS_PARAM )
 
 float32 float32_div( float32 a, float32 b STATUS_PARAM )
 {
+    float32 hres;
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
     uint32_t aSig, bSig, zSig;
+
+    if (float32_host_op(host_fpu_div, a, b, &hres STATUS_VAR)) {
+        return hres;
+    }
+
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -3414,7 +3581,13 @@ static float64 subFloat64Sigs( float64 a, float64 b, flag zSign STATUS_PARAM )
 
 float64 float64_add( float64 a, float64 b STATUS_PARAM )
 {
+    float64 hres;
     flag aSign, bSign;
+
+    if (float64_host_op(host_fpu_add, a, b, &hres STATUS_VAR)) {
+        return hres;
+    }
+
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3437,7 +3610,13 @@ float64 float64_add( float64 a, float64 b STATUS_PARAM )
 
 float64 float64_sub( float64 a, float64 b STATUS_PARAM )
 {
+    float64 hres;
     flag aSign, bSign;
+
+    if (float64_host_op(host_fpu_sub, a, b, &hres STATUS_VAR)) {
+        return hres;
+    }
+
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3460,10 +3639,15 @@ float64 float64_sub( float64 a, float64 b STATUS_PARAM )
 
 float64 float64_mul( float64 a, float64 b STATUS_PARAM )
 {
+    float64 hres;
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
     uint64_t aSig, bSig, zSig0, zSig1;
 
+    if (float64_host_op(host_fpu_mul, a, b, &hres STATUS_VAR)) {
+        return hres;
+    }
+
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3521,11 +3705,17 @@ float64 float64_mul( float64 a, float64 b STATUS_PARAM )
 
 float64 float64_div( float64 a, float64 b STATUS_PARAM )
 {
+    float64 hres;
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
     uint64_t aSig, bSig, zSig;
     uint64_t rem0, rem1;
     uint64_t term0, term1;
+
+    if (float64_host_op(host_fpu_div, a, b, &hres STATUS_VAR)) {
+        return hres;
+    }
+
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -0,0 +1,224 @@
+/*
+ * Hierarchical bitmap
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "host-utils.h"
+#include "qemu/hbitmap.h"
+
+/*
+ * Level 0 is the bit array itself.  Bit N of level L+1 is set iff word N
+ * of level L is non-zero.  The topmost level fits in a single word.
+ */
+#define HBITMAP_BITS_PER_WORD   64
+#define HBITMAP_LOG_BITS        6
+#define HBITMAP_MAX_LEVELS      11      /* enough for 2^64 bits */
+
+struct HBitmap {
+    uint64_t size;              /* in items */
+    uint64_t nbits;             /* in granules */
+    uint64_t count;             /* set bits */
+    int granularity;
+    int levels;
+    uint64_t *level[HBITMAP_MAX_LEVELS];
+    uint64_t words[HBITMAP_MAX_LEVELS];
+};
+
+static inline uint64_t hbitmap_words(uint64_t nbits)
+{
+    return (nbits + HBITMAP_BITS_PER_WORD - 1) >> HBITMAP_LOG_BITS;
+}
+
+HBitmap *hbitmap_alloc(uint64_t size, int granularity)
+{
+    HBitmap *hb = g_new0(HBitmap, 1);
+    uint64_t nbits;
+    int i;
+
+    assert(granularity >= 0 && granularity < 64);
+    hb->size = size;
+    hb->granularity = granularity;
+    hb->nbits = (size + (1ULL << granularity) - 1) >> granularity;
+
+    nbits = hb->nbits;
+    for (i = 0; ; i++) {
+        assert(i < HBITMAP_MAX_LEVELS);
+        hb->words[i] = MAX(hbitmap_words(nbits), 1);
+        hb->level[i] = g_new0(uint64_t, hb->words[i]);
+        if (hb->words[i] == 1) {
+            break;
+        }
+        nbits = hb->words[i];
+    }
+    hb->levels = i + 1;
+    return hb;
+}
+
+void hbitmap_free(HBitmap *hb)
+{
+    int i;
+
+    for (i = 0; i < hb->levels; i++) {
+        g_free(hb->level[i]);
+    }
+    g_free(hb);
+}
+
+int hbitmap_granularity(const HBitmap *hb)
+{
+    return hb->granularity;
+}
+
+uint64_t hbitmap_count(const HBitmap *hb)
+{
+    return hb->count << hb->granularity;
+}
+
+bool hbitmap_empty(const HBitmap *hb)
+{
+    return hb->count == 0;
+}
+
+/* Propagate a word of @level going from zero to non-zero or back */
+static void hbitmap_update_parents(HBitmap *hb, int level, uint64_t word,
+                                   bool set)
+{
+    while (++level < hb->levels) {
+        uint64_t *p = &hb->level[level][word >> HBITMAP_LOG_BITS];
+        uint64_t bit = 1ULL << (word & (HBITMAP_BITS_PER_WORD - 1));
+        uint64_t old = *p;
+
+        if (set) {
+            *p |= bit;
+            if (old) {
+                return;
+            }
+        } else {
+            *p &= ~bit;
+            if (*p) {
+                return;
+            }
+        }
+        word >>= HBITMAP_LOG_BITS;
+    }
+}
+
+static void hbitmap_change(HBitmap *hb, uint64_t start, uint64_t count,
+                           bool set)
+{
+    uint64_t first, last, word;
+
+    if (count == 0 || start >= hb->size) {
+        return;
+    }
+    count = MIN(count, hb->size - start);
+    first = start >> hb->granularity;
+    last = (start + count - 1) >> hb->granularity;
+
+    for (word = first >> HBITMAP_LOG_BITS;
+         word <= last >> HBITMAP_LOG_BITS; word++) {
+        uint64_t lo = MAX(first, word << HBITMAP_LOG_BITS);
+        uint64_t hi = MIN(last, (word << HBITMAP_LOG_BITS) +
+                                HBITMAP_BITS_PER_WORD - 1);
+        uint64_t mask, old, new;
+
+        mask = ~0ULL << (lo & (HBITMAP_BITS_PER_WORD - 1));
+        mask &= ~0ULL >> (HBITMAP_BITS_PER_WORD - 1 -
+                          (hi & (HBITMAP_BITS_PER_WORD - 1)));
+
+        old = hb->level[0][word];
+        new = set ? old | mask : old & ~mask;
+        if (new == old) {
+            continue;
+        }
+        hb->level[0][word] = new;
+        if (set) {
+            hb->count += ctpop64(new) - ctpop64(old);
+            if (!old) {
+                hbitmap_update_parents(hb, 0, word, true);
+            }
+        } else {
+            hb->count -= ctpop64(old) - ctpop64(new);
+            if (!new) {
+                hbitmap_update_parents(hb, 0, word, false);
+            }
+        }
+    }
+}
+
+void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
+{
+    hbitmap_change(hb, start, count, true);
+}
+
+void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
+{
+    hbitmap_change(hb, start, count, false);
+}
+
+bool hbitmap_get(const HBitmap *hb, uint64_t item)
+{
+    uint64_t bit;
+
+    if (item >= hb->size) {
+        return false;
+    }
+    bit = item >> hb->granularity;
+    return (hb->level[0][bit >> HBITMAP_LOG_BITS] >>
+            (bit & (HBITMAP_BITS_PER_WORD - 1))) & 1;
+}
+
+/* Return the first set bit of level 0 at or after @pos, or -1 */
+static int64_t hbitmap_next_bit(const HBitmap *hb, uint64_t pos)
+{
+    int level = 0;
+    uint64_t word, w;
+
+    for (;;) {
+        word = pos >> HBITMAP_LOG_BITS;
+        if (word < hb->words[level]) {
+            w = hb->level[level][word] &
+                (~0ULL << (pos & (HBITMAP_BITS_PER_WORD - 1)));
+            if (w) {
+                break;
+            }
+        }
+        /* Nothing left in this word, ask the summary for the next one */
+        if (level == hb->levels - 1) {
+            return -1;
+        }
+        level++;
+        pos = word + 1;
+    }
+
+    pos = (word << HBITMAP_LOG_BITS) + ctz64(w);
+    while (level > 0) {
+        level--;
+        w = hb->level[level][pos];
+        assert(w);
+        pos = (pos << HBITMAP_LOG_BITS) + ctz64(w);
+    }
+    return pos;
+}
+
+void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
+{
+    hbi->hb = hb;
+    hbi->pos = first >> hb->granularity;
+}
+
+int64_t hbitmap_iter_next(HBitmapIter *hbi)
+{
+    int64_t bit = hbitmap_next_bit(hbi->hb, hbi->pos);
+
+    if (bit < 0) {
+        hbi->pos = hbi->hb->nbits;
+        return -1;
+    }
+    hbi->pos = bit + 1;
+    return bit << hbi->hb->granularity;
+}
@@ -81,6 +81,21 @@ STEXI
 @item block_stream
 @findex block_stream
 Copy data from a backing file into a block device.
+ETEXI
+
+    {
+        .name       = "block_commit",
+        .args_type  = "device:B,top:s?,base:s?,speed:o?",
+        .params     = "device [top [base [speed]]]",
+        .help       = "commit data from a backing file into its base",
+        .mhandler.cmd = hmp_block_commit,
+    },
+
+STEXI
+@item block_commit
+@findex block_commit
+Commit the data of a backing file (or of the active image when @var{top}
+is omitted) into a base image while the guest runs.
 ETEXI
 
     {
@@ -109,6 +124,20 @@ STEXI
 @item block_job_cancel
 @findex block_job_cancel
 Stop an active block streaming operation.
+ETEXI
+
+    {
+        .name       = "block_job_complete",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "finish a background block operation that is ready",
+        .mhandler.cmd = hmp_block_job_complete,
+    },
+
+STEXI
+@item block_job_complete
+@findex block_job_complete
+Switch a device over to its mirror once the mirroring job is ready.
 ETEXI
 
     {
@@ -264,34 +293,48 @@ ETEXI
 
     {
         .name       = "savevm",
-        .args_type  = "name:s?",
-        .params     = "[tag|id]",
-        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created",
+        .args_type  = "live:-l,name:s?",
+        .params     = "[-l] [tag|id]",
+        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created"
+                      "\n\t\t\t -l to save RAM while the VM keeps running",
         .mhandler.cmd = do_savevm,
     },
 
 STEXI
-@item savevm [@var{tag}|@var{id}]
+@item savevm [-l] [@var{tag}|@var{id}]
 @findex savevm
 Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
 a snapshot with the same tag or ID, it is replaced. More info at
 @ref{vm_snapshots}.
+
+With @option{-l}, RAM is saved while the virtual machine keeps running,
+the same way as for live migration.  The virtual machine is only stopped
+at the end, for at most about the maximum migration downtime (see
+@code{migrate_set_downtime}).
 ETEXI
 
     {
         .name       = "loadvm",
-        .args_type  = "name:s",
-        .params     = "tag|id",
-        .help       = "restore a VM snapshot from its tag or id",
+        .args_type  = "lazy:-l,name:s",
+        .params     = "[-l] tag|id",
+        .help       = "restore a VM snapshot from its tag or id "
+                      "(-l: load RAM while the guest runs)",
         .mhandler.cmd = do_loadvm,
     },
 
 STEXI
-@item loadvm @var{tag}|@var{id}
+@item loadvm [-l] @var{tag}|@var{id}
 @findex loadvm
 Set the whole virtual machine to the snapshot identified by the tag
 @var{tag} or the unique snapshot ID @var{id}.
+
+With @option{-l}, the guest resumes as soon as the device state is loaded,
+and its RAM is read from the snapshot when first accessed and in the
+background.  This needs a snapshot taken by @code{savevm} without @option{-l}
+and single-threaded TCG; it is not available with KVM.  Until all RAM is
+loaded, the image holding the VM state is in use, and saving the VM or
+migrating it first waits for the rest of RAM.
 ETEXI
 
     {
@@ -794,6 +837,22 @@ STEXI
 @item nmi @var{cpu}
 @findex nmi
 Inject an NMI on the given CPU (x86 only).
+ETEXI
+
+    {
+        .name       = "set_thread_affinity",
+        .args_type  = "thread:s,cpus:s",
+        .params     = "vcpu|main|dataplane cpus",
+        .help       = "restrict a vCPU or I/O thread to a set of host CPUs",
+        .mhandler.cmd = hmp_set_thread_affinity,
+    },
+
+STEXI
+@item set_thread_affinity @var{thread} @var{cpus}
+@findex set_thread_affinity
+Restrict a thread to the host CPUs in @var{cpus}, such as @code{0-3,8}.
+@var{thread} is the index of a vCPU, @code{main} for the main I/O thread, or
+@code{dataplane} for the threads of all x-data-plane devices.
 ETEXI
 
     {
@@ -887,6 +946,36 @@ STEXI
 @item migrate_set_cache_size @var{value}
 @findex migrate_set_cache_size
 Set cache size to @var{value} (in bytes) for xbzrle migrations.
+ETEXI
+
+    {
+        .name       = "migrate_set_compress_threads",
+        .args_type  = "value:i",
+        .params     = "value",
+        .help       = "set the number of page compression threads used "
+                      "when the compress capability is on",
+        .mhandler.cmd = hmp_migrate_set_compress_threads,
+    },
+
+STEXI
+@item migrate_set_compress_threads @var{value}
+@findex migrate_set_compress_threads
+Set the number of page compression threads to @var{value}.
+ETEXI
+
+    {
+        .name       = "migrate_set_multifd_channels",
+        .args_type  = "value:i",
+        .params     = "value",
+        .help       = "set the number of connections RAM is sent over "
+                      "when the multifd capability is on",
+        .mhandler.cmd = hmp_migrate_set_multifd_channels,
+    },
+
+STEXI
+@item migrate_set_multifd_channels @var{value}
+@findex migrate_set_multifd_channels
+Set the number of multifd migration connections to @var{value}.
 ETEXI
 
     {
@@ -953,9 +1042,11 @@ ETEXI
 #if defined(CONFIG_HAVE_CORE_DUMP)
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:-p,protocol:s,begin:i?,length:i?",
-        .params     = "[-p] protocol [begin] [length]",
+        .args_type  = "paging:-p,zlib:-z,live:-l,protocol:s,begin:i?,length:i?",
+        .params     = "[-p] [-z] [-l] protocol [begin] [length]",
         .help       = "dump guest memory to file"
+                      "\n\t\t\t -z: kdump-compressed format"
+                      "\n\t\t\t -l: live, with -z, while the guest runs"
                       "\n\t\t\t begin(optional): the starting physical address"
                       "\n\t\t\t length(optional): the memory size, in bytes",
         .user_print = monitor_user_noop,
@@ -964,13 +1055,17 @@ ETEXI
 
 
 STEXI
-@item dump-guest-memory [-p] @var{protocol} @var{begin} @var{length}
+@item dump-guest-memory [-p] [-z] [-l] @var{protocol} @var{begin} @var{length}
 @findex dump-guest-memory
 Dump guest memory to @var{protocol}. The file can be processed with crash or
 gdb.
   protocol: destination file(started with "file:") or destination file
             descriptor (started with "fd:")
     paging: do paging to get guest's memory mapping
+        -z: use the flattened kdump-compressed format with zlib, restore it
+            with "makedumpfile -R" for crash
+        -l: with -z, dump while the guest runs, and stop it only for the
+            pages it wrote meanwhile
      begin: the starting physical address. It's optional, and should be
             specified with length together.
     length: the memory size, in bytes. It's optional, and should be specified
@@ -1189,6 +1284,54 @@ STEXI
 @item set_link @var{name} [on|off]
 @findex set_link
 Switch link @var{name} on (i.e. up) or off (i.e. down).
+ETEXI
+
+    {
+        .name       = "device_profile",
+        .args_type  = "enable:b",
+        .params     = "on|off",
+        .help       = "start or stop counting host CPU time per device",
+        .mhandler.cmd = hmp_device_profile,
+    },
+
+STEXI
+@item device_profile [on|off]
+@findex device_profile
+Start or stop counting calls and host cycle counter ticks per memory region
+and per main loop file descriptor handler.  Starting clears the counters.
+Use @code{info device-profile} to show them.
+ETEXI
+
+    {
+        .name       = "lock_stats",
+        .args_type  = "enable:b",
+        .params     = "on|off",
+        .help       = "start or stop gathering global mutex statistics",
+        .mhandler.cmd = hmp_lock_stats,
+    },
+
+STEXI
+@item lock_stats [on|off]
+@findex lock_stats
+Start or stop measuring how long each thread waits for and holds the global
+mutex.  Starting clears the statistics.  Use @code{info lock-stats} to show
+them.
+ETEXI
+
+    {
+        .name       = "set_net_coalesce",
+        .args_type  = "name:s,rx_frames:i,rx_usecs:i,tx_frames:i,tx_usecs:i",
+        .params     = "name rx_frames rx_usecs tx_frames tx_usecs",
+        .help       = "set interrupt moderation of a network adapter",
+        .mhandler.cmd = hmp_set_net_coalesce,
+    },
+
+STEXI
+@item set_net_coalesce @var{name} @var{rx_frames} @var{rx_usecs} @var{tx_frames} @var{tx_usecs}
+@findex set_net_coalesce
+Interrupt the guest after @var{rx_frames} received or @var{tx_frames}
+transmitted buffers, or at most @var{rx_usecs} or @var{tx_usecs}
+microseconds after the first one.  A delay of 0 disables moderation.
 ETEXI
 
     {
@@ -1446,6 +1589,8 @@ Show various information about the system state.
 show the version of QEMU
 @item info network
 show the various VLANs and the associated devices
+@item info netqueues
+show the receive queue statistics of the network clients
 @item info chardev
 show the character devices
 @item info block
@@ -1456,6 +1601,10 @@ show block device statistics
 show the cpu registers
 @item info cpus
 show infos for each CPU
+@item info cpulocks
+show how often each CPU took the global mutex and how long it waited
+@item info lock-stats
+show which threads waited for and held the global mutex, see @code{lock_stats}
 @item info history
 show the command line history
 @item info irq
@@ -1468,12 +1617,19 @@ show emulated PCI device info
 show virtual to physical memory mappings (i386, SH4, SPARC, PPC, and Xtensa only)
 @item info mem
 show the active virtual memory mappings (i386 only)
+@item info vapic
+show the instructions patched for TPR access, and per CPU the APIC accesses
+that still trap and the EOIs done through PV EOI (i386 only)
 @item info jit
 show dynamic compiler info
 @item info numa
 show NUMA information
 @item info kvm
 show KVM information
+@item info timers
+show timer slack and host wakeups caused by timers
+@item info device-profile
+show host CPU time spent emulating devices, see @code{device_profile}
 @item info usb
 show USB devices plugged on the virtual USB hub
 @item info usbhost
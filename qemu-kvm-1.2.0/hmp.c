@@ -63,10 +63,48 @@ void hmp_info_kvm(Monitor *mon)
     } else {
         monitor_printf(mon, "not compiled\n");
     }
+    if (info->has_route_commits) {
+        monitor_printf(mon, "irq route commits: %" PRId64
+                       " (%" PRId64 "/s), cached MSI routes: %" PRId64 "\n",
+                       info->route_commits, info->route_commits_per_second,
+                       info->msi_routes);
+    }
 
     qapi_free_KvmInfo(info);
 }
 
+void hmp_info_timers(Monitor *mon)
+{
+    TimersInfo *info;
+
+    info = qmp_query_timers(NULL);
+    monitor_printf(mon, "timer slack: %" PRId64 " ns\n", info->slack_ns);
+    monitor_printf(mon, "alarm wakeups: %" PRId64 " (%" PRId64 "/s)\n",
+                   info->alarm_wakeups, info->alarm_wakeups_per_second);
+
+    qapi_free_TimersInfo(info);
+}
+
+void hmp_info_device_profile(Monitor *mon)
+{
+    DeviceProfileInfo *info;
+    DeviceProfileEntryList *entry;
+
+    info = qmp_query_device_profile(NULL);
+    monitor_printf(mon, "device profiling: %s\n",
+                   info->enabled ? "on" : "off");
+    for (entry = info->entries; entry; entry = entry->next) {
+        DeviceProfileEntry *e = entry->value;
+
+        monitor_printf(mon, "%-4s %-32s calls=%" PRId64 " ticks=%" PRId64
+                       " ticks/call=%" PRId64 "\n",
+                       DeviceProfileKind_lookup[e->kind], e->name,
+                       e->calls, e->ticks, e->ticks / e->calls);
+    }
+
+    qapi_free_DeviceProfileInfo(info);
+}
+
 void hmp_info_status(Monitor *mon)
 {
     StatusInfo *info;
@@ -108,6 +146,24 @@ void hmp_info_chardev(Monitor *mon)
     qapi_free_ChardevInfoList(char_info);
 }
 
+void hmp_info_netqueues(Monitor *mon)
+{
+    NetQueueInfoList *queue_list, *info;
+
+    queue_list = qmp_query_net_queues(NULL);
+    for (info = queue_list; info; info = info->next) {
+        monitor_printf(mon, "%s.%" PRId64 ": capacity=%" PRId64
+                       " backlog=%" PRId64 " max-backlog=%" PRId64
+                       " queued=%" PRId64 " dropped=%" PRId64 "\n",
+                       info->value->name, info->value->queue_index,
+                       info->value->capacity, info->value->backlog,
+                       info->value->max_backlog, info->value->queued,
+                       info->value->dropped);
+    }
+
+    qapi_free_NetQueueInfoList(queue_list);
+}
+
 void hmp_info_mice(Monitor *mon)
 {
     MouseInfoList *mice_list, *mouse;
@@ -166,6 +222,8 @@ void hmp_info_migrate(Monitor *mon)
                        info->ram->normal);
         monitor_printf(mon, "normal bytes: %" PRIu64 " kbytes\n",
                        info->ram->normal_bytes >> 10);
+        monitor_printf(mon, "skipped: %" PRIu64 " pages\n",
+                       info->ram->skipped);
     }
 
     if (info->has_disk) {
@@ -186,10 +244,53 @@ void hmp_info_migrate(Monitor *mon)
                        info->xbzrle_cache->pages);
         monitor_printf(mon, "xbzrle cache miss: %" PRIu64 "\n",
                        info->xbzrle_cache->cache_miss);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
+        if (info->xbzrle_cache->cache_hit + info->xbzrle_cache->cache_miss) {
+            monitor_printf(mon, "xbzrle cache hit rate: %" PRIu64 " %%\n",
+                           info->xbzrle_cache->cache_hit * 100 /
+                           (info->xbzrle_cache->cache_hit +
+                            info->xbzrle_cache->cache_miss));
+        }
+        monitor_printf(mon, "xbzrle cache evictions: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_evictions);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->has_compress_threads) {
+        CompressThreadStatsList *t;
+
+        for (t = info->compress_threads; t; t = t->next) {
+            monitor_printf(mon, "compress thread %" PRId64 ": %" PRIu64
+                           " pages, %" PRIu64 " kbytes in, %" PRIu64
+                           " kbytes out, busy %" PRIu64 " milliseconds\n",
+                           t->value->id, t->value->pages,
+                           t->value->bytes_in >> 10, t->value->bytes_out >> 10,
+                           t->value->busy_time);
+        }
+    }
+
+    if (info->has_dirty_heat) {
+        DirtyHeatStatsList *h;
+        DirtyHeatLevelList *l;
+
+        for (h = info->dirty_heat; h; h = h->next) {
+            monitor_printf(mon, "dirty heat %" PRIu64 ":", h->value->iteration);
+            for (l = h->value->histogram; l; l = l->next) {
+                monitor_printf(mon, " %" PRId64 ":%" PRIu64,
+                               l->value->heat, l->value->pages);
+            }
+            monitor_printf(mon, ", %" PRIu64 " pages deferred\n",
+                           h->value->deferred_pages);
+        }
+    }
+
+    if (info->has_cpu_throttle_percentage) {
+        monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
+                       info->cpu_throttle_percentage);
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -252,12 +353,87 @@ void hmp_info_cpus(Monitor *mon)
             monitor_printf(mon, " (halted)");
         }
 
-        monitor_printf(mon, " thread_id=%" PRId64 "\n", cpu->value->thread_id);
+        monitor_printf(mon, " thread_id=%" PRId64, cpu->value->thread_id);
+
+        if (cpu->value->has_halt_poll_ns) {
+            monitor_printf(mon, " halt_poll_ns=%" PRId64 " (%" PRId64
+                           " ok, %" PRId64 " missed)",
+                           cpu->value->halt_poll_ns,
+                           cpu->value->halt_poll_successes,
+                           cpu->value->halt_poll_misses);
+        }
+        monitor_printf(mon, "\n");
     }
 
     qapi_free_CpuInfoList(cpu_list);
 }
 
+void hmp_info_cpulocks(Monitor *mon)
+{
+    CpuLockStatsList *stats_list, *stats;
+    CpuLockWaitBucketList *bucket;
+
+    stats_list = qmp_query_cpu_lock_stats(NULL);
+
+    for (stats = stats_list; stats; stats = stats->next) {
+        monitor_printf(mon, "CPU #%" PRId64 ": lockless=%" PRId64
+                       " locked=%" PRId64 " waits:", stats->value->CPU,
+                       stats->value->lockless_exits,
+                       stats->value->locked_exits);
+        for (bucket = stats->value->wait_histogram; bucket;
+             bucket = bucket->next) {
+            if (bucket->value->has_below_us) {
+                monitor_printf(mon, " <%" PRId64 "us=%" PRId64,
+                               bucket->value->below_us, bucket->value->count);
+            } else {
+                monitor_printf(mon, " longer=%" PRId64, bucket->value->count);
+            }
+        }
+        monitor_printf(mon, "\n");
+    }
+
+    qapi_free_CpuLockStatsList(stats_list);
+}
+
+static void print_lock_stats_hist(Monitor *mon, const char *name,
+                                  LockStatsBucketList *bucket)
+{
+    monitor_printf(mon, "    %s:", name);
+    for (; bucket; bucket = bucket->next) {
+        if (bucket->value->has_below_us) {
+            monitor_printf(mon, " <%" PRId64 "us=%" PRId64,
+                           bucket->value->below_us, bucket->value->count);
+        } else {
+            monitor_printf(mon, " longer=%" PRId64, bucket->value->count);
+        }
+    }
+    monitor_printf(mon, "\n");
+}
+
+void hmp_info_lock_stats(Monitor *mon)
+{
+    LockStatsInfo *info;
+    LockSiteStatsList *site;
+
+    info = qmp_query_lock_stats(NULL);
+    monitor_printf(mon, "lock statistics: %s\n",
+                   info->enabled ? "on" : "off");
+
+    for (site = info->sites; site; site = site->next) {
+        LockSiteStats *s = site->value;
+
+        monitor_printf(mon, "%s: acquisitions=%" PRId64 " locks=%" PRId64
+                       " wait_ns=%" PRId64 " max_wait_ns=%" PRId64
+                       " hold_ns=%" PRId64 " max_hold_ns=%" PRId64 "\n",
+                       s->site, s->acquisitions, s->locks, s->wait_ns,
+                       s->max_wait_ns, s->hold_ns, s->max_hold_ns);
+        print_lock_stats_hist(mon, "waits", s->wait_histogram);
+        print_lock_stats_hist(mon, "holds", s->hold_histogram);
+    }
+
+    qapi_free_LockStatsInfo(info);
+}
+
 void hmp_info_block(Monitor *mon)
 {
     BlockInfoList *block_list, *info;
@@ -288,10 +464,11 @@ void hmp_info_block(Monitor *mon)
                 monitor_printf(mon, " backing_file_depth=%" PRId64,
                     info->value->inserted->backing_file_depth);
             }
-            monitor_printf(mon, " ro=%d drv=%s encrypted=%d",
+            monitor_printf(mon, " ro=%d drv=%s encrypted=%d write_cache=%d",
                            info->value->inserted->ro,
                            info->value->inserted->drv,
-                           info->value->inserted->encrypted);
+                           info->value->inserted->encrypted,
+                           info->value->inserted->write_cache);
 
             monitor_printf(mon, " bps=%" PRId64 " bps_rd=%" PRId64
                             " bps_wr=%" PRId64 " iops=%" PRId64
@@ -302,6 +479,10 @@ void hmp_info_block(Monitor *mon)
                             info->value->inserted->iops,
                             info->value->inserted->iops_rd,
                             info->value->inserted->iops_wr);
+            if (info->value->inserted->has_group) {
+                monitor_printf(mon, " group=%s",
+                               info->value->inserted->group);
+            }
         } else {
             monitor_printf(mon, " [not inserted]");
         }
@@ -312,9 +493,26 @@ void hmp_info_block(Monitor *mon)
     qapi_free_BlockInfoList(block_list);
 }
 
+static void print_latency_hist(Monitor *mon, const char *name,
+                               BlockLatencyBucketList *bucket)
+{
+    if (!bucket) {
+        return;
+    }
+
+    monitor_printf(mon, "    %s:", name);
+    for (; bucket; bucket = bucket->next) {
+        monitor_printf(mon, " <%" PRId64 "us=%" PRId64,
+                       bucket->value->limit_us, bucket->value->count);
+    }
+    monitor_printf(mon, "\n");
+}
+
 void hmp_info_blockstats(Monitor *mon)
 {
     BlockStatsList *stats_list, *stats;
+    BlockRbdStats *rbd;
+    BlockLocalCacheStats *lc;
 
     stats_list = qmp_query_blockstats(NULL);
 
@@ -332,6 +530,8 @@ void hmp_info_blockstats(Monitor *mon)
                        " wr_total_time_ns=%" PRId64
                        " rd_total_time_ns=%" PRId64
                        " flush_total_time_ns=%" PRId64
+                       " rd_merged=%" PRId64
+                       " wr_merged=%" PRId64
                        "\n",
                        stats->value->stats->rd_bytes,
                        stats->value->stats->wr_bytes,
@@ -340,7 +540,71 @@ void hmp_info_blockstats(Monitor *mon)
                        stats->value->stats->flush_operations,
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
-                       stats->value->stats->flush_total_time_ns);
+                       stats->value->stats->flush_total_time_ns,
+                       stats->value->stats->rd_merged,
+                       stats->value->stats->wr_merged);
+        if (stats->value->stats->has_l2_cache) {
+            BlockCacheStats *l2 = stats->value->stats->l2_cache;
+
+            monitor_printf(mon, "    l2_cache: size=%" PRId64
+                           " hits=%" PRId64 " misses=%" PRId64 "\n",
+                           l2->size, l2->hits, l2->misses);
+        }
+        if (stats->value->stats->has_refcount_cache) {
+            BlockCacheStats *rc = stats->value->stats->refcount_cache;
+
+            monitor_printf(mon, "    refcount_cache: size=%" PRId64
+                           " hits=%" PRId64 " misses=%" PRId64 "\n",
+                           rc->size, rc->hits, rc->misses);
+        }
+        monitor_printf(mon, "    in_flight=%" PRId64
+                       " max_in_flight=%" PRId64 "\n",
+                       stats->value->stats->in_flight,
+                       stats->value->stats->max_in_flight);
+        print_latency_hist(mon, "rd_latency",
+                           stats->value->stats->rd_latency);
+        print_latency_hist(mon, "wr_latency",
+                           stats->value->stats->wr_latency);
+        print_latency_hist(mon, "flush_latency",
+                           stats->value->stats->flush_latency);
+
+        /* RBD is a protocol, usually found below a raw format */
+        rbd = NULL;
+        if (stats->value->stats->has_rbd) {
+            rbd = stats->value->stats->rbd;
+        } else if (stats->value->has_parent &&
+                   stats->value->parent->stats->has_rbd) {
+            rbd = stats->value->parent->stats->rbd;
+        }
+        if (rbd) {
+            monitor_printf(mon, "    rbd: readahead_ops=%" PRId64
+                           " readahead_bytes=%" PRId64
+                           " readahead_hits=%" PRId64
+                           " coalesced_writes=%" PRId64
+                           " write_batches=%" PRId64 "\n",
+                           rbd->readahead_ops, rbd->readahead_bytes,
+                           rbd->readahead_hits, rbd->coalesced_writes,
+                           rbd->write_batches);
+        }
+
+        lc = NULL;
+        if (stats->value->stats->has_local_cache) {
+            lc = stats->value->stats->local_cache;
+        } else if (stats->value->has_parent &&
+                   stats->value->parent->stats->has_local_cache) {
+            lc = stats->value->parent->stats->local_cache;
+        }
+        if (lc) {
+            monitor_printf(mon, "    local_cache: size=%" PRId64
+                           " used=%" PRId64
+                           " dirty=%" PRId64
+                           " hits=%" PRId64
+                           " misses=%" PRId64
+                           " evictions=%" PRId64
+                           " writebacks=%" PRId64 "\n",
+                           lc->size, lc->used, lc->dirty, lc->hits,
+                           lc->misses, lc->evictions, lc->writebacks);
+        }
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -385,6 +649,11 @@ void hmp_info_vnc(Monitor *mon)
             monitor_printf(mon, "    username: %s\n",
                            client->value->has_sasl_username ?
                            client->value->sasl_username : "none");
+            monitor_printf(mon, "     updates: %" PRId64 " queued, %" PRId64
+                           " encoded in %" PRId64 " us\n",
+                           client->value->jobs_queued,
+                           client->value->jobs_encoded,
+                           client->value->encode_time_ns / 1000);
         }
     }
 
@@ -594,11 +863,31 @@ void hmp_info_block_jobs(Monitor *mon)
         if (strcmp(list->value->type, "stream") == 0) {
             monitor_printf(mon, "Streaming device %s: Completed %" PRId64
                            " of %" PRId64 " bytes, speed limit %" PRId64
-                           " bytes/s\n",
+                           " bytes/s, current rate %" PRId64 " bytes/s\n",
                            list->value->device,
                            list->value->offset,
                            list->value->len,
-                           list->value->speed);
+                           list->value->speed,
+                           list->value->rate);
+        } else if (strcmp(list->value->type, "commit") == 0) {
+            monitor_printf(mon, "Committing device %s: Completed %" PRId64
+                           " of %" PRId64 " bytes, speed limit %" PRId64
+                           " bytes/s, current rate %" PRId64 " bytes/s%s\n",
+                           list->value->device,
+                           list->value->offset,
+                           list->value->len,
+                           list->value->speed,
+                           list->value->rate,
+                           list->value->ready ? ", ready to complete" : "");
+        } else if (strcmp(list->value->type, "mirror") == 0) {
+            monitor_printf(mon, "Mirroring device %s: Completed %" PRId64
+                           " of %" PRId64 " bytes, speed limit %" PRId64
+                           " bytes/s%s\n",
+                           list->value->device,
+                           list->value->offset,
+                           list->value->len,
+                           list->value->speed,
+                           list->value->ready ? ", ready to complete" : "");
         } else {
             monitor_printf(mon, "Type %s, device %s: Completed %" PRId64
                            " of %" PRId64 " bytes, speed limit %" PRId64
@@ -714,6 +1003,33 @@ void hmp_inject_nmi(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &errp);
 }
 
+void hmp_set_thread_affinity(Monitor *mon, const QDict *qdict)
+{
+    const char *thread = qdict_get_str(qdict, "thread");
+    const char *cpus = qdict_get_str(qdict, "cpus");
+    Error *errp = NULL;
+    char *end;
+    long vcpu;
+
+    vcpu = strtol(thread, &end, 10);
+    if (qemu_isdigit(*thread) && !*end) {
+        qmp_set_thread_affinity(true, vcpu, false, NULL, cpus, &errp);
+    } else {
+        qmp_set_thread_affinity(false, 0, true, thread, cpus, &errp);
+    }
+    hmp_handle_error(mon, &errp);
+}
+
+void hmp_device_profile(Monitor *mon, const QDict *qdict)
+{
+    qmp_device_profile(qdict_get_bool(qdict, "enable"), NULL);
+}
+
+void hmp_lock_stats(Monitor *mon, const QDict *qdict)
+{
+    qmp_lock_stats(qdict_get_bool(qdict, "enable"), NULL);
+}
+
 void hmp_set_link(Monitor *mon, const QDict *qdict)
 {
     const char *name = qdict_get_str(qdict, "name");
@@ -724,6 +1040,20 @@ void hmp_set_link(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &errp);
 }
 
+void hmp_set_net_coalesce(Monitor *mon, const QDict *qdict)
+{
+    const char *name = qdict_get_str(qdict, "name");
+    Error *errp = NULL;
+
+    qmp_set_net_coalesce(name,
+                         true, qdict_get_int(qdict, "rx_frames"),
+                         true, qdict_get_int(qdict, "rx_usecs"),
+                         true, qdict_get_int(qdict, "tx_frames"),
+                         true, qdict_get_int(qdict, "tx_usecs"),
+                         &errp);
+    hmp_handle_error(mon, &errp);
+}
+
 void hmp_block_passwd(Monitor *mon, const QDict *qdict)
 {
     const char *device = qdict_get_str(qdict, "device");
@@ -803,6 +1133,32 @@ void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_migrate_set_compress_threads(Monitor *mon, const QDict *qdict)
+{
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    qmp_migrate_set_compress_threads(value, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+}
+
+void hmp_migrate_set_multifd_channels(Monitor *mon, const QDict *qdict)
+{
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    qmp_migrate_set_multifd_channels(value, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+}
+
 void hmp_migrate_set_speed(Monitor *mon, const QDict *qdict)
 {
     int64_t value = qdict_get_int(qdict, "value");
@@ -915,7 +1271,10 @@ void hmp_block_set_io_throttle(Monitor *mon, const QDict *qdict)
                               qdict_get_int(qdict, "bps_wr"),
                               qdict_get_int(qdict, "iops"),
                               qdict_get_int(qdict, "iops_rd"),
-                              qdict_get_int(qdict, "iops_wr"), &err);
+                              qdict_get_int(qdict, "iops_wr"),
+                              false, 0, false, 0, false, 0,
+                              false, 0, false, 0, false, 0,
+                              false, NULL, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -932,6 +1291,20 @@ void hmp_block_stream(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &error);
 }
 
+void hmp_block_commit(Monitor *mon, const QDict *qdict)
+{
+    Error *error = NULL;
+    const char *device = qdict_get_str(qdict, "device");
+    const char *top = qdict_get_try_str(qdict, "top");
+    const char *base = qdict_get_try_str(qdict, "base");
+    int64_t speed = qdict_get_try_int(qdict, "speed", 0);
+
+    qmp_block_commit(device, base != NULL, base, top != NULL, top,
+                     qdict_haskey(qdict, "speed"), speed, &error);
+
+    hmp_handle_error(mon, &error);
+}
+
 void hmp_block_job_set_speed(Monitor *mon, const QDict *qdict)
 {
     Error *error = NULL;
@@ -953,6 +1326,16 @@ void hmp_block_job_cancel(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &error);
 }
 
+void hmp_block_job_complete(Monitor *mon, const QDict *qdict)
+{
+    Error *error = NULL;
+    const char *device = qdict_get_str(qdict, "device");
+
+    qmp_block_job_complete(device, &error);
+
+    hmp_handle_error(mon, &error);
+}
+
 typedef struct MigrationStatus
 {
     QEMUTimer *timer;
@@ -1081,6 +1464,8 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
 {
     Error *errp = NULL;
     int paging = qdict_get_try_bool(qdict, "paging", 0);
+    int zlib = qdict_get_try_bool(qdict, "zlib", 0);
+    int live = qdict_get_try_bool(qdict, "live", 0);
     const char *file = qdict_get_str(qdict, "protocol");
     bool has_begin = qdict_haskey(qdict, "begin");
     bool has_length = qdict_haskey(qdict, "length");
@@ -1095,7 +1480,9 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
     }
 
     qmp_dump_guest_memory(paging, file, has_begin, begin, has_length, length,
-                          &errp);
+                          true, zlib ? DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZLIB :
+                                       DUMP_GUEST_MEMORY_FORMAT_ELF,
+                          true, live, &errp);
     hmp_handle_error(mon, &errp);
 }
 
@@ -19,6 +19,10 @@ typedef struct V9fsConf
     /* tag name for the device */
     char *tag;
     char *fsdev_id;
+    /* how long lstat results may be reused, 0 disables the cache */
+    uint32_t attr_cache_ms;
+    /* readahead window for sequential reads, 0 disables readahead */
+    uint32_t readahead_kb;
 } V9fsConf;
 
 #endif
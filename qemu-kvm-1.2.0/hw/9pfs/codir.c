@@ -17,6 +17,195 @@
 #include "qemu-coroutine.h"
 #include "virtio-9p-coth.h"
 
+static size_t v9fs_readdir_data_size(V9fsString *name)
+{
+    /*
+     * Size of each dirent on the wire: size of qid (13) + size of offset (8)
+     * size of type (1) + size of name.size (2) + strlen(name.data)
+     */
+    return 24 + v9fs_string_size(name);
+}
+
+/*
+ * Runs in the worker: marshal directory entries straight into the reply
+ * until max_count bytes are used or the directory ends.
+ */
+static int v9fs_readdir_fill(V9fsState *s, V9fsPDU *pdu, V9fsFidState *fidp,
+                             int32_t max_count)
+{
+    size_t size;
+    V9fsQID qid;
+    V9fsString name;
+    int len, err = 0;
+    int32_t count = 0;
+    off_t saved_dir_pos;
+    struct dirent *dent, *result;
+
+    /* save the directory position */
+    saved_dir_pos = s->ops->telldir(&s->ctx, &fidp->fs);
+    if (saved_dir_pos < 0) {
+        return -errno;
+    }
+
+    dent = g_malloc(sizeof(struct dirent));
+
+    while (1) {
+        errno = 0;
+        s->ops->readdir_r(&s->ctx, &fidp->fs, dent, &result);
+        if (!result) {
+            err = errno ? -errno : 0;
+            break;
+        }
+        v9fs_string_init(&name);
+        v9fs_string_sprintf(&name, "%s", dent->d_name);
+        if ((count + v9fs_readdir_data_size(&name)) > max_count) {
+            /* Ran out of buffer. Set dir back to old position and return */
+            s->ops->seekdir(&s->ctx, &fidp->fs, saved_dir_pos);
+            v9fs_string_free(&name);
+            break;
+        }
+        /*
+         * Fill up just the path field of qid because the client uses
+         * only that. To fill the entire qid structure we will have
+         * to stat each dirent found, which is expensive
+         */
+        size = MIN(sizeof(dent->d_ino), sizeof(qid.path));
+        memcpy(&qid.path, &dent->d_ino, size);
+        /* Fill the other fields with dummy values */
+        qid.type = 0;
+        qid.version = 0;
+
+        /* 11 = 7 + 4 (7 = start offset, 4 = space for storing count) */
+        len = pdu_marshal(pdu, 11 + count, "Qqbs",
+                          &qid, dent->d_off,
+                          dent->d_type, &name);
+        v9fs_string_free(&name);
+        if (len < 0) {
+            s->ops->seekdir(&s->ctx, &fidp->fs, saved_dir_pos);
+            err = len;
+            break;
+        }
+        count += len;
+        saved_dir_pos = dent->d_off;
+    }
+    g_free(dent);
+    if (err < 0) {
+        return err;
+    }
+    return count;
+}
+
+/*
+ * Position the directory and fill the Rreaddir reply in a single trip to
+ * the worker, instead of one trip per entry.
+ */
+int v9fs_co_readdir_many(V9fsPDU *pdu, V9fsFidState *fidp,
+                         uint64_t initial_offset, int32_t max_count)
+{
+    int count;
+    V9fsState *s = pdu->s;
+
+    if (v9fs_request_cancelled(pdu)) {
+        return -EINTR;
+    }
+    v9fs_co_run_in_worker(
+        {
+            if (initial_offset == 0) {
+                s->ops->rewinddir(&s->ctx, &fidp->fs);
+            } else {
+                s->ops->seekdir(&s->ctx, &fidp->fs, initial_offset);
+            }
+            count = v9fs_readdir_fill(s, pdu, fidp, max_count);
+        });
+    return count;
+}
+
+/*
+ * Read up to max entries from the directory in a single trip to the
+ * worker.  With want_stat, each entry is also resolved to a path and
+ * lstat'ed; a failure there is recorded in the entry's err.  Returns the
+ * number of entries read, 0 at the end of the directory, or a negative
+ * errno.  The entries must be released with v9fs_dirents_free().
+ */
+int v9fs_co_readdir_batch(V9fsPDU *pdu, V9fsFidState *fidp,
+                          V9fsDirEnt *ents, int max, bool want_stat)
+{
+    int i, n = 0, err = 0;
+    uint64_t gen;
+    bool stat_in_worker;
+    struct dirent *dent, *result;
+    V9fsState *s = pdu->s;
+
+    if (v9fs_request_cancelled(pdu)) {
+        return -EINTR;
+    }
+    /* name_to_path of these backends has to run in the QEMU thread */
+    stat_in_worker = want_stat &&
+                     !(s->ctx.export_flags & V9FS_PATHNAME_FSCONTEXT);
+
+    dent = g_malloc(sizeof(struct dirent));
+    gen = s->attr_cache_gen;
+    v9fs_path_read_lock(s);
+    v9fs_co_run_in_worker(
+        {
+            while (n < max) {
+                V9fsDirEnt *ent = &ents[n];
+
+                errno = 0;
+                s->ops->readdir_r(&s->ctx, &fidp->fs, dent, &result);
+                if (!result) {
+                    err = errno ? -errno : 0;
+                    break;
+                }
+                ent->name = g_strdup(dent->d_name);
+                ent->d_off = dent->d_off;
+                ent->err = 0;
+                v9fs_path_init(&ent->path);
+                n++;
+                if (!stat_in_worker) {
+                    continue;
+                }
+                if (s->ops->name_to_path(&s->ctx, &fidp->path, ent->name,
+                                         &ent->path) < 0 ||
+                    s->ops->lstat(&s->ctx, &ent->path, &ent->stbuf) < 0) {
+                    ent->err = -errno;
+                }
+            }
+        });
+    v9fs_path_unlock(s);
+    g_free(dent);
+
+    for (i = 0; i < n; i++) {
+        V9fsDirEnt *ent = &ents[i];
+
+        if (want_stat && !stat_in_worker) {
+            ent->err = v9fs_co_name_to_path(pdu, &fidp->path, ent->name,
+                                            &ent->path);
+            if (!ent->err) {
+                ent->err = v9fs_co_lstat(pdu, &ent->path, &ent->stbuf);
+            }
+        } else if (stat_in_worker && !ent->err) {
+            v9fs_attr_cache_insert(s, &ent->path, &ent->stbuf, gen);
+        }
+    }
+
+    if (n == 0 && err < 0) {
+        return err;
+    }
+    return n;
+}
+
+void v9fs_dirents_free(V9fsDirEnt *ents, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        g_free(ents[i].name);
+        ents[i].name = NULL;
+        v9fs_path_free(&ents[i].path);
+    }
+}
+
 int v9fs_co_readdir_r(V9fsPDU *pdu, V9fsFidState *fidp, struct dirent *dent,
                       struct dirent **result)
 {
@@ -15,6 +15,7 @@
 #include "fsdev/qemu-fsdev.h"
 #include "qemu-thread.h"
 #include "qemu-coroutine.h"
+#include "iov.h"
 #include "virtio-9p-coth.h"
 
 int v9fs_co_st_gen(V9fsPDU *pdu, V9fsPath *path, mode_t st_mode,
@@ -44,11 +45,16 @@ int v9fs_co_st_gen(V9fsPDU *pdu, V9fsPath *path, mode_t st_mode,
 int v9fs_co_lstat(V9fsPDU *pdu, V9fsPath *path, struct stat *stbuf)
 {
     int err;
+    uint64_t gen;
     V9fsState *s = pdu->s;
 
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
+    if (v9fs_attr_cache_lookup(s, path, stbuf)) {
+        return 0;
+    }
+    gen = s->attr_cache_gen;
     v9fs_path_read_lock(s);
     v9fs_co_run_in_worker(
         {
@@ -58,6 +64,9 @@ int v9fs_co_lstat(V9fsPDU *pdu, V9fsPath *path, struct stat *stbuf)
             }
         });
     v9fs_path_unlock(s);
+    if (!err) {
+        v9fs_attr_cache_insert(s, path, stbuf, gen);
+    }
     return err;
 }
 
@@ -101,6 +110,10 @@ int v9fs_co_open(V9fsPDU *pdu, V9fsFidState *fidp, int flags)
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
+    /* Topen/Tlopen count as read only, but O_TRUNC changes the file */
+    if (flags & O_TRUNC) {
+        v9fs_attr_cache_invalidate(s);
+    }
     v9fs_path_read_lock(s);
     v9fs_co_run_in_worker(
         {
@@ -112,6 +125,9 @@ int v9fs_co_open(V9fsPDU *pdu, V9fsFidState *fidp, int flags)
             }
         });
     v9fs_path_unlock(s);
+    if (flags & O_TRUNC) {
+        v9fs_attr_cache_invalidate(s);
+    }
     if (!err) {
         total_open_fd++;
         if (total_open_fd > open_fd_hw) {
@@ -273,3 +289,141 @@ int v9fs_co_preadv(V9fsPDU *pdu, V9fsFidState *fidp,
         });
     return err;
 }
+
+/*
+ * Fill qiov from the file at offset, looping over short reads in a single
+ * trip to the worker.  Sequential reads also read up to s->readahead bytes
+ * past the end of qiov into a per-fid buffer, from which the next read is
+ * then served without leaving the QEMU thread.  Returns the number of bytes
+ * read, which is short only at end of file, or a negative errno.
+ */
+int v9fs_co_read(V9fsPDU *pdu, V9fsFidState *fidp, QEMUIOVector *qiov,
+                 int64_t offset)
+{
+    int err = 0;
+    size_t count = 0, want, done = 0, ra_size = 0;
+    uint64_t gen;
+    QEMUIOVector rest, part;
+    V9fsState *s = pdu->s;
+
+    if (v9fs_request_cancelled(pdu)) {
+        return -EINTR;
+    }
+
+    if (fidp->ra_len && !fidp->ra_busy && fidp->ra_gen == s->attr_cache_gen &&
+        offset >= fidp->ra_off && offset < fidp->ra_off + fidp->ra_len) {
+        count = MIN(qiov->size, fidp->ra_off + fidp->ra_len - offset);
+        iov_from_buf(qiov->iov, qiov->niov, 0,
+                     fidp->ra_buf + (offset - fidp->ra_off), count);
+        if (count == qiov->size) {
+            fidp->ra_next = offset + count;
+            return count;
+        }
+    }
+    want = qiov->size - count;
+
+    if (s->readahead && !fidp->ra_busy && offset == fidp->ra_next) {
+        if (!fidp->ra_buf) {
+            fidp->ra_buf = g_malloc(s->readahead);
+        }
+        ra_size = s->readahead;
+        fidp->ra_busy = true;
+        fidp->ra_len = 0;
+    }
+
+    qemu_iovec_init(&rest, qiov->niov + 1);
+    qemu_iovec_concat(&rest, qiov, count, want);
+    if (ra_size) {
+        qemu_iovec_add(&rest, fidp->ra_buf, ra_size);
+    }
+    qemu_iovec_init(&part, rest.niov);
+
+    gen = s->attr_cache_gen;
+    v9fs_co_run_in_worker(
+        {
+            while (done < want) {
+                ssize_t len;
+
+                qemu_iovec_reset(&part);
+                qemu_iovec_concat(&part, &rest, done, rest.size - done);
+                len = s->ops->preadv(&s->ctx, &fidp->fs, part.iov, part.niov,
+                                     offset + count + done);
+                if (len < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    err = -errno;
+                    break;
+                }
+                if (len == 0) {
+                    break;
+                }
+                done += len;
+            }
+        });
+    qemu_iovec_destroy(&part);
+    qemu_iovec_destroy(&rest);
+
+    if (ra_size) {
+        fidp->ra_busy = false;
+        if (done > want && gen == s->attr_cache_gen) {
+            fidp->ra_off = offset + count + want;
+            fidp->ra_len = done - want;
+            fidp->ra_gen = gen;
+        }
+    }
+
+    count += MIN(done, want);
+    if (err < 0 && count == 0) {
+        return err;
+    }
+    fidp->ra_next = offset + count;
+    return count;
+}
+
+/*
+ * Write all of qiov, which points straight at the guest's buffers, to the
+ * file at offset.  Short writes and EINTR are retried within a single
+ * trip to the worker.  Returns the number of bytes written or a negative
+ * errno if nothing could be written.
+ */
+int v9fs_co_write(V9fsPDU *pdu, V9fsFidState *fidp, QEMUIOVector *qiov,
+                  int64_t offset)
+{
+    int err = 0;
+    size_t done = 0;
+    QEMUIOVector part;
+    V9fsState *s = pdu->s;
+
+    if (v9fs_request_cancelled(pdu)) {
+        return -EINTR;
+    }
+    qemu_iovec_init(&part, qiov->niov);
+    v9fs_co_run_in_worker(
+        {
+            while (done < qiov->size) {
+                ssize_t len;
+
+                qemu_iovec_reset(&part);
+                qemu_iovec_concat(&part, qiov, done, qiov->size - done);
+                len = s->ops->pwritev(&s->ctx, &fidp->fs, part.iov, part.niov,
+                                      offset + done);
+                if (len < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    err = -errno;
+                    break;
+                }
+                if (len == 0) {
+                    break;
+                }
+                done += len;
+            }
+        });
+    qemu_iovec_destroy(&part);
+    if (err < 0 && done == 0) {
+        return err;
+    }
+    return done;
+}
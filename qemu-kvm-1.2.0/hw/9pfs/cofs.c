@@ -342,3 +342,67 @@ int v9fs_co_name_to_path(V9fsPDU *pdu, V9fsPath *dirpath,
     }
     return err;
 }
+
+/*
+ * Walk the names in wnames starting at dpath, in a single trip to the
+ * worker.  On success path is the path of the last name and stbufs holds
+ * the lstat results of all of them.
+ */
+int v9fs_co_walk(V9fsPDU *pdu, V9fsPath *dpath, int nwnames,
+                 V9fsString *wnames, V9fsPath *path, struct stat *stbufs)
+{
+    int i, err = 0;
+    uint64_t gen;
+    V9fsPath cur;
+    V9fsState *s = pdu->s;
+
+    v9fs_path_init(&cur);
+    v9fs_path_copy(&cur, dpath);
+
+    if (s->ctx.export_flags & V9FS_PATHNAME_FSCONTEXT) {
+        /* name_to_path has to run in the QEMU thread */
+        for (i = 0; i < nwnames; i++) {
+            err = v9fs_co_name_to_path(pdu, &cur, wnames[i].data, path);
+            if (err < 0) {
+                break;
+            }
+            err = v9fs_co_lstat(pdu, path, &stbufs[i]);
+            if (err < 0) {
+                break;
+            }
+            v9fs_path_copy(&cur, path);
+        }
+        v9fs_path_free(&cur);
+        return err;
+    }
+
+    if (v9fs_request_cancelled(pdu)) {
+        v9fs_path_free(&cur);
+        return -EINTR;
+    }
+    gen = s->attr_cache_gen;
+    v9fs_path_read_lock(s);
+    v9fs_co_run_in_worker(
+        {
+            for (i = 0; i < nwnames; i++) {
+                err = s->ops->name_to_path(&s->ctx, &cur, wnames[i].data,
+                                           path);
+                if (err < 0) {
+                    err = -errno;
+                    break;
+                }
+                err = s->ops->lstat(&s->ctx, path, &stbufs[i]);
+                if (err < 0) {
+                    err = -errno;
+                    break;
+                }
+                v9fs_path_copy(&cur, path);
+            }
+        });
+    v9fs_path_unlock(s);
+    if (!err && nwnames) {
+        v9fs_attr_cache_insert(s, path, &stbufs[nwnames - 1], gen);
+    }
+    v9fs_path_free(&cur);
+    return err;
+}
@@ -16,83 +16,37 @@
 #include "fsdev/qemu-fsdev.h"
 #include "qemu-thread.h"
 #include "qemu-coroutine.h"
+#include "thread-pool.h"
 #include "virtio-9p-coth.h"
 
-/* v9fs glib thread pool */
-static V9fsThPool v9fs_pool;
+/* v9fs shares the block layer's thread pool */
+static ThreadPool *v9fs_pool;
 
-void co_run_in_worker_bh(void *opaque)
-{
-    Coroutine *co = opaque;
-    g_thread_pool_push(v9fs_pool.pool, co, NULL);
-}
-
-static void v9fs_qemu_process_req_done(void *arg)
+static int coroutine_enter_func(void *arg)
 {
-    char byte;
-    ssize_t len;
-    Coroutine *co;
-
-    do {
-        len = read(v9fs_pool.rfd, &byte, sizeof(byte));
-    } while (len == -1 &&  errno == EINTR);
+    Coroutine *co = arg;
 
-    while ((co = g_async_queue_try_pop(v9fs_pool.completed)) != NULL) {
-        qemu_coroutine_enter(co, NULL);
-    }
+    /* runs the code block of v9fs_co_run_in_worker() up to its next yield */
+    qemu_coroutine_enter(co, NULL);
+    return 0;
 }
 
-static void v9fs_thread_routine(gpointer data, gpointer user_data)
+static void coroutine_enter_cb(void *opaque, int ret)
 {
-    ssize_t len;
-    char byte = 0;
-    Coroutine *co = data;
+    Coroutine *co = opaque;
 
     qemu_coroutine_enter(co, NULL);
+}
 
-    g_async_queue_push(v9fs_pool.completed, co);
-    do {
-        len = write(v9fs_pool.wfd, &byte, sizeof(byte));
-    } while (len == -1 && errno == EINTR);
+void co_run_in_worker_bh(void *opaque)
+{
+    Coroutine *co = opaque;
+    thread_pool_submit_aio(v9fs_pool, coroutine_enter_func, co,
+                           coroutine_enter_cb, co);
 }
 
 int v9fs_init_worker_threads(void)
 {
-    int ret = 0;
-    int notifier_fds[2];
-    V9fsThPool *p = &v9fs_pool;
-    sigset_t set, oldset;
-
-    sigfillset(&set);
-    /* Leave signal handling to the iothread.  */
-    pthread_sigmask(SIG_SETMASK, &set, &oldset);
-
-    if (qemu_pipe(notifier_fds) == -1) {
-        ret = -1;
-        goto err_out;
-    }
-    p->pool = g_thread_pool_new(v9fs_thread_routine, p, -1, FALSE, NULL);
-    if (!p->pool) {
-        ret = -1;
-        goto err_out;
-    }
-    p->completed = g_async_queue_new();
-    if (!p->completed) {
-        /*
-         * We are going to terminate.
-         * So don't worry about cleanup
-         */
-        ret = -1;
-        goto err_out;
-    }
-    p->rfd = notifier_fds[0];
-    p->wfd = notifier_fds[1];
-
-    fcntl(p->rfd, F_SETFL, O_NONBLOCK);
-    fcntl(p->wfd, F_SETFL, O_NONBLOCK);
-
-    qemu_set_fd_handler(p->rfd, v9fs_qemu_process_req_done, NULL, NULL);
-err_out:
-    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
-    return ret;
+    v9fs_pool = thread_pool_get_default();
+    return v9fs_pool ? 0 : -1;
 }
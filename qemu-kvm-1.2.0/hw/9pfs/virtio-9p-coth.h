@@ -20,13 +20,6 @@
 #include "virtio-9p.h"
 #include <glib.h>
 
-typedef struct V9fsThPool {
-    int rfd;
-    int wfd;
-    GThreadPool *pool;
-    GAsyncQueue *completed;
-} V9fsThPool;
-
 /*
  * we want to use bottom half because we want to make sure the below
  * sequence of events.
@@ -36,6 +29,10 @@ typedef struct V9fsThPool {
  *   3. Enter the coroutine in the worker thread.
  * we cannot swap step 1 and 2, because that would imply worker thread
  * can enter coroutine while step1 is still running
+ *
+ * The worker runs code_block and returns to the thread pool at the second
+ * yield, whose completion callback re-enters the coroutine in the QEMU
+ * thread.
  */
 #define v9fs_co_run_in_worker(code_block)                               \
     do {                                                                \
@@ -54,11 +51,26 @@ typedef struct V9fsThPool {
         qemu_coroutine_yield();                                         \
     } while (0)
 
+/* A directory entry as returned by v9fs_co_readdir_batch() */
+typedef struct V9fsDirEnt {
+    char *name;
+    off_t d_off;
+    /* only filled in if the caller asked for stats */
+    V9fsPath path;
+    struct stat stbuf;
+    int err;
+} V9fsDirEnt;
+
 extern void co_run_in_worker_bh(void *);
 extern int v9fs_init_worker_threads(void);
 extern int v9fs_co_readlink(V9fsPDU *, V9fsPath *, V9fsString *);
 extern int v9fs_co_readdir_r(V9fsPDU *, V9fsFidState *,
                            struct dirent *, struct dirent **result);
+extern int v9fs_co_readdir_many(V9fsPDU *, V9fsFidState *,
+                                uint64_t, int32_t);
+extern int v9fs_co_readdir_batch(V9fsPDU *, V9fsFidState *,
+                                 V9fsDirEnt *, int, bool);
+extern void v9fs_dirents_free(V9fsDirEnt *, int);
 extern off_t v9fs_co_telldir(V9fsPDU *, V9fsFidState *);
 extern void v9fs_co_seekdir(V9fsPDU *, V9fsFidState *, off_t);
 extern void v9fs_co_rewinddir(V9fsPDU *, V9fsFidState *);
@@ -99,6 +111,10 @@ extern int v9fs_co_pwritev(V9fsPDU *, V9fsFidState *,
                            struct iovec *, int, int64_t);
 extern int v9fs_co_preadv(V9fsPDU *, V9fsFidState *,
                           struct iovec *, int, int64_t);
+extern int v9fs_co_read(V9fsPDU *, V9fsFidState *, QEMUIOVector *, int64_t);
+extern int v9fs_co_write(V9fsPDU *, V9fsFidState *, QEMUIOVector *, int64_t);
+extern int v9fs_co_walk(V9fsPDU *, V9fsPath *, int, V9fsString *,
+                        V9fsPath *, struct stat *);
 extern int v9fs_co_name_to_path(V9fsPDU *, V9fsPath *,
                                 const char *, V9fsPath *);
 extern int v9fs_co_st_gen(V9fsPDU *pdu, V9fsPath *path, mode_t,
@@ -108,6 +108,18 @@ VirtIODevice *virtio_9p_init(DeviceState *dev, V9fsConf *conf)
     s->fid_list = NULL;
     qemu_co_rwlock_init(&s->rename_lock);
 
+    /*
+     * Cached attributes are looked up by the backend's path, which is only
+     * stable across requests if the backend doesn't need the fs context to
+     * build it.
+     */
+    if (conf->attr_cache_ms &&
+        !(s->ctx.export_flags & V9FS_PATHNAME_FSCONTEXT)) {
+        s->attr_cache = v9fs_attr_cache_new();
+        s->attr_cache_ns = conf->attr_cache_ms * 1000000LL;
+    }
+    s->readahead = MIN(conf->readahead_kb, V9FS_MAX_READAHEAD_KB) * 1024;
+
     if (s->ops->init(&s->ctx) < 0) {
         fprintf(stderr, "Virtio-9p Failed to initialize fs-driver with id:%s"
                 " and export path:%s\n", conf->fsdev_id, s->ctx.fs_root);
@@ -160,6 +172,10 @@ static Property virtio_9p_properties[] = {
     DEFINE_VIRTIO_COMMON_FEATURES(VirtIOPCIProxy, host_features),
     DEFINE_PROP_STRING("mount_tag", VirtIOPCIProxy, fsconf.tag),
     DEFINE_PROP_STRING("fsdev", VirtIOPCIProxy, fsconf.fsdev_id),
+    DEFINE_PROP_UINT32("attr_cache_ms", VirtIOPCIProxy,
+                       fsconf.attr_cache_ms, 0),
+    DEFINE_PROP_UINT32("readahead_kb", VirtIOPCIProxy,
+                       fsconf.readahead_kb, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -21,6 +21,7 @@
 #include "virtio-9p-coth.h"
 #include "trace.h"
 #include "migration.h"
+#include "qemu-timer.h"
 
 int open_fd_hw;
 int total_open_fd;
@@ -156,6 +157,92 @@ void v9fs_path_copy(V9fsPath *lhs, V9fsPath *rhs)
     lhs->size = rhs->size;
 }
 
+typedef struct V9fsAttrCacheEntry {
+    struct stat stbuf;
+    int64_t expire;
+} V9fsAttrCacheEntry;
+
+static guint v9fs_path_hash(gconstpointer key)
+{
+    const V9fsPath *path = key;
+    guint hash = 5381;
+    int i;
+
+    for (i = 0; i < path->size; i++) {
+        hash = hash * 33 + (unsigned char)path->data[i];
+    }
+    return hash;
+}
+
+static gboolean v9fs_path_equal(gconstpointer a, gconstpointer b)
+{
+    const V9fsPath *pa = a, *pb = b;
+
+    return pa->size == pb->size && !memcmp(pa->data, pb->data, pa->size);
+}
+
+static void v9fs_path_destroy(gpointer key)
+{
+    v9fs_path_free(key);
+    g_free(key);
+}
+
+GHashTable *v9fs_attr_cache_new(void)
+{
+    return g_hash_table_new_full(v9fs_path_hash, v9fs_path_equal,
+                                 v9fs_path_destroy, g_free);
+}
+
+bool v9fs_attr_cache_lookup(V9fsState *s, V9fsPath *path, struct stat *stbuf)
+{
+    V9fsAttrCacheEntry *entry;
+
+    if (!s->attr_cache) {
+        return false;
+    }
+    entry = g_hash_table_lookup(s->attr_cache, path);
+    if (!entry) {
+        return false;
+    }
+    if (qemu_get_clock_ns(rt_clock) >= entry->expire) {
+        g_hash_table_remove(s->attr_cache, path);
+        return false;
+    }
+    *stbuf = entry->stbuf;
+    return true;
+}
+
+/* gen is the value of attr_cache_gen when the lstat was started */
+void v9fs_attr_cache_insert(V9fsState *s, V9fsPath *path,
+                            const struct stat *stbuf, uint64_t gen)
+{
+    V9fsAttrCacheEntry *entry;
+    V9fsPath *key;
+
+    if (!s->attr_cache || gen != s->attr_cache_gen) {
+        return;
+    }
+    if (g_hash_table_size(s->attr_cache) >= V9FS_ATTR_CACHE_MAX) {
+        g_hash_table_remove_all(s->attr_cache);
+    }
+
+    key = g_malloc(sizeof(*key));
+    v9fs_path_init(key);
+    v9fs_path_copy(key, path);
+    entry = g_malloc(sizeof(*entry));
+    entry->stbuf = *stbuf;
+    entry->expire = qemu_get_clock_ns(rt_clock) + s->attr_cache_ns;
+    g_hash_table_replace(s->attr_cache, key, entry);
+}
+
+void v9fs_attr_cache_invalidate(V9fsState *s)
+{
+    s->attr_cache_gen++;
+    if (s->attr_cache && g_hash_table_size(s->attr_cache)) {
+        g_hash_table_remove_all(s->attr_cache);
+    }
+}
+
 int v9fs_name_to_path(V9fsState *s, V9fsPath *dirpath,
                       const char *name, V9fsPath *path)
 {
@@ -323,6 +410,7 @@ static int free_fid(V9fsPDU *pdu, V9fsFidState *fidp)
         retval = v9fs_xattr_fid_clunk(pdu, fidp);
     }
     v9fs_path_free(&fidp->path);
+    g_free(fidp->ra_buf);
     g_free(fidp);
     return retval;
 }
@@ -595,10 +683,41 @@ static void free_pdu(V9fsState *s, V9fsPDU *pdu)
  * because we always expect to have enough space to encode
  * error details
  */
+static inline bool is_read_only_op(V9fsPDU *pdu)
+{
+    switch (pdu->id) {
+    case P9_TREADDIR:
+    case P9_TSTATFS:
+    case P9_TGETATTR:
+    case P9_TXATTRWALK:
+    case P9_TLOCK:
+    case P9_TGETLOCK:
+    case P9_TREADLINK:
+    case P9_TVERSION:
+    case P9_TLOPEN:
+    case P9_TATTACH:
+    case P9_TSTAT:
+    case P9_TWALK:
+    case P9_TCLUNK:
+    case P9_TFSYNC:
+    case P9_TOPEN:
+    case P9_TREAD:
+    case P9_TAUTH:
+    case P9_TFLUSH:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
 static void complete_pdu(V9fsState *s, V9fsPDU *pdu, ssize_t len)
 {
     int8_t id = pdu->id + 1; /* Response */
 
+    if (!is_read_only_op(pdu)) {
+        v9fs_attr_cache_invalidate(s);
+    }
+
     if (len < 0) {
         int err = -len;
         len = 7;
@@ -1227,7 +1346,7 @@ static void v9fs_walk(void *opaque)
     int i, err = 0;
     V9fsPath dpath, path;
     uint16_t nwnames;
-    struct stat stbuf;
+    struct stat *stbufs = NULL;
     size_t offset = 7;
     int32_t fid, newfid;
     V9fsString *wnames = NULL;
@@ -1272,17 +1391,15 @@ static void v9fs_walk(void *opaque)
      */
     v9fs_path_copy(&dpath, &fidp->path);
     v9fs_path_copy(&path, &fidp->path);
-    for (name_idx = 0; name_idx < nwnames; name_idx++) {
-        err = v9fs_co_name_to_path(pdu, &dpath, wnames[name_idx].data, &path);
+    if (nwnames) {
+        stbufs = g_malloc(sizeof(stbufs[0]) * nwnames);
+        err = v9fs_co_walk(pdu, &dpath, nwnames, wnames, &path, stbufs);
         if (err < 0) {
             goto out;
         }
-        err = v9fs_co_lstat(pdu, &path, &stbuf);
-        if (err < 0) {
-            goto out;
+        for (name_idx = 0; name_idx < nwnames; name_idx++) {
+            stat_to_qid(&stbufs[name_idx], &qids[name_idx]);
         }
-        stat_to_qid(&stbuf, &qids[name_idx]);
-        v9fs_path_copy(&dpath, &path);
     }
     if (fid == newfid) {
         BUG_ON(fidp->fid_type != P9_FID_NONE);
@@ -1305,6 +1422,7 @@ out:
     }
     v9fs_path_free(&dpath);
     v9fs_path_free(&path);
+    g_free(stbufs);
 out_nofid:
     complete_pdu(s, pdu, err);
     if (nwnames && nwnames <= P9_MAXWELEM) {
@@ -1583,13 +1701,12 @@ static int v9fs_xattr_read(V9fsState *s, V9fsPDU *pdu, V9fsFidState *fidp,
 static int v9fs_do_readdir_with_stat(V9fsPDU *pdu,
                                      V9fsFidState *fidp, uint32_t max_count)
 {
-    V9fsPath path;
     V9fsStat v9stat;
-    int len, err = 0;
+    V9fsDirEnt *ents;
+    int i, n, len, err = 0;
     int32_t count = 0;
-    struct stat stbuf;
     off_t saved_dir_pos;
-    struct dirent *dent, *result;
+    bool full = false;
 
     /* save the directory position */
     saved_dir_pos = v9fs_co_telldir(pdu, fidp);
@@ -1597,44 +1714,44 @@ static int v9fs_do_readdir_with_stat(V9fsPDU *pdu,
         return saved_dir_pos;
     }
 
-    dent = g_malloc(sizeof(struct dirent));
+    ents = g_malloc0(sizeof(ents[0]) * V9FS_READDIR_BATCH);
 
-    while (1) {
-        v9fs_path_init(&path);
-        err = v9fs_co_readdir_r(pdu, fidp, dent, &result);
-        if (err || !result) {
+    while (!full) {
+        /* Don't read (and stat) many more entries than can fit */
+        n = MIN(V9FS_READDIR_BATCH,
+                (max_count - count) / V9FS_STAT_MIN_SIZE + 1);
+        n = v9fs_co_readdir_batch(pdu, fidp, ents, n, true);
+        if (n <= 0) {
+            err = n;
             break;
         }
-        err = v9fs_co_name_to_path(pdu, &fidp->path, dent->d_name, &path);
-        if (err < 0) {
-            goto out;
-        }
-        err = v9fs_co_lstat(pdu, &path, &stbuf);
-        if (err < 0) {
-            goto out;
+        for (i = 0; i < n; i++) {
+            err = ents[i].err;
+            if (err < 0) {
+                break;
+            }
+            err = stat_to_v9stat(pdu, &ents[i].path, &ents[i].stbuf, &v9stat);
+            if (err < 0) {
+                break;
+            }
+            /* 11 = 7 + 4 (7 = start offset, 4 = space for storing count) */
+            len = pdu_marshal(pdu, 11 + count, "S", &v9stat);
+            v9fs_stat_free(&v9stat);
+            if ((len != (v9stat.size + 2)) || ((count + len) > max_count)) {
+                /* Ran out of buffer. Set dir back to old position */
+                v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
+                full = true;
+                break;
+            }
+            count += len;
+            saved_dir_pos = ents[i].d_off;
         }
-        err = stat_to_v9stat(pdu, &path, &stbuf, &v9stat);
+        v9fs_dirents_free(ents, n);
         if (err < 0) {
-            goto out;
-        }
-        /* 11 = 7 + 4 (7 = start offset, 4 = space for storing count) */
-        len = pdu_marshal(pdu, 11 + count, "S", &v9stat);
-        if ((len != (v9stat.size + 2)) || ((count + len) > max_count)) {
-            /* Ran out of buffer. Set dir back to old position and return */
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
-            v9fs_stat_free(&v9stat);
-            v9fs_path_free(&path);
-            g_free(dent);
-            return count;
+            break;
         }
-        count += len;
-        v9fs_stat_free(&v9stat);
-        v9fs_path_free(&path);
-        saved_dir_pos = dent->d_off;
     }
-out:
-    g_free(dent);
-    v9fs_path_free(&path);
+    g_free(ents);
     if (err < 0) {
         return err;
     }
@@ -1713,38 +1830,24 @@ static void v9fs_read(void *opaque)
         err += offset + count;
     } else if (fidp->fid_type == P9_FID_FILE) {
         QEMUIOVector qiov_full;
-        QEMUIOVector qiov;
-        int32_t len;
 
         v9fs_init_qiov_from_pdu(&qiov_full, pdu, offset + 4, max_count, false);
-        qemu_iovec_init(&qiov, qiov_full.niov);
-        do {
-            qemu_iovec_reset(&qiov);
-            qemu_iovec_concat(&qiov, &qiov_full, count, qiov_full.size - count);
-            if (0) {
-                print_sg(qiov.iov, qiov.niov);
-            }
-            /* Loop in case of EINTR */
-            do {
-                len = v9fs_co_preadv(pdu, fidp, qiov.iov, qiov.niov, off);
-                if (len >= 0) {
-                    off   += len;
-                    count += len;
-                }
-            } while (len == -EINTR && !pdu->cancelled);
-            if (len < 0) {
-                /* IO error return the error */
-                err = len;
-                goto out;
-            }
-        } while (count < max_count && len > 0);
+        if (0) {
+            print_sg(qiov_full.iov, qiov_full.niov);
+        }
+        /* short reads and EINTR are retried by the worker */
+        count = v9fs_co_read(pdu, fidp, &qiov_full, off);
+        qemu_iovec_destroy(&qiov_full);
+        if (count < 0) {
+            /* IO error return the error */
+            err = count;
+            goto out;
+        }
         err = pdu_marshal(pdu, offset, "d", count);
         if (err < 0) {
             goto out;
         }
         err += offset + count;
-        qemu_iovec_destroy(&qiov);
-        qemu_iovec_destroy(&qiov_full);
     } else if (fidp->fid_type == P9_FID_XATTR) {
         err = v9fs_xattr_read(s, pdu, fidp, off, max_count);
     } else {
@@ -1757,80 +1860,6 @@ out_nofid:
     complete_pdu(s, pdu, err);
 }
 
-static size_t v9fs_readdir_data_size(V9fsString *name)
-{
-    /*
-     * Size of each dirent on the wire: size of qid (13) + size of offset (8)
-     * size of type (1) + size of name.size (2) + strlen(name.data)
-     */
-    return 24 + v9fs_string_size(name);
-}
-
-static int v9fs_do_readdir(V9fsPDU *pdu,
-                           V9fsFidState *fidp, int32_t max_count)
-{
-    size_t size;
-    V9fsQID qid;
-    V9fsString name;
-    int len, err = 0;
-    int32_t count = 0;
-    off_t saved_dir_pos;
-    struct dirent *dent, *result;
-
-    /* save the directory position */
-    saved_dir_pos = v9fs_co_telldir(pdu, fidp);
-    if (saved_dir_pos < 0) {
-        return saved_dir_pos;
-    }
-
-    dent = g_malloc(sizeof(struct dirent));
-
-    while (1) {
-        err = v9fs_co_readdir_r(pdu, fidp, dent, &result);
-        if (err || !result) {
-            break;
-        }
-        v9fs_string_init(&name);
-        v9fs_string_sprintf(&name, "%s", dent->d_name);
-        if ((count + v9fs_readdir_data_size(&name)) > max_count) {
-            /* Ran out of buffer. Set dir back to old position and return */
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
-            v9fs_string_free(&name);
-            g_free(dent);
-            return count;
-        }
-        /*
-         * Fill up just the path field of qid because the client uses
-         * only that. To fill the entire qid structure we will have
-         * to stat each dirent found, which is expensive
-         */
-        size = MIN(sizeof(dent->d_ino), sizeof(qid.path));
-        memcpy(&qid.path, &dent->d_ino, size);
-        /* Fill the other fields with dummy values */
-        qid.type = 0;
-        qid.version = 0;
-
-        /* 11 = 7 + 4 (7 = start offset, 4 = space for storing count) */
-        len = pdu_marshal(pdu, 11 + count, "Qqbs",
-                          &qid, dent->d_off,
-                          dent->d_type, &name);
-        if (len < 0) {
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
-            v9fs_string_free(&name);
-            g_free(dent);
-            return len;
-        }
-        count += len;
-        v9fs_string_free(&name);
-        saved_dir_pos = dent->d_off;
-    }
-    g_free(dent);
-    if (err < 0) {
-        return err;
-    }
-    return count;
-}
-
 static void v9fs_readdir(void *opaque)
 {
     int32_t fid;
@@ -1859,12 +1888,7 @@ static void v9fs_readdir(void *opaque)
         retval = -EINVAL;
         goto out;
     }
-    if (initial_offset == 0) {
-        v9fs_co_rewinddir(pdu, fidp);
-    } else {
-        v9fs_co_seekdir(pdu, fidp, initial_offset);
-    }
-    count = v9fs_do_readdir(pdu, fidp, max_count);
+    count = v9fs_co_readdir_many(pdu, fidp, initial_offset, max_count);
     if (count < 0) {
         retval = count;
         goto out;
@@ -1934,14 +1958,12 @@ static void v9fs_write(void *opaque)
     int32_t fid;
     uint64_t off;
     uint32_t count;
-    int32_t len = 0;
     int32_t total = 0;
     size_t offset = 7;
     V9fsFidState *fidp;
     V9fsPDU *pdu = opaque;
     V9fsState *s = pdu->s;
     QEMUIOVector qiov_full;
-    QEMUIOVector qiov;
 
     err = pdu_unmarshal(pdu, offset, "dqd", &fid, &off, &count);
     if (err < 0) {
@@ -1972,27 +1994,16 @@ static void v9fs_write(void *opaque)
         err = -EINVAL;
         goto out;
     }
-    qemu_iovec_init(&qiov, qiov_full.niov);
-    do {
-        qemu_iovec_reset(&qiov);
-        qemu_iovec_concat(&qiov, &qiov_full, total, qiov_full.size - total);
-        if (0) {
-            print_sg(qiov.iov, qiov.niov);
-        }
-        /* Loop in case of EINTR */
-        do {
-            len = v9fs_co_pwritev(pdu, fidp, qiov.iov, qiov.niov, off);
-            if (len >= 0) {
-                off   += len;
-                total += len;
-            }
-        } while (len == -EINTR && !pdu->cancelled);
-        if (len < 0) {
-            /* IO error return the error */
-            err = len;
-            goto out_qiov;
-        }
-    } while (total < count && len > 0);
+    if (0) {
+        print_sg(qiov_full.iov, qiov_full.niov);
+    }
+    /* short writes and EINTR are retried by the worker */
+    total = v9fs_co_write(pdu, fidp, &qiov_full, off);
+    if (total < 0) {
+        /* IO error return the error */
+        err = total;
+        goto out;
+    }
 
     offset = 7;
     err = pdu_marshal(pdu, offset, "d", total);
@@ -2001,8 +2012,6 @@ static void v9fs_write(void *opaque)
     }
     err += offset;
     trace_v9fs_write_return(pdu->tag, pdu->id, total, err);
-out_qiov:
-    qemu_iovec_destroy(&qiov);
 out:
     put_fid(pdu, fidp);
 out_nofid:
@@ -3206,33 +3215,6 @@ static void v9fs_fs_ro(void *opaque)
     complete_pdu(pdu->s, pdu, -EROFS);
 }
 
-static inline bool is_read_only_op(V9fsPDU *pdu)
-{
-    switch (pdu->id) {
-    case P9_TREADDIR:
-    case P9_TSTATFS:
-    case P9_TGETATTR:
-    case P9_TXATTRWALK:
-    case P9_TLOCK:
-    case P9_TGETLOCK:
-    case P9_TREADLINK:
-    case P9_TVERSION:
-    case P9_TLOPEN:
-    case P9_TATTACH:
-    case P9_TSTAT:
-    case P9_TWALK:
-    case P9_TCLUNK:
-    case P9_TFSYNC:
-    case P9_TOPEN:
-    case P9_TREAD:
-    case P9_TAUTH:
-    case P9_TFLUSH:
-        return 1;
-    default:
-        return 0;
-    }
-}
-
 static void submit_pdu(V9fsState *s, V9fsPDU *pdu)
 {
     Coroutine *co;
@@ -3248,6 +3230,9 @@ static void submit_pdu(V9fsState *s, V9fsPDU *pdu)
     if (is_ro_export(&s->ctx) && !is_read_only_op(pdu)) {
         handler = v9fs_fs_ro;
     }
+    if (!is_read_only_op(pdu)) {
+        v9fs_attr_cache_invalidate(s);
+    }
     co = qemu_coroutine_create(handler);
     qemu_coroutine_enter(co, pdu);
 }
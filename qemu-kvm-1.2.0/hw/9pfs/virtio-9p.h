@@ -152,6 +152,14 @@ struct V9fsPDU
 #define MAX_REQ         128
 #define MAX_TAG_LEN     32
 
+/* Upper bound of the attribute cache, it is flushed when it gets there */
+#define V9FS_ATTR_CACHE_MAX     4096
+#define V9FS_MAX_READAHEAD_KB   1024
+
+/* Directory entries read per worker trip, and the smallest 9P2000.u stat */
+#define V9FS_READDIR_BATCH      128
+#define V9FS_STAT_MIN_SIZE      61
+
 #define BUG_ON(cond) assert(!(cond))
 
 typedef struct V9fsFidState V9fsFidState;
@@ -202,6 +210,13 @@ struct V9fsFidState
     int clunked;
     V9fsFidState *next;
     V9fsFidState *rclm_lst;
+    /* data read past the end of the last sequential read */
+    uint8_t *ra_buf;
+    int64_t ra_off;
+    size_t ra_len;
+    uint64_t ra_gen;
+    int64_t ra_next;
+    bool ra_busy;
 };
 
 typedef struct V9fsState
@@ -225,6 +240,15 @@ typedef struct V9fsState
     CoRwlock rename_lock;
     int32_t root_fid;
     Error *migration_blocker;
+    /*
+     * lstat results by path.  attr_cache_gen is bumped whenever a request
+     * that may modify the file system starts or completes, so that results
+     * of lookups racing with it, and readahead data, are dropped.
+     */
+    GHashTable *attr_cache;
+    int64_t attr_cache_ns;
+    uint64_t attr_cache_gen;
+    uint32_t readahead;
 } V9fsState;
 
 typedef struct V9fsStatState {
@@ -396,6 +420,12 @@ extern void v9fs_path_free(V9fsPath *path);
 extern void v9fs_path_copy(V9fsPath *lhs, V9fsPath *rhs);
 extern int v9fs_name_to_path(V9fsState *s, V9fsPath *dirpath,
                              const char *name, V9fsPath *path);
+extern GHashTable *v9fs_attr_cache_new(void);
+extern bool v9fs_attr_cache_lookup(V9fsState *s, V9fsPath *path,
+                                   struct stat *stbuf);
+extern void v9fs_attr_cache_insert(V9fsState *s, V9fsPath *path,
+                                   const struct stat *stbuf, uint64_t gen);
+extern void v9fs_attr_cache_invalidate(V9fsState *s);
 
 #define pdu_marshal(pdu, offset, fmt, args...)  \
     v9fs_marshal(pdu->elem.in_sg, pdu->elem.in_num, offset, 1, fmt, ##args)
@@ -28,6 +28,7 @@
 #include "range.h"
 #include "ioport.h"
 #include "fw_cfg.h"
+#include "exec-memory.h"
 
 //#define DEBUG
 
@@ -62,6 +63,8 @@ struct pci_status {
 typedef struct PIIX4PMState {
     PCIDevice dev;
     IORange ioport;
+    MemoryRegion tmr_io;
+    bool tmr_io_mapped;
     ACPIREGS ar;
 
     APMState apm;
@@ -176,6 +179,34 @@ static const IORangeOps pm_iorange_ops = {
     .write = pm_ioport_write,
 };
 
+/*
+ * The PM timer gets a region of its own in the I/O address space, so that
+ * guests polling it don't take the global mutex.  It covers the same four
+ * ports as the PM I/O range and returns what that would.
+ */
+static uint64_t pm_tmr_read(void *opaque, target_phys_addr_t addr,
+                            unsigned width)
+{
+    PIIX4PMState *s = opaque;
+
+    return acpi_pm_tmr_get(&s->ar) >> (addr * 8);
+}
+
+static void pm_tmr_write(void *opaque, target_phys_addr_t addr,
+                         uint64_t val, unsigned width)
+{
+}
+
+static const MemoryRegionOps pm_tmr_ops = {
+    .read = pm_tmr_read,
+    .write = pm_tmr_write,
+    .valid = {
+        .min_access_size = 1,
+        .max_access_size = 4,
+    },
+    .endianness = DEVICE_LITTLE_ENDIAN,
+};
+
 static void apm_ctrl_changed(uint32_t val, void *arg)
 {
     PIIX4PMState *s = arg;
@@ -207,6 +238,15 @@ static void pm_io_space_update(PIIX4PMState *s)
         PIIX4_DPRINTF("PM: mapping to 0x%x\n", pm_io_base);
         iorange_init(&s->ioport, &pm_iorange_ops, pm_io_base, 64);
         ioport_register(&s->ioport);
+
+        memory_region_transaction_begin();
+        if (s->tmr_io_mapped) {
+            memory_region_del_subregion(get_system_io(), &s->tmr_io);
+        }
+        memory_region_add_subregion(get_system_io(), pm_io_base + 0x08,
+                                    &s->tmr_io);
+        s->tmr_io_mapped = true;
+        memory_region_transaction_commit();
     }
 }
 
@@ -426,6 +466,8 @@ static int piix4_pm_initfn(PCIDevice *dev)
 
     acpi_pm_tmr_init(&s->ar, pm_tmr_timer);
     acpi_gpe_init(&s->ar, GPE_LEN);
+    memory_region_init_io(&s->tmr_io, &pm_tmr_ops, s, "piix4-pm-tmr", 4);
+    memory_region_set_lockless(&s->tmr_io, true, false);
 
     qemu_system_powerdown = *qemu_allocate_irqs(piix4_powerdown, s, 1);
 
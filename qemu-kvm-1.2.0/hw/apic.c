@@ -24,6 +24,7 @@
 #include "host-utils.h"
 #include "trace.h"
 #include "pc.h"
+#include "kvm.h"
 #include "apic-msidef.h"
 
 #define MAX_APIC_WORDS 8
@@ -134,6 +135,85 @@ static void apic_sync_vapic(APICCommonState *s, int sync_type)
     }
 }
 
+/*
+ * Paravirtual EOI, for TCG: KVM does it in its own APIC.
+ *
+ * When an edge triggered interrupt is the only one in service and nothing
+ * else is requested, bit 0 of the word the guest registered with
+ * MSR_PV_EOI_EN is set on delivery.  A guest that finds it set clears it
+ * instead of writing the EOI register, and the EOI is then completed here
+ * the next time the APIC state is looked at.
+ */
+static target_phys_addr_t apic_pv_eoi_addr(APICCommonState *s)
+{
+    CPUX86State *env = s->cpu_env;
+
+    if (kvm_enabled() || !(env->pv_eoi_en_msr & MSR_PV_EOI_ENABLED)) {
+        return 0;
+    }
+    return env->pv_eoi_en_msr & ~3ULL;
+}
+
+/* Completes the EOI if the guest cleared the flag */
+static void apic_sync_pv_eoi(APICCommonState *s)
+{
+    target_phys_addr_t addr;
+
+    if (s->pv_eoi_vector < 0) {
+        return;
+    }
+    addr = apic_pv_eoi_addr(s);
+    if (!addr) {
+        /* disabled meanwhile, the guest writes the EOI register */
+        s->pv_eoi_vector = -1;
+        return;
+    }
+    if (ldl_le_phys(addr) & 1) {
+        return;
+    }
+    reset_bit(s->isr, s->pv_eoi_vector);
+    s->pv_eoi_vector = -1;
+    s->stats.pv_eois++;
+    apic_sync_vapic(s, SYNC_ISR_IRR_TO_VAPIC);
+}
+
+/*
+ * Takes the flag back before another interrupt is requested or delivered:
+ * the guest must then write the EOI register, and an interrupt blocked by
+ * the one in service gets noticed.
+ */
+static void apic_cancel_pv_eoi(APICCommonState *s)
+{
+    target_phys_addr_t addr;
+
+    apic_sync_pv_eoi(s);
+    if (s->pv_eoi_vector < 0) {
+        return;
+    }
+    addr = apic_pv_eoi_addr(s);
+    stl_le_phys(addr, ldl_le_phys(addr) & ~1);
+    s->pv_eoi_vector = -1;
+}
+
+static void apic_offer_pv_eoi(APICCommonState *s, int vector)
+{
+    target_phys_addr_t addr = apic_pv_eoi_addr(s);
+    int i, in_service = 0;
+
+    if (!addr || get_bit(s->tmr, vector) ||
+        get_highest_priority_int(s->irr) >= 0) {
+        return;
+    }
+    for (i = 0; i < MAX_APIC_WORDS; i++) {
+        in_service += ctpop32(s->isr[i]);
+    }
+    if (in_service != 1) {
+        return;
+    }
+    stl_le_phys(addr, ldl_le_phys(addr) | 1);
+    s->pv_eoi_vector = vector;
+}
+
 static void apic_vapic_base_update(APICCommonState *s)
 {
     apic_sync_vapic(s, SYNC_TO_VAPIC);
@@ -373,6 +453,7 @@ void apic_poll_irq(DeviceState *d)
 {
     APICCommonState *s = APIC_COMMON(d);
 
+    apic_sync_pv_eoi(s);
     apic_sync_vapic(s, SYNC_FROM_VAPIC);
     apic_update_irq(s);
 }
@@ -381,6 +462,8 @@ static void apic_set_irq(APICCommonState *s, int vector_num, int trigger_mode)
 {
     apic_report_irq_delivered(!get_bit(s->irr, vector_num));
 
+    apic_cancel_pv_eoi(s);
+
     set_bit(s->irr, vector_num);
     if (trigger_mode)
         set_bit(s->tmr, vector_num);
@@ -402,6 +485,8 @@ static void apic_set_irq(APICCommonState *s, int vector_num, int trigger_mode)
 static void apic_eoi(APICCommonState *s)
 {
     int isrv;
+
+    apic_cancel_pv_eoi(s);
     isrv = get_highest_priority_int(s->isr);
     if (isrv < 0)
         return;
@@ -556,6 +641,7 @@ int apic_get_interrupt(DeviceState *d)
     if (!(s->spurious_vec & APIC_SV_ENABLE))
         return -1;
 
+    apic_sync_pv_eoi(s);
     apic_sync_vapic(s, SYNC_FROM_VAPIC);
     intno = apic_irq_pending(s);
 
@@ -566,6 +652,7 @@ int apic_get_interrupt(DeviceState *d)
         apic_sync_vapic(s, SYNC_TO_VAPIC);
         return s->spurious_vec & 0xff;
     }
+    apic_cancel_pv_eoi(s);
     reset_bit(s->irr, intno);
     set_bit(s->isr, intno);
     apic_sync_vapic(s, SYNC_TO_VAPIC);
@@ -574,6 +661,7 @@ int apic_get_interrupt(DeviceState *d)
     apic_check_pic(s);
 
     apic_update_irq(s);
+    apic_offer_pv_eoi(s, intno);
 
     return intno;
 }
@@ -662,6 +750,13 @@ static uint32_t apic_mem_readl(void *opaque, target_phys_addr_t addr)
     s = DO_UPCAST(APICCommonState, busdev.qdev, d);
 
     index = (addr >> 4) & 0xff;
+    if (index == 0x08) {
+        s->stats.tpr_accesses++;
+    } else {
+        s->stats.other_accesses++;
+    }
+    apic_sync_pv_eoi(s);
+
     switch(index) {
     case 0x02: /* id */
         val = s->id << 24;
@@ -766,6 +861,22 @@ static void apic_mem_writel(void *opaque, target_phys_addr_t addr, uint32_t val)
 
     trace_apic_mem_writel(addr, val);
 
+    switch (index) {
+    case 0x08:
+        s->stats.tpr_accesses++;
+        break;
+    case 0x0b:
+        s->stats.eoi_writes++;
+        break;
+    case 0x30:
+        s->stats.icr_writes++;
+        break;
+    default:
+        s->stats.other_accesses++;
+        break;
+    }
+    apic_sync_pv_eoi(s);
+
     switch(index) {
     case 0x02:
         s->id = (val >> 24);
@@ -844,6 +955,7 @@ static void apic_mem_writel(void *opaque, target_phys_addr_t addr, uint32_t val)
 
 static void apic_pre_save(APICCommonState *s)
 {
+    apic_sync_pv_eoi(s);
     apic_sync_vapic(s, SYNC_FROM_VAPIC);
 }
 
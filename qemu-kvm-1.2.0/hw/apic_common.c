@@ -103,6 +103,7 @@ void apic_handle_tpr_access_report(DeviceState *d, target_ulong ip,
 {
     APICCommonState *s = DO_UPCAST(APICCommonState, busdev.qdev, d);
 
+    s->stats.tpr_reports++;
     vapic_report_tpr_access(s->vapic, s->cpu_env, ip, access);
 }
 
@@ -181,6 +182,7 @@ void apic_init_reset(DeviceState *d)
     s->log_dest = 0;
     s->dest_mode = 0xf;
     memset(s->isr, 0, sizeof(s->isr));
+    s->pv_eoi_vector = -1;
     memset(s->tmr, 0, sizeof(s->tmr));
     memset(s->irr, 0, sizeof(s->irr));
     for (i = 0; i < APIC_LVT_NB; i++) {
@@ -333,6 +335,24 @@ static int apic_dispatch_post_load(void *opaque, int version_id)
     return 0;
 }
 
+static bool apic_pv_eoi_needed(void *opaque)
+{
+    APICCommonState *s = opaque;
+
+    return s->pv_eoi_vector >= 0;
+}
+
+static const VMStateDescription vmstate_apic_pv_eoi = {
+    .name = "apic/pv_eoi",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_INT32(pv_eoi_vector, APICCommonState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_apic_common = {
     .name = "apic",
     .version_id = 3,
@@ -363,6 +383,14 @@ static const VMStateDescription vmstate_apic_common = {
         VMSTATE_INT64(timer_expiry,
                       APICCommonState), /* open-coded timer state */
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection[]) {
+        {
+            .vmsd = &vmstate_apic_pv_eoi,
+            .needed = apic_pv_eoi_needed,
+        } , {
+            /* empty */
+        }
     }
 };
 
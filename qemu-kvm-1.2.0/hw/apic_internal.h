@@ -70,6 +70,16 @@
 
 typedef struct APICCommonState APICCommonState;
 
+/* guest accesses that still trap, for "info vapic" */
+typedef struct APICStats {
+    uint64_t tpr_reports;       /* TPR accesses reported to the kvmvapic */
+    uint64_t tpr_accesses;      /* MMIO accesses of the following kinds */
+    uint64_t eoi_writes;
+    uint64_t icr_writes;
+    uint64_t other_accesses;
+    uint64_t pv_eois;           /* EOIs done through the PV EOI flag */
+} APICStats;
+
 #define TYPE_APIC_COMMON "apic-common"
 #define APIC_COMMON(obj) \
      OBJECT_CHECK(APICCommonState, (obj), TYPE_APIC_COMMON)
@@ -125,6 +135,10 @@ struct APICCommonState {
     uint32_t vapic_control;
     DeviceState *vapic;
     target_phys_addr_t vapic_paddr; /* note: persistence via kvmvapic */
+
+    /* in-service vector whose PV EOI flag is set, -1 if none */
+    int32_t pv_eoi_vector;
+    APICStats stats;
 };
 
 typedef struct VAPICState {
@@ -2166,6 +2166,14 @@ static void cirrus_cursor_invalidate(VGACommonState *s1)
     }
 }
 
+/* the cursor is blended in while drawing, so it needs a private surface */
+static bool cirrus_cursor_visible(VGACommonState *s1)
+{
+    CirrusVGAState *s = container_of(s1, CirrusVGAState, vga);
+
+    return s->vga.sr[0x12] & CIRRUS_CURSOR_SHOW;
+}
+
 #define DEPTH 8
 #include "cirrus_vga_template.h"
 
@@ -2878,6 +2886,7 @@ static void cirrus_init_common(CirrusVGAState * s, int device_id, int is_pci,
     s->vga.get_resolution = cirrus_get_resolution;
     s->vga.cursor_invalidate = cirrus_cursor_invalidate;
     s->vga.cursor_draw_line = cirrus_cursor_draw_line;
+    s->vga.cursor_visible = cirrus_cursor_visible;
 
     qemu_register_reset(cirrus_reset, s);
 }
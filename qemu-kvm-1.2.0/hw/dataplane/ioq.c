@@ -0,0 +1,176 @@
+/*
+ * Linux AIO request queue for the virtio-blk data plane
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "ioq.h"
+
+int ioq_init(IOQueue *ioq, int fd, unsigned int max_reqs)
+{
+    int rc;
+    unsigned int i;
+
+    ioq->fd = fd;
+    ioq->max_reqs = max_reqs;
+
+    memset(&ioq->io_ctx, 0, sizeof(ioq->io_ctx));
+    rc = io_setup(max_reqs, &ioq->io_ctx);
+    if (rc != 0) {
+        return rc;
+    }
+
+    rc = event_notifier_init(&ioq->io_notifier, 0);
+    if (rc != 0) {
+        io_destroy(ioq->io_ctx);
+        return rc;
+    }
+
+    ioq->freelist = g_malloc0(sizeof(ioq->freelist[0]) * max_reqs);
+    ioq->freelist_idx = 0;
+
+    ioq->queue = g_malloc0(sizeof(ioq->queue[0]) * max_reqs);
+    ioq->queue_idx = 0;
+
+    ioq->events = g_malloc(sizeof(ioq->events[0]) * max_reqs);
+
+    for (i = 0; i < max_reqs; i++) {
+        ioq_put_iocb(ioq, g_malloc0(sizeof(struct iocb)));
+    }
+    return 0;
+}
+
+/* All requests must have completed, or their iocbs are leaked */
+void ioq_cleanup(IOQueue *ioq)
+{
+    unsigned int i;
+
+    for (i = 0; i < ioq->freelist_idx; i++) {
+        g_free(ioq->freelist[i]);
+    }
+
+    g_free(ioq->events);
+    g_free(ioq->queue);
+    g_free(ioq->freelist);
+    event_notifier_cleanup(&ioq->io_notifier);
+    io_destroy(ioq->io_ctx);
+}
+
+EventNotifier *ioq_get_notifier(IOQueue *ioq)
+{
+    return &ioq->io_notifier;
+}
+
+/* Returns NULL when all max_reqs iocbs are in use */
+struct iocb *ioq_get_iocb(IOQueue *ioq)
+{
+    if (unlikely(ioq->freelist_idx == 0)) {
+        return NULL;
+    }
+    return ioq->freelist[--ioq->freelist_idx];
+}
+
+void ioq_put_iocb(IOQueue *ioq, struct iocb *iocb)
+{
+    assert(ioq->freelist_idx < ioq->max_reqs);
+    ioq->freelist[ioq->freelist_idx++] = iocb;
+}
+
+/*
+ * Queues a vectored read or write, the iovec array must stay valid until
+ * the request completes.  Returns NULL if no iocb is free.
+ */
+struct iocb *ioq_rdwr(IOQueue *ioq, bool read, struct iovec *iov,
+                      unsigned int count, long long offset)
+{
+    struct iocb *iocb = ioq_get_iocb(ioq);
+
+    if (!iocb) {
+        return NULL;
+    }
+
+    if (read) {
+        io_prep_preadv(iocb, ioq->fd, iov, count, offset);
+    } else {
+        io_prep_pwritev(iocb, ioq->fd, iov, count, offset);
+    }
+    io_set_eventfd(iocb, event_notifier_get_fd(&ioq->io_notifier));
+    ioq->queue[ioq->queue_idx++] = iocb;
+    return iocb;
+}
+
+/*
+ * Submits all queued requests with a single system call.
+ *
+ * Returns the number of requests the kernel accepted, anything it didn't
+ * take stays queued for the next call, or -errno if it took none.  -EAGAIN
+ * means that the caller should retry after reaping completions.
+ */
+int ioq_submit(IOQueue *ioq)
+{
+    int rc;
+
+    if (ioq->queue_idx == 0) {
+        return 0;
+    }
+
+    do {
+        rc = io_submit(ioq->io_ctx, ioq->queue_idx, ioq->queue);
+    } while (rc == -EINTR);
+
+    if (rc > 0) {
+        ioq->queue_idx -= rc;
+        memmove(ioq->queue, ioq->queue + rc,
+                ioq->queue_idx * sizeof(ioq->queue[0]));
+    }
+    return rc;
+}
+
+/*
+ * Takes the first queued request off the queue again, so that the caller
+ * can fail it after ioq_submit() returned an error other than -EAGAIN.
+ */
+struct iocb *ioq_unqueue(IOQueue *ioq)
+{
+    struct iocb *iocb;
+
+    if (ioq->queue_idx == 0) {
+        return NULL;
+    }
+
+    iocb = ioq->queue[0];
+    ioq->queue_idx--;
+    memmove(ioq->queue, ioq->queue + 1,
+            ioq->queue_idx * sizeof(ioq->queue[0]));
+    return iocb;
+}
+
+/*
+ * Calls completion for every finished request and returns their iocbs to
+ * the free list.  Returns the number of completions or -errno.
+ */
+int ioq_run_completion(IOQueue *ioq, IOQueueCompletion *completion,
+                       void *opaque)
+{
+    int nevents;
+    int i;
+
+    do {
+        nevents = io_getevents(ioq->io_ctx, 0, ioq->max_reqs, ioq->events,
+                               NULL);
+    } while (nevents == -EINTR);
+    if (nevents < 0) {
+        return nevents;
+    }
+
+    for (i = 0; i < nevents; i++) {
+        struct io_event *ev = &ioq->events[i];
+        ssize_t ret = ((uint64_t)ev->res2 << 32) | ev->res;
+
+        completion(ev->obj, ret, opaque);
+        ioq_put_iocb(ioq, ev->obj);
+    }
+    return nevents;
+}
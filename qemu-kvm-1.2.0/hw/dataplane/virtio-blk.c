@@ -0,0 +1,594 @@
+/*
+ * Dedicated thread for virtio-blk I/O processing
+ *
+ * Each virtqueue of the device is owned by an IOThread of its own while the
+ * data plane runs: it is kicked through the queue's ioeventfd, reads the
+ * vring directly from guest memory, submits requests to the image file with
+ * Linux AIO and raises the guest interrupt through the queue's irqfd.  None
+ * of this takes the global mutex.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "iothread.h"
+#include "qemu-error.h"
+#include "qerror.h"
+#include "iov.h"
+#include "sysemu.h"
+#include "cpus.h"
+#include "migration.h"
+#include "block.h"
+#include "trace.h"
+#include "hw/virtio-blk.h"
+#include "hw/dataplane/vring.h"
+#include "hw/dataplane/ioq.h"
+#include "hw/dataplane/virtio-blk.h"
+
+enum {
+    SEG_MAX = 126,                  /* maximum number of I/O segments */
+    VRING_MAX = SEG_MAX + 2,        /* maximum number of vring descriptors */
+};
+
+typedef struct {
+    unsigned int head;              /* vring descriptor index */
+    struct iovec iov[VRING_MAX];    /* descriptors, headers included */
+    struct virtio_blk_inhdr *inhdr; /* status byte in guest memory */
+    size_t len;                     /* bytes to transfer */
+    bool is_write;
+} VirtIOBlockRequest;
+
+/* One virtqueue and the thread that serves it */
+typedef struct {
+    VirtIOBlockDataPlane *s;
+    int n;                          /* virtqueue index */
+    bool stopping;                  /* stop requested, read by the thread */
+
+    Vring vring;                    /* virtqueue vring */
+    EventNotifier *guest_notifier;  /* irq */
+    EventNotifier host_notifier;    /* doorbell */
+    IOThread *iothread;
+
+    IOQueue ioqueue;                /* Linux AIO queue */
+    VirtIOBlockRequest *requests;   /* one per vring descriptor */
+    VirtIOBlockRequest **free_requests;
+    unsigned int num_free_requests;
+    unsigned int num_reqs;          /* requests handed to the kernel */
+    bool notify_pending;            /* used ring updated, guest not told */
+} DataPlaneQueue;
+
+struct VirtIOBlockDataPlane {
+    bool started;
+    bool restart;                   /* start again when the VM resumes */
+
+    VirtIODevice *vdev;
+    BlockDriverState *bs;
+    VirtIOBlkConf *blk;
+    int fd;                         /* image file descriptor */
+    int64_t nb_sectors;             /* image size, resizing is not allowed */
+    bool writethrough;              /* fdatasync() after every write */
+
+    int num_queues;
+    DataPlaneQueue *queues;
+
+    VMChangeStateEntry *vmstate;
+    Error *migration_blocker;
+};
+
+static VirtIOBlockRequest *get_request(DataPlaneQueue *q)
+{
+    assert(q->num_free_requests > 0);
+    return q->free_requests[--q->num_free_requests];
+}
+
+static void put_request(DataPlaneQueue *q, VirtIOBlockRequest *req)
+{
+    q->free_requests[q->num_free_requests++] = req;
+}
+
+/* Raise an interrupt to signal guest, if necessary */
+static void notify_guest(DataPlaneQueue *q)
+{
+    if (!q->notify_pending) {
+        return;
+    }
+    q->notify_pending = false;
+
+    if (!vring_should_notify(q->s->vdev, &q->vring)) {
+        return;
+    }
+
+    event_notifier_set(q->guest_notifier);
+}
+
+static void complete_request(DataPlaneQueue *q, VirtIOBlockRequest *req,
+                             unsigned char status)
+{
+    trace_virtio_blk_data_plane_complete_request(q->s, q->n, req->head,
+                                                 status);
+
+    stb_p(&req->inhdr->status, status);
+
+    /* Same length that hw/virtio-blk.c reports */
+    vring_push(&q->vring, req->head, req->len + sizeof(*req->inhdr));
+    q->notify_pending = true;
+    put_request(q, req);
+}
+
+static void complete_rdwr(struct iocb *iocb, ssize_t ret, void *opaque)
+{
+    DataPlaneQueue *q = opaque;
+    VirtIOBlockRequest *req = iocb->data;
+    unsigned char status = VIRTIO_BLK_S_OK;
+
+    q->num_reqs--;
+
+    if (unlikely(ret != (ssize_t)req->len)) {
+        status = VIRTIO_BLK_S_IOERR;
+    } else if (req->is_write && q->s->writethrough &&
+               qemu_fdatasync(q->s->fd) != 0) {
+        status = VIRTIO_BLK_S_IOERR;
+    }
+    complete_request(q, req, status);
+}
+
+static void do_get_id_cmd(DataPlaneQueue *q, VirtIOBlockRequest *req,
+                          struct iovec *iov, unsigned int iov_cnt)
+{
+    VirtIOBlkConf *blk = q->s->blk;
+    char id[VIRTIO_BLK_ID_BYTES];
+
+    /* Serial number not NUL-terminated when shorter than buffer */
+    strncpy(id, blk->serial ? blk->serial : "", sizeof(id));
+    iov_from_buf(iov, iov_cnt, 0, id, sizeof(id));
+    complete_request(q, req, VIRTIO_BLK_S_OK);
+}
+
+static void do_rdwr_cmd(DataPlaneQueue *q, VirtIOBlockRequest *req,
+                        bool read, struct iovec *iov, unsigned int iov_cnt,
+                        uint64_t sector)
+{
+    VirtIOBlockDataPlane *s = q->s;
+    struct iocb *iocb;
+    size_t len = iov_size(iov, iov_cnt);
+    unsigned int logical_block_size = s->blk->conf.logical_block_size;
+
+    req->len = len;
+    req->is_write = !read;
+
+    if ((sector * BDRV_SECTOR_SIZE) % logical_block_size ||
+        len % logical_block_size ||
+        sector > s->nb_sectors ||
+        len / BDRV_SECTOR_SIZE > s->nb_sectors - sector) {
+        req->len = 0;
+        complete_request(q, req, VIRTIO_BLK_S_IOERR);
+        return;
+    }
+
+    /* There is one iocb per descriptor, so this can't fail */
+    iocb = ioq_rdwr(&q->ioqueue, read, iov, iov_cnt,
+                    sector * BDRV_SECTOR_SIZE);
+    assert(iocb != NULL);
+    iocb->data = req;
+    q->num_reqs++;
+}
+
+static void do_flush_cmd(DataPlaneQueue *q, VirtIOBlockRequest *req)
+{
+    unsigned char status = VIRTIO_BLK_S_OK;
+
+    /*
+     * Only writes that completed before the flush need to be stable, so a
+     * synchronous fdatasync() right here is enough.  Writes that are still
+     * in flight on other queues aren't covered, just like with the main
+     * loop implementation.
+     */
+    if (qemu_fdatasync(q->s->fd) != 0) {
+        status = VIRTIO_BLK_S_IOERR;
+    }
+    complete_request(q, req, status);
+}
+
+static int process_request(DataPlaneQueue *q, VirtIOBlockRequest *req,
+                           unsigned int out_num, unsigned int in_num)
+{
+    struct iovec *iov = req->iov;
+    struct iovec *in_iov = &iov[out_num];
+    struct virtio_blk_outhdr *outhdr;
+    uint32_t type;
+
+    /* Same checks as hw/virtio-blk.c, except that we don't exit() */
+    if (unlikely(out_num < 1 || in_num < 1 ||
+                 iov[0].iov_len < sizeof(*outhdr) ||
+                 in_iov[in_num - 1].iov_len < sizeof(*req->inhdr))) {
+        error_report("virtio-blk request headers not in correct element");
+        return -EFAULT;
+    }
+
+    outhdr = iov[0].iov_base;
+    req->inhdr = in_iov[in_num - 1].iov_base;
+    req->len = 0;
+    in_num--;
+
+    type = ldl_p(&outhdr->type);
+
+    trace_virtio_blk_data_plane_process_request(q->s, q->n, out_num, in_num,
+                                                type);
+
+    if (type & VIRTIO_BLK_T_FLUSH) {
+        do_flush_cmd(q, req);
+    } else if (type & VIRTIO_BLK_T_SCSI_CMD) {
+        /* Just put anything nonzero so that the ioctl fails in the guest */
+        if (in_num >= 1 &&
+            in_iov[in_num - 1].iov_len >= sizeof(struct virtio_scsi_inhdr)) {
+            struct virtio_scsi_inhdr *scsi = in_iov[in_num - 1].iov_base;
+            stl_p(&scsi->errors, 255);
+        }
+        complete_request(q, req, VIRTIO_BLK_S_UNSUPP);
+    } else if (type & VIRTIO_BLK_T_GET_ID) {
+        do_get_id_cmd(q, req, in_iov, in_num);
+    } else if (type & VIRTIO_BLK_T_OUT) {
+        do_rdwr_cmd(q, req, false, &iov[1], out_num - 1,
+                    ldq_p(&outhdr->sector));
+    } else {
+        do_rdwr_cmd(q, req, true, in_iov, in_num, ldq_p(&outhdr->sector));
+    }
+    return 0;
+}
+
+static void submit_requests(DataPlaneQueue *q)
+{
+    struct iocb *iocb;
+    int ret;
+
+    ret = ioq_submit(&q->ioqueue);
+    if (ret >= 0 || ret == -EAGAIN) {
+        /* the rest goes out once requests complete */
+        return;
+    }
+
+    /* The kernel won't take them, so fail everything that is queued */
+    while ((iocb = ioq_unqueue(&q->ioqueue))) {
+        complete_rdwr(iocb, ret, q);
+        ioq_put_iocb(&q->ioqueue, iocb);
+    }
+}
+
+static void handle_notify(void *opaque)
+{
+    DataPlaneQueue *q = opaque;
+    VirtIODevice *vdev = q->s->vdev;
+    VirtIOBlockRequest *req;
+    unsigned int out_num = 0, in_num = 0;
+    int head;
+
+    event_notifier_test_and_clear(&q->host_notifier);
+
+    if (q->stopping) {
+        return;
+    }
+
+    for (;;) {
+        /* Disable guest->host notifies to avoid unnecessary vmexits */
+        vring_disable_notification(vdev, &q->vring);
+
+        for (;;) {
+            /*
+             * Every request holds a descriptor until it completes, so only
+             * a guest that makes the same head available twice gets here.
+             */
+            if (unlikely(q->num_free_requests == 0)) {
+                error_report("virtio-blk guest reused a busy descriptor");
+                vring_set_broken(&q->vring);
+                head = -EFAULT;
+                break;
+            }
+
+            req = get_request(q);
+            head = vring_pop(vdev, &q->vring, req->iov,
+                             req->iov + ARRAY_SIZE(req->iov),
+                             &out_num, &in_num);
+            if (head < 0) {
+                put_request(q, req);
+                break;
+            }
+
+            req->head = head;
+            if (process_request(q, req, out_num, in_num) < 0) {
+                put_request(q, req);
+                vring_set_broken(&q->vring);
+                head = -EFAULT;
+                break;
+            }
+        }
+
+        if (head != -EAGAIN) {
+            /* A broken vring stays quiet until the device is reset */
+            if (head == -ENOBUFS) {
+                error_report("virtio-blk request exceeds %d segments",
+                             SEG_MAX);
+                vring_set_broken(&q->vring);
+            }
+            break;
+        }
+
+        if (vring_enable_notification(vdev, &q->vring)) {
+            break;
+        }
+        /* More requests came in while notification was disabled */
+    }
+
+    submit_requests(q);
+
+    /* GET_ID, flush and failed requests may have completed already */
+    notify_guest(q);
+}
+
+static void handle_io(void *opaque)
+{
+    DataPlaneQueue *q = opaque;
+
+    event_notifier_test_and_clear(ioq_get_notifier(&q->ioqueue));
+
+    if (ioq_run_completion(&q->ioqueue, complete_rdwr, q) > 0) {
+        /* submit what didn't fit into the kernel queue before */
+        if (ioq_num_queued(&q->ioqueue) > 0) {
+            submit_requests(q);
+        }
+        notify_guest(q);
+    }
+}
+
+/* The thread finishes in-flight requests before it exits */
+static int flush_io(void *opaque)
+{
+    DataPlaneQueue *q = opaque;
+
+    return q->num_reqs > 0;
+}
+
+static void data_plane_vm_state_change(void *opaque, int running,
+                                       RunState state)
+{
+    VirtIOBlockDataPlane *s = opaque;
+
+    /*
+     * Requests bypass the block layer, so bdrv_drain_all() doesn't wait for
+     * them.  Stop the threads while the VM is stopped so that guest memory
+     * and the image file don't change behind their back.  A kick that came
+     * in while stopping may have been lost, so don't wait for the next one.
+     */
+    if (running) {
+        if (s->restart) {
+            s->restart = false;
+            virtio_blk_data_plane_start(s);
+        }
+    } else if (s->started) {
+        virtio_blk_data_plane_stop(s);
+        s->restart = true;
+    }
+}
+
+/*
+ * Checks whether @blk can be served by data plane threads and sets them up
+ * if so.  *dataplane is left NULL if the device doesn't ask for it.
+ */
+bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
+                                  VirtIOBlockDataPlane **dataplane)
+{
+    VirtIOBlockDataPlane *s;
+    BlockDriverState *bs = blk->conf.bs;
+    int fd, i;
+
+    *dataplane = NULL;
+
+    if (!blk->data_plane) {
+        return true;
+    }
+
+    if (blk->scsi) {
+        error_report("device is incompatible with x-data-plane, "
+                     "use scsi=off");
+        return false;
+    }
+
+    if (blk->config_wce) {
+        error_report("device is incompatible with x-data-plane, "
+                     "use config-wce=off");
+        return false;
+    }
+
+    if (!vdev->binding->set_host_notifier ||
+        !vdev->binding->set_guest_notifiers) {
+        error_report("x-data-plane needs ioeventfd and irqfd support "
+                     "from the virtio transport");
+        return false;
+    }
+
+    fd = raw_get_aio_fd(bs);
+    if (fd < 0) {
+        error_report("drive is incompatible with x-data-plane, "
+                     "use format=raw,cache=none,aio=native");
+        return false;
+    }
+
+    s = g_malloc0(sizeof(*s));
+    s->vdev = vdev;
+    s->fd = fd;
+    s->bs = bs;
+    s->blk = blk;
+
+    /* Each virtqueue gets a thread of its own */
+    s->num_queues = blk->num_queues;
+    s->queues = g_malloc0(sizeof(s->queues[0]) * s->num_queues);
+    for (i = 0; i < s->num_queues; i++) {
+        s->queues[i].s = s;
+        s->queues[i].n = i;
+    }
+
+    /* Prevent block operations that conflict with data plane thread */
+    bdrv_set_in_use(bs, 1);
+
+    error_set(&s->migration_blocker, QERR_DEVICE_FEATURE_BLOCKS_MIGRATION,
+              "x-data-plane", "virtio-blk");
+    migrate_add_blocker(s->migration_blocker);
+
+    s->vmstate = qemu_add_vm_change_state_handler(data_plane_vm_state_change,
+                                                  s);
+
+    *dataplane = s;
+    return true;
+}
+
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
+{
+    if (!s) {
+        return;
+    }
+
+    virtio_blk_data_plane_stop(s);
+    qemu_del_vm_change_state_handler(s->vmstate);
+    migrate_del_blocker(s->migration_blocker);
+    error_free(s->migration_blocker);
+    bdrv_set_in_use(s->bs, 0);
+    g_free(s->queues);
+    g_free(s);
+}
+
+static void data_plane_queue_start(DataPlaneQueue *q)
+{
+    VirtIOBlockDataPlane *s = q->s;
+    VirtQueue *vq = virtio_get_queue(s->vdev, q->n);
+    AioContext *ctx;
+    unsigned int num, i;
+
+    num = vring_get_num(&q->vring);
+    q->requests = g_malloc0(sizeof(q->requests[0]) * num);
+    q->free_requests = g_malloc(sizeof(q->free_requests[0]) * num);
+    q->num_free_requests = 0;
+    for (i = 0; i < num; i++) {
+        put_request(q, &q->requests[i]);
+    }
+
+    if (ioq_init(&q->ioqueue, s->fd, num) != 0) {
+        error_report("virtio-blk failed to set up Linux AIO");
+        exit(1);
+    }
+
+    q->guest_notifier = virtio_queue_get_guest_notifier(vq);
+
+    /* Set up virtqueue notify */
+    if (s->vdev->binding->set_host_notifier(s->vdev->binding_opaque,
+                                            q->n, true) != 0) {
+        error_report("virtio-blk failed to set host notifier");
+        exit(1);
+    }
+    q->host_notifier = *virtio_queue_get_host_notifier(vq);
+
+    q->iothread = iothread_new();
+    if (!q->iothread) {
+        error_report("virtio-blk failed to create I/O thread");
+        exit(1);
+    }
+    ctx = iothread_get_aio_context(q->iothread);
+    aio_set_fd_handler(ctx, event_notifier_get_fd(&q->host_notifier),
+                       handle_notify, NULL, NULL, q);
+    aio_set_fd_handler(ctx,
+                       event_notifier_get_fd(ioq_get_notifier(&q->ioqueue)),
+                       handle_io, NULL, flush_io, q);
+
+    /* Requests may have been queued before the thread was started */
+    event_notifier_set(&q->host_notifier);
+
+    q->stopping = false;
+    q->notify_pending = false;
+    iothread_start(q->iothread);
+    qemu_register_dataplane_thread(iothread_get_thread(q->iothread));
+}
+
+void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
+{
+    int i;
+
+    if (s->started || !runstate_is_running()) {
+        return;
+    }
+
+    for (i = 0; i < s->num_queues; i++) {
+        if (!vring_setup(&s->queues[i].vring, s->vdev, i)) {
+            while (--i >= 0) {
+                vring_teardown(&s->queues[i].vring, s->vdev, i);
+            }
+            return;
+        }
+    }
+
+    s->nb_sectors = bdrv_getlength(s->bs) / BDRV_SECTOR_SIZE;
+    s->writethrough = !bdrv_enable_write_cache(s->bs);
+
+    /* Set up guest notifiers (irq) */
+    if (s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque,
+                                              true) != 0) {
+        error_report("virtio-blk failed to set guest notifier, "
+                     "ensure -enable-kvm is set");
+        exit(1);
+    }
+
+    trace_virtio_blk_data_plane_start(s, s->num_queues);
+
+    s->started = true;
+    for (i = 0; i < s->num_queues; i++) {
+        data_plane_queue_start(&s->queues[i]);
+    }
+}
+
+static void data_plane_queue_stop(DataPlaneQueue *q)
+{
+    VirtIOBlockDataPlane *s = q->s;
+    AioContext *ctx = iothread_get_aio_context(q->iothread);
+
+    /* The thread finishes in-flight requests before it exits */
+    q->stopping = true;
+    iothread_stop(q->iothread);
+    qemu_unregister_dataplane_thread(iothread_get_thread(q->iothread));
+
+    aio_set_fd_handler(ctx, event_notifier_get_fd(&q->host_notifier),
+                       NULL, NULL, NULL, NULL);
+    aio_set_fd_handler(ctx,
+                       event_notifier_get_fd(ioq_get_notifier(&q->ioqueue)),
+                       NULL, NULL, NULL, NULL);
+    iothread_free(q->iothread);
+    q->iothread = NULL;
+
+    /* Hand the virtqueue back to hw/virtio-blk.c */
+    s->vdev->binding->set_host_notifier(s->vdev->binding_opaque, q->n, false);
+
+    ioq_cleanup(&q->ioqueue);
+    vring_teardown(&q->vring, s->vdev, q->n);
+
+    g_free(q->free_requests);
+    g_free(q->requests);
+    q->free_requests = NULL;
+    q->requests = NULL;
+    q->stopping = false;
+}
+
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
+{
+    int i;
+
+    s->restart = false;
+    if (!s->started) {
+        return;
+    }
+
+    trace_virtio_blk_data_plane_stop(s);
+
+    for (i = 0; i < s->num_queues; i++) {
+        data_plane_queue_stop(&s->queues[i]);
+    }
+    s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque, false);
+
+    s->started = false;
+}
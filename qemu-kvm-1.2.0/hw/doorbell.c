@@ -0,0 +1,147 @@
+/*
+ * Doorbell registers backed by ioeventfd
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "doorbell.h"
+#include "kvm.h"
+
+/*
+ * KVM has a fixed number of I/O bus devices per VM and aborts when a
+ * registration fails, so all doorbells together stay well below it and
+ * leave room for virtio and vhost.
+ */
+#define DOORBELL_MAX_EVENTFDS 256
+
+static int doorbell_eventfds;
+
+static void doorbell_ring(DoorbellValue *v)
+{
+    if (event_notifier_test_and_clear(&v->notifier)) {
+        v->db->handler(v->db->opaque, v->value);
+    }
+}
+
+static void doorbell_handler(EventNotifier *e)
+{
+    doorbell_ring(container_of(e, DoorbellValue, notifier));
+}
+
+/*
+ * Registers @nvalues eventfds for writes of @size bytes at @addr in @mr,
+ * one per entry of @values.  @handler is called with the value whenever
+ * one of them was written.
+ *
+ * Returns 0 on success.  Without KVM, or if the eventfd budget is used
+ * up, returns a negative errno and the register must be emulated as
+ * usual; the doorbell is then inactive and the other functions are
+ * no-ops on it.
+ */
+int doorbell_init(Doorbell *db, MemoryRegion *mr, target_phys_addr_t addr,
+                  unsigned size, const uint64_t *values, int nvalues,
+                  DoorbellHandler *handler, void *opaque)
+{
+    int i, r;
+
+    memset(db, 0, sizeof(*db));
+    assert(nvalues > 0 && nvalues <= DOORBELL_MAX_VALUES);
+
+    if (!kvm_has_many_ioeventfds()) {
+        return -ENOSYS;
+    }
+    if (doorbell_eventfds + nvalues > DOORBELL_MAX_EVENTFDS) {
+        return -ENOSPC;
+    }
+
+    db->mr = mr;
+    db->addr = addr;
+    db->size = size;
+    db->handler = handler;
+    db->opaque = opaque;
+    db->values = g_new0(DoorbellValue, nvalues);
+
+    for (i = 0; i < nvalues; i++) {
+        DoorbellValue *v = &db->values[i];
+
+        r = event_notifier_init(&v->notifier, 0);
+        if (r < 0) {
+            while (--i >= 0) {
+                event_notifier_cleanup(&db->values[i].notifier);
+            }
+            g_free(db->values);
+            db->values = NULL;
+            return r;
+        }
+        v->value = values[i];
+        v->db = db;
+    }
+
+    for (i = 0; i < nvalues; i++) {
+        DoorbellValue *v = &db->values[i];
+
+        event_notifier_set_handler(&v->notifier, doorbell_handler);
+        memory_region_add_eventfd(mr, addr, size, true, v->value,
+                                  &v->notifier);
+    }
+
+    db->nvalues = nvalues;
+    doorbell_eventfds += nvalues;
+    return 0;
+}
+
+/* Drops pending writes; call doorbell_flush() first to keep them. */
+void doorbell_cleanup(Doorbell *db)
+{
+    int i;
+
+    if (!doorbell_active(db)) {
+        return;
+    }
+
+    for (i = 0; i < db->nvalues; i++) {
+        DoorbellValue *v = &db->values[i];
+
+        memory_region_del_eventfd(db->mr, db->addr, db->size, true, v->value,
+                                  &v->notifier);
+        event_notifier_set_handler(&v->notifier, NULL);
+        event_notifier_cleanup(&v->notifier);
+    }
+
+    doorbell_eventfds -= db->nvalues;
+    g_free(db->values);
+    db->values = NULL;
+    db->nvalues = 0;
+}
+
+/*
+ * Runs the handler for every write that completed in the kernel but was
+ * not seen by the I/O thread yet.  A single poll() finds them, so this
+ * is cheap enough to call on each access to the device's registers.
+ */
+void doorbell_flush(Doorbell *db)
+{
+    GPollFD pfds[DOORBELL_MAX_VALUES];
+    int i;
+
+    if (!doorbell_active(db)) {
+        return;
+    }
+
+    for (i = 0; i < db->nvalues; i++) {
+        pfds[i].fd = event_notifier_get_fd(&db->values[i].notifier);
+        pfds[i].events = G_IO_IN;
+        pfds[i].revents = 0;
+    }
+
+    if (g_poll(pfds, db->nvalues, 0) <= 0) {
+        return;
+    }
+
+    for (i = 0; i < db->nvalues; i++) {
+        if (pfds[i].revents & G_IO_IN) {
+            doorbell_ring(&db->values[i]);
+        }
+    }
+}
@@ -0,0 +1,66 @@
+/*
+ * Doorbell registers backed by ioeventfd
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_DOORBELL_H
+#define QEMU_DOORBELL_H
+
+#include "qemu-common.h"
+#include "memory.h"
+#include "event_notifier.h"
+
+/*
+ * A doorbell is a write-only device register whose only side effect is
+ * to kick the device, e.g. a "command issue" or "ring tail" register.
+ * Registering it as a doorbell lets KVM complete the guest's write in
+ * the kernel; the device sees it later from the I/O thread.
+ *
+ * Each value the guest may write needs its own eventfd, so this only
+ * fits registers that take a handful of distinct values.  Writes of
+ * any other value or size still go through the MemoryRegionOps, which
+ * must call doorbell_flush() first so that they are ordered after the
+ * doorbells that already completed.  The same applies to every register
+ * access that may observe the effect of a doorbell.
+ *
+ * Writes to one doorbell may be merged or reordered, so the handler has
+ * to be idempotent and commutative (setting bits is fine, a tail
+ * pointer is not).
+ */
+
+#define DOORBELL_MAX_VALUES 32
+
+typedef void DoorbellHandler(void *opaque, uint64_t value);
+
+typedef struct Doorbell Doorbell;
+
+typedef struct DoorbellValue {
+    EventNotifier notifier;
+    uint64_t value;
+    Doorbell *db;
+} DoorbellValue;
+
+struct Doorbell {
+    MemoryRegion *mr;
+    target_phys_addr_t addr;
+    unsigned size;
+    DoorbellHandler *handler;
+    void *opaque;
+    int nvalues;            /* 0 while the doorbell is not active */
+    DoorbellValue *values;
+};
+
+int doorbell_init(Doorbell *db, MemoryRegion *mr, target_phys_addr_t addr,
+                  unsigned size, const uint64_t *values, int nvalues,
+                  DoorbellHandler *handler, void *opaque);
+void doorbell_cleanup(Doorbell *db);
+void doorbell_flush(Doorbell *db);
+
+static inline bool doorbell_active(Doorbell *db)
+{
+    return db->nvalues > 0;
+}
+
+#endif
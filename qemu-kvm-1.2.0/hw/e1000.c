@@ -32,6 +32,7 @@
 #include "loader.h"
 #include "sysemu.h"
 #include "dma.h"
+#include "virtio-net.h"
 
 #include "e1000_hw.h"
 
@@ -58,6 +59,8 @@ static int debugflags = DBGBIT(TXERR) | DBGBIT(GENERAL);
 #define IOPORT_SIZE       0x40
 #define PNPMMIO_SIZE      0x20000
 #define MIN_BUF_SIZE      60 /* Min. octets in an ethernet frame sans FCS */
+#define E1000_TX_BATCH    32 /* Max. frames in tx_batch */
+#define E1000_DESC_BATCH  16 /* Descriptors per ring DMA, 4 cache lines */
 
 /*
  * HW models:
@@ -93,6 +96,8 @@ typedef struct E1000State_st {
     uint32_t rxbuf_size;
     uint32_t rxbuf_min_shift;
     int check_rxov;
+    bool has_vnet_hdr;  /* peer takes virtio_net_hdr offload metadata */
+    bool has_ufo;
     struct e1000_tx {
         unsigned char header[256];
         unsigned char vlan_header[4];
@@ -116,8 +121,18 @@ typedef struct E1000State_st {
         int8_t ip;
         int8_t tcp;
         char cptse;     // current packet tse bit
+        char gso;       // current packet goes to the peer unsegmented
     } tx;
 
+    /* Frames of one start_xmit() run, for backends that take batches */
+    struct e1000_tx_batch {
+        unsigned char data[0x10000];
+        uint32_t used;
+        int count;
+        struct iovec iov[E1000_TX_BATCH];
+        NetBatchPacket pkts[E1000_TX_BATCH];
+    } tx_batch;
+
     struct {
         uint32_t val_in;	// shifted in from guest driver
         uint16_t bitnum_in;
@@ -127,8 +142,25 @@ typedef struct E1000State_st {
     } eecd_state;
 
     QEMUTimer *autoneg_timer;
+
+    /* Receive descriptors prefetched from RDH on, see e1000_rx_desc_fetch */
+    struct e1000_rx_desc rx_desc_cache[E1000_DESC_BATCH];
+    uint32_t rx_desc_cache_head;    /* ring index of the first entry */
+    uint32_t rx_desc_cache_count;
+
+    /* Interrupt moderation: RDTR/RADV, TIDV/TADV and ITR */
+    QEMUTimer *rx_delay_timer;
+    QEMUTimer *tx_delay_timer;
+    QEMUTimer *itr_timer;
+    int64_t rx_abs_deadline;    /* RADV expiry, -1 when not running */
+    int64_t tx_abs_deadline;    /* TADV expiry, -1 when not running */
+    int64_t itr_next;           /* earliest time for the next interrupt */
+    int irq_level;
 } E1000State;
 
+#define E1000_DELAY_UNIT_NS 1024 /* RDTR, RADV, TIDV, TADV */
+#define E1000_ITR_UNIT_NS   256
+
 #define	defreg(x)	x = (E1000_##x>>2)
 enum {
     defreg(CTRL),	defreg(EECD),	defreg(EERD),	defreg(GPRC),
@@ -141,7 +173,8 @@ enum {
     defreg(TORH),	defreg(TORL),	defreg(TOTH),	defreg(TOTL),
     defreg(TPR),	defreg(TPT),	defreg(TXDCTL),	defreg(WUFC),
     defreg(RA),		defreg(MTA),	defreg(CRCERRS),defreg(VFTA),
-    defreg(VET),
+    defreg(VET),	defreg(ITR),	defreg(RDTR),	defreg(RADV),
+    defreg(TIDV),	defreg(TADV),
 };
 
 static void
@@ -220,6 +253,32 @@ static const uint32_t mac_reg_init[] = {
                 E1000_MANC_RMCP_EN,
 };
 
+static void
+e1000_update_irq(E1000State *s)
+{
+    int level = (s->mac_reg[IMS] & s->mac_reg[ICR]) != 0;
+    uint32_t itr = s->mac_reg[ITR] & 0xffff;
+    int64_t now;
+
+    /* ITR is the minimum interval between two interrupt assertions */
+    if (level && !s->irq_level && itr) {
+        now = qemu_get_clock_ns(vm_clock);
+        if (now < s->itr_next) {
+            qemu_mod_timer(s->itr_timer, s->itr_next);
+            return;
+        }
+        s->itr_next = now + (int64_t)itr * E1000_ITR_UNIT_NS;
+    }
+    s->irq_level = level;
+    qemu_set_irq(s->dev.irq[0], level);
+}
+
+static void
+e1000_itr_timer(void *opaque)
+{
+    e1000_update_irq(opaque);
+}
+
 static void
 set_interrupt_cause(E1000State *s, int index, uint32_t val)
 {
@@ -229,7 +288,7 @@ set_interrupt_cause(E1000State *s, int index, uint32_t val)
     }
     s->mac_reg[ICR] = val;
     s->mac_reg[ICS] = val;
-    qemu_set_irq(s->dev.irq[0], (s->mac_reg[IMS] & s->mac_reg[ICR]) != 0);
+    e1000_update_irq(s);
 }
 
 static void
@@ -240,6 +299,59 @@ set_ics(E1000State *s, int index, uint32_t val)
     set_interrupt_cause(s, 0, val | s->mac_reg[ICR]);
 }
 
+/*
+ * Postpone an interrupt cause: the packet timer (delay) restarts with
+ * every event, the absolute timer (abs_delay) runs from the first event
+ * that has not been signalled yet.  Whichever expires first fires.
+ */
+static void
+e1000_arm_delay(QEMUTimer *timer, int64_t *abs_deadline,
+                uint32_t delay, uint32_t abs_delay)
+{
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    int64_t deadline = now + (int64_t)delay * E1000_DELAY_UNIT_NS;
+
+    if (abs_delay) {
+        if (*abs_deadline < 0) {
+            *abs_deadline = now + (int64_t)abs_delay * E1000_DELAY_UNIT_NS;
+        }
+        deadline = MIN(deadline, *abs_deadline);
+    }
+    qemu_mod_timer(timer, deadline);
+}
+
+static void
+e1000_rx_delay_timer(void *opaque)
+{
+    E1000State *s = opaque;
+
+    s->rx_abs_deadline = -1;
+    set_ics(s, 0, E1000_ICS_RXT0);
+}
+
+static void
+e1000_tx_delay_timer(void *opaque)
+{
+    E1000State *s = opaque;
+
+    s->tx_abs_deadline = -1;
+    set_ics(s, 0, E1000_ICS_TXDW);
+}
+
+/* Signal whatever the delay timers hold back right away */
+static void
+e1000_flush_delayed_irqs(E1000State *s)
+{
+    if (qemu_timer_pending(s->rx_delay_timer)) {
+        qemu_del_timer(s->rx_delay_timer);
+        e1000_rx_delay_timer(s);
+    }
+    if (qemu_timer_pending(s->tx_delay_timer)) {
+        qemu_del_timer(s->tx_delay_timer);
+        e1000_tx_delay_timer(s);
+    }
+}
+
 static int
 rxbufsize(uint32_t v)
 {
@@ -268,12 +380,20 @@ static void e1000_reset(void *opaque)
     E1000State *d = opaque;
 
     qemu_del_timer(d->autoneg_timer);
+    qemu_del_timer(d->rx_delay_timer);
+    qemu_del_timer(d->tx_delay_timer);
+    qemu_del_timer(d->itr_timer);
+    d->rx_abs_deadline = -1;
+    d->tx_abs_deadline = -1;
+    d->itr_next = 0;
+    d->irq_level = 0;
     memset(d->phy_reg, 0, sizeof d->phy_reg);
     memmove(d->phy_reg, phy_reg_init, sizeof phy_reg_init);
     memset(d->mac_reg, 0, sizeof d->mac_reg);
     memmove(d->mac_reg, mac_reg_init, sizeof mac_reg_init);
     d->rxbuf_min_shift = 1;
     memset(&d->tx, 0, sizeof d->tx);
+    d->rx_desc_cache_count = 0;
 
     if (d->nic->nc.link_down) {
         e1000_link_down(d);
@@ -443,23 +563,152 @@ fcs_len(E1000State *s)
 }
 
 static void
-e1000_send_packet(E1000State *s, const uint8_t *buf, int size)
+e1000_flush_tx_batch(E1000State *s)
+{
+    struct e1000_tx_batch *b = &s->tx_batch;
+
+    if (b->count) {
+        qemu_sendv_batch_async(&s->nic->nc, b->pkts, b->count, NULL);
+        b->count = 0;
+        b->used = 0;
+    }
+}
+
+static inline int
+e1000_loopback(E1000State *s)
+{
+    return (s->phy_reg[PHY_CTRL] & MII_CR_LOOPBACK) != 0;
+}
+
+static ssize_t e1000_receive_frame(E1000State *s, const uint8_t *buf,
+                                   size_t size);
+
+/* hdr is only passed on to peers that use vnet headers */
+static void
+e1000_send_packet(E1000State *s, const struct virtio_net_hdr *hdr,
+                  const uint8_t *buf, int size)
+{
+    struct e1000_tx_batch *b = &s->tx_batch;
+    NetClientState *peer = s->nic->nc.peer;
+    int hdr_len = s->has_vnet_hdr ? sizeof(*hdr) : 0;
+    struct iovec iov[2];
+
+    if (e1000_loopback(s)) {
+        e1000_flush_tx_batch(s);
+        e1000_receive_frame(s, buf, size);
+        return;
+    }
+
+    /* Copying only pays off if the backend can send the batch at once */
+    if (!peer || !peer->info->receive_batch ||
+        hdr_len + size > sizeof(b->data)) {
+        e1000_flush_tx_batch(s);
+        iov[0].iov_base = (void *)hdr;
+        iov[0].iov_len = hdr_len;
+        iov[1].iov_base = (void *)buf;
+        iov[1].iov_len = size;
+        qemu_sendv_packet(&s->nic->nc, hdr_len ? iov : iov + 1,
+                          hdr_len ? 2 : 1);
+        return;
+    }
+
+    if (b->count == E1000_TX_BATCH ||
+        b->used + hdr_len + size > sizeof(b->data)) {
+        e1000_flush_tx_batch(s);
+    }
+    memcpy(b->data + b->used, hdr, hdr_len);
+    memcpy(b->data + b->used + hdr_len, buf, size);
+    b->iov[b->count].iov_base = b->data + b->used;
+    b->iov[b->count].iov_len = hdr_len + size;
+    b->pkts[b->count].iov = &b->iov[b->count];
+    b->pkts[b->count].iovcnt = 1;
+    b->used += hdr_len + size;
+    b->count++;
+}
+
+/* Add the L4 length to the pseudo header sum the driver left in the frame */
+static void
+e1000_add_pseudo_len(struct e1000_tx *tp, unsigned int len)
+{
+    uint16_t *sp = (uint16_t *)(tp->data + tp->tucso);
+    unsigned int phsum;
+
+    phsum = be16_to_cpup(sp) + len;
+    phsum = (phsum >> 16) + (phsum & 0xffff);
+    cpu_to_be16wu(sp, phsum);
+}
+
+/*
+ * Can the peer finish the TCP/UDP checksum of the current frame?  virtio
+ * checksums always extend to the end of the frame.
+ */
+static int
+e1000_csum_offload(E1000State *s)
+{
+    struct e1000_tx *tp = &s->tx;
+
+    return s->has_vnet_hdr && !e1000_loopback(s) &&
+           tp->tucso > tp->tucss &&
+           (!tp->tucse || tp->tucse >= tp->size - 1);
+}
+
+/* Can the current TSO context go to the peer as one frame? */
+static int
+e1000_gso_offload(E1000State *s)
+{
+    struct e1000_tx *tp = &s->tx;
+
+    return s->has_vnet_hdr && !e1000_loopback(s) &&
+           tp->tse && tp->mss &&
+           (tp->sum_needed & E1000_TXD_POPTS_TXSM) &&
+           (tp->tcp || s->has_ufo) &&
+           tp->hdr_len + tp->paylen <= sizeof(tp->data);
+}
+
+/* Fix up the headers of a whole TSO frame and describe it in hdr */
+static void
+xmit_gso_prepare(E1000State *s, struct virtio_net_hdr *hdr)
 {
-    if (s->phy_reg[PHY_CTRL] & MII_CR_LOOPBACK) {
-        s->nic->nc.info->receive(&s->nic->nc, buf, size);
+    struct e1000_tx *tp = &s->tx;
+    unsigned int css = tp->ipcss, len;
+
+    if (tp->ip) {
+        cpu_to_be16wu((uint16_t *)(tp->data + css + 2), tp->size - css);
+    } else {
+        cpu_to_be16wu((uint16_t *)(tp->data + css + 4), tp->size - css - 40);
+    }
+
+    len = tp->size - tp->tucss;
+    if (tp->tcp) {
+        hdr->gso_type = tp->ip ? VIRTIO_NET_HDR_GSO_TCPV4 :
+                                 VIRTIO_NET_HDR_GSO_TCPV6;
+        if (tp->data[tp->tucss + 13] & 0x80) {      // CWR
+            hdr->gso_type |= VIRTIO_NET_HDR_GSO_ECN;
+        }
     } else {
-        qemu_send_packet(&s->nic->nc, buf, size);
+        cpu_to_be16wu((uint16_t *)(tp->data + tp->tucss + 4), len);
+        hdr->gso_type = VIRTIO_NET_HDR_GSO_UDP;
     }
+    e1000_add_pseudo_len(tp, len);
+
+    hdr->gso_size = tp->mss;
+    hdr->hdr_len = tp->hdr_len;
+    tp->tso_frames = (tp->size - tp->hdr_len + tp->mss - 1) / tp->mss;
 }
 
 static void
 xmit_seg(E1000State *s)
 {
-    uint16_t len, *sp;
-    unsigned int frames = s->tx.tso_frames, css, sofar, n;
+    uint16_t len;
+    unsigned int frames = s->tx.tso_frames, css, sofar, n, nframes = 1;
     struct e1000_tx *tp = &s->tx;
+    struct virtio_net_hdr hdr;
 
-    if (tp->tse && tp->cptse) {
+    memset(&hdr, 0, sizeof(hdr));
+    if (tp->tse && tp->cptse && tp->gso) {
+        xmit_gso_prepare(s, &hdr);
+        nframes = MAX(tp->tso_frames, 1);
+    } else if (tp->tse && tp->cptse) {
         css = tp->ipcss;
         DBGOUT(TXSUM, "frames %d size %d ipcss %d\n",
                frames, tp->size, css);
@@ -483,29 +732,39 @@ xmit_seg(E1000State *s)
         } else	// UDP
             cpu_to_be16wu((uint16_t *)(tp->data+css+4), len);
         if (tp->sum_needed & E1000_TXD_POPTS_TXSM) {
-            unsigned int phsum;
             // add pseudo-header length before checksum calculation
-            sp = (uint16_t *)(tp->data + tp->tucso);
-            phsum = be16_to_cpup(sp) + len;
-            phsum = (phsum >> 16) + (phsum & 0xffff);
-            cpu_to_be16wu(sp, phsum);
+            e1000_add_pseudo_len(tp, len);
         }
         tp->tso_frames++;
     }
 
-    if (tp->sum_needed & E1000_TXD_POPTS_TXSM)
-        putsum(tp->data, tp->size, tp->tucso, tp->tucss, tp->tucse);
+    if (tp->sum_needed & E1000_TXD_POPTS_TXSM) {
+        if (hdr.gso_type || e1000_csum_offload(s)) {
+            hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+            hdr.csum_start = tp->tucss;
+            hdr.csum_offset = tp->tucso - tp->tucss;
+        } else {
+            putsum(tp->data, tp->size, tp->tucso, tp->tucss, tp->tucse);
+        }
+    }
     if (tp->sum_needed & E1000_TXD_POPTS_IXSM)
         putsum(tp->data, tp->size, tp->ipcso, tp->ipcss, tp->ipcse);
     if (tp->vlan_needed) {
         memmove(tp->vlan, tp->data, 4);
         memmove(tp->data, tp->data + 4, 8);
         memcpy(tp->data + 8, tp->vlan_header, 4);
-        e1000_send_packet(s, tp->vlan, tp->size + 4);
+        /* the tag moves everything behind the MAC addresses */
+        if (hdr.flags) {
+            hdr.csum_start += 4;
+        }
+        if (hdr.gso_type) {
+            hdr.hdr_len += 4;
+        }
+        e1000_send_packet(s, &hdr, tp->vlan, tp->size + 4);
     } else
-        e1000_send_packet(s, tp->data, tp->size);
-    s->mac_reg[TPT]++;
-    s->mac_reg[GPTC]++;
+        e1000_send_packet(s, &hdr, tp->data, tp->size);
+    s->mac_reg[TPT] += nframes;
+    s->mac_reg[GPTC] += nframes;
     n = s->mac_reg[TOTL];
     if ((s->mac_reg[TOTL] += s->tx.size) < n)
         s->mac_reg[TOTH]++;
@@ -546,6 +805,7 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
         // data descriptor
         if (tp->size == 0) {
             tp->sum_needed = le32_to_cpu(dp->upper.data) >> 8;
+            tp->gso = e1000_gso_offload(s);
         }
         tp->cptse = ( txd_lower & E1000_TXD_CMD_TSE ) ? 1 : 0;
     } else {
@@ -565,7 +825,8 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     addr = le64_to_cpu(dp->buffer_addr);
     if (tp->tse && tp->cptse) {
         hdr = tp->hdr_len;
-        msh = hdr + tp->mss;
+        /* with GSO the peer gets the whole frame and segments it */
+        msh = tp->gso ? sizeof(tp->data) : hdr + tp->mss;
         do {
             bytes = split_size;
             if (tp->size + bytes > msh)
@@ -577,7 +838,7 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
                 memmove(tp->header, tp->data, hdr);
             tp->size = sz;
             addr += bytes;
-            if (sz == msh) {
+            if (sz == msh && !tp->gso) {
                 xmit_seg(s);
                 memmove(tp->data, tp->header, hdr);
                 tp->size = hdr;
@@ -601,10 +862,12 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     tp->vlan_needed = 0;
     tp->size = 0;
     tp->cptse = 0;
+    tp->gso = 0;
 }
 
+/* Update the status of *dp, the caller writes it back to the ring */
 static uint32_t
-txdesc_writeback(E1000State *s, dma_addr_t base, struct e1000_tx_desc *dp)
+txdesc_writeback(E1000State *s, struct e1000_tx_desc *dp)
 {
     uint32_t txd_upper, txd_lower = le32_to_cpu(dp->lower.data);
 
@@ -613,8 +876,6 @@ txdesc_writeback(E1000State *s, dma_addr_t base, struct e1000_tx_desc *dp)
     txd_upper = (le32_to_cpu(dp->upper.data) | E1000_TXD_STAT_DD) &
                 ~(E1000_TXD_STAT_EC | E1000_TXD_STAT_LC | E1000_TXD_STAT_TU);
     dp->upper.data = cpu_to_le32(txd_upper);
-    pci_dma_write(&s->dev, base + ((char *)&dp->upper - (char *)dp),
-                  &dp->upper, sizeof(dp->upper));
     return E1000_ICR_TXDW;
 }
 
@@ -630,39 +891,73 @@ static void
 start_xmit(E1000State *s)
 {
     dma_addr_t base;
-    struct e1000_tx_desc desc;
-    uint32_t tdh_start = s->mac_reg[TDH], cause = E1000_ICS_TXQE;
+    struct e1000_tx_desc descs[E1000_DESC_BATCH], *dp;
+    uint32_t tdh_start = s->mac_reg[TDH], cause = E1000_ICS_TXQE, wb;
+    uint32_t head, ndesc;
+    int delayed = 0, wrapped = 0, count, i, dirty;
 
     if (!(s->mac_reg[TCTL] & E1000_TCTL_EN)) {
         DBGOUT(TX, "tx disabled\n");
         return;
     }
 
-    while (s->mac_reg[TDH] != s->mac_reg[TDT]) {
-        base = tx_desc_base(s) +
-               sizeof(struct e1000_tx_desc) * s->mac_reg[TDH];
-        pci_dma_read(&s->dev, base, &desc, sizeof(desc));
-
-        DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
-               (void *)(intptr_t)desc.buffer_addr, desc.lower.data,
-               desc.upper.data);
-
-        process_tx_desc(s, &desc);
-        cause |= txdesc_writeback(s, base, &desc);
-
-        if (++s->mac_reg[TDH] * sizeof(desc) >= s->mac_reg[TDLEN])
-            s->mac_reg[TDH] = 0;
-        /*
-         * the following could happen only if guest sw assigns
-         * bogus values to TDT/TDLEN.
-         * there's nothing too intelligent we could do about this.
-         */
-        if (s->mac_reg[TDH] == tdh_start) {
-            DBGOUT(TXERR, "TDH wraparound @%x, TDT %x, TDLEN %x\n",
-                   tdh_start, s->mac_reg[TDT], s->mac_reg[TDLEN]);
-            break;
+    while (!wrapped && s->mac_reg[TDH] != s->mac_reg[TDT]) {
+        /* Fetch the run of descriptors up to TDT or the end of the ring */
+        head = s->mac_reg[TDH];
+        ndesc = s->mac_reg[TDLEN] / sizeof(descs[0]);
+        if (head < s->mac_reg[TDT]) {
+            count = s->mac_reg[TDT] - head;
+        } else {
+            count = head < ndesc ? ndesc - head : 1;
+        }
+        count = MIN(count, E1000_DESC_BATCH);
+        base = tx_desc_base(s) + sizeof(descs[0]) * head;
+        pci_dma_read(&s->dev, base, descs, count * sizeof(descs[0]));
+
+        dirty = 0;
+        for (i = 0; i < count && !wrapped; i++) {
+            dp = &descs[i];
+            DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
+                   (void *)(intptr_t)dp->buffer_addr, dp->lower.data,
+                   dp->upper.data);
+
+            process_tx_desc(s, dp);
+            wb = txdesc_writeback(s, dp);
+            if (wb) {
+                dirty = i + 1;
+            }
+            /* IDE lets TIDV/TADV hold back the write-back interrupt */
+            if (wb && (le32_to_cpu(dp->lower.data) & E1000_TXD_CMD_IDE) &&
+                (s->mac_reg[TIDV] & 0xffff)) {
+                delayed = 1;
+            } else {
+                cause |= wb;
+            }
+
+            if (++s->mac_reg[TDH] * sizeof(*dp) >= s->mac_reg[TDLEN])
+                s->mac_reg[TDH] = 0;
+            /*
+             * the following could happen only if guest sw assigns
+             * bogus values to TDT/TDLEN.
+             * there's nothing too intelligent we could do about this.
+             */
+            if (s->mac_reg[TDH] == tdh_start) {
+                DBGOUT(TXERR, "TDH wraparound @%x, TDT %x, TDLEN %x\n",
+                       tdh_start, s->mac_reg[TDT], s->mac_reg[TDLEN]);
+                wrapped = 1;
+            }
+        }
+
+        /* One write-back for the batch, up to the last descriptor with RS */
+        if (dirty) {
+            pci_dma_write(&s->dev, base, descs, dirty * sizeof(descs[0]));
         }
     }
+    e1000_flush_tx_batch(s);
+    if (delayed) {
+        e1000_arm_delay(s->tx_delay_timer, &s->tx_abs_deadline,
+                        s->mac_reg[TIDV] & 0xffff, s->mac_reg[TADV] & 0xffff);
+    }
     set_ics(s, 0, cause);
 }
 
@@ -758,6 +1053,8 @@ e1000_can_receive(NetClientState *nc)
 {
     E1000State *s = DO_UPCAST(NICState, nc, nc)->opaque;
 
+    /* RCTL and RDT writes may still sit in the coalesced MMIO ring */
+    qemu_flush_coalesced_mmio_buffer();
     return (s->mac_reg[RCTL] & E1000_RCTL_EN) && e1000_has_rxbufs(s, 1);
 }
 
@@ -769,14 +1066,43 @@ static uint64_t rx_desc_base(E1000State *s)
     return (bah << 32) + bal;
 }
 
+/*
+ * Return the descriptor at RDH.  Descriptors between RDH and RDT belong to
+ * the device, so they are read ahead in batches and consumed from the
+ * front of rx_desc_cache.
+ */
+static void
+e1000_rx_desc_fetch(E1000State *s, struct e1000_rx_desc *desc)
+{
+    uint32_t rdh = s->mac_reg[RDH];
+    uint32_t ndesc = s->mac_reg[RDLEN] / sizeof(*desc);
+    uint32_t count;
+
+    if (!s->rx_desc_cache_count || s->rx_desc_cache_head != rdh) {
+        if (rdh < s->mac_reg[RDT]) {
+            count = s->mac_reg[RDT] - rdh;
+        } else {
+            count = rdh < ndesc ? ndesc - rdh : 1;
+        }
+        count = MIN(count, E1000_DESC_BATCH);
+        pci_dma_read(&s->dev, rx_desc_base(s) + sizeof(*desc) * rdh,
+                     s->rx_desc_cache, count * sizeof(*desc));
+        s->rx_desc_cache_head = rdh;
+        s->rx_desc_cache_count = count;
+    }
+
+    *desc = s->rx_desc_cache[0];
+    memmove(&s->rx_desc_cache[0], &s->rx_desc_cache[1],
+            --s->rx_desc_cache_count * sizeof(*desc));
+    s->rx_desc_cache_head++;
+}
+
 static ssize_t
-e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+e1000_receive_frame(E1000State *s, const uint8_t *buf, size_t size)
 {
-    E1000State *s = DO_UPCAST(NICState, nc, nc)->opaque;
-    struct e1000_rx_desc desc;
-    dma_addr_t base;
-    unsigned int n, rdt;
-    uint32_t rdh_start;
+    struct e1000_rx_desc desc, done[E1000_DESC_BATCH];
+    unsigned int n, rdt, ndone = 0;
+    uint32_t rdh_start, done_start = 0;
     uint16_t vlan_special = 0;
     uint8_t vlan_status = 0, vlan_offset = 0;
     uint8_t min_buf[MIN_BUF_SIZE];
@@ -784,6 +1110,8 @@ e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
     size_t desc_size;
     size_t total_size;
 
+    qemu_flush_coalesced_mmio_buffer();
+
     if (!(s->mac_reg[RCTL] & E1000_RCTL_EN))
         return -1;
 
@@ -818,8 +1146,7 @@ e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
         if (desc_size > s->rxbuf_size) {
             desc_size = s->rxbuf_size;
         }
-        base = rx_desc_base(s) + sizeof(desc) * s->mac_reg[RDH];
-        pci_dma_read(&s->dev, base, &desc, sizeof(desc));
+        e1000_rx_desc_fetch(s, &desc);
         desc.special = vlan_special;
         desc.status |= (vlan_status | E1000_RXD_STAT_DD);
         if (desc.buffer_addr) {
@@ -843,11 +1170,22 @@ e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
         } else { // as per intel docs; skip descriptors with null buf addr
             DBGOUT(RX, "Null RX descriptor!!\n");
         }
-        pci_dma_write(&s->dev, base, &desc, sizeof(desc));
+
+        /* Completed descriptors are written back in contiguous runs */
+        if (!ndone) {
+            done_start = s->mac_reg[RDH];
+        }
+        done[ndone++] = desc;
 
         if (++s->mac_reg[RDH] * sizeof(desc) >= s->mac_reg[RDLEN])
             s->mac_reg[RDH] = 0;
         s->check_rxov = 1;
+        if (ndone == E1000_DESC_BATCH || s->mac_reg[RDH] == 0 ||
+            s->mac_reg[RDH] == rdh_start || desc_offset >= total_size) {
+            pci_dma_write(&s->dev, rx_desc_base(s) + sizeof(desc) * done_start,
+                          done, ndone * sizeof(desc));
+            ndone = 0;
+        }
         /* see comment in start_xmit; same here */
         if (s->mac_reg[RDH] == rdh_start) {
             DBGOUT(RXERR, "RDH wraparound @%x, RDT %x, RDLEN %x\n",
@@ -868,14 +1206,23 @@ e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
         s->mac_reg[TORH]++;
     s->mac_reg[TORL] = n;
 
-    n = E1000_ICS_RXT0;
+    n = 0;
+    if (s->mac_reg[RDTR] & E1000_RDT_DELAY) {
+        e1000_arm_delay(s->rx_delay_timer, &s->rx_abs_deadline,
+                        s->mac_reg[RDTR] & E1000_RDT_DELAY,
+                        s->mac_reg[RADV] & 0xffff);
+    } else {
+        n |= E1000_ICS_RXT0;
+    }
     if ((rdt = s->mac_reg[RDT]) < s->mac_reg[RDH])
         rdt += s->mac_reg[RDLEN] / sizeof(desc);
     if (((rdt - s->mac_reg[RDH]) * sizeof(desc)) <= s->mac_reg[RDLEN] >>
         s->rxbuf_min_shift)
         n |= E1000_ICS_RXDMT0;
 
-    set_ics(s, 0, n);
+    if (n) {
+        set_ics(s, 0, n);
+    }
 
     return size;
 }
@@ -940,6 +1287,20 @@ set_dlen(E1000State *s, int index, uint32_t val)
     s->mac_reg[index] = val & 0xfff80;
 }
 
+static void
+set_rx_ring(E1000State *s, int index, uint32_t val)
+{
+    if (index == RDLEN) {
+        set_dlen(s, index, val);
+    } else if (index == RDH) {
+        set_16bit(s, index, val);
+    } else {
+        mac_writereg(s, index, val);
+    }
+    /* prefetched descriptors belong to the old ring position */
+    s->rx_desc_cache_count = 0;
+}
+
 static void
 set_tctl(E1000State *s, int index, uint32_t val)
 {
@@ -948,6 +1309,16 @@ set_tctl(E1000State *s, int index, uint32_t val)
     start_xmit(s);
 }
 
+static void
+set_rdtr(E1000State *s, int index, uint32_t val)
+{
+    s->mac_reg[index] = val & E1000_RDT_DELAY;
+    if ((val & E1000_RDT_FPDB) && qemu_timer_pending(s->rx_delay_timer)) {
+        qemu_del_timer(s->rx_delay_timer);
+        e1000_rx_delay_timer(s);
+    }
+}
+
 static void
 set_icr(E1000State *s, int index, uint32_t val)
 {
@@ -977,7 +1348,8 @@ static uint32_t (*macreg_readops[])(E1000State *, int) = {
     getreg(TORL),	getreg(TOTL),	getreg(IMS),	getreg(TCTL),
     getreg(RDH),	getreg(RDT),	getreg(VET),	getreg(ICS),
     getreg(TDBAL),	getreg(TDBAH),	getreg(RDBAH),	getreg(RDBAL),
-    getreg(TDLEN),	getreg(RDLEN),
+    getreg(TDLEN),	getreg(RDLEN),	getreg(ITR),	getreg(RDTR),
+    getreg(RADV),	getreg(TIDV),	getreg(TADV),
 
     [TOTH] = mac_read_clr8,	[TORH] = mac_read_clr8,	[GPRC] = mac_read_clr4,
     [GPTC] = mac_read_clr4,	[TPR] = mac_read_clr4,	[TPT] = mac_read_clr4,
@@ -992,13 +1364,16 @@ enum { NREADOPS = ARRAY_SIZE(macreg_readops) };
 #define putreg(x)	[x] = mac_writereg
 static void (*macreg_writeops[])(E1000State *, int, uint32_t) = {
     putreg(PBA),	putreg(EERD),	putreg(SWSM),	putreg(WUFC),
-    putreg(TDBAL),	putreg(TDBAH),	putreg(TXDCTL),	putreg(RDBAH),
-    putreg(RDBAL),	putreg(LEDCTL), putreg(VET),
-    [TDLEN] = set_dlen,	[RDLEN] = set_dlen,	[TCTL] = set_tctl,
+    putreg(TDBAL),	putreg(TDBAH),	putreg(TXDCTL),	putreg(LEDCTL),
+    putreg(VET),
+    [RDBAH] = set_rx_ring, [RDBAL] = set_rx_ring, [RDLEN] = set_rx_ring,
+    [TDLEN] = set_dlen,	[TCTL] = set_tctl,
     [TDT] = set_tctl,	[MDIC] = set_mdic,	[ICS] = set_ics,
-    [TDH] = set_16bit,	[RDH] = set_16bit,	[RDT] = set_rdt,
+    [TDH] = set_16bit,	[RDH] = set_rx_ring,	[RDT] = set_rdt,
     [IMC] = set_imc,	[IMS] = set_ims,	[ICR] = set_icr,
     [EECD] = set_eecd,	[RCTL] = set_rx_control, [CTRL] = set_ctrl,
+    [ITR] = set_16bit,	[RDTR] = set_rdtr,	[RADV] = set_16bit,
+    [TIDV] = set_16bit,	[TADV] = set_16bit,
     [RA ... RA+31] = &mac_writereg,
     [MTA ... MTA+127] = &mac_writereg,
     [VFTA ... VFTA+127] = &mac_writereg,
@@ -1075,11 +1450,59 @@ static bool is_version_1(void *opaque, int version_id)
     return version_id == 1;
 }
 
+static void e1000_pre_save(void *opaque)
+{
+    E1000State *s = opaque;
+
+    /* The moderation timers are not migrated, deliver what they hold */
+    e1000_flush_delayed_irqs(s);
+    if (qemu_timer_pending(s->itr_timer)) {
+        qemu_del_timer(s->itr_timer);
+        s->itr_next = 0;
+        e1000_update_irq(s);
+    }
+}
+
+static int e1000_post_load(void *opaque, int version_id)
+{
+    E1000State *s = opaque;
+
+    s->irq_level = (s->mac_reg[IMS] & s->mac_reg[ICR]) != 0;
+    /* the ring in guest memory is authoritative, refetch from RDH */
+    s->rx_desc_cache_count = 0;
+    return 0;
+}
+
+static bool e1000_mit_state_needed(void *opaque)
+{
+    E1000State *s = opaque;
+
+    return s->mac_reg[ITR] || s->mac_reg[RDTR] || s->mac_reg[RADV] ||
+           s->mac_reg[TIDV] || s->mac_reg[TADV];
+}
+
+static const VMStateDescription vmstate_e1000_mit_state = {
+    .name = "e1000/mit_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField []) {
+        VMSTATE_UINT32(mac_reg[ITR], E1000State),
+        VMSTATE_UINT32(mac_reg[RDTR], E1000State),
+        VMSTATE_UINT32(mac_reg[RADV], E1000State),
+        VMSTATE_UINT32(mac_reg[TIDV], E1000State),
+        VMSTATE_UINT32(mac_reg[TADV], E1000State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_e1000 = {
     .name = "e1000",
     .version_id = 2,
     .minimum_version_id = 1,
     .minimum_version_id_old = 1,
+    .pre_save = e1000_pre_save,
+    .post_load = e1000_post_load,
     .fields      = (VMStateField []) {
         VMSTATE_PCI_DEVICE(dev, E1000State),
         VMSTATE_UNUSED_TEST(is_version_1, 4), /* was instance id */
@@ -1150,6 +1573,14 @@ static const VMStateDescription vmstate_e1000 = {
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, MTA, 128),
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, VFTA, 128),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection []) {
+        {
+            .vmsd = &vmstate_e1000_mit_state,
+            .needed = e1000_mit_state_needed,
+        }, {
+            /* empty */
+        }
     }
 };
 
@@ -1199,11 +1630,35 @@ pci_e1000_uninit(PCIDevice *dev)
 
     qemu_del_timer(d->autoneg_timer);
     qemu_free_timer(d->autoneg_timer);
+    qemu_del_timer(d->rx_delay_timer);
+    qemu_free_timer(d->rx_delay_timer);
+    qemu_del_timer(d->tx_delay_timer);
+    qemu_free_timer(d->tx_delay_timer);
+    qemu_del_timer(d->itr_timer);
+    qemu_free_timer(d->itr_timer);
     memory_region_destroy(&d->mmio);
     memory_region_destroy(&d->io);
     qemu_del_net_client(&d->nic->nc);
 }
 
+static ssize_t
+e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    E1000State *s = DO_UPCAST(NICState, nc, nc)->opaque;
+    size_t hdr_len = s->has_vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
+    ssize_t ret;
+
+    /*
+     * Receive offloads stay disabled on the peer: the header is all zeros,
+     * and frames never exceed what the guest buffers take.
+     */
+    if (size < hdr_len) {
+        return size;
+    }
+    ret = e1000_receive_frame(s, buf + hdr_len, size - hdr_len);
+    return ret <= 0 ? ret : size;
+}
+
 static NetClientInfo net_e1000_info = {
     .type = NET_CLIENT_OPTIONS_KIND_NIC,
     .size = sizeof(NICState),
@@ -1250,9 +1705,21 @@ static int pci_e1000_init(PCIDevice *pci_dev)
 
     qemu_format_nic_info_str(&d->nic->nc, macaddr);
 
+    if (qemu_has_vnet_hdr(d->nic->nc.peer)) {
+        d->has_vnet_hdr = true;
+        d->has_ufo = qemu_has_ufo(d->nic->nc.peer);
+        qemu_using_vnet_hdr(d->nic->nc.peer, 1);
+        qemu_set_offload(d->nic->nc.peer, 0, 0, 0, 0, 0);
+    }
+
     add_boot_device_path(d->conf.bootindex, &pci_dev->qdev, "/ethernet-phy@0");
 
     d->autoneg_timer = qemu_new_timer_ms(vm_clock, e1000_autoneg_timer, d);
+    d->rx_delay_timer = qemu_new_timer_ns(vm_clock, e1000_rx_delay_timer, d);
+    d->tx_delay_timer = qemu_new_timer_ns(vm_clock, e1000_tx_delay_timer, d);
+    d->itr_timer = qemu_new_timer_ns(vm_clock, e1000_itr_timer, d);
+    d->rx_abs_deadline = -1;
+    d->tx_abs_deadline = -1;
 
     return 0;
 }
@@ -730,6 +730,8 @@ struct e1000_tx_desc {
 #define E1000_TXD_CMD_DEXT   0x20000000 /* Descriptor extension (0 = legacy) */
 #define E1000_TXD_CMD_VLE    0x40000000 /* Add VLAN tag */
 #define E1000_TXD_CMD_IDE    0x80000000 /* Enable Tidv register */
+#define E1000_RDT_DELAY      0x0000ffff /* Delay timer (1=1024us) */
+#define E1000_RDT_FPDB       0x80000000 /* Flush descriptor block */
 #define E1000_TXD_STAT_DD    0x00000001 /* Descriptor Done */
 #define E1000_TXD_STAT_EC    0x00000002 /* Excess Collisions */
 #define E1000_TXD_STAT_LC    0x00000004 /* Late Collisions */
@@ -26,6 +26,15 @@ pflash_t *pflash_cfi02_register(target_phys_addr_t base,
 
 MemoryRegion *pflash_cfi01_get_memory(pflash_t *fl);
 
+/* pflash_writeback.c */
+typedef struct PFlashWriteback PFlashWriteback;
+
+PFlashWriteback *pflash_writeback_new(BlockDriverState *bs, void *storage,
+                                      uint64_t size);
+void pflash_writeback_mark(PFlashWriteback *wb, uint64_t offset,
+                           uint64_t size);
+void pflash_writeback_flush(PFlashWriteback *wb);
+
 /* nand.c */
 DeviceState *nand_init(BlockDriverState *bdrv, int manf_id, int chip_id);
 void nand_setpins(DeviceState *dev, uint8_t cle, uint8_t ale,
@@ -27,6 +27,7 @@
 #include "fw_cfg.h"
 #include "sysbus.h"
 #include "qemu-error.h"
+#include "dma.h"
 
 /* debug firmware config */
 //#define DEBUG_FW_CFG
@@ -40,22 +41,27 @@
 
 #define FW_CFG_SIZE 2
 #define FW_CFG_DATA_SIZE 1
+#define FW_CFG_DMA_SIZE 8
 
 typedef struct FWCfgEntry {
     uint32_t len;
     uint8_t *data;
     void *callback_opaque;
     FWCfgCallback callback;
+    void *load_opaque;
+    FWCfgLoadCallback load;
 } FWCfgEntry;
 
 struct FWCfgState {
     SysBusDevice busdev;
-    MemoryRegion ctl_iomem, data_iomem, comb_iomem;
-    uint32_t ctl_iobase, data_iobase;
+    MemoryRegion ctl_iomem, data_iomem, comb_iomem, dma_iomem;
+    uint32_t ctl_iobase, data_iobase, dma_iobase;
+    uint32_t dma_enabled;
     FWCfgEntry entries[2][FW_CFG_MAX_ENTRY];
     FWCfgFiles *files;
     uint16_t cur_entry;
     uint32_t cur_offset;
+    uint64_t dma_addr;
     Notifier machine_ready;
 };
 
@@ -200,6 +206,17 @@ static void fw_cfg_write(FWCfgState *s, uint8_t value)
     }
 }
 
+static void fw_cfg_load_entry(FWCfgState *s, uint16_t key)
+{
+    int arch = !!(key & FW_CFG_ARCH_LOCAL);
+    FWCfgEntry *e = &s->entries[arch][key & FW_CFG_ENTRY_MASK];
+
+    if (e->load) {
+        e->data = e->load(e->load_opaque);
+        e->load = NULL;
+    }
+}
+
 static int fw_cfg_select(FWCfgState *s, uint16_t key)
 {
     int ret;
@@ -209,6 +226,7 @@ static int fw_cfg_select(FWCfgState *s, uint16_t key)
         s->cur_entry = FW_CFG_INVALID;
         ret = 0;
     } else {
+        fw_cfg_load_entry(s, key);
         s->cur_entry = key;
         ret = 1;
     }
@@ -234,6 +252,98 @@ static uint8_t fw_cfg_read(FWCfgState *s)
     return ret;
 }
 
+static void fw_cfg_dma_transfer(FWCfgState *s)
+{
+    dma_addr_t dma_addr = s->dma_addr;
+    FWCfgDmaAccess dma;
+    FWCfgEntry *e;
+    uint32_t control, len, n;
+    uint64_t addr;
+    int arch;
+    bool read = false;
+
+    s->dma_addr = 0;
+    if (dma_memory_read(NULL, dma_addr, &dma, sizeof(dma))) {
+        stl_be_phys(dma_addr + offsetof(FWCfgDmaAccess, control),
+                    FW_CFG_DMA_CTL_ERROR);
+        return;
+    }
+    control = be32_to_cpu(dma.control);
+    len = be32_to_cpu(dma.length);
+    addr = be64_to_cpu(dma.address);
+
+    if (control & FW_CFG_DMA_CTL_SELECT) {
+        fw_cfg_select(s, control >> 16);
+    }
+    arch = !!(s->cur_entry & FW_CFG_ARCH_LOCAL);
+    e = &s->entries[arch][s->cur_entry & FW_CFG_ENTRY_MASK];
+
+    FW_CFG_DPRINTF("dma key %d control %x length %u to %" PRIx64 "\n",
+                   s->cur_entry, control, len, addr);
+
+    if (control & FW_CFG_DMA_CTL_READ) {
+        read = true;
+    } else if (!(control & FW_CFG_DMA_CTL_SKIP)) {
+        len = 0;
+    }
+
+    control = 0;
+    while (len > 0) {
+        if (s->cur_entry == FW_CFG_INVALID || !e->data ||
+            s->cur_offset >= e->len) {
+            /* like fw_cfg_read, past the end of the item reads as 0 */
+            n = len;
+            if (read && dma_memory_set(NULL, addr, 0, n)) {
+                control = FW_CFG_DMA_CTL_ERROR;
+            }
+        } else {
+            n = MIN(len, e->len - s->cur_offset);
+            if (read && dma_memory_write(NULL, addr, e->data + s->cur_offset,
+                                         n)) {
+                control = FW_CFG_DMA_CTL_ERROR;
+            }
+            s->cur_offset += n;
+        }
+        addr += n;
+        len -= n;
+    }
+
+    stl_be_phys(dma_addr + offsetof(FWCfgDmaAccess, control), control);
+}
+
+static uint64_t fw_cfg_dma_mem_read(void *opaque, target_phys_addr_t addr,
+                                    unsigned size)
+{
+    /* lets the guest probe for the DMA interface */
+    return FW_CFG_DMA_SIGNATURE >> ((FW_CFG_DMA_SIZE - addr - size) * 8);
+}
+
+static void fw_cfg_dma_mem_write(void *opaque, target_phys_addr_t addr,
+                                 uint64_t value, unsigned size)
+{
+    FWCfgState *s = opaque;
+
+    if (size == 4) {
+        if (addr == 0) {
+            /* high half, wait for the low half */
+            s->dma_addr = value << 32;
+        } else if (addr == 4) {
+            s->dma_addr |= value;
+            fw_cfg_dma_transfer(s);
+        }
+    } else if (size == 8 && addr == 0) {
+        s->dma_addr = value;
+        fw_cfg_dma_transfer(s);
+    }
+}
+
+static bool fw_cfg_dma_mem_valid(void *opaque, target_phys_addr_t addr,
+                                 unsigned size, bool is_write)
+{
+    return !is_write || ((size == 4 && (addr == 0 || addr == 4)) ||
+                         (size == 8 && addr == 0));
+}
+
 static uint64_t fw_cfg_data_mem_read(void *opaque, target_phys_addr_t addr,
                                      unsigned size)
 {
@@ -306,11 +416,27 @@ static const MemoryRegionOps fw_cfg_comb_mem_ops = {
     .valid.accepts = fw_cfg_comb_valid,
 };
 
+static const MemoryRegionOps fw_cfg_dma_mem_ops = {
+    .read = fw_cfg_dma_mem_read,
+    .write = fw_cfg_dma_mem_write,
+    .endianness = DEVICE_BIG_ENDIAN,
+    .valid = {
+        .min_access_size = 1,
+        .max_access_size = 8,
+        .accepts = fw_cfg_dma_mem_valid,
+    },
+    .impl = {
+        .min_access_size = 1,
+        .max_access_size = 8,
+    },
+};
+
 static void fw_cfg_reset(DeviceState *d)
 {
     FWCfgState *s = DO_UPCAST(FWCfgState, busdev.qdev, d);
 
     fw_cfg_select(s, 0);
+    s->dma_addr = 0;
 }
 
 /* Save restore 32 bit int as uint16_t
@@ -341,21 +467,60 @@ static const VMStateInfo vmstate_hack_uint32_as_uint16 = {
     VMSTATE_SINGLE_TEST(_f, _s, _t, 0, vmstate_hack_uint32_as_uint16, uint32_t)
 
 
+static int fw_cfg_post_load(void *opaque, int version_id)
+{
+    FWCfgState *s = opaque;
+
+    if (s->cur_entry != FW_CFG_INVALID &&
+        (s->cur_entry & FW_CFG_ENTRY_MASK) < FW_CFG_MAX_ENTRY) {
+        fw_cfg_load_entry(s, s->cur_entry);
+    }
+    return 0;
+}
+
 static bool is_version_1(void *opaque, int version_id)
 {
     return version_id == 1;
 }
 
+static bool fw_cfg_dma_addr_needed(void *opaque)
+{
+    FWCfgState *s = opaque;
+
+    /* only between the two halves of a 32-bit write */
+    return s->dma_addr != 0;
+}
+
+static const VMStateDescription vmstate_fw_cfg_dma = {
+    .name = "fw_cfg/dma",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField []) {
+        VMSTATE_UINT64(dma_addr, FWCfgState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_fw_cfg = {
     .name = "fw_cfg",
     .version_id = 2,
     .minimum_version_id = 1,
     .minimum_version_id_old = 1,
+    .post_load = fw_cfg_post_load,
     .fields      = (VMStateField []) {
         VMSTATE_UINT16(cur_entry, FWCfgState),
         VMSTATE_UINT16_HACK(cur_offset, FWCfgState, is_version_1),
         VMSTATE_UINT32_V(cur_offset, FWCfgState, 2),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection []) {
+        {
+            .vmsd = &vmstate_fw_cfg_dma,
+            .needed = fw_cfg_dma_addr_needed,
+        }, {
+            /* empty */
+        }
     }
 };
 
@@ -422,8 +587,9 @@ int fw_cfg_add_callback(FWCfgState *s, uint16_t key, FWCfgCallback callback,
     return 1;
 }
 
-int fw_cfg_add_file(FWCfgState *s,  const char *filename, uint8_t *data,
-                    uint32_t len)
+static int fw_cfg_add_file_common(FWCfgState *s, const char *filename,
+                                  uint8_t *data, FWCfgLoadCallback load,
+                                  void *load_opaque, uint32_t len)
 {
     int i, index;
 
@@ -440,6 +606,8 @@ int fw_cfg_add_file(FWCfgState *s,  const char *filename, uint8_t *data,
     }
 
     fw_cfg_add_bytes(s, FW_CFG_FILE_FIRST + index, data, len);
+    s->entries[0][FW_CFG_FILE_FIRST + index].load = load;
+    s->entries[0][FW_CFG_FILE_FIRST + index].load_opaque = load_opaque;
 
     pstrcpy(s->files->f[index].name, sizeof(s->files->f[index].name),
             filename);
@@ -460,6 +628,20 @@ int fw_cfg_add_file(FWCfgState *s,  const char *filename, uint8_t *data,
     return 1;
 }
 
+int fw_cfg_add_file(FWCfgState *s,  const char *filename, uint8_t *data,
+                    uint32_t len)
+{
+    return fw_cfg_add_file_common(s, filename, data, NULL, NULL, len);
+}
+
+/* Like fw_cfg_add_file, but the data is only produced if it is used */
+int fw_cfg_add_file_lazy(FWCfgState *s, const char *filename,
+                         FWCfgLoadCallback load, void *load_opaque,
+                         uint32_t len)
+{
+    return fw_cfg_add_file_common(s, filename, NULL, load, load_opaque, len);
+}
+
 static void fw_cfg_machine_ready(struct Notifier *n, void *data)
 {
     uint32_t len;
@@ -469,8 +651,10 @@ static void fw_cfg_machine_ready(struct Notifier *n, void *data)
     fw_cfg_add_file(s, "bootorder", (uint8_t*)bootindex, len);
 }
 
-FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
-                        target_phys_addr_t ctl_addr, target_phys_addr_t data_addr)
+static FWCfgState *fw_cfg_init_common(uint32_t ctl_port, uint32_t data_port,
+                                       uint32_t dma_port,
+                                       target_phys_addr_t ctl_addr,
+                                       target_phys_addr_t data_addr)
 {
     DeviceState *dev;
     SysBusDevice *d;
@@ -479,6 +663,7 @@ FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
     dev = qdev_create(NULL, "fw_cfg");
     qdev_prop_set_uint32(dev, "ctl_iobase", ctl_port);
     qdev_prop_set_uint32(dev, "data_iobase", data_port);
+    qdev_prop_set_uint32(dev, "dma_iobase", dma_port);
     qdev_init_nofail(dev);
     d = sysbus_from_qdev(dev);
 
@@ -504,6 +689,29 @@ FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
     return s;
 }
 
+FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
+                        target_phys_addr_t ctl_addr, target_phys_addr_t data_addr)
+{
+    return fw_cfg_init_common(ctl_port, data_port, 0, ctl_addr, data_addr);
+}
+
+/*
+ * Like fw_cfg_init with I/O ports only, plus the 8 byte DMA address
+ * register at dma_port.  Unless disabled with the dma_enabled property
+ * the board should set FW_CFG_VERSION_DMA in FW_CFG_ID, see
+ * fw_cfg_dma_enabled.
+ */
+FWCfgState *fw_cfg_init_dma(uint32_t ctl_port, uint32_t data_port,
+                            uint32_t dma_port)
+{
+    return fw_cfg_init_common(ctl_port, data_port, dma_port, 0, 0);
+}
+
+bool fw_cfg_dma_enabled(FWCfgState *s)
+{
+    return s->dma_enabled && s->dma_iobase;
+}
+
 static int fw_cfg_init1(SysBusDevice *dev)
 {
     FWCfgState *s = FROM_SYSBUS(FWCfgState, dev);
@@ -528,12 +736,19 @@ static int fw_cfg_init1(SysBusDevice *dev)
             sysbus_add_io(dev, s->data_iobase, &s->data_iomem);
         }
     }
+    if (fw_cfg_dma_enabled(s)) {
+        memory_region_init_io(&s->dma_iomem, &fw_cfg_dma_mem_ops, s,
+                              "fwcfg.dma", FW_CFG_DMA_SIZE);
+        sysbus_add_io(dev, s->dma_iobase, &s->dma_iomem);
+    }
     return 0;
 }
 
 static Property fw_cfg_properties[] = {
     DEFINE_PROP_HEX32("ctl_iobase", FWCfgState, ctl_iobase, -1),
     DEFINE_PROP_HEX32("data_iobase", FWCfgState, data_iobase, -1),
+    DEFINE_PROP_HEX32("dma_iobase", FWCfgState, dma_iobase, 0),
+    DEFINE_PROP_BIT("dma_enabled", FWCfgState, dma_enabled, 0, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
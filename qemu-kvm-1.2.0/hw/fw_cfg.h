@@ -38,6 +38,19 @@
 
 #define FW_CFG_INVALID          0xffff
 
+/* FW_CFG_ID bits */
+#define FW_CFG_VERSION          0x01
+#define FW_CFG_VERSION_DMA      0x02
+
+/* FWCfgDmaAccess control bits, the selector goes in the top 16 bits */
+#define FW_CFG_DMA_CTL_ERROR    0x01
+#define FW_CFG_DMA_CTL_READ     0x02
+#define FW_CFG_DMA_CTL_SKIP     0x04
+#define FW_CFG_DMA_CTL_SELECT   0x08
+
+/* read back from the DMA address register, "QEMU CFG" */
+#define FW_CFG_DMA_SIGNATURE    0x51454d5520434647ULL
+
 #ifndef NO_QEMU_PROTOS
 typedef struct FWCfgFile {
     uint32_t  size;        /* file size */
@@ -51,7 +64,21 @@ typedef struct FWCfgFiles {
     FWCfgFile f[];
 } FWCfgFiles;
 
+/*
+ * The guest writes the address of one of these, big endian, to the DMA
+ * address register; the low half of the register starts the transfer.
+ * All fields are big endian.  control is cleared when the transfer is
+ * done, or left with FW_CFG_DMA_CTL_ERROR set if it failed.
+ */
+typedef struct FWCfgDmaAccess {
+    uint32_t control;
+    uint32_t length;
+    uint64_t address;
+} QEMU_PACKED FWCfgDmaAccess;
+
 typedef void (*FWCfgCallback)(void *opaque, uint8_t *data);
+/* returns the data of an item, when the guest first selects it */
+typedef uint8_t *(*FWCfgLoadCallback)(void *opaque);
 
 typedef struct FWCfgState FWCfgState;
 int fw_cfg_add_bytes(FWCfgState *s, uint16_t key, uint8_t *data, uint32_t len);
@@ -62,8 +89,14 @@ int fw_cfg_add_callback(FWCfgState *s, uint16_t key, FWCfgCallback callback,
                         void *callback_opaque, uint8_t *data, size_t len);
 int fw_cfg_add_file(FWCfgState *s, const char *filename, uint8_t *data,
                     uint32_t len);
+int fw_cfg_add_file_lazy(FWCfgState *s, const char *filename,
+                         FWCfgLoadCallback load, void *load_opaque,
+                         uint32_t len);
 FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
                         target_phys_addr_t crl_addr, target_phys_addr_t data_addr);
+FWCfgState *fw_cfg_init_dma(uint32_t ctl_port, uint32_t data_port,
+                            uint32_t dma_port);
+bool fw_cfg_dma_enabled(FWCfgState *s);
 
 #endif /* NO_QEMU_PROTOS */
 
@@ -61,6 +61,7 @@ typedef struct HPETTimer {  /* timers */
 typedef struct HPETState {
     SysBusDevice busdev;
     MemoryRegion iomem;
+    MemoryRegion counter;
     uint64_t hpet_offset;
     qemu_irq irqs[HPET_NUM_IRQ_ROUTES];
     uint32_t flags;
@@ -632,6 +633,33 @@ static const MemoryRegionOps hpet_ram_ops = {
     .endianness = DEVICE_NATIVE_ENDIAN,
 };
 
+/*
+ * The main counter has a region of its own so that guests polling it don't
+ * take the global mutex.  A read racing with a write to HPET_CFG may see
+ * the counter from just before the HPET got enabled or disabled.
+ */
+static uint64_t hpet_counter_read(void *opaque, target_phys_addr_t addr,
+                                  unsigned size)
+{
+    return hpet_ram_read(opaque, HPET_COUNTER + addr, size);
+}
+
+static void hpet_counter_write(void *opaque, target_phys_addr_t addr,
+                               uint64_t value, unsigned size)
+{
+    hpet_ram_write(opaque, HPET_COUNTER + addr, value, size);
+}
+
+static const MemoryRegionOps hpet_counter_ops = {
+    .read = hpet_counter_read,
+    .write = hpet_counter_write,
+    .valid = {
+        .min_access_size = 4,
+        .max_access_size = 4,
+    },
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
 static void hpet_reset(DeviceState *d)
 {
     HPETState *s = FROM_SYSBUS(HPETState, sysbus_from_qdev(d));
@@ -723,6 +751,11 @@ static int hpet_init(SysBusDevice *dev)
 
     /* HPET Area */
     memory_region_init_io(&s->iomem, &hpet_ram_ops, s, "hpet", 0x400);
+    memory_region_init_io(&s->counter, &hpet_counter_ops, s, "hpet-counter",
+                          8);
+    memory_region_set_lockless(&s->counter, true, false);
+    memory_region_add_subregion_overlap(&s->iomem, HPET_COUNTER, &s->counter,
+                                        1);
     sysbus_init_mmio(dev, &s->iomem);
     return 0;
 }
@@ -56,6 +56,8 @@ static uint32_t  ahci_port_read(AHCIState *s, int port, int offset)
     AHCIPortRegs *pr;
     pr = &s->dev[port].port_regs;
 
+    doorbell_flush(&s->dev[port].cmd_issue_db);
+
     switch (offset) {
     case PORT_LST_ADDR:
         val = pr->lst_addr;
@@ -191,6 +193,8 @@ static void  ahci_port_write(AHCIState *s, int port, int offset, uint32_t val)
 {
     AHCIPortRegs *pr = &s->dev[port].port_regs;
 
+    doorbell_flush(&s->dev[port].cmd_issue_db);
+
     DPRINTF(port, "offset: 0x%x val: 0x%x\n", offset, val);
     switch (offset) {
         case PORT_LST_ADDR:
@@ -279,6 +283,24 @@ static void  ahci_port_write(AHCIState *s, int port, int offset, uint32_t val)
     }
 }
 
+/* Apply PxCI writes that KVM completed behind our back */
+static void ahci_flush_doorbells(AHCIState *s)
+{
+    int i;
+
+    for (i = 0; i < s->ports; i++) {
+        doorbell_flush(&s->dev[i].cmd_issue_db);
+    }
+}
+
+static void ahci_cmd_issue_doorbell(void *opaque, uint64_t value)
+{
+    AHCIDevice *ad = opaque;
+
+    ad->port_regs.cmd_issue |= value;
+    check_cmd(ad->hba, ad->port_no);
+}
+
 static uint64_t ahci_mem_read(void *opaque, target_phys_addr_t addr,
                               unsigned size)
 {
@@ -286,6 +308,7 @@ static uint64_t ahci_mem_read(void *opaque, target_phys_addr_t addr,
     uint32_t val = 0;
 
     if (addr < AHCI_GENERIC_HOST_CONTROL_REGS_MAX_ADDR) {
+        ahci_flush_doorbells(s);
         switch (addr) {
         case HOST_CAP:
             val = s->control_regs.cap;
@@ -331,6 +354,7 @@ static void ahci_mem_write(void *opaque, target_phys_addr_t addr,
 
     if (addr < AHCI_GENERIC_HOST_CONTROL_REGS_MAX_ADDR) {
         DPRINTF(-1, "(addr 0x%08X), val 0x%08"PRIX64"\n", (unsigned) addr, val);
+        ahci_flush_doorbells(s);
 
         switch (addr) {
             case HOST_CAP: /* R/WO, RO */
@@ -431,15 +455,23 @@ static void ahci_reg_init(AHCIState *s)
 static void check_cmd(AHCIState *s, int port)
 {
     AHCIPortRegs *pr = &s->dev[port].port_regs;
+    BlockDriverState *bs = s->dev[port].port.ifs[0].bs;
     int slot;
 
     if ((pr->cmd & PORT_CMD_START) && pr->cmd_issue) {
+        /* NCQ commands issued together reach the host as one batch */
+        if (bs) {
+            bdrv_io_plug(bs);
+        }
         for (slot = 0; (slot < 32) && pr->cmd_issue; slot++) {
             if ((pr->cmd_issue & (1 << slot)) &&
                 !handle_cmd(s, port, slot)) {
                 pr->cmd_issue &= ~(1 << slot);
             }
         }
+        if (bs) {
+            bdrv_io_unplug(bs);
+        }
     }
 }
 
@@ -522,6 +554,11 @@ static void ahci_reset_port(AHCIState *s, int port)
         ncq_tfs->used = 0;
     }
 
+    /* Cancelled requests are not reported to the guest */
+    d->ncq_done = 0;
+    d->ncq_failed = 0;
+    qemu_bh_cancel(d->ncq_bh);
+
     s->dev[port].port_state = STATE_RUN;
     if (!ide_state->bs) {
         s->dev[port].port_regs.sig = 0;
@@ -709,32 +746,65 @@ out:
     return r;
 }
 
-static void ncq_cb(void *opaque, int ret)
+/*
+ * NCQ completions are collected in ncq_done and reported from a bottom half,
+ * so requests that finish together share one Set Device Bits FIS and one
+ * interrupt.
+ */
+static void ahci_ncq_complete_bh(void *opaque)
 {
-    NCQTransferState *ncq_tfs = (NCQTransferState *)opaque;
-    IDEState *ide_state = &ncq_tfs->drive->port.ifs[0];
+    AHCIDevice *ad = opaque;
+    IDEState *ide_state = &ad->port.ifs[0];
+    uint32_t done = ad->ncq_done;
 
-    /* Clear bit for this tag in SActive */
-    ncq_tfs->drive->port_regs.scr_act &= ~(1 << ncq_tfs->tag);
+    if (!done) {
+        return;
+    }
 
-    if (ret < 0) {
-        /* error */
+    /* Clear bits for these tags in SActive */
+    ad->port_regs.scr_act &= ~done;
+
+    if (ad->ncq_failed) {
         ide_state->error = ABRT_ERR;
         ide_state->status = READY_STAT | ERR_STAT;
-        ncq_tfs->drive->port_regs.scr_err |= (1 << ncq_tfs->tag);
     } else {
         ide_state->status = READY_STAT | SEEK_STAT;
     }
+    ad->ncq_done = 0;
+    ad->ncq_failed = 0;
+
+    DPRINTF(ad->port_no, "NCQ tags %#x finished\n", done);
+
+    ahci_write_fis_sdb(ad->hba, ad->port_no, done);
+}
+
+static void ncq_finish(NCQTransferState *ncq_tfs, int ret)
+{
+    AHCIDevice *ad = ncq_tfs->drive;
+
+    if (ret < 0) {
+        ad->port_regs.scr_err |= (1 << ncq_tfs->tag);
+        ad->ncq_failed |= (1 << ncq_tfs->tag);
+    }
+    ad->ncq_done |= (1 << ncq_tfs->tag);
+    ncq_tfs->used = 0;
+
+    qemu_bh_schedule(ad->ncq_bh);
+}
+
+static void ncq_cb(void *opaque, int ret)
+{
+    NCQTransferState *ncq_tfs = (NCQTransferState *)opaque;
+    BlockDriverState *bs = ncq_tfs->drive->port.ifs[0].bs;
 
-    ahci_write_fis_sdb(ncq_tfs->drive->hba, ncq_tfs->drive->port_no,
-                       (1 << ncq_tfs->tag));
+    ncq_tfs->aiocb = NULL;
 
     DPRINTF(ncq_tfs->drive->port_no, "NCQ transfer tag %d finished\n",
             ncq_tfs->tag);
 
-    bdrv_acct_done(ncq_tfs->drive->port.ifs[0].bs, &ncq_tfs->acct);
+    bdrv_acct_done(bs, &ncq_tfs->acct);
     qemu_sglist_destroy(&ncq_tfs->sglist);
-    ncq_tfs->used = 0;
+    ncq_finish(ncq_tfs, ret);
 }
 
 static void process_ncq_command(AHCIState *s, int port, uint8_t *cmd_fis,
@@ -743,6 +813,7 @@ static void process_ncq_command(AHCIState *s, int port, uint8_t *cmd_fis,
     NCQFrame *ncq_fis = (NCQFrame*)cmd_fis;
     uint8_t tag = ncq_fis->tag >> 3;
     NCQTransferState *ncq_tfs = &s->dev[port].ncq_tfs[tag];
+    IDEState *ide_state = &s->dev[port].port.ifs[0];
 
     if (ncq_tfs->used) {
         /* error - already in use */
@@ -753,12 +824,15 @@ static void process_ncq_command(AHCIState *s, int port, uint8_t *cmd_fis,
     ncq_tfs->used = 1;
     ncq_tfs->drive = &s->dev[port];
     ncq_tfs->slot = slot;
+    ncq_tfs->tag = tag;
+    ncq_tfs->aiocb = NULL;
     ncq_tfs->lba = ((uint64_t)ncq_fis->lba5 << 40) |
                    ((uint64_t)ncq_fis->lba4 << 32) |
                    ((uint64_t)ncq_fis->lba3 << 24) |
                    ((uint64_t)ncq_fis->lba2 << 16) |
                    ((uint64_t)ncq_fis->lba1 << 8) |
                    (uint64_t)ncq_fis->lba0;
+    ncq_tfs->fua = !!(ncq_fis->fua & NCQ_FIS_FUA_MASK);
 
     /* Note: We calculate the sector count, but don't currently rely on it.
      * The total size of the DMA buffer tells us the transfer size instead. */
@@ -768,43 +842,59 @@ static void process_ncq_command(AHCIState *s, int port, uint8_t *cmd_fis,
     DPRINTF(port, "NCQ transfer LBA from %"PRId64" to %"PRId64", "
             "drive max %"PRId64"\n",
             ncq_tfs->lba, ncq_tfs->lba + ncq_tfs->sector_count - 2,
-            s->dev[port].port.ifs[0].nb_sectors - 1);
+            ide_state->nb_sectors - 1);
 
-    ahci_populate_sglist(&s->dev[port], &ncq_tfs->sglist, 0);
-    ncq_tfs->tag = tag;
+    switch (ncq_fis->command) {
+    case READ_FPDMA_QUEUED:
+        ncq_tfs->is_write = 0;
+        break;
+    case WRITE_FPDMA_QUEUED:
+        ncq_tfs->is_write = 1;
+        break;
+    default:
+        DPRINTF(port, "error: tried to process non-NCQ command as NCQ\n");
+        ncq_finish(ncq_tfs, -EINVAL);
+        return;
+    }
 
-    switch(ncq_fis->command) {
-        case READ_FPDMA_QUEUED:
-            DPRINTF(port, "NCQ reading %d sectors from LBA %"PRId64", "
-                    "tag %d\n",
-                    ncq_tfs->sector_count-1, ncq_tfs->lba, ncq_tfs->tag);
+    if (ncq_tfs->lba >= ide_state->nb_sectors) {
+        DPRINTF(port, "error: NCQ LBA %"PRId64" beyond the end of the disk\n",
+                ncq_tfs->lba);
+        ncq_finish(ncq_tfs, -EINVAL);
+        return;
+    }
 
-            DPRINTF(port, "tag %d aio read %"PRId64"\n",
-                    ncq_tfs->tag, ncq_tfs->lba);
+    if (ahci_populate_sglist(&s->dev[port], &ncq_tfs->sglist, 0) < 0) {
+        ncq_finish(ncq_tfs, -EINVAL);
+        return;
+    }
 
-            dma_acct_start(ncq_tfs->drive->port.ifs[0].bs, &ncq_tfs->acct,
-                           &ncq_tfs->sglist, BDRV_ACCT_READ);
-            ncq_tfs->aiocb = dma_bdrv_read(ncq_tfs->drive->port.ifs[0].bs,
-                                           &ncq_tfs->sglist, ncq_tfs->lba,
-                                           ncq_cb, ncq_tfs);
-            break;
-        case WRITE_FPDMA_QUEUED:
-            DPRINTF(port, "NCQ writing %d sectors to LBA %"PRId64", tag %d\n",
-                    ncq_tfs->sector_count-1, ncq_tfs->lba, ncq_tfs->tag);
-
-            DPRINTF(port, "tag %d aio write %"PRId64"\n",
-                    ncq_tfs->tag, ncq_tfs->lba);
-
-            dma_acct_start(ncq_tfs->drive->port.ifs[0].bs, &ncq_tfs->acct,
-                           &ncq_tfs->sglist, BDRV_ACCT_WRITE);
-            ncq_tfs->aiocb = dma_bdrv_write(ncq_tfs->drive->port.ifs[0].bs,
-                                            &ncq_tfs->sglist, ncq_tfs->lba,
-                                            ncq_cb, ncq_tfs);
-            break;
-        default:
-            DPRINTF(port, "error: tried to process non-NCQ command as NCQ\n");
-            qemu_sglist_destroy(&ncq_tfs->sglist);
-            break;
+    if (ncq_tfs->is_write) {
+        DPRINTF(port, "NCQ writing %d sectors to LBA %"PRId64", tag %d\n",
+                ncq_tfs->sector_count-1, ncq_tfs->lba, ncq_tfs->tag);
+
+        dma_acct_start(ide_state->bs, &ncq_tfs->acct,
+                       &ncq_tfs->sglist, BDRV_ACCT_WRITE);
+        /* Forced unit access: the data must be on stable storage before
+         * the command completes.
+         */
+        ncq_tfs->aiocb = dma_bdrv_io(ide_state->bs,
+                                     &ncq_tfs->sglist, ncq_tfs->lba,
+                                     ncq_tfs->fua ? bdrv_aio_writev_fua
+                                                  : bdrv_aio_writev,
+                                     ncq_cb, ncq_tfs,
+                                     DMA_DIRECTION_TO_DEVICE);
+    } else {
+        DPRINTF(port, "NCQ reading %d sectors from LBA %"PRId64", "
+                "tag %d\n",
+                ncq_tfs->sector_count-1, ncq_tfs->lba, ncq_tfs->tag);
+
+        ncq_tfs->fua = 0;
+        dma_acct_start(ide_state->bs, &ncq_tfs->acct,
+                       &ncq_tfs->sglist, BDRV_ACCT_READ);
+        ncq_tfs->aiocb = dma_bdrv_read(ide_state->bs,
+                                       &ncq_tfs->sglist, ncq_tfs->lba,
+                                       ncq_cb, ncq_tfs);
     }
 }
 
@@ -1150,6 +1240,33 @@ static const IDEDMAOps ahci_dma_ops = {
     .reset = ahci_dma_reset,
 };
 
+/*
+ * Drivers issue one command per PxCI write, so with ioeventfd enabled each
+ * single-bit write completes in KVM and the command is started from the
+ * I/O thread.  Anything else still exits to ahci_port_write().
+ */
+static void ahci_init_doorbells(AHCIState *s)
+{
+    uint64_t slots[AHCI_MAX_CMDS];
+    int i;
+
+    for (i = 0; i < AHCI_MAX_CMDS; i++) {
+        slots[i] = 1ULL << i;
+    }
+
+    for (i = 0; i < s->ports; i++) {
+        AHCIDevice *ad = &s->dev[i];
+
+        if (doorbell_init(&ad->cmd_issue_db, &s->mem,
+                          AHCI_PORT_REGS_START_ADDR +
+                          i * AHCI_PORT_ADDR_OFFSET_LEN + PORT_CMD_ISSUE,
+                          4, slots, AHCI_MAX_CMDS,
+                          ahci_cmd_issue_doorbell, ad) < 0) {
+            break;
+        }
+    }
+}
+
 void ahci_init(AHCIState *s, DeviceState *qdev, DMAContext *dma, int ports)
 {
     qemu_irq *irqs;
@@ -1176,11 +1293,22 @@ void ahci_init(AHCIState *s, DeviceState *qdev, DMAContext *dma, int ports)
         ad->port.dma = &ad->dma;
         ad->port.dma->ops = &ahci_dma_ops;
         ad->port_regs.cmd = PORT_CMD_SPIN_UP | PORT_CMD_POWER_ON;
+        ad->ncq_bh = qemu_bh_new(ahci_ncq_complete_bh, ad);
+    }
+
+    if (s->flags & (1 << AHCI_FLAG_USE_IOEVENTFD_BIT)) {
+        ahci_init_doorbells(s);
     }
 }
 
 void ahci_uninit(AHCIState *s)
 {
+    int i;
+
+    for (i = 0; i < s->ports; i++) {
+        doorbell_cleanup(&s->dev[i].cmd_issue_db);
+        qemu_bh_delete(s->dev[i].ncq_bh);
+    }
     memory_region_destroy(&s->mem);
     memory_region_destroy(&s->idp);
     g_free(s->dev);
@@ -24,6 +24,8 @@
 #ifndef HW_IDE_AHCI_H
 #define HW_IDE_AHCI_H
 
+#include <hw/doorbell.h>
+
 #define AHCI_MEM_BAR_SIZE         0x1000
 #define AHCI_MAX_PORTS            32
 #define AHCI_MAX_SG               168 /* hardware max is 64K */
@@ -179,6 +181,8 @@
 #define SATA_FIS_TYPE_REGISTER_H2D        0x27
 #define SATA_FIS_REG_H2D_UPDATE_COMMAND_REGISTER 0x80
 
+#define NCQ_FIS_FUA_MASK                  0x80
+
 #define AHCI_CMD_HDR_CMD_FIS_LEN           0x1f
 #define AHCI_CMD_HDR_PRDT_LEN              16
 
@@ -268,6 +272,8 @@ typedef struct NCQTransferState {
     uint8_t tag;
     int slot;
     int used;
+    int is_write;
+    int fua;                /* flush once the write is done */
 } NCQTransferState;
 
 struct AHCIDevice {
@@ -288,6 +294,10 @@ struct AHCIDevice {
     BlockDriverCompletionFunc *dma_cb;
     AHCICmdHdr *cur_cmd;
     NCQTransferState ncq_tfs[AHCI_MAX_CMDS];
+    QEMUBH *ncq_bh;         /* reports completed NCQ tags */
+    uint32_t ncq_done;      /* tags completed since the last SDB FIS */
+    uint32_t ncq_failed;    /* ... and those of them that failed */
+    Doorbell cmd_issue_db;  /* PxCI writes of a single slot bit */
 };
 
 typedef struct AHCIState {
@@ -300,8 +310,11 @@ typedef struct AHCIState {
     int ports;
     qemu_irq irq;
     DMAContext *dma;
+    uint32_t flags;
 } AHCIState;
 
+#define AHCI_FLAG_USE_IOEVENTFD_BIT 0
+
 typedef struct AHCIPCIState {
     PCIDevice card;
     AHCIState ahci;
@@ -323,48 +323,15 @@ static void ide_set_signature(IDEState *s)
     }
 }
 
-typedef struct TrimAIOCB {
-    BlockDriverAIOCB common;
-    QEMUBH *bh;
-    int ret;
-} TrimAIOCB;
-
-static void trim_aio_cancel(BlockDriverAIOCB *acb)
-{
-    TrimAIOCB *iocb = container_of(acb, TrimAIOCB, common);
-
-    qemu_bh_delete(iocb->bh);
-    iocb->bh = NULL;
-    qemu_aio_release(iocb);
-}
-
-static AIOPool trim_aio_pool = {
-    .aiocb_size         = sizeof(TrimAIOCB),
-    .cancel             = trim_aio_cancel,
-};
-
-static void ide_trim_bh_cb(void *opaque)
-{
-    TrimAIOCB *iocb = opaque;
-
-    iocb->common.cb(iocb->common.opaque, iocb->ret);
-
-    qemu_bh_delete(iocb->bh);
-    iocb->bh = NULL;
-
-    qemu_aio_release(iocb);
-}
-
 BlockDriverAIOCB *ide_issue_trim(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
-    TrimAIOCB *iocb;
-    int i, j, ret;
+    BlockDiscardRange *ranges;
+    BlockDriverAIOCB *acb;
+    int i, j, n = 0;
 
-    iocb = qemu_aio_get(&trim_aio_pool, bs, cb, opaque);
-    iocb->bh = qemu_bh_new(ide_trim_bh_cb, iocb);
-    iocb->ret = 0;
+    ranges = g_new(BlockDiscardRange, qiov->size / 8 + 1);
 
     for (j = 0; j < qiov->niov; j++) {
         uint64_t *buffer = qiov->iov[j].iov_base;
@@ -379,16 +346,17 @@ BlockDriverAIOCB *ide_issue_trim(BlockDriverState *bs,
                 break;
             }
 
-            ret = bdrv_discard(bs, sector, count);
-            if (!iocb->ret) {
-                iocb->ret = ret;
-            }
+            ranges[n].sector_num = sector;
+            ranges[n].nb_sectors = count;
+            n++;
         }
     }
 
-    qemu_bh_schedule(iocb->bh);
+    /* All ranges of the command are merged and discarded in one go */
+    acb = bdrv_aio_discard_ranges(bs, ranges, n, cb, opaque);
+    g_free(ranges);
 
-    return &iocb->common;
+    return acb;
 }
 
 static inline void ide_abort_command(IDEState *s)
@@ -141,6 +141,12 @@ static void pci_ich9_uninit(PCIDevice *dev)
     ahci_uninit(&d->ahci);
 }
 
+static Property ich_ahci_properties[] = {
+    DEFINE_PROP_BIT("ioeventfd", AHCIPCIState, ahci.flags,
+                    AHCI_FLAG_USE_IOEVENTFD_BIT, false),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void ich_ahci_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -154,6 +160,7 @@ static void ich_ahci_class_init(ObjectClass *klass, void *data)
     k->class_id = PCI_CLASS_STORAGE_SATA;
     dc->vmsd = &vmstate_ahci;
     dc->reset = pci_ich9_reset;
+    dc->props = ich_ahci_properties;
 }
 
 static TypeInfo ich_ahci_info = {
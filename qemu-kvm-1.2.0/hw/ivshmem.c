@@ -52,6 +52,8 @@ typedef struct Peer {
 typedef struct EventfdEntry {
     PCIDevice *pdev;
     int vector;
+    int virq;       /* KVM MSI route of the vector, or -1 */
+    bool irqfd;     /* our eventfd for the vector is bound to virq */
 } EventfdEntry;
 
 typedef struct IVShmemState {
@@ -168,7 +170,7 @@ static void ivshmem_io_write(void *opaque, target_phys_addr_t addr,
     IVShmemState *s = opaque;
 
     uint16_t dest = val >> 16;
-    uint16_t vector = val & 0xff;
+    uint16_t vector = val & 0xffff;
 
     addr &= 0xfc;
 
@@ -342,6 +344,96 @@ static void create_shared_memory_BAR(IVShmemState *s, int fd) {
     pci_register_bar(&s->dev, 2, PCI_BASE_ADDRESS_SPACE_MEMORY, &s->bar);
 }
 
+/*
+ * With an in-kernel irqchip, the eventfds that peers kick to interrupt us
+ * are bound to the MSI-X vectors' KVM routes as irqfds while the vectors
+ * are unmasked, so a doorbell from another VM is injected by the kernel
+ * without waking up QEMU.  While a vector is masked, or before its eventfd
+ * has arrived from the server, the eventfd is read by its character device
+ * as before, and msix_notify() sets the pending bit.
+ */
+static int ivshmem_vector_use(PCIDevice *dev, unsigned vector,
+                              MSIMessage msg)
+{
+    IVShmemState *s = DO_UPCAST(IVShmemState, dev, dev);
+    EventfdEntry *entry = &s->eventfd_table[vector];
+    int ret;
+
+    if (s->vm_id < 0 || vector >= s->peers[s->vm_id].nb_eventfds ||
+        entry->irqfd) {
+        return 0;
+    }
+
+    if (entry->virq < 0) {
+        ret = kvm_irqchip_add_msi_route(kvm_state, msg);
+        if (ret < 0) {
+            /* keep delivering through userspace */
+            return 0;
+        }
+        entry->virq = ret;
+    } else {
+        kvm_irqchip_update_msi_route(kvm_state, entry->virq, msg);
+    }
+
+    ret = kvm_irqchip_add_irq_notifier(kvm_state,
+                                       &s->peers[s->vm_id].eventfds[vector],
+                                       entry->virq);
+    if (ret < 0) {
+        return 0;
+    }
+
+    /* the kernel consumes the eventfd from now on */
+    qemu_chr_add_handlers(s->eventfd_chr[vector], NULL, NULL, NULL, NULL);
+    entry->irqfd = true;
+    return 0;
+}
+
+static void ivshmem_vector_release(PCIDevice *dev, unsigned vector)
+{
+    IVShmemState *s = DO_UPCAST(IVShmemState, dev, dev);
+    EventfdEntry *entry = &s->eventfd_table[vector];
+
+    if (!entry->irqfd) {
+        return;
+    }
+
+    kvm_irqchip_remove_irq_notifier(kvm_state,
+                                    &s->peers[s->vm_id].eventfds[vector],
+                                    entry->virq);
+    entry->irqfd = false;
+    qemu_chr_add_handlers(s->eventfd_chr[vector], ivshmem_can_receive,
+                          fake_irqfd, ivshmem_event, entry);
+}
+
+static bool ivshmem_use_irqfd(IVShmemState *s)
+{
+    /* eventfd_table only exists with MSI and a server */
+    return s->eventfd_table && kvm_msi_via_irqfd_enabled();
+}
+
+/* bind eventfds that arrived while their vector was already unmasked */
+static void ivshmem_sync_irqfds(IVShmemState *s)
+{
+    if (!ivshmem_use_irqfd(s)) {
+        return;
+    }
+    msix_unset_vector_notifiers(&s->dev);
+    msix_set_vector_notifiers(&s->dev, ivshmem_vector_use,
+                              ivshmem_vector_release);
+}
+
+static void ivshmem_release_irqfds(IVShmemState *s)
+{
+    int i;
+
+    if (!ivshmem_use_irqfd(s)) {
+        return;
+    }
+    for (i = 0; i < s->vectors; i++) {
+        ivshmem_vector_release(&s->dev, i);
+    }
+}
+
 static void ivshmem_add_eventfd(IVShmemState *s, int posn, int i)
 {
     memory_region_add_eventfd(&s->ivshmem_mmio,
@@ -366,6 +458,10 @@ static void close_guest_eventfds(IVShmemState *s, int posn)
 {
     int i, guest_curr_max;
 
+    if (posn == s->vm_id) {
+        ivshmem_release_irqfds(s);
+    }
+
     if (!ivshmem_has_feature(s, IVSHMEM_IOEVENTFD)) {
         return;
     }
@@ -480,6 +576,13 @@ static void ivshmem_read(void *opaque, const uint8_t * buf, int flags)
      * guests for each VM */
     guest_max_eventfd = s->peers[incoming_posn].nb_eventfds;
 
+    if (guest_max_eventfd >= s->vectors) {
+        fprintf(stderr, "ivshmem: too many eventfds for peer %ld, "
+                "only %d vectors\n", incoming_posn, s->vectors);
+        close(incoming_fd);
+        return;
+    }
+
     if (guest_max_eventfd == 0) {
         /* one eventfd per MSI vector */
         s->peers[incoming_posn].eventfds = g_new(EventNotifier, s->vectors);
@@ -503,6 +606,7 @@ static void ivshmem_read(void *opaque, const uint8_t * buf, int flags)
         s->eventfd_chr[guest_max_eventfd] = create_eventfd_chr_device(s,
                    &s->peers[s->vm_id].eventfds[guest_max_eventfd],
                    guest_max_eventfd);
+        ivshmem_sync_irqfds(s);
     }
 
     if (ivshmem_has_feature(s, IVSHMEM_IOEVENTFD)) {
@@ -532,6 +636,8 @@ static void ivshmem_reset(DeviceState *d)
 {
     IVShmemState *s = DO_UPCAST(IVShmemState, dev.qdev, d);
 
+    /* reset masks all vectors without telling the release notifier */
+    ivshmem_release_irqfds(s);
     s->intrstatus = 0;
     ivshmem_use_msix(s);
     return;
@@ -566,6 +672,8 @@ static uint64_t ivshmem_get_size(IVShmemState * s) {
 
 static void ivshmem_setup_msi(IVShmemState * s)
 {
+    int i;
+
     if (msix_init_exclusive_bar(&s->dev, s->vectors, 1)) {
         IVSHMEM_DPRINTF("msix initialization failed\n");
         exit(1);
@@ -575,8 +683,16 @@ static void ivshmem_setup_msi(IVShmemState * s)
 
     /* allocate QEMU char devices for receiving interrupts */
     s->eventfd_table = g_malloc0(s->vectors * sizeof(EventfdEntry));
+    for (i = 0; i < s->vectors; i++) {
+        s->eventfd_table[i].virq = -1;
+    }
 
     ivshmem_use_msix(s);
+
+    if (ivshmem_use_irqfd(s)) {
+        msix_set_vector_notifiers(&s->dev, ivshmem_vector_use,
+                                  ivshmem_vector_release);
+    }
 }
 
 static void ivshmem_save(QEMUFile* f, void *opaque)
@@ -770,6 +886,18 @@ static void pci_ivshmem_uninit(PCIDevice *dev)
         error_free(s->migration_blocker);
     }
 
+    if (ivshmem_use_irqfd(s)) {
+        int i;
+
+        msix_unset_vector_notifiers(&s->dev);
+        ivshmem_release_irqfds(s);
+        for (i = 0; i < s->vectors; i++) {
+            if (s->eventfd_table[i].virq >= 0) {
+                kvm_irqchip_release_virq(kvm_state, s->eventfd_table[i].virq);
+            }
+        }
+    }
+
     memory_region_destroy(&s->ivshmem_mmio);
     memory_region_del_subregion(&s->bar, &s->ivshmem);
     vmstate_unregister_ram(&s->ivshmem, &s->dev.qdev);
@@ -129,7 +129,7 @@ static void do_inject_external_nmi(void *data)
     uint32_t lvt;
     int ret;
 
-    cpu_synchronize_state(env);
+    cpu_synchronize_groups(env, KVM_REGS_LAPIC);
 
     lvt = s->lvt[APIC_LVT_LINT1];
     if (!(lvt & APIC_LVT_MASKED) && ((lvt >> 8) & 7) == APIC_DM_NMI) {
@@ -175,6 +175,10 @@ static void kvm_apic_init(APICCommonState *s)
 {
     memory_region_init_io(&s->io_memory, &kvm_apic_io_ops, s, "kvm-apic-msi",
                           MSI_SPACE_SIZE);
+    /* KVM_SIGNAL_MSI needs no state of ours, the route cache does */
+    if (kvm_has_direct_msi()) {
+        memory_region_set_lockless(&s->io_memory, true, true);
+    }
 
     if (kvm_has_gsi_routing()) {
         msi_supported = true;
@@ -433,6 +433,57 @@ static uint8_t pci_find_cap_offset(PCIDevice *d, uint8_t cap, uint8_t start)
     return 0;
 }
 
+/*
+ * A memory BAR smaller than a page can be mapped straight into the guest
+ * if it starts a host page that holds nothing else, i.e. no other device
+ * or BAR decodes any part of it.  The guest then gets the whole page.
+ * Anything listed in /proc/iomem that overlaps the page without either
+ * covering all of it (a bridge window) or being the BAR itself (or the
+ * driver that claimed it) makes the mapping unsafe.  Without root the
+ * addresses read as zero and our own BAR is not found, so we fall back to
+ * the slow path.
+ */
+static bool assigned_dev_subpage_exclusive(PCIRegion *region)
+{
+    uint64_t page_start = region->base_addr;
+    uint64_t page_end = page_start + 0xFFF;
+    uint64_t bar_end = page_start + region->size - 1;
+    unsigned long long start, end;
+    bool found = false;
+    char line[256];
+    FILE *f;
+
+    if (region->base_addr & 0xFFF) {
+        return false;
+    }
+
+    f = fopen("/proc/iomem", "r");
+    if (!f) {
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, " %llx-%llx", &start, &end) != 2) {
+            continue;
+        }
+        if (end < page_start || start > page_end) {
+            continue;
+        }
+        if (start <= page_start && end >= page_end) {
+            continue;
+        }
+        if (start == page_start && end == bar_end) {
+            found = true;
+            continue;
+        }
+        found = false;
+        break;
+    }
+
+    fclose(f);
+    return found;
+}
+
 static int assigned_dev_register_regions(PCIRegion *io_regions,
                                          unsigned long regions_num,
                                          AssignedDevice *pci_dev)
@@ -450,9 +501,16 @@ static int assigned_dev_register_regions(PCIRegion *io_regions,
             int t = cur_region->type & IORESOURCE_PREFETCH
                 ? PCI_BASE_ADDRESS_MEM_PREFETCH
                 : PCI_BASE_ADDRESS_SPACE_MEMORY;
+            pcibus_t map_size = cur_region->size;
+
+            /* a sub-page BAR alone in its page is exposed as a full page */
+            if ((cur_region->size & 0xFFF) &&
+                assigned_dev_subpage_exclusive(cur_region)) {
+                map_size = (cur_region->size + 0xFFF) & ~0xFFFULL;
+            }
 
             /* map physical memory */
-            pci_dev->v_addrs[i].u.r_virtbase = mmap(NULL, cur_region->size,
+            pci_dev->v_addrs[i].u.r_virtbase = mmap(NULL, map_size,
                                                     PROT_WRITE | PROT_READ,
                                                     MAP_SHARED,
                                                     cur_region->resource_fd,
@@ -473,7 +531,7 @@ static int assigned_dev_register_regions(PCIRegion *io_regions,
             pci_dev->v_addrs[i].u.r_virtbase +=
                 (cur_region->base_addr & 0xFFF);
 
-            if (cur_region->size & 0xFFF) {
+            if (map_size & 0xFFF) {
                 fprintf(stderr, "PCI region %d at address 0x%llx "
                         "has size 0x%x, which is not a multiple of 4K. "
                         "You might experience some performance hit "
@@ -490,13 +548,12 @@ static int assigned_dev_register_regions(PCIRegion *io_regions,
                 snprintf(name, sizeof(name), "%s.bar%d",
                          object_get_typename(OBJECT(pci_dev)), i);
                 memory_region_init_ram_ptr(&pci_dev->v_addrs[i].real_iomem,
-                                           name, cur_region->size,
-                                           virtbase);
+                                           name, map_size, virtbase);
                 vmstate_register_ram(&pci_dev->v_addrs[i].real_iomem,
                                      &pci_dev->dev.qdev);
             }
 
-            assigned_dev_iomem_setup(&pci_dev->dev, i, cur_region->size);
+            assigned_dev_iomem_setup(&pci_dev->dev, i, map_size);
             pci_register_bar((PCIDevice *) pci_dev, i, t,
                              &pci_dev->v_addrs[i].container);
             continue;
@@ -1046,6 +1103,19 @@ static bool msix_masked(MSIXTableEntry *entry)
     return (entry->ctrl & cpu_to_le32(0x1)) != 0;
 }
 
+/*
+ * Vectors that the guest already wrote a message to get a route even if
+ * they are masked, so that unmasking them later is a single route update
+ * instead of tearing down and rebuilding the whole MSI-X setup.  Guests
+ * commonly program all vectors masked, enable MSI-X and only then unmask
+ * them one by one.  Like vectors masked after being enabled, these still
+ * inject if the device raises them while masked.
+ */
+static bool msix_routable(MSIXTableEntry *entry)
+{
+    return !msix_masked(entry) || entry->addr_lo != 0;
+}
+
 static int assigned_dev_update_msix_mmio(PCIDevice *pci_dev)
 {
     AssignedDevice *adev = DO_UPCAST(AssignedDevice, dev, pci_dev);
@@ -1056,7 +1126,7 @@ static int assigned_dev_update_msix_mmio(PCIDevice *pci_dev)
 
     /* Get the usable entry number for allocating */
     for (i = 0; i < adev->msix_max; i++, entry++) {
-        if (msix_masked(entry)) {
+        if (!msix_routable(entry)) {
             continue;
         }
         entries_nr++;
@@ -1085,7 +1155,7 @@ static int assigned_dev_update_msix_mmio(PCIDevice *pci_dev)
     for (i = 0; i < adev->msix_max; i++, entry++) {
         adev->msi_virq[i] = -1;
 
-        if (msix_masked(entry)) {
+        if (!msix_routable(entry)) {
             continue;
         }
 
@@ -1568,14 +1638,21 @@ static void msix_mmio_write(void *opaque, target_phys_addr_t addr,
              * are lost.  Can we get away with always injecting an
              * interrupt on unmask?
              */
-        } else if (msix_masked(&orig) && !msix_masked(entry)) {
-            /* Vector unmasked */
+        } else if (!msix_masked(entry)) {
             if (i >= adev->msi_virq_nr || adev->msi_virq[i] < 0) {
-                /* Previously unassigned vector, start from scratch */
-                assigned_dev_update_msix(pdev);
+                if (msix_masked(&orig)) {
+                    /* Previously unassigned vector, start from scratch */
+                    assigned_dev_update_msix(pdev);
+                }
                 return;
-            } else {
-                /* Update an existing, previously masked vector */
+            } else if (msix_masked(&orig) ||
+                       orig.addr_lo != entry->addr_lo ||
+                       orig.addr_hi != entry->addr_hi ||
+                       orig.data != entry->data) {
+                /*
+                 * Vector unmasked, or its message rewritten while unmasked
+                 * (e.g. on an affinity change): update its route in place.
+                 */
                 MSIMessage msg;
                 int ret;
 
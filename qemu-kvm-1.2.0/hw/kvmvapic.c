@@ -11,6 +11,8 @@
 #include "sysemu.h"
 #include "cpus.h"
 #include "kvm.h"
+#include "monitor.h"
+#include "pc.h"
 #include "apic_internal.h"
 
 #define APIC_DEFAULT_ADDRESS    0xfee00000
@@ -66,6 +68,7 @@ typedef struct VAPICROMState {
 #define TPR_INSTR_MATCH_MODRM_REG       0x2
 
 typedef struct TPRInstruction {
+    const char *name;
     uint8_t opcode;
     uint8_t modrm_reg;
     unsigned int flags;
@@ -77,18 +80,21 @@ typedef struct TPRInstruction {
 /* must be sorted by length, shortest first */
 static const TPRInstruction tpr_instr[] = {
     { /* mov abs to eax */
+        .name = "mov abs to eax",
         .opcode = 0xa1,
         .access = TPR_ACCESS_READ,
         .length = 5,
         .addr_offset = 1,
     },
     { /* mov eax to abs */
+        .name = "mov eax to abs",
         .opcode = 0xa3,
         .access = TPR_ACCESS_WRITE,
         .length = 5,
         .addr_offset = 1,
     },
     { /* mov r32 to r/m32 */
+        .name = "mov r32 to r/m32",
         .opcode = 0x89,
         .flags = TPR_INSTR_ABS_MODRM,
         .access = TPR_ACCESS_WRITE,
@@ -96,6 +102,7 @@ static const TPRInstruction tpr_instr[] = {
         .addr_offset = 2,
     },
     { /* mov r/m32 to r32 */
+        .name = "mov r/m32 to r32",
         .opcode = 0x8b,
         .flags = TPR_INSTR_ABS_MODRM,
         .access = TPR_ACCESS_READ,
@@ -103,6 +110,7 @@ static const TPRInstruction tpr_instr[] = {
         .addr_offset = 2,
     },
     { /* push r/m32 */
+        .name = "push r/m32",
         .opcode = 0xff,
         .modrm_reg = 6,
         .flags = TPR_INSTR_ABS_MODRM | TPR_INSTR_MATCH_MODRM_REG,
@@ -111,6 +119,7 @@ static const TPRInstruction tpr_instr[] = {
         .addr_offset = 2,
     },
     { /* mov imm32, r/m32 (c7/0) */
+        .name = "mov imm32, r/m32",
         .opcode = 0xc7,
         .modrm_reg = 0,
         .flags = TPR_INSTR_ABS_MODRM | TPR_INSTR_MATCH_MODRM_REG,
@@ -120,6 +129,12 @@ static const TPRInstruction tpr_instr[] = {
     },
 };
 
+/* for "info vapic" */
+static struct {
+    uint64_t patched[ARRAY_SIZE(tpr_instr)];
+    uint64_t unpatchable;
+} vapic_stats;
+
 static void read_guest_rom_state(VAPICROMState *s)
 {
     cpu_physical_memory_rw(s->rom_state_paddr, (void *)&s->rom_state,
@@ -388,6 +403,7 @@ static void patch_instruction(VAPICROMState *s, CPUX86State *env, target_ulong i
     VAPICHandlers *handlers;
     uint8_t opcode[2];
     uint32_t imm32;
+    int i;
 
     if (smp_cpus == 1) {
         handlers = &s->rom_state.up;
@@ -430,6 +446,12 @@ static void patch_instruction(VAPICROMState *s, CPUX86State *env, target_ulong i
 
     resume_all_vcpus();
 
+    for (i = 0; i < ARRAY_SIZE(tpr_instr); i++) {
+        if (tpr_instr[i].opcode == opcode[0]) {
+            vapic_stats.patched[i]++;
+        }
+    }
+
     paddr = cpu_get_phys_page_debug(env, ip);
     paddr += ip & ~TARGET_PAGE_MASK;
     tb_invalidate_phys_page_range(paddr, paddr + 1, 1);
@@ -441,9 +463,10 @@ void vapic_report_tpr_access(DeviceState *dev, void *cpu, target_ulong ip,
     VAPICROMState *s = DO_UPCAST(VAPICROMState, busdev.qdev, dev);
     CPUX86State *env = cpu;
 
-    cpu_synchronize_state(env);
+    cpu_synchronize_groups(env, KVM_REGS_SREGS);
 
     if (evaluate_tpr_instruction(s, env, &ip, access) < 0) {
+        vapic_stats.unpatchable++;
         if (s->state == VAPIC_ACTIVE) {
             vapic_enable(s, env);
         }
@@ -458,6 +481,54 @@ void vapic_report_tpr_access(DeviceState *dev, void *cpu, target_ulong ip,
     patch_instruction(s, env, ip);
 }
 
+void vapic_info(Monitor *mon)
+{
+    static const char *const modes[] = {
+        [VAPIC_INACTIVE] = "inactive",
+        [VAPIC_ACTIVE] = "active",
+        [VAPIC_STANDBY] = "standby",
+    };
+    APICCommonState *apic;
+    VAPICROMState *s;
+    CPUX86State *env;
+    int i;
+
+    if (!first_cpu || !first_cpu->apic_state) {
+        monitor_printf(mon, "no APIC\n");
+        return;
+    }
+    apic = APIC_COMMON(first_cpu->apic_state);
+    if (apic->vapic) {
+        s = DO_UPCAST(VAPICROMState, busdev.qdev, apic->vapic);
+        monitor_printf(mon, "TPR patching %s, %" PRIu64
+                       " unpatchable TPR accesses\n",
+                       s->state < ARRAY_SIZE(modes) ? modes[s->state] : "?",
+                       vapic_stats.unpatchable);
+        for (i = 0; i < ARRAY_SIZE(tpr_instr); i++) {
+            monitor_printf(mon, "  %-18s %" PRIu64 " sites patched\n",
+                           tpr_instr[i].name, vapic_stats.patched[i]);
+        }
+    } else {
+        monitor_printf(mon, "TPR patching disabled\n");
+    }
+
+    if (kvm_irqchip_in_kernel()) {
+        monitor_printf(mon, "APIC accesses and PV EOI are handled by KVM\n");
+    }
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (!env->apic_state) {
+            continue;
+        }
+        apic = APIC_COMMON(env->apic_state);
+        monitor_printf(mon, "CPU #%d: TPR reports %" PRIu64 ", TPR %" PRIu64
+                       ", EOI %" PRIu64 ", ICR %" PRIu64 ", other %" PRIu64
+                       ", PV EOI %" PRIu64 "\n", env->cpu_index,
+                       apic->stats.tpr_reports, apic->stats.tpr_accesses,
+                       apic->stats.eoi_writes, apic->stats.icr_writes,
+                       apic->stats.other_accesses, apic->stats.pv_eois);
+    }
+}
+
 typedef struct VAPICEnableTPRReporting {
     DeviceState *apic;
     bool enable;
@@ -610,7 +681,7 @@ static void vapic_write(void *opaque, target_phys_addr_t addr, uint64_t data,
     target_phys_addr_t rom_paddr;
     VAPICROMState *s = opaque;
 
-    cpu_synchronize_state(env);
+    cpu_synchronize_groups(env, KVM_REGS_SREGS);
 
     /*
      * The VAPIC supports two PIO-based hypercalls, both via port 0x7E.
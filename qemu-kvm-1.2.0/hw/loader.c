@@ -546,6 +546,25 @@ struct Rom {
 static FWCfgState *fw_cfg;
 static QTAILQ_HEAD(, Rom) roms = QTAILQ_HEAD_INITIALIZER(roms);
 
+/* fw_cfg items are read from the file only when the guest asks for them */
+static uint8_t *rom_load_file(void *opaque)
+{
+    Rom *rom = opaque;
+    int rc, fd;
+
+    rom->data = g_malloc0(rom->romsize);
+    fd = open(rom->path, O_RDONLY | O_BINARY);
+    rc = fd == -1 ? -1 : read(fd, rom->data, rom->romsize);
+    if (rc != rom->romsize) {
+        fprintf(stderr, "rom: file %-20s: read error: rc=%d (expected %zd)\n",
+                rom->name, rc, rom->romsize);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    return rom->data;
+}
+
 static void rom_insert(Rom *rom)
 {
     Rom *item;
@@ -591,13 +610,15 @@ int rom_add_file(const char *file, const char *fw_dir,
     }
     rom->addr    = addr;
     rom->romsize = lseek(fd, 0, SEEK_END);
-    rom->data    = g_malloc0(rom->romsize);
-    lseek(fd, 0, SEEK_SET);
-    rc = read(fd, rom->data, rom->romsize);
-    if (rc != rom->romsize) {
-        fprintf(stderr, "rom: file %-20s: read error: rc=%d (expected %zd)\n",
-                rom->name, rc, rom->romsize);
-        goto err;
+    if (!rom->fw_file || !fw_cfg) {
+        rom->data    = g_malloc0(rom->romsize);
+        lseek(fd, 0, SEEK_SET);
+        rc = read(fd, rom->data, rom->romsize);
+        if (rc != rom->romsize) {
+            fprintf(stderr, "rom: file %-20s: read error: rc=%d "
+                    "(expected %zd)\n", rom->name, rc, rom->romsize);
+            goto err;
+        }
     }
     close(fd);
     rom_insert(rom);
@@ -613,7 +634,8 @@ int rom_add_file(const char *file, const char *fw_dir,
         }
         snprintf(fw_file_name, sizeof(fw_file_name), "%s/%s", rom->fw_dir,
                  basename);
-        fw_cfg_add_file(fw_cfg, fw_file_name, rom->data, rom->romsize);
+        fw_cfg_add_file_lazy(fw_cfg, fw_file_name, rom_load_file, rom,
+                             rom->romsize);
         snprintf(devpath, sizeof(devpath), "/rom@%s", fw_file_name);
     } else {
         snprintf(devpath, sizeof(devpath), "/rom@" TARGET_FMT_plx, addr);
@@ -656,6 +656,8 @@ static int rtc_initfn(ISADevice *dev)
 
     memory_region_init_io(&s->io, &cmos_ops, s, "rtc", 2);
     isa_register_ioport(dev, &s->io, base);
+    /* index writes are only latched until the next data port access */
+    memory_region_add_coalescing(&s->io, 0, 1);
 
     qdev_set_legacy_instance_id(&dev->qdev, base, 2);
     qemu_register_reset(rtc_reset, s);
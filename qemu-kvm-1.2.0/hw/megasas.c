@@ -711,6 +711,7 @@ static int megasas_ctrl_get_info(MegasasState *s, MegasasCmd *cmd)
         uint8_t biosver[32];
         uint8_t *ptr;
 
+        pci_load_option_rom(&s->dev);
         ptr = memory_region_get_ram_ptr(&s->dev.rom);
         memcpy(biosver, ptr + 0x41, 31);
         qemu_put_ram_ptr(ptr);
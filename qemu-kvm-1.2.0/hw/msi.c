@@ -20,6 +20,8 @@
 
 #include "msi.h"
 #include "range.h"
+#include "kvm.h"
+#include "event_notifier.h"
 
 /* Eventually those constants should go to Linux pci_regs.h */
 #define PCI_MSI_PENDING_32      0x10
@@ -39,6 +41,12 @@
 /* Flag for interrupt controller to declare MSI/MSI-X support */
 bool msi_supported;
 
+typedef struct MSIIrqfd {
+    int virq;
+    EventNotifier notifier;
+    MSIMessage msg;
+} MSIIrqfd;
+
 /* If we get rid of cap allocator, we won't need this. */
 static inline uint8_t msi_cap_sizeof(uint16_t flags)
 {
@@ -244,6 +252,94 @@ static bool msi_is_masked(const PCIDevice *dev, unsigned int vector)
     return mask & (1U << vector);
 }
 
+/*
+ * With an in-kernel irqchip, MSI and MSI-X messages are sent by writing
+ * to an eventfd bound to a KVM MSI route (an irqfd), instead of going
+ * through the APIC MMIO emulation and an ioctl.  A vector gets its route
+ * on its first notification, and the route follows the message when the
+ * guest reprograms it; MSI and MSI-X share the table since only one of
+ * them is enabled at a time.  Once set up, a notification is one eventfd
+ * write, which device threads can do without the global mutex.
+ *
+ * Returns false if the message has to be sent the slow way.
+ */
+bool msi_irqfd_notify(PCIDevice *dev, unsigned int vector, MSIMessage msg)
+{
+    MSIIrqfd *irqfd;
+    unsigned int i;
+    int virq;
+
+    if (!kvm_msi_via_irqfd_enabled() ||
+        !(dev->cap_present & QEMU_PCI_CAP_MSI_IRQFD)) {
+        return false;
+    }
+
+    if (!dev->msi_irqfd) {
+        dev->msi_irqfd_nr = MAX(PCI_MSI_VECTORS_MAX, dev->msix_entries_nr);
+        dev->msi_irqfd = g_new(MSIIrqfd, dev->msi_irqfd_nr);
+        for (i = 0; i < dev->msi_irqfd_nr; i++) {
+            dev->msi_irqfd[i].virq = -1;
+        }
+    }
+    if (vector >= dev->msi_irqfd_nr) {
+        return false;
+    }
+    irqfd = &dev->msi_irqfd[vector];
+
+    if (irqfd->virq < 0) {
+        if (event_notifier_init(&irqfd->notifier, 0) < 0) {
+            goto fail;
+        }
+        virq = kvm_irqchip_add_msi_route(kvm_state, msg);
+        if (virq < 0) {
+            event_notifier_cleanup(&irqfd->notifier);
+            goto fail;
+        }
+        if (kvm_irqchip_add_irq_notifier(kvm_state, &irqfd->notifier,
+                                         virq) < 0) {
+            kvm_irqchip_release_virq(kvm_state, virq);
+            event_notifier_cleanup(&irqfd->notifier);
+            goto fail;
+        }
+        irqfd->virq = virq;
+        irqfd->msg = msg;
+    } else if (irqfd->msg.address != msg.address ||
+               irqfd->msg.data != msg.data) {
+        if (kvm_irqchip_update_msi_route(kvm_state, irqfd->virq, msg) < 0) {
+            return false;
+        }
+        irqfd->msg = msg;
+    }
+
+    event_notifier_set(&irqfd->notifier);
+    return true;
+
+fail:
+    /* out of GSIs or file descriptors, don't try again for this device */
+    dev->cap_present &= ~QEMU_PCI_CAP_MSI_IRQFD;
+    return false;
+}
+
+void msi_irqfd_release(PCIDevice *dev)
+{
+    MSIIrqfd *irqfd;
+    unsigned int i;
+
+    for (i = 0; i < dev->msi_irqfd_nr; i++) {
+        irqfd = &dev->msi_irqfd[i];
+        if (irqfd->virq < 0) {
+            continue;
+        }
+        kvm_irqchip_remove_irq_notifier(kvm_state, &irqfd->notifier,
+                                        irqfd->virq);
+        kvm_irqchip_release_virq(kvm_state, irqfd->virq);
+        event_notifier_cleanup(&irqfd->notifier);
+    }
+    g_free(dev->msi_irqfd);
+    dev->msi_irqfd = NULL;
+    dev->msi_irqfd_nr = 0;
+}
+
 void msi_notify(PCIDevice *dev, unsigned int vector)
 {
     uint16_t flags = pci_get_word(dev->config + msi_flags_off(dev));
@@ -251,6 +347,7 @@ void msi_notify(PCIDevice *dev, unsigned int vector)
     unsigned int nr_vectors = msi_nr_vectors(flags);
     uint64_t address;
     uint32_t data;
+    MSIMessage msg;
 
     assert(vector < nr_vectors);
     if (msi_is_masked(dev, vector)) {
@@ -278,6 +375,11 @@ void msi_notify(PCIDevice *dev, unsigned int vector)
                    "notify vector 0x%x"
                    " address: 0x%"PRIx64" data: 0x%"PRIx32"\n",
                    vector, address, data);
+    msg.address = address;
+    msg.data = data;
+    if (msi_irqfd_notify(dev, vector, msg)) {
+        return;
+    }
     stl_le_phys(address, data);
 }
 
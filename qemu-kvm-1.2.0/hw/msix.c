@@ -436,6 +436,9 @@ void msix_notify(PCIDevice *dev, unsigned vector)
     }
 
     msg = msix_get_message(dev, vector);
+    if (msi_irqfd_notify(dev, vector, msg)) {
+        return;
+    }
 
     stl_le_phys(msg.address, msg.data);
 }
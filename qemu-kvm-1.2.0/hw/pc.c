@@ -608,9 +608,11 @@ static void *bochs_bios_init(void)
     register_ioport_write(0x500, 1, 1, bochs_bios_write, NULL);
     register_ioport_write(0x503, 1, 1, bochs_bios_write, NULL);
 
-    fw_cfg = fw_cfg_init(BIOS_CFG_IOPORT, BIOS_CFG_IOPORT + 1, 0, 0);
+    fw_cfg = fw_cfg_init_dma(BIOS_CFG_IOPORT, BIOS_CFG_IOPORT + 1,
+                             BIOS_CFG_IOPORT + 4);
 
-    fw_cfg_add_i32(fw_cfg, FW_CFG_ID, 1);
+    fw_cfg_add_i32(fw_cfg, FW_CFG_ID, FW_CFG_VERSION |
+                   (fw_cfg_dma_enabled(fw_cfg) ? FW_CFG_VERSION_DMA : 0));
     fw_cfg_add_i64(fw_cfg, FW_CFG_RAM_SIZE, (uint64_t)ram_size);
     fw_cfg_add_bytes(fw_cfg, FW_CFG_ACPI_TABLES, (uint8_t *)acpi_tables,
                      acpi_tables_len);
@@ -70,6 +70,9 @@ int pic_get_output(DeviceState *d);
 void pic_info(Monitor *mon);
 void irq_info(Monitor *mon);
 
+/* kvmvapic.c */
+void vapic_info(Monitor *mon);
+
 /* Global System Interrupts */
 
 #define GSI_NUM_PINS IOAPIC_NUM_PINS
@@ -54,6 +54,8 @@ static Property pci_props[] = {
                     QEMU_PCI_CAP_MULTIFUNCTION_BITNR, false),
     DEFINE_PROP_BIT("command_serr_enable", PCIDevice, cap_present,
                     QEMU_PCI_CAP_SERR_BITNR, true),
+    DEFINE_PROP_BIT("msi-irqfd", PCIDevice, cap_present,
+                    QEMU_PCI_MSI_IRQFD_BITNR, true),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -827,6 +829,7 @@ static PCIDevice *do_pci_register_device(PCIDevice *pci_dev, PCIBus *bus,
 
 static void do_pci_unregister_device(PCIDevice *pci_dev)
 {
+    msi_irqfd_release(pci_dev);
     qemu_free_irqs(pci_dev->irq);
     pci_dev->bus->devices[pci_dev->devfn] = NULL;
     pci_config_free(pci_dev);
@@ -1000,6 +1003,9 @@ static void pci_update_mappings(PCIDevice *d)
         }
         r->addr = new_addr;
         if (r->addr != PCI_BAR_UNMAPPED) {
+            if (r->memory == &d->rom) {
+                pci_load_option_rom(d);
+            }
             memory_region_add_subregion_overlap(r->address_space,
                                                 r->addr, r->memory, 1);
         }
@@ -1737,7 +1743,6 @@ static int pci_add_option_rom(PCIDevice *pdev, bool is_default_rom)
 {
     int size;
     char *path;
-    void *ptr;
     char name[32];
     const VMStateDescription *vmsd;
 
@@ -1786,22 +1791,43 @@ static int pci_add_option_rom(PCIDevice *pdev, bool is_default_rom)
     pdev->has_rom = true;
     memory_region_init_ram(&pdev->rom, name, size);
     vmstate_register_ram(&pdev->rom, &pdev->qdev);
-    ptr = memory_region_get_ram_ptr(&pdev->rom);
-    load_image(path, ptr);
-    g_free(path);
-
-    if (is_default_rom) {
-        /* Only the default rom images will be patched (if needed). */
-        pci_patch_ids(pdev, ptr, size);
-    }
 
-    qemu_put_ram_ptr(ptr);
+    /* The image is read when the guest first maps the BAR, so that
+       devices whose ROM is never used don't slow down startup. */
+    pdev->rom_path = path;
+    /* Only the default rom images will be patched (if needed). */
+    pdev->rom_patch_ids = is_default_rom;
 
     pci_register_bar(pdev, PCI_ROM_SLOT, 0, &pdev->rom);
 
     return 0;
 }
 
+/* Fill the ROM BAR, if not done yet */
+void pci_load_option_rom(PCIDevice *pdev)
+{
+    void *ptr;
+
+    if (!pdev->rom_path) {
+        return;
+    }
+
+    /* on incoming migration the contents come with the guest RAM */
+    if (!runstate_check(RUN_STATE_INMIGRATE)) {
+        ptr = memory_region_get_ram_ptr(&pdev->rom);
+        if (load_image(pdev->rom_path, ptr) < 0) {
+            error_report("%s: failed to load romfile \"%s\"",
+                         __FUNCTION__, pdev->rom_path);
+        } else if (pdev->rom_patch_ids) {
+            pci_patch_ids(pdev, ptr, memory_region_size(&pdev->rom));
+        }
+        qemu_put_ram_ptr(ptr);
+    }
+
+    g_free(pdev->rom_path);
+    pdev->rom_path = NULL;
+}
+
 static void pci_del_option_rom(PCIDevice *pdev)
 {
     if (!pdev->has_rom)
@@ -1809,6 +1835,8 @@ static void pci_del_option_rom(PCIDevice *pdev)
 
     vmstate_unregister_ram(&pdev->rom, &pdev->qdev);
     memory_region_destroy(&pdev->rom);
+    g_free(pdev->rom_path);
+    pdev->rom_path = NULL;
     pdev->has_rom = false;
 }
 
@@ -131,6 +131,9 @@ enum {
     QEMU_PCI_CAP_SHPC = (1 << QEMU_PCI_SHPC_BITNR),
 #define QEMU_PCI_SLOTID_BITNR 6
     QEMU_PCI_CAP_SLOTID = (1 << QEMU_PCI_SLOTID_BITNR),
+    /* send MSI/MSI-X through KVM irqfds */
+#define QEMU_PCI_MSI_IRQFD_BITNR 7
+    QEMU_PCI_CAP_MSI_IRQFD = (1 << QEMU_PCI_MSI_IRQFD_BITNR),
 };
 
 #define TYPE_PCI_DEVICE "pci-device"
@@ -250,6 +253,10 @@ struct PCIDevice {
     /* Offset of MSI capability in config space */
     uint8_t msi_cap;
 
+    /* irqfds for MSI and MSI-X vectors, see msi_irqfd_notify() */
+    struct MSIIrqfd *msi_irqfd;
+    unsigned int msi_irqfd_nr;
+
     /* PCI Express */
     PCIExpressDevice exp;
 
@@ -261,6 +268,9 @@ struct PCIDevice {
     bool has_rom;
     MemoryRegion rom;
     uint32_t rom_bar;
+    /* set until the ROM contents are loaded from the file */
+    char *rom_path;
+    bool rom_patch_ids;
 
     /* INTx routing notifier */
     PCIINTxRoutingNotifier intx_routing_notifier;
@@ -348,6 +358,7 @@ int pci_read_devaddr(Monitor *mon, const char *addr, int *domp, int *busp,
                      unsigned *slotp);
 
 void pci_device_deassert_intx(PCIDevice *dev);
+void pci_load_option_rom(PCIDevice *pdev);
 
 typedef DMAContext *(*PCIDMAContextFunc)(PCIBus *, void *, int);
 
@@ -58,6 +58,14 @@ do {                                               \
 #define DPRINTF(fmt, ...) do { } while (0)
 #endif
 
+/* Going back to ROMD mode is a memory topology change.  Stay in I/O mode
+ * when the flash returns to read array mode, until the guest either reads
+ * the array this many times or leaves the flash alone for a while, so that
+ * a burst of program commands does not remap the flash for each word.
+ */
+#define PFLASH_LAZY_ROMD_THRESHOLD 42
+#define PFLASH_LAZY_ROMD_DELAY (get_ticks_per_sec() / 100)
+
 struct pflash_t {
     BlockDriverState *bs;
     target_phys_addr_t base;
@@ -75,10 +83,20 @@ struct pflash_t {
     target_phys_addr_t counter;
     unsigned int writeblock_size;
     QEMUTimer *timer;
+    QEMUTimer *romd_timer;
     MemoryRegion mem;
+    int rom_mode;
+    int read_counter; /* used for lazy switch-back to rom mode */
     void *storage;
+    PFlashWriteback *writeback;
 };
 
+static void pflash_register_memory(pflash_t *pfl, int rom_mode)
+{
+    memory_region_rom_device_set_readable(&pfl->mem, rom_mode);
+    pfl->rom_mode = rom_mode;
+}
+
 static void pflash_timer (void *opaque)
 {
     pflash_t *pfl = opaque;
@@ -89,10 +107,35 @@ static void pflash_timer (void *opaque)
     if (pfl->bypass) {
         pfl->wcycle = 2;
     } else {
-        memory_region_rom_device_set_readable(&pfl->mem, true);
         pfl->wcycle = 0;
+        qemu_mod_timer(pfl->romd_timer,
+                       qemu_get_clock_ns(vm_clock) + PFLASH_LAZY_ROMD_DELAY);
+    }
+    pfl->cmd = 0;
+}
+
+static void pflash_romd_timer(void *opaque)
+{
+    pflash_t *pfl = opaque;
+
+    if (!pfl->rom_mode && pfl->wcycle == 0 && pfl->cmd == 0) {
+        pflash_register_memory(pfl, 1);
     }
+}
+
+static void pflash_reset(void *opaque)
+{
+    pflash_t *pfl = opaque;
+
+    /* The CPU may fetch its first instructions from the flash */
+    qemu_del_timer(pfl->timer);
+    qemu_del_timer(pfl->romd_timer);
+    pfl->bypass = 0;
+    pfl->wcycle = 0;
     pfl->cmd = 0;
+    if (!pfl->rom_mode) {
+        pflash_register_memory(pfl, 1);
+    }
 }
 
 static uint32_t pflash_read (pflash_t *pfl, target_phys_addr_t offset,
@@ -103,6 +146,11 @@ static uint32_t pflash_read (pflash_t *pfl, target_phys_addr_t offset,
     uint8_t *p;
 
     ret = -1;
+    /* Lazy reset to ROMD mode after a certain amount of read accesses */
+    if (!pfl->rom_mode && pfl->wcycle == 0 && pfl->cmd == 0 &&
+        ++pfl->read_counter > PFLASH_LAZY_ROMD_THRESHOLD) {
+        pflash_register_memory(pfl, 1);
+    }
     boff = offset & 0xFF; /* why this here ?? */
 
     if (pfl->width == 2)
@@ -199,14 +247,8 @@ static uint32_t pflash_read (pflash_t *pfl, target_phys_addr_t offset,
 static void pflash_update(pflash_t *pfl, int offset,
                           int size)
 {
-    int offset_end;
-    if (pfl->bs) {
-        offset_end = offset + size;
-        /* round to sectors */
-        offset = offset >> 9;
-        offset_end = (offset_end + 511) >> 9;
-        bdrv_write(pfl->bs, offset, pfl->storage + (offset << 9),
-                   offset_end - offset);
+    if (pfl->writeback) {
+        pflash_writeback_mark(pfl->writeback, offset, size);
     }
 }
 
@@ -259,10 +301,13 @@ static void pflash_write(pflash_t *pfl, target_phys_addr_t offset,
     DPRINTF("%s: writing offset " TARGET_FMT_plx " value %08x width %d wcycle 0x%x\n",
             __func__, offset, value, width, pfl->wcycle);
 
-    if (!pfl->wcycle) {
+    if (pfl->rom_mode) {
         /* Set the device in I/O access mode */
-        memory_region_rom_device_set_readable(&pfl->mem, false);
+        pflash_register_memory(pfl, 0);
     }
+    pfl->read_counter = 0;
+    qemu_mod_timer(pfl->romd_timer,
+                   qemu_get_clock_ns(vm_clock) + PFLASH_LAZY_ROMD_DELAY);
 
     switch (pfl->wcycle) {
     case 0:
@@ -436,8 +481,7 @@ static void pflash_write(pflash_t *pfl, target_phys_addr_t offset,
            __func__, offset, pfl->wcycle, pfl->cmd, value);
 
  reset_flash:
-    memory_region_rom_device_set_readable(&pfl->mem, true);
-
+    /* Stay in I/O mode for now, see pflash_read() and pflash_romd_timer() */
     pfl->bypass = 0;
     pfl->wcycle = 0;
     pfl->cmd = 0;
@@ -628,8 +672,15 @@ pflash_t *pflash_cfi01_register(target_phys_addr_t base,
     } else {
         pfl->ro = 0;
     }
+    if (pfl->bs && !pfl->ro) {
+        pfl->writeback = pflash_writeback_new(pfl->bs, pfl->storage,
+                                              total_len);
+    }
 
+    pfl->rom_mode = 1;
     pfl->timer = qemu_new_timer_ns(vm_clock, pflash_timer, pfl);
+    pfl->romd_timer = qemu_new_timer_ns(vm_clock, pflash_romd_timer, pfl);
+    qemu_register_reset(pflash_reset, pfl);
     pfl->base = base;
     pfl->sector_len = sector_len;
     pfl->total_len = total_len;
@@ -51,7 +51,10 @@ do {                                               \
 #define DPRINTF(fmt, ...) do { } while (0)
 #endif
 
+/* Return to ROMD mode after this many reads in read array mode... */
 #define PFLASH_LAZY_ROMD_THRESHOLD 42
+/* ... or once the flash has been left alone for this long */
+#define PFLASH_LAZY_ROMD_DELAY (get_ticks_per_sec() / 100)
 
 struct pflash_t {
     BlockDriverState *bs;
@@ -70,6 +73,7 @@ struct pflash_t {
     uint8_t cfi_len;
     uint8_t cfi_table[0x52];
     QEMUTimer *timer;
+    QEMUTimer *romd_timer;
     /* The device replicates the flash memory across its memory space.  Emulate
      * that by having a container (.mem) filled with an array of aliases
      * (.mem_mappings) pointing to the flash memory (.orig_mem).
@@ -80,6 +84,7 @@ struct pflash_t {
     int rom_mode;
     int read_counter; /* used for lazy switch-back to rom mode */
     void *storage;
+    PFlashWriteback *writeback;
 };
 
 /*
@@ -115,10 +120,35 @@ static void pflash_timer (void *opaque)
     if (pfl->bypass) {
         pfl->wcycle = 2;
     } else {
-        pflash_register_memory(pfl, 1);
         pfl->wcycle = 0;
+        qemu_mod_timer(pfl->romd_timer,
+                       qemu_get_clock_ns(vm_clock) + PFLASH_LAZY_ROMD_DELAY);
+    }
+    pfl->cmd = 0;
+}
+
+static void pflash_romd_timer(void *opaque)
+{
+    pflash_t *pfl = opaque;
+
+    if (!pfl->rom_mode && pfl->wcycle == 0) {
+        pflash_register_memory(pfl, 1);
     }
+}
+
+static void pflash_reset(void *opaque)
+{
+    pflash_t *pfl = opaque;
+
+    /* The CPU may fetch its first instructions from the flash */
+    qemu_del_timer(pfl->timer);
+    qemu_del_timer(pfl->romd_timer);
+    pfl->bypass = 0;
+    pfl->wcycle = 0;
     pfl->cmd = 0;
+    if (!pfl->rom_mode) {
+        pflash_register_memory(pfl, 1);
+    }
 }
 
 static uint32_t pflash_read (pflash_t *pfl, target_phys_addr_t offset,
@@ -230,14 +260,8 @@ static uint32_t pflash_read (pflash_t *pfl, target_phys_addr_t offset,
 static void pflash_update(pflash_t *pfl, int offset,
                           int size)
 {
-    int offset_end;
-    if (pfl->bs) {
-        offset_end = offset + size;
-        /* round to sectors */
-        offset = offset >> 9;
-        offset_end = (offset_end + 511) >> 9;
-        bdrv_write(pfl->bs, offset, pfl->storage + (offset << 9),
-                   offset_end - offset);
+    if (pfl->writeback) {
+        pflash_writeback_mark(pfl->writeback, offset, size);
     }
 }
 
@@ -267,6 +291,8 @@ static void pflash_write (pflash_t *pfl, target_phys_addr_t offset,
         boff = boff >> 1;
     else if (pfl->width == 4)
         boff = boff >> 2;
+    qemu_mod_timer(pfl->romd_timer,
+                   qemu_get_clock_ns(vm_clock) + PFLASH_LAZY_ROMD_DELAY);
     switch (pfl->wcycle) {
     case 0:
         /* Set the device in I/O access mode if required */
@@ -661,8 +687,14 @@ pflash_t *pflash_cfi02_register(target_phys_addr_t base,
     } else {
         pfl->ro = 0;
     }
+    if (pfl->bs && !pfl->ro) {
+        pfl->writeback = pflash_writeback_new(pfl->bs, pfl->storage,
+                                              chip_len);
+    }
 
     pfl->timer = qemu_new_timer_ns(vm_clock, pflash_timer, pfl);
+    pfl->romd_timer = qemu_new_timer_ns(vm_clock, pflash_romd_timer, pfl);
+    qemu_register_reset(pflash_reset, pfl);
     pfl->sector_len = sector_len;
     pfl->width = width;
     pfl->wcycle = 0;
@@ -0,0 +1,175 @@
+/*
+ * Write-back of the contents of parallel NOR flash devices
+ *
+ * Programming and erasing only update the RAM copy of the flash and mark
+ * the 512 byte sectors that they touched as dirty.  A bottom half writes
+ * the dirty sectors back with asynchronous requests, one at a time, so
+ * that everything dirtied while a request is in flight goes out together
+ * with the next one: a firmware variable update made of hundreds of word
+ * programs costs a few writes instead of one synchronous write per word,
+ * and the vCPU never waits for the disk.
+ *
+ * Stopping the VM writes back what is left synchronously, so that the
+ * image is up to date before migration or savevm look at it, and so does
+ * leaving the main loop, once the vCPUs are paused and before the image is
+ * closed.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "hw.h"
+#include "flash.h"
+#include "block.h"
+#include "bitmap.h"
+#include "sysemu.h"
+
+/* Largest write-back request, in sectors */
+#define PFLASH_WRITEBACK_MAX_SECTORS 256
+
+struct PFlashWriteback {
+    BlockDriverState *bs;
+    uint8_t *storage;
+    int64_t nb_sectors;
+    unsigned long *dirty;
+    QEMUBH *bh;
+    VMChangeStateEntry *vmstate;
+    Notifier exit_notifier;
+
+    /* Request in flight, if acb is not NULL.  It writes a copy of the
+     * sectors, the guest may program them again in the meantime.
+     */
+    BlockDriverAIOCB *acb;
+    uint8_t *buf;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int64_t sector_num;
+    int nb;
+};
+
+/* Take the next run of dirty sectors off the bitmap */
+static bool pflash_writeback_next(PFlashWriteback *wb, int64_t *sector_num,
+                                  int *nb)
+{
+    int64_t start, end;
+
+    start = find_first_bit(wb->dirty, wb->nb_sectors);
+    if (start >= wb->nb_sectors) {
+        return false;
+    }
+    end = find_next_zero_bit(wb->dirty, wb->nb_sectors, start);
+    end = MIN(end, start + PFLASH_WRITEBACK_MAX_SECTORS);
+    bitmap_clear(wb->dirty, start, end - start);
+
+    *sector_num = start;
+    *nb = end - start;
+    return true;
+}
+
+static void pflash_writeback_submit(PFlashWriteback *wb);
+
+static void pflash_writeback_cb(void *opaque, int ret)
+{
+    PFlashWriteback *wb = opaque;
+
+    wb->acb = NULL;
+    if (ret < 0) {
+        fprintf(stderr, "pflash: failed to write back sectors %" PRId64
+                "-%" PRId64 ": %s\n", wb->sector_num,
+                wb->sector_num + wb->nb - 1, strerror(-ret));
+    }
+    pflash_writeback_submit(wb);
+}
+
+static void pflash_writeback_submit(PFlashWriteback *wb)
+{
+    if (wb->acb ||
+        !pflash_writeback_next(wb, &wb->sector_num, &wb->nb)) {
+        return;
+    }
+
+    memcpy(wb->buf, wb->storage + (wb->sector_num << BDRV_SECTOR_BITS),
+           wb->nb << BDRV_SECTOR_BITS);
+    wb->iov.iov_base = wb->buf;
+    wb->iov.iov_len = wb->nb << BDRV_SECTOR_BITS;
+    qemu_iovec_init_external(&wb->qiov, &wb->iov, 1);
+    wb->acb = bdrv_aio_writev(wb->bs, wb->sector_num, &wb->qiov, wb->nb,
+                              pflash_writeback_cb, wb);
+    if (!wb->acb) {
+        pflash_writeback_cb(wb, -EIO);
+    }
+}
+
+static void pflash_writeback_bh(void *opaque)
+{
+    pflash_writeback_submit(opaque);
+}
+
+static void pflash_writeback_vm_state_change(void *opaque, int running,
+                                             RunState state)
+{
+    if (!running) {
+        pflash_writeback_flush(opaque);
+    }
+}
+
+static void pflash_writeback_exit(Notifier *notifier, void *data)
+{
+    PFlashWriteback *wb = container_of(notifier, PFlashWriteback,
+                                       exit_notifier);
+
+    pflash_writeback_flush(wb);
+}
+
+PFlashWriteback *pflash_writeback_new(BlockDriverState *bs, void *storage,
+                                      uint64_t size)
+{
+    PFlashWriteback *wb = g_malloc0(sizeof(*wb));
+
+    wb->bs = bs;
+    wb->storage = storage;
+    wb->nb_sectors = size >> BDRV_SECTOR_BITS;
+    wb->dirty = bitmap_new(wb->nb_sectors);
+    wb->buf = qemu_blockalign(bs, PFLASH_WRITEBACK_MAX_SECTORS <<
+                              BDRV_SECTOR_BITS);
+    wb->bh = qemu_bh_new(pflash_writeback_bh, wb);
+    wb->vmstate =
+        qemu_add_vm_change_state_handler(pflash_writeback_vm_state_change, wb);
+    wb->exit_notifier.notify = pflash_writeback_exit;
+    qemu_add_main_loop_exit_notifier(&wb->exit_notifier);
+    return wb;
+}
+
+void pflash_writeback_mark(PFlashWriteback *wb, uint64_t offset,
+                           uint64_t size)
+{
+    int64_t first = offset >> BDRV_SECTOR_BITS;
+    int64_t last = (offset + size - 1) >> BDRV_SECTOR_BITS;
+
+    last = MIN(last, wb->nb_sectors - 1);
+    if (size == 0 || first > last) {
+        return;
+    }
+    bitmap_set(wb->dirty, first, last - first + 1);
+    qemu_bh_schedule(wb->bh);
+}
+
+void pflash_writeback_flush(PFlashWriteback *wb)
+{
+    int64_t sector_num;
+    int nb;
+
+    qemu_bh_cancel(wb->bh);
+    /* The completion submits whatever got dirty in the meantime */
+    while (wb->acb) {
+        qemu_aio_wait();
+    }
+    while (pflash_writeback_next(wb, &sector_num, &nb)) {
+        if (bdrv_write(wb->bs, sector_num,
+                       wb->storage + (sector_num << BDRV_SECTOR_BITS),
+                       nb) < 0) {
+            fprintf(stderr, "pflash: failed to write back sectors %" PRId64
+                    "-%" PRId64 "\n", sector_num, sector_num + nb - 1);
+        }
+    }
+}
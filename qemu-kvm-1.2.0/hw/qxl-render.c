@@ -19,6 +19,7 @@
  * along with this program; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "qemu-timer.h"
 #include "qxl.h"
 
 static void qxl_blit(PCIQXLDevice *qxl, QXLRect *rect)
@@ -100,6 +101,7 @@ static void qxl_render_update_area_unlocked(PCIQXLDevice *qxl)
     VGACommonState *vga = &qxl->vga;
     int i;
     DisplaySurface *surface = vga->ds->surface;
+    int64_t start = qemu_get_clock_ns(rt_clock);
 
     if (qxl->guest_primary.resized) {
         qxl->guest_primary.resized = 0;
@@ -140,6 +142,10 @@ static void qxl_render_update_area_unlocked(PCIQXLDevice *qxl)
                    qxl->dirty[i].bottom - qxl->dirty[i].top);
     }
     qxl->num_dirty_rects = 0;
+
+    qxl->stats.updates++;
+    qxl->stats.update_rects += i;
+    qxl->stats.update_ns += qemu_get_clock_ns(rt_clock) - start;
 }
 
 /*
@@ -24,9 +24,12 @@
 #include "monitor.h"
 #include "sysemu.h"
 #include "trace.h"
+#include "kvm.h"
 
 #include "qxl.h"
 
+#include <poll.h>
+
 /*
  * NOTE: SPICE_RING_PROD_ITEM accesses memory on the pci bar and as
  * such can be changed by the guest, so to avoid a guest trigerrable
@@ -1310,6 +1313,7 @@ static void ioport_write(void *opaque, target_phys_addr_t addr,
     qxl_async_io async = QXL_SYNC;
     uint32_t orig_io_port = io_port;
 
+    d->stats.io_writes++;
     if (d->guest_bug && !io_port == QXL_IO_RESET) {
         return;
     }
@@ -1363,6 +1367,7 @@ static void ioport_write(void *opaque, target_phys_addr_t addr,
     case QXL_IO_FLUSH_SURFACES_ASYNC:
 async_common:
         async = QXL_ASYNC;
+        d->stats.async_ios++;
         qemu_mutex_lock(&d->async_lock);
         if (d->current_async != QXL_UNDEFINED_IO) {
             qxl_set_guest_bug(d, "%d async started before last (%d) complete",
@@ -1567,6 +1572,60 @@ static void init_pipe_signaling(PCIQXLDevice *d)
     qemu_set_fd_handler(d->pipe[0], pipe_read, NULL, d);
 }
 
+/*
+ * QXL_IO_NOTIFY_CMD and QXL_IO_NOTIFY_CURSOR only kick the spice worker,
+ * which is safe from any thread.  With KVM the guest writes are turned
+ * into eventfd signals and handled here, so the vcpu neither exits to
+ * userspace nor takes the global mutex for every command it queues.
+ */
+static void *qxl_notify_thread(void *opaque)
+{
+    PCIQXLDevice *d = opaque;
+    struct pollfd pfd = {
+        .fd = event_notifier_get_fd(&d->notify),
+        .events = POLLIN,
+    };
+
+    for (;;) {
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (!event_notifier_test_and_clear(&d->notify)) {
+            continue;
+        }
+        /* same filtering as ioport_write */
+        if (d->guest_bug || d->mode == QXL_MODE_VGA) {
+            continue;
+        }
+        d->stats.notify_wakeups++;
+        qemu_spice_wakeup(&d->ssd);
+    }
+    return NULL;
+}
+
+static void init_notify_ioeventfd(PCIQXLDevice *d)
+{
+    if (!d->ioeventfd || !kvm_enabled() || !kvm_has_many_ioeventfds()) {
+        return;
+    }
+    if (event_notifier_init(&d->notify, 0) < 0) {
+        dprint(d, 1, "%s: no eventfd, notifications stay in qemu\n",
+               __func__);
+        return;
+    }
+
+    /* guest drivers write zero with outb to both ports */
+    memory_region_add_eventfd(&d->io_bar, QXL_IO_NOTIFY_CMD, 1,
+                              true, 0, &d->notify);
+    memory_region_add_eventfd(&d->io_bar, QXL_IO_NOTIFY_CURSOR, 1,
+                              true, 0, &d->notify);
+    qemu_thread_create(&d->notify_thread, qxl_notify_thread, d,
+                       QEMU_THREAD_DETACHED);
+}
+
 /* graphics console */
 
 static void qxl_hw_update(void *opaque)
@@ -1760,6 +1819,22 @@ static void qxl_init_ramsize(PCIQXLDevice *qxl)
     qxl->vram_size = msb_mask(qxl->vram_size * 2 - 1);
 }
 
+static void qxl_get_render_stats(Object *obj, Visitor *v, void *opaque,
+                                 const char *name, Error **errp)
+{
+    PCIQXLDevice *qxl = opaque;
+    struct render_stats stats = qxl->stats;
+
+    visit_start_struct(v, NULL, "qxl-render-stats", name, 0, errp);
+    visit_type_uint64(v, &stats.io_writes, "io-writes", errp);
+    visit_type_uint64(v, &stats.async_ios, "async-ios", errp);
+    visit_type_uint64(v, &stats.notify_wakeups, "notify-wakeups", errp);
+    visit_type_uint64(v, &stats.updates, "updates", errp);
+    visit_type_uint64(v, &stats.update_rects, "update-rects", errp);
+    visit_type_uint64(v, &stats.update_ns, "update-ns", errp);
+    visit_end_struct(v, errp);
+}
+
 static int qxl_init_common(PCIQXLDevice *qxl)
 {
     uint8_t* config = qxl->pci.config;
@@ -1852,10 +1927,14 @@ static int qxl_init_common(PCIQXLDevice *qxl)
     qemu_add_vm_change_state_handler(qxl_vm_change_state_handler, qxl);
 
     init_pipe_signaling(qxl);
+    init_notify_ioeventfd(qxl);
     qxl_reset_state(qxl);
 
     qxl->update_area_bh = qemu_bh_new(qxl_render_update_area_bh, qxl);
 
+    object_property_add(OBJECT(qxl), "render-stats", "qxl-render-stats",
+                        qxl_get_render_stats, NULL, NULL, qxl, NULL);
+
     return 0;
 }
 
@@ -2068,6 +2147,7 @@ static Property qxl_properties[] = {
         DEFINE_PROP_UINT32("vram_size_mb", PCIQXLDevice, vram32_size_mb, -1),
         DEFINE_PROP_UINT32("vram64_size_mb", PCIQXLDevice, vram_size_mb, -1),
         DEFINE_PROP_UINT32("vgamem_mb", PCIQXLDevice, vgamem_size_mb, 16),
+        DEFINE_PROP_UINT32("ioeventfd", PCIQXLDevice, ioeventfd, 1),
         DEFINE_PROP_END_OF_LIST(),
 };
 
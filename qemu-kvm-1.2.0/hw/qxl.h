@@ -5,6 +5,7 @@
 #include "pci.h"
 #include "vga_int.h"
 #include "qemu-thread.h"
+#include "event_notifier.h"
 
 #include "ui/qemu-spice.h"
 #include "ui/spice-display.h"
@@ -77,6 +78,11 @@ typedef struct PCIQXLDevice {
     QemuThread         main;
     int                pipe[2];
 
+    /* guest notifications delivered by ioeventfd */
+    uint32_t           ioeventfd;
+    EventNotifier      notify;
+    QemuThread         notify_thread;
+
     /* ram pci bar */
     QXLRam             *ram;
     VGACommonState     vga;
@@ -113,6 +119,16 @@ typedef struct PCIQXLDevice {
     int                num_dirty_rects;
     QXLRect            dirty[QXL_NUM_DIRTY_RECTS];
     QEMUBH            *update_area_bh;
+
+    /* statistics, exported as the "render-stats" property */
+    struct render_stats {
+        uint64_t       io_writes;
+        uint64_t       async_ios;
+        uint64_t       notify_wakeups;
+        uint64_t       updates;
+        uint64_t       update_rects;
+        uint64_t       update_ns;
+    } stats;
 } PCIQXLDevice;
 
 #define PANIC_ON(x) if ((x)) {                         \
@@ -381,6 +381,15 @@ static Property s390_virtio_net_properties[] = {
     DEFINE_PROP_INT32("x-txburst", VirtIOS390Device,
                       net.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIOS390Device, net.tx),
+    DEFINE_PROP_UINT32("rx_coalesce_frames", VirtIOS390Device,
+                       net.rx_coalesce.max_frames, 0),
+    DEFINE_PROP_UINT32("rx_coalesce_usecs", VirtIOS390Device,
+                       net.rx_coalesce.usecs, 0),
+    DEFINE_PROP_UINT32("tx_coalesce_frames", VirtIOS390Device,
+                       net.tx_coalesce.max_frames, 0),
+    DEFINE_PROP_UINT32("tx_coalesce_usecs", VirtIOS390Device,
+                       net.tx_coalesce.usecs, 0),
+    DEFINE_PROP_UINT32("queues", VirtIOS390Device, net.queues, 1),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -404,6 +413,7 @@ static Property s390_virtio_blk_properties[] = {
     DEFINE_BLOCK_PROPERTIES(VirtIOS390Device, blk.conf),
     DEFINE_BLOCK_CHS_PROPERTIES(VirtIOS390Device, blk.conf),
     DEFINE_PROP_STRING("serial", VirtIOS390Device, blk.serial),
+    DEFINE_PROP_UINT32("num_queues", VirtIOS390Device, blk.num_queues, 1),
 #ifdef __linux__
     DEFINE_PROP_BIT("scsi", VirtIOS390Device, blk.scsi, 0, true),
 #endif
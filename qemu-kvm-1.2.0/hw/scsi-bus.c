@@ -7,6 +7,9 @@
 #include "trace.h"
 #include "dma.h"
 
+/* Released requests kept for reuse per device */
+#define SCSI_MAX_FREE_REQS 32
+
 static char *scsibus_get_dev_path(DeviceState *dev);
 static char *scsibus_get_fw_dev_path(DeviceState *dev);
 static int scsi_req_parse(SCSICommand *cmd, SCSIDevice *dev, uint8_t *buf);
@@ -201,7 +204,16 @@ static int scsi_qdev_exit(DeviceState *qdev)
     if (dev->vmsentry) {
         qemu_del_vm_change_state_handler(dev->vmsentry);
     }
+    dev->destroying = true;
     scsi_device_destroy(dev);
+
+    while (dev->free_reqs) {
+        SCSIRequest *req = dev->free_reqs;
+
+        dev->free_reqs = req->next_free;
+        g_free(req);
+    }
+    dev->num_free_reqs = 0;
     return 0;
 }
 
@@ -496,12 +508,14 @@ static const struct SCSIReqOps reqops_target_command = {
 };
 
 
-SCSIRequest *scsi_req_alloc(const SCSIReqOps *reqops, SCSIDevice *d,
-                            uint32_t tag, uint32_t lun, void *hba_private)
+/*
+ * Initializes a request in memory provided by the device, which gets it
+ * back through reqops->release once the last reference is dropped.
+ */
+void scsi_req_init(SCSIRequest *req, const SCSIReqOps *reqops, SCSIDevice *d,
+                   uint32_t tag, uint32_t lun, void *hba_private)
 {
-    SCSIRequest *req;
-
-    req = g_malloc0(reqops->size);
+    memset(req, 0, reqops->size);
     req->refcount = 1;
     req->bus = scsi_bus_from_device(d);
     req->dev = d;
@@ -512,9 +526,51 @@ SCSIRequest *scsi_req_alloc(const SCSIReqOps *reqops, SCSIDevice *d,
     req->sense_len = 0;
     req->ops = reqops;
     trace_scsi_req_alloc(req->dev->id, req->lun, req->tag);
+}
+
+/*
+ * Requests allocated here are kept on a per-device free list once released,
+ * so a busy LUN does not go through malloc for every command.  Devices that
+ * embed SCSIRequest in bigger structures use scsi_req_init and recycle those
+ * themselves.
+ */
+SCSIRequest *scsi_req_alloc(const SCSIReqOps *reqops, SCSIDevice *d,
+                            uint32_t tag, uint32_t lun, void *hba_private)
+{
+    SCSIRequest *req, **p;
+
+    for (p = &d->free_reqs; *p; p = &(*p)->next_free) {
+        if ((*p)->pool_size == reqops->size) {
+            break;
+        }
+    }
+    if (*p) {
+        req = *p;
+        *p = req->next_free;
+        d->num_free_reqs--;
+    } else {
+        req = g_malloc(reqops->size);
+    }
+
+    scsi_req_init(req, reqops, d, tag, lun, hba_private);
+    req->pool_size = reqops->size;
     return req;
 }
 
+static void scsi_req_release(SCSIRequest *req)
+{
+    SCSIDevice *d = req->dev;
+
+    if (!req->pool_size || d->destroying ||
+        d->num_free_reqs >= SCSI_MAX_FREE_REQS) {
+        g_free(req);
+        return;
+    }
+    req->next_free = d->free_reqs;
+    d->free_reqs = req;
+    d->num_free_reqs++;
+}
+
 SCSIRequest *scsi_req_new(SCSIDevice *d, uint32_t tag, uint32_t lun,
                           uint8_t *buf, void *hba_private)
 {
@@ -1487,7 +1543,11 @@ void scsi_req_unref(SCSIRequest *req)
         if (req->ops->free_req) {
             req->ops->free_req(req);
         }
-        g_free(req);
+        if (req->ops->release) {
+            req->ops->release(req);
+        } else {
+            scsi_req_release(req);
+        }
     }
 }
 
@@ -45,6 +45,9 @@ do { printf("scsi-disk: " fmt , ## __VA_ARGS__); } while (0)
 #define SCSI_MAX_INQUIRY_LEN 256
 #define SCSI_MAX_MODE_LEN    256
 
+/* Completed requests kept per device for reuse */
+#define SCSI_DISK_MAX_FREE_REQS 128
+
 typedef struct SCSIDiskState SCSIDiskState;
 
 typedef struct SCSIDiskReq {
@@ -57,6 +60,7 @@ typedef struct SCSIDiskReq {
     struct iovec iov;
     QEMUIOVector qiov;
     BlockAcctCookie acct;
+    struct SCSIDiskReq *next_free;
 } SCSIDiskReq;
 
 #define SCSI_DISK_F_REMOVABLE   0
@@ -77,6 +81,9 @@ struct SCSIDiskState
     char *product;
     bool tray_open;
     bool tray_locked;
+    SCSIDiskReq *free_reqs;
+    unsigned int num_free_reqs;
+    bool destroying; /* the free list is gone, free requests directly */
 };
 
 static int scsi_handle_rw_error(SCSIDiskReq *r, int error);
@@ -90,6 +97,37 @@ static void scsi_free_request(SCSIRequest *req)
     }
 }
 
+/* Take a request from the free list instead of allocating it */
+static SCSIRequest *scsi_disk_alloc_req(SCSIDiskState *s,
+                                        const SCSIReqOps *ops, uint32_t tag,
+                                        uint32_t lun, void *hba_private)
+{
+    SCSIDiskReq *r = s->free_reqs;
+
+    if (r) {
+        s->free_reqs = r->next_free;
+        s->num_free_reqs--;
+    } else {
+        r = g_malloc(sizeof(*r));
+    }
+    scsi_req_init(&r->req, ops, &s->qdev, tag, lun, hba_private);
+    return &r->req;
+}
+
+static void scsi_disk_release_req(SCSIRequest *req)
+{
+    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, req->dev);
+    SCSIDiskReq *r = DO_UPCAST(SCSIDiskReq, req, req);
+
+    if (s->destroying || s->num_free_reqs >= SCSI_DISK_MAX_FREE_REQS) {
+        g_free(r);
+        return;
+    }
+    r->next_free = s->free_reqs;
+    s->free_reqs = r;
+    s->num_free_reqs++;
+}
+
 /* Helper function for command completion with sense.  */
 static void scsi_check_condition(SCSIDiskReq *r, SCSISense sense)
 {
@@ -219,11 +257,25 @@ static bool scsi_is_cmd_fua(SCSICommand *cmd)
     }
 }
 
+static bool scsi_is_cmd_verify(SCSICommand *cmd)
+{
+    switch (cmd->buf[0]) {
+    case VERIFY_10:
+    case VERIFY_12:
+    case VERIFY_16:
+        return true;
+    default:
+        return false;
+    }
+}
+
 static void scsi_write_do_fua(SCSIDiskReq *r)
 {
     SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
 
-    if (scsi_is_cmd_fua(&r->req.cmd)) {
+    /* Writes with FUA were already sent with bdrv_aio_writev_fua, only
+     * VERIFY, which writes nothing, still needs the flush.  */
+    if (scsi_is_cmd_fua(&r->req.cmd) && scsi_is_cmd_verify(&r->req.cmd)) {
         bdrv_acct_start(s->qdev.conf.bs, &r->acct, 0, BDRV_ACCT_FLUSH);
         r->req.aiocb = bdrv_aio_flush(s->qdev.conf.bs, scsi_aio_complete, r);
         return;
@@ -461,6 +513,7 @@ static void scsi_write_data(SCSIRequest *req)
 {
     SCSIDiskReq *r = DO_UPCAST(SCSIDiskReq, req, req);
     SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
+    DMAIOFunc *write_func;
     uint32_t n;
 
     /* No data transfer may already be in progress */
@@ -495,16 +548,19 @@ static void scsi_write_data(SCSIRequest *req)
         return;
     }
 
+    write_func = scsi_is_cmd_fua(&r->req.cmd) ? bdrv_aio_writev_fua
+                                              : bdrv_aio_writev;
     if (r->req.sg) {
         dma_acct_start(s->qdev.conf.bs, &r->acct, r->req.sg, BDRV_ACCT_WRITE);
         r->req.resid -= r->req.sg->size;
-        r->req.aiocb = dma_bdrv_write(s->qdev.conf.bs, r->req.sg, r->sector,
-                                      scsi_dma_complete, r);
+        r->req.aiocb = dma_bdrv_io(s->qdev.conf.bs, r->req.sg, r->sector,
+                                   write_func, scsi_dma_complete, r,
+                                   DMA_DIRECTION_TO_DEVICE);
     } else {
         n = r->qiov.size / 512;
         bdrv_acct_start(s->qdev.conf.bs, &r->acct, n * BDRV_SECTOR_SIZE, BDRV_ACCT_WRITE);
-        r->req.aiocb = bdrv_aio_writev(s->qdev.conf.bs, r->sector, &r->qiov, n,
-                                       scsi_write_complete, r);
+        r->req.aiocb = write_func(s->qdev.conf.bs, r->sector, &r->qiov, n,
+                                  scsi_write_complete, r);
     }
 }
 
@@ -1449,60 +1505,34 @@ invalid_field:
     return;
 }
 
-typedef struct UnmapCBData {
-    SCSIDiskReq *r;
-    uint8_t *inbuf;
-    int count;
-} UnmapCBData;
-
 static void scsi_unmap_complete(void *opaque, int ret)
 {
-    UnmapCBData *data = opaque;
-    SCSIDiskReq *r = data->r;
-    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
-    uint64_t sector_num;
-    uint32_t nb_sectors;
+    SCSIDiskReq *r = opaque;
 
+    assert(r->req.aiocb != NULL);
     r->req.aiocb = NULL;
+
     if (ret < 0) {
         if (scsi_handle_rw_error(r, -ret)) {
             goto done;
         }
     }
 
-    if (data->count > 0 && !r->req.io_canceled) {
-        sector_num = ldq_be_p(&data->inbuf[0]);
-        nb_sectors = ldl_be_p(&data->inbuf[8]) & 0xffffffffULL;
-        if (sector_num > sector_num + nb_sectors ||
-            sector_num + nb_sectors - 1 > s->qdev.max_lba) {
-            scsi_check_condition(r, SENSE_CODE(LBA_OUT_OF_RANGE));
-            goto done;
-        }
-
-        r->req.aiocb = bdrv_aio_discard(s->qdev.conf.bs,
-                                        sector_num * (s->qdev.blocksize / 512),
-                                        nb_sectors * (s->qdev.blocksize / 512),
-                                        scsi_unmap_complete, data);
-        data->count--;
-        data->inbuf += 16;
-        return;
-    }
+    scsi_req_complete(&r->req, GOOD);
 
 done:
-    if (data->count == 0) {
-        scsi_req_complete(&r->req, GOOD);
-    }
     if (!r->req.io_canceled) {
         scsi_req_unref(&r->req);
     }
-    g_free(data);
 }
 
 static void scsi_disk_emulate_unmap(SCSIDiskReq *r, uint8_t *inbuf)
 {
+    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
     uint8_t *p = inbuf;
     int len = r->req.cmd.xfer;
-    UnmapCBData *data;
+    BlockDiscardRange *ranges;
+    int i, count;
 
     if (len < 8) {
         goto invalid_param_len;
@@ -1517,14 +1547,34 @@ static void scsi_disk_emulate_unmap(SCSIDiskReq *r, uint8_t *inbuf)
         goto invalid_param_len;
     }
 
-    data = g_new0(UnmapCBData, 1);
-    data->r = r;
-    data->inbuf = &p[8];
-    data->count = lduw_be_p(&p[2]) >> 4;
+    count = lduw_be_p(&p[2]) >> 4;
+    if (count == 0) {
+        scsi_req_complete(&r->req, GOOD);
+        return;
+    }
+
+    /* Check all descriptors first, then discard them as one request */
+    ranges = g_new(BlockDiscardRange, count);
+    for (i = 0; i < count; i++) {
+        uint64_t sector_num = ldq_be_p(&p[8 + i * 16]);
+        uint32_t nb_sectors = ldl_be_p(&p[8 + i * 16 + 8]) & 0xffffffffULL;
+
+        if (sector_num > sector_num + nb_sectors ||
+            sector_num + nb_sectors - 1 > s->qdev.max_lba) {
+            g_free(ranges);
+            scsi_check_condition(r, SENSE_CODE(LBA_OUT_OF_RANGE));
+            return;
+        }
+        ranges[i].sector_num = sector_num * (s->qdev.blocksize / 512);
+        ranges[i].nb_sectors = (int64_t)nb_sectors *
+                               (s->qdev.blocksize / 512);
+    }
 
-    /* The matching unref is in scsi_unmap_complete, before data is freed.  */
+    /* The matching unref is in scsi_unmap_complete.  */
     scsi_req_ref(&r->req);
-    scsi_unmap_complete(data, 0);
+    r->req.aiocb = bdrv_aio_discard_ranges(s->qdev.conf.bs, ranges, count,
+                                           scsi_unmap_complete, r);
+    g_free(ranges);
     return;
 
 invalid_param_len:
@@ -1952,8 +2002,15 @@ static void scsi_disk_reset(DeviceState *dev)
 static void scsi_destroy(SCSIDevice *dev)
 {
     SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, dev);
+    SCSIDiskReq *r;
 
+    s->destroying = true;
     scsi_device_purge_requests(&s->qdev, SENSE_CODE(NO_SENSE));
+    while ((r = s->free_reqs)) {
+        s->free_reqs = r->next_free;
+        g_free(r);
+    }
+    s->num_free_reqs = 0;
     blockdev_mark_auto_del(s->qdev.conf.bs);
 }
 
@@ -2124,6 +2181,7 @@ static const SCSIReqOps scsi_disk_emulate_reqops = {
     .read_data    = scsi_disk_emulate_read_data,
     .write_data   = scsi_disk_emulate_write_data,
     .get_buf      = scsi_get_buf,
+    .release      = scsi_disk_release_req,
 };
 
 static const SCSIReqOps scsi_disk_dma_reqops = {
@@ -2136,6 +2194,7 @@ static const SCSIReqOps scsi_disk_dma_reqops = {
     .get_buf      = scsi_get_buf,
     .load_request = scsi_disk_load_request,
     .save_request = scsi_disk_save_request,
+    .release      = scsi_disk_release_req,
 };
 
 static const SCSIReqOps *const scsi_disk_reqops_dispatch[256] = {
@@ -2191,7 +2250,7 @@ static SCSIRequest *scsi_new_request(SCSIDevice *d, uint32_t tag, uint32_t lun,
     if (!ops) {
         ops = &scsi_disk_emulate_reqops;
     }
-    req = scsi_req_alloc(ops, &s->qdev, tag, lun, hba_private);
+    req = scsi_disk_alloc_req(s, ops, tag, lun, hba_private);
 
 #ifdef DEBUG_SCSI
     DPRINTF("Command: lun=%d tag=0x%x data=0x%02x", lun, tag, buf[0]);
@@ -2322,8 +2381,8 @@ static SCSIRequest *scsi_block_new_request(SCSIDevice *d, uint32_t tag,
          * just make scsi-block operate the same as scsi-generic for them.
          */
         if (s->qdev.type != TYPE_ROM) {
-            return scsi_req_alloc(&scsi_disk_dma_reqops, &s->qdev, tag, lun,
-                                  hba_private);
+            return scsi_disk_alloc_req(s, &scsi_disk_dma_reqops, tag, lun,
+                                       hba_private);
         }
     }
 
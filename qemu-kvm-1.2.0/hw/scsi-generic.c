@@ -14,6 +14,7 @@
 #include "qemu-common.h"
 #include "qemu-error.h"
 #include "scsi.h"
+#include "dma.h"
 #include "blockdev.h"
 
 #ifdef __linux__
@@ -57,6 +58,12 @@ typedef struct SCSIGenericReq {
     int buflen;
     int len;
     sg_io_hdr_t io_header;
+
+    /* Guest memory the HBA's scatter/gather list maps to, if the
+     * transfer goes straight to it instead of through buf.  */
+    struct iovec *iov;
+    int niov;
+    size_t iov_size;
 } SCSIGenericReq;
 
 static void scsi_generic_save_request(QEMUFile *f, SCSIRequest *req)
@@ -86,6 +93,95 @@ static void scsi_free_request(SCSIRequest *req)
     SCSIGenericReq *r = DO_UPCAST(SCSIGenericReq, req, req);
 
     g_free(r->buf);
+    g_free(r->iov);
+}
+
+/* The data of these commands is looked at by QEMU, so it must stay in
+   the bounce buffer.  */
+static bool scsi_generic_snoops_data(SCSIGenericReq *r)
+{
+    SCSIDevice *s = r->req.dev;
+
+    switch (r->req.cmd.buf[0]) {
+    case READ_CAPACITY_10:
+        return true;
+    case SERVICE_ACTION_IN_16:
+        return (r->req.cmd.buf[1] & 31) == SAI_READ_CAPACITY_16;
+    case MODE_SELECT:
+        return s->type == TYPE_TAPE;
+    default:
+        return false;
+    }
+}
+
+static void scsi_generic_unmap_sg(SCSIGenericReq *r, size_t access_len)
+{
+    DMADirection dir = r->req.cmd.mode == SCSI_XFER_FROM_DEV ?
+        DMA_DIRECTION_FROM_DEVICE : DMA_DIRECTION_TO_DEVICE;
+    int i;
+
+    for (i = 0; i < r->niov; i++) {
+        size_t len = MIN(access_len, r->iov[i].iov_len);
+
+        dma_memory_unmap(r->req.sg->dma, r->iov[i].iov_base,
+                         r->iov[i].iov_len, dir, len);
+        access_len -= len;
+    }
+    r->niov = 0;
+    r->iov_size = 0;
+}
+
+/* Map the HBA's scatter/gather list so that SG_IO transfers directly
+   to and from guest memory.  Returns false if the bounce buffer has to
+   be used instead.  */
+static bool scsi_generic_map_sg(SCSIGenericReq *r)
+{
+    QEMUSGList *sg = r->req.sg;
+    DMADirection dir = r->req.cmd.mode == SCSI_XFER_FROM_DEV ?
+        DMA_DIRECTION_FROM_DEVICE : DMA_DIRECTION_TO_DEVICE;
+    size_t remaining = r->req.cmd.xfer;
+    int i;
+
+    if (!sg || sg->size < r->req.cmd.xfer || sg->nsg > IOV_MAX ||
+        scsi_generic_snoops_data(r)) {
+        return false;
+    }
+
+    if (!r->iov) {
+        r->iov = g_new(struct iovec, sg->nsg);
+    }
+    assert(r->niov == 0);
+    for (i = 0; i < sg->nsg && remaining > 0; i++) {
+        dma_addr_t len = MIN(sg->sg[i].len, remaining);
+        dma_addr_t mapped = len;
+        void *mem;
+
+        mem = dma_memory_map(sg->dma, sg->sg[i].base, &mapped, dir);
+        if (!mem) {
+            goto fail;
+        }
+        r->iov[r->niov].iov_base = mem;
+        r->iov[r->niov].iov_len = mapped;
+        r->niov++;
+        r->iov_size += mapped;
+        if (mapped < len) {
+            /* Bounce buffers are not good enough for us */
+            goto fail;
+        }
+        remaining -= len;
+    }
+    return true;
+
+fail:
+    scsi_generic_unmap_sg(r, 0);
+    return false;
+}
+
+static void scsi_generic_alloc_buf(SCSIGenericReq *r)
+{
+    if (!r->buf) {
+        r->buf = g_malloc0(r->buflen);
+    }
 }
 
 /* Helper function for command completion.  */
@@ -148,6 +244,9 @@ static void scsi_cancel_io(SCSIRequest *req)
     DPRINTF("Cancel tag=0x%x\n", req->tag);
     if (r->req.aiocb) {
         bdrv_aio_cancel(r->req.aiocb);
+        if (r->niov) {
+            scsi_generic_unmap_sg(r, 0);
+        }
 
         /* This reference was left in by scsi_*_data.  We take ownership of
          * it independent of whether bdrv_aio_cancel completes the request
@@ -163,21 +262,46 @@ static int execute_command(BlockDriverState *bdrv,
 {
     r->io_header.interface_id = 'S';
     r->io_header.dxfer_direction = direction;
-    r->io_header.dxferp = r->buf;
-    r->io_header.dxfer_len = r->buflen;
+    if (r->niov) {
+        r->io_header.iovec_count = r->niov;
+        r->io_header.dxferp = r->iov;
+        r->io_header.dxfer_len = r->iov_size;
+    } else {
+        r->io_header.iovec_count = 0;
+        r->io_header.dxferp = r->buf;
+        r->io_header.dxfer_len = r->buflen;
+    }
     r->io_header.cmdp = r->req.cmd.buf;
     r->io_header.cmd_len = r->req.cmd.len;
     r->io_header.mx_sb_len = sizeof(r->req.sense);
     r->io_header.sbp = r->req.sense;
     r->io_header.timeout = MAX_UINT;
     r->io_header.usr_ptr = r;
-    r->io_header.flags |= SG_FLAG_DIRECT_IO;
+    if (r->niov) {
+        r->io_header.flags &= ~SG_FLAG_DIRECT_IO;
+    } else {
+        r->io_header.flags |= SG_FLAG_DIRECT_IO;
+    }
 
     r->req.aiocb = bdrv_aio_ioctl(bdrv, SG_IO, &r->io_header, complete, r);
 
     return 0;
 }
 
+static void scsi_read_sg_complete(void *opaque, int ret)
+{
+    SCSIGenericReq *r = (SCSIGenericReq *)opaque;
+    int len;
+
+    r->req.aiocb = NULL;
+    len = ret ? 0 : r->io_header.dxfer_len - r->io_header.resid;
+    DPRINTF("Data transferred tag=0x%x len=%d\n", r->req.tag, len);
+    scsi_generic_unmap_sg(r, len);
+    r->req.resid = r->req.sg->size - len;
+    r->len = -1;
+    scsi_command_complete(r, ret);
+}
+
 static void scsi_read_complete(void * opaque, int ret)
 {
     SCSIGenericReq *r = (SCSIGenericReq *)opaque;
@@ -231,7 +355,14 @@ static void scsi_read_data(SCSIRequest *req)
         return;
     }
 
-    ret = execute_command(s->conf.bs, r, SG_DXFER_FROM_DEV, scsi_read_complete);
+    if (scsi_generic_map_sg(r)) {
+        ret = execute_command(s->conf.bs, r, SG_DXFER_FROM_DEV,
+                              scsi_read_sg_complete);
+    } else {
+        scsi_generic_alloc_buf(r);
+        ret = execute_command(s->conf.bs, r, SG_DXFER_FROM_DEV,
+                              scsi_read_complete);
+    }
     if (ret < 0) {
         scsi_command_complete(r, ret);
     }
@@ -244,6 +375,10 @@ static void scsi_write_complete(void * opaque, int ret)
 
     DPRINTF("scsi_write_complete() ret = %d\n", ret);
     r->req.aiocb = NULL;
+    if (r->niov) {
+        r->req.resid = r->req.sg->size - r->iov_size;
+        scsi_generic_unmap_sg(r, r->iov_size);
+    }
     if (ret) {
         DPRINTF("IO error\n");
         scsi_command_complete(r, ret);
@@ -268,7 +403,11 @@ static void scsi_write_data(SCSIRequest *req)
     int ret;
 
     DPRINTF("scsi_write_data 0x%x\n", req->tag);
-    if (r->len == 0) {
+    if (r->len == 0 && scsi_generic_map_sg(r)) {
+        /* The data is already in place, send the command right away */
+        r->len = r->req.cmd.xfer;
+    } else if (r->len == 0) {
+        scsi_generic_alloc_buf(r);
         r->len = r->buflen;
         scsi_req_data(&r->req, r->len);
         return;
@@ -329,14 +468,22 @@ static int32_t scsi_send_command(SCSIRequest *req, uint8_t *cmd)
         return 0;
     }
 
-    if (r->buflen != r->req.cmd.xfer) {
-        if (r->buf != NULL)
-            g_free(r->buf);
-        r->buf = g_malloc(r->req.cmd.xfer);
+    if (r->req.sg && !scsi_generic_snoops_data(r)) {
+        /* The transfer will most likely go straight to guest memory, so
+         * the bounce buffer is only allocated if mapping it fails.  */
+        g_free(r->buf);
+        r->buf = NULL;
         r->buflen = r->req.cmd.xfer;
-    }
+    } else {
+        if (r->buflen != r->req.cmd.xfer) {
+            if (r->buf != NULL)
+                g_free(r->buf);
+            r->buf = g_malloc(r->req.cmd.xfer);
+            r->buflen = r->req.cmd.xfer;
+        }
 
-    memset(r->buf, 0, r->buflen);
+        memset(r->buf, 0, r->buflen);
+    }
     r->len = r->req.cmd.xfer;
     if (r->req.cmd.mode == SCSI_XFER_TO_DEV) {
         r->len = 0;
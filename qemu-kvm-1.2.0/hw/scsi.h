@@ -59,6 +59,8 @@ struct SCSIRequest {
     bool retry;
     void *hba_private;
     QTAILQ_ENTRY(SCSIRequest) next;
+    size_t pool_size;       /* size of the allocation made by scsi-bus */
+    SCSIRequest *next_free;
 };
 
 #define TYPE_SCSI_DEVICE "scsi-device"
@@ -95,6 +97,9 @@ struct SCSIDevice
     int blocksize;
     int type;
     uint64_t max_lba;
+    SCSIRequest *free_reqs; /* released requests allocated by scsi-bus */
+    unsigned int num_free_reqs;
+    bool destroying; /* the free list is gone, free requests directly */
 };
 
 extern const VMStateDescription vmstate_scsi_device;
@@ -123,6 +128,9 @@ struct SCSIReqOps {
 
     void (*save_request)(QEMUFile *f, SCSIRequest *req);
     void (*load_request)(QEMUFile *f, SCSIRequest *req);
+
+    /* Gives back memory set up with scsi_req_init; g_free if NULL */
+    void (*release)(SCSIRequest *req);
 };
 
 struct SCSIBusInfo {
@@ -222,6 +230,8 @@ int scsi_sense_valid(SCSISense sense);
 int scsi_build_sense(uint8_t *in_buf, int in_len,
                      uint8_t *buf, int len, bool fixed);
 
+void scsi_req_init(SCSIRequest *req, const SCSIReqOps *reqops, SCSIDevice *d,
+                   uint32_t tag, uint32_t lun, void *hba_private);
 SCSIRequest *scsi_req_alloc(const SCSIReqOps *reqops, SCSIDevice *d,
                             uint32_t tag, uint32_t lun, void *hba_private);
 SCSIRequest *scsi_req_new(SCSIDevice *d, uint32_t tag, uint32_t lun,
@@ -139,6 +139,7 @@ struct SerialState {
     int it_shift;
     int baudbase;
     int tsr_retry;
+    Notifier write_notifier;            /* backend drained its output buffer */
     uint32_t wakeup;
 
     uint64_t last_xmit_ts;              /* Time when the last byte was successfully sent out of the tsr */
@@ -367,6 +368,16 @@ static void serial_xmit(void *opaque)
 }
 
 
+/* The backend has room again, retry the byte in the tsr right away */
+static void serial_write_ready(Notifier *notifier, void *data)
+{
+    SerialState *s = container_of(notifier, SerialState, write_notifier);
+
+    if (s->tsr_retry > 0) {
+        qemu_mod_timer(s->transmit_timer, qemu_get_clock_ns(vm_clock));
+    }
+}
+
 static void serial_ioport_write(void *opaque, uint32_t addr, uint32_t val)
 {
     SerialState *s = opaque;
@@ -752,6 +763,8 @@ static void serial_init_core(SerialState *s)
 
     qemu_chr_add_handlers(s->chr, serial_can_receive1, serial_receive1,
                           serial_event, s);
+    s->write_notifier.notify = serial_write_ready;
+    qemu_chr_fe_add_write_notifier(s->chr, &s->write_notifier);
 }
 
 /* Change the main reference oscillator frequency. */
@@ -92,6 +92,56 @@ static target_ulong compute_tlbie_rb(target_ulong v, target_ulong r,
     return rb;
 }
 
+/*
+ * tlbie on a 64-bit hash MMU flushes the whole softmmu TLB, because the
+ * TLB is indexed by effective address and an HPTE only gives the virtual
+ * one.  For a 4k page in a 256M segment, the HPTE and its index hold the
+ * whole virtual page number, so look up the effective addresses mapping
+ * it in the SLB and flush just those pages.  Returns false if the whole
+ * TLB has to be flushed instead: large pages, 1T segments, or no SLB
+ * entry for the segment (it might have been replaced without a flush).
+ */
+static bool flush_hpte_pages(CPUPPCState *env, target_ulong v,
+                             target_ulong ptex)
+{
+    uint64_t vsid, page, va_low;
+    bool found = false;
+    int n;
+
+    if (v & (HPTE_V_LARGE | HPTE_V_1TB_SEG)) {
+        return false;
+    }
+
+    vsid = (v >> 12) & (SLB_VSID_VSID >> SLB_VSID_SHIFT);
+    va_low = ptex >> 3;
+    if (v & HPTE_V_SECONDARY) {
+        va_low = ~va_low;
+    }
+    va_low = (va_low ^ vsid) & 0x7ff;
+    page = (((v >> HPTE_V_AVPN_SHIFT) & 0x1f) << 11) | va_low;
+
+    for (n = 0; n < env->slb_nr; n++) {
+        ppc_slb_t *slb = &env->slb[n];
+
+        if (!(slb->esid & SLB_ESID_V) ||
+            (slb->vsid & SLB_VSID_B) != SLB_VSID_B_256M ||
+            ((slb->vsid & SLB_VSID_VSID) >> SLB_VSID_SHIFT) != vsid) {
+            continue;
+        }
+        tlb_flush_page(env, (slb->esid & SLB_ESID_ESID) | (page << 12));
+        found = true;
+    }
+    return found;
+}
+
+static void invalidate_hpte(CPUPPCState *env, target_ulong v, target_ulong r,
+                            target_ulong ptex)
+{
+    if (!flush_hpte_pages(env, v, ptex)) {
+        ppc_tlb_invalidate_one(env, compute_tlbie_rb(v, r, ptex));
+    }
+}
+
 static target_ulong h_enter(CPUPPCState *env, sPAPREnvironment *spapr,
                             target_ulong opcode, target_ulong *args)
 {
@@ -181,13 +231,14 @@ enum {
     REMOVE_HW = 3,
 };
 
+/* The caller invalidates the TLB for removed entries */
 static target_ulong remove_hpte(CPUPPCState *env, target_ulong ptex,
                                 target_ulong avpn,
                                 target_ulong flags,
                                 target_ulong *vp, target_ulong *rp)
 {
     uint8_t *hpte;
-    target_ulong v, r, rb;
+    target_ulong v, r;
 
     if ((ptex * HASH_PTE_SIZE_64) & ~env->htab_mask) {
         return REMOVE_PARM;
@@ -213,8 +264,6 @@ static target_ulong remove_hpte(CPUPPCState *env, target_ulong ptex,
     *vp = v & ~HPTE_V_HVLOCK;
     *rp = r;
     stq_p(hpte, 0);
-    rb = compute_tlbie_rb(v, r, ptex);
-    ppc_tlb_invalidate_one(env, rb);
     assert(!(ldq_p(hpte) & HPTE_V_HVLOCK));
     return REMOVE_SUCCESS;
 }
@@ -232,6 +281,7 @@ static target_ulong h_remove(CPUPPCState *env, sPAPREnvironment *spapr,
 
     switch (ret) {
     case REMOVE_SUCCESS:
+        invalidate_hpte(env, args[0], args[1], pte_index);
         return H_SUCCESS;
 
     case REMOVE_NOT_FOUND:
@@ -265,9 +315,15 @@ static target_ulong h_remove(CPUPPCState *env, sPAPREnvironment *spapr,
 
 #define H_BULK_REMOVE_MAX_BATCH        4
 
+/*
+ * Removed entries are invalidated page by page where possible, otherwise
+ * with a single TLB flush once the whole batch is done.
+ */
 static target_ulong h_bulk_remove(CPUPPCState *env, sPAPREnvironment *spapr,
                                   target_ulong opcode, target_ulong *args)
 {
+    target_ulong rc = H_SUCCESS;
+    bool flush_all = false;
     int i;
 
     for (i = 0; i < H_BULK_REMOVE_MAX_BATCH; i++) {
@@ -278,7 +334,8 @@ static target_ulong h_bulk_remove(CPUPPCState *env, sPAPREnvironment *spapr,
         if ((*tsh & H_BULK_REMOVE_TYPE) == H_BULK_REMOVE_END) {
             break;
         } else if ((*tsh & H_BULK_REMOVE_TYPE) != H_BULK_REMOVE_REQUEST) {
-            return H_PARAMETER;
+            rc = H_PARAMETER;
+            break;
         }
 
         *tsh &= H_BULK_REMOVE_PTEX | H_BULK_REMOVE_FLAGS;
@@ -286,7 +343,8 @@ static target_ulong h_bulk_remove(CPUPPCState *env, sPAPREnvironment *spapr,
 
         if ((*tsh & H_BULK_REMOVE_ANDCOND) && (*tsh & H_BULK_REMOVE_AVPN)) {
             *tsh |= H_BULK_REMOVE_PARM;
-            return H_PARAMETER;
+            rc = H_PARAMETER;
+            break;
         }
 
         ret = remove_hpte(env, *tsh & H_BULK_REMOVE_PTEX, tsl,
@@ -295,20 +353,26 @@ static target_ulong h_bulk_remove(CPUPPCState *env, sPAPREnvironment *spapr,
 
         *tsh |= ret << 60;
 
-        switch (ret) {
-        case REMOVE_SUCCESS:
+        if (ret == REMOVE_SUCCESS) {
             *tsh |= (r & (HPTE_R_C | HPTE_R_R)) << 43;
+            if (!flush_all) {
+                flush_all = !flush_hpte_pages(env, v,
+                                              *tsh & H_BULK_REMOVE_PTEX);
+            }
+        } else if (ret == REMOVE_PARM) {
+            rc = H_PARAMETER;
+            break;
+        } else if (ret == REMOVE_HW) {
+            rc = H_HARDWARE;
             break;
-
-        case REMOVE_PARM:
-            return H_PARAMETER;
-
-        case REMOVE_HW:
-            return H_HARDWARE;
         }
     }
 
-    return H_SUCCESS;
+    /* entries removed before an error must not stay in the TLB either */
+    if (flush_all) {
+        tlb_flush(env, 1);
+    }
+    return rc;
 }
 
 static target_ulong h_protect(CPUPPCState *env, sPAPREnvironment *spapr,
@@ -318,7 +382,7 @@ static target_ulong h_protect(CPUPPCState *env, sPAPREnvironment *spapr,
     target_ulong pte_index = args[1];
     target_ulong avpn = args[2];
     uint8_t *hpte;
-    target_ulong v, r, rb;
+    target_ulong v, r;
 
     if ((pte_index * HASH_PTE_SIZE_64) & ~env->htab_mask) {
         return H_PARAMETER;
@@ -346,9 +410,8 @@ static target_ulong h_protect(CPUPPCState *env, sPAPREnvironment *spapr,
     r |= (flags << 55) & HPTE_R_PP0;
     r |= (flags << 48) & HPTE_R_KEY_HI;
     r |= flags & (HPTE_R_PP | HPTE_R_N | HPTE_R_KEY_LO);
-    rb = compute_tlbie_rb(v, r, pte_index);
     stq_p(hpte, v & ~HPTE_V_VALID);
-    ppc_tlb_invalidate_one(env, rb);
+    invalidate_hpte(env, v & ~HPTE_V_HVLOCK, r, pte_index);
     stq_p(hpte + (HASH_PTE_SIZE_64/2), r);
     /* Don't need a memory barrier, due to qemu's global lock */
     stq_p(hpte, v & ~HPTE_V_HVLOCK);
@@ -26,7 +26,9 @@
  */
 #include "hw.h"
 #include "net.h"
+#include "net/checksum.h"
 #include "hw/qdev.h"
+#include "hw/virtio-net.h"
 #include "hw/spapr.h"
 #include "hw/spapr_vio.h"
 
@@ -71,7 +73,36 @@ typedef uint64_t vlan_bd_t;
 #define VLAN_RXQ_BD_OFF      0
 #define VLAN_FILTER_BD_OFF   8
 #define VLAN_RX_BDS_OFF      16
-#define VLAN_MAX_BUFS        ((SPAPR_TCE_PAGE_SIZE - VLAN_RX_BDS_OFF) / 8)
+
+/* H_ILLAN_ATTRIBUTES bits */
+#define VLAN_ATTR_PADDED_PKT_CSUM 0x0000000000002000ULL
+#define VLAN_ATTR_IPV4_TCP_CSUM   0x0000000000000002ULL
+#define VLAN_ATTR_SETTABLE        VLAN_ATTR_IPV4_TCP_CSUM
+
+/*
+ * Receive buffers are kept here rather than in the guest's buffer list
+ * page, grouped by size (the guest driver uses a handful of sizes), so
+ * that finding one for a frame takes no scan of guest memory.
+ */
+#define VLAN_RX_POOLS        5
+#define VLAN_RX_POOL_BDS     4096
+
+typedef struct VLANRxPool {
+    uint32_t bufsize;
+    int count;
+    vlan_bd_t bds[VLAN_RX_POOL_BDS];
+} VLANRxPool;
+
+/* Frames sent with consecutive hcalls, for backends that take batches */
+#define VLAN_TX_BATCH        32
+
+typedef struct VLANTxBatch {
+    uint8_t data[MAX_PACKET_SIZE];
+    uint32_t used;
+    int count;
+    struct iovec iov[VLAN_TX_BATCH];
+    NetBatchPacket pkts[VLAN_TX_BATCH];
+} VLANTxBatch;
 
 typedef struct VIOsPAPRVLANDevice {
     VIOsPAPRDevice sdev;
@@ -79,8 +110,13 @@ typedef struct VIOsPAPRVLANDevice {
     NICState *nic;
     int isopen;
     target_ulong buf_list;
-    int add_buf_ptr, use_buf_ptr, rx_bufs;
+    int rx_bufs;
     target_ulong rxq_ptr;
+    VLANRxPool *rx_pool[VLAN_RX_POOLS];   /* sorted by bufsize */
+    uint64_t attr;
+    bool has_vnet_hdr;
+    VLANTxBatch *tx_batch;
+    QEMUBH *tx_bh;
 } VIOsPAPRVLANDevice;
 
 static int spapr_vlan_can_receive(NetClientState *nc)
@@ -90,6 +126,90 @@ static int spapr_vlan_can_receive(NetClientState *nc)
     return (dev->isopen && dev->rx_bufs > 0);
 }
 
+static void spapr_vlan_flush_tx(VIOsPAPRVLANDevice *dev)
+{
+    VLANTxBatch *b = dev->tx_batch;
+
+    if (b->count) {
+        qemu_sendv_batch_async(&dev->nic->nc, b->pkts, b->count, NULL);
+        b->count = 0;
+        b->used = 0;
+    }
+}
+
+static void spapr_vlan_tx_bh(void *opaque)
+{
+    spapr_vlan_flush_tx(opaque);
+}
+
+static void spapr_vlan_clear_rx_pools(VIOsPAPRVLANDevice *dev)
+{
+    int i;
+
+    for (i = 0; i < VLAN_RX_POOLS; i++) {
+        dev->rx_pool[i]->bufsize = 0;
+        dev->rx_pool[i]->count = 0;
+    }
+    dev->rx_bufs = 0;
+}
+
+/* Take the smallest buffer that holds size bytes out of its pool */
+static vlan_bd_t spapr_vlan_get_rx_bd(VIOsPAPRVLANDevice *dev, size_t size)
+{
+    VLANRxPool *pool;
+    int i;
+
+    for (i = 0; i < VLAN_RX_POOLS; i++) {
+        pool = dev->rx_pool[i];
+        if (pool->count && pool->bufsize >= size) {
+            dev->rx_bufs--;
+            return pool->bds[--pool->count];
+        }
+    }
+    return 0;
+}
+
+static int spapr_vlan_add_rx_bd(VIOsPAPRVLANDevice *dev, vlan_bd_t bd)
+{
+    uint32_t size = VLAN_BD_LEN(bd);
+    VLANRxPool *pool = NULL;
+    int i;
+
+    for (i = 0; i < VLAN_RX_POOLS; i++) {
+        if (dev->rx_pool[i]->bufsize == size) {
+            pool = dev->rx_pool[i];
+            break;
+        }
+    }
+    if (!pool) {
+        /* reuse an empty pool for the new size and keep the order */
+        for (i = 0; i < VLAN_RX_POOLS; i++) {
+            if (dev->rx_pool[i]->count == 0) {
+                pool = dev->rx_pool[i];
+                break;
+            }
+        }
+        if (!pool) {
+            return -1;
+        }
+        pool->bufsize = size;
+        for (; i > 0 && dev->rx_pool[i - 1]->bufsize > size; i--) {
+            dev->rx_pool[i] = dev->rx_pool[i - 1];
+        }
+        for (; i < VLAN_RX_POOLS - 1 &&
+               dev->rx_pool[i + 1]->bufsize < size; i++) {
+            dev->rx_pool[i] = dev->rx_pool[i + 1];
+        }
+        dev->rx_pool[i] = pool;
+    }
+    if (pool->count == VLAN_RX_POOL_BDS) {
+        return -1;
+    }
+    pool->bds[pool->count++] = bd;
+    dev->rx_bufs++;
+    return 0;
+}
+
 static ssize_t spapr_vlan_receive(NetClientState *nc, const uint8_t *buf,
                                   size_t size)
 {
@@ -97,9 +217,11 @@ static ssize_t spapr_vlan_receive(NetClientState *nc, const uint8_t *buf,
     VIOsPAPRVLANDevice *dev = (VIOsPAPRVLANDevice *)sdev;
     vlan_bd_t rxq_bd = vio_ldq(sdev, dev->buf_list + VLAN_RXQ_BD_OFF);
     vlan_bd_t bd;
-    int buf_ptr = dev->use_buf_ptr;
     uint64_t handle;
     uint8_t control;
+    size_t hdr_len = dev->has_vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
+    const struct virtio_net_hdr *hdr = (const struct virtio_net_hdr *)buf;
+    size_t full_size = size;
 
     dprintf("spapr_vlan_receive() [%s] rx_bufs=%d\n", sdev->qdev.id,
             dev->rx_bufs);
@@ -112,29 +234,21 @@ static ssize_t spapr_vlan_receive(NetClientState *nc, const uint8_t *buf,
         return -1;
     }
 
-    do {
-        buf_ptr += 8;
-        if (buf_ptr >= SPAPR_TCE_PAGE_SIZE) {
-            buf_ptr = VLAN_RX_BDS_OFF;
-        }
-
-        bd = vio_ldq(sdev, dev->buf_list + buf_ptr);
-        dprintf("use_buf_ptr=%d bd=0x%016llx\n",
-                buf_ptr, (unsigned long long)bd);
-    } while ((!(bd & VLAN_BD_VALID) || (VLAN_BD_LEN(bd) < (size + 8)))
-             && (buf_ptr != dev->use_buf_ptr));
+    /* Receive offloads stay disabled on the peer, only DATA_VALID is used */
+    if (size < hdr_len) {
+        return size;
+    }
+    buf += hdr_len;
+    size -= hdr_len;
 
-    if (!(bd & VLAN_BD_VALID) || (VLAN_BD_LEN(bd) < (size + 8))) {
+    bd = spapr_vlan_get_rx_bd(dev, size + 8);
+    if (!bd) {
         /* Failed to find a suitable buffer */
         return -1;
     }
 
-    /* Remove the buffer from the pool */
-    dev->rx_bufs--;
-    dev->use_buf_ptr = buf_ptr;
-    vio_stq(sdev, dev->buf_list + dev->use_buf_ptr, 0);
-
-    dprintf("Found buffer: ptr=%d num=%d\n", dev->use_buf_ptr, dev->rx_bufs);
+    dprintf("Found buffer: bd=0x%016llx num=%d\n", (unsigned long long)bd,
+            dev->rx_bufs);
 
     /* Transfer the packet data */
     if (spapr_vio_dma_write(sdev, VLAN_BD_ADDR(bd) + 8, buf, size) < 0) {
@@ -148,6 +262,9 @@ static ssize_t spapr_vlan_receive(NetClientState *nc, const uint8_t *buf,
     if (rxq_bd & VLAN_BD_TOGGLE) {
         control ^= VLAN_RXQC_TOGGLE;
     }
+    if (hdr_len && (hdr->flags & VIRTIO_NET_HDR_F_DATA_VALID)) {
+        control |= VLAN_RXQC_CSUM_GOOD;
+    }
 
     handle = vio_ldq(sdev, VLAN_BD_ADDR(bd));
     vio_stq(sdev, VLAN_BD_ADDR(rxq_bd) + dev->rxq_ptr + 8, handle);
@@ -172,7 +289,7 @@ static ssize_t spapr_vlan_receive(NetClientState *nc, const uint8_t *buf,
         qemu_irq_pulse(spapr_vio_qirq(sdev));
     }
 
-    return size;
+    return full_size;
 }
 
 static NetClientInfo net_spapr_vlan_info = {
@@ -186,14 +303,17 @@ static void spapr_vlan_reset(VIOsPAPRDevice *sdev)
 {
     VIOsPAPRVLANDevice *dev = DO_UPCAST(VIOsPAPRVLANDevice, sdev, sdev);
 
+    spapr_vlan_flush_tx(dev);
     dev->buf_list = 0;
-    dev->rx_bufs = 0;
+    spapr_vlan_clear_rx_pools(dev);
+    dev->attr = 0;
     dev->isopen = 0;
 }
 
 static int spapr_vlan_init(VIOsPAPRDevice *sdev)
 {
     VIOsPAPRVLANDevice *dev = (VIOsPAPRVLANDevice *)sdev;
+    int i;
 
     qemu_macaddr_default_if_unset(&dev->nicconf.macaddr);
 
@@ -201,6 +321,18 @@ static int spapr_vlan_init(VIOsPAPRDevice *sdev)
                             object_get_typename(OBJECT(sdev)), sdev->qdev.id, dev);
     qemu_format_nic_info_str(&dev->nic->nc, dev->nicconf.macaddr.a);
 
+    if (qemu_has_vnet_hdr(dev->nic->nc.peer)) {
+        dev->has_vnet_hdr = true;
+        qemu_using_vnet_hdr(dev->nic->nc.peer, 1);
+        qemu_set_offload(dev->nic->nc.peer, 0, 0, 0, 0, 0);
+    }
+
+    for (i = 0; i < VLAN_RX_POOLS; i++) {
+        dev->rx_pool[i] = g_new0(VLANRxPool, 1);
+    }
+    dev->tx_batch = g_new0(VLANTxBatch, 1);
+    dev->tx_bh = qemu_bh_new(spapr_vlan_tx_bh, dev);
+
     return 0;
 }
 
@@ -315,9 +447,7 @@ static target_ulong h_register_logical_lan(CPUPPCState *env,
     vio_stq(sdev, buf_list + 8, filter_list_bd);
     spapr_vio_dma_set(sdev, buf_list + VLAN_RX_BDS_OFF, 0,
                       SPAPR_TCE_PAGE_SIZE - VLAN_RX_BDS_OFF);
-    dev->add_buf_ptr = VLAN_RX_BDS_OFF - 8;
-    dev->use_buf_ptr = VLAN_RX_BDS_OFF - 8;
-    dev->rx_bufs = 0;
+    spapr_vlan_clear_rx_pools(dev);
     dev->rxq_ptr = 0;
 
     /* Initialize the receive queue */
@@ -358,7 +488,6 @@ static target_ulong h_add_logical_lan_buffer(CPUPPCState *env,
     target_ulong buf = args[1];
     VIOsPAPRDevice *sdev = spapr_vio_find_by_reg(spapr->vio_bus, reg);
     VIOsPAPRVLANDevice *dev = (VIOsPAPRVLANDevice *)sdev;
-    vlan_bd_t bd;
 
     dprintf("H_ADD_LOGICAL_LAN_BUFFER(0x" TARGET_FMT_lx
             ", 0x" TARGET_FMT_lx ")\n", reg, buf);
@@ -368,34 +497,68 @@ static target_ulong h_add_logical_lan_buffer(CPUPPCState *env,
         return H_PARAMETER;
     }
 
-    if ((check_bd(dev, buf, 4) < 0)
+    if (!(buf & VLAN_BD_VALID) || (check_bd(dev, buf, 4) < 0)
         || (VLAN_BD_LEN(buf) < 16)) {
         hcall_dprintf("Bad buffer enqueued\n");
         return H_PARAMETER;
     }
 
-    if (!dev->isopen || dev->rx_bufs >= VLAN_MAX_BUFS) {
+    if (!dev->isopen || spapr_vlan_add_rx_bd(dev, buf) < 0) {
         return H_RESOURCE;
     }
 
-    do {
-        dev->add_buf_ptr += 8;
-        if (dev->add_buf_ptr >= SPAPR_TCE_PAGE_SIZE) {
-            dev->add_buf_ptr = VLAN_RX_BDS_OFF;
-        }
+    dprintf("h_add_logical_lan_buffer():  Added buf  rx_bufs=%d"
+            " bd=0x%016llx\n", dev->rx_bufs, (unsigned long long)buf);
 
-        bd = vio_ldq(sdev, dev->buf_list + dev->add_buf_ptr);
-    } while (bd & VLAN_BD_VALID);
+    return H_SUCCESS;
+}
 
-    vio_stq(sdev, dev->buf_list + dev->add_buf_ptr, buf);
+/*
+ * The guest left the TCP/UDP checksum of an IPv4 frame to us, with the
+ * field zeroed.  Have the peer compute it if it takes vnet headers,
+ * otherwise do it here.
+ */
+static void spapr_vlan_tx_csum(VIOsPAPRVLANDevice *dev,
+                               struct virtio_net_hdr *hdr,
+                               uint8_t *buf, unsigned len)
+{
+    unsigned hlen, plen, csum_offset;
+    uint32_t sum;
+    uint16_t phsum;
 
-    dev->rx_bufs++;
+    if (len < 14 + 20 || buf[12] != 0x08 || buf[13] != 0x00 ||
+        (buf[14] & 0xf0) != 0x40) {
+        return;
+    }
+    hlen = (buf[14] & 0x0f) * 4;
+    plen = ((buf[16] << 8) | buf[17]) - hlen;
+    switch (buf[23]) {
+    case 6:     /* TCP */
+        csum_offset = 16;
+        break;
+    case 17:    /* UDP */
+        csum_offset = 6;
+        break;
+    default:
+        return;
+    }
+    if (hlen < 20 || plen < csum_offset + 2 || 14 + hlen + plen > len) {
+        return;
+    }
 
-    dprintf("h_add_logical_lan_buffer():  Added buf  ptr=%d  rx_bufs=%d"
-            " bd=0x%016llx\n", dev->add_buf_ptr, dev->rx_bufs,
-            (unsigned long long)buf);
+    /* the peer sums up to the end of the frame, so not with padding */
+    if (!dev->has_vnet_hdr || 14 + hlen + plen != len) {
+        net_checksum_calculate(buf, len);
+        return;
+    }
 
-    return H_SUCCESS;
+    sum = net_checksum_add(8, buf + 14 + 12) + buf[23] + plen;
+    phsum = ~net_checksum_finish(sum);
+    buf[14 + hlen + csum_offset] = phsum >> 8;
+    buf[14 + hlen + csum_offset + 1] = phsum & 0xff;
+    hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr->csum_start = 14 + hlen;
+    hdr->csum_offset = csum_offset;
 }
 
 static target_ulong h_send_logical_lan(CPUPPCState *env, sPAPREnvironment *spapr,
@@ -406,8 +569,13 @@ static target_ulong h_send_logical_lan(CPUPPCState *env, sPAPREnvironment *spapr
     target_ulong continue_token = args[7];
     VIOsPAPRDevice *sdev = spapr_vio_find_by_reg(spapr->vio_bus, reg);
     VIOsPAPRVLANDevice *dev = (VIOsPAPRVLANDevice *)sdev;
-    unsigned total_len;
+    NetClientState *peer;
+    VLANTxBatch *b;
+    struct virtio_net_hdr hdr;
+    struct iovec iov[2];
+    unsigned total_len, hdr_len;
     uint8_t *lbuf, *p;
+    bool batch;
     int i, nbufs;
     int ret;
 
@@ -450,7 +618,26 @@ static target_ulong h_send_logical_lan(CPUPPCState *env, sPAPREnvironment *spapr
         return H_RESOURCE;
     }
 
-    lbuf = alloca(total_len);
+    /*
+     * Frames of consecutive hcalls are collected and handed to backends
+     * that take batches from a bottom half; copying them is needed anyway.
+     */
+    peer = dev->nic->nc.peer;
+    b = dev->tx_batch;
+    hdr_len = dev->has_vnet_hdr ? sizeof(hdr) : 0;
+    batch = peer && peer->info->receive_batch &&
+            hdr_len + total_len <= sizeof(b->data);
+    if (batch) {
+        if (b->count == VLAN_TX_BATCH ||
+            b->used + hdr_len + total_len > sizeof(b->data)) {
+            spapr_vlan_flush_tx(dev);
+        }
+        lbuf = b->data + b->used + hdr_len;
+    } else {
+        spapr_vlan_flush_tx(dev);
+        lbuf = alloca(total_len);
+    }
+
     p = lbuf;
     for (i = 0; i < nbufs; i++) {
         ret = spapr_vio_dma_read(sdev, VLAN_BD_ADDR(bufs[i]),
@@ -462,8 +649,53 @@ static target_ulong h_send_logical_lan(CPUPPCState *env, sPAPREnvironment *spapr
         p += VLAN_BD_LEN(bufs[i]);
     }
 
-    qemu_send_packet(&dev->nic->nc, lbuf, total_len);
+    memset(&hdr, 0, sizeof(hdr));
+    if ((dev->attr & VLAN_ATTR_IPV4_TCP_CSUM) && (bufs[0] & VLAN_BD_NO_CSUM)) {
+        spapr_vlan_tx_csum(dev, &hdr, lbuf, total_len);
+    }
+
+    if (!batch) {
+        iov[0].iov_base = &hdr;
+        iov[0].iov_len = hdr_len;
+        iov[1].iov_base = lbuf;
+        iov[1].iov_len = total_len;
+        qemu_sendv_packet(&dev->nic->nc, hdr_len ? iov : iov + 1,
+                          hdr_len ? 2 : 1);
+        return H_SUCCESS;
+    }
+
+    memcpy(lbuf - hdr_len, &hdr, hdr_len);
+    b->iov[b->count].iov_base = lbuf - hdr_len;
+    b->iov[b->count].iov_len = hdr_len + total_len;
+    b->pkts[b->count].iov = &b->iov[b->count];
+    b->pkts[b->count].iovcnt = 1;
+    b->used += hdr_len + total_len;
+    b->count++;
+    qemu_bh_schedule(dev->tx_bh);
+
+    return H_SUCCESS;
+}
+
+static target_ulong h_illan_attributes(CPUPPCState *env,
+                                       sPAPREnvironment *spapr,
+                                       target_ulong opcode, target_ulong *args)
+{
+    target_ulong reg = args[0];
+    target_ulong reset_mask = args[1];
+    target_ulong set_mask = args[2];
+    VIOsPAPRDevice *sdev = spapr_vio_find_by_reg(spapr->vio_bus, reg);
+    VIOsPAPRVLANDevice *dev = (VIOsPAPRVLANDevice *)sdev;
+
+    if (!dev) {
+        return H_PARAMETER;
+    }
+
+    if ((reset_mask | set_mask) & ~VLAN_ATTR_SETTABLE) {
+        return H_PARAMETER;
+    }
 
+    dev->attr = (dev->attr & ~reset_mask) | set_mask;
+    args[0] = dev->attr | VLAN_ATTR_PADDED_PKT_CSUM;
     return H_SUCCESS;
 }
 
@@ -517,6 +749,7 @@ static void spapr_vlan_register_types(void)
     spapr_register_hypercall(H_ADD_LOGICAL_LAN_BUFFER,
                              h_add_logical_lan_buffer);
     spapr_register_hypercall(H_MULTICAST_CTRL, h_multicast_ctrl);
+    spapr_register_hypercall(H_ILLAN_ATTRIBUTES, h_illan_attributes);
     type_register_static(&spapr_vlan_info);
 }
 
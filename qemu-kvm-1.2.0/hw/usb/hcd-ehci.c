@@ -432,7 +432,14 @@ struct EHCIState {
     QEMUSGList isgl;
 
     uint64_t last_run_ns;
+    /*
+     * Extra frames to wait before the next frame timer tick.  Grows while
+     * neither schedule has anything to do, including a periodic schedule
+     * whose interrupt endpoints only NAK.
+     */
     uint32_t async_stepdown;
+    uint32_t periodic_busy;
+    uint64_t frame_wakeups;
 };
 
 #define SET_LAST_RUN_CLOCK(s) \
@@ -1051,6 +1058,9 @@ static void ehci_reset(void *opaque)
     qemu_bh_cancel(s->async_bh);
 }
 
+static void ehci_idle_catch_up(EHCIState *ehci);
+static void ehci_kick(EHCIState *ehci);
+
 static uint32_t ehci_mem_readb(void *ptr, target_phys_addr_t addr)
 {
     EHCIState *s = ptr;
@@ -1076,6 +1086,10 @@ static uint32_t ehci_mem_readl(void *ptr, target_phys_addr_t addr)
     EHCIState *s = ptr;
     uint32_t val;
 
+    if (addr == FRINDEX) {
+        ehci_idle_catch_up(s);
+    }
+
     val = s->mmio[addr] | (s->mmio[addr+1] << 8) |
           (s->mmio[addr+2] << 16) | (s->mmio[addr+3] << 24);
 
@@ -1189,6 +1203,7 @@ static void ehci_mem_writel(void *ptr, target_phys_addr_t addr, uint32_t val)
         return;
     }
 
+    ehci_kick(s);
 
     /* Do any register specific pre-write processing here.  */
     switch(addr) {
@@ -1441,6 +1456,8 @@ static void ehci_async_complete_packet(USBPort *port, USBPacket *packet)
 
     if (p->queue->async) {
         qemu_bh_schedule(p->queue->ehci->async_bh);
+    } else {
+        ehci_kick(p->queue->ehci);
     }
 }
 
@@ -1590,6 +1607,7 @@ static int ehci_process_itd(EHCIState *ehci,
 
     for(i = 0; i < 8; i++) {
         if (itd->transact[i] & ITD_XACT_ACTIVE) {
+            ehci->periodic_busy = 1;
             pg   = get_field(itd->transact[i], ITD_XACT_PGSEL);
             off  = itd->transact[i] & ITD_XACT_OFFSET_MASK;
             ptr1 = (itd->bufptr[pg] & ITD_BUFPTR_MASK);
@@ -2131,6 +2149,9 @@ static int ehci_state_executing(EHCIQueue *q)
         ehci_set_state(q->ehci, q->async, EST_HORIZONTALQH);
     } else {
         ehci_set_state(q->ehci, q->async, EST_WRITEBACK);
+        if (!q->async) {
+            q->ehci->periodic_busy = 1;
+        }
     }
 
     ehci_flush_qh(q);
@@ -2401,6 +2422,33 @@ static void ehci_update_frindex(EHCIState *ehci, int frames)
     }
 }
 
+/* Account for the frames that went by while the timer was stepped down */
+static void ehci_idle_catch_up(EHCIState *ehci)
+{
+    int frames;
+
+    if (!ehci->async_stepdown) {
+        return;
+    }
+    frames = (qemu_get_clock_ns(vm_clock) - ehci->last_run_ns) /
+             FRAME_TIMER_NS;
+    if (frames > 0) {
+        ehci_update_frindex(ehci, frames);
+        ehci->last_run_ns += FRAME_TIMER_NS * frames;
+    }
+}
+
+/* Run the frame timer now if it is stepped down */
+static void ehci_kick(EHCIState *ehci)
+{
+    if (!ehci->async_stepdown) {
+        return;
+    }
+    ehci->async_stepdown = 0;
+    trace_usb_ehci_kick(ehci->frame_wakeups);
+    qemu_mod_timer(ehci->frame_timer, qemu_get_clock_ns(vm_clock));
+}
+
 static void ehci_frame_timer(void *opaque)
 {
     EHCIState *ehci = opaque;
@@ -2410,13 +2458,13 @@ static void ehci_frame_timer(void *opaque)
     int frames, skipped_frames;
     int i;
 
+    ehci->frame_wakeups++;
     t_now = qemu_get_clock_ns(vm_clock);
     ns_elapsed = t_now - ehci->last_run_ns;
     frames = ns_elapsed / FRAME_TIMER_NS;
 
     if (ehci_periodic_enabled(ehci) || ehci->pstate != EST_INACTIVE) {
         need_timer++;
-        ehci->async_stepdown = 0;
 
         if (frames > ehci->maxframes) {
             skipped_frames = frames - ehci->maxframes;
@@ -2426,11 +2474,25 @@ static void ehci_frame_timer(void *opaque)
             DPRINTF("WARNING - EHCI skipped %d frames\n", skipped_frames);
         }
 
+        if (ehci->async_stepdown && frames > 1) {
+            /* stepped down: only the frame ending now is walked */
+            ehci_update_frindex(ehci, frames - 1);
+            ehci->last_run_ns += FRAME_TIMER_NS * (frames - 1);
+            frames = 1;
+        }
+
+        ehci->periodic_busy = 0;
         for (i = 0; i < frames; i++) {
             ehci_update_frindex(ehci, 1);
             ehci_advance_periodic_state(ehci);
             ehci->last_run_ns += FRAME_TIMER_NS;
         }
+
+        if (ehci->periodic_busy) {
+            ehci->async_stepdown = 0;
+        } else if (frames && ehci->async_stepdown < ehci->maxframes / 2) {
+            ehci->async_stepdown++;
+        }
     } else {
         if (ehci->async_stepdown < ehci->maxframes / 2) {
             ehci->async_stepdown++;
@@ -2454,6 +2516,9 @@ static void ehci_frame_timer(void *opaque)
     }
 
     if (need_timer) {
+        if (ehci->async_stepdown == 1) {
+            trace_usb_ehci_idle(ehci->frame_wakeups);
+        }
         expire_time = t_now + (get_ticks_per_sec()
                                * (ehci->async_stepdown+1) / FRAME_TIMER_FREQ);
         qemu_mod_timer(ehci->frame_timer, expire_time);
@@ -2484,8 +2549,16 @@ static USBPortOps ehci_port_ops = {
     .complete = ehci_async_complete_packet,
 };
 
+static void ehci_wakeup_endpoint(USBBus *bus, USBEndpoint *ep)
+{
+    EHCIState *s = container_of(bus, EHCIState, bus);
+
+    ehci_kick(s);
+}
+
 static USBBusOps ehci_bus_ops = {
     .register_companion = ehci_register_companion,
+    .wakeup_endpoint = ehci_wakeup_endpoint,
 };
 
 static int usb_ehci_post_load(void *opaque, int version_id)
@@ -32,6 +32,7 @@
 #include "hw/pci.h"
 #include "hw/sysbus.h"
 #include "hw/qdev-dma.h"
+#include "trace.h"
 
 //#define DEBUG_OHCI
 /* Dump packet contents.  */
@@ -50,6 +51,13 @@
 
 #define OHCI_MAX_PORTS 15
 
+/*
+ * Once a frame goes by without any TD retiring, the frame timer period
+ * grows by one frame per idle tick, up to this many frames.  Register
+ * writes, packet completions and endpoint wakeups bring it back to one.
+ */
+#define OHCI_IDLE_STEPDOWN_MAX 32
+
 static int64_t usb_frame_time;
 static int64_t usb_bit_time;
 
@@ -68,6 +76,9 @@ typedef struct {
 
     QEMUTimer *eof_timer;
     int64_t sof_time;
+    int frame_busy;
+    uint32_t idle_stepdown;
+    uint64_t frame_wakeups;
 
     /* OHCI state */
     /* Control partition */
@@ -129,6 +140,7 @@ struct ohci_hcca {
 #define ED_WBACK_SIZE   4
 
 static void ohci_bus_stop(OHCIState *ohci);
+static void ohci_kick(OHCIState *ohci);
 static void ohci_async_cancel_device(OHCIState *ohci, USBDevice *dev);
 
 /* Bitfields for the first word of an Endpoint Desciptor.  */
@@ -438,6 +450,7 @@ static void ohci_reset(void *opaque)
     int i;
 
     ohci_bus_stop(ohci);
+    ohci->idle_stepdown = 0;
     ohci->ctl = 0;
     ohci->old_ctl = 0;
     ohci->status = 0;
@@ -653,6 +666,7 @@ static void ohci_async_complete_packet(USBPort *port, USBPacket *packet)
 #endif
     ohci->async_complete = 1;
     ohci_process_lists(ohci, 1);
+    ohci_kick(ohci);
 }
 
 #define USUB(a, b) ((int16_t)((uint16_t)(a) - (uint16_t)(b)))
@@ -1056,6 +1070,7 @@ static int ohci_service_td(OHCIState *ohci, struct ohci_ed *ed)
 
         if ((dir != OHCI_TD_DIR_IN) && (ret != len)) {
             /* Partial packet transfer: TD not ready to retire yet */
+            ohci->frame_busy = 1;
             goto exit_no_retire;
         }
 
@@ -1101,6 +1116,7 @@ static int ohci_service_td(OHCIState *ohci, struct ohci_ed *ed)
     i = OHCI_BM(td.flags, TD_DI);
     if (i < ohci->done_count)
         ohci->done_count = i;
+    ohci->frame_busy = 1;
 exit_no_retire:
     ohci_put_td(ohci, addr, &td);
     return OHCI_BM(td.flags, TD_CC) != OHCI_CC_NOERROR;
@@ -1156,6 +1172,7 @@ static int ohci_service_ed_list(OHCIState *ohci, uint32_t head, int completion)
                     break;
             } else {
                 /* Handle isochronous endpoints */
+                ohci->frame_busy = 1;
                 if (ohci_service_iso_td(ohci, &ed, completion))
                     break;
             }
@@ -1171,10 +1188,42 @@ static int ohci_service_ed_list(OHCIState *ohci, uint32_t head, int completion)
 static void ohci_sof(OHCIState *ohci)
 {
     ohci->sof_time = qemu_get_clock_ns(vm_clock);
-    qemu_mod_timer(ohci->eof_timer, ohci->sof_time + usb_frame_time);
+    qemu_mod_timer(ohci->eof_timer, ohci->sof_time +
+                   usb_frame_time * (ohci->idle_stepdown + 1));
     ohci_set_interrupt(ohci, OHCI_INTR_SF);
 }
 
+/* Count frames that went by while the timer was stepped down */
+static void ohci_idle_skip(OHCIState *ohci, int64_t frames)
+{
+    if (frames > 0) {
+        ohci->frame_number = (ohci->frame_number + frames) & 0xffff;
+        ohci->sof_time += frames * usb_frame_time;
+    }
+}
+
+/* Bring a stepped down frame timer back to finishing the current frame */
+static void ohci_kick(OHCIState *ohci)
+{
+    if (!ohci->idle_stepdown || !ohci->eof_timer) {
+        return;
+    }
+    ohci_idle_skip(ohci, (qemu_get_clock_ns(vm_clock) - ohci->sof_time) /
+                         usb_frame_time);
+    ohci->idle_stepdown = 0;
+    trace_usb_ohci_kick(ohci->frame_wakeups);
+    qemu_mod_timer(ohci->eof_timer, ohci->sof_time + usb_frame_time);
+}
+
+/* Nothing moved this frame and the guest is not waiting for SOF */
+static bool ohci_frame_idle(OHCIState *ohci)
+{
+    return !ohci->frame_busy && !ohci->async_td &&
+           ohci->done_count == 7 &&
+           !(ohci->intr & OHCI_INTR_SF) &&
+           !(ohci->status & (OHCI_STATUS_CLF | OHCI_STATUS_BLF));
+}
+
 /* Process Control and Bulk lists.  */
 static void ohci_process_lists(OHCIState *ohci, int completion)
 {
@@ -1203,6 +1252,14 @@ static void ohci_frame_boundary(void *opaque)
     OHCIState *ohci = opaque;
     struct ohci_hcca hcca;
 
+    ohci->frame_wakeups++;
+    if (ohci->idle_stepdown) {
+        /* only the frame ending now is walked */
+        ohci_idle_skip(ohci, (qemu_get_clock_ns(vm_clock) - ohci->sof_time) /
+                             usb_frame_time - 1);
+    }
+    ohci->frame_busy = 0;
+
     ohci_read_hcca(ohci, ohci->hcca, &hcca);
 
     /* Process all the lists at the end of the frame */
@@ -1243,6 +1300,15 @@ static void ohci_frame_boundary(void *opaque)
     if (ohci->done_count != 7 && ohci->done_count != 0)
         ohci->done_count--;
 
+    if (!ohci_frame_idle(ohci)) {
+        ohci->idle_stepdown = 0;
+    } else if (ohci->idle_stepdown < OHCI_IDLE_STEPDOWN_MAX) {
+        if (ohci->idle_stepdown == 0) {
+            trace_usb_ohci_idle(ohci->frame_wakeups);
+        }
+        ohci->idle_stepdown++;
+    }
+
     /* Do SOF stuff here */
     ohci_sof(ohci);
 
@@ -1548,6 +1614,10 @@ static uint64_t ohci_mem_read(void *opaque,
             break;
 
         case 15: /* HcFmNumber */
+            if (ohci->idle_stepdown) {
+                ohci_idle_skip(ohci, (qemu_get_clock_ns(vm_clock) -
+                                      ohci->sof_time) / usb_frame_time);
+            }
             retval = ohci->frame_number;
             break;
 
@@ -1610,6 +1680,8 @@ static void ohci_mem_write(void *opaque,
         return;
     }
 
+    ohci_kick(ohci);
+
     if (addr >= 0x54 && addr < 0x54 + ohci->num_ports * 4) {
         /* HcRhPortStatus */
         ohci_port_set_status(ohci, (addr - 0x54) >> 2, val);
@@ -1748,7 +1820,15 @@ static USBPortOps ohci_port_ops = {
     .complete = ohci_async_complete_packet,
 };
 
+static void ohci_wakeup_endpoint(USBBus *bus, USBEndpoint *ep)
+{
+    OHCIState *ohci = container_of(bus, OHCIState, bus);
+
+    ohci_kick(ohci);
+}
+
 static USBBusOps ohci_bus_ops = {
+    .wakeup_endpoint = ohci_wakeup_endpoint,
 };
 
 static int usb_ohci_init(OHCIState *ohci, DeviceState *dev,
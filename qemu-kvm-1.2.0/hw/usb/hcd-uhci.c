@@ -73,6 +73,13 @@
 
 #define FRAME_TIMER_FREQ 1000
 
+/*
+ * Once a frame goes by without any TD completing, the timer period grows
+ * by one frame per idle tick, up to this many frames.  Register writes,
+ * packet completions and endpoint wakeups bring it back to one frame.
+ */
+#define IDLE_STEPDOWN_MAX 32
+
 #define FRAME_MAX_LOOPS  256
 
 #define NB_PORTS 2
@@ -134,6 +141,9 @@ struct UHCIState {
     QEMUBH *bh;
     uint32_t frame_bytes;
     uint32_t frame_bandwidth;
+    uint32_t frame_busy;
+    uint32_t idle_stepdown;
+    uint64_t frame_wakeups;
     UHCIPort ports[NB_PORTS];
 
     /* Interrupts that should be raised at the end of the current frame.  */
@@ -374,9 +384,38 @@ static void uhci_reset(void *opaque)
 
     uhci_async_cancel_all(s);
     qemu_bh_cancel(s->bh);
+    s->idle_stepdown = 0;
     uhci_update_irq(s);
 }
 
+/* Account for the frames that went by while the timer was stepped down */
+static void uhci_idle_catch_up(UHCIState *s)
+{
+    int64_t frame_t = get_ticks_per_sec() / FRAME_TIMER_FREQ;
+    int64_t late;
+
+    if (!s->idle_stepdown) {
+        return;
+    }
+    late = (qemu_get_clock_ns(vm_clock) - s->expire_time) / frame_t;
+    if (late > 0) {
+        s->frnum = (s->frnum + late) & 0x7ff;
+        s->expire_time += late * frame_t;
+    }
+}
+
+/* Run the next frame now if the timer is stepped down */
+static void uhci_kick(UHCIState *s)
+{
+    if (!s->idle_stepdown || !(s->cmd & UHCI_CMD_RS)) {
+        return;
+    }
+    uhci_idle_catch_up(s);
+    s->idle_stepdown = 0;
+    trace_usb_uhci_schedule_kick(s->frame_wakeups);
+    qemu_mod_timer(s->frame_timer, qemu_get_clock_ns(vm_clock));
+}
+
 static const VMStateDescription vmstate_uhci_port = {
     .name = "uhci port",
     .version_id = 1,
@@ -428,6 +467,7 @@ static void uhci_ioport_writeb(void *opaque, uint32_t addr, uint32_t val)
     UHCIState *s = opaque;
 
     addr &= 0x1f;
+    uhci_kick(s);
     switch(addr) {
     case 0x0c:
         s->sof_timing = val;
@@ -458,6 +498,7 @@ static void uhci_ioport_writew(void *opaque, uint32_t addr, uint32_t val)
 
     addr &= 0x1f;
     trace_usb_uhci_mmio_writew(addr, val);
+    uhci_kick(s);
 
     switch(addr) {
     case 0x00:
@@ -466,6 +507,7 @@ static void uhci_ioport_writew(void *opaque, uint32_t addr, uint32_t val)
             trace_usb_uhci_schedule_start();
             s->expire_time = qemu_get_clock_ns(vm_clock) +
                 (get_ticks_per_sec() / FRAME_TIMER_FREQ);
+            s->idle_stepdown = 0;
             qemu_mod_timer(s->frame_timer, qemu_get_clock_ns(vm_clock));
             s->status &= ~UHCI_STS_HCHALTED;
         } else if (!(val & UHCI_CMD_RS)) {
@@ -549,6 +591,7 @@ static uint32_t uhci_ioport_readw(void *opaque, uint32_t addr)
         val = s->intr;
         break;
     case 0x06:
+        uhci_idle_catch_up(s);
         val = s->frnum;
         break;
     case 0x10 ... 0x1f:
@@ -579,6 +622,7 @@ static void uhci_ioport_writel(void *opaque, uint32_t addr, uint32_t val)
 
     addr &= 0x1f;
     trace_usb_uhci_mmio_writel(addr, val);
+    uhci_kick(s);
 
     switch(addr) {
     case 0x08:
@@ -934,6 +978,7 @@ static void uhci_async_complete(USBPort *port, USBPacket *packet)
             qemu_bh_schedule(s->bh);
         }
     }
+    uhci_kick(s);
 }
 
 static int is_valid(uint32_t link)
@@ -1102,6 +1147,7 @@ static void uhci_process_frame(UHCIState *s)
 
         case TD_RESULT_ASYNC_START:
             trace_usb_uhci_td_async(curr_qh & ~0xf, link & ~0xf);
+            s->frame_busy = 1;
             if (is_valid(td.link)) {
                 uhci_fill_queue(s, &td);
             }
@@ -1112,6 +1158,7 @@ static void uhci_process_frame(UHCIState *s)
             trace_usb_uhci_td_complete(curr_qh & ~0xf, link & ~0xf);
             link = td.link;
             td_count++;
+            s->frame_busy = 1;
             s->frame_bytes += (td.ctrl & 0x7ff) + 1;
 
             if (curr_qh) {
@@ -1148,9 +1195,15 @@ static void uhci_bh(void *opaque)
 static void uhci_frame_timer(void *opaque)
 {
     UHCIState *s = opaque;
+    int64_t frame_t = get_ticks_per_sec() / FRAME_TIMER_FREQ;
+
+    s->frame_wakeups++;
+
+    /* frames skipped while stepped down are counted but not walked */
+    uhci_idle_catch_up(s);
 
     /* prepare the timer for the next frame */
-    s->expire_time += (get_ticks_per_sec() / FRAME_TIMER_FREQ);
+    s->expire_time += frame_t;
     s->frame_bytes = 0;
     qemu_bh_cancel(s->bh);
 
@@ -1179,11 +1232,22 @@ static void uhci_frame_timer(void *opaque)
 
     uhci_async_validate_begin(s);
 
+    s->frame_busy = 0;
     uhci_process_frame(s);
 
     uhci_async_validate_end(s);
 
-    qemu_mod_timer(s->frame_timer, s->expire_time);
+    if (s->frame_busy || s->pending_int_mask) {
+        s->idle_stepdown = 0;
+    } else if (s->idle_stepdown < IDLE_STEPDOWN_MAX) {
+        if (s->idle_stepdown == 0) {
+            trace_usb_uhci_schedule_idle(s->frame_wakeups);
+        }
+        s->idle_stepdown++;
+    }
+
+    qemu_mod_timer(s->frame_timer,
+                   s->expire_time + s->idle_stepdown * frame_t);
 }
 
 static const MemoryRegionPortio uhci_portio[] = {
@@ -1208,7 +1272,15 @@ static USBPortOps uhci_port_ops = {
     .complete = uhci_async_complete,
 };
 
+static void uhci_wakeup_endpoint(USBBus *bus, USBEndpoint *ep)
+{
+    UHCIState *s = container_of(bus, UHCIState, bus);
+
+    uhci_kick(s);
+}
+
 static USBBusOps uhci_bus_ops = {
+    .wakeup_endpoint = uhci_wakeup_endpoint,
 };
 
 static int usb_uhci_common_initfn(PCIDevice *dev)
@@ -23,6 +23,7 @@
 #include "hw/usb.h"
 #include "hw/pci.h"
 #include "hw/msi.h"
+#include "hw/msix.h"
 #include "trace.h"
 
 //#define DEBUG_XHCI
@@ -37,7 +38,7 @@
                              __func__, __LINE__); abort(); } while (0)
 
 #define MAXSLOTS 8
-#define MAXINTRS 1
+#define MAXINTRS 16
 
 #define USB2_PORTS 4
 #define USB3_PORTS 4
@@ -62,17 +63,15 @@
 #define OFF_DOORBELL    (OFF_RUNTIME + LEN_RUNTIME)
 #define LEN_DOORBELL    ((MAXSLOTS + 1) * 0x20)
 
+#define OFF_MSIX_TABLE  0x3000
+#define OFF_MSIX_PBA    0x3800
 /* must be power of 2 */
-#define LEN_REGS        0x2000
+#define LEN_REGS        0x4000
 
-#if (OFF_DOORBELL + LEN_DOORBELL) > LEN_REGS
+#if (OFF_DOORBELL + LEN_DOORBELL) > OFF_MSIX_TABLE
 # error Increase LEN_REGS
 #endif
 
-#if MAXINTRS > 1
-# error TODO: only one interrupter supported
-#endif
-
 /* bit definitions */
 #define USBCMD_RS       (1<<0)
 #define USBCMD_HCRST    (1<<1)
@@ -231,6 +230,10 @@ typedef enum TRBCCode {
 
 #define TRB_EV_ED           (1<<2)
 
+#define TRB_INTR_SHIFT          22
+#define TRB_INTR_MASK       0x3ff
+#define TRB_INTR(t)         (((t).status >> TRB_INTR_SHIFT) & TRB_INTR_MASK)
+
 #define TRB_TR_ENT          (1<<1)
 #define TRB_TR_ISP          (1<<2)
 #define TRB_TR_NS           (1<<3)
@@ -369,6 +372,26 @@ typedef struct XHCIEvent {
     uint8_t epid;
 } XHCIEvent;
 
+typedef struct XHCIInterrupter {
+    uint32_t iman;
+    uint32_t imod;
+    uint32_t erstsz;
+    uint32_t erstba_low;
+    uint32_t erstba_high;
+    uint32_t erdp_low;
+    uint32_t erdp_high;
+
+    dma_addr_t er_start;
+    uint32_t er_size;
+    bool er_pcs;
+    unsigned int er_ep_idx;
+    bool er_full;
+
+    XHCIEvent ev_buffer[EV_QUEUE];
+    unsigned int ev_buffer_put;
+    unsigned int ev_buffer_get;
+} XHCIInterrupter;
+
 struct XHCIState {
     PCIDevice pci_dev;
     USBBus bus;
@@ -376,8 +399,17 @@ struct XHCIState {
     MemoryRegion mem;
     const char *name;
     uint32_t msi;
+    uint32_t msix;
+    uint32_t numintrs;
     unsigned int devaddr;
 
+    /*
+     * While a doorbell or a completion is being processed, interrupts are
+     * only collected in batch_pending and signalled once at the end.
+     */
+    unsigned int batch;
+    uint32_t batch_pending;
+
     /* Operational Registers */
     uint32_t usbcmd;
     uint32_t usbsts;
@@ -393,24 +425,7 @@ struct XHCIState {
 
     /* Runtime Registers */
     uint32_t mfindex;
-    /* note: we only support one interrupter */
-    uint32_t iman;
-    uint32_t imod;
-    uint32_t erstsz;
-    uint32_t erstba_low;
-    uint32_t erstba_high;
-    uint32_t erdp_low;
-    uint32_t erdp_high;
-
-    dma_addr_t er_start;
-    uint32_t er_size;
-    bool er_pcs;
-    unsigned int er_ep_idx;
-    bool er_full;
-
-    XHCIEvent ev_buffer[EV_QUEUE];
-    unsigned int ev_buffer_put;
-    unsigned int ev_buffer_get;
+    XHCIInterrupter intr[MAXINTRS];
 
     XHCIRing cmd_ring;
 };
@@ -495,29 +510,87 @@ static inline dma_addr_t xhci_mask64(uint64_t addr)
     }
 }
 
-static void xhci_irq_update(XHCIState *xhci)
+static bool xhci_intr_pending(XHCIState *xhci, int v)
+{
+    XHCIInterrupter *intr = &xhci->intr[v];
+
+    return intr->iman & IMAN_IP && intr->iman & IMAN_IE &&
+           xhci->usbcmd & USBCMD_INTE;
+}
+
+static void xhci_irq_update(XHCIState *xhci, int v)
 {
     int level = 0;
+    int i;
+
+    if (xhci->batch && xhci_intr_pending(xhci, v)) {
+        xhci->batch_pending |= 1 << v;
+        return;
+    }
 
-    if (xhci->iman & IMAN_IP && xhci->iman & IMAN_IE &&
-        xhci->usbcmd & USBCMD_INTE) {
-        level = 1;
+    if (xhci->msix && msix_enabled(&xhci->pci_dev)) {
+        if (xhci_intr_pending(xhci, v)) {
+            trace_usb_xhci_irq_msix(v);
+            msix_notify(&xhci->pci_dev, v);
+        }
+        return;
     }
 
     if (xhci->msi && msi_enabled(&xhci->pci_dev)) {
-        if (level) {
+        if (xhci_intr_pending(xhci, v)) {
             trace_usb_xhci_irq_msi(0);
             msi_notify(&xhci->pci_dev, 0);
         }
-    } else {
-        trace_usb_xhci_irq_intx(level);
-        qemu_set_irq(xhci->irq, level);
+        return;
+    }
+
+    /* INTx is shared by all interrupters */
+    for (i = 0; i < xhci->numintrs; i++) {
+        if (xhci_intr_pending(xhci, i)) {
+            level = 1;
+            break;
+        }
+    }
+    trace_usb_xhci_irq_intx(level);
+    qemu_set_irq(xhci->irq, level);
+}
+
+static void xhci_irq_update_all(XHCIState *xhci)
+{
+    int v;
+
+    for (v = 0; v < xhci->numintrs; v++) {
+        xhci_irq_update(xhci, v);
+    }
+}
+
+static void xhci_batch_begin(XHCIState *xhci)
+{
+    xhci->batch++;
+}
+
+static void xhci_batch_end(XHCIState *xhci)
+{
+    uint32_t pending;
+    int v;
+
+    assert(xhci->batch > 0);
+    if (--xhci->batch) {
+        return;
+    }
+
+    pending = xhci->batch_pending;
+    xhci->batch_pending = 0;
+    for (v = 0; pending; v++, pending >>= 1) {
+        if (pending & 1) {
+            xhci_irq_update(xhci, v);
+        }
     }
 }
 
 static inline int xhci_running(XHCIState *xhci)
 {
-    return !(xhci->usbsts & USBSTS_HCH) && !xhci->er_full;
+    return !(xhci->usbsts & USBSTS_HCH) && !xhci->intr[0].er_full;
 }
 
 static void xhci_die(XHCIState *xhci)
@@ -526,8 +599,9 @@ static void xhci_die(XHCIState *xhci)
     fprintf(stderr, "xhci: asserted controller error\n");
 }
 
-static void xhci_write_event(XHCIState *xhci, XHCIEvent *event)
+static void xhci_write_event(XHCIState *xhci, XHCIEvent *event, int v)
 {
+    XHCIInterrupter *intr = &xhci->intr[v];
     XHCITRB ev_trb;
     dma_addr_t addr;
 
@@ -535,26 +609,27 @@ static void xhci_write_event(XHCIState *xhci, XHCIEvent *event)
     ev_trb.status = cpu_to_le32(event->length | (event->ccode << 24));
     ev_trb.control = (event->slotid << 24) | (event->epid << 16) |
                      event->flags | (event->type << TRB_TYPE_SHIFT);
-    if (xhci->er_pcs) {
+    if (intr->er_pcs) {
         ev_trb.control |= TRB_C;
     }
     ev_trb.control = cpu_to_le32(ev_trb.control);
 
-    trace_usb_xhci_queue_event(xhci->er_ep_idx, trb_name(&ev_trb),
+    trace_usb_xhci_queue_event(intr->er_ep_idx, trb_name(&ev_trb),
                                ev_trb.parameter, ev_trb.status, ev_trb.control);
 
-    addr = xhci->er_start + TRB_SIZE*xhci->er_ep_idx;
+    addr = intr->er_start + TRB_SIZE*intr->er_ep_idx;
     pci_dma_write(&xhci->pci_dev, addr, &ev_trb, TRB_SIZE);
 
-    xhci->er_ep_idx++;
-    if (xhci->er_ep_idx >= xhci->er_size) {
-        xhci->er_ep_idx = 0;
-        xhci->er_pcs = !xhci->er_pcs;
+    intr->er_ep_idx++;
+    if (intr->er_ep_idx >= intr->er_size) {
+        intr->er_ep_idx = 0;
+        intr->er_pcs = !intr->er_pcs;
     }
 }
 
-static void xhci_events_update(XHCIState *xhci)
+static void xhci_events_update(XHCIState *xhci, int v)
 {
+    XHCIInterrupter *intr = &xhci->intr[v];
     dma_addr_t erdp;
     unsigned int dp_idx;
     bool do_irq = 0;
@@ -563,122 +638,129 @@ static void xhci_events_update(XHCIState *xhci)
         return;
     }
 
-    erdp = xhci_addr64(xhci->erdp_low, xhci->erdp_high);
-    if (erdp < xhci->er_start ||
-        erdp >= (xhci->er_start + TRB_SIZE*xhci->er_size)) {
+    erdp = xhci_addr64(intr->erdp_low, intr->erdp_high);
+    if (erdp < intr->er_start ||
+        erdp >= (intr->er_start + TRB_SIZE*intr->er_size)) {
         fprintf(stderr, "xhci: ERDP out of bounds: "DMA_ADDR_FMT"\n", erdp);
         fprintf(stderr, "xhci: ER at "DMA_ADDR_FMT" len %d\n",
-                xhci->er_start, xhci->er_size);
+                intr->er_start, intr->er_size);
         xhci_die(xhci);
         return;
     }
-    dp_idx = (erdp - xhci->er_start) / TRB_SIZE;
-    assert(dp_idx < xhci->er_size);
+    dp_idx = (erdp - intr->er_start) / TRB_SIZE;
+    assert(dp_idx < intr->er_size);
 
     /* NEC didn't read section 4.9.4 of the spec (v1.0 p139 top Note) and thus
      * deadlocks when the ER is full. Hack it by holding off events until
      * the driver decides to free at least half of the ring */
-    if (xhci->er_full) {
-        int er_free = dp_idx - xhci->er_ep_idx;
+    if (intr->er_full) {
+        int er_free = dp_idx - intr->er_ep_idx;
         if (er_free <= 0) {
-            er_free += xhci->er_size;
+            er_free += intr->er_size;
         }
-        if (er_free < (xhci->er_size/2)) {
+        if (er_free < (intr->er_size/2)) {
             DPRINTF("xhci_events_update(): event ring still "
                     "more than half full (hack)\n");
             return;
         }
     }
 
-    while (xhci->ev_buffer_put != xhci->ev_buffer_get) {
-        assert(xhci->er_full);
-        if (((xhci->er_ep_idx+1) % xhci->er_size) == dp_idx) {
+    while (intr->ev_buffer_put != intr->ev_buffer_get) {
+        assert(intr->er_full);
+        if (((intr->er_ep_idx+1) % intr->er_size) == dp_idx) {
             DPRINTF("xhci_events_update(): event ring full again\n");
 #ifndef ER_FULL_HACK
             XHCIEvent full = {ER_HOST_CONTROLLER, CC_EVENT_RING_FULL_ERROR};
-            xhci_write_event(xhci, &full);
+            xhci_write_event(xhci, &full, v);
 #endif
             do_irq = 1;
             break;
         }
-        XHCIEvent *event = &xhci->ev_buffer[xhci->ev_buffer_get];
-        xhci_write_event(xhci, event);
-        xhci->ev_buffer_get++;
+        XHCIEvent *event = &intr->ev_buffer[intr->ev_buffer_get];
+        xhci_write_event(xhci, event, v);
+        intr->ev_buffer_get++;
         do_irq = 1;
-        if (xhci->ev_buffer_get == EV_QUEUE) {
-            xhci->ev_buffer_get = 0;
+        if (intr->ev_buffer_get == EV_QUEUE) {
+            intr->ev_buffer_get = 0;
         }
     }
 
     if (do_irq) {
-        xhci->erdp_low |= ERDP_EHB;
-        xhci->iman |= IMAN_IP;
+        intr->erdp_low |= ERDP_EHB;
+        intr->iman |= IMAN_IP;
         xhci->usbsts |= USBSTS_EINT;
-        xhci_irq_update(xhci);
+        xhci_irq_update(xhci, v);
     }
 
-    if (xhci->er_full && xhci->ev_buffer_put == xhci->ev_buffer_get) {
+    if (intr->er_full && intr->ev_buffer_put == intr->ev_buffer_get) {
         DPRINTF("xhci_events_update(): event ring no longer full\n");
-        xhci->er_full = 0;
+        intr->er_full = 0;
     }
     return;
 }
 
-static void xhci_event(XHCIState *xhci, XHCIEvent *event)
+static void xhci_event(XHCIState *xhci, XHCIEvent *event, int v)
 {
+    XHCIInterrupter *intr;
     dma_addr_t erdp;
     unsigned int dp_idx;
 
-    if (xhci->er_full) {
+    if (v >= xhci->numintrs) {
+        fprintf(stderr, "xhci: event for interrupter %d out of range\n", v);
+        return;
+    }
+    intr = &xhci->intr[v];
+
+    if (intr->er_full) {
         DPRINTF("xhci_event(): ER full, queueing\n");
-        if (((xhci->ev_buffer_put+1) % EV_QUEUE) == xhci->ev_buffer_get) {
+        if (((intr->ev_buffer_put+1) % EV_QUEUE) == intr->ev_buffer_get) {
             fprintf(stderr, "xhci: event queue full, dropping event!\n");
             return;
         }
-        xhci->ev_buffer[xhci->ev_buffer_put++] = *event;
-        if (xhci->ev_buffer_put == EV_QUEUE) {
-            xhci->ev_buffer_put = 0;
+        intr->ev_buffer[intr->ev_buffer_put++] = *event;
+        if (intr->ev_buffer_put == EV_QUEUE) {
+            intr->ev_buffer_put = 0;
         }
         return;
     }
 
-    erdp = xhci_addr64(xhci->erdp_low, xhci->erdp_high);
-    if (erdp < xhci->er_start ||
-        erdp >= (xhci->er_start + TRB_SIZE*xhci->er_size)) {
+    erdp = xhci_addr64(intr->erdp_low, intr->erdp_high);
+    if (erdp < intr->er_start ||
+        erdp >= (intr->er_start + TRB_SIZE*intr->er_size)) {
         fprintf(stderr, "xhci: ERDP out of bounds: "DMA_ADDR_FMT"\n", erdp);
         fprintf(stderr, "xhci: ER at "DMA_ADDR_FMT" len %d\n",
-                xhci->er_start, xhci->er_size);
+                intr->er_start, intr->er_size);
         xhci_die(xhci);
         return;
     }
 
-    dp_idx = (erdp - xhci->er_start) / TRB_SIZE;
-    assert(dp_idx < xhci->er_size);
+    dp_idx = (erdp - intr->er_start) / TRB_SIZE;
+    assert(dp_idx < intr->er_size);
 
-    if ((xhci->er_ep_idx+1) % xhci->er_size == dp_idx) {
+    if ((intr->er_ep_idx+1) % intr->er_size == dp_idx) {
         DPRINTF("xhci_event(): ER full, queueing\n");
 #ifndef ER_FULL_HACK
         XHCIEvent full = {ER_HOST_CONTROLLER, CC_EVENT_RING_FULL_ERROR};
-        xhci_write_event(xhci, &full);
+        xhci_write_event(xhci, &full, v);
 #endif
-        xhci->er_full = 1;
-        if (((xhci->ev_buffer_put+1) % EV_QUEUE) == xhci->ev_buffer_get) {
+        intr->er_full = 1;
+        if (((intr->ev_buffer_put+1) % EV_QUEUE) == intr->ev_buffer_get) {
             fprintf(stderr, "xhci: event queue full, dropping event!\n");
             return;
         }
-        xhci->ev_buffer[xhci->ev_buffer_put++] = *event;
-        if (xhci->ev_buffer_put == EV_QUEUE) {
-            xhci->ev_buffer_put = 0;
+        intr->ev_buffer[intr->ev_buffer_put++] = *event;
+        if (intr->ev_buffer_put == EV_QUEUE) {
+            intr->ev_buffer_put = 0;
         }
     } else {
-        xhci_write_event(xhci, event);
+        xhci_write_event(xhci, event, v);
     }
 
-    xhci->erdp_low |= ERDP_EHB;
-    xhci->iman |= IMAN_IP;
+    intr->erdp_low |= ERDP_EHB;
+    intr->iman |= IMAN_IP;
     xhci->usbsts |= USBSTS_EINT;
 
-    xhci_irq_update(xhci);
+    xhci_irq_update(xhci, v);
 }
 
 static void xhci_ring_init(XHCIState *xhci, XHCIRing *ring,
@@ -725,7 +807,14 @@ static TRBType xhci_ring_fetch(XHCIState *xhci, XHCIRing *ring, XHCITRB *trb,
     }
 }
 
-static int xhci_ring_chain_length(XHCIState *xhci, const XHCIRing *ring)
+/*
+ * Read the next complete TD from a transfer ring into xfer->trbs, each TRB
+ * is read from guest memory only once.  The ring is advanced only if the
+ * whole TD has been written by the guest; returns the number of TRBs
+ * fetched, or 0 if there is no complete TD yet.
+ */
+static int xhci_ring_fetch_td(XHCIState *xhci, XHCIRing *ring,
+                              XHCITransfer *xfer)
 {
     XHCITRB trb;
     int length = 0;
@@ -737,14 +826,19 @@ static int xhci_ring_chain_length(XHCIState *xhci, const XHCIRing *ring)
     while (1) {
         TRBType type;
         pci_dma_read(&xhci->pci_dev, dequeue, &trb, TRB_SIZE);
+        trb.addr = dequeue;
+        trb.ccs = ccs;
         le64_to_cpus(&trb.parameter);
         le32_to_cpus(&trb.status);
         le32_to_cpus(&trb.control);
 
         if ((trb.control & TRB_C) != ccs) {
-            return -length;
+            return 0;
         }
 
+        trace_usb_xhci_fetch_trb(dequeue, trb_name(&trb),
+                                 trb.parameter, trb.status, trb.control);
+
         type = TRB_TYPE(trb);
 
         if (type == TR_LINK) {
@@ -755,7 +849,11 @@ static int xhci_ring_chain_length(XHCIState *xhci, const XHCIRing *ring)
             continue;
         }
 
-        length += 1;
+        if (length == xfer->trb_alloced) {
+            xfer->trb_alloced = MAX(2 * xfer->trb_alloced, 4);
+            xfer->trbs = g_renew(XHCITRB, xfer->trbs, xfer->trb_alloced);
+        }
+        xfer->trbs[length++] = trb;
         dequeue += TRB_SIZE;
 
         if (type == TR_SETUP) {
@@ -765,22 +863,28 @@ static int xhci_ring_chain_length(XHCIState *xhci, const XHCIRing *ring)
         }
 
         if (!control_td_set && !(trb.control & TRB_TR_CH)) {
-            return length;
+            break;
         }
     }
+
+    ring->dequeue = dequeue;
+    ring->ccs = ccs;
+    xfer->trb_count = length;
+    return length;
 }
 
-static void xhci_er_reset(XHCIState *xhci)
+static void xhci_er_reset(XHCIState *xhci, int v)
 {
+    XHCIInterrupter *intr = &xhci->intr[v];
     XHCIEvRingSeg seg;
 
     /* cache the (sole) event ring segment location */
-    if (xhci->erstsz != 1) {
-        fprintf(stderr, "xhci: invalid value for ERSTSZ: %d\n", xhci->erstsz);
+    if (intr->erstsz != 1) {
+        fprintf(stderr, "xhci: invalid value for ERSTSZ: %d\n", intr->erstsz);
         xhci_die(xhci);
         return;
     }
-    dma_addr_t erstba = xhci_addr64(xhci->erstba_low, xhci->erstba_high);
+    dma_addr_t erstba = xhci_addr64(intr->erstba_low, intr->erstba_high);
     pci_dma_read(&xhci->pci_dev, erstba, &seg, sizeof(seg));
     le32_to_cpus(&seg.addr_low);
     le32_to_cpus(&seg.addr_high);
@@ -790,15 +894,15 @@ static void xhci_er_reset(XHCIState *xhci)
         xhci_die(xhci);
         return;
     }
-    xhci->er_start = xhci_addr64(seg.addr_low, seg.addr_high);
-    xhci->er_size = seg.size;
+    intr->er_start = xhci_addr64(seg.addr_low, seg.addr_high);
+    intr->er_size = seg.size;
 
-    xhci->er_ep_idx = 0;
-    xhci->er_pcs = 1;
-    xhci->er_full = 0;
+    intr->er_ep_idx = 0;
+    intr->er_pcs = 1;
+    intr->er_full = 0;
 
-    DPRINTF("xhci: event ring:" DMA_ADDR_FMT " [%d]\n",
-            xhci->er_start, xhci->er_size);
+    DPRINTF("xhci: event ring[%d]:" DMA_ADDR_FMT " [%d]\n", v,
+            intr->er_start, intr->er_size);
 }
 
 static void xhci_run(XHCIState *xhci)
@@ -1208,7 +1312,7 @@ static int xhci_xfer_data(XHCITransfer *xfer, uint8_t *data,
                 DPRINTF("xhci_xfer_data: EDTLA=%d\n", event.length);
                 edtla = 0;
             }
-            xhci_event(xhci, &event);
+            xhci_event(xhci, &event, TRB_INTR(*trb));
             reported = 1;
         }
     }
@@ -1652,7 +1756,6 @@ static void xhci_kick_ep(XHCIState *xhci, unsigned int slotid, unsigned int epid
 {
     XHCIEPContext *epctx;
     int length;
-    int i;
 
     trace_usb_xhci_ep_kick(slotid, epid);
     assert(slotid >= 1 && slotid <= MAXSLOTS);
@@ -1698,26 +1801,9 @@ static void xhci_kick_ep(XHCIState *xhci, unsigned int slotid, unsigned int epid
         if (xfer->running_async || xfer->running_retry || xfer->backgrounded) {
             break;
         }
-        length = xhci_ring_chain_length(xhci, &epctx->ring);
-        if (length < 0) {
+        length = xhci_ring_fetch_td(xhci, &epctx->ring, xfer);
+        if (length == 0) {
             break;
-        } else if (length == 0) {
-            break;
-        }
-        if (xfer->trbs && xfer->trb_alloced < length) {
-            xfer->trb_count = 0;
-            xfer->trb_alloced = 0;
-            g_free(xfer->trbs);
-            xfer->trbs = NULL;
-        }
-        if (!xfer->trbs) {
-            xfer->trbs = g_malloc(sizeof(XHCITRB) * length);
-            xfer->trb_alloced = length;
-        }
-        xfer->trb_count = length;
-
-        for (i = 0; i < length; i++) {
-            assert(xhci_ring_fetch(xhci, &epctx->ring, &xfer->trbs[i], NULL));
         }
         xfer->xhci = xhci;
         xfer->epid = epid;
@@ -2244,7 +2330,7 @@ static void xhci_process_commands(XHCIState *xhci)
             break;
         }
         event.slotid = slotid;
-        xhci_event(xhci, &event);
+        xhci_event(xhci, &event, 0);
     }
 }
 
@@ -2271,7 +2357,7 @@ static void xhci_update_port(XHCIState *xhci, XHCIPort *port, int is_detach)
     if (xhci_running(xhci)) {
         port->portsc |= PORTSC_CSC;
         XHCIEvent ev = { ER_PORT_STATUS_CHANGE, CC_SUCCESS, nr << 24};
-        xhci_event(xhci, &ev);
+        xhci_event(xhci, &ev, 0);
         DPRINTF("xhci: port change event for port %d\n", nr);
     }
 }
@@ -2305,19 +2391,24 @@ static void xhci_reset(DeviceState *dev)
     }
 
     xhci->mfindex = 0;
-    xhci->iman = 0;
-    xhci->imod = 0;
-    xhci->erstsz = 0;
-    xhci->erstba_low = 0;
-    xhci->erstba_high = 0;
-    xhci->erdp_low = 0;
-    xhci->erdp_high = 0;
+    for (i = 0; i < xhci->numintrs; i++) {
+        XHCIInterrupter *intr = &xhci->intr[i];
+
+        intr->iman = 0;
+        intr->imod = 0;
+        intr->erstsz = 0;
+        intr->erstba_low = 0;
+        intr->erstba_high = 0;
+        intr->erdp_low = 0;
+        intr->erdp_high = 0;
 
-    xhci->er_ep_idx = 0;
-    xhci->er_pcs = 1;
-    xhci->er_full = 0;
-    xhci->ev_buffer_put = 0;
-    xhci->ev_buffer_get = 0;
+        intr->er_ep_idx = 0;
+        intr->er_pcs = 1;
+        intr->er_full = 0;
+        intr->ev_buffer_put = 0;
+        intr->ev_buffer_get = 0;
+    }
+    xhci->batch_pending = 0;
 }
 
 static uint32_t xhci_cap_read(XHCIState *xhci, uint32_t reg)
@@ -2329,7 +2420,7 @@ static uint32_t xhci_cap_read(XHCIState *xhci, uint32_t reg)
         ret = 0x01000000 | LEN_CAP;
         break;
     case 0x04: /* HCSPARAMS 1 */
-        ret = (MAXPORTS<<24) | (MAXINTRS<<8) | MAXSLOTS;
+        ret = (MAXPORTS<<24) | (xhci->numintrs<<8) | MAXSLOTS;
         break;
     case 0x08: /* HCSPARAMS 2 */
         ret = 0x0000000f;
@@ -2523,13 +2614,13 @@ static void xhci_oper_write(XHCIState *xhci, uint32_t reg, uint32_t val)
         if (val & USBCMD_HCRST) {
             xhci_reset(&xhci->pci_dev.qdev);
         }
-        xhci_irq_update(xhci);
+        xhci_irq_update_all(xhci);
         break;
 
     case 0x04: /* USBSTS */
         /* these bits are write-1-to-clear */
         xhci->usbsts &= ~(val & (USBSTS_HSE|USBSTS_EINT|USBSTS_PCD|USBSTS_SRE));
-        xhci_irq_update(xhci);
+        xhci_irq_update_all(xhci);
         break;
 
     case 0x14: /* DNCTRL */
@@ -2543,7 +2634,7 @@ static void xhci_oper_write(XHCIState *xhci, uint32_t reg, uint32_t val)
         if (xhci->crcr_low & (CRCR_CA|CRCR_CS) && (xhci->crcr_low & CRCR_CRR)) {
             XHCIEvent event = {ER_COMMAND_COMPLETE, CC_COMMAND_RING_STOPPED};
             xhci->crcr_low &= ~CRCR_CRR;
-            xhci_event(xhci, &event);
+            xhci_event(xhci, &event, 0);
             DPRINTF("xhci: command ring stopped (CRCR=%08x)\n", xhci->crcr_low);
         } else {
             dma_addr_t base = xhci_addr64(xhci->crcr_low & ~0x3f, val);
@@ -2567,37 +2658,57 @@ static void xhci_oper_write(XHCIState *xhci, uint32_t reg, uint32_t val)
 
 static uint32_t xhci_runtime_read(XHCIState *xhci, uint32_t reg)
 {
-    uint32_t ret;
+    XHCIInterrupter *intr;
+    uint32_t ret = 0;
+    int v;
 
-    switch (reg) {
-    case 0x00: /* MFINDEX */
-        fprintf(stderr, "xhci_runtime_read: MFINDEX not yet implemented\n");
-        ret = xhci->mfindex;
-        break;
-    case 0x20: /* IMAN */
-        ret = xhci->iman;
+    if (reg < 0x20) {
+        switch (reg) {
+        case 0x00: /* MFINDEX */
+            fprintf(stderr,
+                    "xhci_runtime_read: MFINDEX not yet implemented\n");
+            ret = xhci->mfindex;
+            break;
+        default:
+            fprintf(stderr, "xhci_runtime_read: reg 0x%x unimplemented\n",
+                    reg);
+        }
+        trace_usb_xhci_runtime_read(reg, ret);
+        return ret;
+    }
+
+    v = (reg - 0x20) / 0x20;
+    if (v >= xhci->numintrs) {
+        fprintf(stderr, "xhci_runtime_read: no interrupter %d\n", v);
+        trace_usb_xhci_runtime_read(reg, ret);
+        return ret;
+    }
+    intr = &xhci->intr[v];
+
+    switch (reg & 0x1f) {
+    case 0x00: /* IMAN */
+        ret = intr->iman;
         break;
-    case 0x24: /* IMOD */
-        ret = xhci->imod;
+    case 0x04: /* IMOD */
+        ret = intr->imod;
         break;
-    case 0x28: /* ERSTSZ */
-        ret = xhci->erstsz;
+    case 0x08: /* ERSTSZ */
+        ret = intr->erstsz;
         break;
-    case 0x30: /* ERSTBA low */
-        ret = xhci->erstba_low;
+    case 0x10: /* ERSTBA low */
+        ret = intr->erstba_low;
         break;
-    case 0x34: /* ERSTBA high */
-        ret = xhci->erstba_high;
+    case 0x14: /* ERSTBA high */
+        ret = intr->erstba_high;
         break;
-    case 0x38: /* ERDP low */
-        ret = xhci->erdp_low;
+    case 0x18: /* ERDP low */
+        ret = intr->erdp_low;
         break;
-    case 0x3c: /* ERDP high */
-        ret = xhci->erdp_high;
+    case 0x1c: /* ERDP high */
+        ret = intr->erdp_high;
         break;
     default:
         fprintf(stderr, "xhci_runtime_read: reg 0x%x unimplemented\n", reg);
-        ret = 0;
     }
 
     trace_usb_xhci_runtime_read(reg, ret);
@@ -2606,41 +2717,56 @@ static uint32_t xhci_runtime_read(XHCIState *xhci, uint32_t reg)
 
 static void xhci_runtime_write(XHCIState *xhci, uint32_t reg, uint32_t val)
 {
+    XHCIInterrupter *intr;
+    int v;
+
     trace_usb_xhci_runtime_read(reg, val);
 
-    switch (reg) {
-    case 0x20: /* IMAN */
+    if (reg < 0x20) {
+        fprintf(stderr, "xhci_runtime_write: reg 0x%x unimplemented\n", reg);
+        return;
+    }
+
+    v = (reg - 0x20) / 0x20;
+    if (v >= xhci->numintrs) {
+        fprintf(stderr, "xhci_runtime_write: no interrupter %d\n", v);
+        return;
+    }
+    intr = &xhci->intr[v];
+
+    switch (reg & 0x1f) {
+    case 0x00: /* IMAN */
         if (val & IMAN_IP) {
-            xhci->iman &= ~IMAN_IP;
+            intr->iman &= ~IMAN_IP;
         }
-        xhci->iman &= ~IMAN_IE;
-        xhci->iman |= val & IMAN_IE;
-        xhci_irq_update(xhci);
+        intr->iman &= ~IMAN_IE;
+        intr->iman |= val & IMAN_IE;
+        xhci_irq_update(xhci, v);
         break;
-    case 0x24: /* IMOD */
-        xhci->imod = val;
+    case 0x04: /* IMOD */
+        intr->imod = val;
         break;
-    case 0x28: /* ERSTSZ */
-        xhci->erstsz = val & 0xffff;
+    case 0x08: /* ERSTSZ */
+        intr->erstsz = val & 0xffff;
         break;
-    case 0x30: /* ERSTBA low */
+    case 0x10: /* ERSTBA low */
         /* XXX NEC driver bug: it doesn't align this to 64 bytes
-        xhci->erstba_low = val & 0xffffffc0; */
-        xhci->erstba_low = val & 0xfffffff0;
+        intr->erstba_low = val & 0xffffffc0; */
+        intr->erstba_low = val & 0xfffffff0;
         break;
-    case 0x34: /* ERSTBA high */
-        xhci->erstba_high = val;
-        xhci_er_reset(xhci);
+    case 0x14: /* ERSTBA high */
+        intr->erstba_high = val;
+        xhci_er_reset(xhci, v);
         break;
-    case 0x38: /* ERDP low */
+    case 0x18: /* ERDP low */
         if (val & ERDP_EHB) {
-            xhci->erdp_low &= ~ERDP_EHB;
+            intr->erdp_low &= ~ERDP_EHB;
         }
-        xhci->erdp_low = (val & ~ERDP_EHB) | (xhci->erdp_low & ERDP_EHB);
+        intr->erdp_low = (val & ~ERDP_EHB) | (intr->erdp_low & ERDP_EHB);
         break;
-    case 0x3c: /* ERDP high */
-        xhci->erdp_high = val;
-        xhci_events_update(xhci);
+    case 0x1c: /* ERDP high */
+        intr->erdp_high = val;
+        xhci_events_update(xhci, v);
         break;
     default:
         fprintf(stderr, "xhci_oper_write: reg 0x%x unimplemented\n", reg);
@@ -2665,6 +2791,7 @@ static void xhci_doorbell_write(XHCIState *xhci, uint32_t reg, uint32_t val)
 
     reg >>= 2;
 
+    xhci_batch_begin(xhci);
     if (reg == 0) {
         if (val == 0) {
             xhci_process_commands(xhci);
@@ -2680,6 +2807,7 @@ static void xhci_doorbell_write(XHCIState *xhci, uint32_t reg, uint32_t val)
             xhci_kick_ep(xhci, reg, val);
         }
     }
+    xhci_batch_end(xhci);
 }
 
 static uint64_t xhci_mem_read(void *ptr, target_phys_addr_t addr,
@@ -2770,15 +2898,18 @@ static void xhci_wakeup(USBPort *usbport)
         return;
     }
     port->portsc |= PORTSC_PLC;
-    xhci_event(xhci, &ev);
+    xhci_event(xhci, &ev, 0);
 }
 
 static void xhci_complete(USBPort *port, USBPacket *packet)
 {
     XHCITransfer *xfer = container_of(packet, XHCITransfer, packet);
+    XHCIState *xhci = xfer->xhci;
 
+    xhci_batch_begin(xhci);
     xhci_complete_packet(xfer, packet->result);
-    xhci_kick_ep(xfer->xhci, xfer->slotid, xfer->epid);
+    xhci_kick_ep(xhci, xfer->slotid, xfer->epid);
+    xhci_batch_end(xhci);
 }
 
 static void xhci_child_detach(USBPort *port, USBDevice *child)
@@ -2831,7 +2962,9 @@ static void xhci_wakeup_endpoint(USBBus *bus, USBEndpoint *ep)
         DPRINTF("%s: oops, no slot for dev %d\n", __func__, ep->dev->addr);
         return;
     }
+    xhci_batch_begin(xhci);
     xhci_kick_ep(xhci, slotid, xhci_find_epid(ep));
+    xhci_batch_end(xhci);
 }
 
 static USBBusOps xhci_bus_ops = {
@@ -2844,6 +2977,13 @@ static void usb_xhci_init(XHCIState *xhci, DeviceState *dev)
 
     xhci->usbsts = USBSTS_HCH;
 
+    if (xhci->numintrs > MAXINTRS) {
+        xhci->numintrs = MAXINTRS;
+    }
+    if (xhci->numintrs < 1) {
+        xhci->numintrs = 1;
+    }
+
     usb_bus_new(&xhci->bus, &xhci_bus_ops, &xhci->pci_dev.qdev);
 
     for (i = 0; i < MAXPORTS; i++) {
@@ -2861,7 +3001,7 @@ static void usb_xhci_init(XHCIState *xhci, DeviceState *dev)
 
 static int usb_xhci_initfn(struct PCIDevice *dev)
 {
-    int ret;
+    int i, ret;
 
     XHCIState *xhci = DO_UPCAST(XHCIState, pci_dev, dev);
 
@@ -2887,6 +3027,18 @@ static int usb_xhci_initfn(struct PCIDevice *dev)
         ret = msi_init(&xhci->pci_dev, 0x70, 1, true, false);
         assert(ret >= 0);
     }
+    /* One MSI-X vector per interrupter */
+    if (xhci->msix) {
+        if (msix_init(&xhci->pci_dev, xhci->numintrs,
+                      &xhci->mem, 0, OFF_MSIX_TABLE,
+                      &xhci->mem, 0, OFF_MSIX_PBA, 0x90) < 0) {
+            xhci->msix = 0;
+        } else {
+            for (i = 0; i < xhci->numintrs; i++) {
+                msix_vector_use(&xhci->pci_dev, i);
+            }
+        }
+    }
 
     return 0;
 }
@@ -2909,6 +3061,8 @@ static const VMStateDescription vmstate_xhci = {
 
 static Property xhci_properties[] = {
     DEFINE_PROP_UINT32("msi", XHCIState, msi, 0),
+    DEFINE_PROP_UINT32("msix", XHCIState, msix, 1),
+    DEFINE_PROP_UINT32("intrs", XHCIState, numintrs, MAXINTRS),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -35,6 +35,7 @@
 #include "monitor.h"
 #include "sysemu.h"
 #include "trace.h"
+#include "iov.h"
 
 #include <dirent.h>
 #include <sys/ioctl.h>
@@ -44,6 +45,15 @@
 #include "hw/usb.h"
 #include "hw/usb/desc.h"
 
+/* Older kernel headers lack these, probing the capabilities then fails */
+#ifndef USBDEVFS_CAP_BULK_CONTINUATION
+#define USBDEVFS_CAP_BULK_CONTINUATION  0x02
+#define USBDEVFS_URB_BULK_CONTINUATION  0x04
+#endif
+#ifndef USBDEVFS_CAP_NO_PACKET_SIZE_LIM
+#define USBDEVFS_CAP_NO_PACKET_SIZE_LIM 0x04
+#endif
+
 /* We redefine it to avoid version problems */
 struct usb_ctrltransfer {
     uint8_t  bRequestType;
@@ -76,6 +86,12 @@ typedef int USBScanFunc(void *opaque, int bus_num, int addr, const char *port,
 /* devio.c limits single requests to 16k */
 #define MAX_USBFS_BUFFER_SIZE 16384
 
+/*
+ * When the kernel reports USBDEVFS_CAP_NO_PACKET_SIZE_LIM, bulk packets
+ * are submitted in urbs of up to this size instead.
+ */
+#define MAX_USBFS_BULK_SIZE (256 * 1024)
+
 typedef struct AsyncURB AsyncURB;
 
 struct endp_data {
@@ -110,6 +126,7 @@ typedef struct USBHostDevice {
     int       closing;
     uint32_t  iso_urb_count;
     uint32_t  options;
+    uint32_t  usbfs_caps;
     Notifier  exit;
     QEMUBH    *bh;
 
@@ -281,6 +298,7 @@ struct AsyncURB
     /* For regular async urbs */
     USBPacket     *packet;
     int more; /* large transfer, more urbs follow */
+    uint8_t       *bounce; /* combined buffer for a multi-segment packet */
 
     /* For buffered iso handling */
     int iso_frame_idx; /* -1 means in flight */
@@ -297,9 +315,32 @@ static AsyncURB *async_alloc(USBHostDevice *s)
 static void async_free(AsyncURB *aurb)
 {
     QLIST_REMOVE(aurb, next);
+    g_free(aurb->bounce);
     g_free(aurb);
 }
 
+/* Detach all urbs of a packet from it and ask the kernel to drop them */
+static void async_discard_packet(USBHostDevice *s, USBPacket *p)
+{
+    AsyncURB *aurb;
+
+    QLIST_FOREACH(aurb, &s->aurbs, next) {
+        if (p != aurb->packet) {
+            continue;
+        }
+
+        trace_usb_host_urb_canceled(s->bus_num, s->addr, aurb);
+
+        /* Mark it as dead (see async_complete above) */
+        aurb->packet = NULL;
+
+        int r = ioctl(s->fd, USBDEVFS_DISCARDURB, aurb);
+        if (r < 0) {
+            DPRINTF("husb: async. discard urb failed errno %d\n", errno);
+        }
+    }
+}
+
 static void do_disconnect(USBHostDevice *s)
 {
     usb_host_close(s);
@@ -366,7 +407,12 @@ static void async_complete(void *opaque)
         if (p) {
             switch (aurb->urb.status) {
             case 0:
-                p->result += aurb->urb.actual_length;
+            case -EREMOTEIO: /* short read on a SHORT_NOT_OK urb */
+                if (aurb->bounce && p->pid == USB_TOKEN_IN) {
+                    usb_packet_copy(p, aurb->bounce, aurb->urb.actual_length);
+                } else {
+                    p->result += aurb->urb.actual_length;
+                }
                 break;
 
             case -EPIPE:
@@ -386,6 +432,17 @@ static void async_complete(void *opaque)
             if (aurb->urb.type == USBDEVFS_URB_TYPE_CONTROL) {
                 trace_usb_host_req_complete(s->bus_num, s->addr, p, p->result);
                 usb_generic_async_ctrl_complete(&s->dev, p);
+            } else if (aurb->more &&
+                       (p->result < 0 || (p->pid == USB_TOKEN_IN &&
+                        aurb->urb.actual_length < aurb->urb.buffer_length))) {
+                /*
+                 * A short read or an error ends the transfer, the urbs
+                 * queued behind this one must not be reported or they
+                 * would eat into the next transfer.
+                 */
+                async_discard_packet(s, p);
+                trace_usb_host_req_complete(s->bus_num, s->addr, p, p->result);
+                usb_packet_complete(&s->dev, p);
             } else if (!aurb->more) {
                 trace_usb_host_req_complete(s->bus_num, s->addr, p, p->result);
                 usb_packet_complete(&s->dev, p);
@@ -399,25 +456,10 @@ static void async_complete(void *opaque)
 static void usb_host_async_cancel(USBDevice *dev, USBPacket *p)
 {
     USBHostDevice *s = DO_UPCAST(USBHostDevice, dev, dev);
-    AsyncURB *aurb;
 
     trace_usb_host_req_canceled(s->bus_num, s->addr, p);
 
-    QLIST_FOREACH(aurb, &s->aurbs, next) {
-        if (p != aurb->packet) {
-            continue;
-        }
-
-        trace_usb_host_urb_canceled(s->bus_num, s->addr, aurb);
-
-        /* Mark it as dead (see async_complete above) */
-        aurb->packet = NULL;
-
-        int r = ioctl(s->fd, USBDEVFS_DISCARDURB, aurb);
-        if (r < 0) {
-            DPRINTF("husb: async. discard urb failed errno %d\n", errno);
-        }
-    }
+    async_discard_packet(s, p);
 }
 
 static int usb_host_open_device(int bus, int addr)
@@ -852,7 +894,8 @@ static int usb_host_handle_data(USBDevice *dev, USBPacket *p)
     USBHostDevice *s = DO_UPCAST(USBHostDevice, dev, dev);
     struct usbdevfs_urb *urb;
     AsyncURB *aurb;
-    int ret, rem, prem, v;
+    int ret, rem, prem, v, offset, max_urb_size;
+    bool bulk, combine;
     uint8_t *pbuf;
     uint8_t ep;
 
@@ -886,12 +929,25 @@ static int usb_host_handle_data(USBDevice *dev, USBPacket *p)
         return usb_host_handle_iso_data(s, p, p->pid == USB_TOKEN_IN);
     }
 
+    /*
+     * Bulk packets made of several guest buffers (one per qTD page for
+     * ehci) are gathered into bounce buffers, so that they go out in as
+     * few urbs as the kernel lets us, instead of one urb per fragment.
+     */
+    bulk = usb_host_usbfs_type(s, p) == USBDEVFS_URB_TYPE_BULK;
+    combine = bulk && p->iov.niov > 1;
+    max_urb_size = MAX_USBFS_BUFFER_SIZE;
+    if (bulk && (s->usbfs_caps & USBDEVFS_CAP_NO_PACKET_SIZE_LIM)) {
+        max_urb_size = MAX_USBFS_BULK_SIZE;
+    }
+
     v = 0;
     prem = 0;
     pbuf = NULL;
+    offset = 0;
     rem = p->iov.size;
     do {
-        if (prem == 0 && rem > 0) {
+        if (!combine && prem == 0 && rem > 0) {
             assert(v < p->iov.niov);
             prem = p->iov.iov[v].iov_len;
             pbuf = p->iov.iov[v].iov_base;
@@ -905,19 +961,42 @@ static int usb_host_handle_data(USBDevice *dev, USBPacket *p)
         urb->endpoint      = ep;
         urb->type          = usb_host_usbfs_type(s, p);
         urb->usercontext   = s;
-        urb->buffer        = pbuf;
-        urb->buffer_length = prem;
 
-        if (urb->buffer_length > MAX_USBFS_BUFFER_SIZE) {
-            urb->buffer_length = MAX_USBFS_BUFFER_SIZE;
+        if (combine) {
+            urb->buffer_length = MIN(rem, max_urb_size);
+            aurb->bounce = g_malloc(urb->buffer_length);
+            if (p->pid != USB_TOKEN_IN) {
+                iov_to_buf(p->iov.iov, p->iov.niov, offset,
+                           aurb->bounce, urb->buffer_length);
+            }
+            urb->buffer    = aurb->bounce;
+        } else {
+            urb->buffer        = pbuf;
+            urb->buffer_length = MIN(prem, max_urb_size);
+            pbuf += urb->buffer_length;
+            prem -= urb->buffer_length;
         }
-        pbuf += urb->buffer_length;
-        prem -= urb->buffer_length;
-        rem  -= urb->buffer_length;
+        offset += urb->buffer_length;
+        rem    -= urb->buffer_length;
         if (rem) {
             aurb->more         = 1;
         }
 
+        /*
+         * Let the kernel stop the endpoint queue on a short read, so the
+         * remaining urbs of this packet can't swallow data belonging to
+         * the next transfer.
+         */
+        if (bulk && p->pid == USB_TOKEN_IN &&
+            (s->usbfs_caps & USBDEVFS_CAP_BULK_CONTINUATION)) {
+            if (rem) {
+                urb->flags |= USBDEVFS_URB_SHORT_NOT_OK;
+            }
+            if (offset != urb->buffer_length) {
+                urb->flags |= USBDEVFS_URB_BULK_CONTINUATION;
+            }
+        }
+
         trace_usb_host_urb_submit(s->bus_num, s->addr, aurb,
                                   urb->buffer_length, aurb->more);
         ret = ioctl(s->fd, USBDEVFS_SUBMITURB, urb);
@@ -928,6 +1007,8 @@ static int usb_host_handle_data(USBDevice *dev, USBPacket *p)
         if (ret < 0) {
             perror("USBDEVFS_SUBMITURB");
             async_free(aurb);
+            /* Drop the part of the packet which already went out */
+            async_discard_packet(s, p);
 
             switch(errno) {
             case ETIMEDOUT:
@@ -1305,6 +1386,13 @@ static int usb_host_open(USBHostDevice *dev, int bus_num,
     strcpy(dev->port, port);
     dev->fd = fd;
 
+    dev->usbfs_caps = 0;
+#ifdef USBDEVFS_GET_CAPABILITIES
+    if (ioctl(fd, USBDEVFS_GET_CAPABILITIES, &dev->usbfs_caps) < 0) {
+        dev->usbfs_caps = 0;
+    }
+#endif
+
     /* read the device description */
     dev->descr_len = read(fd, dev->descr, sizeof(dev->descr));
     if (dev->descr_len <= 0) {
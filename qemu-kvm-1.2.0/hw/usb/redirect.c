@@ -43,6 +43,8 @@
 #define EP2I(ep_address) (((ep_address & 0x80) >> 3) | (ep_address & 0x0f))
 #define I2EP(i) (((i & 0x10) << 3) | (i & 0x0f))
 
+#define USB_REDIR_OPT_PIPELINE 0
+
 typedef struct AsyncURB AsyncURB;
 typedef struct USBRedirDevice USBRedirDevice;
 
@@ -76,6 +78,7 @@ struct USBRedirDevice {
     uint8_t debug;
     char *filter_str;
     int32_t bootindex;
+    uint32_t options;
     /* Data passed from chardev the fd_read cb to the usbredirparser read cb */
     const uint8_t *read_buf;
     int read_buf_size;
@@ -1199,6 +1202,15 @@ static void usbredir_ep_info(void *priv,
                             i & 0x0f);
         usb_ep->type = dev->endpoint[i].type;
         usb_ep->ifnum = dev->endpoint[i].interface;
+        /*
+         * Bulk packets complete in submission order on the other side, so
+         * let the hcd queue them up instead of one round trip at a time.
+         */
+        usb_ep_set_pipeline(&dev->dev,
+                            (i & 0x10) ? USB_TOKEN_IN : USB_TOKEN_OUT,
+                            i & 0x0f,
+                            usb_ep->type == USB_ENDPOINT_XFER_BULK &&
+                            (dev->options & (1 << USB_REDIR_OPT_PIPELINE)));
     }
 }
 
@@ -1468,6 +1480,8 @@ static Property usbredir_properties[] = {
     DEFINE_PROP_UINT8("debug", USBRedirDevice, debug, 0),
     DEFINE_PROP_STRING("filter", USBRedirDevice, filter_str),
     DEFINE_PROP_INT32("bootindex", USBRedirDevice, bootindex, -1),
+    DEFINE_PROP_BIT("pipeline", USBRedirDevice, options,
+                    USB_REDIR_OPT_PIPELINE, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
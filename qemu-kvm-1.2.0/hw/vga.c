@@ -1629,6 +1629,68 @@ void vga_dirty_log_stop(VGACommonState *s)
 /*
  * graphic modes
  */
+/*
+ * Whether anything vga_draw_graphic() is about to scan out changed since
+ * the last refresh.  Only the lines it reads are checked, unless the CGA
+ * compatibility bits scatter them over video memory.
+ */
+static bool vga_scanout_dirty(VGACommonState *s, uint32_t addr, int bwidth,
+                              int height)
+{
+    ram_addr_t start, end;
+    int i;
+
+    for (i = 0; i < (height + 31) >> 5; i++) {
+        if (s->invalidated_y_table[i]) {
+            return true;
+        }
+    }
+
+    if ((s->cr[VGA_CRTC_MODE] & 3) != 3) {
+        start = 0;
+        end = s->vram_size;
+    } else {
+        /* line compare wraps the display back to address 0 */
+        start = s->line_compare < height ? 0 : addr;
+        end = MIN((ram_addr_t)addr + s->line_offset * height + bwidth,
+                  s->vram_size);
+    }
+    return start < end &&
+           memory_region_get_dirty(&s->vram, start, end - start,
+                                   DIRTY_MEMORY_VGA);
+}
+
+/*
+ * Whether the display surface can point straight into video memory: the
+ * scanout must be a plain framebuffer in a pixel format the UI reads,
+ * with no doubled or split lines, no CGA interleave and no hardware
+ * cursor to blend in.
+ */
+static bool vga_can_share_surface(VGACommonState *s, int depth, int height,
+                                  int multi_scan)
+{
+#if defined(HOST_WORDS_BIGENDIAN) == defined(TARGET_WORDS_BIGENDIAN)
+    if (depth != 16 && depth != 32) {
+        return false;
+    }
+#else
+    if (depth != 32) {
+        return false;
+    }
+#endif
+    if (multi_scan || (s->cr[VGA_CRTC_MODE] & 3) != 3 ||
+        s->line_compare < height) {
+        return false;
+    }
+    if (s->start_addr * 4 + (uint64_t)s->line_offset * height > s->vram_size) {
+        return false;
+    }
+    if (s->cursor_visible && s->cursor_visible(s)) {
+        return false;
+    }
+    return true;
+}
+
 static void vga_draw_graphic(VGACommonState *s, int full_update)
 {
     int y1, y, update, linesize, y_start, double_scan, mask, depth;
@@ -1638,6 +1700,7 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
     uint8_t *d;
     uint32_t v, addr1, addr;
     vga_draw_line_func *vga_draw_line;
+    bool share;
 
     full_update |= update_basic_params(s);
 
@@ -1676,15 +1739,13 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
     }
 
     depth = s->get_bpp(s);
+    share = vga_can_share_surface(s, depth, height, multi_scan);
     if (s->line_offset != s->last_line_offset ||
         disp_width != s->last_width ||
         height != s->last_height ||
-        s->last_depth != depth) {
-#if defined(HOST_WORDS_BIGENDIAN) == defined(TARGET_WORDS_BIGENDIAN)
-        if (depth == 16 || depth == 32) {
-#else
-        if (depth == 32) {
-#endif
+        s->last_depth != depth ||
+        share != is_buffer_shared(s->ds->surface)) {
+        if (share) {
             qemu_free_displaysurface(s->ds);
             s->ds->surface = qemu_create_displaysurface_from(disp_width, height, depth,
                     s->line_offset,
@@ -1772,6 +1833,12 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
 #endif
     addr1 = (s->start_addr * 4);
     bwidth = (width * bits + 7) / 8;
+
+    /* an idle guest changed nothing, don't even walk the lines */
+    if (!full_update && !vga_scanout_dirty(s, addr1, bwidth, height)) {
+        return;
+    }
+
     y_start = -1;
     page_min = -1;
     page_max = 0;
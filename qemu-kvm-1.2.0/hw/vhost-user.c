@@ -0,0 +1,396 @@
+/*
+ * vhost-user
+ *
+ * Copyright (C) 2012
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * The vhost-user protocol carries the vhost ioctls over a UNIX socket to a
+ * backend in another process.  Every message is a VhostUserMsg header
+ * followed by size bytes of payload; file descriptors travel alongside as
+ * SCM_RIGHTS ancillary data:
+ *
+ * - VHOST_USER_SET_MEM_TABLE passes one fd per guest RAM region, which the
+ *   backend mmaps at mmap_offset.  This needs guest RAM allocated from a
+ *   shared file, i.e. -mem-path together with -mem-prealloc.
+ * - VHOST_USER_SET_VRING_KICK/CALL/ERR pass the eventfd of the ring given
+ *   by the low bits of u64, or set VHOST_USER_VRING_NOFD_MASK instead.
+ *
+ * Only GET_FEATURES and GET_VRING_BASE are answered, with the same request
+ * and VHOST_USER_REPLY_MASK set in flags.
+ */
+
+#include "vhost.h"
+#include "vhost-backend.h"
+#include "qemu-common.h"
+#include "qemu-error.h"
+#include "cpu-common.h"
+#include "migration.h"
+#include "qerror.h"
+
+#include <sys/socket.h>
+#include <linux/vhost.h>
+
+#define VHOST_MEMORY_MAX_NREGIONS    8
+
+typedef enum VhostUserRequest {
+    VHOST_USER_NONE = 0,
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_RESET_OWNER = 4,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_LOG_BASE = 6,
+    VHOST_USER_SET_LOG_FD = 7,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_MAX
+} VhostUserRequest;
+
+typedef struct VhostUserMemoryRegion {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+} VhostUserMemoryRegion;
+
+typedef struct VhostUserMemory {
+    uint32_t nregions;
+    uint32_t padding;
+    VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+} VhostUserMemory;
+
+typedef struct VhostUserMsg {
+    uint32_t request;
+
+#define VHOST_USER_VERSION_MASK     (0x3)
+#define VHOST_USER_REPLY_MASK       (0x1 << 2)
+    uint32_t flags;
+    uint32_t size; /* the following payload size */
+    union {
+#define VHOST_USER_VRING_IDX_MASK   (0xff)
+#define VHOST_USER_VRING_NOFD_MASK  (0x1 << 8)
+        uint64_t u64;
+        struct vhost_vring_state state;
+        struct vhost_vring_addr addr;
+        VhostUserMemory memory;
+    } payload;
+} QEMU_PACKED VhostUserMsg;
+
+#define VHOST_USER_HDR_SIZE  offsetof(VhostUserMsg, payload)
+
+/* The version of the protocol we support */
+#define VHOST_USER_VERSION   (0x1)
+
+static int vhost_user_fd(struct vhost_dev *dev)
+{
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    return (uintptr_t) dev->opaque;
+}
+
+static VhostUserRequest vhost_user_request_translate(unsigned long int request)
+{
+    switch (request) {
+    case VHOST_GET_FEATURES:
+        return VHOST_USER_GET_FEATURES;
+    case VHOST_SET_FEATURES:
+        return VHOST_USER_SET_FEATURES;
+    case VHOST_SET_OWNER:
+        return VHOST_USER_SET_OWNER;
+    case VHOST_RESET_OWNER:
+        return VHOST_USER_RESET_OWNER;
+    case VHOST_SET_MEM_TABLE:
+        return VHOST_USER_SET_MEM_TABLE;
+    case VHOST_SET_VRING_NUM:
+        return VHOST_USER_SET_VRING_NUM;
+    case VHOST_SET_VRING_ADDR:
+        return VHOST_USER_SET_VRING_ADDR;
+    case VHOST_SET_VRING_BASE:
+        return VHOST_USER_SET_VRING_BASE;
+    case VHOST_GET_VRING_BASE:
+        return VHOST_USER_GET_VRING_BASE;
+    case VHOST_SET_VRING_KICK:
+        return VHOST_USER_SET_VRING_KICK;
+    case VHOST_SET_VRING_CALL:
+        return VHOST_USER_SET_VRING_CALL;
+    case VHOST_SET_VRING_ERR:
+        return VHOST_USER_SET_VRING_ERR;
+    default:
+        /* dirty logging needs a shared log, see the migration blocker */
+        return VHOST_USER_NONE;
+    }
+}
+
+static int vhost_user_read(struct vhost_dev *dev, VhostUserMsg *msg)
+{
+    int fd = vhost_user_fd(dev);
+    ssize_t r;
+
+    r = qemu_recv_full(fd, msg, VHOST_USER_HDR_SIZE, 0);
+    if (r != VHOST_USER_HDR_SIZE) {
+        error_report("Failed to read msg header. Read %zd instead of %zu.",
+                     r, VHOST_USER_HDR_SIZE);
+        return -1;
+    }
+
+    if (msg->flags != (VHOST_USER_REPLY_MASK | VHOST_USER_VERSION)) {
+        error_report("Failed to read msg header. Flags 0x%x instead of 0x%x.",
+                     msg->flags, VHOST_USER_REPLY_MASK | VHOST_USER_VERSION);
+        return -1;
+    }
+
+    if (msg->size > sizeof(msg->payload)) {
+        error_report("Failed to read msg header. Size %u exceeds the "
+                     "maximum %zu.", msg->size, sizeof(msg->payload));
+        return -1;
+    }
+
+    if (msg->size) {
+        r = qemu_recv_full(fd, &msg->payload, msg->size, 0);
+        if (r != msg->size) {
+            error_report("Failed to read msg payload. Read %zd instead "
+                         "of %u.", r, msg->size);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int vhost_user_write(struct vhost_dev *dev, VhostUserMsg *msg,
+                            int *fds, int fd_num)
+{
+    int fd = vhost_user_fd(dev);
+    size_t fd_size = fd_num * sizeof(int);
+    char control[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))];
+    struct msghdr msgh;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    ssize_t r;
+
+    memset(&msgh, 0, sizeof(msgh));
+    memset(control, 0, sizeof(control));
+
+    iov.iov_base = msg;
+    iov.iov_len = VHOST_USER_HDR_SIZE + msg->size;
+    msgh.msg_iov = &iov;
+    msgh.msg_iovlen = 1;
+
+    if (fd_num) {
+        msgh.msg_control = control;
+        msgh.msg_controllen = CMSG_SPACE(fd_size);
+
+        cmsg = CMSG_FIRSTHDR(&msgh);
+        cmsg->cmsg_len = CMSG_LEN(fd_size);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsg), fds, fd_size);
+    }
+
+    do {
+        r = sendmsg(fd, &msgh, 0);
+    } while (r < 0 && errno == EINTR);
+
+    if (r < 0) {
+        return -1;
+    }
+    if (r != iov.iov_len) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/* Describe the guest RAM regions of dev->mem by the files backing them */
+static int vhost_user_fill_mem_table(struct vhost_dev *dev, VhostUserMsg *msg,
+                                     int *fds, int *fd_num)
+{
+    int i;
+
+    if (dev->mem->nregions > VHOST_MEMORY_MAX_NREGIONS) {
+        error_report("vhost-user supports at most %d memory regions",
+                     VHOST_MEMORY_MAX_NREGIONS);
+        return -1;
+    }
+
+    for (i = 0; i < dev->mem->nregions; i++) {
+        struct vhost_memory_region *reg = dev->mem->regions + i;
+        VhostUserMemoryRegion *ureg = msg->payload.memory.regions + i;
+        ram_addr_t offset;
+        int fd;
+
+        fd = qemu_ram_get_fd((void *)(uintptr_t)reg->userspace_addr, &offset);
+        if (fd < 0) {
+            error_report("vhost-user needs guest RAM in a shared file, "
+                         "use -mem-path with -mem-prealloc");
+            return -1;
+        }
+        ureg->guest_phys_addr = reg->guest_phys_addr;
+        ureg->memory_size = reg->memory_size;
+        ureg->userspace_addr = reg->userspace_addr;
+        ureg->mmap_offset = offset;
+        fds[i] = fd;
+    }
+
+    msg->payload.memory.nregions = dev->mem->nregions;
+    msg->size = offsetof(VhostUserMemory, regions) +
+                dev->mem->nregions * sizeof(VhostUserMemoryRegion);
+    *fd_num = dev->mem->nregions;
+    return 0;
+}
+
+static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
+                           void *arg)
+{
+    VhostUserMsg msg;
+    VhostUserRequest msg_request;
+    struct vhost_vring_file *file;
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    int fd_num = 0;
+    bool need_reply = false;
+
+    msg_request = vhost_user_request_translate(request);
+    msg.request = msg_request;
+    msg.flags = VHOST_USER_VERSION;
+    msg.size = 0;
+
+    switch (msg_request) {
+    case VHOST_USER_GET_FEATURES:
+        need_reply = true;
+        break;
+
+    case VHOST_USER_SET_FEATURES:
+        msg.payload.u64 = *((uint64_t *) arg);
+        msg.size = sizeof(msg.payload.u64);
+        break;
+
+    case VHOST_USER_SET_OWNER:
+    case VHOST_USER_RESET_OWNER:
+        break;
+
+    case VHOST_USER_SET_MEM_TABLE:
+        if (vhost_user_fill_mem_table(dev, &msg, fds, &fd_num) < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        break;
+
+    case VHOST_USER_SET_VRING_NUM:
+    case VHOST_USER_SET_VRING_BASE:
+        memcpy(&msg.payload.state, arg, sizeof(struct vhost_vring_state));
+        msg.size = sizeof(struct vhost_vring_state);
+        break;
+
+    case VHOST_USER_GET_VRING_BASE:
+        memcpy(&msg.payload.state, arg, sizeof(struct vhost_vring_state));
+        msg.size = sizeof(struct vhost_vring_state);
+        need_reply = true;
+        break;
+
+    case VHOST_USER_SET_VRING_ADDR:
+        memcpy(&msg.payload.addr, arg, sizeof(struct vhost_vring_addr));
+        msg.size = sizeof(struct vhost_vring_addr);
+        break;
+
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL:
+    case VHOST_USER_SET_VRING_ERR:
+        file = arg;
+        msg.payload.u64 = file->index & VHOST_USER_VRING_IDX_MASK;
+        msg.size = sizeof(msg.payload.u64);
+        if (file->fd >= 0) {
+            fds[fd_num++] = file->fd;
+        } else {
+            msg.payload.u64 |= VHOST_USER_VRING_NOFD_MASK;
+        }
+        break;
+
+    default:
+        error_report("vhost-user cannot forward vhost request 0x%lx",
+                     request);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    if (vhost_user_write(dev, &msg, fds, fd_num) < 0) {
+        return -1;
+    }
+
+    if (!need_reply) {
+        return 0;
+    }
+
+    if (vhost_user_read(dev, &msg) < 0 || msg.request != msg_request) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    switch (msg_request) {
+    case VHOST_USER_GET_FEATURES:
+        if (msg.size != sizeof(msg.payload.u64)) {
+            errno = EPROTO;
+            return -1;
+        }
+        *((uint64_t *) arg) = msg.payload.u64;
+        break;
+    case VHOST_USER_GET_VRING_BASE:
+        if (msg.size != sizeof(struct vhost_vring_state)) {
+            errno = EPROTO;
+            return -1;
+        }
+        memcpy(arg, &msg.payload.state, sizeof(struct vhost_vring_state));
+        break;
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+/* opaque is the fd of a socket connected to the backend */
+static int vhost_user_init(struct vhost_dev *dev, void *opaque)
+{
+    int fd = (intptr_t) opaque;
+
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    if (fd < 0) {
+        return -EBADF;
+    }
+    dev->opaque = (void *)(uintptr_t) fd;
+
+    /* Guest memory written by the backend is not tracked */
+    error_set(&dev->migration_blocker, QERR_DEVICE_FEATURE_BLOCKS_MIGRATION,
+              "vhost-user", "virtio-net");
+    migrate_add_blocker(dev->migration_blocker);
+
+    return 0;
+}
+
+static int vhost_user_cleanup(struct vhost_dev *dev)
+{
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    migrate_del_blocker(dev->migration_blocker);
+    error_free(dev->migration_blocker);
+    dev->migration_blocker = NULL;
+
+    return close(vhost_user_fd(dev));
+}
+
+const VhostOps user_ops = {
+        .backend_type = VHOST_BACKEND_TYPE_USER,
+        .vhost_call = vhost_user_call,
+        .vhost_backend_init = vhost_user_init,
+        .vhost_backend_cleanup = vhost_user_cleanup
+};
@@ -4,6 +4,8 @@
 #include "hw/hw.h"
 #include "hw/virtio.h"
 #include "memory.h"
+#include "hw/vhost-backend.h"
+#include "error.h"
 
 /* Generic structures common for any vhost based device. */
 struct vhost_virtqueue {
@@ -28,12 +30,23 @@ typedef unsigned long vhost_log_chunk_t;
 struct vhost_memory;
 struct vhost_dev {
     MemoryListener memory_listener;
-    int control;
+    /* the fd of the vhost device or of the vhost-user socket */
+    void *opaque;
+    const VhostOps *vhost_ops;
+    Error *migration_blocker;
     struct vhost_memory *mem;
+    /* last table passed to VHOST_SET_MEM_TABLE, NULL if none */
+    struct vhost_memory *mem_sent;
+    /* guest range touched by the current memory transaction */
+    bool memory_changed;
+    uint64_t mem_changed_start_addr;
+    uint64_t mem_changed_end_addr;
     int n_mem_sections;
     MemoryRegionSection *mem_sections;
     struct vhost_virtqueue *vqs;
     int nvqs;
+    /* the first virtio queue handled by this device */
+    int vq_index;
     unsigned long long features;
     unsigned long long acked_features;
     unsigned long long backend_features;
@@ -44,7 +57,8 @@ struct vhost_dev {
     bool force;
 };
 
-int vhost_dev_init(struct vhost_dev *hdev, int devfd, bool force);
+int vhost_dev_init(struct vhost_dev *hdev, void *opaque,
+                   VhostBackendType backend_type, bool force);
 void vhost_dev_cleanup(struct vhost_dev *hdev);
 bool vhost_dev_query(struct vhost_dev *hdev, VirtIODevice *vdev);
 int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev);
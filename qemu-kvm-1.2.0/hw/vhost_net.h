@@ -2,15 +2,27 @@
 #define VHOST_NET_H
 
 #include "net.h"
+#include "hw/vhost-backend.h"
 
 struct vhost_net;
 typedef struct vhost_net VHostNetState;
 
-VHostNetState *vhost_net_init(NetClientState *backend, int devfd, bool force);
+typedef struct VhostNetOptions {
+    VhostBackendType backend_type;
+    NetClientState *net_backend;
+    /* device fd (-1 opens /dev/vhost-net), or the vhost-user socket */
+    void *opaque;
+    bool force;
+} VhostNetOptions;
+
+VHostNetState *vhost_net_init(VhostNetOptions *options);
+VHostNetState *get_vhost_net(NetClientState *nc);
 
 bool vhost_net_query(VHostNetState *net, VirtIODevice *dev);
-int vhost_net_start(VHostNetState *net, VirtIODevice *dev);
-void vhost_net_stop(VHostNetState *net, VirtIODevice *dev);
+int vhost_net_start(VirtIODevice *dev, NetClientState **ncs,
+                    int total_queues);
+void vhost_net_stop(VirtIODevice *dev, NetClientState **ncs,
+                    int total_queues);
 
 void vhost_net_cleanup(VHostNetState *net);
 
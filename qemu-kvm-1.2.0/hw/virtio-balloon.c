@@ -22,6 +22,11 @@
 #include "virtio-balloon.h"
 #include "kvm.h"
 #include "exec-memory.h"
+#include "migration.h"
+#include "thread-pool.h"
+#include "qemu-timer.h"
+#include "trace.h"
+#include "qemu-error.h"
 
 #if defined(__linux__)
 #include <sys/mman.h>
@@ -30,27 +35,121 @@
 typedef struct VirtIOBalloon
 {
     VirtIODevice vdev;
-    VirtQueue *ivq, *dvq, *svq;
+    VirtQueue *ivq, *dvq, *svq, *rvq;
     uint32_t num_pages;
     uint32_t actual;
     uint64_t stats[VIRTIO_BALLOON_S_NR];
     VirtQueueElement stats_vq_elem;
     size_t stats_vq_offset;
+    /* stats_vq_elem is held, to be returned for the next stats */
+    bool stats_vq_elem_held;
+    QEMUTimer *stats_timer;
+    VirtIOBalloonConf conf;
     DeviceState *qdev;
+    /* requests in the worker thread */
+    int inflight;
 } VirtIOBalloon;
 
+/*
+ * The pages of a request are coalesced into ranges, which are discarded
+ * by a single worker thread: one madvise() per range instead of one per
+ * page, without holding the global lock.  Requests complete in order, so
+ * pages are never discarded after a later deflate gave them back.
+ */
+typedef struct BalloonRange {
+    void *host;
+    ram_addr_t ram_addr;
+    size_t len;
+} BalloonRange;
+
+typedef struct VirtIOBalloonReq {
+    VirtIOBalloon *s;
+    VirtQueue *vq;
+    VirtQueueElement elem;
+    size_t len;
+    int advice;
+    bool free_hint;
+    BalloonRange *ranges;
+    int nr_ranges;
+} VirtIOBalloonReq;
+
+static ThreadPool *balloon_pool;
+
 static VirtIOBalloon *to_virtio_balloon(VirtIODevice *vdev)
 {
     return (VirtIOBalloon *)vdev;
 }
 
-static void balloon_page(void *addr, int deflate)
+static void balloon_req_add(VirtIOBalloonReq *req, void *host,
+                            ram_addr_t ram_addr, size_t len)
+{
+    BalloonRange *r;
+
+    if (req->nr_ranges) {
+        r = &req->ranges[req->nr_ranges - 1];
+        if (r->host + r->len == host && r->ram_addr + r->len == ram_addr) {
+            r->len += len;
+            return;
+        }
+    }
+    r = &req->ranges[req->nr_ranges++];
+    r->host = host;
+    r->ram_addr = ram_addr;
+    r->len = len;
+}
+
+static int balloon_req_worker(void *opaque)
 {
+    VirtIOBalloonReq *req = opaque;
+    int i;
+
+    for (i = 0; i < req->nr_ranges; i++) {
+        BalloonRange *r = &req->ranges[i];
+
 #if defined(__linux__)
-    if (!kvm_enabled() || kvm_has_sync_mmu())
-        qemu_madvise(addr, TARGET_PAGE_SIZE,
-                deflate ? QEMU_MADV_WILLNEED : QEMU_MADV_DONTNEED);
+        if (!kvm_enabled() || kvm_has_sync_mmu()) {
+            qemu_madvise(r->host, r->len, req->advice);
+        }
 #endif
+        if (req->free_hint) {
+            ram_free_page_hint(r->ram_addr, r->len);
+        }
+    }
+    return 0;
+}
+
+static void balloon_req_complete(void *opaque, int ret)
+{
+    VirtIOBalloonReq *req = opaque;
+    VirtIOBalloon *s = req->s;
+
+    s->inflight--;
+    virtqueue_push(req->vq, &req->elem, req->len);
+    virtio_notify(&s->vdev, req->vq);
+    g_free(req->ranges);
+    g_free(req);
+}
+
+static void balloon_req_submit(VirtIOBalloonReq *req)
+{
+    req->s->inflight++;
+    if (!req->nr_ranges) {
+        balloon_req_complete(req, 0);
+        return;
+    }
+#ifdef CONFIG_POSIX
+    thread_pool_submit_aio(balloon_pool, balloon_req_worker, req,
+                           balloon_req_complete, req);
+#else
+    balloon_req_complete(req, balloon_req_worker(req));
+#endif
+}
+
+static void virtio_balloon_drain(VirtIOBalloon *s)
+{
+    while (s->inflight) {
+        qemu_aio_wait();
+    }
 }
 
 /*
@@ -70,35 +169,185 @@ static inline void reset_stats(VirtIOBalloon *dev)
 static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = to_virtio_balloon(vdev);
-    VirtQueueElement elem;
-    MemoryRegionSection section;
+    /* the RAM found by the last lookup, from the pfn to its end */
+    MemoryRegionSection section = { .mr = NULL, .size = 0 };
+    VirtIOBalloonReq *req;
 
-    while (virtqueue_pop(vq, &elem)) {
+    req = g_new0(VirtIOBalloonReq, 1);
+    while (virtqueue_pop(vq, &req->elem)) {
         size_t offset = 0;
         uint32_t pfn;
 
-        while (iov_to_buf(elem.out_sg, elem.out_num, offset, &pfn, 4) == 4) {
-            ram_addr_t pa;
-            ram_addr_t addr;
+        req->s = s;
+        req->vq = vq;
+        req->advice = vq == s->dvq ? QEMU_MADV_WILLNEED : QEMU_MADV_DONTNEED;
+        req->ranges = g_new(BalloonRange,
+                            iov_size(req->elem.out_sg, req->elem.out_num) / 4);
+
+        while (iov_to_buf(req->elem.out_sg, req->elem.out_num, offset,
+                          &pfn, 4) == 4) {
+            target_phys_addr_t pa, delta;
 
-            pa = (ram_addr_t)ldl_p(&pfn) << VIRTIO_BALLOON_PFN_SHIFT;
+            pa = (target_phys_addr_t)ldl_p(&pfn) << VIRTIO_BALLOON_PFN_SHIFT;
             offset += 4;
 
-            /* FIXME: remove get_system_memory(), but how? */
-            section = memory_region_find(get_system_memory(), pa, 1);
-            if (!section.size || !memory_region_is_ram(section.mr))
-                continue;
+            if (pa < section.offset_within_address_space ||
+                pa - section.offset_within_address_space >= section.size) {
+                /* FIXME: remove get_system_memory(), but how? */
+                section = memory_region_find(get_system_memory(), pa,
+                                             UINT64_MAX - pa);
+                if (!section.size ||
+                    section.offset_within_address_space != pa ||
+                    !memory_region_is_ram(section.mr)) {
+                    section.size = 0;
+                    continue;
+                }
+            }
 
             /* Using memory_region_get_ram_ptr is bending the rules a bit, but
-               should be OK because we only want a single page.  */
-            addr = section.offset_within_region;
-            balloon_page(memory_region_get_ram_ptr(section.mr) + addr,
-                         !!(vq == s->dvq));
+               should be OK because the pages stay within the section.  */
+            delta = section.offset_within_region +
+                    (pa - section.offset_within_address_space);
+            balloon_req_add(req, memory_region_get_ram_ptr(section.mr) + delta,
+                            memory_region_get_ram_addr(section.mr) + delta,
+                            1 << VIRTIO_BALLOON_PFN_SHIFT);
+        }
+
+        req->len = offset;
+        balloon_req_submit(req);
+        req = g_new0(VirtIOBalloonReq, 1);
+    }
+    g_free(req);
+}
+
+/*
+ * Free page reporting: each buffer is a range of pages the guest does not
+ * use until it gets the buffer back.  They are discarded, and a migration
+ * skips them.
+ */
+static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIOBalloon *s = to_virtio_balloon(vdev);
+    VirtIOBalloonReq *req;
+    ram_addr_t ram_addr;
+    int i;
+
+    req = g_new0(VirtIOBalloonReq, 1);
+    while (virtqueue_pop(vq, &req->elem)) {
+        req->s = s;
+        req->vq = vq;
+        req->advice = QEMU_MADV_DONTNEED;
+        req->free_hint = true;
+        req->ranges = g_new(BalloonRange, req->elem.in_num);
+        for (i = 0; i < req->elem.in_num; i++) {
+            void *host = req->elem.in_sg[i].iov_base;
+
+            if (qemu_ram_addr_from_host(host, &ram_addr) == 0) {
+                balloon_req_add(req, host, ram_addr,
+                                req->elem.in_sg[i].iov_len);
+            }
+        }
+
+        balloon_req_submit(req);
+        req = g_new0(VirtIOBalloonReq, 1);
+    }
+    g_free(req);
+}
+
+/* don't move the balloon for less than this */
+#define BALLOON_AUTO_MIN_STEP (16 << 20)
+
+static void virtio_balloon_to_target(void *opaque, ram_addr_t target);
+
+/* Memory available on the host in bytes, or -1 if unknown */
+static int64_t balloon_host_available(void)
+{
+#ifdef __linux__
+    unsigned long long kb;
+    int64_t avail = -1, free_cached = 0;
+    char line[128];
+    FILE *f;
+
+    f = fopen("/proc/meminfo", "r");
+    if (!f) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+            avail = kb << 10;
+            break;
+        }
+        /* older kernels */
+        if (sscanf(line, "MemFree: %llu kB", &kb) == 1 ||
+            sscanf(line, "Cached: %llu kB", &kb) == 1) {
+            free_cached += kb << 10;
         }
+    }
+    fclose(f);
+    return avail >= 0 ? avail : free_cached;
+#else
+    return -1;
+#endif
+}
 
-        virtqueue_push(vq, &elem, offset);
-        virtio_notify(vdev, vq);
+/* Size the balloon after the stats the guest just sent */
+static void virtio_balloon_auto(VirtIOBalloon *s)
+{
+    VirtIOBalloonConf *conf = &s->conf;
+    uint64_t free = s->stats[VIRTIO_BALLOON_S_MEMFREE];
+    int64_t size, target, min, max, want_free, avail;
+    bool pressure = false;
+
+    if (!conf->auto_min || free == (uint64_t)-1) {
+        return;
+    }
+
+    size = ram_size - ((uint64_t)s->actual << VIRTIO_BALLOON_PFN_SHIFT);
+    min = MIN((int64_t)conf->auto_min << 20, ram_size);
+    max = conf->auto_max ? MIN((int64_t)conf->auto_max << 20, ram_size)
+                         : ram_size;
+    if (conf->host_reserve) {
+        avail = balloon_host_available();
+        pressure = avail >= 0 && avail < (int64_t)conf->host_reserve << 20;
+    }
+
+    if (!pressure && free * 100 >= size * conf->free_low &&
+        free * 100 <= size * conf->free_high) {
+        trace_virtio_balloon_auto_keep(s, size, free);
+        return;
+    }
+
+    /* aim for the middle of the range, or its low end to give memory
+       back to the host */
+    want_free = size * (pressure ? conf->free_low :
+                        (conf->free_low + conf->free_high) / 2) / 100;
+    target = size - (int64_t)free + want_free;
+    if (pressure) {
+        target = MIN(target, size);
     }
+    target = MAX(MIN(target, max), min) & TARGET_PAGE_MASK;
+    trace_virtio_balloon_auto(s, size, free, pressure, target);
+
+    if (target > size - BALLOON_AUTO_MIN_STEP &&
+        target < size + BALLOON_AUTO_MIN_STEP) {
+        return;
+    }
+    virtio_balloon_to_target(s, target);
+}
+
+/* Give the guest its stats buffer back, so that it sends new stats */
+static void virtio_balloon_poll_stats(void *opaque)
+{
+    VirtIOBalloon *s = opaque;
+
+    if (s->stats_vq_elem_held &&
+        (s->vdev.guest_features & (1 << VIRTIO_BALLOON_F_STATS_VQ))) {
+        virtqueue_push(s->svq, &s->stats_vq_elem, s->stats_vq_offset);
+        virtio_notify(&s->vdev, s->svq);
+        s->stats_vq_elem_held = false;
+    }
+    qemu_mod_timer(s->stats_timer, qemu_get_clock_ms(vm_clock) +
+                   s->conf.stats_interval * 1000);
 }
 
 static void virtio_balloon_receive_stats(VirtIODevice *vdev, VirtQueue *vq)
@@ -128,6 +377,9 @@ static void virtio_balloon_receive_stats(VirtIODevice *vdev, VirtQueue *vq)
             s->stats[tag] = val;
     }
     s->stats_vq_offset = offset;
+    s->stats_vq_elem_held = true;
+
+    virtio_balloon_auto(s);
 }
 
 static void virtio_balloon_get_config(VirtIODevice *vdev, uint8_t *config_data)
@@ -203,10 +455,21 @@ static void virtio_balloon_to_target(void *opaque, ram_addr_t target)
     }
 }
 
+static void virtio_balloon_reset(VirtIODevice *vdev)
+{
+    VirtIOBalloon *s = to_virtio_balloon(vdev);
+
+    virtio_balloon_drain(s);
+    s->stats_vq_elem_held = false;
+}
+
 static void virtio_balloon_save(QEMUFile *f, void *opaque)
 {
     VirtIOBalloon *s = opaque;
 
+    /* requests in flight were popped from the rings */
+    virtio_balloon_drain(s);
+
     virtio_save(&s->vdev, f);
 
     qemu_put_be32(f, s->num_pages);
@@ -231,11 +494,17 @@ static int virtio_balloon_load(QEMUFile *f, void *opaque, int version_id)
     return 0;
 }
 
-VirtIODevice *virtio_balloon_init(DeviceState *dev)
+VirtIODevice *virtio_balloon_init(DeviceState *dev, VirtIOBalloonConf *conf)
 {
     VirtIOBalloon *s;
     int ret;
 
+    if (conf->free_low > conf->free_high || conf->free_high > 100) {
+        error_report("virtio-balloon: auto-free-low must not be above "
+                     "auto-free-high, nor auto-free-high above 100");
+        return NULL;
+    }
+
     s = (VirtIOBalloon *)virtio_common_init("virtio-balloon",
                                             VIRTIO_ID_BALLOON,
                                             8, sizeof(VirtIOBalloon));
@@ -243,6 +512,7 @@ VirtIODevice *virtio_balloon_init(DeviceState *dev)
     s->vdev.get_config = virtio_balloon_get_config;
     s->vdev.set_config = virtio_balloon_set_config;
     s->vdev.get_features = virtio_balloon_get_features;
+    s->vdev.reset = virtio_balloon_reset;
 
     ret = qemu_add_balloon_handler(virtio_balloon_to_target,
                                    virtio_balloon_stat, s);
@@ -254,9 +524,24 @@ VirtIODevice *virtio_balloon_init(DeviceState *dev)
     s->ivq = virtio_add_queue(&s->vdev, 128, virtio_balloon_handle_output);
     s->dvq = virtio_add_queue(&s->vdev, 128, virtio_balloon_handle_output);
     s->svq = virtio_add_queue(&s->vdev, 128, virtio_balloon_receive_stats);
+    s->rvq = virtio_add_queue(&s->vdev, 128, virtio_balloon_handle_report);
+
+#ifdef CONFIG_POSIX
+    if (!balloon_pool) {
+        balloon_pool = thread_pool_new(1);
+    }
+#endif
 
     reset_stats(s);
 
+    s->conf = *conf;
+    if (s->conf.stats_interval) {
+        s->stats_timer = qemu_new_timer_ms(vm_clock,
+                                           virtio_balloon_poll_stats, s);
+        qemu_mod_timer(s->stats_timer, qemu_get_clock_ms(vm_clock) +
+                       s->conf.stats_interval * 1000);
+    }
+
     s->qdev = dev;
     register_savevm(dev, "virtio-balloon", -1, 1,
                     virtio_balloon_save, virtio_balloon_load, s);
@@ -268,6 +553,11 @@ void virtio_balloon_exit(VirtIODevice *vdev)
 {
     VirtIOBalloon *s = DO_UPCAST(VirtIOBalloon, vdev, vdev);
 
+    virtio_balloon_drain(s);
+    if (s->stats_timer) {
+        qemu_del_timer(s->stats_timer);
+        qemu_free_timer(s->stats_timer);
+    }
     qemu_remove_balloon_handler(s);
     unregister_savevm(s->qdev, "virtio-balloon", s);
     virtio_cleanup(vdev);
@@ -26,6 +26,7 @@
 /* The feature bitmap for virtio balloon */
 #define VIRTIO_BALLOON_F_MUST_TELL_HOST 0 /* Tell before reclaiming pages */
 #define VIRTIO_BALLOON_F_STATS_VQ 1       /* Memory stats virtqueue */
+#define VIRTIO_BALLOON_F_REPORTING 5      /* Free page reporting virtqueue */
 
 /* Size of a PFN in the balloon interface. */
 #define VIRTIO_BALLOON_PFN_SHIFT 12
@@ -38,6 +39,22 @@ struct virtio_balloon_config
     uint32_t actual;
 };
 
+/*
+ * Automatic ballooning: every stats_interval seconds the guest's memory
+ * stats are requested, and the balloon is sized so that the guest keeps
+ * between free_low and free_high percent of its memory free, within
+ * [auto_min, auto_max].  While the host has less than host_reserve
+ * available, the guest is only shrunk, down to free_low.
+ */
+struct VirtIOBalloonConf {
+    uint32_t stats_interval;    /* seconds, 0 to not poll */
+    uint32_t auto_min;          /* MB, 0 disables the policy */
+    uint32_t auto_max;          /* MB, 0 for all of RAM */
+    uint32_t free_low;          /* percent */
+    uint32_t free_high;         /* percent */
+    uint32_t host_reserve;      /* MB, 0 to ignore the host */
+};
+
 /* Memory Statistics */
 #define VIRTIO_BALLOON_S_SWAP_IN  0   /* Amount of memory swapped in */
 #define VIRTIO_BALLOON_S_SWAP_OUT 1   /* Amount of memory swapped out */
@@ -18,21 +18,37 @@
 #include "blockdev.h"
 #include "virtio-blk.h"
 #include "scsi-defs.h"
+#include "iov.h"
 #ifdef __linux__
 # include <scsi/sg.h>
 #endif
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#include "hw/dataplane/virtio-blk.h"
+#endif
+
+/* Virtqueue size, also the number of requests kept for reuse per queue */
+#define VIRTIO_BLK_QUEUE_SIZE 128
+
+/* Limits of VIRTIO_BLK_T_DISCARD requests */
+#define VIRTIO_BLK_MAX_DISCARD_SECTORS  (1U << 30)
+#define VIRTIO_BLK_MAX_DISCARD_SEG      256
 
 typedef struct VirtIOBlock
 {
     VirtIODevice vdev;
     BlockDriverState *bs;
-    VirtQueue *vq;
     void *rq;
     QEMUBH *bh;
     BlockConf *conf;
     VirtIOBlkConf *blk;
     unsigned short sector_mask;
     DeviceState *qdev;
+    struct VirtIOBlockReq *free_reqs;
+    unsigned int num_free_reqs;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOBlockDataPlane *dataplane;
+#endif
+    VirtQueue *vqs[0];              /* blk->num_queues request queues */
 } VirtIOBlock;
 
 static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
@@ -43,6 +59,7 @@ static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
 typedef struct VirtIOBlockReq
 {
     VirtIOBlock *dev;
+    VirtQueue *vq;
     VirtQueueElement elem;
     struct virtio_blk_inhdr *in;
     struct virtio_blk_outhdr *out;
@@ -52,6 +69,24 @@ typedef struct VirtIOBlockReq
     BlockAcctCookie acct;
 } VirtIOBlockReq;
 
+/*
+ * Requests embed a full VirtQueueElement, which is too big to go through
+ * malloc for every I/O.  Completed requests are kept on a per-device free
+ * list, up to one full set of queues, and handed out again.
+ */
+static void virtio_blk_free_request(VirtIOBlockReq *req)
+{
+    VirtIOBlock *s = req->dev;
+
+    if (s->num_free_reqs >= s->blk->num_queues * VIRTIO_BLK_QUEUE_SIZE) {
+        g_free(req);
+        return;
+    }
+    req->next = s->free_reqs;
+    s->free_reqs = req;
+    s->num_free_reqs++;
+}
+
 static void virtio_blk_req_complete(VirtIOBlockReq *req, int status)
 {
     VirtIOBlock *s = req->dev;
@@ -59,8 +94,8 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, int status)
     trace_virtio_blk_req_complete(req, status);
 
     stb_p(&req->in->status, status);
-    virtqueue_push(s->vq, &req->elem, req->qiov.size + sizeof(*req->in));
-    virtio_notify(&s->vdev, s->vq);
+    virtqueue_push(req->vq, &req->elem, req->qiov.size + sizeof(*req->in));
+    virtio_notify(&s->vdev, req->vq);
 }
 
 static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
@@ -84,7 +119,7 @@ static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
     } else {
         virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
         bdrv_acct_done(s->bs, &req->acct);
-        g_free(req);
+        virtio_blk_free_request(req);
         bdrv_emit_qmp_error_event(s->bs, BDRV_ACTION_REPORT, is_read);
     }
 
@@ -105,7 +140,7 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
 
     virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
     bdrv_acct_done(req->dev->bs, &req->acct);
-    g_free(req);
+    virtio_blk_free_request(req);
 }
 
 static void virtio_blk_flush_complete(void *opaque, int ret)
@@ -120,25 +155,34 @@ static void virtio_blk_flush_complete(void *opaque, int ret)
 
     virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
     bdrv_acct_done(req->dev->bs, &req->acct);
-    g_free(req);
+    virtio_blk_free_request(req);
 }
 
-static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s)
+static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s,
+                                                VirtQueue *vq)
 {
-    VirtIOBlockReq *req = g_malloc(sizeof(*req));
+    VirtIOBlockReq *req = s->free_reqs;
+
+    if (req) {
+        s->free_reqs = req->next;
+        s->num_free_reqs--;
+    } else {
+        req = g_malloc(sizeof(*req));
+    }
     req->dev = s;
+    req->vq = vq;
     req->qiov.size = 0;
     req->next = NULL;
     return req;
 }
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
+static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req = virtio_blk_alloc_request(s);
+    VirtIOBlockReq *req = virtio_blk_alloc_request(s, vq);
 
     if (req != NULL) {
-        if (!virtqueue_pop(s->vq, &req->elem)) {
-            g_free(req);
+        if (!virtqueue_pop(vq, &req->elem)) {
+            virtio_blk_free_request(req);
             return NULL;
         }
     }
@@ -163,7 +207,7 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
      */
     if (req->elem.out_num < 2 || req->elem.in_num < 3) {
         virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
-        g_free(req);
+        virtio_blk_free_request(req);
         return;
     }
 
@@ -253,7 +297,7 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
     stl_p(&req->scsi->data_len, hdr.dxfer_len);
 
     virtio_blk_req_complete(req, status);
-    g_free(req);
+    virtio_blk_free_request(req);
     return;
 #else
     abort();
@@ -263,12 +307,14 @@ fail:
     /* Just put anything nonzero so that the ioctl fails in the guest.  */
     stl_p(&req->scsi->errors, 255);
     virtio_blk_req_complete(req, status);
-    g_free(req);
+    virtio_blk_free_request(req);
 }
 
 typedef struct MultiReqBuffer {
     BlockRequest        blkreq[32];
     unsigned int        num_writes;
+    BlockRequest        readreq[32];
+    unsigned int        num_reads;
 } MultiReqBuffer;
 
 static void virtio_submit_multiwrite(BlockDriverState *bs, MultiReqBuffer *mrb)
@@ -291,6 +337,26 @@ static void virtio_submit_multiwrite(BlockDriverState *bs, MultiReqBuffer *mrb)
     mrb->num_writes = 0;
 }
 
+static void virtio_submit_multiread(BlockDriverState *bs, MultiReqBuffer *mrb)
+{
+    int i, ret;
+
+    if (!mrb->num_reads) {
+        return;
+    }
+
+    ret = bdrv_aio_multiread(bs, mrb->readreq, mrb->num_reads);
+    if (ret != 0) {
+        for (i = 0; i < mrb->num_reads; i++) {
+            if (mrb->readreq[i].error) {
+                virtio_blk_rw_complete(mrb->readreq[i].opaque, -EIO);
+            }
+        }
+    }
+
+    mrb->num_reads = 0;
+}
+
 static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
     bdrv_acct_start(req->dev->bs, &req->acct, 0, BDRV_ACCT_FLUSH);
@@ -302,6 +368,69 @@ static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     bdrv_aio_flush(req->dev->bs, virtio_blk_flush_complete, req);
 }
 
+static void virtio_blk_discard_complete(void *opaque, int ret)
+{
+    VirtIOBlockReq *req = opaque;
+
+    trace_virtio_blk_rw_complete(req, ret);
+
+    /* Discard is only a hint, so the error policy does not apply */
+    virtio_blk_req_complete(req, ret ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK);
+    virtio_blk_free_request(req);
+}
+
+static void virtio_blk_handle_discard(VirtIOBlockReq *req)
+{
+    VirtIOBlock *s = req->dev;
+    struct iovec *iov = &req->elem.out_sg[1];
+    unsigned int iov_cnt = req->elem.out_num - 1;
+    size_t size = iov_size(iov, iov_cnt);
+    int i, n = size / sizeof(struct virtio_blk_discard);
+    BlockDiscardRange *ranges;
+    int status;
+
+    if (!s->conf->discard_granularity) {
+        status = VIRTIO_BLK_S_UNSUPP;
+        goto fail;
+    }
+    if (n == 0 || n > VIRTIO_BLK_MAX_DISCARD_SEG ||
+        size % sizeof(struct virtio_blk_discard)) {
+        status = VIRTIO_BLK_S_IOERR;
+        goto fail;
+    }
+
+    ranges = g_new(BlockDiscardRange, n);
+    for (i = 0; i < n; i++) {
+        struct virtio_blk_discard d;
+
+        iov_to_buf(iov, iov_cnt, i * sizeof(d), &d, sizeof(d));
+        ranges[i].sector_num = ldq_p(&d.sector);
+        ranges[i].nb_sectors = ldl_p(&d.num_sectors);
+
+        if (ldl_p(&d.flags) != 0) {
+            g_free(ranges);
+            status = VIRTIO_BLK_S_UNSUPP;
+            goto fail;
+        }
+        if ((ranges[i].sector_num | ranges[i].nb_sectors) & s->sector_mask ||
+            ranges[i].nb_sectors > VIRTIO_BLK_MAX_DISCARD_SECTORS) {
+            g_free(ranges);
+            status = VIRTIO_BLK_S_IOERR;
+            goto fail;
+        }
+    }
+
+    trace_virtio_blk_handle_discard(req, n);
+    bdrv_aio_discard_ranges(s->bs, ranges, n, virtio_blk_discard_complete,
+                            req);
+    g_free(ranges);
+    return;
+
+fail:
+    virtio_blk_req_complete(req, status);
+    virtio_blk_free_request(req);
+}
+
 static void virtio_blk_handle_write(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
     BlockRequest *blkreq;
@@ -337,8 +466,9 @@ static void virtio_blk_handle_write(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     mrb->num_writes++;
 }
 
-static void virtio_blk_handle_read(VirtIOBlockReq *req)
+static void virtio_blk_handle_read(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
+    BlockRequest *blkreq;
     uint64_t sector;
 
     sector = ldq_p(&req->out->sector);
@@ -355,9 +485,20 @@ static void virtio_blk_handle_read(VirtIOBlockReq *req)
         virtio_blk_rw_complete(req, -EIO);
         return;
     }
-    bdrv_aio_readv(req->dev->bs, sector, &req->qiov,
-                   req->qiov.size / BDRV_SECTOR_SIZE,
-                   virtio_blk_rw_complete, req);
+
+    if (mrb->num_reads == 32) {
+        virtio_submit_multiread(req->dev->bs, mrb);
+    }
+
+    blkreq = &mrb->readreq[mrb->num_reads];
+    blkreq->sector = sector;
+    blkreq->nb_sectors = req->qiov.size / BDRV_SECTOR_SIZE;
+    blkreq->qiov = &req->qiov;
+    blkreq->cb = virtio_blk_rw_complete;
+    blkreq->opaque = req;
+    blkreq->error = 0;
+
+    mrb->num_reads++;
 }
 
 static void virtio_blk_handle_request(VirtIOBlockReq *req,
@@ -381,7 +522,10 @@ static void virtio_blk_handle_request(VirtIOBlockReq *req,
 
     type = ldl_p(&req->out->type);
 
-    if (type & VIRTIO_BLK_T_FLUSH) {
+    /* DISCARD shares bits with the older request types, test it first */
+    if ((type & ~VIRTIO_BLK_T_BARRIER) == VIRTIO_BLK_T_DISCARD) {
+        virtio_blk_handle_discard(req);
+    } else if (type & VIRTIO_BLK_T_FLUSH) {
         virtio_blk_handle_flush(req, mrb);
     } else if (type & VIRTIO_BLK_T_SCSI_CMD) {
         virtio_blk_handle_scsi(req);
@@ -396,7 +540,7 @@ static void virtio_blk_handle_request(VirtIOBlockReq *req,
                 s->blk->serial ? s->blk->serial : "",
                 MIN(req->elem.in_sg[0].iov_len, VIRTIO_BLK_ID_BYTES));
         virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
-        g_free(req);
+        virtio_blk_free_request(req);
     } else if (type & VIRTIO_BLK_T_OUT) {
         qemu_iovec_init_external(&req->qiov, &req->elem.out_sg[1],
                                  req->elem.out_num - 1);
@@ -404,7 +548,7 @@ static void virtio_blk_handle_request(VirtIOBlockReq *req,
     } else {
         qemu_iovec_init_external(&req->qiov, &req->elem.in_sg[0],
                                  req->elem.in_num - 1);
-        virtio_blk_handle_read(req);
+        virtio_blk_handle_read(req, mrb);
     }
 }
 
@@ -414,13 +558,30 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     VirtIOBlockReq *req;
     MultiReqBuffer mrb = {
         .num_writes = 0,
+        .num_reads = 0,
     };
 
-    while ((req = virtio_blk_get_request(s))) {
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    /* Some guests kick before setting VIRTIO_CONFIG_S_DRIVER_OK so start
+     * dataplane here instead of waiting for .set_status().
+     */
+    if (s->dataplane) {
+        virtio_blk_data_plane_start(s->dataplane);
+        return;
+    }
+#endif
+
+    /* submit all requests of this kick with as few syscalls as possible */
+    bdrv_io_plug(s->bs);
+
+    while ((req = virtio_blk_get_request(s, vq))) {
         virtio_blk_handle_request(req, &mrb);
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
+    virtio_submit_multiread(s->bs, &mrb);
+
+    bdrv_io_unplug(s->bs);
 
     /*
      * FIXME: Want to check for completions before returning to guest mode,
@@ -435,6 +596,7 @@ static void virtio_blk_dma_restart_bh(void *opaque)
     VirtIOBlockReq *req = s->rq;
     MultiReqBuffer mrb = {
         .num_writes = 0,
+        .num_reads = 0,
     };
 
     qemu_bh_delete(s->bh);
@@ -448,6 +610,7 @@ static void virtio_blk_dma_restart_bh(void *opaque)
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
+    virtio_submit_multiread(s->bs, &mrb);
 }
 
 static void virtio_blk_dma_restart_cb(void *opaque, int running,
@@ -466,6 +629,14 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running,
 
 static void virtio_blk_reset(VirtIODevice *vdev)
 {
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOBlock *s = to_virtio_blk(vdev);
+
+    if (s->dataplane) {
+        virtio_blk_data_plane_stop(s->dataplane);
+    }
+#endif
+
     /*
      * This should cancel pending requests, but can't do nicely until there
      * are per-device request lists.
@@ -490,6 +661,11 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     stl_raw(&blkcfg.blk_size, blk_size);
     stw_raw(&blkcfg.min_io_size, s->conf->min_io_size / blk_size);
     stw_raw(&blkcfg.opt_io_size, s->conf->opt_io_size / blk_size);
+    stw_raw(&blkcfg.num_queues, s->blk->num_queues);
+    stl_raw(&blkcfg.max_discard_sectors, VIRTIO_BLK_MAX_DISCARD_SECTORS);
+    stl_raw(&blkcfg.max_discard_seg, VIRTIO_BLK_MAX_DISCARD_SEG);
+    stl_raw(&blkcfg.discard_sector_alignment,
+            s->conf->discard_granularity / BDRV_SECTOR_SIZE);
     blkcfg.heads = s->conf->heads;
     /*
      * We must ensure that the block device capacity is a multiple of
@@ -533,6 +709,15 @@ static uint32_t virtio_blk_get_features(VirtIODevice *vdev, uint32_t features)
     features |= (1 << VIRTIO_BLK_F_BLK_SIZE);
     features |= (1 << VIRTIO_BLK_F_SCSI);
 
+    if (s->blk->num_queues > 1) {
+        features |= (1 << VIRTIO_BLK_F_MQ);
+    }
+
+    /* The data plane only does reads, writes and flushes */
+    if (s->conf->discard_granularity && !s->blk->data_plane) {
+        features |= (1 << VIRTIO_BLK_F_DISCARD);
+    }
+
     if (bdrv_enable_write_cache(s->bs))
         features |= (1 << VIRTIO_BLK_F_WCE);
 
@@ -547,6 +732,13 @@ static void virtio_blk_set_status(VirtIODevice *vdev, uint8_t status)
     VirtIOBlock *s = to_virtio_blk(vdev);
     uint32_t features;
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (s->dataplane && !(status & (VIRTIO_CONFIG_S_DRIVER |
+                                    VIRTIO_CONFIG_S_DRIVER_OK))) {
+        virtio_blk_data_plane_stop(s->dataplane);
+    }
+#endif
+
     if (!(status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return;
     }
@@ -564,6 +756,10 @@ static void virtio_blk_save(QEMUFile *f, void *opaque)
     
     while (req) {
         qemu_put_sbyte(f, 1);
+        /* single queue devices keep the old format */
+        if (s->blk->num_queues > 1) {
+            qemu_put_be32(f, virtio_queue_get_id(req->vq));
+        }
         qemu_put_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
         req = req->next;
     }
@@ -584,7 +780,16 @@ static int virtio_blk_load(QEMUFile *f, void *opaque, int version_id)
     }
 
     while (qemu_get_sbyte(f)) {
-        VirtIOBlockReq *req = virtio_blk_alloc_request(s);
+        unsigned int n = 0;
+        VirtIOBlockReq *req;
+
+        if (s->blk->num_queues > 1) {
+            n = qemu_get_be32(f);
+            if (n >= s->blk->num_queues) {
+                return -EINVAL;
+            }
+        }
+        req = virtio_blk_alloc_request(s, s->vqs[n]);
         qemu_get_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
         req->next = s->rq;
         s->rq = req;
@@ -613,6 +818,7 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
 {
     VirtIOBlock *s;
     static int virtio_blk_id;
+    int i;
 
     if (!blk->conf.bs) {
         error_report("drive property not set");
@@ -623,6 +829,12 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
         return NULL;
     }
 
+    if (blk->num_queues < 1 || blk->num_queues > VIRTIO_PCI_QUEUE_MAX) {
+        error_report("num_queues must be between 1 and %d",
+                     VIRTIO_PCI_QUEUE_MAX);
+        return NULL;
+    }
+
     blkconf_serial(&blk->conf, &blk->serial);
     if (blkconf_geometry(&blk->conf, NULL, 65535, 255, 255) < 0) {
         return NULL;
@@ -630,7 +842,9 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
 
     s = (VirtIOBlock *)virtio_common_init("virtio-blk", VIRTIO_ID_BLOCK,
                                           sizeof(struct virtio_blk_config),
-                                          sizeof(VirtIOBlock));
+                                          sizeof(VirtIOBlock) +
+                                          blk->num_queues *
+                                          sizeof(VirtQueue *));
 
     s->vdev.get_config = virtio_blk_update_config;
     s->vdev.set_config = virtio_blk_set_config;
@@ -641,9 +855,20 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
     s->conf = &blk->conf;
     s->blk = blk;
     s->rq = NULL;
+    s->free_reqs = NULL;
+    s->num_free_reqs = 0;
     s->sector_mask = (s->conf->logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
-    s->vq = virtio_add_queue(&s->vdev, 128, virtio_blk_handle_output);
+    for (i = 0; i < blk->num_queues; i++) {
+        s->vqs[i] = virtio_add_queue(&s->vdev, VIRTIO_BLK_QUEUE_SIZE,
+                                     virtio_blk_handle_output);
+    }
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (!virtio_blk_data_plane_create(&s->vdev, blk, &s->dataplane)) {
+        virtio_cleanup(&s->vdev);
+        return NULL;
+    }
+#endif
 
     qemu_add_vm_change_state_handler(virtio_blk_dma_restart_cb, s);
     s->qdev = dev;
@@ -661,6 +886,16 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
 void virtio_blk_exit(VirtIODevice *vdev)
 {
     VirtIOBlock *s = to_virtio_blk(vdev);
+    VirtIOBlockReq *req;
+
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    virtio_blk_data_plane_destroy(s->dataplane);
+    s->dataplane = NULL;
+#endif
+    while ((req = s->free_reqs)) {
+        s->free_reqs = req->next;
+        g_free(req);
+    }
     unregister_savevm(s->qdev, "virtio-blk", s);
     blockdev_mark_auto_del(s->bs);
     virtio_cleanup(vdev);
@@ -34,6 +34,8 @@
 #define VIRTIO_BLK_F_WCE        9       /* write cache enabled */
 #define VIRTIO_BLK_F_TOPOLOGY   10      /* Topology information is available */
 #define VIRTIO_BLK_F_CONFIG_WCE 11      /* write cache configurable */
+#define VIRTIO_BLK_F_MQ         12      /* support more than one vq */
+#define VIRTIO_BLK_F_DISCARD    13      /* DISCARD is supported */
 
 #define VIRTIO_BLK_ID_BYTES     20      /* ID string length */
 
@@ -51,6 +53,11 @@ struct virtio_blk_config
     uint16_t min_io_size;
     uint32_t opt_io_size;
     uint8_t wce;
+    uint8_t unused;
+    uint16_t num_queues;
+    uint32_t max_discard_sectors;
+    uint32_t max_discard_seg;
+    uint32_t discard_sector_alignment;
 } QEMU_PACKED;
 
 /* These two define direction. */
@@ -66,6 +73,9 @@ struct virtio_blk_config
 /* return the device ID string */
 #define VIRTIO_BLK_T_GET_ID     8
 
+/* Discard sectors, the payload is an array of virtio_blk_discard */
+#define VIRTIO_BLK_T_DISCARD    11
+
 /* Barrier before this op. */
 #define VIRTIO_BLK_T_BARRIER    0x80000000
 
@@ -80,6 +90,14 @@ struct virtio_blk_outhdr
     uint64_t sector;
 };
 
+/* One range of a VIRTIO_BLK_T_DISCARD request */
+struct virtio_blk_discard
+{
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+};
+
 #define VIRTIO_BLK_S_OK         0
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
@@ -105,6 +123,8 @@ struct VirtIOBlkConf
     char *serial;
     uint32_t scsi;
     uint32_t config_wce;
+    uint32_t data_plane;
+    uint32_t num_queues;
 };
 
 #define DEFINE_VIRTIO_BLK_FEATURES(_state, _field) \
@@ -26,26 +26,63 @@
 #define MAC_TABLE_ENTRIES    64
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
-typedef struct VirtIONet
-{
-    VirtIODevice vdev;
-    uint8_t mac[ETH_ALEN];
-    uint16_t status;
+/* Room for a GSO packet read past the end of the guest's buffer, as
+ * much as the tap backend reads at most */
+#define RX_SPILL_SIZE    (4096 + 65536)
+
+/* Packets handed to the backend at once by virtio_net_flush_tx() */
+#define VIRTIO_NET_TX_BATCH    16
+
+/* Only tap backends have more than one queue */
+#define MAX_QUEUE_PAIRS    MAX_TAP_QUEUES
+
+struct VirtIONet;
+
+/* Interrupts held back for one virtqueue, see virtio_net_coalesce() */
+typedef struct VirtIONetCoalesce {
+    struct VirtIONet *n;
+    VirtQueue *vq;
+    const NetCoalesce *params;  /* in the NIC's NetClientState */
+    uint32_t pending;           /* completions not signalled yet */
+    QEMUTimer *timer;           /* armed whenever pending != 0 */
+} VirtIONetCoalesce;
+
+/* One RX/TX queue pair, bound to the same queue of the backend */
+typedef struct VirtIONetQueue {
+    struct VirtIONet *n;
     VirtQueue *rx_vq;
     VirtQueue *tx_vq;
-    VirtQueue *ctrl_vq;
     NICState *nic;
     QEMUTimer *tx_timer;
     QEMUBH *tx_bh;
-    uint32_t tx_timeout;
-    int32_t tx_burst;
     int tx_waiting;
-    uint32_t has_vnet_hdr;
-    uint8_t has_ufo;
     struct {
         VirtQueueElement elem;
         ssize_t len;
     } async_tx;
+    VirtIONetCoalesce rx_coalesce;
+    VirtIONetCoalesce tx_coalesce;
+    uint8_t *rx_spill;          /* see virtio_net_receive_read() */
+    VirtQueueElement *tx_batch; /* VIRTIO_NET_TX_BATCH elements */
+    NetBatchPacket tx_pkts[VIRTIO_NET_TX_BATCH];
+    ssize_t tx_hdr_len[VIRTIO_NET_TX_BATCH];
+} VirtIONetQueue;
+
+typedef struct VirtIONet
+{
+    VirtIODevice vdev;
+    uint8_t mac[ETH_ALEN];
+    uint16_t status;
+    VirtIONetQueue *vqs;
+    VirtQueue *ctrl_vq;
+    NICState *nic;              /* vqs[0].nic */
+    uint16_t max_queues;
+    uint16_t curr_queues;       /* queue pairs the driver uses */
+    size_t config_size;
+    uint32_t tx_timeout;
+    int32_t tx_burst;
+    uint32_t has_vnet_hdr;
+    uint8_t has_ufo;
     int mergeable_rx_bufs;
     uint8_t promisc;
     uint8_t allmulti;
@@ -69,19 +106,94 @@ typedef struct VirtIONet
  * - we could suppress RX interrupt if we were so inclined.
  */
 
+static void virtio_net_coalesce_flush(VirtIONetCoalesce *c)
+{
+    if (c->pending) {
+        qemu_del_timer(c->timer);
+        c->pending = 0;
+        virtio_notify(&c->n->vdev, c->vq);
+    }
+}
+
+static void virtio_net_coalesce_timer(void *opaque)
+{
+    virtio_net_coalesce_flush(opaque);
+}
+
+/*
+ * Signal @count completed buffers on c->vq.  With moderation enabled the
+ * interrupt is held back until max_frames buffers are pending or usecs
+ * have passed since the first of them.
+ */
+static void virtio_net_coalesce(VirtIONetCoalesce *c, uint32_t count)
+{
+    const NetCoalesce *params = c->params;
+
+    if (!params->usecs && !c->pending) {
+        virtio_notify(&c->n->vdev, c->vq);
+        return;
+    }
+
+    c->pending += count;
+    if (!params->usecs ||
+        (params->max_frames && c->pending >= params->max_frames)) {
+        virtio_net_coalesce_flush(c);
+    } else if (c->pending == count) {
+        qemu_mod_timer(c->timer, qemu_get_clock_ns(vm_clock) +
+                       (int64_t)params->usecs * SCALE_US);
+    }
+}
+
+static void virtio_net_coalesce_init(VirtIONet *n, VirtIONetCoalesce *c,
+                                     VirtQueue *vq, const NetCoalesce *params)
+{
+    c->n = n;
+    c->vq = vq;
+    c->params = params;
+    c->pending = 0;
+    c->timer = qemu_new_timer_ns(vm_clock, virtio_net_coalesce_timer, c);
+}
+
+static void virtio_net_coalesce_cleanup(VirtIONetCoalesce *c)
+{
+    qemu_del_timer(c->timer);
+    qemu_free_timer(c->timer);
+}
+
 static VirtIONet *to_virtio_net(VirtIODevice *vdev)
 {
     return (VirtIONet *)vdev;
 }
 
+static VirtIONetQueue *virtio_net_get_queue(NetClientState *nc)
+{
+    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+
+    return &n->vqs[nc->queue_index];
+}
+
+/* Find the queue pair @vq belongs to */
+static VirtIONetQueue *virtio_net_vq_to_queue(VirtIONet *n, VirtQueue *vq)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        if (n->vqs[i].rx_vq == vq || n->vqs[i].tx_vq == vq) {
+            return &n->vqs[i];
+        }
+    }
+    abort();
+}
+
 static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
 {
     VirtIONet *n = to_virtio_net(vdev);
     struct virtio_net_config netcfg;
 
     stw_p(&netcfg.status, n->status);
+    stw_p(&netcfg.max_virtqueue_pairs, n->max_queues);
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
-    memcpy(config, &netcfg, sizeof(netcfg));
+    memcpy(config, &netcfg, n->config_size);
 }
 
 static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
@@ -89,7 +201,7 @@ static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
     VirtIONet *n = to_virtio_net(vdev);
     struct virtio_net_config netcfg;
 
-    memcpy(&netcfg, config, sizeof(netcfg));
+    memcpy(&netcfg, config, n->config_size);
 
     if (memcmp(netcfg.mac, n->mac, ETH_ALEN)) {
         memcpy(n->mac, netcfg.mac, ETH_ALEN);
@@ -105,26 +217,27 @@ static bool virtio_net_started(VirtIONet *n, uint8_t status)
 
 static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
 {
-    if (!n->nic->nc.peer) {
-        return;
-    }
-    if (n->nic->nc.peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
-        return;
-    }
+    NetClientState *peers[MAX_QUEUE_PAIRS];
+    int i;
 
-    if (!tap_get_vhost_net(n->nic->nc.peer)) {
+    if (!get_vhost_net(n->nic->nc.peer)) {
         return;
     }
     if (!!n->vhost_started == virtio_net_started(n, status) &&
                               !n->nic->nc.peer->link_down) {
         return;
     }
+
+    for (i = 0; i < n->curr_queues; i++) {
+        peers[i] = n->vqs[i].nic->nc.peer;
+    }
+
     if (!n->vhost_started) {
         int r;
-        if (!vhost_net_query(tap_get_vhost_net(n->nic->nc.peer), &n->vdev)) {
+        if (!vhost_net_query(get_vhost_net(n->nic->nc.peer), &n->vdev)) {
             return;
         }
-        r = vhost_net_start(tap_get_vhost_net(n->nic->nc.peer), &n->vdev);
+        r = vhost_net_start(&n->vdev, peers, n->curr_queues);
         if (r < 0) {
             error_report("unable to start vhost net: %d: "
                          "falling back on userspace virtio", -r);
@@ -132,7 +245,7 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
             n->vhost_started = 1;
         }
     } else {
-        vhost_net_stop(tap_get_vhost_net(n->nic->nc.peer), &n->vdev);
+        vhost_net_stop(&n->vdev, peers, n->curr_queues);
         n->vhost_started = 0;
     }
 }
@@ -141,24 +254,56 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = to_virtio_net(vdev);
 
+    VirtIONetQueue *q;
+    uint8_t queue_status;
+    int i;
+
     virtio_net_vhost_status(n, status);
 
-    if (!n->tx_waiting) {
+    for (i = 0; i < n->max_queues; i++) {
+        q = &n->vqs[i];
+        queue_status = i < n->curr_queues ? status : 0;
+
+        if (!q->tx_waiting) {
+            continue;
+        }
+
+        if (virtio_net_started(n, queue_status) && !n->vhost_started) {
+            if (q->tx_timer) {
+                qemu_mod_timer(q->tx_timer,
+                               qemu_get_clock_ns(vm_clock) + n->tx_timeout);
+            } else {
+                qemu_bh_schedule(q->tx_bh);
+            }
+        } else {
+            if (q->tx_timer) {
+                qemu_del_timer(q->tx_timer);
+            } else {
+                qemu_bh_cancel(q->tx_bh);
+            }
+        }
+    }
+}
+
+/* Only the queue pairs in use get traffic from a multiqueue backend */
+static void virtio_net_set_queues(VirtIONet *n)
+{
+    NetClientState *peer;
+    int i;
+
+    if (n->max_queues == 1) {
         return;
     }
 
-    if (virtio_net_started(n, status) && !n->vhost_started) {
-        if (n->tx_timer) {
-            qemu_mod_timer(n->tx_timer,
-                           qemu_get_clock_ns(vm_clock) + n->tx_timeout);
-        } else {
-            qemu_bh_schedule(n->tx_bh);
+    for (i = 0; i < n->max_queues; i++) {
+        peer = n->vqs[i].nic->nc.peer;
+        if (!peer || peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
+            continue;
         }
-    } else {
-        if (n->tx_timer) {
-            qemu_del_timer(n->tx_timer);
+        if (i < n->curr_queues) {
+            tap_enable(peer);
         } else {
-            qemu_bh_cancel(n->tx_bh);
+            tap_disable(peer);
         }
     }
 }
@@ -179,9 +324,22 @@ static void virtio_net_set_link_status(NetClientState *nc)
     virtio_net_set_status(&n->vdev, n->vdev.status);
 }
 
+static void virtio_net_set_coalesce(NetClientState *nc)
+{
+    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    int i;
+
+    /* New parameters apply from the next completion on */
+    for (i = 0; i < n->max_queues; i++) {
+        virtio_net_coalesce_flush(&n->vqs[i].rx_coalesce);
+        virtio_net_coalesce_flush(&n->vqs[i].tx_coalesce);
+    }
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    int i;
 
     /* Reset back to compatibility mode */
     n->promisc = 1;
@@ -198,6 +356,18 @@ static void virtio_net_reset(VirtIODevice *vdev)
     n->mac_table.uni_overflow = 0;
     memset(n->mac_table.macs, 0, MAC_TABLE_ENTRIES * ETH_ALEN);
     memset(n->vlans, 0, MAX_VLAN >> 3);
+
+    /* Interrupts held back for the old driver are of no use to a new one */
+    for (i = 0; i < n->max_queues; i++) {
+        qemu_del_timer(n->vqs[i].rx_coalesce.timer);
+        n->vqs[i].rx_coalesce.pending = 0;
+        qemu_del_timer(n->vqs[i].tx_coalesce.timer);
+        n->vqs[i].tx_coalesce.pending = 0;
+    }
+
+    /* A new driver starts out with a single queue pair */
+    n->curr_queues = 1;
+    virtio_net_set_queues(n);
 }
 
 static int peer_has_vnet_hdr(VirtIONet *n)
@@ -205,10 +375,7 @@ static int peer_has_vnet_hdr(VirtIONet *n)
     if (!n->nic->nc.peer)
         return 0;
 
-    if (n->nic->nc.peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP)
-        return 0;
-
-    n->has_vnet_hdr = tap_has_vnet_hdr(n->nic->nc.peer);
+    n->has_vnet_hdr = qemu_has_vnet_hdr(n->nic->nc.peer);
 
     return n->has_vnet_hdr;
 }
@@ -218,7 +385,7 @@ static int peer_has_ufo(VirtIONet *n)
     if (!peer_has_vnet_hdr(n))
         return 0;
 
-    n->has_ufo = tap_has_ufo(n->nic->nc.peer);
+    n->has_ufo = qemu_has_ufo(n->nic->nc.peer);
 
     return n->has_ufo;
 }
@@ -226,11 +393,18 @@ static int peer_has_ufo(VirtIONet *n)
 static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    int i;
 
     features |= (1 << VIRTIO_NET_F_MAC);
 
+    if (n->max_queues == 1) {
+        features &= ~(0x1 << VIRTIO_NET_F_MQ);
+    }
+
     if (peer_has_vnet_hdr(n)) {
-        tap_using_vnet_hdr(n->nic->nc.peer, 1);
+        for (i = 0; i < n->max_queues; i++) {
+            qemu_using_vnet_hdr(n->vqs[i].nic->nc.peer, 1);
+        }
     } else {
         features &= ~(0x1 << VIRTIO_NET_F_CSUM);
         features &= ~(0x1 << VIRTIO_NET_F_HOST_TSO4);
@@ -248,14 +422,10 @@ static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
         features &= ~(0x1 << VIRTIO_NET_F_HOST_UFO);
     }
 
-    if (!n->nic->nc.peer ||
-        n->nic->nc.peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
+    if (!get_vhost_net(n->nic->nc.peer)) {
         return features;
     }
-    if (!tap_get_vhost_net(n->nic->nc.peer)) {
-        return features;
-    }
-    return vhost_net_get_features(tap_get_vhost_net(n->nic->nc.peer), features);
+    return vhost_net_get_features(get_vhost_net(n->nic->nc.peer), features);
 }
 
 static uint32_t virtio_net_bad_features(VirtIODevice *vdev)
@@ -276,25 +446,27 @@ static uint32_t virtio_net_bad_features(VirtIODevice *vdev)
 static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    NetClientState *peer;
+    int i;
 
     n->mergeable_rx_bufs = !!(features & (1 << VIRTIO_NET_F_MRG_RXBUF));
 
-    if (n->has_vnet_hdr) {
-        tap_set_offload(n->nic->nc.peer,
-                        (features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
-                        (features >> VIRTIO_NET_F_GUEST_TSO4) & 1,
-                        (features >> VIRTIO_NET_F_GUEST_TSO6) & 1,
-                        (features >> VIRTIO_NET_F_GUEST_ECN)  & 1,
-                        (features >> VIRTIO_NET_F_GUEST_UFO)  & 1);
-    }
-    if (!n->nic->nc.peer ||
-        n->nic->nc.peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
-        return;
-    }
-    if (!tap_get_vhost_net(n->nic->nc.peer)) {
-        return;
+    for (i = 0; i < n->max_queues; i++) {
+        peer = n->vqs[i].nic->nc.peer;
+
+        if (n->has_vnet_hdr) {
+            qemu_set_offload(peer,
+                             (features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
+                             (features >> VIRTIO_NET_F_GUEST_TSO4) & 1,
+                             (features >> VIRTIO_NET_F_GUEST_TSO6) & 1,
+                             (features >> VIRTIO_NET_F_GUEST_ECN)  & 1,
+                             (features >> VIRTIO_NET_F_GUEST_UFO)  & 1);
+        }
+        if (!get_vhost_net(peer)) {
+            continue;
+        }
+        vhost_net_ack_features(get_vhost_net(peer), features);
     }
-    vhost_net_ack_features(tap_get_vhost_net(n->nic->nc.peer), features);
 }
 
 static int virtio_net_handle_rx_mode(VirtIONet *n, uint8_t cmd,
@@ -404,6 +576,35 @@ static int virtio_net_handle_vlan_table(VirtIONet *n, uint8_t cmd,
     return VIRTIO_NET_OK;
 }
 
+static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
+                                VirtQueueElement *elem)
+{
+    uint16_t queues;
+
+    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET || elem->out_num != 2 ||
+        elem->out_sg[1].iov_len != sizeof(struct virtio_net_ctrl_mq)) {
+        error_report("virtio-net ctrl invalid mq command");
+        return VIRTIO_NET_ERR;
+    }
+
+    queues = lduw_p(elem->out_sg[1].iov_base);
+
+    if (!(n->vdev.guest_features & (1 << VIRTIO_NET_F_MQ)) ||
+        queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
+        queues > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX ||
+        queues > n->max_queues) {
+        return VIRTIO_NET_ERR;
+    }
+
+    /* Stop the backend on the old set of queues, restart it on the new */
+    virtio_net_set_status(&n->vdev, 0);
+    n->curr_queues = queues;
+    virtio_net_set_queues(n);
+    virtio_net_set_status(&n->vdev, n->vdev.status);
+
+    return VIRTIO_NET_OK;
+}
+
 static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
@@ -432,6 +633,8 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
             status = virtio_net_handle_mac(n, ctrl.cmd, &elem);
         else if (ctrl.class == VIRTIO_NET_CTRL_VLAN)
             status = virtio_net_handle_vlan_table(n, ctrl.cmd, &elem);
+        else if (ctrl.class == VIRTIO_NET_CTRL_MQ)
+            status = virtio_net_handle_mq(n, ctrl.cmd, &elem);
 
         stb_p(elem.in_sg[elem.in_num - 1].iov_base, status);
 
@@ -445,8 +648,9 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = virtio_net_vq_to_queue(n, vq);
 
-    qemu_flush_queued_packets(&n->nic->nc);
+    qemu_flush_queued_packets(&q->nic->nc);
 
     /* We now have RX buffers, signal to the IO thread to break out of the
      * select to re-poll the tap file descriptor */
@@ -456,35 +660,43 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 static int virtio_net_can_receive(NetClientState *nc)
 {
     VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+
     if (!n->vdev.vm_running) {
         return 0;
     }
 
-    if (!virtio_queue_ready(n->rx_vq) ||
+    if (nc->queue_index >= n->curr_queues) {
+        return 0;
+    }
+
+    if (!virtio_queue_ready(q->rx_vq) ||
         !(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK))
         return 0;
 
     return 1;
 }
 
-static int virtio_net_has_buffers(VirtIONet *n, int bufsize)
+static int virtio_net_has_buffers(VirtIONetQueue *q, int bufsize)
 {
-    if (virtio_queue_empty(n->rx_vq) ||
+    VirtIONet *n = q->n;
+
+    if (virtio_queue_empty(q->rx_vq) ||
         (n->mergeable_rx_bufs &&
-         !virtqueue_avail_bytes(n->rx_vq, bufsize, 0))) {
-        virtio_queue_set_notification(n->rx_vq, 1);
+         !virtqueue_avail_bytes(q->rx_vq, bufsize, 0))) {
+        virtio_queue_set_notification(q->rx_vq, 1);
 
         /* To avoid a race condition where the guest has made some buffers
          * available after the above check but before notification was
          * enabled, check for available buffers again.
          */
-        if (virtio_queue_empty(n->rx_vq) ||
+        if (virtio_queue_empty(q->rx_vq) ||
             (n->mergeable_rx_bufs &&
-             !virtqueue_avail_bytes(n->rx_vq, bufsize, 0)))
+             !virtqueue_avail_bytes(q->rx_vq, bufsize, 0)))
             return 0;
     }
 
-    virtio_queue_set_notification(n->rx_vq, 0);
+    virtio_queue_set_notification(q->rx_vq, 0);
     return 1;
 }
 
@@ -596,10 +808,11 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
 static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
     struct virtio_net_hdr_mrg_rxbuf *mhdr = NULL;
     size_t guest_hdr_len, offset, i, host_hdr_len;
 
-    if (!virtio_net_can_receive(&n->nic->nc))
+    if (!virtio_net_can_receive(nc))
         return -1;
 
     /* hdr_len refers to the header we supply to the guest */
@@ -608,7 +821,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
 
 
     host_hdr_len = n->has_vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
-    if (!virtio_net_has_buffers(n, size + guest_hdr_len - host_hdr_len))
+    if (!virtio_net_has_buffers(q, size + guest_hdr_len - host_hdr_len))
         return 0;
 
     if (!receive_filter(n, buf, size))
@@ -623,7 +836,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
 
         total = 0;
 
-        if (virtqueue_pop(n->rx_vq, &elem) == 0) {
+        if (virtqueue_pop(q->rx_vq, &elem) == 0) {
             if (i == 0)
                 return -1;
             error_report("virtio-net unexpected empty queue: "
@@ -675,38 +888,155 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         }
 
         /* signal other side */
-        virtqueue_fill(n->rx_vq, &elem, total, i++);
+        virtqueue_fill(q->rx_vq, &elem, total, i++);
     }
 
     if (mhdr) {
         stw_p(&mhdr->num_buffers, i);
     }
 
-    virtqueue_flush(n->rx_vq, i);
-    virtio_notify(&n->vdev, n->rx_vq);
+    virtqueue_flush(q->rx_vq, i);
+    virtio_net_coalesce(&q->rx_coalesce, 1);
 
     return size;
 }
 
-static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq);
+/*
+ * Receive the next packet by having the backend read it straight into a
+ * guest buffer.  Whatever does not fit in that buffer lands in rx_spill,
+ * from where it is copied to further buffers with mergeable RX buffers
+ * and dropped otherwise, as virtio_net_receive() does.
+ */
+static ssize_t virtio_net_receive_read(NetClientState *nc, NetReadFunc *read,
+                                       void *opaque)
+{
+    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+    struct virtio_net_hdr *hdr;
+    struct iovec iov[VIRTQUEUE_MAX_SIZE + 2];
+    uint8_t head[sizeof(struct virtio_net_hdr) + 18];
+    VirtQueueElement elem;
+    size_t guest_hdr_len, host_hdr_len, capacity, size, offset;
+    ssize_t len;
+    int iovcnt, j, i;
+
+    if (!virtio_net_can_receive(nc)) {
+        return 0;
+    }
+
+    guest_hdr_len = n->mergeable_rx_bufs ?
+        sizeof(struct virtio_net_hdr_mrg_rxbuf) : sizeof(struct virtio_net_hdr);
+    host_hdr_len = n->has_vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
+
+    if (!virtio_net_has_buffers(q, guest_hdr_len) ||
+        !virtqueue_pop(q->rx_vq, &elem)) {
+        return 0;
+    }
+
+    /* Leave anything unusual to virtio_net_receive() */
+    if (elem.in_num < 1 || elem.in_num + 2 > IOV_MAX ||
+        elem.in_sg[0].iov_len < guest_hdr_len ||
+        (!n->mergeable_rx_bufs && elem.in_sg[0].iov_len != guest_hdr_len)) {
+        virtqueue_discard(q->rx_vq, &elem);
+        return 0;
+    }
+
+    /* The backend's vnet header goes to the start of the guest's, the
+     * packet after the whole guest header */
+    hdr = elem.in_sg[0].iov_base;
+    iovcnt = 0;
+    if (host_hdr_len) {
+        iov[iovcnt].iov_base = hdr;
+        iov[iovcnt++].iov_len = host_hdr_len;
+    } else {
+        hdr->flags = 0;
+        hdr->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+    }
+    capacity = 0;
+    for (j = 0; j < elem.in_num; j++) {
+        offset = j == 0 ? guest_hdr_len : 0;
+        if (elem.in_sg[j].iov_len > offset) {
+            iov[iovcnt].iov_base = elem.in_sg[j].iov_base + offset;
+            iov[iovcnt++].iov_len = elem.in_sg[j].iov_len - offset;
+            capacity += elem.in_sg[j].iov_len - offset;
+        }
+    }
+    iov[iovcnt].iov_base = q->rx_spill;
+    iov[iovcnt++].iov_len = RX_SPILL_SIZE;
+
+    len = read(opaque, iov, iovcnt);
+    if (len <= (ssize_t)host_hdr_len) {
+        virtqueue_discard(q->rx_vq, &elem);
+        return len <= 0 ? -1 : len;
+    }
+    size = len - host_hdr_len;
+
+    memset(head, 0, sizeof(head));
+    iov_to_buf(iov, iovcnt, 0, head, host_hdr_len + MIN(size, 18));
+    if (!receive_filter(n, head, host_hdr_len + size)) {
+        virtqueue_discard(q->rx_vq, &elem);
+        return len;
+    }
+
+    /* Only look at packets that are in one piece */
+    if (host_hdr_len && size <= iov[1].iov_len) {
+        work_around_broken_dhclient(hdr, iov[1].iov_base, size);
+    }
+
+    if (size <= capacity) {
+        virtqueue_fill(q->rx_vq, &elem, guest_hdr_len + size, 0);
+        i = 1;
+    } else if (!n->mergeable_rx_bufs ||
+               !virtqueue_avail_bytes(q->rx_vq, size - capacity, 0)) {
+        /* Truncated, or the guest ran out of buffers while we read it */
+        virtqueue_discard(q->rx_vq, &elem);
+        return len;
+    } else {
+        virtqueue_fill(q->rx_vq, &elem, guest_hdr_len + capacity, 0);
+        i = 1;
+        for (offset = 0; capacity + offset < size; i++) {
+            size_t copied;
+
+            virtqueue_pop(q->rx_vq, &elem);
+            copied = iov_from_buf(elem.in_sg, elem.in_num, 0,
+                                  q->rx_spill + offset,
+                                  size - capacity - offset);
+            virtqueue_fill(q->rx_vq, &elem, copied, i);
+            offset += copied;
+        }
+    }
+
+    if (n->mergeable_rx_bufs) {
+        struct virtio_net_hdr_mrg_rxbuf *mhdr = (void *)hdr;
+
+        stw_p(&mhdr->num_buffers, i);
+    }
+
+    virtqueue_flush(q->rx_vq, i);
+    virtio_net_coalesce(&q->rx_coalesce, 1);
+
+    return len;
+}
+
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
-    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
 
-    virtqueue_push(n->tx_vq, &n->async_tx.elem, n->async_tx.len);
-    virtio_notify(&n->vdev, n->tx_vq);
+    virtqueue_push(q->tx_vq, &q->async_tx.elem, q->async_tx.len);
+    virtio_net_coalesce(&q->tx_coalesce, 1);
 
-    n->async_tx.elem.out_num = n->async_tx.len = 0;
+    q->async_tx.elem.out_num = q->async_tx.len = 0;
 
-    virtio_queue_set_notification(n->tx_vq, 1);
-    virtio_net_flush_tx(n, n->tx_vq);
+    virtio_queue_set_notification(q->tx_vq, 1);
+    virtio_net_flush_tx(q);
 }
 
 /* TX */
-static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
-    VirtQueueElement elem;
+    VirtIONet *n = q->n;
     int32_t num_packets = 0;
     if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
@@ -714,55 +1044,78 @@ static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
 
     assert(n->vdev.vm_running);
 
-    if (n->async_tx.elem.out_num) {
-        virtio_queue_set_notification(n->tx_vq, 0);
+    if (q->async_tx.elem.out_num) {
+        virtio_queue_set_notification(q->tx_vq, 0);
         return num_packets;
     }
 
-    while (virtqueue_pop(vq, &elem)) {
-        ssize_t ret, len = 0;
-        unsigned int out_num = elem.out_num;
-        struct iovec *out_sg = &elem.out_sg[0];
-        unsigned hdr_len;
+    while (num_packets < n->tx_burst) {
+        int count = 0, sent, i;
+
+        /* Collect a batch, the backend may be able to send it at once */
+        while (count < VIRTIO_NET_TX_BATCH &&
+               num_packets + count < n->tx_burst &&
+               virtqueue_pop(q->tx_vq, &q->tx_batch[count])) {
+            VirtQueueElement *elem = &q->tx_batch[count];
+            unsigned int out_num = elem->out_num;
+            struct iovec *out_sg = &elem->out_sg[0];
+            ssize_t len = 0;
+            unsigned hdr_len;
+
+            /* hdr_len refers to the header received from the guest */
+            hdr_len = n->mergeable_rx_bufs ?
+                sizeof(struct virtio_net_hdr_mrg_rxbuf) :
+                sizeof(struct virtio_net_hdr);
+
+            if (out_num < 1 || out_sg->iov_len != hdr_len) {
+                error_report("virtio-net header not in first element");
+                exit(1);
+            }
 
-        /* hdr_len refers to the header received from the guest */
-        hdr_len = n->mergeable_rx_bufs ?
-            sizeof(struct virtio_net_hdr_mrg_rxbuf) :
-            sizeof(struct virtio_net_hdr);
+            /* ignore the header if GSO is not supported */
+            if (!n->has_vnet_hdr) {
+                out_num--;
+                out_sg++;
+                len += hdr_len;
+            } else if (n->mergeable_rx_bufs) {
+                /* tapfd expects a struct virtio_net_hdr */
+                hdr_len -= sizeof(struct virtio_net_hdr);
+                out_sg->iov_len -= hdr_len;
+                len += hdr_len;
+            }
 
-        if (out_num < 1 || out_sg->iov_len != hdr_len) {
-            error_report("virtio-net header not in first element");
-            exit(1);
+            q->tx_pkts[count].iov = out_sg;
+            q->tx_pkts[count].iovcnt = out_num;
+            q->tx_hdr_len[count] = len;
+            count++;
         }
-
-        /* ignore the header if GSO is not supported */
-        if (!n->has_vnet_hdr) {
-            out_num--;
-            out_sg++;
-            len += hdr_len;
-        } else if (n->mergeable_rx_bufs) {
-            /* tapfd expects a struct virtio_net_hdr */
-            hdr_len -= sizeof(struct virtio_net_hdr);
-            out_sg->iov_len -= hdr_len;
-            len += hdr_len;
+        if (!count) {
+            break;
         }
 
-        ret = qemu_sendv_packet_async(&n->nic->nc, out_sg, out_num,
+        sent = qemu_sendv_batch_async(&q->nic->nc, q->tx_pkts, count,
                                       virtio_net_tx_complete);
-        if (ret == 0) {
-            virtio_queue_set_notification(n->tx_vq, 0);
-            n->async_tx.elem = elem;
-            n->async_tx.len  = len;
-            return -EBUSY;
-        }
 
-        len += ret;
-
-        virtqueue_push(vq, &elem, len);
-        virtio_notify(&n->vdev, vq);
+        for (i = 0; i < sent; i++) {
+            virtqueue_fill(q->tx_vq, &q->tx_batch[i], q->tx_hdr_len[i] +
+                           iov_size(q->tx_pkts[i].iov, q->tx_pkts[i].iovcnt),
+                           i);
+        }
+        if (sent) {
+            virtqueue_flush(q->tx_vq, sent);
+            virtio_net_coalesce(&q->tx_coalesce, sent);
+            num_packets += sent;
+        }
 
-        if (++num_packets >= n->tx_burst) {
-            break;
+        if (sent < count) {
+            /* The rest goes back to the ring for the next flush */
+            for (i = count - 1; i > sent; i--) {
+                virtqueue_discard(q->tx_vq, &q->tx_batch[i]);
+            }
+            virtio_queue_set_notification(q->tx_vq, 0);
+            q->async_tx.elem = q->tx_batch[sent];
+            q->async_tx.len  = q->tx_hdr_len[sent];
+            return -EBUSY;
         }
     }
     return num_packets;
@@ -771,22 +1124,23 @@ static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = virtio_net_vq_to_queue(n, vq);
 
     /* This happens when device was stopped but VCPU wasn't. */
     if (!n->vdev.vm_running) {
-        n->tx_waiting = 1;
+        q->tx_waiting = 1;
         return;
     }
 
-    if (n->tx_waiting) {
+    if (q->tx_waiting) {
         virtio_queue_set_notification(vq, 1);
-        qemu_del_timer(n->tx_timer);
-        n->tx_waiting = 0;
-        virtio_net_flush_tx(n, vq);
+        qemu_del_timer(q->tx_timer);
+        q->tx_waiting = 0;
+        virtio_net_flush_tx(q);
     } else {
-        qemu_mod_timer(n->tx_timer,
+        qemu_mod_timer(q->tx_timer,
                        qemu_get_clock_ns(vm_clock) + n->tx_timeout);
-        n->tx_waiting = 1;
+        q->tx_waiting = 1;
         virtio_queue_set_notification(vq, 0);
     }
 }
@@ -794,48 +1148,51 @@ static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = virtio_net_vq_to_queue(n, vq);
 
-    if (unlikely(n->tx_waiting)) {
+    if (unlikely(q->tx_waiting)) {
         return;
     }
-    n->tx_waiting = 1;
+    q->tx_waiting = 1;
     /* This happens when device was stopped but VCPU wasn't. */
     if (!n->vdev.vm_running) {
         return;
     }
     virtio_queue_set_notification(vq, 0);
-    qemu_bh_schedule(n->tx_bh);
+    qemu_bh_schedule(q->tx_bh);
 }
 
 static void virtio_net_tx_timer(void *opaque)
 {
-    VirtIONet *n = opaque;
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
     assert(n->vdev.vm_running);
 
-    n->tx_waiting = 0;
+    q->tx_waiting = 0;
 
     /* Just in case the driver is not ready on more */
     if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK))
         return;
 
-    virtio_queue_set_notification(n->tx_vq, 1);
-    virtio_net_flush_tx(n, n->tx_vq);
+    virtio_queue_set_notification(q->tx_vq, 1);
+    virtio_net_flush_tx(q);
 }
 
 static void virtio_net_tx_bh(void *opaque)
 {
-    VirtIONet *n = opaque;
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
     int32_t ret;
 
     assert(n->vdev.vm_running);
 
-    n->tx_waiting = 0;
+    q->tx_waiting = 0;
 
     /* Just in case the driver is not ready on more */
     if (unlikely(!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK)))
         return;
 
-    ret = virtio_net_flush_tx(n, n->tx_vq);
+    ret = virtio_net_flush_tx(q);
     if (ret == -EBUSY) {
         return; /* Notification re-enable handled by tx_complete */
     }
@@ -843,33 +1200,41 @@ static void virtio_net_tx_bh(void *opaque)
     /* If we flush a full burst of packets, assume there are
      * more coming and immediately reschedule */
     if (ret >= n->tx_burst) {
-        qemu_bh_schedule(n->tx_bh);
-        n->tx_waiting = 1;
+        qemu_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
         return;
     }
 
     /* If less than a full burst, re-enable notification and flush
      * anything that may have come in while we weren't looking.  If
      * we find something, assume the guest is still active and reschedule */
-    virtio_queue_set_notification(n->tx_vq, 1);
-    if (virtio_net_flush_tx(n, n->tx_vq) > 0) {
-        virtio_queue_set_notification(n->tx_vq, 0);
-        qemu_bh_schedule(n->tx_bh);
-        n->tx_waiting = 1;
+    virtio_queue_set_notification(q->tx_vq, 1);
+    if (virtio_net_flush_tx(q) > 0) {
+        virtio_queue_set_notification(q->tx_vq, 0);
+        qemu_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
     }
 }
 
 static void virtio_net_save(QEMUFile *f, void *opaque)
 {
     VirtIONet *n = opaque;
+    int i;
 
     /* At this point, backend must be stopped, otherwise
      * it might keep writing to memory. */
     assert(!n->vhost_started);
+
+    /* Held back interrupts are not migrated, deliver them now */
+    for (i = 0; i < n->max_queues; i++) {
+        virtio_net_coalesce_flush(&n->vqs[i].rx_coalesce);
+        virtio_net_coalesce_flush(&n->vqs[i].tx_coalesce);
+    }
+
     virtio_save(&n->vdev, f);
 
     qemu_put_buffer(f, n->mac, ETH_ALEN);
-    qemu_put_be32(f, n->tx_waiting);
+    qemu_put_be32(f, n->vqs[0].tx_waiting);
     qemu_put_be32(f, n->mergeable_rx_bufs);
     qemu_put_be16(f, n->status);
     qemu_put_byte(f, n->promisc);
@@ -885,6 +1250,15 @@ static void virtio_net_save(QEMUFile *f, void *opaque)
     qemu_put_byte(f, n->nouni);
     qemu_put_byte(f, n->nobcast);
     qemu_put_byte(f, n->has_ufo);
+
+    /* Only multiqueue devices carry this, keeping the format unchanged
+     * for the others */
+    if (n->max_queues > 1) {
+        qemu_put_be16(f, n->curr_queues);
+        for (i = 1; i < n->curr_queues; i++) {
+            qemu_put_be32(f, n->vqs[i].tx_waiting);
+        }
+    }
 }
 
 static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
@@ -902,7 +1276,7 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
     }
 
     qemu_get_buffer(f, n->mac, ETH_ALEN);
-    n->tx_waiting = qemu_get_be32(f);
+    n->vqs[0].tx_waiting = qemu_get_be32(f);
     n->mergeable_rx_bufs = qemu_get_be32(f);
 
     if (version_id >= 3)
@@ -941,13 +1315,17 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
         }
 
         if (n->has_vnet_hdr) {
-            tap_using_vnet_hdr(n->nic->nc.peer, 1);
-            tap_set_offload(n->nic->nc.peer,
+            for (i = 0; i < n->max_queues; i++) {
+                NetClientState *peer = n->vqs[i].nic->nc.peer;
+
+                qemu_using_vnet_hdr(peer, 1);
+                qemu_set_offload(peer,
                     (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
                     (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_TSO4) & 1,
                     (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_TSO6) & 1,
                     (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_ECN)  & 1,
                     (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_UFO)  & 1);
+            }
         }
     }
 
@@ -970,6 +1348,19 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
+    if (n->max_queues > 1) {
+        n->curr_queues = qemu_get_be16(f);
+        if (n->curr_queues < 1 || n->curr_queues > n->max_queues) {
+            error_report("virtio-net: saved image uses %d queue pairs, "
+                         "device has %d", n->curr_queues, n->max_queues);
+            return -1;
+        }
+        for (i = 1; i < n->curr_queues; i++) {
+            n->vqs[i].tx_waiting = qemu_get_be32(f);
+        }
+        virtio_net_set_queues(n);
+    }
+
     /* Find the first multicast entry in the saved MAC filter */
     for (i = 0; i < n->mac_table.in_use; i++) {
         if (n->mac_table.macs[i * ETH_ALEN] & 1) {
@@ -984,7 +1375,10 @@ static void virtio_net_cleanup(NetClientState *nc)
 {
     VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
 
-    n->nic = NULL;
+    n->vqs[nc->queue_index].nic = NULL;
+    if (nc->queue_index == 0) {
+        n->nic = NULL;
+    }
 }
 
 static NetClientInfo net_virtio_info = {
@@ -992,18 +1386,32 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_read = virtio_net_receive_read,
         .cleanup = virtio_net_cleanup,
     .link_status_changed = virtio_net_set_link_status,
+    .coalesce_changed = virtio_net_set_coalesce,
 };
 
 VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
                               virtio_net_conf *net)
 {
     VirtIONet *n;
+    VirtIONetQueue *q;
+    size_t config_size;
+    int i;
+
+    if (net->queues < 1 || net->queues > MAX_QUEUE_PAIRS) {
+        error_report("virtio-net: queues must be between 1 and %d",
+                     MAX_QUEUE_PAIRS);
+        return NULL;
+    }
+
+    /* Single queue devices keep the old config space layout */
+    config_size = net->queues > 1 ? sizeof(struct virtio_net_config) :
+                  offsetof(struct virtio_net_config, max_virtqueue_pairs);
 
     n = (VirtIONet *)virtio_common_init("virtio-net", VIRTIO_ID_NET,
-                                        sizeof(struct virtio_net_config),
-                                        sizeof(VirtIONet));
+                                        config_size, sizeof(VirtIONet));
 
     n->vdev.get_config = virtio_net_get_config;
     n->vdev.set_config = virtio_net_set_config;
@@ -1012,7 +1420,32 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
     n->vdev.bad_features = virtio_net_bad_features;
     n->vdev.reset = virtio_net_reset;
     n->vdev.set_status = virtio_net_set_status;
-    n->rx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_rx);
+    n->config_size = config_size;
+    n->max_queues = net->queues;
+    n->curr_queues = 1;
+    n->vqs = g_new0(VirtIONetQueue, n->max_queues);
+
+    qemu_macaddr_default_if_unset(&conf->macaddr);
+    memcpy(&n->mac[0], &conf->macaddr, sizeof(n->mac));
+    n->status = VIRTIO_NET_S_LINK_UP;
+
+    n->nic = qemu_new_nic(&net_virtio_info, conf, object_get_typename(OBJECT(dev)), dev->id, n);
+    n->vqs[0].nic = n->nic;
+
+    /* Every further queue pair is connected to the same queue of the
+     * backend, which must have been created with at least as many */
+    for (i = 1; i < n->max_queues; i++) {
+        n->vqs[i].nic = qemu_new_nic_queue(n->nic, i);
+        if (!n->vqs[i].nic) {
+            error_report("virtio-net: backend has no free queue %d", i);
+            while (i-- > 0) {
+                qemu_del_net_client(&n->vqs[i].nic->nc);
+            }
+            g_free(n->vqs);
+            virtio_cleanup(&n->vdev);
+            return NULL;
+        }
+    }
 
     if (net->tx && strcmp(net->tx, "timer") && strcmp(net->tx, "bh")) {
         error_report("virtio-net: "
@@ -1021,24 +1454,38 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
         error_report("Defaulting to \"bh\"");
     }
 
-    if (net->tx && !strcmp(net->tx, "timer")) {
-        n->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_timer);
-        n->tx_timer = qemu_new_timer_ns(vm_clock, virtio_net_tx_timer, n);
-        n->tx_timeout = net->txtimer;
-    } else {
-        n->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_bh);
-        n->tx_bh = qemu_bh_new(virtio_net_tx_bh, n);
-    }
-    n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
-    qemu_macaddr_default_if_unset(&conf->macaddr);
-    memcpy(&n->mac[0], &conf->macaddr, sizeof(n->mac));
-    n->status = VIRTIO_NET_S_LINK_UP;
+    n->nic->nc.rx_coalesce = net->rx_coalesce;
+    n->nic->nc.tx_coalesce = net->tx_coalesce;
+
+    for (i = 0; i < n->max_queues; i++) {
+        q = &n->vqs[i];
+        q->n = n;
+        q->rx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_rx);
+        if (net->tx && !strcmp(net->tx, "timer")) {
+            q->tx_vq = virtio_add_queue(&n->vdev, 256,
+                                        virtio_net_handle_tx_timer);
+            q->tx_timer = qemu_new_timer_ns(vm_clock, virtio_net_tx_timer, q);
+        } else {
+            q->tx_vq = virtio_add_queue(&n->vdev, 256,
+                                        virtio_net_handle_tx_bh);
+            q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+        }
+        q->tx_waiting = 0;
+        q->rx_spill = g_malloc(RX_SPILL_SIZE);
+        q->tx_batch = g_new(VirtQueueElement, VIRTIO_NET_TX_BATCH);
 
-    n->nic = qemu_new_nic(&net_virtio_info, conf, object_get_typename(OBJECT(dev)), dev->id, n);
+        qemu_format_nic_info_str(&q->nic->nc, conf->macaddr.a);
 
-    qemu_format_nic_info_str(&n->nic->nc, conf->macaddr.a);
+        /* set_net_coalesce works on the device as a whole */
+        virtio_net_coalesce_init(n, &q->rx_coalesce, q->rx_vq,
+                                 &n->nic->nc.rx_coalesce);
+        virtio_net_coalesce_init(n, &q->tx_coalesce, q->tx_vq,
+                                 &n->nic->nc.tx_coalesce);
+    }
+    n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
+    n->tx_timeout = net->txtimer;
+    virtio_net_set_queues(n);
 
-    n->tx_waiting = 0;
     n->tx_burst = net->txburst;
     n->mergeable_rx_bufs = 0;
     n->promisc = 1; /* for compatibility */
@@ -1059,24 +1506,39 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
 void virtio_net_exit(VirtIODevice *vdev)
 {
     VirtIONet *n = DO_UPCAST(VirtIONet, vdev, vdev);
+    VirtIONetQueue *q;
+    int i;
 
     /* This will stop vhost backend if appropriate. */
     virtio_net_set_status(vdev, 0);
 
-    qemu_purge_queued_packets(&n->nic->nc);
-
     unregister_savevm(n->qdev, "virtio-net", n);
 
     g_free(n->mac_table.macs);
     g_free(n->vlans);
 
-    if (n->tx_timer) {
-        qemu_del_timer(n->tx_timer);
-        qemu_free_timer(n->tx_timer);
-    } else {
-        qemu_bh_delete(n->tx_bh);
+    for (i = 0; i < n->max_queues; i++) {
+        q = &n->vqs[i];
+
+        qemu_purge_queued_packets(&q->nic->nc);
+
+        if (q->tx_timer) {
+            qemu_del_timer(q->tx_timer);
+            qemu_free_timer(q->tx_timer);
+        } else {
+            qemu_bh_delete(q->tx_bh);
+        }
+
+        virtio_net_coalesce_cleanup(&q->rx_coalesce);
+        virtio_net_coalesce_cleanup(&q->tx_coalesce);
+        g_free(q->rx_spill);
+        g_free(q->tx_batch);
+    }
+
+    for (i = 0; i < n->max_queues; i++) {
+        qemu_del_net_client(&n->vqs[i].nic->nc);
     }
 
-    qemu_del_net_client(&n->nic->nc);
+    g_free(n->vqs);
     virtio_cleanup(&n->vdev);
 }
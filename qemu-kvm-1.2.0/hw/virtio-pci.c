@@ -175,10 +175,10 @@ static int virtio_pci_set_host_notifier_internal(VirtIOPCIProxy *proxy,
             return r;
         }
         virtio_queue_set_host_notifier_fd_handler(vq, true, set_handler);
-        memory_region_add_eventfd(&proxy->bar, VIRTIO_PCI_QUEUE_NOTIFY, 2,
+        memory_region_add_eventfd(&proxy->notify, 0, 2,
                                   true, n, notifier);
     } else {
-        memory_region_del_eventfd(&proxy->bar, VIRTIO_PCI_QUEUE_NOTIFY, 2,
+        memory_region_del_eventfd(&proxy->notify, 0, 2,
                                   true, n, notifier);
         virtio_queue_set_host_notifier_fd_handler(vq, false, false);
         event_notifier_cleanup(notifier);
@@ -207,6 +207,7 @@ static void virtio_pci_start_ioeventfd(VirtIOPCIProxy *proxy)
         }
     }
     proxy->ioeventfd_started = true;
+    memory_region_set_lockless(&proxy->notify, false, true);
     return;
 
 assign_error:
@@ -231,6 +232,9 @@ static void virtio_pci_stop_ioeventfd(VirtIOPCIProxy *proxy)
         return;
     }
 
+    /* No vCPU may kick a host notifier once we start to release them */
+    memory_region_set_lockless(&proxy->notify, false, false);
+
     for (n = 0; n < VIRTIO_PCI_QUEUE_MAX; n++) {
         if (!virtio_queue_get_num(proxy->vdev, n)) {
             continue;
@@ -476,6 +480,45 @@ static const MemoryRegionOps virtio_pci_config_ops = {
     .endianness = DEVICE_LITTLE_ENDIAN,
 };
 
+static uint64_t virtio_pci_notify_read(void *opaque, target_phys_addr_t addr,
+                                       unsigned size)
+{
+    return virtio_ioport_read(opaque, VIRTIO_PCI_QUEUE_NOTIFY + addr);
+}
+
+/*
+ * Called without the global mutex while ioeventfd is started: KVM missed
+ * the write, e.g. because of its size, so kick the host notifier like it
+ * would have done.
+ */
+static void virtio_pci_notify_write(void *opaque, target_phys_addr_t addr,
+                                    uint64_t val, unsigned size)
+{
+    VirtIOPCIProxy *proxy = opaque;
+    VirtQueue *vq;
+
+    if (addr != 0 || val >= VIRTIO_PCI_QUEUE_MAX) {
+        return;
+    }
+
+    if (!proxy->ioeventfd_started) {
+        virtio_queue_notify(proxy->vdev, val);
+        return;
+    }
+
+    /* Only queues with a ring got a host notifier */
+    if (virtio_queue_get_num(proxy->vdev, val)) {
+        vq = virtio_get_queue(proxy->vdev, val);
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+    }
+}
+
+static const MemoryRegionOps virtio_pci_notify_ops = {
+    .read = virtio_pci_notify_read,
+    .write = virtio_pci_notify_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+};
+
 static void virtio_write_config(PCIDevice *pci_dev, uint32_t address,
                                 uint32_t val, int len)
 {
@@ -748,6 +791,10 @@ void virtio_init_pci(VirtIOPCIProxy *proxy, VirtIODevice *vdev)
 
     memory_region_init_io(&proxy->bar, &virtio_pci_config_ops, proxy,
                           "virtio-pci", size);
+    memory_region_init_io(&proxy->notify, &virtio_pci_notify_ops, proxy,
+                          "virtio-pci-notify", 2);
+    memory_region_add_subregion_overlap(&proxy->bar, VIRTIO_PCI_QUEUE_NOTIFY,
+                                        &proxy->notify, 1);
     pci_register_bar(&proxy->pci_dev, 0, PCI_BASE_ADDRESS_SPACE_IO,
                      &proxy->bar);
 
@@ -774,7 +821,10 @@ static int virtio_blk_init_pci(PCIDevice *pci_dev)
     if (!vdev) {
         return -1;
     }
-    vdev->nvectors = proxy->nvectors;
+    /* one vector per request queue plus one for config changes */
+    vdev->nvectors = proxy->nvectors == DEV_NVECTORS_UNSPECIFIED
+                                        ? proxy->blk.num_queues + 1
+                                        : proxy->nvectors;
     virtio_init_pci(proxy, vdev);
     /* make the actual value visible */
     proxy->nvectors = vdev->nvectors;
@@ -785,6 +835,8 @@ static void virtio_exit_pci(PCIDevice *pci_dev)
 {
     VirtIOPCIProxy *proxy = DO_UPCAST(VirtIOPCIProxy, pci_dev, pci_dev);
 
+    memory_region_del_subregion(&proxy->bar, &proxy->notify);
+    memory_region_destroy(&proxy->notify);
     memory_region_destroy(&proxy->bar);
     msix_uninit_exclusive_bar(pci_dev);
 }
@@ -835,8 +887,15 @@ static int virtio_net_init_pci(PCIDevice *pci_dev)
     VirtIODevice *vdev;
 
     vdev = virtio_net_init(&pci_dev->qdev, &proxy->nic, &proxy->net);
+    if (!vdev) {
+        return -1;
+    }
 
-    vdev->nvectors = proxy->nvectors;
+    /* one vector per RX and TX queue plus one for config changes, which
+     * is the old default of 3 for a single queue pair */
+    vdev->nvectors = proxy->nvectors == DEV_NVECTORS_UNSPECIFIED
+                                        ? 2 * proxy->net.queues + 1
+                                        : proxy->nvectors;
     virtio_init_pci(proxy, vdev);
 
     /* make the actual value visible */
@@ -863,7 +922,7 @@ static int virtio_balloon_init_pci(PCIDevice *pci_dev)
         proxy->class_code = PCI_CLASS_OTHERS;
     }
 
-    vdev = virtio_balloon_init(&pci_dev->qdev);
+    vdev = virtio_balloon_init(&pci_dev->qdev, &proxy->balloon);
     if (!vdev) {
         return -1;
     }
@@ -889,8 +948,12 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_BIT("scsi", VirtIOPCIProxy, blk.scsi, 0, true),
 #endif
     DEFINE_PROP_BIT("config-wce", VirtIOPCIProxy, blk.config_wce, 0, true),
+    DEFINE_PROP_UINT32("num_queues", VirtIOPCIProxy, blk.num_queues, 1),
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    DEFINE_PROP_BIT("x-data-plane", VirtIOPCIProxy, blk.data_plane, 0, false),
+#endif
     DEFINE_PROP_BIT("ioeventfd", VirtIOPCIProxy, flags, VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, true),
-    DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, 2),
+    DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, DEV_NVECTORS_UNSPECIFIED),
     DEFINE_VIRTIO_BLK_FEATURES(VirtIOPCIProxy, host_features),
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -919,12 +982,21 @@ static TypeInfo virtio_blk_info = {
 
 static Property virtio_net_properties[] = {
     DEFINE_PROP_BIT("ioeventfd", VirtIOPCIProxy, flags, VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, false),
-    DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, 3),
+    DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, DEV_NVECTORS_UNSPECIFIED),
     DEFINE_VIRTIO_NET_FEATURES(VirtIOPCIProxy, host_features),
     DEFINE_NIC_PROPERTIES(VirtIOPCIProxy, nic),
     DEFINE_PROP_UINT32("x-txtimer", VirtIOPCIProxy, net.txtimer, TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIOPCIProxy, net.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIOPCIProxy, net.tx),
+    DEFINE_PROP_UINT32("rx_coalesce_frames", VirtIOPCIProxy,
+                       net.rx_coalesce.max_frames, 0),
+    DEFINE_PROP_UINT32("rx_coalesce_usecs", VirtIOPCIProxy,
+                       net.rx_coalesce.usecs, 0),
+    DEFINE_PROP_UINT32("tx_coalesce_frames", VirtIOPCIProxy,
+                       net.tx_coalesce.max_frames, 0),
+    DEFINE_PROP_UINT32("tx_coalesce_usecs", VirtIOPCIProxy,
+                       net.tx_coalesce.usecs, 0),
+    DEFINE_PROP_UINT32("queues", VirtIOPCIProxy, net.queues, 1),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -984,6 +1056,17 @@ static TypeInfo virtio_serial_info = {
 
 static Property virtio_balloon_properties[] = {
     DEFINE_VIRTIO_COMMON_FEATURES(VirtIOPCIProxy, host_features),
+    DEFINE_PROP_BIT("free-page-reporting", VirtIOPCIProxy, host_features,
+                    VIRTIO_BALLOON_F_REPORTING, true),
+    DEFINE_PROP_UINT32("stats-interval", VirtIOPCIProxy,
+                       balloon.stats_interval, 0),
+    DEFINE_PROP_UINT32("auto-min", VirtIOPCIProxy, balloon.auto_min, 0),
+    DEFINE_PROP_UINT32("auto-max", VirtIOPCIProxy, balloon.auto_max, 0),
+    DEFINE_PROP_UINT32("auto-free-low", VirtIOPCIProxy, balloon.free_low, 10),
+    DEFINE_PROP_UINT32("auto-free-high", VirtIOPCIProxy, balloon.free_high,
+                       30),
+    DEFINE_PROP_UINT32("host-reserve", VirtIOPCIProxy, balloon.host_reserve,
+                       0),
     DEFINE_PROP_HEX32("class", VirtIOPCIProxy, class_code, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
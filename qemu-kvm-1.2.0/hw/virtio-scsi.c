@@ -139,6 +139,8 @@ typedef struct {
     uint32_t cdb_size;
     int resetting;
     bool events_dropped;
+    struct VirtIOSCSIReq *free_reqs;
+    unsigned int num_free_reqs;
     VirtQueue *ctrl_vq;
     VirtQueue *event_vq;
     VirtQueue *cmd_vqs[0];
@@ -163,6 +165,7 @@ typedef struct VirtIOSCSIReq {
         VirtIOSCSICtrlANResp  *an;
         VirtIOSCSIEvent       *event;
     } resp;
+    struct VirtIOSCSIReq *next_free;
 } VirtIOSCSIReq;
 
 static inline int virtio_scsi_get_lun(uint8_t *lun)
@@ -181,6 +184,33 @@ static inline SCSIDevice *virtio_scsi_device_find(VirtIOSCSI *s, uint8_t *lun)
     return scsi_device_find(&s->bus, 0, lun[1], virtio_scsi_get_lun(lun));
 }
 
+/*
+ * Requests embed a full VirtQueueElement, so like virtio-blk we keep the
+ * completed ones on a free list, up to one full set of command queues.
+ */
+static VirtIOSCSIReq *virtio_scsi_alloc_req(VirtIOSCSI *s)
+{
+    VirtIOSCSIReq *req = s->free_reqs;
+
+    if (req) {
+        s->free_reqs = req->next_free;
+        s->num_free_reqs--;
+        return req;
+    }
+    return g_malloc(sizeof(*req));
+}
+
+static void virtio_scsi_free_req(VirtIOSCSI *s, VirtIOSCSIReq *req)
+{
+    if (s->num_free_reqs >= s->conf->num_queues * VIRTIO_SCSI_VQ_SIZE) {
+        g_free(req);
+        return;
+    }
+    req->next_free = s->free_reqs;
+    s->free_reqs = req;
+    s->num_free_reqs++;
+}
+
 static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
 {
     VirtIOSCSI *s = req->dev;
@@ -191,7 +221,7 @@ static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
         req->sreq->hba_private = NULL;
         scsi_req_unref(req->sreq);
     }
-    g_free(req);
+    virtio_scsi_free_req(s, req);
     virtio_notify(&s->vdev, vq);
 }
 
@@ -236,9 +266,9 @@ static void virtio_scsi_parse_req(VirtIOSCSI *s, VirtQueue *vq,
 static VirtIOSCSIReq *virtio_scsi_pop_req(VirtIOSCSI *s, VirtQueue *vq)
 {
     VirtIOSCSIReq *req;
-    req = g_malloc(sizeof(*req));
+    req = virtio_scsi_alloc_req(s);
     if (!virtqueue_pop(vq, &req->elem)) {
-        g_free(req);
+        virtio_scsi_free_req(s, req);
         return NULL;
     }
 
@@ -263,7 +293,7 @@ static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
     VirtIOSCSIReq *req;
     uint32_t n;
 
-    req = g_malloc(sizeof(*req));
+    req = virtio_scsi_alloc_req(s);
     qemu_get_be32s(f, &n);
     assert(n < s->conf->num_queues);
     qemu_get_buffer(f, (unsigned char *)&req->elem, sizeof(req->elem));
@@ -465,10 +495,34 @@ static void virtio_scsi_fail_cmd_req(VirtIOSCSIReq *req)
     virtio_scsi_complete_req(req);
 }
 
+/*
+ * Plug the drive of a LUN the first time one of the requests of a kick goes
+ * to it, so that its requests are submitted to the host together
+ */
+static void virtio_scsi_plug_device(SCSIDevice *d, BlockDriverState **plugged,
+                                    int *nb_plugged)
+{
+    BlockDriverState *bs = d->conf.bs;
+    int i;
+
+    if (!bs || *nb_plugged == VIRTIO_SCSI_VQ_SIZE) {
+        return;
+    }
+    for (i = 0; i < *nb_plugged; i++) {
+        if (plugged[i] == bs) {
+            return;
+        }
+    }
+    bdrv_io_plug(bs);
+    plugged[(*nb_plugged)++] = bs;
+}
+
 static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOSCSI *s = (VirtIOSCSI *)vdev;
     VirtIOSCSIReq *req;
+    BlockDriverState *plugged[VIRTIO_SCSI_VQ_SIZE];
+    int nb_plugged = 0;
     int n;
 
     while ((req = virtio_scsi_pop_req(s, vq))) {
@@ -512,11 +566,16 @@ static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
             }
         }
 
+        virtio_scsi_plug_device(d, plugged, &nb_plugged);
         n = scsi_req_enqueue(req->sreq);
         if (n) {
             scsi_req_continue(req->sreq);
         }
     }
+
+    for (n = 0; n < nb_plugged; n++) {
+        bdrv_io_unplug(plugged[n]);
+    }
 }
 
 static void virtio_scsi_get_config(VirtIODevice *vdev,
@@ -735,6 +794,13 @@ VirtIODevice *virtio_scsi_init(DeviceState *dev, VirtIOSCSIConf *proxyconf)
 void virtio_scsi_exit(VirtIODevice *vdev)
 {
     VirtIOSCSI *s = (VirtIOSCSI *)vdev;
+    VirtIOSCSIReq *req;
+
     unregister_savevm(s->qdev, "virtio-scsi", s);
+
+    while ((req = s->free_reqs) != NULL) {
+        s->free_reqs = req->next_free;
+        g_free(req);
+    }
     virtio_cleanup(vdev);
 }
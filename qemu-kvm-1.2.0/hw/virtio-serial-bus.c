@@ -25,6 +25,9 @@
 #include "trace.h"
 #include "virtio-serial.h"
 
+/* Guest data handed to a port in one have_data() call, at most */
+#define VIRTIO_SERIAL_TX_BUF_SIZE (64 * 1024)
+
 /* The virtio-serial bus on top of which the ports will ride as devices */
 struct VirtIOSerialBus {
     BusState qbus;
@@ -130,10 +133,36 @@ static void discard_vq_data(VirtQueue *vq, VirtIODevice *vdev)
     virtio_notify(vdev, vq);
 }
 
+/*
+ * Copy what is left of port->elem into the tx buffer.  Returns true
+ * once the whole element has been consumed.
+ */
+static bool fill_tx_buf(VirtIOSerialPort *port)
+{
+    while (port->iov_idx < port->elem.out_num &&
+           port->tx_len < VIRTIO_SERIAL_TX_BUF_SIZE) {
+        struct iovec *iov = &port->elem.out_sg[port->iov_idx];
+        size_t len;
+
+        len = MIN(iov->iov_len - port->iov_offset,
+                  VIRTIO_SERIAL_TX_BUF_SIZE - port->tx_len);
+        memcpy(port->tx_buf + port->tx_len,
+               (uint8_t *)iov->iov_base + port->iov_offset, len);
+        port->tx_len += len;
+        port->iov_offset += len;
+        if (port->iov_offset == iov->iov_len) {
+            port->iov_idx++;
+            port->iov_offset = 0;
+        }
+    }
+    return port->iov_idx == port->elem.out_num;
+}
+
 static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
                                  VirtIODevice *vdev)
 {
     VirtIOSerialPortClass *vsc;
+    bool pushed = false;
 
     assert(port);
     assert(virtio_queue_ready(vq));
@@ -141,59 +170,56 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
     vsc = VIRTIO_SERIAL_PORT_GET_CLASS(port);
 
     while (!port->throttled) {
-        unsigned int i;
-
-        /* Pop an elem only if we haven't left off a previous one mid-way */
-        if (!port->elem.out_num) {
-            if (!virtqueue_pop(vq, &port->elem)) {
+        ssize_t ret;
+
+        /* Batch up as many elements as fit in the tx buffer */
+        while (port->tx_len < VIRTIO_SERIAL_TX_BUF_SIZE) {
+            /* Pop an elem only if we haven't left off a previous one mid-way */
+            if (!port->elem.out_num) {
+                if (!virtqueue_pop(vq, &port->elem)) {
+                    break;
+                }
+                port->iov_idx = 0;
+                port->iov_offset = 0;
+            }
+            if (!fill_tx_buf(port)) {
                 break;
             }
-            port->iov_idx = 0;
-            port->iov_offset = 0;
+            virtqueue_push(vq, &port->elem, 0);
+            port->elem.out_num = 0;
+            pushed = true;
+        }
+        if (!port->tx_len) {
+            break;
         }
 
-        for (i = port->iov_idx; i < port->elem.out_num; i++) {
-            size_t buf_size;
-            ssize_t ret;
-
-            buf_size = port->elem.out_sg[i].iov_len - port->iov_offset;
-            ret = vsc->have_data(port,
-                                  port->elem.out_sg[i].iov_base
-                                  + port->iov_offset,
-                                  buf_size);
-            if (ret < 0 && ret != -EAGAIN) {
-                /* We don't handle any other type of errors here */
-                abort();
-            }
-            if (ret == -EAGAIN || (ret >= 0 && ret < buf_size)) {
-		/*
-                 * this is a temporary check until chardevs can signal to
-                 * frontends that they are writable again. This prevents
-                 * the console from going into throttled mode (forever)
-                 * if virtio-console is connected to a pty without a
-                 * listener. Otherwise the guest spins forever.
-                 * We can revert this if
-                 * 1: chardevs can notify frondends
-                 * 2: the guest driver does not spin in these cases
-                 */
-                if (!vsc->is_console) {
-                    virtio_serial_throttle_port(port, true);
-                }
-                port->iov_idx = i;
-                if (ret > 0) {
-                    port->iov_offset += ret;
-                }
+        ret = vsc->have_data(port, port->tx_buf, port->tx_len);
+        if (ret < 0 && ret != -EAGAIN) {
+            /* We don't handle any other type of errors here */
+            abort();
+        }
+        if (ret == -EAGAIN) {
+            ret = 0;
+        }
+        if (ret < port->tx_len) {
+            /*
+             * Consoles are not throttled: a console on a pty without a
+             * listener would otherwise never be written to again, and
+             * the guest driver spins waiting for it.  What the backend
+             * did not take is dropped.
+             */
+            if (!vsc->is_console) {
+                virtio_serial_throttle_port(port, true);
+                memmove(port->tx_buf, port->tx_buf + ret, port->tx_len - ret);
+                port->tx_len -= ret;
                 break;
             }
-            port->iov_offset = 0;
-        }
-        if (port->throttled) {
-            break;
         }
-        virtqueue_push(vq, &port->elem, 0);
-        port->elem.out_num = 0;
+        port->tx_len = 0;
+    }
+    if (pushed) {
+        virtio_notify(vdev, vq);
     }
-    virtio_notify(vdev, vq);
 }
 
 static void flush_queued_data(VirtIOSerialPort *port)
@@ -263,6 +289,11 @@ int virtio_serial_close(VirtIOSerialPort *port)
      * consume, reset the throttling flag and discard the data.
      */
     port->throttled = false;
+    port->tx_len = 0;
+    if (port->elem.out_num && virtio_queue_ready(port->ovq)) {
+        virtqueue_push(port->ovq, &port->elem, 0);
+        port->elem.out_num = 0;
+    }
     discard_vq_data(port->ovq, &port->vser->vdev);
 
     send_control_event(port, VIRTIO_CONSOLE_PORT_OPEN, 0);
@@ -628,6 +659,9 @@ static void virtio_serial_save(QEMUFile *f, void *opaque)
             qemu_put_buffer(f, (unsigned char *)&port->elem,
                             sizeof(port->elem));
         }
+
+        qemu_put_be32s(f, &port->tx_len);
+        qemu_put_buffer(f, port->tx_buf, port->tx_len);
     }
 }
 
@@ -639,7 +673,7 @@ static int virtio_serial_load(QEMUFile *f, void *opaque, int version_id)
     unsigned int i;
     int ret;
 
-    if (version_id > 3) {
+    if (version_id > 4) {
         return -EINVAL;
     }
 
@@ -722,6 +756,17 @@ static int virtio_serial_load(QEMUFile *f, void *opaque, int version_id)
                 virtio_serial_throttle_port(port, false);
             }
         }
+
+        if (version_id > 3) {
+            qemu_get_be32s(f, &port->tx_len);
+            if (port->tx_len > VIRTIO_SERIAL_TX_BUF_SIZE) {
+                return -EINVAL;
+            }
+            qemu_get_buffer(f, port->tx_buf, port->tx_len);
+            if (port->tx_len) {
+                virtio_serial_throttle_port(port, false);
+            }
+        }
     }
     return 0;
 }
@@ -862,6 +907,8 @@ static int virtser_port_qdev_init(DeviceState *qdev)
     }
 
     port->elem.out_num = 0;
+    port->tx_buf = g_malloc(VIRTIO_SERIAL_TX_BUF_SIZE);
+    port->tx_len = 0;
 
     QTAILQ_INSERT_TAIL(&port->vser->ports, port, next);
     port->ivq = port->vser->ivqs[port->id];
@@ -889,6 +936,7 @@ static int virtser_port_qdev_exit(DeviceState *qdev)
     if (vsc->exit) {
         vsc->exit(port);
     }
+    g_free(port->tx_buf);
     return 0;
 }
 
@@ -969,7 +1017,7 @@ VirtIODevice *virtio_serial_init(DeviceState *dev, virtio_serial_conf *conf)
      * Register for the savevm section with the virtio-console name
      * to preserve backward compat
      */
-    register_savevm(dev, "virtio-console", -1, 3, virtio_serial_save,
+    register_savevm(dev, "virtio-console", -1, 4, virtio_serial_save,
                     virtio_serial_load, vser);
 
     return vdev;
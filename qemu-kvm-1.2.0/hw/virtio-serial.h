@@ -160,6 +160,15 @@ struct VirtIOSerialPort {
     uint32_t iov_idx;
     uint64_t iov_offset;
 
+    /*
+     * Guest data is gathered from as many elements as fit in tx_buf
+     * and handed to the port in one go.  Elements are returned to the
+     * guest as soon as they have been copied; tx_len bytes are still
+     * waiting for the backend.
+     */
+    uint8_t *tx_buf;
+    uint32_t tx_len;
+
     /*
      * When unthrottling we use a bottom-half to call flush_queued_data.
      */
@@ -17,6 +17,7 @@
 #include "qemu-error.h"
 #include "virtio.h"
 #include "qemu-barrier.h"
+#include "exec-memory.h"
 
 /* The alignment to use between consumer and producer parts of vring.
  * x86 pagesize again. */
@@ -56,6 +57,11 @@ typedef struct VRing
     target_phys_addr_t desc;
     target_phys_addr_t avail;
     target_phys_addr_t used;
+
+    /* Host pointers to the descriptor table and avail ring, NULL when they
+     * are not in plain guest RAM and must be read with ld*_phys. */
+    VRingDesc *desc_ptr;
+    VRingAvail *avail_ptr;
 } VRing;
 
 struct VirtQueue
@@ -81,6 +87,42 @@ struct VirtQueue
     EventNotifier host_notifier;
 };
 
+/* Host pointer to a guest RAM range, NULL if it is not entirely RAM */
+static void *vring_map_ram(target_phys_addr_t pa, target_phys_addr_t size)
+{
+    MemoryRegionSection section;
+
+    section = memory_region_find(get_system_memory(), pa, size);
+    if (!section.mr || !memory_region_is_ram(section.mr) ||
+        section.offset_within_address_space != pa || section.size < size) {
+        return NULL;
+    }
+    return memory_region_get_ram_ptr(section.mr) +
+           section.offset_within_region;
+}
+
+/* The guest only writes the descriptor table and the avail ring, so they
+ * are mapped once instead of being looked up for every field, and mapped
+ * again whenever the memory map changes.  The used ring keeps going through
+ * st*_phys so that migration sees the pages we dirty.
+ */
+static void virtqueue_map_rings(VirtQueue *vq)
+{
+    target_phys_addr_t pa = vq->pa;
+
+    vq->vring.desc_ptr = NULL;
+    vq->vring.avail_ptr = NULL;
+    if (pa) {
+        vq->vring.desc_ptr =
+            vring_map_ram(pa, vq->vring.avail - pa +
+                          offsetof(VRingAvail, ring[vq->vring.num + 1]));
+    }
+    if (vq->vring.desc_ptr) {
+        vq->vring.avail_ptr = (VRingAvail *)(vq->vring.desc_ptr +
+                                             vq->vring.num);
+    }
+}
+
 /* virt queue functions */
 static void virtqueue_init(VirtQueue *vq)
 {
@@ -91,39 +133,36 @@ static void virtqueue_init(VirtQueue *vq)
     vq->vring.used = vring_align(vq->vring.avail +
                                  offsetof(VRingAvail, ring[vq->vring.num]),
                                  VIRTIO_PCI_VRING_ALIGN);
+    virtqueue_map_rings(vq);
 }
 
-static inline uint64_t vring_desc_addr(target_phys_addr_t desc_pa, int i)
-{
-    target_phys_addr_t pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
-    return ldq_phys(pa);
-}
-
-static inline uint32_t vring_desc_len(target_phys_addr_t desc_pa, int i)
-{
-    target_phys_addr_t pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
-    return ldl_phys(pa);
-}
-
-static inline uint16_t vring_desc_flags(target_phys_addr_t desc_pa, int i)
-{
-    target_phys_addr_t pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
-    return lduw_phys(pa);
-}
-
-static inline uint16_t vring_desc_next(target_phys_addr_t desc_pa, int i)
-{
-    target_phys_addr_t pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
-    return lduw_phys(pa);
+/*
+ * Read descriptor i of a table, either through its host mapping @table or,
+ * if that is NULL, from guest memory at @desc_pa.
+ */
+static void vring_desc_read(const VRingDesc *table, target_phys_addr_t desc_pa,
+                            int i, VRingDesc *desc)
+{
+    if (table) {
+        desc->addr = ldq_p(&table[i].addr);
+        desc->len = ldl_p(&table[i].len);
+        desc->flags = lduw_p(&table[i].flags);
+        desc->next = lduw_p(&table[i].next);
+    } else {
+        desc_pa += sizeof(VRingDesc) * i;
+        desc->addr = ldq_phys(desc_pa + offsetof(VRingDesc, addr));
+        desc->len = ldl_phys(desc_pa + offsetof(VRingDesc, len));
+        desc->flags = lduw_phys(desc_pa + offsetof(VRingDesc, flags));
+        desc->next = lduw_phys(desc_pa + offsetof(VRingDesc, next));
+    }
 }
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
     target_phys_addr_t pa;
+    if (vq->vring.avail_ptr) {
+        return lduw_p(&vq->vring.avail_ptr->flags);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, flags);
     return lduw_phys(pa);
 }
@@ -131,6 +170,9 @@ static inline uint16_t vring_avail_flags(VirtQueue *vq)
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
     target_phys_addr_t pa;
+    if (vq->vring.avail_ptr) {
+        return lduw_p(&vq->vring.avail_ptr->idx);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, idx);
     return lduw_phys(pa);
 }
@@ -138,6 +180,9 @@ static inline uint16_t vring_avail_idx(VirtQueue *vq)
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
     target_phys_addr_t pa;
+    if (vq->vring.avail_ptr) {
+        return lduw_p(&vq->vring.avail_ptr->ring[i]);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
     return lduw_phys(pa);
 }
@@ -270,6 +315,26 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
         vq->signalled_used_valid = false;
 }
 
+/*
+ * Give back an element popped from @vq without using it.  Elements must be
+ * given back in the reverse order they were popped in.
+ */
+void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem)
+{
+    int i;
+
+    for (i = 0; i < elem->in_num; i++)
+        cpu_physical_memory_unmap(elem->in_sg[i].iov_base,
+                                  elem->in_sg[i].iov_len, 1, 0);
+
+    for (i = 0; i < elem->out_num; i++)
+        cpu_physical_memory_unmap(elem->out_sg[i].iov_base,
+                                  elem->out_sg[i].iov_len, 0, 0);
+
+    vq->last_avail_idx--;
+    vq->inuse--;
+}
+
 void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len)
 {
@@ -313,17 +378,35 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(target_phys_addr_t desc_pa,
-                                    unsigned int i, unsigned int max)
+/*
+ * Map the indirect table @desc points to and return its number of entries.
+ * The table is mapped for exactly that many entries, and every index into
+ * it is checked against that number by virtqueue_next_desc().
+ */
+static unsigned int vring_map_indirect(const VRingDesc *desc,
+                                       const VRingDesc **table)
+{
+    unsigned int num;
+
+    if (desc->len < sizeof(VRingDesc) || desc->len % sizeof(VRingDesc)) {
+        error_report("Invalid size for indirect buffer table");
+        exit(1);
+    }
+    num = desc->len / sizeof(VRingDesc);
+    *table = vring_map_ram(desc->addr, num * sizeof(VRingDesc));
+    return num;
+}
+
+static unsigned virtqueue_next_desc(const VRingDesc *desc, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(desc_pa, i) & VRING_DESC_F_NEXT))
+    if (!(desc->flags & VRING_DESC_F_NEXT))
         return max;
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(desc_pa, i);
+    next = desc->next;
     /* Make sure compiler knows to grab that: we don't want it changing! */
     smp_wmb();
 
@@ -346,19 +429,18 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
     while (virtqueue_num_heads(vq, idx)) {
         unsigned int max, num_bufs, indirect = 0;
         target_phys_addr_t desc_pa;
+        const VRingDesc *table;
+        VRingDesc desc;
         int i;
 
         max = vq->vring.num;
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
+        table = vq->vring.desc_ptr;
+        vring_desc_read(table, desc_pa, i, &desc);
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
-                error_report("Invalid size for indirect buffer table");
-                exit(1);
-            }
-
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
             /* If we've got too many, that implies a descriptor loop. */
             if (num_bufs >= max) {
                 error_report("Looped descriptor");
@@ -367,9 +449,10 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
+            desc_pa = desc.addr;
+            max = vring_map_indirect(&desc, &table);
             num_bufs = i = 0;
-            desc_pa = vring_desc_addr(desc_pa, i);
+            vring_desc_read(table, desc_pa, i, &desc);
         }
 
         do {
@@ -379,16 +462,20 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
                 exit(1);
             }
 
-            if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
+            if (desc.flags & VRING_DESC_F_WRITE) {
                 if (in_bytes > 0 &&
-                    (in_total += vring_desc_len(desc_pa, i)) >= in_bytes)
+                    (in_total += desc.len) >= in_bytes)
                     return 1;
             } else {
                 if (out_bytes > 0 &&
-                    (out_total += vring_desc_len(desc_pa, i)) >= out_bytes)
+                    (out_total += desc.len) >= out_bytes)
                     return 1;
             }
-        } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+            i = virtqueue_next_desc(&desc, max);
+            if (i != max) {
+                vring_desc_read(table, desc_pa, i, &desc);
+            }
+        } while (i != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -419,6 +506,8 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
 {
     unsigned int i, head, max;
     target_phys_addr_t desc_pa = vq->vring.desc;
+    const VRingDesc *table = vq->vring.desc_ptr;
+    VRingDesc desc;
 
     if (!virtqueue_num_heads(vq, vq->last_avail_idx))
         return 0;
@@ -433,46 +522,48 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
         vring_avail_event(vq, vring_avail_idx(vq));
     }
 
-    if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
-            error_report("Invalid size for indirect buffer table");
-            exit(1);
-        }
-
+    vring_desc_read(table, desc_pa, i, &desc);
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(desc_pa, i);
+        desc_pa = desc.addr;
+        max = vring_map_indirect(&desc, &table);
         i = 0;
+        vring_desc_read(table, desc_pa, i, &desc);
     }
 
     /* Collect all the descriptors */
     do {
         struct iovec *sg;
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
+        if (desc.flags & VRING_DESC_F_WRITE) {
             if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
                 error_report("Too many write descriptors in indirect table");
                 exit(1);
             }
-            elem->in_addr[elem->in_num] = vring_desc_addr(desc_pa, i);
+            elem->in_addr[elem->in_num] = desc.addr;
             sg = &elem->in_sg[elem->in_num++];
         } else {
             if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
                 error_report("Too many read descriptors in indirect table");
                 exit(1);
             }
-            elem->out_addr[elem->out_num] = vring_desc_addr(desc_pa, i);
+            elem->out_addr[elem->out_num] = desc.addr;
             sg = &elem->out_sg[elem->out_num++];
         }
 
-        sg->iov_len = vring_desc_len(desc_pa, i);
+        sg->iov_len = desc.len;
 
         /* If we've got too many, that implies a descriptor loop. */
         if ((elem->in_num + elem->out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+
+        i = virtqueue_next_desc(&desc, max);
+        if (i != max) {
+            vring_desc_read(table, desc_pa, i, &desc);
+        }
+    } while (i != max);
 
     /* Now map what we have collected */
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
@@ -532,6 +623,8 @@ void virtio_reset(void *opaque)
         vdev->vq[i].vring.used = 0;
         vdev->vq[i].last_avail_idx = 0;
         vdev->vq[i].pa = 0;
+        vdev->vq[i].vring.desc_ptr = NULL;
+        vdev->vq[i].vring.avail_ptr = NULL;
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].signalled_used = 0;
         vdev->vq[i].signalled_used_valid = false;
@@ -862,6 +955,7 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    memory_listener_unregister(&vdev->memory_listener);
     qemu_del_vm_change_state_handler(vdev->vmstate);
     g_free(vdev->config);
     g_free(vdev->vq);
@@ -887,6 +981,40 @@ static void virtio_vmstate_change(void *opaque, int running, RunState state)
     }
 }
 
+static void virtio_memory_begin(MemoryListener *listener)
+{
+}
+
+static void virtio_memory_commit(MemoryListener *listener)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice,
+                                      memory_listener);
+    int i;
+
+    /* RAM may have been remapped or unplugged under the ring pointers */
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        if (vdev->vq[i].pa) {
+            virtqueue_map_rings(&vdev->vq[i]);
+        }
+    }
+}
+
+static void virtio_memory_section(MemoryListener *listener,
+                                  MemoryRegionSection *section)
+{
+}
+
+static void virtio_memory_global(MemoryListener *listener)
+{
+}
+
+static void virtio_memory_eventfd(MemoryListener *listener,
+                                  MemoryRegionSection *section,
+                                  bool match_data, uint64_t data,
+                                  EventNotifier *e)
+{
+}
+
 VirtIODevice *virtio_common_init(const char *name, uint16_t device_id,
                                  size_t config_size, size_t struct_size)
 {
@@ -916,6 +1044,23 @@ VirtIODevice *virtio_common_init(const char *name, uint16_t device_id,
 
     vdev->vmstate = qemu_add_vm_change_state_handler(virtio_vmstate_change, vdev);
 
+    vdev->memory_listener = (MemoryListener) {
+        .begin = virtio_memory_begin,
+        .commit = virtio_memory_commit,
+        .region_add = virtio_memory_section,
+        .region_del = virtio_memory_section,
+        .region_nop = virtio_memory_section,
+        .log_start = virtio_memory_section,
+        .log_stop = virtio_memory_section,
+        .log_sync = virtio_memory_section,
+        .log_global_start = virtio_memory_global,
+        .log_global_stop = virtio_memory_global,
+        .eventfd_add = virtio_memory_eventfd,
+        .eventfd_del = virtio_memory_eventfd,
+        .priority = 10
+    };
+    memory_listener_register(&vdev->memory_listener, get_system_memory());
+
     return vdev;
 }
 
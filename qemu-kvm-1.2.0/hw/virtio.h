@@ -15,6 +15,7 @@
 #define _QEMU_VIRTIO_H
 
 #include "hw.h"
+#include "memory.h"
 #include "net.h"
 #include "qdev.h"
 #include "sysemu.h"
@@ -132,6 +133,8 @@ struct VirtIODevice
     uint16_t device_id;
     bool vm_running;
     VMChangeStateEntry *vmstate;
+    /* remaps the rings when the memory map changes */
+    MemoryListener memory_listener;
 };
 
 VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
@@ -143,6 +146,7 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_flush(VirtQueue *vq, unsigned int count);
 void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len, unsigned int idx);
+void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem);
 
 void virtqueue_map_sg(struct iovec *sg, target_phys_addr_t *addr,
     size_t num_sg, int is_write);
@@ -197,7 +201,8 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
                               struct virtio_net_conf *net);
 typedef struct virtio_serial_conf virtio_serial_conf;
 VirtIODevice *virtio_serial_init(DeviceState *dev, virtio_serial_conf *serial);
-VirtIODevice *virtio_balloon_init(DeviceState *dev);
+typedef struct VirtIOBalloonConf VirtIOBalloonConf;
+VirtIODevice *virtio_balloon_init(DeviceState *dev, VirtIOBalloonConf *conf);
 typedef struct VirtIOSCSIConf VirtIOSCSIConf;
 VirtIODevice *virtio_scsi_init(DeviceState *dev, VirtIOSCSIConf *conf);
 #ifdef CONFIG_LINUX
@@ -61,7 +61,7 @@ static uint32_t vmport_ioport_read(void *opaque, uint32_t addr)
     unsigned char command;
     uint32_t eax;
 
-    cpu_synchronize_state(env);
+    cpu_synchronize_groups(env, KVM_REGS_GPR);
 
     eax = env->regs[R_EAX];
     if (eax != VMPORT_MAGIC)
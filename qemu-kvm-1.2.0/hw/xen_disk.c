@@ -52,6 +52,13 @@ static int max_requests = 32;
 #define BLOCK_SIZE  512
 #define IOCB_COUNT  (BLKIF_MAX_SEGMENTS_PER_REQUEST + 2)
 
+struct PersistentGrant {
+    void *page;
+    struct XenBlkDev *blkdev;
+};
+
+typedef struct PersistentGrant PersistentGrant;
+
 struct ioreq {
     blkif_request_t     req;
     int16_t             status;
@@ -69,6 +76,7 @@ struct ioreq {
     int                 prot;
     void                *page[BLKIF_MAX_SEGMENTS_PER_REQUEST];
     void                *pages;
+    int                 num_unmap;
 
     /* aio status */
     int                 aio_inflight;
@@ -105,6 +113,12 @@ struct XenBlkDev {
     int                 requests_inflight;
     int                 requests_finished;
 
+    /* persistent grants, keyed by grant reference */
+    bool                feature_persistent;
+    GTree               *persistent_gnts;
+    unsigned int        persistent_gnt_count;
+    unsigned int        max_grants;
+
     /* qemu block driver */
     DriveInfo           *dinfo;
     BlockDriverState    *bs;
@@ -242,21 +256,26 @@ static void ioreq_unmap(struct ioreq *ioreq)
     XenGnttab gnt = ioreq->blkdev->xendev.gnttabdev;
     int i;
 
-    if (ioreq->v.niov == 0 || ioreq->mapped == 0) {
+    if (ioreq->mapped == 0) {
+        return;
+    }
+    if (ioreq->num_unmap == 0) {
+        /* everything is mapped persistently */
+        ioreq->mapped = 0;
         return;
     }
     if (batch_maps) {
         if (!ioreq->pages) {
             return;
         }
-        if (xc_gnttab_munmap(gnt, ioreq->pages, ioreq->v.niov) != 0) {
+        if (xc_gnttab_munmap(gnt, ioreq->pages, ioreq->num_unmap) != 0) {
             xen_be_printf(&ioreq->blkdev->xendev, 0, "xc_gnttab_munmap failed: %s\n",
                           strerror(errno));
         }
-        ioreq->blkdev->cnt_map -= ioreq->v.niov;
+        ioreq->blkdev->cnt_map -= ioreq->num_unmap;
         ioreq->pages = NULL;
     } else {
-        for (i = 0; i < ioreq->v.niov; i++) {
+        for (i = 0; i < ioreq->num_unmap; i++) {
             if (!ioreq->page[i]) {
                 continue;
             }
@@ -273,45 +292,135 @@ static void ioreq_unmap(struct ioreq *ioreq)
 
 static int ioreq_map(struct ioreq *ioreq)
 {
-    XenGnttab gnt = ioreq->blkdev->xendev.gnttabdev;
-    int i;
+    struct XenBlkDev *blkdev = ioreq->blkdev;
+    XenGnttab gnt = blkdev->xendev.gnttabdev;
+    uint32_t domids[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    uint32_t refs[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    void *page[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    PersistentGrant *grant;
+    bool persist = false;
+    int i, j, new_maps = 0;
 
     if (ioreq->v.niov == 0 || ioreq->mapped == 1) {
         return 0;
     }
-    if (batch_maps) {
+    if (blkdev->feature_persistent) {
+        persist = true;
+        for (i = 0; i < ioreq->v.niov; i++) {
+            grant = g_tree_lookup(blkdev->persistent_gnts,
+                                  GUINT_TO_POINTER(ioreq->refs[i]));
+            if (grant != NULL) {
+                page[i] = grant->page;
+                xen_be_printf(&blkdev->xendev, 3,
+                              "using persistent grant %" PRIu32 "\n",
+                              ioreq->refs[i]);
+                continue;
+            }
+            for (j = 0; j < new_maps; j++) {
+                if (refs[j] == ioreq->refs[i]) {
+                    /* the same page twice, keep it simple and map it
+                     * twice without making either mapping persistent */
+                    persist = false;
+                }
+            }
+            domids[new_maps] = ioreq->domids[i];
+            refs[new_maps] = ioreq->refs[i];
+            page[i] = NULL;
+            new_maps++;
+        }
+        if (blkdev->persistent_gnt_count + new_maps > blkdev->max_grants) {
+            persist = false;
+        }
+        /* grants may be reused later for the opposite direction */
+        ioreq->prot = PROT_READ | PROT_WRITE;
+    } else {
+        memcpy(domids, ioreq->domids, sizeof(domids));
+        memcpy(refs, ioreq->refs, sizeof(refs));
+        memset(page, 0, sizeof(page));
+        new_maps = ioreq->v.niov;
+    }
+
+    ioreq->num_unmap = new_maps;
+    if (batch_maps && new_maps) {
         ioreq->pages = xc_gnttab_map_grant_refs
-            (gnt, ioreq->v.niov, ioreq->domids, ioreq->refs, ioreq->prot);
+            (gnt, new_maps, domids, refs, ioreq->prot);
         if (ioreq->pages == NULL) {
-            xen_be_printf(&ioreq->blkdev->xendev, 0,
+            xen_be_printf(&blkdev->xendev, 0,
                           "can't map %d grant refs (%s, %d maps)\n",
-                          ioreq->v.niov, strerror(errno), ioreq->blkdev->cnt_map);
+                          new_maps, strerror(errno), blkdev->cnt_map);
             return -1;
         }
-        for (i = 0; i < ioreq->v.niov; i++) {
-            ioreq->v.iov[i].iov_base = ioreq->pages + i * XC_PAGE_SIZE +
-                (uintptr_t)ioreq->v.iov[i].iov_base;
-        }
-        ioreq->blkdev->cnt_map += ioreq->v.niov;
-    } else  {
-        for (i = 0; i < ioreq->v.niov; i++) {
+        blkdev->cnt_map += new_maps;
+    } else {
+        for (i = 0; i < new_maps; i++) {
             ioreq->page[i] = xc_gnttab_map_grant_ref
-                (gnt, ioreq->domids[i], ioreq->refs[i], ioreq->prot);
+                (gnt, domids[i], refs[i], ioreq->prot);
             if (ioreq->page[i] == NULL) {
-                xen_be_printf(&ioreq->blkdev->xendev, 0,
+                xen_be_printf(&blkdev->xendev, 0,
                               "can't map grant ref %d (%s, %d maps)\n",
-                              ioreq->refs[i], strerror(errno), ioreq->blkdev->cnt_map);
+                              refs[i], strerror(errno), blkdev->cnt_map);
+                ioreq->num_unmap = i;
+                ioreq->mapped = 1;
                 ioreq_unmap(ioreq);
                 return -1;
             }
-            ioreq->v.iov[i].iov_base = ioreq->page[i] + (uintptr_t)ioreq->v.iov[i].iov_base;
-            ioreq->blkdev->cnt_map++;
+            blkdev->cnt_map++;
         }
     }
+
+    for (i = 0, j = 0; i < ioreq->v.niov; i++) {
+        if (page[i] == NULL) {
+            page[i] = batch_maps ? ioreq->pages + (j++) * XC_PAGE_SIZE
+                                 : ioreq->page[j++];
+        }
+        ioreq->v.iov[i].iov_base = page[i] + (uintptr_t)ioreq->v.iov[i].iov_base;
+    }
+
+    if (persist && new_maps) {
+        /* Keep the new mappings, they are released on disconnect */
+        for (i = 0; i < new_maps; i++) {
+            grant = g_malloc0(sizeof(*grant));
+            grant->page = batch_maps ? ioreq->pages + i * XC_PAGE_SIZE
+                                     : ioreq->page[i];
+            grant->blkdev = blkdev;
+            xen_be_printf(&blkdev->xendev, 3,
+                          "adding persistent grant %" PRIu32 "\n", refs[i]);
+            g_tree_insert(blkdev->persistent_gnts, GUINT_TO_POINTER(refs[i]),
+                          grant);
+            blkdev->persistent_gnt_count++;
+        }
+        ioreq->num_unmap = 0;
+        ioreq->pages = NULL;
+        memset(ioreq->page, 0, sizeof(ioreq->page));
+    }
     ioreq->mapped = 1;
     return 0;
 }
 
+static int int_cmp(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    guint ua = GPOINTER_TO_UINT(a);
+    guint ub = GPOINTER_TO_UINT(b);
+
+    return (ua > ub) - (ua < ub);
+}
+
+static void destroy_grant(gpointer pgnt)
+{
+    PersistentGrant *grant = pgnt;
+    XenGnttab gnt = grant->blkdev->xendev.gnttabdev;
+
+    if (xc_gnttab_munmap(gnt, grant->page, 1) != 0) {
+        xen_be_printf(&grant->blkdev->xendev, 0,
+                      "xc_gnttab_munmap failed: %s\n", strerror(errno));
+    }
+    grant->blkdev->persistent_gnt_count--;
+    grant->blkdev->cnt_map--;
+    xen_be_printf(&grant->blkdev->xendev, 3,
+                  "unmapped grant %p\n", grant->page);
+    g_free(grant);
+}
+
 static int ioreq_runio_qemu_aio(struct ioreq *ioreq);
 
 static void qemu_aio_complete(void *opaque, int ret)
@@ -494,6 +603,8 @@ static void blk_handle_requests(struct XenBlkDev *blkdev)
     xen_rmb(); /* Ensure we see queued requests up to 'rp'. */
 
     blk_send_response_all(blkdev);
+    /* Submit everything found on the ring in one go */
+    bdrv_io_plug(blkdev->bs);
     while (rc != rp) {
         /* pull request from ring */
         if (RING_REQUEST_CONS_OVERFLOW(&blkdev->rings.common, rc)) {
@@ -518,6 +629,7 @@ static void blk_handle_requests(struct XenBlkDev *blkdev)
 
         ioreq_runio_qemu_aio(ioreq);
     }
+    bdrv_io_unplug(blkdev->bs);
 
     if (blkdev->more_work && blkdev->requests_inflight < max_requests) {
         qemu_bh_schedule(blkdev->bh);
@@ -538,8 +650,9 @@ static void blk_bh(void *opaque)
  *     max_req * max_seg + (max_req - 1) * (max_seg - 1) + 1,
  * but in order to keep things simple just use
  *     2 * max_req * max_seg.
+ * On top of that come up to max_req * max_seg persistent grants.
  */
-#define MAX_GRANTS(max_req, max_seg) (2 * (max_req) * (max_seg))
+#define MAX_GRANTS(max_req, max_seg) (3 * (max_req) * (max_seg))
 
 static void blk_alloc(struct XenDevice *xendev)
 {
@@ -656,6 +769,7 @@ static int blk_init(struct XenDevice *xendev)
 
     /* fill info */
     xenstore_write_be_int(&blkdev->xendev, "feature-barrier", 1);
+    xenstore_write_be_int(&blkdev->xendev, "feature-persistent", 1);
     xenstore_write_be_int(&blkdev->xendev, "info",            info);
     xenstore_write_be_int(&blkdev->xendev, "sector-size",     blkdev->file_blk);
     xenstore_write_be_int(&blkdev->xendev, "sectors",
@@ -679,6 +793,7 @@ out_error:
 static int blk_connect(struct XenDevice *xendev)
 {
     struct XenBlkDev *blkdev = container_of(xendev, struct XenBlkDev, xendev);
+    int pers;
 
     if (xenstore_read_fe_int(&blkdev->xendev, "ring-ref", &blkdev->ring_ref) == -1) {
         return -1;
@@ -687,6 +802,11 @@ static int blk_connect(struct XenDevice *xendev)
                              &blkdev->xendev.remote_port) == -1) {
         return -1;
     }
+    if (xenstore_read_fe_int(&blkdev->xendev, "feature-persistent", &pers)) {
+        blkdev->feature_persistent = false;
+    } else {
+        blkdev->feature_persistent = !!pers;
+    }
 
     blkdev->protocol = BLKIF_PROTOCOL_NATIVE;
     if (blkdev->xendev.protocol) {
@@ -730,12 +850,22 @@ static int blk_connect(struct XenDevice *xendev)
     }
     }
 
+    if (blkdev->feature_persistent) {
+        /* Init persistent grants */
+        blkdev->max_grants = max_requests * BLKIF_MAX_SEGMENTS_PER_REQUEST;
+        blkdev->persistent_gnts = g_tree_new_full((GCompareDataFunc)int_cmp,
+                                                  NULL, NULL,
+                                                  (GDestroyNotify)destroy_grant);
+        blkdev->persistent_gnt_count = 0;
+    }
+
     xen_be_bind_evtchn(&blkdev->xendev);
 
     xen_be_printf(&blkdev->xendev, 1, "ok: proto %s, ring-ref %d, "
-                  "remote port %d, local port %d\n",
+                  "remote port %d, local port %d, persistent grants %s\n",
                   blkdev->xendev.protocol, blkdev->ring_ref,
-                  blkdev->xendev.remote_port, blkdev->xendev.local_port);
+                  blkdev->xendev.remote_port, blkdev->xendev.local_port,
+                  blkdev->feature_persistent ? "on" : "off");
     return 0;
 }
 
@@ -759,6 +889,14 @@ static void blk_disconnect(struct XenDevice *xendev)
         blkdev->cnt_map--;
         blkdev->sring = NULL;
     }
+
+    if (blkdev->persistent_gnts) {
+        /* Unmap all persistent grants */
+        g_tree_destroy(blkdev->persistent_gnts);
+        assert(blkdev->persistent_gnt_count == 0);
+        blkdev->persistent_gnts = NULL;
+        blkdev->feature_persistent = false;
+    }
 }
 
 static int blk_free(struct XenDevice *xendev)
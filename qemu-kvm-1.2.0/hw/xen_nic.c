@@ -41,11 +41,16 @@
 #include "net/util.h"
 #include "qemu-char.h"
 #include "xen_backend.h"
+#include "virtio-net.h"
 
 #include <xen/io/netif.h>
 
 /* ------------------------------------------------------------- */
 
+/* ring requests handled with one grant map each way */
+#define NET_TX_BATCH 32
+#define NET_RX_BATCH 32
+
 struct XenNetDev {
     struct XenDevice      xendev;  /* must be first */
     char                  *mac;
@@ -58,15 +63,79 @@ struct XenNetDev {
     netif_rx_back_ring_t  rx_ring;
     NICConf               conf;
     NICState              *nic;
+    int                   has_vnet_hdr;
+
+    /* received frames waiting to be copied into the guest's buffers */
+    int                   rx_count;
+    netif_rx_request_t    rx_req[NET_RX_BATCH];
+    uint16_t              rx_size[NET_RX_BATCH];
+    uint16_t              rx_flags[NET_RX_BATCH];
+    uint8_t               *rx_data;
+    QEMUBH                *rx_bh;
+
+    /* copies of tx frames whose checksum we fill in */
+    uint8_t               *tx_data;
 };
 
+static int batch_maps = 0;
+
+/* ------------------------------------------------------------- */
+
+/*
+ * Maps the guest pages of count grant refs.  Returns 1 if they were
+ * mapped with a single call, 0 if one by one, in which case pages that
+ * could not be mapped are NULL.
+ */
+static int net_map_grants(struct XenNetDev *netdev, uint32_t *refs,
+                          int count, int prot, void **page)
+{
+    uint32_t domids[MAX(NET_TX_BATCH, NET_RX_BATCH)];
+    uint8_t *pages;
+    int i;
+
+    if (batch_maps) {
+        for (i = 0; i < count; i++) {
+            domids[i] = netdev->xendev.dom;
+        }
+        pages = xc_gnttab_map_grant_refs(netdev->xendev.gnttabdev, count,
+                                         domids, refs, prot);
+        if (pages) {
+            for (i = 0; i < count; i++) {
+                page[i] = pages + i * XC_PAGE_SIZE;
+            }
+            return 1;
+        }
+        /* one bad ref fails them all, find out which */
+    }
+    for (i = 0; i < count; i++) {
+        page[i] = xc_gnttab_map_grant_ref(netdev->xendev.gnttabdev,
+                                          netdev->xendev.dom, refs[i], prot);
+    }
+    return 0;
+}
+
+static void net_unmap_grants(struct XenNetDev *netdev, void **page,
+                             int count, int batched)
+{
+    int i;
+
+    if (batched) {
+        xc_gnttab_munmap(netdev->xendev.gnttabdev, page[0], count);
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        if (page[i]) {
+            xc_gnttab_munmap(netdev->xendev.gnttabdev, page[i], 1);
+        }
+    }
+}
+
 /* ------------------------------------------------------------- */
 
 static void net_tx_response(struct XenNetDev *netdev, netif_tx_request_t *txp, int8_t st)
 {
     RING_IDX i = netdev->tx_ring.rsp_prod_pvt;
     netif_tx_response_t *resp;
-    int notify;
 
     resp = RING_GET_RESPONSE(&netdev->tx_ring, i);
     resp->id     = txp->id;
@@ -79,12 +148,19 @@ static void net_tx_response(struct XenNetDev *netdev, netif_tx_request_t *txp, i
 #endif
 
     netdev->tx_ring.rsp_prod_pvt = ++i;
+}
+
+/* Publish the responses written so far, with one notification at most */
+static void net_tx_push_responses(struct XenNetDev *netdev)
+{
+    int notify;
+
     RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&netdev->tx_ring, notify);
     if (notify) {
         xen_be_send_notify(&netdev->xendev);
     }
 
-    if (i == netdev->tx_ring.req_cons) {
+    if (netdev->tx_ring.rsp_prod_pvt == netdev->tx_ring.req_cons) {
         int more_to_do;
         RING_FINAL_CHECK_FOR_REQUESTS(&netdev->tx_ring, more_to_do);
         if (more_to_do) {
@@ -117,88 +193,163 @@ static void net_tx_error(struct XenNetDev *netdev, netif_tx_request_t *txp, RING
 #endif
 }
 
+/*
+ * The frontend left the TCP/UDP checksum of an IPv4 frame blank, with
+ * the pseudo header sum in it as Linux does.  Describe it in hdr so that
+ * the peer completes it; returns -1 if the frame can't be parsed.
+ */
+static int net_tx_csum_hdr(struct virtio_net_hdr *hdr, const uint8_t *buf,
+                           unsigned len)
+{
+    unsigned hlen;
+
+    if (len < 14 + 20 || buf[12] != 0x08 || buf[13] != 0x00 ||
+        (buf[14] & 0xf0) != 0x40) {
+        return -1;
+    }
+    hlen = (buf[14] & 0x0f) * 4;
+    if (hlen < 20) {
+        return -1;
+    }
+    switch (buf[23]) {
+    case 6:     /* TCP */
+        hdr->csum_offset = 16;
+        break;
+    case 17:    /* UDP */
+        hdr->csum_offset = 6;
+        break;
+    default:
+        return -1;
+    }
+    if (14 + hlen + hdr->csum_offset + 2 > len) {
+        return -1;
+    }
+    hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr->csum_start = 14 + hlen;
+    return 0;
+}
+
 static void net_tx_packets(struct XenNetDev *netdev)
 {
-    netif_tx_request_t txreq;
+    netif_tx_request_t txreq[NET_TX_BATCH];
+    uint32_t refs[NET_TX_BATCH];
+    void *page[NET_TX_BATCH];
+    struct virtio_net_hdr hdr[NET_TX_BATCH];
+    struct iovec iov[NET_TX_BATCH][2];
+    NetBatchPacket pkts[NET_TX_BATCH];
+    int hdr_len = netdev->has_vnet_hdr ? sizeof(hdr[0]) : 0;
     RING_IDX rc, rp;
-    void *page;
-    void *tmpbuf = NULL;
+    uint8_t *data;
+    int n, count, npkts, batched, i;
 
     for (;;) {
         rc = netdev->tx_ring.req_cons;
         rp = netdev->tx_ring.sring->req_prod;
         xen_rmb(); /* Ensure we see queued requests up to 'rp'. */
 
-        while ((rc != rp)) {
+        /* collect a batch of requests */
+        n = count = 0;
+        while ((rc != rp) && n < NET_TX_BATCH) {
+            netif_tx_request_t *req = &txreq[count];
+
             if (RING_REQUEST_CONS_OVERFLOW(&netdev->tx_ring, rc)) {
                 break;
             }
-            memcpy(&txreq, RING_GET_REQUEST(&netdev->tx_ring, rc), sizeof(txreq));
+            memcpy(req, RING_GET_REQUEST(&netdev->tx_ring, rc), sizeof(*req));
             netdev->tx_ring.req_cons = ++rc;
+            n++;
 
 #if 1
             /* should not happen in theory, we don't announce the *
              * feature-{sg,gso,whatelse} flags in xenstore (yet?) */
-            if (txreq.flags & NETTXF_extra_info) {
+            if (req->flags & NETTXF_extra_info) {
                 xen_be_printf(&netdev->xendev, 0, "FIXME: extra info flag\n");
-                net_tx_error(netdev, &txreq, rc);
+                net_tx_error(netdev, req, rc);
                 continue;
             }
-            if (txreq.flags & NETTXF_more_data) {
+            if (req->flags & NETTXF_more_data) {
                 xen_be_printf(&netdev->xendev, 0, "FIXME: more data flag\n");
-                net_tx_error(netdev, &txreq, rc);
+                net_tx_error(netdev, req, rc);
                 continue;
             }
 #endif
 
-            if (txreq.size < 14) {
-                xen_be_printf(&netdev->xendev, 0, "bad packet size: %d\n", txreq.size);
-                net_tx_error(netdev, &txreq, rc);
+            if (req->size < 14) {
+                xen_be_printf(&netdev->xendev, 0, "bad packet size: %d\n", req->size);
+                net_tx_error(netdev, req, rc);
                 continue;
             }
 
-            if ((txreq.offset + txreq.size) > XC_PAGE_SIZE) {
+            if ((req->offset + req->size) > XC_PAGE_SIZE) {
                 xen_be_printf(&netdev->xendev, 0, "error: page crossing\n");
-                net_tx_error(netdev, &txreq, rc);
+                net_tx_error(netdev, req, rc);
                 continue;
             }
 
             xen_be_printf(&netdev->xendev, 3, "tx packet ref %d, off %d, len %d, flags 0x%x%s%s%s%s\n",
-                          txreq.gref, txreq.offset, txreq.size, txreq.flags,
-                          (txreq.flags & NETTXF_csum_blank)     ? " csum_blank"     : "",
-                          (txreq.flags & NETTXF_data_validated) ? " data_validated" : "",
-                          (txreq.flags & NETTXF_more_data)      ? " more_data"      : "",
-                          (txreq.flags & NETTXF_extra_info)     ? " extra_info"     : "");
-
-            page = xc_gnttab_map_grant_ref(netdev->xendev.gnttabdev,
-                                           netdev->xendev.dom,
-                                           txreq.gref, PROT_READ);
-            if (page == NULL) {
-                xen_be_printf(&netdev->xendev, 0, "error: tx gref dereference failed (%d)\n",
-                              txreq.gref);
-                net_tx_error(netdev, &txreq, rc);
-                continue;
+                          req->gref, req->offset, req->size, req->flags,
+                          (req->flags & NETTXF_csum_blank)     ? " csum_blank"     : "",
+                          (req->flags & NETTXF_data_validated) ? " data_validated" : "",
+                          (req->flags & NETTXF_more_data)      ? " more_data"      : "",
+                          (req->flags & NETTXF_extra_info)     ? " extra_info"     : "");
+
+            refs[count++] = req->gref;
+        }
+
+        if (count) {
+            batched = net_map_grants(netdev, refs, count, PROT_READ, page);
+            npkts = 0;
+            for (i = 0; i < count; i++) {
+                if (page[i] == NULL) {
+                    xen_be_printf(&netdev->xendev, 0, "error: tx gref dereference failed (%d)\n",
+                                  txreq[i].gref);
+                    net_tx_error(netdev, &txreq[i], rc);
+                    continue;
+                }
+                data = (uint8_t *)page[i] + txreq[i].offset;
+                memset(&hdr[i], 0, sizeof(hdr[i]));
+                if ((txreq[i].flags & NETTXF_csum_blank) &&
+                    (!hdr_len ||
+                     net_tx_csum_hdr(&hdr[i], data, txreq[i].size) < 0)) {
+                    /* have read-only mapping -> can't fill checksum in-place */
+                    if (!netdev->tx_data) {
+                        netdev->tx_data = g_malloc(NET_TX_BATCH * XC_PAGE_SIZE);
+                    }
+                    memcpy(netdev->tx_data + i * XC_PAGE_SIZE, data,
+                           txreq[i].size);
+                    data = netdev->tx_data + i * XC_PAGE_SIZE;
+                    net_checksum_calculate(data, txreq[i].size);
+                }
+                iov[i][0].iov_base = &hdr[i];
+                iov[i][0].iov_len = hdr_len;
+                iov[i][1].iov_base = data;
+                iov[i][1].iov_len = txreq[i].size;
+                pkts[npkts].iov = hdr_len ? iov[i] : &iov[i][1];
+                pkts[npkts].iovcnt = hdr_len ? 2 : 1;
+                npkts++;
             }
-            if (txreq.flags & NETTXF_csum_blank) {
-                /* have read-only mapping -> can't fill checksum in-place */
-                if (!tmpbuf) {
-                    tmpbuf = g_malloc(XC_PAGE_SIZE);
+
+            /* frames the peer has to queue are copied */
+            qemu_sendv_batch_async(&netdev->nic->nc, pkts, npkts, NULL);
+
+            net_unmap_grants(netdev, page, count, batched);
+            for (i = 0; i < count; i++) {
+                if (page[i]) {
+                    net_tx_response(netdev, &txreq[i], NETIF_RSP_OKAY);
                 }
-                memcpy(tmpbuf, page + txreq.offset, txreq.size);
-                net_checksum_calculate(tmpbuf, txreq.size);
-                qemu_send_packet(&netdev->nic->nc, tmpbuf, txreq.size);
-            } else {
-                qemu_send_packet(&netdev->nic->nc, page + txreq.offset, txreq.size);
             }
-            xc_gnttab_munmap(netdev->xendev.gnttabdev, page, 1);
-            net_tx_response(netdev, &txreq, NETIF_RSP_OKAY);
+        }
+        if (n) {
+            net_tx_push_responses(netdev);
+        }
+        if (n == NET_TX_BATCH) {
+            continue;
         }
         if (!netdev->tx_work) {
             break;
         }
         netdev->tx_work = 0;
     }
-    g_free(tmpbuf);
 }
 
 /* ------------------------------------------------------------- */
@@ -210,7 +361,6 @@ static void net_rx_response(struct XenNetDev *netdev,
 {
     RING_IDX i = netdev->rx_ring.rsp_prod_pvt;
     netif_rx_response_t *resp;
-    int notify;
 
     resp = RING_GET_RESPONSE(&netdev->rx_ring, i);
     resp->offset     = offset;
@@ -225,13 +375,56 @@ static void net_rx_response(struct XenNetDev *netdev,
                   i, resp->status, resp->flags);
 
     netdev->rx_ring.rsp_prod_pvt = ++i;
+}
+
+#define NET_IP_ALIGN 2
+
+/* Copy the pending frames into the guest's buffers and notify it once */
+static void net_rx_flush(struct XenNetDev *netdev)
+{
+    uint32_t refs[NET_RX_BATCH];
+    void *page[NET_RX_BATCH];
+    int count = netdev->rx_count;
+    int batched, notify, i;
+
+    if (!count) {
+        return;
+    }
+    netdev->rx_count = 0;
+
+    for (i = 0; i < count; i++) {
+        refs[i] = netdev->rx_req[i].gref;
+    }
+    batched = net_map_grants(netdev, refs, count, PROT_WRITE, page);
+    for (i = 0; i < count; i++) {
+        if (page[i] == NULL) {
+            xen_be_printf(&netdev->xendev, 0, "error: rx gref dereference failed (%d)\n",
+                          refs[i]);
+            net_rx_response(netdev, &netdev->rx_req[i], NETIF_RSP_ERROR,
+                            0, 0, 0);
+            continue;
+        }
+        memcpy((uint8_t *)page[i] + NET_IP_ALIGN,
+               netdev->rx_data + i * XC_PAGE_SIZE, netdev->rx_size[i]);
+        net_rx_response(netdev, &netdev->rx_req[i], NETIF_RSP_OKAY,
+                        NET_IP_ALIGN, netdev->rx_size[i], netdev->rx_flags[i]);
+    }
+    net_unmap_grants(netdev, page, count, batched);
+
     RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&netdev->rx_ring, notify);
     if (notify) {
         xen_be_send_notify(&netdev->xendev);
     }
 }
 
-#define NET_IP_ALIGN 2
+static void net_rx_bh(void *opaque)
+{
+    struct XenNetDev *netdev = opaque;
+
+    if (netdev->xendev.be_state == XenbusStateConnected) {
+        net_rx_flush(netdev);
+    }
+}
 
 static int net_rx_ok(NetClientState *nc)
 {
@@ -254,12 +447,18 @@ static int net_rx_ok(NetClientState *nc)
     return 1;
 }
 
+/*
+ * Frames are staged and copied into the guest from a bottom half, so
+ * that a burst from the peer costs one grant map and one notification.
+ */
 static ssize_t net_rx_packet(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     struct XenNetDev *netdev = DO_UPCAST(NICState, nc, nc)->opaque;
-    netif_rx_request_t rxreq;
+    size_t hdr_len = netdev->has_vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
+    const struct virtio_net_hdr *hdr = (const struct virtio_net_hdr *)buf;
+    size_t full_size = size;
     RING_IDX rc, rp;
-    void *page;
+    int i;
 
     if (netdev->xendev.be_state != XenbusStateConnected) {
         return -1;
@@ -273,29 +472,36 @@ static ssize_t net_rx_packet(NetClientState *nc, const uint8_t *buf, size_t size
         xen_be_printf(&netdev->xendev, 2, "no buffer, drop packet\n");
         return -1;
     }
+    /* receive offloads stay disabled on the peer */
+    if (size < hdr_len) {
+        return size;
+    }
+    buf += hdr_len;
+    size -= hdr_len;
     if (size > XC_PAGE_SIZE - NET_IP_ALIGN) {
         xen_be_printf(&netdev->xendev, 0, "packet too big (%lu > %ld)",
                       (unsigned long)size, XC_PAGE_SIZE - NET_IP_ALIGN);
         return -1;
     }
 
-    memcpy(&rxreq, RING_GET_REQUEST(&netdev->rx_ring, rc), sizeof(rxreq));
+    i = netdev->rx_count++;
+    memcpy(&netdev->rx_req[i], RING_GET_REQUEST(&netdev->rx_ring, rc),
+           sizeof(netdev->rx_req[i]));
     netdev->rx_ring.req_cons = ++rc;
+    memcpy(netdev->rx_data + i * XC_PAGE_SIZE, buf, size);
+    netdev->rx_size[i] = size;
+    netdev->rx_flags[i] = 0;
+    if (hdr_len && (hdr->flags & VIRTIO_NET_HDR_F_DATA_VALID)) {
+        netdev->rx_flags[i] = NETRXF_data_validated;
+    }
 
-    page = xc_gnttab_map_grant_ref(netdev->xendev.gnttabdev,
-                                   netdev->xendev.dom,
-                                   rxreq.gref, PROT_WRITE);
-    if (page == NULL) {
-        xen_be_printf(&netdev->xendev, 0, "error: rx gref dereference failed (%d)\n",
-                      rxreq.gref);
-        net_rx_response(netdev, &rxreq, NETIF_RSP_ERROR, 0, 0, 0);
-        return -1;
+    if (netdev->rx_count == NET_RX_BATCH) {
+        net_rx_flush(netdev);
+    } else {
+        qemu_bh_schedule(netdev->rx_bh);
     }
-    memcpy(page + NET_IP_ALIGN, buf, size);
-    xc_gnttab_munmap(netdev->xendev.gnttabdev, page, 1);
-    net_rx_response(netdev, &rxreq, NETIF_RSP_OKAY, NET_IP_ALIGN, size, 0);
 
-    return size;
+    return full_size;
 }
 
 /* ------------------------------------------------------------- */
@@ -333,6 +539,26 @@ static int net_init(struct XenDevice *xendev)
     snprintf(netdev->nic->nc.info_str, sizeof(netdev->nic->nc.info_str),
              "nic: xenbus vif macaddr=%s", netdev->mac);
 
+    netdev->has_vnet_hdr = qemu_has_vnet_hdr(netdev->nic->nc.peer);
+    if (netdev->has_vnet_hdr) {
+        qemu_using_vnet_hdr(netdev->nic->nc.peer, 1);
+        qemu_set_offload(netdev->nic->nc.peer, 0, 0, 0, 0, 0);
+    }
+
+    if (!netdev->rx_data) {
+        netdev->rx_data = g_malloc(NET_RX_BATCH * XC_PAGE_SIZE);
+        netdev->rx_bh = qemu_bh_new(net_rx_bh, netdev);
+    }
+    if (xen_mode != XEN_EMULATE) {
+        batch_maps = 1;
+    }
+    /* both rings plus a batch each way */
+    if (xc_gnttab_set_max_grants(xendev->gnttabdev,
+                                 2 + NET_TX_BATCH + NET_RX_BATCH) < 0) {
+        xen_be_printf(xendev, 0, "xc_gnttab_set_max_grants failed: %s\n",
+                      strerror(errno));
+    }
+
     /* fill info */
     xenstore_write_be_int(&netdev->xendev, "feature-rx-copy", 1);
     xenstore_write_be_int(&netdev->xendev, "feature-rx-flip", 0);
@@ -395,6 +621,9 @@ static void net_disconnect(struct XenDevice *xendev)
 {
     struct XenNetDev *netdev = container_of(xendev, struct XenNetDev, xendev);
 
+    if (netdev->rxs) {
+        net_rx_flush(netdev);
+    }
     xen_be_unbind_evtchn(&netdev->xendev);
 
     if (netdev->txs) {
@@ -422,6 +651,11 @@ static int net_free(struct XenDevice *xendev)
     struct XenNetDev *netdev = container_of(xendev, struct XenNetDev, xendev);
 
     g_free(netdev->mac);
+    if (netdev->rx_bh) {
+        qemu_bh_delete(netdev->rx_bh);
+    }
+    g_free(netdev->rx_data);
+    g_free(netdev->tx_data);
     return 0;
 }
 
@@ -67,6 +67,7 @@ struct CPUState {
     HANDLE hThread;
 #endif
     bool thread_kicked;
+    bool throttle_thread_scheduled;
 
     /* TODO Move common fields from CPUArchState here. */
 };
@@ -0,0 +1,121 @@
+/*
+ * Hierarchical bitmap
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_HBITMAP_H
+#define QEMU_HBITMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * An HBitmap tracks a range of @size items, one bit per 2^@granularity
+ * items.  On top of the bit array it keeps summary levels where each bit
+ * tells whether a 64-bit word of the level below has any bit set, so that
+ * looking for the next set bit costs O(log64 size) instead of a linear
+ * scan, and it keeps the number of set bits up to date so that counting
+ * is O(1).
+ */
+typedef struct HBitmap HBitmap;
+
+typedef struct HBitmapIter {
+    const HBitmap *hb;
+    uint64_t pos;       /* next bit to look at, in units of granules */
+} HBitmapIter;
+
+/**
+ * hbitmap_alloc:
+ * @size: Number of items to track.
+ * @granularity: Each bit covers 2^@granularity items.
+ *
+ * Allocate a new, clear bitmap.
+ */
+HBitmap *hbitmap_alloc(uint64_t size, int granularity);
+
+/**
+ * hbitmap_free:
+ * @hb: The bitmap to free.
+ */
+void hbitmap_free(HBitmap *hb);
+
+/**
+ * hbitmap_granularity:
+ * @hb: The bitmap.
+ *
+ * Return the log2 of the number of items covered by each bit.
+ */
+int hbitmap_granularity(const HBitmap *hb);
+
+/**
+ * hbitmap_count:
+ * @hb: The bitmap.
+ *
+ * Return the number of items covered by set bits.  The last bit may
+ * cover fewer than 2^granularity items, it is counted in full.
+ */
+uint64_t hbitmap_count(const HBitmap *hb);
+
+/**
+ * hbitmap_empty:
+ * @hb: The bitmap.
+ *
+ * Return whether no bit is set.
+ */
+bool hbitmap_empty(const HBitmap *hb);
+
+/**
+ * hbitmap_set:
+ * @hb: The bitmap.
+ * @start: First item to mark.
+ * @count: Number of items to mark.
+ *
+ * Set the bits that cover items [@start, @start + @count).
+ */
+void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_reset:
+ * @hb: The bitmap.
+ * @start: First item to clear.
+ * @count: Number of items to clear.
+ *
+ * Clear the bits that cover items [@start, @start + @count).  Partially
+ * covered bits are cleared too.
+ */
+void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_get:
+ * @hb: The bitmap.
+ * @item: The item to test.
+ *
+ * Return whether the bit covering @item is set.
+ */
+bool hbitmap_get(const HBitmap *hb, uint64_t item);
+
+/**
+ * hbitmap_iter_init:
+ * @hbi: The iterator to initialize.
+ * @hb: The bitmap to walk.
+ * @first: The first item to look at.
+ *
+ * Prepare @hbi to return the set bits of @hb starting at @first.  The
+ * bitmap may be modified while it is walked; bits set behind the
+ * iterator are not returned until the iterator is initialized again.
+ */
+void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first);
+
+/**
+ * hbitmap_iter_next:
+ * @hbi: The iterator.
+ *
+ * Return the first item covered by the next set bit, or -1 if there is
+ * none left.
+ */
+int64_t hbitmap_iter_next(HBitmapIter *hbi);
+
+#endif
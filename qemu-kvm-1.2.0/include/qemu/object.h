@@ -235,11 +235,18 @@ typedef struct ObjectProperty
  * The base for all classes.  The only thing that #ObjectClass contains is an
  * integer type handle.
  */
+#define OBJECT_CLASS_CAST_CACHE 4
+
 struct ObjectClass
 {
     /*< private >*/
     Type type;
     GSList *interfaces;
+
+    /* typenames that casts of objects and of this class itself recently
+     * succeeded for, most recent first; compared by pointer */
+    const char *object_cast_cache[OBJECT_CLASS_CAST_CACHE];
+    const char *class_cast_cache[OBJECT_CLASS_CAST_CACHE];
 };
 
 /**
@@ -355,7 +362,7 @@ struct TypeInfo
  * this object type.
  *
  * If an invalid object is passed to this function, a run time assert will be
- * generated.
+ * generated, unless QEMU was configured with --disable-qom-cast-debug.
  */
 #define OBJECT_CHECK(type, obj, name) \
     ((type *)object_dynamic_cast_assert(OBJECT(obj), (name)))
@@ -511,6 +518,11 @@ Object *object_dynamic_cast(Object *obj, const char *typename);
  * See object_dynamic_cast() for a description of the parameters of this
  * function.  The only difference in behavior is that this function asserts
  * instead of returning #NULL on failure.
+ *
+ * Successful casts are cached in the class of @obj by the address of
+ * @typename, which must therefore stay valid and unchanged forever, as
+ * the string literals of the cast macros do.  With --disable-qom-cast-debug
+ * no check is made and @obj is returned as is.
  */
 Object *object_dynamic_cast_assert(Object *obj, const char *typename);
 
@@ -558,6 +570,10 @@ Type type_register(const TypeInfo *info);
  * @typename: The QOM typename of the class to cast to.
  *
  * Returns: This function always returns @klass and asserts on failure.
+ *
+ * Like object_dynamic_cast_assert(), this caches successful casts by the
+ * address of @typename, and only resolves casts to interfaces when
+ * configured with --disable-qom-cast-debug.
  */
 ObjectClass *object_class_dynamic_cast_assert(ObjectClass *klass,
                                               const char *typename);
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set associative cache indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -47,17 +47,20 @@ void cache_fini(PageCache *cache);
 bool cache_is_cached(const PageCache *cache, uint64_t addr);
 
 /**
- * get_cached_data: Get the data cached for an addr
+ * get_cached_data: Get the data cached for an addr, and mark it as the
+ * most recently used page of its set
  *
  * Returns pointer to the data cached or NULL if not cached
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
  */
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr);
 
 /**
- * cache_insert: insert the page into the cache. the previous value will be overwritten
+ * cache_insert: insert the page into the cache. the previous value will be
+ * overwritten and freed; if the set is full its least recently used page is
+ * evicted
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
@@ -65,6 +68,13 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
  */
 void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata);
 
+/**
+ * cache_get_evictions: Get the number of pages evicted from the cache
+ *
+ * @cache pointer to the PageCache struct
+ */
+uint64_t cache_get_evictions(const PageCache *cache);
+
 /**
  * cache_resize: resize the page cache. In case of size reduction the extra
  * pages will be freed
@@ -0,0 +1,58 @@
+/*
+ * Xor Based Zero Run Length Encoding
+ *
+ * Copyright 2012 Red Hat, Inc. and/or its affiliates
+ *
+ * Authors:
+ *  Orit Wasserman  <owasserm@redhat.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_XBZRLE_H
+#define QEMU_XBZRLE_H
+
+/**
+ * xbzrle_encode_buffer: encode the difference between two buffers
+ *
+ * Returns the encoded length, 0 if the buffers are identical or -1 if the
+ * encoding does not fit in @dlen bytes
+ *
+ * @old_buf: previous content, aligned to sizeof(long)
+ * @new_buf: current content, aligned to sizeof(long)
+ * @slen: length of both buffers, a multiple of sizeof(long)
+ * @dst: output buffer
+ * @dlen: size of @dst
+ */
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen);
+
+/**
+ * xbzrle_decode_buffer: apply an encoded difference on top of @dst
+ *
+ * Returns the length of @dst covered by the encoding or -1 on error
+ *
+ * @src: encoded data
+ * @slen: length of @src
+ * @dst: buffer holding the previous content
+ * @dlen: size of @dst
+ */
+int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+
+/**
+ * xbzrle_accel_name: name of the encoder variant in use
+ */
+const char *xbzrle_accel_name(void);
+
+/**
+ * xbzrle_test_next_accel: switch to the next slower encoder variant that
+ * the host supports, so that tests can cover all of them
+ *
+ * Returns %false, and leaves the encoder alone, once the generic variant
+ * is in use
+ */
+bool xbzrle_test_next_accel(void);
+
+#endif
@@ -27,10 +27,14 @@
 #include "qemu-char.h"
 #include "qemu-queue.h"
 #include "main-loop.h"
+#include "qemu-timer.h"
 
 #ifndef _WIN32
 #include <sys/wait.h>
 #endif
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
 
 typedef struct IOHandlerRecord {
     IOCanReadHandler *fd_read_poll;
@@ -40,11 +44,94 @@ typedef struct IOHandlerRecord {
     QLIST_ENTRY(IOHandlerRecord) next;
     int fd;
     bool deleted;
+    uint64_t prof_calls;
+    uint64_t prof_ticks;
+#ifdef CONFIG_EPOLL
+    bool no_epoll;          /* fd not supported by epoll, use select */
+    uint32_t epoll_events;  /* events currently registered with epoll */
+    uint32_t revents;       /* events reported by the last epoll_wait */
+#endif
 } IOHandlerRecord;
 
 static QLIST_HEAD(, IOHandlerRecord) io_handlers =
     QLIST_HEAD_INITIALIZER(io_handlers);
 
+bool device_profiling;
+
+#ifdef CONFIG_EPOLL
+/* On Linux the handlers' fds stay registered with an epoll instance
+ * across main loop iterations, and only the epoll fd itself is passed to
+ * select().  A wakeup then no longer costs time proportional to the
+ * number of handlers, and their fds are not limited by FD_SETSIZE.
+ * Registrations are only touched when the set of wanted events changes.
+ */
+#define IOHANDLER_MAX_EVENTS 64
+
+static int iohandler_epoll_fd = -1;
+static bool iohandler_epoll_failed;
+
+static int iohandler_epoll_init(void)
+{
+    if (iohandler_epoll_fd >= 0 || iohandler_epoll_failed) {
+        return iohandler_epoll_fd;
+    }
+#ifdef CONFIG_EPOLL_CREATE1
+    iohandler_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+    iohandler_epoll_fd = epoll_create(IOHANDLER_MAX_EVENTS);
+    if (iohandler_epoll_fd >= 0) {
+        qemu_set_cloexec(iohandler_epoll_fd);
+    }
+#endif
+    if (iohandler_epoll_fd < 0) {
+        iohandler_epoll_failed = true;
+    }
+    return iohandler_epoll_fd;
+}
+
+/* Make epoll watch ioh for events.  Returns false if the fd has to be
+   handled through select() instead.  */
+static bool iohandler_epoll_update(IOHandlerRecord *ioh, uint32_t events)
+{
+    struct epoll_event ev;
+    int op, ret;
+
+    if (ioh->no_epoll || iohandler_epoll_init() < 0) {
+        return false;
+    }
+    if (events == ioh->epoll_events) {
+        return true;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = ioh;
+    if (!events) {
+        op = EPOLL_CTL_DEL;
+    } else if (!ioh->epoll_events) {
+        op = EPOLL_CTL_ADD;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+    ret = epoll_ctl(iohandler_epoll_fd, op, ioh->fd, &ev);
+    if (ret < 0 && op == EPOLL_CTL_MOD && errno == ENOENT) {
+        /* the fd was closed and reopened behind our back */
+        ret = epoll_ctl(iohandler_epoll_fd, EPOLL_CTL_ADD, ioh->fd, &ev);
+    }
+    if (ret < 0 && op == EPOLL_CTL_ADD && errno == EEXIST) {
+        ret = epoll_ctl(iohandler_epoll_fd, EPOLL_CTL_MOD, ioh->fd, &ev);
+    }
+    if (ret < 0 && events) {
+        /* e.g. regular files, which select() considers always ready */
+        ioh->no_epoll = true;
+        ioh->epoll_events = 0;
+        return false;
+    }
+    ioh->epoll_events = events;
+    return true;
+}
+#endif
+
 
 /* XXX: fd_read_poll should be suppressed, but an API change is
    necessary in the character devices to suppress fd_can_read(). */
@@ -60,6 +147,10 @@ int qemu_set_fd_handler2(int fd,
         QLIST_FOREACH(ioh, &io_handlers, next) {
             if (ioh->fd == fd) {
                 ioh->deleted = 1;
+#ifdef CONFIG_EPOLL
+                /* the caller is likely to close fd right away */
+                iohandler_epoll_update(ioh, 0);
+#endif
                 break;
             }
         }
@@ -77,6 +168,8 @@ int qemu_set_fd_handler2(int fd,
         ioh->fd_write = fd_write;
         ioh->opaque = opaque;
         ioh->deleted = 0;
+        ioh->prof_calls = 0;
+        ioh->prof_ticks = 0;
         qemu_notify_event();
     }
     return 0;
@@ -97,6 +190,23 @@ void qemu_iohandler_fill(int *pnfds, fd_set *readfds, fd_set *writefds, fd_set *
     QLIST_FOREACH(ioh, &io_handlers, next) {
         if (ioh->deleted)
             continue;
+#ifdef CONFIG_EPOLL
+        {
+            uint32_t events = 0;
+
+            if (ioh->fd_read &&
+                (!ioh->fd_read_poll ||
+                 ioh->fd_read_poll(ioh->opaque) != 0)) {
+                events |= EPOLLIN;
+            }
+            if (ioh->fd_write) {
+                events |= EPOLLOUT;
+            }
+            if (iohandler_epoll_update(ioh, events)) {
+                continue;
+            }
+        }
+#endif
         if (ioh->fd_read &&
             (!ioh->fd_read_poll ||
              ioh->fd_read_poll(ioh->opaque) != 0)) {
@@ -110,20 +220,61 @@ void qemu_iohandler_fill(int *pnfds, fd_set *readfds, fd_set *writefds, fd_set *
                 *pnfds = ioh->fd;
         }
     }
+#ifdef CONFIG_EPOLL
+    if (iohandler_epoll_fd >= 0) {
+        FD_SET(iohandler_epoll_fd, readfds);
+        if (iohandler_epoll_fd > *pnfds)
+            *pnfds = iohandler_epoll_fd;
+    }
+#endif
 }
 
 void qemu_iohandler_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds, int ret)
 {
     if (ret > 0) {
         IOHandlerRecord *pioh, *ioh;
+        bool can_read, can_write;
+        int64_t start = 0;
+
+#ifdef CONFIG_EPOLL
+        if (iohandler_epoll_fd >= 0 && FD_ISSET(iohandler_epoll_fd, readfds)) {
+            struct epoll_event events[IOHANDLER_MAX_EVENTS];
+            int i, n;
+
+            n = epoll_wait(iohandler_epoll_fd, events, ARRAY_SIZE(events), 0);
+            for (i = 0; i < n; i++) {
+                ioh = events[i].data.ptr;
+                ioh->revents = events[i].events;
+            }
+        }
+#endif
 
         QLIST_FOREACH_SAFE(ioh, &io_handlers, next, pioh) {
-            if (!ioh->deleted && ioh->fd_read && FD_ISSET(ioh->fd, readfds)) {
+#ifdef CONFIG_EPOLL
+            if (!ioh->no_epoll) {
+                can_read = ioh->revents & (EPOLLIN | EPOLLHUP | EPOLLERR);
+                can_write = ioh->revents & (EPOLLOUT | EPOLLERR);
+                ioh->revents = 0;
+            } else
+#endif
+            {
+                can_read = FD_ISSET(ioh->fd, readfds);
+                can_write = FD_ISSET(ioh->fd, writefds);
+            }
+            if (device_profiling && (can_read || can_write)) {
+                start = cpu_get_real_ticks();
+            }
+            if (!ioh->deleted && ioh->fd_read && can_read) {
                 ioh->fd_read(ioh->opaque);
             }
-            if (!ioh->deleted && ioh->fd_write && FD_ISSET(ioh->fd, writefds)) {
+            if (!ioh->deleted && ioh->fd_write && can_write) {
                 ioh->fd_write(ioh->opaque);
             }
+            if (start) {
+                ioh->prof_ticks += cpu_get_real_ticks() - start;
+                ioh->prof_calls++;
+                start = 0;
+            }
 
             /* Do this last in case read/write handlers marked it for deletion */
             if (ioh->deleted) {
@@ -134,6 +285,29 @@ void qemu_iohandler_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds, int re
     }
 }
 
+void qemu_iohandler_profile_foreach(IOHandlerProfileFunc *fn, void *opaque)
+{
+    IOHandlerRecord *ioh;
+
+    QLIST_FOREACH(ioh, &io_handlers, next) {
+        if (!ioh->deleted && ioh->prof_calls) {
+            fn(opaque, ioh->fd,
+               ioh->fd_read ? (void *)ioh->fd_read : (void *)ioh->fd_write,
+               ioh->prof_calls, ioh->prof_ticks);
+        }
+    }
+}
+
+void qemu_iohandler_profile_reset(void)
+{
+    IOHandlerRecord *ioh;
+
+    QLIST_FOREACH(ioh, &io_handlers, next) {
+        ioh->prof_calls = 0;
+        ioh->prof_ticks = 0;
+    }
+}
+
 /* reaping of zombies.  right now we're not passing the status to
    anyone, but it would be possible to add a callback.  */
 #ifndef _WIN32
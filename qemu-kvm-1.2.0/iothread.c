@@ -0,0 +1,115 @@
+/*
+ * Event loop thread
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "event_notifier.h"
+#include "iothread.h"
+#include "qemu-rcu.h"
+
+struct IOThread {
+    AioContext *ctx;
+    QemuThread thread;
+    EventNotifier stop_notifier;    /* wakes the thread up for stopping */
+    bool stopping;                  /* stop requested, read by the thread */
+    bool running;
+};
+
+static void iothread_stop_cb(void *opaque)
+{
+    IOThread *iothread = opaque;
+
+    event_notifier_test_and_clear(&iothread->stop_notifier);
+}
+
+/* Keeps aio_poll() blocking while the thread is idle */
+static int iothread_stop_flush(void *opaque)
+{
+    IOThread *iothread = opaque;
+
+    return !iothread->stopping;
+}
+
+static void *iothread_run(void *opaque)
+{
+    IOThread *iothread = opaque;
+
+    rcu_register_thread();
+    while (!iothread->stopping) {
+        aio_poll(iothread->ctx, true);
+    }
+
+    /* Finish what is in flight */
+    while (aio_poll(iothread->ctx, true)) {
+        /* do nothing */
+    }
+    rcu_unregister_thread();
+    return NULL;
+}
+
+IOThread *iothread_new(void)
+{
+    IOThread *iothread = g_malloc0(sizeof(*iothread));
+
+    iothread->ctx = aio_context_new();
+    if (!iothread->ctx) {
+        g_free(iothread);
+        return NULL;
+    }
+    if (event_notifier_init(&iothread->stop_notifier, 0) != 0) {
+        aio_context_free(iothread->ctx);
+        g_free(iothread);
+        return NULL;
+    }
+    aio_set_fd_handler(iothread->ctx,
+                       event_notifier_get_fd(&iothread->stop_notifier),
+                       iothread_stop_cb, NULL, iothread_stop_flush, iothread);
+    return iothread;
+}
+
+void iothread_free(IOThread *iothread)
+{
+    assert(!iothread->running);
+
+    aio_set_fd_handler(iothread->ctx,
+                       event_notifier_get_fd(&iothread->stop_notifier),
+                       NULL, NULL, NULL, NULL);
+    event_notifier_cleanup(&iothread->stop_notifier);
+    aio_context_free(iothread->ctx);
+    g_free(iothread);
+}
+
+void iothread_start(IOThread *iothread)
+{
+    assert(!iothread->running);
+
+    iothread->stopping = false;
+    iothread->running = true;
+    qemu_thread_create(&iothread->thread, iothread_run, iothread,
+                       QEMU_THREAD_JOINABLE);
+}
+
+void iothread_stop(IOThread *iothread)
+{
+    if (!iothread->running) {
+        return;
+    }
+
+    iothread->stopping = true;
+    event_notifier_set(&iothread->stop_notifier);
+    qemu_thread_join(&iothread->thread);
+    iothread->running = false;
+}
+
+AioContext *iothread_get_aio_context(IOThread *iothread)
+{
+    return iothread->ctx;
+}
+
+QemuThread *iothread_get_thread(IOThread *iothread)
+{
+    return &iothread->thread;
+}
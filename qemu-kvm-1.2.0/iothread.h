@@ -0,0 +1,30 @@
+/*
+ * Event loop thread
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef IOTHREAD_H
+#define IOTHREAD_H
+
+#include "qemu-aio.h"
+#include "qemu-thread.h"
+
+/*
+ * A thread that runs an AioContext of its own.  Handlers are registered with
+ * the context before iothread_start(); while the thread runs, they are only
+ * changed from the callbacks of the context.  iothread_stop() lets the
+ * context drain, i.e. it returns once no io_flush handler reports pending
+ * requests anymore.
+ */
+typedef struct IOThread IOThread;
+
+IOThread *iothread_new(void);
+void iothread_free(IOThread *iothread);
+void iothread_start(IOThread *iothread);
+void iothread_stop(IOThread *iothread);
+AioContext *iothread_get_aio_context(IOThread *iothread);
+QemuThread *iothread_get_thread(IOThread *iothread);
+
+#endif
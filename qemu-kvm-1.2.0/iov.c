@@ -83,6 +83,170 @@ size_t iov_memset(const struct iovec *iov, const unsigned int iov_cnt,
     return done;
 }
 
+static void iov_cursor_skip_empty(IOVCursor *cur)
+{
+    while (cur->iov_cnt && cur->offset >= cur->iov[0].iov_len) {
+        cur->offset -= cur->iov[0].iov_len;
+        cur->iov++;
+        cur->iov_cnt--;
+    }
+}
+
+void iov_cursor_init(IOVCursor *cur, const struct iovec *iov,
+                     unsigned int iov_cnt, size_t offset)
+{
+    cur->iov = iov;
+    cur->iov_cnt = iov_cnt;
+    cur->offset = offset;
+    iov_cursor_skip_empty(cur);
+    if (!cur->iov_cnt) {
+        cur->offset = 0;
+    }
+}
+
+size_t iov_cursor_advance(IOVCursor *cur, size_t bytes)
+{
+    size_t done = 0;
+
+    while (done < bytes && cur->iov_cnt) {
+        size_t len = MIN(cur->iov[0].iov_len - cur->offset, bytes - done);
+
+        cur->offset += len;
+        done += len;
+        iov_cursor_skip_empty(cur);
+    }
+    return done;
+}
+
+size_t iov_copy(const struct iovec *dst, unsigned int dst_cnt,
+                size_t dst_offset,
+                const struct iovec *src, unsigned int src_cnt,
+                size_t src_offset, size_t bytes)
+{
+    IOVCursor d, s;
+    size_t done = 0;
+
+    iov_cursor_init(&d, dst, dst_cnt, dst_offset);
+    iov_cursor_init(&s, src, src_cnt, src_offset);
+    while (done < bytes && !iov_cursor_done(&d) && !iov_cursor_done(&s)) {
+        size_t dlen, slen, len;
+        void *dp = iov_cursor_chunk(&d, &dlen);
+        void *sp = iov_cursor_chunk(&s, &slen);
+
+        len = MIN(MIN(dlen, slen), bytes - done);
+        memcpy(dp, sp, len);
+        iov_cursor_advance(&d, len);
+        iov_cursor_advance(&s, len);
+        done += len;
+    }
+    return done;
+}
+
+bool iov_is_zero(const struct iovec *iov, unsigned int iov_cnt,
+                 size_t offset, size_t bytes)
+{
+    IOVCursor cur;
+    size_t done = 0;
+
+    iov_cursor_init(&cur, iov, iov_cnt, offset);
+    while (done < bytes && !iov_cursor_done(&cur)) {
+        size_t len;
+        const uint8_t *p = iov_cursor_chunk(&cur, &len);
+
+        len = MIN(len, bytes - done);
+        if (!buffer_is_zero(p, len)) {
+            return false;
+        }
+        iov_cursor_advance(&cur, len);
+        done += len;
+    }
+    return true;
+}
+
+/*
+ * Add the ones' complement sum of `len' bytes at `p' to `sum'.  The bytes
+ * are summed as native words, which the compiler can vectorize, and the
+ * result is folded and byte swapped into big endian order at the end
+ * (RFC 1071).  `odd' says that p[0] is at an odd position of the summed
+ * data, in which case all bytes swap their place in the 16-bit words.
+ */
+static uint32_t csum_add(uint32_t sum, const uint8_t *p, size_t len, bool odd)
+{
+    uint64_t s = 0;
+    uint32_t w;
+    uint16_t h;
+
+    for (; len >= 4; p += 4, len -= 4) {
+        memcpy(&w, p, 4);
+        s += w;
+    }
+    if (len >= 2) {
+        memcpy(&h, p, 2);
+        s += h;
+        p += 2;
+        len -= 2;
+    }
+    if (len) {
+#ifdef HOST_WORDS_BIGENDIAN
+        s += (uint32_t)*p << 8;
+#else
+        s += *p;
+#endif
+    }
+    /* end-around carries keep a nonzero sum nonzero */
+    while (s >> 16) {
+        s = (s & 0xffff) + (s >> 16);
+    }
+#ifndef HOST_WORDS_BIGENDIAN
+    s = bswap16(s);
+#endif
+    if (odd) {
+        s = bswap16(s);
+    }
+    return sum + s;
+}
+
+size_t iov_to_buf_csum(const struct iovec *iov, unsigned int iov_cnt,
+                       size_t offset, void *buf, size_t bytes,
+                       uint32_t *csum)
+{
+    IOVCursor cur;
+    size_t done = 0;
+
+    iov_cursor_init(&cur, iov, iov_cnt, offset);
+    while (done < bytes && !iov_cursor_done(&cur)) {
+        size_t len;
+        void *p = iov_cursor_chunk(&cur, &len);
+
+        len = MIN(len, bytes - done);
+        memcpy(buf + done, p, len);
+        *csum = csum_add(*csum, buf + done, len, done & 1);
+        iov_cursor_advance(&cur, len);
+        done += len;
+    }
+    return done;
+}
+
+uint32_t iov_csum(const struct iovec *iov, unsigned int iov_cnt,
+                  size_t offset, size_t bytes)
+{
+    IOVCursor cur;
+    uint32_t sum = 0;
+    size_t done = 0;
+
+    iov_cursor_init(&cur, iov, iov_cnt, offset);
+    while (done < bytes && !iov_cursor_done(&cur)) {
+        size_t len;
+        const uint8_t *p = iov_cursor_chunk(&cur, &len);
+
+        len = MIN(len, bytes - done);
+        sum = csum_add(sum, p, len, done & 1);
+        iov_cursor_advance(&cur, len);
+        done += len;
+    }
+    return sum;
+}
+
 size_t iov_size(const struct iovec *iov, const unsigned int iov_cnt)
 {
     size_t len;
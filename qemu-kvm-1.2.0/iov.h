@@ -54,6 +54,82 @@ size_t iov_to_buf(const struct iovec *iov, const unsigned int iov_cnt,
 size_t iov_memset(const struct iovec *iov, const unsigned int iov_cnt,
                   size_t offset, int fillc, size_t bytes);
 
+/**
+ * A position within an iovec, for code that walks it piecewise instead
+ * of recomputing the element from a byte offset each time.  Once
+ * initialized, the cursor never points at the end of an element: either
+ * `offset' is within iov[0], or `iov_cnt' is zero and the walk is over.
+ */
+typedef struct IOVCursor {
+    const struct iovec *iov;
+    unsigned int iov_cnt;
+    size_t offset;
+} IOVCursor;
+
+/**
+ * Point cursor `cur' at byte `offset' of the iovec `iov' with `iov_cnt'
+ * elements.  An offset past the end of the iovec leaves the cursor done.
+ */
+void iov_cursor_init(IOVCursor *cur, const struct iovec *iov,
+                     unsigned int iov_cnt, size_t offset);
+
+/**
+ * Move cursor `cur' forward by `bytes' bytes, or up to the end of the
+ * iovec if it comes first.  Returns the number of bytes skipped.
+ */
+size_t iov_cursor_advance(IOVCursor *cur, size_t bytes);
+
+static inline bool iov_cursor_done(const IOVCursor *cur)
+{
+    return cur->iov_cnt == 0;
+}
+
+/**
+ * Return the contiguous piece of data at the cursor, and its length in
+ * `*len'.  The cursor must not be done.
+ */
+static inline void *iov_cursor_chunk(const IOVCursor *cur, size_t *len)
+{
+    *len = cur->iov[0].iov_len - cur->offset;
+    return cur->iov[0].iov_base + cur->offset;
+}
+
+/**
+ * Copy `bytes' bytes between two iovecs, from byte position `src_offset'
+ * of `src' to byte position `dst_offset' of `dst', without going through
+ * a linear buffer.  Returns the number of bytes copied, which is less
+ * than `bytes' if either iovec ends first.  The iovecs must not overlap.
+ */
+size_t iov_copy(const struct iovec *dst, unsigned int dst_cnt,
+                size_t dst_offset,
+                const struct iovec *src, unsigned int src_cnt,
+                size_t src_offset, size_t bytes);
+
+/**
+ * Return whether the `bytes' bytes starting at byte position `offset' of
+ * the iovec are all zero.  Bytes past the end of the iovec are ignored.
+ */
+bool iov_is_zero(const struct iovec *iov, unsigned int iov_cnt,
+                 size_t offset, size_t bytes);
+
+/**
+ * Like iov_to_buf(), but also add the Internet checksum of the copied
+ * data to `*csum', in the same partial sum format as net_checksum_add()
+ * on `buf'.  The partial sums may differ, but net_checksum_finish()
+ * gives the same result for both.  Data is summed while it is still in
+ * the cache, so this is cheaper than a copy followed by a checksum.
+ */
+size_t iov_to_buf_csum(const struct iovec *iov, unsigned int iov_cnt,
+                       size_t offset, void *buf, size_t bytes,
+                       uint32_t *csum);
+
+/**
+ * Return the Internet checksum partial sum of `bytes' bytes at byte
+ * position `offset' of the iovec, in the format of net_checksum_add().
+ */
+uint32_t iov_csum(const struct iovec *iov, unsigned int iov_cnt,
+                  size_t offset, size_t bytes);
+
 /*
  * Send/recv data from/to iovec buffers directly
  *
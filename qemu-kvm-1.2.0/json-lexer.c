@@ -11,10 +11,6 @@
  *
  */
 
-#include "qstring.h"
-#include "qlist.h"
-#include "qdict.h"
-#include "qint.h"
 #include "qemu-common.h"
 #include "json-lexer.h"
 
@@ -272,7 +268,7 @@ void json_lexer_init(JSONLexer *lexer, JSONLexerEmitter func)
 {
     lexer->emit = func;
     lexer->state = IN_START;
-    lexer->token = qstring_new();
+    lexer->token = g_string_sized_new(64);
     lexer->x = lexer->y = 0;
 }
 
@@ -290,7 +286,7 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
         new_state = json_lexer[lexer->state][(uint8_t)ch];
         char_consumed = !TERMINAL_NEEDED_LOOKAHEAD(lexer->state, new_state);
         if (char_consumed) {
-            qstring_append_chr(lexer->token, ch);
+            g_string_append_c(lexer->token, ch);
         }
 
         switch (new_state) {
@@ -303,8 +299,7 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
             lexer->emit(lexer, lexer->token, new_state, lexer->x, lexer->y);
             /* fall through */
         case JSON_SKIP:
-            QDECREF(lexer->token);
-            lexer->token = qstring_new();
+            g_string_truncate(lexer->token, 0);
             new_state = IN_START;
             break;
         case IN_ERROR:
@@ -322,8 +317,7 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
              * induce an error/flush state.
              */
             lexer->emit(lexer, lexer->token, JSON_ERROR, lexer->x, lexer->y);
-            QDECREF(lexer->token);
-            lexer->token = qstring_new();
+            g_string_truncate(lexer->token, 0);
             new_state = IN_START;
             lexer->state = new_state;
             return 0;
@@ -336,27 +330,60 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
     /* Do not let a single token grow to an arbitrarily large size,
      * this is a security consideration.
      */
-    if (lexer->token->length > MAX_TOKEN_SIZE) {
+    if (lexer->token->len > MAX_TOKEN_SIZE) {
         lexer->emit(lexer, lexer->token, lexer->state, lexer->x, lexer->y);
-        QDECREF(lexer->token);
-        lexer->token = qstring_new();
+        g_string_truncate(lexer->token, 0);
         lexer->state = IN_START;
     }
 
     return 0;
 }
 
-int json_lexer_feed(JSONLexer *lexer, const char *buffer, size_t size)
+/*
+ * Number of characters at the start of buffer that leave the lexer in
+ * the same string state.  The bodies of strings are most of the input,
+ * so they are copied in one go.
+ */
+static size_t json_lexer_string_run(JSONLexer *lexer, const char *buffer,
+                                    size_t size)
 {
+    const uint8_t *table = json_lexer[lexer->state];
     size_t i;
 
+    if (lexer->state != IN_DQ_STRING && lexer->state != IN_SQ_STRING) {
+        return 0;
+    }
+    /* json_lexer_feed_char enforces MAX_TOKEN_SIZE */
+    size = MIN(size, MAX_TOKEN_SIZE - MIN(lexer->token->len, MAX_TOKEN_SIZE));
     for (i = 0; i < size; i++) {
+        if (table[(uint8_t)buffer[i]] != lexer->state || buffer[i] == '\n') {
+            break;
+        }
+    }
+    return i;
+}
+
+int json_lexer_feed(JSONLexer *lexer, const char *buffer, size_t size)
+{
+    size_t i = 0;
+
+    while (i < size) {
+        size_t run;
         int err;
 
+        run = json_lexer_string_run(lexer, buffer + i, size - i);
+        if (run) {
+            g_string_append_len(lexer->token, buffer + i, run);
+            lexer->x += run;
+            i += run;
+            continue;
+        }
+
         err = json_lexer_feed_char(lexer, buffer[i], false);
         if (err < 0) {
             return err;
         }
+        i++;
     }
 
     return 0;
@@ -369,5 +396,5 @@ int json_lexer_flush(JSONLexer *lexer)
 
 void json_lexer_destroy(JSONLexer *lexer)
 {
-    QDECREF(lexer->token);
+    g_string_free(lexer->token, true);
 }
@@ -22,13 +22,14 @@
 #include "qbool.h"
 #include "json-parser.h"
 #include "json-lexer.h"
+#include "json-streamer.h"
 #include "qerror.h"
 
 typedef struct JSONParserContext
 {
     Error *err;
     struct {
-        QObject **buf;
+        JSONToken **buf;
         size_t pos;
         size_t count;
     } tokens;
@@ -50,21 +51,21 @@ static QObject *parse_value(JSONParserContext *ctxt, va_list *ap);
 /**
  * Token manipulators
  *
- * tokens are dictionaries that contain a type, a string value, and geometry information
+ * tokens are JSONTokens that contain a type, a string value, and geometry information
  * about a token identified by the lexer.  These are routines that make working with
  * these objects a bit easier.
  */
-static const char *token_get_value(QObject *obj)
+static const char *token_get_value(JSONToken *token)
 {
-    return qdict_get_str(qobject_to_qdict(obj), "token");
+    return token->str;
 }
 
-static JSONTokenType token_get_type(QObject *obj)
+static JSONTokenType token_get_type(JSONToken *token)
 {
-    return qdict_get_int(qobject_to_qdict(obj), "type");
+    return token->type;
 }
 
-static int token_is_operator(QObject *obj, char op)
+static int token_is_operator(JSONToken *obj, char op)
 {
     const char *val;
 
@@ -77,7 +78,7 @@ static int token_is_operator(QObject *obj, char op)
     return (val[0] == op) && (val[1] == 0);
 }
 
-static int token_is_keyword(QObject *obj, const char *value)
+static int token_is_keyword(JSONToken *obj, const char *value)
 {
     if (token_get_type(obj) != JSON_KEYWORD) {
         return 0;
@@ -86,7 +87,7 @@ static int token_is_keyword(QObject *obj, const char *value)
     return strcmp(token_get_value(obj), value) == 0;
 }
 
-static int token_is_escape(QObject *obj, const char *value)
+static int token_is_escape(JSONToken *obj, const char *value)
 {
     if (token_get_type(obj) != JSON_ESCAPE) {
         return 0;
@@ -99,7 +100,7 @@ static int token_is_escape(QObject *obj, const char *value)
  * Error handler
  */
 static void GCC_FMT_ATTR(3, 4) parse_error(JSONParserContext *ctxt,
-                                           QObject *token, const char *msg, ...)
+                                           JSONToken *token, const char *msg, ...)
 {
     va_list ap;
     char message[1024];
@@ -177,7 +178,7 @@ static int hex2decimal(char ch)
  *      \t
  *      \u four-hex-digits 
  */
-static QString *qstring_from_escaped_str(JSONParserContext *ctxt, QObject *token)
+static QString *qstring_from_escaped_str(JSONParserContext *ctxt, JSONToken *token)
 {
     const char *ptr = token_get_value(token);
     QString *str;
@@ -259,12 +260,7 @@ static QString *qstring_from_escaped_str(JSONParserContext *ctxt, QObject *token
                 goto out;
             }
         } else {
-            char dummy[2];
-
-            dummy[0] = *ptr++;
-            dummy[1] = 0;
-
-            qstring_append(str, dummy);
+            qstring_append_chr(str, *ptr++);
         }
     }
 
@@ -275,23 +271,21 @@ out:
     return NULL;
 }
 
-static QObject *parser_context_pop_token(JSONParserContext *ctxt)
+static JSONToken *parser_context_pop_token(JSONParserContext *ctxt)
 {
-    QObject *token;
+    JSONToken *token;
     g_assert(ctxt->tokens.pos < ctxt->tokens.count);
     token = ctxt->tokens.buf[ctxt->tokens.pos];
     ctxt->tokens.pos++;
     return token;
 }
 
-/* Note: parser_context_{peek|pop}_token do not increment the
- * token object's refcount. In both cases the references will continue
- * to be tracked and cleaned up in parser_context_free(), so do not
- * attempt to free the token object.
+/* Note: the tokens belong to the JSONMessageParser, which frees them
+ * once the message has been parsed.
  */
-static QObject *parser_context_peek_token(JSONParserContext *ctxt)
+static JSONToken *parser_context_peek_token(JSONParserContext *ctxt)
 {
-    QObject *token;
+    JSONToken *token;
     g_assert(ctxt->tokens.pos < ctxt->tokens.count);
     token = ctxt->tokens.buf[ctxt->tokens.pos];
     return token;
@@ -314,24 +308,17 @@ static void parser_context_restore(JSONParserContext *ctxt,
     ctxt->tokens.buf = saved_ctxt.tokens.buf;
 }
 
-static void tokens_append_from_iter(QObject *obj, void *opaque)
-{
-    JSONParserContext *ctxt = opaque;
-    g_assert(ctxt->tokens.pos < ctxt->tokens.count);
-    ctxt->tokens.buf[ctxt->tokens.pos++] = obj;
-    qobject_incref(obj);
-}
-
-static JSONParserContext *parser_context_new(QList *tokens)
+static JSONParserContext *parser_context_new(GQueue *tokens)
 {
     JSONParserContext *ctxt;
     size_t count;
+    GList *l;
 
     if (!tokens) {
         return NULL;
     }
 
-    count = qlist_size(tokens);
+    count = g_queue_get_length(tokens);
     if (count == 0) {
         return NULL;
     }
@@ -339,8 +326,10 @@ static JSONParserContext *parser_context_new(QList *tokens)
     ctxt = g_malloc0(sizeof(JSONParserContext));
     ctxt->tokens.pos = 0;
     ctxt->tokens.count = count;
-    ctxt->tokens.buf = g_malloc(count * sizeof(QObject *));
-    qlist_iter(tokens, tokens_append_from_iter, ctxt);
+    ctxt->tokens.buf = g_malloc(count * sizeof(JSONToken *));
+    for (l = tokens->head; l; l = l->next) {
+        ctxt->tokens.buf[ctxt->tokens.pos++] = l->data;
+    }
     ctxt->tokens.pos = 0;
 
     return ctxt;
@@ -349,11 +338,7 @@ static JSONParserContext *parser_context_new(QList *tokens)
 /* to support error propagation, ctxt->err must be freed separately */
 static void parser_context_free(JSONParserContext *ctxt)
 {
-    int i;
     if (ctxt) {
-        for (i = 0; i < ctxt->tokens.count; i++) {
-            qobject_decref(ctxt->tokens.buf[i]);
-        }
         g_free(ctxt->tokens.buf);
         g_free(ctxt);
     }
@@ -364,7 +349,8 @@ static void parser_context_free(JSONParserContext *ctxt)
  */
 static int parse_pair(JSONParserContext *ctxt, QDict *dict, va_list *ap)
 {
-    QObject *key = NULL, *token = NULL, *value, *peek;
+    QObject *key = NULL, *value;
+    JSONToken *token = NULL, *peek;
     JSONParserContext saved_ctxt = parser_context_save(ctxt);
 
     peek = parser_context_peek_token(ctxt);
@@ -412,7 +398,7 @@ out:
 static QObject *parse_object(JSONParserContext *ctxt, va_list *ap)
 {
     QDict *dict = NULL;
-    QObject *token, *peek;
+    JSONToken *token, *peek;
     JSONParserContext saved_ctxt = parser_context_save(ctxt);
 
     token = parser_context_pop_token(ctxt);
@@ -478,7 +464,7 @@ out:
 static QObject *parse_array(JSONParserContext *ctxt, va_list *ap)
 {
     QList *list = NULL;
-    QObject *token, *peek;
+    JSONToken *token, *peek;
     JSONParserContext saved_ctxt = parser_context_save(ctxt);
 
     token = parser_context_pop_token(ctxt);
@@ -556,7 +542,8 @@ out:
 
 static QObject *parse_keyword(JSONParserContext *ctxt)
 {
-    QObject *token, *ret;
+    JSONToken *token;
+    QObject *ret;
     JSONParserContext saved_ctxt = parser_context_save(ctxt);
 
     token = parser_context_pop_token(ctxt);
@@ -587,7 +574,8 @@ out:
 
 static QObject *parse_escape(JSONParserContext *ctxt, va_list *ap)
 {
-    QObject *token = NULL, *obj;
+    JSONToken *token = NULL;
+    QObject *obj;
     JSONParserContext saved_ctxt = parser_context_save(ctxt);
 
     if (ap == NULL) {
@@ -628,7 +616,8 @@ out:
 
 static QObject *parse_literal(JSONParserContext *ctxt)
 {
-    QObject *token, *obj;
+    JSONToken *token;
+    QObject *obj;
     JSONParserContext saved_ctxt = parser_context_save(ctxt);
 
     token = parser_context_pop_token(ctxt);
@@ -661,31 +650,37 @@ out:
 
 static QObject *parse_value(JSONParserContext *ctxt, va_list *ap)
 {
-    QObject *obj;
+    JSONToken *token;
 
-    obj = parse_object(ctxt, ap);
-    if (obj == NULL) {
-        obj = parse_array(ctxt, ap);
-    }
-    if (obj == NULL) {
-        obj = parse_escape(ctxt, ap);
-    }
-    if (obj == NULL) {
-        obj = parse_keyword(ctxt);
-    } 
-    if (obj == NULL) {
-        obj = parse_literal(ctxt);
+    /* the type of the next token tells which rule can match */
+    token = parser_context_peek_token(ctxt);
+    switch (token_get_type(token)) {
+    case JSON_OPERATOR:
+        if (token_is_operator(token, '{')) {
+            return parse_object(ctxt, ap);
+        } else if (token_is_operator(token, '[')) {
+            return parse_array(ctxt, ap);
+        }
+        return NULL;
+    case JSON_ESCAPE:
+        return parse_escape(ctxt, ap);
+    case JSON_KEYWORD:
+        return parse_keyword(ctxt);
+    case JSON_STRING:
+    case JSON_INTEGER:
+    case JSON_FLOAT:
+        return parse_literal(ctxt);
+    default:
+        return NULL;
     }
-
-    return obj;
 }
 
-QObject *json_parser_parse(QList *tokens, va_list *ap)
+QObject *json_parser_parse(GQueue *tokens, va_list *ap)
 {
     return json_parser_parse_err(tokens, ap, NULL);
 }
 
-QObject *json_parser_parse_err(QList *tokens, va_list *ap, Error **errp)
+QObject *json_parser_parse_err(GQueue *tokens, va_list *ap, Error **errp)
 {
     JSONParserContext *ctxt = parser_context_new(tokens);
     QObject *result;
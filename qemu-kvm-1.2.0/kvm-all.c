@@ -33,6 +33,9 @@
 #include "memory.h"
 #include "exec-memory.h"
 #include "event_notifier.h"
+#include "qemu-thread.h"
+#include "qemu-timer.h"
+#include "trace.h"
 
 /* This check must be after config-host.h is included */
 #ifdef CONFIG_EVENTFD
@@ -54,6 +57,9 @@
 
 #define KVM_MSI_HASHTAB_SIZE    256
 
+/* Slots available when the kernel doesn't report KVM_CAP_NR_MEMSLOTS */
+#define KVM_DEFAULT_NR_SLOTS    32
+
 typedef struct KVMSlot
 {
     target_phys_addr_t start_addr;
@@ -61,16 +67,32 @@ typedef struct KVMSlot
     void *ram;
     int slot;
     int flags;
+    /* what the kernel was last told about the slot */
+    struct kvm_userspace_memory_region kernel;
+    /* changed by the current memory transaction */
+    bool pending;
 } KVMSlot;
 
 typedef struct kvm_dirty_log KVMDirtyLog;
 
 struct KVMState
 {
-    KVMSlot slots[32];
+    KVMSlot *slots;
+    int nr_slots;
+    /* slots in use, sorted by guest physical address */
+    KVMSlot **used_slots;
+    int nr_used_slots;
+    /* slots not in use, handed out from the end */
+    KVMSlot **free_slots;
+    int nr_free_slots;
+    /* slots changed since kvm_begin(), applied by kvm_commit() */
+    bool in_transaction;
+    KVMSlot **pending_slots;
+    int nr_pending_slots;
     int fd;
     int vmfd;
     int coalesced_mmio;
+    bool coalesced_pio;
     struct kvm_coalesced_mmio_ring *coalesced_mmio_ring;
     bool coalesced_flush_in_progress;
     int broken_set_mem_region;
@@ -95,8 +117,14 @@ struct KVMState
     uint32_t *used_gsi_bitmap;
     unsigned int gsi_count;
     QTAILQ_HEAD(msi_hashtab, KVMMSIRoute) msi_hashtab[KVM_MSI_HASHTAB_SIZE];
+    QTAILQ_HEAD(, KVMMSIRoute) msi_lru;
+    unsigned int nr_msi_routes;
     bool direct_msi;
 #endif
+    uint64_t route_commits;
+    uint64_t route_commits_last;
+    uint64_t route_commits_rate;
+    int64_t route_commits_stamp;
 };
 
 KVMState *kvm_state;
@@ -114,26 +142,61 @@ static const KVMCapabilityInfo kvm_required_capabilites[] = {
 
 static KVMSlot *kvm_alloc_slot(KVMState *s)
 {
-    int i;
-
-    for (i = 0; i < ARRAY_SIZE(s->slots); i++) {
-        if (s->slots[i].memory_size == 0) {
-            return &s->slots[i];
-        }
+    if (s->nr_free_slots) {
+        return s->free_slots[--s->nr_free_slots];
     }
 
     fprintf(stderr, "%s: no free slot available\n", __func__);
     abort();
 }
 
+/*
+ * Number of used slots that start at or below @addr.  Used slots never
+ * overlap, so the one before that is the only candidate containing @addr.
+ */
+static int kvm_slot_upper_bound(KVMState *s, target_phys_addr_t addr)
+{
+    int lo = 0, hi = s->nr_used_slots;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (s->used_slots[mid]->start_addr <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Keep the used and free lists in step after a slot was (un)registered */
+static void kvm_slot_update_index(KVMState *s, KVMSlot *slot)
+{
+    int i = kvm_slot_upper_bound(s, slot->start_addr);
+    bool indexed = i > 0 && s->used_slots[i - 1] == slot;
+
+    if (slot->memory_size && !indexed) {
+        memmove(&s->used_slots[i + 1], &s->used_slots[i],
+                (s->nr_used_slots - i) * sizeof(s->used_slots[0]));
+        s->used_slots[i] = slot;
+        s->nr_used_slots++;
+    } else if (!slot->memory_size && indexed) {
+        memmove(&s->used_slots[i - 1], &s->used_slots[i],
+                (s->nr_used_slots - i) * sizeof(s->used_slots[0]));
+        s->nr_used_slots--;
+        s->free_slots[s->nr_free_slots++] = slot;
+    }
+}
+
 static KVMSlot *kvm_lookup_matching_slot(KVMState *s,
                                          target_phys_addr_t start_addr,
                                          target_phys_addr_t end_addr)
 {
-    int i;
+    int i = kvm_slot_upper_bound(s, start_addr);
 
-    for (i = 0; i < ARRAY_SIZE(s->slots); i++) {
-        KVMSlot *mem = &s->slots[i];
+    if (i > 0) {
+        KVMSlot *mem = s->used_slots[i - 1];
 
         if (start_addr == mem->start_addr &&
             end_addr == mem->start_addr + mem->memory_size) {
@@ -151,24 +214,23 @@ static KVMSlot *kvm_lookup_overlapping_slot(KVMState *s,
                                             target_phys_addr_t start_addr,
                                             target_phys_addr_t end_addr)
 {
-    KVMSlot *found = NULL;
-    int i;
-
-    for (i = 0; i < ARRAY_SIZE(s->slots); i++) {
-        KVMSlot *mem = &s->slots[i];
+    int i = kvm_slot_upper_bound(s, start_addr);
+    KVMSlot *mem;
 
-        if (mem->memory_size == 0 ||
-            (found && found->start_addr < mem->start_addr)) {
-            continue;
+    if (i > 0) {
+        mem = s->used_slots[i - 1];
+        if (start_addr < mem->start_addr + mem->memory_size) {
+            return mem;
         }
-
-        if (end_addr > mem->start_addr &&
-            start_addr < mem->start_addr + mem->memory_size) {
-            found = mem;
+    }
+    if (i < s->nr_used_slots) {
+        mem = s->used_slots[i];
+        if (end_addr > mem->start_addr) {
+            return mem;
         }
     }
 
-    return found;
+    return NULL;
 }
 
 int kvm_physical_memory_addr_from_host(KVMState *s, void *ram,
@@ -176,8 +238,8 @@ int kvm_physical_memory_addr_from_host(KVMState *s, void *ram,
 {
     int i;
 
-    for (i = 0; i < ARRAY_SIZE(s->slots); i++) {
-        KVMSlot *mem = &s->slots[i];
+    for (i = 0; i < s->nr_used_slots; i++) {
+        KVMSlot *mem = s->used_slots[i];
 
         if (ram >= mem->ram && ram < mem->ram + mem->memory_size) {
             *phys_addr = mem->start_addr + (ram - mem->ram);
@@ -188,19 +250,63 @@ int kvm_physical_memory_addr_from_host(KVMState *s, void *ram,
     return 0;
 }
 
+static void kvm_slot_region(KVMState *s, KVMSlot *slot,
+                            struct kvm_userspace_memory_region *mem)
+{
+    mem->slot = slot->slot;
+    mem->guest_phys_addr = slot->start_addr;
+    mem->memory_size = slot->memory_size;
+    mem->userspace_addr = (unsigned long)slot->ram;
+    mem->flags = slot->flags;
+    if (s->migration_log) {
+        mem->flags |= KVM_MEM_LOG_DIRTY_PAGES;
+    }
+}
+
+static int kvm_slot_ioctl(KVMState *s, KVMSlot *slot,
+                          struct kvm_userspace_memory_region *mem)
+{
+    int ret;
+
+    ret = kvm_vm_ioctl(s, KVM_SET_USER_MEMORY_REGION, mem);
+    if (ret == 0) {
+        slot->kernel = *mem;
+    }
+    return ret;
+}
+
+/* True if the kernel's view of the slot covers the same memory as ours */
+static bool kvm_slot_in_sync(KVMSlot *slot)
+{
+    return !slot->pending ||
+        (slot->kernel.guest_phys_addr == slot->start_addr &&
+         slot->kernel.memory_size == slot->memory_size);
+}
+
+/*
+ * Within a memory transaction only the slot table is updated, the kernel
+ * hears about the net result in kvm_commit().
+ */
 static int kvm_set_user_memory_region(KVMState *s, KVMSlot *slot)
 {
     struct kvm_userspace_memory_region mem;
+    int ret;
 
-    mem.slot = slot->slot;
-    mem.guest_phys_addr = slot->start_addr;
-    mem.memory_size = slot->memory_size;
-    mem.userspace_addr = (unsigned long)slot->ram;
-    mem.flags = slot->flags;
-    if (s->migration_log) {
-        mem.flags |= KVM_MEM_LOG_DIRTY_PAGES;
+    if (s->in_transaction) {
+        kvm_slot_update_index(s, slot);
+        if (!slot->pending) {
+            slot->pending = true;
+            s->pending_slots[s->nr_pending_slots++] = slot;
+        }
+        return 0;
+    }
+
+    kvm_slot_region(s, slot, &mem);
+    ret = kvm_slot_ioctl(s, slot, &mem);
+    if (ret == 0) {
+        kvm_slot_update_index(s, slot);
     }
-    return kvm_vm_ioctl(s, KVM_SET_USER_MEMORY_REGION, &mem);
+    return ret;
 }
 
 static void kvm_reset_vcpu(void *opaque)
@@ -227,6 +333,7 @@ int kvm_init_vcpu(CPUArchState *env)
     env->kvm_fd = ret;
     env->kvm_state = s;
     env->kvm_vcpu_dirty = 1;
+    env->kvm_regs_valid = KVM_REGS_ALL;
 
     mmap_size = kvm_ioctl(s, KVM_GET_VCPU_MMAP_SIZE, 0);
     if (mmap_size < 0) {
@@ -336,12 +443,9 @@ static int kvm_set_migration_log(int enable)
 
     s->migration_log = enable;
 
-    for (i = 0; i < ARRAY_SIZE(s->slots); i++) {
-        mem = &s->slots[i];
+    for (i = 0; i < s->nr_used_slots; i++) {
+        mem = s->used_slots[i];
 
-        if (!mem->memory_size) {
-            continue;
-        }
         if (!!(mem->flags & KVM_MEM_LOG_DIRTY_PAGES) == enable) {
             continue;
         }
@@ -353,34 +457,137 @@ static int kvm_set_migration_log(int enable)
     return 0;
 }
 
+/*
+ * Dirty logs are harvested in chunks of this many bits.  Slots bigger than
+ * one chunk are spread over up to KVM_DIRTY_LOG_THREADS threads, the
+ * calling thread included, since a large guest's log takes long enough to
+ * walk that it adds noticeably to migration downtime.
+ */
+#define KVM_DIRTY_LOG_CHUNK     (256 * 1024)
+#define KVM_DIRTY_LOG_THREADS   8
+
+typedef struct KVMDirtyHarvest {
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    int nthreads;
+
+    /* the slot being harvested, protected by lock */
+    MemoryRegionSection *section;
+    unsigned long *bitmap;
+    unsigned long nbits;
+    unsigned long next_chunk;
+    unsigned long nchunks;
+    unsigned long pending;
+} KVMDirtyHarvest;
+
+static KVMDirtyHarvest dirty_harvest;
+
+static void kvm_harvest_chunk(KVMDirtyHarvest *h, unsigned long chunk)
+{
+    unsigned long hpratio = getpagesize() / TARGET_PAGE_SIZE;
+    unsigned long first = chunk * KVM_DIRTY_LOG_CHUNK;
+    unsigned long nbits = MIN(h->nbits - first, KVM_DIRTY_LOG_CHUNK);
+
+    memory_region_set_dirty_lebitmap(h->section->mr,
+                                     h->section->offset_within_region +
+                                     (target_phys_addr_t)first * hpratio *
+                                     TARGET_PAGE_SIZE,
+                                     h->bitmap + first / HOST_LONG_BITS,
+                                     nbits, hpratio);
+}
+
+/* Take chunks until none is left; called and returns with h->lock held */
+static void kvm_harvest_chunks(KVMDirtyHarvest *h)
+{
+    while (h->next_chunk < h->nchunks) {
+        unsigned long chunk = h->next_chunk++;
+
+        qemu_mutex_unlock(&h->lock);
+        kvm_harvest_chunk(h, chunk);
+        qemu_mutex_lock(&h->lock);
+
+        if (--h->pending == 0) {
+            qemu_cond_signal(&h->done_cond);
+        }
+    }
+}
+
+static void *kvm_harvest_thread(void *opaque)
+{
+    KVMDirtyHarvest *h = opaque;
+
+    qemu_mutex_lock(&h->lock);
+    for (;;) {
+        while (h->next_chunk >= h->nchunks) {
+            qemu_cond_wait(&h->work_cond, &h->lock);
+        }
+        kvm_harvest_chunks(h);
+    }
+    return NULL;
+}
+
+static void kvm_harvest_init(KVMDirtyHarvest *h)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    qemu_mutex_init(&h->lock);
+    qemu_cond_init(&h->work_cond);
+    qemu_cond_init(&h->done_cond);
+
+    h->nthreads = MIN(MAX(ncpus, 1), KVM_DIRTY_LOG_THREADS) - 1;
+    for (i = 0; i < h->nthreads; i++) {
+        QemuThread thread;
+
+        qemu_thread_create(&thread, kvm_harvest_thread, h,
+                           QEMU_THREAD_DETACHED);
+    }
+}
+
 /* get kvm's dirty pages bitmap and update qemu's */
 static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
                                          unsigned long *bitmap)
 {
-    unsigned int i, j;
-    unsigned long page_number, c;
-    target_phys_addr_t addr, addr1;
-    unsigned int len = ((section->size / TARGET_PAGE_SIZE) + HOST_LONG_BITS - 1) / HOST_LONG_BITS;
-    unsigned long hpratio = getpagesize() / TARGET_PAGE_SIZE;
+    KVMDirtyHarvest *h = &dirty_harvest;
+    unsigned long nbits = section->size / getpagesize();
+    unsigned long nchunks = DIV_ROUND_UP(nbits, KVM_DIRTY_LOG_CHUNK);
+    static bool threads_started;
 
-    /*
-     * bitmap-traveling is faster than memory-traveling (for addr...)
-     * especially when most of the memory is not dirty.
-     */
-    for (i = 0; i < len; i++) {
-        if (bitmap[i] != 0) {
-            c = leul_to_cpu(bitmap[i]);
-            do {
-                j = ffsl(c) - 1;
-                c &= ~(1ul << j);
-                page_number = (i * HOST_LONG_BITS + j) * hpratio;
-                addr1 = page_number * TARGET_PAGE_SIZE;
-                addr = section->offset_within_region + addr1;
-                memory_region_set_dirty(section->mr, addr,
-                                        TARGET_PAGE_SIZE * hpratio);
-            } while (c != 0);
+    if (nchunks > 1 && !threads_started) {
+        kvm_harvest_init(h);
+        threads_started = true;
+    }
+
+    if (nchunks <= 1 || !h->nthreads) {
+        KVMDirtyHarvest one = {
+            .section = section,
+            .bitmap = bitmap,
+            .nbits = nbits,
+        };
+        unsigned long chunk;
+
+        for (chunk = 0; chunk < nchunks; chunk++) {
+            kvm_harvest_chunk(&one, chunk);
         }
+        return 0;
     }
+
+    qemu_mutex_lock(&h->lock);
+    h->section = section;
+    h->bitmap = bitmap;
+    h->nbits = nbits;
+    h->next_chunk = 0;
+    h->nchunks = nchunks;
+    h->pending = nchunks;
+    qemu_cond_broadcast(&h->work_cond);
+
+    kvm_harvest_chunks(h);
+    while (h->pending) {
+        qemu_cond_wait(&h->done_cond, &h->lock);
+    }
+    qemu_mutex_unlock(&h->lock);
+
     return 0;
 }
 
@@ -407,10 +614,17 @@ static int kvm_physical_sync_dirty_bitmap(MemoryRegionSection *section)
 
     d.dirty_bitmap = NULL;
     while (start_addr < end_addr) {
+        int64_t start_time = get_clock();
+
         mem = kvm_lookup_overlapping_slot(s, start_addr, end_addr);
         if (mem == NULL) {
             break;
         }
+        if (!kvm_slot_in_sync(mem)) {
+            /* created by the open transaction, nothing logged yet */
+            start_addr = mem->start_addr + mem->memory_size;
+            continue;
+        }
 
         /* XXX bad kernel interface alert
          * For dirty bitmap, kernel allocates array of size aligned to
@@ -443,6 +657,8 @@ static int kvm_physical_sync_dirty_bitmap(MemoryRegionSection *section)
         }
 
         kvm_get_dirty_pages_log_range(section, d.dirty_bitmap);
+        trace_kvm_sync_dirty_log(mem->slot, mem->memory_size,
+                                 get_clock() - start_time);
         start_addr = mem->start_addr + mem->memory_size;
     }
     g_free(d.dirty_bitmap);
@@ -486,6 +702,42 @@ int kvm_uncoalesce_mmio_region(target_phys_addr_t start, ram_addr_t size)
     return ret;
 }
 
+int kvm_coalesce_pio_region(target_phys_addr_t start, ram_addr_t size)
+{
+    int ret = -ENOSYS;
+    KVMState *s = kvm_state;
+
+    if (s->coalesced_pio) {
+        struct kvm_coalesced_mmio_zone zone;
+
+        zone.addr = start;
+        zone.size = size;
+        zone.pio = 1;
+
+        ret = kvm_vm_ioctl(s, KVM_REGISTER_COALESCED_MMIO, &zone);
+    }
+
+    return ret;
+}
+
+int kvm_uncoalesce_pio_region(target_phys_addr_t start, ram_addr_t size)
+{
+    int ret = -ENOSYS;
+    KVMState *s = kvm_state;
+
+    if (s->coalesced_pio) {
+        struct kvm_coalesced_mmio_zone zone;
+
+        zone.addr = start;
+        zone.size = size;
+        zone.pio = 1;
+
+        ret = kvm_vm_ioctl(s, KVM_UNREGISTER_COALESCED_MMIO, &zone);
+    }
+
+    return ret;
+}
+
 int kvm_check_extension(KVMState *s, unsigned int extension)
 {
     int ret;
@@ -701,10 +953,67 @@ static void kvm_set_phys_mem(MemoryRegionSection *section, bool add)
 
 static void kvm_begin(MemoryListener *listener)
 {
+    kvm_state->in_transaction = true;
 }
 
 static void kvm_commit(MemoryListener *listener)
 {
+    KVMState *s = kvm_state;
+    struct kvm_userspace_memory_region mem;
+    int pending = s->nr_pending_slots;
+    int ioctls = 0;
+    int i, err;
+
+    s->in_transaction = false;
+
+    /* Slots that went away or moved are deleted first, so the kernel never
+     * sees two slots overlap.  Slots that were deleted and recreated in
+     * place, as happens when a BAR is disabled and enabled again, are not
+     * touched at all.  Freed slots are reused most recent first, which
+     * makes that the common case.
+     */
+    for (i = 0; i < pending; i++) {
+        KVMSlot *slot = s->pending_slots[i];
+
+        kvm_slot_region(s, slot, &mem);
+        if (slot->kernel.memory_size &&
+            (mem.memory_size != slot->kernel.memory_size ||
+             mem.guest_phys_addr != slot->kernel.guest_phys_addr ||
+             mem.userspace_addr != slot->kernel.userspace_addr)) {
+            mem = slot->kernel;
+            mem.memory_size = 0;
+            err = kvm_slot_ioctl(s, slot, &mem);
+            if (err) {
+                fprintf(stderr, "%s: error unregistering slot: %s\n",
+                        __func__, strerror(-err));
+                abort();
+            }
+            ioctls++;
+        }
+    }
+
+    for (i = 0; i < pending; i++) {
+        KVMSlot *slot = s->pending_slots[i];
+
+        slot->pending = false;
+        kvm_slot_region(s, slot, &mem);
+        if (mem.memory_size &&
+            (mem.memory_size != slot->kernel.memory_size ||
+             mem.guest_phys_addr != slot->kernel.guest_phys_addr ||
+             mem.userspace_addr != slot->kernel.userspace_addr ||
+             mem.flags != slot->kernel.flags)) {
+            err = kvm_slot_ioctl(s, slot, &mem);
+            if (err) {
+                fprintf(stderr, "%s: error registering slot: %s\n",
+                        __func__, strerror(-err));
+                abort();
+            }
+            ioctls++;
+        }
+    }
+    s->nr_pending_slots = 0;
+
+    trace_kvm_commit(pending, ioctls);
 }
 
 static void kvm_region_add(MemoryListener *listener,
@@ -782,10 +1091,10 @@ static void kvm_io_ioeventfd_add(MemoryRegionSection *section,
 {
     int r;
 
-    assert(match_data && section->size == 2);
+    assert(match_data && section->size <= 2);
 
-    r = kvm_set_ioeventfd_pio_word(fd, section->offset_within_address_space,
-                                   data, true);
+    r = kvm_set_ioeventfd_pio(fd, section->offset_within_address_space,
+                              data, true, section->size);
     if (r < 0) {
         abort();
     }
@@ -797,8 +1106,8 @@ static void kvm_io_ioeventfd_del(MemoryRegionSection *section,
 {
     int r;
 
-    r = kvm_set_ioeventfd_pio_word(fd, section->offset_within_address_space,
-                                   data, false);
+    r = kvm_set_ioeventfd_pio(fd, section->offset_within_address_space,
+                              data, false, section->size);
     if (r < 0) {
         abort();
     }
@@ -879,6 +1188,7 @@ int kvm_set_irq(KVMState *s, int irq, int level)
 typedef struct KVMMSIRoute {
     struct kvm_irq_routing_entry kroute;
     QTAILQ_ENTRY(KVMMSIRoute) entry;
+    QTAILQ_ENTRY(KVMMSIRoute) lru;
 } KVMMSIRoute;
 
 static void set_gsi(KVMState *s, unsigned int gsi)
@@ -917,6 +1227,7 @@ static void kvm_init_irq_routing(KVMState *s)
         for (i = 0; i < KVM_MSI_HASHTAB_SIZE; i++) {
             QTAILQ_INIT(&s->msi_hashtab[i]);
         }
+        QTAILQ_INIT(&s->msi_lru);
     }
 
     kvm_arch_init_irq_routing(s);
@@ -929,6 +1240,8 @@ static void kvm_irqchip_commit_routes(KVMState *s)
     s->irq_routes->flags = 0;
     ret = kvm_vm_ioctl(s, KVM_SET_GSI_ROUTING, s->irq_routes);
     assert(ret == 0);
+    s->route_commits++;
+    trace_kvm_irqchip_commit_routes(s->irq_routes->nr);
 }
 
 static void kvm_add_routing_entry(KVMState *s,
@@ -972,6 +1285,13 @@ static int kvm_update_routing_entry(KVMState *s,
             continue;
         }
 
+        /* the kernel only takes whole tables, so skip no-op updates */
+        if (entry->type == new_entry->type &&
+            entry->flags == new_entry->flags &&
+            !memcmp(&entry->u, &new_entry->u, sizeof(entry->u))) {
+            return 0;
+        }
+
         entry->type = new_entry->type;
         entry->flags = new_entry->flags;
         entry->u = new_entry->u;
@@ -1022,28 +1342,33 @@ static unsigned int kvm_hash_msi(uint32_t data)
     return data & 0xff;
 }
 
-static void kvm_flush_dynamic_msi_routes(KVMState *s)
+/*
+ * Dynamic MSI routes, used when the kernel cannot inject an MSI directly,
+ * are kept on an LRU list and may use any GSI that is not otherwise taken.
+ * When GSIs run out, the least recently used route is evicted, and reused
+ * in place if the new route is itself a dynamic one: that costs a single
+ * KVM_SET_GSI_ROUTING instead of flushing the whole cache and re-adding
+ * routes one commit at a time.
+ */
+static KVMMSIRoute *kvm_evict_msi_route(KVMState *s)
 {
-    KVMMSIRoute *route, *next;
-    unsigned int hash;
+    KVMMSIRoute *route = QTAILQ_FIRST(&s->msi_lru);
 
-    for (hash = 0; hash < KVM_MSI_HASHTAB_SIZE; hash++) {
-        QTAILQ_FOREACH_SAFE(route, &s->msi_hashtab[hash], entry, next) {
-            kvm_irqchip_release_virq(s, route->kroute.gsi);
-            QTAILQ_REMOVE(&s->msi_hashtab[hash], route, entry);
-            g_free(route);
-        }
+    if (route) {
+        QTAILQ_REMOVE(&s->msi_hashtab[kvm_hash_msi(route->kroute.u.msi.data)],
+                      route, entry);
+        QTAILQ_REMOVE(&s->msi_lru, route, lru);
+        s->nr_msi_routes--;
     }
+    return route;
 }
 
-static int kvm_irqchip_get_virq(KVMState *s)
+static int kvm_irqchip_find_free_gsi(KVMState *s)
 {
     uint32_t *word = s->used_gsi_bitmap;
     int max_words = ALIGN(s->gsi_count, 32) / 32;
     int i, bit;
-    bool retry = true;
 
-again:
     /* Return the lowest unused GSI in the bitmap */
     for (i = 0; i < max_words; i++) {
         bit = ffs(~word[i]);
@@ -1053,13 +1378,24 @@ again:
 
         return bit - 1 + i * 32;
     }
-    if (!s->direct_msi && retry) {
-        retry = false;
-        kvm_flush_dynamic_msi_routes(s);
-        goto again;
-    }
     return -ENOSPC;
+}
+
+static int kvm_irqchip_get_virq(KVMState *s)
+{
+    KVMMSIRoute *route;
+    int virq;
 
+    virq = kvm_irqchip_find_free_gsi(s);
+    if (virq < 0 && !s->direct_msi) {
+        route = kvm_evict_msi_route(s);
+        if (route) {
+            virq = route->kroute.gsi;
+            kvm_irqchip_release_virq(s, virq);
+            g_free(route);
+        }
+    }
+    return virq;
 }
 
 static KVMMSIRoute *kvm_lookup_msi_route(KVMState *s, MSIMessage msg)
@@ -1093,27 +1429,37 @@ int kvm_irqchip_send_msi(KVMState *s, MSIMessage msg)
     }
 
     route = kvm_lookup_msi_route(s, msg);
-    if (!route) {
-        int virq;
+    if (route) {
+        QTAILQ_REMOVE(&s->msi_lru, route, lru);
+    } else {
+        int virq = kvm_irqchip_find_free_gsi(s);
 
-        virq = kvm_irqchip_get_virq(s);
-        if (virq < 0) {
-            return virq;
+        if (virq >= 0) {
+            route = g_malloc0(sizeof(KVMMSIRoute));
+            route->kroute.gsi = virq;
+        } else {
+            route = kvm_evict_msi_route(s);
+            if (!route) {
+                return virq;
+            }
         }
-
-        route = g_malloc(sizeof(KVMMSIRoute));
-        route->kroute.gsi = virq;
         route->kroute.type = KVM_IRQ_ROUTING_MSI;
         route->kroute.flags = 0;
         route->kroute.u.msi.address_lo = (uint32_t)msg.address;
         route->kroute.u.msi.address_hi = msg.address >> 32;
         route->kroute.u.msi.data = msg.data;
 
-        kvm_add_routing_entry(s, &route->kroute);
+        if (virq >= 0) {
+            kvm_add_routing_entry(s, &route->kroute);
+        } else {
+            kvm_update_routing_entry(s, &route->kroute);
+        }
 
         QTAILQ_INSERT_TAIL(&s->msi_hashtab[kvm_hash_msi(msg.data)], route,
                            entry);
+        s->nr_msi_routes++;
     }
+    QTAILQ_INSERT_TAIL(&s->msi_lru, route, lru);
 
     assert(route->kroute.type == KVM_IRQ_ROUTING_MSI);
 
@@ -1134,6 +1480,7 @@ int kvm_irqchip_add_msi_route(KVMState *s, MSIMessage msg)
         return virq;
     }
 
+    memset(&kroute, 0, sizeof(kroute));
     kroute.gsi = virq;
     kroute.type = KVM_IRQ_ROUTING_MSI;
     kroute.flags = 0;
@@ -1154,6 +1501,7 @@ int kvm_irqchip_update_msi_route(KVMState *s, int virq, MSIMessage msg)
         return -ENOSYS;
     }
 
+    memset(&kroute, 0, sizeof(kroute));
     kroute.gsi = virq;
     kroute.type = KVM_IRQ_ROUTING_MSI;
     kroute.flags = 0;
@@ -1302,9 +1650,6 @@ int kvm_init(void)
 #ifdef KVM_CAP_SET_GUEST_DEBUG
     QTAILQ_INIT(&s->kvm_sw_breakpoints);
 #endif
-    for (i = 0; i < ARRAY_SIZE(s->slots); i++) {
-        s->slots[i].slot = i;
-    }
     s->vmfd = -1;
     s->fd = qemu_open("/dev/kvm", O_RDWR);
     if (s->fd == -1) {
@@ -1328,6 +1673,21 @@ int kvm_init(void)
         goto err;
     }
 
+    s->nr_slots = kvm_check_extension(s, KVM_CAP_NR_MEMSLOTS);
+    if (s->nr_slots <= 0) {
+        s->nr_slots = KVM_DEFAULT_NR_SLOTS;
+    }
+    s->slots = g_malloc0(s->nr_slots * sizeof(s->slots[0]));
+    s->used_slots = g_malloc(s->nr_slots * sizeof(s->used_slots[0]));
+    s->free_slots = g_malloc(s->nr_slots * sizeof(s->free_slots[0]));
+    s->pending_slots = g_malloc(s->nr_slots * sizeof(s->pending_slots[0]));
+    for (i = 0; i < s->nr_slots; i++) {
+        s->slots[i].slot = i;
+        /* hand out the lowest numbers first */
+        s->free_slots[s->nr_slots - 1 - i] = &s->slots[i];
+    }
+    s->nr_free_slots = s->nr_slots;
+
     max_vcpus = kvm_max_vcpus(s);
     if (smp_cpus > max_vcpus) {
         ret = -EINVAL;
@@ -1359,6 +1719,8 @@ int kvm_init(void)
     }
 
     s->coalesced_mmio = kvm_check_extension(s, KVM_CAP_COALESCED_MMIO);
+    s->coalesced_pio = s->coalesced_mmio &&
+                       kvm_check_extension(s, KVM_CAP_COALESCED_PIO);
 
     s->broken_set_mem_region = 1;
     ret = kvm_check_extension(s, KVM_CAP_JOIN_MEMORY_REGIONS_WORKS);
@@ -1422,6 +1784,10 @@ err:
         if (s->fd != -1) {
             close(s->fd);
         }
+        g_free(s->slots);
+        g_free(s->used_slots);
+        g_free(s->free_slots);
+        g_free(s->pending_slots);
     }
     g_free(s);
 
@@ -1509,7 +1875,12 @@ void kvm_flush_coalesced_mmio_buffer(void)
 
             ent = &ring->coalesced_mmio[ring->first];
 
-            cpu_physical_memory_write(ent->phys_addr, ent->data, ent->len);
+            if (ent->pio == 1) {
+                kvm_handle_io(ent->phys_addr, ent->data, KVM_EXIT_IO_OUT,
+                              ent->len, 1);
+            } else {
+                cpu_physical_memory_write(ent->phys_addr, ent->data, ent->len);
+            }
             smp_wmb();
             ring->first = (ring->first + 1) % KVM_COALESCED_MMIO_MAX;
         }
@@ -1518,39 +1889,108 @@ void kvm_flush_coalesced_mmio_buffer(void)
     s->coalesced_flush_in_progress = false;
 }
 
-static void do_kvm_cpu_synchronize_state(void *_env)
+/*
+ * While kvm_vcpu_dirty is set, the register groups in kvm_regs_valid are
+ * current in env and are written back before the next KVM_RUN.  Groups
+ * are fetched on demand, so a caller that only needs the instruction
+ * pointer does not pay for the FPU and MSR state.
+ */
+typedef struct KVMSyncRequest {
+    CPUArchState *env;
+    unsigned int groups;
+} KVMSyncRequest;
+
+static bool kvm_regs_current(CPUArchState *env, unsigned int groups)
+{
+    return env->kvm_vcpu_dirty && (env->kvm_regs_valid & groups) == groups;
+}
+
+static void do_kvm_cpu_synchronize_state(void *opaque)
 {
-    CPUArchState *env = _env;
+    KVMSyncRequest *req = opaque;
+    CPUArchState *env = req->env;
 
-    if (!env->kvm_vcpu_dirty) {
-        kvm_arch_get_registers(env);
+    if (!kvm_regs_current(env, req->groups)) {
+        kvm_arch_get_registers(env, req->groups);
         env->kvm_vcpu_dirty = 1;
     }
 }
 
-void kvm_cpu_synchronize_state(CPUArchState *env)
+void kvm_cpu_synchronize_groups(CPUArchState *env, unsigned int groups)
 {
-    if (!env->kvm_vcpu_dirty) {
-        run_on_cpu(env, do_kvm_cpu_synchronize_state, env);
+    KVMSyncRequest req = { .env = env, .groups = groups };
+
+    if (!kvm_regs_current(env, groups)) {
+        run_on_cpu(env, do_kvm_cpu_synchronize_state, &req);
     }
 }
 
+void kvm_cpu_synchronize_state(CPUArchState *env)
+{
+    kvm_cpu_synchronize_groups(env, KVM_REGS_ALL);
+}
+
 void kvm_cpu_synchronize_post_reset(CPUArchState *env)
 {
     kvm_arch_put_registers(env, KVM_PUT_RESET_STATE);
     env->kvm_vcpu_dirty = 0;
+    env->kvm_regs_valid = 0;
 }
 
 void kvm_cpu_synchronize_post_init(CPUArchState *env)
 {
     kvm_arch_put_registers(env, KVM_PUT_FULL_STATE);
     env->kvm_vcpu_dirty = 0;
+    env->kvm_regs_valid = 0;
+}
+
+/*
+ * Handles MMIO and PIO exits to regions that allow it without the global
+ * mutex.  Only with the in-kernel irqchip, otherwise kvm_arch_pre_run() and
+ * kvm_arch_post_run() have work to do around every KVM_RUN.
+ */
+static bool kvm_handle_exit_lockless(CPUArchState *env, struct kvm_run *run)
+{
+    if (!kvm_irqchip_in_kernel()) {
+        return false;
+    }
+
+    switch (run->exit_reason) {
+    case KVM_EXIT_IO:
+        return memory_dispatch_lockless(true, run->io.port,
+                                        (uint8_t *)run + run->io.data_offset,
+                                        run->io.size, run->io.count,
+                                        run->io.direction == KVM_EXIT_IO_OUT);
+    case KVM_EXIT_MMIO:
+        return memory_dispatch_lockless(false, run->mmio.phys_addr,
+                                        run->mmio.data, run->mmio.len, 1,
+                                        run->mmio.is_write);
+    default:
+        return false;
+    }
+}
+
+static void kvm_lock_iothread(CPUArchState *env)
+{
+    int64_t start = get_clock();
+    uint64_t wait_us;
+    int i = 0;
+
+    qemu_mutex_lock_iothread();
+
+    wait_us = (get_clock() - start) / 1000;
+    while (i < CPU_LOCK_WAIT_BUCKETS - 1 && wait_us >= (1ULL << (2 * i))) {
+        i++;
+    }
+    env->lock_wait_hist[i]++;
+    env->locked_exits++;
 }
 
 int kvm_cpu_exec(CPUArchState *env)
 {
     struct kvm_run *run = env->kvm_run;
     int ret, run_ret;
+    bool handled;
 
     DPRINTF("kvm_cpu_exec()\n");
 
@@ -1563,6 +2003,7 @@ int kvm_cpu_exec(CPUArchState *env)
         if (env->kvm_vcpu_dirty) {
             kvm_arch_put_registers(env, KVM_PUT_RUNTIME_STATE);
             env->kvm_vcpu_dirty = 0;
+            env->kvm_regs_valid = 0;
         }
 
         kvm_arch_pre_run(env, run);
@@ -1577,12 +2018,24 @@ int kvm_cpu_exec(CPUArchState *env)
         }
         qemu_mutex_unlock_iothread();
 
-        run_ret = kvm_vcpu_ioctl(env, KVM_RUN, 0);
+        /*
+         * Pending interrupts and stop requests kick us out of KVM_RUN with
+         * -EINTR, so there is no need to go through kvm_arch_pre_run()
+         * again while exits can be handled without the global mutex.
+         */
+        do {
+            run_ret = kvm_vcpu_ioctl(env, KVM_RUN, 0);
+            handled = run_ret == 0 && kvm_handle_exit_lockless(env, run);
+            env->lockless_exits += handled;
+        } while (handled && !env->exit_request);
 
-        qemu_mutex_lock_iothread();
+        kvm_lock_iothread(env);
         kvm_arch_post_run(env, run);
 
-        kvm_flush_coalesced_mmio_buffer();
+        if (handled) {
+            ret = 0;
+            continue;
+        }
 
         if (run_ret < 0) {
             if (run_ret == -EINTR || run_ret == -EAGAIN) {
@@ -1749,6 +2202,33 @@ int kvm_has_gsi_routing(void)
 #endif
 }
 
+int kvm_has_direct_msi(void)
+{
+    return kvm_state->direct_msi;
+}
+
+void kvm_get_route_stats(uint64_t *commits, uint64_t *per_second,
+                         unsigned int *msi_routes)
+{
+    KVMState *s = kvm_state;
+    int64_t now = get_clock();
+
+    if (now - s->route_commits_stamp >= get_ticks_per_sec()) {
+        s->route_commits_rate = (s->route_commits - s->route_commits_last) *
+                                get_ticks_per_sec() /
+                                (now - s->route_commits_stamp);
+        s->route_commits_last = s->route_commits;
+        s->route_commits_stamp = now;
+    }
+    *commits = s->route_commits;
+    *per_second = s->route_commits_rate;
+#ifdef KVM_CAP_IRQ_ROUTING
+    *msi_routes = s->nr_msi_routes;
+#else
+    *msi_routes = 0;
+#endif
+}
+
 int kvm_has_intx_set_mask(void)
 {
     return kvm_state->intx_set_mask;
@@ -2011,12 +2491,13 @@ int kvm_set_ioeventfd_mmio(int fd, uint32_t addr, uint32_t val, bool assign,
     return 0;
 }
 
-int kvm_set_ioeventfd_pio_word(int fd, uint16_t addr, uint16_t val, bool assign)
+int kvm_set_ioeventfd_pio(int fd, uint16_t addr, uint16_t val, bool assign,
+                          uint32_t size)
 {
     struct kvm_ioeventfd kick = {
         .datamatch = val,
         .addr = addr,
-        .len = 2,
+        .len = size,
         .flags = KVM_IOEVENTFD_FLAG_DATAMATCH | KVM_IOEVENTFD_FLAG_PIO,
         .fd = fd,
     };
@@ -2034,6 +2515,11 @@ int kvm_set_ioeventfd_pio_word(int fd, uint16_t addr, uint16_t val, bool assign)
     return 0;
 }
 
+int kvm_set_ioeventfd_pio_word(int fd, uint16_t addr, uint16_t val, bool assign)
+{
+    return kvm_set_ioeventfd_pio(fd, addr, val, assign, 2);
+}
+
 int kvm_on_sigbus_vcpu(CPUArchState *env, int code, void *addr)
 {
     return kvm_arch_on_sigbus_vcpu(env, code, addr);
@@ -52,6 +52,10 @@ void kvm_cpu_synchronize_state(CPUArchState *env)
 {
 }
 
+void kvm_cpu_synchronize_groups(CPUArchState *env, unsigned int groups)
+{
+}
+
 void kvm_cpu_synchronize_post_reset(CPUArchState *env)
 {
 }
@@ -80,6 +84,18 @@ int kvm_has_pit_state2(void)
     return 0;
 }
 
+int kvm_has_direct_msi(void)
+{
+    return 0;
+}
+
+void kvm_get_route_stats(uint64_t *commits, uint64_t *per_second,
+                         unsigned int *msi_routes)
+{
+    *commits = *per_second = 0;
+    *msi_routes = 0;
+}
+
 void kvm_setup_guest_memory(void *start, size_t size)
 {
 }
@@ -112,6 +128,12 @@ int kvm_set_signal_mask(CPUArchState *env, const sigset_t *sigset)
 }
 #endif
 
+int kvm_set_ioeventfd_pio(int fd, uint16_t addr, uint16_t val, bool assign,
+                          uint32_t size)
+{
+    return -ENOSYS;
+}
+
 int kvm_set_ioeventfd_pio_word(int fd, uint16_t addr, uint16_t val, bool assign)
 {
     return -ENOSYS;
@@ -137,6 +159,11 @@ int kvm_irqchip_add_msi_route(KVMState *s, MSIMessage msg)
     return -ENOSYS;
 }
 
+int kvm_irqchip_update_msi_route(KVMState *s, int virq, MSIMessage msg)
+{
+    return -ENOSYS;
+}
+
 void kvm_irqchip_release_virq(KVMState *s, int virq)
 {
 }
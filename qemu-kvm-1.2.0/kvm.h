@@ -117,7 +117,10 @@ int kvm_has_xcrs(void);
 int kvm_has_pit_state2(void);
 int kvm_has_many_ioeventfds(void);
 int kvm_has_gsi_routing(void);
+int kvm_has_direct_msi(void);
 int kvm_has_intx_set_mask(void);
+void kvm_get_route_stats(uint64_t *commits, uint64_t *per_second,
+                         unsigned int *msi_routes);
 
 #ifdef NEED_CPU_H
 int kvm_init_vcpu(CPUArchState *env);
@@ -131,6 +134,8 @@ void kvm_setup_guest_memory(void *start, size_t size);
 
 int kvm_coalesce_mmio_region(target_phys_addr_t start, ram_addr_t size);
 int kvm_uncoalesce_mmio_region(target_phys_addr_t start, ram_addr_t size);
+int kvm_coalesce_pio_region(target_phys_addr_t start, ram_addr_t size);
+int kvm_uncoalesce_pio_region(target_phys_addr_t start, ram_addr_t size);
 void kvm_flush_coalesced_mmio_buffer(void);
 #endif
 
@@ -166,7 +171,16 @@ int kvm_arch_handle_exit(CPUArchState *env, struct kvm_run *run);
 
 int kvm_arch_process_async_events(CPUArchState *env);
 
-int kvm_arch_get_registers(CPUArchState *env);
+/*
+ * Register groups for kvm_cpu_synchronize_groups(); what a group covers is
+ * up to the architecture.  kvm_arch_get_registers() fetches at least the
+ * groups it is asked for that are not in env->kvm_regs_valid yet, and adds
+ * what it fetched to env->kvm_regs_valid.  Architectures without groups
+ * fetch everything and set KVM_REGS_ALL.
+ */
+#define KVM_REGS_ALL            (~0U)
+
+int kvm_arch_get_registers(CPUArchState *env, unsigned int groups);
 
 /* state subset only touched by the VCPU itself during runtime */
 #define KVM_PUT_RUNTIME_STATE   1
@@ -232,6 +246,7 @@ int kvm_check_extension(KVMState *s, unsigned int extension);
 uint32_t kvm_arch_get_supported_cpuid(KVMState *env, uint32_t function,
                                       uint32_t index, int reg);
 void kvm_cpu_synchronize_state(CPUArchState *env);
+void kvm_cpu_synchronize_groups(CPUArchState *env, unsigned int groups);
 void kvm_cpu_synchronize_post_reset(CPUArchState *env);
 void kvm_cpu_synchronize_post_init(CPUArchState *env);
 
@@ -244,6 +259,16 @@ static inline void cpu_synchronize_state(CPUArchState *env)
     }
 }
 
+/* Like cpu_synchronize_state(), but only the register groups the caller
+ * reads or modifies need to be current.  */
+static inline void cpu_synchronize_groups(CPUArchState *env,
+                                          unsigned int groups)
+{
+    if (kvm_enabled()) {
+        kvm_cpu_synchronize_groups(env, groups);
+    }
+}
+
 static inline void cpu_synchronize_post_reset(CPUArchState *env)
 {
     if (kvm_enabled()) {
@@ -268,6 +293,8 @@ int kvm_physical_memory_addr_from_host(KVMState *s, void *ram_addr,
 int kvm_set_ioeventfd_mmio(int fd, uint32_t adr, uint32_t val, bool assign,
                            uint32_t size);
 
+int kvm_set_ioeventfd_pio(int fd, uint16_t adr, uint16_t val, bool assign,
+                          uint32_t size);
 int kvm_set_ioeventfd_pio_word(int fd, uint16_t adr, uint16_t val, bool assign);
 
 int kvm_irqchip_add_msi_route(KVMState *s, MSIMessage msg);
@@ -15,7 +15,7 @@
 #include <libaio.h>
 
 /*
- * Queue size (per-device).
+ * Default queue size (per-device), -drive aio-queue-depth overrides it.
  *
  * XXX: eventually we need to communicate this to the guest and/or make it
  *      tunable by the guest.  If we get more outstanding requests at a time
@@ -39,6 +39,17 @@ struct qemu_laio_state {
     io_context_t ctx;
     int efd;
     int count;
+    int max_events;
+    struct io_event *events;
+
+    /* requests queued while plugged */
+    struct iocb **io_q;
+    int io_q_len;
+    int plugged;
+
+    /* queued requests that io_submit() refused, failed from a BH */
+    QLIST_HEAD(, qemu_laiocb) failed;
+    QEMUBH *failed_bh;
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -81,7 +92,7 @@ static void qemu_laio_completion_cb(void *opaque)
     struct qemu_laio_state *s = opaque;
 
     while (1) {
-        struct io_event events[MAX_EVENTS];
+        struct io_event *events = s->events;
         uint64_t val;
         ssize_t ret;
         struct timespec ts = { 0 };
@@ -98,7 +109,8 @@ static void qemu_laio_completion_cb(void *opaque)
             break;
 
         do {
-            nevents = io_getevents(s->ctx, val, MAX_EVENTS, events, &ts);
+            nevents = io_getevents(s->ctx, MIN(val, s->max_events),
+                                   s->max_events, events, &ts);
         } while (nevents == -EINTR);
 
         for (i = 0; i < nevents; i++) {
@@ -119,14 +131,40 @@ static int qemu_laio_flush_cb(void *opaque)
     return (s->count > 0) ? 1 : 0;
 }
 
+/* Take a request that was queued while plugged off the queue */
+static bool ioq_remove(struct qemu_laio_state *s, struct iocb *iocb)
+{
+    int i;
+
+    for (i = 0; i < s->io_q_len; i++) {
+        if (s->io_q[i] == iocb) {
+            memmove(&s->io_q[i], &s->io_q[i + 1],
+                    (s->io_q_len - i - 1) * sizeof(s->io_q[0]));
+            s->io_q_len--;
+            return true;
+        }
+    }
+    return false;
+}
+
 static void laio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
     struct io_event event;
     int ret;
 
-    if (laiocb->ret != -EINPROGRESS)
+    if (laiocb->ret != -EINPROGRESS) {
+        /* a failed submission waiting for its BH, don't call back */
+        laiocb->ret = -ECANCELED;
+        return;
+    }
+
+    /* Never submitted, so it would never complete either */
+    if (ioq_remove(laiocb->ctx, &laiocb->iocb)) {
+        laiocb->ret = -ECANCELED;
+        qemu_laio_process_completion(laiocb->ctx, laiocb);
         return;
+    }
 
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
@@ -150,6 +188,71 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
         qemu_laio_completion_cb(laiocb->ctx);
 }
 
+static void qemu_laio_failed_bh(void *opaque)
+{
+    struct qemu_laio_state *s = opaque;
+    struct qemu_laiocb *laiocb;
+
+    while ((laiocb = QLIST_FIRST(&s->failed))) {
+        QLIST_REMOVE(laiocb, node);
+        qemu_laio_process_completion(s, laiocb);
+    }
+}
+
+/*
+ * Submits the queued requests with as few io_submit() calls as the kernel
+ * allows.  Requests it refuses fail with the error it returned; they are
+ * completed from a BH because their submitter may not have seen its ACB
+ * yet.
+ */
+static void ioq_submit(struct qemu_laio_state *s)
+{
+    struct iocb **iocbs = s->io_q;
+    int len = s->io_q_len;
+    int ret;
+
+    s->io_q_len = 0;
+    while (len > 0) {
+        ret = io_submit(s->ctx, len, iocbs);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            if (ret == 0) {
+                ret = -EAGAIN;
+            }
+            while (len-- > 0) {
+                struct qemu_laiocb *laiocb =
+                    container_of(*iocbs++, struct qemu_laiocb, iocb);
+
+                laiocb->ret = ret;
+                QLIST_INSERT_HEAD(&s->failed, laiocb, node);
+            }
+            qemu_bh_schedule(s->failed_bh);
+            break;
+        }
+        iocbs += ret;
+        len -= ret;
+    }
+}
+
+void laio_io_plug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->plugged++;
+}
+
+void laio_io_unplug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->plugged > 0);
+    if (--s->plugged == 0 && s->io_q_len) {
+        ioq_submit(s);
+    }
+}
+
 static AIOPool laio_pool = {
     .aiocb_size         = sizeof(struct qemu_laiocb),
     .cancel             = laio_cancel,
@@ -189,6 +292,14 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, s->efd);
     s->count++;
 
+    if (s->plugged) {
+        s->io_q[s->io_q_len++] = iocbs;
+        if (s->io_q_len == s->max_events) {
+            ioq_submit(s);
+        }
+        return &laiocb->common;
+    }
+
     if (io_submit(s->ctx, 1, &iocbs) < 0)
         goto out_dec_count;
     return &laiocb->common;
@@ -200,19 +311,25 @@ out_free_aiocb:
     return NULL;
 }
 
-void *laio_init(void)
+void *laio_init(int max_events)
 {
     struct qemu_laio_state *s;
 
     s = g_malloc0(sizeof(*s));
+    s->max_events = max_events > 0 ? max_events : MAX_EVENTS;
     s->efd = eventfd(0, 0);
     if (s->efd == -1)
         goto out_free_state;
     fcntl(s->efd, F_SETFL, O_NONBLOCK);
 
-    if (io_setup(MAX_EVENTS, &s->ctx) != 0)
+    if (io_setup(s->max_events, &s->ctx) != 0)
         goto out_close_efd;
 
+    s->events = g_new(struct io_event, s->max_events);
+    s->io_q = g_new(struct iocb *, s->max_events);
+    QLIST_INIT(&s->failed);
+    s->failed_bh = qemu_bh_new(qemu_laio_failed_bh, s);
+
     qemu_aio_set_fd_handler(s->efd, qemu_laio_completion_cb, NULL,
         qemu_laio_flush_cb, s);
 
@@ -1707,7 +1707,7 @@ static void load_elf_image(const char *image_name, int image_fd,
     for (i = 0; i < ehdr->e_phnum; i++) {
         struct elf_phdr *eppnt = phdr + i;
         if (eppnt->p_type == PT_LOAD) {
-            abi_ulong vaddr, vaddr_po, vaddr_ps, vaddr_ef, vaddr_em;
+            abi_ulong vaddr, vaddr_po, vaddr_ps, vaddr_ef, vaddr_em, vaddr_len;
             int elf_prot = 0;
 
             if (eppnt->p_flags & PF_R) elf_prot =  PROT_READ;
@@ -1718,7 +1718,18 @@ static void load_elf_image(const char *image_name, int image_fd,
             vaddr_po = TARGET_ELF_PAGEOFFSET(vaddr);
             vaddr_ps = TARGET_ELF_PAGESTART(vaddr);
 
-            error = target_mmap(vaddr_ps, eppnt->p_filesz + vaddr_po,
+            /* Map whole host pages of the file, as the kernel does.  A
+               partial last page would make target_mmap fall back to
+               allocating it and reading it in with pread; mapping the
+               rest of that page from the file keeps the whole segment
+               demand paged and shared with the page cache.  Whatever
+               lies beyond p_filesz is cleared by zero_bss below.  */
+            vaddr_len = eppnt->p_filesz + vaddr_po;
+            if (eppnt->p_filesz != 0) {
+                vaddr_len = HOST_PAGE_ALIGN(vaddr_ps + vaddr_len) - vaddr_ps;
+            }
+
+            error = target_mmap(vaddr_ps, vaddr_len,
                                 elf_prot, MAP_PRIVATE | MAP_FIXED,
                                 image_fd, eppnt->p_offset - vaddr_po);
             if (error == -1) {
@@ -29,6 +29,7 @@
 #include "qemu.h"
 #include "qemu-common.h"
 #include "cache-utils.h"
+#include "qemu-barrier.h"
 #include "cpu.h"
 #include "tcg.h"
 #include "qemu-timer.h"
@@ -45,6 +46,7 @@ const char *argv0;
 int gdbstub_port;
 envlist_t *envlist;
 const char *cpu_model;
+static const char *tcache_dir;
 unsigned long mmap_min_addr;
 #if defined(CONFIG_USE_GUEST_BASE)
 unsigned long guest_base;
@@ -109,12 +111,18 @@ int64_t cpu_get_real_ticks(void)
 /* To implement exclusive operations we force all cpus to syncronise.
    We don't require a full sync, only that no cpus are executing guest code.
    The alternative is to map target atomic ops onto host equivalents,
-   which requires quite a lot of per host/target work.  */
+   which requires quite a lot of per host/target work.
+
+   Entering and leaving cpu_exec happens on every syscall, so it must not
+   touch exclusive_lock unless an exclusive operation is pending.  Each
+   side publishes its own flag (env->running resp. pending_cpus), issues
+   a full barrier and then looks at the other side's flag; at least one
+   of them is guaranteed to see the other and fall back to the lock.  */
 static pthread_mutex_t cpu_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t exclusive_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t exclusive_cond = PTHREAD_COND_INITIALIZER;
 static pthread_cond_t exclusive_resume = PTHREAD_COND_INITIALIZER;
-static int pending_cpus;
+static volatile int pending_cpus;
 
 /* Make sure everything is in a consistent state for calling fork().  */
 void fork_start(void)
@@ -132,6 +140,7 @@ void fork_end(int child)
            Discard information about the parent threads.  */
         first_cpu = thread_env;
         thread_env->next_cpu = NULL;
+        thread_env->has_waiter = 0;
         pending_cpus = 0;
         pthread_mutex_init(&exclusive_lock, NULL);
         pthread_mutex_init(&cpu_list_mutex, NULL);
@@ -159,18 +168,28 @@ static inline void exclusive_idle(void)
 static inline void start_exclusive(void)
 {
     CPUArchState *other;
+    int running_cpus;
+
     pthread_mutex_lock(&exclusive_lock);
     exclusive_idle();
 
+    /* Make all other cpus stop executing.  From now on a cpu entering
+       cpu_exec will see pending_cpus and block on exclusive_lock.  */
     pending_cpus = 1;
-    /* Make all other cpus stop executing.  */
+    smp_mb();
+    running_cpus = 0;
+    /* Exiting threads unlink and free their CPU under cpu_list_mutex.  */
+    pthread_mutex_lock(&cpu_list_mutex);
     for (other = first_cpu; other; other = other->next_cpu) {
         if (other->running) {
-            pending_cpus++;
+            other->has_waiter = 1;
+            running_cpus++;
             cpu_exit(other);
         }
     }
-    if (pending_cpus > 1) {
+    pthread_mutex_unlock(&cpu_list_mutex);
+    pending_cpus = running_cpus + 1;
+    while (pending_cpus > 1) {
         pthread_cond_wait(&exclusive_cond, &exclusive_lock);
     }
 }
@@ -186,25 +205,39 @@ static inline void end_exclusive(void)
 /* Wait for exclusive ops to finish, and begin cpu execution.  */
 static inline void cpu_exec_start(CPUArchState *env)
 {
-    pthread_mutex_lock(&exclusive_lock);
-    exclusive_idle();
     env->running = 1;
-    pthread_mutex_unlock(&exclusive_lock);
+    smp_mb();
+    if (unlikely(pending_cpus)) {
+        pthread_mutex_lock(&exclusive_lock);
+        if (!env->has_waiter) {
+            /* Not counted by start_exclusive, so stay out of its way.  */
+            env->running = 0;
+            exclusive_idle();
+            env->running = 1;
+        }
+        /* Otherwise we were counted and cpu_exit'ed; cpu_exec_end will
+           release the waiter right away.  */
+        pthread_mutex_unlock(&exclusive_lock);
+    }
 }
 
 /* Mark cpu as not executing, and release pending exclusive ops.  */
 static inline void cpu_exec_end(CPUArchState *env)
 {
-    pthread_mutex_lock(&exclusive_lock);
     env->running = 0;
-    if (pending_cpus > 1) {
-        pending_cpus--;
-        if (pending_cpus == 1) {
-            pthread_cond_signal(&exclusive_cond);
+    smp_mb();
+    if (unlikely(pending_cpus)) {
+        pthread_mutex_lock(&exclusive_lock);
+        if (env->has_waiter) {
+            env->has_waiter = 0;
+            pending_cpus--;
+            if (pending_cpus == 1) {
+                pthread_cond_signal(&exclusive_cond);
+            }
         }
+        exclusive_idle();
+        pthread_mutex_unlock(&exclusive_lock);
     }
-    exclusive_idle();
-    pthread_mutex_unlock(&exclusive_lock);
 }
 
 void cpu_list_lock(void)
@@ -3206,6 +3239,11 @@ static void handle_arg_strace(const char *arg)
     do_strace = 1;
 }
 
+static void handle_arg_tcache(const char *arg)
+{
+    tcache_dir = arg;
+}
+
 static void handle_arg_version(const char *arg)
 {
     printf("qemu-" TARGET_ARCH " version " QEMU_VERSION QEMU_PKGVERSION
@@ -3257,6 +3295,8 @@ static const struct qemu_argument arg_table[] = {
      "",           "run in singlestep mode"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
+    {"tcache",     "QEMU_TCACHE",      true,  handle_arg_tcache,
+     "dir",        "keep translated code across runs in directory 'dir'"},
     {"version",    "QEMU_VERSION",     false, handle_arg_version,
      "",           "display version information and exit"},
     {NULL, NULL, false, NULL, NULL, NULL}
@@ -3486,6 +3526,9 @@ int main(int argc, char **argv, char **envp)
         cpu_model = "any";
 #endif
     }
+    if (tcache_dir && !gdbstub_port) {
+        tb_cache_init(tcache_dir, filename, cpu_model, singlestep);
+    }
     tcg_exec_init(0);
     cpu_exec_init_all();
     /* NOTE: we need to init the CPU at this stage to get
@@ -3623,6 +3666,7 @@ int main(int argc, char **argv, char **envp)
        the real value of GUEST_BASE into account.  */
     tcg_prologue_init(&tcg_ctx);
 #endif
+    tb_cache_load();
 
 #if defined(TARGET_I386)
     cpu_x86_set_cpl(env, 3);
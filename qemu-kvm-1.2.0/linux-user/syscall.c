@@ -3685,6 +3685,16 @@ static abi_long do_ioctl(int fd, abi_long cmd, abi_long arg)
     case TYPE_PTR:
         arg_type++;
         target_size = thunk_type_size(arg_type, 0);
+        if (thunk_type_same_layout(arg_type)) {
+            /* no conversion needed: let the host operate on guest memory */
+            argptr = lock_user(ie->access == IOC_W ? VERIFY_READ : VERIFY_WRITE,
+                               arg, target_size, ie->access != IOC_R);
+            if (!argptr)
+                return -TARGET_EFAULT;
+            ret = get_errno(ioctl(fd, ie->host_cmd, argptr));
+            unlock_user(argptr, arg, ie->access == IOC_W ? 0 : target_size);
+            break;
+        }
         switch(ie->access) {
         case IOC_R:
             ret = get_errno(ioctl(fd, ie->host_cmd, buf_temp));
@@ -5148,6 +5158,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
 #ifdef TARGET_GPROF
         _mcleanup();
 #endif
+        tb_cache_save();
         gdb_exit(cpu_env, arg1);
         _exit(arg1);
         ret = 0; /* avoid warning */
@@ -6902,6 +6913,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
 #ifdef TARGET_GPROF
         _mcleanup();
 #endif
+        tb_cache_save();
         gdb_exit(cpu_env, arg1);
         ret = get_errno(exit_group(arg1));
         break;
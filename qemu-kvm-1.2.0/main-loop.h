@@ -353,12 +353,30 @@ void qemu_mutex_lock_iothread(void);
  */
 void qemu_mutex_unlock_iothread(void);
 
+/**
+ * qemu_lock_stats_set_site: Name the calling thread in lock statistics.
+ *
+ * Global mutex waits and holds of the calling thread are accounted to
+ * @name in query-lock-stats.  Threads that never call this are counted
+ * as "other".
+ */
+void qemu_lock_stats_set_site(const char *name);
+
 /* internal interfaces */
 
 void qemu_fd_register(int fd);
 void qemu_iohandler_fill(int *pnfds, fd_set *readfds, fd_set *writefds, fd_set *xfds);
 void qemu_iohandler_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds, int rc);
 
+/* When set, MMIO/PIO dispatch and fd handlers count their calls and the
+ * cpu_get_real_ticks() spent in them, see query-device-profile.  */
+extern bool device_profiling;
+
+typedef void IOHandlerProfileFunc(void *opaque, int fd, void *handler,
+                                  uint64_t calls, uint64_t ticks);
+void qemu_iohandler_profile_foreach(IOHandlerProfileFunc *fn, void *opaque);
+void qemu_iohandler_profile_reset(void);
+
 void qemu_bh_schedule_idle(QEMUBH *bh);
 int qemu_bh_poll(void);
 void qemu_bh_update_timeout(uint32_t *timeout);
@@ -18,13 +18,18 @@
 #include "ioport.h"
 #include "bitops.h"
 #include "kvm.h"
+#include "qemu-barrier.h"
+#include "qemu-rcu.h"
+#include "qemu-timer.h"
+#include "main-loop.h"
 #include <assert.h>
 
 #define WANT_EXEC_OBSOLETE
 #include "exec-obsolete.h"
 
 unsigned memory_region_transaction_depth = 0;
-static bool memory_region_update_pending = false;
+/* Bumped for every topology update; see memory_region_update_topology().  */
+static unsigned memory_region_render_gen;
 static bool global_dirty_log = false;
 
 static QTAILQ_HEAD(memory_listeners, MemoryListener) memory_listeners
@@ -210,9 +215,11 @@ struct FlatRange {
 };
 
 /* Flattened global view of current active memory hierarchy.  Kept in sorted
- * order.
+ * order.  Never modified once it is an address space's current_map, and
+ * freed after an RCU grace period when it is replaced.
  */
 struct FlatView {
+    RCUHead rcu;
     FlatRange *ranges;
     unsigned nr;
     unsigned nr_allocated;
@@ -221,12 +228,36 @@ struct FlatView {
 typedef struct AddressSpace AddressSpace;
 typedef struct AddressSpaceOps AddressSpaceOps;
 
+typedef struct LocklessRange LocklessRange;
+typedef struct LocklessMap LocklessMap;
+
+/* A FlatRange that vCPUs may access without the global mutex. */
+struct LocklessRange {
+    AddrRange addr;
+    MemoryRegion *mr;
+    target_phys_addr_t offset_in_region;
+    bool read;
+    bool write;
+};
+
+/* Lockless ranges of an address space, immutable once published. */
+struct LocklessMap {
+    RCUHead rcu;
+    unsigned nr;
+    LocklessRange ranges[];
+};
+
 /* A system address space - I/O, memory, etc. */
 struct AddressSpace {
     MemoryRegion *root;
-    FlatView current_map;
+    /* Written under the iothread lock, read under it or under RCU */
+    FlatView *current_map;
     int ioeventfd_nb;
     MemoryRegionIoeventfd *ioeventfds;
+    LocklessMap *lockless_map;
+    /* generation current_map was rendered in */
+    unsigned render_gen;
+    bool update_pending;
 };
 
 #define FOR_EACH_FLAT_RANGE(var, view)          \
@@ -269,6 +300,17 @@ static void flatview_destroy(FlatView *view)
     g_free(view->ranges);
 }
 
+/* current_map of address spaces that were never rendered */
+static FlatView flatview_empty;
+
+static void flatview_reclaim(RCUHead *rcu)
+{
+    FlatView *view = container_of(rcu, FlatView, rcu);
+
+    flatview_destroy(view);
+    g_free(view);
+}
+
 static bool can_merge(FlatRange *r1, FlatRange *r2)
 {
     return int128_eq(addrrange_end(r1->addr), r2->addr.start)
@@ -360,7 +402,9 @@ static void access_with_adjusted_size(target_phys_addr_t addr,
     }
 }
 
-static AddressSpace address_space_memory;
+static AddressSpace address_space_memory = {
+    .current_map = &flatview_empty,
+};
 
 static const MemoryRegionPortio *find_portio(MemoryRegion *mr, uint64_t offset,
                                              unsigned width, bool write)
@@ -386,6 +430,9 @@ static void memory_region_iorange_read(IORange *iorange,
         = container_of(iorange, MemoryRegionIORange, iorange);
     MemoryRegion *mr = mrio->mr;
 
+    if (mr->flush_coalesced_mmio) {
+        qemu_flush_coalesced_mmio_buffer();
+    }
     offset += mrio->offset;
     if (mr->ops->old_portio) {
         const MemoryRegionPortio *mrp = find_portio(mr, offset - mrio->offset,
@@ -418,6 +465,9 @@ static void memory_region_iorange_write(IORange *iorange,
         = container_of(iorange, MemoryRegionIORange, iorange);
     MemoryRegion *mr = mrio->mr;
 
+    if (mr->flush_coalesced_mmio) {
+        qemu_flush_coalesced_mmio_buffer();
+    }
     offset += mrio->offset;
     if (mr->ops->old_portio) {
         const MemoryRegionPortio *mrp = find_portio(mr, offset - mrio->offset,
@@ -450,7 +500,9 @@ const IORangeOps memory_region_iorange_ops = {
     .destructor = memory_region_iorange_destructor,
 };
 
-static AddressSpace address_space_io;
+static AddressSpace address_space_io = {
+    .current_map = &flatview_empty,
+};
 
 static AddressSpace *memory_region_to_address_space(MemoryRegion *mr)
 {
@@ -473,7 +525,8 @@ static void render_memory_region(FlatView *view,
                                  MemoryRegion *mr,
                                  Int128 base,
                                  AddrRange clip,
-                                 bool readonly)
+                                 bool readonly,
+                                 unsigned gen)
 {
     MemoryRegion *subregion;
     unsigned i;
@@ -483,6 +536,8 @@ static void render_memory_region(FlatView *view,
     FlatRange fr;
     AddrRange tmp;
 
+    mr->render_gen = gen;
+
     if (!mr->enabled) {
         return;
     }
@@ -501,13 +556,13 @@ static void render_memory_region(FlatView *view,
     if (mr->alias) {
         int128_subfrom(&base, int128_make64(mr->alias->addr));
         int128_subfrom(&base, int128_make64(mr->alias_offset));
-        render_memory_region(view, mr->alias, base, clip, readonly);
+        render_memory_region(view, mr->alias, base, clip, readonly, gen);
         return;
     }
 
     /* Render subregions in priority order. */
     QTAILQ_FOREACH(subregion, &mr->subregions, subregions_link) {
-        render_memory_region(view, subregion, base, clip, readonly);
+        render_memory_region(view, subregion, base, clip, readonly, gen);
     }
 
     if (!mr->terminates) {
@@ -557,15 +612,16 @@ static void render_memory_region(FlatView *view,
 }
 
 /* Render a memory topology into a list of disjoint absolute ranges. */
-static FlatView generate_memory_topology(MemoryRegion *mr)
+static FlatView *generate_memory_topology(MemoryRegion *mr, unsigned gen)
 {
-    FlatView view;
+    FlatView *view = g_new(FlatView, 1);
 
-    flatview_init(&view);
+    flatview_init(view);
 
-    render_memory_region(&view, mr, int128_zero(),
-                         addrrange_make(int128_zero(), int128_2_64()), false);
-    flatview_simplify(&view);
+    render_memory_region(view, mr, int128_zero(),
+                         addrrange_make(int128_zero(), int128_2_64()), false,
+                         gen);
+    flatview_simplify(view);
 
     return view;
 }
@@ -627,7 +683,7 @@ static void address_space_update_ioeventfds(AddressSpace *as)
     AddrRange tmp;
     unsigned i;
 
-    FOR_EACH_FLAT_RANGE(fr, &as->current_map) {
+    FOR_EACH_FLAT_RANGE(fr, as->current_map) {
         for (i = 0; i < fr->mr->ioeventfd_nb; ++i) {
             tmp = addrrange_shift(fr->mr->ioeventfds[i].addr,
                                   int128_sub(fr->addr.start,
@@ -650,6 +706,46 @@ static void address_space_update_ioeventfds(AddressSpace *as)
     as->ioeventfd_nb = ioeventfd_nb;
 }
 
+static void flat_range_coalesced_io_del(FlatRange *fr, AddressSpace *as)
+{
+    if (QTAILQ_EMPTY(&fr->mr->coalesced)) {
+        return;
+    }
+
+    if (as == &address_space_io) {
+        qemu_unregister_coalesced_pio(int128_get64(fr->addr.start),
+                                      int128_get64(fr->addr.size));
+    } else {
+        qemu_unregister_coalesced_mmio(int128_get64(fr->addr.start),
+                                       int128_get64(fr->addr.size));
+    }
+}
+
+/* Register the parts of the region's coalesced ranges that @fr maps */
+static void flat_range_coalesced_io_add(FlatRange *fr, AddressSpace *as)
+{
+    MemoryRegion *mr = fr->mr;
+    CoalescedMemoryRange *cmr;
+    AddrRange tmp;
+
+    QTAILQ_FOREACH(cmr, &mr->coalesced, link) {
+        tmp = addrrange_shift(cmr->addr,
+                              int128_sub(fr->addr.start,
+                                         int128_make64(fr->offset_in_region)));
+        if (!addrrange_intersects(tmp, fr->addr)) {
+            continue;
+        }
+        tmp = addrrange_intersection(tmp, fr->addr);
+        if (as == &address_space_io) {
+            qemu_register_coalesced_pio(int128_get64(tmp.start),
+                                        int128_get64(tmp.size));
+        } else {
+            qemu_register_coalesced_mmio(int128_get64(tmp.start),
+                                         int128_get64(tmp.size));
+        }
+    }
+}
+
 static void address_space_update_topology_pass(AddressSpace *as,
                                                FlatView old_view,
                                                FlatView new_view,
@@ -682,6 +778,7 @@ static void address_space_update_topology_pass(AddressSpace *as,
             /* In old, but (not in new, or in new but attributes changed). */
 
             if (!adding) {
+                flat_range_coalesced_io_del(frold, as);
                 MEMORY_LISTENER_UPDATE_REGION(frold, as, Reverse, region_del);
             }
 
@@ -705,6 +802,7 @@ static void address_space_update_topology_pass(AddressSpace *as,
 
             if (adding) {
                 MEMORY_LISTENER_UPDATE_REGION(frnew, as, Forward, region_add);
+                flat_range_coalesced_io_add(frnew, as);
             }
 
             ++inew;
@@ -713,42 +811,165 @@ static void address_space_update_topology_pass(AddressSpace *as,
 }
 
 
+static bool flat_range_lockless(FlatRange *fr)
+{
+    MemoryRegion *mr = fr->mr;
+
+    if (!mr->lockless_read && !mr->lockless_write) {
+        return false;
+    }
+    return !mr->ram && !mr->rom_device && mr->ops && mr->ops->read
+        && mr->ops->write && !mr->ops->old_portio;
+}
+
+static bool lockless_map_equal(LocklessMap *a, LocklessMap *b)
+{
+    unsigned i;
+
+    if (!a || !b) {
+        return a == b;
+    }
+    if (a->nr != b->nr) {
+        return false;
+    }
+    for (i = 0; i < a->nr; ++i) {
+        if (a->ranges[i].mr != b->ranges[i].mr
+            || !addrrange_equal(a->ranges[i].addr, b->ranges[i].addr)
+            || a->ranges[i].offset_in_region != b->ranges[i].offset_in_region
+            || a->ranges[i].read != b->ranges[i].read
+            || a->ranges[i].write != b->ranges[i].write) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void address_space_update_lockless(AddressSpace *as)
+{
+    LocklessMap *old_map = as->lockless_map;
+    LocklessMap *new_map = NULL;
+    FlatRange *fr;
+    unsigned nr = 0;
+
+    FOR_EACH_FLAT_RANGE(fr, as->current_map) {
+        nr += flat_range_lockless(fr);
+    }
+
+    if (nr) {
+        new_map = g_malloc(sizeof(*new_map) + nr * sizeof(LocklessRange));
+        new_map->nr = 0;
+        FOR_EACH_FLAT_RANGE(fr, as->current_map) {
+            if (flat_range_lockless(fr)) {
+                new_map->ranges[new_map->nr++] = (LocklessRange) {
+                    .addr = fr->addr,
+                    .mr = fr->mr,
+                    .offset_in_region = fr->offset_in_region,
+                    .read = fr->mr->lockless_read,
+                    .write = fr->mr->lockless_write,
+                };
+            }
+        }
+    }
+
+    if (lockless_map_equal(old_map, new_map)) {
+        g_free(new_map);
+        return;
+    }
+
+    /* Wait for the grace period instead of deferring the free: the
+     * regions that only old_map refers to may be destroyed as soon as
+     * the transaction that removed them commits.
+     */
+    atomic_rcu_set(&as->lockless_map, new_map);
+    synchronize_rcu();
+    g_free(old_map);
+}
+
 static void address_space_update_topology(AddressSpace *as)
 {
-    FlatView old_view = as->current_map;
-    FlatView new_view = generate_memory_topology(as->root);
+    FlatView *old_view = as->current_map;
+    FlatView *new_view = generate_memory_topology(as->root,
+                                                  memory_region_render_gen);
 
-    address_space_update_topology_pass(as, old_view, new_view, false);
-    address_space_update_topology_pass(as, old_view, new_view, true);
+    address_space_update_topology_pass(as, *old_view, *new_view, false);
+    address_space_update_topology_pass(as, *old_view, *new_view, true);
 
-    as->current_map = new_view;
-    flatview_destroy(&old_view);
+    atomic_rcu_set(&as->current_map, new_view);
+    as->render_gen = memory_region_render_gen;
+    as->update_pending = false;
+    if (old_view != &flatview_empty) {
+        call_rcu1(&old_view->rcu, flatview_reclaim);
+    }
     address_space_update_ioeventfds(as);
+    address_space_update_lockless(as);
 }
 
-static void memory_region_update_topology(MemoryRegion *mr)
+/* Can a change to mr affect as?  Every region the last rendering of an
+ * address space reached is stamped with its generation; regions it did
+ * not reach (below a disabled or clipped region, or not attached to
+ * anything yet) cannot change the view, whatever happens to them.  A
+ * region rendered into the other address space in a later generation
+ * is conservatively considered part of this one too.
+ */
+static bool address_space_may_contain(AddressSpace *as, MemoryRegion *mr)
 {
-    if (memory_region_transaction_depth) {
-        memory_region_update_pending |= !mr || mr->enabled;
+    return as->root && (!mr || mr->render_gen >= as->render_gen);
+}
+
+static void address_space_commit_topology(AddressSpace *as)
+{
+    if (!as->root) {
         return;
     }
+    if (as->update_pending) {
+        address_space_update_topology(as);
+    } else {
+        /* Listeners rebuild their state between begin and commit, so
+           replay the unchanged view as region_nop calls.  */
+        address_space_update_topology_pass(as, *as->current_map,
+                                           *as->current_map, true);
+    }
+}
 
-    if (mr && !mr->enabled) {
+static void memory_region_commit_topology(void)
+{
+    if (!address_space_memory.update_pending
+        && !address_space_io.update_pending) {
         return;
     }
 
     MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
-    if (address_space_memory.root) {
-        address_space_update_topology(&address_space_memory);
+    ++memory_region_render_gen;
+    address_space_commit_topology(&address_space_memory);
+    address_space_commit_topology(&address_space_io);
+
+    MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+}
+
+/* Re-render the address spaces mr may be part of, or all if mr is NULL */
+static void memory_region_schedule_update(MemoryRegion *mr)
+{
+    if (address_space_may_contain(&address_space_memory, mr)) {
+        address_space_memory.update_pending = true;
     }
-    if (address_space_io.root) {
-        address_space_update_topology(&address_space_io);
+    if (address_space_may_contain(&address_space_io, mr)) {
+        address_space_io.update_pending = true;
     }
 
-    MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+    if (!memory_region_transaction_depth) {
+        memory_region_commit_topology();
+    }
+}
+
+/* mr is the region whose contents changed, or NULL to re-render all */
+static void memory_region_update_topology(MemoryRegion *mr)
+{
+    if (mr && !mr->enabled) {
+        return;
+    }
 
-    memory_region_update_pending = false;
+    memory_region_schedule_update(mr);
 }
 
 void memory_region_transaction_begin(void)
@@ -760,8 +981,8 @@ void memory_region_transaction_commit(void)
 {
     assert(memory_region_transaction_depth);
     --memory_region_transaction_depth;
-    if (!memory_region_transaction_depth && memory_region_update_pending) {
-        memory_region_update_topology(NULL);
+    if (!memory_region_transaction_depth) {
+        memory_region_commit_topology();
     }
 }
 
@@ -822,10 +1043,16 @@ void memory_region_init(MemoryRegion *mr,
     QTAILQ_INIT(&mr->subregions);
     memset(&mr->subregions_link, 0, sizeof mr->subregions_link);
     QTAILQ_INIT(&mr->coalesced);
+    mr->flush_coalesced_mmio = false;
+    mr->lockless_read = false;
+    mr->lockless_write = false;
     mr->name = g_strdup(name);
     mr->dirty_log_mask = 0;
     mr->ioeventfd_nb = 0;
     mr->ioeventfds = NULL;
+    mr->render_gen = 0;
+    mr->prof_calls = 0;
+    mr->prof_ticks = 0;
 }
 
 static bool memory_region_access_valid(MemoryRegion *mr,
@@ -895,22 +1122,43 @@ static void adjust_endianness(MemoryRegion *mr, uint64_t *data, unsigned size)
     }
 }
 
+static void memory_region_profile(MemoryRegion *mr, int64_t start)
+{
+    /* Lockless regions are dispatched from several vCPUs at once */
+    __sync_fetch_and_add(&mr->prof_ticks, cpu_get_real_ticks() - start);
+    __sync_fetch_and_add(&mr->prof_calls, 1);
+}
+
 static uint64_t memory_region_dispatch_read(MemoryRegion *mr,
                                             target_phys_addr_t addr,
                                             unsigned size)
 {
+    bool profile = device_profiling;
+    int64_t start = 0;
     uint64_t ret;
 
+    if (profile) {
+        start = cpu_get_real_ticks();
+    }
+    if (mr->flush_coalesced_mmio) {
+        qemu_flush_coalesced_mmio_buffer();
+    }
     ret = memory_region_dispatch_read1(mr, addr, size);
     adjust_endianness(mr, &ret, size);
+    if (profile) {
+        memory_region_profile(mr, start);
+    }
     return ret;
 }
 
-static void memory_region_dispatch_write(MemoryRegion *mr,
-                                         target_phys_addr_t addr,
-                                         uint64_t data,
-                                         unsigned size)
+static void memory_region_dispatch_write1(MemoryRegion *mr,
+                                          target_phys_addr_t addr,
+                                          uint64_t data,
+                                          unsigned size)
 {
+    if (mr->flush_coalesced_mmio) {
+        qemu_flush_coalesced_mmio_buffer();
+    }
     if (!memory_region_access_valid(mr, addr, size, true)) {
         return; /* FIXME: better signalling */
     }
@@ -929,6 +1177,146 @@ static void memory_region_dispatch_write(MemoryRegion *mr,
                               memory_region_write_accessor, mr);
 }
 
+static void memory_region_dispatch_write(MemoryRegion *mr,
+                                         target_phys_addr_t addr,
+                                         uint64_t data,
+                                         unsigned size)
+{
+    int64_t start;
+
+    if (!device_profiling) {
+        memory_region_dispatch_write1(mr, addr, data, size);
+        return;
+    }
+
+    start = cpu_get_real_ticks();
+    memory_region_dispatch_write1(mr, addr, data, size);
+    memory_region_profile(mr, start);
+}
+
+static int lockless_range_cmp(const void *addr_, const void *range_)
+{
+    const Int128 *addr = addr_;
+    const LocklessRange *range = range_;
+
+    if (int128_lt(*addr, range->addr.start)) {
+        return -1;
+    } else if (int128_ge(*addr, addrrange_end(range->addr))) {
+        return 1;
+    }
+    return 0;
+}
+
+static void memory_lockless_io(MemoryRegion *mr, target_phys_addr_t offset,
+                               uint8_t *buf, unsigned size, unsigned count,
+                               bool is_write)
+{
+    uint64_t data;
+    unsigned i;
+
+    /* Same as memory_region_iorange_read/write() */
+    for (i = 0; i < count; i++, buf += size) {
+        if (is_write) {
+            data = size == 1 ? ldub_p(buf) : size == 2 ? lduw_p(buf)
+                                                       : ldl_p(buf);
+            access_with_adjusted_size(offset, &data, size,
+                                      mr->ops->impl.min_access_size,
+                                      mr->ops->impl.max_access_size,
+                                      memory_region_write_accessor, mr);
+        } else {
+            data = 0;
+            access_with_adjusted_size(offset, &data, size,
+                                      mr->ops->impl.min_access_size,
+                                      mr->ops->impl.max_access_size,
+                                      memory_region_read_accessor, mr);
+            switch (size) {
+            case 1:
+                stb_p(buf, data);
+                break;
+            case 2:
+                stw_p(buf, data);
+                break;
+            default:
+                stl_p(buf, data);
+                break;
+            }
+        }
+    }
+}
+
+static void memory_lockless_mmio(MemoryRegion *mr, target_phys_addr_t offset,
+                                 uint8_t *buf, unsigned len, bool is_write)
+{
+    uint64_t val;
+    unsigned l;
+
+    /* Split like cpu_physical_memory_rw() does */
+    while (len) {
+        if (len >= 4 && !(offset & 3)) {
+            l = 4;
+        } else if (len >= 2 && !(offset & 1)) {
+            l = 2;
+        } else {
+            l = 1;
+        }
+        if (is_write) {
+            val = l == 4 ? ldl_p(buf) : l == 2 ? lduw_p(buf) : ldub_p(buf);
+            memory_region_dispatch_write(mr, offset, val, l);
+        } else {
+            val = memory_region_dispatch_read(mr, offset, l);
+            if (l == 4) {
+                stl_p(buf, val);
+            } else if (l == 2) {
+                stw_p(buf, val);
+            } else {
+                stb_p(buf, val);
+            }
+        }
+        offset += l;
+        buf += l;
+        len -= l;
+    }
+}
+
+bool memory_dispatch_lockless(bool is_io, target_phys_addr_t addr,
+                              uint8_t *buf, unsigned size, unsigned count,
+                              bool is_write)
+{
+    AddressSpace *as = is_io ? &address_space_io : &address_space_memory;
+    Int128 start = int128_make64(addr);
+    LocklessMap *map;
+    LocklessRange *lr = NULL;
+    target_phys_addr_t offset;
+    bool done = false;
+
+    rcu_read_lock();
+
+    map = atomic_rcu_read(&as->lockless_map);
+    if (map) {
+        lr = bsearch(&start, map->ranges, map->nr, sizeof(LocklessRange),
+                     lockless_range_cmp);
+    }
+    if (!lr || !(is_write ? lr->write : lr->read)
+        || lr->mr->flush_coalesced_mmio
+        || int128_gt(int128_add(start, int128_make64(size)),
+                     addrrange_end(lr->addr))
+        || (!is_io && count != 1)) {
+        goto out;
+    }
+
+    offset = addr - int128_get64(lr->addr.start) + lr->offset_in_region;
+    if (is_io) {
+        memory_lockless_io(lr->mr, offset, buf, size, count, is_write);
+    } else {
+        memory_lockless_mmio(lr->mr, offset, buf, size, is_write);
+    }
+    done = true;
+
+out:
+    rcu_read_unlock();
+    return done;
+}
+
 void memory_region_init_io(MemoryRegion *mr,
                            const MemoryRegionOps *ops,
                            void *opaque,
@@ -1088,11 +1476,23 @@ void memory_region_set_dirty(MemoryRegion *mr, target_phys_addr_t addr,
     return cpu_physical_memory_set_dirty_range(mr->ram_addr + addr, size, -1);
 }
 
+void memory_region_set_dirty_lebitmap(MemoryRegion *mr,
+                                      target_phys_addr_t addr,
+                                      const unsigned long *bitmap,
+                                      unsigned long nbits,
+                                      unsigned pages_per_bit)
+{
+    assert(mr->terminates);
+    assert(!(addr & ~TARGET_PAGE_MASK));
+    cpu_physical_memory_set_dirty_lebitmap(bitmap, mr->ram_addr + addr,
+                                           nbits, pages_per_bit);
+}
+
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
 {
     FlatRange *fr;
 
-    FOR_EACH_FLAT_RANGE(fr, &address_space_memory.current_map) {
+    FOR_EACH_FLAT_RANGE(fr, address_space_memory.current_map) {
         if (fr->mr == mr) {
             MEMORY_LISTENER_UPDATE_REGION(fr, &address_space_memory,
                                           Forward, log_sync);
@@ -1136,31 +1536,25 @@ void *memory_region_get_ram_ptr(MemoryRegion *mr)
     return qemu_get_ram_ptr(mr->ram_addr & TARGET_PAGE_MASK);
 }
 
-static void memory_region_update_coalesced_range(MemoryRegion *mr)
+static void memory_region_update_coalesced_range_as(MemoryRegion *mr,
+                                                    AddressSpace *as)
 {
     FlatRange *fr;
-    CoalescedMemoryRange *cmr;
-    AddrRange tmp;
 
-    FOR_EACH_FLAT_RANGE(fr, &address_space_memory.current_map) {
+    FOR_EACH_FLAT_RANGE(fr, as->current_map) {
         if (fr->mr == mr) {
-            qemu_unregister_coalesced_mmio(int128_get64(fr->addr.start),
-                                           int128_get64(fr->addr.size));
-            QTAILQ_FOREACH(cmr, &mr->coalesced, link) {
-                tmp = addrrange_shift(cmr->addr,
-                                      int128_sub(fr->addr.start,
-                                                 int128_make64(fr->offset_in_region)));
-                if (!addrrange_intersects(tmp, fr->addr)) {
-                    continue;
-                }
-                tmp = addrrange_intersection(tmp, fr->addr);
-                qemu_register_coalesced_mmio(int128_get64(tmp.start),
-                                             int128_get64(tmp.size));
-            }
+            flat_range_coalesced_io_del(fr, as);
+            flat_range_coalesced_io_add(fr, as);
         }
     }
 }
 
+static void memory_region_update_coalesced_range(MemoryRegion *mr)
+{
+    memory_region_update_coalesced_range_as(mr, &address_space_memory);
+    memory_region_update_coalesced_range_as(mr, &address_space_io);
+}
+
 void memory_region_set_coalescing(MemoryRegion *mr)
 {
     memory_region_clear_coalescing(mr);
@@ -1176,12 +1570,16 @@ void memory_region_add_coalescing(MemoryRegion *mr,
     cmr->addr = addrrange_make(int128_make64(offset), int128_make64(size));
     QTAILQ_INSERT_TAIL(&mr->coalesced, cmr, link);
     memory_region_update_coalesced_range(mr);
+    memory_region_set_flush_coalesced(mr);
 }
 
 void memory_region_clear_coalescing(MemoryRegion *mr)
 {
     CoalescedMemoryRange *cmr;
 
+    qemu_flush_coalesced_mmio_buffer();
+    mr->flush_coalesced_mmio = false;
+
     while (!QTAILQ_EMPTY(&mr->coalesced)) {
         cmr = QTAILQ_FIRST(&mr->coalesced);
         QTAILQ_REMOVE(&mr->coalesced, cmr, link);
@@ -1190,6 +1588,29 @@ void memory_region_clear_coalescing(MemoryRegion *mr)
     memory_region_update_coalesced_range(mr);
 }
 
+void memory_region_set_flush_coalesced(MemoryRegion *mr)
+{
+    mr->flush_coalesced_mmio = true;
+}
+
+void memory_region_clear_flush_coalesced(MemoryRegion *mr)
+{
+    qemu_flush_coalesced_mmio_buffer();
+    if (QTAILQ_EMPTY(&mr->coalesced)) {
+        mr->flush_coalesced_mmio = false;
+    }
+}
+
+void memory_region_set_lockless(MemoryRegion *mr, bool reads, bool writes)
+{
+    if (mr->lockless_read == reads && mr->lockless_write == writes) {
+        return;
+    }
+    mr->lockless_read = reads;
+    mr->lockless_write = writes;
+    memory_region_update_topology(mr);
+}
+
 void memory_region_add_eventfd(MemoryRegion *mr,
                                target_phys_addr_t addr,
                                unsigned size,
@@ -1326,7 +1747,7 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
         return;
     }
     mr->enabled = enabled;
-    memory_region_update_topology(NULL);
+    memory_region_schedule_update(mr);
 }
 
 void memory_region_set_address(MemoryRegion *mr, target_phys_addr_t addr)
@@ -1382,9 +1803,9 @@ static int cmp_flatrange_addr(const void *addr_, const void *fr_)
     return 0;
 }
 
-static FlatRange *address_space_lookup(AddressSpace *as, AddrRange addr)
+static FlatRange *address_space_lookup(FlatView *view, AddrRange addr)
 {
-    return bsearch(&addr, as->current_map.ranges, as->current_map.nr,
+    return bsearch(&addr, view->ranges, view->nr,
                    sizeof(FlatRange), cmp_flatrange_addr);
 }
 
@@ -1394,14 +1815,19 @@ MemoryRegionSection memory_region_find(MemoryRegion *address_space,
     AddressSpace *as = memory_region_to_address_space(address_space);
     AddrRange range = addrrange_make(int128_make64(addr),
                                      int128_make64(size));
-    FlatRange *fr = address_space_lookup(as, range);
     MemoryRegionSection ret = { .mr = NULL, .size = 0 };
+    FlatView *view;
+    FlatRange *fr;
 
+    rcu_read_lock();
+    view = atomic_rcu_read(&as->current_map);
+    fr = address_space_lookup(view, range);
     if (!fr) {
+        rcu_read_unlock();
         return ret;
     }
 
-    while (fr > as->current_map.ranges
+    while (fr > view->ranges
            && addrrange_intersects(fr[-1].addr, range)) {
         --fr;
     }
@@ -1414,6 +1840,7 @@ MemoryRegionSection memory_region_find(MemoryRegion *address_space,
     ret.size = int128_get64(range.size);
     ret.offset_within_address_space = int128_get64(range.start);
     ret.readonly = fr->readonly;
+    rcu_read_unlock();
     return ret;
 }
 
@@ -1422,7 +1849,7 @@ void memory_global_sync_dirty_bitmap(MemoryRegion *address_space)
     AddressSpace *as = memory_region_to_address_space(address_space);
     FlatRange *fr;
 
-    FOR_EACH_FLAT_RANGE(fr, &as->current_map) {
+    FOR_EACH_FLAT_RANGE(fr, as->current_map) {
         MEMORY_LISTENER_UPDATE_REGION(fr, as, Forward, log_sync);
     }
 }
@@ -1452,7 +1879,7 @@ static void listener_add_address_space(MemoryListener *listener,
     if (global_dirty_log) {
         listener->log_global_start(listener);
     }
-    FOR_EACH_FLAT_RANGE(fr, &as->current_map) {
+    FOR_EACH_FLAT_RANGE(fr, as->current_map) {
         MemoryRegionSection section = {
             .mr = fr->mr,
             .address_space = as->root,
@@ -1616,6 +2043,56 @@ static void mtree_print_mr(fprintf_function mon_printf, void *f,
     }
 }
 
+typedef struct MemoryRegionProfileWalk {
+    GHashTable *visited;
+    MemoryRegionProfileFunc *fn;    /* NULL to clear the counters */
+    void *opaque;
+} MemoryRegionProfileWalk;
+
+static void memory_region_profile_walk(MemoryRegionProfileWalk *walk,
+                                       MemoryRegion *mr, bool is_io)
+{
+    MemoryRegion *submr;
+
+    if (!mr || g_hash_table_lookup(walk->visited, mr)) {
+        return;
+    }
+    g_hash_table_insert(walk->visited, mr, mr);
+
+    if (mr->alias) {
+        memory_region_profile_walk(walk, mr->alias, is_io);
+        return;
+    }
+    if (!walk->fn) {
+        mr->prof_calls = 0;
+        mr->prof_ticks = 0;
+    } else if (mr->prof_calls) {
+        walk->fn(walk->opaque, mr->name, is_io, mr->prof_calls,
+                 mr->prof_ticks);
+    }
+    QTAILQ_FOREACH(submr, &mr->subregions, subregions_link) {
+        memory_region_profile_walk(walk, submr, is_io);
+    }
+}
+
+void memory_region_profile_foreach(MemoryRegionProfileFunc *fn, void *opaque)
+{
+    MemoryRegionProfileWalk walk = {
+        .visited = g_hash_table_new(NULL, NULL),
+        .fn = fn,
+        .opaque = opaque,
+    };
+
+    memory_region_profile_walk(&walk, address_space_memory.root, false);
+    memory_region_profile_walk(&walk, address_space_io.root, true);
+    g_hash_table_destroy(walk.visited);
+}
+
+void memory_region_profile_reset(void)
+{
+    memory_region_profile_foreach(NULL, NULL);
+}
+
 void mtree_info(fprintf_function mon_printf, void *f)
 {
     MemoryRegionListHead ml_head;
@@ -1644,4 +2121,6 @@ void mtree_info(fprintf_function mon_printf, void *f)
     QTAILQ_FOREACH_SAFE(ml, &ml_head, queue, ml2) {
         g_free(ml);
     }
+
+    dma_bounce_info(mon_printf, f);
 }
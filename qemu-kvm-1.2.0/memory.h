@@ -37,6 +37,7 @@ typedef struct MemoryRegionMmio MemoryRegionMmio;
 #define DIRTY_MEMORY_VGA       0
 #define DIRTY_MEMORY_CODE      1
 #define DIRTY_MEMORY_MIGRATION 3
+#define DIRTY_MEMORY_DUMP      4
 
 struct MemoryRegionMmio {
     CPUReadMemoryFunc *read[3];
@@ -140,10 +141,16 @@ struct MemoryRegion {
     QTAILQ_HEAD(subregions, MemoryRegion) subregions;
     QTAILQ_ENTRY(MemoryRegion) subregions_link;
     QTAILQ_HEAD(coalesced_ranges, CoalescedMemoryRange) coalesced;
+    bool flush_coalesced_mmio;
+    bool lockless_read;
+    bool lockless_write;
     const char *name;
     uint8_t dirty_log_mask;
     unsigned ioeventfd_nb;
     MemoryRegionIoeventfd *ioeventfds;
+    unsigned render_gen;
+    uint64_t prof_calls;        /* dispatches while device_profiling is on */
+    uint64_t prof_ticks;        /* cpu_get_real_ticks() spent in them */
 };
 
 struct MemoryRegionPortio {
@@ -432,6 +439,25 @@ bool memory_region_get_dirty(MemoryRegion *mr, target_phys_addr_t addr,
 void memory_region_set_dirty(MemoryRegion *mr, target_phys_addr_t addr,
                              target_phys_addr_t size);
 
+/**
+ * memory_region_set_dirty_lebitmap: Mark the pages of a memory region that
+ *                                   are set in a bitmap as dirty.
+ *
+ * Like memory_region_set_dirty(), for dirty logs such as kvm's.  May be
+ * called from several threads at once for disjoint ranges.
+ *
+ * @mr: the memory region being dirtied.
+ * @addr: the address (relative to the start of the region) of the first bit.
+ * @bitmap: little endian bitmap with one bit per @pages_per_bit pages.
+ * @nbits: the number of bits in @bitmap.
+ * @pages_per_bit: target pages covered by each bit.
+ */
+void memory_region_set_dirty_lebitmap(MemoryRegion *mr,
+                                      target_phys_addr_t addr,
+                                      const unsigned long *bitmap,
+                                      unsigned long nbits,
+                                      unsigned pages_per_bit);
+
 /**
  * memory_region_sync_dirty_bitmap: Synchronize a region's dirty bitmap with
  *                                  any external TLBs (e.g. kvm)
@@ -486,8 +512,11 @@ void memory_region_rom_device_set_readable(MemoryRegion *mr, bool readable);
 /**
  * memory_region_set_coalescing: Enable memory coalescing for the region.
  *
- * Enabled writes to a region to be queued for later processing. MMIO ->write
- * callbacks may be delayed until a non-coalesced MMIO is issued.
+ * Enabled writes to a region to be queued for later processing. MMIO and PIO
+ * ->write callbacks may be delayed until the region, or another one marked
+ * with memory_region_set_flush_coalesced(), is accessed.  Devices that look
+ * at their state outside of guest accesses must call
+ * qemu_flush_coalesced_mmio_buffer() first.
  * Only useful for IO regions.  Roughly similar to write-combining hardware.
  *
  * @mr: the memory region to be write coalesced
@@ -509,6 +538,31 @@ void memory_region_add_coalescing(MemoryRegion *mr,
                                   target_phys_addr_t offset,
                                   uint64_t size);
 
+/**
+ * memory_region_set_flush_coalesced: Enforce memory coalescing flush before
+ *                                    accesses.
+ *
+ * Ensure that pending coalesced MMIO and PIO requests are flushed before
+ * any access to this region, so the device sees writes in order.
+ * memory_region_add_coalescing() sets this for the coalesced region itself,
+ * use this for other regions of the same device.
+ *
+ * @mr: the memory region to be updated.
+ */
+void memory_region_set_flush_coalesced(MemoryRegion *mr);
+
+/**
+ * memory_region_clear_flush_coalesced: Disable memory coalescing flush before
+ *                                      accesses.
+ *
+ * Clear the automatic coalesced flush enabled via
+ * memory_region_set_flush_coalesced().  Note that this flag is also cleared
+ * by memory_region_clear_coalescing().
+ *
+ * @mr: the memory region to be updated.
+ */
+void memory_region_clear_flush_coalesced(MemoryRegion *mr);
+
 /**
  * memory_region_clear_coalescing: Disable MMIO coalescing for the region.
  *
@@ -520,6 +574,24 @@ void memory_region_add_coalescing(MemoryRegion *mr,
  */
 void memory_region_clear_coalescing(MemoryRegion *mr);
 
+/**
+ * memory_region_set_lockless: Allow accesses without the global mutex.
+ *
+ * Lets a vCPU thread dispatch reads and/or writes to an IO region without
+ * taking the global mutex first.  The region's callbacks then must do their
+ * own locking and must not call anything that relies on the global mutex.
+ * Regions using old_portio or flushing coalesced MMIO are always dispatched
+ * with the mutex held.
+ *
+ * Once this returns no vCPU is still running a lockless access that was
+ * disallowed, so a device may tear down what its lockless callbacks use.
+ *
+ * @mr: the memory region being updated.
+ * @reads: whether reads may be dispatched without the global mutex.
+ * @writes: whether writes may be dispatched without the global mutex.
+ */
+void memory_region_set_lockless(MemoryRegion *mr, bool reads, bool writes);
+
 /**
  * memory_region_add_eventfd: Request an eventfd to be triggered when a word
  *                            is written to a location.
@@ -747,8 +819,50 @@ void memory_global_dirty_log_start(void);
  */
 void memory_global_dirty_log_stop(void);
 
+/**
+ * memory_dispatch_lockless: dispatch an access without the global mutex
+ *
+ * Performs @count accesses of @size bytes at @addr, all to the same
+ * address, if it lies in a region that allows it through
+ * memory_region_set_lockless().  @buf holds the data in target byte order.
+ * Can be called from any thread, with or without the global mutex.
+ *
+ * Returns %false without doing anything if the access has to be dispatched
+ * with the global mutex held.
+ *
+ * @is_io: whether @addr is an I/O port (%true) or a physical address
+ * @addr: the address accessed
+ * @buf: the data read or written
+ * @size: the size of each access, 1, 2, 4 or (for memory) 8 bytes
+ * @count: the number of accesses, only I/O ports may use more than one
+ * @is_write: whether this is a write (%true) or a read (%false)
+ */
+bool memory_dispatch_lockless(bool is_io, target_phys_addr_t addr,
+                              uint8_t *buf, unsigned size, unsigned count,
+                              bool is_write);
+
 void mtree_info(fprintf_function mon_printf, void *f);
 
+typedef void MemoryRegionProfileFunc(void *opaque, const char *name,
+                                     bool is_io, uint64_t calls,
+                                     uint64_t ticks);
+
+/**
+ * memory_region_profile_foreach: report device profiling counters
+ *
+ * Calls @fn for every region reachable from the system memory and I/O
+ * address spaces that was dispatched to while device_profiling was on.
+ *
+ * @fn: the function to call
+ * @opaque: passed to @fn
+ */
+void memory_region_profile_foreach(MemoryRegionProfileFunc *fn, void *opaque);
+
+/**
+ * memory_region_profile_reset: clear device profiling counters
+ */
+void memory_region_profile_reset(void);
+
 #endif
 
 #endif
@@ -0,0 +1,182 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * The migration stream is written sequentially from the start of the
+ * file, and RAM goes to fixed offsets after MIGRATION_FILE_STREAM_SIZE,
+ * see arch_init.c.  The gap between them is a hole of the file.
+ *
+ * The file is written under a temporary name and only renamed to PATH
+ * once the migration has completed.  A file that is used as a template,
+ * i.e. mapped privately by any number of clones with "file:PATH,mmap",
+ * is thus never truncated or overwritten under them, since saving over
+ * it replaces it with a new inode.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "migration.h"
+#include "qemu-char.h"
+#include "buffered_file.h"
+#include "block.h"
+
+//#define DEBUG_MIGRATION_FILE
+
+#ifdef DEBUG_MIGRATION_FILE
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-file: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+static char *file_path;
+static char *file_tmp_path;
+static Notifier file_state_notifier;
+
+static void file_migration_state_changed(Notifier *notifier, void *data)
+{
+    MigrationState *s = data;
+
+    if (migration_has_finished(s)) {
+        if (rename(file_tmp_path, file_path) != 0) {
+            fprintf(stderr, "migration-file: cannot rename %s to %s: %s\n",
+                    file_tmp_path, file_path, strerror(errno));
+        }
+    } else if (migration_has_failed(s)) {
+        unlink(file_tmp_path);
+    } else {
+        return;
+    }
+
+    remove_migration_state_change_notifier(&file_state_notifier);
+    g_free(file_path);
+    g_free(file_tmp_path);
+    file_path = file_tmp_path = NULL;
+}
+
+static int file_errno(MigrationState *s)
+{
+    return errno;
+}
+
+static int file_write(MigrationState *s, const void *buf, size_t size)
+{
+    off_t pos = lseek(s->fd, 0, SEEK_CUR);
+
+    /* the stream must not run into the RAM regions */
+    if (pos >= 0 && pos + size > MIGRATION_FILE_STREAM_SIZE) {
+        errno = EFBIG;
+        return -1;
+    }
+    return write(s->fd, buf, size);
+}
+
+static int file_close(MigrationState *s)
+{
+    int ret = 0;
+
+    DPRINTF("file_close\n");
+    if (s->fd != -1) {
+        if (fsync(s->fd) != 0) {
+            ret = -errno;
+            perror("migration-file: fsync");
+        }
+        if (close(s->fd) != 0 && ret == 0) {
+            ret = -errno;
+            perror("migration-file: close");
+        }
+        s->fd = -1;
+    }
+    return ret;
+}
+
+int file_start_outgoing_migration(MigrationState *s, const char *path)
+{
+    if (file_path) {
+        return -EBUSY;
+    }
+
+    file_tmp_path = g_strdup_printf("%s.XXXXXX", path);
+    s->fd = mkstemp(file_tmp_path);
+    if (s->fd == -1) {
+        int ret = -errno;
+
+        DPRINTF("Unable to create %s: %s\n", file_tmp_path, strerror(errno));
+        g_free(file_tmp_path);
+        file_tmp_path = NULL;
+        return ret;
+    }
+    qemu_set_cloexec(s->fd);
+    file_path = g_strdup(path);
+    file_state_notifier.notify = file_migration_state_changed;
+    add_migration_state_change_notifier(&file_state_notifier);
+
+    s->get_error = file_errno;
+    s->write = file_write;
+    s->close = file_close;
+    s->params.file = true;
+    s->params.file_fd = s->fd;
+
+    migrate_fd_connect(s);
+    return 0;
+}
+
+static void file_accept_incoming_migration(void *opaque)
+{
+    QEMUFile *f = opaque;
+
+    process_incoming_migration(f);
+    qemu_set_fd_handler2(qemu_stdio_fd(f), NULL, NULL, NULL, NULL);
+    qemu_fclose(f);
+    ram_load_set_file(-1, false);
+}
+
+/*
+ * "file:PATH" reads RAM with several threads, "file:PATH,mmap" maps it
+ * privately instead, so that pages are read on first access.  The file
+ * must then stay as it is while the guest runs.
+ */
+int file_start_incoming_migration(const char *spec)
+{
+    char *path = g_strdup(spec);
+    size_t len = strlen(path);
+    bool map = false;
+    int fd, ram_fd;
+    QEMUFile *f;
+
+    if (len > 5 && !strcmp(path + len - 5, ",mmap")) {
+        path[len - 5] = 0;
+        map = true;
+    }
+
+    DPRINTF("Attempting to start an incoming migration from %s\n", path);
+
+    fd = qemu_open(path, O_RDONLY);
+    if (fd == -1) {
+        DPRINTF("Unable to open %s: %s\n", path, strerror(errno));
+        g_free(path);
+        return -errno;
+    }
+    /* RAM is read with its own file offset, next to the stream */
+    ram_fd = qemu_open(path, O_RDONLY);
+    g_free(path);
+    if (ram_fd == -1) {
+        close(fd);
+        return -errno;
+    }
+
+    f = qemu_fdopen(fd, "rb");
+    if (f == NULL) {
+        DPRINTF("Unable to apply qemu wrapper to file descriptor\n");
+        close(fd);
+        close(ram_fd);
+        return -errno;
+    }
+
+    ram_load_set_file(ram_fd, map);
+    qemu_set_fd_handler2(fd, NULL, file_accept_incoming_migration, NULL, f);
+
+    return 0;
+}
@@ -0,0 +1,887 @@
+/*
+ * QEMU live migration over RDMA
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "cpu-common.h"
+#include "qemu_socket.h"
+#include "migration.h"
+#include "qemu-char.h"
+#include "hw/hw.h"
+#include "qerror.h"
+
+#include <rdma/rdma_cma.h>
+
+//#define DEBUG_MIGRATION_RDMA
+
+#ifdef DEBUG_MIGRATION_RDMA
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-rdma: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+/*
+ * The migration stream is sent as DATA control messages, with one message
+ * in flight each way: after each DATA message, the source waits until the
+ * destination loaded it and asks for more with READY.
+ *
+ * RAM pages are not part of the stream, the source writes them with RDMA
+ * WRITEs straight into the RAM blocks the destination registered and sent
+ * over in a BLOCKS message when connecting.  The QP executes the work
+ * requests in order, so the pages written before a DATA message are in
+ * place when it is loaded; and as nothing is written before READY, no page
+ * loaded from the stream can overwrite a newer copy written since.
+ */
+
+/* control messages are big endian */
+typedef struct QEMU_PACKED RDMAControlHeader {
+    uint32_t type;
+    uint32_t len;
+} RDMAControlHeader;
+
+enum {
+    RDMA_CONTROL_BLOCKS,
+    RDMA_CONTROL_DATA,
+    RDMA_CONTROL_READY,
+};
+
+typedef struct QEMU_PACKED RDMARemoteBlock {
+    char idstr[256];
+    uint64_t addr;
+    uint64_t length;
+    uint32_t rkey;
+} RDMARemoteBlock;
+
+#define RDMA_CONTROL_SIZE (512 * 1024)
+#define RDMA_CONTROL_PAYLOAD (RDMA_CONTROL_SIZE - sizeof(RDMAControlHeader))
+
+/* contiguous pages are merged into RDMA WRITEs of up to this size */
+#define RDMA_MAX_WRITE_SIZE (1024 * 1024)
+/* RDMA WRITEs in flight */
+#define RDMA_MAX_WRITES 64
+
+#define RDMA_RESOLVE_TIMEOUT_MS 10000
+
+enum {
+    RDMA_WRID_SEND = 1,
+    RDMA_WRID_RECV,
+    RDMA_WRID_WRITE,
+};
+
+typedef struct RDMALocalBlock {
+    char idstr[256];
+    uint8_t *host;
+    uint64_t length;
+    struct ibv_mr *mr;
+    /* where the destination has the block, source only */
+    bool remote;
+    uint64_t remote_addr;
+    uint32_t rkey;
+} RDMALocalBlock;
+
+typedef struct RDMAContext {
+    struct rdma_event_channel *channel;
+    struct rdma_cm_id *listen_id;
+    struct rdma_cm_id *cm_id;
+    struct ibv_pd *pd;
+    struct ibv_comp_channel *comp_channel;
+    struct ibv_cq *cq;
+    bool connected;
+    /* negative errno, the connection is unusable once set */
+    int error;
+
+    uint8_t *send_buf;
+    uint8_t *recv_buf;
+    struct ibv_mr *send_mr;
+    struct ibv_mr *recv_mr;
+    bool send_pending;
+    bool recv_pending;
+    size_t recv_len;
+
+    RDMALocalBlock *blocks;
+    int nb_blocks;
+
+    /* the DATA message being loaded, destination only */
+    size_t data_len;
+    size_t data_pos;
+    bool ready_due;
+
+    /* the pages of the next RDMA WRITE, source only */
+    const char *lookup_idstr;
+    RDMALocalBlock *lookup_block;
+    RDMALocalBlock *write_block;
+    uint64_t write_offset;
+    size_t write_len;
+    int nb_writes;
+} RDMAContext;
+
+/* the outgoing migration rdma_save_page() writes the pages of */
+static RDMAContext *outgoing_rdma;
+
+static struct addrinfo *rdma_getaddrinfo(const char *host_port, bool passive)
+{
+    struct addrinfo hints, *res;
+    const char *port;
+    char *host;
+    size_t len;
+    int ret;
+
+    port = strrchr(host_port, ':');
+    if (!port) {
+        fprintf(stderr, "rdma: host:port expected, got %s\n", host_port);
+        return NULL;
+    }
+    host = g_strndup(host_port, port - host_port);
+    port++;
+
+    len = strlen(host);
+    if (len >= 2 && host[0] == '[' && host[len - 1] == ']') {
+        memmove(host, host + 1, len - 2);
+        host[len - 2] = 0;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    hints.ai_family = PF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    ret = getaddrinfo(strlen(host) ? host : NULL, port, &hints, &res);
+    if (ret != 0) {
+        fprintf(stderr, "getaddrinfo(%s,%s): %s\n", host, port,
+                gai_strerror(ret));
+        res = NULL;
+    }
+    g_free(host);
+    return res;
+}
+
+static int rdma_wait_cm_event(RDMAContext *r, enum rdma_cm_event_type type,
+                              struct rdma_cm_id **id)
+{
+    struct rdma_cm_event *event;
+
+    if (rdma_get_cm_event(r->channel, &event) < 0) {
+        return -errno;
+    }
+    if (event->event != type) {
+        fprintf(stderr, "rdma: %s while waiting for %s\n",
+                rdma_event_str(event->event), rdma_event_str(type));
+        rdma_ack_cm_event(event);
+        return -EIO;
+    }
+    if (id) {
+        *id = event->id;
+    }
+    rdma_ack_cm_event(event);
+    return 0;
+}
+
+/* Waits for a completion event, or for the connection to go away */
+static int rdma_wait_event(RDMAContext *r)
+{
+    int nfds = MAX(r->comp_channel->fd, r->channel->fd) + 1;
+    fd_set rfds;
+    int ret;
+
+    do {
+        FD_ZERO(&rfds);
+        FD_SET(r->comp_channel->fd, &rfds);
+        FD_SET(r->channel->fd, &rfds);
+        ret = select(nfds, &rfds, NULL, NULL, NULL);
+    } while (ret == -1 && errno == EINTR);
+    if (ret < 0) {
+        return -errno;
+    }
+
+    if (FD_ISSET(r->channel->fd, &rfds)) {
+        struct rdma_cm_event *event;
+        enum rdma_cm_event_type type;
+
+        if (rdma_get_cm_event(r->channel, &event) < 0) {
+            return -errno;
+        }
+        type = event->event;
+        if (type == RDMA_CM_EVENT_CONNECT_REQUEST) {
+            /* only one migration at a time */
+            rdma_reject(event->id, NULL, 0);
+        }
+        rdma_ack_cm_event(event);
+        if (type == RDMA_CM_EVENT_DISCONNECTED ||
+            type == RDMA_CM_EVENT_DEVICE_REMOVAL) {
+            DPRINTF("%s\n", rdma_event_str(type));
+            r->connected = false;
+            return -EPIPE;
+        }
+    }
+
+    if (FD_ISSET(r->comp_channel->fd, &rfds)) {
+        struct ibv_cq *cq;
+        void *cq_context;
+
+        if (ibv_get_cq_event(r->comp_channel, &cq, &cq_context) < 0) {
+            return -EIO;
+        }
+        ibv_ack_cq_events(cq, 1);
+    }
+    return 0;
+}
+
+/* Handles the next work completion, waiting for it if needed */
+static int rdma_poll(RDMAContext *r)
+{
+    struct ibv_wc wc;
+    int ret;
+
+    for (;;) {
+        ret = ibv_poll_cq(r->cq, 1, &wc);
+        if (ret != 0) {
+            break;
+        }
+        /* the completion may come in before the notification is armed */
+        if (ibv_req_notify_cq(r->cq, 0)) {
+            return -EIO;
+        }
+        ret = ibv_poll_cq(r->cq, 1, &wc);
+        if (ret != 0) {
+            break;
+        }
+        ret = rdma_wait_event(r);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (ret < 0) {
+        return -EIO;
+    }
+
+    if (wc.status != IBV_WC_SUCCESS) {
+        fprintf(stderr, "rdma: work request %" PRIu64 " failed: %s\n",
+                (uint64_t)wc.wr_id, ibv_wc_status_str(wc.status));
+        return -EIO;
+    }
+
+    switch (wc.wr_id) {
+    case RDMA_WRID_SEND:
+        r->send_pending = false;
+        break;
+    case RDMA_WRID_RECV:
+        r->recv_pending = false;
+        r->recv_len = wc.byte_len;
+        break;
+    case RDMA_WRID_WRITE:
+        r->nb_writes--;
+        break;
+    }
+    return 0;
+}
+
+static int rdma_post_recv(RDMAContext *r)
+{
+    struct ibv_recv_wr wr, *bad_wr;
+    struct ibv_sge sge;
+
+    sge.addr = (uintptr_t)r->recv_buf;
+    sge.length = RDMA_CONTROL_SIZE;
+    sge.lkey = r->recv_mr->lkey;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = RDMA_WRID_RECV;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+
+    if (ibv_post_recv(r->cm_id->qp, &wr, &bad_wr)) {
+        return -EIO;
+    }
+    r->recv_pending = true;
+    return 0;
+}
+
+/* Sends the @len bytes of payload the caller put after the header */
+static int rdma_send_control(RDMAContext *r, uint32_t type, size_t len)
+{
+    RDMAControlHeader *hdr = (RDMAControlHeader *)r->send_buf;
+    struct ibv_send_wr wr, *bad_wr;
+    struct ibv_sge sge;
+
+    hdr->type = cpu_to_be32(type);
+    hdr->len = cpu_to_be32(len);
+
+    sge.addr = (uintptr_t)r->send_buf;
+    sge.length = sizeof(*hdr) + len;
+    sge.lkey = r->send_mr->lkey;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = RDMA_WRID_SEND;
+    wr.opcode = IBV_WR_SEND;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+
+    if (ibv_post_send(r->cm_id->qp, &wr, &bad_wr)) {
+        return -EIO;
+    }
+    r->send_pending = true;
+
+    while (r->send_pending) {
+        int ret = rdma_poll(r);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Waits for the next control message, which must be of @type.  Returns
+ * the length of its payload, which stays valid until the next receive is
+ * posted.
+ */
+static int rdma_recv_control(RDMAContext *r, uint32_t type)
+{
+    RDMAControlHeader *hdr = (RDMAControlHeader *)r->recv_buf;
+    uint32_t len;
+
+    while (r->recv_pending) {
+        int ret = rdma_poll(r);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (r->recv_len < sizeof(*hdr)) {
+        fprintf(stderr, "rdma: truncated control message\n");
+        return -EINVAL;
+    }
+    len = be32_to_cpu(hdr->len);
+    if (be32_to_cpu(hdr->type) != type || len > r->recv_len - sizeof(*hdr)) {
+        fprintf(stderr, "rdma: unexpected control message %u\n",
+                be32_to_cpu(hdr->type));
+        return -EINVAL;
+    }
+    return len;
+}
+
+static void rdma_add_block(const char *idstr, void *host_addr,
+                           ram_addr_t length, void *opaque)
+{
+    RDMAContext *r = opaque;
+    RDMALocalBlock *block;
+
+    r->blocks = g_realloc(r->blocks, (r->nb_blocks + 1) * sizeof(*block));
+    block = &r->blocks[r->nb_blocks++];
+    memset(block, 0, sizeof(*block));
+    pstrcpy(block->idstr, sizeof(block->idstr), idstr);
+    block->host = host_addr;
+    block->length = length;
+}
+
+static RDMALocalBlock *rdma_find_block(RDMAContext *r, const char *idstr)
+{
+    int i;
+
+    for (i = 0; i < r->nb_blocks; i++) {
+        if (!strcmp(r->blocks[i].idstr, idstr)) {
+            return &r->blocks[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Sets up the queue pair of the connection, and registers the control
+ * buffers and every RAM block with @access.
+ */
+static int rdma_init_verbs(RDMAContext *r, int access)
+{
+    struct ibv_context *verbs = r->cm_id->verbs;
+    struct ibv_qp_init_attr attr;
+    int i;
+
+    r->pd = ibv_alloc_pd(verbs);
+    if (!r->pd) {
+        return -EIO;
+    }
+    r->comp_channel = ibv_create_comp_channel(verbs);
+    if (!r->comp_channel) {
+        return -EIO;
+    }
+    /* the writes in flight, the control SEND and RECV */
+    r->cq = ibv_create_cq(verbs, RDMA_MAX_WRITES + 2, NULL,
+                          r->comp_channel, 0);
+    if (!r->cq) {
+        return -EIO;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.send_cq = r->cq;
+    attr.recv_cq = r->cq;
+    attr.qp_type = IBV_QPT_RC;
+    attr.cap.max_send_wr = RDMA_MAX_WRITES + 1;
+    attr.cap.max_recv_wr = 1;
+    attr.cap.max_send_sge = 1;
+    attr.cap.max_recv_sge = 1;
+    if (rdma_create_qp(r->cm_id, r->pd, &attr) < 0) {
+        return -errno;
+    }
+
+    r->send_buf = g_malloc(RDMA_CONTROL_SIZE);
+    r->recv_buf = g_malloc(RDMA_CONTROL_SIZE);
+    r->send_mr = ibv_reg_mr(r->pd, r->send_buf, RDMA_CONTROL_SIZE, 0);
+    r->recv_mr = ibv_reg_mr(r->pd, r->recv_buf, RDMA_CONTROL_SIZE,
+                            IBV_ACCESS_LOCAL_WRITE);
+    if (!r->send_mr || !r->recv_mr) {
+        return -errno;
+    }
+
+    qemu_ram_foreach_block(rdma_add_block, r);
+    for (i = 0; i < r->nb_blocks; i++) {
+        RDMALocalBlock *block = &r->blocks[i];
+
+        block->mr = ibv_reg_mr(r->pd, block->host, block->length, access);
+        if (!block->mr) {
+            fprintf(stderr, "rdma: could not register RAM block %s: %s\n",
+                    block->idstr, strerror(errno));
+            return -errno;
+        }
+    }
+    return 0;
+}
+
+static void rdma_conn_param_init(struct rdma_conn_param *param)
+{
+    memset(param, 0, sizeof(*param));
+    param->flow_control = 1;
+    param->retry_count = 7;
+    /* retry for as long as it takes the peer to post a receive */
+    param->rnr_retry_count = 7;
+}
+
+static void rdma_cleanup(RDMAContext *r)
+{
+    int i;
+
+    if (r->connected) {
+        rdma_disconnect(r->cm_id);
+    }
+    if (r->cm_id && r->cm_id->qp) {
+        rdma_destroy_qp(r->cm_id);
+    }
+    for (i = 0; i < r->nb_blocks; i++) {
+        if (r->blocks[i].mr) {
+            ibv_dereg_mr(r->blocks[i].mr);
+        }
+    }
+    if (r->send_mr) {
+        ibv_dereg_mr(r->send_mr);
+    }
+    if (r->recv_mr) {
+        ibv_dereg_mr(r->recv_mr);
+    }
+    if (r->cq) {
+        ibv_destroy_cq(r->cq);
+    }
+    if (r->comp_channel) {
+        ibv_destroy_comp_channel(r->comp_channel);
+    }
+    if (r->pd) {
+        ibv_dealloc_pd(r->pd);
+    }
+    if (r->cm_id) {
+        rdma_destroy_id(r->cm_id);
+    }
+    if (r->listen_id) {
+        rdma_destroy_id(r->listen_id);
+    }
+    if (r->channel) {
+        rdma_destroy_event_channel(r->channel);
+    }
+    g_free(r->blocks);
+    g_free(r->send_buf);
+    g_free(r->recv_buf);
+    g_free(r);
+}
+
+/* outgoing */
+
+static int rdma_post_write(RDMAContext *r)
+{
+    RDMALocalBlock *block = r->write_block;
+    struct ibv_send_wr wr, *bad_wr;
+    struct ibv_sge sge;
+
+    if (!r->write_len) {
+        return 0;
+    }
+
+    while (r->nb_writes >= RDMA_MAX_WRITES) {
+        int ret = rdma_poll(r);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    sge.addr = (uintptr_t)(block->host + r->write_offset);
+    sge.length = r->write_len;
+    sge.lkey = block->mr->lkey;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = RDMA_WRID_WRITE;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.wr.rdma.remote_addr = block->remote_addr + r->write_offset;
+    wr.wr.rdma.rkey = block->rkey;
+
+    if (ibv_post_send(r->cm_id->qp, &wr, &bad_wr)) {
+        return -EIO;
+    }
+    r->nb_writes++;
+    r->write_len = 0;
+    return 0;
+}
+
+int rdma_save_page(const char *idstr, uint64_t offset, size_t size)
+{
+    RDMAContext *r = outgoing_rdma;
+    RDMALocalBlock *block;
+    int ret;
+
+    if (!r) {
+        return 0;
+    }
+    if (r->error) {
+        return r->error;
+    }
+
+    if (idstr != r->lookup_idstr) {
+        r->lookup_idstr = idstr;
+        r->lookup_block = rdma_find_block(r, idstr);
+    }
+    block = r->lookup_block;
+    if (!block || !block->remote || offset + size > block->length) {
+        return 0;
+    }
+
+    if (block == r->write_block && offset == r->write_offset + r->write_len &&
+        r->write_len + size <= RDMA_MAX_WRITE_SIZE) {
+        r->write_len += size;
+        return size;
+    }
+
+    ret = rdma_post_write(r);
+    if (ret < 0) {
+        r->error = ret;
+        return ret;
+    }
+    r->write_block = block;
+    r->write_offset = offset;
+    r->write_len = size;
+    return size;
+}
+
+static int rdma_errno(MigrationState *s)
+{
+    RDMAContext *r = s->opaque;
+
+    return r && r->error ? -r->error : EIO;
+}
+
+static int rdma_write(MigrationState *s, const void *buf, size_t size)
+{
+    RDMAContext *r = s->opaque;
+    size_t len = MIN(size, RDMA_CONTROL_PAYLOAD);
+    int ret = r->error;
+
+    /* the pages written so far go before the stream that follows them */
+    if (ret == 0) {
+        ret = rdma_post_write(r);
+    }
+    if (ret == 0) {
+        memcpy(r->send_buf + sizeof(RDMAControlHeader), buf, len);
+        ret = rdma_send_control(r, RDMA_CONTROL_DATA, len);
+    }
+    if (ret == 0) {
+        ret = rdma_recv_control(r, RDMA_CONTROL_READY);
+    }
+    if (ret >= 0) {
+        ret = rdma_post_recv(r);
+    }
+    if (ret < 0) {
+        DPRINTF("write failed: %s\n", strerror(-ret));
+        r->error = ret;
+        return -1;
+    }
+    return len;
+}
+
+static int rdma_close(MigrationState *s)
+{
+    RDMAContext *r = s->opaque;
+    int ret = 0;
+
+    DPRINTF("rdma_close\n");
+    if (r) {
+        ret = r->error;
+        outgoing_rdma = NULL;
+        rdma_cleanup(r);
+        s->opaque = NULL;
+    }
+    return ret;
+}
+
+static int rdma_recv_blocks(RDMAContext *r)
+{
+    RDMARemoteBlock *rb;
+    int i, nb;
+    int ret;
+
+    ret = rdma_recv_control(r, RDMA_CONTROL_BLOCKS);
+    if (ret < 0) {
+        return ret;
+    }
+    rb = (RDMARemoteBlock *)(r->recv_buf + sizeof(RDMAControlHeader));
+    nb = ret / sizeof(*rb);
+
+    /* blocks the destination does not have go in the stream, and
+       ram_load() reports them */
+    for (i = 0; i < nb; i++) {
+        RDMALocalBlock *block;
+
+        rb[i].idstr[sizeof(rb[i].idstr) - 1] = 0;
+        block = rdma_find_block(r, rb[i].idstr);
+        if (!block || be64_to_cpu(rb[i].length) != block->length) {
+            continue;
+        }
+        block->remote = true;
+        block->remote_addr = be64_to_cpu(rb[i].addr);
+        block->rkey = be32_to_cpu(rb[i].rkey);
+    }
+    return 0;
+}
+
+int rdma_start_outgoing_migration(MigrationState *s, const char *host_port,
+                                  Error **errp)
+{
+    struct rdma_conn_param param;
+    struct addrinfo *res;
+    RDMAContext *r;
+    int ret;
+
+    r = g_malloc0(sizeof(*r));
+    s->get_error = rdma_errno;
+    s->write = rdma_write;
+    s->close = rdma_close;
+    s->opaque = r;
+    s->fd = -1;
+
+    res = rdma_getaddrinfo(host_port, false);
+    if (!res) {
+        goto err;
+    }
+    r->channel = rdma_create_event_channel();
+    if (!r->channel ||
+        rdma_create_id(r->channel, &r->cm_id, NULL, RDMA_PS_TCP) < 0) {
+        freeaddrinfo(res);
+        goto err;
+    }
+    ret = rdma_resolve_addr(r->cm_id, NULL, res->ai_addr,
+                            RDMA_RESOLVE_TIMEOUT_MS);
+    freeaddrinfo(res);
+    if (ret < 0 ||
+        rdma_wait_cm_event(r, RDMA_CM_EVENT_ADDR_RESOLVED, NULL) < 0) {
+        goto err;
+    }
+    if (rdma_resolve_route(r->cm_id, RDMA_RESOLVE_TIMEOUT_MS) < 0 ||
+        rdma_wait_cm_event(r, RDMA_CM_EVENT_ROUTE_RESOLVED, NULL) < 0) {
+        goto err;
+    }
+
+    /* the RAM blocks are only read from */
+    if (rdma_init_verbs(r, 0) < 0 || rdma_post_recv(r) < 0) {
+        goto err;
+    }
+
+    rdma_conn_param_init(&param);
+    if (rdma_connect(r->cm_id, &param) < 0 ||
+        rdma_wait_cm_event(r, RDMA_CM_EVENT_ESTABLISHED, NULL) < 0) {
+        goto err;
+    }
+    r->connected = true;
+
+    if (rdma_recv_blocks(r) < 0 || rdma_post_recv(r) < 0) {
+        goto err;
+    }
+
+    DPRINTF("connected\n");
+    outgoing_rdma = r;
+    migrate_fd_connect(s);
+    return 0;
+
+err:
+    fprintf(stderr, "rdma: could not connect to %s\n", host_port);
+    error_set(errp, QERR_SOCKET_CONNECT_FAILED);
+    rdma_cleanup(r);
+    s->opaque = NULL;
+    migrate_fd_error(s);
+    return -1;
+}
+
+/* incoming */
+
+static int rdma_send_blocks(RDMAContext *r)
+{
+    RDMARemoteBlock *rb;
+    int i;
+
+    if (r->nb_blocks * sizeof(*rb) > RDMA_CONTROL_PAYLOAD) {
+        fprintf(stderr, "rdma: too many RAM blocks\n");
+        return -E2BIG;
+    }
+
+    rb = (RDMARemoteBlock *)(r->send_buf + sizeof(RDMAControlHeader));
+    for (i = 0; i < r->nb_blocks; i++) {
+        memset(&rb[i], 0, sizeof(rb[i]));
+        pstrcpy(rb[i].idstr, sizeof(rb[i].idstr), r->blocks[i].idstr);
+        rb[i].addr = cpu_to_be64((uintptr_t)r->blocks[i].host);
+        rb[i].length = cpu_to_be64(r->blocks[i].length);
+        rb[i].rkey = cpu_to_be32(r->blocks[i].mr->rkey);
+    }
+    return rdma_send_control(r, RDMA_CONTROL_BLOCKS,
+                             r->nb_blocks * sizeof(*rb));
+}
+
+static int rdma_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    RDMAContext *r = opaque;
+    int ret;
+
+    if (r->error) {
+        return r->error;
+    }
+
+    if (r->data_pos == r->data_len) {
+        /* all of the last message is loaded, the source can go on */
+        if (r->ready_due) {
+            r->ready_due = false;
+            ret = rdma_post_recv(r);
+            if (ret == 0) {
+                ret = rdma_send_control(r, RDMA_CONTROL_READY, 0);
+            }
+            if (ret < 0) {
+                r->error = ret;
+                return ret;
+            }
+        }
+        ret = rdma_recv_control(r, RDMA_CONTROL_DATA);
+        if (ret < 0) {
+            r->error = ret;
+            return ret;
+        }
+        r->data_len = ret;
+        r->data_pos = 0;
+        r->ready_due = true;
+    }
+
+    size = MIN((size_t)size, r->data_len - r->data_pos);
+    memcpy(buf, r->recv_buf + sizeof(RDMAControlHeader) + r->data_pos, size);
+    r->data_pos += size;
+    return size;
+}
+
+static int rdma_close_incoming(void *opaque)
+{
+    RDMAContext *r = opaque;
+
+    /* the source waits for its last message to be loaded */
+    if (!r->error && r->ready_due) {
+        rdma_send_control(r, RDMA_CONTROL_READY, 0);
+    }
+    rdma_cleanup(r);
+    return 0;
+}
+
+static void rdma_accept_incoming_migration(void *opaque)
+{
+    RDMAContext *r = opaque;
+    struct rdma_conn_param param;
+    QEMUFile *f;
+
+    /* the connection is set up and loaded from here, blocking */
+    qemu_set_fd_handler2(r->channel->fd, NULL, NULL, NULL, NULL);
+
+    if (rdma_wait_cm_event(r, RDMA_CM_EVENT_CONNECT_REQUEST, &r->cm_id) < 0) {
+        goto err;
+    }
+    if (rdma_init_verbs(r, IBV_ACCESS_LOCAL_WRITE |
+                           IBV_ACCESS_REMOTE_WRITE) < 0 ||
+        rdma_post_recv(r) < 0) {
+        rdma_reject(r->cm_id, NULL, 0);
+        goto err;
+    }
+
+    rdma_conn_param_init(&param);
+    if (rdma_accept(r->cm_id, &param) < 0 ||
+        rdma_wait_cm_event(r, RDMA_CM_EVENT_ESTABLISHED, NULL) < 0) {
+        goto err;
+    }
+    r->connected = true;
+
+    if (rdma_send_blocks(r) < 0) {
+        goto err;
+    }
+
+    DPRINTF("accepted migration\n");
+
+    f = qemu_fopen_ops(r, NULL, rdma_get_buffer, rdma_close_incoming,
+                       NULL, NULL, NULL);
+    /* postcopy is not supported over RDMA, see qmp_migrate() */
+    process_incoming_migration(f);
+    qemu_fclose(f);
+    return;
+
+err:
+    fprintf(stderr, "could not accept migration connection\n");
+    rdma_cleanup(r);
+}
+
+int rdma_start_incoming_migration(const char *host_port, Error **errp)
+{
+    struct addrinfo *res;
+    RDMAContext *r;
+    int ret;
+
+    r = g_malloc0(sizeof(*r));
+
+    res = rdma_getaddrinfo(host_port, true);
+    if (!res) {
+        goto err;
+    }
+    r->channel = rdma_create_event_channel();
+    if (!r->channel ||
+        rdma_create_id(r->channel, &r->listen_id, NULL, RDMA_PS_TCP) < 0) {
+        freeaddrinfo(res);
+        goto err;
+    }
+    ret = rdma_bind_addr(r->listen_id, res->ai_addr);
+    freeaddrinfo(res);
+    if (ret < 0 || rdma_listen(r->listen_id, 1) < 0) {
+        goto err;
+    }
+
+    qemu_set_fd_handler2(r->channel->fd, NULL,
+                         rdma_accept_incoming_migration, NULL, r);
+    return 0;
+
+err:
+    fprintf(stderr, "rdma: could not listen on %s\n", host_port);
+    error_set(errp, QERR_SOCKET_LISTEN_FAILED);
+    rdma_cleanup(r);
+    return -1;
+}
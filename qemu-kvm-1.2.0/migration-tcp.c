@@ -30,6 +30,11 @@
     do { } while (0)
 #endif
 
+/* where the multifd channels of the outgoing migration connect to */
+static char *outgoing_host_port;
+/* listening socket of the incoming migration while it is loaded */
+static int incoming_listen_fd = -1;
+
 static int socket_errno(MigrationState *s)
 {
     return socket_error();
@@ -92,6 +97,9 @@ int tcp_start_outgoing_migration(MigrationState *s, const char *host_port,
     s->write = socket_write;
     s->close = tcp_close;
 
+    g_free(outgoing_host_port);
+    outgoing_host_port = g_strdup(host_port);
+
     s->fd = inet_connect(host_port, false, &in_progress, errp);
     if (error_is_set(errp)) {
         migrate_fd_error(s);
@@ -116,6 +124,9 @@ int tcp_start_outgoing_precopy_cloning(MigrationState *s, const char *host_port,
     s->write = socket_write;                 // write handler
     s->close = tcp_close;                    // close handler
 
+    g_free(outgoing_host_port);
+    outgoing_host_port = g_strdup(host_port);
+
     bool in_progress;
     // initialize the socket and connect to destination
     s->fd = inet_connect(host_port, false, &in_progress, errp);
@@ -135,6 +146,76 @@ int tcp_start_outgoing_precopy_cloning(MigrationState *s, const char *host_port,
 }
 // end_pavan
 
+/*
+ * Multifd channels connect to the same address as the migration itself.
+ * The connection is not waited for: the destination only accepts it once
+ * the migration stream asks it to, and its listen backlog is short.
+ * Returns the socket or -1.
+ */
+int tcp_connect_outgoing_channel(Error **errp)
+{
+    bool in_progress;
+
+    return inet_connect(outgoing_host_port, false, &in_progress, errp);
+}
+
+/*
+ * Waits for a socket from tcp_connect_outgoing_channel() to be connected,
+ * and makes it blocking.  Returns 0 or a negative errno.
+ */
+int tcp_finish_outgoing_channel(int fd)
+{
+    fd_set wfds;
+    int val, ret;
+    socklen_t valsize = sizeof(val);
+
+    do {
+        FD_ZERO(&wfds);
+        FD_SET(fd, &wfds);
+        ret = select(fd + 1, NULL, &wfds, NULL, NULL);
+    } while (ret == -1 && socket_error() == EINTR);
+    if (ret < 0) {
+        return -socket_error();
+    }
+
+    do {
+        ret = getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *) &val, &valsize);
+    } while (ret == -1 && socket_error() == EINTR);
+    if (ret < 0) {
+        return -socket_error();
+    }
+    if (val) {
+        DPRINTF("error connecting channel %d\n", val);
+        return -val;
+    }
+
+    socket_set_block(fd);
+    return 0;
+}
+
+/*
+ * Accepts a multifd channel of the migration being loaded, blocking.
+ * Returns the socket or -1.
+ */
+int tcp_accept_incoming_channel(void)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int c;
+
+    if (incoming_listen_fd == -1) {
+        return -1;
+    }
+
+    do {
+        c = qemu_accept(incoming_listen_fd, (struct sockaddr *)&addr,
+                        &addrlen);
+    } while (c == -1 && socket_error() == EINTR);
+
+    DPRINTF("accepted channel %d\n", c);
+    return c;
+}
+
 static void tcp_accept_incoming_migration(void *opaque)
 {
     struct sockaddr_in addr;
@@ -160,11 +241,16 @@ static void tcp_accept_incoming_migration(void *opaque)
         goto out;
     }
 
-    process_incoming_migration(f);
+    incoming_listen_fd = s;
+    if (process_incoming_migration(f)) {
+        /* the postcopy thread owns the connection now */
+        goto out2;
+    }
     qemu_fclose(f);
 out:
     close(c);
 out2:
+    incoming_listen_fd = -1;
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
     close(s);
 }
@@ -178,6 +264,9 @@ int tcp_start_incoming_migration(const char *host_port, Error **errp)
     if (s < 0) {
         return -1;
     }
+    /* multifd channels connect before the migration stream gets to
+       accepting them, don't make them retry */
+    listen(s, SOMAXCONN);
 
     qemu_set_fd_handler2(s, NULL, tcp_accept_incoming_migration, NULL,
                          (void *)(intptr_t)s);
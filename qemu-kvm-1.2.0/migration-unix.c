@@ -143,7 +143,10 @@ static void unix_accept_incoming_migration(void *opaque)
         goto out;
     }
 
-    process_incoming_migration(f);
+    if (process_incoming_migration(f)) {
+        /* the postcopy thread owns the connection now */
+        goto out2;
+    }
     qemu_fclose(f);
 out:
     close(c);
@@ -22,6 +22,7 @@
 #include "qemu_socket.h"
 #include "block-migration.h"
 #include "qmp-commands.h"
+#include "cpus.h"
 
 //#define DEBUG_MIGRATION
 
@@ -43,9 +44,20 @@ enum {
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration speed throttling */
 
+/* how often the bandwidth, and so what fits in the downtime, is measured */
+#define BANDWIDTH_PERIOD 100 /* ms */
+
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Migration page compression default and maximum thread counts */
+#define DEFAULT_MIGRATE_COMPRESS_THREADS 4
+#define MAX_MIGRATE_COMPRESS_THREADS 255
+
+/* Migration multifd default and maximum connection counts */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 4
+#define MAX_MIGRATE_MULTIFD_CHANNELS 16
+
 //Mahesh:CloudClone:changes
 //True indicates pre copy cloning is in progress at destination.
 //Source need to use opType in MigrationState
@@ -64,6 +76,8 @@ static MigrationState *migrate_get_current(void)
         .state = MIG_STATE_SETUP,
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
+        .compress_threads = DEFAULT_MIGRATE_COMPRESS_THREADS,
+        .multifd_channels = DEFAULT_MIGRATE_MULTIFD_CHANNELS,
     };
 
     return &current_migration;
@@ -76,6 +90,10 @@ int qemu_start_incoming_migration(const char *uri, Error **errp)
 
     if (strstart(uri, "tcp:", &p))
         ret = tcp_start_incoming_migration(p, errp);
+#ifdef CONFIG_RDMA
+    else if (strstart(uri, "rdma:", &p))
+        ret = rdma_start_incoming_migration(p, errp);
+#endif
 #if !defined(WIN32)
     else if (strstart(uri, "exec:", &p))
         ret =  exec_start_incoming_migration(p);
@@ -83,6 +101,8 @@ int qemu_start_incoming_migration(const char *uri, Error **errp)
         ret = unix_start_incoming_migration(p);
     else if (strstart(uri, "fd:", &p))
         ret = fd_start_incoming_migration(p);
+    else if (strstart(uri, "file:", &p))
+        ret = file_start_incoming_migration(p);
 #endif
     else {
         fprintf(stderr, "unknown migration protocol: %s\n", uri);
@@ -91,12 +111,25 @@ int qemu_start_incoming_migration(const char *uri, Error **errp)
     return ret;
 }
 
-void process_incoming_migration(QEMUFile *f)
+/*
+ * Returns 1 if the postcopy phase took over @f, in which case the caller
+ * must leave the file and its socket open, 0 otherwise.
+ */
+int process_incoming_migration(QEMUFile *f)
 {
+    int postcopy = 0;
+
     if (qemu_loadvm_state(f) < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(0);
     }
+    if (ram_postcopy_incoming_pending()) {
+        if (ram_postcopy_incoming_start(f) < 0) {
+            fprintf(stderr, "could not start postcopy migration\n");
+            exit(1);
+        }
+        postcopy = 1;
+    }
     qemu_announce_self();
     DPRINTF("successfully loaded vm state\n");
 
@@ -116,6 +149,8 @@ void process_incoming_migration(QEMUFile *f)
     {
       signal_end_cloning();
     }
+
+    return postcopy;
 }
 
 /* amount of nanoseconds we are willing to wait for migration to be down.
@@ -162,10 +197,27 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->bytes = xbzrle_mig_bytes_transferred();
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
+        info->xbzrle_cache->cache_hit = xbzrle_mig_pages_cache_hit();
+        info->xbzrle_cache->cache_evictions =
+            xbzrle_mig_pages_cache_evictions();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
     }
 }
 
+static void get_dirty_heat_stats(MigrationInfo *info)
+{
+    info->dirty_heat = ram_dirty_heat_stats();
+    info->has_dirty_heat = info->dirty_heat != NULL;
+}
+
+static void get_compress_thread_stats(MigrationInfo *info)
+{
+    if (migrate_use_compress()) {
+        info->compress_threads = compress_mig_thread_stats();
+        info->has_compress_threads = info->compress_threads != NULL;
+    }
+}
+
 MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
@@ -190,6 +242,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->duplicate = dup_mig_pages_transferred();
         info->ram->normal = norm_mig_pages_transferred();
         info->ram->normal_bytes = norm_mig_bytes_transferred();
+        info->ram->skipped = skipped_mig_pages_transferred();
 
         if (blk_mig_active()) {
             info->has_disk = true;
@@ -200,9 +253,18 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_compress_thread_stats(info);
+        get_dirty_heat_stats(info);
+
+        if (cpu_throttle_active()) {
+            info->has_cpu_throttle_percentage = true;
+            info->cpu_throttle_percentage = cpu_throttle_get_percentage();
+        }
         break;
     case MIG_STATE_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_compress_thread_stats(info);
+        get_dirty_heat_stats(info);
 
         info->has_status = true;
         info->status = g_strdup("completed");
@@ -216,6 +278,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->duplicate = dup_mig_pages_transferred();
         info->ram->normal = norm_mig_pages_transferred();
         info->ram->normal_bytes = norm_mig_bytes_transferred();
+        info->ram->skipped = skipped_mig_pages_transferred();
         break;
     case MIG_STATE_ERROR:
         info->has_status = true;
@@ -294,13 +357,79 @@ static void migrate_fd_completed(MigrationState *s)
 #endif
 }
 
-static void migrate_fd_put_notify(void *opaque)
+/* the descriptor is blocking, check first that a read won't block */
+static bool migrate_fd_wait_readable(MigrationState *s, int64_t timeout_ms)
 {
-    MigrationState *s = opaque;
+    struct timeval tv;
+    fd_set rfds;
+    int ret;
 
-    qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
-    qemu_file_put_notify(s->file);
-    if (s->file && qemu_file_get_error(s->file)) {
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    do {
+        FD_ZERO(&rfds);
+        FD_SET(s->fd, &rfds);
+        ret = select(s->fd + 1, &rfds, NULL, NULL, &tv);
+    } while (ret == -1 && (s->get_error(s)) == EINTR);
+
+    /* errors are reported by the read */
+    return ret != 0;
+}
+
+/* Called with the iothread lock held */
+static void migrate_postcopy_read_requests(MigrationState *s)
+{
+    ssize_t ret;
+    int pos = 0;
+
+    if (!migrate_fd_wait_readable(s, 0)) {
+        return;
+    }
+
+    do {
+        ret = qemu_recv(s->fd, s->postcopy_req + s->postcopy_req_len,
+                        sizeof(s->postcopy_req) - s->postcopy_req_len, 0);
+    } while (ret == -1 && socket_error() == EINTR);
+
+    if (ret == -1 && socket_error() == EAGAIN) {
+        return;
+    }
+    if (ret <= 0) {
+        DPRINTF("postcopy request channel closed\n");
+        migrate_fd_error(s);
+        return;
+    }
+    s->postcopy_req_len += ret;
+
+    /* Requests are: idstr length (1 byte), idstr, page offset (be64) */
+    while (s->postcopy_req_len - pos >= 1) {
+        uint8_t *req = s->postcopy_req + pos;
+        char idstr[256];
+        uint64_t offset = 0;
+        int len = req[0];
+        int i;
+
+        if (s->postcopy_req_len - pos < 1 + len + 8) {
+            break;
+        }
+        memcpy(idstr, req + 1, len);
+        idstr[len] = 0;
+        for (i = 0; i < 8; i++) {
+            offset = (offset << 8) | req[1 + len + i];
+        }
+        pos += 1 + len + 8;
+
+        if (ram_postcopy_request_page(s->file, idstr, offset) < 0) {
+            fprintf(stderr, "bad postcopy page request for %s\n", idstr);
+            migrate_fd_error(s);
+            return;
+        }
+    }
+    memmove(s->postcopy_req, s->postcopy_req + pos, s->postcopy_req_len - pos);
+    s->postcopy_req_len -= pos;
+
+    qemu_fflush(s->file);
+    if (qemu_file_get_error(s->file)) {
         migrate_fd_error(s);
     }
 }
@@ -322,36 +451,172 @@ static ssize_t migrate_fd_put_buffer(void *opaque, const void *data,
     if (ret == -1)
         ret = -(s->get_error(s));
 
-    if (ret == -EAGAIN) {
-        qemu_set_fd_handler2(s->fd, NULL, NULL, migrate_fd_put_notify, s);
+    return ret;
+}
+
+/*
+ * migrate_fd_cancel() only sets the state, the migration thread cleans
+ * up the next time it takes the iothread lock.  Returns true if the
+ * migration was cancelled.
+ */
+static bool migrate_fd_check_cancelled(MigrationState *s)
+{
+    if (s->state != MIG_STATE_CANCELLED) {
+        return false;
+    }
+    if (s->file) {
+        DPRINTF("cleaning up cancelled migration\n");
+        if (s->started) {
+            qemu_savevm_state_cancel(s->file);
+        }
+        migrate_fd_cleanup(s);
     }
+    return true;
+}
 
-    return ret;
+static void migrate_update_max_size(MigrationState *s, int64_t now)
+{
+    /* waiting for the guest to dirty memory is not transfer time */
+    int64_t time_spent = MAX(now - s->period_start - s->period_idle, 1);
+    double bandwidth;
+
+    /* bytes per ms, the downtime is in ns */
+    bandwidth = (double)(qemu_ftell(s->file) - s->period_bytes) / time_spent;
+    s->max_size = bandwidth * migrate_max_downtime() / 1000000;
+    DPRINTF("bandwidth %g bytes/ms, max size %" PRIu64 "\n",
+            bandwidth, s->max_size);
+
+    s->period_start = now;
+    s->period_bytes = qemu_ftell(s->file);
+    s->period_idle = 0;
 }
 
+/* Called from the migration thread without the iothread lock */
+static void migrate_fd_iterate(MigrationState *s)
+{
+    int ret;
+
+    DPRINTF("iterate\n");
+    ret = qemu_savevm_state_iterate(s->file);
+    if (ret < 0 || s->state != MIG_STATE_ACTIVE) {
+        qemu_mutex_lock_iothread();
+        if (!migrate_fd_check_cancelled(s) && ret < 0) {
+            qemu_savevm_state_cancel(s->file);
+            migrate_fd_error(s);
+        }
+        qemu_mutex_unlock_iothread();
+    } else if (ret == 1) {
+        /* nothing left until the next sync of the dirty state */
+        int64_t delay = s->period_start + BANDWIDTH_PERIOD -
+                        qemu_get_clock_ms(rt_clock);
+
+        if (delay > 0) {
+            g_usleep(delay * 1000);
+            s->period_idle += delay;
+        }
+    }
+}
+
+/*
+ * Called from the migration thread.  The iothread lock is only taken
+ * once per BANDWIDTH_PERIOD, to sync the dirty state and check for the
+ * end of the migration; the iterations in between run without it, so
+ * that the vCPUs and devices keep running meanwhile.
+ */
 static void migrate_fd_put_ready(void *opaque)
 {
     MigrationState *s = opaque;
+    int64_t now = qemu_get_clock_ms(rt_clock);
+    uint64_t pending;
+    bool converged;
     int ret;
 
+    if (s->started && !s->postcopy && s->state == MIG_STATE_ACTIVE &&
+        now < s->period_start + BANDWIDTH_PERIOD) {
+        migrate_fd_iterate(s);
+        return;
+    }
+
+    qemu_mutex_lock_iothread();
     if (s->state != MIG_STATE_ACTIVE) {
         DPRINTF("put_ready returning because of non-active state\n");
+        migrate_fd_check_cancelled(s);
+        goto out;
+    }
+    if (qemu_file_get_error(s->file)) {
+        migrate_fd_error(s);
+        goto out;
+    }
+
+    if (!s->started) {
+        DPRINTF("beginning savevm\n");
+        s->started = true;
+        ret = qemu_savevm_state_begin(s->file, &s->params);
+        if (ret < 0) {
+            DPRINTF("failed, %d\n", ret);
+            migrate_fd_error(s);
+            goto out;
+        }
+        s->period_start = qemu_get_clock_ms(rt_clock);
+        s->period_bytes = qemu_ftell(s->file);
+        s->period_idle = 0;
+        /* let the buffered file send the setup sections before iterating,
+           the destination needs them to accept the multifd channels */
+        goto out;
+    }
+
+    if (s->postcopy) {
+        /* The destination is running, the source stays stopped whatever
+           happens from here on. */
+        migrate_postcopy_read_requests(s);
+        if (s->state != MIG_STATE_ACTIVE) {
+            goto out;
+        }
+        ret = ram_postcopy_iterate(s->file);
+        if (ret < 0) {
+            migrate_fd_error(s);
+        } else if (ret == 1) {
+            DPRINTF("postcopy done\n");
+            migrate_fd_completed(s);
+            s->total_time = qemu_get_clock_ms(rt_clock) - s->total_time;
+        }
+        goto out;
+    }
+
+    migrate_update_max_size(s, now);
+    pending = qemu_savevm_state_pending(s->file, s->max_size);
+    DPRINTF("pending %" PRIu64 " max %" PRIu64 "\n", pending, s->max_size);
+    converged = !pending || pending < s->max_size;
+
+    if (!converged && !(migrate_use_postcopy() && s->opType == MIGRATION &&
+                        ram_postcopy_ready())) {
+        qemu_mutex_unlock_iothread();
+        migrate_fd_iterate(s);
         return;
     }
 
-    DPRINTF("iterate\n");
-    ret = qemu_savevm_state_iterate(s->file);
-    if (ret < 0) {
-        migrate_fd_error(s);
-    } else if (ret == 1) {
+    if (s->opType == CLONING) {
+        cloning_stop_n_copy_phase(s);
+        goto out;
+    }
+
+    {
         int old_vm_running = runstate_is_running();
 
         DPRINTF("done iterating\n");
         qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
         vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
 
+        if (!converged) {
+            DPRINTF("switching to postcopy\n");
+            ram_postcopy_begin();
+        }
         if (qemu_savevm_state_complete(s->file) < 0) {
             migrate_fd_error(s);
+        } else if (!converged) {
+            s->postcopy = true;
+            qemu_fflush(s->file);
+            goto out;
         } else {
             migrate_fd_completed(s);
         }
@@ -362,6 +627,9 @@ static void migrate_fd_put_ready(void *opaque)
             }
         }
     }
+
+out:
+    qemu_mutex_unlock_iothread();
 }
 
 static void migrate_fd_cancel(MigrationState *s)
@@ -373,31 +641,28 @@ static void migrate_fd_cancel(MigrationState *s)
 
     s->state = MIG_STATE_CANCELLED;
     notifier_list_notify(&migration_state_notifiers, s);
-    qemu_savevm_state_cancel(s->file);
-
-    migrate_fd_cleanup(s);
+    /* the migration thread cleans up, see migrate_fd_check_cancelled() */
 }
 
-static void migrate_fd_wait_for_unfreeze(void *opaque)
+/* Called from the migration thread when the transfer limit is reached */
+static void migrate_fd_wait(void *opaque, int64_t timeout_ms)
 {
     MigrationState *s = opaque;
-    int ret;
 
-    DPRINTF("wait for unfreeze\n");
-    if (s->state != MIG_STATE_ACTIVE)
+    if (!s->postcopy) {
+        g_usleep(timeout_ms * 1000);
         return;
+    }
 
-    do {
-        fd_set wfds;
-
-        FD_ZERO(&wfds);
-        FD_SET(s->fd, &wfds);
-
-        ret = select(s->fd + 1, NULL, &wfds, NULL, NULL);
-    } while (ret == -1 && (s->get_error(s)) == EINTR);
-
-    if (ret == -1) {
-        qemu_file_set_error(s->file, -s->get_error(s));
+    /* the destination's page requests are served right away */
+    if (migrate_fd_wait_readable(s, timeout_ms)) {
+        qemu_mutex_lock_iothread();
+        if (s->state == MIG_STATE_ACTIVE) {
+            migrate_postcopy_read_requests(s);
+        } else {
+            migrate_fd_check_cancelled(s);
+        }
+        qemu_mutex_unlock_iothread();
     }
 }
 
@@ -429,6 +694,14 @@ bool migration_has_finished(MigrationState *s)
     return s->state == MIG_STATE_COMPLETED;
 }
 
+bool migration_in_progress(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    /* a cancelled migration is active until its thread cleaned up */
+    return s->state == MIG_STATE_ACTIVE || s->file;
+}
+
 bool migration_has_failed(MigrationState *s)
 {
     return (s->state == MIG_STATE_CANCELLED ||
@@ -495,60 +768,42 @@ void cloning_stop_n_copy_phase(MigrationState *s)
 
 void cloning_iterate_phase(void *opaque)
 {
-    MigrationState *s = (MigrationState *)opaque;
-    int status  = qemu_savevm_state_iterate(s->file);
-
-    if ( status < 0) {
-        migrate_fd_error(s);
-        return;
-    } else if (status == 1) {
-	cloning_stop_n_copy_phase(s);
-    }
+    /* cloning converges as a migration does, only its end differs */
+    migrate_fd_put_ready(opaque);
 }
+
 void do_precopy_cloning(MigrationState *s)
 {   
 #ifdef DCLOUDCLONE
     fprintf(stderr, "do_precopy_cloning:start\n");
 #endif
     s->state = MIG_STATE_ACTIVE;	// set state to active from setup
-    
-    // open an in-memory file to save the ram and create sections to send to destination
+    s->started = false;
+    s->max_size = 0;
+
+    // the migration thread writes the sections with a blocking socket
+    socket_set_block(s->fd);
     s->file = qemu_fopen_ops_buffered(s,
                                       s->bandwidth_limit,
                                       migrate_fd_put_buffer,
                                       cloning_iterate_phase,
-                                      migrate_fd_wait_for_unfreeze,
+                                      migrate_fd_wait,
                                       migrate_fd_close);
-
-    if(qemu_savevm_state_begin(s->file, &s->params) < 0 )
-    {
-	migrate_fd_error(s);
-	return;
-    }
-    cloning_iterate_phase(s);
 }
 // end_pavan
 
 void migrate_fd_connect(MigrationState *s)
 {
-    int ret;
-
     s->state = MIG_STATE_ACTIVE;
+    /* the migration thread starts the savevm once we drop the iothread
+       lock, it does blocking writes */
+    socket_set_block(s->fd);
     s->file = qemu_fopen_ops_buffered(s,
                                       s->bandwidth_limit,
                                       migrate_fd_put_buffer,
                                       migrate_fd_put_ready,
-                                      migrate_fd_wait_for_unfreeze,
+                                      migrate_fd_wait,
                                       migrate_fd_close);
-
-    DPRINTF("beginning savevm\n");
-    ret = qemu_savevm_state_begin(s->file, &s->params);
-    if (ret < 0) {
-        DPRINTF("failed, %d\n", ret);
-        migrate_fd_error(s);
-        return;
-    }
-    migrate_fd_put_ready(s);
 }
 
 static MigrationState *migrate_init(const MigrationParams *params)
@@ -557,6 +812,8 @@ static MigrationState *migrate_init(const MigrationParams *params)
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int compress_threads = s->compress_threads;
+    int multifd_channels = s->multifd_channels;
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
@@ -567,6 +824,8 @@ static MigrationState *migrate_init(const MigrationParams *params)
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
     s->xbzrle_cache_size = xbzrle_cache_size;
+    s->compress_threads = compress_threads;
+    s->multifd_channels = multifd_channels;
 
     s->bandwidth_limit = bandwidth_limit;
     s->state = MIG_STATE_SETUP;
@@ -598,6 +857,11 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
 
     params.blk = blk;
     params.shared = inc;
+    params.multifd_channels = migrate_use_multifd() ? s->multifd_channels : 0;
+    params.rdma = strstart(uri, "rdma:", NULL);
+    params.flat = false;
+    params.file = false;
+    params.file_fd = -1;
     
 #ifdef DCLOUDCLONE
     fprintf(stderr, "qmp_migrate:start\n");
@@ -606,7 +870,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     s->opType = MIGRATION;
     // end_pavan
 
-    if (s->state == MIG_STATE_ACTIVE) {
+    /* a cancelled migration is active until its thread cleaned up */
+    if (s->state == MIG_STATE_ACTIVE || s->file) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -620,10 +885,34 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_use_postcopy() &&
+        !strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
+                  "a tcp or unix migration protocol for postcopy");
+        return;
+    }
+
+    if (migrate_use_multifd() && !strstart(uri, "tcp:", NULL)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
+                  "a tcp migration protocol for multifd");
+        return;
+    }
+
+    /* the disks would not fit in the part of the file left to the stream */
+    if (blk && strstart(uri, "file:", NULL)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
+                  "a protocol other than file for block migration");
+        return;
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
         ret = tcp_start_outgoing_migration(s, p, errp);
+#ifdef CONFIG_RDMA
+    } else if (strstart(uri, "rdma:", &p)) {
+        ret = rdma_start_outgoing_migration(s, p, errp);
+#endif
 #if !defined(WIN32)
     } else if (strstart(uri, "exec:", &p)) {
         ret = exec_start_outgoing_migration(s, p);
@@ -631,6 +920,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         ret = unix_start_outgoing_migration(s, p);
     } else if (strstart(uri, "fd:", &p)) {
         ret = fd_start_outgoing_migration(s, p);
+    } else if (strstart(uri, "file:", &p)) {
+        ret = file_start_outgoing_migration(s, p);
 #endif
     } else {
         error_set(errp, QERR_INVALID_PARAMETER_VALUE, "uri", "a valid migration protocol");
@@ -660,6 +951,10 @@ void qmp_precopy_cloning(const char *uri, bool has_blk, bool blk,
 #ifdef DCLOUDCLONE
     fprintf(stderr, "qmp_precopy_cloning:start\n");
 #endif
+    if (s->state == MIG_STATE_ACTIVE || s->file) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
     s->opType = CLONING;
 
     MigrationParams params;
@@ -667,6 +962,11 @@ void qmp_precopy_cloning(const char *uri, bool has_blk, bool blk,
     //if( has_inc) params.shared = inc;
     params.blk = blk;
     params.shared = inc;
+    params.multifd_channels = migrate_use_multifd() ? s->multifd_channels : 0;
+    params.rdma = false;
+    params.flat = false;
+    params.file = false;
+    params.file_fd = -1;
 
     // if in case any of the device's state can not be saved
     // you can't do cloning.. in such case simply return
@@ -719,6 +1019,32 @@ int64_t qmp_query_migrate_cache_size(Error **errp)
     return migrate_xbzrle_cache_size();
 }
 
+void qmp_migrate_set_compress_threads(int64_t value, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (value < 1 || value > MAX_MIGRATE_COMPRESS_THREADS) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "value",
+                  "a number of threads between 1 and 255");
+        return;
+    }
+
+    s->compress_threads = value;
+}
+
+void qmp_migrate_set_multifd_channels(int64_t value, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (value < 1 || value > MAX_MIGRATE_MULTIFD_CHANNELS) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "value",
+                  "a number of channels between 1 and 16");
+        return;
+    }
+
+    s->multifd_channels = value;
+}
+
 void qmp_migrate_set_speed(int64_t value, Error **errp)
 {
     MigrationState *s;
@@ -756,3 +1082,66 @@ int64_t migrate_xbzrle_cache_size(void)
 
     return s->xbzrle_cache_size;
 }
+
+int migrate_use_compress(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->compress_threads;
+}
+
+int migrate_auto_converge(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
+}
+
+int migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
+}
+
+int migrate_zero_blocks(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_BLOCKS];
+}
+
+int migrate_defer_hot_pages(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_DEFER_HOT_PAGES];
+}
+
+int migrate_use_postcopy(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY];
+}
@@ -24,8 +24,20 @@
 struct MigrationParams {
     bool blk;
     bool shared;
+    /* extra connections RAM is sent over, 0 without multifd */
+    int multifd_channels;
+    /* RAM pages are written straight into the destination's memory */
+    bool rdma;
+    /* RAM is written as a flat image that loadvm can load lazily */
+    bool flat;
+    /* RAM pages are written at fixed offsets of the file file_fd */
+    bool file;
+    int file_fd;
 };
 
+/* A migration file starts with the stream, RAM comes after this much */
+#define MIGRATION_FILE_STREAM_SIZE (1ULL << 30)
+
 // add_pavan
 enum {
         MIGRATION = 0,
@@ -53,6 +65,19 @@ struct MigrationState
     int64_t total_time;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size;
+    int compress_threads;
+    int multifd_channels;
+    /* the migration thread called qemu_savevm_state_begin() */
+    bool started;
+    /* what can be sent in the downtime, at the last measured bandwidth */
+    uint64_t max_size;
+    int64_t period_start;
+    int64_t period_bytes;
+    int64_t period_idle;
+    /* the destination is running, RAM is being sent postcopy */
+    bool postcopy;
+    uint8_t postcopy_req[512];
+    int postcopy_req_len;
 //  add_Mahesh, pavan
     bool opType;	// should be set to CLONING or MIGRATION incase of source.
                         // Destination will use is_precopy_clone.
@@ -74,7 +99,7 @@ void cloning_stop_n_copy_phase(MigrationState *s);
 int tcp_start_outgoing_precopy_cloning(MigrationState *s,const char *uri, Error **errp);
 //  end_pavan
 
-void process_incoming_migration(QEMUFile *f);
+int process_incoming_migration(QEMUFile *f);
 
 int qemu_start_incoming_migration(const char *uri, Error **errp);
 
@@ -93,6 +118,25 @@ int tcp_start_incoming_migration(const char *host_port, Error **errp);
 int tcp_start_outgoing_migration(MigrationState *s, const char *host_port,
                                  Error **errp);
 
+int tcp_connect_outgoing_channel(Error **errp);
+
+int tcp_finish_outgoing_channel(int fd);
+
+int tcp_accept_incoming_channel(void);
+
+int rdma_start_incoming_migration(const char *host_port, Error **errp);
+
+int rdma_start_outgoing_migration(MigrationState *s, const char *host_port,
+                                  Error **errp);
+
+/**
+ * @rdma_save_page - write a page straight into the destination's memory
+ *
+ * Returns @size if the page went out over RDMA, 0 if it must be sent in
+ * the migration stream, negative on error.
+ */
+int rdma_save_page(const char *idstr, uint64_t offset, size_t size);
+
 int unix_start_incoming_migration(const char *path);
 
 int unix_start_outgoing_migration(MigrationState *s, const char *path);
@@ -101,6 +145,10 @@ int fd_start_incoming_migration(const char *path);
 
 int fd_start_outgoing_migration(MigrationState *s, const char *fdname);
 
+int file_start_incoming_migration(const char *spec);
+
+int file_start_outgoing_migration(MigrationState *s, const char *path);
+
 void migrate_fd_error(MigrationState *s);
 
 void migrate_fd_connect(MigrationState *s);
@@ -109,6 +157,7 @@ void add_migration_state_change_notifier(Notifier *notify);
 void remove_migration_state_change_notifier(Notifier *notify);
 bool migration_is_active(MigrationState *);
 bool migration_has_finished(MigrationState *);
+bool migration_in_progress(void);
 bool migration_has_failed(MigrationState *);
 
 uint64_t ram_bytes_remaining(void);
@@ -117,14 +166,34 @@ uint64_t ram_bytes_total(void);
 
 extern SaveVMHandlers savevm_ram_handlers;
 
+int ram_lazy_load_begin(BlockDriverState *bs);
+void ram_lazy_load_start(void);
+void ram_lazy_load_cancel(void);
+void ram_lazy_load_all(void);
+
+/**
+ * @ram_load_set_file - the incoming migration comes from a file
+ *
+ * RAM regions of the file are read through @fd, which is closed when
+ * another one (or -1) is set.  With @map, they are mapped instead.
+ */
+void ram_load_set_file(int fd, bool map);
+
+void ram_free_page_hint(ram_addr_t addr, ram_addr_t length);
+
 uint64_t dup_mig_bytes_transferred(void);
 uint64_t dup_mig_pages_transferred(void);
 uint64_t norm_mig_bytes_transferred(void);
+uint64_t skipped_mig_pages_transferred(void);
 uint64_t norm_mig_pages_transferred(void);
 uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t xbzrle_mig_pages_cache_hit(void);
+uint64_t xbzrle_mig_pages_cache_evictions(void);
+CompressThreadStatsList *compress_mig_thread_stats(void);
+DirtyHeatStatsList *ram_dirty_heat_stats(void);
 
 /**
  * @migrate_add_blocker - prevent migration from proceeding
@@ -140,13 +209,28 @@ void migrate_add_blocker(Error *reason);
  */
 void migrate_del_blocker(Error *reason);
 
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen);
-int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
-
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
 
 int64_t xbzrle_cache_resize(int64_t new_size);
 
+int migrate_use_compress(void);
+int migrate_compress_threads(void);
+
+int migrate_use_multifd(void);
+
+int migrate_zero_blocks(void);
+
+int migrate_defer_hot_pages(void);
+
+int migrate_use_postcopy(void);
+int migrate_auto_converge(void);
+bool ram_postcopy_ready(void);
+void ram_postcopy_begin(void);
+int ram_postcopy_iterate(QEMUFile *f);
+int ram_postcopy_request_page(QEMUFile *f, const char *idstr,
+                              uint64_t offset);
+bool ram_postcopy_incoming_pending(void);
+int ram_postcopy_incoming_start(QEMUFile *f);
+
 #endif
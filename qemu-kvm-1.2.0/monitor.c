@@ -36,6 +36,7 @@
 #include "qemu-char.h"
 #include "ui/qemu-spice.h"
 #include "sysemu.h"
+#include "bitmap.h"
 #include "monitor.h"
 #include "readline.h"
 #include "console.h"
@@ -450,11 +451,13 @@ static const char *monitor_event_names[] = {
     [QEVENT_SPICE_DISCONNECTED] = "SPICE_DISCONNECTED",
     [QEVENT_BLOCK_JOB_COMPLETED] = "BLOCK_JOB_COMPLETED",
     [QEVENT_BLOCK_JOB_CANCELLED] = "BLOCK_JOB_CANCELLED",
+    [QEVENT_BLOCK_JOB_READY] = "BLOCK_JOB_READY",
     [QEVENT_DEVICE_TRAY_MOVED] = "DEVICE_TRAY_MOVED",
     [QEVENT_SUSPEND] = "SUSPEND",
     [QEVENT_SUSPEND_DISK] = "SUSPEND_DISK",
     [QEVENT_WAKEUP] = "WAKEUP",
     [QEVENT_BALLOON_CHANGE] = "BALLOON_CHANGE",
+    [QEVENT_DUMP_COMPLETED] = "DUMP_COMPLETED",
 };
 QEMU_BUILD_BUG_ON(ARRAY_SIZE(monitor_event_names) != QEVENT_MAX)
 
@@ -948,7 +951,7 @@ static void do_info_history(Monitor *mon)
     }
 }
 
-#if defined(TARGET_PPC)
+#if defined(TARGET_PPC) || defined(TARGET_I386)
 /* XXX: not implemented in other targets */
 static void do_info_cpu_stats(Monitor *mon)
 {
@@ -2102,6 +2105,24 @@ static void do_info_numa(Monitor *mon)
         monitor_printf(mon, "\n");
         monitor_printf(mon, "node %d size: %" PRId64 " MB\n", i,
             node_mem[i] >> 20);
+        if (!bitmap_empty(node_host_nodes[i], MAX_HOST_NODES)) {
+            static const char *const policies[] = {
+                [NUMA_POLICY_BIND] = "bind",
+                [NUMA_POLICY_PREFERRED] = "preferred",
+                [NUMA_POLICY_INTERLEAVE] = "interleave",
+            };
+            int node;
+
+            monitor_printf(mon, "node %d host nodes (%s):", i,
+                           policies[node_policy[i]]);
+            for (node = find_first_bit(node_host_nodes[i], MAX_HOST_NODES);
+                 node < MAX_HOST_NODES;
+                 node = find_next_bit(node_host_nodes[i], MAX_HOST_NODES,
+                                      node + 1)) {
+                monitor_printf(mon, " %d", node);
+            }
+            monitor_printf(mon, "\n");
+        }
     }
 }
 
@@ -2375,10 +2396,11 @@ static void do_loadvm(Monitor *mon, const QDict *qdict)
 {
     int saved_vm_running  = runstate_is_running();
     const char *name = qdict_get_str(qdict, "name");
+    bool lazy = qdict_get_try_bool(qdict, "lazy", 0);
 
     vm_stop(RUN_STATE_RESTORE_VM);
 
-    if (load_vmstate(name) == 0 && saved_vm_running) {
+    if (load_vmstate(name, lazy) == 0 && saved_vm_running) {
         vm_start();
     }
 }
@@ -2694,6 +2716,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show the network state",
         .mhandler.info = do_info_network,
     },
+    {
+        .name       = "netqueues",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the network receive queue statistics",
+        .mhandler.info = hmp_info_netqueues,
+    },
     {
         .name       = "chardev",
         .args_type  = "",
@@ -2736,6 +2765,20 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show infos for each CPU",
         .mhandler.info = hmp_info_cpus,
     },
+    {
+        .name       = "cpulocks",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the global mutex statistics of each CPU",
+        .mhandler.info = hmp_info_cpulocks,
+    },
+    {
+        .name       = "lock-stats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show who waited for and held the global mutex",
+        .mhandler.info = hmp_info_lock_stats,
+    },
     {
         .name       = "history",
         .args_type  = "",
@@ -2797,6 +2840,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show the active virtual memory mappings",
         .mhandler.info = mem_info,
     },
+    {
+        .name       = "vapic",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show TPR patching and APIC access statistics",
+        .mhandler.info = vapic_info,
+    },
 #endif
     {
         .name       = "mtree",
@@ -2819,6 +2869,20 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show KVM information",
         .mhandler.info = hmp_info_kvm,
     },
+    {
+        .name       = "timers",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show timer slack and host wakeups",
+        .mhandler.info = hmp_info_timers,
+    },
+    {
+        .name       = "device-profile",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show host CPU time spent emulating devices",
+        .mhandler.info = hmp_info_device_profile,
+    },
     {
         .name       = "numa",
         .args_type  = "",
@@ -2912,7 +2976,7 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show the current VM UUID",
         .mhandler.info = hmp_info_uuid,
     },
-#if defined(TARGET_PPC)
+#if defined(TARGET_PPC) || defined(TARGET_I386)
     {
         .name       = "cpustats",
         .args_type  = "",
@@ -4712,7 +4776,7 @@ static void qmp_call_cmd(Monitor *mon, const mon_cmd_t *cmd,
     qobject_decref(data);
 }
 
-static void handle_qmp_command(JSONMessageParser *parser, QList *tokens)
+static void handle_qmp_command(JSONMessageParser *parser, GQueue *tokens)
 {
     int err;
     QObject *obj;
@@ -228,7 +228,8 @@ static int nbd_send_negotiate(int csock, off_t size, uint32_t flags)
     cpu_to_be64w((uint64_t*)(buf + 16), size);
     cpu_to_be32w((uint32_t*)(buf + 24),
                  flags | NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
-                 NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA);
+                 NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
+                 NBD_FLAG_SEND_WRITE_ZEROES | NBD_FLAG_SEND_BLOCK_STATUS);
     memset(buf + 28, 0, 124);
 
     if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
@@ -759,6 +760,7 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
 {
     NBDClient *client = req->client;
     int csock = client->sock;
+    uint32_t command;
     ssize_t rc;
 
     client->recv_coroutine = qemu_coroutine_self();
@@ -770,7 +772,10 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
         goto out;
     }
 
-    if (request->len > NBD_BUFFER_SIZE) {
+    /* Only reads and writes carry data, other commands may cover more */
+    command = request->type & NBD_CMD_MASK_COMMAND;
+    if ((command == NBD_CMD_READ || command == NBD_CMD_WRITE) &&
+        request->len > NBD_BUFFER_SIZE) {
         LOG("len (%u) is larger than max len (%u)",
             request->len, NBD_BUFFER_SIZE);
         rc = -EINVAL;
@@ -786,7 +791,7 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
 
     TRACE("Decoding type");
 
-    if ((request->type & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE) {
+    if (command == NBD_CMD_WRITE) {
         TRACE("Reading %u byte(s)", request->len);
 
         if (qemu_co_recv(csock, req->data, request->len) != request->len) {
@@ -923,6 +928,62 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_WRITE_ZEROES:
+        TRACE("Request type is WRITE_ZEROES");
+
+        if (exp->nbdflags & NBD_FLAG_READ_ONLY) {
+            TRACE("Server is read-only, return error");
+            reply.error = EROFS;
+            goto error_reply;
+        }
+
+        ret = bdrv_co_write_zeroes(exp->bs,
+                                   (request.from + exp->dev_offset) / 512,
+                                   request.len / 512);
+        if (ret < 0) {
+            LOG("writing zeroes to file failed");
+            reply.error = -ret;
+            goto error_reply;
+        }
+
+        if (request.type & NBD_CMD_FLAG_FUA) {
+            ret = bdrv_co_flush(exp->bs);
+            if (ret < 0) {
+                LOG("flush failed");
+                reply.error = -ret;
+                goto error_reply;
+            }
+        }
+
+        if (nbd_co_send_reply(req, &reply, 0) < 0) {
+            goto out;
+        }
+        break;
+    case NBD_CMD_BLOCK_STATUS: {
+        struct nbd_block_status *status = req->data;
+        int pnum;
+
+        TRACE("Request type is BLOCK_STATUS");
+
+        /* Unallocated means that the whole chain reads as zeroes there */
+        ret = bdrv_co_is_allocated_above(exp->bs, NULL,
+                                         (request.from + exp->dev_offset) / 512,
+                                         request.len / 512, &pnum);
+        if (ret < 0) {
+            LOG("querying allocation status failed");
+            reply.error = -ret;
+            goto error_reply;
+        }
+
+        /* pnum is 0 for requests shorter than a sector */
+        cpu_to_be32w(&status->length,
+                     pnum ? pnum * 512 : request.len);
+        cpu_to_be32w(&status->flags, ret ? NBD_STATE_ALLOCATED : 0);
+        if (nbd_co_send_reply(req, &reply, sizeof(*status)) < 0) {
+            goto out;
+        }
+        break;
+    }
     default:
         LOG("invalid request type (%u) received", request.type);
     invalid_request:
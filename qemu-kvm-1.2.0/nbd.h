@@ -37,12 +37,25 @@ struct nbd_reply {
     uint64_t handle;
 } QEMU_PACKED;
 
+/* Payload that follows a successful NBD_CMD_BLOCK_STATUS reply.  It
+ * describes the run of bytes starting at the request offset, which is
+ * at most as long as the request.  Both fields are big endian on the wire.
+ */
+struct nbd_block_status {
+    uint32_t length;
+    uint32_t flags;
+} QEMU_PACKED;
+
+#define NBD_STATE_ALLOCATED     (1 << 0)        /* Data, not a hole */
+
 #define NBD_FLAG_HAS_FLAGS      (1 << 0)        /* Flags are there */
 #define NBD_FLAG_READ_ONLY      (1 << 1)        /* Device is read-only */
 #define NBD_FLAG_SEND_FLUSH     (1 << 2)        /* Send FLUSH */
 #define NBD_FLAG_SEND_FUA       (1 << 3)        /* Send FUA (Force Unit Access) */
 #define NBD_FLAG_ROTATIONAL     (1 << 4)        /* Use elevator algorithm - rotational media */
 #define NBD_FLAG_SEND_TRIM      (1 << 5)        /* Send TRIM (discard) */
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)     /* Send WRITE_ZEROES */
+#define NBD_FLAG_SEND_BLOCK_STATUS (1 << 7)     /* Send BLOCK_STATUS */
 
 #define NBD_CMD_MASK_COMMAND	0x0000ffff
 #define NBD_CMD_FLAG_FUA	(1 << 16)
@@ -52,7 +65,9 @@ enum {
     NBD_CMD_WRITE = 1,
     NBD_CMD_DISC = 2,
     NBD_CMD_FLUSH = 3,
-    NBD_CMD_TRIM = 4
+    NBD_CMD_TRIM = 4,
+    NBD_CMD_WRITE_ZEROES = 6,
+    NBD_CMD_BLOCK_STATUS = 7
 };
 
 #define NBD_DEFAULT_PORT	10809
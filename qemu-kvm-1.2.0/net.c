@@ -32,6 +32,7 @@
 #include "net/vde.h"
 #include "net/hub.h"
 #include "net/util.h"
+#include "net/vhost-user.h"
 #include "monitor.h"
 #include "qemu-common.h"
 #include "qemu_socket.h"
@@ -236,6 +237,52 @@ NICState *qemu_new_nic(NetClientInfo *info,
     return nic;
 }
 
+/*
+ * Returns queue @queue_index of the multiqueue client that @nc belongs to,
+ * or NULL if it has no such queue.
+ */
+NetClientState *qemu_find_net_queue(NetClientState *nc, int queue_index)
+{
+    NetClientState *q;
+
+    QTAILQ_FOREACH(q, &net_clients, next) {
+        if (q->info == nc->info && q->queue_index == queue_index &&
+            !strcmp(q->name, nc->name)) {
+            return q;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Creates the client for queue @queue_index of a multiqueue NIC whose first
+ * queue is @nic, and connects it to the same queue of the NIC's backend.
+ */
+NICState *qemu_new_nic_queue(NICState *nic, int queue_index)
+{
+    NetClientState *peer = NULL;
+    NetClientState *nc;
+    NICState *q;
+
+    if (nic->nc.peer) {
+        peer = qemu_find_net_queue(nic->nc.peer, queue_index);
+        if (!peer || peer->peer) {
+            return NULL;
+        }
+    }
+
+    nc = qemu_new_net_client(nic->nc.info, peer, nic->nc.model,
+                             nic->nc.name);
+    nc->queue_index = queue_index;
+
+    q = DO_UPCAST(NICState, nc, nc);
+    q->conf = nic->conf;
+    q->opaque = nic->opaque;
+
+    return q;
+}
+
 static void qemu_cleanup_net_client(NetClientState *nc)
 {
     QTAILQ_REMOVE(&net_clients, nc, next);
@@ -453,6 +500,145 @@ qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
     return qemu_sendv_packet_async(nc, iov, iovcnt, NULL);
 }
 
+/*
+ * Sends a packet that the caller also sends from other clients.  Peers
+ * that have to queue it share one copy of the payload through *@shared,
+ * see qemu_net_queue_send_shared().
+ */
+ssize_t qemu_sendv_packet_shared(NetClientState *sender,
+                                 const struct iovec *iov, int iovcnt,
+                                 NetPacketBuf **shared)
+{
+    NetQueue *queue;
+
+    if (sender->link_down || !sender->peer) {
+        return iov_size(iov, iovcnt);
+    }
+
+    queue = sender->peer->send_queue;
+
+    return qemu_net_queue_send_shared(queue, sender,
+                                      QEMU_NET_PACKET_FLAG_NONE,
+                                      iov, iovcnt, shared, NULL);
+}
+
+/*
+ * Sends @count packets, handing them to the peer in one go if it has a
+ * receive_batch method and nothing is queued for it.  Packets the peer
+ * doesn't take then go through its queue one at a time as usual.
+ *
+ * With @sent_cb this stops at the first packet that had to be queued,
+ * which completes through @sent_cb later.  Returns the number of packets
+ * sent before it, or @count if all of them were sent.
+ */
+int qemu_sendv_batch_async(NetClientState *sender, const NetBatchPacket *pkts,
+                           int count, NetPacketSent *sent_cb)
+{
+    NetClientState *peer = sender->peer;
+    int done = 0;
+
+    if (sender->link_down || !peer) {
+        return count;
+    }
+
+    if (peer->info->receive_batch && !peer->link_down &&
+        qemu_net_queue_idle(peer->send_queue) &&
+        qemu_can_send_packet(sender)) {
+        done = peer->info->receive_batch(peer, pkts, count);
+    }
+
+    for (; done < count; done++) {
+        if (qemu_sendv_packet_async(sender, pkts[done].iov, pkts[done].iovcnt,
+                                    sent_cb) == 0 && sent_cb) {
+            break;
+        }
+    }
+
+    return done;
+}
+
+/*
+ * Lets the peer of @sender take the next packet straight into its own
+ * buffers, saving the copy through a bounce buffer.  The peer calls @read
+ * with its buffers, which returns the packet size like readv().
+ *
+ * Returns what @read returned, or 0 without calling it if the peer can't
+ * take a packet this way right now.  The caller then reads the packet
+ * itself and uses qemu_send_packet_async() as usual.
+ */
+int qemu_has_ufo(NetClientState *nc)
+{
+    if (!nc || !nc->info->has_ufo) {
+        return 0;
+    }
+
+    return nc->info->has_ufo(nc);
+}
+
+int qemu_has_vnet_hdr(NetClientState *nc)
+{
+    if (!nc || !nc->info->has_vnet_hdr) {
+        return 0;
+    }
+
+    return nc->info->has_vnet_hdr(nc);
+}
+
+int qemu_has_vnet_hdr_len(NetClientState *nc, int len)
+{
+    if (!nc || !nc->info->has_vnet_hdr_len) {
+        return 0;
+    }
+
+    return nc->info->has_vnet_hdr_len(nc, len);
+}
+
+void qemu_using_vnet_hdr(NetClientState *nc, int enable)
+{
+    if (!nc || !nc->info->using_vnet_hdr) {
+        return;
+    }
+
+    nc->info->using_vnet_hdr(nc, enable);
+}
+
+void qemu_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
+                      int ecn, int ufo)
+{
+    if (!nc || !nc->info->set_offload) {
+        return;
+    }
+
+    nc->info->set_offload(nc, csum, tso4, tso6, ecn, ufo);
+}
+
+void qemu_set_vnet_hdr_len(NetClientState *nc, int len)
+{
+    if (!nc || !nc->info->set_vnet_hdr_len) {
+        return;
+    }
+
+    nc->info->set_vnet_hdr_len(nc, len);
+}
+
+ssize_t qemu_receive_read(NetClientState *sender, NetReadFunc *read,
+                          void *opaque)
+{
+    NetClientState *peer = sender->peer;
+
+    if (sender->link_down || !peer || !peer->info->receive_read ||
+        peer->link_down || peer->receive_disabled) {
+        return 0;
+    }
+
+    /* Packets already queued for the peer go first */
+    if (!qemu_net_queue_idle(peer->send_queue)) {
+        return 0;
+    }
+
+    return peer->info->receive_read(peer, read, opaque);
+}
+
 NetClientState *qemu_find_netdev(const char *id)
 {
     NetClientState *nc;
@@ -622,6 +808,9 @@ static int (* const net_client_init_fun[NET_CLIENT_OPTIONS_KIND_MAX])(
         [NET_CLIENT_OPTIONS_KIND_BRIDGE]    = net_init_bridge,
 #endif
         [NET_CLIENT_OPTIONS_KIND_HUBPORT]   = net_init_hubport,
+#ifdef CONFIG_LINUX
+        [NET_CLIENT_OPTIONS_KIND_VHOST_USER] = net_init_vhost_user,
+#endif
 };
 
 
@@ -652,6 +841,9 @@ static int net_client_init1(const void *object, int is_netdev, Error **errp)
         case NET_CLIENT_OPTIONS_KIND_BRIDGE:
 #endif
         case NET_CLIENT_OPTIONS_KIND_HUBPORT:
+#ifdef CONFIG_LINUX
+        case NET_CLIENT_OPTIONS_KIND_VHOST_USER:
+#endif
             break;
 
         default:
@@ -839,7 +1031,10 @@ void qmp_netdev_del(const char *id, Error **errp)
         return;
     }
 
-    qemu_del_net_client(nc);
+    /* multiqueue backends have one client per queue, all named @id */
+    do {
+        qemu_del_net_client(nc);
+    } while ((nc = qemu_find_netdev(id)));
     qemu_opts_del(qemu_opts_find(qemu_find_opts_err("netdev", errp), id));
 }
 
@@ -878,6 +1073,8 @@ void do_info_network(Monitor *mon)
 void qmp_set_link(const char *name, bool up, Error **errp)
 {
     NetClientState *nc = NULL;
+    NetClientState *q;
+    int i;
 
     QTAILQ_FOREACH(nc, &net_clients, next) {
         if (!strcmp(nc->name, name)) {
@@ -890,6 +1087,10 @@ done:
         return;
     }
 
+    /* All queues of a multiqueue client share the link state */
+    for (i = 0; (q = qemu_find_net_queue(nc, i)); i++) {
+        q->link_down = !up;
+    }
     nc->link_down = !up;
 
     if (nc->info->link_status_changed) {
@@ -903,11 +1104,91 @@ done:
      * Current behaviour is compatible with qemu vlans where there could be
      * multiple clients that can still communicate with each other in
      * disconnected mode. For now maintain this compatibility. */
-    if (nc->peer && nc->peer->info->link_status_changed) {
-        nc->peer->info->link_status_changed(nc->peer);
+    for (i = 0; (q = qemu_find_net_queue(nc, i)); i++) {
+        if (q->peer && q->peer->info->link_status_changed) {
+            q->peer->info->link_status_changed(q->peer);
+        }
     }
 }
 
+NetQueueInfoList *qmp_query_net_queues(Error **errp)
+{
+    NetQueueInfoList *head = NULL, **tail = &head;
+    NetClientState *nc;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        NetQueueInfoList *entry;
+        NetQueueStats stats;
+
+        qemu_net_queue_get_stats(nc->send_queue, &stats);
+
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->name = g_strdup(nc->name);
+        entry->value->queue_index = nc->queue_index;
+        entry->value->capacity = stats.capacity;
+        entry->value->backlog = stats.backlog;
+        entry->value->max_backlog = stats.max_backlog;
+        entry->value->queued = stats.queued;
+        entry->value->dropped = stats.dropped;
+
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
+
+void qmp_set_net_coalesce(const char *name,
+                          bool has_rx_max_frames, int64_t rx_max_frames,
+                          bool has_rx_usecs, int64_t rx_usecs,
+                          bool has_tx_max_frames, int64_t tx_max_frames,
+                          bool has_tx_usecs, int64_t tx_usecs,
+                          Error **errp)
+{
+    NetClientState *nc = NULL;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        if (!strcmp(nc->name, name)) {
+            break;
+        }
+    }
+    if (!nc) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, name);
+        return;
+    }
+    if (!nc->info->coalesce_changed) {
+        error_set(errp, QERR_UNSUPPORTED);
+        return;
+    }
+
+    if ((has_rx_max_frames && (rx_max_frames < 0 ||
+                               rx_max_frames > UINT32_MAX)) ||
+        (has_rx_usecs && (rx_usecs < 0 || rx_usecs > UINT32_MAX)) ||
+        (has_tx_max_frames && (tx_max_frames < 0 ||
+                               tx_max_frames > UINT32_MAX)) ||
+        (has_tx_usecs && (tx_usecs < 0 || tx_usecs > UINT32_MAX))) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "coalesce",
+                  "a 32-bit unsigned value");
+        return;
+    }
+
+    if (has_rx_max_frames) {
+        nc->rx_coalesce.max_frames = rx_max_frames;
+    }
+    if (has_rx_usecs) {
+        nc->rx_coalesce.usecs = rx_usecs;
+    }
+    if (has_tx_max_frames) {
+        nc->tx_coalesce.max_frames = tx_max_frames;
+    }
+    if (has_tx_usecs) {
+        nc->tx_coalesce.usecs = tx_usecs;
+    }
+
+    nc->info->coalesce_changed(nc);
+}
+
 void net_cleanup(void)
 {
     NetClientState *nc, *next_vc;
@@ -33,8 +33,31 @@ typedef void (NetPoll)(NetClientState *, bool enable);
 typedef int (NetCanReceive)(NetClientState *);
 typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
+typedef ssize_t (NetReadFunc)(void *opaque, const struct iovec *, int);
+typedef ssize_t (NetReceiveRead)(NetClientState *, NetReadFunc *, void *);
+
+/* One packet of a batch, see qemu_sendv_batch_async() */
+typedef struct NetBatchPacket {
+    const struct iovec *iov;
+    int iovcnt;
+} NetBatchPacket;
+
+typedef int (NetReceiveBatch)(NetClientState *, const NetBatchPacket *, int);
 typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
+typedef void (CoalesceChanged)(NetClientState *);
+typedef int (HasUfo)(NetClientState *);
+typedef int (HasVnetHdr)(NetClientState *);
+typedef int (HasVnetHdrLen)(NetClientState *, int);
+typedef void (UsingVnetHdr)(NetClientState *, int);
+typedef void (SetOffload)(NetClientState *, int, int, int, int, int);
+typedef void (SetVnetHdrLen)(NetClientState *, int);
+
+/* Interrupt moderation: signal after max_frames or usecs, 0 usecs is off */
+typedef struct NetCoalesce {
+    uint32_t max_frames;
+    uint32_t usecs;
+} NetCoalesce;
 
 typedef struct NetClientInfo {
     NetClientOptionsKind type;
@@ -42,15 +65,27 @@ typedef struct NetClientInfo {
     NetReceive *receive;
     NetReceive *receive_raw;
     NetReceiveIOV *receive_iov;
+    NetReceiveRead *receive_read;
+    NetReceiveBatch *receive_batch;
     NetCanReceive *can_receive;
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
+    CoalesceChanged *coalesce_changed;
     NetPoll *poll;
+    /* Backends that exchange virtio_net_hdr-prefixed frames */
+    HasUfo *has_ufo;
+    HasVnetHdr *has_vnet_hdr;
+    HasVnetHdrLen *has_vnet_hdr_len;
+    UsingVnetHdr *using_vnet_hdr;
+    SetOffload *set_offload;
+    SetVnetHdrLen *set_vnet_hdr_len;
 } NetClientInfo;
 
 struct NetClientState {
     NetClientInfo *info;
     int link_down;
+    NetCoalesce rx_coalesce;
+    NetCoalesce tx_coalesce;
     QTAILQ_ENTRY(NetClientState) next;
     NetClientState *peer;
     NetQueue *send_queue;
@@ -58,6 +93,7 @@ struct NetClientState {
     char *name;
     char info_str[256];
     unsigned receive_disabled : 1;
+    int queue_index;        /* clients of a multiqueue device share a name */
 };
 
 typedef struct NICState {
@@ -77,6 +113,8 @@ NICState *qemu_new_nic(NetClientInfo *info,
                        const char *model,
                        const char *name,
                        void *opaque);
+NICState *qemu_new_nic_queue(NICState *nic, int queue_index);
+NetClientState *qemu_find_net_queue(NetClientState *nc, int queue_index);
 void qemu_del_net_client(NetClientState *nc);
 NetClientState *qemu_find_vlan_client_by_name(Monitor *mon, int vlan_id,
                                               const char *client_str);
@@ -87,11 +125,24 @@ ssize_t qemu_sendv_packet(NetClientState *nc, const struct iovec *iov,
                           int iovcnt);
 ssize_t qemu_sendv_packet_async(NetClientState *nc, const struct iovec *iov,
                                 int iovcnt, NetPacketSent *sent_cb);
+ssize_t qemu_sendv_packet_shared(NetClientState *nc, const struct iovec *iov,
+                                 int iovcnt, NetPacketBuf **shared);
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+ssize_t qemu_receive_read(NetClientState *nc, NetReadFunc *read,
+                          void *opaque);
+int qemu_sendv_batch_async(NetClientState *nc, const NetBatchPacket *pkts,
+                           int count, NetPacketSent *sent_cb);
 void qemu_purge_queued_packets(NetClientState *nc);
+int qemu_has_ufo(NetClientState *nc);
+int qemu_has_vnet_hdr(NetClientState *nc);
+int qemu_has_vnet_hdr_len(NetClientState *nc, int len);
+void qemu_using_vnet_hdr(NetClientState *nc, int enable);
+void qemu_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
+                      int ecn, int ufo);
+void qemu_set_vnet_hdr_len(NetClientState *nc, int len);
 void qemu_flush_queued_packets(NetClientState *nc);
 void qemu_format_nic_info_str(NetClientState *nc, uint8_t macaddr[6]);
 void qemu_macaddr_default_if_unset(MACAddr *macaddr);
@@ -41,35 +41,51 @@ struct NetHub {
 
 static QLIST_HEAD(, NetHub) hubs = QLIST_HEAD_INITIALIZER(&hubs);
 
-static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
-                               const uint8_t *buf, size_t len)
+static ssize_t net_hub_receive_iov(NetHub *hub, NetHubPort *source_port,
+                                   const struct iovec *iov, int iovcnt)
 {
     NetHubPort *port;
+    NetPacketBuf *shared = NULL;
+    ssize_t len = iov_size(iov, iovcnt);
 
+    /* Ports that can't take the packet right away all queue the same copy */
     QLIST_FOREACH(port, &hub->ports, next) {
         if (port == source_port) {
             continue;
         }
 
-        qemu_send_packet(&port->nc, buf, len);
+        qemu_sendv_packet_shared(&port->nc, iov, iovcnt, &shared);
+    }
+    if (shared) {
+        qemu_net_packet_buf_unref(shared);
     }
     return len;
 }
 
-static ssize_t net_hub_receive_iov(NetHub *hub, NetHubPort *source_port,
-                                   const struct iovec *iov, int iovcnt)
+static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
+                               const uint8_t *buf, size_t len)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = len,
+    };
+
+    return net_hub_receive_iov(hub, source_port, &iov, 1);
+}
+
+static int net_hub_receive_batch(NetHub *hub, NetHubPort *source_port,
+                                 const NetBatchPacket *pkts, int count)
 {
     NetHubPort *port;
-    ssize_t len = iov_size(iov, iovcnt);
 
     QLIST_FOREACH(port, &hub->ports, next) {
         if (port == source_port) {
             continue;
         }
 
-        qemu_sendv_packet(&port->nc, iov, iovcnt);
+        qemu_sendv_batch_async(&port->nc, pkts, count, NULL);
     }
-    return len;
+    return count;
 }
 
 static NetHub *net_hub_new(int id)
@@ -121,6 +137,14 @@ static ssize_t net_hub_port_receive_iov(NetClientState *nc,
     return net_hub_receive_iov(port->hub, port, iov, iovcnt);
 }
 
+static int net_hub_port_receive_batch(NetClientState *nc,
+                                      const NetBatchPacket *pkts, int count)
+{
+    NetHubPort *port = DO_UPCAST(NetHubPort, nc, nc);
+
+    return net_hub_receive_batch(port->hub, port, pkts, count);
+}
+
 static void net_hub_port_cleanup(NetClientState *nc)
 {
     NetHubPort *port = DO_UPCAST(NetHubPort, nc, nc);
@@ -134,6 +158,7 @@ static NetClientInfo net_hub_port_info = {
     .can_receive = net_hub_port_can_receive,
     .receive = net_hub_port_receive,
     .receive_iov = net_hub_port_receive_iov,
+    .receive_batch = net_hub_port_receive_batch,
     .cleanup = net_hub_port_cleanup,
 };
 
@@ -22,8 +22,10 @@
  */
 
 #include "net/queue.h"
-#include "qemu-queue.h"
+#include "qemu-barrier.h"
+#include "event_notifier.h"
 #include "net.h"
+#include "iov.h"
 
 /* The delivery handler may only return zero if it will call
  * qemu_net_queue_flush() when it determines that it is once again able
@@ -33,25 +35,52 @@
  * If a sent callback is provided to send(), the caller must handle a
  * zero return from the delivery handler by not sending any more packets
  * until we have invoked the callback. Only in that case will we queue
- * the packet.
+ * the packet even if the ring is full.
  *
- * If a sent callback isn't provided, we just drop the packet to avoid
- * unbounded queueing.
+ * If a sent callback isn't provided, we just drop the packet once the
+ * ring is full to avoid unbounded queueing.
+ *
+ * Packets are copied into a ring of slots, each with a preallocated
+ * buffer of NET_QUEUE_SLOT_SIZE bytes, so that queueing does not cost a
+ * malloc.  Larger packets (e.g. with GSO) get a buffer of their own.
+ * A packet sent to several queues at once can instead reference one
+ * refcounted NetPacketBuf from all of them.
  */
 
+#define NET_QUEUE_LEN        256    /* initial number of slots */
+#define NET_QUEUE_SLOT_SIZE  2048
+
 struct NetPacket {
-    QTAILQ_ENTRY(NetPacket) entry;
-    NetClientState *sender;
+    NetClientState *sender; /* NULL once purged */
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
-    uint8_t data[0];
+    uint8_t *data;
+    bool oversized;         /* data was allocated for this packet */
+    NetPacketBuf *buf;      /* data is buf->data, shared with other queues */
 };
 
 struct NetQueue {
     void *opaque;
 
-    QTAILQ_HEAD(packets, NetPacket) packets;
+    /* nslots is a power of two.  head and tail run freely and are only
+     * masked when indexing slots, so tail - head is the backlog.
+     */
+    NetPacket *slots;
+    uint8_t *pool;
+    unsigned nslots;
+    unsigned head;
+    unsigned tail;
+
+    /* In SPSC mode one thread sends and another one flushes, see
+     * qemu_net_queue_enable_spsc().
+     */
+    bool spsc;
+    EventNotifier *notifier;
+
+    uint64_t queued;
+    uint64_t dropped;
+    unsigned max_backlog;
 
     unsigned delivering : 1;
 };
@@ -64,44 +93,124 @@ NetQueue *qemu_new_net_queue(void *opaque)
 
     queue->opaque = opaque;
 
-    QTAILQ_INIT(&queue->packets);
-
     queue->delivering = 0;
 
     return queue;
 }
 
+static void qemu_net_queue_alloc(NetQueue *queue, unsigned nslots)
+{
+    unsigned i;
+
+    queue->slots = g_malloc0(nslots * sizeof(NetPacket));
+    queue->pool = g_malloc((size_t)nslots * NET_QUEUE_SLOT_SIZE);
+    queue->nslots = nslots;
+
+    for (i = 0; i < nslots; i++) {
+        queue->slots[i].data = queue->pool + (size_t)i * NET_QUEUE_SLOT_SIZE;
+    }
+}
+
+static NetPacket *qemu_net_queue_slot(NetQueue *queue, unsigned idx)
+{
+    return &queue->slots[idx & (queue->nslots - 1)];
+}
+
+NetPacketBuf *qemu_net_packet_buf_new(const struct iovec *iov, int iovcnt)
+{
+    size_t size = iov_size(iov, iovcnt);
+    NetPacketBuf *buf = g_malloc(sizeof(*buf) + size);
+
+    buf->refcnt = 1;
+    buf->size = iov_to_buf(iov, iovcnt, 0, buf->data, size);
+    return buf;
+}
+
+void qemu_net_packet_buf_unref(NetPacketBuf *buf)
+{
+    if (--buf->refcnt == 0) {
+        g_free(buf);
+    }
+}
+
+/* Drop the packet's payload and hand the slot buffer back */
+static void qemu_net_packet_release(NetQueue *queue, NetPacket *packet)
+{
+    if (packet->oversized) {
+        g_free(packet->data);
+        packet->oversized = false;
+    } else if (packet->buf) {
+        qemu_net_packet_buf_unref(packet->buf);
+        packet->buf = NULL;
+    }
+    packet->data = queue->pool +
+        (size_t)(packet - queue->slots) * NET_QUEUE_SLOT_SIZE;
+    packet->sender = NULL;
+    packet->sent_cb = NULL;
+}
+
 void qemu_del_net_queue(NetQueue *queue)
 {
-    NetPacket *packet, *next;
+    unsigned i;
 
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
-        g_free(packet);
+    for (i = queue->head; i != queue->tail; i++) {
+        qemu_net_packet_release(queue, qemu_net_queue_slot(queue, i));
     }
 
+    g_free(queue->slots);
+    g_free(queue->pool);
     g_free(queue);
 }
 
-static ssize_t qemu_net_queue_append(NetQueue *queue,
-                                     NetClientState *sender,
-                                     unsigned flags,
-                                     const uint8_t *buf,
-                                     size_t size,
-                                     NetPacketSent *sent_cb)
+/*
+ * Let one thread append packets with qemu_net_queue_send*() while another
+ * one delivers them with qemu_net_queue_flush(), without a lock.  The
+ * sending side never delivers directly and drops packets when the ring is
+ * full, because it cannot wait for the flushing side to make room.  If
+ * @notifier is given it is set whenever a packet is appended to an empty
+ * ring.  qemu_net_queue_purge() belongs to the flushing side.
+ *
+ * Must be called before the queue is shared between threads.
+ */
+void qemu_net_queue_enable_spsc(NetQueue *queue, EventNotifier *notifier)
 {
-    NetPacket *packet;
+    assert(queue->head == queue->tail);
 
-    packet = g_malloc(sizeof(NetPacket) + size);
-    packet->sender = sender;
-    packet->flags = flags;
-    packet->size = size;
-    packet->sent_cb = sent_cb;
-    memcpy(packet->data, buf, size);
+    if (!queue->slots) {
+        qemu_net_queue_alloc(queue, NET_QUEUE_LEN);
+    }
+    queue->notifier = notifier;
+    queue->spsc = true;
+}
+
+/* Double the ring, only used from the main loop while not delivering */
+static void qemu_net_queue_grow(NetQueue *queue)
+{
+    NetPacket *old_slots = queue->slots;
+    uint8_t *old_pool = queue->pool;
+    unsigned old_mask = queue->nslots - 1;
+    unsigned i, n = queue->tail - queue->head;
+
+    assert(!queue->spsc && !queue->delivering);
+
+    qemu_net_queue_alloc(queue, queue->nslots * 2);
+
+    for (i = 0; i < n; i++) {
+        NetPacket *old = &old_slots[(queue->head + i) & old_mask];
+        NetPacket *packet = &queue->slots[i];
+        uint8_t *data = packet->data;
 
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+        *packet = *old;
+        if (!old->oversized && !old->buf) {
+            packet->data = data;
+            memcpy(packet->data, old->data, old->size);
+        }
+    }
+    queue->head = 0;
+    queue->tail = n;
 
-    return size;
+    g_free(old_slots);
+    g_free(old_pool);
 }
 
 static ssize_t qemu_net_queue_append_iov(NetQueue *queue,
@@ -109,9 +218,13 @@ static ssize_t qemu_net_queue_append_iov(NetQueue *queue,
                                          unsigned flags,
                                          const struct iovec *iov,
                                          int iovcnt,
-                                         NetPacketSent *sent_cb)
+                                         NetPacketSent *sent_cb,
+                                         bool must_queue,
+                                         NetPacketBuf **shared)
 {
     NetPacket *packet;
+    unsigned tail = queue->tail;
+    unsigned head, backlog;
     size_t max_len = 0;
     int i;
 
@@ -119,12 +232,47 @@ static ssize_t qemu_net_queue_append_iov(NetQueue *queue,
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    if (!queue->slots) {
+        qemu_net_queue_alloc(queue, NET_QUEUE_LEN);
+    }
+
+    head = queue->head;
+    if (queue->spsc) {
+        /* the flushing side must be done with a slot before we reuse it */
+        smp_mb();
+    }
+
+    if (tail - head == queue->nslots) {
+        if (!must_queue || queue->spsc) {
+            queue->dropped++;
+            return max_len;
+        }
+        qemu_net_queue_grow(queue);
+        tail = queue->tail;
+        head = queue->head;
+    }
+
+    packet = qemu_net_queue_slot(queue, tail);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
     packet->size = 0;
 
+    /* The refcount is not atomic, so SPSC queues always take a copy */
+    if (shared && !queue->spsc) {
+        if (!*shared) {
+            *shared = qemu_net_packet_buf_new(iov, iovcnt);
+        }
+        (*shared)->refcnt++;
+        packet->buf = *shared;
+        packet->data = packet->buf->data;
+        packet->size = packet->buf->size;
+        iovcnt = 0;
+    } else if (max_len > NET_QUEUE_SLOT_SIZE) {
+        packet->data = g_malloc(max_len);
+        packet->oversized = true;
+    }
+
     for (i = 0; i < iovcnt; i++) {
         size_t len = iov[i].iov_len;
 
@@ -132,9 +280,43 @@ static ssize_t qemu_net_queue_append_iov(NetQueue *queue,
         packet->size += len;
     }
 
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    queue->queued++;
+    backlog = tail + 1 - head;
+    if (backlog > queue->max_backlog) {
+        queue->max_backlog = backlog;
+    }
+
+    if (!queue->spsc) {
+        queue->tail = tail + 1;
+        return packet->size;
+    }
+
+    /* publish the packet, then check whether the ring was drained meanwhile */
+    smp_wmb();
+    queue->tail = tail + 1;
+    smp_mb();
+    if (queue->notifier && queue->head == tail) {
+        event_notifier_set(queue->notifier);
+    }
+
+    return max_len;
+}
+
+static ssize_t qemu_net_queue_append(NetQueue *queue,
+                                     NetClientState *sender,
+                                     unsigned flags,
+                                     const uint8_t *buf,
+                                     size_t size,
+                                     NetPacketSent *sent_cb,
+                                     bool must_queue)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
 
-    return packet->size;
+    return qemu_net_queue_append_iov(queue, sender, flags, &iov, 1,
+                                     sent_cb, must_queue, NULL);
 }
 
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
@@ -176,13 +358,14 @@ ssize_t qemu_net_queue_send(NetQueue *queue,
 {
     ssize_t ret;
 
-    if (queue->delivering || !qemu_can_send_packet(sender)) {
-        return qemu_net_queue_append(queue, sender, flags, data, size, sent_cb);
+    if (queue->spsc || queue->delivering || !qemu_can_send_packet(sender)) {
+        return qemu_net_queue_append(queue, sender, flags, data, size,
+                                     sent_cb, false);
     }
 
     ret = qemu_net_queue_deliver(queue, sender, flags, data, size);
     if (ret == 0) {
-        qemu_net_queue_append(queue, sender, flags, data, size, sent_cb);
+        qemu_net_queue_append(queue, sender, flags, data, size, sent_cb, true);
         return 0;
     }
 
@@ -200,14 +383,36 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
 {
     ssize_t ret;
 
-    if (queue->delivering || !qemu_can_send_packet(sender)) {
+    return qemu_net_queue_send_shared(queue, sender, flags, iov, iovcnt,
+                                      NULL, sent_cb);
+}
+
+/*
+ * Like qemu_net_queue_send_iov(), for a packet that goes to several
+ * queues.  If the packet has to be queued, the queue takes a reference to
+ * *@shared instead of copying the payload, first creating *@shared from
+ * @iov if it is NULL.  The caller drops its own reference with
+ * qemu_net_packet_buf_unref() once the packet went to all queues.
+ */
+ssize_t qemu_net_queue_send_shared(NetQueue *queue,
+                                   NetClientState *sender,
+                                   unsigned flags,
+                                   const struct iovec *iov,
+                                   int iovcnt,
+                                   NetPacketBuf **shared,
+                                   NetPacketSent *sent_cb)
+{
+    ssize_t ret;
+
+    if (queue->spsc || queue->delivering || !qemu_can_send_packet(sender)) {
         return qemu_net_queue_append_iov(queue, sender, flags,
-                                         iov, iovcnt, sent_cb);
+                                         iov, iovcnt, sent_cb, false, shared);
     }
 
     ret = qemu_net_queue_deliver_iov(queue, sender, flags, iov, iovcnt);
     if (ret == 0) {
-        qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt, sent_cb);
+        qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt,
+                                  sent_cb, true, shared);
         return 0;
     }
 
@@ -216,41 +421,90 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/* Number of published packets, including purged ones not yet skipped */
+static unsigned qemu_net_queue_backlog(NetQueue *queue)
+{
+    unsigned tail = queue->tail;
+
+    if (queue->spsc) {
+        /* read the slots only after seeing them published */
+        smp_rmb();
+    }
+    return tail - queue->head;
+}
+
+/* Retire the packet at the head of the ring */
+static void qemu_net_queue_pop(NetQueue *queue)
+{
+    qemu_net_packet_release(queue, qemu_net_queue_slot(queue, queue->head));
+    if (queue->spsc) {
+        smp_mb();
+    }
+    queue->head++;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
-    NetPacket *packet, *next;
+    unsigned i, n = qemu_net_queue_backlog(queue);
+
+    /* Packets behind the head can't be unlinked from a ring, so they are
+     * only marked and skipped by the flush.
+     */
+    for (i = 0; i < n; i++) {
+        NetPacket *packet = qemu_net_queue_slot(queue, queue->head + i);
 
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         if (packet->sender == from) {
-            QTAILQ_REMOVE(&queue->packets, packet, entry);
-            g_free(packet);
+            qemu_net_packet_release(queue, packet);
         }
     }
+
+    while (qemu_net_queue_backlog(queue) &&
+           !qemu_net_queue_slot(queue, queue->head)->sender) {
+        qemu_net_queue_pop(queue);
+    }
+}
+
+/* True if nothing is queued or being delivered from the queue */
+bool qemu_net_queue_idle(NetQueue *queue)
+{
+    return !queue->delivering && !qemu_net_queue_backlog(queue);
 }
 
 void qemu_net_queue_flush(NetQueue *queue)
 {
-    while (!QTAILQ_EMPTY(&queue->packets)) {
-        NetPacket *packet;
+    while (qemu_net_queue_backlog(queue)) {
+        NetPacket *packet = qemu_net_queue_slot(queue, queue->head);
+        NetClientState *sender = packet->sender;
+        NetPacketSent *sent_cb = packet->sent_cb;
         int ret;
 
-        packet = QTAILQ_FIRST(&queue->packets);
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
+        if (!sender) {
+            qemu_net_queue_pop(queue);
+            continue;
+        }
 
         ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
+                                     sender,
                                      packet->flags,
                                      packet->data,
                                      packet->size);
         if (ret == 0) {
-            QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
             break;
         }
 
-        if (packet->sent_cb) {
-            packet->sent_cb(packet->sender, ret);
-        }
+        qemu_net_queue_pop(queue);
 
-        g_free(packet);
+        if (sent_cb) {
+            sent_cb(sender, ret);
+        }
     }
 }
+
+void qemu_net_queue_get_stats(NetQueue *queue, NetQueueStats *stats)
+{
+    stats->capacity = queue->nslots ? queue->nslots : NET_QUEUE_LEN;
+    stats->backlog = queue->tail - queue->head;
+    stats->max_backlog = queue->max_backlog;
+    stats->queued = queue->queued;
+    stats->dropped = queue->dropped;
+}
@@ -29,14 +29,30 @@
 typedef struct NetPacket NetPacket;
 typedef struct NetQueue NetQueue;
 
+/* Packet payload shared by several queues, see qemu_net_queue_send_shared() */
+typedef struct NetPacketBuf {
+    int refcnt;
+    size_t size;
+    uint8_t data[];
+} NetPacketBuf;
+
 typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
+typedef struct NetQueueStats {
+    unsigned capacity;      /* slots in the ring */
+    unsigned backlog;       /* packets currently queued */
+    unsigned max_backlog;   /* highest backlog seen */
+    uint64_t queued;        /* packets queued since creation */
+    uint64_t dropped;       /* packets dropped because the ring was full */
+} NetQueueStats;
+
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
 
 NetQueue *qemu_new_net_queue(void *opaque);
 
 void qemu_del_net_queue(NetQueue *queue);
+void qemu_net_queue_enable_spsc(NetQueue *queue, EventNotifier *notifier);
 
 ssize_t qemu_net_queue_send(NetQueue *queue,
                             NetClientState *sender,
@@ -52,7 +68,20 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+ssize_t qemu_net_queue_send_shared(NetQueue *queue,
+                                   NetClientState *sender,
+                                   unsigned flags,
+                                   const struct iovec *iov,
+                                   int iovcnt,
+                                   NetPacketBuf **shared,
+                                   NetPacketSent *sent_cb);
+
+NetPacketBuf *qemu_net_packet_buf_new(const struct iovec *iov, int iovcnt);
+void qemu_net_packet_buf_unref(NetPacketBuf *buf);
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
+bool qemu_net_queue_idle(NetQueue *queue);
 void qemu_net_queue_flush(NetQueue *queue);
+void qemu_net_queue_get_stats(NetQueue *queue, NetQueueStats *stats);
 
 #endif /* QEMU_NET_QUEUE_H */
@@ -34,6 +34,7 @@
 #include "monitor.h"
 #include "qemu_socket.h"
 #include "slirp/libslirp.h"
+#include "hw/virtio-net.h"
 
 static int get_str_sep(char *buf, int buf_size, const char **pp, int sep)
 {
@@ -71,6 +72,7 @@ typedef struct SlirpState {
     NetClientState nc;
     QTAILQ_ENTRY(SlirpState) entry;
     Slirp *slirp;
+    bool using_vnet_hdr;
 #ifndef _WIN32
     char smb_dir[128];
 #endif
@@ -98,21 +100,96 @@ static inline void slirp_smb_cleanup(SlirpState *s) { }
 #endif
 
 void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len)
+{
+    slirp_output_offload(opaque, pkt, pkt_len, 0, 0, 0, 0);
+}
+
+void slirp_output_offload(void *opaque, const uint8_t *pkt, int pkt_len,
+                          int csum_start, int csum_offset, int hdr_len,
+                          int gso_size)
 {
     SlirpState *s = opaque;
+    struct virtio_net_hdr hdr;
+    struct iovec iov[2];
+
+    if (!s->using_vnet_hdr) {
+        /* offloads were negotiated away while the frame was queued */
+        if (!csum_start) {
+            qemu_send_packet(&s->nc, pkt, pkt_len);
+        }
+        return;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    if (csum_start) {
+        hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr.csum_start = csum_start;
+        hdr.csum_offset = csum_offset;
+    }
+    if (gso_size) {
+        hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        hdr.gso_size = gso_size;
+        hdr.hdr_len = hdr_len;
+    }
 
-    qemu_send_packet(&s->nc, pkt, pkt_len);
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = (void *)pkt;
+    iov[1].iov_len = pkt_len;
+    qemu_sendv_packet(&s->nc, iov, 2);
 }
 
 static ssize_t net_slirp_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+    size_t hdr_len = 0;
+    int csum_partial = 0;
+
+    if (s->using_vnet_hdr) {
+        const struct virtio_net_hdr *hdr = (const struct virtio_net_hdr *)buf;
+
+        hdr_len = sizeof(*hdr);
+        if (size < hdr_len) {
+            return size;
+        }
+        csum_partial = hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    }
 
-    slirp_input(s->slirp, buf, size);
+    slirp_input_offload(s->slirp, buf + hdr_len, size - hdr_len,
+                        csum_partial);
 
     return size;
 }
 
+static int net_slirp_has_vnet_hdr(NetClientState *nc)
+{
+    return 1;
+}
+
+static int net_slirp_has_vnet_hdr_len(NetClientState *nc, int len)
+{
+    return len == sizeof(struct virtio_net_hdr);
+}
+
+static void net_slirp_using_vnet_hdr(NetClientState *nc, int using_vnet_hdr)
+{
+    SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+
+    s->using_vnet_hdr = using_vnet_hdr != 0;
+    if (!s->using_vnet_hdr) {
+        slirp_set_offload(s->slirp, 0, 0);
+    }
+}
+
+static void net_slirp_set_offload(NetClientState *nc, int csum, int tso4,
+                                  int tso6, int ecn, int ufo)
+{
+    SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+
+    /* slirp only ever sends IPv4 TCP segments, and never with ECN */
+    slirp_set_offload(s->slirp, s->using_vnet_hdr && csum, tso4);
+}
+
 static void net_slirp_cleanup(NetClientState *nc)
 {
     SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
@@ -127,6 +204,10 @@ static NetClientInfo net_slirp_info = {
     .size = sizeof(SlirpState),
     .receive = net_slirp_receive,
     .cleanup = net_slirp_cleanup,
+    .has_vnet_hdr = net_slirp_has_vnet_hdr,
+    .has_vnet_hdr_len = net_slirp_has_vnet_hdr_len,
+    .using_vnet_hdr = net_slirp_using_vnet_hdr,
+    .set_offload = net_slirp_set_offload,
 };
 
 static int net_slirp_init(NetClientState *peer, const char *model,
@@ -65,6 +65,33 @@ static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf,
                   (struct sockaddr *)&s->dgram_dst, sizeof(s->dgram_dst));
 }
 
+#ifdef CONFIG_SENDMMSG
+/* Send a whole batch with one system call */
+static int net_socket_receive_batch_dgram(NetClientState *nc,
+                                          const NetBatchPacket *pkts,
+                                          int count)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    struct mmsghdr msgs[count];
+    int i, ret;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < count; i++) {
+        msgs[i].msg_hdr.msg_name = &s->dgram_dst;
+        msgs[i].msg_hdr.msg_namelen = sizeof(s->dgram_dst);
+        msgs[i].msg_hdr.msg_iov = (struct iovec *)pkts[i].iov;
+        msgs[i].msg_hdr.msg_iovlen = pkts[i].iovcnt;
+    }
+
+    do {
+        ret = sendmmsg(s->fd, msgs, count, 0);
+    } while (ret == -1 && errno == EINTR);
+
+    /* Whatever was not sent takes the per-packet path */
+    return ret < 0 ? 0 : ret;
+}
+#endif
+
 static void net_socket_send(void *opaque)
 {
     NetSocketState *s = opaque;
@@ -258,6 +285,9 @@ static NetClientInfo net_dgram_socket_info = {
     .type = NET_CLIENT_OPTIONS_KIND_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive_dgram,
+#ifdef CONFIG_SENDMMSG
+    .receive_batch = net_socket_receive_batch_dgram,
+#endif
     .cleanup = net_socket_cleanup,
 };
 
@@ -751,3 +751,13 @@ struct vhost_net *tap_get_vhost_net(NetClientState *nc)
 {
     return NULL;
 }
+
+int tap_enable(NetClientState *nc)
+{
+    return -1;
+}
+
+int tap_disable(NetClientState *nc)
+{
+    return -1;
+}
@@ -59,6 +59,7 @@ typedef struct TAPState {
     unsigned int write_poll : 1;
     unsigned int using_vnet_hdr : 1;
     unsigned int has_ufo: 1;
+    unsigned int enabled : 1;
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
 } TAPState;
@@ -181,6 +182,13 @@ ssize_t tap_read_packet(int tapfd, uint8_t *buf, int maxlen)
 {
     return read(tapfd, buf, maxlen);
 }
+
+static ssize_t tap_read_iov(void *opaque, const struct iovec *iov, int iovcnt)
+{
+    TAPState *s = opaque;
+
+    return readv(s->fd, iov, iovcnt);
+}
 #endif
 
 static void tap_send_completed(NetClientState *nc, ssize_t len)
@@ -197,6 +205,20 @@ static void tap_send(void *opaque)
     do {
         uint8_t *buf = s->buf;
 
+#ifndef __sun__
+        /* Read straight into the guest's buffers when the peer can take
+         * the packet with the vnet header as we get it from the kernel */
+        if (!s->host_vnet_hdr_len || s->using_vnet_hdr) {
+            size = qemu_receive_read(&s->nc, tap_read_iov, s);
+            if (size < 0) {
+                break;
+            }
+            if (size > 0) {
+                continue;
+            }
+        }
+#endif
+
         size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
         if (size <= 0) {
             break;
@@ -310,6 +332,47 @@ int tap_get_fd(NetClientState *nc)
     return s->fd;
 }
 
+/*
+ * Queues of a multiqueue device can be detached while the guest does not
+ * use them, the kernel then spreads the traffic over the attached ones.
+ */
+int tap_enable(NetClientState *nc)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    int ret;
+
+    assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_TAP);
+
+    if (s->enabled) {
+        return 0;
+    }
+
+    ret = tap_fd_enable(s->fd);
+    if (ret == 0) {
+        s->enabled = 1;
+    }
+    return ret;
+}
+
+int tap_disable(NetClientState *nc)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    int ret;
+
+    assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_TAP);
+
+    if (!s->enabled) {
+        return 0;
+    }
+
+    ret = tap_fd_disable(s->fd);
+    if (ret == 0) {
+        qemu_purge_queued_packets(nc);
+        s->enabled = 0;
+    }
+    return ret;
+}
+
 /* fd support */
 
 static NetClientInfo net_tap_info = {
@@ -320,6 +383,12 @@ static NetClientInfo net_tap_info = {
     .receive_iov = tap_receive_iov,
     .poll = tap_poll,
     .cleanup = tap_cleanup,
+    .has_ufo = tap_has_ufo,
+    .has_vnet_hdr = tap_has_vnet_hdr,
+    .has_vnet_hdr_len = tap_has_vnet_hdr_len,
+    .using_vnet_hdr = tap_using_vnet_hdr,
+    .set_offload = tap_set_offload,
+    .set_vnet_hdr_len = tap_set_vnet_hdr_len,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -339,6 +408,7 @@ static TAPState *net_tap_fd_init(NetClientState *peer,
     s->host_vnet_hdr_len = vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
     s->using_vnet_hdr = 0;
     s->has_ufo = tap_probe_has_ufo(s->fd);
+    s->enabled = 1;
     tap_set_offload(&s->nc, 0, 0, 0, 0, 0);
     tap_read_poll(s, 1);
     s->vhost_net = NULL;
@@ -551,17 +621,10 @@ int net_init_bridge(const NetClientOptions *opts, const char *name,
 
 static int net_tap_init(const NetdevTapOptions *tap, int *vnet_hdr,
                         const char *setup_script, char *ifname,
-                        size_t ifname_sz)
+                        size_t ifname_sz, int mq_required)
 {
     int fd, vnet_hdr_required;
 
-    if (tap->has_ifname) {
-        pstrcpy(ifname, ifname_sz, tap->ifname);
-    } else {
-        assert(ifname_sz > 0);
-        ifname[0] = '\0';
-    }
-
     if (tap->has_vnet_hdr) {
         *vnet_hdr = tap->vnet_hdr;
         vnet_hdr_required = *vnet_hdr;
@@ -570,7 +633,8 @@ static int net_tap_init(const NetdevTapOptions *tap, int *vnet_hdr,
         vnet_hdr_required = 0;
     }
 
-    TFR(fd = tap_open(ifname, ifname_sz, vnet_hdr, vnet_hdr_required));
+    TFR(fd = tap_open(ifname, ifname_sz, vnet_hdr, vnet_hdr_required,
+                      mq_required));
     if (fd < 0) {
         return -1;
     }
@@ -586,27 +650,102 @@ static int net_tap_init(const NetdevTapOptions *tap, int *vnet_hdr,
     return fd;
 }
 
+/* Sets up the client for one queue of a tap device opened as @fd */
+static int net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
+                            const char *model, const char *name,
+                            int queue_index, int fd, int vnet_hdr,
+                            const char *ifname, const char *script,
+                            const char *downscript)
+{
+    TAPState *s;
+
+    s = net_tap_fd_init(peer, model, name, fd, vnet_hdr);
+    if (!s) {
+        close(fd);
+        return -1;
+    }
+    s->nc.queue_index = queue_index;
+
+    if (tap_set_sndbuf(s->fd, tap) < 0) {
+        return -1;
+    }
+
+    if (tap->has_fd) {
+        snprintf(s->nc.info_str, sizeof(s->nc.info_str), "fd=%d", fd);
+    } else if (tap->has_helper) {
+        snprintf(s->nc.info_str, sizeof(s->nc.info_str), "helper=%s",
+                 tap->helper);
+    } else {
+        snprintf(s->nc.info_str, sizeof(s->nc.info_str),
+                 "ifname=%s,script=%s,downscript=%s", ifname, script,
+                 downscript);
+        if (queue_index > 0) {
+            size_t len = strlen(s->nc.info_str);
+
+            snprintf(s->nc.info_str + len, sizeof(s->nc.info_str) - len,
+                     ",queue=%d", queue_index);
+        }
+
+        /* the interface goes away with its first queue */
+        if (queue_index == 0 && strcmp(downscript, "no") != 0) {
+            snprintf(s->down_script, sizeof(s->down_script), "%s", downscript);
+            snprintf(s->down_script_arg, sizeof(s->down_script_arg), "%s", ifname);
+        }
+    }
+
+    if (tap->has_vhost ? tap->vhost :
+        tap->has_vhostfd || (tap->has_vhostforce && tap->vhostforce)) {
+        VhostNetOptions options;
+        int vhostfd;
+
+        if (tap->has_vhostfd) {
+            vhostfd = net_handle_fd_param(cur_mon, tap->vhostfd);
+            if (vhostfd == -1) {
+                return -1;
+            }
+        } else {
+            vhostfd = -1;
+        }
+
+        options.backend_type = VHOST_BACKEND_TYPE_KERNEL;
+        options.net_backend = &s->nc;
+        options.opaque = (void *)(intptr_t)vhostfd;
+        options.force = tap->has_vhostforce && tap->vhostforce;
+        s->vhost_net = vhost_net_init(&options);
+        if (!s->vhost_net) {
+            error_report("vhost-net requested but could not be initialized");
+            return -1;
+        }
+    } else if (tap->has_vhostfd) {
+        error_report("vhostfd= is not valid without vhost");
+        return -1;
+    }
+
+    return 0;
+}
+
 int net_init_tap(const NetClientOptions *opts, const char *name,
                  NetClientState *peer)
 {
     const NetdevTapOptions *tap;
 
     int fd, vnet_hdr = 0;
-    const char *model;
-    TAPState *s;
+    int i, queues;
 
     /* for the no-fd, no-helper case */
     const char *script = NULL; /* suppress wrong "uninit'd use" gcc warning */
+    const char *downscript = NULL;
     char ifname[128];
 
     assert(opts->kind == NET_CLIENT_OPTIONS_KIND_TAP);
     tap = opts->tap;
+    queues = tap->has_queues ? tap->queues : 1;
 
     if (tap->has_fd) {
         if (tap->has_ifname || tap->has_script || tap->has_downscript ||
-            tap->has_vnet_hdr || tap->has_helper) {
+            tap->has_vnet_hdr || tap->has_helper || tap->has_queues) {
             error_report("ifname=, script=, downscript=, vnet_hdr=, "
-                         "and helper= are invalid with fd=");
+                         "helper= and queues= are invalid with fd=");
             return -1;
         }
 
@@ -619,13 +758,14 @@ int net_init_tap(const NetClientOptions *opts, const char *name,
 
         vnet_hdr = tap_probe_vnet_hdr(fd);
 
-        model = "tap";
+        return net_init_tap_one(tap, peer, "tap", name, 0, fd, vnet_hdr,
+                                NULL, NULL, NULL);
 
     } else if (tap->has_helper) {
         if (tap->has_ifname || tap->has_script || tap->has_downscript ||
-            tap->has_vnet_hdr) {
-            error_report("ifname=, script=, downscript=, and vnet_hdr= "
-                         "are invalid with helper=");
+            tap->has_vnet_hdr || tap->has_queues) {
+            error_report("ifname=, script=, downscript=, vnet_hdr= "
+                         "and queues= are invalid with helper=");
             return -1;
         }
 
@@ -638,71 +778,49 @@ int net_init_tap(const NetClientOptions *opts, const char *name,
 
         vnet_hdr = tap_probe_vnet_hdr(fd);
 
-        model = "bridge";
-
-    } else {
-        script = tap->has_script ? tap->script : DEFAULT_NETWORK_SCRIPT;
-        fd = net_tap_init(tap, &vnet_hdr, script, ifname, sizeof ifname);
-        if (fd == -1) {
-            return -1;
-        }
-
-        model = "tap";
+        return net_init_tap_one(tap, peer, "bridge", name, 0, fd, vnet_hdr,
+                                NULL, NULL, NULL);
     }
 
-    s = net_tap_fd_init(peer, model, name, fd, vnet_hdr);
-    if (!s) {
-        close(fd);
+    if (queues < 1 || queues > MAX_TAP_QUEUES) {
+        error_report("queues= must be between 1 and %d", MAX_TAP_QUEUES);
         return -1;
     }
-
-    if (tap_set_sndbuf(s->fd, tap) < 0) {
+    if (queues > 1 && peer) {
+        error_report("queues= is only valid with -netdev");
+        return -1;
+    }
+    if (queues > 1 && tap->has_vhostfd) {
+        error_report("vhostfd= is invalid with queues=");
         return -1;
     }
 
-    if (tap->has_fd) {
-        snprintf(s->nc.info_str, sizeof(s->nc.info_str), "fd=%d", fd);
-    } else if (tap->has_helper) {
-        snprintf(s->nc.info_str, sizeof(s->nc.info_str), "helper=%s",
-                 tap->helper);
+    script = tap->has_script ? tap->script : DEFAULT_NETWORK_SCRIPT;
+    downscript = tap->has_downscript ? tap->downscript :
+                                       DEFAULT_NETWORK_DOWN_SCRIPT;
+    if (tap->has_ifname) {
+        pstrcpy(ifname, sizeof ifname, tap->ifname);
     } else {
-        const char *downscript;
-
-        downscript = tap->has_downscript ? tap->downscript :
-                                           DEFAULT_NETWORK_DOWN_SCRIPT;
-
-        snprintf(s->nc.info_str, sizeof(s->nc.info_str),
-                 "ifname=%s,script=%s,downscript=%s", ifname, script,
-                 downscript);
-
-        if (strcmp(downscript, "no") != 0) {
-            snprintf(s->down_script, sizeof(s->down_script), "%s", downscript);
-            snprintf(s->down_script_arg, sizeof(s->down_script_arg), "%s", ifname);
-        }
+        ifname[0] = '\0';
     }
 
-    if (tap->has_vhost ? tap->vhost :
-        tap->has_vhostfd || (tap->has_vhostforce && tap->vhostforce)) {
-        int vhostfd;
-
-        if (tap->has_vhostfd) {
-            vhostfd = net_handle_fd_param(cur_mon, tap->vhostfd);
-            if (vhostfd == -1) {
-                return -1;
-            }
-        } else {
-            vhostfd = -1;
+    /*
+     * Each queue is a separate open of the same interface.  The first one
+     * creates it (and picks its name if none was given) and runs the
+     * script, the others attach to it.  The kernel steers each flow to
+     * the queue that last transmitted on it.
+     */
+    for (i = 0; i < queues; i++) {
+        fd = net_tap_init(tap, &vnet_hdr, i == 0 ? script : NULL,
+                          ifname, sizeof ifname, queues > 1);
+        if (fd == -1) {
+            return -1;
         }
 
-        s->vhost_net = vhost_net_init(&s->nc, vhostfd,
-                                      tap->has_vhostforce && tap->vhostforce);
-        if (!s->vhost_net) {
-            error_report("vhost-net requested but could not be initialized");
+        if (net_init_tap_one(tap, peer, "tap", name, i, fd, vnet_hdr,
+                             ifname, script, downscript) < 0) {
             return -1;
         }
-    } else if (tap->has_vhostfd) {
-        error_report("vhostfd= is not valid without vhost");
-        return -1;
     }
 
     return 0;
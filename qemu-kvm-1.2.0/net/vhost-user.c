@@ -0,0 +1,117 @@
+/*
+ * vhost-user net client
+ *
+ * Copyright (C) 2012
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * The packets of a vhost-user netdev never pass through QEMU: the process
+ * at the other end of the socket serves the virtio-net rings of the guest
+ * directly, see hw/vhost-user.c.  This client only holds the vhost
+ * instance for the virtio-net device it is attached to.
+ */
+
+#include "net/vhost-user.h"
+#include "hw/vhost_net.h"
+#include "hw/virtio-net.h"
+#include "qemu_socket.h"
+#include "qemu-error.h"
+
+typedef struct VhostUserState {
+    NetClientState nc;
+    VHostNetState *vhost_net;
+} VhostUserState;
+
+VHostNetState *vhost_user_get_vhost_net(NetClientState *nc)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+    return s->vhost_net;
+}
+
+/* Packets sent while the rings are not running have nowhere to go */
+static ssize_t vhost_user_receive(NetClientState *nc, const uint8_t *buf,
+                                  size_t size)
+{
+    return size;
+}
+
+/* The backend sees the guest's buffers, virtio-net header included */
+static int vhost_user_has_vnet_hdr(NetClientState *nc)
+{
+    return 1;
+}
+
+static int vhost_user_has_vnet_hdr_len(NetClientState *nc, int len)
+{
+    return len == sizeof(struct virtio_net_hdr) ||
+           len == sizeof(struct virtio_net_hdr_mrg_rxbuf);
+}
+
+static void vhost_user_cleanup(NetClientState *nc)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+
+    if (s->vhost_net) {
+        vhost_net_cleanup(s->vhost_net);
+        s->vhost_net = NULL;
+    }
+}
+
+static NetClientInfo net_vhost_user_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_VHOST_USER,
+    .size = sizeof(VhostUserState),
+    .receive = vhost_user_receive,
+    .cleanup = vhost_user_cleanup,
+    .has_vnet_hdr = vhost_user_has_vnet_hdr,
+    .has_vnet_hdr_len = vhost_user_has_vnet_hdr_len,
+};
+
+int net_init_vhost_user(const NetClientOptions *opts, const char *name,
+                        NetClientState *peer)
+{
+    const NetdevVhostUserOptions *vhost_user;
+    VhostNetOptions options;
+    NetClientState *nc;
+    VhostUserState *s;
+    int fd;
+
+    assert(opts->kind == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+    vhost_user = opts->vhost_user;
+
+    /* the rings are handed over only to a virtio-net device that is the
+     * direct peer, not across a hub */
+    if (peer) {
+        error_report("vhost-user is only supported with -netdev");
+        return -1;
+    }
+
+    fd = unix_connect(vhost_user->path);
+    if (fd < 0) {
+        error_report("vhost-user: can't connect to %s", vhost_user->path);
+        return -1;
+    }
+
+    nc = qemu_new_net_client(&net_vhost_user_info, peer, "vhost_user", name);
+    snprintf(nc->info_str, sizeof(nc->info_str), "vhost-user to %s",
+             vhost_user->path);
+    s = DO_UPCAST(VhostUserState, nc, nc);
+
+    /* the vhost instance owns the socket from here on */
+    options.backend_type = VHOST_BACKEND_TYPE_USER;
+    options.net_backend = nc;
+    options.opaque = (void *)(intptr_t)fd;
+    options.force = vhost_user->has_vhostforce && vhost_user->vhostforce;
+    s->vhost_net = vhost_net_init(&options);
+    if (!s->vhost_net) {
+        error_report("vhost-user requested but could not be initialized");
+        qemu_del_net_client(nc);
+        return -1;
+    }
+
+    return 0;
+}
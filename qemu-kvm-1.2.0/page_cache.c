@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set associative cache indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -34,6 +34,12 @@
     do { } while (0)
 #endif
 
+/*
+ * The cache is CACHE_WAYS-way set associative: a page address selects a
+ * set, and within the set the least recently used item is replaced.
+ */
+#define CACHE_WAYS 4
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
@@ -48,6 +54,9 @@ struct PageCache {
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
+    unsigned int num_ways;
+    int64_t num_sets;
+    uint64_t num_evictions;
 };
 
 PageCache *cache_init(int64_t num_pages, unsigned int page_size)
@@ -72,8 +81,12 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
+    cache->num_evictions = 0;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " (%" PRId64 " sets of %u)\n",
+            cache->max_num_items, cache->num_sets, cache->num_ways);
 
     cache->page_cache = g_malloc((cache->max_num_items) *
                                  sizeof(*cache->page_cache));
@@ -102,43 +115,69 @@ void cache_fini(PageCache *cache)
     cache->page_cache = NULL;
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* Returns the first item of the set @address maps to */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
     size_t pos;
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    g_assert(cache->num_sets);
+    pos = (address / cache->page_size) & (cache->num_sets - 1);
+    return &cache->page_cache[pos * cache->num_ways];
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
+    set = cache_get_set(cache, addr);
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
 
-    return (cache->page_cache[pos].it_addr == addr);
+    return NULL;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+/* Returns the item @addr should go to: a free one, or else the LRU one */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
-
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    CacheItem *set, *victim;
+    unsigned int i;
+
+    set = cache_get_set(cache, addr);
+    victim = &set[0];
+    for (i = 0; i < cache->num_ways; i++) {
+        if (!set[i].it_data) {
+            return &set[i];
+        }
+        if (set[i].it_age < victim->it_age) {
+            victim = &set[i];
+        }
+    }
 
-    pos = cache_get_cache_pos(cache, addr);
+    return victim;
+}
 
-    return &cache->page_cache[pos];
+bool cache_is_cached(const PageCache *cache, uint64_t addr)
+{
+    return cache_get_by_addr(cache, addr) != NULL;
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    if (!it) {
+        return NULL;
+    }
+
+    it->it_age = ++cache->max_item_age;
+    return it->it_data;
 }
 
 void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
@@ -151,9 +190,17 @@ void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
+    if (!it) {
+        it = cache_get_victim(cache, addr);
+        if (it->it_data) {
+            cache->num_evictions++;
+        }
+    }
 
     if (!it->it_data) {
         cache->num_items++;
+    } else if (it->it_data != pdata) {
+        g_free(it->it_data);
     }
 
     it->it_data = pdata;
@@ -161,6 +208,11 @@ void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
     it->it_addr = addr;
 }
 
+uint64_t cache_get_evictions(const PageCache *cache)
+{
+    return cache->num_evictions;
+}
+
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
     PageCache *new_cache;
@@ -190,27 +242,28 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     for (i = 0; i < cache->max_num_items; i++) {
         old_it = &cache->page_cache[i];
         if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data) {
-                /* keep the MRU page */
-                if (new_it->it_age >= old_it->it_age) {
-                    g_free(old_it->it_data);
-                } else {
-                    g_free(new_it->it_data);
-                    new_it->it_data = old_it->it_data;
-                    new_it->it_age = old_it->it_age;
-                    new_it->it_addr = old_it->it_addr;
-                }
+            /* if the new set is full, keep the MRU pages */
+            new_it = cache_get_victim(new_cache, old_it->it_addr);
+            if (!new_it->it_data) {
+                new_cache->num_items++;
+            } else if (new_it->it_age >= old_it->it_age) {
+                g_free(old_it->it_data);
+                continue;
             } else {
-                cache_insert(new_cache, old_it->it_addr, old_it->it_data);
+                g_free(new_it->it_data);
             }
+            new_it->it_data = old_it->it_data;
+            new_it->it_age = old_it->it_age;
+            new_it->it_addr = old_it->it_addr;
         }
     }
 
+    g_free(cache->page_cache);
     cache->page_cache = new_cache->page_cache;
     cache->max_num_items = new_cache->max_num_items;
     cache->num_items = new_cache->num_items;
+    cache->num_ways = new_cache->num_ways;
+    cache->num_sets = new_cache->num_sets;
 
     g_free(new_cache);
 
@@ -24,6 +24,8 @@
 
 #define BIOS_CFG_IOPORT_CFG	0x510
 #define BIOS_CFG_IOPORT_DATA	0x511
+/* low half of the DMA address register at 0x514 */
+#define BIOS_CFG_IOPORT_DMA_LO	0x518
 
 /* Break the translation block flow so -d cpu shows us values */
 #define DEBUG_HERE \
@@ -87,6 +89,45 @@
 	*/						\
 	.dc.b		0x67,0xf3,0x6c
 
+/*
+ * Read a blob from the fw_cfg device with a single DMA transfer, if
+ * FW_CFG_ID has FW_CFG_VERSION_DMA.  The FWCfgDmaAccess is built on
+ * the stack, whose linear address must be below 4G.
+ * Requires _ADDR, _SIZE and _DATA values for the parameter.
+ *
+ * Clobbers:	%eax, %edx, %ecx, %edi, %ebp
+ */
+#define read_fw_blob_dma(var)				\
+	read_fw		var ## _ADDR;			\
+	mov		%eax, %edi;			\
+	read_fw		var ## _SIZE;			\
+	mov		%eax, %ecx;			\
+	mov		%esp, %ebp;			\
+	sub		$16, %esp;			\
+	mov		$((var ## _DATA << 16) |	\
+			  FW_CFG_DMA_CTL_SELECT |	\
+			  FW_CFG_DMA_CTL_READ), %eax;	\
+	bswap		%eax;				\
+	mov		%eax, -16(%bp);			\
+	bswap		%ecx;				\
+	mov		%ecx, -12(%bp);			\
+	movl		$0, -8(%bp);			\
+	bswap		%edi;				\
+	mov		%edi, -4(%bp);			\
+	xor		%eax, %eax;			\
+	mov		%ss, %ax;			\
+	shl		$4, %eax;			\
+	movzwl		%sp, %edx;			\
+	add		%edx, %eax;			\
+	bswap		%eax;				\
+	mov		$BIOS_CFG_IOPORT_DMA_LO, %dx;	\
+	outl		%eax, (%dx);			\
+	/* wait for all bits but ERROR to clear */	\
+	2:						\
+	testl		$0xfeffffff, -16(%bp);		\
+	jnz		2b;				\
+	mov		%ebp, %esp
+
 #define OPTION_ROM_START					\
     .code16;						\
     .text;						\
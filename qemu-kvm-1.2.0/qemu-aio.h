@@ -41,6 +41,104 @@ void qemu_aio_release(void *p);
 /* Returns 1 if there are still outstanding AIO requests; 0 otherwise */
 typedef int (AioFlushHandler)(void *opaque);
 
+typedef struct AioHandler AioHandler;
+typedef struct AioTimer AioTimer;
+
+/*
+ * An event loop: fd handlers, bottom halves and timers that are dispatched
+ * together by aio_poll().  Only one thread runs a context at a time; that
+ * thread alone may add or remove handlers and timers, while bottom halves
+ * can be created and scheduled from any thread without holding a lock.
+ *
+ * The main loop's context is returned by qemu_get_aio_context().  Its fd
+ * handlers are mirrored into the main loop's iohandlers and the qemu_aio_*
+ * and qemu_bh_* functions operate on it.
+ */
+typedef struct AioContext {
+    /* The list of registered AIO handlers */
+    QLIST_HEAD(, AioHandler) aio_handlers;
+
+    /* This is a simple lock used to protect the aio_handlers list.
+     * Specifically, it's used to ensure that no callbacks are removed while
+     * we're walking and dispatching callbacks.
+     */
+    int walking_handlers;
+
+    /* Anchor of the list of bottom halves belonging to the context */
+    struct QEMUBH *first_bh;
+
+    /* Set when a scheduled bottom half has notified the context, cleared
+     * by aio_bh_poll().  Coalesces wakeups from other threads.
+     */
+    int notify_pending;
+
+    /* Nesting depth of aio_bh_poll, deleted bhs are freed at depth 0 */
+    int bh_nesting;
+
+    /* Armed timers, sorted by expiry time */
+    AioTimer *active_timers;
+
+    /* Wakes up aio_poll() when a bottom half is scheduled from another
+     * thread, rfd == wfd with eventfd.  The main context's notifier is
+     * polled by the main loop as well.
+     */
+    int notify_rfd, notify_wfd;
+
+    bool is_main;
+} AioContext;
+
+typedef void AioTimerFunc(void *opaque);
+
+/* Allocate a new context, to be run by a thread of its own */
+AioContext *aio_context_new(void);
+
+/* Free a context; all its handlers and timers must be gone */
+void aio_context_free(AioContext *ctx);
+
+/* The context of the main loop */
+AioContext *qemu_get_aio_context(void);
+
+/* Wake up the thread running @ctx, e.g. because the condition it waits
+ * for has changed.  Safe to call from any thread.
+ */
+void aio_notify(AioContext *ctx);
+
+/* Run the handlers of @ctx that are ready, blocking for one if @blocking is
+ * true and the io_flush handlers say that requests are outstanding.
+ * Returns whether progress was made or may still be made, so that
+ * "while (aio_poll(ctx, true));" drains the context.
+ */
+bool aio_poll(AioContext *ctx, bool blocking);
+
+/* Like qemu_aio_set_fd_handler, for the handlers of @ctx */
+void aio_set_fd_handler(AioContext *ctx,
+                        int fd,
+                        IOHandler *io_read,
+                        IOHandler *io_write,
+                        AioFlushHandler *io_flush,
+                        void *opaque);
+
+/* Like qemu_bh_new, for a bottom half run by @ctx */
+QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque);
+
+/* Run the scheduled bottom halves of @ctx, returns 1 if a non-idle one ran */
+int aio_bh_poll(AioContext *ctx);
+
+/* Lower *timeout (in ms) to the next bottom half or timer of @ctx */
+void aio_update_timeout(AioContext *ctx, uint32_t *timeout);
+
+/* Timers of a context.  Expiry times are in nanoseconds of get_clock(), the
+ * callback runs from aio_poll() in the thread that runs the context.
+ */
+AioTimer *aio_timer_new(AioContext *ctx, AioTimerFunc *cb, void *opaque);
+void aio_timer_free(AioTimer *ts);
+void aio_timer_mod(AioTimer *ts, int64_t expire_time);
+void aio_timer_del(AioTimer *ts);
+bool aio_timer_pending(AioTimer *ts);
+
+/* Run the timers of @ctx that have expired, returns how many ran */
+int aio_run_timers(AioContext *ctx);
+
 /* Flush any pending AIO operation. This function will block until all
  * outstanding AIO operations have been completed or cancelled. */
 void qemu_aio_flush(void);
@@ -144,6 +144,11 @@ int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len)
     return s->chr_write(s, buf, len);
 }
 
+void qemu_chr_fe_add_write_notifier(CharDriverState *s, Notifier *notifier)
+{
+    notifier_list_add(&s->write_notifiers, notifier);
+}
+
 int qemu_chr_fe_ioctl(CharDriverState *s, int cmd, void *arg)
 {
     if (!s->chr_ioctl)
@@ -240,6 +245,7 @@ typedef struct {
     IOEventHandler *chr_event[MAX_MUX];
     void *ext_opaque[MAX_MUX];
     CharDriverState *drv;
+    CharDriverState *chr;
     int focus;
     int mux_cnt;
     int term_got_escape;
@@ -477,6 +483,7 @@ static CharDriverState *qemu_chr_open_mux(CharDriverState *drv)
 
     chr->opaque = d;
     d->drv = drv;
+    d->chr = chr;
     d->focus = -1;
     chr->chr_write = mux_chr_write;
     chr->chr_update_read_handler = mux_chr_update_read_handler;
@@ -539,6 +546,223 @@ int send_all(int fd, const void *_buf, int len1)
 }
 #endif /* !_WIN32 */
 
+/***********************************************************/
+/* Output buffering for fd based backends
+ *
+ * Writes go straight to the (non-blocking) fd while the buffer is empty.
+ * Whatever the fd does not take is queued in a ring and flushed from a
+ * write handler in the main loop, so a slow reader never stalls the
+ * device model.  When the ring is full the write is short, and the
+ * frontend is told through the write notifiers once there is room.
+ * Frontends that did not register a write notifier would lose the rest,
+ * so for them a full ring makes the write block as it did without the
+ * buffer.
+ */
+
+#define CHR_OUTBUF_SIZE (64 * 1024)
+
+struct CharOutBuf {
+    int fd;
+    uint8_t *buf;
+    int size;
+    int head;
+    int len;
+    bool blocked;
+    IOCanReadHandler *fd_read_poll;
+    IOHandler *fd_read;
+};
+
+static void chr_outbuf_flush(void *opaque);
+
+static void chr_outbuf_init(CharDriverState *chr, int fd, uint64_t size)
+{
+    CharOutBuf *ob;
+
+    if (size == 0) {
+        return;
+    }
+    ob = g_malloc0(sizeof(*ob));
+    ob->fd = fd;
+    ob->size = MIN(size, INT_MAX);
+    ob->buf = g_malloc(ob->size);
+    if (fd >= 0) {
+        socket_set_nonblock(fd);
+    }
+    chr->outbuf = ob;
+}
+
+static void chr_outbuf_free(CharDriverState *chr)
+{
+    if (chr->outbuf) {
+        g_free(chr->outbuf->buf);
+        g_free(chr->outbuf);
+        chr->outbuf = NULL;
+    }
+}
+
+/* Set the read handlers of @fd, keeping the output write handler if
+ * the output buffer shares that fd.  */
+static void chr_set_fd_handlers(CharDriverState *chr, int fd,
+                                IOCanReadHandler *fd_read_poll,
+                                IOHandler *fd_read)
+{
+    CharOutBuf *ob = chr->outbuf;
+
+    if (ob && ob->fd == fd && fd >= 0) {
+        ob->fd_read_poll = fd_read_poll;
+        ob->fd_read = fd_read;
+        qemu_set_fd_handler2(fd, fd_read_poll, fd_read,
+                             ob->len ? chr_outbuf_flush : NULL, chr);
+    } else {
+        qemu_set_fd_handler2(fd, fd_read_poll, fd_read, NULL, chr);
+    }
+}
+
+static void chr_outbuf_update(CharDriverState *chr)
+{
+    CharOutBuf *ob = chr->outbuf;
+
+    chr_set_fd_handlers(chr, ob->fd, ob->fd_read_poll, ob->fd_read);
+}
+
+/* Point the buffer at a new fd, dropping anything queued for the old one */
+static void chr_outbuf_set_fd(CharDriverState *chr, int fd)
+{
+    CharOutBuf *ob = chr->outbuf;
+
+    if (!ob) {
+        return;
+    }
+    ob->fd = fd;
+    ob->head = 0;
+    ob->len = 0;
+    ob->fd_read_poll = NULL;
+    ob->fd_read = NULL;
+    if (fd >= 0) {
+        socket_set_nonblock(fd);
+    }
+}
+
+/* Returns the number of bytes written, 0 if the fd is full, -1 on error */
+static int chr_outbuf_send(int fd, const uint8_t *buf, int len)
+{
+    int ret;
+
+    do {
+#ifdef _WIN32
+        ret = send(fd, (const char *)buf, len, 0);
+        if (ret < 0) {
+            errno = WSAGetLastError();
+            if (errno == WSAEWOULDBLOCK) {
+                return 0;
+            }
+        }
+#else
+        ret = write(fd, buf, len);
+        if (ret < 0 && errno == EAGAIN) {
+            return 0;
+        }
+#endif
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
+
+static void chr_outbuf_flush(void *opaque)
+{
+    CharDriverState *chr = opaque;
+    CharOutBuf *ob = chr->outbuf;
+    int ret, chunk;
+
+    while (ob->len) {
+        chunk = MIN(ob->len, ob->size - ob->head);
+        ret = chr_outbuf_send(ob->fd, ob->buf + ob->head, chunk);
+        if (ret < 0) {
+            /* Nobody is going to read this anymore */
+            ob->len = 0;
+            break;
+        }
+        if (ret == 0) {
+            break;
+        }
+        ob->head = (ob->head + ret) % ob->size;
+        ob->len -= ret;
+    }
+    if (ob->len == 0) {
+        ob->head = 0;
+        chr_outbuf_update(chr);
+    }
+
+    if (ob->blocked && ob->len <= ob->size / 2) {
+        ob->blocked = false;
+        notifier_list_notify(&chr->write_notifiers, chr);
+    }
+}
+
+/* Write out the whole ring, waiting for the fd */
+static int chr_outbuf_drain(CharDriverState *chr)
+{
+    CharOutBuf *ob = chr->outbuf;
+    int ret = 0, chunk;
+
+    while (ob->len) {
+        chunk = MIN(ob->len, ob->size - ob->head);
+        if (send_all(ob->fd, ob->buf + ob->head, chunk) < chunk) {
+            ob->len = 0;
+            ret = -1;
+            break;
+        }
+        ob->head = (ob->head + chunk) % ob->size;
+        ob->len -= chunk;
+    }
+    ob->head = 0;
+    chr_outbuf_update(chr);
+    return ret;
+}
+
+static int chr_outbuf_write(CharDriverState *chr, const uint8_t *buf, int len)
+{
+    CharOutBuf *ob = chr->outbuf;
+    int done = 0, tail, chunk, was_empty, ret;
+
+    if (ob->fd < 0) {
+        return 0;
+    }
+
+    was_empty = ob->len == 0;
+    if (was_empty) {
+        done = chr_outbuf_send(ob->fd, buf, len);
+        if (done < 0) {
+            return -1;
+        }
+    }
+
+    while (done < len && ob->len < ob->size) {
+        tail = (ob->head + ob->len) % ob->size;
+        chunk = tail >= ob->head ? ob->size - tail : ob->head - tail;
+        chunk = MIN(chunk, len - done);
+        memcpy(ob->buf + tail, buf + done, chunk);
+        ob->len += chunk;
+        done += chunk;
+    }
+
+    if (done < len) {
+        if (QLIST_EMPTY(&chr->write_notifiers.notifiers)) {
+            /* Nobody would retry the rest */
+            if (chr_outbuf_drain(chr) < 0) {
+                return -1;
+            }
+            ret = send_all(ob->fd, buf + done, len - done);
+            return ret < 0 ? -1 : done + ret;
+        }
+        ob->blocked = true;
+    }
+    if (was_empty && ob->len) {
+        chr_outbuf_update(chr);
+    }
+    return done;
+}
+
 #define STDIO_MAX_CLIENTS 1
 static int stdio_nb_clients;
 
@@ -553,6 +777,10 @@ typedef struct {
 static int fd_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
 {
     FDCharDriver *s = chr->opaque;
+
+    if (chr->outbuf) {
+        return chr_outbuf_write(chr, buf, len);
+    }
     return send_all(s->fd_out, buf, len);
 }
 
@@ -580,7 +808,7 @@ static void fd_chr_read(void *opaque)
     size = read(s->fd_in, buf, len);
     if (size == 0) {
         /* FD has been closed. Remove it from the active list.  */
-        qemu_set_fd_handler2(s->fd_in, NULL, NULL, NULL, NULL);
+        chr_set_fd_handlers(chr, s->fd_in, NULL, NULL);
         qemu_chr_be_event(chr, CHR_EVENT_CLOSED);
         return;
     }
@@ -596,8 +824,7 @@ static void fd_chr_update_read_handler(CharDriverState *chr)
     if (s->fd_in >= 0) {
         if (display_type == DT_NOGRAPHIC && s->fd_in == 0) {
         } else {
-            qemu_set_fd_handler2(s->fd_in, fd_chr_read_poll,
-                                 fd_chr_read, NULL, chr);
+            chr_set_fd_handlers(chr, s->fd_in, fd_chr_read_poll, fd_chr_read);
         }
     }
 }
@@ -612,6 +839,10 @@ static void fd_chr_close(struct CharDriverState *chr)
             qemu_set_fd_handler2(s->fd_in, NULL, NULL, NULL, NULL);
         }
     }
+    if (chr->outbuf) {
+        qemu_set_fd_handler2(s->fd_out, NULL, NULL, NULL, NULL);
+        chr_outbuf_free(chr);
+    }
 
     g_free(s);
     qemu_chr_be_event(chr, CHR_EVENT_CLOSED);
@@ -639,6 +870,7 @@ static CharDriverState *qemu_chr_open_fd(int fd_in, int fd_out)
 
 static CharDriverState *qemu_chr_open_file_out(QemuOpts *opts)
 {
+    CharDriverState *chr;
     int fd_out;
 
     TFR(fd_out = qemu_open(qemu_opt_get(opts, "path"),
@@ -646,11 +878,15 @@ static CharDriverState *qemu_chr_open_file_out(QemuOpts *opts)
     if (fd_out < 0) {
         return NULL;
     }
-    return qemu_chr_open_fd(-1, fd_out);
+    chr = qemu_chr_open_fd(-1, fd_out);
+    chr_outbuf_init(chr, fd_out,
+                    qemu_opt_get_size(opts, "outbuf", CHR_OUTBUF_SIZE));
+    return chr;
 }
 
 static CharDriverState *qemu_chr_open_pipe(QemuOpts *opts)
 {
+    CharDriverState *chr;
     int fd_in, fd_out;
     char filename_in[256], filename_out[256];
     const char *filename = qemu_opt_get(opts, "path");
@@ -674,7 +910,10 @@ static CharDriverState *qemu_chr_open_pipe(QemuOpts *opts)
             return NULL;
         }
     }
-    return qemu_chr_open_fd(fd_in, fd_out);
+    chr = qemu_chr_open_fd(fd_in, fd_out);
+    chr_outbuf_init(chr, fd_out,
+                    qemu_opt_get_size(opts, "outbuf", CHR_OUTBUF_SIZE));
+    return chr;
 }
 
 
@@ -872,6 +1111,9 @@ static int pty_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
         pty_chr_update_read_handler(chr);
         return 0;
     }
+    if (chr->outbuf) {
+        return chr_outbuf_write(chr, buf, len);
+    }
     return send_all(s->fd, buf, len);
 }
 
@@ -912,8 +1154,7 @@ static void pty_chr_update_read_handler(CharDriverState *chr)
 {
     PtyCharDriver *s = chr->opaque;
 
-    qemu_set_fd_handler2(s->fd, pty_chr_read_poll,
-                         pty_chr_read, NULL, chr);
+    chr_set_fd_handlers(chr, s->fd, pty_chr_read_poll, pty_chr_read);
     s->polling = 1;
     /*
      * Short timeout here: just need wait long enougth that qemu makes
@@ -931,6 +1172,7 @@ static void pty_chr_state(CharDriverState *chr, int connected)
     PtyCharDriver *s = chr->opaque;
 
     if (!connected) {
+        chr_outbuf_set_fd(chr, s->fd);
         qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
         s->connected = 0;
         s->polling = 0;
@@ -971,6 +1213,7 @@ static void pty_chr_close(struct CharDriverState *chr)
     close(s->fd);
     qemu_del_timer(s->timer);
     qemu_free_timer(s->timer);
+    chr_outbuf_free(chr);
     g_free(s);
     qemu_chr_be_event(chr, CHR_EVENT_CLOSED);
 }
@@ -1015,6 +1258,8 @@ static CharDriverState *qemu_chr_open_pty(QemuOpts *opts)
 
     s->fd = master_fd;
     s->timer = qemu_new_timer_ms(rt_clock, pty_chr_timer, chr);
+    chr_outbuf_init(chr, master_fd,
+                    qemu_opt_get_size(opts, "outbuf", CHR_OUTBUF_SIZE));
 
     return chr;
 }
@@ -2147,6 +2392,9 @@ static int tcp_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
 {
     TCPCharDriver *s = chr->opaque;
     if (s->connected) {
+        if (chr->outbuf) {
+            return chr_outbuf_write(chr, buf, len);
+        }
         return send_all(s->fd, buf, len);
     } else {
         /* (Re-)connect for unconnected writing */
@@ -2307,6 +2555,7 @@ static void tcp_chr_read(void *opaque)
         if (s->listen_fd >= 0) {
             qemu_set_fd_handler2(s->listen_fd, NULL, tcp_chr_accept, NULL, chr);
         }
+        chr_outbuf_set_fd(chr, -1);
         qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
         closesocket(s->fd);
         s->fd = -1;
@@ -2332,8 +2581,8 @@ static void tcp_chr_connect(void *opaque)
     TCPCharDriver *s = chr->opaque;
 
     s->connected = 1;
-    qemu_set_fd_handler2(s->fd, tcp_chr_read_poll,
-                         tcp_chr_read, NULL, chr);
+    chr_outbuf_set_fd(chr, s->fd);
+    chr_set_fd_handlers(chr, s->fd, tcp_chr_read_poll, tcp_chr_read);
     qemu_chr_generic_open(chr);
 }
 
@@ -2421,6 +2670,7 @@ static void tcp_chr_close(CharDriverState *chr)
         qemu_set_fd_handler2(s->listen_fd, NULL, NULL, NULL, NULL);
         closesocket(s->listen_fd);
     }
+    chr_outbuf_free(chr);
     g_free(s);
     qemu_chr_be_event(chr, CHR_EVENT_CLOSED);
 }
@@ -2479,6 +2729,8 @@ static CharDriverState *qemu_chr_open_socket(QemuOpts *opts)
     chr->chr_close = tcp_chr_close;
     chr->get_msgfd = tcp_get_msgfd;
     chr->chr_add_client = tcp_chr_add_client;
+    chr_outbuf_init(chr, -1,
+                    qemu_opt_get_size(opts, "outbuf", CHR_OUTBUF_SIZE));
 
     if (is_listen) {
         s->listen_fd = fd;
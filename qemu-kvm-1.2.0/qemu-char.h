@@ -8,6 +8,7 @@
 #include "qobject.h"
 #include "qstring.h"
 #include "main-loop.h"
+#include "notify.h"
 
 /* character device */
 
@@ -52,6 +53,8 @@ typedef struct {
 
 typedef void IOEventHandler(void *opaque, int event);
 
+typedef struct CharOutBuf CharOutBuf;
+
 struct CharDriverState {
     void (*init)(struct CharDriverState *s);
     int (*chr_write)(struct CharDriverState *s, const uint8_t *buf, int len);
@@ -74,6 +77,8 @@ struct CharDriverState {
     char *filename;
     int opened;
     int avail_connections;
+    CharOutBuf *outbuf;
+    NotifierList write_notifiers;
     QTAILQ_ENTRY(CharDriverState) next;
 };
 
@@ -158,10 +163,28 @@ void qemu_chr_fe_printf(CharDriverState *s, const char *fmt, ...)
  * @buf the data
  * @len the number of bytes to send
  *
+ * Backends with an output buffer never block; when the buffer is full
+ * fewer than @len bytes are consumed and the write notifiers run once
+ * the backend can take more data.
+ *
  * Returns: the number of bytes consumed
  */
 int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len);
 
+/**
+ * @qemu_chr_fe_add_write_notifier:
+ *
+ * Register a notifier that is called when a backend that refused data
+ * has drained its output buffer.  Remove it with notifier_remove().
+ *
+ * Only frontends that registered one get short writes from a backend
+ * whose output buffer is full; for the others qemu_chr_fe_write() waits
+ * until everything is written.
+ *
+ * @notifier the notifier to add
+ */
+void qemu_chr_fe_add_write_notifier(CharDriverState *s, Notifier *notifier);
+
 /**
  * @qemu_chr_fe_ioctl:
  *
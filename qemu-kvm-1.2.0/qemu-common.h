@@ -168,6 +168,7 @@ int qemu_fdatasync(int fd);
 int fcntl_setfl(int fd, int flag);
 int qemu_parse_fd(const char *param);
 int qemu_parse_fdset(const char *param);
+int qemu_parse_bitmap_list(const char *str, unsigned long *bitmap, long nbits);
 
 /*
  * strtosz() suffixes used to specify the default treatment of an
@@ -321,6 +322,7 @@ struct qemu_work_item {
     void (*func)(void *data);
     void *data;
     int done;
+    bool free;
 };
 
 #ifdef CONFIG_USER_ONLY
@@ -375,10 +377,17 @@ size_t qemu_iovec_memset(QEMUIOVector *qiov, size_t offset,
                          int fillc, size_t bytes);
 
 bool buffer_is_zero(const void *buf, size_t len);
+const char *buffer_zero_accel_name(void);
+/* for tests: use the next slower variant, false once at the generic one */
+bool buffer_zero_test_next_accel(void);
+#if defined CONFIG_AVX2_OPT && defined __SSE2__
+bool host_has_avx2(void);
+#endif
 
 void qemu_progress_init(int enabled, float min_skip);
 void qemu_progress_end(void);
 void qemu_progress_print(float delta, int max);
+void qemu_progress_add_bytes(uint64_t bytes);
 const char *qemu_get_vm_name(void);
 
 #define QEMU_FILE_TYPE_BIOS   0
@@ -110,10 +110,58 @@ static QemuOptsList qemu_drive_opts = {
             .name = "bps_wr",
             .type = QEMU_OPT_NUMBER,
             .help = "limit write bytes per second",
+        },{
+            .name = "iops_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total I/O operations burst",
+        },{
+            .name = "iops_rd_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "read operations burst",
+        },{
+            .name = "iops_wr_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "write operations burst",
+        },{
+            .name = "bps_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total bytes burst",
+        },{
+            .name = "bps_rd_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "read bytes burst",
+        },{
+            .name = "bps_wr_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "write bytes burst",
+        },{
+            .name = "throttle_group",
+            .type = QEMU_OPT_STRING,
+            .help = "share I/O limits with the other drives of this group",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
             .help = "copy read data from backing file into image file",
+        },{
+            .name = "l2-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the L2 table cache of the image format",
+        },{
+            .name = "refcount-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the refcount block cache of the image format",
+        },{
+            .name = "compressed-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the cache of decompressed clusters",
+        },{
+            .name = "lazy-refcounts",
+            .type = QEMU_OPT_BOOL,
+            .help = "defer refcount updates, repair them after a crash",
+        },{
+            .name = "aio-queue-depth",
+            .type = QEMU_OPT_NUMBER,
+            .help = "number of requests the native AIO context can hold",
         },{
             .name = "boot",
             .type = QEMU_OPT_BOOL,
@@ -144,6 +192,15 @@ static QemuOptsList qemu_iscsi_opts = {
             .name = "initiator-name",
             .type = QEMU_OPT_STRING,
             .help = "Initiator iqn name to use when connecting",
+        },{
+            .name = "queue-depth",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of reads and writes in flight "
+                    "per session",
+        },{
+            .name = "sessions",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of sessions to open to each LUN",
         },
         { /* end of list */ }
     },
@@ -217,6 +274,9 @@ static QemuOptsList qemu_chardev_opts = {
         },{
             .name = "debug",
             .type = QEMU_OPT_NUMBER,
+        },{
+            .name = "outbuf",
+            .type = QEMU_OPT_SIZE,
         },
         { /* end of list */ }
     },
@@ -379,6 +439,24 @@ QemuOptsList qemu_sandbox_opts = {
     },
 };
 
+static QemuOptsList qemu_thread_affinity_opts = {
+    .name = "thread-affinity",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_thread_affinity_opts.head),
+    .desc = {
+        {
+            .name = "vcpu",
+            .type = QEMU_OPT_NUMBER,
+        },{
+            .name = "iothread",
+            .type = QEMU_OPT_STRING,
+        },{
+            .name = "cpus",
+            .type = QEMU_OPT_STRING,
+        },
+        { /* end of list */ }
+    },
+};
+
 static QemuOptsList qemu_mon_opts = {
     .name = "mon",
     .implied_opt_name = "chardev",
@@ -584,6 +662,18 @@ static QemuOptsList qemu_machine_opts = {
             .name = "kvm_shadow_mem",
             .type = QEMU_OPT_SIZE,
             .help = "KVM shadow MMU size",
+        }, {
+            .name = "kvm_halt_poll_ns",
+            .type = QEMU_OPT_NUMBER,
+            .help = "longest time a halted KVM vCPU polls before sleeping",
+        }, {
+            .name = "mem_prealloc_threads",
+            .type = QEMU_OPT_NUMBER,
+            .help = "number of threads that preallocate -mem-path memory",
+        }, {
+            .name = "mem_thp",
+            .type = QEMU_OPT_BOOL,
+            .help = "back anonymous guest RAM with transparent hugepages",
         }, {
             .name = "kernel",
             .type = QEMU_OPT_STRING,
@@ -616,6 +706,18 @@ static QemuOptsList qemu_machine_opts = {
             .name = "dump-guest-core",
             .type = QEMU_OPT_BOOL,
             .help = "Include guest memory in  a core dump",
+        }, {
+            .name = "mttcg",
+            .type = QEMU_OPT_BOOL,
+            .help = "Run each TCG vCPU in its own host thread",
+        }, {
+            .name = "dma_bounce_size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Total size of DMA bounce buffers for device memory",
+        }, {
+            .name = "timer_slack_ns",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Window in which timer expirations are coalesced",
         },
         { /* End of list */ }
     },
@@ -663,6 +765,7 @@ static QemuOptsList *vm_config_groups[32] = {
     &qemu_boot_opts,
     &qemu_iscsi_opts,
     &qemu_sandbox_opts,
+    &qemu_thread_affinity_opts,
     NULL,
 };
 
@@ -16,14 +16,83 @@
 #include "qemu-common.h"
 #include "qemu-coroutine.h"
 #include "qemu-coroutine-int.h"
+#include "qemu-tls.h"
+
+enum {
+    /* Maximum free pool size prevents holding too many freed coroutines */
+    POOL_MAX_SIZE = 64,
+};
+
+/*
+ * Free list to speed up creation, so that the stack and context of a
+ * terminated coroutine are reused instead of freed and allocated again.
+ * Coroutines never migrate between threads, so each thread has a pool of
+ * its own and needs no locking.  (Hosts without real TLS only run
+ * coroutines under the global mutex.)
+ */
+typedef struct {
+    QSLIST_HEAD(, Coroutine) free_list;
+    unsigned int size;
+    uint64_t hits;
+    uint64_t misses;
+} CoroutinePool;
+
+static DEFINE_TLS(CoroutinePool, coroutine_pool);
+
+static void __attribute__((destructor)) coroutine_pool_cleanup(void)
+{
+    CoroutinePool *pool = &tls_var(coroutine_pool);
+    Coroutine *co;
+    Coroutine *tmp;
+
+    QSLIST_FOREACH_SAFE(co, &pool->free_list, pool_next, tmp) {
+        QSLIST_REMOVE_HEAD(&pool->free_list, pool_next);
+        qemu_coroutine_delete(co);
+    }
+    pool->size = 0;
+}
 
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
 {
-    Coroutine *co = qemu_coroutine_new();
+    CoroutinePool *pool = &tls_var(coroutine_pool);
+    Coroutine *co;
+
+    co = QSLIST_FIRST(&pool->free_list);
+    if (co) {
+        QSLIST_REMOVE_HEAD(&pool->free_list, pool_next);
+        pool->size--;
+        pool->hits++;
+    } else {
+        co = qemu_coroutine_new();
+        pool->misses++;
+    }
+
     co->entry = entry;
     return co;
 }
 
+static void coroutine_terminate(Coroutine *co)
+{
+    CoroutinePool *pool = &tls_var(coroutine_pool);
+
+    if (pool->size < POOL_MAX_SIZE) {
+        QSLIST_INSERT_HEAD(&pool->free_list, co, pool_next);
+        co->caller = NULL;
+        pool->size++;
+        return;
+    }
+
+    qemu_coroutine_delete(co);
+}
+
+void qemu_coroutine_get_pool_stats(uint64_t *hits, uint64_t *misses)
+{
+    CoroutinePool *pool = &tls_var(coroutine_pool);
+
+    *hits = pool->hits;
+    *misses = pool->misses;
+}
+
 static void coroutine_swap(Coroutine *from, Coroutine *to)
 {
     CoroutineAction ret;
@@ -35,7 +104,7 @@ static void coroutine_swap(Coroutine *from, Coroutine *to)
         return;
     case COROUTINE_TERMINATE:
         trace_qemu_coroutine_terminate(to);
-        qemu_coroutine_delete(to);
+        coroutine_terminate(to);
         return;
     default:
         abort();
@@ -95,6 +95,14 @@ Coroutine *coroutine_fn qemu_coroutine_self(void);
  */
 bool qemu_in_coroutine(void);
 
+/**
+ * Get the coroutine pool counters of the calling thread
+ *
+ * @hits counts qemu_coroutine_create() calls that reused a terminated
+ * coroutine, @misses those that had to allocate a new one.
+ */
+void qemu_coroutine_get_pool_stats(uint64_t *hits, uint64_t *misses);
+
 
 
 /**
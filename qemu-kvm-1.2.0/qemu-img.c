@@ -84,6 +84,9 @@ static void help(void)
            "  '-p' show progress of command (only certain commands)\n"
            "  '-S' indicates the consecutive number of bytes that must contain only zeros\n"
            "       for qemu-img to create a sparse image during conversion\n"
+           "  '-m' number of parallel requests used for conversion (1 to 16, default 8)\n"
+           "  '-W' allows conversion to write out of order, which is faster but can\n"
+           "       leave the target image fragmented\n"
            "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
@@ -651,24 +654,326 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 }
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
+#define CONVERT_MAX_COROUTINES 16
+
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    BlockDriverState *target;
+    bool compressed;
+    bool has_zero_init;
+    bool target_has_backing;
+    bool wr_in_order;
+    int min_sparse;
+    int buf_sectors;
+
+    CoMutex lock;           /* protects sector_num */
+    int64_t sector_num;     /* next sector handed out to a coroutine */
+    int64_t wr_offs;        /* next sector to write with wr_in_order */
+    CoQueue wr_queue;
+    int running_coroutines;
+    int ret;
+} ImgConvertState;
+
+static int convert_find_source(ImgConvertState *s, int64_t sector_num,
+                               int64_t *src_sector)
+{
+    int i;
+
+    for (i = 0; sector_num >= s->src_sectors[i]; i++) {
+        sector_num -= s->src_sectors[i];
+        assert(i + 1 < s->src_num);
+    }
+    *src_sector = sector_num;
+    return i;
+}
+
+enum ImgConvertChunkStatus {
+    CONVERT_DATA,           /* read and write the chunk */
+    CONVERT_ZERO,           /* reads as zeroes, nothing to read */
+    CONVERT_BACKING,        /* target's backing file has the data */
+};
+
+/*
+ * Picks the next chunk to copy.  Compressed chunks are whole clusters and
+ * may span several source images, other chunks stay within one source.
+ * Returns the chunk size, 0 at the end of the input, or -errno.
+ *
+ * The allocation status comes from the driver, so unallocated ranges of
+ * sparse images are skipped without reading them.
+ */
+static int coroutine_fn convert_co_next_chunk(ImgConvertState *s,
+                                              int64_t *sector_num,
+                                              enum ImgConvertChunkStatus *status)
+{
+    int64_t src_sector;
+    int i, n, count, ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    if (s->ret || s->sector_num >= s->total_sectors) {
+        qemu_co_mutex_unlock(&s->lock);
+        return 0;
+    }
+
+    n = MIN(s->total_sectors - s->sector_num, s->buf_sectors);
+    *status = CONVERT_DATA;
+    i = convert_find_source(s, s->sector_num, &src_sector);
+    if (n > s->src_sectors[i] - src_sector) {
+        if (s->compressed) {
+            /* cluster spans several sources, just copy it */
+            goto done;
+        }
+        n = s->src_sectors[i] - src_sector;
+    }
+
+    /* If the output image is being created as a copy on write image,
+       assume that sectors which are unallocated in the input image
+       are present in both the output's and input's base images (no
+       need to copy them). */
+    if (s->target_has_backing) {
+        ret = bdrv_co_is_allocated(s->src[i], src_sector, n, &count);
+    } else {
+        ret = bdrv_co_is_allocated_above(s->src[i], NULL, src_sector, n,
+                                         &count);
+    }
+    if (ret < 0) {
+        error_report("error while reading sector %" PRId64 ": %s",
+                     src_sector, strerror(-ret));
+        qemu_co_mutex_unlock(&s->lock);
+        return ret;
+    }
+
+    if (s->compressed) {
+        /* only whole clusters can be skipped */
+        if (!ret && count == n) {
+            *status = CONVERT_ZERO;
+        }
+    } else {
+        n = count;
+        if (!ret) {
+            *status = s->target_has_backing ? CONVERT_BACKING : CONVERT_ZERO;
+        }
+    }
+
+done:
+    *sector_num = s->sector_num;
+    s->sector_num += n;
+    qemu_co_mutex_unlock(&s->lock);
+    return n;
+}
+
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t src_sector;
+    int i, n, ret;
+
+    while (nb_sectors > 0) {
+        i = convert_find_source(s, sector_num, &src_sector);
+        n = MIN(nb_sectors, s->src_sectors[i] - src_sector);
+
+        iov.iov_base = buf;
+        iov.iov_len = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(s->src[i], src_sector, n, &qiov);
+        if (ret < 0) {
+            error_report("error while reading sector %" PRId64 ": %s",
+                         src_sector, strerror(-ret));
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int n, ret;
+
+    if (s->compressed) {
+        if (nb_sectors < s->buf_sectors) {
+            memset(buf + nb_sectors * BDRV_SECTOR_SIZE, 0,
+                   (s->buf_sectors - nb_sectors) * BDRV_SECTOR_SIZE);
+        }
+        if (buffer_is_zero(buf, s->buf_sectors * BDRV_SECTOR_SIZE)) {
+            return 0;
+        }
+        ret = bdrv_write_compressed(s->target, sector_num, buf,
+                                    s->buf_sectors);
+        if (ret < 0) {
+            error_report("error while compressing sector %" PRId64
+                         ": %s", sector_num, strerror(-ret));
+        }
+        return ret;
+    }
+
+    /* NOTE: at the same time we convert, we do not write zero
+       sectors to have a chance to compress the image. Ideally, we
+       should add a specific call to have the info to go faster */
+    while (nb_sectors > 0) {
+        /* If the output image is being created as a copy on write image,
+           copy all sectors even the ones containing only NUL bytes,
+           because they may differ from the sectors in the base image.
+
+           If the output is to a host device, we also write out
+           sectors that are entirely 0, since whatever data was
+           already there is garbage, not 0s. */
+        n = nb_sectors;
+        if (!s->has_zero_init || s->target_has_backing ||
+            is_allocated_sectors_min(buf, nb_sectors, &n, s->min_sparse)) {
+            iov.iov_base = buf;
+            iov.iov_len = n * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+
+            ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                return ret;
+            }
+        }
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+/*
+ * Each coroutine copies one chunk at a time, so that several reads and
+ * writes are in flight and zero detection of one chunk overlaps with I/O
+ * for the others.  With wr_in_order, a chunk is only written once all
+ * chunks before it are, which keeps the target image laid out
+ * sequentially.
+ */
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf;
+    int64_t sector_num;
+    enum ImgConvertChunkStatus status;
+    bool copy, zero;
+    int n, ret;
+
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    for (;;) {
+        n = convert_co_next_chunk(s, &sector_num, &status);
+        if (n <= 0) {
+            ret = n;
+            break;
+        }
+
+        ret = 0;
+        copy = true;
+        zero = false;
+        if (status == CONVERT_DATA) {
+            ret = convert_co_read(s, sector_num, n, buf);
+        } else if (status == CONVERT_ZERO && !s->has_zero_init) {
+            /* whatever the target holds there must be overwritten */
+            if (s->compressed) {
+                memset(buf, 0, n * BDRV_SECTOR_SIZE);
+            } else {
+                zero = true;
+            }
+        } else {
+            copy = false;
+        }
+
+        if (s->wr_in_order) {
+            while (s->wr_offs != sector_num && !s->ret) {
+                qemu_co_queue_wait(&s->wr_queue);
+            }
+        }
+
+        if (copy && zero && !ret && !s->ret) {
+            /* let the target skip the data transfer if it can */
+            ret = bdrv_co_write_zeroes(s->target, sector_num, n);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+            }
+        } else if (copy && !ret && !s->ret) {
+            ret = convert_co_write(s, sector_num, n, buf);
+        }
+
+        if (s->wr_in_order) {
+            s->wr_offs = sector_num + n;
+            qemu_co_queue_restart_all(&s->wr_queue);
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        qemu_progress_add_bytes((uint64_t)n * BDRV_SECTOR_SIZE);
+        qemu_progress_print((float)n * 100 / s->total_sectors, 100);
+    }
+
+    if (ret < 0 && !s->ret) {
+        s->ret = ret;
+        /* let coroutines waiting for their turn to write give up */
+        qemu_co_queue_restart_all(&s->wr_queue);
+    }
+
+    qemu_vfree(buf);
+    s->running_coroutines--;
+}
+
+static int convert_do_copy(ImgConvertState *s, int num_coroutines)
+{
+    Coroutine *co;
+    int i;
+
+    qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->wr_queue);
+    s->sector_num = 0;
+    s->wr_offs = 0;
+    s->ret = 0;
+
+    for (i = 0; i < num_coroutines; i++) {
+        s->running_coroutines++;
+        co = qemu_coroutine_create(convert_co_do_copy);
+        qemu_coroutine_enter(co, s);
+    }
+
+    while (s->running_coroutines) {
+        qemu_aio_wait();
+    }
+
+    if (s->ret == 0 && s->compressed) {
+        /* signal EOF to align */
+        bdrv_write_compressed(s->target, 0, NULL, 0);
+    }
+    return s->ret;
+}
 
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
-    int progress = 0, flags;
+    int c, ret = 0, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int progress = 0, flags, num_coroutines = 8, wr_in_order = 1;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
-    uint64_t bs_sectors;
-    uint8_t * buf = NULL;
-    const uint8_t *buf1;
+    int64_t total_sectors;
+    int64_t *bs_sectors = NULL;
+    uint64_t sectors;
     BlockDriverInfo bdi;
+    ImgConvertState state;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
     char *options = NULL;
     const char *snapshot_name = NULL;
-    float local_progress;
     int min_sparse = 8; /* Need at least 4k of zeros for sparse detection */
 
     fmt = NULL;
@@ -677,7 +982,7 @@ static int img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:m:W");
         if (c == -1) {
             break;
         }
@@ -731,6 +1036,22 @@ static int img_convert(int argc, char **argv)
         case 't':
             cache = optarg;
             break;
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > CONVERT_MAX_COROUTINES) {
+                error_report("Invalid number of parallel requests specified. "
+                             "It must be between 1 and %d",
+                             CONVERT_MAX_COROUTINES);
+                return 1;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = 0;
+            break;
         }
     }
 
@@ -759,6 +1080,7 @@ static int img_convert(int argc, char **argv)
     qemu_progress_print(0, 100);
 
     bs = g_malloc0(bs_n * sizeof(BlockDriverState *));
+    bs_sectors = g_malloc0(bs_n * sizeof(int64_t));
 
     total_sectors = 0;
     for (bs_i = 0; bs_i < bs_n; bs_i++) {
@@ -768,8 +1090,9 @@ static int img_convert(int argc, char **argv)
             ret = -1;
             goto out;
         }
-        bdrv_get_geometry(bs[bs_i], &bs_sectors);
-        total_sectors += bs_sectors;
+        bdrv_get_geometry(bs[bs_i], &sectors);
+        bs_sectors[bs_i] = sectors;
+        total_sectors += sectors;
     }
 
     if (snapshot_name != NULL) {
@@ -887,11 +1210,7 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_blockalign(out_bs, IO_BUF_SIZE);
-
+    cluster_sectors = 0;
     if (compress) {
         ret = bdrv_get_info(out_bs, &bdi);
         if (ret < 0) {
@@ -905,167 +1224,29 @@ static int img_convert(int argc, char **argv)
             goto out;
         }
         cluster_sectors = cluster_size >> 9;
-        sector_num = 0;
-
-        nb_sectors = total_sectors;
-        local_progress = (float)100 /
-            (nb_sectors / MIN(nb_sectors, cluster_sectors));
-
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
-
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
-
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error_report("error while reading sector %" PRId64 ": %s",
-                                 bs_num, strerror(-ret));
-                    goto out;
-                }
-
-                buf2 += nlow * 512;
-                bs_num += nlow;
-
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
-
-            if (n < cluster_sectors) {
-                memset(buf + n * 512, 0, cluster_size - n * 512);
-            }
-            if (!buffer_is_zero(buf, cluster_size)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf,
-                                            cluster_sectors);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64
-                                 ": %s", sector_num, strerror(-ret));
-                    goto out;
-                }
-            }
-            sector_num += n;
-            qemu_progress_print(local_progress, 100);
-        }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
-    } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        local_progress = (float)100 /
-            (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
+    }
 
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
+    state = (ImgConvertState) {
+        .src                = bs,
+        .src_sectors        = bs_sectors,
+        .src_num            = bs_n,
+        .total_sectors      = total_sectors,
+        .target             = out_bs,
+        .compressed         = compress,
+        .has_zero_init      = bdrv_has_zero_init(out_bs),
+        .min_sparse         = min_sparse,
+        .buf_sectors        = compress ? cluster_sectors : IO_BUF_SIZE / 512,
+        /* compression happens in the write, keep it parallel */
+        .wr_in_order        = wr_in_order && !compress,
+    };
+    state.target_has_backing = state.has_zero_init && out_baseimg != NULL;
 
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
-    }
+    ret = convert_do_copy(&state, num_coroutines);
 out:
     qemu_progress_end();
     free_option_parameters(create_options);
     free_option_parameters(param);
-    qemu_vfree(buf);
+    g_free(bs_sectors);
     if (out_bs) {
         bdrv_delete(out_bs);
     }
@@ -1299,6 +1480,28 @@ static int img_snapshot(int argc, char **argv)
     return 0;
 }
 
+/*
+ * Returns 1 if the first sectors of [sector, sector + *n) read as zeroes
+ * from @bs because no image in its chain has them allocated, and shortens
+ * *n to the number of such sectors.  Returns 0 if they may hold data.
+ */
+static int backing_range_is_zero(BlockDriverState *bs, uint64_t bs_sectors,
+                                 int64_t sector, int *n)
+{
+    int ret, pnum;
+
+    if (sector >= bs_sectors) {
+        return 1;
+    }
+
+    ret = bdrv_is_allocated_above(bs, NULL, sector, *n, &pnum);
+    if (ret == 0 && pnum > 0) {
+        *n = pnum;
+        return 1;
+    }
+    return ret < 0 ? ret : 0;
+}
+
 static int img_rebase(int argc, char **argv)
 {
     BlockDriverState *bs, *bs_old_backing = NULL, *bs_new_backing = NULL;
@@ -1462,6 +1665,24 @@ static int img_rebase(int argc, char **argv)
                 continue;
             }
 
+            /* Neither is there anything to do where both backing files read
+             * as zeroes, which their allocation status tells without reading
+             * them */
+            ret = backing_range_is_zero(bs_old_backing,
+                                        old_backing_num_sectors, sector, &n);
+            if (ret > 0) {
+                ret = backing_range_is_zero(bs_new_backing,
+                                            new_backing_num_sectors, sector,
+                                            &n);
+            }
+            if (ret < 0) {
+                error_report("error while reading backing file allocation: %s",
+                             strerror(-ret));
+                goto out;
+            } else if (ret) {
+                continue;
+            }
+
             /*
              * Read old and new backing file and take into consideration that
              * backing files may be smaller than the COW image.
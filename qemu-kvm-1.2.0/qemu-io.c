@@ -28,6 +28,7 @@ char *progname;
 static BlockDriverState *bs;
 
 static int misalign;
+static uint64_t l2_cache_size;
 
 /*
  * Parse the pattern argument to various sub-commands.
@@ -1360,6 +1361,322 @@ static int aio_write_f(int argc, char **argv)
     return 0;
 }
 
+typedef struct BenchState BenchState;
+
+typedef struct BenchReq {
+    BenchState *s;
+    QEMUIOVector qiov;
+    void *buf;
+    bool is_write;
+    int64_t start;
+} BenchReq;
+
+struct BenchState {
+    int64_t offset;
+    int64_t length;
+    int size;
+    int write_percent;
+    int random;
+    GRand *rand;
+
+    uint64_t max_reqs;
+    int64_t deadline;
+    uint64_t next_seq;
+
+    uint64_t submitted;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t errors;
+    int in_flight;
+
+    /* completion latencies in nanoseconds, in completion order */
+    uint64_t *latency;
+    uint64_t nr_latency;
+    uint64_t latency_alloc;
+};
+
+static void bench_submit(BenchReq *req);
+
+static bool bench_done(BenchState *s)
+{
+    if (s->errors) {
+        return true;
+    }
+    if (s->max_reqs) {
+        return s->submitted >= s->max_reqs;
+    }
+    return get_clock() >= s->deadline;
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchReq *req = opaque;
+    BenchState *s = req->s;
+
+    s->in_flight--;
+    if (ret < 0) {
+        printf("bench: %s failed: %s\n", req->is_write ? "write" : "read",
+               strerror(-ret));
+        s->errors++;
+        return;
+    }
+
+    if (s->nr_latency == s->latency_alloc) {
+        s->latency_alloc = MAX(s->latency_alloc * 2, 4096);
+        s->latency = g_renew(uint64_t, s->latency, s->latency_alloc);
+    }
+    s->latency[s->nr_latency++] = get_clock() - req->start;
+
+    if (!bench_done(s)) {
+        bench_submit(req);
+    }
+}
+
+static void bench_submit(BenchReq *req)
+{
+    BenchState *s = req->s;
+    int64_t blocks = s->length / s->size;
+    int64_t offset;
+
+    if (s->random) {
+        /* g_rand_int_range() takes gint32, images can have more blocks */
+        offset = ((uint64_t)g_rand_int(s->rand) << 32 | g_rand_int(s->rand)) %
+                 blocks;
+    } else {
+        offset = s->next_seq++ % blocks;
+    }
+    offset = s->offset + offset * s->size;
+
+    req->is_write = g_rand_int_range(s->rand, 0, 100) < s->write_percent;
+    req->start = get_clock();
+    s->submitted++;
+    s->in_flight++;
+    if (req->is_write) {
+        s->writes++;
+        bdrv_aio_writev(bs, offset >> 9, &req->qiov, s->size >> 9,
+                        bench_cb, req);
+    } else {
+        s->reads++;
+        bdrv_aio_readv(bs, offset >> 9, &req->qiov, s->size >> 9,
+                       bench_cb, req);
+    }
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* in microseconds, nearest rank */
+static double bench_percentile(BenchState *s, double p)
+{
+    uint64_t i;
+
+    if (!s->nr_latency) {
+        return 0;
+    }
+    i = (uint64_t)(p / 100 * s->nr_latency + 0.5);
+    i = MIN(MAX(i, 1), s->nr_latency) - 1;
+    return s->latency[i] / 1000.0;
+}
+
+static void bench_report(BenchState *s, int depth, int64_t ns, int Cflag)
+{
+    double secs = ns / 1e9;
+    uint64_t bytes = s->nr_latency * s->size;
+    double sum = 0;
+    uint64_t i;
+    char s1[64], s2[64];
+
+    qsort(s->latency, s->nr_latency, sizeof(*s->latency), compare_u64);
+    for (i = 0; i < s->nr_latency; i++) {
+        sum += s->latency[i];
+    }
+    sum = s->nr_latency ? sum / s->nr_latency / 1000.0 : 0;
+
+    if (Cflag) {
+        /* ops,reads,writes,bytes,seconds,ops/sec,bytes/sec,
+         * avg,p50,p90,p99,p99.9,max latency in usec */
+        printf("%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+               ",%.6f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+               s->nr_latency, s->reads, s->writes, bytes, secs,
+               s->nr_latency / secs, bytes / secs, sum,
+               bench_percentile(s, 50), bench_percentile(s, 90),
+               bench_percentile(s, 99), bench_percentile(s, 99.9),
+               bench_percentile(s, 100));
+        return;
+    }
+
+    cvtstr((double)bytes, s1, sizeof(s1));
+    cvtstr(bytes / secs, s2, sizeof(s2));
+    printf("%" PRIu64 " ops (%" PRIu64 " reads, %" PRIu64 " writes) of %d "
+           "bytes, %s, queue depth %d\n",
+           s->nr_latency, s->reads, s->writes, s->size,
+           s->random ? "random" : "sequential", depth);
+    printf("%s in %.3f sec (%s/sec and %.4f ops/sec)\n",
+           s1, secs, s2, s->nr_latency / secs);
+    printf("latency usec: avg %.1f, p50 %.1f, p90 %.1f, p99 %.1f, "
+           "p99.9 %.1f, max %.1f\n", sum,
+           bench_percentile(s, 50), bench_percentile(s, 90),
+           bench_percentile(s, 99), bench_percentile(s, 99.9),
+           bench_percentile(s, 100));
+}
+
+static void bench_help(void)
+{
+    printf(
+"\n"
+" issues a stream of concurrent requests and reports their throughput\n"
+"\n"
+" Example:\n"
+" 'bench -d 32 -r -w 30 -n 100000' - 100000 random 4k requests, 30%% of them\n"
+"                                     writes, 32 in flight at any time\n"
+"\n"
+" Keeps a fixed number of requests in flight against the currently open\n"
+" file, and reports IOPS, bandwidth and completion latency percentiles.\n"
+" Writes store the pattern 0xcd, so only use it on scratch images.\n"
+" -C, -- report statistics in a machine parsable format\n"
+" -d, -- queue depth, number of requests in flight (default 1)\n"
+" -l, -- length of the region to use (default: up to the end of the file)\n"
+" -n, -- number of requests (default 10000)\n"
+" -o, -- start offset of the region to use (default 0)\n"
+" -r, -- random offsets instead of sequential ones\n"
+" -s, -- request size (default 4k)\n"
+" -S, -- seed for random offsets and the read/write mix (default 1)\n"
+" -t, -- run for this many seconds instead of a number of requests\n"
+" -w, -- percentage of writes (default 0)\n"
+"\n");
+}
+
+static int bench_f(int argc, char **argv);
+
+static const cmdinfo_t bench_cmd = {
+    .name       = "bench",
+    .cfunc      = bench_f,
+    .argmin     = 0,
+    .argmax     = -1,
+    .args       = "[-Cr] [-d depth] [-n count | -t secs] [-o off] [-l len] "
+                  "[-s size] [-S seed] [-w percent]",
+    .oneline    = "benchmarks concurrent reads and writes",
+    .help       = bench_help,
+};
+
+static int bench_f(int argc, char **argv)
+{
+    BenchState s = {
+        .size = 4096,
+        .max_reqs = 10000,
+    };
+    BenchReq *reqs;
+    int64_t start, length;
+    int Cflag = 0, depth = 1, seconds = 0, seed = 1;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "Cd:l:n:o:rs:S:t:w:")) != EOF) {
+        switch (c) {
+        case 'C':
+            Cflag = 1;
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'l':
+            s.length = cvtnum(optarg);
+            break;
+        case 'n':
+            s.max_reqs = cvtnum(optarg);
+            break;
+        case 'o':
+            s.offset = cvtnum(optarg);
+            break;
+        case 'r':
+            s.random = 1;
+            break;
+        case 's':
+            s.size = cvtnum(optarg);
+            break;
+        case 'S':
+            seed = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'w':
+            s.write_percent = atoi(optarg);
+            break;
+        default:
+            return command_usage(&bench_cmd);
+        }
+    }
+
+    if (optind != argc) {
+        return command_usage(&bench_cmd);
+    }
+
+    length = bdrv_getlength(bs);
+    if (length < 0) {
+        printf("bench: cannot get the length: %s\n", strerror(-length));
+        return 0;
+    }
+    if (!s.length) {
+        s.length = length - s.offset;
+    }
+    if (depth <= 0 || s.size <= 0 || s.offset < 0 || s.length <= 0 ||
+        s.write_percent < 0 || s.write_percent > 100 ||
+        (!seconds && s.max_reqs <= 0)) {
+        printf("bench: invalid arguments\n");
+        return 0;
+    }
+    if ((s.size | s.offset | s.length) & 0x1ff) {
+        printf("bench: offset, length and size must be sector aligned\n");
+        return 0;
+    }
+    if (s.offset + s.length > length || s.length < s.size) {
+        printf("bench: region is not within the file\n");
+        return 0;
+    }
+    if (s.write_percent && bdrv_is_read_only(bs)) {
+        printf("bench: file is read-only\n");
+        return 0;
+    }
+    if (seconds) {
+        s.max_reqs = 0;
+    }
+
+    s.rand = g_rand_new_with_seed(seed);
+    reqs = g_new0(BenchReq, depth);
+    for (i = 0; i < depth; i++) {
+        reqs[i].s = &s;
+        reqs[i].buf = qemu_io_alloc(s.size, 0xcd);
+        qemu_iovec_init(&reqs[i].qiov, 1);
+        qemu_iovec_add(&reqs[i].qiov, reqs[i].buf, s.size);
+    }
+
+    start = get_clock();
+    s.deadline = start + seconds * get_ticks_per_sec();
+    for (i = 0; i < depth && !bench_done(&s); i++) {
+        bench_submit(&reqs[i]);
+    }
+    while (s.in_flight) {
+        qemu_aio_wait();
+    }
+
+    if (!s.errors) {
+        bench_report(&s, depth, get_clock() - start, Cflag);
+    }
+
+    for (i = 0; i < depth; i++) {
+        qemu_iovec_destroy(&reqs[i].qiov);
+        qemu_io_free(reqs[i].buf);
+    }
+    g_free(reqs);
+    g_free(s.latency);
+    g_rand_free(s.rand);
+    return 0;
+}
+
 static int aio_flush_f(int argc, char **argv)
 {
     qemu_aio_flush();
@@ -1692,6 +2009,7 @@ static int openfile(char *name, int flags, int growable)
         }
     } else {
         bs = bdrv_new("hda");
+        bdrv_set_cache_sizes(bs, l2_cache_size, 0, 0);
 
         if (bdrv_open(bs, name, flags, NULL) < 0) {
             fprintf(stderr, "%s: can't open device %s\n", progname, name);
@@ -1808,6 +2126,7 @@ static void usage(const char *name)
 "  -k, --native-aio     use kernel AIO implementation (on Linux only)\n"
 "  -t, --cache=MODE     use the given cache mode for the image\n"
 "  -T, --trace FILE     enable trace events listed in the given file\n"
+"  -L, --l2-cache-size=SIZE  size of the qcow2 L2 table cache\n"
 "  -h, --help           display this help and exit\n"
 "  -V, --version        output version information and exit\n"
 "\n",
@@ -1819,7 +2138,7 @@ int main(int argc, char **argv)
 {
     int readonly = 0;
     int growable = 0;
-    const char *sopt = "hVc:rsnmgkt:T:";
+    const char *sopt = "hVc:rsnmgkt:T:L:";
     const struct option lopt[] = {
         { "help", 0, NULL, 'h' },
         { "version", 0, NULL, 'V' },
@@ -1833,11 +2152,13 @@ int main(int argc, char **argv)
         { "native-aio", 0, NULL, 'k' },
         { "cache", 1, NULL, 't' },
         { "trace", 1, NULL, 'T' },
+        { "l2-cache-size", 1, NULL, 'L' },
         { NULL, 0, NULL, 0 }
     };
     int c;
     int opt_index = 0;
     int flags = 0;
+    int64_t cache_size;
 
     progname = basename(argv[0]);
 
@@ -1875,6 +2196,14 @@ int main(int argc, char **argv)
                 exit(1); /* error message will have been printed */
             }
             break;
+        case 'L':
+            cache_size = strtosz(optarg, NULL);
+            if (cache_size < 0) {
+                error_report("Invalid L2 cache size: %s", optarg);
+                exit(1);
+            }
+            l2_cache_size = cache_size;
+            break;
         case 'V':
             printf("%s version %s\n", progname, VERSION);
             exit(0);
@@ -1908,6 +2237,7 @@ int main(int argc, char **argv)
     add_command(&multiwrite_cmd);
     add_command(&aio_read_cmd);
     add_command(&aio_write_cmd);
+    add_command(&bench_cmd);
     add_command(&aio_flush_cmd);
     add_command(&flush_cmd);
     add_command(&truncate_cmd);
@@ -38,7 +38,13 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                supported accelerators are kvm, xen, tcg (default: tcg)\n"
     "                kernel_irqchip=on|off controls accelerated irqchip support\n"
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
-    "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n",
+    "                kvm_halt_poll_ns=maximum halt polling time in ns (default=0)\n"
+    "                mem_prealloc_threads=threads preallocating -mem-path memory\n"
+    "                mem_thp=on|off back guest RAM with transparent hugepages (default=off)\n"
+    "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
+    "                mttcg=on|off run TCG vCPUs in parallel host threads (default=off)\n"
+    "                dma_bounce_size=size of DMA bounce buffers for device memory (default=64K)\n"
+    "                timer_slack_ns=coalesce timer expirations within this window (default=0)\n",
     QEMU_ARCH_ALL)
 STEXI
 @item -machine [type=]@var{name}[,prop=@var{value}[,...]]
@@ -55,8 +61,37 @@ to initialize.
 Enables in-kernel irqchip support for the chosen accelerator when available.
 @item kvm_shadow_mem=size
 Defines the size of the KVM shadow MMU.
+@item kvm_halt_poll_ns=@var{ns}
+Lets a vCPU that halted with the irqchip in userspace spin for up to @var{ns}
+nanoseconds before it sleeps.  The actual window adapts to how long recent
+halts lasted.  The default of 0 disables polling.
+@item mem_prealloc_threads=@var{n}
+Number of threads that fault in guest memory for @option{-mem-prealloc}.  The
+default is the number of host CPUs, at most 16.  Memory bound to host nodes
+with @option{-numa hostnodes} is touched by threads on those nodes.
+@item mem_thp=on|off
+Ask the host to back guest RAM that is not allocated from @option{-mem-path}
+with transparent hugepages.  Such RAM is no longer offered to KSM.  The
+default is off.
 @item dump-guest-core=on|off
 Include guest memory in a core dump. The default is on.
+@item mttcg=on|off
+Run every TCG vCPU in a host thread of its own instead of taking turns in a
+single thread.  This is experimental: it is only available for ARM guests on
+Linux hosts and cannot be combined with @option{-icount}.  Store-exclusive
+and SWP are atomic with respect to each other, but not against plain stores
+from other vCPUs.  The default is off.
+@item dma_bounce_size=@var{size}
+Total size of the bounce buffers used when devices DMA to or from memory
+that is not RAM, such as MMIO or ROM.  When all of it is in use, further
+such transfers wait until a buffer is released.  The default is 64K.
+@item timer_slack_ns=@var{ns}
+Let timers expire up to @var{ns} nanoseconds late, so that expirations within
+that window share a single host wakeup.  Deadlines are rounded to multiples
+of @var{ns} in host time, which also lines up the wakeups of VMs using the
+same value.  On Linux, this becomes the kernel timer slack of the QEMU threads
+as well.  Useful for hosts running many mostly idle guests.  The default of 0
+fires timers as soon as they expire.
 @end table
 ETEXI
 
@@ -94,12 +129,35 @@ specifies the maximum number of hotpluggable CPUs.
 ETEXI
 
 DEF("numa", HAS_ARG, QEMU_OPTION_numa,
-    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n", QEMU_ARCH_ALL)
+    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n"
+    "          [,hostnodes=node[-node]][,policy=bind|preferred|interleave]\n",
+    QEMU_ARCH_ALL)
 STEXI
 @item -numa @var{opts}
 @findex -numa
 Simulate a multi node NUMA system. If mem and cpus are omitted, resources
 are split equally.
+
+With @option{hostnodes}, the guest RAM of the node is placed on the given
+host NUMA nodes according to @option{policy} (default @code{bind}), and
+the node's vCPUs are pinned to the CPUs of those host nodes when KVM is
+used.  Only the main RAM of the machine is placed this way.
+ETEXI
+
+DEF("thread-affinity", HAS_ARG, QEMU_OPTION_thread_affinity,
+    "-thread-affinity vcpu=n|iothread=name,cpus=cpu[-cpu][,cpus=...]\n"
+    "                set the host CPUs a vCPU or I/O thread may run on\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -thread-affinity vcpu=@var{n}|iothread=main|dataplane,cpus=@var{cpu}[-@var{cpu}][,cpus=...]
+@findex -thread-affinity
+Restrict a thread to the listed host CPUs.  @option{vcpu} selects the thread
+of a virtual CPU and needs KVM.  @option{iothread=main} selects the main
+I/O thread, @option{iothread=dataplane} the threads of all
+@option{x-data-plane} devices.  Repeat @option{cpus} to list several ranges.
+This overrides the pinning implied by @option{-numa hostnodes}.  The
+affinity can be changed at run time with the @code{set_thread_affinity}
+monitor command.
 ETEXI
 
 DEF("fda", HAS_ARG, QEMU_OPTION_fda,
@@ -149,7 +207,13 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,l2-cache-size=size][,refcount-cache-size=size]\n"
+    "       [,compressed-cache-size=size]\n"
+    "       [,lazy-refcounts=on|off][,aio-queue-depth=n]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]\n"
+    "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
+    "       [[,iops_max=im]|[[,iops_rd_max=irm][,iops_wr_max=iwm]]]\n"
+    "       [,throttle_group=g]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -203,6 +267,39 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item l2-cache-size=@var{size}
+@item refcount-cache-size=@var{size}
+Amount of memory used to cache the L2 tables and refcount blocks of a qcow2
+image.  Each cached table covers one cluster of the image file.  A bigger L2
+cache avoids extra metadata reads on random I/O to large images: with 64k
+clusters, 1M of L2 cache covers 8G of the disk.  By default 16 L2 tables and
+4 refcount blocks are cached.
+For QED images @var{l2-cache-size} sets the size of the L2 table cache,
+where each table is cluster size times table size bytes and 50 tables are
+cached by default.
+@item compressed-cache-size=@var{size}
+Amount of memory used to keep decompressed clusters of a qcow2 image, so
+that reads from compressed clusters don't inflate them again.  The default
+is 16 clusters.  Backing files use the default.
+@item lazy-refcounts=@var{lazy-refcounts}
+@var{lazy-refcounts} is "on" or "off".  When on, a qcow2 version 3 image
+keeps refcount updates in its refcount cache and writes them back only when
+they are evicted or the image is closed, so flushes do not wait for them.
+If QEMU exits without closing the image, its refcounts are repaired the next
+time it is opened.  By default the image's lazy_refcounts setting is used.
+@item aio-queue-depth=@var{n}
+Number of requests that can be outstanding at the host with
+@option{aio=native}, 128 by default.  Fast devices such as NVMe drives may
+need more to stay busy.
+@item bps_max=@var{b},bps_rd_max=@var{r},bps_wr_max=@var{w}
+@itemx iops_max=@var{i},iops_rd_max=@var{r},iops_wr_max=@var{w}
+Burst sizes for the matching @option{bps} and @option{iops} limits: after an
+idle period, up to that many bytes or requests go through before the limit
+applies.  By default the burst is a tenth of a second worth of I/O.
+@item throttle_group=@var{g}
+Put the drive in throttle group @var{g}.  The I/O limits of a group apply to
+the combined I/O of all its drives.  A drive without limits of its own takes
+those of the group.
 @end table
 
 By default, writethrough caching is used for all block device.  This means that
@@ -412,7 +509,8 @@ DEF("mem-prealloc", 0, QEMU_OPTION_mem_prealloc,
     QEMU_ARCH_ALL)
 STEXI
 @item -mem-prealloc
-Preallocate memory when using -mem-path.
+Preallocate memory when using -mem-path.  The work is split between several
+threads, see @option{-machine mem_prealloc_threads}.
 ETEXI
 #endif
 
@@ -1268,7 +1366,7 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "-net tap[,vlan=n][,name=str],ifname=name\n"
     "                connect the host TAP network interface to VLAN 'n'\n"
 #else
-    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off]\n"
+    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off][,queues=n]\n"
     "                connect the host TAP network interface to VLAN 'n' \n"
     "                use network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
     "                to configure it and 'dfile' (default=" DEFAULT_NETWORK_DOWN_SCRIPT ")\n"
@@ -1285,6 +1383,8 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                    (only has effect for virtio guests which use MSIX)\n"
     "                use vhostforce=on to force vhost on for non-MSIX virtio guests\n"
     "                use 'vhostfd=h' to connect to an already opened vhost net device\n"
+    "                use 'queues=n' to open n queues of a multiqueue tap interface\n"
+    "                    (-netdev only, for use with a multiqueue virtio-net device)\n"
     "-net bridge[,vlan=n][,name=str][,br=bridge][,helper=helper]\n"
     "                connects a host TAP network interface to a host bridge device 'br'\n"
     "                (default=" DEFAULT_BRIDGE_INTERFACE ") using the program 'helper'\n"
@@ -1303,6 +1403,11 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                on host and listening for incoming connections on 'socketpath'.\n"
     "                Use group 'groupname' and mode 'octalmode' to change default\n"
     "                ownership and permissions for communication port.\n"
+#endif
+#ifdef CONFIG_LINUX
+    "-netdev vhost-user,id=str,path=socketpath[,vhostforce=on|off]\n"
+    "                let the process listening on UNIX socket 'socketpath' serve\n"
+    "                the virtio-net rings directly; needs -mem-path and -mem-prealloc\n"
 #endif
     "-net dump[,vlan=n][,file=f][,len=n]\n"
     "                dump traffic on vlan 'n' to file 'f' (max n bytes per packet)\n"
@@ -1315,6 +1420,9 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
 #endif
     "tap|"
     "bridge|"
+#ifdef CONFIG_LINUX
+    "vhost-user|"
+#endif
 #ifdef CONFIG_VDE
     "vde|"
 #endif
@@ -1620,6 +1728,21 @@ vde_switch -F -sock /tmp/myswitch
 qemu-system-i386 linux.img -net nic -net vde,sock=/tmp/myswitch
 @end example
 
+@item -netdev vhost-user,id=@var{id},path=@var{socketpath}[,vhostforce=on|off]
+Connect a virtio-net device to a backend in another process, e.g. a
+userspace switch, listening on the UNIX socket @var{socketpath}.  The
+backend accesses the virtqueues and the guest buffers directly, so packets
+do not pass through QEMU.  Guest RAM must be allocated from a shared file
+with @option{-mem-path} and @option{-mem-prealloc}.  Live migration is not
+supported.
+
+Example:
+@example
+qemu-system-x86_64 -m 1024 -mem-path /dev/hugepages -mem-prealloc \
+                   -netdev vhost-user,id=net0,path=/tmp/vhost-user.sock \
+                   -device virtio-net-pci,netdev=net0 linux.img
+@end example
+
 @item -net dump[,vlan=@var{n}][,file=@var{file}][,len=@var{len}]
 Dump network traffic on VLAN @var{n} to file @var{file} (@file{qemu-vlan0.pcap} by default).
 At most @var{len} bytes (64k by default) per packet are stored. The file format is
@@ -1704,6 +1827,13 @@ A character device may be used in multiplexing mode by multiple front-ends.
 The key sequence of @key{Control-a} and @key{c} will rotate the input focus
 between attached front-ends. Specify @option{mux=on} to enable this mode.
 
+The @option{socket}, @option{file}, @option{pipe} and @option{pty} backends
+queue output that the other end is not ready to take in a buffer of
+@option{outbuf} bytes (64k by default), instead of stalling the guest.
+When the buffer is full, front-ends that can retry (serial ports and
+virtio-console) are asked to retry later; writes from the others block.
+@option{outbuf=0} restores blocking writes.
+
 Options to each backend are described below.
 
 @item -chardev null ,id=@var{id}
@@ -1930,7 +2060,7 @@ ETEXI
 DEF("iscsi", HAS_ARG, QEMU_OPTION_iscsi,
     "-iscsi [user=user][,password=password]\n"
     "       [,header-digest=CRC32C|CR32C-NONE|NONE-CRC32C|NONE\n"
-    "       [,initiator-name=iqn]\n"
+    "       [,initiator-name=iqn][,queue-depth=n][,sessions=n]\n"
     "                iSCSI session parameters\n", QEMU_ARCH_ALL)
 STEXI
 
@@ -1942,10 +2072,13 @@ QEMU supports NBD (Network Block Devices) both using TCP protocol as well
 as Unix Domain Sockets.
 
 Syntax for specifying a NBD device using TCP
-``nbd:<server-ip>:<port>[:exportname=<export>]''
+``nbd:<server-ip>:<port>[:connections=<n>][:exportname=<export>]''
 
 Syntax for specifying a NBD device using Unix Domain Sockets
-``nbd:unix:<domain-socket>[:exportname=<export>]''
+``nbd:unix:<domain-socket>[:connections=<n>][:exportname=<export>]''
+
+With ``connections'', requests are spread over @var{n} sockets (at most 8)
+to the same server.
 
 
 Example for TCP
@@ -25,12 +25,15 @@
 #include "qemu-common.h"
 #include "osdep.h"
 #include "sysemu.h"
+#include "qemu-timer.h"
 #include <stdio.h>
 
 struct progress_state {
     float current;
     float last_print;
     float min_skip;
+    uint64_t bytes;
+    int64_t start;
     void (*print)(void);
     void (*end)(void);
 };
@@ -38,6 +41,17 @@ struct progress_state {
 static struct progress_state state;
 static volatile sig_atomic_t print_pending;
 
+/* Throughput in MB/s of the bytes accounted with qemu_progress_add_bytes */
+static double progress_rate(void)
+{
+    int64_t elapsed = get_clock() - state.start;
+
+    if (elapsed <= 0) {
+        return 0;
+    }
+    return (double)state.bytes / (1024 * 1024) * get_ticks_per_sec() / elapsed;
+}
+
 /*
  * Simple progress print function.
  * @percent relative percent of current operation
@@ -45,12 +59,20 @@ static volatile sig_atomic_t print_pending;
  */
 static void progress_simple_print(void)
 {
-    printf("    (%3.2f/100%%)\r", state.current);
+    if (state.bytes) {
+        printf("    (%3.2f/100%%) %.1f MB/s\r", state.current, progress_rate());
+    } else {
+        printf("    (%3.2f/100%%)\r", state.current);
+    }
     fflush(stdout);
 }
 
 static void progress_simple_end(void)
 {
+    if (state.bytes) {
+        printf("\n    %" PRIu64 " MB processed, %.1f MB/s on average",
+               state.bytes / (1024 * 1024), progress_rate());
+    }
     printf("\n");
 }
 
@@ -70,7 +92,12 @@ static void sigusr_print(int signal)
 static void progress_dummy_print(void)
 {
     if (print_pending) {
-        fprintf(stderr, "    (%3.2f/100%%)\n", state.current);
+        if (state.bytes) {
+            fprintf(stderr, "    (%3.2f/100%%) %.1f MB/s\n", state.current,
+                    progress_rate());
+        } else {
+            fprintf(stderr, "    (%3.2f/100%%)\n", state.current);
+        }
         print_pending = 0;
     }
 }
@@ -105,6 +132,8 @@ static void progress_dummy_init(void)
 void qemu_progress_init(int enabled, float min_skip)
 {
     state.min_skip = min_skip;
+    state.bytes = 0;
+    state.start = get_clock();
     if (enabled) {
         progress_simple_init();
     } else {
@@ -148,3 +177,12 @@ void qemu_progress_print(float delta, int max)
         state.print();
     }
 }
+
+/*
+ * Account @bytes of data moved by the operation.  Once anything has been
+ * accounted, reports include the throughput since qemu_progress_init().
+ */
+void qemu_progress_add_bytes(uint64_t bytes)
+{
+    state.bytes += bytes;
+}
@@ -0,0 +1,118 @@
+/*
+ * Read-copy-update
+ *
+ * Readers bracket their accesses to an RCU-protected structure with
+ * rcu_read_lock() and rcu_read_unlock().  They take no lock and never wait
+ * for writers.  A writer, still serialized by whatever lock it already
+ * uses, builds a new copy of the structure and publishes it with
+ * atomic_rcu_set().  The old copy may only be freed after a grace period,
+ * that is once every registered thread has gone through a quiescent state
+ * (has been outside any read-side critical section) since the update:
+ * synchronize_rcu() waits for that, call_rcu1() defers a callback until
+ * then.
+ *
+ * Threads that read RCU-protected data must call rcu_register_thread()
+ * first, except for the main thread which is registered at startup.
+ * Read-side critical sections nest, must not block for long and must not
+ * call synchronize_rcu().
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_RCU_H
+#define QEMU_RCU_H
+
+#include <assert.h>
+#include <stdbool.h>
+#include "qemu-queue.h"
+#include "qemu-barrier.h"
+#include "qemu-tls.h"
+#include "qemu-thread.h"
+
+/* rcu_gp_ctr never has this bit clear, so that a reader's snapshot of it
+ * is never zero; zero means "not in a critical section".
+ */
+#define RCU_GP_LOCKED (1UL << 0)
+#define RCU_GP_CTR    (1UL << 1)
+
+typedef struct RCUReaderData RCUReaderData;
+
+struct RCUReaderData {
+    /* rcu_gp_ctr as of the outermost rcu_read_lock(), 0 when quiescent */
+    unsigned long ctr;
+    unsigned int depth;
+    bool registered;
+    /* synchronize_rcu() is waiting for this thread to go quiescent */
+    bool waiting;
+    QLIST_ENTRY(RCUReaderData) node;
+};
+
+extern unsigned long rcu_gp_ctr;
+extern QemuEvent rcu_gp_event;
+DECLARE_TLS(RCUReaderData, rcu_reader);
+
+static inline void rcu_read_lock(void)
+{
+    RCUReaderData *p = &tls_var(rcu_reader);
+
+    if (p->depth++ > 0) {
+        return;
+    }
+    *(volatile unsigned long *)&p->ctr = *(volatile unsigned long *)&rcu_gp_ctr;
+    smp_mb(); /* publish ctr before reading any protected pointer */
+}
+
+static inline void rcu_read_unlock(void)
+{
+    RCUReaderData *p = &tls_var(rcu_reader);
+
+    assert(p->depth > 0);
+    if (--p->depth > 0) {
+        return;
+    }
+    smp_mb(); /* finish all protected reads before going quiescent */
+    *(volatile unsigned long *)&p->ctr = 0;
+    smp_mb(); /* write ctr before reading waiting */
+    if (*(volatile bool *)&p->waiting) {
+        p->waiting = false;
+        qemu_event_set(&rcu_gp_event);
+    }
+}
+
+/* Read a pointer that writers update with atomic_rcu_set().  The result
+ * may only be dereferenced within the current read-side critical section.
+ */
+#define atomic_rcu_read(ptr) ({                                 \
+    typeof(*(ptr)) _rcu_val = *(volatile typeof(*(ptr)) *)(ptr); \
+    smp_rmb();                                                  \
+    _rcu_val;                                                   \
+})
+
+/* Publish a fully initialized object to readers. */
+#define atomic_rcu_set(ptr, val) do {                           \
+    smp_wmb();                                                  \
+    *(volatile typeof(*(ptr)) *)(ptr) = (val);                  \
+} while (0)
+
+void rcu_register_thread(void);
+void rcu_unregister_thread(void);
+void synchronize_rcu(void);
+
+typedef struct RCUHead RCUHead;
+typedef void RCUCBFunc(RCUHead *head);
+
+/* Embed this in an object to free it with call_rcu1(), and recover the
+ * object in the callback with container_of().
+ */
+struct RCUHead {
+    RCUHead *next;
+    RCUCBFunc *func;
+};
+
+/* Run func(head) after a grace period.  Callbacks run in a separate
+ * thread, without the iothread lock, and in the order they were queued.
+ */
+void call_rcu1(RCUHead *head, RCUCBFunc *func);
+
+#endif
@@ -17,7 +17,14 @@
 #include <signal.h>
 #include <stdint.h>
 #include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 #include "qemu-thread.h"
+#include "qemu-barrier.h"
 
 static void error_exit(int err, const char *msg)
 {
@@ -38,6 +45,23 @@ void qemu_mutex_init(QemuMutex *mutex)
         error_exit(err, __func__);
 }
 
+void qemu_mutex_init_adaptive(QemuMutex *mutex)
+{
+#ifdef PTHREAD_ADAPTIVE_MUTEX_INITIALIZER_NP
+    int err;
+    pthread_mutexattr_t mutexattr;
+
+    pthread_mutexattr_init(&mutexattr);
+    pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_ADAPTIVE_NP);
+    err = pthread_mutex_init(&mutex->lock, &mutexattr);
+    pthread_mutexattr_destroy(&mutexattr);
+    if (err)
+        error_exit(err, __func__);
+#else
+    qemu_mutex_init(mutex);
+#endif
+}
+
 void qemu_mutex_destroy(QemuMutex *mutex)
 {
     int err;
@@ -115,6 +139,133 @@ void qemu_cond_wait(QemuCond *cond, QemuMutex *mutex)
         error_exit(err, __func__);
 }
 
+#ifdef __linux__
+static inline void futex_wake(QemuEvent *ev, int n)
+{
+    syscall(SYS_futex, &ev->value, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
+static inline void futex_wait(QemuEvent *ev, unsigned val)
+{
+    while (syscall(SYS_futex, &ev->value, FUTEX_WAIT, (int) val,
+                   NULL, NULL, 0)) {
+        switch (errno) {
+        case EWOULDBLOCK:
+            return;
+        case EINTR:
+            break; /* get out of switch and retry */
+        default:
+            abort();
+        }
+    }
+}
+#else
+static inline void futex_wake(QemuEvent *ev, int n)
+{
+    pthread_mutex_lock(&ev->lock);
+    if (n == 1) {
+        pthread_cond_signal(&ev->cond);
+    } else {
+        pthread_cond_broadcast(&ev->cond);
+    }
+    pthread_mutex_unlock(&ev->lock);
+}
+
+static inline void futex_wait(QemuEvent *ev, unsigned val)
+{
+    pthread_mutex_lock(&ev->lock);
+    if (ev->value == val) {
+        pthread_cond_wait(&ev->cond, &ev->lock);
+    }
+    pthread_mutex_unlock(&ev->lock);
+}
+#endif
+
+/*
+ * Valid transitions:
+ * - free->set, when setting the event
+ * - busy->set, when setting the event, followed by futex_wake
+ * - set->free, when resetting the event
+ * - free->busy, when waiting
+ *
+ * set->busy does not happen (it can be observed from the outside but
+ * it really is set->free->busy).
+ *
+ * busy->free provably cannot happen; to enforce it, the set->free
+ * transition is done with an OR, which becomes a no-op if the event
+ * has concurrently transitioned to free or busy.
+ */
+
+#define EV_SET         0
+#define EV_FREE        1
+#define EV_BUSY       -1
+
+void qemu_event_init(QemuEvent *ev, bool init)
+{
+#ifndef __linux__
+    pthread_mutex_init(&ev->lock, NULL);
+    pthread_cond_init(&ev->cond, NULL);
+#endif
+
+    ev->value = (init ? EV_SET : EV_FREE);
+}
+
+void qemu_event_destroy(QemuEvent *ev)
+{
+#ifndef __linux__
+    pthread_mutex_destroy(&ev->lock);
+    pthread_cond_destroy(&ev->cond);
+#endif
+}
+
+void qemu_event_set(QemuEvent *ev)
+{
+    /* Order the caller's stores before the event becomes visible as set */
+    smp_mb();
+    if (*(volatile unsigned *)&ev->value != EV_SET) {
+        if (__sync_lock_test_and_set(&ev->value, EV_SET) == EV_BUSY) {
+            /* There were waiters, wake them up.  */
+            futex_wake(ev, INT_MAX);
+        }
+    }
+}
+
+void qemu_event_reset(QemuEvent *ev)
+{
+    if (*(volatile unsigned *)&ev->value == EV_SET) {
+        /*
+         * If there was a concurrent reset (or even reset+wait),
+         * do nothing.  Otherwise change EV_SET->EV_FREE.
+         */
+        __sync_fetch_and_or(&ev->value, EV_FREE);
+    }
+    /* Order the reset before the caller checks its condition again */
+    smp_mb();
+}
+
+void qemu_event_wait(QemuEvent *ev)
+{
+    unsigned value;
+
+    value = *(volatile unsigned *)&ev->value;
+    smp_rmb();
+    if (value != EV_SET) {
+        if (value == EV_FREE) {
+            /*
+             * Leave the event reset and tell qemu_event_set that there
+             * are waiters.  No need to retry, because there cannot be
+             * a concurrent busy->free transition.  After the CAS, the
+             * event will be either set or busy.
+             */
+            if (__sync_val_compare_and_swap(&ev->value, EV_FREE, EV_BUSY)
+                == EV_SET) {
+                return;
+            }
+        }
+        futex_wait(ev, EV_BUSY);
+    }
+}
+
 void qemu_thread_create(QemuThread *thread,
                        void *(*start_routine)(void*),
                        void *arg, int mode)
@@ -134,8 +285,11 @@ void qemu_thread_create(QemuThread *thread,
         }
     }
 
-    /* Leave signal handling to the iothread.  */
+    /* Leave signal handling to the iothread.  SIGSEGV stays unblocked:
+     * it is synchronous, and postcopy migration resolves faults on not yet
+     * received guest pages in whichever thread touches them.  */
     sigfillset(&set);
+    sigdelset(&set, SIGSEGV);
     pthread_sigmask(SIG_SETMASK, &set, &oldset);
     err = pthread_create(&thread->thread, &attr, start_routine, arg);
     if (err)
@@ -146,6 +300,26 @@ void qemu_thread_create(QemuThread *thread,
     pthread_attr_destroy(&attr);
 }
 
+int qemu_thread_set_affinity(QemuThread *thread, const unsigned long *cpus,
+                             long nbits)
+{
+#ifdef __linux__
+    const long bits_per_long = sizeof(unsigned long) * 8;
+    cpu_set_t set;
+    long i;
+
+    CPU_ZERO(&set);
+    for (i = 0; i < nbits && i < CPU_SETSIZE; i++) {
+        if (cpus[i / bits_per_long] & (1UL << (i % bits_per_long))) {
+            CPU_SET(i, &set);
+        }
+    }
+    return -pthread_setaffinity_np(thread->thread, sizeof(set), &set);
+#else
+    return -ENOSYS;
+#endif
+}
+
 void qemu_thread_get_self(QemuThread *thread)
 {
     thread->thread = pthread_self();
@@ -6,6 +6,7 @@
 
 typedef struct QemuMutex QemuMutex;
 typedef struct QemuCond QemuCond;
+typedef struct QemuEvent QemuEvent;
 typedef struct QemuThread QemuThread;
 
 #ifdef _WIN32
@@ -18,14 +19,16 @@ typedef struct QemuThread QemuThread;
 #define QEMU_THREAD_DETACHED 1
 
 void qemu_mutex_init(QemuMutex *mutex);
+/* For locks that are held briefly and handed over between threads often:
+ * contended lockers spin for a while before going to sleep.  Such a mutex
+ * does not check for recursive locking or unlocking by a non-owner.
+ */
+void qemu_mutex_init_adaptive(QemuMutex *mutex);
 void qemu_mutex_destroy(QemuMutex *mutex);
 void qemu_mutex_lock(QemuMutex *mutex);
 int qemu_mutex_trylock(QemuMutex *mutex);
 void qemu_mutex_unlock(QemuMutex *mutex);
 
-#define rcu_read_lock() do { } while (0)
-#define rcu_read_unlock() do { } while (0)
-
 void qemu_cond_init(QemuCond *cond);
 void qemu_cond_destroy(QemuCond *cond);
 
@@ -38,6 +41,19 @@ void qemu_cond_signal(QemuCond *cond);
 void qemu_cond_broadcast(QemuCond *cond);
 void qemu_cond_wait(QemuCond *cond, QemuMutex *mutex);
 
+/*
+ * One-shot wakeups without a mutex.  qemu_event_wait() returns as soon as
+ * the event is set; a waiter typically resets the event, checks its
+ * condition and only waits if the condition is still false, while the
+ * waking thread makes the condition true before setting the event.
+ * Setting an event that is already set is cheap, as is waiting for it.
+ */
+void qemu_event_init(QemuEvent *ev, bool init);
+void qemu_event_set(QemuEvent *ev);
+void qemu_event_reset(QemuEvent *ev);
+void qemu_event_wait(QemuEvent *ev);
+void qemu_event_destroy(QemuEvent *ev);
+
 void qemu_thread_create(QemuThread *thread,
                         void *(*start_routine)(void *),
                         void *arg, int mode);
@@ -46,4 +62,10 @@ void qemu_thread_get_self(QemuThread *thread);
 bool qemu_thread_is_self(QemuThread *thread);
 void qemu_thread_exit(void *retval);
 
+/* Restrict @thread to the host CPUs set in the @nbits long bitmap @cpus.
+ * Returns 0 or a negative errno value.
+ */
+int qemu_thread_set_affinity(QemuThread *thread, const unsigned long *cpus,
+                             long nbits);
+
 #endif
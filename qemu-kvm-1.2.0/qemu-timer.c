@@ -35,6 +35,10 @@
 #include <mmsystem.h>
 #endif
 
+#ifdef CONFIG_LINUX
+#include <sys/prctl.h>
+#endif
+
 /***********************************************************/
 /* timers */
 
@@ -42,8 +46,17 @@
 #define QEMU_CLOCK_VIRTUAL  1
 #define QEMU_CLOCK_HOST     2
 
+/*
+ * The armed timers of a clock are kept in a binary min-heap ordered by
+ * expiry time, so that arming or deleting a timer is O(log n) and finding
+ * the next deadline is O(1).  Timers with the same expiry time fire in the
+ * order they were armed, like they did with a sorted list.
+ */
 struct QEMUClock {
-    QEMUTimer *active_timers;
+    QEMUTimer **active_timers;      /* the heap, active_timers[0] is next */
+    int nb_active_timers;
+    int max_active_timers;
+    uint64_t arm_seq;               /* tie breaker for equal expiry times */
 
     NotifierList reset_notifiers;
     int64_t last;
@@ -57,7 +70,8 @@ struct QEMUTimer {
     QEMUClock *clock;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+    uint64_t seq;
+    int heap_index;                 /* -1 if not armed */
     int scale;
 };
 
@@ -78,30 +92,133 @@ struct qemu_alarm_timer {
 
 static struct qemu_alarm_timer *alarm_timer;
 
+/*
+ * Alarms are rounded up to a multiple of the slack in host time, so that
+ * timers expiring within one slack window, in this VM and in any other VM
+ * using the same slack, are served by a single host wakeup.
+ */
+static int64_t timer_slack_ns;
+
+/* Alarm wakeups, total and over the last full second */
+static uint64_t alarm_wakeups;
+static uint64_t alarm_wakeups_last;
+static uint64_t alarm_wakeups_rate;
+static int64_t alarm_wakeups_stamp;
+
 static bool qemu_timer_expired_ns(QEMUTimer *timer_head, int64_t current_time)
 {
     return timer_head && (timer_head->expire_time <= current_time);
 }
 
+static inline QEMUTimer *qemu_clock_first_timer(QEMUClock *clock)
+{
+    return clock->nb_active_timers ? clock->active_timers[0] : NULL;
+}
+
+static inline bool timer_before(QEMUTimer *a, QEMUTimer *b)
+{
+    return a->expire_time < b->expire_time ||
+           (a->expire_time == b->expire_time && a->seq < b->seq);
+}
+
+static inline void timer_heap_set(QEMUClock *clock, int i, QEMUTimer *ts)
+{
+    clock->active_timers[i] = ts;
+    ts->heap_index = i;
+}
+
+static void timer_heap_sift_up(QEMUClock *clock, int i)
+{
+    QEMUTimer *ts = clock->active_timers[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!timer_before(ts, clock->active_timers[parent])) {
+            break;
+        }
+        timer_heap_set(clock, i, clock->active_timers[parent]);
+        i = parent;
+    }
+    timer_heap_set(clock, i, ts);
+}
+
+static void timer_heap_sift_down(QEMUClock *clock, int i)
+{
+    QEMUTimer *ts = clock->active_timers[i];
+    int n = clock->nb_active_timers;
+
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n &&
+            timer_before(clock->active_timers[child + 1],
+                         clock->active_timers[child])) {
+            child++;
+        }
+        if (!timer_before(clock->active_timers[child], ts)) {
+            break;
+        }
+        timer_heap_set(clock, i, clock->active_timers[child]);
+        i = child;
+    }
+    timer_heap_set(clock, i, ts);
+}
+
+static void timer_heap_remove(QEMUClock *clock, QEMUTimer *ts)
+{
+    int i = ts->heap_index;
+    QEMUTimer *last;
+
+    ts->heap_index = -1;
+    last = clock->active_timers[--clock->nb_active_timers];
+    if (last == ts) {
+        return;
+    }
+
+    /* move the last timer into the hole and restore the heap property */
+    timer_heap_set(clock, i, last);
+    if (i > 0 && timer_before(last, clock->active_timers[(i - 1) / 2])) {
+        timer_heap_sift_up(clock, i);
+    } else {
+        timer_heap_sift_down(clock, i);
+    }
+}
+
+static void timer_heap_insert(QEMUClock *clock, QEMUTimer *ts)
+{
+    if (clock->nb_active_timers == clock->max_active_timers) {
+        clock->max_active_timers = MAX(16, clock->max_active_timers * 2);
+        clock->active_timers = g_renew(QEMUTimer *, clock->active_timers,
+                                       clock->max_active_timers);
+    }
+    timer_heap_set(clock, clock->nb_active_timers++, ts);
+    timer_heap_sift_up(clock, ts->heap_index);
+}
+
 static int64_t qemu_next_alarm_deadline(void)
 {
     int64_t delta = INT64_MAX;
     int64_t rtdelta;
+    QEMUTimer *ts;
 
-    if (!use_icount && vm_clock->enabled && vm_clock->active_timers) {
-        delta = vm_clock->active_timers->expire_time -
-                     qemu_get_clock_ns(vm_clock);
+    /* Only the heads of the heaps matter, clocks without timers are not
+     * even read. */
+    ts = qemu_clock_first_timer(vm_clock);
+    if (!use_icount && vm_clock->enabled && ts) {
+        delta = ts->expire_time - qemu_get_clock_ns(vm_clock);
     }
-    if (host_clock->enabled && host_clock->active_timers) {
-        int64_t hdelta = host_clock->active_timers->expire_time -
-                 qemu_get_clock_ns(host_clock);
+    ts = qemu_clock_first_timer(host_clock);
+    if (host_clock->enabled && ts) {
+        int64_t hdelta = ts->expire_time - qemu_get_clock_ns(host_clock);
         if (hdelta < delta) {
             delta = hdelta;
         }
     }
-    if (rt_clock->enabled && rt_clock->active_timers) {
-        rtdelta = (rt_clock->active_timers->expire_time -
-                 qemu_get_clock_ns(rt_clock));
+    ts = qemu_clock_first_timer(rt_clock);
+    if (rt_clock->enabled && ts) {
+        rtdelta = ts->expire_time - qemu_get_clock_ns(rt_clock);
         if (rtdelta < delta) {
             delta = rtdelta;
         }
@@ -114,10 +231,55 @@ static void qemu_rearm_alarm_timer(struct qemu_alarm_timer *t)
 {
     int64_t nearest_delta_ns = qemu_next_alarm_deadline();
     if (nearest_delta_ns < INT64_MAX) {
+        if (timer_slack_ns && nearest_delta_ns > 0) {
+            int64_t now = get_clock();
+            int64_t deadline = now + nearest_delta_ns;
+
+            deadline += timer_slack_ns - 1;
+            deadline -= deadline % timer_slack_ns;
+            nearest_delta_ns = deadline - now;
+        }
         t->rearm(t, nearest_delta_ns);
     }
 }
 
+void qemu_set_timer_slack(int64_t slack_ns)
+{
+    timer_slack_ns = MAX(slack_ns, 0);
+
+#ifdef CONFIG_LINUX
+    /* Let the kernel batch the sleeps of this thread and of the threads it
+     * creates from now on, too.  0 would restore the default slack. */
+    if (timer_slack_ns) {
+        prctl(PR_SET_TIMERSLACK, (unsigned long)timer_slack_ns, 0, 0, 0);
+    }
+#endif
+}
+
+int64_t qemu_get_timer_slack(void)
+{
+    return timer_slack_ns;
+}
+
+static void qemu_update_alarm_wakeups(void)
+{
+    int64_t now = get_clock();
+
+    if (now - alarm_wakeups_stamp >= get_ticks_per_sec()) {
+        alarm_wakeups_rate = (alarm_wakeups - alarm_wakeups_last) *
+                             get_ticks_per_sec() / (now - alarm_wakeups_stamp);
+        alarm_wakeups_last = alarm_wakeups;
+        alarm_wakeups_stamp = now;
+    }
+}
+
+void qemu_get_alarm_wakeups(uint64_t *total, uint64_t *per_second)
+{
+    qemu_update_alarm_wakeups();
+    *total = alarm_wakeups;
+    *per_second = alarm_wakeups_rate;
+}
+
 /* TODO: MIN_TIMER_REARM_NS should be optimized */
 #define MIN_TIMER_REARM_NS 250000
 
@@ -252,22 +414,24 @@ void qemu_clock_enable(QEMUClock *clock, bool enabled)
 
 int64_t qemu_clock_has_timers(QEMUClock *clock)
 {
-    return !!clock->active_timers;
+    return clock->nb_active_timers > 0;
 }
 
 int64_t qemu_clock_expired(QEMUClock *clock)
 {
-    return (clock->active_timers &&
-            clock->active_timers->expire_time < qemu_get_clock_ns(clock));
+    QEMUTimer *ts = qemu_clock_first_timer(clock);
+
+    return ts && ts->expire_time < qemu_get_clock_ns(clock);
 }
 
 int64_t qemu_clock_deadline(QEMUClock *clock)
 {
     /* To avoid problems with overflow limit this to 2^32.  */
     int64_t delta = INT32_MAX;
+    QEMUTimer *ts = qemu_clock_first_timer(clock);
 
-    if (clock->active_timers) {
-        delta = clock->active_timers->expire_time - qemu_get_clock_ns(clock);
+    if (ts) {
+        delta = ts->expire_time - qemu_get_clock_ns(clock);
     }
     if (delta < 0) {
         delta = 0;
@@ -285,31 +449,22 @@ QEMUTimer *qemu_new_timer(QEMUClock *clock, int scale,
     ts->cb = cb;
     ts->opaque = opaque;
     ts->scale = scale;
+    ts->heap_index = -1;
     return ts;
 }
 
 void qemu_free_timer(QEMUTimer *ts)
 {
+    /* the heap must not keep a pointer to freed memory */
+    qemu_del_timer(ts);
     g_free(ts);
 }
 
 /* stop a timer, but do not dealloc it */
 void qemu_del_timer(QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
-
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &ts->clock->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
-            break;
-        }
-        pt = &t->next;
+    if (ts->heap_index >= 0) {
+        timer_heap_remove(ts->clock, ts);
     }
 }
 
@@ -317,27 +472,16 @@ void qemu_del_timer(QEMUTimer *ts)
    >= expire_time. The corresponding callback will be called. */
 void qemu_mod_timer_ns(QEMUTimer *ts, int64_t expire_time)
 {
-    QEMUTimer **pt, *t;
+    QEMUClock *clock = ts->clock;
 
     qemu_del_timer(ts);
 
-    /* add the timer in the sorted list */
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &ts->clock->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!qemu_timer_expired_ns(t, expire_time)) {
-            break;
-        }
-        pt = &t->next;
-    }
     ts->expire_time = expire_time;
-    ts->next = *pt;
-    *pt = ts;
+    ts->seq = clock->arm_seq++;
+    timer_heap_insert(clock, ts);
 
     /* Rearm if necessary  */
-    if (pt == &ts->clock->active_timers) {
+    if (ts->heap_index == 0) {
         if (!alarm_timer->pending) {
             qemu_rearm_alarm_timer(alarm_timer);
         }
@@ -356,13 +500,7 @@ void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
 
 bool qemu_timer_pending(QEMUTimer *ts)
 {
-    QEMUTimer *t;
-    for (t = ts->clock->active_timers; t != NULL; t = t->next) {
-        if (t == ts) {
-            return true;
-        }
-    }
-    return false;
+    return ts->heap_index >= 0;
 }
 
 bool qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
@@ -372,22 +510,21 @@ bool qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
 
 void qemu_run_timers(QEMUClock *clock)
 {
-    QEMUTimer **ptimer_head, *ts;
+    QEMUTimer *ts;
     int64_t current_time;
-   
-    if (!clock->enabled)
+
+    /* No need to read the clock if nothing is armed */
+    if (!clock->enabled || !clock->nb_active_timers)
         return;
 
     current_time = qemu_get_clock_ns(clock);
-    ptimer_head = &clock->active_timers;
     for(;;) {
-        ts = *ptimer_head;
+        ts = qemu_clock_first_timer(clock);
         if (!qemu_timer_expired_ns(ts, current_time)) {
             break;
         }
-        /* remove timer from the list before calling the callback */
-        *ptimer_head = ts->next;
-        ts->next = NULL;
+        /* remove timer from the heap before calling the callback */
+        timer_heap_remove(clock, ts);
 
         /* run the callback (the timer list can be modified) */
         ts->cb(ts->opaque);
@@ -443,6 +580,10 @@ uint64_t qemu_timer_expire_time_ns(QEMUTimer *ts)
 
 void qemu_run_all_timers(void)
 {
+    if (alarm_timer->pending) {
+        alarm_wakeups++;
+        qemu_update_alarm_wakeups();
+    }
     alarm_timer->pending = false;
 
     /* vm time timers */
@@ -62,6 +62,9 @@ void qemu_run_all_timers(void);
 void configure_alarms(char const *opt);
 void init_clocks(void);
 int init_timer_alarm(void);
+void qemu_set_timer_slack(int64_t slack_ns);
+int64_t qemu_get_timer_slack(void);
+void qemu_get_alarm_wakeups(uint64_t *total, uint64_t *per_second);
 
 int64_t cpu_get_ticks(void);
 void cpu_enable_ticks(void);
@@ -51,6 +51,9 @@ void assert_no_error(Error *err);
 #define QERR_BLOCK_FORMAT_FEATURE_NOT_SUPPORTED \
     ERROR_CLASS_GENERIC_ERROR, "Block format '%s' used by device '%s' does not support feature '%s'"
 
+#define QERR_BLOCK_JOB_NOT_READY \
+    ERROR_CLASS_GENERIC_ERROR, "The active block job for device '%s' cannot be completed"
+
 #define QERR_BUFFER_OVERRUN \
     ERROR_CLASS_GENERIC_ERROR, "An internal buffer overran"
 
@@ -108,6 +111,9 @@ void assert_no_error(Error *err);
 #define QERR_DEVICE_NOT_REMOVABLE \
     ERROR_CLASS_GENERIC_ERROR, "Device '%s' is not removable"
 
+#define QERR_DUMP_IN_PROGRESS \
+    ERROR_CLASS_GENERIC_ERROR, "A live dump of guest memory is in progress"
+
 #define QERR_DUPLICATE_ID \
     ERROR_CLASS_GENERIC_ERROR, "Duplicate ID '%s' for %s"
 
@@ -216,6 +222,9 @@ void assert_no_error(Error *err);
 #define QERR_SET_PASSWD_FAILED \
     ERROR_CLASS_GENERIC_ERROR, "Could not set password"
 
+#define QERR_TOP_NOT_FOUND \
+    ERROR_CLASS_GENERIC_ERROR, "Top '%s' not found"
+
 #define QERR_TOO_MANY_FILES \
     ERROR_CLASS_GENERIC_ERROR, "Too many open files"
 
@@ -28,7 +28,7 @@ typedef struct JSONParsingState
     QObject *result;
 } JSONParsingState;
 
-static void parse_json(JSONMessageParser *parser, QList *tokens)
+static void parse_json(JSONMessageParser *parser, GQueue *tokens)
 {
     JSONParsingState *s = container_of(parser, JSONParsingState, parser);
     s->result = json_parser_parse(tokens, s->ap);
@@ -80,10 +80,89 @@ typedef struct ToJsonIterState
 
 static void to_json(const QObject *obj, QString *str, int pretty, int indent);
 
+/* Characters that can be copied to the output as they are */
+static inline bool to_json_plain(unsigned char c)
+{
+    return c > 0x1F && c < 0x80 && c != '\"' && c != '\\';
+}
+
+static void to_json_str(const char *ptr, QString *str)
+{
+    qstring_append_chr(str, '"');
+    while (*ptr) {
+        const char *run = ptr;
+
+        while (to_json_plain(*ptr)) {
+            ptr++;
+        }
+        if (ptr != run) {
+            qstring_append_len(str, run, ptr - run);
+            continue;
+        }
+
+        if ((ptr[0] & 0xE0) == 0xE0 &&
+            (ptr[1] & 0x80) && (ptr[2] & 0x80)) {
+            uint16_t wchar;
+            char escape[7];
+
+            wchar  = (ptr[0] & 0x0F) << 12;
+            wchar |= (ptr[1] & 0x3F) << 6;
+            wchar |= (ptr[2] & 0x3F);
+            ptr += 2;
+
+            snprintf(escape, sizeof(escape), "\\u%04X", wchar);
+            qstring_append(str, escape);
+        } else if ((ptr[0] & 0xE0) == 0xC0 && (ptr[1] & 0x80)) {
+            uint16_t wchar;
+            char escape[7];
+
+            wchar  = (ptr[0] & 0x1F) << 6;
+            wchar |= (ptr[1] & 0x3F);
+            ptr++;
+
+            snprintf(escape, sizeof(escape), "\\u%04X", wchar);
+            qstring_append(str, escape);
+        } else switch (ptr[0]) {
+            case '\"':
+                qstring_append(str, "\\\"");
+                break;
+            case '\\':
+                qstring_append(str, "\\\\");
+                break;
+            case '\b':
+                qstring_append(str, "\\b");
+                break;
+            case '\f':
+                qstring_append(str, "\\f");
+                break;
+            case '\n':
+                qstring_append(str, "\\n");
+                break;
+            case '\r':
+                qstring_append(str, "\\r");
+                break;
+            case '\t':
+                qstring_append(str, "\\t");
+                break;
+            default: {
+                if (ptr[0] <= 0x1F) {
+                    char escape[7];
+                    snprintf(escape, sizeof(escape), "\\u%04X", ptr[0]);
+                    qstring_append(str, escape);
+                } else {
+                    qstring_append_chr(str, ptr[0]);
+                }
+                break;
+            }
+            }
+        ptr++;
+    }
+    qstring_append_chr(str, '"');
+}
+
 static void to_json_dict_iter(const char *key, QObject *obj, void *opaque)
 {
     ToJsonIterState *s = opaque;
-    QString *qkey;
     int j;
 
     if (s->count)
@@ -95,9 +174,7 @@ static void to_json_dict_iter(const char *key, QObject *obj, void *opaque)
             qstring_append(s->str, "    ");
     }
 
-    qkey = qstring_from_str(key);
-    to_json(QOBJECT(qkey), s->str, s->pretty, s->indent);
-    QDECREF(qkey);
+    to_json_str(key, s->str);
 
     qstring_append(s->str, ": ");
     to_json(obj, s->str, s->pretty, s->indent);
@@ -125,82 +202,12 @@ static void to_json_list_iter(QObject *obj, void *opaque)
 static void to_json(const QObject *obj, QString *str, int pretty, int indent)
 {
     switch (qobject_type(obj)) {
-    case QTYPE_QINT: {
-        QInt *val = qobject_to_qint(obj);
-        char buffer[1024];
-
-        snprintf(buffer, sizeof(buffer), "%" PRId64, qint_get_int(val));
-        qstring_append(str, buffer);
+    case QTYPE_QINT:
+        qstring_append_int(str, qint_get_int(qobject_to_qint(obj)));
         break;
-    }
-    case QTYPE_QSTRING: {
-        QString *val = qobject_to_qstring(obj);
-        const char *ptr;
-
-        ptr = qstring_get_str(val);
-        qstring_append(str, "\"");
-        while (*ptr) {
-            if ((ptr[0] & 0xE0) == 0xE0 &&
-                (ptr[1] & 0x80) && (ptr[2] & 0x80)) {
-                uint16_t wchar;
-                char escape[7];
-
-                wchar  = (ptr[0] & 0x0F) << 12;
-                wchar |= (ptr[1] & 0x3F) << 6;
-                wchar |= (ptr[2] & 0x3F);
-                ptr += 2;
-
-                snprintf(escape, sizeof(escape), "\\u%04X", wchar);
-                qstring_append(str, escape);
-            } else if ((ptr[0] & 0xE0) == 0xC0 && (ptr[1] & 0x80)) {
-                uint16_t wchar;
-                char escape[7];
-
-                wchar  = (ptr[0] & 0x1F) << 6;
-                wchar |= (ptr[1] & 0x3F);
-                ptr++;
-
-                snprintf(escape, sizeof(escape), "\\u%04X", wchar);
-                qstring_append(str, escape);
-            } else switch (ptr[0]) {
-                case '\"':
-                    qstring_append(str, "\\\"");
-                    break;
-                case '\\':
-                    qstring_append(str, "\\\\");
-                    break;
-                case '\b':
-                    qstring_append(str, "\\b");
-                    break;
-                case '\f':
-                    qstring_append(str, "\\f");
-                    break;
-                case '\n':
-                    qstring_append(str, "\\n");
-                    break;
-                case '\r':
-                    qstring_append(str, "\\r");
-                    break;
-                case '\t':
-                    qstring_append(str, "\\t");
-                    break;
-                default: {
-                    if (ptr[0] <= 0x1F) {
-                        char escape[7];
-                        snprintf(escape, sizeof(escape), "\\u%04X", ptr[0]);
-                        qstring_append(str, escape);
-                    } else {
-                        char buf[2] = { ptr[0], 0 };
-                        qstring_append(str, buf);
-                    }
-                    break;
-                }
-                }
-            ptr++;
-        }
-        qstring_append(str, "\"");
+    case QTYPE_QSTRING:
+        to_json_str(qstring_get_str(qobject_to_qstring(obj)), str);
         break;
-    }
     case QTYPE_QDICT: {
         ToJsonIterState s;
         QDict *val = qobject_to_qdict(obj);
@@ -438,6 +438,36 @@ Example:
 Note: inject-nmi fails when the guest doesn't support injecting.
       Currently, only x86 guests do.
 
+EQMP
+
+    {
+        .name       = "set-thread-affinity",
+        .args_type  = "vcpu:i?,iothread:s?,cpus:s",
+        .mhandler.cmd_new = qmp_marshal_input_set_thread_affinity,
+    },
+
+SQMP
+set-thread-affinity
+-------------------
+
+Restrict a vCPU or I/O thread to a set of host CPUs.
+
+Arguments:
+
+- "vcpu": index of the vCPU whose thread is pinned, needs KVM
+          (json-int, optional)
+- "iothread": "main" for the main I/O thread, or "dataplane" for the threads
+              of all x-data-plane devices (json-string, optional)
+- "cpus": host CPUs as numbers and ranges, such as "0-3,8" (json-string)
+
+Exactly one of "vcpu" and "iothread" must be given.
+
+Example:
+
+-> { "execute": "set-thread-affinity",
+     "arguments": { "vcpu": 1, "cpus": "2-3" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -563,6 +593,54 @@ Example:
 -> { "execute": "query-migrate-cache-size" }
 <- { "return": 67108864 }
 
+EQMP
+
+    {
+        .name       = "migrate-set-compress-threads",
+        .args_type  = "value:i",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_compress_threads,
+    },
+
+SQMP
+migrate-set-compress-threads
+----------------------------
+
+Set the number of threads used to compress pages when the "compress"
+migration capability is on.  Takes effect on the next migration.
+
+Arguments:
+
+- "value": number of threads (json-int)
+
+Example:
+
+-> { "execute": "migrate-set-compress-threads", "arguments": { "value": 8 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate-set-multifd-channels",
+        .args_type  = "value:i",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_multifd_channels,
+    },
+
+SQMP
+migrate-set-multifd-channels
+----------------------------
+
+Set the number of extra connections RAM pages are sent over when the
+"multifd" migration capability is on.  Takes effect on the next migration.
+
+Arguments:
+
+- "value": number of connections (json-int)
+
+Example:
+
+-> { "execute": "migrate-set-multifd-channels", "arguments": { "value": 4 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -649,7 +727,7 @@ EQMP
 
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:b,protocol:s,begin:i?,end:i?",
+        .args_type  = "paging:b,protocol:s,begin:i?,end:i?,format:s?,live:b?",
         .params     = "-p protocol [begin] [length]",
         .help       = "dump guest memory to file",
         .user_print = monitor_user_noop,
@@ -671,6 +749,12 @@ Arguments:
            with length together (json-int)
 - "length": the memory size, in bytes. It's optional, and should be specified
             with begin together (json-int)
+- "format": "elf" (default) or "kdump-zlib" for the kdump-compressed
+            format, which cannot be used with paging, begin or length
+            (json-string, optional)
+- "live": dump while the guest runs, kdump-compressed format only.  The
+          command returns at once and DUMP_COMPLETED is emitted at the end
+          (json-bool, optional)
 
 Example:
 
@@ -766,6 +850,46 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_block_stream,
     },
 
+    {
+        .name       = "block-commit",
+        .args_type  = "device:B,base:s?,top:s?,speed:o?",
+        .mhandler.cmd_new = qmp_marshal_input_block_commit,
+    },
+
+SQMP
+block-commit
+------------
+
+Live commit of data from overlay image nodes into backing nodes - i.e.,
+writes data between 'top' and 'base' into 'base'.
+
+Arguments:
+
+- "device": The device's ID, must be unique (json-string)
+- "base": The file name of the backing image to write data into.
+          If not specified, this is the deepest backing image
+          (json-string, optional)
+- "top": The file name of the backing image within the image chain,
+         which contains the topmost data to be committed down.
+         If not specified, this is the active layer (json-string, optional)
+- "speed": the maximum speed, in bytes per second (json-int, optional)
+
+When "top" is an image below the active layer, the job ends on its own
+once the data is copied; the image above "top" then uses "base" as its
+backing file and the images in between are dropped from the chain.
+
+When "top" is the active layer, guest writes keep being copied to "base"
+until the job is completed with block-job-complete after the
+BLOCK_JOB_READY event; "base" then becomes the active image.
+
+Example:
+
+-> { "execute": "block-commit", "arguments": { "device": "virtio0",
+                                              "top": "/tmp/snap1.qcow2" } }
+<- { "return": {} }
+
+EQMP
+
     {
         .name       = "block-job-set-speed",
         .args_type  = "device:B,speed:o",
@@ -777,6 +901,11 @@ EQMP
         .args_type  = "device:B",
         .mhandler.cmd_new = qmp_marshal_input_block_job_cancel,
     },
+    {
+        .name       = "block-job-complete",
+        .args_type  = "device:B",
+        .mhandler.cmd_new = qmp_marshal_input_block_job_complete,
+    },
     {
         .name       = "transaction",
         .args_type  = "actions:q",
@@ -863,6 +992,53 @@ Example:
                                                         "format": "qcow2" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "drive-mirror",
+        .args_type  = "sync:s,device:B,target:s,speed:o?,mode:s?,format:s?,granularity:i?",
+        .mhandler.cmd_new = qmp_marshal_input_drive_mirror,
+    },
+
+SQMP
+drive-mirror
+------------
+
+Start mirroring a block device's writes to a new destination. target
+specifies the target of the new image. If the file exists, or if it is
+a device, it will be used as the new destination for writes. If it does
+not exist, a new file will be created. format specifies the format of
+the mirror image, default is to probe if mode='existing', else the format
+of the source.
+
+The job emits BLOCK_JOB_READY once the destination has caught up with
+the source. After that, block-job-complete switches the device over to
+the destination and block-job-cancel stops mirroring, leaving the
+destination as a consistent copy of the source.
+
+Arguments:
+
+- "device": device name to operate on (json-string)
+- "target": name of new image file (json-string)
+- "format": format of new image (json-string, optional)
+- "mode": how an image file should be created into the target
+  file/device (NewImageMode, optional, default 'absolute-paths')
+- "speed": maximum speed of the streaming job, in bytes per second
+  (json-int, optional)
+- "sync": what parts of the disk image should be copied to the destination;
+  possibilities include "full" for all the disk, "top" for only the sectors
+  allocated in the topmost image.
+- "granularity": granularity of the dirty bitmap in bytes, a power of two
+  between 512 and 64M (json-int, optional, default 65536)
+
+Example:
+
+-> { "execute": "drive-mirror", "arguments": { "device": "ide-hd0",
+                                               "target": "/some/place/my-image",
+                                               "sync": "full",
+                                               "format": "qcow2" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -910,6 +1086,88 @@ Example:
 -> { "execute": "set_link", "arguments": { "name": "e1000.0", "up": false } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "set-net-coalesce",
+        .args_type  = "name:s,rx-max-frames:i?,rx-usecs:i?,"
+                      "tx-max-frames:i?,tx-usecs:i?",
+        .mhandler.cmd_new = qmp_marshal_input_set_net_coalesce,
+    },
+
+SQMP
+set-net-coalesce
+----------------
+
+Set interrupt moderation for the queues of a network adapter.  The guest
+is interrupted once the given number of buffers have completed or the
+given time has passed since the first of them, whichever comes first.
+
+Arguments:
+
+- "name": network device name (json-string)
+- "rx-max-frames": receive buffers per interrupt, 0 for no limit
+                   (json-int, optional)
+- "rx-usecs": maximum receive interrupt delay, 0 to disable
+              (json-int, optional)
+- "tx-max-frames": transmit buffers per interrupt, 0 for no limit
+                   (json-int, optional)
+- "tx-usecs": maximum transmit interrupt delay, 0 to disable
+              (json-int, optional)
+
+Arguments that are not given keep their current value.
+
+Example:
+
+-> { "execute": "set-net-coalesce",
+     "arguments": { "name": "net0", "rx-max-frames": 32, "rx-usecs": 50 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-net-queues",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_net_queues,
+    },
+
+SQMP
+query-net-queues
+----------------
+
+Show the statistics of the queues holding packets for network clients that
+cannot receive them yet.
+
+Each queue is represented by a json-object. The returned value is a json-array
+of all queues.
+
+Each json-object contains the following:
+
+- "name": network client name (json-string)
+- "queue-index": queue of a multiqueue client, 0 otherwise (json-int)
+- "capacity": packets held before dropping (json-int)
+- "backlog": packets currently queued (json-int)
+- "max-backlog": highest number of packets queued at once (json-int)
+- "queued": packets queued since creation (json-int)
+- "dropped": packets dropped because the queue was full (json-int)
+
+Example:
+
+-> { "execute": "query-net-queues" }
+<- {
+      "return":[
+         {
+            "name":"net0",
+            "queue-index":0,
+            "capacity":256,
+            "backlog":0,
+            "max-backlog":12,
+            "queued":1043,
+            "dropped":0
+         }
+      ]
+   }
+
 EQMP
 
     {
@@ -1119,7 +1377,9 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,"
+                      "bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,"
+                      "iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,group:s?",
         .mhandler.cmd_new = qmp_marshal_input_block_set_io_throttle,
     },
 
@@ -1138,6 +1398,14 @@ Arguments:
 - "iops":  total I/O operations per second(json-int)
 - "iops_rd":  read I/O operations per second(json-int)
 - "iops_wr":  write I/O operations per second(json-int)
+- "bps_max":  total burst in bytes(json-int, optional)
+- "bps_rd_max":  read burst in bytes(json-int, optional)
+- "bps_wr_max":  write burst in bytes(json-int, optional)
+- "iops_max":  total I/O operations burst(json-int, optional)
+- "iops_rd_max":  read I/O operations burst(json-int, optional)
+- "iops_wr_max":  write I/O operations burst(json-int, optional)
+- "group":  throttle group; drives of a group share their limits, "" leaves
+            the group(json-string, optional)
 
 Example:
 
@@ -1150,6 +1418,30 @@ Example:
                                                "iops_wr": "0" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-latency-reset",
+        .args_type  = "device:B?",
+        .mhandler.cmd_new = qmp_marshal_input_block_latency_reset,
+    },
+
+SQMP
+block-latency-reset
+-------------------
+
+Clear the latency histograms and the peak queue depth reported by
+query-blockstats.  Byte and operation totals are not affected.
+
+Arguments:
+
+- "device": device name, all devices if omitted (json-string, optional)
+
+Example:
+
+-> { "execute": "block-latency-reset", "arguments": { "device": "virtio0" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1485,12 +1777,21 @@ Each json-object contain the following:
          - "backing_file": backing file name (json-string, optional)
          - "backing_file_depth": number of files in the backing file chain (json-int)
          - "encrypted": true if encrypted, false otherwise (json-bool)
+         - "write_cache": true if the guest sees a volatile write cache,
+                          false for writethrough (json-bool)
          - "bps": limit total bytes per second (json-int)
          - "bps_rd": limit read bytes per second (json-int)
          - "bps_wr": limit write bytes per second (json-int)
          - "iops": limit total I/O operations per second (json-int)
          - "iops_rd": limit read operations per second (json-int)
          - "iops_wr": limit write operations per second (json-int)
+         - "bps_max": total burst in bytes (json-int, optional)
+         - "bps_rd_max": read burst in bytes (json-int, optional)
+         - "bps_wr_max": write burst in bytes (json-int, optional)
+         - "iops_max": total I/O operations burst (json-int, optional)
+         - "iops_rd_max": read I/O operations burst (json-int, optional)
+         - "iops_wr_max": write I/O operations burst (json-int, optional)
+         - "group": throttle group (json-string, optional)
 
 - "io-status": I/O operation status, only present if the device supports it
                and the VM is configured to stop on errors. It's always reset
@@ -1511,6 +1812,7 @@ Example:
                "ro":false,
                "drv":"qcow2",
                "encrypted":false,
+               "write_cache":true,
                "file":"disks/test.img",
                "backing_file_depth":0,
                "bps":1000000,
@@ -1575,6 +1877,41 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "l2_cache": usage of the L2 table cache of the image format, if it
+                  has one (json-object, optional), it contains:
+        - "size": number of tables the cache holds (json-int)
+        - "hits": lookups that found their table cached (json-int)
+        - "misses": lookups that had to load or allocate a table (json-int)
+    - "refcount_cache": same for the refcount block cache (json-object,
+                        optional)
+    - "rd_merged": read requests merged into another one (json-int)
+    - "wr_merged": write requests merged into another one (json-int)
+    - "in_flight": read and write requests being processed (json-int)
+    - "max_in_flight": peak of "in_flight" since the last
+                       block-latency-reset (json-int)
+    - "rd_latency": histogram of read latencies, omitted if there were no
+                    reads (json-array, optional).  Each element contains:
+        - "limit_us": exclusive upper bound in microseconds; buckets are
+                      powers of two and empty buckets are omitted (json-int)
+        - "count": requests that completed within the bucket (json-int)
+    - "wr_latency": same for writes (json-array, optional)
+    - "flush_latency": same for cache flushes (json-array, optional)
+    - "rbd": readahead and write merging of an RBD image (json-object,
+             optional), it contains:
+        - "readahead_ops": readahead requests sent to the cluster (json-int)
+        - "readahead_bytes": bytes read ahead (json-int)
+        - "readahead_hits": guest reads served from readahead (json-int)
+        - "coalesced_writes": guest writes merged with others (json-int)
+        - "write_batches": cluster writes built from merged ones (json-int)
+    - "local_cache": usage of a local cache file in front of the image
+                     (json-object, optional), it contains:
+        - "size": size of the cache in bytes (json-int)
+        - "used": bytes of the cache that hold image data (json-int)
+        - "dirty": bytes not written back to the image yet (json-int)
+        - "hits": clusters that reads found in the cache (json-int)
+        - "misses": clusters that reads got from the image (json-int)
+        - "evictions": clusters dropped to make room (json-int)
+        - "writebacks": dirty clusters written back (json-int)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -1610,6 +1947,23 @@ Example:
                "wr_total_times_ns":313253456
                "rd_total_times_ns":3465673657
                "flush_total_times_ns":49653
+               "l2_cache":{
+                  "size":16,
+                  "hits":36511,
+                  "misses":93
+               },
+               "refcount_cache":{
+                  "size":4,
+                  "hits":1384,
+                  "misses":12
+               },
+               "in_flight":1,
+               "max_in_flight":12,
+               "rd_latency":[
+                  { "limit_us":64, "count":30211 },
+                  { "limit_us":128, "count":5920 },
+                  { "limit_us":4096, "count":473 }
+               ]
             }
          },
          {
@@ -1682,6 +2036,10 @@ Return a json-array. Each CPU is represented by a json-object, which contains:
      "pc" and "npc": sparc (json-int)
      "PC": mips (json-int)
 - "thread_id": ID of the underlying host thread (json-int)
+- "halt-poll-ns": current halt polling window in nanoseconds (json-int,
+                  optional, only with -machine kvm_halt_poll_ns)
+- "halt-poll-successes": halts that ended while polling (json-int, optional)
+- "halt-poll-misses": halts that slept after polling (json-int, optional)
 
 Example:
 
@@ -1713,6 +2071,121 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_cpus,
     },
 
+SQMP
+query-cpu-lock-stats
+--------------------
+
+Show how often each CPU took the global mutex to handle an exit, and how long
+it had to wait for it.  Only gathered with KVM.
+
+Return a json-array. Each CPU is represented by a json-object, which contains:
+
+- "CPU": CPU index (json-int)
+- "lockless-exits": exits handled without the global mutex (json-int)
+- "locked-exits": exits that took the global mutex (json-int)
+- "wait-histogram": json-array of json-objects, each containing:
+    - "below-us": upper bound of the wait time in microseconds, absent for
+                  the last bucket (json-int, optional)
+    - "count": number of waits in this bucket (json-int)
+
+Example:
+
+-> { "execute": "query-cpu-lock-stats" }
+<- {
+      "return":[
+         {
+            "CPU":0,
+            "lockless-exits":1532,
+            "locked-exits":20841,
+            "wait-histogram":[
+               { "below-us":1, "count":20011 },
+               { "below-us":4, "count":634 },
+               { "below-us":16, "count":160 },
+               { "below-us":64, "count":31 },
+               { "below-us":256, "count":5 },
+               { "below-us":1024, "count":0 },
+               { "below-us":4096, "count":0 },
+               { "count":0 }
+            ]
+         }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-cpu-lock-stats",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_cpu_lock_stats,
+    },
+
+SQMP
+lock-stats
+----------
+
+Start or stop gathering global mutex statistics.  Starting clears them.
+
+Arguments:
+
+- "enable": true to start gathering, false to stop (json-bool)
+
+Example:
+
+-> { "execute": "lock-stats", "arguments": { "enable": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "lock-stats",
+        .args_type  = "enable:b",
+        .mhandler.cmd_new = qmp_marshal_input_lock_stats,
+    },
+
+SQMP
+query-lock-stats
+----------------
+
+Show which threads waited for and held the global mutex, and for how long.
+
+Return a json-object with the following information:
+
+- "enabled": whether the statistics are being gathered (json-bool)
+- "sites": json-array with one json-object per site that took the mutex:
+    - "site": "main-loop", "vcpuN", "tcg", "migration" or "other"
+              (json-string)
+    - "acquisitions": times the mutex was held (json-int)
+    - "locks": acquisitions that waited in a lock call, as opposed to
+               waking up from a condition variable (json-int)
+    - "wait-ns": total wait of the lock calls in nanoseconds (json-int)
+    - "max-wait-ns": longest wait (json-int)
+    - "hold-ns": total hold time in nanoseconds (json-int)
+    - "max-hold-ns": longest hold (json-int)
+    - "wait-histogram": wait times, in the buckets of query-cpu-lock-stats
+                        (json-array)
+    - "hold-histogram": hold times, in the same buckets (json-array)
+
+Example:
+
+-> { "execute": "query-lock-stats" }
+<- { "return": {
+       "enabled": true,
+       "sites": [
+          { "site": "main-loop", "acquisitions": 5120, "locks": 5120,
+            "wait-ns": 20381123, "max-wait-ns": 912330,
+            "hold-ns": 101235342, "max-hold-ns": 4093221,
+            "wait-histogram": [ { "below-us": 1, "count": 4811 }, ... ],
+            "hold-histogram": [ { "below-us": 1, "count": 211 }, ... ] },
+          { "site": "vcpu0", ... } ] } }
+
+EQMP
+
+    {
+        .name       = "query-lock-stats",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_lock_stats,
+    },
+
 SQMP
 query-pci
 ---------
@@ -1940,11 +2413,17 @@ Return a json-object with the following information:
 
 - "enabled": true if KVM support is enabled, false otherwise (json-bool)
 - "present": true if QEMU has KVM support, false otherwise (json-bool)
+- "route-commits": number of interrupt routing table updates, only present
+                   when KVM is enabled (json-int, optional)
+- "route-commits-per-second": the same over the last second or more
+                              (json-int, optional)
+- "msi-routes": number of cached MSI routes (json-int, optional)
 
 Example:
 
 -> { "execute": "query-kvm" }
-<- { "return": { "enabled": true, "present": true } }
+<- { "return": { "enabled": true, "present": true, "route-commits": 42,
+                 "route-commits-per-second": 0, "msi-routes": 0 } }
 
 EQMP
 
@@ -1954,6 +2433,92 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_kvm,
     },
 
+SQMP
+query-timers
+------------
+
+Show how often QEMU timers wake up the host.
+
+Return a json-object with the following information:
+
+- "slack-ns": window in which timer expirations are coalesced (json-int)
+- "alarm-wakeups": number of host alarm timer wakeups (json-int)
+- "alarm-wakeups-per-second": alarm wakeups over the last second or more
+                              (json-int)
+
+Example:
+
+-> { "execute": "query-timers" }
+<- { "return": { "slack-ns": 1000000, "alarm-wakeups": 123456,
+                 "alarm-wakeups-per-second": 64 } }
+
+EQMP
+
+    {
+        .name       = "query-timers",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_timers,
+    },
+
+SQMP
+device-profile
+--------------
+
+Start or stop device profiling.  Starting it clears all counters.
+
+Arguments:
+
+- "enable": true to start profiling, false to stop it (json-bool)
+
+Example:
+
+-> { "execute": "device-profile", "arguments": { "enable": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "device-profile",
+        .args_type  = "enable:b",
+        .mhandler.cmd_new = qmp_marshal_input_device_profile,
+    },
+
+SQMP
+query-device-profile
+--------------------
+
+Show how much host CPU time went into device emulation.
+
+Return a json-object with the following information:
+
+- "enabled": whether the counters are being updated (json-bool)
+- "entries": a json-array of json-objects, one per memory region or main
+  loop file descriptor handler that was called, with:
+    - "kind": "mmio", "pio" or "fd" (json-string)
+    - "name": region name, or fd number and handler address (json-string)
+    - "calls": number of accesses or handler invocations (json-int)
+    - "ticks": host cycle counter ticks spent in them (json-int)
+
+Example:
+
+-> { "execute": "query-device-profile" }
+<- { "return": { "enabled": true,
+                 "entries": [
+                    { "kind": "pio", "name": "rtc", "calls": 20480,
+                      "ticks": 31457280 },
+                    { "kind": "mmio", "name": "e1000-mmio", "calls": 90112,
+                      "ticks": 412090368 },
+                    { "kind": "fd", "name": "fd 17 (0x7f3a2c41b230)",
+                      "calls": 4096, "ticks": 9437184 } ] } }
+
+EQMP
+
+    {
+        .name       = "query-device-profile",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_device_profile,
+    },
+
 SQMP
 query-status
 ------------
@@ -2072,6 +2637,9 @@ Clients are described by a json-object, each one contain the following:
 - "service": client's port number (json-string)
 - "x509_dname": TLS dname (json-string, optional)
 - "sasl_username": SASL username (json-string, optional)
+- "jobs-queued": framebuffer updates waiting to be encoded (json-int)
+- "jobs-encoded": framebuffer updates encoded so far (json-int)
+- "encode-time-ns": time spent encoding them (json-int)
 
 Example:
 
@@ -2087,7 +2655,10 @@ Example:
             {
                "host":"127.0.0.1",
                "service":"50401",
-               "family":"ipv4"
+               "family":"ipv4",
+               "jobs-queued":0,
+               "jobs-encoded":1842,
+               "encode-time-ns":913452310
             }
          ]
       }
@@ -2225,6 +2796,37 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_uuid,
     },
 
+SQMP
+query-startup-timing
+--------------------
+
+Show how long each phase of QEMU startup took.
+
+Return a json-array of json-objects, each with:
+
+- "name": phase name (json-string), one of "init", "block", "machine",
+          "devices", "reset", "start"
+- "start": start of the phase in microseconds since QEMU started (json-int)
+- "duration": length of the phase in microseconds (json-int)
+
+Example:
+
+-> { "execute": "query-startup-timing" }
+<- { "return": [ { "name": "init", "start": 0, "duration": 21520 },
+                 { "name": "block", "start": 21520, "duration": 3080 },
+                 { "name": "machine", "start": 24600, "duration": 9310 },
+                 { "name": "devices", "start": 33910, "duration": 4210 },
+                 { "name": "reset", "start": 38120, "duration": 1950 },
+                 { "name": "start", "start": 40070, "duration": 130 } ] }
+
+EQMP
+
+    {
+        .name       = "query-startup-timing",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_startup_timing,
+    },
+
 SQMP
 query-migrate
 -------------
@@ -2250,6 +2852,8 @@ The main json-object contains the following:
          - "duplicate": number of duplicated pages (json-int)
          - "normal" : number of normal pages transferred (json-int)
          - "normal-bytes" : number of normal bytes transferred (json-int)
+         - "skipped" : number of zero pages that did not need to be sent
+                       again (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information (in bytes):
          - "transferred": amount transferred (json-int)
@@ -2261,7 +2865,29 @@ The main json-object contains the following:
          - "bytes": total XBZRLE bytes transferred
          - "pages": number of XBZRLE compressed pages
          - "cache-miss": number of cache misses
+         - "cache-hit": number of cache hits
+         - "cache-evictions": number of pages evicted from the cache
          - "overflow": number of XBZRLE overflows
+- "compress-threads": only present if page compression is active.
+  It is a json-array with one json-object per compression thread:
+         - "id": thread index (json-int)
+         - "pages": number of pages compressed (json-int)
+         - "bytes-in": page bytes handed to the thread (json-int)
+         - "bytes-out": compressed bytes produced (json-int)
+         - "busy-time": milliseconds spent compressing (json-int)
+- "dirty-heat": only present if "status" is "active" or "completed".
+  It is a json-array with one json-object for each of the last dirty
+  bitmap syncs, up to 8, oldest first:
+         - "iteration": number of the sync (json-int)
+         - "histogram": json-array of json-objects, from the coldest:
+              - "heat": syncs in a row the memory was dirty (json-int)
+              - "pages": number of pages at that heat (json-int)
+         - "threshold": heat from which pages are deferred, 16 if none
+                        are (json-int)
+         - "deferred-pages": dirty pages held back until the guest
+                             stops (json-int)
+- "cpu-throttle-percentage": percentage of time the vCPUs are throttled by
+  auto-converge, only present while the throttle is active (json-int)
 Examples:
 
 1. Before the first migration
@@ -2281,7 +2907,8 @@ Examples:
           "total-time":12345,
           "duplicate":123,
           "normal":123,
-          "normal-bytes":123456
+          "normal-bytes":123456,
+          "skipped":0
         }
      }
    }
@@ -2304,7 +2931,8 @@ Examples:
             "total-time":12345,
             "duplicate":123,
             "normal":123,
-            "normal-bytes":123456
+            "normal-bytes":123456,
+            "skipped":0
          }
       }
    }
@@ -2322,7 +2950,8 @@ Examples:
             "total-time":12345,
             "duplicate":123,
             "normal":123,
-            "normal-bytes":123456
+            "normal-bytes":123456,
+            "skipped":0
          },
          "disk":{
             "total":20971520,
@@ -2346,13 +2975,16 @@ Examples:
             "total-time":12345,
             "duplicate":10,
             "normal":3333,
-            "normal-bytes":3412992
+            "normal-bytes":3412992,
+            "skipped":0
          },
          "xbzrle-cache":{
             "cache-size":67108864,
             "bytes":20971520,
             "pages":2444343,
             "cache-miss":2244,
+            "cache-hit":2442099,
+            "cache-evictions":1024,
             "overflow":34434
          }
       }
@@ -2373,6 +3005,14 @@ migrate-set-capabilities
 Enable/Disable migration capabilities
 
 - "xbzrle": xbzrle support
+- "compress": multithreaded zlib page compression
+- "postcopy": demand-paged completion of the migration
+- "auto-converge": throttle the vCPUs of guests that keep migration from
+  converging
+- "multifd": send RAM pages over several parallel tcp connections
+- "zero-blocks": send zero blocks of block migration without their data
+- "defer-hot-pages": send the most frequently dirtied pages only once the
+  guest has stopped
 
 Arguments:
 
@@ -2397,6 +3037,12 @@ Query current migration capabilities
 
 - "capabilities": migration capabilities state
          - "xbzrle" : XBZRLE state (json-bool)
+         - "compress" : page compression state (json-bool)
+         - "postcopy" : postcopy state (json-bool)
+         - "auto-converge" : auto-converge state (json-bool)
+         - "multifd" : multifd state (json-bool)
+         - "zero-blocks" : zero-blocks state (json-bool)
+         - "defer-hot-pages" : defer-hot-pages state (json-bool)
 
 Arguments:
 
@@ -24,6 +24,8 @@
 #include "blockdev.h"
 #include "qemu/qom-qobject.h"
 #include "migration.h"
+#include "memory.h"
+#include "main-loop.h"
 
 #define DCLOUDCLONE
 
@@ -55,12 +57,91 @@ VersionInfo *qmp_query_version(Error **err)
     return info;
 }
 
+TimersInfo *qmp_query_timers(Error **errp)
+{
+    TimersInfo *info = g_malloc0(sizeof(*info));
+    uint64_t total, per_second;
+
+    qemu_get_alarm_wakeups(&total, &per_second);
+    info->slack_ns = qemu_get_timer_slack();
+    info->alarm_wakeups = total;
+    info->alarm_wakeups_per_second = per_second;
+
+    return info;
+}
+
+static void device_profile_add(DeviceProfileEntryList ***tail,
+                               DeviceProfileKind kind, char *name,
+                               uint64_t calls, uint64_t ticks)
+{
+    DeviceProfileEntryList *entry = g_malloc0(sizeof(*entry));
+
+    entry->value = g_malloc0(sizeof(*entry->value));
+    entry->value->kind = kind;
+    entry->value->name = name;
+    entry->value->calls = calls;
+    entry->value->ticks = ticks;
+    **tail = entry;
+    *tail = &entry->next;
+}
+
+static void device_profile_add_region(void *opaque, const char *name,
+                                      bool is_io, uint64_t calls,
+                                      uint64_t ticks)
+{
+    device_profile_add(opaque,
+                       is_io ? DEVICE_PROFILE_KIND_PIO
+                             : DEVICE_PROFILE_KIND_MMIO,
+                       g_strdup(name ? name : "(unnamed)"), calls, ticks);
+}
+
+static void device_profile_add_fd(void *opaque, int fd, void *handler,
+                                  uint64_t calls, uint64_t ticks)
+{
+    device_profile_add(opaque, DEVICE_PROFILE_KIND_FD,
+                       g_strdup_printf("fd %d (%p)", fd, handler),
+                       calls, ticks);
+}
+
+DeviceProfileInfo *qmp_query_device_profile(Error **errp)
+{
+    DeviceProfileInfo *info = g_malloc0(sizeof(*info));
+    DeviceProfileEntryList **tail = &info->entries;
+
+    info->enabled = device_profiling;
+    memory_region_profile_foreach(device_profile_add_region, &tail);
+    qemu_iohandler_profile_foreach(device_profile_add_fd, &tail);
+
+    return info;
+}
+
+void qmp_device_profile(bool enable, Error **errp)
+{
+    if (enable && !device_profiling) {
+        memory_region_profile_reset();
+        qemu_iohandler_profile_reset();
+    }
+    device_profiling = enable;
+}
+
 KvmInfo *qmp_query_kvm(Error **errp)
 {
     KvmInfo *info = g_malloc0(sizeof(*info));
 
     info->enabled = kvm_enabled();
     info->present = kvm_available();
+    if (kvm_enabled()) {
+        uint64_t commits, per_second;
+        unsigned int msi_routes;
+
+        kvm_get_route_stats(&commits, &per_second, &msi_routes);
+        info->has_route_commits = true;
+        info->route_commits = commits;
+        info->has_route_commits_per_second = true;
+        info->route_commits_per_second = per_second;
+        info->has_msi_routes = true;
+        info->msi_routes = msi_routes;
+    }
 
     return info;
 }
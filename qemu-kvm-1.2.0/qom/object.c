@@ -243,6 +243,8 @@ static void type_initialize(TypeImpl *ti)
         int i;
 
         g_assert(parent->class_size <= ti->class_size);
+        /* This also copies the cast caches, whose entries hold for
+         * subclasses too.  */
         memcpy(ti->class, parent->class, parent->class_size);
 
         for (e = parent->class->interfaces; e; e = e->next) {
@@ -424,10 +426,38 @@ Object *object_dynamic_cast(Object *obj, const char *typename)
     return NULL;
 }
 
+/* Remember that a cast to typename succeeded, most recent first */
+static void cast_cache_insert(const char **cache, const char *typename)
+{
+    int i;
+
+    for (i = OBJECT_CLASS_CAST_CACHE - 1; i > 0; i--) {
+        cache[i] = cache[i - 1];
+    }
+    cache[0] = typename;
+}
+
+static bool cast_cache_lookup(const char **cache, const char *typename)
+{
+    int i;
+
+    for (i = 0; i < OBJECT_CLASS_CAST_CACHE; i++) {
+        if (cache[i] == typename) {
+            return true;
+        }
+    }
+    return false;
+}
+
 Object *object_dynamic_cast_assert(Object *obj, const char *typename)
 {
+#ifdef CONFIG_QOM_CAST_DEBUG
     Object *inst;
 
+    if (obj && cast_cache_lookup(obj->class->object_cast_cache, typename)) {
+        return obj;
+    }
+
     inst = object_dynamic_cast(obj, typename);
 
     if (!inst) {
@@ -436,7 +466,11 @@ Object *object_dynamic_cast_assert(Object *obj, const char *typename)
         abort();
     }
 
+    cast_cache_insert(obj->class->object_cast_cache, typename);
     return inst;
+#else
+    return obj;
+#endif
 }
 
 ObjectClass *object_class_dynamic_cast(ObjectClass *class,
@@ -473,7 +507,19 @@ ObjectClass *object_class_dynamic_cast(ObjectClass *class,
 ObjectClass *object_class_dynamic_cast_assert(ObjectClass *class,
                                               const char *typename)
 {
-    ObjectClass *ret = object_class_dynamic_cast(class, typename);
+    ObjectClass *ret;
+
+#ifndef CONFIG_QOM_CAST_DEBUG
+    /* Only a cast to an interface can return something else than class */
+    if (!class->interfaces) {
+        return class;
+    }
+#endif
+    if (cast_cache_lookup(class->class_cast_cache, typename)) {
+        return class;
+    }
+
+    ret = object_class_dynamic_cast(class, typename);
 
     if (!ret) {
         fprintf(stderr, "Object %p is not an instance of type %s\n",
@@ -481,6 +527,10 @@ ObjectClass *object_class_dynamic_cast_assert(ObjectClass *class,
         abort();
     }
 
+    /* Casts to interfaces return the interface class, don't cache them */
+    if (ret == class) {
+        cast_cache_insert(class->class_cast_cache, typename);
+    }
     return ret;
 }
 
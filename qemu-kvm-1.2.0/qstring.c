@@ -74,18 +74,23 @@ static void capacity_increase(QString *qstring, size_t len)
     }
 }
 
-/* qstring_append(): Append a C string to a QString
+/* qstring_append_len(): Append len bytes of a C string to a QString
  */
-void qstring_append(QString *qstring, const char *str)
+void qstring_append_len(QString *qstring, const char *str, size_t len)
 {
-    size_t len = strlen(str);
-
     capacity_increase(qstring, len);
     memcpy(qstring->string + qstring->length, str, len);
     qstring->length += len;
     qstring->string[qstring->length] = 0;
 }
 
+/* qstring_append(): Append a C string to a QString
+ */
+void qstring_append(QString *qstring, const char *str)
+{
+    qstring_append_len(qstring, str, strlen(str));
+}
+
 void qstring_append_int(QString *qstring, int64_t value)
 {
     char num[32];
@@ -19,6 +19,7 @@
 #include "hw/irq.h"
 #include "sysemu.h"
 #include "cpus.h"
+#include "qemu-timer.h"
 
 #define MAX_IRQ 256
 
@@ -99,6 +100,17 @@ static bool qtest_opened;
  * than the expected size, the value will be zero filled at the end of the data
  * sequence.
  *
+ * Benchmarking:
+ *
+ *  > bench OP ADDR COUNT [VALUE]
+ *  < OK NS
+ *
+ * Repeat COUNT times the access OP to ADDR, and return how long it took on
+ * the host in nanoseconds.  OP is one of inb, inw, inl, outb, outw, outl
+ * for PIO, or readb, readw, readl, writeb, writew, writel for MMIO; writes
+ * store VALUE, 0 by default.  This measures the dispatch cost without a
+ * round trip through the qtest stream for each access.
+ *
  * IRQ management:
  *
  *  > irq_intercept_in QOM-PATH
@@ -187,6 +199,54 @@ static void qtest_irq_handler(void *opaque, int n, int level)
     }
 }
 
+/* in the order of the bench ops: PIO then MMIO, reads then writes */
+static const char *bench_ops[] = {
+    "inb", "inw", "inl", "outb", "outw", "outl",
+    "readb", "readw", "readl", "writeb", "writew", "writel",
+};
+
+static inline void qtest_bench_access(int op, uint64_t addr, uint32_t value)
+{
+    switch (op) {
+    case 0:
+        cpu_inb(addr);
+        break;
+    case 1:
+        cpu_inw(addr);
+        break;
+    case 2:
+        cpu_inl(addr);
+        break;
+    case 3:
+        cpu_outb(addr, value);
+        break;
+    case 4:
+        cpu_outw(addr, value);
+        break;
+    case 5:
+        cpu_outl(addr, value);
+        break;
+    case 6:
+        ldub_phys(addr);
+        break;
+    case 7:
+        lduw_le_phys(addr);
+        break;
+    case 8:
+        ldl_le_phys(addr);
+        break;
+    case 9:
+        stb_phys(addr, value);
+        break;
+    case 10:
+        stw_le_phys(addr, value);
+        break;
+    case 11:
+        stl_le_phys(addr, value);
+        break;
+    }
+}
+
 static void qtest_process_command(CharDriverState *chr, gchar **words)
 {
     const gchar *command;
@@ -325,6 +385,35 @@ static void qtest_process_command(CharDriverState *chr, gchar **words)
 
         qtest_send_prefix(chr);
         qtest_send(chr, "OK\n");
+    } else if (strcmp(words[0], "bench") == 0) {
+        uint64_t addr, count, i;
+        uint32_t value = 0;
+        int64_t start;
+        int op;
+
+        g_assert(words[1] && words[2] && words[3]);
+        for (op = 0; op < ARRAY_SIZE(bench_ops); op++) {
+            if (strcmp(words[1], bench_ops[op]) == 0) {
+                break;
+            }
+        }
+        if (op == ARRAY_SIZE(bench_ops)) {
+            qtest_send_prefix(chr);
+            qtest_send(chr, "FAIL Unknown access `%s'\n", words[1]);
+            return;
+        }
+        addr = strtoull(words[2], NULL, 0);
+        count = strtoull(words[3], NULL, 0);
+        if (words[4]) {
+            value = strtoul(words[4], NULL, 0);
+        }
+
+        start = get_clock();
+        for (i = 0; i < count; i++) {
+            qtest_bench_access(op, addr, value);
+        }
+        qtest_send_prefix(chr);
+        qtest_send(chr, "OK %"PRIi64"\n", get_clock() - start);
     } else if (strcmp(words[0], "clock_step") == 0) {
         int64_t ns;
 
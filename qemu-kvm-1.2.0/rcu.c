@@ -0,0 +1,180 @@
+/*
+ * Read-copy-update
+ *
+ * Every registered thread publishes in its RCUReaderData the value of
+ * rcu_gp_ctr it saw when entering its outermost read-side critical section,
+ * or 0 outside of one.  synchronize_rcu() advances rcu_gp_ctr and then
+ * waits until no registered thread is still inside a critical section
+ * started before the update, i.e. until each one went through a quiescent
+ * state.  Threads that are idle or blocked outside critical sections do
+ * not delay the grace period.  The writer sleeps on rcu_gp_event, which the
+ * last reader it waits for sets when leaving its critical section.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu-thread.h"
+#include "qemu-rcu.h"
+
+unsigned long rcu_gp_ctr = RCU_GP_LOCKED;
+QemuEvent rcu_gp_event;
+DEFINE_TLS(RCUReaderData, rcu_reader);
+
+/* Serializes grace periods */
+static QemuMutex rcu_gp_lock;
+
+/* Protects the list of registered threads */
+static QemuMutex rcu_registry_lock;
+static QLIST_HEAD(, RCUReaderData) registry = QLIST_HEAD_INITIALIZER(registry);
+
+static bool rcu_gp_ongoing(unsigned long *ctr)
+{
+    unsigned long v = *(volatile unsigned long *)ctr;
+
+    return v && v != rcu_gp_ctr;
+}
+
+/* Called with rcu_gp_lock and rcu_registry_lock held */
+static void wait_for_readers(void)
+{
+    RCUReaderData *p;
+
+    QLIST_FOREACH(p, &registry, node) {
+        while (rcu_gp_ongoing(&p->ctr)) {
+            qemu_event_reset(&rcu_gp_event);
+            p->waiting = true;
+            /* Pairs with the barrier in rcu_read_unlock(): either the
+             * reader sees waiting, or we see it quiescent.
+             */
+            smp_mb();
+            if (!rcu_gp_ongoing(&p->ctr)) {
+                break;
+            }
+            qemu_event_wait(&rcu_gp_event);
+        }
+        p->waiting = false;
+    }
+}
+
+void synchronize_rcu(void)
+{
+    assert(tls_var(rcu_reader).depth == 0);
+
+    qemu_mutex_lock(&rcu_gp_lock);
+    qemu_mutex_lock(&rcu_registry_lock);
+
+    if (!QLIST_EMPTY(&registry)) {
+        /* Order the writer's updates before the counter change, so that
+         * a reader that sees the new counter also sees the new data.
+         */
+        smp_mb();
+
+        if (sizeof(rcu_gp_ctr) < 8) {
+            /* A 32-bit counter could wrap around and match the snapshot
+             * of a reader that has been preempted for very long.  Flip a
+             * single bit instead, and wait in two phases, so that a
+             * snapshot can only ever look current for one of them.
+             */
+            rcu_gp_ctr ^= RCU_GP_CTR;
+            wait_for_readers();
+            smp_mb();
+            rcu_gp_ctr ^= RCU_GP_CTR;
+        } else {
+            rcu_gp_ctr += RCU_GP_CTR;
+        }
+        wait_for_readers();
+
+        /* Readers are done with the old data before it is freed */
+        smp_mb();
+    }
+
+    qemu_mutex_unlock(&rcu_registry_lock);
+    qemu_mutex_unlock(&rcu_gp_lock);
+}
+
+void rcu_register_thread(void)
+{
+    RCUReaderData *p = &tls_var(rcu_reader);
+
+    assert(!p->registered);
+    qemu_mutex_lock(&rcu_registry_lock);
+    QLIST_INSERT_HEAD(&registry, p, node);
+    p->registered = true;
+    qemu_mutex_unlock(&rcu_registry_lock);
+}
+
+void rcu_unregister_thread(void)
+{
+    RCUReaderData *p = &tls_var(rcu_reader);
+
+    assert(p->registered && p->depth == 0);
+    qemu_mutex_lock(&rcu_registry_lock);
+    QLIST_REMOVE(p, node);
+    p->registered = false;
+    qemu_mutex_unlock(&rcu_registry_lock);
+}
+
+/*
+ * Deferred callbacks.  A single thread, started on the first call_rcu1(),
+ * takes the whole queue at once, waits for one grace period and runs the
+ * callbacks, so that bursts of updates share grace periods.
+ */
+static QemuMutex rcu_call_lock;
+static QemuCond rcu_call_cond;
+static RCUHead *rcu_call_head;
+static RCUHead **rcu_call_tail = &rcu_call_head;
+static bool rcu_call_started;
+static QemuThread rcu_call_thread;
+
+static void *call_rcu_thread(void *opaque)
+{
+    RCUHead *head, *next;
+
+    for (;;) {
+        qemu_mutex_lock(&rcu_call_lock);
+        while (!rcu_call_head) {
+            qemu_cond_wait(&rcu_call_cond, &rcu_call_lock);
+        }
+        head = rcu_call_head;
+        rcu_call_head = NULL;
+        rcu_call_tail = &rcu_call_head;
+        qemu_mutex_unlock(&rcu_call_lock);
+
+        synchronize_rcu();
+
+        for (; head; head = next) {
+            next = head->next;
+            head->func(head);
+        }
+    }
+    return NULL;
+}
+
+void call_rcu1(RCUHead *head, RCUCBFunc *func)
+{
+    head->func = func;
+    head->next = NULL;
+
+    qemu_mutex_lock(&rcu_call_lock);
+    *rcu_call_tail = head;
+    rcu_call_tail = &head->next;
+    if (!rcu_call_started) {
+        rcu_call_started = true;
+        qemu_thread_create(&rcu_call_thread, call_rcu_thread, NULL,
+                           QEMU_THREAD_DETACHED);
+    }
+    qemu_cond_signal(&rcu_call_cond);
+    qemu_mutex_unlock(&rcu_call_lock);
+}
+
+static void __attribute__((constructor)) rcu_init(void)
+{
+    qemu_mutex_init(&rcu_gp_lock);
+    qemu_mutex_init(&rcu_registry_lock);
+    qemu_mutex_init(&rcu_call_lock);
+    qemu_cond_init(&rcu_call_cond);
+    qemu_event_init(&rcu_gp_event, true);
+    rcu_register_thread();
+}
@@ -85,6 +85,7 @@
 #include "cpus.h"
 #include "memory.h"
 #include "qmp-commands.h"
+#include "qemu-coroutine.h"
 #include "trace.h"
 
 #define SELF_ANNOUNCE_ROUNDS 5
@@ -342,6 +343,18 @@ QEMUFile *qemu_fopen_socket(int fd)
     return s->file;
 }
 
+int qemu_socket_fd(QEMUFile *f)
+{
+    QEMUFileSocket *s;
+
+    if (f->get_buffer != socket_get_buffer) {
+        return -1;
+    }
+
+    s = f->opaque;
+    return s->fd;
+}
+
 static int file_put_buffer(void *opaque, const uint8_t *buf,
                             int64_t pos, int size)
 {
@@ -387,10 +400,99 @@ fail:
     return NULL;
 }
 
+/*
+ * The vmstate is gathered in chunks that are written by coroutines, so
+ * that several writes are in flight and savevm doesn't wait for each
+ * one.  Chunks are aligned to their size and never share a sector.
+ */
+#define BDRV_VMSTATE_CHUNK      (1024 * 1024)
+#define BDRV_VMSTATE_IN_FLIGHT  4
+
+typedef struct QEMUFileBdrv {
+    BlockDriverState *bs;
+    uint8_t *buf;
+    int64_t buf_pos;
+    int buf_len;
+    int in_flight;
+    int ret;
+    int growable;
+} QEMUFileBdrv;
+
+typedef struct BdrvVMStateWrite {
+    QEMUFileBdrv *s;
+    uint8_t *buf;
+    int64_t pos;
+    int len;
+} BdrvVMStateWrite;
+
+static void coroutine_fn block_write_vmstate_entry(void *opaque)
+{
+    BdrvVMStateWrite *w = opaque;
+    QEMUFileBdrv *s = w->s;
+    int ret;
+
+    ret = bdrv_save_vmstate(s->bs, w->buf, w->pos, w->len);
+    if (ret < 0 && s->ret == 0) {
+        s->ret = ret;
+    }
+    s->in_flight--;
+    qemu_vfree(w->buf);
+    g_free(w);
+}
+
+static void block_submit_vmstate(QEMUFileBdrv *s)
+{
+    BdrvVMStateWrite *w;
+    Coroutine *co;
+
+    if (!s->buf_len) {
+        return;
+    }
+    while (s->in_flight >= BDRV_VMSTATE_IN_FLIGHT) {
+        qemu_aio_wait();
+    }
+
+    w = g_new(BdrvVMStateWrite, 1);
+    w->s = s;
+    w->buf = s->buf;
+    w->pos = s->buf_pos;
+    w->len = s->buf_len;
+
+    s->buf = qemu_blockalign(s->bs, BDRV_VMSTATE_CHUNK);
+    s->buf_pos += s->buf_len;
+    s->buf_len = 0;
+    s->in_flight++;
+
+    co = qemu_coroutine_create(block_write_vmstate_entry);
+    qemu_coroutine_enter(co, w);
+}
+
 static int block_put_buffer(void *opaque, const uint8_t *buf,
                            int64_t pos, int size)
 {
-    bdrv_save_vmstate(opaque, buf, pos, size);
+    QEMUFileBdrv *s = opaque;
+    int done = 0;
+
+    if (s->ret < 0) {
+        return s->ret;
+    }
+    if (size == 0) {
+        return 0;
+    }
+    if (pos != s->buf_pos + s->buf_len) {
+        block_submit_vmstate(s);
+        s->buf_pos = pos;
+    }
+    while (done < size) {
+        int len = MIN(size - done, BDRV_VMSTATE_CHUNK - s->buf_len);
+
+        memcpy(s->buf + s->buf_len, buf + done, len);
+        s->buf_len += len;
+        done += len;
+        if (s->buf_len == BDRV_VMSTATE_CHUNK) {
+            block_submit_vmstate(s);
+        }
+    }
     return size;
 }
 
@@ -404,11 +506,39 @@ static int bdrv_fclose(void *opaque)
     return bdrv_flush(opaque);
 }
 
+static int bdrv_fclose_writable(void *opaque)
+{
+    QEMUFileBdrv *s = opaque;
+    int ret;
+
+    block_submit_vmstate(s);
+    while (s->in_flight) {
+        qemu_aio_wait();
+    }
+    /* Image formats raise bs->growable around each vmstate write, and
+     * writes that overlap can leave it raised */
+    s->bs->growable = s->growable;
+
+    ret = s->ret;
+    if (ret == 0) {
+        ret = bdrv_flush(s->bs);
+    }
+    qemu_vfree(s->buf);
+    g_free(s);
+    return ret;
+}
+
 static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
 {
-    if (is_writable)
-        return qemu_fopen_ops(bs, block_put_buffer, NULL, bdrv_fclose, 
-			      NULL, NULL, NULL);
+    if (is_writable) {
+        QEMUFileBdrv *s = g_malloc0(sizeof(*s));
+
+        s->bs = bs;
+        s->buf = qemu_blockalign(bs, BDRV_VMSTATE_CHUNK);
+        s->growable = bs->growable;
+        return qemu_fopen_ops(s, block_put_buffer, NULL, bdrv_fclose_writable,
+                              NULL, NULL, NULL);
+    }
     return qemu_fopen_ops(bs, NULL, block_get_buffer, bdrv_fclose, NULL, NULL, NULL);
 }
 
@@ -676,6 +806,16 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->buf_offset - f->buf_size + f->buf_index;
 }
 
+/*
+ * Accounts for @size bytes a writer sent on another connection, so that
+ * they count in qemu_ftell() and against the rate limit.  Only for files
+ * whose put_buffer does not use the position.
+ */
+void qemu_update_position(QEMUFile *f, size_t size)
+{
+    f->buf_offset += size;
+}
+
 int64_t qemu_fseek(QEMUFile *f, int64_t pos, int whence)
 {
     if (whence == SEEK_SET) {
@@ -1541,10 +1681,31 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
 
+typedef struct SavevmLiveState {
+    Monitor *mon;
+    int mon_suspended;
+    BlockDriverState *bs;
+    QEMUFile *f;
+    QEMUSnapshotInfo sn;
+    QEMUBH *bh;
+} SavevmLiveState;
+
+/* The live savevm in progress, see savevm_live_start() */
+static SavevmLiveState *savevm_live;
+
 bool qemu_savevm_state_blocked(Error **errp)
 {
     SaveStateEntry *se;
 
+    /* The live handlers keep their state for the snapshot being taken */
+    if (savevm_live) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return true;
+    }
+
+    /* Whatever comes next saves RAM, which must all be there */
+    ram_lazy_load_all();
+
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (se->no_migrate) {
             error_set(errp, QERR_MIGRATION_NOT_SUPPORTED, se->idstr);
@@ -1650,11 +1811,8 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     if (ret != 0) {
         return ret;
     }
-    ret = qemu_file_get_error(f);
-    if (ret != 0) {
-        qemu_savevm_state_cancel(f);
-    }
-    return ret;
+    /* the caller cancels, it may not hold the iothread lock here */
+    return qemu_file_get_error(f);
 }
 
 int qemu_savevm_state_complete(QEMUFile *f)
@@ -1713,6 +1871,30 @@ int qemu_savevm_state_complete(QEMUFile *f)
     return qemu_file_get_error(f);
 }
 
+/*
+ * Returns how many bytes the live sections have left to send.  Called
+ * with the iothread lock held; handlers may sync their dirty state when
+ * what is left fits in @max_size.
+ */
+uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size)
+{
+    SaveStateEntry *se;
+    uint64_t ret = 0;
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (!se->ops || !se->ops->save_live_pending) {
+            continue;
+        }
+        if (se->ops && se->ops->is_active) {
+            if (!se->ops->is_active(se->opaque)) {
+                continue;
+            }
+        }
+        ret += se->ops->save_live_pending(f, se->opaque, max_size);
+    }
+    return ret;
+}
+
 void qemu_savevm_state_cancel(QEMUFile *f)
 {
     SaveStateEntry *se;
@@ -1729,7 +1911,8 @@ static int qemu_savevm_state(QEMUFile *f)
     int ret;
     MigrationParams params = {
         .blk = 0,
-        .shared = 0
+        .shared = 0,
+        .flat = true,
     };
 
     if (qemu_savevm_state_blocked(NULL)) {
@@ -1743,8 +1926,10 @@ static int qemu_savevm_state(QEMUFile *f)
 
     do {
         ret = qemu_savevm_state_iterate(f);
-        if (ret < 0)
+        if (ret < 0) {
+            qemu_savevm_state_cancel(f);
             goto out;
+        }
     } while (ret == 0);
 
     ret = qemu_savevm_state_complete(f);
@@ -2064,22 +2249,10 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
     return 0;
 }
 
-void do_savevm(Monitor *mon, const QDict *qdict)
+/* Returns the image that will hold the vmstate, or NULL */
+static BlockDriverState *savevm_check_devices(Monitor *mon)
 {
-    BlockDriverState *bs, *bs1;
-    QEMUSnapshotInfo sn1, *sn = &sn1, old_sn1, *old_sn = &old_sn1;
-    int ret;
-    QEMUFile *f;
-    int saved_vm_running;
-    uint64_t vm_state_size;
-#ifdef _WIN32
-    struct _timeb tb;
-    struct tm *ptm;
-#else
-    struct timeval tv;
-    struct tm tm;
-#endif
-    const char *name = qdict_get_try_str(qdict, "name");
+    BlockDriverState *bs;
 
     /* Verify if there is a device that doesn't support snapshots and is writable */
     bs = NULL;
@@ -2092,18 +2265,31 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         if (!bdrv_can_snapshot(bs)) {
             monitor_printf(mon, "Device '%s' is writable but does not support snapshots.\n",
                                bdrv_get_device_name(bs));
-            return;
+            return NULL;
         }
     }
 
     bs = bdrv_snapshots();
     if (!bs) {
         monitor_printf(mon, "No block device can accept snapshots\n");
-        return;
+        return NULL;
     }
+    return bs;
+}
 
-    saved_vm_running = runstate_is_running();
-    vm_stop(RUN_STATE_SAVE_VM);
+/* Fill in @sn and delete old snapshots of the same name */
+static int savevm_prepare_snapshot(Monitor *mon, BlockDriverState *bs,
+                                   const char *name, QEMUSnapshotInfo *sn)
+{
+    QEMUSnapshotInfo old_sn1, *old_sn = &old_sn1;
+    int ret;
+#ifdef _WIN32
+    struct _timeb tb;
+    struct tm *ptm;
+#else
+    struct timeval tv;
+    struct tm tm;
+#endif
 
     memset(sn, 0, sizeof(*sn));
 
@@ -2141,6 +2327,175 @@ void do_savevm(Monitor *mon, const QDict *qdict)
 
     /* Delete old snapshots of the same name */
     if (name && del_existing_snapshots(mon, name) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static void savevm_create_snapshots(Monitor *mon, BlockDriverState *bs,
+                                    QEMUSnapshotInfo *sn,
+                                    uint64_t vm_state_size)
+{
+    BlockDriverState *bs1;
+    int ret;
+
+    bs1 = NULL;
+    while ((bs1 = bdrv_next(bs1))) {
+        if (bdrv_can_snapshot(bs1)) {
+            /* Write VM state size only to the image that contains the state */
+            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
+            ret = bdrv_snapshot_create(bs1, sn);
+            if (ret < 0) {
+                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
+                               bdrv_get_device_name(bs1));
+            }
+        }
+    }
+}
+
+/*
+ * Live savevm: RAM is written with the migration iterators while the
+ * guest keeps running, and the guest is only stopped for the last
+ * dirty pages and the device state, once they fit in the maximum
+ * migration downtime.  The disks are snapshotted at that point, so
+ * they match the saved RAM.
+ */
+static void savevm_live_finish(SavevmLiveState *s, int ret)
+{
+    int saved_vm_running = runstate_is_running();
+    uint64_t vm_state_size = 0;
+    int close_ret;
+
+    if (ret == 0) {
+        vm_stop(RUN_STATE_SAVE_VM);
+        s->sn.vm_clock_nsec = qemu_get_clock_ns(vm_clock);
+        ret = qemu_savevm_state_complete(s->f);
+    } else {
+        qemu_savevm_state_cancel(s->f);
+        saved_vm_running = 0;
+    }
+    vm_state_size = qemu_ftell(s->f);
+    close_ret = qemu_fclose(s->f);
+    if (ret == 0) {
+        ret = close_ret;
+    }
+
+    if (ret < 0) {
+        monitor_printf(s->mon, "Error %d while writing VM\n", ret);
+    } else {
+        savevm_create_snapshots(s->mon, s->bs, &s->sn, vm_state_size);
+    }
+
+    if (saved_vm_running) {
+        vm_start();
+    }
+    if (s->mon_suspended) {
+        monitor_resume(s->mon);
+    }
+    qemu_bh_delete(s->bh);
+    g_free(s);
+    savevm_live = NULL;
+}
+
+static void savevm_live_iterate(void *opaque)
+{
+    SavevmLiveState *s = opaque;
+    int64_t start = qemu_get_clock_ms(rt_clock);
+    int64_t start_bytes = qemu_ftell(s->f);
+    double bandwidth;
+    uint64_t max_size;
+    int ret;
+
+    ret = qemu_savevm_state_iterate(s->f);
+    if (ret < 0) {
+        savevm_live_finish(s, ret);
+        return;
+    }
+
+    /* bytes per ms, the downtime is in ns */
+    bandwidth = (double)(qemu_ftell(s->f) - start_bytes) /
+                MAX(qemu_get_clock_ms(rt_clock) - start, 1);
+    max_size = bandwidth * migrate_max_downtime() / 1000000;
+
+    if (qemu_savevm_state_pending(s->f, max_size) <= max_size) {
+        savevm_live_finish(s, 0);
+        return;
+    }
+    /* Go back to the main loop, so that I/O for the guest gets done */
+    qemu_bh_schedule(s->bh);
+}
+
+static void savevm_live_start(Monitor *mon, BlockDriverState *bs,
+                              const char *name)
+{
+    SavevmLiveState *s;
+    MigrationParams params = {
+        .blk = 0,
+        .shared = 0
+    };
+    int ret;
+
+    if (qemu_savevm_state_blocked(NULL)) {
+        monitor_printf(mon, "Device state cannot be saved\n");
+        return;
+    }
+    if (migration_in_progress()) {
+        monitor_printf(mon, "Cannot take a live snapshot during migration\n");
+        return;
+    }
+
+    s = g_malloc0(sizeof(*s));
+    s->mon = mon;
+    s->bs = bs;
+    if (savevm_prepare_snapshot(mon, bs, name, &s->sn) < 0) {
+        g_free(s);
+        return;
+    }
+
+    s->f = qemu_fopen_bdrv(bs, 1);
+    ret = qemu_savevm_state_begin(s->f, &params);
+    if (ret < 0) {
+        monitor_printf(mon, "Error %d while writing VM\n", ret);
+        qemu_fclose(s->f);
+        g_free(s);
+        return;
+    }
+
+    s->mon_suspended = monitor_suspend(mon) == 0;
+    s->bh = qemu_bh_new(savevm_live_iterate, s);
+    savevm_live = s;
+    qemu_bh_schedule(s->bh);
+}
+
+void do_savevm(Monitor *mon, const QDict *qdict)
+{
+    BlockDriverState *bs;
+    QEMUSnapshotInfo sn1, *sn = &sn1;
+    int ret;
+    QEMUFile *f;
+    int saved_vm_running;
+    uint64_t vm_state_size;
+    const char *name = qdict_get_try_str(qdict, "name");
+
+    if (savevm_live) {
+        monitor_printf(mon, "A live snapshot is being taken\n");
+        return;
+    }
+
+    bs = savevm_check_devices(mon);
+    if (!bs) {
+        return;
+    }
+
+    if (qdict_get_try_bool(qdict, "live", 0)) {
+        savevm_live_start(mon, bs, name);
+        return;
+    }
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_SAVE_VM);
+
+    if (savevm_prepare_snapshot(mon, bs, name, sn) < 0) {
         goto the_end;
     }
 
@@ -2152,26 +2507,16 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     }
     ret = qemu_savevm_state(f);
     vm_state_size = qemu_ftell(f);
-    qemu_fclose(f);
+    if (qemu_fclose(f) < 0 && ret == 0) {
+        ret = -EIO;
+    }
     if (ret < 0) {
         monitor_printf(mon, "Error %d while writing VM\n", ret);
         goto the_end;
     }
 
     /* create the snapshots */
-
-    bs1 = NULL;
-    while ((bs1 = bdrv_next(bs1))) {
-        if (bdrv_can_snapshot(bs1)) {
-            /* Write VM state size only to the image that contains the state */
-            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
-            ret = bdrv_snapshot_create(bs1, sn);
-            if (ret < 0) {
-                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
-                               bdrv_get_device_name(bs1));
-            }
-        }
-    }
+    savevm_create_snapshots(mon, bs, sn, vm_state_size);
 
  the_end:
     if (saved_vm_running)
@@ -2204,13 +2549,18 @@ void qmp_xen_save_devices_state(const char *filename, Error **errp)
     return;
 }
 
-int load_vmstate(const char *name)
+int load_vmstate(const char *name, bool lazy)
 {
     BlockDriverState *bs, *bs_vm_state;
     QEMUSnapshotInfo sn;
     QEMUFile *f;
     int ret;
 
+    if (savevm_live) {
+        error_report("A live snapshot is being taken");
+        return -EBUSY;
+    }
+
     bs_vm_state = bdrv_snapshots();
     if (!bs_vm_state) {
         error_report("No block device supports snapshots");
@@ -2250,6 +2600,15 @@ int load_vmstate(const char *name)
         }
     }
 
+    /* RAM that is still being loaded is overwritten anyway */
+    ram_lazy_load_cancel();
+    if (lazy) {
+        ret = ram_lazy_load_begin(bs_vm_state);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     /* Flush all IO requests so they don't interfere with the new state.  */
     bdrv_drain_all();
 
@@ -2260,6 +2619,7 @@ int load_vmstate(const char *name)
             if (ret < 0) {
                 error_report("Error %d while activating snapshot '%s' on '%s'",
                              ret, name, bdrv_get_device_name(bs));
+                ram_lazy_load_cancel();
                 return ret;
             }
         }
@@ -2269,6 +2629,7 @@ int load_vmstate(const char *name)
     f = qemu_fopen_bdrv(bs_vm_state, 0);
     if (!f) {
         error_report("Could not open VM state file");
+        ram_lazy_load_cancel();
         return -EINVAL;
     }
 
@@ -2278,9 +2639,12 @@ int load_vmstate(const char *name)
     qemu_fclose(f);
     if (ret < 0) {
         error_report("Error %d while loading VM state", ret);
+        ram_lazy_load_cancel();
         return ret;
     }
 
+    /* pages of flat RAM images that were left out are read from now on */
+    ram_lazy_load_start();
     return 0;
 }
 
@@ -2392,162 +2756,3 @@ void vmstate_register_ram_global(MemoryRegion *mr)
 {
     vmstate_register_ram(mr, NULL);
 }
-
-/*
-  page = zrun nzrun
-       | zrun nzrun page
-
-  zrun = length
-
-  nzrun = length byte...
-
-  length = uleb128 encoded integer
- */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
-{
-    uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res, xor;
-    uint8_t *nzrun_start = NULL;
-
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
-
-    while (i < slen) {
-        /* overflow */
-        if (d + 2 > dlen) {
-            return -1;
-        }
-
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
-
-        /* buffer unchanged */
-        if (zrun_len == slen) {
-            return 0;
-        }
-
-        /* skip last zero run */
-        if (i == slen) {
-            return d;
-        }
-
-        d += uleb128_encode_small(dst + d, zrun_len);
-
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
-
-        /* overflow */
-        if (d + 2 > dlen) {
-            return -1;
-        }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            long mask = (long)0x0101010101010101ULL;
-            while (i < slen) {
-                xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
-
-        d += uleb128_encode_small(dst + d, nzrun_len);
-        /* overflow */
-        if (d + nzrun_len > dlen) {
-            return -1;
-        }
-        memcpy(dst + d, nzrun_start, nzrun_len);
-        d += nzrun_len;
-        nzrun_len = 0;
-    }
-
-    return d;
-}
-
-int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
-{
-    int i = 0, d = 0;
-    int ret;
-    uint32_t count = 0;
-
-    while (i < slen) {
-
-        /* zrun */
-        if ((slen - i) < 2) {
-            return -1;
-        }
-
-        ret = uleb128_decode_small(src + i, &count);
-        if (ret < 0 || (i && !count)) {
-            return -1;
-        }
-        i += ret;
-        d += count;
-
-        /* overflow */
-        if (d > dlen) {
-            return -1;
-        }
-
-        /* nzrun */
-        if ((slen - i) < 2) {
-            return -1;
-        }
-
-        ret = uleb128_decode_small(src + i, &count);
-        if (ret < 0 || !count) {
-            return -1;
-        }
-        i += ret;
-
-        /* overflow */
-        if (d + count > dlen || i + count > slen) {
-            return -1;
-        }
-
-        memcpy(dst + d, src + i, count);
-        d += count;
-        i += count;
-    }
-
-    return d;
-}
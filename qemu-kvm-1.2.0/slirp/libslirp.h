@@ -23,9 +23,22 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds,
                        int select_error);
 
 void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len);
+/* csum_partial: the guest left the TCP/UDP checksum for us to skip */
+void slirp_input_offload(Slirp *slirp, const uint8_t *pkt, int pkt_len,
+                         int csum_partial);
+/* Let TCP segments to the guest go out with a partial checksum and, with
+ * tso, as single frames of up to 64k that the guest splits itself. */
+void slirp_set_offload(Slirp *slirp, int csum, int tso);
 
 /* you must provide the following functions: */
 void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len);
+/* Only used once slirp_set_offload() enabled csum: a nonzero csum_start
+ * means the checksum at csum_start + csum_offset only covers the pseudo
+ * header, a nonzero gso_size that the payload after hdr_len bytes has to
+ * be segmented into gso_size chunks. */
+void slirp_output_offload(void *opaque, const uint8_t *pkt, int pkt_len,
+                          int csum_start, int csum_offset, int hdr_len,
+                          int gso_size);
 
 int slirp_add_hostfwd(Slirp *slirp, int is_udp,
                       struct in_addr host_addr, int host_port,
@@ -17,7 +17,7 @@
 
 #include <slirp.h>
 
-#define MBUF_THRESH 30
+#define MBUF_THRESH 256
 
 /*
  * Find a nice value for msize
@@ -51,6 +51,28 @@ void m_cleanup(Slirp *slirp)
         free(m);
         m = next;
     }
+    while (slirp->m_ext_cached > 0) {
+        free(slirp->m_ext_cache[--slirp->m_ext_cached]);
+    }
+}
+
+static char *m_ext_alloc(Slirp *slirp)
+{
+    if (slirp->m_ext_cached > 0) {
+        return slirp->m_ext_cache[--slirp->m_ext_cached];
+    }
+    return (char *)malloc(SLIRP_MEXT_SIZE);
+}
+
+static void m_ext_free(struct mbuf *m)
+{
+    Slirp *slirp = m->slirp;
+
+    if (m->m_size == SLIRP_MEXT_SIZE && slirp->m_ext_cached < MBUF_EXT_CACHE) {
+        slirp->m_ext_cache[slirp->m_ext_cached++] = m->m_ext;
+    } else {
+        free(m->m_ext);
+    }
 }
 
 /*
@@ -93,6 +115,7 @@ m_get(Slirp *slirp)
         m->m_prevpkt = NULL;
         m->arp_requested = false;
         m->expiration_date = (uint64_t)-1;
+        m->gso_size = 0;
 end_error:
 	DEBUG_ARG("m = %lx", (long )m);
 	return m;
@@ -112,7 +135,7 @@ m_free(struct mbuf *m)
 
 	/* If it's M_EXT, free() it */
 	if (m->m_flags & M_EXT)
-	   free(m->m_ext);
+	   m_ext_free(m);
 
 	/*
 	 * Either free() it or put it on the free list
@@ -164,7 +187,13 @@ m_inc(struct mbuf *m, int size)
         } else {
 	  char *dat;
 	  datasize = m->m_data - m->m_dat;
-	  dat = (char *)malloc(size);
+	  if (size <= SLIRP_MEXT_SIZE) {
+	    /* round up to the size class so the buffer can be recycled */
+	    size = SLIRP_MEXT_SIZE;
+	    dat = m_ext_alloc(m->slirp);
+	  } else {
+	    dat = (char *)malloc(size);
+	  }
 	  memcpy(dat, m->m_dat, m->m_size);
 
 	  m->m_ext = dat;
@@ -35,6 +35,13 @@
 
 #define MINCSIZE 4096	/* Amount to increase mbuf if too small */
 
+/*
+ * External data buffers come in one size class that holds any frame up to
+ * 64k, and freed ones are kept for reuse.  Larger buffers are malloced.
+ */
+#define SLIRP_MEXT_SIZE	(IP_MAXPACKET + IF_MAXLINKHDR)
+#define MBUF_EXT_CACHE	32
+
 /*
  * Macros for type conversion
  * mtod(m,t) -	convert mbuf pointer to data pointer of correct type
@@ -84,6 +91,7 @@ struct mbuf {
 	Slirp *slirp;
 	bool	arp_requested;
 	uint64_t expiration_date;
+	int	gso_size;	/* segment size of an oversized TCP frame */
 	/* start of dynamic buffer area, must be last element */
 	union M_dat {
 		char	m_dat_[1]; /* ANSI don't like 0 sized arrays */
@@ -114,6 +122,8 @@ struct mbuf {
 #define M_USEDLIST		0x04	/* XXX mbuf is on used list (for dtom()) */
 #define M_DOFREE		0x08	/* when m_free is called on the mbuf, free()
 					 * it rather than putting it on the free list */
+#define M_CSUM_OK		0x10	/* guest offloaded the checksum, don't verify it */
+#define M_CSUM_PARTIAL		0x20	/* TCP checksum only covers the pseudo header */
 
 void m_init(Slirp *);
 void m_cleanup(Slirp *slirp);
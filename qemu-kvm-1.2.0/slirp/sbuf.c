@@ -60,6 +60,67 @@ sbreserve(struct sbuf *sb, int size)
 	}
 }
 
+/*
+ * Describe the data in sb with up to two iovecs (the buffer is a ring),
+ * returns the number of iovecs used
+ */
+int
+sbiov(struct sbuf *sb, struct iovec *iov)
+{
+	int len = sb->sb_cc;
+
+	iov[0].iov_base = sb->sb_rptr;
+	iov[1].iov_base = NULL;
+	iov[1].iov_len = 0;
+	if (sb->sb_rptr < sb->sb_wptr) {
+		iov[0].iov_len = sb->sb_wptr - sb->sb_rptr;
+		/* Should never succeed, but... */
+		if (iov[0].iov_len > len) iov[0].iov_len = len;
+		return 1;
+	}
+	iov[0].iov_len = (sb->sb_data + sb->sb_datalen) - sb->sb_rptr;
+	if (iov[0].iov_len > len) iov[0].iov_len = len;
+	len -= iov[0].iov_len;
+	if (len) {
+		iov[1].iov_base = sb->sb_data;
+		iov[1].iov_len = sb->sb_wptr - sb->sb_data;
+		if (iov[1].iov_len > len) iov[1].iov_len = len;
+		return 2;
+	}
+	return 1;
+}
+
+#ifdef HAVE_READV
+/*
+ * Flush what is already queued in so_rcv together with m in one writev(),
+ * so that m only needs to be copied into the buffer if the socket is full.
+ * Returns how much of m was written.
+ */
+static int
+sbwritev(struct socket *so, struct mbuf *m)
+{
+	struct sbuf *sb = &so->so_rcv;
+	struct iovec iov[3];
+	int n, nn;
+
+	n = sbiov(sb, iov);
+	iov[n].iov_base = m->m_data;
+	iov[n].iov_len = m->m_len;
+
+	nn = writev(so->s, iov, n + 1);
+	if (nn <= 0) {
+		return 0;
+	}
+	if (nn <= sb->sb_cc) {
+		sbdrop(sb, nn);
+		return 0;
+	}
+	nn -= sb->sb_cc;
+	sbdrop(sb, sb->sb_cc);
+	return nn;
+}
+#endif
+
 /*
  * Try and write() to the socket, whatever doesn't get written
  * append to the buffer... for a host with a fast net connection,
@@ -100,6 +161,10 @@ sbappend(struct socket *so, struct mbuf *m)
 	 */
 	if (!so->so_rcv.sb_cc)
 	   ret = slirp_send(so, m->m_data, m->m_len, 0);
+#ifdef HAVE_READV
+	else if (so->s != -1)
+	   ret = sbwritev(so, m);
+#endif
 
 	if (ret <= 0) {
 		/*
@@ -26,5 +26,6 @@ void sbdrop(struct sbuf *, int);
 void sbreserve(struct sbuf *, int);
 void sbappend(struct socket *, struct mbuf *);
 void sbcopy(struct sbuf *, int, int, char *);
+int sbiov(struct sbuf *, struct iovec *);
 
 #endif
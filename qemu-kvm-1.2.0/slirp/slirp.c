@@ -666,7 +666,8 @@ static void arp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
     }
 }
 
-void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
+void slirp_input_offload(Slirp *slirp, const uint8_t *pkt, int pkt_len,
+                         int csum_partial)
 {
     struct mbuf *m;
     int proto;
@@ -692,6 +693,9 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
 
         m->m_data += 2 + ETH_HLEN;
         m->m_len -= 2 + ETH_HLEN;
+        if (csum_partial) {
+            m->m_flags |= M_CSUM_OK;
+        }
 
         ip_input(m);
         break;
@@ -700,17 +704,30 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
     }
 }
 
+void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
+{
+    slirp_input_offload(slirp, pkt, pkt_len, 0);
+}
+
+void slirp_set_offload(Slirp *slirp, int csum, int tso)
+{
+    slirp->csum_offload = csum;
+    /* segmentation offload implies checksum offload */
+    slirp->tso_offload = csum && tso;
+}
+
 /* Output the IP packet to the ethernet device. Returns 0 if the packet must be
  * re-queued.
  */
 int if_encap(Slirp *slirp, struct mbuf *ifm)
 {
-    uint8_t buf[1600];
-    struct ethhdr *eh = (struct ethhdr *)buf;
+    uint8_t stack_buf[1600];
+    uint8_t *buf = stack_buf;
+    struct ethhdr *eh;
     uint8_t ethaddr[ETH_ALEN];
     const struct ip *iph = (const struct ip *)ifm->m_data;
 
-    if (ifm->m_len + ETH_HLEN > sizeof(buf)) {
+    if (ifm->m_len + ETH_HLEN > sizeof(stack_buf) && !ifm->gso_size) {
         return 1;
     }
 
@@ -752,13 +769,31 @@ int if_encap(Slirp *slirp, struct mbuf *ifm)
         }
         return 0;
     } else {
+        if (ifm->m_len + ETH_HLEN > sizeof(stack_buf)) {
+            buf = g_malloc(ifm->m_len + ETH_HLEN);
+        }
+        eh = (struct ethhdr *)buf;
         memcpy(eh->h_dest, ethaddr, ETH_ALEN);
         memcpy(eh->h_source, special_ethaddr, ETH_ALEN - 4);
         /* XXX: not correct */
         memcpy(&eh->h_source[2], &slirp->vhost_addr, 4);
         eh->h_proto = htons(ETH_P_IP);
         memcpy(buf + sizeof(struct ethhdr), ifm->m_data, ifm->m_len);
-        slirp_output(slirp->opaque, buf, ifm->m_len + ETH_HLEN);
+        if (ifm->m_flags & M_CSUM_PARTIAL) {
+            int csum_start = ETH_HLEN + (iph->ip_hl << 2);
+            const struct tcphdr *th =
+                (const struct tcphdr *)(buf + csum_start);
+
+            slirp_output_offload(slirp->opaque, buf, ifm->m_len + ETH_HLEN,
+                                 csum_start, offsetof(struct tcphdr, th_sum),
+                                 csum_start + (th->th_off << 2),
+                                 ifm->gso_size);
+        } else {
+            slirp_output(slirp->opaque, buf, ifm->m_len + ETH_HLEN);
+        }
+        if (buf != stack_buf) {
+            g_free(buf);
+        }
         return 1;
     }
 }
@@ -1069,6 +1104,7 @@ static int slirp_socket_load(QEMUFile *f, struct socket *so)
     so->so_laddr.s_addr = qemu_get_be32(f);
     so->so_fport = qemu_get_be16(f);
     so->so_lport = qemu_get_be16(f);
+    sohash_tcp(so);
     so->so_iptos = qemu_get_byte(f);
     so->so_emu = qemu_get_byte(f);
     so->so_type = qemu_get_byte(f);
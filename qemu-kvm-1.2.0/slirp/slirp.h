@@ -215,12 +215,16 @@ struct Slirp {
     char client_hostname[33];
 
     int restricted;
+    bool csum_offload;      /* guest completes TCP checksums */
+    bool tso_offload;       /* guest segments large TCP frames */
     struct timeval tt;
     struct ex_list *exec_list;
 
     /* mbuf states */
     struct mbuf m_freelist, m_usedlist;
     int mbuf_alloced;
+    char *m_ext_cache[MBUF_EXT_CACHE];  /* free SLIRP_MEXT_SIZE buffers */
+    int m_ext_cached;
 
     /* if states */
     struct mbuf if_fastq;   /* fast queue (for interactive data) */
@@ -239,12 +243,14 @@ struct Slirp {
     /* tcp states */
     struct socket tcb;
     struct socket *tcp_last_so;
+    struct socket *tcb_hash[SO_HASH_SIZE];  /* by guest and peer address */
     tcp_seq tcp_iss;        /* tcp initial send seq # */
     uint32_t tcp_now;       /* for RFC 1323 timestamps */
 
     /* udp states */
     struct socket udb;
     struct socket *udp_last_so;
+    struct socket *udb_hash[SO_HASH_SIZE];  /* by guest address */
 
     /* icmp states */
     struct socket icmp;
@@ -86,7 +86,9 @@
 //#undef HOST_WORDS_BIGENDIAN
 
 /* Define if you have readv */
-#undef HAVE_READV
+#ifndef _WIN32
+#define HAVE_READV
+#endif
 
 /* Define if iovec needs to be declared */
 #undef DECLARE_IOVEC
@@ -15,24 +15,91 @@
 static void sofcantrcvmore(struct socket *so);
 static void sofcantsendmore(struct socket *so);
 
+static unsigned int
+sohash(uint32_t laddr, uint16_t lport, uint32_t faddr, uint16_t fport)
+{
+	uint32_t h = laddr ^ faddr ^ ((uint32_t)lport << 16 | fport);
+
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+	return h & (SO_HASH_SIZE - 1);
+}
+
+static void
+sohash_insert(struct socket **bucket, struct socket *so)
+{
+	sounhash(so);
+	so->so_hash_next = *bucket;
+	if (*bucket)
+	   (*bucket)->so_hash_pprev = &so->so_hash_next;
+	so->so_hash_pprev = bucket;
+	*bucket = so;
+}
+
+/*
+ * (Re)hash a socket on slirp->tcb after its addresses or ports were set
+ */
+void
+sohash_tcp(struct socket *so)
+{
+	sohash_insert(&so->slirp->tcb_hash[sohash(so->so_laddr.s_addr,
+						  so->so_lport,
+						  so->so_faddr.s_addr,
+						  so->so_fport)], so);
+}
+
+/*
+ * Likewise for slirp->udb, where only the guest side identifies a socket
+ */
+void
+sohash_udp(struct socket *so)
+{
+	sohash_insert(&so->slirp->udb_hash[sohash(so->so_laddr.s_addr,
+						  so->so_lport, 0, 0)], so);
+}
+
+void
+sounhash(struct socket *so)
+{
+	if (!so->so_hash_pprev)
+	   return;
+	*so->so_hash_pprev = so->so_hash_next;
+	if (so->so_hash_next)
+	   so->so_hash_next->so_hash_pprev = so->so_hash_pprev;
+	so->so_hash_next = NULL;
+	so->so_hash_pprev = NULL;
+}
+
 struct socket *
-solookup(struct socket *head, struct in_addr laddr, u_int lport,
+solookup(Slirp *slirp, struct in_addr laddr, u_int lport,
          struct in_addr faddr, u_int fport)
 {
 	struct socket *so;
 
-	for (so = head->so_next; so != head; so = so->so_next) {
+	so = slirp->tcb_hash[sohash(laddr.s_addr, lport, faddr.s_addr, fport)];
+	for (; so; so = so->so_hash_next) {
 		if (so->so_lport == lport &&
 		    so->so_laddr.s_addr == laddr.s_addr &&
 		    so->so_faddr.s_addr == faddr.s_addr &&
 		    so->so_fport == fport)
 		   break;
 	}
-
-	if (so == head)
-	   return (struct socket *)NULL;
 	return so;
+}
+
+struct socket *
+udp_solookup(Slirp *slirp, struct in_addr laddr, u_int lport)
+{
+	struct socket *so;
 
+	so = slirp->udb_hash[sohash(laddr.s_addr, lport, 0, 0)];
+	for (; so; so = so->so_hash_next) {
+		if (so->so_lport == lport &&
+		    so->so_laddr.s_addr == laddr.s_addr)
+		   break;
+	}
+	return so;
 }
 
 /*
@@ -76,6 +143,7 @@ sofree(struct socket *so)
   }
   m_free(so->so_m);
 
+  sounhash(so);
   if(so->so_next && so->so_prev)
     remque(so);  /* crashes if so is not in a queue */
 
@@ -346,7 +414,6 @@ sowrite(struct socket *so)
 {
 	int  n,nn;
 	struct sbuf *sb = &so->so_rcv;
-	int len = sb->sb_cc;
 	struct iovec iov[2];
 
 	DEBUG_CALL("sowrite");
@@ -363,26 +430,7 @@ sowrite(struct socket *so)
 	 * sowrite wouldn't have been called otherwise
 	 */
 
-	iov[0].iov_base = sb->sb_rptr;
-        iov[1].iov_base = NULL;
-        iov[1].iov_len = 0;
-	if (sb->sb_rptr < sb->sb_wptr) {
-		iov[0].iov_len = sb->sb_wptr - sb->sb_rptr;
-		/* Should never succeed, but... */
-		if (iov[0].iov_len > len) iov[0].iov_len = len;
-		n = 1;
-	} else {
-		iov[0].iov_len = (sb->sb_data + sb->sb_datalen) - sb->sb_rptr;
-		if (iov[0].iov_len > len) iov[0].iov_len = len;
-		len -= iov[0].iov_len;
-		if (len) {
-			iov[1].iov_base = sb->sb_data;
-			iov[1].iov_len = sb->sb_wptr - sb->sb_data;
-			if (iov[1].iov_len > len) iov[1].iov_len = len;
-			n = 2;
-		} else
-			n = 1;
-	}
+	n = sbiov(sb, iov);
 	/* Check if there's urgent data to send, and if so, send it */
 
 #ifdef HAVE_READV
@@ -649,6 +697,7 @@ tcp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 	   so->so_faddr = slirp->vhost_addr;
 	else
 	   so->so_faddr = addr.sin_addr;
+	sohash_tcp(so);
 
 	so->s = s;
 	return so;
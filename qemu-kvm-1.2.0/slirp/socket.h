@@ -11,12 +11,17 @@
 #define SO_EXPIRE 240000
 #define SO_EXPIREFAST 10000
 
+/* Buckets in the TCP and UDP socket hash tables, a power of two */
+#define SO_HASH_SIZE 1024
+
 /*
  * Our socket structure
  */
 
 struct socket {
   struct socket *so_next,*so_prev;      /* For a linked list of sockets */
+  struct socket *so_hash_next;          /* Hash chain for lookups */
+  struct socket **so_hash_pprev;        /* NULL if not hashed */
 
   int s;                           /* The actual socket */
 
@@ -74,7 +79,11 @@ struct socket {
 #define SS_HOSTFWD		0x1000	/* Socket describes host->guest forwarding */
 #define SS_INCOMING		0x2000	/* Connection was initiated by a host on the internet */
 
-struct socket * solookup(struct socket *, struct in_addr, u_int, struct in_addr, u_int);
+struct socket * solookup(Slirp *, struct in_addr, u_int, struct in_addr, u_int);
+struct socket * udp_solookup(Slirp *, struct in_addr, u_int);
+void sohash_tcp(struct socket *);
+void sohash_udp(struct socket *);
+void sounhash(struct socket *);
 struct socket * socreate(Slirp *);
 void sofree(struct socket *);
 int soread(struct socket *);
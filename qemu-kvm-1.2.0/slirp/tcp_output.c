@@ -50,6 +50,9 @@ static const u_char  tcp_outflags[TCP_NSTATES] = {
 #undef MAX_TCPOPTLEN
 #define MAX_TCPOPTLEN	32	/* max # bytes that go in options */
 
+/* Largest segment handed to a guest that does TCP segmentation offload */
+#define TCP_TSO_MAXSEG	(IP_MAXPACKET - sizeof(struct tcpiphdr) - MAX_TCPOPTLEN)
+
 /*
  * Tcp output routine: figure out what should be sent and send it.
  */
@@ -64,6 +67,7 @@ tcp_output(struct tcpcb *tp)
 	u_char opt[MAX_TCPOPTLEN];
 	unsigned optlen, hdrlen;
 	int idle, sendalot;
+	long maxseg;
 
 	DEBUG_CALL("tcp_output");
 	DEBUG_ARG("tp = %lx", (long )tp);
@@ -144,8 +148,13 @@ again:
 		}
 	}
 
-	if (len > tp->t_maxseg) {
-		len = tp->t_maxseg;
+	/*
+	 * A guest doing TSO gets everything that fits the window in one
+	 * frame and cuts it into t_maxseg sized segments itself.
+	 */
+	maxseg = so->slirp->tso_offload ? TCP_TSO_MAXSEG : tp->t_maxseg;
+	if (len > maxseg) {
+		len = maxseg;
 		sendalot = 1;
 	}
 	if (SEQ_LT(tp->snd_nxt + len, tp->snd_una + so->so_snd.sb_cc))
@@ -164,7 +173,7 @@ again:
 	 * to send into a small window), then must resend.
 	 */
 	if (len) {
-		if (len == tp->t_maxseg)
+		if (len >= tp->t_maxseg)
 			goto send;
 		if ((1 || idle || tp->t_flags & TF_NODELAY) &&
 		    len + off >= so->so_snd.sb_cc)
@@ -280,8 +289,8 @@ send:
 	 * Adjust data length if insertion of options will
 	 * bump the packet length beyond the t_maxseg length.
 	 */
-	 if (len > tp->t_maxseg - optlen) {
-		len = tp->t_maxseg - optlen;
+	 if (len > maxseg - optlen) {
+		len = maxseg - optlen;
 		sendalot = 1;
 	 }
 
@@ -298,6 +307,12 @@ send:
 		}
 		m->m_data += IF_MAXLINKHDR;
 		m->m_len = hdrlen;
+		if (M_FREEROOM(m) < hdrlen + len) {
+			m_inc(m, IF_MAXLINKHDR + hdrlen + len);
+		}
+		if (len > tp->t_maxseg - optlen) {
+			m->gso_size = tp->t_maxseg - optlen;
+		}
 
 		sbcopy(&so->so_snd, off, (int) len, mtod(m, caddr_t) + hdrlen);
 		m->m_len += len;
@@ -386,7 +401,13 @@ send:
 	if (len + optlen)
 		ti->ti_len = htons((uint16_t)(sizeof (struct tcphdr) +
 		    optlen + len));
-	ti->ti_sum = cksum(m, (int)(hdrlen + len));
+	if (so->slirp->csum_offload) {
+		/* Leave the pseudo header sum for the guest to complete */
+		ti->ti_sum = ~cksum(m, sizeof(struct ipovly));
+		m->m_flags |= M_CSUM_PARTIAL;
+	} else {
+		ti->ti_sum = cksum(m, (int)(hdrlen + len));
+	}
 
 	/*
 	 * In transmit state, time the transmission and arrange for
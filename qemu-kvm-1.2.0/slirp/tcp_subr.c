@@ -440,6 +440,7 @@ tcp_connect(struct socket *inso)
             (loopback_addr.s_addr & loopback_mask)) {
             so->so_faddr = slirp->vhost_addr;
         }
+	sohash_tcp(so);
 
 	/* Close the accept() socket, set right state */
 	if (inso->so_state & SS_FACCEPTONCE) {
@@ -67,11 +67,12 @@ void qemu_system_reset(bool report);
 
 void qemu_add_exit_notifier(Notifier *notify);
 void qemu_remove_exit_notifier(Notifier *notify);
+void qemu_add_main_loop_exit_notifier(Notifier *notify);
 
 void qemu_add_machine_init_done_notifier(Notifier *notify);
 
 void do_savevm(Monitor *mon, const QDict *qdict);
-int load_vmstate(const char *name);
+int load_vmstate(const char *name, bool lazy);
 void do_delvm(Monitor *mon, const QDict *qdict);
 void do_info_snapshots(Monitor *mon);
 
@@ -82,6 +83,7 @@ int qemu_savevm_state_begin(QEMUFile *f,
                             const MigrationParams *params);
 int qemu_savevm_state_iterate(QEMUFile *f);
 int qemu_savevm_state_complete(QEMUFile *f);
+uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size);
 void qemu_savevm_state_cancel(QEMUFile *f);
 int qemu_loadvm_state(QEMUFile *f);
 
@@ -140,6 +142,20 @@ extern int nb_numa_nodes;
 extern uint64_t node_mem[MAX_NODES];
 extern unsigned long *node_cpumask[MAX_NODES];
 
+/* Host NUMA placement of the guest RAM of each node, see -numa hostnodes */
+#define MAX_HOST_NODES 128
+enum {
+    NUMA_POLICY_BIND,
+    NUMA_POLICY_PREFERRED,
+    NUMA_POLICY_INTERLEAVE,
+};
+extern unsigned long *node_host_nodes[MAX_NODES];
+extern int node_policy[MAX_NODES];
+
+/* cpus.c */
+#define MAX_HOST_CPUS 1024
+void numa_get_host_node_cpus(const unsigned long *nodes, unsigned long *cpus);
+
 #define MAX_OPTION_ROMS 16
 typedef struct QEMUOptionRom {
     const char *name;
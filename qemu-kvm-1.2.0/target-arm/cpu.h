@@ -32,6 +32,7 @@
 #include "softfloat.h"
 
 #define TARGET_HAS_ICE 1
+#define TARGET_SUPPORTS_MTTCG 1
 
 #define EXCP_UDEF            1   /* undefined instruction */
 #define EXCP_SWI             2   /* software interrupt */
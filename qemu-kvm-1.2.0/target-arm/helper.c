@@ -96,11 +96,38 @@ static int contextidr_write(CPUARMState *env, const ARMCPRegInfo *ri,
     return 0;
 }
 
+/* The inner-shareable variants (crm == 3) also apply to the TLBs of the
+ * other cores; that only matters when they run in parallel (MTTCG), and
+ * then we just flush them completely.  The operation only completes once
+ * the other cores are done with it, so that a DSB after it really orders
+ * the flush before later accesses.
+ */
+static void tlbi_broadcast(CPUARMState *env, const ARMCPRegInfo *ri)
+{
+    CPUARMState *other;
+
+    if (ri->crm != 3) {
+        return;
+    }
+#if !defined(CONFIG_USER_ONLY)
+    if (mttcg_enabled) {
+        qemu_tcg_tlb_flush_others(env);
+        return;
+    }
+#endif
+    for (other = first_cpu; other != NULL; other = other->next_cpu) {
+        if (other != env) {
+            tlb_flush_request(other);
+        }
+    }
+}
+
 static int tlbiall_write(CPUARMState *env, const ARMCPRegInfo *ri,
                          uint64_t value)
 {
     /* Invalidate all (TLBIALL) */
     tlb_flush(env, 1);
+    tlbi_broadcast(env, ri);
     return 0;
 }
 
@@ -109,6 +136,7 @@ static int tlbimva_write(CPUARMState *env, const ARMCPRegInfo *ri,
 {
     /* Invalidate single TLB entry by MVA and ASID (TLBIMVA) */
     tlb_flush_page(env, value & TARGET_PAGE_MASK);
+    tlbi_broadcast(env, ri);
     return 0;
 }
 
@@ -117,6 +145,7 @@ static int tlbiasid_write(CPUARMState *env, const ARMCPRegInfo *ri,
 {
     /* Invalidate by ASID (TLBIASID) */
     tlb_flush(env, value == 0);
+    tlbi_broadcast(env, ri);
     return 0;
 }
 
@@ -125,6 +154,7 @@ static int tlbimvaa_write(CPUARMState *env, const ARMCPRegInfo *ri,
 {
     /* Invalidate single entry by MVA, all ASIDs (TLBIMVAA) */
     tlb_flush_page(env, value & TARGET_PAGE_MASK);
+    tlbi_broadcast(env, ri);
     return 0;
 }
 
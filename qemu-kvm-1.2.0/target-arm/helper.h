@@ -52,25 +52,31 @@ DEF_HELPER_1(logicq_cc, i32, i64)
 DEF_HELPER_3(sel_flags, i32, i32, i32, i32)
 DEF_HELPER_1(exception, void, i32)
 DEF_HELPER_0(wfi, void)
+#if !defined(CONFIG_USER_ONLY)
+DEF_HELPER_0(exclusive_lock, void)
+DEF_HELPER_0(exclusive_unlock, void)
+#endif
+
+DEF_HELPER_FLAGS_1(lookup_tb_ptr, TCG_CALL_NO_WRITE_GLOBALS, ptr, env)
 
 DEF_HELPER_2(cpsr_write, void, i32, i32)
-DEF_HELPER_0(cpsr_read, i32)
+DEF_HELPER_FLAGS_0(cpsr_read, TCG_CALL_NO_WRITE_GLOBALS, i32)
 
 DEF_HELPER_3(v7m_msr, void, env, i32, i32)
-DEF_HELPER_2(v7m_mrs, i32, env, i32)
+DEF_HELPER_FLAGS_2(v7m_mrs, TCG_CALL_NO_WRITE_GLOBALS, i32, env, i32)
 
 DEF_HELPER_3(set_cp_reg, void, env, ptr, i32)
-DEF_HELPER_2(get_cp_reg, i32, env, ptr)
+DEF_HELPER_FLAGS_2(get_cp_reg, TCG_CALL_NO_WRITE_GLOBALS, i32, env, ptr)
 DEF_HELPER_3(set_cp_reg64, void, env, ptr, i64)
-DEF_HELPER_2(get_cp_reg64, i64, env, ptr)
+DEF_HELPER_FLAGS_2(get_cp_reg64, TCG_CALL_NO_WRITE_GLOBALS, i64, env, ptr)
 
-DEF_HELPER_2(get_r13_banked, i32, env, i32)
+DEF_HELPER_FLAGS_2(get_r13_banked, TCG_CALL_NO_WRITE_GLOBALS, i32, env, i32)
 DEF_HELPER_3(set_r13_banked, void, env, i32, i32)
 
-DEF_HELPER_1(get_user_reg, i32, i32)
+DEF_HELPER_FLAGS_1(get_user_reg, TCG_CALL_NO_WRITE_GLOBALS, i32, i32)
 DEF_HELPER_2(set_user_reg, void, i32, i32)
 
-DEF_HELPER_1(vfp_get_fpscr, i32, env)
+DEF_HELPER_FLAGS_1(vfp_get_fpscr, TCG_CALL_NO_WRITE_GLOBALS, i32, env)
 DEF_HELPER_2(vfp_set_fpscr, void, env, i32)
 
 DEF_HELPER_3(vfp_adds, f32, f32, f32, ptr)
@@ -270,12 +276,8 @@ DEF_HELPER_3(neon_qrshl_s32, i32, env, i32, i32)
 DEF_HELPER_3(neon_qrshl_u64, i64, env, i64, i64)
 DEF_HELPER_3(neon_qrshl_s64, i64, env, i64, i64)
 
-DEF_HELPER_2(neon_add_u8, i32, i32, i32)
-DEF_HELPER_2(neon_add_u16, i32, i32, i32)
 DEF_HELPER_2(neon_padd_u8, i32, i32, i32)
 DEF_HELPER_2(neon_padd_u16, i32, i32, i32)
-DEF_HELPER_2(neon_sub_u8, i32, i32, i32)
-DEF_HELPER_2(neon_sub_u16, i32, i32, i32)
 DEF_HELPER_2(neon_mul_u8, i32, i32, i32)
 DEF_HELPER_2(neon_mul_u16, i32, i32, i32)
 DEF_HELPER_2(neon_mul_p8, i32, i32, i32)
@@ -322,12 +324,8 @@ DEF_HELPER_1(neon_widen_s8, i64, i32)
 DEF_HELPER_1(neon_widen_u16, i64, i32)
 DEF_HELPER_1(neon_widen_s16, i64, i32)
 
-DEF_HELPER_2(neon_addl_u16, i64, i64, i64)
-DEF_HELPER_2(neon_addl_u32, i64, i64, i64)
 DEF_HELPER_2(neon_paddl_u16, i64, i64, i64)
 DEF_HELPER_2(neon_paddl_u32, i64, i64, i64)
-DEF_HELPER_2(neon_subl_u16, i64, i64, i64)
-DEF_HELPER_2(neon_subl_u32, i64, i64, i64)
 DEF_HELPER_3(neon_addl_saturate_s32, i64, env, i64, i64)
 DEF_HELPER_3(neon_addl_saturate_s64, i64, env, i64, i64)
 DEF_HELPER_2(neon_abdl_u16, i64, i32, i32)
@@ -82,7 +82,10 @@ void tlb_fill(CPUARMState *env1, target_ulong addr, int is_write, int mmu_idx,
 
     saved_env = env;
     env = env1;
+    /* the page table walk reads guest memory through phys_map */
+    phys_map_lock();
     ret = cpu_arm_handle_mmu_fault(env, addr, is_write, mmu_idx);
+    phys_map_unlock();
     if (unlikely(ret)) {
         if (retaddr) {
             /* now we have a real cpu fault */
@@ -97,6 +100,18 @@ void tlb_fill(CPUARMState *env1, target_ulong addr, int is_write, int mmu_idx,
     }
     env = saved_env;
 }
+
+/* Serialize store-exclusive and SWP between MTTCG vCPU threads.  A fault
+   inside the locked region is unwound by cpu_exec().  */
+void HELPER(exclusive_lock)(void)
+{
+    qemu_tcg_atomic_lock();
+}
+
+void HELPER(exclusive_unlock)(void)
+{
+    qemu_tcg_atomic_unlock();
+}
 #endif
 
 /* FIXME: Pass an explicit pointer to QF to CPUARMState, and move saturating
@@ -243,6 +258,11 @@ void HELPER(exception)(uint32_t excp)
     cpu_loop_exit(env);
 }
 
+void *HELPER(lookup_tb_ptr)(CPUARMState *env)
+{
+    return tb_lookup_tc_ptr(env);
+}
+
 uint32_t HELPER(cpsr_read)(void)
 {
     return cpsr_read(env) & ~CPSR_EXEC;
@@ -3325,6 +3325,20 @@ static int disas_vfp_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
     return 0;
 }
 
+/* Jump to the TB for the current CPU state without going back to
+   cpu_exec() if it has already been translated.  */
+static inline void gen_lookup_and_goto_ptr(DisasContext *s)
+{
+    if (TCG_TARGET_HAS_goto_ptr) {
+        TCGv_ptr ptr = tcg_temp_new_ptr();
+        gen_helper_lookup_tb_ptr(ptr, cpu_env);
+        tcg_gen_goto_ptr(ptr);
+        tcg_temp_free_ptr(ptr);
+    } else {
+        tcg_gen_exit_tb(0);
+    }
+}
+
 static inline void gen_goto_tb(DisasContext *s, int n, uint32_t dest)
 {
     TranslationBlock *tb;
@@ -3336,7 +3350,7 @@ static inline void gen_goto_tb(DisasContext *s, int n, uint32_t dest)
         tcg_gen_exit_tb((tcg_target_long)tb + n);
     } else {
         gen_set_pc_im(dest);
-        tcg_gen_exit_tb(0);
+        gen_lookup_and_goto_ptr(s);
     }
 }
 
@@ -3489,8 +3503,8 @@ static void gen_nop_hint(DisasContext *s, int val)
 static inline void gen_neon_add(int size, TCGv t0, TCGv t1)
 {
     switch (size) {
-    case 0: gen_helper_neon_add_u8(t0, t0, t1); break;
-    case 1: gen_helper_neon_add_u16(t0, t0, t1); break;
+    case 0: tcg_gen_vec_add8_i32(t0, t0, t1); break;
+    case 1: tcg_gen_vec_add16_i32(t0, t0, t1); break;
     case 2: tcg_gen_add_i32(t0, t0, t1); break;
     default: abort();
     }
@@ -3499,8 +3513,8 @@ static inline void gen_neon_add(int size, TCGv t0, TCGv t1)
 static inline void gen_neon_rsb(int size, TCGv t0, TCGv t1)
 {
     switch (size) {
-    case 0: gen_helper_neon_sub_u8(t0, t1, t0); break;
-    case 1: gen_helper_neon_sub_u16(t0, t1, t0); break;
+    case 0: tcg_gen_vec_sub8_i32(t0, t1, t0); break;
+    case 1: tcg_gen_vec_sub16_i32(t0, t1, t0); break;
     case 2: tcg_gen_sub_i32(t0, t1, t0); break;
     default: return;
     }
@@ -4138,8 +4152,8 @@ static inline void gen_neon_widen(TCGv_i64 dest, TCGv src, int size, int u)
 static inline void gen_neon_addl(int size)
 {
     switch (size) {
-    case 0: gen_helper_neon_addl_u16(CPU_V001); break;
-    case 1: gen_helper_neon_addl_u32(CPU_V001); break;
+    case 0: tcg_gen_vec_add16_i64(CPU_V001); break;
+    case 1: tcg_gen_vec_add32_i64(CPU_V001); break;
     case 2: tcg_gen_add_i64(CPU_V001); break;
     default: abort();
     }
@@ -4148,8 +4162,8 @@ static inline void gen_neon_addl(int size)
 static inline void gen_neon_subl(int size)
 {
     switch (size) {
-    case 0: gen_helper_neon_subl_u16(CPU_V001); break;
-    case 1: gen_helper_neon_subl_u32(CPU_V001); break;
+    case 0: tcg_gen_vec_sub16_i64(CPU_V001); break;
+    case 1: tcg_gen_vec_sub32_i64(CPU_V001); break;
     case 2: tcg_gen_sub_i64(CPU_V001); break;
     default: abort();
     }
@@ -4678,8 +4692,8 @@ static int disas_neon_data_insn(CPUARMState * env, DisasContext *s, uint32_t ins
                 gen_neon_add(size, tmp, tmp2);
             } else { /* VSUB */
                 switch (size) {
-                case 0: gen_helper_neon_sub_u8(tmp, tmp, tmp2); break;
-                case 1: gen_helper_neon_sub_u16(tmp, tmp, tmp2); break;
+                case 0: tcg_gen_vec_sub8_i32(tmp, tmp, tmp2); break;
+                case 1: tcg_gen_vec_sub16_i32(tmp, tmp, tmp2); break;
                 case 2: tcg_gen_sub_i32(tmp, tmp, tmp2); break;
                 default: abort();
                 }
@@ -6168,6 +6182,15 @@ static int disas_neon_data_insn(CPUARMState * env, DisasContext *s, uint32_t ins
     return 0;
 }
 
+/* Pass a coprocessor register description to a helper.  The pointer is
+   only valid in this process, so the TB cannot be saved to the persistent
+   translation cache.  */
+static TCGv_ptr gen_cp_reginfo_ptr(const ARMCPRegInfo *ri)
+{
+    tb_gen_uncacheable = 1;
+    return tcg_const_ptr(ri);
+}
+
 static int disas_coproc_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
 {
     int cpnum, is64, crn, crm, opc1, opc2, isread, rt, rt2;
@@ -6252,7 +6275,7 @@ static int disas_coproc_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
                     TCGv_ptr tmpptr;
                     gen_set_pc_im(s->pc);
                     tmp64 = tcg_temp_new_i64();
-                    tmpptr = tcg_const_ptr(ri);
+                    tmpptr = gen_cp_reginfo_ptr(ri);
                     gen_helper_get_cp_reg64(tmp64, cpu_env, tmpptr);
                     tcg_temp_free_ptr(tmpptr);
                 } else {
@@ -6275,7 +6298,7 @@ static int disas_coproc_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
                     TCGv_ptr tmpptr;
                     gen_set_pc_im(s->pc);
                     tmp = tcg_temp_new_i32();
-                    tmpptr = tcg_const_ptr(ri);
+                    tmpptr = gen_cp_reginfo_ptr(ri);
                     gen_helper_get_cp_reg(tmp, cpu_env, tmpptr);
                     tcg_temp_free_ptr(tmpptr);
                 } else {
@@ -6307,7 +6330,7 @@ static int disas_coproc_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
                 tcg_temp_free_i32(tmplo);
                 tcg_temp_free_i32(tmphi);
                 if (ri->writefn) {
-                    TCGv_ptr tmpptr = tcg_const_ptr(ri);
+                    TCGv_ptr tmpptr = gen_cp_reginfo_ptr(ri);
                     gen_set_pc_im(s->pc);
                     gen_helper_set_cp_reg64(cpu_env, tmpptr, tmp64);
                     tcg_temp_free_ptr(tmpptr);
@@ -6321,7 +6344,7 @@ static int disas_coproc_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
                     TCGv_ptr tmpptr;
                     gen_set_pc_im(s->pc);
                     tmp = load_reg(s, rt);
-                    tmpptr = tcg_const_ptr(ri);
+                    tmpptr = gen_cp_reginfo_ptr(ri);
                     gen_helper_set_cp_reg(cpu_env, tmpptr, tmp);
                     tcg_temp_free_ptr(tmpptr);
                     tcg_temp_free_i32(tmp);
@@ -6407,8 +6430,11 @@ static void gen_logicq_cc(TCGv_i64 val)
    regular stores.
 
    In system emulation mode only one CPU will be running at once, so
-   this sequence is effectively atomic.  In user emulation mode we
-   throw an exception and handle the atomic operation elsewhere.  */
+   this sequence is effectively atomic.  With multi-threaded TCG the
+   store-exclusive is done under a lock shared by all vCPUs, which makes
+   it atomic against other store-exclusives and SWPs but not against
+   plain stores.  In user emulation mode we throw an exception and handle
+   the atomic operation elsewhere.  */
 static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
                                TCGv addr, int size)
 {
@@ -6471,6 +6497,9 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
        } */
     fail_label = gen_new_label();
     done_label = gen_new_label();
+    if (mttcg_enabled) {
+        gen_helper_exclusive_lock();
+    }
     tcg_gen_brcond_i32(TCG_COND_NE, addr, cpu_exclusive_addr, fail_label);
     switch (size) {
     case 0:
@@ -6521,6 +6550,9 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     gen_set_label(fail_label);
     tcg_gen_movi_i32(cpu_R[rd], 1);
     gen_set_label(done_label);
+    if (mttcg_enabled) {
+        gen_helper_exclusive_unlock();
+    }
     tcg_gen_movi_i32(cpu_exclusive_addr, -1);
 }
 #endif
@@ -7248,9 +7280,15 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
 
                         /* ??? This is not really atomic.  However we know
                            we never have multiple CPUs running in parallel,
-                           so it is good enough.  */
+                           so it is good enough.  Multi-threaded TCG takes
+                           the store-exclusive lock instead.  */
                         addr = load_reg(s, rn);
                         tmp = load_reg(s, rm);
+#ifndef CONFIG_USER_ONLY
+                        if (mttcg_enabled) {
+                            gen_helper_exclusive_lock();
+                        }
+#endif
                         if (insn & (1 << 22)) {
                             tmp2 = gen_ld8u(addr, IS_USER(s));
                             gen_st8(tmp, addr, IS_USER(s));
@@ -7258,6 +7296,11 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
                             tmp2 = gen_ld32(addr, IS_USER(s));
                             gen_st32(tmp, addr, IS_USER(s));
                         }
+#ifndef CONFIG_USER_ONLY
+                        if (mttcg_enabled) {
+                            gen_helper_exclusive_unlock();
+                        }
+#endif
                         tcg_temp_free_i32(addr);
                         store_reg(s, rd, tmp2);
                     }
@@ -9903,8 +9946,11 @@ static inline void gen_intermediate_code_internal(CPUARMState *env,
         case DISAS_NEXT:
             gen_goto_tb(dc, 1, dc->pc);
             break;
-        default:
         case DISAS_JUMP:
+            /* look the next TB up without leaving the generated code */
+            gen_lookup_and_goto_ptr(dc);
+            break;
+        default:
         case DISAS_UPDATE:
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
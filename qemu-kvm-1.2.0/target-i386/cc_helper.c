@@ -85,7 +85,7 @@ static int compute_c_eflags(CPUX86State *env)
     return CC_SRC & CC_C;
 }
 
-uint32_t helper_cc_compute_all(CPUX86State *env, int op)
+static uint32_t cc_compute_all(CPUX86State *env, int op)
 {
     switch (op) {
     default: /* should never happen */
@@ -198,12 +198,22 @@ uint32_t helper_cc_compute_all(CPUX86State *env, int op)
     }
 }
 
+/* The helpers are only called when the translator could not derive the
+   flags inline; count them per CC_OP for "info cpustats". */
+uint32_t helper_cc_compute_all(CPUX86State *env, int op)
+{
+    if ((unsigned)op < CC_OP_NB) {
+        env->cc_compute_all_count[op]++;
+    }
+    return cc_compute_all(env, op);
+}
+
 uint32_t cpu_cc_compute_all(CPUX86State *env, int op)
 {
-    return helper_cc_compute_all(env, op);
+    return cc_compute_all(env, op);
 }
 
-uint32_t helper_cc_compute_c(CPUX86State *env, int op)
+static uint32_t cc_compute_c(CPUX86State *env, int op)
 {
     switch (op) {
     default: /* should never happen */
@@ -316,6 +326,14 @@ uint32_t helper_cc_compute_c(CPUX86State *env, int op)
     }
 }
 
+uint32_t helper_cc_compute_c(CPUX86State *env, int op)
+{
+    if ((unsigned)op < CC_OP_NB) {
+        env->cc_compute_c_count[op]++;
+    }
+    return cc_compute_c(env, op);
+}
+
 void helper_write_eflags(CPUX86State *env, target_ulong t0,
                          uint32_t update_mask)
 {
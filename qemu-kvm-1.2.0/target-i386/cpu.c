@@ -1378,6 +1378,23 @@ void cpu_x86_cpuid(CPUX86State *env, uint32_t index, uint32_t count,
                    uint32_t *eax, uint32_t *ebx,
                    uint32_t *ecx, uint32_t *edx)
 {
+    /* KVM sets up its paravirtual leaves itself, TCG only offers PV EOI */
+    if ((index == CPUID_PV_SIGNATURE || index == CPUID_PV_FEATURES) &&
+        !kvm_enabled() && (env->cpuid_kvm_features & CPUID_PV_FEATURE_EOI)) {
+        if (index == CPUID_PV_SIGNATURE) {
+            *eax = 0;
+            *ebx = 0x4b4d564b; /* "KVMKVMKVM\0\0\0" */
+            *ecx = 0x564b4d56;
+            *edx = 0x0000004d;
+        } else {
+            *eax = CPUID_PV_FEATURE_EOI;
+            *ebx = 0;
+            *ecx = 0;
+            *edx = 0;
+        }
+        return;
+    }
+
     /* test if maximum index reached */
     if (index & 0x80000000) {
         if (index > env->cpuid_xlevel) {
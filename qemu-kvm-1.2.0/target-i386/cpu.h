@@ -173,6 +173,11 @@
 #define HF_SVMI_MASK         (1 << HF_SVMI_SHIFT)
 #define HF_OSFXSR_MASK       (1 << HF_OSFXSR_SHIFT)
 
+/* The TB flags also hold the cc_op the block is entered with, above the
+   hflags; it is translated assuming that cc_op */
+#define TB_FLAGS_CC_OP_SHIFT 24
+#define TB_FLAGS_CC_OP_MASK  (0x3f << TB_FLAGS_CC_OP_SHIFT)
+
 /* hflags2 */
 
 #define HF2_GIF_SHIFT        0 /* if set CPU takes interrupts */
@@ -349,6 +354,13 @@
 
 #define MSR_VM_HSAVE_PA                 0xc0010117
 
+/* KVM's paravirtual EOI, which TCG implements as well */
+#define MSR_PV_EOI_EN                   0x4b564d04
+#define MSR_PV_EOI_ENABLED              (1ULL << 0)
+#define CPUID_PV_SIGNATURE              0x40000000
+#define CPUID_PV_FEATURES               0x40000001
+#define CPUID_PV_FEATURE_EOI            (1U << 6)
+
 /* cpuid_features bits */
 #define CPUID_FP87 (1 << 0)
 #define CPUID_VME  (1 << 1)
@@ -617,6 +629,17 @@ typedef struct {
 
 #define NB_MMU_MODES 2
 
+/* KVM register groups, see cpu_synchronize_groups() */
+#define KVM_REGS_GPR            (1U << 0)   /* GPRs, eflags, eip */
+#define KVM_REGS_FPU            (1U << 1)   /* FPU/SSE/AVX state */
+#define KVM_REGS_XCRS           (1U << 2)
+#define KVM_REGS_SREGS          (1U << 3)   /* segments, CRs, efer */
+#define KVM_REGS_MSRS           (1U << 4)
+#define KVM_REGS_MP_STATE       (1U << 5)
+#define KVM_REGS_LAPIC          (1U << 6)
+#define KVM_REGS_EVENTS         (1U << 7)   /* pending exception/irq/nmi */
+#define KVM_REGS_DEBUG          (1U << 8)
+
 typedef enum TPRAccess {
     TPR_ACCESS_READ,
     TPR_ACCESS_WRITE,
@@ -725,6 +748,10 @@ typedef struct CPUX86State {
 
     CPU_COMMON
 
+    /* calls of the lazy flags helpers, per CC_OP; not reset */
+    uint64_t cc_compute_all_count[CC_OP_NB];
+    uint64_t cc_compute_c_count[CC_OP_NB];
+
     uint64_t pat;
 
     /* processor features (e.g. for CPUID insn) */
@@ -764,6 +791,7 @@ typedef struct CPUX86State {
     bool tsc_valid;
     int tsc_khz;
     void *kvm_xsave_buf;
+    void *kvm_reg_snapshot;
 
     /* in order to simplify APIC support, we leave this pointer to the
        user */
@@ -1074,7 +1102,8 @@ static inline void cpu_get_tb_cpu_state(CPUX86State *env, target_ulong *pc,
     *cs_base = env->segs[R_CS].base;
     *pc = *cs_base + env->eip;
     *flags = env->hflags |
-        (env->eflags & (IOPL_MASK | TF_MASK | RF_MASK | VM_MASK));
+        (env->eflags & (IOPL_MASK | TF_MASK | RF_MASK | VM_MASK)) |
+        (env->cc_op << TB_FLAGS_CC_OP_SHIFT);
 }
 
 void do_cpu_init(X86CPU *cpu);
@@ -362,6 +362,24 @@ void cpu_dump_state(CPUX86State *env, FILE *f, fprintf_function cpu_fprintf,
     }
 }
 
+/* Show how often the generated code had to call out to compute the
+   flags, i.e. which CC_OP/condition pairs the translator misses. */
+void cpu_dump_statistics(CPUX86State *env, FILE *f, fprintf_function cpu_fprintf,
+                         int flags)
+{
+    int i;
+
+    cpu_fprintf(f, "%-8s %20s %20s\n", "CC_OP", "compute_all", "compute_c");
+    for (i = 0; i < CC_OP_NB; i++) {
+        if (env->cc_compute_all_count[i] == 0 &&
+            env->cc_compute_c_count[i] == 0) {
+            continue;
+        }
+        cpu_fprintf(f, "%-8s %20" PRIu64 " %20" PRIu64 "\n", cc_op_str[i],
+                    env->cc_compute_all_count[i], env->cc_compute_c_count[i]);
+    }
+}
+
 /***********************************************************/
 /* x86 mmu */
 /* XXX: add PGE support */
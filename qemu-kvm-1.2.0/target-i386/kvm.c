@@ -68,6 +68,29 @@ static bool has_msr_pv_eoi_en;
 static bool has_msr_misc_enable;
 static int lm_capable_kernel;
 
+typedef struct KVMMSRData {
+    struct kvm_msrs info;
+    struct kvm_msr_entry entries[100];
+} KVMMSRData;
+
+/*
+ * Register groups as last fetched from KVM, encoded the way the put
+ * functions would write them back.  A runtime writeback skips groups that
+ * were not fetched since the last put, and groups whose encoding still
+ * matches the snapshot.
+ */
+typedef struct KVMRegSnapshot {
+    unsigned int groups;
+    struct kvm_regs regs;
+    struct kvm_fpu fpu;
+    struct kvm_xsave xsave;
+    struct kvm_xcrs xcrs;
+    struct kvm_sregs sregs;
+    KVMMSRData msrs;
+    struct kvm_vcpu_events events;
+    struct kvm_debugregs dbgregs;
+} KVMRegSnapshot;
+
 bool kvm_allows_irq0_override(void)
 {
     return !kvm_irqchip_in_kernel() || kvm_has_gsi_routing();
@@ -406,6 +429,11 @@ int kvm_arch_init_vcpu(CPUX86State *env)
     c->function = KVM_CPUID_FEATURES;
     c->eax = env->cpuid_kvm_features &
         kvm_arch_get_supported_cpuid(s, KVM_CPUID_FEATURES, 0, R_EAX);
+    /* the kernel only does PV EOI in its own APIC, hw/apic.c cannot see
+       the MSR change under KVM */
+    if (!kvm_irqchip_in_kernel()) {
+        c->eax &= ~(1 << KVM_FEATURE_PV_EOI);
+    }
 
     if (hyperv_enabled()) {
         memcpy(signature, "Hv#1\0\0\0\0\0\0\0\0", 12);
@@ -588,6 +616,7 @@ int kvm_arch_init_vcpu(CPUX86State *env)
     if (kvm_has_xsave()) {
         env->kvm_xsave_buf = qemu_memalign(4096, sizeof(struct kvm_xsave));
     }
+    env->kvm_reg_snapshot = g_malloc0(sizeof(KVMRegSnapshot));
 
     return 0;
 }
@@ -785,16 +814,36 @@ static void kvm_getput_reg(__u64 *kvm_reg, target_ulong *qemu_reg, int set)
     }
 }
 
-static int kvm_getput_regs(CPUX86State *env, int set)
+static void kvm_snapshot_group(CPUX86State *env, unsigned int group)
+{
+    KVMRegSnapshot *snap = env->kvm_reg_snapshot;
+
+    snap->groups |= group;
+}
+
+static bool kvm_group_needs_put(CPUX86State *env, int level,
+                                unsigned int group, const void *snapshot,
+                                const void *data, size_t size)
+{
+    KVMRegSnapshot *snap = env->kvm_reg_snapshot;
+
+    if (level > KVM_PUT_RUNTIME_STATE) {
+        return true;
+    }
+    if (!(env->kvm_regs_valid & group)) {
+        return false;
+    }
+    return !(snap->groups & group) || memcmp(snapshot, data, size) != 0;
+}
+
+static void kvm_getput_regs(CPUX86State *env, struct kvm_regs *kregs, int set)
 {
     struct kvm_regs regs;
-    int ret = 0;
 
-    if (!set) {
-        ret = kvm_vcpu_ioctl(env, KVM_GET_REGS, &regs);
-        if (ret < 0) {
-            return ret;
-        }
+    if (set) {
+        memset(&regs, 0, sizeof(regs));
+    } else {
+        regs = *kregs;
     }
 
     kvm_getput_reg(&regs.rax, &env->regs[R_EAX], set);
@@ -820,13 +869,41 @@ static int kvm_getput_regs(CPUX86State *env, int set)
     kvm_getput_reg(&regs.rip, &env->eip, set);
 
     if (set) {
-        ret = kvm_vcpu_ioctl(env, KVM_SET_REGS, &regs);
+        *kregs = regs;
     }
+}
 
-    return ret;
+static int kvm_put_regs(CPUX86State *env, int level)
+{
+    KVMRegSnapshot *snap = env->kvm_reg_snapshot;
+    struct kvm_regs regs;
+
+    kvm_getput_regs(env, &regs, 1);
+    if (!kvm_group_needs_put(env, level, KVM_REGS_GPR, &snap->regs, &regs,
+                             sizeof(regs))) {
+        return 0;
+    }
+    return kvm_vcpu_ioctl(env, KVM_SET_REGS, &regs);
+}
+
+static int kvm_get_regs(CPUX86State *env)
+{
+    KVMRegSnapshot *snap = env->kvm_reg_snapshot;
+    struct kvm_regs regs;
+    int ret;
+
+    ret = kvm_vcpu_ioctl(env, KVM_GET_REGS, &regs);
+    if (ret < 0) {
+        return ret;
+    }
+    kvm_getput_regs(env, &regs, 0);
+
+    kvm_getput_regs(env, &snap->regs, 1);
+    kvm_snapshot_group(env, KVM_REGS_GPR);
+    return 0;
 }
 
-static int kvm_put_fpu(CPUX86State *env)
+static void kvm_fill_fpu(CPUX86State *env, struct kvm_fpu *kfpu)
 {
     struct kvm_fpu fpu;
     int i;
@@ -844,7 +921,19 @@ static int kvm_put_fpu(CPUX86State *env)
     memcpy(fpu.fpr, env->fpregs, sizeof env->fpregs);
     memcpy(fpu.xmm, env->xmm_regs, sizeof env->xmm_regs);
     fpu.mxcsr = env->mxcsr;
+    *kfpu = fpu;
+}
 
+static int kvm_put_fpu(CPUX86State *env, int level)
+{
+    KVMRegSnapshot *snap = env->kvm_reg_snapshot;
+    struct kvm_fpu fpu;
+
+    kvm_fill_fpu(env, &fpu);
+    if (!kvm_group_needs_put(env, level, KVM_REGS_FPU, &snap->fpu, &fpu,
+                             sizeof(fpu))) {
+        return 0;
+    }
     return kvm_vcpu_ioctl(env, KVM_SET_FPU, &fpu);
 }
 
@@ -858,15 +947,10 @@ static int kvm_put_fpu(CPUX86State *env)
 #define XSAVE_XSTATE_BV   128
 #define XSAVE_YMMH_SPACE  144
 
-static int kvm_put_xsave(CPUX86State *env)
+static void kvm_fill_xsave(CPUX86State *env, struct kvm_xsave *xsave)
 {
-    struct kvm_xsave* xsave = env->kvm_xsave_buf;
     uint16_t cwd, swd, twd;
-    int i, r;
-
-    if (!kvm_has_xsave()) {
-        return kvm_put_fpu(env);
-    }
+    int i;
 
     memset(xsave, 0, sizeof(struct kvm_xsave));
     twd = 0;
@@ -888,30 +972,56 @@ static int kvm_put_xsave(CPUX86State *env)
     *(uint64_t *)&xsave->region[XSAVE_XSTATE_BV] = env->xstate_bv;
     memcpy(&xsave->region[XSAVE_YMMH_SPACE], env->ymmh_regs,
             sizeof env->ymmh_regs);
-    r = kvm_vcpu_ioctl(env, KVM_SET_XSAVE, xsave);
-    return r;
 }
 
-static int kvm_put_xcrs(CPUX86State *env)
+static int kvm_put_xsave(CPUX86State *env, int level)
 {
+    KVMRegSnapshot *snap = env->kvm_reg_snapshot;
+    struct kvm_xsave* xsave = env->kvm_xsave_buf;
+
+    if (!kvm_has_xsave()) {
+        return kvm_put_fpu(env, level);
+    }
+
+    kvm_fill_xsave(env, xsave);
+    if (!kvm_group_needs_put(env, level, KVM_REGS_FPU, &snap->xsave, xsave,
+                             sizeof(*xsave))) {
+        return 0;
+    }
+    return kvm_vcpu_ioctl(env, KVM_SET_XSAVE, xsave);
+}
+
+static void kvm_fill_xcrs(CPUX86State *env, struct kvm_xcrs *xcrs)
+{
+    memset(xcrs, 0, sizeof(*xcrs));
+    xcrs->nr_xcrs = 1;
+    xcrs->flags = 0;
+    xcrs->xcrs[0].xcr = 0;
+    xcrs->xcrs[0].value = env->xcr0;
+}
+
+static int kvm_put_xcrs(CPUX86State *env, int level)
+{
+    KVMRegSnapshot *snap = env->kvm_reg_snapshot;
     struct kvm_xcrs xcrs;
 
     if (!kvm_has_xcrs()) {
         return 0;
     }
 
-    xcrs.nr_xcrs = 1;
-    xcrs.flags = 0;
-    xcrs.xcrs[0].xcr = 0;
-    xcrs.xcrs[0].value = env->xcr0;
+    kvm_fill_xcrs(env, &xcrs);
+    if (!kvm_group_needs_put(env, level, KVM_REGS_XCRS, &snap->xcrs, &xcrs,
+                             sizeof(xcrs))) {
+        return 0;
+    }
     return kvm_vcpu_ioctl(env, KVM_SET_XCRS, &xcrs);
 }
 
-static int kvm_put_sregs(CPUX86State *env)
+static void kvm_fill_sregs(CPUX86State *env, struct kvm_sregs *ksregs)
 {
     struct kvm_sregs sregs;
 
-    memset(sregs.interrupt_bitmap, 0, sizeof(sregs.interrupt_bitmap));
+    memset(&sregs, 0, sizeof(sregs));
     if (env->interrupt_injected >= 0) {
         sregs.interrupt_bitmap[env->interrupt_injected / 64] |=
                 (uint64_t)1 << (env->interrupt_injected % 64);
@@ -952,7 +1062,19 @@ static int kvm_put_sregs(CPUX86State *env)
     sregs.apic_base = cpu_get_apic_base(env->apic_state);
 
     sregs.efer = env->efer;
+    *ksregs = sregs;
+}
+
+static int kvm_put_sregs(CPUX86State *env, int level)
+{
+    KVMRegSnapshot *snap = env->kvm_reg_snapshot;
+    struct kvm_sregs sregs;
 
+    kvm_fill_sregs(env, &sregs);
+    if (!kvm_group_needs_put(env, level, KVM_REGS_SREGS, &snap->sregs,
+                             &sregs, sizeof(sregs))) {
+        return 0;
+    }
     return kvm_vcpu_ioctl(env, KVM_SET_SREGS, &sregs);
 }
 
@@ -963,15 +1085,12 @@ static void kvm_msr_entry_set(struct kvm_msr_entry *entry,
     entry->data = value;
 }
 
-static int kvm_put_msrs(CPUX86State *env, int level)
+static size_t kvm_fill_msrs(CPUX86State *env, int level, KVMMSRData *msr_data)
 {
-    struct {
-        struct kvm_msrs info;
-        struct kvm_msr_entry entries[100];
-    } msr_data;
-    struct kvm_msr_entry *msrs = msr_data.entries;
+    struct kvm_msr_entry *msrs = msr_data->entries;
     int n = 0;
 
+    memset(msr_data, 0, sizeof(*msr_data));
     kvm_msr_entry_set(&msrs[n++], MSR_IA32_SYSENTER_CS, env->sysenter_cs);
     kvm_msr_entry_set(&msrs[n++], MSR_IA32_SYSENTER_ESP, env->sysenter_esp);
     kvm_msr_entry_set(&msrs[n++], MSR_IA32_SYSENTER_EIP, env->sysenter_eip);
@@ -1043,15 +1162,29 @@ static int kvm_put_msrs(CPUX86State *env, int level)
         }
     }
 
-    msr_data.info.nmsrs = n;
+    msr_data->info.nmsrs = n;
 
-    return kvm_vcpu_ioctl(env, KVM_SET_MSRS, &msr_data);
+    return offsetof(KVMMSRData, entries) + n * sizeof(msrs[0]);
+}
 
+static int kvm_put_msrs(CPUX86State *env, int level)
+{
+    KVMRegSnapshot *snap = env->kvm_reg_snapshot;
+    KVMMSRData msr_data;
+    size_t size;
+
+    size = kvm_fill_msrs(env, level, &msr_data);
+    if (!kvm_group_needs_put(env, level, KVM_REGS_MSRS, &snap->msrs,
+                             &msr_data, size)) {
+        return 0;
+    }
+    return kvm_vcpu_ioctl(env, KVM_SET_MSRS, &msr_data);
 }
 
 
 static int kvm_get_fpu(CPUX86State *env)
 {
+    KVMRegSnapshot *snap = env->kvm_reg_snapshot;
     struct kvm_fpu fpu;
     int i, ret;
 
@@ -1073,11 +1206,14 @@ static int kvm_get_fpu(CPUX86State *env)
     memcpy(env->xmm_regs, fpu.xmm, sizeof env->xmm_regs);
     env->mxcsr = fpu.mxcsr;
 
+    kvm_fill_fpu(env, &snap->fpu);
+    kvm_snapshot_group(env, KVM_REGS_FPU);
     return 0;
 }
 
 static int kvm_get_xsave(CPUX86State *env)
 {
+    KVMRegSnapshot *snap = env->kvm_reg_snapshot;
     struct kvm_xsave* xsave = env->kvm_xsave_buf;
     int ret, i;
     uint16_t cwd, swd, twd;
@@ -1111,11 +1247,15 @@ static int kvm_get_xsave(CPUX86State *env)
     env->xstate_bv = *(uint64_t *)&xsave->region[XSAVE_XSTATE_BV];
     memcpy(env->ymmh_regs, &xsave->region[XSAVE_YMMH_SPACE],
             sizeof env->ymmh_regs);
+
+    kvm_fill_xsave(env, &snap->xsave);
+    kvm_snapshot_group(env, KVM_REGS_FPU);
     return 0;
 }
 
 static int kvm_get_xcrs(CPUX86State *env)
 {
+    KVMRegSnapshot *snap = env->kvm_reg_snapshot;
     int i, ret;
     struct kvm_xcrs xcrs;
 
@@ -1135,11 +1275,15 @@ static int kvm_get_xcrs(CPUX86State *env)
             break;
         }
     }
+
+    kvm_fill_xcrs(env, &snap->xcrs);
+    kvm_snapshot_group(env, KVM_REGS_XCRS);
     return 0;
 }
 
 static int kvm_get_sregs(CPUX86State *env)
 {
+    KVMRegSnapshot *snap = env->kvm_reg_snapshot;
     struct kvm_sregs sregs;
     uint32_t hflags;
     int bit, i, ret;
@@ -1219,15 +1363,15 @@ static int kvm_get_sregs(CPUX86State *env)
     }
     env->hflags = (env->hflags & HFLAG_COPY_MASK) | hflags;
 
+    kvm_fill_sregs(env, &snap->sregs);
+    kvm_snapshot_group(env, KVM_REGS_SREGS);
     return 0;
 }
 
 static int kvm_get_msrs(CPUX86State *env)
 {
-    struct {
-        struct kvm_msrs info;
-        struct kvm_msr_entry entries[100];
-    } msr_data;
+    KVMRegSnapshot *snap = env->kvm_reg_snapshot;
+    KVMMSRData msr_data;
     struct kvm_msr_entry *msrs = msr_data.entries;
     int ret, i, n;
 
@@ -1355,6 +1499,8 @@ static int kvm_get_msrs(CPUX86State *env)
         }
     }
 
+    kvm_fill_msrs(env, KVM_PUT_RUNTIME_STATE, &snap->msrs);
+    kvm_snapshot_group(env, KVM_REGS_MSRS);
     return 0;
 }
 
@@ -1411,14 +1557,12 @@ static int kvm_put_apic(CPUX86State *env)
     return 0;
 }
 
-static int kvm_put_vcpu_events(CPUX86State *env, int level)
+static void kvm_fill_vcpu_events(CPUX86State *env, int level,
+                                 struct kvm_vcpu_events *kevents)
 {
     struct kvm_vcpu_events events;
 
-    if (!kvm_has_vcpu_events()) {
-        return 0;
-    }
-
+    memset(&events, 0, sizeof(events));
     events.exception.injected = (env->exception_injected >= 0);
     events.exception.nr = env->exception_injected;
     events.exception.has_error_code = env->has_error_code;
@@ -1441,12 +1585,29 @@ static int kvm_put_vcpu_events(CPUX86State *env, int level)
         events.flags |=
             KVM_VCPUEVENT_VALID_NMI_PENDING | KVM_VCPUEVENT_VALID_SIPI_VECTOR;
     }
+    *kevents = events;
+}
+
+static int kvm_put_vcpu_events(CPUX86State *env, int level)
+{
+    KVMRegSnapshot *snap = env->kvm_reg_snapshot;
+    struct kvm_vcpu_events events;
 
+    if (!kvm_has_vcpu_events()) {
+        return 0;
+    }
+
+    kvm_fill_vcpu_events(env, level, &events);
+    if (!kvm_group_needs_put(env, level, KVM_REGS_EVENTS, &snap->events,
+                             &events, sizeof(events))) {
+        return 0;
+    }
     return kvm_vcpu_ioctl(env, KVM_SET_VCPU_EVENTS, &events);
 }
 
 static int kvm_get_vcpu_events(CPUX86State *env)
 {
+    KVMRegSnapshot *snap = env->kvm_reg_snapshot;
     struct kvm_vcpu_events events;
     int ret;
 
@@ -1477,6 +1638,8 @@ static int kvm_get_vcpu_events(CPUX86State *env)
 
     env->sipi_vector = events.sipi_vector;
 
+    kvm_fill_vcpu_events(env, KVM_PUT_RUNTIME_STATE, &snap->events);
+    kvm_snapshot_group(env, KVM_REGS_EVENTS);
     return 0;
 }
 
@@ -1509,27 +1672,39 @@ static int kvm_guest_debug_workarounds(CPUX86State *env)
     return ret;
 }
 
-static int kvm_put_debugregs(CPUX86State *env)
+static void kvm_fill_debugregs(CPUX86State *env, struct kvm_debugregs *dbgregs)
 {
-    struct kvm_debugregs dbgregs;
     int i;
 
+    memset(dbgregs, 0, sizeof(*dbgregs));
+    for (i = 0; i < 4; i++) {
+        dbgregs->db[i] = env->dr[i];
+    }
+    dbgregs->dr6 = env->dr[6];
+    dbgregs->dr7 = env->dr[7];
+    dbgregs->flags = 0;
+}
+
+static int kvm_put_debugregs(CPUX86State *env, int level)
+{
+    KVMRegSnapshot *snap = env->kvm_reg_snapshot;
+    struct kvm_debugregs dbgregs;
+
     if (!kvm_has_debugregs()) {
         return 0;
     }
 
-    for (i = 0; i < 4; i++) {
-        dbgregs.db[i] = env->dr[i];
+    kvm_fill_debugregs(env, &dbgregs);
+    if (!kvm_group_needs_put(env, level, KVM_REGS_DEBUG, &snap->dbgregs,
+                             &dbgregs, sizeof(dbgregs))) {
+        return 0;
     }
-    dbgregs.dr6 = env->dr[6];
-    dbgregs.dr7 = env->dr[7];
-    dbgregs.flags = 0;
-
     return kvm_vcpu_ioctl(env, KVM_SET_DEBUGREGS, &dbgregs);
 }
 
 static int kvm_get_debugregs(CPUX86State *env)
 {
+    KVMRegSnapshot *snap = env->kvm_reg_snapshot;
     struct kvm_debugregs dbgregs;
     int i, ret;
 
@@ -1547,6 +1722,8 @@ static int kvm_get_debugregs(CPUX86State *env)
     env->dr[4] = env->dr[6] = dbgregs.dr6;
     env->dr[5] = env->dr[7] = dbgregs.dr7;
 
+    kvm_fill_debugregs(env, &snap->dbgregs);
+    kvm_snapshot_group(env, KVM_REGS_DEBUG);
     return 0;
 }
 
@@ -1556,19 +1733,19 @@ int kvm_arch_put_registers(CPUX86State *env, int level)
 
     assert(cpu_is_stopped(env) || qemu_cpu_is_self(env));
 
-    ret = kvm_getput_regs(env, 1);
+    ret = kvm_put_regs(env, level);
     if (ret < 0) {
         return ret;
     }
-    ret = kvm_put_xsave(env);
+    ret = kvm_put_xsave(env, level);
     if (ret < 0) {
         return ret;
     }
-    ret = kvm_put_xcrs(env);
+    ret = kvm_put_xcrs(env, level);
     if (ret < 0) {
         return ret;
     }
-    ret = kvm_put_sregs(env);
+    ret = kvm_put_sregs(env, level);
     if (ret < 0) {
         return ret;
     }
@@ -1595,7 +1772,7 @@ int kvm_arch_put_registers(CPUX86State *env, int level)
     if (ret < 0) {
         return ret;
     }
-    ret = kvm_put_debugregs(env);
+    ret = kvm_put_debugregs(env, level);
     if (ret < 0) {
         return ret;
     }
@@ -1604,51 +1781,81 @@ int kvm_arch_put_registers(CPUX86State *env, int level)
     if (ret < 0) {
         return ret;
     }
+    ((KVMRegSnapshot *)env->kvm_reg_snapshot)->groups = 0;
     return 0;
 }
 
-int kvm_arch_get_registers(CPUX86State *env)
+int kvm_arch_get_registers(CPUX86State *env, unsigned int groups)
 {
     int ret;
 
     assert(cpu_is_stopped(env) || qemu_cpu_is_self(env));
 
-    ret = kvm_getput_regs(env, 0);
-    if (ret < 0) {
-        return ret;
+    /*
+     * hflags are derived from eflags and the segment registers, and both
+     * sregs and vcpu events carry the injected interrupt, so these always
+     * come together.
+     */
+    if (groups & (KVM_REGS_SREGS | KVM_REGS_EVENTS)) {
+        groups |= KVM_REGS_GPR | KVM_REGS_SREGS | KVM_REGS_EVENTS;
     }
-    ret = kvm_get_xsave(env);
-    if (ret < 0) {
-        return ret;
+    groups &= ~env->kvm_regs_valid;
+
+    if (groups & KVM_REGS_GPR) {
+        ret = kvm_get_regs(env);
+        if (ret < 0) {
+            return ret;
+        }
     }
-    ret = kvm_get_xcrs(env);
-    if (ret < 0) {
-        return ret;
+    if (groups & KVM_REGS_FPU) {
+        ret = kvm_get_xsave(env);
+        if (ret < 0) {
+            return ret;
+        }
     }
-    ret = kvm_get_sregs(env);
-    if (ret < 0) {
-        return ret;
+    if (groups & KVM_REGS_XCRS) {
+        ret = kvm_get_xcrs(env);
+        if (ret < 0) {
+            return ret;
+        }
     }
-    ret = kvm_get_msrs(env);
-    if (ret < 0) {
-        return ret;
+    if (groups & KVM_REGS_SREGS) {
+        ret = kvm_get_sregs(env);
+        if (ret < 0) {
+            return ret;
+        }
     }
-    ret = kvm_get_mp_state(env);
-    if (ret < 0) {
-        return ret;
+    if (groups & KVM_REGS_MSRS) {
+        ret = kvm_get_msrs(env);
+        if (ret < 0) {
+            return ret;
+        }
     }
-    ret = kvm_get_apic(env);
-    if (ret < 0) {
-        return ret;
+    if (groups & KVM_REGS_MP_STATE) {
+        ret = kvm_get_mp_state(env);
+        if (ret < 0) {
+            return ret;
+        }
     }
-    ret = kvm_get_vcpu_events(env);
-    if (ret < 0) {
-        return ret;
+    if (groups & KVM_REGS_LAPIC) {
+        ret = kvm_get_apic(env);
+        if (ret < 0) {
+            return ret;
+        }
     }
-    ret = kvm_get_debugregs(env);
-    if (ret < 0) {
-        return ret;
+    if (groups & KVM_REGS_EVENTS) {
+        ret = kvm_get_vcpu_events(env);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (groups & KVM_REGS_DEBUG) {
+        ret = kvm_get_debugregs(env);
+        if (ret < 0) {
+            return ret;
+        }
     }
+    env->kvm_regs_valid |= groups;
     return 0;
 }
 
@@ -1733,7 +1940,7 @@ int kvm_arch_process_async_events(CPUX86State *env)
 
         env->interrupt_request &= ~CPU_INTERRUPT_MCE;
 
-        kvm_cpu_synchronize_state(env);
+        kvm_cpu_synchronize_groups(env, KVM_REGS_EVENTS | KVM_REGS_MP_STATE);
 
         if (env->exception_injected == EXCP08_DBLE) {
             /* this means triple fault */
@@ -1773,7 +1980,7 @@ int kvm_arch_process_async_events(CPUX86State *env)
     }
     if (env->interrupt_request & CPU_INTERRUPT_TPR) {
         env->interrupt_request &= ~CPU_INTERRUPT_TPR;
-        kvm_cpu_synchronize_state(env);
+        kvm_cpu_synchronize_groups(env, KVM_REGS_GPR);
         apic_handle_tpr_access_report(env->apic_state, env->eip,
                                       env->tpr_access_type);
     }
@@ -1946,7 +2153,7 @@ static int kvm_handle_debug(struct kvm_debug_exit_arch *arch_info)
         ret = EXCP_DEBUG;
     }
     if (ret == 0) {
-        cpu_synchronize_state(cpu_single_env);
+        cpu_synchronize_groups(cpu_single_env, KVM_REGS_EVENTS);
         assert(cpu_single_env->exception_injected == -1);
 
         /* pass to guest */
@@ -2047,7 +2254,7 @@ int kvm_arch_handle_exit(CPUX86State *env, struct kvm_run *run)
 
 bool kvm_arch_stop_on_emulation_error(CPUX86State *env)
 {
-    kvm_cpu_synchronize_state(env);
+    kvm_cpu_synchronize_groups(env, KVM_REGS_SREGS);
     return !(env->cr[0] & CR0_PE_MASK) ||
            ((env->segs[R_CS].selector  & 3) != 3);
 }
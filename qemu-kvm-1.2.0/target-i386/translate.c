@@ -899,17 +899,21 @@ static int is_fast_jcc_case(DisasContext *s, int b)
             goto slow_jcc;
         break;
 
+        /* CF and OF are cleared, only PF needs the helper */
+    case CC_OP_LOGICB:
+    case CC_OP_LOGICW:
+    case CC_OP_LOGICL:
+    case CC_OP_LOGICQ:
+        if (jcc_op == JCC_P)
+            goto slow_jcc;
+        break;
+
         /* some jumps are easy to compute */
     case CC_OP_ADDB:
     case CC_OP_ADDW:
     case CC_OP_ADDL:
     case CC_OP_ADDQ:
 
-    case CC_OP_LOGICB:
-    case CC_OP_LOGICW:
-    case CC_OP_LOGICL:
-    case CC_OP_LOGICQ:
-
     case CC_OP_INCB:
     case CC_OP_INCW:
     case CC_OP_INCL:
@@ -924,7 +928,12 @@ static int is_fast_jcc_case(DisasContext *s, int b)
     case CC_OP_SHLW:
     case CC_OP_SHLL:
     case CC_OP_SHLQ:
-        if (jcc_op != JCC_Z && jcc_op != JCC_S)
+
+    case CC_OP_SARB:
+    case CC_OP_SARW:
+    case CC_OP_SARL:
+    case CC_OP_SARQ:
+        if (jcc_op != JCC_Z && jcc_op != JCC_S && jcc_op != JCC_B)
             goto slow_jcc;
         break;
     default:
@@ -1071,7 +1080,53 @@ static inline void gen_jcc1(DisasContext *s, int cc_op, int b, int l1)
             goto slow_jcc;
         }
         break;
-        
+
+        /* after a logical operation CF = OF = 0, so everything but
+           PF follows from the result */
+    case CC_OP_LOGICB:
+    case CC_OP_LOGICW:
+    case CC_OP_LOGICL:
+    case CC_OP_LOGICQ:
+        size = cc_op - CC_OP_LOGICB;
+        switch(jcc_op) {
+        case JCC_O:
+        case JCC_B:
+            if (inv)
+                tcg_gen_br(l1);
+            break;
+        case JCC_Z:
+        case JCC_BE:
+            goto fast_jcc_z;
+        case JCC_S:
+        case JCC_L:
+            goto fast_jcc_s;
+        case JCC_LE:
+            switch(size) {
+            case 0:
+                tcg_gen_ext8s_tl(cpu_tmp0, cpu_cc_dst);
+                t0 = cpu_tmp0;
+                break;
+            case 1:
+                tcg_gen_ext16s_tl(cpu_tmp0, cpu_cc_dst);
+                t0 = cpu_tmp0;
+                break;
+#ifdef TARGET_X86_64
+            case 2:
+                tcg_gen_ext32s_tl(cpu_tmp0, cpu_cc_dst);
+                t0 = cpu_tmp0;
+                break;
+#endif
+            default:
+                t0 = cpu_cc_dst;
+                break;
+            }
+            tcg_gen_brcondi_tl(inv ? TCG_COND_GT : TCG_COND_LE, t0, 0, l1);
+            break;
+        default:
+            goto slow_jcc;
+        }
+        break;
+
         /* some jumps are easy to compute */
     case CC_OP_ADDB:
     case CC_OP_ADDW:
@@ -1088,11 +1143,6 @@ static inline void gen_jcc1(DisasContext *s, int cc_op, int b, int l1)
     case CC_OP_SBBL:
     case CC_OP_SBBQ:
         
-    case CC_OP_LOGICB:
-    case CC_OP_LOGICW:
-    case CC_OP_LOGICL:
-    case CC_OP_LOGICQ:
-        
     case CC_OP_INCB:
     case CC_OP_INCW:
     case CC_OP_INCL:
@@ -1119,6 +1169,49 @@ static inline void gen_jcc1(DisasContext *s, int cc_op, int b, int l1)
         case JCC_S:
             size = (cc_op - CC_OP_ADDB) & 3;
             goto fast_jcc_s;
+        case JCC_B:
+            size = (cc_op - CC_OP_ADDB) & 3;
+            if (cc_op >= CC_OP_ADDB && cc_op <= CC_OP_ADDQ) {
+                /* CF = res < src1 */
+                switch(size) {
+                case 0:
+                    tcg_gen_andi_tl(cpu_tmp4, cpu_cc_dst, 0xff);
+                    tcg_gen_andi_tl(cpu_tmp0, cpu_cc_src, 0xff);
+                    break;
+                case 1:
+                    tcg_gen_andi_tl(cpu_tmp4, cpu_cc_dst, 0xffff);
+                    tcg_gen_andi_tl(cpu_tmp0, cpu_cc_src, 0xffff);
+                    break;
+#ifdef TARGET_X86_64
+                case 2:
+                    tcg_gen_andi_tl(cpu_tmp4, cpu_cc_dst, 0xffffffff);
+                    tcg_gen_andi_tl(cpu_tmp0, cpu_cc_src, 0xffffffff);
+                    break;
+#endif
+                default:
+                    tcg_gen_mov_tl(cpu_tmp4, cpu_cc_dst);
+                    tcg_gen_mov_tl(cpu_tmp0, cpu_cc_src);
+                    break;
+                }
+                tcg_gen_brcond_tl(inv ? TCG_COND_GEU : TCG_COND_LTU,
+                                  cpu_tmp4, cpu_tmp0, l1);
+            } else if (cc_op >= CC_OP_INCB && cc_op <= CC_OP_DECQ) {
+                /* CC_SRC holds the preserved CF as 0 or 1 */
+                tcg_gen_brcondi_tl(inv ? TCG_COND_EQ : TCG_COND_NE,
+                                   cpu_cc_src, 0, l1);
+            } else if (cc_op >= CC_OP_SHLB && cc_op <= CC_OP_SHLQ) {
+                tcg_gen_shri_tl(cpu_tmp0, cpu_cc_src, (8 << size) - 1);
+                tcg_gen_andi_tl(cpu_tmp0, cpu_tmp0, 1);
+                tcg_gen_brcondi_tl(inv ? TCG_COND_EQ : TCG_COND_NE,
+                                   cpu_tmp0, 0, l1);
+            } else if (cc_op >= CC_OP_SARB && cc_op <= CC_OP_SARQ) {
+                tcg_gen_andi_tl(cpu_tmp0, cpu_cc_src, 1);
+                tcg_gen_brcondi_tl(inv ? TCG_COND_EQ : TCG_COND_NE,
+                                   cpu_tmp0, 0, l1);
+            } else {
+                goto slow_jcc;
+            }
+            break;
         default:
             goto slow_jcc;
         }
@@ -1232,9 +1325,14 @@ static inline void gen_outs(DisasContext *s, int ot)
 static inline void gen_repz_ ## op(DisasContext *s, int ot,                   \
                                  target_ulong cur_eip, target_ulong next_eip) \
 {                                                                             \
-    int l2;\
-    gen_update_cc_op(s);                                                      \
+    int l2, cc_op;\
+    /* the flags are not touched: keep cc_op known for both jumps, so that    \
+       the loop chains to itself without computing the flags */              \
+    cc_op = s->cc_op;                                                         \
+    if (cc_op != CC_OP_DYNAMIC)                                               \
+        gen_op_set_cc_op(cc_op);                                              \
     l2 = gen_jz_ecx_string(s, next_eip);                                      \
+    s->cc_op = cc_op;                                                         \
     gen_ ## op(s, ot);                                                        \
     gen_op_add_reg_im(s->aflag, R_ECX, -1);                                   \
     /* a loop would cause two single step exceptions if ECX = 1               \
@@ -1257,6 +1355,7 @@ static inline void gen_repz_ ## op(DisasContext *s, int ot,                   \
     gen_op_add_reg_im(s->aflag, R_ECX, -1);                                   \
     gen_op_set_cc_op(CC_OP_SUBB + ot);                                        \
     gen_jcc1(s, CC_OP_SUBB + ot, (JCC_Z << 1) | (nz ^ 1), l2);                \
+    s->cc_op = CC_OP_SUBB + ot;                                               \
     if (!s->jmp_opt)                                                          \
         gen_op_jz_ecx(s->aflag, l2);                                          \
     gen_jmp(s, cur_eip);                                                      \
@@ -2335,7 +2434,10 @@ static inline int insn_const_size(unsigned int ot)
         return 4;
 }
 
-static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
+/* cc_op is the value env->cc_op holds at the jump, or CC_OP_DYNAMIC if
+   it is not known at translation time */
+static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip,
+                               int cc_op)
 {
     TranslationBlock *tb;
     target_ulong pc;
@@ -2345,7 +2447,14 @@ static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
     /* NOTE: we handle the case where the TB spans two pages here */
     if ((pc & TARGET_PAGE_MASK) == (tb->pc & TARGET_PAGE_MASK) ||
         (pc & TARGET_PAGE_MASK) == ((s->pc - 1) & TARGET_PAGE_MASK))  {
-        /* jump to same page: we can use a direct jump */
+        /* jump to same page: we can use a direct jump.  The next block is
+           translated for the cc_op it is entered with, so the jump must
+           always leave the same one: fix it to CC_OP_EFLAGS if it is not
+           known here */
+        if (cc_op == CC_OP_DYNAMIC) {
+            gen_compute_eflags(cpu_cc_src);
+            gen_op_set_cc_op(CC_OP_EFLAGS);
+        }
         tcg_gen_goto_tb(tb_num);
         gen_jmp_im(eip);
         tcg_gen_exit_tb((tcg_target_long)tb + tb_num);
@@ -2367,10 +2476,10 @@ static inline void gen_jcc(DisasContext *s, int b,
         l1 = gen_new_label();
         gen_jcc1(s, cc_op, b, l1);
         
-        gen_goto_tb(s, 0, next_eip);
+        gen_goto_tb(s, 0, next_eip, cc_op);
 
         gen_set_label(l1);
-        gen_goto_tb(s, 1, val);
+        gen_goto_tb(s, 1, val, cc_op);
         s->is_jmp = DISAS_TB_JUMP;
     } else {
 
@@ -2772,9 +2881,12 @@ static void gen_eob(DisasContext *s)
    direct call to the next block may occur */
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num)
 {
+    int cc_op;
+
     if (s->jmp_opt) {
+        cc_op = s->cc_op;
         gen_update_cc_op(s);
-        gen_goto_tb(s, tb_num, eip);
+        gen_goto_tb(s, tb_num, eip, cc_op);
         s->is_jmp = DISAS_TB_JUMP;
     } else {
         gen_jmp_im(eip);
@@ -3166,6 +3278,65 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0x63] = SSE42_OP(pcmpistri),
 };
 
+/* Integer MMX/SSE ops that work lane by lane within 64 bits are done
+   with TCG ops on each quadword instead of a helper call.  */
+static void gen_sse_op_inline(int b, int op1_offset, int op2_offset,
+                              int nb_quads)
+{
+    TCGv_i64 t0, t1;
+    int i;
+
+    t0 = tcg_temp_new_i64();
+    t1 = tcg_temp_new_i64();
+    for (i = 0; i < nb_quads; i++) {
+        tcg_gen_ld_i64(t0, cpu_env, op1_offset + i * 8);
+        tcg_gen_ld_i64(t1, cpu_env, op2_offset + i * 8);
+        switch (b) {
+        case 0xd4: /* paddq */
+            tcg_gen_add_i64(t0, t0, t1);
+            break;
+        case 0xdb: /* pand */
+            tcg_gen_and_i64(t0, t0, t1);
+            break;
+        case 0xdf: /* pandn */
+            tcg_gen_andc_i64(t0, t1, t0);
+            break;
+        case 0xeb: /* por */
+            tcg_gen_or_i64(t0, t0, t1);
+            break;
+        case 0xef: /* pxor */
+            tcg_gen_xor_i64(t0, t0, t1);
+            break;
+        case 0xf8: /* psubb */
+            tcg_gen_vec_sub8_i64(t0, t0, t1);
+            break;
+        case 0xf9: /* psubw */
+            tcg_gen_vec_sub16_i64(t0, t0, t1);
+            break;
+        case 0xfa: /* psubl */
+            tcg_gen_vec_sub32_i64(t0, t0, t1);
+            break;
+        case 0xfb: /* psubq */
+            tcg_gen_sub_i64(t0, t0, t1);
+            break;
+        case 0xfc: /* paddb */
+            tcg_gen_vec_add8_i64(t0, t0, t1);
+            break;
+        case 0xfd: /* paddw */
+            tcg_gen_vec_add16_i64(t0, t0, t1);
+            break;
+        case 0xfe: /* paddl */
+            tcg_gen_vec_add32_i64(t0, t0, t1);
+            break;
+        default:
+            abort();
+        }
+        tcg_gen_st_i64(t0, cpu_env, op1_offset + i * 8);
+    }
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+}
+
 static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
 {
     int b1, op1_offset, op2_offset, is_xmm, val, ot;
@@ -4180,6 +4351,14 @@ static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
             sse_fn_eppt = (SSEFunc_0_eppt)sse_fn_epp;
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
+        case 0xd4: /* paddq */
+        case 0xdb: /* pand */
+        case 0xdf: /* pandn */
+        case 0xeb: /* por */
+        case 0xef: /* pxor */
+        case 0xf8 ... 0xfe: /* psubb ... paddl */
+            gen_sse_op_inline(b, op1_offset, op2_offset, is_xmm ? 2 : 1);
+            break;
         default:
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
@@ -7893,7 +8072,7 @@ static inline void gen_intermediate_code_internal(CPUX86State *env,
     dc->iopl = (flags >> IOPL_SHIFT) & 3;
     dc->tf = (flags >> TF_SHIFT) & 1;
     dc->singlestep_enabled = env->singlestep_enabled;
-    dc->cc_op = CC_OP_DYNAMIC;
+    dc->cc_op = (flags & TB_FLAGS_CC_OP_MASK) >> TB_FLAGS_CC_OP_SHIFT;
     dc->cs_base = cs_base;
     dc->tb = tb;
     dc->popl_esp_hack = 0;
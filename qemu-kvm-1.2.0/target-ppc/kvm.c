@@ -472,7 +472,7 @@ int kvm_arch_put_registers(CPUPPCState *env, int level)
     return ret;
 }
 
-int kvm_arch_get_registers(CPUPPCState *env)
+int kvm_arch_get_registers(CPUPPCState *env, unsigned int groups)
 {
     struct kvm_regs regs;
     struct kvm_sregs sregs;
@@ -646,6 +646,7 @@ int kvm_arch_get_registers(CPUPPCState *env)
         }
     }
 
+    env->kvm_regs_valid = KVM_REGS_ALL;
     return 0;
 }
 
@@ -114,7 +114,7 @@ int kvm_arch_put_registers(CPUS390XState *env, int level)
     return ret;
 }
 
-int kvm_arch_get_registers(CPUS390XState *env)
+int kvm_arch_get_registers(CPUS390XState *env, unsigned int groups)
 {
     int ret;
     struct kvm_regs regs;
@@ -131,6 +131,7 @@ int kvm_arch_get_registers(CPUS390XState *env)
 
     env->psw.addr = env->kvm_run->psw_addr;
     env->psw.mask = env->kvm_run->psw_mask;
+    env->kvm_regs_valid = KVM_REGS_ALL;
 
     return 0;
 }
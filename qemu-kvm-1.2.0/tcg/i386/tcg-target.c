@@ -1003,6 +1003,25 @@ static void *qemu_st_helpers[4] = {
 };
 #endif
 
+/* Emit the forward jump taken on a TLB miss and return the position of
+   its displacement.  With CONFIG_QEMU_LDST_OPTIMIZATION the miss path is
+   at the end of the TB, out of the reach of a short jump.  */
+static inline uint8_t *tcg_out_tlb_miss_jump(TCGContext *s)
+{
+    uint8_t *label_ptr;
+
+#ifdef CONFIG_QEMU_LDST_OPTIMIZATION
+    tcg_out_opc(s, OPC_JCC_long + JCC_JNE, 0, 0, 0);
+    label_ptr = s->code_ptr;
+    s->code_ptr += 4;
+#else
+    tcg_out8(s, OPC_JCC_short + JCC_JNE);
+    label_ptr = s->code_ptr;
+    s->code_ptr++;
+#endif
+    return label_ptr;
+}
+
 /* Perform the TLB load and compare.
 
    Inputs:
@@ -1062,18 +1081,14 @@ static inline void tcg_out_tlb_load(TCGContext *s, int addrlo_idx,
     tcg_out_mov(s, type, r0, addrlo);
 
     /* jne label1 */
-    tcg_out8(s, OPC_JCC_short + JCC_JNE);
-    label_ptr[0] = s->code_ptr;
-    s->code_ptr++;
+    label_ptr[0] = tcg_out_tlb_miss_jump(s);
 
     if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
         /* cmp 4(r1), addrhi */
         tcg_out_modrm_offset(s, OPC_CMP_GvEv, args[addrlo_idx+1], r1, 4);
 
         /* jne label1 */
-        tcg_out8(s, OPC_JCC_short + JCC_JNE);
-        label_ptr[1] = s->code_ptr;
-        s->code_ptr++;
+        label_ptr[1] = tcg_out_tlb_miss_jump(s);
     }
 
     /* TLB Hit.  */
@@ -1161,64 +1176,74 @@ static void tcg_out_qemu_ld_direct(TCGContext *s, int datalo, int datahi,
     }
 }
 
-/* XXX: qemu_ld and qemu_st could be modified to clobber only EDX and
-   EAX. It will be useful once fixed registers globals are less
-   common. */
-static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
-                            int opc)
+#ifdef CONFIG_QEMU_LDST_OPTIMIZATION
+/* Record the address to return to in the fast path right after a slow
+   path helper call: a short jump over the 32-bit offset from the return
+   address of the call to RADDR.  See GETPC_LDST().  */
+static void tcg_out_ldst_retaddr(TCGContext *s, uint8_t *raddr)
 {
-    int data_reg, data_reg2 = 0;
-    int addrlo_idx;
-#if defined(CONFIG_SOFTMMU)
-    int mem_index, s_bits;
-#if TCG_TARGET_REG_BITS == 64
-    int arg_idx;
-#else
-    int stack_adjust;
-#endif
-    uint8_t *label_ptr[3];
-#endif
+    uint8_t *ra = s->code_ptr;
 
-    data_reg = args[0];
-    addrlo_idx = 1;
-    if (TCG_TARGET_REG_BITS == 32 && opc == 3) {
-        data_reg2 = args[1];
-        addrlo_idx = 2;
-    }
-
-#if defined(CONFIG_SOFTMMU)
-    mem_index = args[addrlo_idx + 1 + (TARGET_LONG_BITS > TCG_TARGET_REG_BITS)];
-    s_bits = opc & 3;
-
-    tcg_out_tlb_load(s, addrlo_idx, mem_index, s_bits, args,
-                     label_ptr, offsetof(CPUTLBEntry, addr_read));
-
-    /* TLB Hit.  */
-    tcg_out_qemu_ld_direct(s, data_reg, data_reg2,
-                           tcg_target_call_iarg_regs[0], 0, opc);
-
-    /* jmp label2 */
     tcg_out8(s, OPC_JMP_short);
-    label_ptr[2] = s->code_ptr;
-    s->code_ptr++;
+    tcg_out8(s, 4);
+    tcg_out32(s, raddr - ra);
+}
 
-    /* TLB Miss.  */
+static void add_qemu_ldst_label(TCGContext *s, int is_ld, int opc,
+                               int data_reg, int data_reg2,
+                               int addrlo, int addrhi, int mem_index,
+                               uint8_t **label_ptr)
+{
+    TCGLabelQemuLdst *l;
 
-    /* label1: */
-    *label_ptr[0] = s->code_ptr - label_ptr[0] - 1;
+    if (s->nb_qemu_ldst_labels >= TCG_MAX_QEMU_LDST) {
+        tcg_abort();
+    }
+    l = &s->qemu_ldst_labels[s->nb_qemu_ldst_labels++];
+    l->is_ld = is_ld;
+    l->opc = opc;
+    l->datalo_reg = data_reg;
+    l->datahi_reg = data_reg2;
+    l->addrlo_reg = addrlo;
+    l->addrhi_reg = addrhi;
+    l->mem_index = mem_index;
+    l->raddr = s->code_ptr;
+    l->label_ptr[0] = label_ptr[0];
     if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
-        *label_ptr[1] = s->code_ptr - label_ptr[1] - 1;
+        l->label_ptr[1] = label_ptr[1];
     }
+}
+#else
+static inline void tcg_out_ldst_retaddr(TCGContext *s, uint8_t *raddr)
+{
+}
+#endif
+
+#if defined(CONFIG_SOFTMMU)
+/* Call the load helper for a TLB miss and move its result to DATA_REG.
+   The first argument register holds the guest address.  A non-NULL RADDR
+   is the fast path address the out-of-line slow path returns to; it is
+   recorded right after the call for GETPC_LDST().  */
+static void tcg_out_qemu_ld_helper_call(TCGContext *s, int opc,
+                                        int data_reg, int data_reg2,
+                                        int addrlo, int addrhi,
+                                        int mem_index, uint8_t *raddr)
+{
+    int s_bits = opc & 3;
+#if TCG_TARGET_REG_BITS == 64
+    int arg_idx;
+#else
+    int stack_adjust;
+#endif
 
-    /* XXX: move that code at the end of the TB */
 #if TCG_TARGET_REG_BITS == 32
     tcg_out_pushi(s, mem_index);
     stack_adjust = 4;
     if (TARGET_LONG_BITS == 64) {
-        tcg_out_push(s, args[addrlo_idx + 1]);
+        tcg_out_push(s, addrhi);
         stack_adjust += 4;
     }
-    tcg_out_push(s, args[addrlo_idx]);
+    tcg_out_push(s, addrlo);
     stack_adjust += 4;
 #ifdef CONFIG_TCG_PASS_AREG0
     tcg_out_push(s, TCG_AREG0);
@@ -1243,6 +1268,9 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
 #endif
 
     tcg_out_calli(s, (tcg_target_long)qemu_ld_helpers[s_bits]);
+    if (raddr) {
+        tcg_out_ldst_retaddr(s, raddr);
+    }
 
 #if TCG_TARGET_REG_BITS == 32
     if (stack_adjust == (TCG_TARGET_REG_BITS / 8)) {
@@ -1289,9 +1317,65 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     default:
         tcg_abort();
     }
+}
+#endif
+
+/* XXX: qemu_ld and qemu_st could be modified to clobber only EDX and
+   EAX. It will be useful once fixed registers globals are less
+   common. */
+static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
+                            int opc)
+{
+    int data_reg, data_reg2 = 0;
+    int addrlo_idx;
+#if defined(CONFIG_SOFTMMU)
+    int mem_index, s_bits;
+    uint8_t *label_ptr[3];
+#endif
+
+    data_reg = args[0];
+    addrlo_idx = 1;
+    if (TCG_TARGET_REG_BITS == 32 && opc == 3) {
+        data_reg2 = args[1];
+        addrlo_idx = 2;
+    }
+
+#if defined(CONFIG_SOFTMMU)
+    mem_index = args[addrlo_idx + 1 + (TARGET_LONG_BITS > TCG_TARGET_REG_BITS)];
+    s_bits = opc & 3;
+
+    tcg_out_tlb_load(s, addrlo_idx, mem_index, s_bits, args,
+                     label_ptr, offsetof(CPUTLBEntry, addr_read));
+
+    /* TLB Hit.  */
+    tcg_out_qemu_ld_direct(s, data_reg, data_reg2,
+                           tcg_target_call_iarg_regs[0], 0, opc);
+
+#ifdef CONFIG_QEMU_LDST_OPTIMIZATION
+    /* TLB Miss: emitted at the end of the TB.  */
+    add_qemu_ldst_label(s, 1, opc, data_reg, data_reg2, args[addrlo_idx],
+                        args[addrlo_idx + 1], mem_index, label_ptr);
+#else
+    /* jmp label2 */
+    tcg_out8(s, OPC_JMP_short);
+    label_ptr[2] = s->code_ptr;
+    s->code_ptr++;
+
+    /* TLB Miss.  */
+
+    /* label1: */
+    *label_ptr[0] = s->code_ptr - label_ptr[0] - 1;
+    if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
+        *label_ptr[1] = s->code_ptr - label_ptr[1] - 1;
+    }
+
+    tcg_out_qemu_ld_helper_call(s, opc, data_reg, data_reg2,
+                                args[addrlo_idx], args[addrlo_idx + 1],
+                                mem_index, NULL);
 
     /* label2: */
     *label_ptr[2] = s->code_ptr - label_ptr[2] - 1;
+#endif
 #else
     {
         int32_t offset = GUEST_BASE;
@@ -1378,49 +1462,15 @@ static void tcg_out_qemu_st_direct(TCGContext *s, int datalo, int datahi,
     }
 }
 
-static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
-                            int opc)
-{
-    int data_reg, data_reg2 = 0;
-    int addrlo_idx;
 #if defined(CONFIG_SOFTMMU)
-    int mem_index, s_bits;
+/* Call the store helper for a TLB miss; see tcg_out_qemu_ld_helper_call. */
+static void tcg_out_qemu_st_helper_call(TCGContext *s, int opc,
+                                        int data_reg, int data_reg2,
+                                        int addrlo, int addrhi,
+                                        int mem_index, uint8_t *raddr)
+{
     int stack_adjust;
-    uint8_t *label_ptr[3];
-#endif
-
-    data_reg = args[0];
-    addrlo_idx = 1;
-    if (TCG_TARGET_REG_BITS == 32 && opc == 3) {
-        data_reg2 = args[1];
-        addrlo_idx = 2;
-    }
-
-#if defined(CONFIG_SOFTMMU)
-    mem_index = args[addrlo_idx + 1 + (TARGET_LONG_BITS > TCG_TARGET_REG_BITS)];
-    s_bits = opc;
-
-    tcg_out_tlb_load(s, addrlo_idx, mem_index, s_bits, args,
-                     label_ptr, offsetof(CPUTLBEntry, addr_write));
-
-    /* TLB Hit.  */
-    tcg_out_qemu_st_direct(s, data_reg, data_reg2,
-                           tcg_target_call_iarg_regs[0], 0, opc);
-
-    /* jmp label2 */
-    tcg_out8(s, OPC_JMP_short);
-    label_ptr[2] = s->code_ptr;
-    s->code_ptr++;
 
-    /* TLB Miss.  */
-
-    /* label1: */
-    *label_ptr[0] = s->code_ptr - label_ptr[0] - 1;
-    if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
-        *label_ptr[1] = s->code_ptr - label_ptr[1] - 1;
-    }
-
-    /* XXX: move that code at the end of the TB */
 #if TCG_TARGET_REG_BITS == 32
     tcg_out_pushi(s, mem_index);
     stack_adjust = 4;
@@ -1431,10 +1481,10 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     tcg_out_push(s, data_reg);
     stack_adjust += 4;
     if (TARGET_LONG_BITS == 64) {
-        tcg_out_push(s, args[addrlo_idx + 1]);
+        tcg_out_push(s, addrhi);
         stack_adjust += 4;
     }
-    tcg_out_push(s, args[addrlo_idx]);
+    tcg_out_push(s, addrlo);
     stack_adjust += 4;
 #ifdef CONFIG_TCG_PASS_AREG0
     tcg_out_push(s, TCG_AREG0);
@@ -1458,7 +1508,10 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
 #endif
 #endif
 
-    tcg_out_calli(s, (tcg_target_long)qemu_st_helpers[s_bits]);
+    tcg_out_calli(s, (tcg_target_long)qemu_st_helpers[opc]);
+    if (raddr) {
+        tcg_out_ldst_retaddr(s, raddr);
+    }
 
     if (stack_adjust == (TCG_TARGET_REG_BITS / 8)) {
         /* Pop and discard.  This is 2 bytes smaller than the add.  */
@@ -1466,9 +1519,62 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     } else if (stack_adjust != 0) {
         tcg_out_addi(s, TCG_REG_CALL_STACK, stack_adjust);
     }
+}
+#endif
+
+static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
+                            int opc)
+{
+    int data_reg, data_reg2 = 0;
+    int addrlo_idx;
+#if defined(CONFIG_SOFTMMU)
+    int mem_index, s_bits;
+    uint8_t *label_ptr[3];
+#endif
+
+    data_reg = args[0];
+    addrlo_idx = 1;
+    if (TCG_TARGET_REG_BITS == 32 && opc == 3) {
+        data_reg2 = args[1];
+        addrlo_idx = 2;
+    }
+
+#if defined(CONFIG_SOFTMMU)
+    mem_index = args[addrlo_idx + 1 + (TARGET_LONG_BITS > TCG_TARGET_REG_BITS)];
+    s_bits = opc;
+
+    tcg_out_tlb_load(s, addrlo_idx, mem_index, s_bits, args,
+                     label_ptr, offsetof(CPUTLBEntry, addr_write));
+
+    /* TLB Hit.  */
+    tcg_out_qemu_st_direct(s, data_reg, data_reg2,
+                           tcg_target_call_iarg_regs[0], 0, opc);
+
+#ifdef CONFIG_QEMU_LDST_OPTIMIZATION
+    /* TLB Miss: emitted at the end of the TB.  */
+    add_qemu_ldst_label(s, 0, opc, data_reg, data_reg2, args[addrlo_idx],
+                        args[addrlo_idx + 1], mem_index, label_ptr);
+#else
+    /* jmp label2 */
+    tcg_out8(s, OPC_JMP_short);
+    label_ptr[2] = s->code_ptr;
+    s->code_ptr++;
+
+    /* TLB Miss.  */
+
+    /* label1: */
+    *label_ptr[0] = s->code_ptr - label_ptr[0] - 1;
+    if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
+        *label_ptr[1] = s->code_ptr - label_ptr[1] - 1;
+    }
+
+    tcg_out_qemu_st_helper_call(s, opc, data_reg, data_reg2,
+                                args[addrlo_idx], args[addrlo_idx + 1],
+                                mem_index, NULL);
 
     /* label2: */
     *label_ptr[2] = s->code_ptr - label_ptr[2] - 1;
+#endif
 #else
     {
         int32_t offset = GUEST_BASE;
@@ -1496,6 +1602,37 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
 #endif
 }
 
+#ifdef CONFIG_QEMU_LDST_OPTIMIZATION
+/* Emit the TLB miss paths of the TB's qemu_ld/st ops.  Registers are
+   as they were at the jump from the fast path.  */
+static void tcg_out_qemu_ldst_slow_paths(TCGContext *s)
+{
+    TCGLabelQemuLdst *l;
+    int i;
+
+    for (i = 0; i < s->nb_qemu_ldst_labels; i++) {
+        l = &s->qemu_ldst_labels[i];
+
+        *(int32_t *)l->label_ptr[0] = s->code_ptr - l->label_ptr[0] - 4;
+        if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
+            *(int32_t *)l->label_ptr[1] = s->code_ptr - l->label_ptr[1] - 4;
+        }
+        if (l->is_ld) {
+            tcg_out_qemu_ld_helper_call(s, l->opc, l->datalo_reg,
+                                        l->datahi_reg, l->addrlo_reg,
+                                        l->addrhi_reg, l->mem_index,
+                                        l->raddr);
+        } else {
+            tcg_out_qemu_st_helper_call(s, l->opc, l->datalo_reg,
+                                        l->datahi_reg, l->addrlo_reg,
+                                        l->addrhi_reg, l->mem_index,
+                                        l->raddr);
+        }
+        tcg_out_jmp(s, (tcg_target_long)l->raddr);
+    }
+}
+#endif
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
@@ -1529,6 +1666,10 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         s->tb_next_offset[args[0]] = s->code_ptr - s->code_buf;
         break;
+    case INDEX_op_goto_ptr:
+        /* jmp *reg */
+        tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, args[0]);
+        break;
     case INDEX_op_call:
         if (const_args[0]) {
             tcg_out_calli(s, args[0]);
@@ -1840,6 +1981,7 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
     { INDEX_op_call, { "ri" } },
     { INDEX_op_jmp, { "ri" } },
     { INDEX_op_br, { } },
@@ -2048,6 +2190,10 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     /* jmp *tb.  */
     tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, tcg_target_call_iarg_regs[1]);
 
+    /* Return path for goto_ptr: no TB to chain to.  */
+    s->code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_REG, TCG_REG_EAX, 0);
+
     /* TB epilogue */
     tb_ret_addr = s->code_ptr;
 
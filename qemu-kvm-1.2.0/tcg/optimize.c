@@ -471,7 +471,8 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             }
         case INDEX_op_call:
             nb_call_args = (args[0] >> 16) + (args[0] & 0xffff);
-            if (!(args[nb_call_args + 1] & (TCG_CALL_CONST | TCG_CALL_PURE))) {
+            if (!(args[nb_call_args + 1] & (TCG_CALL_CONST | TCG_CALL_PURE |
+                                            TCG_CALL_NO_WRITE_GLOBALS))) {
                 for (i = 0; i < nb_globals; i++) {
                     reset_temp(i, nb_temps, nb_globals);
                 }
@@ -488,10 +489,21 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             }
             break;
         case INDEX_op_set_label:
+            /* other paths join here */
+            memset(temps, 0, nb_temps * sizeof(struct tcg_temp_info));
+            for (i = 0; i < def->nb_args; i++) {
+                *gen_args = *args;
+                args++;
+                gen_args++;
+            }
+            break;
         case INDEX_op_jmp:
         case INDEX_op_br:
         CASE_OP_32_64(brcond):
-            memset(temps, 0, nb_temps * sizeof(struct tcg_temp_info));
+            /* The code that follows can only be reached from here (a label
+               in between resets everything), so what is known about globals
+               and local temps stays true.  Normal temps do not survive the
+               end of the basic block and are never read again.  */
             for (i = 0; i < def->nb_args; i++) {
                 *gen_args = *args;
                 args++;
@@ -516,10 +528,138 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
     return gen_args;
 }
 
+/* Size of the env access done by OP, 0 if OP is not a load or store.  */
+static int tcg_opt_ldst_size(TCGOpcode op, int *is_store)
+{
+    *is_store = 0;
+    switch (op) {
+    case INDEX_op_st8_i32:
+    case INDEX_op_st8_i64:
+        *is_store = 1;
+        /* fallthrough */
+    CASE_OP_32_64(ld8u):
+    CASE_OP_32_64(ld8s):
+        return 1;
+    case INDEX_op_st16_i32:
+    case INDEX_op_st16_i64:
+        *is_store = 1;
+        /* fallthrough */
+    CASE_OP_32_64(ld16u):
+    CASE_OP_32_64(ld16s):
+        return 2;
+    case INDEX_op_st_i32:
+    case INDEX_op_st32_i64:
+        *is_store = 1;
+        /* fallthrough */
+    case INDEX_op_ld_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+        return 4;
+    case INDEX_op_st_i64:
+        *is_store = 1;
+        /* fallthrough */
+    case INDEX_op_ld_i64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+#define MAX_LATER_STORES 16
+
+/* Remove stores to env that are overwritten by a later store before
+   anything can read them.  The ops are walked backwards, remembering the
+   env locations stored to further on; anything that may observe env
+   other than a plain load from it (calls, accesses through another
+   pointer, guest memory accesses and other ops that can raise an
+   exception, branches and labels) forgets them all.  */
+static void tcg_dead_store_elimination(TCGContext *s, uint16_t *tcg_opc_ptr,
+                                       TCGArg *args, TCGOpDef *tcg_op_defs)
+{
+    struct {
+        tcg_target_long offset;
+        int size;
+    } later[MAX_LATER_STORES];
+    int nb_later, op_index, nb_args, size, is_store, i, j;
+    tcg_target_long offset;
+    const TCGOpDef *def;
+    TCGTemp *base;
+    TCGOpcode op;
+
+    nb_later = 0;
+    for (op_index = tcg_opc_ptr - gen_opc_buf - 1; op_index >= 0; op_index--) {
+        op = gen_opc_buf[op_index];
+        def = &tcg_op_defs[op];
+        switch (op) {
+        case INDEX_op_call:
+            nb_args = args[-1];
+            args -= nb_args;
+            nb_later = 0;
+            continue;
+        case INDEX_op_nopn:
+            nb_args = args[-1];
+            args -= nb_args;
+            continue;
+        case INDEX_op_set_label:
+            args -= def->nb_args;
+            nb_later = 0;
+            continue;
+        default:
+            args -= def->nb_args;
+            break;
+        }
+
+        size = tcg_opt_ldst_size(op, &is_store);
+        if (size == 0) {
+            if (def->flags & (TCG_OPF_BB_END | TCG_OPF_CALL_CLOBBER |
+                              TCG_OPF_SIDE_EFFECTS)) {
+                nb_later = 0;
+            }
+            continue;
+        }
+        base = &s->temps[args[1]];
+        if (!base->fixed_reg || base->reg != TCG_AREG0) {
+            /* may point anywhere into env */
+            nb_later = 0;
+            continue;
+        }
+        offset = args[2];
+        if (!is_store) {
+            for (i = j = 0; i < nb_later; i++) {
+                if (later[i].offset >= offset + size ||
+                    later[i].offset + later[i].size <= offset) {
+                    later[j++] = later[i];
+                }
+            }
+            nb_later = j;
+            continue;
+        }
+        for (i = 0; i < nb_later; i++) {
+            if (later[i].offset <= offset &&
+                later[i].offset + later[i].size >= offset + size) {
+                break;
+            }
+        }
+        if (i < nb_later) {
+            gen_opc_buf[op_index] = INDEX_op_nopn;
+            args[0] = def->nb_args;
+            args[def->nb_args - 1] = def->nb_args;
+#ifdef CONFIG_PROFILER
+            s->del_st_count++;
+#endif
+        } else if (nb_later < MAX_LATER_STORES) {
+            later[nb_later].offset = offset;
+            later[nb_later].size = size;
+            nb_later++;
+        }
+    }
+}
+
 TCGArg *tcg_optimize(TCGContext *s, uint16_t *tcg_opc_ptr,
         TCGArg *args, TCGOpDef *tcg_op_defs)
 {
     TCGArg *res;
     res = tcg_constant_folding(s, tcg_opc_ptr, args, tcg_op_defs);
+    tcg_dead_store_elimination(s, tcg_opc_ptr, res, tcg_op_defs);
     return res;
 }
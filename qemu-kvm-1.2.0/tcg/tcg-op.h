@@ -2118,6 +2118,148 @@ static inline void tcg_gen_deposit_i64(TCGv_i64 ret, TCGv_i64 arg1,
     tcg_temp_free_i64(t1);
 }
 
+/***************************************/
+/* Lane-wise operations on vectors of 8, 16 or 32 bit elements packed in
+   a 32 or 64 bit value.  M has the top bit of every lane set; clearing
+   it in both inputs keeps carries and borrows from crossing lanes, and
+   the top bits are then fixed up separately.  */
+
+static inline void tcg_gen_vec_add_mask_i32(TCGv_i32 ret, TCGv_i32 a,
+                                            TCGv_i32 b, uint32_t m)
+{
+    TCGv_i32 t1 = tcg_temp_new_i32();
+    TCGv_i32 t2 = tcg_temp_new_i32();
+    TCGv_i32 t3 = tcg_temp_new_i32();
+
+    tcg_gen_andi_i32(t1, a, ~m);
+    tcg_gen_andi_i32(t2, b, ~m);
+    tcg_gen_xor_i32(t3, a, b);
+    tcg_gen_add_i32(ret, t1, t2);
+    tcg_gen_andi_i32(t3, t3, m);
+    tcg_gen_xor_i32(ret, ret, t3);
+
+    tcg_temp_free_i32(t1);
+    tcg_temp_free_i32(t2);
+    tcg_temp_free_i32(t3);
+}
+
+static inline void tcg_gen_vec_sub_mask_i32(TCGv_i32 ret, TCGv_i32 a,
+                                            TCGv_i32 b, uint32_t m)
+{
+    TCGv_i32 t1 = tcg_temp_new_i32();
+    TCGv_i32 t2 = tcg_temp_new_i32();
+    TCGv_i32 t3 = tcg_temp_new_i32();
+
+    tcg_gen_ori_i32(t1, a, m);
+    tcg_gen_andi_i32(t2, b, ~m);
+    tcg_gen_eqv_i32(t3, a, b);
+    tcg_gen_sub_i32(ret, t1, t2);
+    tcg_gen_andi_i32(t3, t3, m);
+    tcg_gen_xor_i32(ret, ret, t3);
+
+    tcg_temp_free_i32(t1);
+    tcg_temp_free_i32(t2);
+    tcg_temp_free_i32(t3);
+}
+
+static inline void tcg_gen_vec_add_mask_i64(TCGv_i64 ret, TCGv_i64 a,
+                                            TCGv_i64 b, uint64_t m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_andi_i64(t1, a, ~m);
+    tcg_gen_andi_i64(t2, b, ~m);
+    tcg_gen_xor_i64(t3, a, b);
+    tcg_gen_add_i64(ret, t1, t2);
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_xor_i64(ret, ret, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static inline void tcg_gen_vec_sub_mask_i64(TCGv_i64 ret, TCGv_i64 a,
+                                            TCGv_i64 b, uint64_t m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_ori_i64(t1, a, m);
+    tcg_gen_andi_i64(t2, b, ~m);
+    tcg_gen_eqv_i64(t3, a, b);
+    tcg_gen_sub_i64(ret, t1, t2);
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_xor_i64(ret, ret, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static inline void tcg_gen_vec_add8_i32(TCGv_i32 ret, TCGv_i32 a, TCGv_i32 b)
+{
+    tcg_gen_vec_add_mask_i32(ret, a, b, 0x80808080u);
+}
+
+static inline void tcg_gen_vec_add16_i32(TCGv_i32 ret, TCGv_i32 a, TCGv_i32 b)
+{
+    tcg_gen_vec_add_mask_i32(ret, a, b, 0x80008000u);
+}
+
+static inline void tcg_gen_vec_sub8_i32(TCGv_i32 ret, TCGv_i32 a, TCGv_i32 b)
+{
+    tcg_gen_vec_sub_mask_i32(ret, a, b, 0x80808080u);
+}
+
+static inline void tcg_gen_vec_sub16_i32(TCGv_i32 ret, TCGv_i32 a, TCGv_i32 b)
+{
+    tcg_gen_vec_sub_mask_i32(ret, a, b, 0x80008000u);
+}
+
+static inline void tcg_gen_vec_add8_i64(TCGv_i64 ret, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_vec_add_mask_i64(ret, a, b, 0x8080808080808080ull);
+}
+
+static inline void tcg_gen_vec_add16_i64(TCGv_i64 ret, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_vec_add_mask_i64(ret, a, b, 0x8000800080008000ull);
+}
+
+static inline void tcg_gen_vec_add32_i64(TCGv_i64 ret, TCGv_i64 a, TCGv_i64 b)
+{
+#if TCG_TARGET_REG_BITS == 32
+    tcg_gen_add_i32(TCGV_LOW(ret), TCGV_LOW(a), TCGV_LOW(b));
+    tcg_gen_add_i32(TCGV_HIGH(ret), TCGV_HIGH(a), TCGV_HIGH(b));
+#else
+    tcg_gen_vec_add_mask_i64(ret, a, b, 0x8000000080000000ull);
+#endif
+}
+
+static inline void tcg_gen_vec_sub8_i64(TCGv_i64 ret, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_vec_sub_mask_i64(ret, a, b, 0x8080808080808080ull);
+}
+
+static inline void tcg_gen_vec_sub16_i64(TCGv_i64 ret, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_vec_sub_mask_i64(ret, a, b, 0x8000800080008000ull);
+}
+
+static inline void tcg_gen_vec_sub32_i64(TCGv_i64 ret, TCGv_i64 a, TCGv_i64 b)
+{
+#if TCG_TARGET_REG_BITS == 32
+    tcg_gen_sub_i32(TCGV_LOW(ret), TCGV_LOW(a), TCGV_LOW(b));
+    tcg_gen_sub_i32(TCGV_HIGH(ret), TCGV_HIGH(a), TCGV_HIGH(b));
+#else
+    tcg_gen_vec_sub_mask_i64(ret, a, b, 0x8000000080000000ull);
+#endif
+}
+
 /***************************************/
 /* QEMU specific operations. Their type depend on the QEMU CPU
    type. */
@@ -2171,6 +2313,16 @@ static inline void tcg_gen_goto_tb(int idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+/* Only valid if TCG_TARGET_HAS_goto_ptr.  */
+static inline void tcg_gen_goto_ptr(TCGv_ptr ptr)
+{
+#if TCG_TARGET_REG_BITS == 32
+    tcg_gen_op1_i32(INDEX_op_goto_ptr, TCGV_PTR_TO_NAT(ptr));
+#else
+    tcg_gen_op1_i64(INDEX_op_goto_ptr, TCGV_PTR_TO_NAT(ptr));
+#endif
+}
+
 #if TCG_TARGET_REG_BITS == 32
 static inline void tcg_gen_qemu_ld8u(TCGv ret, TCGv addr, int mem_index)
 {
@@ -71,6 +71,9 @@ static void tcg_target_init(TCGContext *s);
 static void tcg_target_qemu_prologue(TCGContext *s);
 static void patch_reloc(uint8_t *code_ptr, int type, 
                         tcg_target_long value, tcg_target_long addend);
+#ifdef CONFIG_QEMU_LDST_OPTIMIZATION
+static void tcg_out_qemu_ldst_slow_paths(TCGContext *s);
+#endif
 
 static void tcg_register_jit_int(void *buf, size_t size,
                                  void *debug_frame, size_t debug_frame_size)
@@ -1199,21 +1202,12 @@ static inline void tcg_la_func_end(TCGContext *s, uint8_t *dead_temps)
 }
 
 /* liveness analysis: end of basic block: globals are live, temps are
-   dead, local temps are live. */
-static inline void tcg_la_bb_end(TCGContext *s, uint8_t *dead_temps)
+   dead, local temps are live.  That state is computed once per TB in
+   bb_end_temps and copied at each basic block end. */
+static inline void tcg_la_bb_end(TCGContext *s, uint8_t *dead_temps,
+                                 const uint8_t *bb_end_temps)
 {
-    int i;
-    TCGTemp *ts;
-
-    memset(dead_temps, 0, s->nb_globals);
-    ts = &s->temps[s->nb_globals];
-    for(i = s->nb_globals; i < s->nb_temps; i++) {
-        if (ts->temp_local)
-            dead_temps[i] = 0;
-        else
-            dead_temps[i] = 1;
-        ts++;
-    }
+    memcpy(dead_temps, bb_end_temps, s->nb_temps);
 }
 
 /* Liveness analysis : update the opc_dead_args array to tell if a
@@ -1225,7 +1219,7 @@ static void tcg_liveness_analysis(TCGContext *s)
     TCGOpcode op;
     TCGArg *args;
     const TCGOpDef *def;
-    uint8_t *dead_temps;
+    uint8_t *dead_temps, *bb_end_temps;
     unsigned int dead_args;
     
     gen_opc_ptr++; /* skip end */
@@ -1237,6 +1231,12 @@ static void tcg_liveness_analysis(TCGContext *s)
     dead_temps = tcg_malloc(s->nb_temps);
     memset(dead_temps, 1, s->nb_temps);
 
+    bb_end_temps = tcg_malloc(s->nb_temps);
+    memset(bb_end_temps, 0, s->nb_globals);
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        bb_end_temps[i] = !s->temps[i].temp_local;
+    }
+
     args = gen_opparam_ptr;
     op_index = nb_ops - 1;
     while (op_index >= 0) {
@@ -1300,7 +1300,7 @@ static void tcg_liveness_analysis(TCGContext *s)
         case INDEX_op_set_label:
             args--;
             /* mark end of basic block */
-            tcg_la_bb_end(s, dead_temps);
+            tcg_la_bb_end(s, dead_temps, bb_end_temps);
             break;
         case INDEX_op_debug_insn_start:
             args -= def->nb_args;
@@ -1350,7 +1350,7 @@ static void tcg_liveness_analysis(TCGContext *s)
 
                 /* if end of basic block, update */
                 if (def->flags & TCG_OPF_BB_END) {
-                    tcg_la_bb_end(s, dead_temps);
+                    tcg_la_bb_end(s, dead_temps, bb_end_temps);
                 } else if (def->flags & TCG_OPF_CALL_CLOBBER) {
                     /* globals are live */
                     memset(dead_temps, 0, s->nb_globals);
@@ -1570,6 +1570,29 @@ static void save_globals(TCGContext *s, TCGRegSet allocated_regs)
     }
 }
 
+/* write back the globals whose register copy is newer than their
+   canonical location, but keep them in registers */
+static void sync_globals(TCGContext *s, TCGRegSet allocated_regs)
+{
+    TCGTemp *ts;
+    int i;
+
+    for(i = 0; i < s->nb_globals; i++) {
+        ts = &s->temps[i];
+        if (ts->fixed_reg) {
+            continue;
+        }
+        if (ts->val_type == TEMP_VAL_REG) {
+            if (!ts->mem_coherent) {
+                tcg_out_st(s, ts->type, ts->reg, ts->mem_reg, ts->mem_offset);
+                ts->mem_coherent = 1;
+            }
+        } else {
+            temp_save(s, i, allocated_regs);
+        }
+    }
+}
+
 /* at the end of a basic block, we assume all temporaries are dead and
    all globals are stored at their canonical location. */
 static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
@@ -1991,9 +2014,16 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
     }
     
     /* store globals and free associated registers (we assume the call
-       can modify any global. */
+       can modify any global, unless told otherwise). */
     if (!(flags & TCG_CALL_CONST)) {
-        save_globals(s, allocated_regs);
+        if (flags & (TCG_CALL_PURE | TCG_CALL_NO_WRITE_GLOBALS)) {
+            sync_globals(s, allocated_regs);
+#ifdef CONFIG_PROFILER
+            s->sync_call_count++;
+#endif
+        } else {
+            save_globals(s, allocated_regs);
+        }
     }
 
     tcg_out_op(s, opc, &func_arg, &const_func_arg);
@@ -2084,6 +2114,10 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
 
     s->code_buf = gen_code_buf;
     s->code_ptr = gen_code_buf;
+    s->nb_search_ops = 0;
+#ifdef CONFIG_QEMU_LDST_OPTIMIZATION
+    s->nb_qemu_ldst_labels = 0;
+#endif
 
     args = gen_opparam_buf;
     op_index = 0;
@@ -2163,12 +2197,24 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
         if (search_pc >= 0 && search_pc < s->code_ptr - gen_code_buf) {
             return op_index;
         }
+        if (search_pc < 0 &&
+            s->code_ptr - gen_code_buf > (s->nb_search_ops ?
+                s->search_code_end[s->nb_search_ops - 1] : 0)) {
+            s->search_op_index[s->nb_search_ops] = op_index;
+            s->search_code_end[s->nb_search_ops] = s->code_ptr - gen_code_buf;
+            s->nb_search_ops++;
+        }
         op_index++;
 #ifndef NDEBUG
         check_regs(s);
 #endif
     }
  the_end:
+#ifdef CONFIG_QEMU_LDST_OPTIMIZATION
+    if (search_pc < 0) {
+        tcg_out_qemu_ldst_slow_paths(s);
+    }
+#endif
     return -1;
 }
 
@@ -2206,6 +2252,74 @@ int tcg_gen_code_search_pc(TCGContext *s, uint8_t *gen_code_buf, long offset)
     return tcg_gen_code_common(s, gen_code_buf, offset);
 }
 
+static uint8_t *tcg_encode_uleb128(uint8_t *p, uint8_t *end, uint32_t val)
+{
+    do {
+        if (p == end) {
+            return NULL;
+        }
+        *p++ = (val & 0x7f) | (val >= 0x80 ? 0x80 : 0);
+        val >>= 7;
+    } while (val);
+    return p;
+}
+
+static uint32_t tcg_decode_uleb128(const uint8_t **pp)
+{
+    const uint8_t *p = *pp;
+    uint32_t val = 0;
+    int shift = 0;
+
+    do {
+        val |= (uint32_t)(*p & 0x7f) << shift;
+        shift += 7;
+    } while (*p++ & 0x80);
+    *pp = p;
+    return val;
+}
+
+/* Store at buf what tcg_search_pc() needs to find the op of an offset in
+   the code generated by the last tcg_gen_code(), so that it doesn't have
+   to be generated again.  Returns the number of bytes used, or -1 if more
+   than size would be needed.  The format is the number of entries and, for
+   each op after which the code grew, the increments of its index and of
+   the code size, all as ULEB128.  */
+int tcg_encode_search_pc(TCGContext *s, uint8_t *buf, long size)
+{
+    uint8_t *p = buf, *end = buf + size;
+    uint32_t last_op = 0, last_end = 0;
+    int i;
+
+    p = tcg_encode_uleb128(p, end, s->nb_search_ops);
+    for (i = 0; p && i < s->nb_search_ops; i++) {
+        p = tcg_encode_uleb128(p, end, s->search_op_index[i] - last_op);
+        if (p) {
+            p = tcg_encode_uleb128(p, end, s->search_code_end[i] - last_end);
+        }
+        last_op = s->search_op_index[i];
+        last_end = s->search_code_end[i];
+    }
+    return p ? p - buf : -1;
+}
+
+/* Same as tcg_gen_code_search_pc(), from the data of
+   tcg_encode_search_pc().  */
+int tcg_search_pc(const uint8_t *data, long offset)
+{
+    uint32_t op_index = 0, code_end = 0;
+    int n;
+
+    n = tcg_decode_uleb128(&data);
+    while (n-- > 0) {
+        op_index += tcg_decode_uleb128(&data);
+        code_end += tcg_decode_uleb128(&data);
+        if (offset < code_end) {
+            return op_index;
+        }
+    }
+    return -1;
+}
+
 #ifdef CONFIG_PROFILER
 void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
 {
@@ -2224,6 +2338,12 @@ void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
     cpu_fprintf(f, "deleted ops/TB      %0.2f\n",
                 s->tb_count ? 
                 (double)s->del_op_count / s->tb_count : 0);
+    cpu_fprintf(f, "dead env stores/TB  %0.2f\n",
+                s->tb_count ?
+                (double)s->del_st_count / s->tb_count : 0);
+    cpu_fprintf(f, "syncing calls/TB    %0.2f\n",
+                s->tb_count ?
+                (double)s->sync_call_count / s->tb_count : 0);
     cpu_fprintf(f, "avg temps/TB        %0.2f max=%d\n",
                 s->tb_count ? 
                 (double)s->temp_count / s->tb_count : 0,
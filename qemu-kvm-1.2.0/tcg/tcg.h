@@ -133,6 +133,24 @@ typedef struct TCGLabel {
     } u;
 } TCGLabel;
 
+#ifdef CONFIG_QEMU_LDST_OPTIMIZATION
+/* A qemu_ld/st op whose TLB miss path is emitted at the end of the TB.  */
+typedef struct TCGLabelQemuLdst {
+    int is_ld;
+    int opc;            /* log2 of the size, plus 4 for sign extension */
+    int addrlo_reg;
+    int addrhi_reg;
+    int datalo_reg;
+    int datahi_reg;
+    int mem_index;
+    uint8_t *raddr;     /* fast path code following the access */
+    uint8_t *label_ptr[2]; /* displacements of the jumps to the miss path */
+} TCGLabelQemuLdst;
+
+/* at most one per op (OPC_BUF_SIZE) */
+#define TCG_MAX_QEMU_LDST 640
+#endif
+
 typedef struct TCGPool {
     struct TCGPool *next;
     int size;
@@ -141,6 +159,9 @@ typedef struct TCGPool {
 
 #define TCG_POOL_CHUNK_SIZE 32768
 
+/* at most one per op (OPC_BUF_SIZE) */
+#define TCG_MAX_SEARCH_OPS 640
+
 #define TCG_MAX_LABELS 512
 
 #define TCG_MAX_TEMPS 512
@@ -260,6 +281,11 @@ typedef int TCGv_i64;
    global variables. Hence a call to such a function does not
    save TCG global variables back to their canonical location. */
 #define TCG_CALL_CONST          0x0020
+/* The function may read TCG global variables but never writes them.
+   Hence globals are written back to their canonical location before the
+   call but stay valid in registers after it.  TCG_CALL_PURE implies
+   it. */
+#define TCG_CALL_NO_WRITE_GLOBALS 0x0040
 
 /* used to align parameters */
 #define TCG_CALL_DUMMY_TCGV     MAKE_TCGV_I32(-1)
@@ -361,8 +387,20 @@ struct TCGContext {
     int frame_reg;
 
     uint8_t *code_ptr;
+    /* ops after which the code grew, and by then its size, for
+       tcg_encode_search_pc() */
+    int nb_search_ops;
+    uint16_t search_op_index[TCG_MAX_SEARCH_OPS];
+    uint32_t search_code_end[TCG_MAX_SEARCH_OPS];
+    /* exit path returning 0, the target of goto_ptr on a lookup miss */
+    uint8_t *code_gen_epilogue;
     TCGTemp static_temps[TCG_MAX_TEMPS];
 
+#ifdef CONFIG_QEMU_LDST_OPTIMIZATION
+    TCGLabelQemuLdst qemu_ldst_labels[TCG_MAX_QEMU_LDST];
+    int nb_qemu_ldst_labels;
+#endif
+
     TCGHelperInfo *helpers;
     int nb_helpers;
     int allocated_helpers;
@@ -377,6 +415,8 @@ struct TCGContext {
     int64_t temp_count;
     int temp_count_max;
     int64_t del_op_count;
+    int64_t del_st_count; /* env stores removed by the optimizer */
+    int64_t sync_call_count; /* calls that kept globals in registers */
     int64_t code_in_len;
     int64_t code_out_len;
     int64_t interm_time;
@@ -424,6 +464,8 @@ void tcg_func_start(TCGContext *s);
 
 int tcg_gen_code(TCGContext *s, uint8_t *gen_code_buf);
 int tcg_gen_code_search_pc(TCGContext *s, uint8_t *gen_code_buf, long offset);
+int tcg_encode_search_pc(TCGContext *s, uint8_t *buf, long size);
+int tcg_search_pc(const uint8_t *data, long offset);
 
 void tcg_set_frame(TCGContext *s, int reg,
                    tcg_target_long start, tcg_target_long size);
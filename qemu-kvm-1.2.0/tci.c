@@ -439,59 +439,284 @@ static bool tci_compare64(uint64_t u0, uint64_t u1, TCGCond condition)
     return result;
 }
 
+/* Read the opcode and size entry of the next op and skip them. */
+#if defined(GETPC)
+# define TCI_SET_TB_PTR() (tci_tb_ptr = (uintptr_t)tb_ptr)
+#else
+# define TCI_SET_TB_PTR() ((void)0)
+#endif
+#if !defined(NDEBUG)
+# define TCI_FETCH() \
+    do { \
+        TCI_SET_TB_PTR(); \
+        opc = tb_ptr[0]; \
+        op_size = tb_ptr[1]; \
+        old_code_ptr = tb_ptr; \
+        tb_ptr += 2; \
+    } while (0)
+# define TCI_CHECK_SIZE() assert(tb_ptr == old_code_ptr + op_size)
+#else
+# define TCI_FETCH() \
+    do { \
+        TCI_SET_TB_PTR(); \
+        opc = tb_ptr[0]; \
+        tb_ptr += 2; \
+    } while (0)
+# define TCI_CHECK_SIZE() ((void)0)
+#endif
+
+/* With GCC, each handler jumps directly to the handler of the next op
+   through a table of label addresses (threaded code) instead of going
+   back to the single indirect jump of the switch.  Every handler then
+   has its own, much better predicted, dispatch branch.  The switch is
+   still used to enter the first op of a TB and for non-GCC compilers;
+   define CONFIG_TCI_SWITCH to use it exclusively, e.g. for comparing
+   both with tests/tcg "make speed".  */
+#if defined(__GNUC__) && !defined(CONFIG_TCI_SWITCH)
+# define TCI_THREADED
+#endif
+
+#if defined(TCI_THREADED)
+# define TCI_LABEL(op) [op] = &&tci_label_##op
+# define TCI_CASE(op) case op: tci_label_##op
+# define TCI_CASE_DEFAULT default: tci_label_default
+# define TCI_DISPATCH() \
+    do { \
+        TCI_FETCH(); \
+        goto *tci_labels[opc]; \
+    } while (0)
+# define TCI_NEXT() \
+    do { \
+        TCI_CHECK_SIZE(); \
+        TCI_DISPATCH(); \
+    } while (0)
+#else
+# define TCI_CASE(op) case op
+# define TCI_CASE_DEFAULT default
+# define TCI_DISPATCH() continue
+# define TCI_NEXT() break
+#endif
+
 /* Interpret pseudo code in tb. */
 tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
 {
     tcg_target_ulong next_tb = 0;
-
-    env = cpustate;
-    tci_reg[TCG_AREG0] = (tcg_target_ulong)env;
-    assert(tb_ptr);
-
-    for (;;) {
-#if defined(GETPC)
-        tci_tb_ptr = (uintptr_t)tb_ptr;
-#endif
-        TCGOpcode opc = tb_ptr[0];
+    TCGOpcode opc;
 #if !defined(NDEBUG)
-        uint8_t op_size = tb_ptr[1];
-        uint8_t *old_code_ptr = tb_ptr;
-#endif
-        tcg_target_ulong t0;
-        tcg_target_ulong t1;
-        tcg_target_ulong t2;
-        tcg_target_ulong label;
-        TCGCond condition;
-        target_ulong taddr;
+    uint8_t op_size;
+    uint8_t *old_code_ptr;
+#endif
+    tcg_target_ulong t0;
+    tcg_target_ulong t1;
+    tcg_target_ulong t2;
+    tcg_target_ulong label;
+    TCGCond condition;
+    target_ulong taddr;
 #ifndef CONFIG_SOFTMMU
-        tcg_target_ulong host_addr;
+    tcg_target_ulong host_addr;
 #endif
-        uint8_t tmp8;
-        uint16_t tmp16;
-        uint32_t tmp32;
-        uint64_t tmp64;
+    uint8_t tmp8;
+    uint16_t tmp16;
+    uint32_t tmp32;
+    uint64_t tmp64;
 #if TCG_TARGET_REG_BITS == 32
-        uint64_t v64;
+    uint64_t v64;
+#endif
+#if defined(TCI_THREADED)
+    static const void *const tci_labels[NB_OPS] = {
+        [0 ... NB_OPS - 1] = &&tci_label_default,
+        TCI_LABEL(INDEX_op_end),
+        TCI_LABEL(INDEX_op_nop),
+        TCI_LABEL(INDEX_op_nop1),
+        TCI_LABEL(INDEX_op_nop2),
+        TCI_LABEL(INDEX_op_nop3),
+        TCI_LABEL(INDEX_op_nopn),
+        TCI_LABEL(INDEX_op_discard),
+        TCI_LABEL(INDEX_op_set_label),
+        TCI_LABEL(INDEX_op_call),
+        TCI_LABEL(INDEX_op_jmp),
+        TCI_LABEL(INDEX_op_br),
+        TCI_LABEL(INDEX_op_setcond_i32),
+#if TCG_TARGET_REG_BITS == 32
+        TCI_LABEL(INDEX_op_setcond2_i32),
+#elif TCG_TARGET_REG_BITS == 64
+        TCI_LABEL(INDEX_op_setcond_i64),
+#endif
+        TCI_LABEL(INDEX_op_mov_i32),
+        TCI_LABEL(INDEX_op_movi_i32),
+        TCI_LABEL(INDEX_op_ld8u_i32),
+        TCI_LABEL(INDEX_op_ld8s_i32),
+        TCI_LABEL(INDEX_op_ld16u_i32),
+        TCI_LABEL(INDEX_op_ld16s_i32),
+        TCI_LABEL(INDEX_op_ld_i32),
+        TCI_LABEL(INDEX_op_st8_i32),
+        TCI_LABEL(INDEX_op_st16_i32),
+        TCI_LABEL(INDEX_op_st_i32),
+        TCI_LABEL(INDEX_op_add_i32),
+        TCI_LABEL(INDEX_op_sub_i32),
+        TCI_LABEL(INDEX_op_mul_i32),
+#if TCG_TARGET_HAS_div_i32
+        TCI_LABEL(INDEX_op_div_i32),
+        TCI_LABEL(INDEX_op_divu_i32),
+        TCI_LABEL(INDEX_op_rem_i32),
+        TCI_LABEL(INDEX_op_remu_i32),
+#elif TCG_TARGET_HAS_div2_i32
+        TCI_LABEL(INDEX_op_div2_i32),
+        TCI_LABEL(INDEX_op_divu2_i32),
+#endif
+        TCI_LABEL(INDEX_op_and_i32),
+        TCI_LABEL(INDEX_op_or_i32),
+        TCI_LABEL(INDEX_op_xor_i32),
+        TCI_LABEL(INDEX_op_shl_i32),
+        TCI_LABEL(INDEX_op_shr_i32),
+        TCI_LABEL(INDEX_op_sar_i32),
+#if TCG_TARGET_HAS_rot_i32
+        TCI_LABEL(INDEX_op_rotl_i32),
+        TCI_LABEL(INDEX_op_rotr_i32),
+#endif
+        TCI_LABEL(INDEX_op_brcond_i32),
+#if TCG_TARGET_REG_BITS == 32
+        TCI_LABEL(INDEX_op_add2_i32),
+        TCI_LABEL(INDEX_op_sub2_i32),
+        TCI_LABEL(INDEX_op_brcond2_i32),
+        TCI_LABEL(INDEX_op_mulu2_i32),
+#endif /* TCG_TARGET_REG_BITS == 32 */
+#if TCG_TARGET_HAS_ext8s_i32
+        TCI_LABEL(INDEX_op_ext8s_i32),
+#endif
+#if TCG_TARGET_HAS_ext16s_i32
+        TCI_LABEL(INDEX_op_ext16s_i32),
+#endif
+#if TCG_TARGET_HAS_ext8u_i32
+        TCI_LABEL(INDEX_op_ext8u_i32),
+#endif
+#if TCG_TARGET_HAS_ext16u_i32
+        TCI_LABEL(INDEX_op_ext16u_i32),
+#endif
+#if TCG_TARGET_HAS_bswap16_i32
+        TCI_LABEL(INDEX_op_bswap16_i32),
+#endif
+#if TCG_TARGET_HAS_bswap32_i32
+        TCI_LABEL(INDEX_op_bswap32_i32),
+#endif
+#if TCG_TARGET_HAS_not_i32
+        TCI_LABEL(INDEX_op_not_i32),
+#endif
+#if TCG_TARGET_HAS_neg_i32
+        TCI_LABEL(INDEX_op_neg_i32),
+#endif
+#if TCG_TARGET_REG_BITS == 64
+        TCI_LABEL(INDEX_op_mov_i64),
+        TCI_LABEL(INDEX_op_movi_i64),
+        TCI_LABEL(INDEX_op_ld8u_i64),
+        TCI_LABEL(INDEX_op_ld8s_i64),
+        TCI_LABEL(INDEX_op_ld16u_i64),
+        TCI_LABEL(INDEX_op_ld16s_i64),
+        TCI_LABEL(INDEX_op_ld32u_i64),
+        TCI_LABEL(INDEX_op_ld32s_i64),
+        TCI_LABEL(INDEX_op_ld_i64),
+        TCI_LABEL(INDEX_op_st8_i64),
+        TCI_LABEL(INDEX_op_st16_i64),
+        TCI_LABEL(INDEX_op_st32_i64),
+        TCI_LABEL(INDEX_op_st_i64),
+        TCI_LABEL(INDEX_op_add_i64),
+        TCI_LABEL(INDEX_op_sub_i64),
+        TCI_LABEL(INDEX_op_mul_i64),
+#if TCG_TARGET_HAS_div_i64
+        TCI_LABEL(INDEX_op_div_i64),
+        TCI_LABEL(INDEX_op_divu_i64),
+        TCI_LABEL(INDEX_op_rem_i64),
+        TCI_LABEL(INDEX_op_remu_i64),
+#elif TCG_TARGET_HAS_div2_i64
+        TCI_LABEL(INDEX_op_div2_i64),
+        TCI_LABEL(INDEX_op_divu2_i64),
+#endif
+        TCI_LABEL(INDEX_op_and_i64),
+        TCI_LABEL(INDEX_op_or_i64),
+        TCI_LABEL(INDEX_op_xor_i64),
+        TCI_LABEL(INDEX_op_shl_i64),
+        TCI_LABEL(INDEX_op_shr_i64),
+        TCI_LABEL(INDEX_op_sar_i64),
+#if TCG_TARGET_HAS_rot_i64
+        TCI_LABEL(INDEX_op_rotl_i64),
+        TCI_LABEL(INDEX_op_rotr_i64),
+#endif
+        TCI_LABEL(INDEX_op_brcond_i64),
+#if TCG_TARGET_HAS_ext8u_i64
+        TCI_LABEL(INDEX_op_ext8u_i64),
+#endif
+#if TCG_TARGET_HAS_ext8s_i64
+        TCI_LABEL(INDEX_op_ext8s_i64),
+#endif
+#if TCG_TARGET_HAS_ext16s_i64
+        TCI_LABEL(INDEX_op_ext16s_i64),
+#endif
+#if TCG_TARGET_HAS_ext16u_i64
+        TCI_LABEL(INDEX_op_ext16u_i64),
+#endif
+#if TCG_TARGET_HAS_ext32s_i64
+        TCI_LABEL(INDEX_op_ext32s_i64),
+#endif
+#if TCG_TARGET_HAS_ext32u_i64
+        TCI_LABEL(INDEX_op_ext32u_i64),
+#endif
+#if TCG_TARGET_HAS_bswap16_i64
+        TCI_LABEL(INDEX_op_bswap16_i64),
+#endif
+#if TCG_TARGET_HAS_bswap32_i64
+        TCI_LABEL(INDEX_op_bswap32_i64),
+#endif
+#if TCG_TARGET_HAS_bswap64_i64
+        TCI_LABEL(INDEX_op_bswap64_i64),
+#endif
+#if TCG_TARGET_HAS_not_i64
+        TCI_LABEL(INDEX_op_not_i64),
+#endif
+#if TCG_TARGET_HAS_neg_i64
+        TCI_LABEL(INDEX_op_neg_i64),
+#endif
+#endif /* TCG_TARGET_REG_BITS == 64 */
+        TCI_LABEL(INDEX_op_debug_insn_start),
+        TCI_LABEL(INDEX_op_exit_tb),
+        TCI_LABEL(INDEX_op_goto_tb),
+        TCI_LABEL(INDEX_op_qemu_ld8u),
+        TCI_LABEL(INDEX_op_qemu_ld8s),
+        TCI_LABEL(INDEX_op_qemu_ld16u),
+        TCI_LABEL(INDEX_op_qemu_ld16s),
+#if TCG_TARGET_REG_BITS == 64
+        TCI_LABEL(INDEX_op_qemu_ld32u),
+        TCI_LABEL(INDEX_op_qemu_ld32s),
+#endif /* TCG_TARGET_REG_BITS == 64 */
+        TCI_LABEL(INDEX_op_qemu_ld32),
+        TCI_LABEL(INDEX_op_qemu_ld64),
+        TCI_LABEL(INDEX_op_qemu_st8),
+        TCI_LABEL(INDEX_op_qemu_st16),
+        TCI_LABEL(INDEX_op_qemu_st32),
+        TCI_LABEL(INDEX_op_qemu_st64),
+    };
 #endif
 
-        /* Skip opcode and size entry. */
-        tb_ptr += 2;
+    env = cpustate;
+    tci_reg[TCG_AREG0] = (tcg_target_ulong)env;
+    assert(tb_ptr);
 
+    for (;;) {
+        TCI_FETCH();
         switch (opc) {
-        case INDEX_op_end:
-        case INDEX_op_nop:
-            break;
-        case INDEX_op_nop1:
-        case INDEX_op_nop2:
-        case INDEX_op_nop3:
-        case INDEX_op_nopn:
-        case INDEX_op_discard:
+        TCI_CASE(INDEX_op_end):
+        TCI_CASE(INDEX_op_nop):
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_nop1):
+        TCI_CASE(INDEX_op_nop2):
+        TCI_CASE(INDEX_op_nop3):
+        TCI_CASE(INDEX_op_nopn):
+        TCI_CASE(INDEX_op_discard):
             TODO();
-            break;
-        case INDEX_op_set_label:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_set_label):
             TODO();
-            break;
-        case INDEX_op_call:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_call):
             t0 = tci_read_ri(&tb_ptr);
 #if TCG_TARGET_REG_BITS == 32
             tmp64 = ((helper_function)t0)(tci_read_reg(TCG_REG_R0),
@@ -511,193 +736,193 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
                                           tci_read_reg(TCG_REG_R3));
             tci_write_reg(TCG_REG_R0, tmp64);
 #endif
-            break;
-        case INDEX_op_jmp:
-        case INDEX_op_br:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_jmp):
+        TCI_CASE(INDEX_op_br):
             label = tci_read_label(&tb_ptr);
             assert(tb_ptr == old_code_ptr + op_size);
             tb_ptr = (uint8_t *)label;
-            continue;
-        case INDEX_op_setcond_i32:
+            TCI_DISPATCH();
+        TCI_CASE(INDEX_op_setcond_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             condition = *tb_ptr++;
             tci_write_reg32(t0, tci_compare32(t1, t2, condition));
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_REG_BITS == 32
-        case INDEX_op_setcond2_i32:
+        TCI_CASE(INDEX_op_setcond2_i32):
             t0 = *tb_ptr++;
             tmp64 = tci_read_r64(&tb_ptr);
             v64 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
             tci_write_reg32(t0, tci_compare64(tmp64, v64, condition));
-            break;
+            TCI_NEXT();
 #elif TCG_TARGET_REG_BITS == 64
-        case INDEX_op_setcond_i64:
+        TCI_CASE(INDEX_op_setcond_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
             tci_write_reg64(t0, tci_compare64(t1, t2, condition));
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_mov_i32:
+        TCI_CASE(INDEX_op_mov_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
-        case INDEX_op_movi_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_movi_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_i32(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            TCI_NEXT();
 
             /* Load/store operations (32 bit). */
 
-        case INDEX_op_ld8u_i32:
+        TCI_CASE(INDEX_op_ld8u_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             tci_write_reg8(t0, *(uint8_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld8s_i32:
-        case INDEX_op_ld16u_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_ld8s_i32):
+        TCI_CASE(INDEX_op_ld16u_i32):
             TODO();
-            break;
-        case INDEX_op_ld16s_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_ld16s_i32):
             TODO();
-            break;
-        case INDEX_op_ld_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_ld_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             tci_write_reg32(t0, *(uint32_t *)(t1 + t2));
-            break;
-        case INDEX_op_st8_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_st8_i32):
             t0 = tci_read_r8(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             *(uint8_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st16_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_st16_i32):
             t0 = tci_read_r16(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             *(uint16_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_st_i32):
             t0 = tci_read_r32(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             *(uint32_t *)(t1 + t2) = t0;
-            break;
+            TCI_NEXT();
 
             /* Arithmetic operations (32 bit). */
 
-        case INDEX_op_add_i32:
+        TCI_CASE(INDEX_op_add_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 + t2);
-            break;
-        case INDEX_op_sub_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_sub_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 - t2);
-            break;
-        case INDEX_op_mul_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_mul_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 * t2);
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_HAS_div_i32
-        case INDEX_op_div_i32:
+        TCI_CASE(INDEX_op_div_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, (int32_t)t1 / (int32_t)t2);
-            break;
-        case INDEX_op_divu_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_divu_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 / t2);
-            break;
-        case INDEX_op_rem_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_rem_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, (int32_t)t1 % (int32_t)t2);
-            break;
-        case INDEX_op_remu_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_remu_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 % t2);
-            break;
+            TCI_NEXT();
 #elif TCG_TARGET_HAS_div2_i32
-        case INDEX_op_div2_i32:
-        case INDEX_op_divu2_i32:
+        TCI_CASE(INDEX_op_div2_i32):
+        TCI_CASE(INDEX_op_divu2_i32):
             TODO();
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_and_i32:
+        TCI_CASE(INDEX_op_and_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 & t2);
-            break;
-        case INDEX_op_or_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_or_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 | t2);
-            break;
-        case INDEX_op_xor_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_xor_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 ^ t2);
-            break;
+            TCI_NEXT();
 
             /* Shift/rotate operations (32 bit). */
 
-        case INDEX_op_shl_i32:
+        TCI_CASE(INDEX_op_shl_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 << t2);
-            break;
-        case INDEX_op_shr_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_shr_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 >> t2);
-            break;
-        case INDEX_op_sar_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_sar_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, ((int32_t)t1 >> t2));
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_HAS_rot_i32
-        case INDEX_op_rotl_i32:
+        TCI_CASE(INDEX_op_rotl_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, (t1 << t2) | (t1 >> (32 - t2)));
-            break;
-        case INDEX_op_rotr_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_rotr_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, (t1 >> t2) | (t1 << (32 - t2)));
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_brcond_i32:
+        TCI_CASE(INDEX_op_brcond_i32):
             t0 = tci_read_r32(&tb_ptr);
             t1 = tci_read_ri32(&tb_ptr);
             condition = *tb_ptr++;
@@ -705,25 +930,25 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             if (tci_compare32(t0, t1, condition)) {
                 assert(tb_ptr == old_code_ptr + op_size);
                 tb_ptr = (uint8_t *)label;
-                continue;
+                TCI_DISPATCH();
             }
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_REG_BITS == 32
-        case INDEX_op_add2_i32:
+        TCI_CASE(INDEX_op_add2_i32):
             t0 = *tb_ptr++;
             t1 = *tb_ptr++;
             tmp64 = tci_read_r64(&tb_ptr);
             tmp64 += tci_read_r64(&tb_ptr);
             tci_write_reg64(t1, t0, tmp64);
-            break;
-        case INDEX_op_sub2_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_sub2_i32):
             t0 = *tb_ptr++;
             t1 = *tb_ptr++;
             tmp64 = tci_read_r64(&tb_ptr);
             tmp64 -= tci_read_r64(&tb_ptr);
             tci_write_reg64(t1, t0, tmp64);
-            break;
-        case INDEX_op_brcond2_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_brcond2_i32):
             tmp64 = tci_read_r64(&tb_ptr);
             v64 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
@@ -731,220 +956,220 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             if (tci_compare64(tmp64, v64, condition)) {
                 assert(tb_ptr == old_code_ptr + op_size);
                 tb_ptr = (uint8_t *)label;
-                continue;
+                TCI_DISPATCH();
             }
-            break;
-        case INDEX_op_mulu2_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_mulu2_i32):
             t0 = *tb_ptr++;
             t1 = *tb_ptr++;
             t2 = tci_read_r32(&tb_ptr);
             tmp64 = tci_read_r32(&tb_ptr);
             tci_write_reg64(t1, t0, t2 * tmp64);
-            break;
+            TCI_NEXT();
 #endif /* TCG_TARGET_REG_BITS == 32 */
 #if TCG_TARGET_HAS_ext8s_i32
-        case INDEX_op_ext8s_i32:
+        TCI_CASE(INDEX_op_ext8s_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r8s(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16s_i32
-        case INDEX_op_ext16s_i32:
+        TCI_CASE(INDEX_op_ext16s_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r16s(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext8u_i32
-        case INDEX_op_ext8u_i32:
+        TCI_CASE(INDEX_op_ext8u_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r8(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16u_i32
-        case INDEX_op_ext16u_i32:
+        TCI_CASE(INDEX_op_ext16u_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap16_i32
-        case INDEX_op_bswap16_i32:
+        TCI_CASE(INDEX_op_bswap16_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg32(t0, bswap16(t1));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap32_i32
-        case INDEX_op_bswap32_i32:
+        TCI_CASE(INDEX_op_bswap32_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, bswap32(t1));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_not_i32
-        case INDEX_op_not_i32:
+        TCI_CASE(INDEX_op_not_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, ~t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_neg_i32
-        case INDEX_op_neg_i32:
+        TCI_CASE(INDEX_op_neg_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, -t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_REG_BITS == 64
-        case INDEX_op_mov_i64:
+        TCI_CASE(INDEX_op_mov_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
-        case INDEX_op_movi_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_movi_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_i64(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 
             /* Load/store operations (64 bit). */
 
-        case INDEX_op_ld8u_i64:
+        TCI_CASE(INDEX_op_ld8u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             tci_write_reg8(t0, *(uint8_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld8s_i64:
-        case INDEX_op_ld16u_i64:
-        case INDEX_op_ld16s_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_ld8s_i64):
+        TCI_CASE(INDEX_op_ld16u_i64):
+        TCI_CASE(INDEX_op_ld16s_i64):
             TODO();
-            break;
-        case INDEX_op_ld32u_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_ld32u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             tci_write_reg32(t0, *(uint32_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld32s_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_ld32s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             tci_write_reg32s(t0, *(int32_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_ld_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             tci_write_reg64(t0, *(uint64_t *)(t1 + t2));
-            break;
-        case INDEX_op_st8_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_st8_i64):
             t0 = tci_read_r8(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             *(uint8_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st16_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_st16_i64):
             t0 = tci_read_r16(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             *(uint16_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st32_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_st32_i64):
             t0 = tci_read_r32(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             *(uint32_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_st_i64):
             t0 = tci_read_r64(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             *(uint64_t *)(t1 + t2) = t0;
-            break;
+            TCI_NEXT();
 
             /* Arithmetic operations (64 bit). */
 
-        case INDEX_op_add_i64:
+        TCI_CASE(INDEX_op_add_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 + t2);
-            break;
-        case INDEX_op_sub_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_sub_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 - t2);
-            break;
-        case INDEX_op_mul_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_mul_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 * t2);
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_HAS_div_i64
-        case INDEX_op_div_i64:
-        case INDEX_op_divu_i64:
-        case INDEX_op_rem_i64:
-        case INDEX_op_remu_i64:
+        TCI_CASE(INDEX_op_div_i64):
+        TCI_CASE(INDEX_op_divu_i64):
+        TCI_CASE(INDEX_op_rem_i64):
+        TCI_CASE(INDEX_op_remu_i64):
             TODO();
-            break;
+            TCI_NEXT();
 #elif TCG_TARGET_HAS_div2_i64
-        case INDEX_op_div2_i64:
-        case INDEX_op_divu2_i64:
+        TCI_CASE(INDEX_op_div2_i64):
+        TCI_CASE(INDEX_op_divu2_i64):
             TODO();
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_and_i64:
+        TCI_CASE(INDEX_op_and_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 & t2);
-            break;
-        case INDEX_op_or_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_or_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 | t2);
-            break;
-        case INDEX_op_xor_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_xor_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 ^ t2);
-            break;
+            TCI_NEXT();
 
             /* Shift/rotate operations (64 bit). */
 
-        case INDEX_op_shl_i64:
+        TCI_CASE(INDEX_op_shl_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 << t2);
-            break;
-        case INDEX_op_shr_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_shr_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 >> t2);
-            break;
-        case INDEX_op_sar_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_sar_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, ((int64_t)t1 >> t2));
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_HAS_rot_i64
-        case INDEX_op_rotl_i64:
-        case INDEX_op_rotr_i64:
+        TCI_CASE(INDEX_op_rotl_i64):
+        TCI_CASE(INDEX_op_rotr_i64):
             TODO();
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_brcond_i64:
+        TCI_CASE(INDEX_op_brcond_i64):
             t0 = tci_read_r64(&tb_ptr);
             t1 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
@@ -952,110 +1177,110 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             if (tci_compare64(t0, t1, condition)) {
                 assert(tb_ptr == old_code_ptr + op_size);
                 tb_ptr = (uint8_t *)label;
-                continue;
+                TCI_DISPATCH();
             }
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_HAS_ext8u_i64
-        case INDEX_op_ext8u_i64:
+        TCI_CASE(INDEX_op_ext8u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r8(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext8s_i64
-        case INDEX_op_ext8s_i64:
+        TCI_CASE(INDEX_op_ext8s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r8s(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16s_i64
-        case INDEX_op_ext16s_i64:
+        TCI_CASE(INDEX_op_ext16s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r16s(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16u_i64
-        case INDEX_op_ext16u_i64:
+        TCI_CASE(INDEX_op_ext16u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext32s_i64
-        case INDEX_op_ext32s_i64:
+        TCI_CASE(INDEX_op_ext32s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r32s(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext32u_i64
-        case INDEX_op_ext32u_i64:
+        TCI_CASE(INDEX_op_ext32u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap16_i64
-        case INDEX_op_bswap16_i64:
+        TCI_CASE(INDEX_op_bswap16_i64):
             TODO();
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg64(t0, bswap16(t1));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap32_i64
-        case INDEX_op_bswap32_i64:
+        TCI_CASE(INDEX_op_bswap32_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg64(t0, bswap32(t1));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap64_i64
-        case INDEX_op_bswap64_i64:
+        TCI_CASE(INDEX_op_bswap64_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, bswap64(t1));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_not_i64
-        case INDEX_op_not_i64:
+        TCI_CASE(INDEX_op_not_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, ~t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_neg_i64
-        case INDEX_op_neg_i64:
+        TCI_CASE(INDEX_op_neg_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, -t1);
-            break;
+            TCI_NEXT();
 #endif
 #endif /* TCG_TARGET_REG_BITS == 64 */
 
             /* QEMU specific operations. */
 
 #if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
-        case INDEX_op_debug_insn_start:
+        TCI_CASE(INDEX_op_debug_insn_start):
             TODO();
-            break;
+            TCI_NEXT();
 #else
-        case INDEX_op_debug_insn_start:
+        TCI_CASE(INDEX_op_debug_insn_start):
             TODO();
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_exit_tb:
+        TCI_CASE(INDEX_op_exit_tb):
             next_tb = *(uint64_t *)tb_ptr;
             goto exit;
-            break;
-        case INDEX_op_goto_tb:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_goto_tb):
             t0 = tci_read_i32(&tb_ptr);
             assert(tb_ptr == old_code_ptr + op_size);
             tb_ptr += (int32_t)t0;
-            continue;
-        case INDEX_op_qemu_ld8u:
+            TCI_DISPATCH();
+        TCI_CASE(INDEX_op_qemu_ld8u):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1066,8 +1291,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp8 = *(uint8_t *)(host_addr + GUEST_BASE);
 #endif
             tci_write_reg8(t0, tmp8);
-            break;
-        case INDEX_op_qemu_ld8s:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_qemu_ld8s):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1078,8 +1303,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp8 = *(uint8_t *)(host_addr + GUEST_BASE);
 #endif
             tci_write_reg8s(t0, tmp8);
-            break;
-        case INDEX_op_qemu_ld16u:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_qemu_ld16u):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1090,8 +1315,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp16 = tswap16(*(uint16_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg16(t0, tmp16);
-            break;
-        case INDEX_op_qemu_ld16s:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_qemu_ld16s):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1102,9 +1327,9 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp16 = tswap16(*(uint16_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg16s(t0, tmp16);
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_REG_BITS == 64
-        case INDEX_op_qemu_ld32u:
+        TCI_CASE(INDEX_op_qemu_ld32u):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1115,8 +1340,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp32 = tswap32(*(uint32_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg32(t0, tmp32);
-            break;
-        case INDEX_op_qemu_ld32s:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_qemu_ld32s):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1127,9 +1352,9 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp32 = tswap32(*(uint32_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg32s(t0, tmp32);
-            break;
+            TCI_NEXT();
 #endif /* TCG_TARGET_REG_BITS == 64 */
-        case INDEX_op_qemu_ld32:
+        TCI_CASE(INDEX_op_qemu_ld32):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1140,8 +1365,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp32 = tswap32(*(uint32_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg32(t0, tmp32);
-            break;
-        case INDEX_op_qemu_ld64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_qemu_ld64):
             t0 = *tb_ptr++;
 #if TCG_TARGET_REG_BITS == 32
             t1 = *tb_ptr++;
@@ -1158,8 +1383,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
 #if TCG_TARGET_REG_BITS == 32
             tci_write_reg(t1, tmp64 >> 32);
 #endif
-            break;
-        case INDEX_op_qemu_st8:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_qemu_st8):
             t0 = tci_read_r8(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1170,8 +1395,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             assert(taddr == host_addr);
             *(uint8_t *)(host_addr + GUEST_BASE) = t0;
 #endif
-            break;
-        case INDEX_op_qemu_st16:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_qemu_st16):
             t0 = tci_read_r16(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1182,8 +1407,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             assert(taddr == host_addr);
             *(uint16_t *)(host_addr + GUEST_BASE) = tswap16(t0);
 #endif
-            break;
-        case INDEX_op_qemu_st32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_qemu_st32):
             t0 = tci_read_r32(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1194,8 +1419,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             assert(taddr == host_addr);
             *(uint32_t *)(host_addr + GUEST_BASE) = tswap32(t0);
 #endif
-            break;
-        case INDEX_op_qemu_st64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_qemu_st64):
             tmp64 = tci_read_r64(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1206,12 +1431,12 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             assert(taddr == host_addr);
             *(uint64_t *)(host_addr + GUEST_BASE) = tswap64(tmp64);
 #endif
-            break;
-        default:
+            TCI_NEXT();
+        TCI_CASE_DEFAULT:
             TODO();
-            break;
+            TCI_NEXT();
         }
-        assert(tb_ptr == old_code_ptr + op_size);
+        TCI_CHECK_SIZE();
     }
 exit:
     return next_tb;
@@ -0,0 +1,65 @@
+#!/bin/sh
+#
+# Block layer performance comparison across image formats
+#
+# Creates a scratch image in each format and runs the same qemu-io "bench"
+# workloads on all of them, printing one CSV line per format and workload:
+#
+#   format,workload,ops,reads,writes,bytes,seconds,ops/sec,bytes/sec,
+#   avg,p50,p90,p99,p99.9,max latency in usec
+#
+# Run it from the build directory:
+#
+#   SRC_PATH=.. sh $SRC_PATH/tests/block-bench.sh [size] [seconds]
+#
+# FORMATS overrides the list of formats (default "raw qcow2 qed"), and
+# RBD_IMAGE=pool/image adds an existing rbd image, which is overwritten.
+# Images are opened with O_DIRECT; set QEMU_IO_OPTIONS="" to use the host
+# page cache instead, e.g. on tmpfs.
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+QEMU_IMG_PROG="${QEMU_IMG_PROG:-$(pwd)/qemu-img}"
+QEMU_IO_PROG="${QEMU_IO_PROG:-$(pwd)/qemu-io}"
+
+size=${1:-4G}
+seconds=${2:-10}
+formats=${FORMATS:-raw qcow2 qed}
+io_opts=${QEMU_IO_OPTIONS--n}
+img=${TMPDIR:-/tmp}/block-bench.$$
+
+trap 'rm -f "$img"' EXIT
+
+# name and qemu-io bench arguments
+workloads="seq-write-64k:-s64k_-d4_-w100
+seq-read-64k:-s64k_-d4
+rand-read-4k-qd1:-r_-d1
+rand-read-4k-qd32:-r_-d32
+rand-rw-4k-qd32:-r_-d32_-w30"
+
+run()
+{
+    name=$1
+    file=$2
+    for w in $workloads; do
+        args=$(echo "${w#*:}" | tr _ ' ')
+        echo "bench -C -t $seconds $args" |
+            "$QEMU_IO_PROG" $io_opts "$file" | sed -n "s/^[0-9]/$name,${w%%:*},&/p"
+    done
+}
+
+for fmt in $formats; do
+    rm -f "$img"
+    "$QEMU_IMG_PROG" create -f $fmt "$img" $size > /dev/null || exit 1
+    # write everything once, so that reads do not hit unallocated clusters
+    bytes=$("$QEMU_IMG_PROG" info "$img" |
+        sed -n 's/^virtual size: .*(\([0-9]*\) bytes)/\1/p')
+    echo "bench -s 1M -d 4 -w 100 -n $((bytes / 1048576))" |
+        "$QEMU_IO_PROG" $io_opts "$img" > /dev/null || exit 1
+    run $fmt "$img"
+done
+
+if [ -n "$RBD_IMAGE" ]; then
+    run rbd "rbd:$RBD_IMAGE"
+fi
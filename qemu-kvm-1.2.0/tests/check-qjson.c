@@ -17,6 +17,8 @@
 #include "qfloat.h"
 #include "qbool.h"
 #include "qjson.h"
+#include "json-streamer.h"
+#include "json-parser.h"
 
 #include "qemu-common.h"
 
@@ -742,6 +744,111 @@ static void unterminated_literal(void)
     g_assert(obj == NULL);
 }
 
+/*
+ * QMP round trip with a reply shaped like query-blockstats: serialize it,
+ * then parse it back fed in chunks like the monitor reads them.  In perf
+ * mode (gtester -m=perf) the number of messages per second is reported.
+ */
+typedef struct QmpBenchState {
+    JSONMessageParser parser;
+    QObject *result;
+} QmpBenchState;
+
+static void qmp_bench_emit(JSONMessageParser *parser, GQueue *tokens)
+{
+    QmpBenchState *s = container_of(parser, QmpBenchState, parser);
+
+    qobject_decref(s->result);
+    s->result = json_parser_parse(tokens, NULL);
+}
+
+static QObject *qmp_bench_reply(int devices)
+{
+    QList *list = qlist_new();
+    QDict *reply;
+    int i;
+
+    for (i = 0; i < devices; i++) {
+        char device[32];
+
+        snprintf(device, sizeof(device), "drive-virtio-disk%d", i);
+        qlist_append_obj(list, qobject_from_jsonf(
+            "{ 'device': %s, 'stats': { 'rd_bytes': %" PRId64 ", "
+            "'wr_bytes': %" PRId64 ", 'rd_operations': %" PRId64 ", "
+            "'wr_operations': %" PRId64 ", 'flush_operations': %d, "
+            "'wr_total_time_ns': %" PRId64 ", 'rd_total_time_ns': %" PRId64
+            ", 'flush_total_time_ns': %d, 'wr_highest_offset': %" PRId64
+            " }, 'parent': { 'stats': { 'rd_bytes': 0, 'wr_bytes': 0, "
+            "'rd_operations': 0, 'wr_operations': 0, 'flush_operations': 0, "
+            "'wr_total_time_ns': 0, 'rd_total_time_ns': 0, "
+            "'flush_total_time_ns': 0, 'wr_highest_offset': %" PRId64
+            " } } }",
+            device, (int64_t)i << 30, (int64_t)i << 29, (int64_t)i << 16,
+            (int64_t)i << 15, i, (int64_t)i << 33, (int64_t)i << 34, i,
+            (int64_t)i << 35, (int64_t)i << 35));
+    }
+    reply = qdict_new();
+    qdict_put(reply, "return", list);
+    qdict_put(reply, "id", qstring_from_str("libvirt-42"));
+    return QOBJECT(reply);
+}
+
+static QObject *qmp_bench_parse(QmpBenchState *s, QString *json)
+{
+    const char *buf = qstring_get_str(json);
+    size_t len = strlen(buf), i, chunk;
+
+    for (i = 0; i < len; i += chunk) {
+        chunk = MIN(len - i, 4096);
+        json_message_parser_feed(&s->parser, buf + i, chunk);
+    }
+    return s->result;
+}
+
+static void qmp_throughput(void)
+{
+    QmpBenchState s = {};
+    QObject *reply = qmp_bench_reply(64);
+    QString *json;
+    QDict *dict, *stats;
+    QList *list;
+    int i, iterations = 2000;
+    double elapsed;
+
+    json_message_parser_init(&s.parser, qmp_bench_emit);
+
+    json = qobject_to_json(reply);
+    dict = qobject_to_qdict(qmp_bench_parse(&s, json));
+    g_assert(dict);
+    g_assert_cmpstr(qdict_get_str(dict, "id"), ==, "libvirt-42");
+    list = qobject_to_qlist(qdict_get(dict, "return"));
+    g_assert_cmpint(qlist_size(list), ==, 64);
+    dict = qobject_to_qdict(qlist_peek(list));
+    g_assert_cmpstr(qdict_get_str(dict, "device"), ==, "drive-virtio-disk0");
+    stats = qdict_get_qdict(qdict_get_qdict(dict, "parent"), "stats");
+    g_assert_cmpint(qdict_get_int(stats, "wr_highest_offset"), ==, 0);
+
+    if (g_test_perf()) {
+        g_test_timer_start();
+        for (i = 0; i < iterations; i++) {
+            QDECREF(json);
+            json = qobject_to_json(reply);
+            qmp_bench_parse(&s, json);
+        }
+        elapsed = g_test_timer_elapsed();
+        g_test_maximized_result(iterations / elapsed,
+                                "query-blockstats, 64 devices, %zd bytes: "
+                                "%.0f round trips/s",
+                                strlen(qstring_get_str(json)),
+                                iterations / elapsed);
+    }
+
+    QDECREF(json);
+    qobject_decref(s.result);
+    qobject_decref(reply);
+    json_message_parser_destroy(&s.parser);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -777,5 +884,7 @@ int main(int argc, char **argv)
     g_test_add_func("/errors/invalid_dict_comma", invalid_dict_comma);
     g_test_add_func("/errors/unterminated/literal", unterminated_literal);
 
+    g_test_add_func("/perf/qmp_throughput", qmp_throughput);
+
     return g_test_run();
 }
@@ -0,0 +1,549 @@
+/*
+ * Device emulation benchmarks
+ *
+ * Drives devices through qtest, without a guest, and reports how many
+ * operations per second each of them sustains: MMIO and PIO dispatch,
+ * virtio-blk requests, e1000 transmitted packets and AHCI commands.
+ *
+ * Dispatch is measured inside QEMU with the qtest "bench" command.  The
+ * device benchmarks go through the qtest stream for every register
+ * access, like a very slow guest would, so their absolute numbers are
+ * mostly useful to compare QEMU builds with each other on one host.
+ *
+ * The results are printed on stdout as a JSON object, one result per
+ * line with the keys always in the same order:
+ *
+ *   { "arch": "x86_64", "results": [
+ *       { "name": "pio/cmos-inb", "ops": 1000000, "seconds": 0.041000,
+ *         "ops-per-second": 24390243.9 },
+ *       ...
+ *   ] }
+ *
+ * Run with QTEST_QEMU_BINARY set, "-q" divides the number of operations
+ * by ten.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "qemu-common.h"
+#include "libqtest.h"
+
+#define PCI_CONFIG_ADDR     0xcf8
+#define PCI_CONFIG_DATA     0xcfc
+#define PCI_COMMAND         0x04
+#define PCI_BASE_ADDRESS_0  0x10
+
+/* where the benchmarks map BARs, there is a QEMU instance per device */
+#define BENCH_MMIO_BASE     0xe0000000
+#define BENCH_PIO_BASE      0xc000
+
+#define HPET_BASE           0xfed00000
+#define HPET_CFG            0x010
+#define HPET_COUNTER        0x0f0
+
+#define IMAGE_SIZE          (1 << 20)
+
+static int scale = 1;
+static bool first_result = true;
+
+/*
+ * Results
+ */
+
+static void bench_report(const char *name, uint64_t ops, double seconds)
+{
+    printf("%s\n    { \"name\": \"%s\", \"ops\": %" PRIu64
+           ", \"seconds\": %.6f, \"ops-per-second\": %.1f }",
+           first_result ? "" : ",", name, ops, seconds,
+           seconds > 0 ? ops / seconds : 0.0);
+    first_result = false;
+    fflush(stdout);
+}
+
+/* an access repeated inside QEMU */
+static void bench_dispatch(const char *name, const char *op, uint64_t addr,
+                           uint64_t count, uint32_t value)
+{
+    int64_t ns;
+
+    count /= scale;
+    ns = qtest_bench(global_qtest, op, addr, count, value);
+    bench_report(name, count, ns / 1e9);
+}
+
+/*
+ * Guest memory and MMIO helpers
+ */
+
+static uint64_t guest_next;
+
+static uint64_t guest_alloc(size_t size, size_t align)
+{
+    uint64_t addr = (guest_next + align - 1) & ~(uint64_t)(align - 1);
+    void *zero = g_malloc0(size);
+
+    memwrite(addr, zero, size);
+    g_free(zero);
+    guest_next = addr + size;
+    return addr;
+}
+
+static void guest_reset(void)
+{
+    guest_next = 1 << 20;
+}
+
+static void writew(uint64_t addr, uint16_t val)
+{
+    val = cpu_to_le16(val);
+    memwrite(addr, &val, sizeof(val));
+}
+
+static uint16_t readw(uint64_t addr)
+{
+    uint16_t val;
+
+    memread(addr, &val, sizeof(val));
+    return le16_to_cpu(val);
+}
+
+static void writel(uint64_t addr, uint32_t val)
+{
+    val = cpu_to_le32(val);
+    memwrite(addr, &val, sizeof(val));
+}
+
+static uint32_t readl(uint64_t addr)
+{
+    uint32_t val;
+
+    memread(addr, &val, sizeof(val));
+    return le32_to_cpu(val);
+}
+
+/* poll a register until (value & mask) == expected, with a generous limit */
+#define POLL_LIMIT 10000000
+
+#define poll_until(read, addr, mask, expected) do {                         \
+        int polls_ = 0;                                                     \
+        while (((read)(addr) & (mask)) != (expected)) {                     \
+            g_assert(++polls_ < POLL_LIMIT);                                \
+        }                                                                   \
+    } while (0)
+
+/*
+ * PCI configuration through the PC's configuration mechanism #1
+ */
+
+static uint32_t pci_config_readl(int devfn, uint8_t offset)
+{
+    outl(PCI_CONFIG_ADDR, 0x80000000 | (devfn << 8) | offset);
+    return inl(PCI_CONFIG_DATA);
+}
+
+static void pci_config_writel(int devfn, uint8_t offset, uint32_t val)
+{
+    outl(PCI_CONFIG_ADDR, 0x80000000 | (devfn << 8) | offset);
+    outl(PCI_CONFIG_DATA, val);
+}
+
+/* find a function on bus 0, map BAR @bar at @addr and enable it */
+static int pci_setup(uint16_t vendor, uint16_t device, int bar, uint32_t addr)
+{
+    int devfn;
+
+    for (devfn = 0; devfn < 256; devfn++) {
+        if (pci_config_readl(devfn, 0) == (vendor | (device << 16))) {
+            break;
+        }
+    }
+    g_assert_cmpint(devfn, <, 256);
+
+    pci_config_writel(devfn, PCI_BASE_ADDRESS_0 + bar * 4, addr);
+    /* I/O, memory and bus master */
+    pci_config_writel(devfn, PCI_COMMAND, 0x7);
+    return devfn;
+}
+
+static char *create_image(void)
+{
+    char *path = g_strdup("/tmp/qtest-bench.XXXXXX");
+    int fd, ret;
+
+    fd = mkstemp(path);
+    g_assert(fd >= 0);
+    ret = ftruncate(fd, IMAGE_SIZE);
+    g_assert(ret == 0);
+    close(fd);
+    return path;
+}
+
+/*
+ * PIO and MMIO dispatch
+ */
+
+static void bench_pc(void)
+{
+    GTimer *timer;
+    uint64_t i, count = 20000 / scale;
+
+    qtest_start("-display none");
+
+    /* CMOS index, then data */
+    outb(0x70, 0x0a);
+    bench_dispatch("pio/cmos-inb", "inb", 0x71, 2000000, 0);
+    outl(PCI_CONFIG_ADDR, 0x80000000);
+    bench_dispatch("pio/pci-config-inl", "inl", PCI_CONFIG_DATA, 2000000, 0);
+    bench_dispatch("mmio/hpet-counter-readl", "readl",
+                   HPET_BASE + HPET_COUNTER, 2000000, 0);
+    bench_dispatch("mmio/hpet-config-readl", "readl",
+                   HPET_BASE + HPET_CFG, 2000000, 0);
+
+    /* the same PIO read, through the qtest stream each time */
+    timer = g_timer_new();
+    for (i = 0; i < count; i++) {
+        inb(0x71);
+    }
+    bench_report("qtest/cmos-inb-roundtrip", count,
+                 g_timer_elapsed(timer, NULL));
+    g_timer_destroy(timer);
+
+    qtest_quit(global_qtest);
+}
+
+/*
+ * virtio-blk, legacy virtio-pci interface
+ */
+
+#define VIRTIO_PCI_GUEST_FEATURES   4
+#define VIRTIO_PCI_QUEUE_PFN        8
+#define VIRTIO_PCI_QUEUE_NUM        12
+#define VIRTIO_PCI_QUEUE_SEL        14
+#define VIRTIO_PCI_QUEUE_NOTIFY     16
+#define VIRTIO_PCI_STATUS           18
+
+#define VIRTIO_STATUS_ACKNOWLEDGE   1
+#define VIRTIO_STATUS_DRIVER        2
+#define VIRTIO_STATUS_DRIVER_OK     4
+
+#define VRING_DESC_F_NEXT           1
+#define VRING_DESC_F_WRITE          2
+
+#define VIRTIO_BLK_T_IN             0
+
+typedef struct QEMU_PACKED VRingDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} VRingDesc;
+
+typedef struct QEMU_PACKED VirtIOBlkReq {
+    uint32_t type;
+    uint32_t ioprio;
+    uint64_t sector;
+} VirtIOBlkReq;
+
+static void bench_virtio_blk(void)
+{
+    char *image = create_image();
+    char *args;
+    uint64_t desc, avail, used, hdrs, data, status;
+    uint16_t io = BENCH_PIO_BASE;
+    uint16_t num, avail_idx = 0;
+    VRingDesc *descs;
+    VirtIOBlkReq *reqs;
+    uint16_t *ring;
+    GTimer *timer;
+    int i, r, nreqs, batches = 2000 / scale;
+
+    args = g_strdup_printf("-display none "
+                           "-drive if=none,id=drv0,file=%s,format=raw "
+                           "-device virtio-blk-pci,drive=drv0", image);
+    qtest_start(args);
+    g_free(args);
+    guest_reset();
+
+    pci_setup(0x1af4, 0x1001, 0, io);
+    outb(io + VIRTIO_PCI_STATUS, 0);
+    outb(io + VIRTIO_PCI_STATUS,
+         VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+    outl(io + VIRTIO_PCI_GUEST_FEATURES, 0);
+    outw(io + VIRTIO_PCI_QUEUE_SEL, 0);
+    num = inw(io + VIRTIO_PCI_QUEUE_NUM);
+    g_assert(num >= 3);
+
+    /* legacy layout: descriptors, available ring, then page aligned used */
+    desc = guest_alloc(16 * num + 6 + 2 * num, 4096);
+    avail = desc + 16 * num;
+    used = guest_alloc(6 + 8 * num, 4096);
+    outl(io + VIRTIO_PCI_QUEUE_PFN, desc >> 12);
+    outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE |
+         VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+    /* as many 4k reads as fit in the ring, three descriptors each */
+    nreqs = num / 3;
+    hdrs = guest_alloc(nreqs * sizeof(VirtIOBlkReq), 16);
+    data = guest_alloc(nreqs * 4096, 4096);
+    status = guest_alloc(nreqs, 1);
+
+    reqs = g_new0(VirtIOBlkReq, nreqs);
+    descs = g_new0(VRingDesc, nreqs * 3);
+    for (r = 0; r < nreqs; r++) {
+        reqs[r].type = cpu_to_le32(VIRTIO_BLK_T_IN);
+        reqs[r].sector = cpu_to_le64(r * 8);
+
+        descs[r * 3].addr = cpu_to_le64(hdrs + r * sizeof(VirtIOBlkReq));
+        descs[r * 3].len = cpu_to_le32(sizeof(VirtIOBlkReq));
+        descs[r * 3].flags = cpu_to_le16(VRING_DESC_F_NEXT);
+        descs[r * 3].next = cpu_to_le16(r * 3 + 1);
+        descs[r * 3 + 1].addr = cpu_to_le64(data + r * 4096);
+        descs[r * 3 + 1].len = cpu_to_le32(4096);
+        descs[r * 3 + 1].flags =
+            cpu_to_le16(VRING_DESC_F_NEXT | VRING_DESC_F_WRITE);
+        descs[r * 3 + 1].next = cpu_to_le16(r * 3 + 2);
+        descs[r * 3 + 2].addr = cpu_to_le64(status + r);
+        descs[r * 3 + 2].len = cpu_to_le32(1);
+        descs[r * 3 + 2].flags = cpu_to_le16(VRING_DESC_F_WRITE);
+    }
+    memwrite(hdrs, reqs, nreqs * sizeof(VirtIOBlkReq));
+    memwrite(desc, descs, nreqs * 3 * sizeof(VRingDesc));
+
+    ring = g_new0(uint16_t, num);
+    timer = g_timer_new();
+    for (i = 0; i < batches; i++) {
+        for (r = 0; r < nreqs; r++) {
+            ring[(uint16_t)(avail_idx + r) % num] = cpu_to_le16(r * 3);
+        }
+        memwrite(avail + 4, ring, num * sizeof(uint16_t));
+        avail_idx += nreqs;
+        writew(avail + 2, avail_idx);
+        outw(io + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+        poll_until(readw, used + 2, 0xffff, avail_idx);
+    }
+    bench_report("virtio-blk/read-4k", (uint64_t)batches * nreqs,
+                 g_timer_elapsed(timer, NULL));
+    g_timer_destroy(timer);
+
+    g_free(ring);
+    g_free(descs);
+    g_free(reqs);
+    qtest_quit(global_qtest);
+    unlink(image);
+    g_free(image);
+}
+
+/*
+ * e1000 transmit
+ */
+
+#define E1000_STATUS        0x00008
+#define E1000_TCTL          0x00400
+#define E1000_TDBAL         0x03800
+#define E1000_TDBAH         0x03804
+#define E1000_TDLEN         0x03808
+#define E1000_TDH           0x03810
+#define E1000_TDT           0x03818
+
+#define E1000_TCTL_EN       0x00000002
+#define E1000_TCTL_PSP      0x00000008
+
+#define E1000_TXD_CMD_EOP   0x01000000
+#define E1000_TXD_CMD_IFCS  0x02000000
+#define E1000_TXD_CMD_RS    0x08000000
+
+#define E1000_TXD_NUM       256
+#define E1000_TX_BATCH      32
+
+typedef struct QEMU_PACKED E1000TxDesc {
+    uint64_t buffer_addr;
+    uint32_t lower;
+    uint32_t upper;
+} E1000TxDesc;
+
+static void bench_e1000_tx(int size)
+{
+    static const uint8_t header[] = {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     /* broadcast */
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x56,
+        0x08, 0x00,                             /* IPv4 */
+    };
+    E1000TxDesc descs[E1000_TXD_NUM];
+    uint64_t base = BENCH_MMIO_BASE, ring, buf;
+    uint32_t tdt = 0;
+    GTimer *timer;
+    char *name;
+    int i, batches = 4000 / scale;
+
+    guest_reset();
+    ring = guest_alloc(sizeof(descs), 128);
+    buf = guest_alloc(size, 64);
+    memwrite(buf, header, sizeof(header));
+
+    /* the device does not look at the status, descriptors can be reused */
+    for (i = 0; i < E1000_TXD_NUM; i++) {
+        descs[i].buffer_addr = cpu_to_le64(buf);
+        descs[i].lower = cpu_to_le32(size | E1000_TXD_CMD_EOP |
+                                     E1000_TXD_CMD_IFCS | E1000_TXD_CMD_RS);
+        descs[i].upper = 0;
+    }
+    memwrite(ring, descs, sizeof(descs));
+
+    writel(base + E1000_TDBAL, ring);
+    writel(base + E1000_TDBAH, 0);
+    writel(base + E1000_TDLEN, sizeof(descs));
+    writel(base + E1000_TDH, 0);
+    writel(base + E1000_TDT, 0);
+    writel(base + E1000_TCTL, E1000_TCTL_EN | E1000_TCTL_PSP);
+
+    /* a tail update transmits the whole batch before returning */
+    timer = g_timer_new();
+    for (i = 0; i < batches; i++) {
+        tdt = (tdt + E1000_TX_BATCH) % E1000_TXD_NUM;
+        writel(base + E1000_TDT, tdt);
+    }
+    name = g_strdup_printf("e1000/tx-%db", size);
+    bench_report(name, (uint64_t)batches * E1000_TX_BATCH,
+                 g_timer_elapsed(timer, NULL));
+    g_free(name);
+    g_timer_destroy(timer);
+
+    g_assert_cmpint(readl(base + E1000_TDH), ==, tdt);
+    writel(base + E1000_TCTL, 0);
+}
+
+static void bench_e1000(void)
+{
+    qtest_start("-display none -device e1000");
+    pci_setup(0x8086, 0x100e, 0, BENCH_MMIO_BASE);
+
+    bench_dispatch("mmio/e1000-status-readl", "readl",
+                   BENCH_MMIO_BASE + E1000_STATUS, 2000000, 0);
+    bench_e1000_tx(60);
+    bench_e1000_tx(1514);
+
+    qtest_quit(global_qtest);
+}
+
+/*
+ * AHCI, one non-NCQ command at a time on port 0
+ */
+
+#define AHCI_GHC            0x04
+#define AHCI_GHC_AE         (1U << 31)
+
+#define AHCI_PORT0          0x100
+#define AHCI_PX_CLB         0x00
+#define AHCI_PX_CLBU        0x04
+#define AHCI_PX_FB          0x08
+#define AHCI_PX_FBU         0x0c
+#define AHCI_PX_IS          0x10
+#define AHCI_PX_CMD         0x18
+#define AHCI_PX_SERR        0x30
+#define AHCI_PX_CI          0x38
+
+#define AHCI_PX_CMD_ST      (1 << 0)
+#define AHCI_PX_CMD_FRE     (1 << 4)
+
+#define SATA_FIS_REG_H2D    0x27
+#define ATA_READ_DMA_EXT    0x25
+
+static void bench_ahci(void)
+{
+    char *image = create_image();
+    char *args;
+    uint64_t port = BENCH_MMIO_BASE + AHCI_PORT0;
+    uint64_t clb, fb, table, buf;
+    uint32_t header[4];
+    uint8_t cfis[20] = { 0 };
+    uint32_t prd[4];
+    GTimer *timer;
+    int i, count = 4000 / scale;
+
+    args = g_strdup_printf("-display none "
+                           "-drive if=none,id=drv0,file=%s,format=raw "
+                           "-device ich9-ahci,id=ahci "
+                           "-device ide-hd,drive=drv0,bus=ahci.0", image);
+    qtest_start(args);
+    g_free(args);
+    guest_reset();
+
+    pci_setup(0x8086, 0x2922, 5, BENCH_MMIO_BASE);
+    writel(BENCH_MMIO_BASE + AHCI_GHC, AHCI_GHC_AE);
+
+    clb = guest_alloc(32 * 32, 1024);
+    fb = guest_alloc(256, 256);
+    table = guest_alloc(0x80 + sizeof(prd), 128);
+    buf = guest_alloc(4096, 4096);
+
+    writel(port + AHCI_PX_CLB, clb);
+    writel(port + AHCI_PX_CLBU, 0);
+    writel(port + AHCI_PX_FB, fb);
+    writel(port + AHCI_PX_FBU, 0);
+    writel(port + AHCI_PX_SERR, 0xffffffff);
+    writel(port + AHCI_PX_IS, 0xffffffff);
+    writel(port + AHCI_PX_CMD, AHCI_PX_CMD_FRE);
+    writel(port + AHCI_PX_CMD, AHCI_PX_CMD_FRE | AHCI_PX_CMD_ST);
+
+    /* slot 0: 5 dword FIS, one PRD */
+    header[0] = cpu_to_le32(5 | (1 << 16));
+    header[1] = 0;
+    header[2] = cpu_to_le32(table);
+    header[3] = 0;
+    memwrite(clb, header, sizeof(header));
+
+    /* READ DMA EXT of 8 sectors at LBA 0 */
+    cfis[0] = SATA_FIS_REG_H2D;
+    cfis[1] = 0x80;
+    cfis[2] = ATA_READ_DMA_EXT;
+    cfis[7] = 0x40;
+    cfis[12] = 8;
+    memwrite(table, cfis, sizeof(cfis));
+
+    prd[0] = cpu_to_le32(buf);
+    prd[1] = 0;
+    prd[2] = 0;
+    prd[3] = cpu_to_le32(4096 - 1);
+    memwrite(table + 0x80, prd, sizeof(prd));
+
+    timer = g_timer_new();
+    for (i = 0; i < count; i++) {
+        writel(port + AHCI_PX_CI, 1);
+        poll_until(readl, port + AHCI_PX_CI, 1, 0);
+    }
+    bench_report("ahci/read-dma-4k", count, g_timer_elapsed(timer, NULL));
+    g_timer_destroy(timer);
+
+    qtest_quit(global_qtest);
+    unlink(image);
+    g_free(image);
+}
+
+int main(int argc, char **argv)
+{
+    const char *arch;
+
+    if (argc > 1 && strcmp(argv[1], "-q") == 0) {
+        scale = 10;
+    }
+
+    arch = qtest_get_arch();
+    if (strcmp(arch, "i386") && strcmp(arch, "x86_64")) {
+        fprintf(stderr, "device-bench: unsupported target %s\n", arch);
+        return 1;
+    }
+
+    printf("{ \"arch\": \"%s\", \"results\": [", arch);
+    bench_pc();
+    bench_virtio_blk();
+    bench_e1000();
+    bench_ahci();
+    printf("\n] }\n");
+
+    return 0;
+}
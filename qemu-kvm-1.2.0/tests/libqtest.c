@@ -446,6 +446,21 @@ void qtest_memread(QTestState *s, uint64_t addr, void *data, size_t size)
     g_strfreev(args);
 }
 
+int64_t qtest_bench(QTestState *s, const char *op, uint64_t addr,
+                    uint64_t count, uint32_t value)
+{
+    gchar **args;
+    int64_t ns;
+
+    qtest_sendf(s, "bench %s 0x%" PRIx64 " %" PRIu64 " 0x%x\n",
+                op, addr, count, value);
+    args = qtest_rsp(s, 2);
+    ns = g_ascii_strtoll(args[1], NULL, 0);
+    g_strfreev(args);
+
+    return ns;
+}
+
 void qtest_add_func(const char *str, void (*fn))
 {
     gchar *path = g_strdup_printf("/%s/%s", qtest_get_arch(), str);
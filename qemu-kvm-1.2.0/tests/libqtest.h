@@ -157,6 +157,22 @@ void qtest_memread(QTestState *s, uint64_t addr, void *data, size_t size);
  */
 void qtest_memwrite(QTestState *s, uint64_t addr, const void *data, size_t size);
 
+/**
+ * qtest_bench:
+ * @s: QTestState instance to operate on.
+ * @op: Access to repeat: "inb", "inw", "inl", "outb", "outw", "outl",
+ * "readb", "readw", "readl", "writeb", "writew" or "writel".
+ * @addr: I/O port or guest physical address to access.
+ * @count: Number of times to repeat the access.
+ * @value: Value stored by writes.
+ *
+ * Repeat an access inside QEMU, without a round trip through the qtest
+ * stream for each one.  Return how long the accesses took on the host,
+ * in nanoseconds.
+ */
+int64_t qtest_bench(QTestState *s, const char *op, uint64_t addr,
+                    uint64_t count, uint32_t value);
+
 /**
  * qtest_clock_step_next:
  * @s: QTestState instance to operate on.
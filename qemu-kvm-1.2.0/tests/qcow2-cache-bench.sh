@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# Random read micro-benchmark for the qcow2 metadata cache
+#
+# Creates a large qcow2 image with an L2 table for every part of the disk,
+# then times random 4k reads through qemu-io, once with the default L2 cache
+# and once with a cache that holds all L2 tables.  Run it from the build
+# directory:
+#
+#   SRC_PATH=.. sh $SRC_PATH/tests/qcow2-cache-bench.sh [size] [reads]
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+QEMU_IMG_PROG="${QEMU_IMG_PROG:-$(pwd)/qemu-img}"
+QEMU_IO_PROG="${QEMU_IO_PROG:-$(pwd)/qemu-io}"
+
+size_gb=${1:-1024}
+reads=${2:-200000}
+cluster_size=65536
+img=${TMPDIR:-/tmp}/qcow2-cache-bench.$$.qcow2
+
+trap 'rm -f "$img"' EXIT
+
+# one L2 table maps cluster_size / 8 clusters
+l2_coverage=$((cluster_size / 8 * cluster_size))
+l2_tables=$((size_gb * 1024 * 1024 * 1024 / l2_coverage))
+full_cache=$((l2_tables * cluster_size))
+
+"$QEMU_IMG_PROG" create -f qcow2 -o cluster_size=$cluster_size \
+    "$img" ${size_gb}G > /dev/null || exit 1
+
+echo "allocating $l2_tables L2 tables..."
+awk -v n=$l2_tables -v step=$l2_coverage \
+    'BEGIN { for (i = 0; i < n; i++) printf "write -q %.0f 64k\n", i * step }' |
+    "$QEMU_IO_PROG" "$img" > /dev/null || exit 1
+
+random_reads()
+{
+    awk -v n=$reads -v size=$size_gb 'BEGIN {
+        srand(1);
+        blocks = size * 262144;
+        for (i = 0; i < n; i++) {
+            printf "read -q %.0f 4k\n", int(rand() * blocks) * 4096;
+        }
+    }'
+}
+
+for cache in 0 $full_cache; do
+    if [ $cache -eq 0 ]; then
+        echo "$reads random reads, default L2 cache:"
+    else
+        echo "$reads random reads, ${cache}-byte L2 cache:"
+    fi
+    start=$(date +%s.%N)
+    random_reads | "$QEMU_IO_PROG" -r -L ${cache}b "$img" > /dev/null || exit 1
+    end=$(date +%s.%N)
+    echo "$start $end" | awk '{ printf "    %.2f seconds\n", $2 - $1 }'
+done
@@ -0,0 +1,44 @@
+/*
+ * Floating point throughput test: a mix of single and double precision
+ * add, mul and div on ordinary normal numbers, which is what most guest
+ * floating point code spends its time on.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 1024
+
+static float fa[N], fb[N];
+static double da[N], db[N];
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+    float fsum = 0;
+    double dsum = 0;
+    int i, j;
+
+    for (i = 0; i < N; i++) {
+        fa[i] = 1.0f + i / (float)N;
+        fb[i] = 2.0f - i / (float)(2 * N);
+        da[i] = 1.0 + i / (double)N;
+        db[i] = 2.0 - i / (double)(2 * N);
+    }
+
+    for (j = 0; j < iterations; j++) {
+        for (i = 0; i < N; i++) {
+            fsum += fa[i] * fb[i] - fa[i] / fb[i];
+            dsum += da[i] * db[i] - da[i] / db[i];
+        }
+        /* keep the sums in a range where every result stays normal */
+        fsum *= 0.5f;
+        dsum *= 0.5;
+    }
+
+    printf("float %.6e double %.15e\n", fsum, dsum);
+    return 0;
+}
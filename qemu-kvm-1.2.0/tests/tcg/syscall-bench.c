@@ -0,0 +1,74 @@
+/*
+ * System call latency test: times a few cheap, frequent system calls
+ * so that the per-call overhead of the linux-user emulation shows up.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void report(const char *name, int iterations, double start)
+{
+    printf("%-8s %8.3f us/call\n", name,
+           (now() - start) * 1e6 / iterations);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 200000;
+    struct stat st;
+    char buf[64];
+    int fd, futex_word = 0;
+    int i;
+    double start;
+
+    fd = open("/dev/null", O_RDWR);
+    if (fd < 0) {
+        perror("/dev/null");
+        return 1;
+    }
+
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        read(fd, buf, sizeof(buf));
+    }
+    report("read", iterations, start);
+
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        write(fd, buf, sizeof(buf));
+    }
+    report("write", iterations, start);
+
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        stat("/dev/null", &st);
+    }
+    report("stat", iterations, start);
+
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        /* nobody is waiting, so this returns immediately */
+        syscall(SYS_futex, &futex_word, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+    report("futex", iterations, start);
+
+    close(fd);
+    return 0;
+}
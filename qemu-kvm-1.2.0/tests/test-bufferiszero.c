@@ -0,0 +1,117 @@
+/*
+ * buffer_is_zero() tests
+ *
+ * Every variant the host supports is checked against a byte at a time
+ * loop, for all alignments and for lengths that end in every part of the
+ * vector loops.  When run in perf mode (gtester -m=perf) the throughput
+ * of each variant is reported for aligned and unaligned buffers, both
+ * zero and with a non-zero byte early or late in the buffer.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+
+#define BUF_SIZE (64 * 1024)
+
+static bool ref_is_zero(const uint8_t *p, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (p[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void check_buffer(uint8_t *buf)
+{
+    size_t align, len, i;
+
+    for (align = 0; align < 32; align++) {
+        for (len = 0; len <= 300; len++) {
+            g_assert(buffer_is_zero(buf + align, len));
+            /* a single bit anywhere in, or right around, the buffer */
+            for (i = 0; i < len + 2; i++) {
+                if (align + i == 0) {
+                    continue;
+                }
+                buf[align + i - 1] = 0x10;
+                g_assert(buffer_is_zero(buf + align, len) ==
+                         ref_is_zero(buf + align, len));
+                buf[align + i - 1] = 0;
+            }
+        }
+    }
+}
+
+typedef struct BufferMix {
+    const char *name;
+    size_t offset;
+    /* where the first non-zero byte is, BUF_SIZE for none */
+    size_t nonzero;
+    int iterations;
+} BufferMix;
+
+static const BufferMix buffer_mixes[] = {
+    { "aligned zero",      0, BUF_SIZE,         20000 },
+    { "unaligned zero",    3, BUF_SIZE,         20000 },
+    { "aligned dense",     0, 0,                10000000 },
+    { "aligned sparse",    0, BUF_SIZE - 4096,  20000 },
+    { "unaligned sparse",  3, BUF_SIZE - 4096,  20000 },
+};
+
+static void bench_buffer(const BufferMix *mix, uint8_t *buf)
+{
+    size_t len = BUF_SIZE - mix->offset;
+    double elapsed, bytes;
+    int i;
+
+    memset(buf, 0, BUF_SIZE);
+    if (mix->nonzero < BUF_SIZE) {
+        buf[mix->nonzero] = 1;
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < mix->iterations; i++) {
+        g_assert(buffer_is_zero(buf + mix->offset, len) ==
+                 (mix->nonzero == BUF_SIZE));
+    }
+    elapsed = g_test_timer_elapsed();
+
+    /* only count what had to be looked at */
+    bytes = (double)MIN(len, mix->nonzero - mix->offset + 1) *
+            mix->iterations;
+    g_test_maximized_result(bytes / elapsed / 1e9, "%s %s: %.2f GB/s",
+                            buffer_zero_accel_name(), mix->name,
+                            bytes / elapsed / 1e9);
+}
+
+static void test_buffer_is_zero(void)
+{
+    uint8_t *buf = qemu_memalign(64, BUF_SIZE);
+    int i;
+
+    do {
+        memset(buf, 0, BUF_SIZE);
+        check_buffer(buf);
+        if (g_test_perf()) {
+            for (i = 0; i < ARRAY_SIZE(buffer_mixes); i++) {
+                bench_buffer(&buffer_mixes[i], buf);
+            }
+        }
+    } while (buffer_zero_test_next_accel());
+
+    qemu_vfree(buf);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/cutils/buffer-is-zero", test_buffer_is_zero);
+    return g_test_run();
+}
@@ -150,6 +150,33 @@ static void test_lifecycle(void)
     g_assert(done); /* expect done to be true (second time) */
 }
 
+/*
+ * Check that terminated coroutines are reused
+ */
+
+static void test_pool(void)
+{
+    Coroutine *coroutine;
+    uint64_t hits, misses, new_hits, new_misses;
+    bool done = false;
+
+    /* Make sure that at least one coroutine is in the pool */
+    coroutine = qemu_coroutine_create(set_and_exit);
+    qemu_coroutine_enter(coroutine, &done);
+    g_assert(done);
+
+    qemu_coroutine_get_pool_stats(&hits, &misses);
+
+    done = false;
+    coroutine = qemu_coroutine_create(set_and_exit);
+    qemu_coroutine_enter(coroutine, &done);
+    g_assert(done);
+
+    qemu_coroutine_get_pool_stats(&new_hits, &new_misses);
+    g_assert_cmpint(new_hits, ==, hits + 1);
+    g_assert_cmpint(new_misses, ==, misses);
+}
+
 /*
  * Lifecycle benchmark
  */
@@ -163,10 +190,13 @@ static void perf_lifecycle(void)
 {
     Coroutine *coroutine;
     unsigned int i, max;
+    uint64_t hits, misses, new_hits, new_misses;
     double duration;
 
     max = 1000000;
 
+    qemu_coroutine_get_pool_stats(&hits, &misses);
+
     g_test_timer_start();
     for (i = 0; i < max; i++) {
         coroutine = qemu_coroutine_create(empty_coroutine);
@@ -174,7 +204,12 @@ static void perf_lifecycle(void)
     }
     duration = g_test_timer_elapsed();
 
-    g_test_message("Lifecycle %u iterations: %f s\n", max, duration);
+    qemu_coroutine_get_pool_stats(&new_hits, &new_misses);
+
+    g_test_message("Lifecycle %u iterations: %f s, %.0f cycles/s, "
+                   "pool hits %" PRIu64 " misses %" PRIu64 "\n",
+                   max, duration, max / duration,
+                   new_hits - hits, new_misses - misses);
 }
 
 static void perf_nesting(void)
@@ -207,6 +242,7 @@ int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/basic/lifecycle", test_lifecycle);
+    g_test_add_func("/basic/pool", test_pool);
     g_test_add_func("/basic/yield", test_yield);
     g_test_add_func("/basic/nesting", test_nesting);
     g_test_add_func("/basic/self", test_self);
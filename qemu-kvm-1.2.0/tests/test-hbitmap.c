@@ -0,0 +1,175 @@
+/*
+ * Hierarchical bitmap tests
+ *
+ * Every operation is mirrored on a plain byte array, and the bitmap's
+ * count, lookups and iteration are checked against it.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/hbitmap.h"
+
+typedef struct TestHBitmapData {
+    HBitmap *hb;
+    uint8_t *ref;       /* one byte per granule */
+    uint64_t size;
+    uint64_t nbits;
+    int granularity;
+} TestHBitmapData;
+
+static void hbitmap_test_init(TestHBitmapData *data, uint64_t size,
+                              int granularity)
+{
+    data->hb = hbitmap_alloc(size, granularity);
+    data->size = size;
+    data->granularity = granularity;
+    data->nbits = (size + (1ULL << granularity) - 1) >> granularity;
+    data->ref = g_malloc0(MAX(data->nbits, 1));
+}
+
+static void hbitmap_test_teardown(TestHBitmapData *data)
+{
+    hbitmap_free(data->hb);
+    g_free(data->ref);
+}
+
+static void hbitmap_test_change(TestHBitmapData *data, uint64_t start,
+                                uint64_t count, bool set)
+{
+    uint64_t bit, end;
+
+    if (set) {
+        hbitmap_set(data->hb, start, count);
+    } else {
+        hbitmap_reset(data->hb, start, count);
+    }
+    if (count == 0 || start >= data->size) {
+        return;
+    }
+    end = MIN(start + count, data->size);
+    for (bit = start >> data->granularity;
+         bit <= (end - 1) >> data->granularity; bit++) {
+        data->ref[bit] = set;
+    }
+}
+
+static void hbitmap_test_check(TestHBitmapData *data, uint64_t first)
+{
+    HBitmapIter hbi;
+    uint64_t bit, count = 0;
+    int64_t item;
+
+    for (bit = 0; bit < data->nbits; bit++) {
+        count += data->ref[bit];
+    }
+    g_assert_cmpint(hbitmap_count(data->hb), ==, count << data->granularity);
+    g_assert_cmpint(hbitmap_empty(data->hb), ==, count == 0);
+
+    hbitmap_iter_init(&hbi, data->hb, first);
+    bit = first >> data->granularity;
+    while ((item = hbitmap_iter_next(&hbi)) >= 0) {
+        while (!data->ref[bit]) {
+            bit++;
+        }
+        g_assert_cmpint(item, ==, bit << data->granularity);
+        g_assert(hbitmap_get(data->hb, item));
+        bit++;
+    }
+    for (; bit < data->nbits; bit++) {
+        g_assert(!data->ref[bit]);
+    }
+}
+
+static void test_hbitmap_empty(void)
+{
+    TestHBitmapData data;
+
+    hbitmap_test_init(&data, 0, 0);
+    hbitmap_test_check(&data, 0);
+    hbitmap_test_change(&data, 0, 1, true);
+    hbitmap_test_check(&data, 0);
+    hbitmap_test_teardown(&data);
+}
+
+static void test_hbitmap_edges(void)
+{
+    /* sizes around word and level boundaries */
+    static const uint64_t sizes[] = { 1, 63, 64, 65, 4095, 4096, 4097,
+                                      262143, 262144, 262145 };
+    TestHBitmapData data;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        uint64_t size = sizes[i];
+
+        hbitmap_test_init(&data, size, 0);
+        hbitmap_test_change(&data, size - 1, 1, true);
+        hbitmap_test_check(&data, 0);
+        hbitmap_test_check(&data, size - 1);
+        hbitmap_test_change(&data, 0, 1, true);
+        hbitmap_test_check(&data, 1);
+        hbitmap_test_change(&data, 0, size, true);
+        hbitmap_test_check(&data, 0);
+        hbitmap_test_change(&data, 1, size - 2, false);
+        hbitmap_test_check(&data, 0);
+        hbitmap_test_change(&data, 0, size, false);
+        hbitmap_test_check(&data, 0);
+        hbitmap_test_teardown(&data);
+    }
+}
+
+static void test_hbitmap_granularity(void)
+{
+    TestHBitmapData data;
+
+    hbitmap_test_init(&data, 1000, 4);
+    g_assert_cmpint(hbitmap_granularity(data.hb), ==, 4);
+
+    /* setting one item marks its whole granule */
+    hbitmap_test_change(&data, 17, 1, true);
+    g_assert(hbitmap_get(data.hb, 16));
+    g_assert(hbitmap_get(data.hb, 31));
+    g_assert(!hbitmap_get(data.hb, 32));
+    hbitmap_test_check(&data, 0);
+
+    /* the last granule is only partially inside the bitmap */
+    hbitmap_test_change(&data, 999, 100, true);
+    g_assert(!hbitmap_get(data.hb, 1000));
+    hbitmap_test_check(&data, 20);
+    hbitmap_test_teardown(&data);
+}
+
+static void test_hbitmap_random(void)
+{
+    TestHBitmapData data;
+    int i, op;
+
+    for (i = 0; i < 20; i++) {
+        uint64_t size = g_test_rand_int_range(1, i < 10 ? 5000 : 3000000);
+
+        hbitmap_test_init(&data, size, g_test_rand_int_range(0, 5));
+        for (op = 0; op < 200; op++) {
+            uint64_t start = g_test_rand_int_range(0, size);
+            uint64_t count = g_test_rand_int_range(0, op & 1 ? 100 :
+                                                   size / 4 + 1);
+
+            hbitmap_test_change(&data, start, count,
+                                g_test_rand_int_range(0, 3) != 0);
+            hbitmap_test_check(&data, g_test_rand_int_range(0, size));
+        }
+        hbitmap_test_teardown(&data);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/hbitmap/empty", test_hbitmap_empty);
+    g_test_add_func("/hbitmap/edges", test_hbitmap_edges);
+    g_test_add_func("/hbitmap/granularity", test_hbitmap_granularity);
+    g_test_add_func("/hbitmap/random", test_hbitmap_random);
+    return g_test_run();
+}
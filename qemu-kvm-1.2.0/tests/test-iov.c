@@ -250,11 +250,165 @@ static void test_io(void)
 #endif
 }
 
+static void test_copy(void)
+{
+    unsigned sniov, dniov;
+    struct iovec *siov, *diov;
+    size_t ssz, dsz, i, j, n;
+    unsigned char *sbuf, *dbuf;
+
+    iov_random(&siov, &sniov);
+    iov_random(&diov, &dniov);
+    ssz = iov_size(siov, sniov);
+    dsz = iov_size(diov, dniov);
+    sbuf = g_malloc(ssz);
+    dbuf = g_malloc(dsz);
+
+    for (i = 0; i < ssz; ++i) {
+        sbuf[i] = i & 255;
+    }
+    iov_from_buf(siov, sniov, 0, sbuf, ssz);
+
+    for (i = 0; i <= ssz; ++i) {
+        for (j = 0; j <= dsz; ++j) {
+            iov_memset(diov, dniov, 0, 0xff, -1);
+            n = iov_copy(diov, dniov, j, siov, sniov, i, -1);
+            g_assert_cmpint(n, ==, MIN(ssz - i, dsz - j));
+            iov_to_buf(diov, dniov, 0, dbuf, dsz);
+            g_assert(memcmp(dbuf + j, sbuf + i, n) == 0);
+        }
+    }
+
+    iov_free(siov, sniov);
+    iov_free(diov, dniov);
+    g_free(sbuf);
+    g_free(dbuf);
+}
+
+static void test_cursor(void)
+{
+    unsigned niov;
+    struct iovec *iov;
+    IOVCursor cur;
+    size_t sz, i, len;
+
+    iov_random(&iov, &niov);
+    sz = iov_size(iov, niov);
+    iov_memset(iov, niov, 0, 0, -1);
+
+    /* walk the whole iovec one byte at a time */
+    iov_cursor_init(&cur, iov, niov, 0);
+    for (i = 0; i < sz; ++i) {
+        unsigned char *p = iov_cursor_chunk(&cur, &len);
+
+        g_assert(len > 0);
+        *p = i & 255;
+        g_assert_cmpint(iov_cursor_advance(&cur, 1), ==, 1);
+    }
+    g_assert(iov_cursor_done(&cur));
+    g_assert_cmpint(iov_cursor_advance(&cur, 1), ==, 0);
+    test_iov_bytes(iov, niov, 0, sz);
+
+    iov_cursor_init(&cur, iov, niov, sz);
+    g_assert(iov_cursor_done(&cur));
+    iov_cursor_init(&cur, iov, niov, 1);
+    g_assert_cmpint(iov_cursor_advance(&cur, -1), ==, sz - 1);
+
+    iov_free(iov, niov);
+}
+
+static void test_is_zero(void)
+{
+    unsigned niov;
+    struct iovec *iov;
+    size_t sz, i, j, k;
+
+    iov_random(&iov, &niov);
+    sz = iov_size(iov, niov);
+
+    iov_memset(iov, niov, 0, 0, -1);
+    g_assert(iov_is_zero(iov, niov, 0, -1));
+    for (k = 0; k < sz; ++k) {
+        iov_memset(iov, niov, k, 1, 1);
+        for (i = 0; i <= sz; ++i) {
+            for (j = i; j <= sz; ++j) {
+                g_assert(iov_is_zero(iov, niov, i, j - i) ==
+                         (k < i || k >= j));
+            }
+        }
+        iov_memset(iov, niov, k, 0, 1);
+    }
+
+    iov_free(iov, niov);
+}
+
+/* what net_checksum_add() + net_checksum_finish() compute */
+static uint16_t csum_ref(const unsigned char *buf, size_t len)
+{
+    uint32_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        sum += (i & 1) ? buf[i] : buf[i] << 8;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+static uint16_t csum_finish(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+static void test_csum(void)
+{
+    unsigned niov;
+    struct iovec *iov;
+    size_t sz, i, j, n;
+    unsigned char *ibuf, *obuf;
+    uint32_t sum;
+
+    iov_random(&iov, &niov);
+    sz = iov_size(iov, niov);
+    ibuf = g_malloc(sz);
+    obuf = g_malloc(sz);
+
+    for (i = 0; i < sz; ++i) {
+        ibuf[i] = g_test_rand_int();
+    }
+    iov_from_buf(iov, niov, 0, ibuf, sz);
+
+    for (i = 0; i <= sz; ++i) {
+        for (j = i; j <= sz; ++j) {
+            sum = 0;
+            n = iov_to_buf_csum(iov, niov, i, obuf, j - i, &sum);
+            g_assert_cmpint(n, ==, j - i);
+            g_assert(memcmp(obuf, ibuf + i, n) == 0);
+            g_assert_cmpint(csum_finish(sum), ==, csum_ref(ibuf + i, n));
+            g_assert_cmpint(csum_finish(iov_csum(iov, niov, i, j - i)), ==,
+                            csum_ref(ibuf + i, n));
+        }
+    }
+
+    iov_free(iov, niov);
+    g_free(ibuf);
+    g_free(obuf);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
     g_test_rand_int();
     g_test_add_func("/basic/iov/from-to-buf", test_to_from_buf);
     g_test_add_func("/basic/iov/io", test_io);
+    g_test_add_func("/basic/iov/cursor", test_cursor);
+    g_test_add_func("/basic/iov/copy", test_copy);
+    g_test_add_func("/basic/iov/is-zero", test_is_zero);
+    g_test_add_func("/basic/iov/csum", test_csum);
     return g_test_run();
 }
@@ -0,0 +1,148 @@
+/*
+ * RCU tests
+ *
+ * Reader threads keep dereferencing a shared pointer while the main thread
+ * replaces it, and poisons each old copy once synchronize_rcu() or a
+ * call_rcu1() callback says no reader can still be using it.  A reader
+ * that finds a poisoned copy means a grace period ended too early.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu-thread.h"
+#include "qemu-rcu.h"
+
+#define NR_READERS  4
+#define NR_UPDATES  2000
+
+#define OBJ_LIVE    0x1badcafe
+#define OBJ_DEAD    0xdeadbeef
+
+typedef struct TestObj {
+    RCUHead rcu;
+    unsigned int magic;
+} TestObj;
+
+static TestObj objs[NR_UPDATES + 1];
+static TestObj *shared;
+static int stop_readers;
+static int reclaimed;
+static int bad_reads;
+static unsigned long total_reads;
+
+static void *reader_thread(void *opaque)
+{
+    unsigned long reads = 0;
+    TestObj *obj;
+    int i;
+
+    rcu_register_thread();
+    while (!*(volatile int *)&stop_readers) {
+        rcu_read_lock();
+        obj = atomic_rcu_read(&shared);
+        /* Stay in the critical section for a while, so that an early
+         * end of the grace period has a chance to be noticed.
+         */
+        for (i = 0; i < 100; i++) {
+            if (*(volatile unsigned int *)&obj->magic != OBJ_LIVE) {
+                __sync_fetch_and_add(&bad_reads, 1);
+                break;
+            }
+        }
+        rcu_read_unlock();
+        reads++;
+    }
+    rcu_unregister_thread();
+
+    __sync_fetch_and_add(&total_reads, reads);
+    return NULL;
+}
+
+static void obj_reclaim(RCUHead *rcu)
+{
+    TestObj *obj = container_of(rcu, TestObj, rcu);
+
+    obj->magic = OBJ_DEAD;
+    __sync_fetch_and_add(&reclaimed, 1);
+}
+
+static void test_rcu_nesting(void)
+{
+    rcu_read_lock();
+    rcu_read_lock();
+    g_assert_cmpuint(tls_var(rcu_reader).depth, ==, 2);
+    rcu_read_unlock();
+    g_assert(tls_var(rcu_reader).ctr != 0);
+    rcu_read_unlock();
+    g_assert_cmpuint(tls_var(rcu_reader).ctr, ==, 0);
+
+    /* No reader is active, so this must not wait for anything */
+    synchronize_rcu();
+}
+
+static void test_rcu_update(bool deferred)
+{
+    QemuThread threads[NR_READERS];
+    TestObj *old;
+    int i;
+
+    memset(objs, 0, sizeof(objs));
+    stop_readers = reclaimed = bad_reads = 0;
+    total_reads = 0;
+
+    objs[0].magic = OBJ_LIVE;
+    shared = &objs[0];
+    for (i = 0; i < NR_READERS; i++) {
+        qemu_thread_create(&threads[i], reader_thread, NULL,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    for (i = 1; i <= NR_UPDATES; i++) {
+        old = shared;
+        objs[i].magic = OBJ_LIVE;
+        atomic_rcu_set(&shared, &objs[i]);
+        if (deferred) {
+            call_rcu1(&old->rcu, obj_reclaim);
+        } else {
+            synchronize_rcu();
+            obj_reclaim(&old->rcu);
+        }
+    }
+
+    while (*(volatile int *)&reclaimed < NR_UPDATES) {
+        g_usleep(1000);
+    }
+
+    stop_readers = 1;
+    for (i = 0; i < NR_READERS; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+
+    g_assert_cmpint(bad_reads, ==, 0);
+    g_assert_cmpint(shared->magic, ==, OBJ_LIVE);
+    if (g_test_verbose()) {
+        g_test_message("%lu reads during %d updates", total_reads, NR_UPDATES);
+    }
+}
+
+static void test_rcu_synchronize(void)
+{
+    test_rcu_update(false);
+}
+
+static void test_rcu_call(void)
+{
+    test_rcu_update(true);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/rcu/nesting", test_rcu_nesting);
+    g_test_add_func("/rcu/synchronize", test_rcu_synchronize);
+    g_test_add_func("/rcu/call", test_rcu_call);
+    return g_test_run();
+}
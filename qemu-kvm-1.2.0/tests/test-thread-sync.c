@@ -0,0 +1,219 @@
+/*
+ * QemuEvent and QemuMutex tests
+ *
+ * Checks that events wake up waiters and are not lost when set before
+ * the wait.  When run in perf mode (gtester -m=perf) the latency of a
+ * wakeup handed back and forth between two threads is reported for
+ * QemuEvent and for a QemuCond/QemuMutex pair, and the cost of a lock
+ * handoff under contention for the default and the adaptive QemuMutex.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu-thread.h"
+
+#define PINGPONG_ROUNDS     20000
+#define HANDOFF_ROUNDS      200000
+
+/* Two threads passing a token back and forth */
+typedef struct PingPong {
+    bool use_cond;
+    QemuEvent ev[2];
+    QemuMutex lock;
+    QemuCond cond;
+    int turn;
+    int rounds;
+} PingPong;
+
+static void pingpong_wait(PingPong *pp, int me)
+{
+    if (pp->use_cond) {
+        qemu_mutex_lock(&pp->lock);
+        while (pp->turn != me) {
+            qemu_cond_wait(&pp->cond, &pp->lock);
+        }
+        qemu_mutex_unlock(&pp->lock);
+    } else {
+        qemu_event_wait(&pp->ev[me]);
+        qemu_event_reset(&pp->ev[me]);
+        g_assert_cmpint(*(volatile int *)&pp->turn, ==, me);
+    }
+}
+
+static void pingpong_pass(PingPong *pp, int me)
+{
+    if (pp->use_cond) {
+        qemu_mutex_lock(&pp->lock);
+        pp->turn = !me;
+        qemu_cond_signal(&pp->cond);
+        qemu_mutex_unlock(&pp->lock);
+    } else {
+        pp->turn = !me;
+        qemu_event_set(&pp->ev[!me]);
+    }
+}
+
+static void *pingpong_thread(void *opaque)
+{
+    PingPong *pp = opaque;
+    int i;
+
+    for (i = 0; i < pp->rounds; i++) {
+        pingpong_wait(pp, 1);
+        pingpong_pass(pp, 1);
+    }
+    return NULL;
+}
+
+/* Returns the round trip time in seconds */
+static double run_pingpong(bool use_cond, int rounds)
+{
+    PingPong pp = { .use_cond = use_cond, .rounds = rounds };
+    QemuThread thread;
+    double elapsed;
+    int i;
+
+    qemu_event_init(&pp.ev[0], false);
+    qemu_event_init(&pp.ev[1], false);
+    qemu_mutex_init(&pp.lock);
+    qemu_cond_init(&pp.cond);
+
+    qemu_thread_create(&thread, pingpong_thread, &pp, QEMU_THREAD_JOINABLE);
+    g_test_timer_start();
+    for (i = 0; i < rounds; i++) {
+        pingpong_pass(&pp, 0);
+        pingpong_wait(&pp, 0);
+    }
+    elapsed = g_test_timer_elapsed();
+    qemu_thread_join(&thread);
+
+    qemu_cond_destroy(&pp.cond);
+    qemu_mutex_destroy(&pp.lock);
+    qemu_event_destroy(&pp.ev[1]);
+    qemu_event_destroy(&pp.ev[0]);
+    return elapsed / rounds;
+}
+
+static void *event_waiter(void *opaque)
+{
+    QemuEvent *ev = opaque;
+
+    qemu_event_wait(ev);
+    return NULL;
+}
+
+static void test_event_basic(void)
+{
+    QemuEvent ev;
+    QemuThread thread;
+
+    /* A set event does not block, whatever the number of waits */
+    qemu_event_init(&ev, true);
+    qemu_event_wait(&ev);
+    qemu_event_wait(&ev);
+    qemu_event_set(&ev);
+    qemu_event_wait(&ev);
+
+    /* A wakeup that comes before the wait is not lost */
+    qemu_event_reset(&ev);
+    qemu_event_set(&ev);
+    qemu_event_wait(&ev);
+
+    /* A waiter in another thread is woken up */
+    qemu_event_reset(&ev);
+    qemu_thread_create(&thread, event_waiter, &ev, QEMU_THREAD_JOINABLE);
+    g_usleep(10000);
+    qemu_event_set(&ev);
+    qemu_thread_join(&thread);
+
+    qemu_event_destroy(&ev);
+}
+
+static void test_event_pingpong(void)
+{
+    double rtt;
+
+    rtt = run_pingpong(false, PINGPONG_ROUNDS);
+    if (g_test_perf()) {
+        g_test_minimized_result(rtt * 1e9 / 2,
+                                "QemuEvent wakeup: %.0f ns", rtt * 1e9 / 2);
+        rtt = run_pingpong(true, PINGPONG_ROUNDS);
+        g_test_minimized_result(rtt * 1e9 / 2,
+                                "QemuCond wakeup: %.0f ns", rtt * 1e9 / 2);
+    }
+}
+
+/* Two threads taking a lock in turn, with a short critical section */
+typedef struct Handoff {
+    QemuMutex lock;
+    unsigned long counter;
+} Handoff;
+
+static void *handoff_thread(void *opaque)
+{
+    Handoff *h = opaque;
+    int i, j;
+
+    for (i = 0; i < HANDOFF_ROUNDS; i++) {
+        qemu_mutex_lock(&h->lock);
+        for (j = 0; j < 10; j++) {
+            *(volatile unsigned long *)&h->counter += 1;
+        }
+        qemu_mutex_unlock(&h->lock);
+    }
+    return NULL;
+}
+
+static double run_handoff(bool adaptive)
+{
+    Handoff h = { .counter = 0 };
+    QemuThread threads[2];
+    double elapsed;
+    int i;
+
+    if (adaptive) {
+        qemu_mutex_init_adaptive(&h.lock);
+    } else {
+        qemu_mutex_init(&h.lock);
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < 2; i++) {
+        qemu_thread_create(&threads[i], handoff_thread, &h,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < 2; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    elapsed = g_test_timer_elapsed();
+
+    g_assert_cmpint(h.counter, ==, 2 * 10 * HANDOFF_ROUNDS);
+    qemu_mutex_destroy(&h.lock);
+    return elapsed / (2 * HANDOFF_ROUNDS);
+}
+
+static void test_mutex_handoff(void)
+{
+    double t;
+
+    t = run_handoff(true);
+    if (g_test_perf()) {
+        g_test_minimized_result(t * 1e9, "adaptive mutex: %.0f ns/lock",
+                                t * 1e9);
+        t = run_handoff(false);
+        g_test_minimized_result(t * 1e9, "default mutex: %.0f ns/lock",
+                                t * 1e9);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/thread/event/basic", test_event_basic);
+    g_test_add_func("/thread/event/pingpong", test_event_pingpong);
+    g_test_add_func("/thread/mutex/handoff", test_mutex_handoff);
+    return g_test_run();
+}
@@ -0,0 +1,198 @@
+/*
+ * XBZRLE encoder/decoder tests
+ *
+ * Every encoder variant the host supports is checked against a byte at a
+ * time reference encoder.  When run in perf mode (gtester -m=perf) the
+ * encode throughput of each variant is reported as well.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/xbzrle.h"
+
+#define PAGE_SIZE 4096
+
+typedef struct PageMix {
+    const char *name;
+    /* longest changed run and longest unchanged run, 0 means none */
+    int max_nzrun;
+    int max_zrun;
+} PageMix;
+
+static const PageMix page_mixes[] = {
+    { "unchanged",   0,         PAGE_SIZE },
+    { "sparse",      1,         512 },
+    { "short-runs",  16,        64 },
+    { "long-runs",   256,       256 },
+    { "changed",     PAGE_SIZE, 0 },
+};
+
+static int reference_encode(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                            uint8_t *dst, int dlen)
+{
+    int d = 0, i = 0;
+
+    while (i < slen) {
+        int zrun_len = 0, nzrun_len = 0;
+
+        if (d + 2 > dlen) {
+            return -1;
+        }
+        while (i < slen && old_buf[i] == new_buf[i]) {
+            zrun_len++;
+            i++;
+        }
+        if (zrun_len == slen) {
+            return 0;
+        }
+        if (i == slen) {
+            return d;
+        }
+        d += uleb128_encode_small(dst + d, zrun_len);
+
+        if (d + 2 > dlen) {
+            return -1;
+        }
+        while (i < slen && old_buf[i] != new_buf[i]) {
+            nzrun_len++;
+            i++;
+        }
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + i - nzrun_len, nzrun_len);
+        d += nzrun_len;
+    }
+
+    return d;
+}
+
+/* fill new_buf with alternating unchanged and changed runs of old_buf */
+static void build_page(const PageMix *mix, uint8_t *old_buf, uint8_t *new_buf)
+{
+    int i = 0;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old_buf[i] = g_test_rand_int_range(0, 256);
+    }
+    memcpy(new_buf, old_buf, PAGE_SIZE);
+
+    i = 0;
+    while (i < PAGE_SIZE) {
+        int run;
+
+        if (mix->max_zrun) {
+            i += g_test_rand_int_range(1, mix->max_zrun + 1);
+        }
+        if (!mix->max_nzrun) {
+            continue;
+        }
+        run = g_test_rand_int_range(1, mix->max_nzrun + 1);
+        for (; run && i < PAGE_SIZE; run--, i++) {
+            new_buf[i] = old_buf[i] ^ g_test_rand_int_range(1, 256);
+        }
+    }
+}
+
+static void check_page(const PageMix *mix, uint8_t *old_buf,
+                       uint8_t *new_buf, int dlen)
+{
+    uint8_t *encoded = g_malloc(dlen);
+    uint8_t *expected = g_malloc(dlen);
+    uint8_t *decoded = g_malloc(PAGE_SIZE);
+    int len, expected_len;
+
+    len = xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE, encoded, dlen);
+    expected_len = reference_encode(old_buf, new_buf, PAGE_SIZE,
+                                    expected, dlen);
+    g_assert_cmpint(len, ==, expected_len);
+    if (len <= 0) {
+        goto out;
+    }
+    g_assert(memcmp(encoded, expected, len) == 0);
+
+    memcpy(decoded, old_buf, PAGE_SIZE);
+    g_assert_cmpint(xbzrle_decode_buffer(encoded, len, decoded, PAGE_SIZE),
+                    <=, PAGE_SIZE);
+    g_assert(memcmp(decoded, new_buf, PAGE_SIZE) == 0);
+
+out:
+    g_free(encoded);
+    g_free(expected);
+    g_free(decoded);
+}
+
+static void bench_page(const PageMix *mix, uint8_t *old_buf, uint8_t *new_buf)
+{
+    uint8_t *encoded = g_malloc(PAGE_SIZE * 2);
+    int i, iterations = 100000;
+    double elapsed;
+
+    g_test_timer_start();
+    for (i = 0; i < iterations; i++) {
+        xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE, encoded,
+                             PAGE_SIZE * 2);
+    }
+    elapsed = g_test_timer_elapsed();
+
+    g_test_maximized_result((double)PAGE_SIZE * iterations / elapsed / 1e9,
+                            "%s encode %s: %.2f GB/s", xbzrle_accel_name(),
+                            mix->name,
+                            (double)PAGE_SIZE * iterations / elapsed / 1e9);
+    g_free(encoded);
+}
+
+static void test_encode_decode(void)
+{
+    uint8_t *old_buf = qemu_memalign(64, PAGE_SIZE);
+    uint8_t *new_buf = qemu_memalign(64, PAGE_SIZE);
+    int i, j;
+
+    do {
+        for (i = 0; i < ARRAY_SIZE(page_mixes); i++) {
+            for (j = 0; j < 100; j++) {
+                build_page(&page_mixes[i], old_buf, new_buf);
+                /* the migration code only has a page for the output */
+                check_page(&page_mixes[i], old_buf, new_buf, PAGE_SIZE);
+                check_page(&page_mixes[i], old_buf, new_buf, PAGE_SIZE * 2);
+            }
+            if (g_test_perf()) {
+                bench_page(&page_mixes[i], old_buf, new_buf);
+            }
+        }
+    } while (xbzrle_test_next_accel());
+
+    qemu_vfree(old_buf);
+    qemu_vfree(new_buf);
+}
+
+static void test_decode_errors(void)
+{
+    uint8_t dst[PAGE_SIZE];
+    /* zrun of 0x100 bytes then nzrun of 4 bytes, but only 2 of them */
+    uint8_t truncated[] = { 0x80, 0x02, 0x04, 0xaa, 0xbb };
+    /* zrun past the end of the page */
+    uint8_t overflow[] = { 0x81, 0x40, 0x01, 0xaa };
+    /* empty nzrun */
+    uint8_t empty[] = { 0x10, 0x00 };
+
+    g_assert_cmpint(xbzrle_decode_buffer(truncated, sizeof(truncated),
+                                         dst, PAGE_SIZE), ==, -1);
+    g_assert_cmpint(xbzrle_decode_buffer(overflow, sizeof(overflow),
+                                         dst, PAGE_SIZE), ==, -1);
+    g_assert_cmpint(xbzrle_decode_buffer(empty, sizeof(empty),
+                                         dst, PAGE_SIZE), ==, -1);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_rand_int();
+    g_test_add_func("/xbzrle/encode-decode", test_encode_decode);
+    g_test_add_func("/xbzrle/decode-errors", test_decode_errors);
+    return g_test_run();
+}
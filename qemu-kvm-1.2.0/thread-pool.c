@@ -0,0 +1,428 @@
+/*
+ * QEMU block layer thread pool
+ *
+ * Copyright IBM, Corp. 2008
+ *
+ * Authors:
+ *  Anthony Liguori   <aliguori@us.ibm.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * Contributions after 2012-01-13 are licensed under the terms of the
+ * GNU GPL, version 2 or (at your option) any later version.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+#include "qemu-common.h"
+#include "qemu-queue.h"
+#include "osdep.h"
+#include "trace.h"
+#include "thread-pool.h"
+
+#ifdef CONFIG_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+#define THREAD_POOL_DEFAULT_MAX_THREADS 64
+
+typedef struct ThreadPoolElement ThreadPoolElement;
+
+enum ThreadState {
+    THREAD_QUEUED,
+    THREAD_ACTIVE,
+    THREAD_DONE,
+};
+
+struct ThreadPoolElement {
+    BlockDriverAIOCB common;
+    ThreadPool *pool;
+    ThreadPoolFunc *func;
+    void *arg;
+
+    /* protected by pool->lock */
+    enum ThreadState state;
+    int ret;
+    QTAILQ_ENTRY(ThreadPoolElement) reqs;
+
+    /* link in pool->done */
+    ThreadPoolElement *next_done;
+
+    /* only used by the I/O thread */
+    bool canceled;
+};
+
+struct ThreadPool {
+    int max_threads;
+
+    /* completion notification, rfd == wfd with eventfd */
+    int rfd, wfd;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    int cur_threads;
+    int idle_threads;
+    int new_threads;     /* backlog of threads we need to create */
+    int pending_threads; /* threads created but not running yet */
+    QEMUBH *new_thread_bh;
+
+    /*
+     * Completed requests, most recent first.  Workers push onto it without
+     * taking the lock and only the first one after the I/O thread emptied
+     * it writes the notifier, so a burst of completions costs one wakeup.
+     */
+    ThreadPoolElement *done;
+
+    /* requests submitted and not completed yet, only used by the I/O thread */
+    int in_flight;
+};
+
+static ThreadPool *default_pool;
+
+static void die2(int err, const char *what)
+{
+    fprintf(stderr, "%s failed: %s\n", what, strerror(err));
+    abort();
+}
+
+static void do_spawn_thread(ThreadPool *pool);
+
+static void thread_pool_notify(ThreadPool *pool)
+{
+    uint64_t value = 1;
+    ssize_t ret;
+
+    do {
+        ret = write(pool->wfd, &value, sizeof(value));
+    } while (ret == -1 && errno == EINTR);
+
+    /* a full pipe already has a wakeup pending */
+    if (ret == -1 && errno != EAGAIN) {
+        die2(errno, "write()");
+    }
+}
+
+static void thread_pool_push_done(ThreadPool *pool, ThreadPoolElement *req)
+{
+    ThreadPoolElement *old;
+
+    do {
+        old = pool->done;
+        req->next_done = old;
+    } while (__sync_val_compare_and_swap(&pool->done, old, req) != old);
+
+    if (!old) {
+        thread_pool_notify(pool);
+    }
+}
+
+static void *worker_thread(void *opaque)
+{
+    ThreadPool *pool = opaque;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->pending_threads--;
+    pthread_mutex_unlock(&pool->lock);
+    do_spawn_thread(pool);
+
+    while (1) {
+        ThreadPoolElement *req;
+        qemu_timeval tv;
+        struct timespec ts;
+        int ret = 0;
+
+        qemu_gettimeofday(&tv);
+        ts.tv_sec = tv.tv_sec + 10;
+        ts.tv_nsec = 0;
+
+        pthread_mutex_lock(&pool->lock);
+
+        while (QTAILQ_EMPTY(&pool->request_list) && ret != ETIMEDOUT) {
+            pool->idle_threads++;
+            ret = pthread_cond_timedwait(&pool->cond, &pool->lock, &ts);
+            pool->idle_threads--;
+            if (ret && ret != ETIMEDOUT) {
+                die2(ret, "pthread_cond_timedwait");
+            }
+        }
+
+        if (QTAILQ_EMPTY(&pool->request_list)) {
+            break;
+        }
+
+        req = QTAILQ_FIRST(&pool->request_list);
+        QTAILQ_REMOVE(&pool->request_list, req, reqs);
+        req->state = THREAD_ACTIVE;
+        pthread_mutex_unlock(&pool->lock);
+
+        ret = req->func(req->arg);
+
+        pthread_mutex_lock(&pool->lock);
+        req->ret = ret;
+        req->state = THREAD_DONE;
+        pthread_mutex_unlock(&pool->lock);
+
+        /* req belongs to the I/O thread again after this */
+        thread_pool_push_done(pool, req);
+    }
+
+    pool->cur_threads--;
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static void do_spawn_thread(ThreadPool *pool)
+{
+    sigset_t set, oldset;
+    pthread_t thread;
+    int ret;
+
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->new_threads) {
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+
+    pool->new_threads--;
+    pool->pending_threads++;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    /* block all signals, leave signal handling to the I/O thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+
+    ret = pthread_create(&thread, NULL, worker_thread, pool);
+    if (ret) {
+        die2(ret, "pthread_create");
+    }
+    pthread_detach(thread);
+
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+}
+
+static void spawn_thread_bh_fn(void *opaque)
+{
+    do_spawn_thread(opaque);
+}
+
+/* Called with pool->lock held */
+static void spawn_thread(ThreadPool *pool)
+{
+    pool->cur_threads++;
+    pool->new_threads++;
+    /* If there are threads being created, they will spawn new workers, so
+     * we don't spend time creating many threads in a loop holding a mutex or
+     * starving the current vcpu.
+     *
+     * If there are no idle threads, ask the main thread to create one, so we
+     * inherit the correct affinity instead of the vcpu affinity.
+     */
+    if (!pool->pending_threads) {
+        qemu_bh_schedule(pool->new_thread_bh);
+    }
+}
+
+static void thread_pool_completion_cb(void *opaque)
+{
+    ThreadPool *pool = opaque;
+    ThreadPoolElement *req, *next, *list = NULL;
+    char bytes[16];
+    ssize_t len;
+
+    /* eventfd reads return 8 bytes, a pipe may have more to drain */
+    do {
+        len = read(pool->rfd, bytes, sizeof(bytes));
+    } while ((len == -1 && errno == EINTR) || len == sizeof(bytes));
+
+    do {
+        req = pool->done;
+    } while (req && __sync_val_compare_and_swap(&pool->done, req, NULL) != req);
+
+    /* complete in submission order as far as the workers allow */
+    while (req) {
+        next = req->next_done;
+        req->next_done = list;
+        list = req;
+        req = next;
+    }
+
+    while ((req = list)) {
+        list = req->next_done;
+        pool->in_flight--;
+
+        trace_thread_pool_complete(pool, req, req->common.opaque, req->ret);
+        if (!req->canceled) {
+            req->common.cb(req->common.opaque, req->ret);
+        }
+        qemu_aio_release(req);
+    }
+}
+
+static int thread_pool_flush_cb(void *opaque)
+{
+    ThreadPool *pool = opaque;
+
+    return pool->in_flight > 0;
+}
+
+static void thread_pool_cancel(BlockDriverAIOCB *acb)
+{
+    ThreadPoolElement *req = container_of(acb, ThreadPoolElement, common);
+    ThreadPool *pool = req->pool;
+
+    trace_thread_pool_cancel(req, req->common.opaque);
+
+    pthread_mutex_lock(&pool->lock);
+    if (req->state == THREAD_QUEUED) {
+        QTAILQ_REMOVE(&pool->request_list, req, reqs);
+        pthread_mutex_unlock(&pool->lock);
+        pool->in_flight--;
+        qemu_aio_release(req);
+        return;
+    }
+
+    /* fail safe: a running request can't be stopped, so we wait for it */
+    while (req->state != THREAD_DONE) {
+        pthread_mutex_unlock(&pool->lock);
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    /* the completion handler releases it without calling back */
+    req->canceled = true;
+}
+
+static AIOPool thread_pool_aio_pool = {
+    .aiocb_size         = sizeof(ThreadPoolElement),
+    .cancel             = thread_pool_cancel,
+};
+
+/*
+ * Runs func(arg) in a worker thread of @pool and passes its return value
+ * to cb in the I/O thread.  cb is never called before this returns.
+ */
+BlockDriverAIOCB *thread_pool_submit_aio(ThreadPool *pool,
+        ThreadPoolFunc *func, void *arg,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    ThreadPoolElement *req;
+    int idle;
+
+    req = qemu_aio_get(&thread_pool_aio_pool, NULL, cb, opaque);
+    req->pool = pool;
+    req->func = func;
+    req->arg = arg;
+    req->state = THREAD_QUEUED;
+    req->next_done = NULL;
+    req->canceled = false;
+    pool->in_flight++;
+
+    trace_thread_pool_submit(pool, req, arg);
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
+        spawn_thread(pool);
+    }
+    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
+    idle = pool->idle_threads;
+    pthread_mutex_unlock(&pool->lock);
+
+    /* busy workers look at the queue before they go idle again */
+    if (idle) {
+        pthread_cond_signal(&pool->cond);
+    }
+    return &req->common;
+}
+
+typedef struct ThreadPoolCo {
+    Coroutine *co;
+    int ret;
+} ThreadPoolCo;
+
+static void thread_pool_co_cb(void *opaque, int ret)
+{
+    ThreadPoolCo *co = opaque;
+
+    co->ret = ret;
+    qemu_coroutine_enter(co->co, NULL);
+}
+
+/*
+ * Runs func(arg) in a worker thread of @pool and returns its return value,
+ * yielding the calling coroutine in the meantime.
+ */
+int coroutine_fn thread_pool_submit_co(ThreadPool *pool,
+        ThreadPoolFunc *func, void *arg)
+{
+    ThreadPoolCo tpc = { .co = qemu_coroutine_self(), .ret = -EINPROGRESS };
+
+    assert(qemu_in_coroutine());
+    thread_pool_submit_aio(pool, func, arg, thread_pool_co_cb, &tpc);
+    qemu_coroutine_yield();
+    return tpc.ret;
+}
+
+/*
+ * Creates a pool that runs at most @max_threads requests at a time.  Idle
+ * workers exit after ten seconds.  Must be called from the I/O thread.
+ */
+ThreadPool *thread_pool_new(int max_threads)
+{
+    ThreadPool *pool;
+    int fds[2];
+    int ret;
+
+    pool = g_malloc0(sizeof(*pool));
+    pool->max_threads = max_threads;
+
+#ifdef CONFIG_EVENTFD
+    pool->rfd = pool->wfd = eventfd(0, 0);
+    if (pool->rfd == -1)
+#endif
+    {
+        if (qemu_pipe(fds) == -1) {
+            fprintf(stderr, "failed to create thread pool notifier\n");
+            g_free(pool);
+            return NULL;
+        }
+        pool->rfd = fds[0];
+        pool->wfd = fds[1];
+    }
+    fcntl(pool->rfd, F_SETFL, O_NONBLOCK);
+    fcntl(pool->wfd, F_SETFL, O_NONBLOCK);
+
+    ret = pthread_mutex_init(&pool->lock, NULL);
+    if (ret) {
+        die2(ret, "pthread_mutex_init");
+    }
+    ret = pthread_cond_init(&pool->cond, NULL);
+    if (ret) {
+        die2(ret, "pthread_cond_init");
+    }
+
+    QTAILQ_INIT(&pool->request_list);
+    pool->new_thread_bh = qemu_bh_new(spawn_thread_bh_fn, pool);
+
+    qemu_aio_set_fd_handler(pool->rfd, thread_pool_completion_cb, NULL,
+                            thread_pool_flush_cb, pool);
+    return pool;
+}
+
+/*
+ * The pool shared by the block layer, 9pfs and the tools, so that they
+ * don't each keep their own set of threads.
+ */
+ThreadPool *thread_pool_get_default(void)
+{
+    if (!default_pool) {
+        default_pool = thread_pool_new(THREAD_POOL_DEFAULT_MAX_THREADS);
+    }
+    return default_pool;
+}
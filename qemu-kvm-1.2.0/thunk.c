@@ -19,6 +19,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 
 #include "qemu.h"
 #include "thunk.h"
@@ -111,6 +112,21 @@ void thunk_register_struct(int id, const char *name, const argtype *types)
                i == THUNK_HOST ? "host" : "target", offset, max_align);
 #endif
     }
+
+    /* if nothing needs converting, thunk_convert() can just copy it */
+    se->same_layout = se->size[THUNK_HOST] == se->size[THUNK_TARGET];
+    type_ptr = se->field_types;
+    for (j = 0; j < nb_fields && se->same_layout; j++) {
+        if (se->field_offsets[THUNK_HOST][j] !=
+            se->field_offsets[THUNK_TARGET][j] ||
+            !thunk_type_same_layout(type_ptr)) {
+            se->same_layout = 0;
+        }
+        type_ptr = thunk_type_next(type_ptr);
+    }
+#ifdef DEBUG
+    printf("%s: same layout=%d\n", se->name, se->same_layout);
+#endif
 }
 
 void thunk_register_struct_direct(int id, const char *name,
@@ -120,6 +136,37 @@ void thunk_register_struct_direct(int id, const char *name,
     se = struct_entries + id;
     *se = *se1;
     se->name = name;
+    se->same_layout = 0;
+}
+
+/* Return true if the host and target representations of the type are
+   bitwise identical, i.e. converting it between them is a plain copy.  */
+int thunk_type_same_layout(const argtype *type_ptr)
+{
+#if defined(HOST_WORDS_BIGENDIAN) != defined(TARGET_WORDS_BIGENDIAN)
+    return 0;
+#else
+    switch (*type_ptr) {
+    case TYPE_CHAR:
+    case TYPE_SHORT:
+    case TYPE_INT:
+    case TYPE_LONGLONG:
+    case TYPE_ULONGLONG:
+        return 1;
+    case TYPE_LONG:
+    case TYPE_ULONG:
+    case TYPE_PTRVOID:
+    case TYPE_OLDDEVT:
+        return thunk_type_size(type_ptr, THUNK_HOST) ==
+            thunk_type_size(type_ptr, THUNK_TARGET);
+    case TYPE_ARRAY:
+        return thunk_type_same_layout(type_ptr + 2);
+    case TYPE_STRUCT:
+        return struct_entries[type_ptr[1]].same_layout;
+    default:
+        return 0;
+    }
+#endif
 }
 
 
@@ -227,10 +274,14 @@ const argtype *thunk_convert(void *dst, const void *src,
             src_size = thunk_type_size(type_ptr, 1 - to_host);
             d = dst;
             s = src;
-            for(i = 0;i < array_length; i++) {
-                thunk_convert(d, s, type_ptr, to_host);
-                d += dst_size;
-                s += src_size;
+            if (thunk_type_same_layout(type_ptr)) {
+                memcpy(d, s, array_length * dst_size);
+            } else {
+                for (i = 0; i < array_length; i++) {
+                    thunk_convert(d, s, type_ptr, to_host);
+                    d += dst_size;
+                    s += src_size;
+                }
             }
             type_ptr = thunk_type_next(type_ptr);
         }
@@ -245,7 +296,9 @@ const argtype *thunk_convert(void *dst, const void *src,
             const int *dst_offsets, *src_offsets;
 
             se = struct_entries + *type_ptr++;
-            if (se->convert[0] != NULL) {
+            if (se->same_layout) {
+                memcpy(dst, src, se->size[to_host]);
+            } else if (se->convert[0] != NULL) {
                 /* specific conversion is needed */
                 (*se->convert[to_host])(dst, src);
             } else {
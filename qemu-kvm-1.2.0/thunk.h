@@ -57,6 +57,8 @@ typedef struct {
     int size[2];
     int align[2];
     const char *name;
+    /* host and target layouts are bitwise identical */
+    int same_layout;
 } StructEntry;
 
 /* Translation table for bitmasks... */
@@ -72,6 +74,7 @@ void thunk_register_struct_direct(int id, const char *name,
                                   const StructEntry *se1);
 const argtype *thunk_convert(void *dst, const void *src,
                              const argtype *type_ptr, int to_host);
+int thunk_type_same_layout(const argtype *type_ptr);
 #ifndef NO_THUNK_TYPE_SIZE
 
 extern StructEntry struct_entries[];
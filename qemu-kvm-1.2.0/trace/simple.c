@@ -17,6 +17,7 @@
 #include <pthread.h>
 #endif
 #include "qemu-timer.h"
+#include "qemu-barrier.h"
 #include "trace.h"
 #include "trace/control.h"
 
@@ -32,8 +33,8 @@
 /** Records were dropped event ID */
 #define DROPPED_EVENT_ID (~(uint64_t)0 - 1)
 
-/** Trace record is valid */
-#define TRACE_RECORD_VALID ((uint64_t)1 << 63)
+/** Ring padding up to the end of the buffer, never written to the file */
+#define PADDING_EVENT_ID (~(uint64_t)0 - 2)
 
 /*
  * Trace records are written out by a dedicated thread.  The thread waits for
@@ -46,14 +47,35 @@ static bool trace_available;
 static bool trace_writeout_enabled;
 
 enum {
-    TRACE_BUF_LEN = 4096 * 64,
-    TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
+    TRACE_RING_LEN = 4096 * 16,
+    TRACE_RING_FLUSH_THRESHOLD = TRACE_RING_LEN / 4,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static unsigned int trace_idx;
-static unsigned int writeout_idx;
-static uint64_t dropped_events;
+/*
+ * Each thread that emits trace events owns a ring buffer, so the fast path
+ * takes no locks and issues no atomic instructions.  The owner advances head
+ * once a record is complete; the writeout thread copies records to the file
+ * and advances tail.  Records are contiguous and 8-byte aligned: a record
+ * that does not fit before the end of the buffer is preceded by padding.
+ *
+ * Rings are never freed.  When a thread exits its ring is left on the list
+ * so that pending records still get written out, and the next new thread
+ * takes it over.
+ */
+typedef struct TraceRing {
+    uint8_t buf[TRACE_RING_LEN];
+    unsigned int head;      /* free-running, written by the owner */
+    unsigned int tail;      /* free-running, written by the writeout thread */
+    unsigned int dropped;   /* events lost because the ring was full */
+    bool busy;              /* owner is between start and finish */
+    int in_use;             /* owned by a live thread */
+    uint32_t id;
+    struct TraceRing *next;
+} TraceRing;
+
+static TraceRing *trace_rings;
+static uint32_t trace_ring_count;
+static bool trace_rings_ready;
 static FILE *trace_fp;
 static char *trace_file_name;
 
@@ -62,7 +84,7 @@ typedef struct {
     uint64_t event; /*   TraceEventID */
     uint64_t timestamp_ns;
     uint32_t length;   /*    in bytes */
-    uint32_t reserved; /*    unused */
+    uint32_t reserved; /*    id of the ring the record came from */
     uint8_t arguments[];
 } TraceRecord;
 
@@ -72,55 +94,7 @@ typedef struct {
     uint64_t header_version;  /* HEADER_VERSION  */
 } TraceLogHeader;
 
-
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
-
-static void clear_buffer_range(unsigned int idx, size_t len)
-{
-    uint32_t num = 0;
-    while (num < len) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = 0;
-        num++;
-    }
-}
-/**
- * Read a trace record from the trace buffer
- *
- * @idx         Trace buffer index
- * @record      Trace record to fill
- *
- * Returns false if the record is not valid.
- */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
-{
-    uint64_t event_flag = 0;
-    TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
-
-    if (!(record.event & TRACE_RECORD_VALID)) {
-        return false;
-    }
-
-    smp_rmb(); /* read memory barrier before accessing record */
-    /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
-    *recordptr = malloc(record.length); /* dont use g_malloc, can deadlock when traced */
-    /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
-    smp_rmb(); /* memory barrier before clearing valid flag */
-    (*recordptr)->event &= ~TRACE_RECORD_VALID;
-    /* clear the trace buffer range for consumed record otherwise any byte
-     * with its MSB set may be considered as a valid event id when the writer
-     * thread crosses this range of buffer again.
-     */
-    clear_buffer_range(idx, record.length);
-    return true;
-}
+#define TRACE_ALIGN(len) (((len) + 7) & ~7)
 
 /**
  * Kick writeout thread
@@ -152,41 +126,195 @@ static void wait_for_trace_records_available(void)
     g_static_mutex_unlock(&trace_lock);
 }
 
-static gpointer writeout_thread(gpointer opaque)
+static TraceRing *trace_ring_alloc(void)
+{
+    TraceRing *ring;
+
+    ring = calloc(1, sizeof(*ring)); /* dont use g_malloc, can deadlock when traced */
+    if (!ring) {
+        return NULL;
+    }
+    ring->in_use = 1;
+    ring->id = __sync_fetch_and_add(&trace_ring_count, 1);
+    do {
+        ring->next = trace_rings;
+    } while (!__sync_bool_compare_and_swap(&trace_rings, ring->next, ring));
+    return ring;
+}
+
+#ifndef _WIN32
+static pthread_key_t trace_ring_key;
+
+static void trace_ring_release(void *opaque)
+{
+    TraceRing *ring = opaque;
+
+    smp_wmb();
+    ring->in_use = 0;
+}
+
+/**
+ * Look up the calling thread's ring, attaching one on first use
+ *
+ * Must be paired with trace_ring_put().
+ */
+static TraceRing *trace_ring_get(void)
+{
+    TraceRing *ring;
+
+    if (!trace_rings_ready) {
+        return NULL;
+    }
+
+    ring = pthread_getspecific(trace_ring_key);
+    if (ring) {
+        return ring;
+    }
+
+    for (ring = trace_rings; ring; ring = ring->next) {
+        if (!ring->in_use &&
+            __sync_bool_compare_and_swap(&ring->in_use, 0, 1)) {
+            break;
+        }
+    }
+    if (!ring) {
+        ring = trace_ring_alloc();
+        if (!ring) {
+            return NULL;
+        }
+    }
+    pthread_setspecific(trace_ring_key, ring);
+    return ring;
+}
+
+static void trace_ring_put(TraceRing *ring)
+{
+}
+
+static bool trace_rings_init(void)
+{
+    if (pthread_key_create(&trace_ring_key, trace_ring_release) != 0) {
+        return false;
+    }
+    trace_rings_ready = true;
+    return true;
+}
+#else
+/* No cheap thread-exit hook here, so all threads share one ring */
+static GStaticMutex trace_ring_lock = G_STATIC_MUTEX_INIT;
+
+static TraceRing *trace_ring_get(void)
+{
+    if (!trace_rings_ready) {
+        return NULL;
+    }
+    g_static_mutex_lock(&trace_ring_lock);
+    return trace_rings;
+}
+
+static void trace_ring_put(TraceRing *ring)
+{
+    g_static_mutex_unlock(&trace_ring_lock);
+}
+
+static bool trace_rings_init(void)
+{
+    if (!trace_ring_alloc()) {
+        return false;
+    }
+    trace_rings_ready = true;
+    return true;
+}
+#endif
+
+/**
+ * Return the oldest unconsumed record in a ring, skipping padding
+ *
+ * Only called from the writeout thread.
+ */
+static TraceRecord *trace_ring_peek(TraceRing *ring)
+{
+    unsigned int head = ring->head;
+    unsigned int off;
+    TraceRecord *record;
+
+    smp_rmb(); /* read head before the records it covers */
+
+    while (ring->tail != head) {
+        off = ring->tail % TRACE_RING_LEN;
+        if (TRACE_RING_LEN - off < sizeof(TraceRecord)) {
+            ring->tail += TRACE_RING_LEN - off;
+            continue;
+        }
+        record = (TraceRecord *)&ring->buf[off];
+        if (record->event == PADDING_EVENT_ID) {
+            smp_mb(); /* finish reading before the producer may reuse it */
+            ring->tail += record->length;
+            continue;
+        }
+        return record;
+    }
+    return NULL;
+}
+
+static void trace_ring_consume(TraceRing *ring, TraceRecord *record)
+{
+    smp_mb(); /* finish reading before the producer may reuse it */
+    ring->tail += TRACE_ALIGN(record->length);
+}
+
+static void write_dropped_record(TraceRing *ring)
 {
-    TraceRecord *recordptr;
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
     uint64_t dropped_count;
     size_t unused __attribute__ ((unused));
 
+    dropped_count = __sync_fetch_and_and(&ring->dropped, 0);
+    if (!dropped_count) {
+        return;
+    }
+
+    dropped.rec.event = DROPPED_EVENT_ID;
+    dropped.rec.timestamp_ns = get_clock();
+    dropped.rec.length = sizeof(TraceRecord) + sizeof(dropped_count);
+    dropped.rec.reserved = ring->id;
+    memcpy(dropped.rec.arguments, &dropped_count, sizeof(uint64_t));
+    unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
+}
+
+static gpointer writeout_thread(gpointer opaque)
+{
+    TraceRing *ring, *oldest_ring;
+    TraceRecord *record, *oldest;
+    size_t unused __attribute__ ((unused));
+
     for (;;) {
         wait_for_trace_records_available();
 
-        if (dropped_events) {
-            dropped.rec.event = DROPPED_EVENT_ID,
-            dropped.rec.timestamp_ns = get_clock();
-            dropped.rec.length = sizeof(TraceRecord) + sizeof(dropped_events),
-            dropped.rec.reserved = 0;
-            while (1) {
-                dropped_count = dropped_events;
-                if (g_atomic_int_compare_and_exchange((gint *)&dropped_events,
-                                                      dropped_count, 0)) {
-                    break;
-                }
-            }
-            memcpy(dropped.rec.arguments, &dropped_count, sizeof(uint64_t));
-            unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
+        for (ring = trace_rings; ring; ring = ring->next) {
+            write_dropped_record(ring);
         }
 
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* dont use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
+        /* Merge the rings so each batch is ordered by timestamp */
+        for (;;) {
+            oldest = NULL;
+            oldest_ring = NULL;
+            for (ring = trace_rings; ring; ring = ring->next) {
+                record = trace_ring_peek(ring);
+                if (record && (!oldest ||
+                               record->timestamp_ns < oldest->timestamp_ns)) {
+                    oldest = record;
+                    oldest_ring = ring;
+                }
+            }
+            if (!oldest) {
+                break;
+            }
+            unused = fwrite(oldest, oldest->length, 1, trace_fp);
+            trace_ring_consume(oldest_ring, oldest);
         }
 
         fflush(trace_fp);
@@ -196,86 +324,96 @@ static gpointer writeout_thread(gpointer opaque)
 
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    memcpy(&rec->ring->buf[rec->rec_off], &val, sizeof(uint64_t));
+    rec->rec_off += sizeof(uint64_t);
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    memcpy(&rec->ring->buf[rec->rec_off], &slen, sizeof(slen));
+    rec->rec_off += sizeof(slen);
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    memcpy(&rec->ring->buf[rec->rec_off], s, slen);
+    rec->rec_off += slen;
 }
 
 int trace_record_start(TraceBufferRecord *rec, TraceEventID event, size_t datasize)
 {
-    unsigned int idx, rec_off, old_idx, new_idx;
+    TraceRing *ring;
+    TraceRecord *record;
     uint32_t rec_len = sizeof(TraceRecord) + datasize;
-    uint64_t timestamp_ns = get_clock();
-
-    while (1) {
-        old_idx = trace_idx;
-        smp_rmb();
-        new_idx = old_idx + rec_len;
-
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
-            /* Trace Buffer Full, Event dropped ! */
-            g_atomic_int_inc((gint *)&dropped_events);
-            return -ENOSPC;
-        }
+    unsigned int aligned_len = TRACE_ALIGN(rec_len);
+    unsigned int head, tail, off, pad = 0;
 
-        if (g_atomic_int_compare_and_exchange((gint *)&trace_idx,
-                                              old_idx, new_idx)) {
-            break;
-        }
+    ring = trace_ring_get();
+    if (!ring) {
+        return -ENOSPC;
     }
 
-    idx = old_idx % TRACE_BUF_LEN;
+    /* A signal handler interrupted this thread in the middle of a record */
+    if (ring->busy) {
+        __sync_fetch_and_add(&ring->dropped, 1);
+        trace_ring_put(ring);
+        return -EBUSY;
+    }
+    ring->busy = true;
+    barrier();
 
-    rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event, sizeof(event));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
+    head = ring->head;
+    tail = ring->tail;
+    smp_rmb(); /* read tail before overwriting the space it frees */
 
-    rec->tbuf_idx = idx;
-    rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
-    return 0;
-}
+    off = head % TRACE_RING_LEN;
+    if (TRACE_RING_LEN - off < aligned_len) {
+        pad = TRACE_RING_LEN - off;
+    }
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        data_ptr[x++] = trace_buf[idx++];
+    if (head + pad + aligned_len - tail > TRACE_RING_LEN) {
+        /* Trace Buffer Full, Event dropped ! */
+        __sync_fetch_and_add(&ring->dropped, 1);
+        barrier();
+        ring->busy = false;
+        trace_ring_put(ring);
+        return -ENOSPC;
     }
-}
 
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
+    if (pad) {
+        /* Shorter gaps are skipped by the reader without a marker */
+        if (pad >= sizeof(TraceRecord)) {
+            record = (TraceRecord *)&ring->buf[off];
+            record->event = PADDING_EVENT_ID;
+            record->length = pad;
         }
-        trace_buf[idx++] = data_ptr[x++];
+        head += pad;
+        off = 0;
     }
-    return idx; /* most callers wants to know where to write next */
+
+    record = (TraceRecord *)&ring->buf[off];
+    record->event = event;
+    record->timestamp_ns = get_clock();
+    record->length = rec_len;
+    record->reserved = ring->id;
+
+    rec->ring = ring;
+    rec->head = head + aligned_len;
+    rec->rec_off = off + sizeof(TraceRecord);
+    return 0;
 }
 
 void trace_record_finish(TraceBufferRecord *rec)
 {
-    TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-    smp_wmb(); /* write barrier before marking as valid */
-    record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    TraceRing *ring = rec->ring;
+    bool kick;
 
-    if ((trace_idx - writeout_idx) > TRACE_BUF_FLUSH_THRESHOLD) {
+    smp_wmb(); /* write barrier before publishing the record */
+    ring->head = rec->head;
+    kick = ring->head - ring->tail > TRACE_RING_FLUSH_THRESHOLD;
+    barrier();
+    ring->busy = false;
+    trace_ring_put(ring);
+
+    if (kick) {
         flush_trace_file(false);
     }
 }
@@ -428,6 +566,11 @@ bool trace_backend_init(const char *events, const char *file)
     trace_available_cond = g_cond_new();
     trace_empty_cond = g_cond_new();
 
+    if (!trace_rings_init()) {
+        fprintf(stderr, "warning: unable to initialize simple trace backend\n");
+        return false;
+    }
+
     thread = trace_thread_create(writeout_thread);
     if (!thread) {
         fprintf(stderr, "warning: unable to initialize simple trace backend\n");
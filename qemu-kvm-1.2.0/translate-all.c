@@ -40,6 +40,9 @@ target_ulong gen_opc_pc[OPC_BUF_SIZE];
 uint16_t gen_opc_icount[OPC_BUF_SIZE];
 uint8_t gen_opc_instr_start[OPC_BUF_SIZE];
 
+uint64_t tb_restore_count;
+uint64_t tb_restore_regen_count;
+
 void cpu_gen_init(void)
 {
     tcg_context_init(&tcg_ctx); 
@@ -106,10 +109,8 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
     return 0;
 }
 
-/* The cpu state corresponding to 'searched_pc' is restored.
- */
-int cpu_restore_state(TranslationBlock *tb,
-                      CPUArchState *env, uintptr_t searched_pc)
+static int cpu_restore_state_locked(TranslationBlock *tb,
+                                    CPUArchState *env, uintptr_t searched_pc)
 {
     TCGContext *s = &tcg_ctx;
     int j;
@@ -137,15 +138,24 @@ int cpu_restore_state(TranslationBlock *tb,
     if (searched_pc < tc_ptr)
         return -1;
 
-    s->tb_next_offset = tb->tb_next_offset;
+    tb_restore_count++;
+    if (tb->tc_search) {
+        /* recorded when the TB was translated, no need to generate the
+           host code again */
+        j = tcg_search_pc(tb->tc_search, searched_pc - tc_ptr);
+    } else {
+        tb_restore_regen_count++;
+        s->tb_next_offset = tb->tb_next_offset;
 #ifdef USE_DIRECT_JUMP
-    s->tb_jmp_offset = tb->tb_jmp_offset;
-    s->tb_next = NULL;
+        s->tb_jmp_offset = tb->tb_jmp_offset;
+        s->tb_next = NULL;
 #else
-    s->tb_jmp_offset = NULL;
-    s->tb_next = tb->tb_next;
+        s->tb_jmp_offset = NULL;
+        s->tb_next = tb->tb_next;
 #endif
-    j = tcg_gen_code_search_pc(s, (uint8_t *)tc_ptr, searched_pc - tc_ptr);
+        j = tcg_gen_code_search_pc(s, (uint8_t *)tc_ptr,
+                                   searched_pc - tc_ptr);
+    }
     if (j < 0)
         return -1;
     /* now find start of instruction before */
@@ -161,3 +171,17 @@ int cpu_restore_state(TranslationBlock *tb,
 #endif
     return 0;
 }
+
+/* The cpu state corresponding to 'searched_pc' is restored.
+ */
+int cpu_restore_state(TranslationBlock *tb,
+                      CPUArchState *env, uintptr_t searched_pc)
+{
+    int ret;
+
+    /* the retranslation uses the shared TCG context */
+    tcg_tb_lock();
+    ret = cpu_restore_state_locked(tb, env, searched_pc);
+    tcg_tb_unlock();
+    return ret;
+}
@@ -44,7 +44,12 @@
 #include <jpeglib.h>
 #endif
 
+#if defined __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "bswap.h"
+#include "host-utils.h"
 #include "qint.h"
 #include "vnc.h"
 #include "vnc-enc-tight.h"
@@ -96,6 +101,9 @@ static const struct {
     { 0.4, 14, 0, 0 },
     { 0.5, 16, 0, 0 },
 };
+
+/* Quality level video regions are streamed at, at most */
+#define TIGHT_VIDEO_QUALITY 2
 #endif
 
 #ifdef CONFIG_VNC_PNG
@@ -336,6 +344,53 @@ tight_detect_smooth_image(VncState *vs, int w, int h)
     return (errors < tight_conf[compression].gradient_threshold);
 }
 
+/*
+ * Index of the first pixel from i on that is not c, or count.  Rectangles
+ * sent as palettes are mostly long runs of a few colors, so the palette
+ * scan spends its time here.
+ */
+#if defined __SSE2__
+#define DEFINE_FIND_CHANGE_FUNCTION(bpp, set1, cmpeq)                   \
+                                                                        \
+    static inline size_t                                                \
+    tight_find_change##bpp(const uint##bpp##_t *data, size_t i,         \
+                           size_t count, uint##bpp##_t c) {             \
+        __m128i vc = set1(c);                                           \
+                                                                        \
+        for (; i + 16 / sizeof(c) <= count; i += 16 / sizeof(c)) {     \
+            __m128i v = _mm_loadu_si128((__m128i *)(data + i));         \
+            int eq = _mm_movemask_epi8(cmpeq(v, vc));                   \
+                                                                        \
+            if (eq != 0xffff) {                                         \
+                return i + ctz32(~eq) / sizeof(c);                      \
+            }                                                           \
+        }                                                               \
+        while (i < count && data[i] == c) {                             \
+            i++;                                                        \
+        }                                                               \
+        return i;                                                       \
+    }
+
+DEFINE_FIND_CHANGE_FUNCTION(8, _mm_set1_epi8, _mm_cmpeq_epi8)
+DEFINE_FIND_CHANGE_FUNCTION(16, _mm_set1_epi16, _mm_cmpeq_epi16)
+DEFINE_FIND_CHANGE_FUNCTION(32, _mm_set1_epi32, _mm_cmpeq_epi32)
+#else
+#define DEFINE_FIND_CHANGE_FUNCTION(bpp)                                \
+                                                                        \
+    static inline size_t                                                \
+    tight_find_change##bpp(const uint##bpp##_t *data, size_t i,         \
+                           size_t count, uint##bpp##_t c) {             \
+        while (i < count && data[i] == c) {                             \
+            i++;                                                        \
+        }                                                               \
+        return i;                                                       \
+    }
+
+DEFINE_FIND_CHANGE_FUNCTION(8)
+DEFINE_FIND_CHANGE_FUNCTION(16)
+DEFINE_FIND_CHANGE_FUNCTION(32)
+#endif
+
 /*
  * Code to determine how many different colors used in rectangle.
  */
@@ -353,9 +408,7 @@ tight_detect_smooth_image(VncState *vs, int w, int h)
         data = (uint##bpp##_t *)vs->tight.tight.buffer;                 \
                                                                         \
         c0 = data[0];                                                   \
-        i = 1;                                                          \
-        while (i < count && data[i] == c0)                              \
-            i++;                                                        \
+        i = tight_find_change##bpp(data, 1, count, c0);                 \
         if (i >= count) {                                               \
             *bg = *fg = c0;                                             \
             return 1;                                                   \
@@ -397,14 +450,12 @@ tight_detect_smooth_image(VncState *vs, int w, int h)
         palette_put(*palette, c1);                                      \
         palette_put(*palette, ci);                                      \
                                                                         \
-        for (i++; i < count; i++) {                                     \
-            if (data[i] == ci) {                                        \
-                continue;                                               \
-            } else {                                                    \
-                ci = data[i];                                           \
-                if (!palette_put(*palette, (uint32_t)ci)) {             \
-                    return 0;                                           \
-                }                                                       \
+        for (i = tight_find_change##bpp(data, i + 1, count, ci);        \
+             i < count;                                                 \
+             i = tight_find_change##bpp(data, i + 1, count, ci)) {      \
+            ci = data[i];                                               \
+            if (!palette_put(*palette, (uint32_t)ci)) {                 \
+                return 0;                                               \
             }                                                           \
         }                                                               \
                                                                         \
@@ -1260,12 +1311,58 @@ static void jpeg_term_destination(j_compress_ptr cinfo)
     buffer->offset = buffer->capacity - cinfo->dest->free_in_buffer;
 }
 
+#ifdef JCS_EXTENSIONS
+/*
+ * libjpeg-turbo reads 32 bit pixels straight from the server surface when
+ * their byte layout is one of its extended color spaces.  Returns
+ * JCS_UNKNOWN when rows have to be converted to RGB first.
+ */
+static J_COLOR_SPACE jpeg_direct_color_space(VncState *vs)
+{
+    PixelFormat *pf = &vs->ds->surface->pf;
+    int r, g, b;
+
+    if (pf->bytes_per_pixel != 4 ||
+        pf->rmax != 0xff || pf->gmax != 0xff || pf->bmax != 0xff ||
+        ((pf->rshift | pf->gshift | pf->bshift) & 7)) {
+        return JCS_UNKNOWN;
+    }
+
+    /* byte offset of each channel within the pixel */
+    r = pf->rshift / 8;
+    g = pf->gshift / 8;
+    b = pf->bshift / 8;
+#ifdef HOST_WORDS_BIGENDIAN
+    r = 3 - r;
+    g = 3 - g;
+    b = 3 - b;
+#endif
+
+    if (r == 0 && g == 1 && b == 2) {
+        return JCS_EXT_RGBX;
+    } else if (r == 2 && g == 1 && b == 0) {
+        return JCS_EXT_BGRX;
+    } else if (r == 1 && g == 2 && b == 3) {
+        return JCS_EXT_XRGB;
+    } else if (r == 3 && g == 2 && b == 1) {
+        return JCS_EXT_XBGR;
+    }
+    return JCS_UNKNOWN;
+}
+#else
+static J_COLOR_SPACE jpeg_direct_color_space(VncState *vs)
+{
+    return JCS_UNKNOWN;
+}
+#endif
+
 static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality)
 {
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
     struct jpeg_destination_mgr manager;
-    JSAMPROW row[1];
+    J_COLOR_SPACE direct;
+    JSAMPROW row[16];
     uint8_t *buf;
     int dy;
 
@@ -1277,11 +1374,18 @@ static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality)
     cinfo.err = jpeg_std_error(&jerr);
     jpeg_create_compress(&cinfo);
 
+    direct = jpeg_direct_color_space(vs);
+
     cinfo.client_data = vs;
     cinfo.image_width = w;
     cinfo.image_height = h;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
+    if (direct != JCS_UNKNOWN) {
+        cinfo.input_components = 4;
+        cinfo.in_color_space = direct;
+    } else {
+        cinfo.input_components = 3;
+        cinfo.in_color_space = JCS_RGB;
+    }
 
     jpeg_set_defaults(&cinfo);
     jpeg_set_quality(&cinfo, quality, true);
@@ -1293,13 +1397,27 @@ static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality)
 
     jpeg_start_compress(&cinfo, true);
 
-    buf = g_malloc(w * 3);
-    row[0] = buf;
-    for (dy = 0; dy < h; dy++) {
-        rgb_prepare_row(vs, buf, x, y + dy, w);
-        jpeg_write_scanlines(&cinfo, row, 1);
+    if (direct != JCS_UNKNOWN) {
+        uint8_t *fbptr = vs->vd->server->data + y * ds_get_linesize(vs->ds) +
+                         x * ds_get_bytes_per_pixel(vs->ds);
+
+        for (dy = 0; dy < h; ) {
+            int i, n = MIN(h - dy, ARRAY_SIZE(row));
+
+            for (i = 0; i < n; i++) {
+                row[i] = fbptr + (dy + i) * ds_get_linesize(vs->ds);
+            }
+            dy += jpeg_write_scanlines(&cinfo, row, n);
+        }
+    } else {
+        buf = g_malloc(w * 3);
+        row[0] = buf;
+        for (dy = 0; dy < h; dy++) {
+            rgb_prepare_row(vs, buf, x, y + dy, w);
+            jpeg_write_scanlines(&cinfo, row, 1);
+        }
+        g_free(buf);
     }
-    g_free(buf);
 
     jpeg_finish_compress(&cinfo);
     jpeg_destroy_compress(&cinfo);
@@ -1557,11 +1675,14 @@ static int send_sub_rect(VncState *vs, int x, int y, int w, int h)
 #ifdef CONFIG_VNC_JPEG
     if (!vs->vd->non_adaptive && vs->tight.quality != (uint8_t)-1) {
         double freq = vnc_update_freq(vs, x, y, w, h);
+        bool video = vnc_update_is_video(vs, x, y, w, h);
 
-        if (freq < tight_jpeg_conf[vs->tight.quality].jpeg_freq_min) {
+        if (freq < tight_jpeg_conf[vs->tight.quality].jpeg_freq_min &&
+            !video) {
             allow_jpeg = false;
         }
-        if (freq >= tight_jpeg_conf[vs->tight.quality].jpeg_freq_threshold) {
+        if (freq >= tight_jpeg_conf[vs->tight.quality].jpeg_freq_threshold ||
+            video) {
             force_jpeg = true;
             vnc_sent_lossy_rect(vs, x, y, w, h);
         }
@@ -1708,6 +1829,23 @@ static int find_large_solid_color_rect(VncState *vs, int x, int y,
     return n + send_rect_simple(vs, x, y, w, h, true);
 }
 
+#ifdef CONFIG_VNC_JPEG
+/*
+ * A video region goes out as one JPEG at reduced quality.  Its cells are
+ * recorded as lossy, so a lossless copy follows once the video stops.
+ */
+static int send_video_rect(VncState *vs, int x, int y, int w, int h)
+{
+    uint8_t quality = vs->tight.quality;
+    int ret;
+
+    vs->tight.quality = MIN(quality, TIGHT_VIDEO_QUALITY);
+    ret = send_rect_simple(vs, x, y, w, h, false);
+    vs->tight.quality = quality;
+    return ret;
+}
+#endif
+
 static int tight_send_framebuffer_update(VncState *vs, int x, int y,
                                          int w, int h)
 {
@@ -1724,6 +1862,9 @@ static int tight_send_framebuffer_update(VncState *vs, int x, int y,
     if (vs->tight.quality != (uint8_t)-1) {
         double freq = vnc_update_freq(vs, x, y, w, h);
 
+        if (!vs->vd->non_adaptive && vnc_update_is_video(vs, x, y, w, h)) {
+            return send_video_rect(vs, x, y, w, h);
+        }
         if (freq > tight_jpeg_conf[vs->tight.quality].jpeg_freq_threshold) {
             return send_rect_simple(vs, x, y, w, h, false);
         }
@@ -29,6 +29,7 @@
 #include "vnc.h"
 #include "vnc-jobs.h"
 #include "qemu_socket.h"
+#include "qemu-timer.h"
 
 /*
  * Locking:
@@ -37,23 +38,43 @@
  * - jobs queue lock: for each operation on the queue (push, pop, isEmpty?)
  * - VncDisplay global lock: mainly used for framebuffer updates to avoid
  *                      screen corruption if the framebuffer is updated
- *			while the worker is doing something.
+ *			while the workers are doing something.
  * - VncState::output lock: used to make sure the output buffer is not corrupted
  * 		   	 if two threads try to write on it at the same time
  *
- * While the VNC worker thread is working, the VncDisplay global lock is hold
- * to avoid screen corruptions (this does not block vnc_refresh() because it
+ * While a VNC worker thread is working, it is counted in vd->encoders to
+ * avoid screen corruptions (this does not block vnc_refresh() because it
  * uses trylock()) but the output lock is not hold because the thread work on
  * its own output buffer.
  * When the encoding job is done, the worker thread will hold the output lock
- * and copy its output buffer in vs->output.
+ * and copy its output buffer in vs->jobs_buffer.  The queue lock nests
+ * outside the output lock.
+ *
+ * Scheduling:
+ *
+ * A pool of workers takes jobs from a single queue.  Jobs of different
+ * clients are encoded in parallel.  The jobs of one client are normally
+ * encoded one at a time and in order, because tight, zlib and ZRLE keep
+ * compression streams across updates.  Raw and hextile keep no such state,
+ * so vnc_job_push() splits their updates into several parallel jobs.
+ * Updates are always appended to jobs_buffer in queue order; a job that
+ * completes ahead of an earlier one of the same client keeps its output
+ * until the earlier one is done.
 */
 
+#define VNC_MAX_WORKERS 8
+
+typedef struct VncWorker {
+    QemuThread thread;
+    Buffer buffer;
+} VncWorker;
+
 struct VncJobQueue {
     QemuCond cond;
     QemuMutex mutex;
-    QemuThread thread;
-    Buffer buffer;
+    VncWorker workers[VNC_MAX_WORKERS];
+    int nworkers;
+    int nexited;
     bool exit;
     QTAILQ_HEAD(, VncJob) jobs;
 };
@@ -61,8 +82,7 @@ struct VncJobQueue {
 typedef struct VncJobQueue VncJobQueue;
 
 /*
- * We use a single global queue, but most of the functions are
- * already reetrant, so we can easilly add more than one encoding thread
+ * We use a single global queue shared by all workers
  */
 static VncJobQueue *queue;
 
@@ -81,6 +101,7 @@ VncJob *vnc_job_new(VncState *vs)
     VncJob *job = g_malloc0(sizeof(VncJob));
 
     job->vs = vs;
+    job->quality = vs->tight.quality;
     vnc_lock_queue(queue);
     QLIST_INIT(&job->rectangles);
     vnc_unlock_queue(queue);
@@ -102,13 +123,71 @@ int vnc_job_add_rect(VncJob *job, int x, int y, int w, int h)
     return 1;
 }
 
+static void vnc_job_free(VncJob *job)
+{
+    VncRectEntry *entry, *tmp;
+
+    QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
+        g_free(entry);
+    }
+    buffer_free(&job->output);
+    g_free(job);
+}
+
+/* Encodings that keep no state from one rectangle to the next */
+static bool vnc_encoding_is_stateless(int encoding)
+{
+    return encoding == VNC_ENCODING_RAW || encoding == VNC_ENCODING_HEXTILE;
+}
+
+/* Deal the rectangles of job to up to one job per worker */
+static void vnc_job_split_locked(VncJob *job)
+{
+    VncJob *parts[VNC_MAX_WORKERS];
+    VncRectEntry *entry, *tmp;
+    int n = 0, i;
+
+    QLIST_FOREACH(entry, &job->rectangles, next) {
+        n++;
+    }
+    n = MIN(n, queue->nworkers);
+
+    parts[0] = job;
+    for (i = 1; i < n; i++) {
+        parts[i] = g_malloc0(sizeof(VncJob));
+        parts[i]->vs = job->vs;
+        parts[i]->quality = job->quality;
+        QLIST_INIT(&parts[i]->rectangles);
+    }
+
+    i = 0;
+    QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
+        if (i) {
+            QLIST_REMOVE(entry, next);
+            QLIST_INSERT_HEAD(&parts[i]->rectangles, entry, next);
+        }
+        i = (i + 1) % n;
+    }
+
+    for (i = 0; i < n; i++) {
+        parts[i]->parallel = true;
+        parts[i]->encoding = job->vs->vnc_encoding;
+        QTAILQ_INSERT_TAIL(&queue->jobs, parts[i], next);
+    }
+}
+
 void vnc_job_push(VncJob *job)
 {
     vnc_lock_queue(queue);
     if (queue->exit || QLIST_EMPTY(&job->rectangles)) {
-        g_free(job);
+        vnc_job_free(job);
     } else {
-        QTAILQ_INSERT_TAIL(&queue->jobs, job, next);
+        if (queue->nworkers > 1 &&
+            vnc_encoding_is_stateless(job->vs->vnc_encoding)) {
+            vnc_job_split_locked(job);
+        } else {
+            QTAILQ_INSERT_TAIL(&queue->jobs, job, next);
+        }
         qemu_cond_broadcast(&queue->cond);
     }
     vnc_unlock_queue(queue);
@@ -136,17 +215,36 @@ bool vnc_has_job(VncState *vs)
     return ret;
 }
 
+/* Number of updates of vs not yet handed to jobs_buffer */
+int vnc_jobs_queued(VncState *vs)
+{
+    VncJob *job;
+    int n = 0;
+
+    vnc_lock_queue(queue);
+    QTAILQ_FOREACH(job, &queue->jobs, next) {
+        if (job->vs == vs) {
+            n++;
+        }
+    }
+    vnc_unlock_queue(queue);
+    return n;
+}
+
+/* Running jobs stay, their worker removes them */
 void vnc_jobs_clear(VncState *vs)
 {
     VncJob *job, *tmp;
 
     vnc_lock_queue(queue);
     QTAILQ_FOREACH_SAFE(job, &queue->jobs, next, tmp) {
-        if (job->vs == vs || !vs) {
+        if ((job->vs == vs || !vs) && !job->running) {
             QTAILQ_REMOVE(&queue->jobs, job, next);
+            vnc_job_free(job);
         }
     }
     vnc_unlock_queue(queue);
+    qemu_cond_broadcast(&queue->cond);
 }
 
 void vnc_jobs_join(VncState *vs)
@@ -179,7 +277,8 @@ void vnc_jobs_consume_buffer(VncState *vs)
 /*
  * Copy data for local use
  */
-static void vnc_async_encoding_start(VncState *orig, VncState *local)
+static void vnc_async_encoding_start(VncState *orig, VncState *local,
+                                     Buffer *output)
 {
     local->vnc_encoding = orig->vnc_encoding;
     local->features = orig->features;
@@ -192,7 +291,7 @@ static void vnc_async_encoding_start(VncState *orig, VncState *local)
     local->zlib = orig->zlib;
     local->hextile = orig->hextile;
     local->zrle = orig->zrle;
-    local->output =  queue->buffer;
+    local->output = *output;
     local->csock = -1; /* Don't do any network work on this thread */
 
     buffer_reset(&local->output);
@@ -205,29 +304,90 @@ static void vnc_async_encoding_end(VncState *orig, VncState *local)
     orig->hextile = local->hextile;
     orig->zrle = local->zrle;
     orig->lossy_rect = local->lossy_rect;
+}
 
-    queue->buffer = local->output;
+/*
+ * The first job in the queue that may start now: jobs of a client that
+ * already has one running must wait, unless both are parallel.
+ */
+static VncJob *vnc_queue_pick_job_locked(VncJobQueue *queue)
+{
+    VncJob *job, *other;
+
+    QTAILQ_FOREACH(job, &queue->jobs, next) {
+        bool busy = false;
+
+        if (job->running || job->done) {
+            continue;
+        }
+        QTAILQ_FOREACH(other, &queue->jobs, next) {
+            if (other == job) {
+                break;
+            }
+            if (other->vs == job->vs && other->running &&
+                !(other->parallel && job->parallel)) {
+                busy = true;
+                break;
+            }
+        }
+        if (!busy) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static bool vnc_job_is_first_locked(VncJob *job)
+{
+    VncJob *other;
+
+    QTAILQ_FOREACH(other, &queue->jobs, next) {
+        if (other->vs == job->vs) {
+            return other == job;
+        }
+    }
+    return false;
+}
+
+/* Hand the updates that completed after job, in order, to jobs_buffer */
+static void vnc_job_flush_following_locked(VncState *vs)
+{
+    VncJob *job, *tmp;
+
+    QTAILQ_FOREACH_SAFE(job, &queue->jobs, next, tmp) {
+        if (job->vs != vs) {
+            continue;
+        }
+        if (!job->done) {
+            break;
+        }
+        buffer_reserve(&vs->jobs_buffer, job->output.offset);
+        buffer_append(&vs->jobs_buffer, job->output.buffer,
+                      job->output.offset);
+        QTAILQ_REMOVE(&queue->jobs, job, next);
+        vnc_job_free(job);
+    }
 }
 
-static int vnc_worker_thread_loop(VncJobQueue *queue)
+static int vnc_worker_thread_loop(VncWorker *worker)
 {
     VncJob *job;
     VncRectEntry *entry, *tmp;
     VncState vs;
     int n_rectangles;
     int saved_offset;
+    int64_t start;
 
     vnc_lock_queue(queue);
-    while (QTAILQ_EMPTY(&queue->jobs) && !queue->exit) {
+    while (!queue->exit && !(job = vnc_queue_pick_job_locked(queue))) {
         qemu_cond_wait(&queue->cond, &queue->mutex);
     }
-    /* Here job can only be NULL if queue->exit is true */
-    job = QTAILQ_FIRST(&queue->jobs);
-    vnc_unlock_queue(queue);
-
     if (queue->exit) {
+        vnc_unlock_queue(queue);
         return -1;
     }
+    job->running = true;
+    vnc_unlock_queue(queue);
 
     vnc_lock_output(job->vs);
     if (job->vs->csock == -1 || job->vs->abort == true) {
@@ -236,8 +396,15 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     }
     vnc_unlock_output(job->vs);
 
+    start = get_clock();
+
     /* Make a local copy of vs and switch output buffers */
-    vnc_async_encoding_start(job->vs, &vs);
+    vnc_async_encoding_start(job->vs, &vs, &worker->buffer);
+    vs.tight.quality = job->quality;
+    if (job->parallel) {
+        /* the client may have switched to a stateful encoding since */
+        vs.vnc_encoding = job->encoding;
+    }
 
     /* Start sending rectangles */
     n_rectangles = 0;
@@ -246,12 +413,13 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     saved_offset = vs.output.offset;
     vnc_write_u16(&vs, 0);
 
-    vnc_lock_display(job->vs->vd);
+    vnc_lock_display_shared(job->vs->vd);
     QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
         int n;
 
         if (job->vs->csock == -1) {
-            vnc_unlock_display(job->vs->vd);
+            vnc_unlock_display_shared(job->vs->vd);
+            worker->buffer = vs.output;
             goto disconnected;
         }
 
@@ -261,32 +429,56 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         if (n >= 0) {
             n_rectangles += n;
         }
+        QLIST_REMOVE(entry, next);
         g_free(entry);
     }
-    vnc_unlock_display(job->vs->vd);
+    vnc_unlock_display_shared(job->vs->vd);
 
     /* Put n_rectangles at the beginning of the message */
     vs.output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
     vs.output.buffer[saved_offset + 1] = n_rectangles & 0xFF;
+    worker->buffer = vs.output;
 
+    vnc_lock_queue(queue);
     vnc_lock_output(job->vs);
     if (job->vs->csock != -1) {
-        buffer_reserve(&job->vs->jobs_buffer, vs.output.offset);
-        buffer_append(&job->vs->jobs_buffer, vs.output.buffer,
-                      vs.output.offset);
         /* Copy persistent encoding data */
-        vnc_async_encoding_end(job->vs, &vs);
+        if (!job->parallel) {
+            vnc_async_encoding_end(job->vs, &vs);
+        }
+        job->vs->jobs_encoded++;
+        job->vs->encode_ns += get_clock() - start;
+
+        job->running = false;
+        job->done = true;
+        if (vnc_job_is_first_locked(job)) {
+            buffer_reserve(&job->vs->jobs_buffer, worker->buffer.offset);
+            buffer_append(&job->vs->jobs_buffer, worker->buffer.buffer,
+                          worker->buffer.offset);
+            QTAILQ_REMOVE(&queue->jobs, job, next);
+            vnc_job_flush_following_locked(job->vs);
+            vnc_job_free(job);
+        } else {
+            buffer_reserve(&job->output, worker->buffer.offset);
+            buffer_append(&job->output, worker->buffer.buffer,
+                          worker->buffer.offset);
+        }
 
 	qemu_bh_schedule(job->vs->bh);
+        vnc_unlock_output(job->vs);
+        vnc_unlock_queue(queue);
+        qemu_cond_broadcast(&queue->cond);
+        return 0;
     }
     vnc_unlock_output(job->vs);
+    vnc_unlock_queue(queue);
 
 disconnected:
     vnc_lock_queue(queue);
     QTAILQ_REMOVE(&queue->jobs, job, next);
     vnc_unlock_queue(queue);
     qemu_cond_broadcast(&queue->cond);
-    g_free(job);
+    vnc_job_free(job);
     return 0;
 }
 
@@ -302,34 +494,64 @@ static VncJobQueue *vnc_queue_init(void)
 
 static void vnc_queue_clear(VncJobQueue *q)
 {
-    qemu_cond_destroy(&queue->cond);
-    qemu_mutex_destroy(&queue->mutex);
-    buffer_free(&queue->buffer);
+    int i;
+
+    qemu_cond_destroy(&q->cond);
+    qemu_mutex_destroy(&q->mutex);
+    for (i = 0; i < q->nworkers; i++) {
+        buffer_free(&q->workers[i].buffer);
+    }
     g_free(q);
-    queue = NULL; /* Unset global queue */
 }
 
 static void *vnc_worker_thread(void *arg)
 {
-    VncJobQueue *queue = arg;
+    VncWorker *worker = arg;
+    VncJobQueue *q = queue;
+    bool last;
+
+    qemu_thread_get_self(&worker->thread);
 
-    qemu_thread_get_self(&queue->thread);
+    while (!vnc_worker_thread_loop(worker)) ;
 
-    while (!vnc_worker_thread_loop(queue)) ;
-    vnc_queue_clear(queue);
+    /* The last worker out frees the queue */
+    vnc_lock_queue(q);
+    last = ++q->nexited == q->nworkers;
+    vnc_unlock_queue(q);
+    if (last) {
+        if (queue == q) {
+            queue = NULL; /* Unset global queue */
+        }
+        vnc_queue_clear(q);
+    }
     return NULL;
 }
 
+static int vnc_worker_count(void)
+{
+    int n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return MAX(1, MIN(n, VNC_MAX_WORKERS));
+}
+
 void vnc_start_worker_thread(void)
 {
     VncJobQueue *q;
+    int i;
 
     if (vnc_worker_thread_running())
         return ;
 
     q = vnc_queue_init();
-    qemu_thread_create(&q->thread, vnc_worker_thread, q, QEMU_THREAD_DETACHED);
+    q->nworkers = vnc_worker_count();
     queue = q; /* Set global queue */
+    for (i = 0; i < q->nworkers; i++) {
+        qemu_thread_create(&q->workers[i].thread, vnc_worker_thread,
+                           &q->workers[i], QEMU_THREAD_DETACHED);
+    }
 }
 
 bool vnc_worker_thread_running(void)
@@ -342,7 +564,7 @@ void vnc_stop_worker_thread(void)
     if (!vnc_worker_thread_running())
         return ;
 
-    /* Remove all jobs and wake up the thread */
+    /* Remove all jobs and wake up the workers */
     vnc_lock_queue(queue);
     queue->exit = true;
     vnc_unlock_queue(queue);
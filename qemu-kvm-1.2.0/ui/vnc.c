@@ -37,12 +37,40 @@
 #define VNC_REFRESH_INTERVAL_BASE 30
 #define VNC_REFRESH_INTERVAL_INC  50
 #define VNC_REFRESH_INTERVAL_MAX  2000
+
+/* Throughput samples smaller than this mostly measure the socket buffer */
+#define VNC_BW_SAMPLE_MIN (64 * 1024)
+/* Links at least this fast get the JPEG quality the client asked for */
+#define VNC_BW_FULL_QUALITY (8 * 1024 * 1024)
+/* Bounds of the output a client may have queued when an update is sent */
+#define VNC_OUTPUT_BUDGET_MIN_NS 20000000LL
+#define VNC_OUTPUT_BUDGET_MAX    (4 * 1024 * 1024)
+
+/* Statistics cells updating at least this often (Hz) are video, until
+ * their rate falls below VNC_VIDEO_FREQ_LEAVE */
+#define VNC_VIDEO_FREQ_ENTER 10
+#define VNC_VIDEO_FREQ_LEAVE 5
+/* Video cells form a stream when there are enough of them and they fill
+ * at least half of the box around them */
+#define VNC_VIDEO_MIN_CELLS  4
+#define VNC_VIDEO_MAX_FPS    15
 static const struct timeval VNC_REFRESH_STATS = { 0, 500000 };
 static const struct timeval VNC_REFRESH_LOSSY = { 2, 0 };
 
 #include "vnc_keysym.h"
 #include "d3des.h"
 
+#if defined __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined CONFIG_AVX2_OPT && defined __SSE2__
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+#pragma GCC pop_options
+#endif
+
 static VncDisplay *vnc_display; /* needed for info vnc */
 static DisplayChangeListener *dcl;
 
@@ -300,7 +328,7 @@ static void vnc_qmp_event(VncState *vs, MonitorEvent event)
     qobject_decref(data);
 }
 
-static VncClientInfo *qmp_query_vnc_client(const VncState *client)
+static VncClientInfo *qmp_query_vnc_client(VncState *client)
 {
     struct sockaddr_storage sa;
     socklen_t salen = sizeof(sa);
@@ -337,6 +365,12 @@ static VncClientInfo *qmp_query_vnc_client(const VncState *client)
     }
 #endif
 
+    info->jobs_queued = vnc_jobs_queued(client);
+    vnc_lock_output(client);
+    info->jobs_encoded = client->jobs_encoded;
+    info->encode_time_ns = client->encode_ns;
+    vnc_unlock_output(client);
+
     return info;
 }
 
@@ -447,6 +481,9 @@ static void vnc_dpy_update(DisplayState *ds, int x, int y, int w, int h)
     w = MIN(x + w, s->ds->width) - x;
     h = MIN(h, s->ds->height);
 
+    if (w > 0 && y < h) {
+        bitmap_set(s->dirty_rows, y, h - y);
+    }
     for (; y < h; y++)
         for (i = 0; i < w; i += 16)
             set_bit((x + i) / 16, s->dirty[y]);
@@ -569,6 +606,8 @@ static void vnc_dpy_resize(DisplayState *ds)
         console_color_init(ds);
     *(vd->guest.ds) = *(ds->surface);
     memset(vd->guest.dirty, 0xFF, sizeof(vd->guest.dirty));
+    memset(vd->guest.dirty_rows, 0xFF, sizeof(vd->guest.dirty_rows));
+    memset(&vd->video, 0, sizeof(vd->video));
 
     QTAILQ_FOREACH(vs, &vd->clients, next) {
         vnc_colordepth(vs);
@@ -869,21 +908,122 @@ static int vnc_update_client_sync(VncState *vs, int has_dirty)
     return ret;
 }
 
+/*
+ * How much output may still be queued for vs when a new update is sent:
+ * about what the link carries in one round trip.  Until the link has been
+ * measured, updates wait for the output buffer to drain.
+ */
+static size_t vnc_output_budget(VncState *vs)
+{
+    int64_t rtt;
+
+    if (!vs->bandwidth) {
+        return 0;
+    }
+    rtt = MAX(vs->latency_ns, VNC_OUTPUT_BUDGET_MIN_NS);
+    return MIN(vs->bandwidth * rtt / get_ticks_per_sec(),
+               VNC_OUTPUT_BUDGET_MAX);
+}
+
+/* Time until the output queued for vs is sent, in ms, or -1 if unknown */
+static int vnc_output_drain_ms(VncState *vs)
+{
+    if (!vs->output.offset || !vs->bandwidth) {
+        return -1;
+    }
+    return MIN(vs->output.offset * 1000 / vs->bandwidth,
+               VNC_REFRESH_INTERVAL_MAX);
+}
+
+/*
+ * JPEG quality for the next update: what the client asked for on links
+ * of VNC_BW_FULL_QUALITY or more, one level less per halving below that.
+ */
+static uint8_t vnc_update_quality(VncState *vs)
+{
+    uint8_t quality = vs->client_quality;
+    uint64_t bw;
+
+    if (quality == (uint8_t)-1 || !vs->bandwidth) {
+        return quality;
+    }
+    for (bw = vs->bandwidth; bw < VNC_BW_FULL_QUALITY && quality > 0;
+         bw *= 2) {
+        quality--;
+    }
+    return quality;
+}
+
+/*
+ * The display's video region as far as vs shows it.  It is streamed only
+ * when the display allows lossy updates.
+ */
+static bool vnc_client_video_rect(VncState *vs, int width, int height,
+                                  VncRect *r)
+{
+    VncDisplay *vd = vs->vd;
+
+    if (!vd->lossy || vd->non_adaptive || !vd->video.w) {
+        return false;
+    }
+    r->x = vd->video.x;
+    r->y = vd->video.y;
+    r->w = MIN(vd->video.x + vd->video.w, width & ~15) - r->x;
+    r->h = MIN(vd->video.y + vd->video.h, height) - r->y;
+    return r->w > 0 && r->h > 0;
+}
+
+/*
+ * Clear the dirty bits of vs inside r, copying them to save (one
+ * VNC_DIRTY_BITS bitmap per row of r) if not NULL.  Returns whether any
+ * was set.
+ */
+static bool vnc_take_dirty_rect(VncState *vs, VncRect *r, unsigned long *save)
+{
+    int first = r->x / 16, last = (r->x + r->w) / 16;
+    bool dirty = false;
+    int y;
+
+    for (y = 0; y < r->h; y++) {
+        unsigned long *row = vs->dirty[r->y + y];
+
+        if (find_next_bit(row, last, first) < last) {
+            dirty = true;
+        }
+        if (save) {
+            unsigned long *dst = save + y * BITS_TO_LONGS(VNC_DIRTY_BITS);
+
+            bitmap_zero(dst, VNC_DIRTY_BITS);
+            bitmap_set(dst, first, last - first);
+            bitmap_and(dst, dst, row, VNC_DIRTY_BITS);
+        }
+        bitmap_clear(row, first, last - first);
+    }
+    return dirty;
+}
+
 static int vnc_update_client(VncState *vs, int has_dirty)
 {
     if (vs->need_update && vs->csock != -1) {
         VncDisplay *vd = vs->vd;
         VncJob *job;
+        VncRect video;
+        unsigned long *held = NULL;
         int y;
         int width, height;
         int n = 0;
 
 
-        if (vs->output.offset && !vs->audio_cap && !vs->force_update)
-            /* kernel send buffers are full -> drop frames to throttle */
+        if (!vs->audio_cap && !vs->force_update &&
+            (vs->output.offset > vnc_output_budget(vs) || vnc_has_job(vs))) {
+            /* the link is behind: keep the dirty bits, they get merged
+             * into the next update that is sent */
+            vs->update_deferred = true;
             return 0;
+        }
 
-        if (!has_dirty && !vs->audio_cap && !vs->force_update)
+        if (!has_dirty && !vs->update_deferred && !vs->audio_cap &&
+            !vs->force_update)
             return 0;
 
         /*
@@ -893,10 +1033,30 @@ static int vnc_update_client(VncState *vs, int has_dirty)
          * send them to the client.
          */
         job = vnc_job_new(vs);
+        job->quality = vnc_update_quality(vs);
 
         width = MIN(vd->server->width, vs->client_width);
         height = MIN(vd->server->height, vs->client_height);
 
+        if (vnc_client_video_rect(vs, width, height, &video)) {
+            int64_t now = get_clock();
+
+            if (now - vs->video_sent_ns >=
+                get_ticks_per_sec() / VNC_VIDEO_MAX_FPS) {
+                /* the whole region as one frame, not tile by tile */
+                if (vnc_take_dirty_rect(vs, &video, NULL)) {
+                    n += vnc_job_add_rect(job, video.x, video.y,
+                                          video.w, video.h);
+                    vs->video_sent_ns = now;
+                }
+            } else {
+                /* between frames, keep the region out of this update */
+                held = g_new(unsigned long,
+                             video.h * BITS_TO_LONGS(VNC_DIRTY_BITS));
+                vnc_take_dirty_rect(vs, &video, held);
+            }
+        }
+
         for (y = 0; y < height; y++) {
             int x;
             int last_x = -1;
@@ -925,6 +1085,18 @@ static int vnc_update_client(VncState *vs, int has_dirty)
 
         vnc_job_push(job);
         vs->force_update = 0;
+        vs->update_deferred = false;
+
+        if (held) {
+            for (y = 0; y < video.h; y++) {
+                unsigned long *row = held + y * BITS_TO_LONGS(VNC_DIRTY_BITS);
+
+                bitmap_or(vs->dirty[video.y + y], vs->dirty[video.y + y],
+                          row, VNC_DIRTY_BITS);
+            }
+            g_free(held);
+            vs->update_deferred = true;
+        }
         return n;
     }
 
@@ -1144,6 +1316,36 @@ long vnc_client_write_buf(VncState *vs, const uint8_t *data, size_t datalen)
  * the buffered output data if the socket would block. Returns
  * -1 on error, and disconnects the client socket.
  */
+/*
+ * Throughput is sampled over each period during which queued output was
+ * draining, and only when enough was written for the period to be
+ * limited by the link rather than by the kernel socket buffer.
+ */
+static void vnc_output_written(VncState *vs, long written)
+{
+    int64_t now = get_clock();
+
+    if (!vs->output_busy_since) {
+        vs->output_busy_since = now;
+        vs->output_busy_bytes = 0;
+    }
+    vs->output_busy_bytes += written;
+    if (vs->output.offset) {
+        return;
+    }
+
+    if (vs->output_busy_bytes >= VNC_BW_SAMPLE_MIN &&
+        now > vs->output_busy_since) {
+        uint64_t sample = vs->output_busy_bytes * get_ticks_per_sec() /
+                          (now - vs->output_busy_since);
+
+        vs->bandwidth = vs->bandwidth ? (3 * vs->bandwidth + sample) / 4
+                                      : sample;
+    }
+    vs->output_busy_since = 0;
+    vs->update_sent_ns = now;
+}
+
 static long vnc_client_write_plain(VncState *vs)
 {
     long ret;
@@ -1167,6 +1369,7 @@ static long vnc_client_write_plain(VncState *vs)
 
     memmove(vs->output.buffer, vs->output.buffer + ret, (vs->output.offset - ret));
     vs->output.offset -= ret;
+    vnc_output_written(vs, ret);
 
     if (vs->output.offset == 0) {
         qemu_set_fd_handler2(vs->csock, NULL, vnc_client_read, NULL, vs);
@@ -1734,6 +1937,14 @@ static void framebuffer_update_request(VncState *vs, int incremental,
     if (y_position + h >= ds_get_height(vs->ds))
         h = ds_get_height(vs->ds) - y_position;
 
+    if (incremental && vs->update_sent_ns) {
+        int64_t sample = get_clock() - vs->update_sent_ns;
+
+        vs->latency_ns = vs->latency_ns ? (3 * vs->latency_ns + sample) / 4
+                                        : sample;
+        vs->update_sent_ns = 0;
+    }
+
     vs->need_update = 1;
     if (!incremental) {
         vs->force_update = 1;
@@ -1778,6 +1989,7 @@ static void set_encodings(VncState *vs, int32_t *encodings, size_t n_encodings)
     vs->vnc_encoding = 0;
     vs->tight.compression = 9;
     vs->tight.quality = -1; /* Lossless by default */
+    vs->client_quality = -1;
     vs->absolute = -1;
 
     /*
@@ -1842,6 +2054,7 @@ static void set_encodings(VncState *vs, int32_t *encodings, size_t n_encodings)
         case VNC_ENCODING_QUALITYLEVEL0 ... VNC_ENCODING_QUALITYLEVEL0 + 9:
             if (vs->vd->lossy) {
                 vs->tight.quality = (enc & 0x0F);
+                vs->client_quality = vs->tight.quality;
             }
             break;
         default:
@@ -2435,6 +2648,43 @@ static int vnc_refresh_lossy_rect(VncDisplay *vd, int x, int y)
     return has_dirty;
 }
 
+/*
+ * A video playing in the guest shows up as a block of cells updating at
+ * a high rate.  Scattered fast cells (a clock, a blinking cursor, a
+ * progress bar) are no stream and keep being sent as they change.
+ */
+static void vnc_update_video_rect(VncDisplay *vd)
+{
+    int x, y, cells = 0, box;
+    int x1 = INT_MAX, y1 = INT_MAX, x2 = 0, y2 = 0;
+
+    for (y = 0; y < vd->guest.ds->height; y += VNC_STAT_RECT) {
+        for (x = 0; x < vd->guest.ds->width; x += VNC_STAT_RECT) {
+            if (vnc_stat_rect(vd, x, y)->video) {
+                cells++;
+                x1 = MIN(x1, x);
+                y1 = MIN(y1, y);
+                x2 = MAX(x2, x + VNC_STAT_RECT);
+                y2 = MAX(y2, y + VNC_STAT_RECT);
+            }
+        }
+    }
+
+    memset(&vd->video, 0, sizeof(vd->video));
+    if (cells < VNC_VIDEO_MIN_CELLS) {
+        return;
+    }
+    box = ((x2 - x1) / VNC_STAT_RECT) * ((y2 - y1) / VNC_STAT_RECT);
+    if (cells * 2 < box) {
+        return;
+    }
+
+    vd->video.x = x1;
+    vd->video.y = y1;
+    vd->video.w = MIN(x2, vd->guest.ds->width) - x1;
+    vd->video.h = MIN(y2, vd->guest.ds->height) - y1;
+}
+
 static int vnc_update_stats(VncDisplay *vd,  struct timeval * tv)
 {
     int x, y;
@@ -2471,6 +2721,7 @@ static int vnc_update_stats(VncDisplay *vd,  struct timeval * tv)
 
             if (timercmp(&res, &VNC_REFRESH_LOSSY, >)) {
                 rect->freq = 0;
+                rect->video = false;
                 has_dirty += vnc_refresh_lossy_rect(vd, x, y);
                 memset(rect->times, 0, sizeof (rect->times));
                 continue ;
@@ -2483,11 +2734,27 @@ static int vnc_update_stats(VncDisplay *vd,  struct timeval * tv)
             rect->freq = res.tv_sec + res.tv_usec / 1000000.;
             rect->freq /= count;
             rect->freq = 1. / rect->freq;
+
+            if (rect->freq >= VNC_VIDEO_FREQ_ENTER) {
+                rect->video = true;
+            } else if (rect->freq < VNC_VIDEO_FREQ_LEAVE) {
+                rect->video = false;
+            }
         }
     }
+    vnc_update_video_rect(vd);
     return has_dirty;
 }
 
+bool vnc_update_is_video(VncState *vs, int x, int y, int w, int h)
+{
+    VncRect *video = &vs->vd->video;
+
+    return vs->vd->lossy && video->w &&
+           x >= video->x && x + w <= video->x + video->w &&
+           y >= video->y && y + h <= video->y + video->h;
+}
+
 double vnc_update_freq(VncState *vs, int x, int y, int w, int h)
 {
     int i, j;
@@ -2524,13 +2791,105 @@ static void vnc_rect_updated(VncDisplay *vd, int x, int y, struct timeval * tv)
     rect->updated = true;
 }
 
-static int vnc_refresh_server_surface(VncDisplay *vd)
+/*
+ * Compare one 16 pixel wide tile of the guest and server surfaces.  Tiles
+ * are at most 64 bytes long, short enough that the call to memcmp() costs
+ * as much as the comparison itself.
+ */
+typedef bool (*VncTileEqualFunc)(const uint8_t *a, const uint8_t *b, int len);
+
+static bool vnc_tile_equal_long(const uint8_t *a, const uint8_t *b, int len)
+{
+    int i = 0;
+
+    for (; i + sizeof(long) <= len; i += sizeof(long)) {
+        if (*(long *)(a + i) != *(long *)(b + i)) {
+            return false;
+        }
+    }
+    return memcmp(a + i, b + i, len - i) == 0;
+}
+
+#if defined __SSE2__
+static bool vnc_tile_equal_sse2(const uint8_t *a, const uint8_t *b, int len)
+{
+    int i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i va = _mm_loadu_si128((__m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((__m128i *)(b + i));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff) {
+            return false;
+        }
+    }
+    return memcmp(a + i, b + i, len - i) == 0;
+}
+#endif
+
+#if defined CONFIG_AVX2_OPT && defined __SSE2__
+#pragma GCC push_options
+#pragma GCC target("avx2")
+static bool vnc_tile_equal_avx2(const uint8_t *a, const uint8_t *b, int len)
+{
+    int i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i va = _mm256_loadu_si256((__m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((__m256i *)(b + i));
+
+        if (!_mm256_testc_si256(_mm256_cmpeq_epi8(va, vb),
+                                _mm256_set1_epi8(-1))) {
+            return false;
+        }
+    }
+    return memcmp(a + i, b + i, len - i) == 0;
+}
+#pragma GCC pop_options
+#endif
+
+static VncTileEqualFunc vnc_tile_equal = vnc_tile_equal_long;
+
+static void vnc_init_tile_equal(void)
+{
+#if defined CONFIG_AVX2_OPT && defined __SSE2__
+    if (host_has_avx2()) {
+        vnc_tile_equal = vnc_tile_equal_avx2;
+        return;
+    }
+#endif
+#if defined __SSE2__
+    vnc_tile_equal = vnc_tile_equal_sse2;
+#endif
+}
+
+/*
+ * Push the tiles that changed on the server surface to every client, one
+ * word-wide OR per dirty row and client instead of one bit per tile.
+ */
+static void vnc_merge_server_dirty(VncDisplay *vd)
 {
+    VncState *vs;
     int y;
+
+    for (y = find_first_bit(vd->server_dirty_rows, VNC_MAX_HEIGHT);
+         y < VNC_MAX_HEIGHT;
+         y = find_next_bit(vd->server_dirty_rows, VNC_MAX_HEIGHT, y + 1)) {
+        QTAILQ_FOREACH(vs, &vd->clients, next) {
+            bitmap_or(vs->dirty[y], vs->dirty[y], vd->server_dirty[y],
+                      VNC_DIRTY_BITS);
+        }
+        bitmap_zero(vd->server_dirty[y], VNC_DIRTY_BITS);
+    }
+    bitmap_zero(vd->server_dirty_rows, VNC_MAX_HEIGHT);
+}
+
+static int vnc_refresh_server_surface(VncDisplay *vd)
+{
+    int y, height, tiles;
     uint8_t *guest_row;
     uint8_t *server_row;
     int cmp_bytes;
-    VncState *vs;
     int has_dirty = 0;
 
     struct timeval tv = { 0, 0 };
@@ -2541,43 +2900,42 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     }
 
     /*
-     * Walk through the guest dirty map.
-     * Check and copy modified bits from guest to server surface.
+     * Walk through the rows the display adapter reported as dirty.
+     * Check and copy modified tiles from guest to server surface.
      * Update server dirty map.
      */
     cmp_bytes = 16 * ds_get_bytes_per_pixel(vd->ds);
     if (cmp_bytes > vd->ds->surface->linesize) {
         cmp_bytes = vd->ds->surface->linesize;
     }
-    guest_row  = vd->guest.ds->data;
-    server_row = vd->server->data;
-    for (y = 0; y < vd->guest.ds->height; y++) {
-        if (!bitmap_empty(vd->guest.dirty[y], VNC_DIRTY_BITS)) {
-            int x;
-            uint8_t *guest_ptr;
-            uint8_t *server_ptr;
+    height = vd->guest.ds->height;
+    tiles = vd->guest.ds->width / 16;
+    for (y = find_first_bit(vd->guest.dirty_rows, height); y < height;
+         y = find_next_bit(vd->guest.dirty_rows, height, y + 1)) {
+        int x;
 
-            guest_ptr  = guest_row;
-            server_ptr = server_row;
+        clear_bit(y, vd->guest.dirty_rows);
+        guest_row  = vd->guest.ds->data + y * ds_get_linesize(vd->ds);
+        server_row = vd->server->data + y * ds_get_linesize(vd->ds);
 
-            for (x = 0; x + 15 < vd->guest.ds->width;
-                    x += 16, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
-                if (!test_and_clear_bit((x / 16), vd->guest.dirty[y]))
-                    continue;
-                if (memcmp(server_ptr, guest_ptr, cmp_bytes) == 0)
-                    continue;
-                memcpy(server_ptr, guest_ptr, cmp_bytes);
-                if (!vd->non_adaptive)
-                    vnc_rect_updated(vd, x, y, &tv);
-                QTAILQ_FOREACH(vs, &vd->clients, next) {
-                    set_bit((x / 16), vs->dirty[y]);
-                }
-                has_dirty++;
-            }
+        for (x = find_first_bit(vd->guest.dirty[y], tiles); x < tiles;
+             x = find_next_bit(vd->guest.dirty[y], tiles, x + 1)) {
+            uint8_t *guest_ptr = guest_row + x * cmp_bytes;
+            uint8_t *server_ptr = server_row + x * cmp_bytes;
+
+            clear_bit(x, vd->guest.dirty[y]);
+            if (vnc_tile_equal(server_ptr, guest_ptr, cmp_bytes))
+                continue;
+            memcpy(server_ptr, guest_ptr, cmp_bytes);
+            if (!vd->non_adaptive)
+                vnc_rect_updated(vd, x * 16, y, &tv);
+            set_bit(x, vd->server_dirty[y]);
+            set_bit(y, vd->server_dirty_rows);
+            has_dirty++;
         }
-        guest_row  += ds_get_linesize(vd->ds);
-        server_row += ds_get_linesize(vd->ds);
     }
+
+    vnc_merge_server_dirty(vd);
     return has_dirty;
 }
 
@@ -2586,6 +2944,7 @@ static void vnc_refresh(void *opaque)
     VncDisplay *vd = opaque;
     VncState *vs, *vn;
     int has_dirty, rects = 0;
+    int drain_ms = -1;
 
     vga_hw_update();
 
@@ -2599,6 +2958,14 @@ static void vnc_refresh(void *opaque)
     has_dirty = vnc_refresh_server_surface(vd);
     vnc_unlock_display(vd);
 
+    QTAILQ_FOREACH(vs, &vd->clients, next) {
+        int ms = vnc_output_drain_ms(vs);
+
+        if (ms >= 0 && (drain_ms < 0 || ms < drain_ms)) {
+            drain_ms = ms;
+        }
+    }
+
     QTAILQ_FOREACH_SAFE(vs, &vd->clients, next, vn) {
         rects += vnc_update_client(vs, has_dirty);
         /* vs might be free()ed here */
@@ -2613,6 +2980,10 @@ static void vnc_refresh(void *opaque)
         vd->timer_interval /= 2;
         if (vd->timer_interval < VNC_REFRESH_INTERVAL_BASE)
             vd->timer_interval = VNC_REFRESH_INTERVAL_BASE;
+    } else if (drain_ms >= 0) {
+        /* updates may be throttled, come back when the fastest client
+         * should have room for the next one */
+        vd->timer_interval = MAX(drain_ms, VNC_REFRESH_INTERVAL_BASE);
     } else {
         vd->timer_interval += VNC_REFRESH_INTERVAL_INC;
         if (vd->timer_interval > VNC_REFRESH_INTERVAL_MAX)
@@ -2746,6 +3117,7 @@ void vnc_display_init(DisplayState *ds)
 
     qemu_mutex_init(&vs->mutex);
     vnc_start_worker_thread();
+    vnc_init_tile_equal();
 
     dcl->dpy_copy = vnc_dpy_copy;
     dcl->dpy_update = vnc_dpy_update;
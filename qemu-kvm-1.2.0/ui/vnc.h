@@ -100,6 +100,14 @@ typedef struct VncDisplay VncDisplay;
 #include "vnc-auth-sasl.h"
 #endif
 
+struct VncRect
+{
+    int x;
+    int y;
+    int w;
+    int h;
+};
+
 struct VncRectStat
 {
     /* time of last 10 updates, to find update frequency */
@@ -108,6 +116,7 @@ struct VncRectStat
 
     double freq;        /* Update frequency (in Hz) */
     bool updated;       /* Already updated during this refresh */
+    bool video;         /* Part of a continuously updating region */
 };
 
 typedef struct VncRectStat VncRectStat;
@@ -116,6 +125,7 @@ struct VncSurface
 {
     struct timeval last_freq_check;
     DECLARE_BITMAP(dirty[VNC_MAX_HEIGHT], VNC_MAX_WIDTH / 16);
+    DECLARE_BITMAP(dirty_rows, VNC_MAX_HEIGHT); /* rows marked in dirty */
     VncRectStat stats[VNC_STAT_ROWS][VNC_STAT_COLS];
     DisplaySurface *ds;
 };
@@ -145,13 +155,18 @@ struct VncDisplay
     kbd_layout_t *kbd_layout;
     int lock_key_sync;
     QemuMutex mutex;
+    int encoders;   /* workers reading the server surface, under mutex */
 
     QEMUCursor *cursor;
     int cursor_msize;
     uint8_t *cursor_mask;
 
     struct VncSurface guest;   /* guest visible surface (aka ds->surface) */
+    struct VncRect video;      /* box around the video cells, w == 0 if none */
     DisplaySurface *server;  /* vnc server surface */
+    /* server surface changes not yet merged into the client dirty maps */
+    DECLARE_BITMAP(server_dirty[VNC_MAX_HEIGHT], VNC_DIRTY_BITS);
+    DECLARE_BITMAP(server_dirty_rows, VNC_MAX_HEIGHT);
 
     char *display;
     char *password;
@@ -212,14 +227,6 @@ typedef struct VncZywrle {
     int buf[VNC_ZRLE_TILE_WIDTH * VNC_ZRLE_TILE_HEIGHT];
 } VncZywrle;
 
-struct VncRect
-{
-    int x;
-    int y;
-    int w;
-    int h;
-};
-
 struct VncRectEntry
 {
     struct VncRect rect;
@@ -232,6 +239,13 @@ struct VncJob
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
+
+    bool parallel;  /* may be encoded alongside other jobs of vs */
+    int encoding;   /* stateless encoding used by parallel jobs */
+    bool running;
+    bool done;
+    Buffer output;  /* encoded update waiting for earlier jobs of vs */
+    uint8_t quality; /* tight JPEG quality picked for this update */
 };
 
 struct VncState
@@ -290,6 +304,19 @@ struct VncState
     QemuMutex output_mutex;
     QEMUBH *bh;
     Buffer jobs_buffer;
+    /* encoding statistics, under output_mutex */
+    uint64_t jobs_encoded;
+    uint64_t encode_ns;
+
+    /* link estimate, only used by the main thread */
+    int64_t output_busy_since;  /* when queued output started draining */
+    uint64_t output_busy_bytes; /* written since output_busy_since */
+    uint64_t bandwidth;         /* bytes per second, 0 until measured */
+    int64_t update_sent_ns;     /* when the last output drained */
+    int64_t latency_ns;         /* from there to the next update request */
+    uint8_t client_quality;     /* JPEG quality requested by the client */
+    bool update_deferred;       /* dirty bits held back while throttled */
+    int64_t video_sent_ns;      /* last frame of the video region sent */
 
     /* Encoding specific, if you add something here, don't forget to
      *  update vnc_async_encoding_start()
@@ -529,6 +556,7 @@ void vnc_framebuffer_update(VncState *vs, int x, int y, int w, int h,
 
 void vnc_convert_pixel(VncState *vs, uint8_t *buf, uint32_t v);
 double vnc_update_freq(VncState *vs, int x, int y, int w, int h);
+bool vnc_update_is_video(VncState *vs, int x, int y, int w, int h);
 void vnc_sent_lossy_rect(VncState *vs, int x, int y, int w, int h);
 
 /* Encodings */
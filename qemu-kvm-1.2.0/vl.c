@@ -134,6 +134,7 @@ int main(int argc, char **argv)
 #include "sysemu.h"
 #include "gdbstub.h"
 #include "qemu-timer.h"
+#include "qemu-thread.h"
 #include "qemu-char.h"
 #include "cache-utils.h"
 #include "blockdev.h"
@@ -253,6 +254,8 @@ QTAILQ_HEAD(, FWBootEntry) fw_boot_order = QTAILQ_HEAD_INITIALIZER(fw_boot_order
 int nb_numa_nodes;
 uint64_t node_mem[MAX_NODES];
 unsigned long *node_cpumask[MAX_NODES];
+unsigned long *node_host_nodes[MAX_NODES];
+int node_policy[MAX_NODES];
 
 uint8_t qemu_uuid[16];
 
@@ -265,6 +268,9 @@ static NotifierList exit_notifiers =
 static NotifierList machine_init_done_notifiers =
     NOTIFIER_LIST_INITIALIZER(machine_init_done_notifiers);
 
+static NotifierList main_loop_exit_notifiers =
+    NOTIFIER_LIST_INITIALIZER(main_loop_exit_notifiers);
+
 static int tcg_allowed = 1;
 int kvm_allowed = 0;
 int xen_allowed = 0;
@@ -479,6 +485,51 @@ StatusInfo *qmp_query_status(Error **errp)
     return info;
 }
 
+/***********************************************************/
+/* startup timing */
+
+#define MAX_STARTUP_PHASES 16
+
+static struct {
+    const char *name;
+    int64_t start, end;
+} startup_phases[MAX_STARTUP_PHASES];
+static int nb_startup_phases;
+static int64_t startup_time, startup_phase_start;
+
+/* The phase that started with the previous call ends now */
+static void startup_phase_end(const char *name)
+{
+    int64_t now = get_clock_realtime();
+
+    if (nb_startup_phases < MAX_STARTUP_PHASES) {
+        startup_phases[nb_startup_phases].name = name;
+        startup_phases[nb_startup_phases].start = startup_phase_start;
+        startup_phases[nb_startup_phases].end = now;
+        nb_startup_phases++;
+    }
+    startup_phase_start = now;
+}
+
+StartupPhaseList *qmp_query_startup_timing(Error **errp)
+{
+    StartupPhaseList *head = NULL, **tail = &head;
+    int i;
+
+    for (i = 0; i < nb_startup_phases; i++) {
+        StartupPhaseList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->name = g_strdup(startup_phases[i].name);
+        entry->value->start = (startup_phases[i].start - startup_time) / 1000;
+        entry->value->duration = (startup_phases[i].end -
+                                  startup_phases[i].start) / 1000;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
 /***********************************************************/
 /* real time host monotonic timer */
 
@@ -847,6 +898,87 @@ static int drive_init_func(QemuOpts *opts, void *opaque)
     return drive_init(opts, *use_scsi) == NULL;
 }
 
+#ifdef CONFIG_POSIX
+#define MAX_DRIVE_PREFETCH 16
+#define DRIVE_PREFETCH_SIZE (1 << 20)
+
+typedef struct DrivePrefetch {
+    QemuThread thread;
+    char *filename;
+} DrivePrefetch;
+
+static DrivePrefetch drive_prefetch[MAX_DRIVE_PREFETCH];
+static int nb_drive_prefetch;
+
+/*
+ * Read the start of an image, where the format headers and usually the
+ * first metadata tables live, into the host page cache.
+ */
+static void *drive_prefetch_thread(void *opaque)
+{
+    DrivePrefetch *p = opaque;
+    char buf[65536];
+    off_t offset;
+    int fd;
+
+    fd = open(p->filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    for (offset = 0; offset < DRIVE_PREFETCH_SIZE; offset += sizeof(buf)) {
+        if (pread(fd, buf, sizeof(buf), offset) < (ssize_t)sizeof(buf)) {
+            break;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+static int drive_prefetch_func(QemuOpts *opts, void *opaque)
+{
+    const char *file = qemu_opt_get(opts, "file");
+    DrivePrefetch *p;
+    struct stat st;
+
+    if (nb_drive_prefetch == MAX_DRIVE_PREFETCH || !file) {
+        return 0;
+    }
+    /* only regular files, and not host devices or network protocols */
+    strstart(file, "file:", &file);
+    if (stat(file, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+
+    p = &drive_prefetch[nb_drive_prefetch++];
+    p->filename = g_strdup(file);
+    qemu_thread_create(&p->thread, drive_prefetch_thread, p,
+                       QEMU_THREAD_JOINABLE);
+    return 0;
+}
+
+/*
+ * Opening images is sequential and, for formats with metadata, a chain
+ * of small synchronous reads.  With many drives on slow storage, warm
+ * all of them in parallel first so that drive_init mostly hits the
+ * page cache.  bdrv_open itself must stay on this thread.
+ */
+static void drive_prefetch_all(void)
+{
+    int i;
+
+    qemu_opts_foreach(qemu_find_opts("drive"), drive_prefetch_func, NULL, 0);
+    for (i = 0; i < nb_drive_prefetch; i++) {
+        qemu_thread_join(&drive_prefetch[i].thread);
+        g_free(drive_prefetch[i].filename);
+    }
+    nb_drive_prefetch = 0;
+}
+#else
+static void drive_prefetch_all(void)
+{
+}
+#endif
+
 static int drive_enable_snapshot(QemuOpts *opts, void *opaque)
 {
     if (NULL == qemu_opt_get(opts, "snapshot")) {
@@ -1061,6 +1193,29 @@ static void numa_add(const char *optarg)
 
             bitmap_set(node_cpumask[nodenr], value, endvalue-value+1);
         }
+        if (get_param_value(option, 128, "hostnodes", optarg) != 0) {
+            if (qemu_parse_bitmap_list(option, node_host_nodes[nodenr],
+                                       MAX_HOST_NODES) < 0) {
+                fprintf(stderr, "qemu: invalid numa hostnodes: %s\n", option);
+                exit(1);
+            }
+        }
+        if (get_param_value(option, 128, "policy", optarg) != 0) {
+            if (!strcmp(option, "bind")) {
+                node_policy[nodenr] = NUMA_POLICY_BIND;
+            } else if (!strcmp(option, "preferred")) {
+                node_policy[nodenr] = NUMA_POLICY_PREFERRED;
+            } else if (!strcmp(option, "interleave")) {
+                node_policy[nodenr] = NUMA_POLICY_INTERLEAVE;
+            } else {
+                fprintf(stderr, "qemu: invalid numa policy: %s\n", option);
+                exit(1);
+            }
+            if (bitmap_empty(node_host_nodes[nodenr], MAX_HOST_NODES)) {
+                fprintf(stderr, "qemu: numa policy needs hostnodes\n");
+                exit(1);
+            }
+        }
         nb_numa_nodes++;
     }
     return;
@@ -2310,6 +2465,15 @@ static void qemu_run_exit_notifiers(void)
     notifier_list_notify(&exit_notifiers, NULL);
 }
 
+/* Run when the main loop returns, once the vCPUs are paused and while the
+ * block devices are still open.  Shutting down this way does not stop the
+ * VM, so vm state change handlers do not run.
+ */
+void qemu_add_main_loop_exit_notifier(Notifier *notify)
+{
+    notifier_list_add(&main_loop_exit_notifiers, notify);
+}
+
 void qemu_add_machine_init_done_notifier(Notifier *notify)
 {
     notifier_list_add(&machine_init_done_notifiers, notify);
@@ -2421,6 +2585,9 @@ int main(int argc, char **argv, char **envp)
     const char *trace_events = NULL;
     const char *trace_file = NULL;
 
+    /* before init_clocks, so not get_clock */
+    startup_time = startup_phase_start = get_clock_realtime();
+
     atexit(qemu_run_exit_notifiers);
     error_set_progname(argv[0]);
 
@@ -2457,6 +2624,8 @@ int main(int argc, char **argv, char **envp)
     for (i = 0; i < MAX_NODES; i++) {
         node_mem[i] = 0;
         node_cpumask[i] = bitmap_new(MAX_CPUMASK_BITS);
+        node_host_nodes[i] = bitmap_new(MAX_HOST_NODES);
+        node_policy[i] = NUMA_POLICY_BIND;
     }
 
     nb_numa_nodes = 0;
@@ -3374,6 +3543,13 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_qtest_log:
                 qtest_log = optarg;
                 break;
+            case QEMU_OPTION_thread_affinity:
+                opts = qemu_opts_parse(qemu_find_opts("thread-affinity"),
+                                       optarg, 0);
+                if (!opts) {
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_sandbox:
                 opts = qemu_opts_parse(qemu_find_opts("sandbox"), optarg, 1);
                 if (!opts) {
@@ -3581,6 +3757,11 @@ int main(int argc, char **argv, char **envp)
         fprintf(stderr, "could not initialize alarm timer\n");
         exit(1);
     }
+    if (machine_opts) {
+        /* vCPU and I/O threads created from here on inherit the slack */
+        qemu_set_timer_slack(qemu_opt_get_number(machine_opts,
+                                                 "timer_slack_ns", 0));
+    }
 
 #ifdef CONFIG_SPICE
     /* spice needs the timers to be initialized by this point */
@@ -3615,9 +3796,12 @@ int main(int argc, char **argv, char **envp)
 
     blk_mig_init();
 
+    startup_phase_end("init");
+
     /* open the virtual block devices */
     if (snapshot)
         qemu_opts_foreach(qemu_find_opts("drive"), drive_enable_snapshot, NULL, 0);
+    drive_prefetch_all();
     if (qemu_opts_foreach(qemu_find_opts("drive"), drive_init_func, &machine->use_scsi, 1) != 0)
         exit(1);
 
@@ -3705,13 +3889,22 @@ int main(int argc, char **argv, char **envp)
 
     qdev_machine_init();
 
+    startup_phase_end("block");
+
     machine->init(ram_size, boot_devices,
                   kernel_filename, kernel_cmdline, initrd_filename, cpu_model);
 
+    startup_phase_end("machine");
+
     cpu_synchronize_all_post_init();
 
     set_numa_modes();
 
+    if (qemu_opts_foreach(qemu_find_opts("thread-affinity"),
+                          qemu_thread_affinity_init, NULL, 1) != 0) {
+        exit(1);
+    }
+
     current_machine = machine;
 
     /* init USB devices */
@@ -3808,6 +4001,8 @@ int main(int argc, char **argv, char **envp)
 
     qdev_machine_creation_done();
 
+    startup_phase_end("devices");
+
     if (rom_load_all() != 0) {
         fprintf(stderr, "rom loading failed\n");
         exit(1);
@@ -3819,8 +4014,9 @@ int main(int argc, char **argv, char **envp)
     qemu_run_machine_init_done_notifiers();
 
     qemu_system_reset(VMRESET_SILENT);
+    startup_phase_end("reset");
     if (loadvm) {
-        if (load_vmstate(loadvm) < 0) {
+        if (load_vmstate(loadvm, false) < 0) {
             autostart = 0;
         }
     }
@@ -3840,13 +4036,15 @@ int main(int argc, char **argv, char **envp)
     } else if (autostart) {
         vm_start();
     }
+    startup_phase_end("start");
 
     os_setup_post();
 
     resume_all_vcpus();
     main_loop();
-    bdrv_close_all();
     pause_all_vcpus();
+    notifier_list_notify(&main_loop_exit_notifiers, NULL);
+    bdrv_close_all();
     net_cleanup();
     res_free();
 
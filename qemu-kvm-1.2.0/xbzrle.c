@@ -0,0 +1,341 @@
+/*
+ * Xor Based Zero Run Length Encoding
+ *
+ * Copyright 2012 Red Hat, Inc. and/or its affiliates
+ *
+ * Authors:
+ *  Orit Wasserman  <owasserm@redhat.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "host-utils.h"
+#include "qemu/xbzrle.h"
+
+#if defined __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined CONFIG_AVX2_OPT && defined __SSE2__
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+#pragma GCC pop_options
+#endif
+
+/*
+ * The encoder alternates between two searches: the length of the run of
+ * bytes that did not change (zrun) and the length of the run of bytes that
+ * all changed (nzrun).  Each accelerated variant only provides these two
+ * kernels; the encoding loop itself is shared, so all variants produce the
+ * same output.
+ */
+
+/* word at a time, for hosts without a usable vector unit */
+static inline int zrun_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                            int len)
+{
+    int i = 0;
+
+    /* runs start at any byte offset, get to a long boundary first */
+    while (i < len && ((uintptr_t)(new_buf + i) % sizeof(long)) &&
+           old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    if ((uintptr_t)(new_buf + i) % sizeof(long)) {
+        return i;
+    }
+
+    while (i < len && *(long *)(old_buf + i) == *(long *)(new_buf + i)) {
+        i += sizeof(long);
+    }
+    while (i < len && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static inline int nzrun_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                             int len)
+{
+    /* truncation to 32-bit long okay */
+    long mask = (long)0x0101010101010101ULL;
+    int i = 0;
+
+    /* runs start at any byte offset, get to a long boundary first */
+    while (i < len && ((uintptr_t)(new_buf + i) % sizeof(long)) &&
+           old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    if ((uintptr_t)(new_buf + i) % sizeof(long)) {
+        return i;
+    }
+
+    while (i < len) {
+        long xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
+
+        if ((xor - mask) & ~xor & (mask << 7)) {
+            /* found the end of an nzrun within the current long */
+            break;
+        }
+        i += sizeof(long);
+    }
+    while (i < len && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+#if defined __SSE2__
+static inline int zrun_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                            int len)
+{
+    int i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((__m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((__m128i *)(new_buf + i));
+        unsigned int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+
+        if (eq != 0xffff) {
+            return i + ctz32(~eq);
+        }
+    }
+    while (i < len && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static inline int nzrun_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                             int len)
+{
+    int i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((__m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((__m128i *)(new_buf + i));
+        unsigned int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    while (i < len && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+#endif
+
+#if defined CONFIG_AVX2_OPT && defined __SSE2__
+#pragma GCC push_options
+#pragma GCC target("avx2")
+static inline int zrun_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                            int len)
+{
+    int i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((__m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((__m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (eq != 0xffffffff) {
+            return i + ctz32(~eq);
+        }
+    }
+    while (i < len && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+#pragma GCC pop_options
+#endif
+
+/*
+  page = zrun nzrun
+       | zrun nzrun page
+
+  zrun = length
+
+  nzrun = length byte...
+
+  length = uleb128 encoded integer
+ */
+#define XBZRLE_ENCODE_FN(name, zrun, nzrun)                                 \
+static int name(uint8_t *old_buf, uint8_t *new_buf, int slen,               \
+                uint8_t *dst, int dlen)                                     \
+{                                                                           \
+    int zrun_len, nzrun_len;                                                \
+    int d = 0, i = 0;                                                       \
+                                                                            \
+    while (i < slen) {                                                      \
+        /* overflow */                                                      \
+        if (d + 2 > dlen) {                                                 \
+            return -1;                                                      \
+        }                                                                   \
+                                                                            \
+        zrun_len = zrun(old_buf + i, new_buf + i, slen - i);                \
+        i += zrun_len;                                                      \
+                                                                            \
+        /* buffer unchanged */                                              \
+        if (zrun_len == slen) {                                             \
+            return 0;                                                       \
+        }                                                                   \
+                                                                            \
+        /* skip last zero run */                                            \
+        if (i == slen) {                                                    \
+            return d;                                                       \
+        }                                                                   \
+                                                                            \
+        d += uleb128_encode_small(dst + d, zrun_len);                       \
+                                                                            \
+        /* overflow */                                                      \
+        if (d + 2 > dlen) {                                                 \
+            return -1;                                                      \
+        }                                                                   \
+                                                                            \
+        nzrun_len = nzrun(old_buf + i, new_buf + i, slen - i);              \
+                                                                            \
+        d += uleb128_encode_small(dst + d, nzrun_len);                      \
+        /* overflow */                                                      \
+        if (d + nzrun_len > dlen) {                                         \
+            return -1;                                                      \
+        }                                                                   \
+        memcpy(dst + d, new_buf + i, nzrun_len);                            \
+        d += nzrun_len;                                                     \
+        i += nzrun_len;                                                     \
+    }                                                                       \
+                                                                            \
+    return d;                                                               \
+}
+
+XBZRLE_ENCODE_FN(xbzrle_encode_long, zrun_long, nzrun_long)
+#if defined __SSE2__
+XBZRLE_ENCODE_FN(xbzrle_encode_sse2, zrun_sse2, nzrun_sse2)
+#endif
+#if defined CONFIG_AVX2_OPT && defined __SSE2__
+#pragma GCC push_options
+#pragma GCC target("avx2")
+/* changed runs are mostly short, 16 bytes at a time is faster for them */
+XBZRLE_ENCODE_FN(xbzrle_encode_avx2, zrun_avx2, nzrun_sse2)
+#pragma GCC pop_options
+#endif
+
+typedef int (*XBZRLEEncodeFunc)(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                uint8_t *dst, int dlen);
+
+typedef struct XBZRLEAccel {
+    const char *name;
+    XBZRLEEncodeFunc encode;
+    bool (*available)(void);
+} XBZRLEAccel;
+
+static bool xbzrle_always_available(void)
+{
+    return true;
+}
+
+/* from the fastest to the slowest */
+static const XBZRLEAccel xbzrle_accels[] = {
+#if defined CONFIG_AVX2_OPT && defined __SSE2__
+    { "avx2", xbzrle_encode_avx2, host_has_avx2 },
+#endif
+#if defined __SSE2__
+    { "sse2", xbzrle_encode_sse2, xbzrle_always_available },
+#endif
+    { "long", xbzrle_encode_long, xbzrle_always_available },
+};
+
+static const XBZRLEAccel *xbzrle_accel =
+    &xbzrle_accels[ARRAY_SIZE(xbzrle_accels) - 1];
+
+static void __attribute__((constructor)) xbzrle_init_accel(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(xbzrle_accels); i++) {
+        if (xbzrle_accels[i].available()) {
+            xbzrle_accel = &xbzrle_accels[i];
+            break;
+        }
+    }
+}
+
+const char *xbzrle_accel_name(void)
+{
+    return xbzrle_accel->name;
+}
+
+bool xbzrle_test_next_accel(void)
+{
+    while (xbzrle_accel < &xbzrle_accels[ARRAY_SIZE(xbzrle_accels) - 1]) {
+        xbzrle_accel++;
+        if (xbzrle_accel->available()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    return xbzrle_accel->encode(old_buf, new_buf, slen, dst, dlen);
+}
+
+int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
+{
+    int i = 0, d = 0;
+    int ret;
+    uint32_t count = 0;
+
+    while (i < slen) {
+
+        /* zrun */
+        if ((slen - i) < 2) {
+            return -1;
+        }
+
+        ret = uleb128_decode_small(src + i, &count);
+        if (ret < 0 || (i && !count)) {
+            return -1;
+        }
+        i += ret;
+        d += count;
+
+        /* overflow */
+        if (d > dlen) {
+            return -1;
+        }
+
+        /* nzrun */
+        if ((slen - i) < 2) {
+            return -1;
+        }
+
+        ret = uleb128_decode_small(src + i, &count);
+        if (ret < 0 || !count) {
+            return -1;
+        }
+        i += ret;
+
+        /* overflow */
+        if (d + count > dlen || i + count > slen) {
+            return -1;
+        }
+
+        memcpy(dst + d, src + i, count);
+        d += count;
+        i += count;
+    }
+
+    return d;
+}